@@ -1,7 +1,14 @@
 // ac97.c - AC'97 Audio Codec Driver for Alteo OS
 #include "ac97.h"
+#include "klib.h"
 #include "heap.h"
 #include "pci.h"
+#include "apic.h"
+#include "irq.h"
+#include "isr.h"
+#include "spinlock.h"
+#include "waitq.h"
+#include "scheduler.h"
 
 // Port I/O
 static inline uint8_t ac97_inb(uint16_t port) {
@@ -32,10 +39,12 @@ static inline void ac97_outl(uint16_t port, uint32_t val) {
 // Global device
 static ac97_device_t ac97_dev = {0};
 
-static void ac97_memset(void* dst, uint8_t val, int n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (int i = 0; i < n; i++) d[i] = val;
-}
+// Guards the BDL against the interrupt handler; writers waiting for ring
+// space sleep on stream_wq
+static spinlock_t ac97_lock = SPINLOCK_INIT;
+static waitq_t stream_wq = WAITQ_INIT;
+static void (*stream_notify)(void) = 0;
+static pci_device_t* ac97_pci = (pci_device_t*)0;
 
 // Scan PCI for AC97 controller (uses central PCI enumerator)
 static int ac97_pci_scan(void) {
@@ -50,6 +59,7 @@ static int ac97_pci_scan(void) {
         ac97_dev.busmaster_base = (uint16_t)dev->bars[1].base;
 
     ac97_dev.irq = dev->irq_line;
+    ac97_pci = dev;
 
     // Enable bus mastering + I/O space
     pci_enable_bus_master(dev);
@@ -58,8 +68,170 @@ static int ac97_pci_scan(void) {
     return 1;
 }
 
+// ---------- Streaming ----------
+
+// Take back the entries the DMA engine has played, then move ring data
+// into free entries and extend the last valid index over them; restart
+// the engine if it had halted at the end of what it was given
+// (ac97_lock held)
+static void ac97_stream_refill(void) {
+    uint16_t bm = ac97_dev.busmaster_base;
+    uint16_t sr = ac97_inw(bm + AC97_BM_PO_SR);
+    int halted = (sr & AC97_SR_DCH) && ac97_dev.play_state != AUDIO_PAUSED;
+    int played = ac97_dev.bdl_count;
+
+    if (halted) {
+        // Stopped at the last valid entry: everything queued has played
+        if (ac97_dev.bdl_count) ac97_dev.underruns++;
+        ac97_dev.bdl_head = (ac97_dev.bdl_head + ac97_dev.bdl_count) % AC97_BDL_ENTRIES;
+        ac97_dev.bdl_count = 0;
+        ac97_dev.play_state = AUDIO_STOPPED;
+    } else {
+        // A paused engine also reports halted, but CIV still holds the
+        // entry it will resume
+        int civ = ac97_inb(bm + AC97_BM_PO_CIV) % AC97_BDL_ENTRIES;
+        while (ac97_dev.bdl_count > 0 && ac97_dev.bdl_head != civ) {
+            ac97_dev.bdl_head = (ac97_dev.bdl_head + 1) % AC97_BDL_ENTRIES;
+            ac97_dev.bdl_count--;
+        }
+    }
+    played -= ac97_dev.bdl_count;
+
+    int last = -1;
+    uint32_t frame = (uint32_t)(ac97_dev.bits_per_sample / 8) * ac97_dev.channels;
+    // One entry stays empty so a full BDL never looks like an empty one
+    while (ac97_dev.bdl_count < AC97_BDL_ENTRIES - 1) {
+        uint32_t head = ac97_dev.stream_head;
+        uint32_t avail = __atomic_load_n(&ac97_dev.stream_tail, __ATOMIC_ACQUIRE) - head;
+        uint32_t chunk = avail < AC97_BDL_BUF_SIZE ? avail : AC97_BDL_BUF_SIZE;
+        chunk -= chunk % frame;
+        if (!chunk || (chunk < AC97_BDL_BUF_SIZE && ac97_dev.bdl_count >= AC97_STREAM_LOW_ENTRIES))
+            break;
+
+        int e = (ac97_dev.bdl_head + ac97_dev.bdl_count) % AC97_BDL_ENTRIES;
+        uint32_t off = head & (AC97_STREAM_BYTES - 1);
+        uint32_t first = AC97_STREAM_BYTES - off;
+        if (first > chunk) first = chunk;
+        memcpy(ac97_dev.play_bufs[e], ac97_dev.stream_ring + off, first);
+        if (chunk > first) memcpy(ac97_dev.play_bufs[e] + first, ac97_dev.stream_ring, chunk - first);
+        __atomic_store_n(&ac97_dev.stream_head, head + chunk, __ATOMIC_RELEASE);
+
+        ac97_dev.play_bdl[e].length = (uint16_t)(chunk / 2);
+        ac97_dev.play_bdl[e].flags = AC97_BDL_IOC;
+        ac97_dev.bdl_count++;
+        last = e;
+    }
+
+    if (last >= 0) {
+        ac97_outb(bm + AC97_BM_PO_LVI, (uint8_t)last);
+        if (halted) {
+            ac97_outb(bm + AC97_BM_PO_CR, AC97_CR_RPBM | AC97_CR_LVBIE | AC97_CR_IOCE);
+            ac97_dev.play_state = AUDIO_PLAYING;
+        }
+        // Ring space freed
+        waitq_wake_all(&stream_wq);
+    }
+    if ((played > 0 || last >= 0) && stream_notify) stream_notify();
+}
+
+// Reset the output channel and point it at an empty BDL
+static void ac97_stream_start(void) {
+    uint16_t bm = ac97_dev.busmaster_base;
+    ac97_outb(bm + AC97_BM_PO_CR, 0);
+    ac97_outb(bm + AC97_BM_PO_CR, AC97_CR_RR);
+    for (volatile int i = 0; i < 10000; i++);
+    ac97_outb(bm + AC97_BM_PO_CR, 0);
+    ac97_outl(bm + AC97_BM_PO_BDBAR, (uint32_t)(uintptr_t)ac97_dev.play_bdl);
+    ac97_dev.bdl_head = 0;
+    ac97_dev.bdl_count = 0;
+    ac97_dev.stream_on = 1;
+}
+
+uint32_t ac97_stream_space(void) {
+    return AC97_STREAM_BYTES -
+           (ac97_dev.stream_tail - __atomic_load_n(&ac97_dev.stream_head, __ATOMIC_ACQUIRE));
+}
+
+uint32_t ac97_stream_queued(void) {
+    uint64_t flags = spin_lock_irqsave(&ac97_lock);
+    uint32_t bytes = ac97_dev.stream_tail - ac97_dev.stream_head;
+    for (int i = 0; i < ac97_dev.bdl_count; i++)
+        bytes += (uint32_t)ac97_dev.play_bdl[(ac97_dev.bdl_head + i) % AC97_BDL_ENTRIES].length * 2;
+    spin_unlock_irqrestore(&ac97_lock, flags);
+    return bytes;
+}
+
+void ac97_stream_set_notify(void (*fn)(void)) {
+    stream_notify = fn;
+}
+
+uint32_t ac97_stream_underruns(void) {
+    return ac97_dev.underruns;
+}
+
+// Waiters re-run the refill themselves, so streams drain (more slowly)
+// even without the interrupt
+static int ac97_stream_has_space(void* arg) {
+    (void)arg;
+    uint64_t flags = spin_lock_irqsave(&ac97_lock);
+    ac97_stream_refill();
+    spin_unlock_irqrestore(&ac97_lock, flags);
+    return ac97_stream_space() > 0;
+}
+
+int ac97_stream_write(const void* data, uint32_t bytes) {
+    if (!ac97_dev.available || !data) return -1;
+    if (!ac97_dev.stream_ring) {
+        uint8_t* ring = (uint8_t*)kmalloc(AC97_STREAM_BYTES);
+        if (!ring) return -1;
+        ac97_dev.stream_ring = ring;
+    }
+
+    const uint8_t* src = (const uint8_t*)data;
+    uint32_t done = 0;
+    while (done < bytes) {
+        uint32_t space = ac97_stream_space();
+        if (!space) {
+            if (waitq_wait(&stream_wq, ac97_stream_has_space, 0) < 0) {
+                if (scheduler_is_running()) scheduler_yield();
+                else __asm__ volatile("pause");
+                ac97_stream_has_space(0);
+            }
+            continue;
+        }
+
+        uint32_t n = bytes - done < space ? bytes - done : space;
+        uint32_t tail = ac97_dev.stream_tail;
+        uint32_t off = tail & (AC97_STREAM_BYTES - 1);
+        uint32_t first = AC97_STREAM_BYTES - off;
+        if (first > n) first = n;
+        memcpy(ac97_dev.stream_ring + off, src + done, first);
+        if (n > first) memcpy(ac97_dev.stream_ring, src + done + first, n - first);
+        __atomic_store_n(&ac97_dev.stream_tail, tail + n, __ATOMIC_RELEASE);
+        done += n;
+
+        uint64_t flags = spin_lock_irqsave(&ac97_lock);
+        if (!ac97_dev.stream_on) ac97_stream_start();
+        ac97_stream_refill();
+        spin_unlock_irqrestore(&ac97_lock, flags);
+    }
+    return (int)done;
+}
+
+static void ac97_irq(registers_t* regs) {
+    (void)regs;
+    ac97_irq_handler();
+}
+
+static void ac97_msi_irq(void* ctx) {
+    (void)ctx;
+    ac97_irq_handler();
+}
+
+// ---------- Initialization ----------
+
 int ac97_init(void) {
-    ac97_memset(&ac97_dev, 0, sizeof(ac97_device_t));
+    memset(&ac97_dev, 0, sizeof(ac97_device_t));
     ac97_dev.master_volume = 80;
     ac97_dev.pcm_volume = 80;
     ac97_dev.sample_rate = AUDIO_SAMPLE_RATE_48000;
@@ -103,7 +275,7 @@ int ac97_init(void) {
     for (int i = 0; i < AC97_BDL_ENTRIES; i++) {
         ac97_dev.play_bufs[i] = (uint8_t*)kmalloc(AC97_BDL_BUF_SIZE + 16);
         if (!ac97_dev.play_bufs[i]) return -1;
-        ac97_memset(ac97_dev.play_bufs[i], 0, AC97_BDL_BUF_SIZE);
+        memset(ac97_dev.play_bufs[i], 0, AC97_BDL_BUF_SIZE);
 
         ac97_dev.play_bdl[i].addr = (uint32_t)(uintptr_t)ac97_dev.play_bufs[i];
         ac97_dev.play_bdl[i].length = AC97_BDL_BUF_SIZE / 2; // In samples
@@ -116,6 +288,16 @@ int ac97_init(void) {
 
     ac97_dev.available = 1;
     ac97_dev.play_state = AUDIO_STOPPED;
+
+    // MSI where the function has it, else the INTx line if the MADT says
+    // where it lands. Without either, streams are refilled by writers.
+    if (!apic_is_active()) return 0;
+    if (pci_msix_count(ac97_pci) > 0 || pci_find_capability(ac97_pci, PCI_CAP_ID_MSI)) {
+        pci_irq_alloc(ac97_pci, 0, ac97_msi_irq, 0, (uint8_t)lapic_get_id());
+    } else if (ac97_dev.irq > 0 && ac97_dev.irq < 16 && ioapic_irq_level_override(ac97_dev.irq)) {
+        irq_install_handler(ac97_dev.irq, ac97_irq);
+        ioapic_set_irq(ac97_dev.irq, APIC_IRQ_BASE + ac97_dev.irq, lapic_get_id(), 0);
+    }
     return 0;
 }
 
@@ -171,6 +353,7 @@ int ac97_is_muted(void) {
 int ac97_play(const uint8_t* samples, uint32_t num_samples) {
     if (!ac97_dev.available || !samples || num_samples == 0)
         return -1;
+    if (ac97_dev.stream_on) ac97_stop();
 
     // Fill buffers
     uint32_t bytes = num_samples * (ac97_dev.bits_per_sample / 8) * ac97_dev.channels;
@@ -181,9 +364,7 @@ int ac97_play(const uint8_t* samples, uint32_t num_samples) {
         uint32_t chunk = bytes - offset;
         if (chunk > AC97_BDL_BUF_SIZE) chunk = AC97_BDL_BUF_SIZE;
 
-        uint8_t* dst = ac97_dev.play_bufs[buf_idx];
-        const uint8_t* src = samples + offset;
-        for (uint32_t i = 0; i < chunk; i++) dst[i] = src[i];
+        memcpy(ac97_dev.play_bufs[buf_idx], samples + offset, chunk);
 
         ac97_dev.play_bdl[buf_idx].length = (uint16_t)(chunk / 2);
         ac97_dev.play_bdl[buf_idx].flags = AC97_BDL_IOC;
@@ -208,6 +389,14 @@ int ac97_play(const uint8_t* samples, uint32_t num_samples) {
 void ac97_stop(void) {
     if (!ac97_dev.available) return;
 
+    // Drop whatever a stream had queued
+    uint64_t flags = spin_lock_irqsave(&ac97_lock);
+    ac97_dev.stream_on = 0;
+    ac97_dev.stream_head = ac97_dev.stream_tail;
+    ac97_dev.bdl_count = 0;
+    spin_unlock_irqrestore(&ac97_lock, flags);
+    waitq_wake_all(&stream_wq);
+
     // Stop DMA
     ac97_outb(ac97_dev.busmaster_base + AC97_BM_PO_CR, 0);
 
@@ -269,6 +458,7 @@ void ac97_beep(uint32_t frequency, uint32_t duration_ms) {
 
 void ac97_play_tone(uint32_t freq, uint32_t duration_ms, int volume) {
     if (!ac97_dev.available || freq == 0) return;
+    if (ac97_dev.stream_on) ac97_stop();
 
     uint32_t sample_rate = ac97_dev.sample_rate;
     uint32_t num_samples = (sample_rate * duration_ms) / 1000;
@@ -320,13 +510,21 @@ void ac97_irq_handler(void) {
     if (!ac97_dev.available) return;
 
     uint16_t sr = ac97_inw(ac97_dev.busmaster_base + AC97_BM_PO_SR);
+    uint16_t events = sr & (AC97_SR_LVBCI | AC97_SR_BCIS | AC97_SR_FIFOE);
+    if (!events) return;    // Shared line, not ours
 
-    if (sr & AC97_SR_LVBCI) {
+    // Clear status
+    ac97_outw(ac97_dev.busmaster_base + AC97_BM_PO_SR, events);
+
+    if (ac97_dev.stream_on) {
+        // Refill the entries just played; the engine keeps running while
+        // writers stay ahead of it
+        uint64_t flags = spin_lock_irqsave(&ac97_lock);
+        ac97_stream_refill();
+        spin_unlock_irqrestore(&ac97_lock, flags);
+    } else if (sr & AC97_SR_LVBCI) {
         // Last buffer completed
         ac97_dev.play_state = AUDIO_STOPPED;
         ac97_outb(ac97_dev.busmaster_base + AC97_BM_PO_CR, 0);
     }
-
-    // Clear status
-    ac97_outw(ac97_dev.busmaster_base + AC97_BM_PO_SR, sr);
 }
@@ -74,6 +74,14 @@
 #define AC97_BDL_ENTRIES        32
 #define AC97_BDL_BUF_SIZE       4096  // Per-entry buffer size
 
+// Streaming playback: writers fill a byte ring, and the buffer
+// completion interrupt moves it into BDL entries as the DMA engine frees
+// them. A partly filled entry is only queued when fewer than
+// AC97_STREAM_LOW_ENTRIES are left to play, to keep latency low without
+// trickling tiny buffers.
+#define AC97_STREAM_BYTES       65536   // Ring size (power of two)
+#define AC97_STREAM_LOW_ENTRIES 2
+
 // Audio format constants
 #define AUDIO_SAMPLE_RATE_44100 44100
 #define AUDIO_SAMPLE_RATE_48000 48000
@@ -116,6 +124,16 @@ typedef struct {
     uint8_t* play_bufs[AC97_BDL_ENTRIES];
     int play_cur_buf;
 
+    // Streaming: ring bytes [stream_head, stream_tail) are not in the BDL
+    // yet. Only writers move the tail and only the refill moves the head,
+    // so each side reads the other's offset without a lock.
+    uint8_t* stream_ring;
+    uint32_t stream_head, stream_tail;      // Free-running byte offsets
+    int      stream_on;
+    int      bdl_head;      // Oldest entry filled and not yet played
+    int      bdl_count;     // Entries filled and not yet played
+    uint32_t underruns;
+
     // Volume (0-100)
     int master_volume;
     int pcm_volume;
@@ -153,10 +171,30 @@ audio_state_t ac97_get_state(void);
 int  ac97_set_sample_rate(uint32_t rate);
 uint32_t ac97_get_sample_rate(void);
 
-// Simple tone generation (for system sounds)
+// Simple tone generation (for system sounds). These take the channel for
+// themselves; mixer_tone() plays alongside other streams instead.
 void ac97_beep(uint32_t frequency, uint32_t duration_ms);
 void ac97_play_tone(uint32_t freq, uint32_t duration_ms, int volume);
 
+// Streaming: queue bytes of PCM in the current format, starting playback
+// if it is stopped. Blocks while the ring is full. Returns bytes queued,
+// or -1.
+int  ac97_stream_write(const void* data, uint32_t bytes);
+
+// Bytes ac97_stream_write() would take without blocking
+uint32_t ac97_stream_space(void);
+
+// Bytes queued and not yet played (ring plus BDL entries)
+uint32_t ac97_stream_queued(void);
+
+// fn() runs whenever queued audio drains (entries played, or ring data
+// moved into the BDL), from the buffer completion interrupt or a writer.
+// For the mixer's bottom half.
+void ac97_stream_set_notify(void (*fn)(void));
+
+// Times the DMA engine ran out of queued buffers while streaming
+uint32_t ac97_stream_underruns(void);
+
 // IRQ handler
 void ac97_irq_handler(void);
 
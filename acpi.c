@@ -1,6 +1,7 @@
 // acpi.c - ACPI Table Parser for Alteo OS
 // Finds RSDP in BIOS memory regions, parses RSDT/XSDT, extracts MADT and FADT
 #include "acpi.h"
+#include "klib.h"
 
 // ---- Port I/O ----
 static inline void acpi_outb(uint16_t port, uint8_t val) {
@@ -29,20 +30,6 @@ static int                acpi_initialized = 0;
 
 // ---- Helpers ----
 
-static void acpi_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
-static int acpi_memcmp(const void* a, const void* b, uint64_t n) {
-    const uint8_t* pa = (const uint8_t*)a;
-    const uint8_t* pb = (const uint8_t*)b;
-    for (uint64_t i = 0; i < n; i++) {
-        if (pa[i] != pb[i]) return (int)pa[i] - (int)pb[i];
-    }
-    return 0;
-}
-
 // Validate checksum (sum of all bytes should be 0)
 static int acpi_checksum_valid(const void* data, uint32_t length) {
     const uint8_t* bytes = (const uint8_t*)data;
@@ -106,7 +93,7 @@ static acpi_sdt_header_t* acpi_find_table_rsdt(uint32_t rsdt_addr, const char* s
 
     for (int i = 0; i < entries; i++) {
         acpi_sdt_header_t* table = (acpi_sdt_header_t*)(uintptr_t)table_ptrs[i];
-        if (acpi_memcmp(table->signature, sig, 4) == 0) {
+        if (memcmp(table->signature, sig, 4) == 0) {
             if (acpi_checksum_valid(table, table->length)) {
                 return table;
             }
@@ -128,7 +115,7 @@ static acpi_sdt_header_t* acpi_find_table_xsdt(uint64_t xsdt_addr, const char* s
 
     for (int i = 0; i < entries; i++) {
         acpi_sdt_header_t* table = (acpi_sdt_header_t*)(uintptr_t)table_ptrs[i];
-        if (acpi_memcmp(table->signature, sig, 4) == 0) {
+        if (memcmp(table->signature, sig, 4) == 0) {
             if (acpi_checksum_valid(table, table->length)) {
                 return table;
             }
@@ -203,9 +190,9 @@ static void acpi_parse_madt(acpi_madt_t* madt) {
 // ---- Public API ----
 
 int acpi_init(void) {
-    acpi_memset(cpus, 0, sizeof(cpus));
-    acpi_memset(ioapics, 0, sizeof(ioapics));
-    acpi_memset(isos, 0, sizeof(isos));
+    memset(cpus, 0, sizeof(cpus));
+    memset(ioapics, 0, sizeof(ioapics));
+    memset(isos, 0, sizeof(isos));
     cpu_count = 0;
     ioapic_count = 0;
     iso_count = 0;
@@ -0,0 +1,693 @@
+// ahci.c - AHCI SATA Driver for Alteo OS
+// ABAR is used through the identity map. Each port gets a command list,
+// a FIS receive area and one command table page per slot. A request is
+// split into commands of up to AHCI_MAX_SECTORS, all issued at once,
+// then the caller sleeps until every one of its slots has been reaped.
+// A request takes all the slots it needs at once and never waits for
+// more while it holds some, so requests cannot deadlock on each other's
+// slots.
+// Where the HBA has MSI/MSI-X, completions interrupt and the handler
+// reaps the ports that raised them; otherwise it runs with interrupts
+// off. Either way a timer event runs while commands are outstanding, to
+// poll PxCI/PxSACT (slowly when interrupts do the work) and catch
+// timeouts. An error or a timed-out command fails everything in flight
+// and restarts the port (an NCQ error aborts all queued commands anyway).
+#include "ahci.h"
+#include "klib.h"
+#include "blkdev.h"
+#include "pci.h"
+#include "apic.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "timer.h"
+#include "waitq.h"
+#include "scheduler.h"
+#include "spinlock.h"
+
+typedef struct {
+    ahci_disk_t        disk;
+    volatile uint8_t*  abar;
+    volatile uint8_t*  regs;                    // This port's registers
+    ahci_cmd_header_t* cmd_list;
+    uint8_t*           tables[AHCI_MAX_SLOTS];
+    spinlock_t         lock;
+    waitq_t            wq;                      // Waiting for slots or completions
+    uint32_t           slot_mask;               // Usable slots
+    uint32_t           busy;                    // Slots owned by a request
+    uint32_t           issued;                  // Sent to the HBA, not reaped yet
+    uint32_t           failed;                  // Reaped with an error
+    uint64_t           deadline[AHCI_MAX_SLOTS];
+    int                exclusive;               // A non-queued command is draining the port
+    int                poll_armed;              // A poll timer event is pending
+    int                irq;                     // Completions raise an MSI
+} ahci_port_t;
+
+static ahci_port_t ports[AHCI_MAX_DEVICES];
+static int disk_count = 0;
+
+static inline uint32_t hba_read(volatile uint8_t* abar, uint32_t reg) {
+    return *(volatile uint32_t*)(abar + reg);
+}
+static inline void hba_write(volatile uint8_t* abar, uint32_t reg, uint32_t val) {
+    *(volatile uint32_t*)(abar + reg) = val;
+}
+static inline uint32_t px_read(ahci_port_t* p, uint32_t reg) {
+    return *(volatile uint32_t*)(p->regs + reg);
+}
+static inline void px_write(ahci_port_t* p, uint32_t reg, uint32_t val) {
+    *(volatile uint32_t*)(p->regs + reg) = val;
+}
+
+// ---------- Port control ----------
+
+static void ahci_port_stop(ahci_port_t* p) {
+    px_write(p, AHCI_PX_CMD, px_read(p, AHCI_PX_CMD) & ~AHCI_PX_CMD_ST);
+    for (int i = 0; i < 1000000 && (px_read(p, AHCI_PX_CMD) & AHCI_PX_CMD_CR); i++) {
+        __asm__ volatile("pause");
+    }
+    px_write(p, AHCI_PX_CMD, px_read(p, AHCI_PX_CMD) & ~AHCI_PX_CMD_FRE);
+    for (int i = 0; i < 1000000 && (px_read(p, AHCI_PX_CMD) & AHCI_PX_CMD_FR); i++) {
+        __asm__ volatile("pause");
+    }
+}
+
+static void ahci_port_start(ahci_port_t* p) {
+    for (int i = 0; i < 1000000; i++) {
+        if (!(px_read(p, AHCI_PX_TFD) & (AHCI_PX_TFD_BSY | AHCI_PX_TFD_DRQ))) break;
+        __asm__ volatile("pause");
+    }
+    px_write(p, AHCI_PX_CMD, px_read(p, AHCI_PX_CMD) | AHCI_PX_CMD_FRE);
+    px_write(p, AHCI_PX_CMD, px_read(p, AHCI_PX_CMD) | AHCI_PX_CMD_ST);
+}
+
+// ---------- Completion (p->lock held) ----------
+
+// Fail every command in flight and restart the port
+static void ahci_port_recover(ahci_port_t* p) {
+    p->failed |= p->issued;
+    p->issued = 0;
+    ahci_port_stop(p);
+    px_write(p, AHCI_PX_SERR, 0xFFFFFFFF);
+    px_write(p, AHCI_PX_IS, 0xFFFFFFFF);
+    ahci_port_start(p);
+}
+
+static void ahci_reap(ahci_port_t* p) {
+    uint32_t is = px_read(p, AHCI_PX_IS);
+    if (!p->issued) {
+        px_write(p, AHCI_PX_IS, is);
+        return;
+    }
+    if (is & AHCI_PX_IS_ERRORS) {
+        ahci_port_recover(p);
+        return;
+    }
+    px_write(p, AHCI_PX_IS, is);
+
+    uint32_t pending = px_read(p, AHCI_PX_CI);
+    if (p->disk.ncq) pending |= px_read(p, AHCI_PX_SACT);
+    p->issued &= pending;
+
+    uint64_t now = timer_now_ns();
+    for (uint32_t m = p->issued; m; m &= m - 1) {
+        if (now > p->deadline[__builtin_ctz(m)]) {
+            ahci_port_recover(p);
+            return;
+        }
+    }
+}
+
+static uint64_t ahci_poll_ns(ahci_port_t* p) {
+    return p->irq ? AHCI_IRQ_POLL_NS : AHCI_POLL_NS;
+}
+
+// Timer event while commands are outstanding (arg = port index)
+static void ahci_poll_event(uint64_t arg) {
+    ahci_port_t* p = &ports[arg];
+    uint64_t flags = spin_lock_irqsave(&p->lock);
+    ahci_reap(p);
+    p->poll_armed = 0;
+    if (p->issued && timer_add(timer_now_ns() + ahci_poll_ns(p), ahci_poll_event, arg) >= 0) {
+        p->poll_armed = 1;
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+    waitq_wake_all(&p->wq);
+}
+
+// HBA interrupt (ctx = ABAR): reap every port that raised one. PxIS is
+// cleared before IS, as the HBA only sends another message for a port
+// once both are.
+static void ahci_msi(void* ctx) {
+    volatile uint8_t* abar = (volatile uint8_t*)ctx;
+    uint32_t is = hba_read(abar, AHCI_HBA_IS);
+    for (int i = 0; i < disk_count; i++) {
+        ahci_port_t* p = &ports[i];
+        if (p->abar != abar || !(is & (1U << p->disk.port))) continue;
+        uint64_t flags = spin_lock_irqsave(&p->lock);
+        ahci_reap(p);
+        spin_unlock_irqrestore(&p->lock, flags);
+        waitq_wake_all(&p->wq);
+    }
+    hba_write(abar, AHCI_HBA_IS, is);
+}
+
+// Sleep until cond(arg) holds. Without a poll event to wake us (or when
+// the caller cannot block) the condition is polled instead.
+static void ahci_wait(ahci_port_t* p, waitq_cond_t cond, void* arg) {
+    if (p->poll_armed && waitq_wait(&p->wq, cond, arg) == 0) return;
+    while (!cond(arg)) {
+        if (scheduler_is_running()) scheduler_yield();
+        else __asm__ volatile("pause");
+    }
+}
+
+// ---------- Slots ----------
+
+typedef struct {
+    ahci_port_t* p;
+    uint32_t     mask;       // Slots of this request
+    uint32_t     need;       // Slots it is asking for
+    int          drain;      // The non-queued command a drain is for
+} ahci_req_t;
+
+// r may take its slots now (p->lock held). A request already holding
+// slots is not held back by a drain, which would be waiting for those
+// very slots.
+static int ahci_slots_free(ahci_req_t* r) {
+    ahci_port_t* p = r->p;
+    uint32_t n = 0;
+    for (uint32_t m = p->slot_mask & ~p->busy; m && n < r->need; m &= m - 1) n++;
+    return n >= r->need && (r->mask || r->drain || !p->exclusive);
+}
+
+static int ahci_slot_available(void* arg) {
+    ahci_req_t* r = (ahci_req_t*)arg;
+    ahci_port_t* p = r->p;
+    uint64_t flags = spin_lock_irqsave(&p->lock);
+    ahci_reap(p);
+    int ok = ahci_slots_free(r);
+    spin_unlock_irqrestore(&p->lock, flags);
+    return ok;
+}
+
+static int ahci_slots_done(void* arg) {
+    ahci_req_t* r = (ahci_req_t*)arg;
+    ahci_port_t* p = r->p;
+    uint64_t flags = spin_lock_irqsave(&p->lock);
+    ahci_reap(p);
+    int done = !(p->issued & r->mask);
+    spin_unlock_irqrestore(&p->lock, flags);
+    return done;
+}
+
+static int ahci_port_idle(void* arg) {
+    ahci_port_t* p = (ahci_port_t*)arg;
+    uint64_t flags = spin_lock_irqsave(&p->lock);
+    ahci_reap(p);
+    int idle = !p->busy;
+    spin_unlock_irqrestore(&p->lock, flags);
+    return idle;
+}
+
+static int ahci_no_drain(void* arg) {
+    return !((ahci_port_t*)arg)->exclusive;
+}
+
+// Take 'need' slots (at most the port's) for r and return them. A request
+// that holds none sleeps until they are free; one that already holds some
+// gets 0 instead and must finish those first, since its own would
+// otherwise be what another request is waiting for.
+static uint32_t ahci_alloc_slots(ahci_req_t* r, uint32_t need) {
+    ahci_port_t* p = r->p;
+    r->need = need;
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&p->lock);
+        if (ahci_slots_free(r)) {
+            uint32_t free = p->slot_mask & ~p->busy, got = 0;
+            for (uint32_t k = 0; k < need; k++) {
+                got |= free & -free;
+                free &= free - 1;
+            }
+            p->busy |= got;
+            spin_unlock_irqrestore(&p->lock, flags);
+            return got;
+        }
+        spin_unlock_irqrestore(&p->lock, flags);
+        if (r->mask) return 0;
+        ahci_wait(p, ahci_slot_available, r);
+    }
+}
+
+// Wait for the request's slots, release them and return those that failed
+static uint32_t ahci_finish(ahci_req_t* r) {
+    ahci_port_t* p = r->p;
+    if (!r->mask) return 0;
+    ahci_wait(p, ahci_slots_done, r);
+    uint64_t flags = spin_lock_irqsave(&p->lock);
+    uint32_t result = p->failed & r->mask;
+    p->failed &= ~r->mask;
+    p->busy &= ~r->mask;
+    spin_unlock_irqrestore(&p->lock, flags);
+    r->mask = 0;
+    waitq_wake_all(&p->wq);
+    return result;
+}
+
+// ---------- Commands ----------
+
+// Describe buf in a command table's PRDT, merging physically contiguous
+// pages. Returns the entry count, or -1 if the buffer cannot be described.
+static int ahci_build_prdt(uint8_t* table, void* buf, uint32_t bytes) {
+    ahci_prd_t* prd = (ahci_prd_t*)(table + AHCI_PRDT_OFFSET);
+    pte_t* pml4 = vmm_get_current_address_space();
+    uint64_t va = (uint64_t)buf;
+    int n = 0;
+
+    while (bytes) {
+        uint64_t pa = vmm_get_physical(pml4, va);
+        uint32_t len = PAGE_SIZE - (uint32_t)(va & (PAGE_SIZE - 1));
+        if (len > bytes) len = bytes;
+        if (!pa) return -1;
+
+        if (n) {
+            uint64_t start = prd[n - 1].dba | ((uint64_t)prd[n - 1].dbau << 32);
+            uint32_t cur = (prd[n - 1].dbc & 0x3FFFFF) + 1;
+            if (start + cur == pa && cur + len <= AHCI_PRD_MAX_BYTES) {
+                prd[n - 1].dbc = cur + len - 1;
+                va += len;
+                bytes -= len;
+                continue;
+            }
+        }
+        if (n == AHCI_PRDT_ENTRIES) return -1;
+        prd[n].dba = (uint32_t)pa;
+        prd[n].dbau = (uint32_t)(pa >> 32);
+        prd[n].reserved = 0;
+        prd[n].dbc = len - 1;
+        n++;
+        va += len;
+        bytes -= len;
+    }
+    return n;
+}
+
+// Fill slot's command header and table. Returns 0 or -1.
+static int ahci_prepare(ahci_port_t* p, int slot, uint8_t command, uint64_t lba,
+                        uint32_t count, void* buf, uint32_t bytes, int write) {
+    uint8_t* table = p->tables[slot];
+    memset(table, 0, AHCI_PRDT_OFFSET);
+
+    ahci_fis_h2d_t* fis = (ahci_fis_h2d_t*)table;
+    fis->fis_type = AHCI_FIS_REG_H2D;
+    fis->flags = 0x80;
+    fis->command = command;
+    if (command != AHCI_ATA_IDENTIFY) fis->device = 0x40;   // LBA mode
+    fis->lba0 = (uint8_t)lba;
+    fis->lba1 = (uint8_t)(lba >> 8);
+    fis->lba2 = (uint8_t)(lba >> 16);
+    fis->lba3 = (uint8_t)(lba >> 24);
+    fis->lba4 = (uint8_t)(lba >> 32);
+    fis->lba5 = (uint8_t)(lba >> 40);
+    if (command == AHCI_ATA_READ_FPDMA || command == AHCI_ATA_WRITE_FPDMA) {
+        // Queued: the sector count moves to FEATURES, the tag into COUNT
+        fis->feature_lo = (uint8_t)count;
+        fis->feature_hi = (uint8_t)(count >> 8);
+        fis->count_lo = (uint8_t)(slot << 3);
+    } else {
+        fis->count_lo = (uint8_t)count;
+        fis->count_hi = (uint8_t)(count >> 8);
+    }
+
+    int n = bytes ? ahci_build_prdt(table, buf, bytes) : 0;
+    if (n < 0) return -1;
+
+    ahci_cmd_header_t* hdr = &p->cmd_list[slot];
+    hdr->flags = (uint16_t)(sizeof(ahci_fis_h2d_t) / 4) | (write ? AHCI_CMDH_WRITE : 0);
+    hdr->prdtl = (uint16_t)n;
+    hdr->prdbc = 0;
+    hdr->ctba = (uint32_t)(uint64_t)table;
+    hdr->ctbau = (uint32_t)((uint64_t)table >> 32);
+    return 0;
+}
+
+static void ahci_issue(ahci_port_t* p, int slot, int queued) {
+    uint32_t bit = 1U << slot;
+    uint64_t flags = spin_lock_irqsave(&p->lock);
+    p->deadline[slot] = timer_now_ns() + AHCI_CMD_TIMEOUT_NS;
+    p->issued |= bit;
+    if (queued) px_write(p, AHCI_PX_SACT, bit);
+    px_write(p, AHCI_PX_CI, bit);
+    if (!p->poll_armed && timer_is_active() &&
+        timer_add(timer_now_ns() + ahci_poll_ns(p), ahci_poll_event, (uint64_t)(p - ports)) >= 0) {
+        p->poll_armed = 1;
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+}
+
+// A non-queued command (IDENTIFY, FLUSH) must not overlap queued ones:
+// stop new requests and let the port drain first
+static int ahci_exec_drained(ahci_port_t* p, uint8_t command, void* buf, uint32_t bytes) {
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&p->lock);
+        if (!p->exclusive) {
+            p->exclusive = 1;
+            spin_unlock_irqrestore(&p->lock, flags);
+            break;
+        }
+        spin_unlock_irqrestore(&p->lock, flags);
+        ahci_wait(p, ahci_no_drain, p);
+    }
+    ahci_wait(p, ahci_port_idle, p);
+
+    ahci_req_t r = { p, 0, 0, 1 };
+    r.mask = ahci_alloc_slots(&r, 1);
+    int slot = __builtin_ctz(r.mask);
+    int result = ahci_prepare(p, slot, command, 0, 0, buf, bytes, 0);
+    if (result == 0) {
+        ahci_issue(p, slot, 0);
+        result = ahci_finish(&r) ? -1 : 0;
+    } else {
+        ahci_finish(&r);
+    }
+
+    p->exclusive = 0;
+    waitq_wake_all(&p->wq);
+    return result;
+}
+
+// ---------- Transfers ----------
+
+static uint32_t ahci_slots_needed(uint32_t count) {
+    return (count + AHCI_MAX_SECTORS - 1) / AHCI_MAX_SECTORS;
+}
+
+// Issue commands for count sectors (at most the port's slots' worth) onto
+// request r. Returns 0, -1 on error, or 1 if r holds slots and the rest
+// are busy: finish r and queue again.
+static int ahci_queue(ahci_port_t* p, ahci_req_t* r, uint64_t lba, uint32_t count, uint8_t* buf, int write) {
+    uint8_t command;
+    if (p->disk.ncq) command = write ? AHCI_ATA_WRITE_FPDMA : AHCI_ATA_READ_FPDMA;
+    else command = write ? AHCI_ATA_WRITE_DMA_EXT : AHCI_ATA_READ_DMA_EXT;
+
+    uint32_t slots = ahci_alloc_slots(r, ahci_slots_needed(count));
+    if (!slots) return 1;
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t n = count - done;
+        if (n > AHCI_MAX_SECTORS) n = AHCI_MAX_SECTORS;
+        int slot = __builtin_ctz(slots);
+        if (ahci_prepare(p, slot, command, lba + done, n, buf + (uint64_t)done * BLKDEV_SECTOR_SIZE,
+                         n * BLKDEV_SECTOR_SIZE, write) < 0) {
+            uint64_t flags = spin_lock_irqsave(&p->lock);
+            p->busy &= ~slots;
+            spin_unlock_irqrestore(&p->lock, flags);
+            waitq_wake_all(&p->wq);
+            return -1;
+        }
+        ahci_issue(p, slot, p->disk.ncq);
+        r->mask |= 1U << slot;
+        slots &= slots - 1;
+        done += n;
+    }
+    return 0;
+}
+
+static int ahci_transfer(ahci_port_t* p, uint64_t lba, uint32_t count, uint8_t* buf, int write) {
+    // A request never asks for more slots than the port has: its own
+    // would not be released until it finished
+    uint32_t window = (uint32_t)p->disk.slots * AHCI_MAX_SECTORS;
+    int result = 0;
+    for (uint32_t done = 0; done < count && result == 0; ) {
+        uint32_t n = count - done < window ? count - done : window;
+        ahci_req_t r = { p, 0, 0, 0 };
+        if (ahci_queue(p, &r, lba + done, n, buf + (uint64_t)done * BLKDEV_SECTOR_SIZE, write) < 0) {
+            result = -1;
+        }
+        if (ahci_finish(&r)) result = -1;
+        done += n;
+    }
+    return result;
+}
+
+// PRDs need word-aligned buffers: odd ones go through a bounce page
+static int ahci_transfer_bounce(ahci_port_t* p, uint64_t lba, uint32_t count, uint8_t* buf, int write) {
+    uint8_t* bounce = (uint8_t*)pmm_alloc_block();
+    if (!bounce) return -1;
+    int result = 0;
+    for (uint32_t done = 0; done < count && result == 0; ) {
+        uint32_t n = count - done;
+        if (n > PAGE_SIZE / BLKDEV_SECTOR_SIZE) n = PAGE_SIZE / BLKDEV_SECTOR_SIZE;
+        uint8_t* at = buf + (uint64_t)done * BLKDEV_SECTOR_SIZE;
+        if (write) memcpy(bounce, at, n * BLKDEV_SECTOR_SIZE);
+        result = ahci_transfer(p, lba + done, n, bounce, write);
+        if (!write && result == 0) memcpy(at, bounce, n * BLKDEV_SECTOR_SIZE);
+        done += n;
+    }
+    pmm_free_block(bounce);
+    return result;
+}
+
+static int ahci_rw(int disk, uint64_t lba, uint32_t count, void* buf, int write) {
+    if (disk < 0 || disk >= disk_count || !buf) return -1;
+    ahci_port_t* p = &ports[disk];
+    if (count == 0) return 0;
+    if (lba + count > p->disk.sectors) return -1;
+
+    int r = ((uint64_t)buf & 1) ? ahci_transfer_bounce(p, lba, count, (uint8_t*)buf, write)
+                                : ahci_transfer(p, lba, count, (uint8_t*)buf, write);
+    return r < 0 ? -1 : (int)count;
+}
+
+int ahci_read_sectors(int disk, uint64_t lba, uint32_t count, void* buf) {
+    return ahci_rw(disk, lba, count, buf, 0);
+}
+
+int ahci_write_sectors(int disk, uint64_t lba, uint32_t count, const void* buf) {
+    return ahci_rw(disk, lba, count, (void*)buf, 1);
+}
+
+int ahci_flush(int disk) {
+    if (disk < 0 || disk >= disk_count) return -1;
+    return ahci_exec_drained(&ports[disk], AHCI_ATA_FLUSH_EXT, 0, 0);
+}
+
+ahci_disk_t* ahci_get_disk(int index) {
+    if (index < 0 || index >= disk_count) return (ahci_disk_t*)0;
+    return &ports[index].disk;
+}
+
+int ahci_get_disk_count(void) {
+    return disk_count;
+}
+
+// ---------- Block device adapters ----------
+
+static int ahci_blkdev_read(void* driver_data, uint32_t lba, uint32_t count, void* buf) {
+    return ahci_read_sectors((int)(uint64_t)driver_data, lba, count, buf);
+}
+
+static int ahci_blkdev_write(void* driver_data, uint32_t lba, uint32_t count, const void* buf) {
+    return ahci_write_sectors((int)(uint64_t)driver_data, lba, count, buf);
+}
+
+static int ahci_blkdev_flush(void* driver_data) {
+    return ahci_flush((int)(uint64_t)driver_data);
+}
+
+// Complete the batch's queued transfers [0, n) and fail those whose
+// slots reported an error
+static void ahci_batch_finish(ahci_req_t* r, blkdev_io_t* ios, uint32_t* masks, int n) {
+    uint32_t failed = ahci_finish(r);
+    for (int i = 0; i < n; i++) {
+        if (masks[i] & failed) ios[i].status = -1;
+        masks[i] = 0;
+    }
+}
+
+// Issue a batch of transfers together so that NCQ can reorder them on the
+// drive. Transfers that need a bounce page or more slots than the port
+// has run on their own, once the commands queued before them are done.
+static int ahci_blkdev_submit(void* driver_data, blkdev_io_t* ios, int count) {
+    int disk = (int)(uint64_t)driver_data;
+    if (disk < 0 || disk >= disk_count || count > BLKDEV_BATCH_MAX) return -1;
+    ahci_port_t* p = &ports[disk];
+    uint32_t masks[BLKDEV_BATCH_MAX];
+    ahci_req_t r = { p, 0, 0, 0 };
+    uint32_t used = 0;
+
+    for (int i = 0; i < count; i++) {
+        blkdev_io_t* io = &ios[i];
+        uint8_t* buf = (uint8_t*)io->buf;
+        uint32_t need = ahci_slots_needed(io->count);
+        int alone = ((uint64_t)buf & 1) || need > (uint32_t)p->disk.slots;
+        masks[i] = 0;
+        io->status = 0;
+        if (r.mask && (alone || used + need > (uint32_t)p->disk.slots)) {
+            ahci_batch_finish(&r, ios, masks, i);
+            used = 0;
+        }
+
+        if (!buf || (uint64_t)io->lba + io->count > p->disk.sectors) {
+            io->status = -1;
+        } else if (alone) {
+            io->status = ((uint64_t)buf & 1) ? ahci_transfer_bounce(p, io->lba, io->count, buf, io->write)
+                                             : ahci_transfer(p, io->lba, io->count, buf, io->write);
+        } else {
+            uint32_t before = r.mask;
+            int q = ahci_queue(p, &r, io->lba, io->count, buf, io->write);
+            if (q > 0) {
+                // Other requests have the slots: complete ours before waiting
+                ahci_batch_finish(&r, ios, masks, i);
+                used = 0;
+                before = 0;
+                q = ahci_queue(p, &r, io->lba, io->count, buf, io->write);
+            }
+            if (q < 0) io->status = -1;
+            masks[i] = r.mask & ~before;
+            used += need;
+        }
+    }
+    ahci_batch_finish(&r, ios, masks, count);
+    return 0;
+}
+
+// ---------- Initialization ----------
+
+static void ahci_free_port(ahci_port_t* p) {
+    for (int s = 0; s < AHCI_MAX_SLOTS; s++) {
+        if (p->tables[s]) pmm_free_block(p->tables[s]);
+        p->tables[s] = 0;
+    }
+    if (p->cmd_list) pmm_free_block(p->cmd_list);
+    p->cmd_list = 0;
+}
+
+// Set up one port with a disk attached. Returns 0 if it is usable.
+static int ahci_port_init(ahci_port_t* p, uint32_t cap) {
+    uint8_t* mem = (uint8_t*)pmm_alloc_block();   // Command list (1KB) + received FIS
+    if (!mem) return -1;
+    memset(mem, 0, PAGE_SIZE);
+    p->cmd_list = (ahci_cmd_header_t*)mem;
+
+    int nslots = (int)((cap >> AHCI_CAP_NCS_SHIFT) & 0x1F) + 1;
+    for (int s = 0; s < nslots; s++) {
+        p->tables[s] = (uint8_t*)pmm_alloc_block();
+        if (!p->tables[s]) {
+            ahci_free_port(p);
+            return -1;
+        }
+        memset(p->tables[s], 0, AHCI_CMD_TABLE_SIZE);
+    }
+    p->slot_mask = nslots == 32 ? 0xFFFFFFFFU : (1U << nslots) - 1;
+
+    ahci_port_stop(p);
+    px_write(p, AHCI_PX_CLB, (uint32_t)(uint64_t)mem);
+    px_write(p, AHCI_PX_CLBU, (uint32_t)((uint64_t)mem >> 32));
+    px_write(p, AHCI_PX_FB, (uint32_t)(uint64_t)(mem + 1024));
+    px_write(p, AHCI_PX_FBU, (uint32_t)((uint64_t)(mem + 1024) >> 32));
+    px_write(p, AHCI_PX_SERR, 0xFFFFFFFF);
+    px_write(p, AHCI_PX_IS, 0xFFFFFFFF);
+    px_write(p, AHCI_PX_IE, 0);
+    ahci_port_start(p);
+
+    uint16_t* ident = (uint16_t*)pmm_alloc_block();
+    if (!ident) {
+        ahci_free_port(p);
+        return -1;
+    }
+    if (ahci_exec_drained(p, AHCI_ATA_IDENTIFY, ident, 512) < 0 || !(ident[83] & (1 << 10))) {
+        // Only LBA48 disks: every transfer uses a 48-bit command
+        pmm_free_block(ident);
+        ahci_port_stop(p);
+        ahci_free_port(p);
+        return -1;
+    }
+
+    for (int i = 0; i < 20; i++) {
+        p->disk.model[i * 2] = (char)(ident[27 + i] >> 8);
+        p->disk.model[i * 2 + 1] = (char)(ident[27 + i] & 0xFF);
+    }
+    p->disk.model[40] = 0;
+    for (int i = 39; i >= 0 && p->disk.model[i] == ' '; i--) p->disk.model[i] = 0;
+    p->disk.sectors = (uint64_t)ident[100] | ((uint64_t)ident[101] << 16) |
+                      ((uint64_t)ident[102] << 32) | ((uint64_t)ident[103] << 48);
+
+    // NCQ needs both sides; the queue depth caps the usable slots
+    p->disk.ncq = (cap & AHCI_CAP_SNCQ) && (ident[76] & (1 << 8));
+    if (p->disk.ncq) {
+        int depth = (ident[75] & 0x1F) + 1;
+        if (depth < nslots) p->slot_mask = (1U << depth) - 1;
+    }
+    p->disk.slots = 0;
+    for (uint32_t m = p->slot_mask; m; m &= m - 1) p->disk.slots++;
+    pmm_free_block(ident);
+    return 0;
+}
+
+static void ahci_init_hba(pci_device_t* dev) {
+    uint64_t bar5 = pci_get_bar_base(dev, 5);
+    if (!bar5) return;
+    pci_enable_bus_master(dev);
+    pci_enable_mem_space(dev);
+    volatile uint8_t* abar = (volatile uint8_t*)(uintptr_t)bar5;
+
+    // Take the HBA from the firmware if it asks for a handoff
+    if (hba_read(abar, AHCI_HBA_CAP2) & AHCI_CAP2_BOH) {
+        hba_write(abar, AHCI_HBA_BOHC, hba_read(abar, AHCI_HBA_BOHC) | AHCI_BOHC_OOS);
+        for (int i = 0; i < 1000000 && (hba_read(abar, AHCI_HBA_BOHC) & AHCI_BOHC_BOS); i++) {
+            __asm__ volatile("pause");
+        }
+    }
+    hba_write(abar, AHCI_HBA_GHC, (hba_read(abar, AHCI_HBA_GHC) | AHCI_GHC_AE) & ~AHCI_GHC_IE);
+    hba_write(abar, AHCI_HBA_IS, 0xFFFFFFFF);
+
+    uint32_t cap = hba_read(abar, AHCI_HBA_CAP);
+    uint32_t pi = hba_read(abar, AHCI_HBA_PI);
+    int first = disk_count;
+    for (int port = 0; port < 32 && disk_count < AHCI_MAX_DEVICES; port++) {
+        if (!(pi & (1U << port))) continue;
+        ahci_port_t* p = &ports[disk_count];
+        memset(p, 0, sizeof(*p));
+        p->abar = abar;
+        p->regs = abar + AHCI_HBA_PORTS + port * AHCI_HBA_PORT_STRIDE;
+        waitq_init(&p->wq);
+
+        if ((px_read(p, AHCI_PX_SSTS) & 0xF) != AHCI_SSTS_DET_PRESENT) continue;
+        if (px_read(p, AHCI_PX_SIG) != AHCI_SIG_ATA) continue;   // ATAPI, PM, ...
+        if (ahci_port_init(p, cap) < 0) continue;
+
+        p->disk.present = 1;
+        p->disk.port = port;
+        int index = disk_count++;
+
+        blkdev_ops_t ops;
+        ops.read_sectors = ahci_blkdev_read;
+        ops.write_sectors = ahci_blkdev_write;
+        ops.flush = ahci_blkdev_flush;
+        ops.submit = ahci_blkdev_submit;
+        char name[16] = "ahci0";
+        name[4] = '0' + (char)index;
+        p->disk.blkdev_id = blkdev_register(name, BLKDEV_TYPE_AHCI, p->disk.sectors,
+                                            BLKDEV_SECTOR_SIZE, (void*)(uint64_t)index, &ops);
+    }
+
+    // One vector for the HBA, on this CPU
+    if (first == disk_count || !apic_is_active()) return;
+    if (pci_irq_alloc(dev, 0, ahci_msi, (void*)abar, (uint8_t)lapic_get_id()) < 0) return;
+    for (int i = first; i < disk_count; i++) {
+        uint64_t flags = spin_lock_irqsave(&ports[i].lock);
+        ports[i].irq = 1;
+        px_write(&ports[i], AHCI_PX_IE, AHCI_PX_IE_DONE | AHCI_PX_IS_ERRORS);
+        spin_unlock_irqrestore(&ports[i].lock, flags);
+    }
+    hba_write(abar, AHCI_HBA_GHC, hba_read(abar, AHCI_HBA_GHC) | AHCI_GHC_IE);
+}
+
+int ahci_init(void) {
+    disk_count = 0;
+    pci_device_t* dev = (pci_device_t*)0;
+    while ((dev = pci_find_class_prog(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA,
+                                      AHCI_PROG_IF, dev)) != 0) {
+        ahci_init_hba(dev);
+    }
+    return disk_count;
+}
@@ -0,0 +1,148 @@
+// ahci.h - AHCI SATA Driver for Alteo OS
+// Drives SATA disks behind a PCI AHCI host bus adapter. Every command
+// slot the HBA and drive support is used: large requests are split into
+// commands that are all issued before waiting, and with native command
+// queuing (NCQ) the drive may complete them in any order.
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "stdint.h"
+
+// PCI class 0x01 / subclass 0x06 / prog_if 0x01
+#define AHCI_PROG_IF            0x01
+
+// Generic host control registers (offsets from ABAR)
+#define AHCI_HBA_CAP            0x00
+#define AHCI_HBA_GHC            0x04
+#define AHCI_HBA_IS             0x08
+#define AHCI_HBA_PI             0x0C
+#define AHCI_HBA_VS             0x10
+#define AHCI_HBA_CAP2           0x24
+#define AHCI_HBA_BOHC           0x28
+#define AHCI_HBA_PORTS          0x100   // Port 0 registers
+#define AHCI_HBA_PORT_STRIDE    0x80
+
+#define AHCI_CAP_NCS_SHIFT      8       // Command slots - 1 (5 bits)
+#define AHCI_CAP_SNCQ           (1U << 30)
+#define AHCI_CAP_S64A           (1U << 31)
+#define AHCI_CAP2_BOH           (1U << 0)
+#define AHCI_GHC_IE             (1U << 1)
+#define AHCI_GHC_AE             (1U << 31)
+#define AHCI_BOHC_BOS           (1U << 0)
+#define AHCI_BOHC_OOS           (1U << 1)
+
+// Port registers (offsets from the port's base)
+#define AHCI_PX_CLB             0x00
+#define AHCI_PX_CLBU            0x04
+#define AHCI_PX_FB              0x08
+#define AHCI_PX_FBU             0x0C
+#define AHCI_PX_IS              0x10
+#define AHCI_PX_IE              0x14
+#define AHCI_PX_CMD             0x18
+#define AHCI_PX_TFD             0x20
+#define AHCI_PX_SIG             0x24
+#define AHCI_PX_SSTS            0x28
+#define AHCI_PX_SERR            0x30
+#define AHCI_PX_SACT            0x34
+#define AHCI_PX_CI              0x38
+
+#define AHCI_PX_CMD_ST          (1U << 0)
+#define AHCI_PX_CMD_FRE         (1U << 4)
+#define AHCI_PX_CMD_FR          (1U << 14)
+#define AHCI_PX_CMD_CR          (1U << 15)
+#define AHCI_PX_IS_ERRORS       0x7D800010U   // TFES HBFS HBDS IFS INFS OFS UFS
+#define AHCI_PX_IE_DONE         0x0000002FU   // DHRS PSS DSS SDBS DPS
+#define AHCI_PX_TFD_ERR         0x01
+#define AHCI_PX_TFD_DRQ         0x08
+#define AHCI_PX_TFD_BSY         0x80
+#define AHCI_SSTS_DET_PRESENT   0x3
+#define AHCI_SIG_ATA            0x00000101
+
+// FIS types and ATA commands
+#define AHCI_FIS_REG_H2D        0x27
+#define AHCI_ATA_READ_DMA_EXT   0x25
+#define AHCI_ATA_WRITE_DMA_EXT  0x35
+#define AHCI_ATA_READ_FPDMA     0x60
+#define AHCI_ATA_WRITE_FPDMA    0x61
+#define AHCI_ATA_FLUSH_EXT      0xEA
+#define AHCI_ATA_IDENTIFY       0xEC
+
+// Command list entry (32 bytes, 32 per port)
+typedef struct __attribute__((packed)) {
+    uint16_t flags;          // CFL (FIS dwords) | A | W (write) | P | R | B | C
+    uint16_t prdtl;          // PRDT entries
+    volatile uint32_t prdbc; // Bytes transferred
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} ahci_cmd_header_t;
+
+#define AHCI_CMDH_WRITE         (1 << 6)
+
+typedef struct __attribute__((packed)) {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;            // Byte count - 1 (bit 0 set), up to 4MB
+} ahci_prd_t;
+
+// Command table: one page per slot; the rest of the page holds PRDs
+#define AHCI_CMD_TABLE_SIZE     4096
+#define AHCI_PRDT_OFFSET        0x80
+#define AHCI_PRDT_ENTRIES       ((AHCI_CMD_TABLE_SIZE - AHCI_PRDT_OFFSET) / 16)
+#define AHCI_PRD_MAX_BYTES      (4U * 1024 * 1024)
+
+// Register H2D FIS (20 bytes)
+typedef struct __attribute__((packed)) {
+    uint8_t fis_type;
+    uint8_t flags;           // Bit 7: command (not control)
+    uint8_t command;
+    uint8_t feature_lo;
+    uint8_t lba0, lba1, lba2;
+    uint8_t device;
+    uint8_t lba3, lba4, lba5;
+    uint8_t feature_hi;
+    uint8_t count_lo;
+    uint8_t count_hi;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+} ahci_fis_h2d_t;
+
+// Driver limits
+#define AHCI_MAX_DEVICES        8
+#define AHCI_MAX_SLOTS          32
+#define AHCI_MAX_SECTORS        1024    // Per command (512KB, fits the PRDT page by page)
+#define AHCI_POLL_NS            100000ULL      // Completion poll while commands run
+#define AHCI_IRQ_POLL_NS        10000000ULL    // Timeout check when completions interrupt
+#define AHCI_CMD_TIMEOUT_NS     5000000000ULL
+
+// One SATA disk
+typedef struct {
+    int      present;
+    int      port;           // HBA port number
+    int      ncq;            // Commands are queued (FPDMA)
+    int      slots;          // Usable command slots
+    uint64_t sectors;
+    char     model[41];
+    int      blkdev_id;
+} ahci_disk_t;
+
+// Find AHCI controllers, bring up their SATA disks and register each
+// with the block layer as "ahci0", "ahci1", ... (after blkdev_init).
+// Returns the number of disks found.
+int ahci_init(void);
+
+// Disk info, or 0 if index is not a disk
+ahci_disk_t* ahci_get_disk(int index);
+int ahci_get_disk_count(void);
+
+// Sector I/O (count may exceed a command; requests are split and queued).
+// Returns count, or -1 on error.
+int ahci_read_sectors(int disk, uint64_t lba, uint32_t count, void* buf);
+int ahci_write_sectors(int disk, uint64_t lba, uint32_t count, const void* buf);
+
+// Flush the disk's write cache (waits for queued commands first)
+int ahci_flush(int disk);
+
+#endif
@@ -87,6 +87,10 @@ static void pit_delay_10ms(void) {
     while (!(inb(0x61) & 0x20));
 }
 
+void apic_delay_ms(uint32_t ms) {
+    for (uint32_t i = 0; i < (ms + 9) / 10; i++) pit_delay_10ms();
+}
+
 // ---- I/O APIC IRQ Configuration ----
 
 // Get the GSI for a given ISA IRQ (accounts for Interrupt Source Overrides)
@@ -106,6 +110,17 @@ static uint32_t irq_to_gsi(uint8_t irq, uint16_t* flags_out) {
     return (uint32_t)irq;
 }
 
+int ioapic_irq_level_override(uint8_t irq) {
+    if (!ioapic_base) return 0;
+    int iso_count = acpi_get_iso_count();
+    acpi_iso_t* isos = acpi_get_isos();
+    for (int i = 0; i < iso_count; i++) {
+        if (isos[i].irq != irq) continue;
+        return ((isos[i].flags >> 2) & 0x03) == 3 && isos[i].gsi <= ioapic_max_redir;
+    }
+    return 0;
+}
+
 void ioapic_set_irq(uint8_t irq, uint8_t vector, uint8_t dest_apic_id, uint32_t flags) {
     if (!ioapic_base) return;
 
@@ -245,6 +260,10 @@ void lapic_eoi(void) {
     }
 }
 
+uint64_t lapic_get_base(void) {
+    return (uint64_t)(uintptr_t)lapic_base;
+}
+
 uint32_t lapic_get_id(void) {
     if (!lapic_base) return 0;
     return (lapic_read(LAPIC_ID) >> 24) & 0xFF;
@@ -270,31 +289,97 @@ void lapic_send_sipi(uint8_t dest_apic_id, uint8_t vector) {
     lapic_send_ipi(dest_apic_id, LAPIC_ICR_STARTUP | (uint32_t)vector);
 }
 
-void lapic_timer_init(uint32_t frequency_hz) {
-    if (!lapic_base) return;
-    (void)frequency_hz;
+// ---- LAPIC timer ----
 
-    // Set divider to 16
-    lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV_16);
+#define IA32_TSC_DEADLINE_MSR   0x6E0
+#define NS_PER_SEC              1000000000ULL
+
+static uint64_t lapic_timer_hz = 0;      // LAPIC timer counts per second (divide by 16)
+static uint64_t tsc_hz = 0;              // TSC cycles per second
+static int tsc_deadline_ok = 0;
 
-    // Calibrate: run timer with max count for 10ms, measure how far it counts
-    lapic_write(LAPIC_TIMER, LAPIC_TIMER_MASKED | LAPIC_TIMER_ONESHOT);
-    lapic_write(LAPIC_TIMER_ICR, 0xFFFFFFFF);
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
 
+// v * num / den without overflowing 64 bits (for num below ~2^34)
+static uint64_t scale64(uint64_t v, uint64_t num, uint64_t den) {
+    return (v / den) * num + (v % den) * num / den;
+}
+
+void lapic_timer_calibrate(void) {
+    if (tsc_hz) return;
+
+    // CPUID.01h:ECX[24] = TSC-deadline mode
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    tsc_deadline_ok = lapic_base && (ecx & (1U << 24));
+
+    // Run the TSC and the LAPIC timer (max count) across one 10ms PIT interval
+    if (lapic_base) {
+        lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV_16);
+        lapic_write(LAPIC_TIMER, LAPIC_TIMER_MASKED | LAPIC_TIMER_ONESHOT);
+        lapic_write(LAPIC_TIMER_ICR, 0xFFFFFFFF);
+    }
+    uint64_t t0 = rdtsc();
     pit_delay_10ms();
+    uint64_t t1 = rdtsc();
+    if (lapic_base) {
+        lapic_write(LAPIC_TIMER, LAPIC_TIMER_MASKED);
+        lapic_timer_hz = (uint64_t)(0xFFFFFFFF - lapic_read(LAPIC_TIMER_CCR)) * 100;
+        lapic_write(LAPIC_TIMER_ICR, 0);
+    }
+    tsc_hz = (t1 - t0) * 100;
+    if (tsc_hz == 0) tsc_hz = 1;
+}
 
-    // Stop timer and read remaining count
-    lapic_write(LAPIC_TIMER, LAPIC_TIMER_MASKED);
-    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CCR);
+uint64_t lapic_tsc_hz(void) {
+    return tsc_hz;
+}
+
+int lapic_timer_has_tsc_deadline(void) {
+    return tsc_deadline_ok;
+}
+
+void lapic_timer_init(uint32_t frequency_hz) {
+    if (!lapic_base) return;
+    lapic_timer_calibrate();
 
-    // elapsed = ticks in 10ms
-    // For target frequency: ticks_per_interval = elapsed * (1000 / 10) / frequency_hz
-    //                     = elapsed * 100 / frequency_hz
     if (frequency_hz == 0) frequency_hz = 1000;
-    lapic_timer_ticks = elapsed * 100 / frequency_hz;
+    lapic_timer_ticks = (uint32_t)(lapic_timer_hz / frequency_hz);
     if (lapic_timer_ticks == 0) lapic_timer_ticks = 1;
 
     // Set up periodic timer with vector APIC_TIMER_VECTOR (0x20 = same as IRQ0)
+    lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV_16);
     lapic_write(LAPIC_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
     lapic_write(LAPIC_TIMER_ICR, lapic_timer_ticks);
 }
+
+void lapic_timer_arm(uint64_t delay_ns) {
+    if (!lapic_base) return;
+    lapic_timer_calibrate();
+
+    if (tsc_deadline_ok) {
+        // Absolute TSC target: no counter width limit, no drift from reprogramming
+        lapic_write(LAPIC_TIMER, LAPIC_TIMER_TSC | APIC_TIMER_VECTOR);
+        wrmsr(IA32_TSC_DEADLINE_MSR, rdtsc() + scale64(delay_ns, tsc_hz, NS_PER_SEC) + 1);
+        return;
+    }
+
+    // One-shot countdown; longer delays expire early and the caller re-arms
+    uint64_t count = scale64(delay_ns, lapic_timer_hz, NS_PER_SEC);
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+    lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_TIMER, LAPIC_TIMER_ONESHOT | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_ICR, (uint32_t)count);
+}
+
+void lapic_timer_stop(void) {
+    if (!lapic_base) return;
+    if (tsc_deadline_ok) wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    lapic_write(LAPIC_TIMER_ICR, 0);
+    lapic_write(LAPIC_TIMER, LAPIC_TIMER_MASKED);
+}
@@ -119,6 +119,12 @@ void lapic_eoi(void);
 // Get current CPU's APIC ID
 uint32_t lapic_get_id(void);
 
+// Virtual (identity-mapped) base of the Local APIC registers, 0 if inactive
+uint64_t lapic_get_base(void);
+
+// Busy-wait using the PIT (10ms granularity; BSP only)
+void apic_delay_ms(uint32_t ms);
+
 // Send IPI (Inter-Processor Interrupt)
 void lapic_send_ipi(uint8_t dest_apic_id, uint32_t flags);
 
@@ -131,6 +137,12 @@ void lapic_send_sipi(uint8_t dest_apic_id, uint8_t vector);
 // I/O APIC: set a redirection table entry for an IRQ
 void ioapic_set_irq(uint8_t irq, uint8_t vector, uint8_t dest_apic_id, uint32_t flags);
 
+// 1 if the MADT overrides ISA IRQ irq as level-triggered. Without an AML
+// interpreter for _PRT this is the only sign that a PCI INTx line the
+// firmware left in PCI_INT_LINE really reaches the I/O APIC there;
+// ioapic_set_irq(irq, ..., 0) then takes polarity and trigger from it.
+int ioapic_irq_level_override(uint8_t irq);
+
 // I/O APIC: mask/unmask an IRQ
 void ioapic_mask_irq(uint8_t irq);
 void ioapic_unmask_irq(uint8_t irq);
@@ -138,6 +150,24 @@ void ioapic_unmask_irq(uint8_t irq);
 // Start APIC timer with periodic interrupt at ~1000Hz (or specified frequency)
 void lapic_timer_init(uint32_t frequency_hz);
 
+// Measure the LAPIC timer and TSC rates against the PIT (once, on the BSP).
+// Works without an APIC too, calibrating only the TSC.
+void lapic_timer_calibrate(void);
+
+// Calibrated TSC frequency in Hz (0 before lapic_timer_calibrate)
+uint64_t lapic_tsc_hz(void);
+
+// 1 if the CPU supports TSC-deadline timer mode
+int lapic_timer_has_tsc_deadline(void);
+
+// Fire one APIC_TIMER_VECTOR interrupt on this CPU after delay_ns, using
+// TSC-deadline mode when available and one-shot mode otherwise (delays
+// beyond the 32-bit counter range fire early). Replaces any pending shot.
+void lapic_timer_arm(uint64_t delay_ns);
+
+// Cancel any pending or periodic LAPIC timer interrupt on this CPU
+void lapic_timer_stop(void);
+
 // Read/write Local APIC register
 uint32_t lapic_read(uint32_t reg);
 void lapic_write(uint32_t reg, uint32_t val);
@@ -1,6 +1,21 @@
 // ata.c - ATA/IDE Hard Disk Driver for Alteo OS
-// PIO mode driver for reading/writing sectors
+// Sectors move by PCI bus-master DMA when the IDE controller and drive
+// support it, with PIO as the fallback. A DMA command sleeps on its
+// channel's wait queue until the IRQ 14/15 handler (or a polling loop,
+// for callers that cannot block) sees the bus-master interrupt bit.
+// Each channel runs one command at a time; the owner may sleep with the
+// BKL dropped, so every register access happens with the channel held.
 #include "ata.h"
+#include "klib.h"
+#include "apic.h"
+#include "irq.h"
+#include "pci.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "timer.h"
+#include "waitq.h"
+#include "scheduler.h"
+#include "spinlock.h"
 
 // Port I/O (duplicated here for standalone compilation)
 static inline uint8_t ata_inb(uint16_t port) {
@@ -19,17 +34,33 @@ static inline uint16_t ata_inw(uint16_t port) {
 static inline void ata_outw(uint16_t port, uint16_t val) {
     __asm__ __volatile__("outw %0, %1" : : "a"(val), "Nd"(port));
 }
-
-// String helper
-static void ata_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
+static inline void ata_outl(uint16_t port, uint32_t val) {
+    __asm__ __volatile__("outl %0, %1" : : "a"(val), "Nd"(port));
 }
 
 // Drive table (up to 4: primary master/slave, secondary master/slave)
 static ata_drive_t drives[4];
 static int drive_count = 0;
 
+typedef struct {
+    uint16_t     io_base;
+    uint16_t     ctrl_port;
+    uint16_t     bm_base;        // Bus-master registers, 0 = no DMA
+    uint8_t      irq;
+    int          irq_ok;         // Completion interrupts are delivered
+    ata_prd_t*   prdt;
+    spinlock_t   lock;
+    waitq_t      wq;             // Channel owners and DMA completion
+    volatile int busy;           // A command owns the channel
+    volatile int dma_active;
+    volatile int done;
+    volatile int timed_out;
+    volatile uint8_t bm_status;  // Latched by the IRQ handler
+    uint32_t     seq;            // Tags timeout events with their command
+} ata_channel_t;
+
+static ata_channel_t channels[2];
+
 // Wait for BSY to clear
 static void ata_wait(uint16_t io_base) {
     for (int i = 0; i < 4; i++) ata_inb(io_base + 7); // 400ns delay
@@ -59,7 +90,7 @@ static void ata_soft_reset(uint16_t ctrl_port) {
 // Identify drive
 static int ata_identify(uint16_t io_base, uint16_t ctrl_port, int slave, ata_drive_t* drv) {
     (void)ctrl_port;
-    ata_memset(drv, 0, sizeof(ata_drive_t));
+    memset(drv, 0, sizeof(ata_drive_t));
 
     // Select drive
     ata_outb(io_base + 6, slave ? ATA_SLAVE : ATA_MASTER);
@@ -127,100 +158,346 @@ static int ata_identify(uint16_t io_base, uint16_t ctrl_port, int slave, ata_dri
 
     // LBA48 sector count (words 100-103)
     if (ident[83] & (1 << 10)) {
-        drv->sectors = (uint32_t)ident[100] | ((uint32_t)ident[101] << 16);
+        drv->lba48 = 1;
+        drv->sectors = (uint64_t)ident[100] | ((uint64_t)ident[101] << 16) |
+                       ((uint64_t)ident[102] << 32) | ((uint64_t)ident[103] << 48);
     } else {
         // LBA28 sector count (words 60-61)
         drv->sectors = (uint32_t)ident[60] | ((uint32_t)ident[61] << 16);
     }
 
-    drv->size_mb = drv->sectors / 2048; // sectors * 512 / (1024*1024)
+    drv->size_mb = (uint32_t)(drv->sectors / 2048); // sectors * 512 / (1024*1024)
+    drv->dma = (ident[49] & (1 << 8)) != 0;         // Capable; needs a controller too
 
     return 1;
 }
 
-void ata_init(void) {
-    ata_memset(drives, 0, sizeof(drives));
-    drive_count = 0;
+// ---------- Channels ----------
 
-    // Soft reset both channels
-    ata_soft_reset(ATA_PRIMARY_CTRL);
-    ata_soft_reset(ATA_SECONDARY_CTRL);
-
-    // Probe all 4 possible drives
-    uint16_t io_bases[] = {ATA_PRIMARY_DATA, ATA_PRIMARY_DATA,
-                           ATA_SECONDARY_DATA, ATA_SECONDARY_DATA};
-    uint16_t ctrl_ports[] = {ATA_PRIMARY_CTRL, ATA_PRIMARY_CTRL,
-                             ATA_SECONDARY_CTRL, ATA_SECONDARY_CTRL};
-    int slaves[] = {0, 1, 0, 1};
+static int ata_chan_idle(void* arg) {
+    return !((ata_channel_t*)arg)->busy;
+}
 
-    for (int i = 0; i < 4; i++) {
-        if (ata_identify(io_bases[i], ctrl_ports[i], slaves[i], &drives[i])) {
-            drives[i].bus = (i >= 2) ? 1 : 0;
-            drives[i].drive = slaves[i];
-            drive_count++;
+static ata_channel_t* ata_chan_acquire(int drive) {
+    ata_channel_t* ch = &channels[drives[drive].bus];
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&ch->lock);
+        if (!ch->busy) {
+            ch->busy = 1;
+            spin_unlock_irqrestore(&ch->lock, flags);
+            return ch;
+        }
+        spin_unlock_irqrestore(&ch->lock, flags);
+        if (waitq_wait(&ch->wq, ata_chan_idle, ch) < 0) {
+            // The kernel process cannot sleep: let the owner run instead
+            if (scheduler_is_running()) scheduler_yield();
+            else __asm__ volatile("pause");
         }
     }
 }
 
-int ata_read_sectors(int drive, uint32_t lba, uint8_t count, void* buf) {
-    if (drive < 0 || drive >= 4 || !drives[drive].present) return -1;
-    if (count == 0) return 0;
+static void ata_chan_release(ata_channel_t* ch) {
+    ch->busy = 0;
+    waitq_wake_all(&ch->wq);
+}
 
-    uint16_t io_base = (drives[drive].bus == 0) ? ATA_PRIMARY_DATA : ATA_SECONDARY_DATA;
+// 48-bit commands are needed past LBA28's reach or its 256-sector count
+static int ata_use_ext(int drive, uint64_t lba, uint32_t count) {
+    return drives[drive].lba48 && (lba + count > ATA_LBA28_LIMIT || count > ATA_LBA28_MAX_SECTORS);
+}
 
-    ata_wait(io_base);
+// Select the drive and load the task file for a command on lba/count.
+// LBA48 writes the high-order bytes first through the same registers.
+static void ata_setup(ata_channel_t* ch, int drive, uint64_t lba, uint32_t count, int ext) {
+    uint16_t io = ch->io_base;
+    int slave = drives[drive].drive;
+    ata_wait(io);
+    if (ext) {
+        ata_outb(io + 6, 0x40 | (slave ? 0x10 : 0));
+        ata_outb(io + 2, (uint8_t)(count >> 8));
+        ata_outb(io + 3, (uint8_t)(lba >> 24));
+        ata_outb(io + 4, (uint8_t)(lba >> 32));
+        ata_outb(io + 5, (uint8_t)(lba >> 40));
+    } else {
+        ata_outb(io + 6, (slave ? 0xF0 : 0xE0) | ((lba >> 24) & 0x0F));
+        ata_outb(io + 1, 0x00); // features
+    }
+    ata_outb(io + 2, (uint8_t)count);   // 0 = 256 (LBA28) or 65536 (LBA48)
+    ata_outb(io + 3, (uint8_t)(lba & 0xFF));
+    ata_outb(io + 4, (uint8_t)((lba >> 8) & 0xFF));
+    ata_outb(io + 5, (uint8_t)((lba >> 16) & 0xFF));
+}
+
+// ---------- PIO ----------
 
-    // Select drive + LBA28 addressing
-    ata_outb(io_base + 6, (drives[drive].drive ? 0xF0 : 0xE0) | ((lba >> 24) & 0x0F));
-    ata_outb(io_base + 1, 0x00); // features
-    ata_outb(io_base + 2, count);
-    ata_outb(io_base + 3, (uint8_t)(lba & 0xFF));
-    ata_outb(io_base + 4, (uint8_t)((lba >> 8) & 0xFF));
-    ata_outb(io_base + 5, (uint8_t)((lba >> 16) & 0xFF));
-    ata_outb(io_base + 7, ATA_CMD_READ_PIO);
+static int ata_pio(ata_channel_t* ch, int drive, uint64_t lba, uint32_t count,
+                   void* buf, int write) {
+    uint16_t io = ch->io_base;
+    int ext = ata_use_ext(drive, lba, count);
+    ata_setup(ch, drive, lba, count, ext);
+    if (write) ata_outb(io + 7, ext ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO);
+    else ata_outb(io + 7, ext ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
 
     uint16_t* wbuf = (uint16_t*)buf;
+    for (uint32_t s = 0; s < count; s++) {
+        if (ata_wait_drq(io) < 0) return -1;
+        if (write) {
+            for (int i = 0; i < 256; i++) ata_outw(io, wbuf[s * 256 + i]);
+        } else {
+            for (int i = 0; i < 256; i++) wbuf[s * 256 + i] = ata_inw(io);
+        }
+    }
+    return 0;
+}
+
+// ---------- Bus-master DMA ----------
+
+// Describe buf in the channel's PRD table. Physically contiguous pages are
+// merged up to the next 64KB boundary. Returns -1 if some page is unmapped
+// or above 4GB, or buf is not word aligned (the caller falls back to PIO).
+static int ata_build_prdt(ata_channel_t* ch, void* buf, uint32_t bytes) {
+    pte_t* pml4 = vmm_get_current_address_space();
+    uint64_t va = (uint64_t)buf;
+    int n = 0;
+    if (va & 1) return -1;
+
+    while (bytes) {
+        uint64_t pa = vmm_get_physical(pml4, va);
+        uint32_t len = PAGE_SIZE - (uint32_t)(va & (PAGE_SIZE - 1));
+        if (len > bytes) len = bytes;
+        if (!pa || pa + len > 0x100000000ULL) return -1;
+
+        ata_prd_t* last = n ? &ch->prdt[n - 1] : 0;
+        uint32_t last_len = last ? (last->byte_count ? last->byte_count : 0x10000) : 0;
+        if (last && last->phys + last_len == pa &&
+            (last->phys >> 16) == ((pa + len - 1) >> 16)) {
+            last->byte_count = (uint16_t)(last_len + len);   // 64KB wraps to 0
+        } else {
+            if (n == ATA_PRD_ENTRIES) return -1;
+            ch->prdt[n].phys = (uint32_t)pa;
+            ch->prdt[n].byte_count = (uint16_t)len;
+            ch->prdt[n].flags = 0;
+            n++;
+        }
+        va += len;
+        bytes -= len;
+    }
+    ch->prdt[n - 1].flags = ATA_PRD_EOT;
+    return n;
+}
+
+static int ata_dma_finished(void* arg) {
+    ata_channel_t* ch = (ata_channel_t*)arg;
+    return ch->done || ch->timed_out;
+}
+
+// Timer event: arg = channel | seq << 1
+static void ata_dma_timeout(uint64_t arg) {
+    ata_channel_t* ch = &channels[arg & 1];
+    if (!ch->dma_active || ch->seq != (uint32_t)(arg >> 1)) return;
+    ch->timed_out = 1;
+    waitq_wake_all(&ch->wq);
+}
+
+// IRQ 14/15: latch and acknowledge the bus-master status of our command
+static void ata_irq_channel(ata_channel_t* ch) {
+    if (!ch->bm_base || !ch->dma_active) return;
+    uint8_t st = ata_inb(ch->bm_base + ATA_BM_STATUS);
+    if (!(st & ATA_BM_SR_IRQ)) return;
+    ata_inb(ch->io_base + 7);                                // Deassert INTRQ
+    ata_outb(ch->bm_base + ATA_BM_STATUS, st | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+    ch->bm_status = st;
+    ch->done = 1;
+    waitq_wake_all(&ch->wq);
+}
+
+static void ata_irq_primary(registers_t* regs) {
+    (void)regs;
+    ata_irq_channel(&channels[0]);
+}
 
-    for (int s = 0; s < count; s++) {
-        if (ata_wait_drq(io_base) < 0) return -1;
-        for (int i = 0; i < 256; i++) {
-            wbuf[s * 256 + i] = ata_inw(io_base);
+static void ata_irq_secondary(registers_t* regs) {
+    (void)regs;
+    ata_irq_channel(&channels[1]);
+}
+
+// Wait for the bus-master interrupt bit when sleeping is not possible
+static int ata_dma_poll(ata_channel_t* ch) {
+    for (uint32_t spin = 0; spin < 10000000U; spin++) {
+        if (ch->done) return 0;
+        uint8_t st = ata_inb(ch->bm_base + ATA_BM_STATUS);
+        if (st & ATA_BM_SR_IRQ) {
+            ata_inb(ch->io_base + 7);
+            ata_outb(ch->bm_base + ATA_BM_STATUS, st | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+            ch->bm_status = st;
+            ch->done = 1;
+            return 0;
         }
+        __asm__ volatile("pause");
     }
+    return -1;
+}
 
-    return count;
+// One DMA command. Returns 0, -1 on a device error, or -2 if the buffer
+// cannot be described (nothing was sent; use PIO).
+static int ata_dma(ata_channel_t* ch, int drive, uint64_t lba, uint32_t count,
+                   void* buf, int write) {
+    if (ata_build_prdt(ch, buf, count * ATA_SECTOR_SIZE) < 0) return -2;
+
+    uint16_t bm = ch->bm_base;
+    int ext = ata_use_ext(drive, lba, count);
+    uint8_t dir = write ? 0 : ATA_BM_CMD_READ;
+
+    ata_outb(bm + ATA_BM_COMMAND, 0);
+    ata_outl(bm + ATA_BM_PRDT, (uint32_t)(uint64_t)ch->prdt);
+    ata_outb(bm + ATA_BM_COMMAND, dir);
+    ata_outb(bm + ATA_BM_STATUS, ata_inb(bm + ATA_BM_STATUS) | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+
+    ch->seq++;
+    ch->done = 0;
+    ch->timed_out = 0;
+    ch->bm_status = 0;
+    ch->dma_active = 1;
+
+    ata_setup(ch, drive, lba, count, ext);
+    if (write) ata_outb(ch->io_base + 7, ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA);
+    else ata_outb(ch->io_base + 7, ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+    ata_outb(bm + ATA_BM_COMMAND, dir | ATA_BM_CMD_START);
+
+    int r = -1;
+    if (ch->irq_ok && timer_is_active()) {
+        uint64_t arg = (uint64_t)(ch - channels) | ((uint64_t)ch->seq << 1);
+        int ev = timer_add(timer_now_ns() + ATA_DMA_TIMEOUT_NS, ata_dma_timeout, arg);
+        if (ev >= 0 && waitq_wait(&ch->wq, ata_dma_finished, ch) == 0) r = ch->done ? 0 : -1;
+        if (ev >= 0) timer_cancel(ev);
+    }
+    if (r < 0 && !ch->timed_out) r = ata_dma_poll(ch);
+
+    ch->dma_active = 0;
+    ata_outb(bm + ATA_BM_COMMAND, 0);
+    uint8_t status = ata_inb(ch->io_base + 7);
+    if (r < 0 || (ch->bm_status & ATA_BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+        ata_soft_reset(ch->ctrl_port);
+        return -1;
+    }
+    return 0;
 }
 
-int ata_write_sectors(int drive, uint32_t lba, uint8_t count, const void* buf) {
+// ---------- Transfers ----------
+
+static int ata_transfer(int drive, uint64_t lba, uint32_t count, void* buf, int write) {
     if (drive < 0 || drive >= 4 || !drives[drive].present) return -1;
     if (count == 0) return 0;
+    ata_drive_t* drv = &drives[drive];
+    if (!drv->lba48 && lba + count > ATA_LBA28_LIMIT) return -1;
+
+    ata_channel_t* ch = ata_chan_acquire(drive);
+    uint8_t* p = (uint8_t*)buf;
+    uint32_t done = 0;
+    int result = 0;
+
+    while (done < count) {
+        uint32_t max = ATA_LBA28_MAX_SECTORS;
+        if (drv->dma && drv->lba48) max = ATA_DMA_MAX_SECTORS;
+        uint32_t n = count - done;
+        if (n > max) n = max;
+
+        int r = -2;
+        if (drv->dma) r = ata_dma(ch, drive, lba + done, n, p, write);
+        // A failed DMA command is retried once by PIO
+        if (r < 0) r = ata_pio(ch, drive, lba + done, n, p, write);
+        if (r < 0) {
+            result = -1;
+            break;
+        }
+        p += n * ATA_SECTOR_SIZE;
+        done += n;
+    }
+
+    if (write && result == 0) {
+        // Flush cache
+        ata_outb(ch->io_base + 7, drv->lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+        ata_wait(ch->io_base);
+    }
+    ata_chan_release(ch);
+    return result < 0 ? -1 : (int)count;
+}
+
+// Find the PCI IDE controller and give each channel a PRD table
+static void ata_dma_init(void) {
+    pci_device_t* dev = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, (pci_device_t*)0);
+    if (!dev || !(dev->prog_if & 0x80)) return;   // No bus-master support
+    if (!pci_bar_is_io(dev, 4)) return;
+    uint16_t bm = (uint16_t)pci_get_bar_base(dev, 4);
+    if (!bm) return;
+
+    pci_enable_io_space(dev);
+    pci_enable_bus_master(dev);
+
+    for (int c = 0; c < 2; c++) {
+        void* prdt = pmm_alloc_block();
+        if (!prdt || (uint64_t)prdt + PAGE_SIZE > 0x100000000ULL) {
+            if (prdt) pmm_free_block(prdt);
+            continue;
+        }
+        memset(prdt, 0, PAGE_SIZE);
+        channels[c].prdt = (ata_prd_t*)prdt;
+        channels[c].bm_base = (uint16_t)(bm + c * ATA_BM_CHANNEL_STRIDE);
+    }
+}
 
-    uint16_t io_base = (drives[drive].bus == 0) ? ATA_PRIMARY_DATA : ATA_SECONDARY_DATA;
+void ata_init(void) {
+    memset(drives, 0, sizeof(drives));
+    memset(channels, 0, sizeof(channels));
+    drive_count = 0;
 
-    ata_wait(io_base);
+    channels[0].io_base = ATA_PRIMARY_DATA;
+    channels[0].ctrl_port = ATA_PRIMARY_CTRL;
+    channels[0].irq = 14;
+    channels[1].io_base = ATA_SECONDARY_DATA;
+    channels[1].ctrl_port = ATA_SECONDARY_CTRL;
+    channels[1].irq = 15;
+    for (int c = 0; c < 2; c++) waitq_init(&channels[c].wq);
 
-    ata_outb(io_base + 6, (drives[drive].drive ? 0xF0 : 0xE0) | ((lba >> 24) & 0x0F));
-    ata_outb(io_base + 1, 0x00);
-    ata_outb(io_base + 2, count);
-    ata_outb(io_base + 3, (uint8_t)(lba & 0xFF));
-    ata_outb(io_base + 4, (uint8_t)((lba >> 8) & 0xFF));
-    ata_outb(io_base + 5, (uint8_t)((lba >> 16) & 0xFF));
-    ata_outb(io_base + 7, ATA_CMD_WRITE_PIO);
+    // Soft reset both channels
+    ata_soft_reset(ATA_PRIMARY_CTRL);
+    ata_soft_reset(ATA_SECONDARY_CTRL);
 
-    const uint16_t* wbuf = (const uint16_t*)buf;
+    // Probe all 4 possible drives
+    uint16_t io_bases[] = {ATA_PRIMARY_DATA, ATA_PRIMARY_DATA,
+                           ATA_SECONDARY_DATA, ATA_SECONDARY_DATA};
+    uint16_t ctrl_ports[] = {ATA_PRIMARY_CTRL, ATA_PRIMARY_CTRL,
+                             ATA_SECONDARY_CTRL, ATA_SECONDARY_CTRL};
+    int slaves[] = {0, 1, 0, 1};
 
-    for (int s = 0; s < count; s++) {
-        if (ata_wait_drq(io_base) < 0) return -1;
-        for (int i = 0; i < 256; i++) {
-            ata_outw(io_base, wbuf[s * 256 + i]);
+    for (int i = 0; i < 4; i++) {
+        if (ata_identify(io_bases[i], ctrl_ports[i], slaves[i], &drives[i])) {
+            drives[i].bus = (i >= 2) ? 1 : 0;
+            drives[i].drive = slaves[i];
+            drive_count++;
         }
     }
 
-    // Flush cache
-    ata_outb(io_base + 7, ATA_CMD_CACHE_FLUSH);
-    ata_wait(io_base);
+    ata_dma_init();
+    for (int i = 0; i < 4; i++) {
+        if (drives[i].present && !channels[drives[i].bus].bm_base) drives[i].dma = 0;
+    }
+
+    // Completion interrupts: IRQ 14/15 are routed by the I/O APIC only;
+    // under the legacy PIC they stay masked and DMA completion is polled
+    irq_install_handler(14, ata_irq_primary);
+    irq_install_handler(15, ata_irq_secondary);
+    if (apic_is_active()) {
+        channels[0].irq_ok = channels[1].irq_ok = 1;
+    }
+}
+
+int ata_read_sectors(int drive, uint64_t lba, uint32_t count, void* buf) {
+    return ata_transfer(drive, lba, count, buf, 0);
+}
 
-    return count;
+int ata_write_sectors(int drive, uint64_t lba, uint32_t count, const void* buf) {
+    return ata_transfer(drive, lba, count, (void*)buf, 1);
 }
 
 ata_drive_t* ata_get_drive(int index) {
@@ -235,8 +512,11 @@ int ata_get_drive_count(void) {
 
 int ata_flush(int drive) {
     if (drive < 0 || drive >= 4 || !drives[drive].present) return -1;
-    uint16_t io_base = (drives[drive].bus == 0) ? ATA_PRIMARY_DATA : ATA_SECONDARY_DATA;
-    ata_outb(io_base + 7, ATA_CMD_CACHE_FLUSH);
-    ata_wait(io_base);
+    ata_channel_t* ch = ata_chan_acquire(drive);
+    ata_outb(ch->io_base + 6, drives[drive].drive ? ATA_SLAVE : ATA_MASTER);
+    ata_wait(ch->io_base);
+    ata_outb(ch->io_base + 7, drives[drive].lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+    ata_wait(ch->io_base);
+    ata_chan_release(ch);
     return 0;
 }
@@ -42,10 +42,49 @@
 
 // ATA Commands
 #define ATA_CMD_READ_PIO       0x20
+#define ATA_CMD_READ_PIO_EXT   0x24
+#define ATA_CMD_READ_DMA_EXT   0x25
 #define ATA_CMD_WRITE_PIO      0x30
+#define ATA_CMD_WRITE_PIO_EXT  0x34
+#define ATA_CMD_WRITE_DMA_EXT  0x35
+#define ATA_CMD_READ_DMA       0xC8
+#define ATA_CMD_WRITE_DMA      0xCA
 #define ATA_CMD_CACHE_FLUSH    0xE7
+#define ATA_CMD_CACHE_FLUSH_EXT 0xEA
 #define ATA_CMD_IDENTIFY       0xEC
 
+// Bus-master IDE registers (offsets from the channel's BAR4 base)
+#define ATA_BM_COMMAND         0x00
+#define ATA_BM_STATUS          0x02
+#define ATA_BM_PRDT            0x04
+#define ATA_BM_CHANNEL_STRIDE  8       // Secondary channel registers
+
+#define ATA_BM_CMD_START       0x01
+#define ATA_BM_CMD_READ        0x08    // Device -> memory
+#define ATA_BM_SR_ACTIVE       0x01
+#define ATA_BM_SR_ERR          0x02
+#define ATA_BM_SR_IRQ          0x04
+
+// Physical Region Descriptor: one contiguous buffer piece, never crossing
+// a 64KB boundary (byte_count 0 = 64KB)
+typedef struct __attribute__((packed)) {
+    uint32_t phys;
+    uint16_t byte_count;
+    uint16_t flags;
+} ata_prd_t;
+
+#define ATA_PRD_EOT            0x8000
+#define ATA_PRD_ENTRIES        512     // One 4KB page per channel
+
+// Sectors per command: 256 for LBA28 (count 0 = 256); DMA commands are
+// also bounded so the PRD table always fits a page-by-page buffer
+#define ATA_LBA28_MAX_SECTORS  256
+#define ATA_DMA_MAX_SECTORS    2048    // 1MB
+#define ATA_LBA28_LIMIT        0x10000000ULL
+
+// A DMA command that has not completed by then is aborted
+#define ATA_DMA_TIMEOUT_NS     5000000000ULL
+
 // Drive select
 #define ATA_MASTER  0xE0
 #define ATA_SLAVE   0xF0
@@ -58,21 +97,25 @@ typedef struct {
     int present;           // Drive detected?
     int bus;               // 0=primary, 1=secondary
     int drive;             // 0=master, 1=slave
-    uint32_t sectors;      // Total sector count
+    int lba48;             // 48-bit addressing supported
+    int dma;               // Bus-master DMA usable for this drive
+    uint64_t sectors;      // Total sector count
     uint32_t size_mb;      // Size in MB
     char model[41];        // Model string
     char serial[21];       // Serial number
 } ata_drive_t;
 
-// Initialize ATA subsystem, detect drives
+// Initialize ATA subsystem, detect drives and the PCI bus-master
+// controller (pci_init must have run; IRQ-driven completion needs the APIC)
 void ata_init(void);
 
-// Read sectors from drive
-// buf must be at least count*512 bytes
-int ata_read_sectors(int drive, uint32_t lba, uint8_t count, void* buf);
+// Read sectors from drive, splitting into as many commands as needed.
+// buf must be at least count*512 bytes. Uses bus-master DMA when the drive
+// and buffer allow it, PIO otherwise. Returns count, or -1 on error.
+int ata_read_sectors(int drive, uint64_t lba, uint32_t count, void* buf);
 
-// Write sectors to drive
-int ata_write_sectors(int drive, uint32_t lba, uint8_t count, const void* buf);
+// Write sectors to drive (then flush its write cache)
+int ata_write_sectors(int drive, uint64_t lba, uint32_t count, const void* buf);
 
 // Get drive info
 ata_drive_t* ata_get_drive(int index);
@@ -0,0 +1,397 @@
+// bench.c - In-kernel Microbenchmarks for Alteo OS
+#include "bench.h"
+#include "klib.h"
+#include "heap.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "blkdev.h"
+#include "pipe.h"
+#include "syscall.h"
+#include "ip.h"
+#include "tcp.h"
+#include "loopback.h"
+#include "compositor.h"
+#include "graphics.h"
+#include "timer.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#define COM1                0x3F8
+#define DEBUG_EXIT_PORT     0xF4        // QEMU isa-debug-exit
+
+#define BENCH_BATCH         64          // Allocations held at once
+#define BENCH_VADDR         0x0000600000000000ULL
+#define BENCH_MISS_STRIDE   7919        // Blocks between cache-miss reads (prime)
+#define BENCH_TCP_PORT      5001
+#define BENCH_TCP_CHUNK     4096
+#define BENCH_TIMEOUT_NS    (2 * TIMER_NS_PER_SEC)
+#define BENCH_WINDOWS       4
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// ---- Serial output ----
+
+static void serial_init(void) {
+    outb(COM1 + 1, 0x00);       // No interrupts
+    outb(COM1 + 3, 0x80);       // DLAB
+    outb(COM1 + 0, 0x01);       // 115200 baud
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03);       // 8N1
+    outb(COM1 + 2, 0xC7);       // FIFO on, cleared
+    outb(COM1 + 4, 0x03);       // DTR, RTS
+}
+
+static void serial_putc(char c) {
+    int spin = 100000;
+    while (spin-- > 0 && !(inb(COM1 + 5) & 0x20)) {}
+    outb(COM1, (uint8_t)c);
+}
+
+static void serial_puts(const char* s) {
+    while (*s) serial_putc(*s++);
+}
+
+static void serial_putu(uint64_t v) {
+    char buf[21];
+    int i = 20;
+    buf[i] = 0;
+    do { buf[--i] = (char)('0' + v % 10); v /= 10; } while (v);
+    serial_puts(&buf[i]);
+}
+
+// v / 1000 with three decimals
+static void serial_putmilli(uint64_t v) {
+    serial_putu(v / 1000);
+    serial_putc('.');
+    uint64_t f = v % 1000;
+    serial_putc((char)('0' + f / 100));
+    serial_putc((char)('0' + f / 10 % 10));
+    serial_putc((char)('0' + f % 10));
+}
+
+// ---- Harness ----
+
+static uint64_t tsc_hz;
+static int bench_failed;            // Set by a run that could not finish
+
+static void report_skip(const char* name, const char* why) {
+    serial_puts("{\"bench\":\""); serial_puts(name);
+    serial_puts("\",\"skipped\":\""); serial_puts(why);
+    serial_puts("\"}\n");
+}
+
+// Time fn(ops) BENCH_RUNS times after one warm-up run and print per
+// operation cycles (fastest and mean run), ns and, if bytes is set, MB/s
+static void bench_measure(const char* name, uint32_t ops, uint32_t bytes, void (*fn)(uint32_t)) {
+    bench_failed = 0;
+    fn(ops);
+    uint64_t best = ~0ULL, sum = 0;
+    for (int r = 0; r < BENCH_RUNS && !bench_failed; r++) {
+        uint64_t t0 = lock_tsc();
+        fn(ops);
+        uint64_t dt = lock_tsc() - t0;
+        if (dt < best) best = dt;
+        sum += dt;
+    }
+    if (bench_failed) {
+        report_skip(name, "timeout");
+        return;
+    }
+
+    serial_puts("{\"bench\":\""); serial_puts(name);
+    serial_puts("\",\"ops\":"); serial_putu(ops);
+    serial_puts(",\"runs\":"); serial_putu(BENCH_RUNS);
+    serial_puts(",\"cycles_min\":"); serial_putu(best / ops);
+    serial_puts(",\"cycles_avg\":"); serial_putu(sum / BENCH_RUNS / ops);
+    if (tsc_hz) {
+        serial_puts(",\"ns_min\":");
+        serial_putmilli(best * 1000 / ops * 1000000ULL / tsc_hz);
+        if (bytes) {
+            serial_puts(",\"mb_s\":");
+            serial_putmilli((uint64_t)bytes * ops * (tsc_hz / 1000) / best);
+        }
+    }
+    serial_puts("}\n");
+}
+
+// ---- Heap and PMM ----
+
+static void* slots[BENCH_BATCH];
+static uint32_t kmalloc_size;
+
+static void run_kmalloc(uint32_t ops) {
+    for (uint32_t done = 0; done < ops; done += BENCH_BATCH) {
+        for (int i = 0; i < BENCH_BATCH; i++) slots[i] = kmalloc(kmalloc_size);
+        for (int i = 0; i < BENCH_BATCH; i++) kfree(slots[i]);
+    }
+}
+
+static void run_pmm(uint32_t ops) {
+    for (uint32_t done = 0; done < ops; done += BENCH_BATCH) {
+        for (int i = 0; i < BENCH_BATCH; i++) slots[i] = pmm_alloc_block();
+        for (int i = 0; i < BENCH_BATCH; i++) if (slots[i]) pmm_free_block(slots[i]);
+    }
+}
+
+// ---- Page mapping ----
+
+static pte_t* bench_pml4;
+static uint64_t bench_frame;
+
+// Map BENCH_BATCH pages, then unmap them (a TLB invalidation each)
+static void run_vmm(uint32_t ops) {
+    for (uint32_t done = 0; done < ops; done += BENCH_BATCH) {
+        for (int i = 0; i < BENCH_BATCH; i++)
+            vmm_map_page(bench_pml4, BENCH_VADDR + (uint64_t)i * VMM_PAGE_SIZE, bench_frame,
+                         VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
+        for (int i = 0; i < BENCH_BATCH; i++)
+            vmm_unmap_page(bench_pml4, BENCH_VADDR + (uint64_t)i * VMM_PAGE_SIZE);
+    }
+}
+
+static void bench_vmm(void) {
+    bench_pml4 = vmm_create_address_space();
+    void* frame = pmm_alloc_block();
+    if (!bench_pml4 || !frame) {
+        if (frame) pmm_free_block(frame);
+        if (bench_pml4) vmm_destroy_address_space(bench_pml4);
+        report_skip("vmm_map_unmap", "no memory");
+        return;
+    }
+    bench_frame = (uint64_t)frame;
+    bench_measure("vmm_map_unmap", 4096, 0, run_vmm);
+    vmm_destroy_address_space(bench_pml4);
+    pmm_free_block(frame);
+}
+
+// ---- Block cache ----
+
+static int bench_dev;
+static uint64_t bench_blocks;
+static uint64_t miss_next;
+static uint8_t* bench_buf;          // BENCH_TCP_CHUNK bytes, page-aligned
+
+static void run_blk_hit(uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) blkdev_read(bench_dev, 0, 1, bench_buf);
+}
+
+// Each read lands in a block no earlier read touched, far enough from the
+// last one that readahead does not cover it
+static void run_blk_miss(uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) {
+        uint64_t block = (++miss_next * BENCH_MISS_STRIDE) % bench_blocks;
+        blkdev_read(bench_dev, (uint32_t)(block * BLKDEV_SECTORS_PER_BLOCK), 1, bench_buf);
+    }
+}
+
+static void bench_blkdev(void) {
+    if (blkdev_get_count() == 0) {
+        report_skip("blkdev_read_hit", "no disk");
+        report_skip("blkdev_read_miss", "no disk");
+        return;
+    }
+    bench_dev = 0;
+    bench_blocks = blkdev_get(0)->total_sectors / BLKDEV_SECTORS_PER_BLOCK;
+    bench_measure("blkdev_read_hit", 4096, BLKDEV_SECTOR_SIZE, run_blk_hit);
+
+    // Warm-up plus BENCH_RUNS runs must all find fresh blocks
+    if (bench_blocks < 64 * (BENCH_RUNS + 1) || bench_blocks % BENCH_MISS_STRIDE == 0) {
+        report_skip("blkdev_read_miss", "disk too small");
+        return;
+    }
+    miss_next = 0;
+    bench_measure("blkdev_read_miss", 64, BLKDEV_SECTOR_SIZE, run_blk_miss);
+}
+
+// ---- Pipe ----
+
+static int bench_pipe;
+
+static void run_pipe(uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) {
+        pipe_write(bench_pipe, bench_buf, BENCH_TCP_CHUNK);
+        pipe_read(bench_pipe, bench_buf, BENCH_TCP_CHUNK);
+    }
+}
+
+static void bench_pipes(void) {
+    bench_pipe = pipe_create();
+    if (bench_pipe < 0) {
+        report_skip("pipe_4k", "no pipe");
+        return;
+    }
+    bench_measure("pipe_4k", 2048, BENCH_TCP_CHUNK, run_pipe);
+    pipe_close(bench_pipe, 1);
+    pipe_close(bench_pipe, 0);
+}
+
+// ---- Syscalls ----
+
+static void run_getpid(uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) syscall_dispatch(SYS_GETPID, 0, 0, 0);
+}
+
+static void run_isatty(uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) syscall_dispatch(SYS_ISATTY, 1, 0, 0);
+}
+
+// ---- Loopback TCP ----
+
+static int tcp_client, tcp_server;
+static uint8_t* rx_buf;
+
+// Deliver loopback packets until cond() holds; 0 on timeout
+static int tcp_settle(int (*cond)(void)) {
+    uint64_t deadline = timer_now_ns() + BENCH_TIMEOUT_NS;
+    while (!cond()) {
+        if (lo_poll(LO_BUDGET) == 0) tcp_timer();
+        if (timer_now_ns() > deadline) return 0;
+    }
+    return 1;
+}
+
+static int tcp_listen_id;
+
+static int tcp_accepted(void) {
+    return tcp_accept_ready(tcp_listen_id);
+}
+
+static int tcp_both_established(void) {
+    return tcp_get_state(tcp_client) == TCP_STATE_ESTABLISHED &&
+           tcp_get_state(tcp_server) == TCP_STATE_ESTABLISHED;
+}
+
+// ops chunks from client to server, sent as fast as the windows allow
+static void run_tcp(uint32_t ops) {
+    uint64_t total = (uint64_t)ops * BENCH_TCP_CHUNK, sent = 0, got = 0;
+    uint64_t deadline = timer_now_ns() + BENCH_TIMEOUT_NS;
+    while (got < total) {
+        int progress = 0;
+        if (sent < total) {
+            uint64_t left = total - sent;
+            int n = tcp_send(tcp_client, bench_buf, left < BENCH_TCP_CHUNK ? (uint32_t)left : BENCH_TCP_CHUNK);
+            if (n > 0) { sent += (uint64_t)n; progress = 1; }
+        }
+        if (lo_poll(LO_BUDGET) > 0) progress = 1;
+        int r = tcp_recv(tcp_server, rx_buf, BENCH_TCP_CHUNK);
+        if (r > 0) { got += (uint64_t)r; progress = 1; }
+        if (!progress) {
+            tcp_timer();
+            if (timer_now_ns() > deadline) { bench_failed = 1; return; }
+        }
+    }
+}
+
+static void bench_tcp(void) {
+    rx_buf = (uint8_t*)kmalloc(BENCH_TCP_CHUNK);
+    tcp_listen_id = tcp_listen(BENCH_TCP_PORT, 4);
+    tcp_client = tcp_server = -1;
+    if (rx_buf && tcp_listen_id >= 0) {
+        tcp_client = tcp_connect(IP_LOOPBACK_ADDR, BENCH_TCP_PORT);
+        if (tcp_client >= 0 && tcp_settle(tcp_accepted)) tcp_server = tcp_accept(tcp_listen_id);
+    }
+    if (tcp_server >= 0 && tcp_settle(tcp_both_established))
+        bench_measure("tcp_loopback_4k", 512, BENCH_TCP_CHUNK, run_tcp);
+    else
+        report_skip("tcp_loopback_4k", "no connection");
+
+    if (tcp_server >= 0) tcp_close(tcp_server);
+    if (tcp_client >= 0) tcp_close(tcp_client);
+    if (tcp_listen_id >= 0) tcp_close(tcp_listen_id);
+    for (int i = 0; i < 16 && lo_poll(LO_BUDGET) > 0; i++) {}
+    if (rx_buf) kfree(rx_buf);
+}
+
+// ---- Compositor and display ----
+
+static int bench_wins[BENCH_WINDOWS];
+
+// Every window fully damaged, then one composited frame
+static void run_composite(uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) {
+        for (int w = 0; w < BENCH_WINDOWS; w++) compositor_window_damage_full(bench_wins[w]);
+        compositor_composite();
+    }
+}
+
+static void bench_compositor(void) {
+    // Overlapping 400x300 windows, each a solid colour
+    static const uint32_t colors[BENCH_WINDOWS] = { 0xFF3060A0, 0xFF60A030, 0xFFA03060, 0xFF808080 };
+    int ok = 1;
+    for (int w = 0; w < BENCH_WINDOWS; w++) {
+        bench_wins[w] = compositor_create_window(40 + w * 120, 40 + w * 90, 400, 300,
+                                                 COMP_WIN_VISIBLE | COMP_WIN_DECORATED);
+        comp_surface_t* s = bench_wins[w] >= 0 ? compositor_get_surface(bench_wins[w]) : 0;
+        if (!s) { ok = 0; continue; }
+        for (int y = 0; y < s->height; y++)
+            for (int x = 0; x < s->width; x++) s->pixels[y * s->pitch + x] = colors[w];
+    }
+    if (ok)
+        bench_measure("compositor_4win", 32, 0, run_composite);
+    else
+        report_skip("compositor_4win", "no compositor");
+    for (int w = 0; w < BENCH_WINDOWS; w++)
+        if (bench_wins[w] >= 0) compositor_destroy_window(bench_wins[w]);
+}
+
+static void run_flip(uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) flip_buffer();
+}
+
+// ---- Entry ----
+
+int bench_requested(uint64_t multiboot_addr) {
+    multiboot_info_t* mbi = (multiboot_info_t*)multiboot_addr;
+    if (!mbi || !(mbi->flags & (1 << 2)) || !mbi->cmdline) return 0;
+    const char* s = (const char*)(uint64_t)mbi->cmdline;
+    while (*s) {
+        while (*s == ' ') s++;
+        const char* w = s;
+        while (*s && *s != ' ') s++;
+        if (s - w == 5 && w[0] == 'b' && w[1] == 'e' && w[2] == 'n' && w[3] == 'c' && w[4] == 'h')
+            return 1;
+    }
+    return 0;
+}
+
+void bench_run(void) {
+    uint64_t base;
+    timer_get_tsc(&base, &tsc_hz);
+    serial_init();
+    serial_puts("{\"suite\":\"alteo\",\"tsc_hz\":"); serial_putu(tsc_hz);
+    serial_puts(",\"cpus\":"); serial_putu((uint64_t)smp_cpu_count());
+    serial_puts(",\"runs\":"); serial_putu(BENCH_RUNS);
+    serial_puts("}\n");
+
+    bench_buf = (uint8_t*)pmm_alloc_block();
+    if (bench_buf) memset(bench_buf, 0x5A, BENCH_TCP_CHUNK);
+
+    kmalloc_size = 32;   bench_measure("kmalloc_kfree_32", 8192, 0, run_kmalloc);
+    kmalloc_size = 256;  bench_measure("kmalloc_kfree_256", 8192, 0, run_kmalloc);
+    kmalloc_size = 4096; bench_measure("kmalloc_kfree_4096", 2048, 0, run_kmalloc);
+    bench_measure("pmm_alloc_free", 8192, 0, run_pmm);
+    bench_vmm();
+    if (bench_buf) {
+        bench_blkdev();
+        bench_pipes();
+    }
+    bench_measure("syscall_getpid", 65536, 0, run_getpid);
+    bench_measure("syscall_isatty", 65536, 0, run_isatty);
+    if (bench_buf) bench_tcp();
+    bench_compositor();
+    bench_measure("flip_buffer", 16, 0, run_flip);
+
+    serial_puts("{\"done\":1}\n");
+
+    // Exit status 1 (0 << 1 | 1); without the device, just stop
+    outb(DEBUG_EXIT_PORT, 0);
+    __asm__ volatile("cli");
+    for (;;) __asm__ volatile("hlt");
+}
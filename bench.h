@@ -0,0 +1,25 @@
+// bench.h - In-kernel Microbenchmarks for Alteo OS
+// Booting with "bench" on the kernel command line (the alteo-bench.iso
+// image built by "make bench") runs a fixed suite once the kernel is up
+// instead of entering the desktop: heap, PMM, page mapping, block cache,
+// pipe, syscall dispatch, loopback TCP, compositing and flip_buffer(),
+// each timed with the TSC.
+//
+// Every benchmark runs BENCH_RUNS times after a warm-up pass; the fastest
+// and the mean run are reported. Results go to COM1 as one JSON object per
+// line, then QEMU is asked to exit through its isa-debug-exit device, so
+// runs of two trees can be compared line by line.
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "stdint.h"
+
+#define BENCH_RUNS      5
+
+// Whether the multiboot command line contains the word "bench"
+int  bench_requested(uint64_t multiboot_addr);
+
+// Run the suite and power off (needs interrupts on). Does not return.
+void bench_run(void);
+
+#endif
@@ -1,20 +1,18 @@
 // blkdev.c - Block Device Layer for Alteo OS
-// Common block I/O interface with a simple page cache
+// Common block I/O interface. Each device is one space in the unified page
+// cache (object 0, page index = LBA / BLKDEV_SECTORS_PER_BLOCK), so the
+// cache grows and shrinks with free memory and is shared with file pages.
+// Device I/O goes through a per-device request queue: the kblockd thread
+// (or, before it runs, the waiter itself) takes batches off the queue in
+// elevator order, merges contiguous requests and hands them to the driver.
 #include "blkdev.h"
+#include "klib.h"
 #include "ata.h"
+#include "process.h"
+#include "scheduler.h"
+#include "timer.h"
 
 // ---- Helpers ----
-static void blk_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
-static void blk_memcpy(void* dst, const void* src, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (uint64_t i = 0; i < n; i++) d[i] = s[i];
-}
-
 static int blk_strcmp(const char* a, const char* b) {
     while (*a && *b && *a == *b) { a++; b++; }
     return (int)*(const unsigned char*)a - (int)*(const unsigned char*)b;
@@ -29,9 +27,20 @@ static void blk_strncpy(char* dst, const char* src, int n) {
 // ---- Storage ----
 static blkdev_t devices[BLKDEV_MAX_DEVICES];
 static int device_count = 0;
+static waitq_t worker_wq = WAITQ_INIT;    // kblockd sleeps here
+static volatile int worker_running = 0;
+
+// Requests of blkdev_read_async() callers and cache writeback
+typedef struct {
+    blkdev_request_t req;    // First, so completions can cast back
+    void (*done)(void* arg, int status);
+    void* arg;
+} async_req_t;
+
+static async_req_t async_reqs[BLKDEV_ASYNC_MAX];
+static uint64_t async_free = ~0ULL;       // Bit per async_reqs[] entry
+static spinlock_t async_lock = SPINLOCK_INIT;
 
-static blkdev_cache_entry_t cache[BLKDEV_CACHE_ENTRIES];
-static uint32_t cache_access_counter = 0;
 
 // ---- ATA Backend ----
 // Adapter functions to bridge ATA driver to blkdev_ops_t interface
@@ -42,39 +51,15 @@ typedef struct {
 
 static ata_blkdev_data_t ata_data[4]; // Up to 4 ATA drives
 
+// The ATA driver splits requests into commands itself
 static int ata_blkdev_read(void* driver_data, uint32_t lba, uint32_t count, void* buf) {
     ata_blkdev_data_t* data = (ata_blkdev_data_t*)driver_data;
-    // ATA driver uses uint8_t count, so we may need multiple calls
-    uint8_t* dst = (uint8_t*)buf;
-    uint32_t remaining = count;
-    uint32_t current_lba = lba;
-
-    while (remaining > 0) {
-        uint8_t chunk = (remaining > 255) ? 255 : (uint8_t)remaining;
-        int ret = ata_read_sectors(data->drive_index, current_lba, chunk, dst);
-        if (ret < 0) return ret;
-        dst += chunk * BLKDEV_SECTOR_SIZE;
-        current_lba += chunk;
-        remaining -= chunk;
-    }
-    return (int)count;
+    return ata_read_sectors(data->drive_index, lba, count, buf);
 }
 
 static int ata_blkdev_write(void* driver_data, uint32_t lba, uint32_t count, const void* buf) {
     ata_blkdev_data_t* data = (ata_blkdev_data_t*)driver_data;
-    const uint8_t* src = (const uint8_t*)buf;
-    uint32_t remaining = count;
-    uint32_t current_lba = lba;
-
-    while (remaining > 0) {
-        uint8_t chunk = (remaining > 255) ? 255 : (uint8_t)remaining;
-        int ret = ata_write_sectors(data->drive_index, current_lba, chunk, src);
-        if (ret < 0) return ret;
-        src += chunk * BLKDEV_SECTOR_SIZE;
-        current_lba += chunk;
-        remaining -= chunk;
-    }
-    return (int)count;
+    return ata_write_sectors(data->drive_index, lba, count, buf);
 }
 
 static int ata_blkdev_flush(void* driver_data) {
@@ -82,81 +67,299 @@ static int ata_blkdev_flush(void* driver_data) {
     return ata_flush(data->drive_index);
 }
 
-// ---- Cache Operations ----
+// ---- Request Queue ----
 
-// Find a cache entry for the given device and block LBA
-static blkdev_cache_entry_t* cache_find(int device_id, uint32_t block_lba) {
-    for (int i = 0; i < BLKDEV_CACHE_ENTRIES; i++) {
-        if (cache[i].valid && cache[i].device_id == device_id &&
-            cache[i].block_lba == block_lba) {
-            cache[i].access_count = ++cache_access_counter;
-            return &cache[i];
-        }
+// Insert in LBA order (q_lock held)
+static void queue_insert(blkdev_t* dev, blkdev_request_t* req) {
+    blkdev_request_t** link = &dev->queue;
+    while (*link && (*link)->lba <= req->lba) link = &(*link)->next;
+    req->next = *link;
+    *link = req;
+    dev->queued++;
+}
+
+// Unlink up to BLKDEV_BATCH_MAX requests into batch[] (q_lock held). The
+// batch starts at an overdue request if there is one, else at the first
+// request at or past the head position, wrapping to the lowest LBA.
+static int queue_take_batch(blkdev_t* dev, blkdev_request_t** batch) {
+    if (!dev->queue) return 0;
+
+    uint64_t now = timer_now_ns();
+    blkdev_request_t** start = 0;
+    blkdev_request_t** oldest = &dev->queue;
+    for (blkdev_request_t** link = &dev->queue; *link; link = &(*link)->next) {
+        if (!start && (*link)->lba >= dev->head_pos) start = link;
+        if ((*link)->deadline < (*oldest)->deadline) oldest = link;
     }
-    return (blkdev_cache_entry_t*)0;
-}
-
-// Find or evict a cache entry (LRU)
-static blkdev_cache_entry_t* cache_alloc(int device_id, uint32_t block_lba) {
-    // First look for an empty slot
-    for (int i = 0; i < BLKDEV_CACHE_ENTRIES; i++) {
-        if (!cache[i].valid) {
-            cache[i].valid = 1;
-            cache[i].dirty = 0;
-            cache[i].device_id = device_id;
-            cache[i].block_lba = block_lba;
-            cache[i].access_count = ++cache_access_counter;
-            return &cache[i];
+    if (now >= (*oldest)->deadline) {
+        start = oldest;
+        dev->q_stats.expired++;
+    }
+    if (!start) start = &dev->queue;
+
+    int n = 0;
+    while (*start && n < BLKDEV_BATCH_MAX) {
+        blkdev_request_t* req = *start;
+        *start = req->next;
+        req->next = 0;
+        batch[n++] = req;
+    }
+    dev->queued -= n;
+    dev->head_pos = batch[n - 1]->lba + batch[n - 1]->count;
+    return n;
+}
+
+// Run one batch through the driver and complete its requests
+static void queue_dispatch(blkdev_t* dev, blkdev_request_t** batch, int n) {
+    blkdev_io_t ios[BLKDEV_BATCH_MAX];
+    int io_of[BLKDEV_BATCH_MAX];
+    int nio = 0;
+
+    // Merge requests that continue the previous transfer on disk and in memory
+    for (int i = 0; i < n; i++) {
+        blkdev_request_t* req = batch[i];
+        blkdev_io_t* last = nio ? &ios[nio - 1] : 0;
+        if (last && last->write == req->write && last->lba + last->count == req->lba &&
+            (uint8_t*)last->buf + (uint64_t)last->count * BLKDEV_SECTOR_SIZE == (uint8_t*)req->buf &&
+            last->count + req->count <= BLKDEV_MERGE_MAX) {
+            last->count += req->count;
+            dev->q_stats.merged++;
+        } else {
+            ios[nio].lba = req->lba;
+            ios[nio].count = req->count;
+            ios[nio].buf = req->buf;
+            ios[nio].write = req->write;
+            ios[nio].status = 0;
+            nio++;
         }
+        io_of[i] = nio - 1;
     }
 
-    // Evict LRU entry
-    int lru_idx = 0;
-    uint32_t lru_count = cache[0].access_count;
-    for (int i = 1; i < BLKDEV_CACHE_ENTRIES; i++) {
-        if (cache[i].access_count < lru_count) {
-            lru_count = cache[i].access_count;
-            lru_idx = i;
+    if (dev->ops.submit) {
+        if (dev->ops.submit(dev->driver_data, ios, nio) < 0) {
+            for (int i = 0; i < nio; i++) ios[i].status = -1;
+        }
+    } else {
+        for (int i = 0; i < nio; i++) {
+            int ret = ios[i].write
+                ? (dev->ops.write_sectors ? dev->ops.write_sectors(dev->driver_data, ios[i].lba,
+                                                                   ios[i].count, ios[i].buf) : -1)
+                : (dev->ops.read_sectors ? dev->ops.read_sectors(dev->driver_data, ios[i].lba,
+                                                                 ios[i].count, ios[i].buf) : -1);
+            ios[i].status = ret < 0 ? -1 : 0;
         }
     }
 
-    blkdev_cache_entry_t* entry = &cache[lru_idx];
+    uint64_t flags = spin_lock_irqsave(&dev->q_lock);
+    dev->q_stats.dispatched += nio;
+    dev->q_stats.batches++;
+    spin_unlock_irqrestore(&dev->q_lock, flags);
+
+    // A waiter may return (and reuse the request) as soon as complete is set
+    for (int i = 0; i < n; i++) {
+        blkdev_request_t* req = batch[i];
+        void (*done)(blkdev_request_t*) = req->done;
+        req->status = ios[io_of[i]].status;
+        __asm__ volatile("" ::: "memory");
+        req->complete = 1;
+        if (done) done(req);
+    }
+    waitq_wake_all(&dev->q_wait);
+}
 
-    // Writeback if dirty
-    if (entry->dirty && entry->device_id >= 0 && entry->device_id < BLKDEV_MAX_DEVICES) {
-        blkdev_t* dev = &devices[entry->device_id];
-        if (dev->active && dev->ops.write_sectors) {
-            dev->ops.write_sectors(dev->driver_data, entry->block_lba,
-                                   BLKDEV_SECTORS_PER_BLOCK, entry->data);
+// Dispatch one batch unless another CPU/thread is already dispatching.
+// Returns the number of requests completed.
+static int queue_run(blkdev_t* dev) {
+    blkdev_request_t* batch[BLKDEV_BATCH_MAX];
+    uint64_t flags = spin_lock_irqsave(&dev->q_lock);
+    if (dev->dispatching) {
+        spin_unlock_irqrestore(&dev->q_lock, flags);
+        return 0;
+    }
+    int n = queue_take_batch(dev, batch);
+    if (n) dev->dispatching = 1;
+    spin_unlock_irqrestore(&dev->q_lock, flags);
+    if (!n) return 0;
+
+    queue_dispatch(dev, batch, n);
+
+    flags = spin_lock_irqsave(&dev->q_lock);
+    dev->dispatching = 0;
+    int more = dev->queue != 0;
+    spin_unlock_irqrestore(&dev->q_lock, flags);
+    waitq_wake_all(&dev->q_wait);
+    if (more && worker_running) waitq_wake_all(&worker_wq);
+    return n;
+}
+
+// Work for kblockd: a queue nobody is dispatching from
+static int queue_pending(void* arg) {
+    (void)arg;
+    for (int i = 0; i < BLKDEV_MAX_DEVICES; i++) {
+        if (devices[i].active && devices[i].queue && !devices[i].dispatching) return 1;
+    }
+    return 0;
+}
+
+static void kblockd(void) {
+    for (;;) {
+        waitq_wait(&worker_wq, queue_pending, 0);
+        for (int i = 0; i < BLKDEV_MAX_DEVICES; i++) {
+            if (devices[i].active) while (queue_run(&devices[i])) {}
         }
     }
+}
+
+static int request_complete(void* arg) {
+    return ((blkdev_request_t*)arg)->complete;
+}
+
+// Submit and wait: the synchronous path used by the cache and bypasses
+static int queue_io(blkdev_t* dev, uint32_t lba, uint32_t count, void* buf, int write) {
+    blkdev_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.lba = lba;
+    req.count = count;
+    req.buf = buf;
+    req.write = write;
+    if (blkdev_submit((int)(dev - devices), &req) < 0) return -1;
+    return blkdev_wait(&req);
+}
+
+static void async_complete(blkdev_request_t* req) {
+    async_req_t* a = (async_req_t*)req;
+    void (*done)(void*, int) = a->done;
+    void* arg = a->arg;
+    int status = req->status;
+    uint64_t flags = spin_lock_irqsave(&async_lock);
+    async_free |= 1ULL << (a - async_reqs);
+    spin_unlock_irqrestore(&async_lock, flags);
+    done(arg, status);
+}
+
+// Queue a transfer with a completion callback. Without kblockd nobody
+// would dispatch it, so it is done synchronously instead.
+static int async_io(blkdev_t* dev, uint32_t lba, uint32_t count, void* buf, int write,
+                    void (*done)(void*, int), void* arg) {
+    if (!worker_running) {
+        done(arg, queue_io(dev, lba, count, buf, write));
+        return 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&async_lock);
+    if (!async_free) {
+        spin_unlock_irqrestore(&async_lock, flags);
+        return -1;
+    }
+    int slot = __builtin_ctzll(async_free);
+    async_free &= ~(1ULL << slot);
+    spin_unlock_irqrestore(&async_lock, flags);
+
+    async_req_t* a = &async_reqs[slot];
+    memset(&a->req, 0, sizeof(a->req));
+    a->req.lba = lba;
+    a->req.count = count;
+    a->req.buf = buf;
+    a->req.write = write;
+    a->req.done = async_complete;
+    a->done = done;
+    a->arg = arg;
+    if (blkdev_submit((int)(dev - devices), &a->req) < 0) {
+        flags = spin_lock_irqsave(&async_lock);
+        async_free |= 1ULL << slot;
+        spin_unlock_irqrestore(&async_lock, flags);
+        return -1;
+    }
+    return 0;
+}
+
+// ---- Cache Operations ----
+
+// Sectors of the cache block at block_lba that exist on the device
+static uint32_t cache_block_sectors(blkdev_t* dev, uint32_t block_lba) {
+    if (dev->total_sectors && block_lba + BLKDEV_SECTORS_PER_BLOCK > dev->total_sectors) {
+        return block_lba < dev->total_sectors ? (uint32_t)(dev->total_sectors - block_lba) : 0;
+    }
+    return BLKDEV_SECTORS_PER_BLOCK;
+}
 
-    entry->valid = 1;
-    entry->dirty = 0;
-    entry->device_id = device_id;
-    entry->block_lba = block_lba;
-    entry->access_count = ++cache_access_counter;
-    return entry;
+// Page cache callbacks (owner = blkdev_t*)
+static int cache_readpage(void* owner, uint64_t object, uint32_t index, void* page) {
+    (void)object;
+    blkdev_t* dev = (blkdev_t*)owner;
+    if (!dev->active || !dev->ops.read_sectors) return -1;
+    uint32_t block_lba = index * BLKDEV_SECTORS_PER_BLOCK;
+    uint32_t n = cache_block_sectors(dev, block_lba);
+    if (n < BLKDEV_SECTORS_PER_BLOCK) memset(page, 0, BLKDEV_CACHE_BLOCK_SIZE);
+    if (n == 0) return 0;
+    return queue_io(dev, block_lba, n, page, 0);
 }
 
-// Read a cache block from disk
-static int cache_fill(blkdev_cache_entry_t* entry) {
-    if (!entry || entry->device_id < 0 || entry->device_id >= BLKDEV_MAX_DEVICES) return -1;
-    blkdev_t* dev = &devices[entry->device_id];
+static int cache_writepage(void* owner, uint64_t object, uint32_t index, const void* page) {
+    (void)object;
+    blkdev_t* dev = (blkdev_t*)owner;
+    if (!dev->active || !dev->ops.write_sectors) return -1;
+    uint32_t block_lba = index * BLKDEV_SECTORS_PER_BLOCK;
+    uint32_t n = cache_block_sectors(dev, block_lba);
+    if (n == 0) return 0;
+    return queue_io(dev, block_lba, n, (void*)page, 1);
+}
+
+static void cache_readahead_done(void* arg, int status) {
+    pagecache_fill_done((pagecache_page_t*)arg, status);
+}
+
+static int cache_readahead(void* owner, uint64_t object, uint32_t index, pagecache_page_t* page) {
+    (void)object;
+    blkdev_t* dev = (blkdev_t*)owner;
     if (!dev->active || !dev->ops.read_sectors) return -1;
+    uint32_t block_lba = index * BLKDEV_SECTORS_PER_BLOCK;
+    uint32_t n = cache_block_sectors(dev, block_lba);
+    if (n == 0) return -1;
+    if (n < BLKDEV_SECTORS_PER_BLOCK) memset(page->data, 0, BLKDEV_CACHE_BLOCK_SIZE);
+    return async_io(dev, block_lba, n, page->data, 0, cache_readahead_done, page);
+}
 
-    int ret = dev->ops.read_sectors(dev->driver_data, entry->block_lba,
-                                     BLKDEV_SECTORS_PER_BLOCK, entry->data);
-    return (ret >= 0) ? 0 : -1;
+static void cache_writeback_done(void* arg, int status) {
+    pagecache_write_done((pagecache_page_t*)arg, status);
+}
+
+static int cache_writeback(void* owner, uint64_t object, uint32_t index, pagecache_page_t* page) {
+    (void)object;
+    blkdev_t* dev = (blkdev_t*)owner;
+    if (!dev->active || !dev->ops.write_sectors) return -1;
+    uint32_t block_lba = index * BLKDEV_SECTORS_PER_BLOCK;
+    uint32_t n = cache_block_sectors(dev, block_lba);
+    if (n == 0) {
+        pagecache_write_done(page, 0);
+        return 0;
+    }
+    return async_io(dev, block_lba, n, page->data, 1, cache_writeback_done, page);
+}
+
+static const pagecache_ops_t cache_ops = {
+    .readpage  = cache_readpage,
+    .writepage = cache_writepage,
+    .readahead = cache_readahead,
+    .writeback = cache_writeback,
+};
+
+// ---- Ramdisks ----
+
+// Copy to or from a memory-backed device (dev->mem) without the cache
+static int mem_io(blkdev_t* dev, uint32_t lba, uint32_t count, void* buf, int write) {
+    if ((uint64_t)lba + count > dev->total_sectors) return -1;
+    uint8_t* mem = dev->mem + (uint64_t)lba * BLKDEV_SECTOR_SIZE;
+    if (write) memcpy(mem, buf, count * BLKDEV_SECTOR_SIZE);
+    else memcpy(buf, mem, count * BLKDEV_SECTOR_SIZE);
+    return (int)count;
 }
 
 // ---- Public API ----
 
 void blkdev_init(void) {
-    blk_memset(devices, 0, sizeof(devices));
-    blk_memset(cache, 0, sizeof(cache));
+    memset(devices, 0, sizeof(devices));
     device_count = 0;
-    cache_access_counter = 0;
 
     // Auto-register detected ATA drives
     int ata_count = ata_get_drive_count();
@@ -168,6 +371,7 @@ void blkdev_init(void) {
             ops.read_sectors = ata_blkdev_read;
             ops.write_sectors = ata_blkdev_write;
             ops.flush = ata_blkdev_flush;
+            ops.submit = 0;     // One channel command at a time
 
             char name[16] = "ata0";
             name[3] = '0' + (char)i;
@@ -190,7 +394,7 @@ int blkdev_register(const char* name, int type, uint64_t total_sectors,
     if (id < 0) return -1;
 
     blkdev_t* dev = &devices[id];
-    blk_memset(dev, 0, sizeof(blkdev_t));
+    memset(dev, 0, sizeof(blkdev_t));
     dev->active = 1;
     dev->type = type;
     blk_strncpy(dev->name, name, 16);
@@ -198,6 +402,12 @@ int blkdev_register(const char* name, int type, uint64_t total_sectors,
     dev->sector_size = sector_size ? sector_size : BLKDEV_SECTOR_SIZE;
     dev->driver_data = driver_data;
     dev->ops = *ops;
+    waitq_init(&dev->q_wait);
+    dev->cache_space = pagecache_register(&cache_ops, dev);
+    if (dev->cache_space < 0) {
+        dev->active = 0;
+        return -1;
+    }
 
     device_count++;
     return id;
@@ -207,15 +417,9 @@ void blkdev_unregister(int device_id) {
     if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES) return;
     if (!devices[device_id].active) return;
 
-    // Flush cache entries for this device
+    // Write back and drop this device's cached blocks
     blkdev_flush(device_id);
-
-    // Invalidate cache entries
-    for (int i = 0; i < BLKDEV_CACHE_ENTRIES; i++) {
-        if (cache[i].valid && cache[i].device_id == device_id) {
-            cache[i].valid = 0;
-        }
-    }
+    pagecache_unregister(devices[device_id].cache_space);
 
     devices[device_id].active = 0;
     device_count--;
@@ -226,6 +430,7 @@ int blkdev_read(int device_id, uint32_t lba, uint32_t count, void* buf) {
     blkdev_t* dev = &devices[device_id];
     if (!dev->active || !dev->ops.read_sectors) return -1;
     if (!buf || count == 0) return 0;
+    if (dev->mem) return mem_io(dev, lba, count, buf, 0);
 
     uint8_t* dst = (uint8_t*)buf;
     uint32_t sectors_read = 0;
@@ -234,22 +439,14 @@ int blkdev_read(int device_id, uint32_t lba, uint32_t count, void* buf) {
         uint32_t current_lba = lba + sectors_read;
 
         // Align to cache block boundary
-        uint32_t block_lba = (current_lba / BLKDEV_SECTORS_PER_BLOCK) * BLKDEV_SECTORS_PER_BLOCK;
-        uint32_t offset_in_block = current_lba - block_lba;
-
-        // Try cache
-        blkdev_cache_entry_t* entry = cache_find(device_id, block_lba);
-        if (!entry) {
-            // Cache miss: allocate and fill
-            entry = cache_alloc(device_id, block_lba);
-            if (!entry) {
-                // Cache allocation failed, read directly
-                return dev->ops.read_sectors(dev->driver_data, lba, count, buf);
-            }
-            if (cache_fill(entry) < 0) {
-                entry->valid = 0;
-                return dev->ops.read_sectors(dev->driver_data, lba, count, buf);
-            }
+        uint32_t block = current_lba / BLKDEV_SECTORS_PER_BLOCK;
+        uint32_t offset_in_block = current_lba % BLKDEV_SECTORS_PER_BLOCK;
+
+        pagecache_page_t* page = pagecache_get(dev->cache_space, 0, block, PAGECACHE_SEQ);
+        if (!page) {
+            // No cache page to be had (or the fill failed): read the rest directly
+            int ret = queue_io(dev, current_lba, count - sectors_read, dst, 0);
+            return ret < 0 ? ret : (int)count;
         }
 
         // Copy from cache to output buffer
@@ -257,8 +454,9 @@ int blkdev_read(int device_id, uint32_t lba, uint32_t count, void* buf) {
         uint32_t sectors_to_copy = count - sectors_read;
         if (sectors_to_copy > sectors_available) sectors_to_copy = sectors_available;
 
-        blk_memcpy(dst, entry->data + offset_in_block * BLKDEV_SECTOR_SIZE,
+        memcpy(dst, page->data + offset_in_block * BLKDEV_SECTOR_SIZE,
                    sectors_to_copy * BLKDEV_SECTOR_SIZE);
+        pagecache_put(page);
 
         dst += sectors_to_copy * BLKDEV_SECTOR_SIZE;
         sectors_read += sectors_to_copy;
@@ -267,46 +465,132 @@ int blkdev_read(int device_id, uint32_t lba, uint32_t count, void* buf) {
     return (int)count;
 }
 
+int blkdev_read_direct(int device_id, uint32_t lba, uint32_t count, void* buf) {
+    if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES) return -1;
+    blkdev_t* dev = &devices[device_id];
+    if (!dev->active || !dev->ops.read_sectors) return -1;
+    if (!buf || count == 0) return 0;
+    if (dev->mem) return mem_io(dev, lba, count, buf, 0);
+
+    uint8_t* dst = (uint8_t*)buf;
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t current_lba = lba + done;
+        uint32_t block = current_lba / BLKDEV_SECTORS_PER_BLOCK;
+        uint32_t offset_in_block = current_lba % BLKDEV_SECTORS_PER_BLOCK;
+        uint32_t n = BLKDEV_SECTORS_PER_BLOCK - offset_in_block;
+        if (n > count - done) n = count - done;
+
+        // A cached copy may be newer than the disk
+        pagecache_page_t* page = pagecache_get(dev->cache_space, 0, block, PAGECACHE_PEEK);
+        if (page) {
+            memcpy(dst, page->data + offset_in_block * BLKDEV_SECTOR_SIZE, n * BLKDEV_SECTOR_SIZE);
+            pagecache_put(page);
+        } else {
+            // Extend the driver read over following uncached blocks
+            uint32_t end = done + n;
+            while (end < count) {
+                uint32_t next = (lba + end) / BLKDEV_SECTORS_PER_BLOCK;
+                pagecache_page_t* p = pagecache_get(dev->cache_space, 0, next, PAGECACHE_PEEK);
+                if (p) { pagecache_put(p); break; }
+                end += BLKDEV_SECTORS_PER_BLOCK;
+                if (end > count) end = count;
+            }
+            n = end - done;
+            if (queue_io(dev, current_lba, n, dst, 0) < 0) return -1;
+        }
+        dst += n * BLKDEV_SECTOR_SIZE;
+        done += n;
+    }
+    return (int)count;
+}
+
+int blkdev_read_async(int device_id, uint32_t lba, uint32_t count, void* buf,
+                      void (*done)(void* arg, int status), void* arg) {
+    if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES || !done) return -1;
+    blkdev_t* dev = &devices[device_id];
+    if (!dev->active || !dev->ops.read_sectors || !buf || count == 0) return -1;
+    if (dev->mem) {
+        done(arg, mem_io(dev, lba, count, buf, 0) < 0 ? -1 : 0);
+        return 0;
+    }
+
+    // Cached blocks may be newer than the disk: let read_direct merge them
+    uint32_t last = (lba + count - 1) / BLKDEV_SECTORS_PER_BLOCK;
+    for (uint32_t block = lba / BLKDEV_SECTORS_PER_BLOCK; block <= last; block++) {
+        pagecache_page_t* page = pagecache_get(dev->cache_space, 0, block, PAGECACHE_PEEK);
+        if (page) {
+            pagecache_put(page);
+            done(arg, blkdev_read_direct(device_id, lba, count, buf) < 0 ? -1 : 0);
+            return 0;
+        }
+    }
+    return async_io(dev, lba, count, buf, 0, done, arg);
+}
+
+const uint8_t* blkdev_map(int device_id, uint32_t lba, pagecache_page_t** page) {
+    if (!page) return (const uint8_t*)0;
+    *page = (pagecache_page_t*)0;
+    if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES) return (const uint8_t*)0;
+    blkdev_t* dev = &devices[device_id];
+    if (!dev->active) return (const uint8_t*)0;
+    if (dev->mem) {
+        if (lba >= dev->total_sectors) return (const uint8_t*)0;
+        return dev->mem + (uint64_t)lba * BLKDEV_SECTOR_SIZE;
+    }
+
+    *page = pagecache_get(dev->cache_space, 0, lba / BLKDEV_SECTORS_PER_BLOCK, 0);
+    if (!*page) return (const uint8_t*)0;
+    return (*page)->data + (lba % BLKDEV_SECTORS_PER_BLOCK) * BLKDEV_SECTOR_SIZE;
+}
+
+void blkdev_unmap(pagecache_page_t* page) {
+    pagecache_put(page);
+}
+
+uint8_t* blkdev_map_rw(int device_id, uint32_t lba, pagecache_page_t** page) {
+    return (uint8_t*)blkdev_map(device_id, lba, page);
+}
+
+void blkdev_unmap_dirty(pagecache_page_t* page) {
+    if (!page) return;
+    pagecache_mark_dirty(page);
+    pagecache_put(page);
+}
+
 int blkdev_write(int device_id, uint32_t lba, uint32_t count, const void* buf) {
     if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES) return -1;
     blkdev_t* dev = &devices[device_id];
     if (!dev->active || !dev->ops.write_sectors) return -1;
     if (!buf || count == 0) return 0;
+    if (dev->mem) return mem_io(dev, lba, count, (void*)buf, 1);
 
     const uint8_t* src = (const uint8_t*)buf;
     uint32_t sectors_written = 0;
 
     while (sectors_written < count) {
         uint32_t current_lba = lba + sectors_written;
-        uint32_t block_lba = (current_lba / BLKDEV_SECTORS_PER_BLOCK) * BLKDEV_SECTORS_PER_BLOCK;
-        uint32_t offset_in_block = current_lba - block_lba;
-
-        // Find or create cache entry
-        blkdev_cache_entry_t* entry = cache_find(device_id, block_lba);
-        if (!entry) {
-            entry = cache_alloc(device_id, block_lba);
-            if (!entry) {
-                // Bypass cache
-                return dev->ops.write_sectors(dev->driver_data, lba, count, buf);
-            }
-            // If we're not writing a full block, read existing data first
-            uint32_t sectors_to_write = count - sectors_written;
-            if (offset_in_block != 0 || sectors_to_write < BLKDEV_SECTORS_PER_BLOCK) {
-                if (cache_fill(entry) < 0) {
-                    blk_memset(entry->data, 0, BLKDEV_CACHE_BLOCK_SIZE);
-                }
-            }
-        }
+        uint32_t block = current_lba / BLKDEV_SECTORS_PER_BLOCK;
+        uint32_t offset_in_block = current_lba % BLKDEV_SECTORS_PER_BLOCK;
 
-        // Copy from input buffer to cache
         uint32_t sectors_available = BLKDEV_SECTORS_PER_BLOCK - offset_in_block;
         uint32_t sectors_to_copy = count - sectors_written;
         if (sectors_to_copy > sectors_available) sectors_to_copy = sectors_available;
 
-        blk_memcpy(entry->data + offset_in_block * BLKDEV_SECTOR_SIZE,
+        // A full block is overwritten, a partial one is read first
+        int flags = sectors_to_copy == BLKDEV_SECTORS_PER_BLOCK ? PAGECACHE_NOFILL : 0;
+        pagecache_page_t* page = pagecache_get(dev->cache_space, 0, block, flags);
+        if (!page) {
+            // Bypass cache
+            int ret = queue_io(dev, current_lba, count - sectors_written, (void*)src, 1);
+            return ret < 0 ? ret : (int)count;
+        }
+
+        memcpy(page->data + offset_in_block * BLKDEV_SECTOR_SIZE,
                    src, sectors_to_copy * BLKDEV_SECTOR_SIZE);
+        pagecache_mark_dirty(page);
+        pagecache_put(page);
 
-        entry->dirty = 1;
         src += sectors_to_copy * BLKDEV_SECTOR_SIZE;
         sectors_written += sectors_to_copy;
     }
@@ -314,26 +598,48 @@ int blkdev_write(int device_id, uint32_t lba, uint32_t count, const void* buf) {
     return (int)count;
 }
 
-int blkdev_flush(int device_id) {
+int blkdev_write_direct(int device_id, uint32_t lba, uint32_t count, const void* buf) {
     if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES) return -1;
     blkdev_t* dev = &devices[device_id];
-    if (!dev->active) return -1;
+    if (!dev->active || !dev->ops.write_sectors) return -1;
+    if (!buf || count == 0) return 0;
+    if (dev->mem) return mem_io(dev, lba, count, (void*)buf, 1);
 
-    for (int i = 0; i < BLKDEV_CACHE_ENTRIES; i++) {
-        if (cache[i].valid && cache[i].dirty && cache[i].device_id == device_id) {
-            if (dev->ops.write_sectors) {
-                dev->ops.write_sectors(dev->driver_data, cache[i].block_lba,
-                                       BLKDEV_SECTORS_PER_BLOCK, cache[i].data);
-            }
-            cache[i].dirty = 0;
+    if (queue_io(dev, lba, count, (void*)buf, 1) < 0) return -1;
+
+    // A cached copy would otherwise read back (or write back) stale data
+    const uint8_t* src = (const uint8_t*)buf;
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t current_lba = lba + done;
+        uint32_t block = current_lba / BLKDEV_SECTORS_PER_BLOCK;
+        uint32_t offset_in_block = current_lba % BLKDEV_SECTORS_PER_BLOCK;
+        uint32_t n = BLKDEV_SECTORS_PER_BLOCK - offset_in_block;
+        if (n > count - done) n = count - done;
+
+        pagecache_page_t* page = pagecache_get(dev->cache_space, 0, block, PAGECACHE_PEEK);
+        if (page) {
+            memcpy(page->data + offset_in_block * BLKDEV_SECTOR_SIZE,
+                   src + (uint64_t)done * BLKDEV_SECTOR_SIZE, n * BLKDEV_SECTOR_SIZE);
+            pagecache_put(page);
         }
+        done += n;
     }
+    return (int)count;
+}
+
+int blkdev_flush(int device_id) {
+    if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES) return -1;
+    blkdev_t* dev = &devices[device_id];
+    if (!dev->active) return -1;
+
+    int ret = pagecache_sync(dev->cache_space);
 
     if (dev->ops.flush) {
         dev->ops.flush(dev->driver_data);
     }
 
-    return 0;
+    return ret;
 }
 
 void blkdev_flush_all(void) {
@@ -344,6 +650,14 @@ void blkdev_flush_all(void) {
     }
 }
 
+int blkdev_find(const char* name) {
+    if (!name) return -1;
+    for (int i = 0; i < BLKDEV_MAX_DEVICES; i++) {
+        if (devices[i].active && blk_strcmp(devices[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
 blkdev_t* blkdev_get(int device_id) {
     if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES) return (blkdev_t*)0;
     if (!devices[device_id].active) return (blkdev_t*)0;
@@ -354,6 +668,47 @@ int blkdev_get_count(void) {
     return device_count;
 }
 
+int blkdev_submit(int device_id, blkdev_request_t* req) {
+    if (device_id < 0 || device_id >= BLKDEV_MAX_DEVICES || !req) return -1;
+    blkdev_t* dev = &devices[device_id];
+    if (!dev->active || !req->buf || req->count == 0) return -1;
+    if (dev->total_sectors && (uint64_t)req->lba + req->count > dev->total_sectors) return -1;
+
+    req->device_id = device_id;
+    req->status = 0;
+    req->complete = 0;
+    req->next = 0;
+    req->deadline = timer_now_ns() +
+        (req->write ? BLKDEV_WRITE_DEADLINE_NS : BLKDEV_READ_DEADLINE_NS);
+
+    uint64_t flags = spin_lock_irqsave(&dev->q_lock);
+    queue_insert(dev, req);
+    dev->q_stats.submitted++;
+    spin_unlock_irqrestore(&dev->q_lock, flags);
+
+    if (worker_running) waitq_wake_all(&worker_wq);
+    return 0;
+}
+
+int blkdev_wait(blkdev_request_t* req) {
+    if (!req) return -1;
+    blkdev_t* dev = &devices[req->device_id];
+    while (!req->complete) {
+        // Sleep while kblockd works; otherwise drive the queue ourselves
+        if (worker_running && waitq_wait(&dev->q_wait, request_complete, req) == 0) break;
+        if (queue_run(dev)) continue;
+        if (req->complete) break;
+        if (scheduler_is_running()) scheduler_yield();
+        else __asm__ volatile("pause");
+    }
+    return req->status;
+}
+
+void blkdev_start_worker(void) {
+    if (worker_running) return;
+    if (process_create("kblockd", kblockd, PRIORITY_HIGH) >= 0) worker_running = 1;
+}
+
 int blkdev_read_sector(int device_id, uint32_t lba, void* buf) {
     return blkdev_read(device_id, lba, 1, buf);
 }
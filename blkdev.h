@@ -1,10 +1,14 @@
 // blkdev.h - Block Device Layer for Alteo OS
-// Provides a common block I/O interface with page cache
+// Provides a common block I/O interface on top of the unified page cache
 // Sits between filesystems (fat32.c) and raw drivers (ata.c)
+// Devices backed by memory (ramdisk.c) bypass the cache and the queue
 #ifndef BLKDEV_H
 #define BLKDEV_H
 
 #include "stdint.h"
+#include "pagecache.h"
+#include "spinlock.h"
+#include "waitq.h"
 
 // Block device types
 #define BLKDEV_TYPE_ATA         0
@@ -16,14 +20,60 @@
 // Sector size
 #define BLKDEV_SECTOR_SIZE      512
 
-// Cache configuration
-#define BLKDEV_CACHE_ENTRIES     256     // Number of cached blocks
-#define BLKDEV_CACHE_BLOCK_SIZE  4096    // 4KB per cache block (8 sectors)
+// Cache configuration (one page cache page per block)
+#define BLKDEV_CACHE_BLOCK_SIZE  PAGECACHE_PAGE_SIZE    // 4KB per cache block (8 sectors)
 #define BLKDEV_SECTORS_PER_BLOCK (BLKDEV_CACHE_BLOCK_SIZE / BLKDEV_SECTOR_SIZE)
 
 // Max block devices
 #define BLKDEV_MAX_DEVICES       8
 
+// Request queue: requests are dispatched in batches of up to
+// BLKDEV_BATCH_MAX, in ascending LBA order from the last position (C-SCAN)
+// unless a request has waited past its deadline. Contiguous requests in
+// one direction merge into a single transfer of up to BLKDEV_MERGE_MAX.
+#define BLKDEV_BATCH_MAX         32
+#define BLKDEV_MERGE_MAX         1024                 // Sectors (512KB)
+#define BLKDEV_READ_DEADLINE_NS  50000000ULL          // 50ms
+#define BLKDEV_WRITE_DEADLINE_NS 500000000ULL         // 500ms
+#define BLKDEV_ASYNC_MAX         64                   // Asynchronous transfers in flight
+
+// One transfer handed to a driver's submit op
+typedef struct {
+    uint32_t lba;
+    uint32_t count;
+    void*    buf;
+    int      write;
+    int      status;         // Set by the driver: 0 or -1
+} blkdev_io_t;
+
+// A queued request. The caller owns the memory and keeps it valid until
+// the request completes: blkdev_wait() returns, or done() is called. buf
+// must be kernel memory, since kblockd may run the transfer.
+typedef struct blkdev_request {
+    uint32_t lba;
+    uint32_t count;
+    void*    buf;
+    int      write;
+    void   (*done)(struct blkdev_request* req);    // Optional, may run on any CPU
+    void*    priv;                                 // For the owner
+    volatile int status;     // 0 or -1 once complete
+    volatile int complete;
+
+    // Queue internals
+    int      device_id;
+    uint64_t deadline;
+    struct blkdev_request* next;
+} blkdev_request_t;
+
+// Queue statistics
+typedef struct {
+    uint64_t submitted;      // Requests queued
+    uint64_t merged;         // Requests merged into a neighbour's transfer
+    uint64_t dispatched;     // Transfers handed to the driver
+    uint64_t batches;
+    uint64_t expired;        // Batches started at an overdue request
+} blkdev_queue_stats_t;
+
 // Block device operations (driver provides these)
 typedef struct {
     // Read `count` sectors starting at `lba` into `buf`
@@ -36,6 +86,11 @@ typedef struct {
 
     // Flush write cache to disk
     int (*flush)(void* driver_data);
+
+    // Optional: run a batch of transfers together (drivers that queue
+    // commands, e.g. NCQ or NVMe) and set each one's status. Without it
+    // the batch is issued through read_sectors/write_sectors in order.
+    int (*submit)(void* driver_data, blkdev_io_t* ios, int count);
 } blkdev_ops_t;
 
 // Block device descriptor
@@ -47,18 +102,19 @@ typedef struct {
     uint32_t    sector_size;    // Usually 512
     void*       driver_data;    // Opaque pointer for the driver
     blkdev_ops_t ops;           // Driver operations
+    int         cache_space;    // Page cache space holding this device's blocks
+    uint8_t*    mem;            // Ramdisk memory: served in place, never cached
+
+    // Request queue
+    spinlock_t  q_lock;
+    blkdev_request_t* queue;    // Pending, sorted by LBA
+    int         queued;
+    uint32_t    head_pos;       // LBA after the last dispatched transfer
+    int         dispatching;    // A batch is being run
+    waitq_t     q_wait;         // Woken when requests complete
+    blkdev_queue_stats_t q_stats;
 } blkdev_t;
 
-// Cache entry
-typedef struct {
-    int      valid;             // Entry contains valid data
-    int      dirty;             // Entry has been modified (needs writeback)
-    int      device_id;         // Which block device
-    uint32_t block_lba;         // Starting LBA of this cache block (aligned)
-    uint32_t access_count;      // LRU counter
-    uint8_t  data[BLKDEV_CACHE_BLOCK_SIZE];
-} blkdev_cache_entry_t;
-
 // ---- API ----
 
 // Initialize the block device layer
@@ -74,21 +130,64 @@ void blkdev_unregister(int device_id);
 // Read sectors from a block device (goes through cache)
 int blkdev_read(int device_id, uint32_t lba, uint32_t count, void* buf);
 
+// Read sectors without caching them (for callers that cache the data
+// themselves, e.g. file pages). Blocks already cached are copied from the
+// cache, since they may be newer than the disk.
+int blkdev_read_direct(int device_id, uint32_t lba, uint32_t count, void* buf);
+
+// Pin the cache block holding sector lba and return a pointer to that
+// sector inside it (valid up to the end of the block). *page receives the
+// pin for blkdev_unmap() (0 for a ramdisk, whose memory is returned
+// directly). Returns 0 on error.
+const uint8_t* blkdev_map(int device_id, uint32_t lba, pagecache_page_t** page);
+void blkdev_unmap(pagecache_page_t* page);
+
+// blkdev_map() for modifying the block in place: release with
+// blkdev_unmap_dirty() (written back later) or blkdev_unmap() (unchanged)
+uint8_t* blkdev_map_rw(int device_id, uint32_t lba, pagecache_page_t** page);
+void blkdev_unmap_dirty(pagecache_page_t* page);
+
 // Write sectors to a block device (goes through cache)
 int blkdev_write(int device_id, uint32_t lba, uint32_t count, const void* buf);
 
+// Write sectors straight to the device (for callers that cache the data
+// themselves). Cached copies of the blocks are updated to match.
+int blkdev_write_direct(int device_id, uint32_t lba, uint32_t count, const void* buf);
+
 // Flush a device's dirty cache entries to disk
 int blkdev_flush(int device_id);
 
 // Flush all devices
 void blkdev_flush_all(void);
 
+// Find a registered device by name ("ata0", ...). Returns its ID or -1.
+int blkdev_find(const char* name);
+
 // Get a block device descriptor
 blkdev_t* blkdev_get(int device_id);
 
 // Get number of registered devices
 int blkdev_get_count(void);
 
+// Queue an asynchronous request (lba, count, buf, write and optionally
+// done/priv filled in). Returns 0, or -1 if the request is invalid.
+int blkdev_submit(int device_id, blkdev_request_t* req);
+
+// Wait for a submitted request to complete. Returns its status.
+int blkdev_wait(blkdev_request_t* req);
+
+// Start reading sectors into buf (kernel memory) without waiting.
+// done(arg, status) runs once the data is in: from kblockd, or before
+// returning when the read is served synchronously (blocks already cached,
+// no kblockd yet). Returns 0, or -1 if nothing was started (done is not
+// called), e.g. when too many reads are in flight.
+int blkdev_read_async(int device_id, uint32_t lba, uint32_t count, void* buf,
+                      void (*done)(void* arg, int status), void* arg);
+
+// Start the kblockd thread that dispatches queued requests (after
+// process_init). Until then requests are dispatched by their waiters.
+void blkdev_start_worker(void);
+
 // Convenience: read a single sector
 int blkdev_read_sector(int device_id, uint32_t lba, void* buf);
 
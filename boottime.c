@@ -0,0 +1,121 @@
+// boottime.c - Boot Phase Timing for Alteo OS
+#include "boottime.h"
+#include "process.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#define BOOT_MAX_DEFERRED   8
+
+typedef struct {
+    const char* name;
+    void (*fn)(void);
+    int claimed;
+} boot_job_t;
+
+static boot_phase_t phases[BOOT_MAX_PHASES];
+static int nphases = 0;
+static int current = -1;                // Running kernel_main() phase
+static uint64_t start_tsc, ready_tsc;
+static spinlock_t boot_lock = SPINLOCK_INIT;
+
+static boot_job_t jobs[BOOT_MAX_DEFERRED];
+static int njobs = 0;
+static int next_ap = 1;
+
+// Claim a phase slot and stamp its start; -1 if the table is full
+static int phase_open(const char* name, uint16_t cpu, uint16_t deferred) {
+    uint64_t irq = spin_lock_irqsave(&boot_lock);
+    int id = nphases < BOOT_MAX_PHASES ? nphases++ : -1;
+    spin_unlock_irqrestore(&boot_lock, irq);
+    if (id < 0) return -1;
+    phases[id].name = name;
+    phases[id].cpu = cpu;
+    phases[id].deferred = deferred;
+    phases[id].end_tsc = 0;
+    phases[id].start_tsc = lock_tsc();
+    return id;
+}
+
+static void phase_close(int id) {
+    if (id >= 0) phases[id].end_tsc = lock_tsc();
+}
+
+void boot_phase(const char* name) {
+    uint64_t now = lock_tsc();
+    if (!start_tsc) start_tsc = now;
+    phase_close(current);
+    // Inline phases all run on the BSP, partly before per-CPU data exists
+    current = name ? phase_open(name, 0, 0) : -1;
+}
+
+void boot_ready(void) {
+    boot_phase(0);
+    ready_tsc = lock_tsc();
+}
+
+// Entry of a boot_defer() thread: take the oldest job nobody runs yet
+static void boot_defer_thread(void) {
+    boot_job_t* job = 0;
+    uint64_t irq = spin_lock_irqsave(&boot_lock);
+    for (int i = 0; i < njobs; i++) {
+        if (!jobs[i].claimed) {
+            jobs[i].claimed = 1;
+            job = &jobs[i];
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&boot_lock, irq);
+    if (!job) return;
+
+    int id = phase_open(job->name, (uint16_t)smp_this_cpu()->cpu, 1);
+    smp_bkl_lock();
+    job->fn();
+    smp_bkl_unlock();
+    phase_close(id);
+}
+
+void boot_defer(const char* name, void (*fn)(void)) {
+    if (njobs < BOOT_MAX_DEFERRED) {
+        uint64_t irq = spin_lock_irqsave(&boot_lock);
+        jobs[njobs].name = name;
+        jobs[njobs].fn = fn;
+        jobs[njobs].claimed = 0;
+        njobs++;
+        spin_unlock_irqrestore(&boot_lock, irq);
+
+        // Round-robin over the APs, if any are online, so the probes
+        // overlap each other and leave the BSP to the desktop
+        int cpus = smp_cpu_count();
+        int cpu = -1;
+        if (cpus > 1) {
+            cpu = next_ap;
+            next_ap = next_ap + 1 < cpus ? next_ap + 1 : 1;
+        }
+        if (process_create_on(name, boot_defer_thread, PRIORITY_NORMAL, cpu) >= 0) return;
+
+        irq = spin_lock_irqsave(&boot_lock);
+        jobs[njobs - 1].claimed = 1;
+        spin_unlock_irqrestore(&boot_lock, irq);
+    }
+
+    int id = phase_open(name, 0, 1);
+    fn();
+    phase_close(id);
+}
+
+int boot_phase_count(void) {
+    return nphases;
+}
+
+const boot_phase_t* boot_get_phase(int i) {
+    if (i < 0 || i >= nphases) return 0;
+    return &phases[i];
+}
+
+uint64_t boot_start_tsc(void) {
+    return start_tsc;
+}
+
+uint64_t boot_ready_tsc(void) {
+    return ready_tsc;
+}
@@ -0,0 +1,46 @@
+// boottime.h - Boot Phase Timing for Alteo OS
+// kernel_main() marks each init phase with boot_phase(); the TSC is read
+// at every mark and converted once the timer has calibrated it, so phases
+// before timer_init() are timed too. Probes the desktop does not wait for
+// (USB, audio) are handed to boot_defer(), which runs each on its own
+// kernel thread (spread over the APs when there are any) after the
+// desktop is up. Their phases are timed the same way and flagged as
+// deferred.
+//
+// /proc/boottime lists every phase with its CPU, start and duration, and
+// the time from kernel entry to the first desktop frame.
+#ifndef BOOTTIME_H
+#define BOOTTIME_H
+
+#include "stdint.h"
+
+#define BOOT_MAX_PHASES     48
+
+typedef struct {
+    const char* name;
+    uint64_t start_tsc;
+    uint64_t end_tsc;           // 0 while running
+    uint16_t cpu;
+    uint16_t deferred;          // Ran on a boot_defer() thread
+} boot_phase_t;
+
+// End the running kernel_main() phase and start name (0: start none)
+void boot_phase(const char* name);
+
+// End the running phase and record the desktop as up
+void boot_ready(void);
+
+// Run fn on a new kernel thread (under the BKL, like the init code it was
+// moved out of) as deferred phase name. Runs fn inline if no thread can
+// be created. Needs the scheduler.
+void boot_defer(const char* name, void (*fn)(void));
+
+// Recorded phases, in start order
+int boot_phase_count(void);
+const boot_phase_t* boot_get_phase(int i);
+
+// TSC at the first boot_phase() and at boot_ready() (0 if not yet)
+uint64_t boot_start_tsc(void);
+uint64_t boot_ready_tsc(void);
+
+#endif
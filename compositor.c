@@ -1,12 +1,24 @@
 // compositor.c - GPU-Accelerated Window Compositor for Alteo OS
-// Composites window surfaces, handles damage tracking, vsync, animations
+// Composites window surfaces, handles damage tracking, vsync, animations.
+// With an NV50+ 2D engine and scanout in VRAM, every surface has a VRAM
+// twin and damaged rectangles are composited by 2D-engine blits and fills
+// into a VRAM composition buffer; otherwise (or for a rectangle with a
+// translucent window in it) the CPU composites into graphics.c's backbuf.
+// Where the display has two scanout buffers, the back one is the
+// composition buffer and a frame is presented by a page flip at vblank.
 #include "compositor.h"
 #include "gpu.h"
 #include "nv_2d.h"
 #include "nv_display.h"
+#include "nv_mem.h"
+#include "pixel.h"
 #include "graphics.h"
 #include "heap.h"
 #include "font.h"
+#include "klib.h"
+#include "shm.h"
+#include "trace.h"
+#include "frametime.h"
 
 // ============================================================
 // External References
@@ -23,8 +35,6 @@ extern int       screen_height;
 
 // Graphics helpers
 extern void draw_rect(int x, int y, int w, int h, uint32_t color);
-extern void draw_char(int x, int y, char c, uint32_t color);
-extern void draw_string(int x, int y, const char* str, uint32_t color);
 
 // ============================================================
 // Global State
@@ -32,6 +42,10 @@ extern void draw_string(int x, int y, const char* str, uint32_t color);
 
 static comp_state_t comp;
 
+#define DECO_TITLE_HEIGHT   24
+#define DECO_BORDER_WIDTH   2
+#define ANIM_SLIDE_PX       50
+
 // ============================================================
 // Internal Helpers
 // ============================================================
@@ -95,10 +109,52 @@ static void add_damage(comp_rect_t* list, int* count, int max_rects,
     (*count)++;
 }
 
+// Screen area a window covers at (x, y), decoration included
+static void window_bounds(comp_window_t* win, int x, int y, comp_rect_t* out) {
+    out->x = x;
+    out->y = y;
+    out->w = win->width;
+    out->h = win->height;
+    if (win->flags & COMP_WIN_DECORATED) {
+        out->x -= DECO_BORDER_WIDTH;
+        out->y -= DECO_TITLE_HEIGHT;
+        out->w += 2 * DECO_BORDER_WIDTH;
+        out->h += DECO_TITLE_HEIGHT + DECO_BORDER_WIDTH;
+    }
+}
+
+static void damage_rect(int x, int y, int w, int h) {
+    if (w <= 0 || h <= 0) return;
+    add_damage(comp.damage, &comp.damage_count, COMP_DAMAGE_RECTS, x, y, w, h);
+}
+
+// Damage everything a window may cover this frame. A sliding window moves
+// by up to ANIM_SLIDE_PX from its resting place.
+static void damage_window(comp_window_t* win) {
+    comp_rect_t b;
+    window_bounds(win, win->x, win->y, &b);
+    if (win->anim_type == ANIM_SLIDE_UP || win->anim_type == ANIM_SLIDE_DOWN) {
+        b.y -= ANIM_SLIDE_PX;
+        b.h += 2 * ANIM_SLIDE_PX;
+    }
+    damage_rect(b.x, b.y, b.w, b.h);
+}
+
 // ============================================================
 // Surface Management
 // ============================================================
 
+// VRAM twin for the GPU backend. Without one (VRAM full) the surface is
+// composited by the CPU.
+static void surface_alloc_twin(comp_surface_t* surf) {
+    uint64_t size = (uint64_t)surf->pitch * surf->height * 4;
+    if (comp.use_gpu && nv_bo_new(size, NV_MEM_VRAM, &surf->bo) == 0) {
+        surf->vram_offset = (uint32_t)surf->bo.gpu_offset;
+    } else {
+        surf->bo.size = 0;
+    }
+}
+
 static int surface_alloc(comp_surface_t* surf, int w, int h) {
     surf->width = w;
     surf->height = h;
@@ -106,20 +162,27 @@ static int surface_alloc(comp_surface_t* surf, int w, int h) {
     surf->format = SURFACE_FORMAT_ARGB8888;
     surf->vram_offset = 0;
     surf->dirty = 1;
+    surf->bo.size = 0;
     surf->pixels = (uint32_t*)kmalloc(w * h * 4);
     if (!surf->pixels) return -1;
     // Clear to transparent
     for (int i = 0; i < w * h; i++) {
         surf->pixels[i] = 0x00000000;
     }
+    surface_alloc_twin(surf);
     return 0;
 }
 
 static void surface_free(comp_surface_t* surf) {
     if (surf->pixels) {
-        kfree(surf->pixels);
+        if (surf->shm_backed) shm_unpin(surf->shm_id);
+        else kfree(surf->pixels);
         surf->pixels = 0;
     }
+    surf->shm_backed = 0;
+    if (surf->bo.size) nv_bo_del(&surf->bo);
+    surf->bo.size = 0;
+    surf->vram_offset = 0;
     surf->width = 0;
     surf->height = 0;
 }
@@ -136,8 +199,6 @@ static void surface_clear(comp_surface_t* surf, uint32_t color) {
 // Window Decoration Drawing
 // ============================================================
 
-#define DECO_TITLE_HEIGHT   24
-#define DECO_BORDER_WIDTH   2
 #define DECO_TITLE_COLOR_FOCUSED    0xFF4488CC
 #define DECO_TITLE_COLOR_UNFOCUSED  0xFF888888
 #define DECO_BORDER_COLOR           0xFF333333
@@ -205,21 +266,12 @@ static void draw_decoration(comp_window_t* win) {
         }
     }
 
-    // Title text
-    int tx = 6;
-    int ty = 4;
+    // Title text, rendered into the surface so either backend can blit it;
+    // only whole glyphs left of the close button
     int title_len = str_len(win->title);
-    for (int i = 0; i < title_len && tx + 8 < close_x; i++) {
-        // Draw each char pixel-by-pixel into the decoration surface
-        // (Simple embedded 8x16 font rendering into surface)
-        for (int gy = 0; gy < 16 && (ty + gy) < h; gy++) {
-            for (int gx = 0; gx < 8 && (tx + gx) < w; gx++) {
-                // Use the global font to get glyph pixels
-                // For simplicity, we'll render title at composite time via draw_string
-            }
-        }
-        tx += 8;
-    }
+    int fit = 0;
+    while (fit < title_len && 6 + fit * 8 + 8 < close_x) fit++;
+    font_draw_text(dec->pixels, w, w, h, 6, 4, win->title, fit, DECO_TEXT_COLOR);
 
     dec->dirty = 1;
 }
@@ -228,30 +280,10 @@ static void draw_decoration(comp_window_t* win) {
 // Compositing
 // ============================================================
 
-// Alpha-blend src pixel over dst (ARGB8888)
-static uint32_t alpha_blend(uint32_t dst, uint32_t src, uint8_t extra_alpha) {
-    uint32_t sa = ((src >> 24) & 0xFF) * extra_alpha / 255;
-    if (sa == 0) return dst;
-    if (sa == 255) return src | 0xFF000000;
-
-    uint32_t sr = (src >> 16) & 0xFF;
-    uint32_t sg = (src >> 8)  & 0xFF;
-    uint32_t sb = src & 0xFF;
-    uint32_t dr = (dst >> 16) & 0xFF;
-    uint32_t dg = (dst >> 8)  & 0xFF;
-    uint32_t db = dst & 0xFF;
-
-    uint32_t inv = 255 - sa;
-    uint32_t or_val = (sr * sa + dr * inv) / 255;
-    uint32_t og = (sg * sa + dg * inv) / 255;
-    uint32_t ob = (sb * sa + db * inv) / 255;
-
-    return 0xFF000000 | (or_val << 16) | (og << 8) | ob;
-}
-
-// Blit surface onto backbuffer at (dx, dy) with clipping
+// Blit surface onto backbuffer at (dx, dy) with clipping. An opaque blit
+// (full opacity, no per-pixel alpha) is a copy, anything else a blend.
 static void blit_surface(comp_surface_t* surf, int dx, int dy, uint8_t opacity,
-                          comp_rect_t* clip) {
+                          comp_rect_t* clip, int opaque) {
     if (!surf || !surf->pixels) return;
 
     int sx_start = 0, sy_start = 0;
@@ -280,17 +312,12 @@ static void blit_surface(comp_surface_t* surf, int dx, int dy, uint8_t opacity,
         if (blit_w <= 0 || blit_h <= 0) return;
     }
 
-    for (int y = 0; y < blit_h; y++) {
-        int src_y = sy_start + y;
-        int dst_y = dy + y;
-        for (int x = 0; x < blit_w; x++) {
-            int src_x = sx_start + x;
-            int dst_x = dx + x;
-            uint32_t src_pixel = surf->pixels[src_y * surf->pitch + src_x];
-            uint32_t dst_pixel = backbuf[dst_y * screen_width + dst_x];
-            backbuf[dst_y * screen_width + dst_x] = alpha_blend(dst_pixel, src_pixel, opacity);
-        }
-    }
+    uint32_t* dst = &backbuf[dy * screen_width + dx];
+    const uint32_t* src = &surf->pixels[sy_start * surf->pitch + sx_start];
+    if (opaque)
+        pixel_copy(dst, screen_width, src, surf->pitch, blit_w, blit_h);
+    else
+        pixel_blend(dst, screen_width, src, surf->pitch, blit_w, blit_h, opacity);
 }
 
 // Apply animation transform to get effective position/opacity
@@ -312,11 +339,11 @@ static void apply_animation(comp_window_t* win, int* eff_x, int* eff_y,
         *eff_opacity = (uint8_t)((1.0f - t) * (float)win->opacity);
         break;
     case ANIM_SLIDE_UP:
-        *eff_y = win->y + (int)((1.0f - t) * 50.0f);
+        *eff_y = win->y + (int)((1.0f - t) * (float)ANIM_SLIDE_PX);
         *eff_opacity = (uint8_t)(t * (float)win->opacity);
         break;
     case ANIM_SLIDE_DOWN:
-        *eff_y = win->y - (int)((1.0f - t) * 50.0f);
+        *eff_y = win->y - (int)((1.0f - t) * (float)ANIM_SLIDE_PX);
         *eff_opacity = (uint8_t)(t * (float)win->opacity);
         break;
     case ANIM_SCALE_IN:
@@ -337,7 +364,9 @@ static void tick_animation(comp_window_t* win) {
     win->anim_progress = (float)win->anim_frame / (float)win->anim_total;
 
     if (win->anim_frame >= win->anim_total) {
-        // Animation done
+        // Animation done: the resting (or vanished) window replaces the
+        // last animated frame
+        damage_window(win);
         if (win->anim_type == ANIM_FADE_OUT || win->anim_type == ANIM_SCALE_OUT) {
             win->flags &= ~COMP_WIN_VISIBLE;
         }
@@ -373,7 +402,27 @@ int compositor_init(void) {
     comp.backbuf.pitch = screen_width;
     comp.backbuf.format = SURFACE_FORMAT_ARGB8888;
 
-    comp.use_gpu = gpu_state.initialized;
+    // GPU backend: an NV50+ 2D engine, scanout in VRAM and room there for
+    // the composition buffer. Surfaces allocated from here on get VRAM
+    // twins.
+    nv_2d_state_t* nv2d = nv_2d_get_state();
+    comp.use_gpu = 0;
+    comp.page_flip = 0;
+    if (gpu_state.display_active && nv2d->initialized && nv2d->use_nv50_engine) {
+        comp.flip_head = nv_display_active_head();
+        if (gpu_state.display_width == screen_width &&
+            gpu_state.display_height == screen_height &&
+            gpu_state.display_pitch == screen_width * 4 &&
+            nv_display_flip_init(comp.flip_head) == 0) {
+            comp.backbuf.vram_offset = nv_display_back_offset(comp.flip_head);
+            comp.page_flip = 1;
+            comp.use_gpu = 1;
+        } else if (nv_bo_new((uint64_t)screen_width * screen_height * 4, NV_MEM_VRAM,
+                             &comp.backbuf.bo) == 0) {
+            comp.backbuf.vram_offset = (uint32_t)comp.backbuf.bo.gpu_offset;
+            comp.use_gpu = 1;
+        }
+    }
     comp.full_redraw = 1;
 
     // Default cursor (simple arrow, 16x16)
@@ -398,6 +447,17 @@ int compositor_init(void) {
         }
     }
 
+    // With a display engine running, the cursor goes on its hardware plane
+    if (gpu_state.display_active && comp.cursor_surface.pixels) {
+        int head = nv_display_active_head();
+        if (nv_cursor_init(head) == 0) {
+            comp.hw_cursor = 1;
+            nv_cursor_set_image(head, comp.cursor_surface.pixels, 16, 16);
+            nv_cursor_move(head, comp.cursor_x, comp.cursor_y);
+            nv_cursor_show(head);
+        }
+    }
+
     comp.initialized = 1;
     return 0;
 }
@@ -412,6 +472,10 @@ void compositor_shutdown(void) {
     }
     surface_free(&comp.wallpaper);
     surface_free(&comp.cursor_surface);
+    if (comp.hw_cursor) nv_cursor_hide(nv_display_active_head());
+    comp.hw_cursor = 0;
+    if (comp.backbuf.bo.size) nv_bo_del(&comp.backbuf.bo);
+    comp.use_gpu = 0;
     comp.initialized = 0;
 }
 
@@ -419,75 +483,367 @@ void compositor_shutdown(void) {
 // Compositing
 // ============================================================
 
-void compositor_composite(void) {
-    if (!comp.initialized) return;
+// Rebuild the back-to-front window list: by layer, then z-order
+static void rebuild_stack(void) {
+    int n = 0;
+    for (int i = 0; i < COMP_MAX_WINDOWS; i++) {
+        comp_window_t* win = &comp.windows[i];
+        if (!win->active) continue;
+        int j = n++;
+        while (j > 0) {
+            comp_window_t* prev = &comp.windows[comp.stack[j - 1]];
+            if (prev->layer < win->layer ||
+                (prev->layer == win->layer && prev->z_order <= win->z_order)) break;
+            comp.stack[j] = comp.stack[j - 1];
+            j--;
+        }
+        comp.stack[j] = i;
+    }
+    comp.stack_count = n;
+    comp.stack_dirty = 0;
+}
 
-    // Step 1: Draw background
-    if (comp.wallpaper.pixels) {
-        // Blit wallpaper
-        blit_surface(&comp.wallpaper, 0, 0, 255, 0);
-    } else {
-        // Solid color fill
-        for (int i = 0; i < comp.screen_w * comp.screen_h; i++) {
-            backbuf[i] = comp.bg_color;
+// ---- Occlusion ----
+
+// A window is opaque when nothing below it can show through: full
+// opacity and no per-pixel alpha. Its decoration covers the rest of its
+// bounds (title bar and borders are solid).
+static int window_opaque(comp_window_t* win, uint8_t eff_opacity) {
+    return eff_opacity == 255 && !(win->flags & COMP_WIN_TRANSPARENT);
+}
+
+// Remove 'cut' from a rect list, splitting what it overlaps into up to
+// four pieces. If the pieces would not fit, the list is left as it was:
+// keeping covered area is safe (it is just painted and then painted over).
+static void region_subtract(comp_rect_t* list, int* count, const comp_rect_t* cut) {
+    comp_rect_t out[COMP_REGION_RECTS];
+    int n = 0;
+    for (int i = 0; i < *count; i++) {
+        comp_rect_t* r = &list[i];
+        comp_rect_t in;
+        if (!rect_intersect(r, (comp_rect_t*)cut, &in)) {
+            if (n == COMP_REGION_RECTS) return;
+            out[n++] = *r;
+            continue;
+        }
+        comp_rect_t piece[4] = {
+            { r->x, r->y, r->w, in.y - r->y },                                  // Above
+            { r->x, in.y + in.h, r->w, r->y + r->h - (in.y + in.h) },           // Below
+            { r->x, in.y, in.x - r->x, in.h },                                  // Left
+            { in.x + in.w, in.y, r->x + r->w - (in.x + in.w), in.h },           // Right
+        };
+        for (int p = 0; p < 4; p++) {
+            if (piece[p].w <= 0 || piece[p].h <= 0) continue;
+            if (n == COMP_REGION_RECTS) return;
+            out[n++] = piece[p];
         }
     }
+    for (int i = 0; i < n; i++) list[i] = out[i];
+    *count = n;
+}
 
-    // Step 2: Composite windows back-to-front by layer, then z-order
-    for (int layer = 0; layer < LAYER_NUM; layer++) {
-        // Find windows in this layer, sorted by z_order
-        for (int z = 0; z < COMP_MAX_WINDOWS; z++) {
-            for (int i = 0; i < COMP_MAX_WINDOWS; i++) {
-                comp_window_t* win = &comp.windows[i];
-                if (!win->active) continue;
-                if (!(win->flags & COMP_WIN_VISIBLE)) continue;
-                if (win->layer != layer) continue;
-                if (win->z_order != z) continue;
-
-                int eff_x, eff_y;
-                uint8_t eff_opacity;
-                apply_animation(win, &eff_x, &eff_y, &eff_opacity);
-
-                if (eff_opacity == 0) continue;
-
-                // Draw decoration first (if decorated)
-                if ((win->flags & COMP_WIN_DECORATED) && win->decoration.pixels) {
-                    draw_decoration(win);
-                    blit_surface(&win->decoration, eff_x - DECO_BORDER_WIDTH,
-                                eff_y - DECO_TITLE_HEIGHT, eff_opacity, 0);
-
-                    // Draw title text on top of decoration
-                    if (win->title[0]) {
-                        int tx = eff_x + 4;
-                        int ty = eff_y - DECO_TITLE_HEIGHT + 4;
-                        // Use graphics draw_string for title
-                        draw_string(tx, ty, win->title, DECO_TEXT_COLOR);
-                    }
-                }
+// Visible parts of each window within the rectangle being repainted
+static comp_rect_t vis_pool[COMP_VIS_RECTS];
+static int vis_start[COMP_MAX_WINDOWS];
+static int vis_count[COMP_MAX_WINDOWS];     // -1: pool ran out, paint the whole clip
+
+static void blit_window(comp_window_t* win, comp_rect_t* clip, int ex, int ey,
+                        uint8_t opacity, int opaque) {
+    comp_rect_t b;
+    window_bounds(win, ex, ey, &b);
+
+    // Decoration first (if decorated)
+    if ((win->flags & COMP_WIN_DECORATED) && win->decoration.pixels)
+        blit_surface(&win->decoration, b.x, b.y, opacity, clip, opaque);
+
+    blit_surface(&win->surface, ex, ey, opacity, clip, opaque);
+}
+
+// ---- GPU backend ----
+
+static void gpu_set_target(void) {
+    nv_2d_set_dst(comp.backbuf.vram_offset, comp.screen_w, comp.screen_h,
+                  comp.screen_w * 4, NV50_2D_FMT_A8R8G8B8);
+}
 
-                // Draw window content
-                blit_surface(&win->surface, eff_x, eff_y, eff_opacity, 0);
+// Copy rows of a surface's CPU pixels into its VRAM twin
+static void gpu_upload(comp_surface_t* surf, int x, int y, int w, int h) {
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > surf->width) w = surf->width - x;
+    if (y + h > surf->height) h = surf->height - y;
+    if (w <= 0 || h <= 0) return;
+    nv_2d_set_dst(surf->vram_offset, surf->width, surf->height, surf->pitch * 4,
+                  NV50_2D_FMT_A8R8G8B8);
+    for (int j = 0; j < h; j++)
+        nv_2d_copy_from_cpu(x, y + j, w, 1, &surf->pixels[(y + j) * surf->pitch + x]);
+}
+
+static void gpu_sync_surface(comp_surface_t* surf) {
+    if (!surf->pixels || !surf->bo.size || !surf->dirty) return;
+    gpu_upload(surf, 0, 0, surf->width, surf->height);
+    surf->dirty = 0;
+}
+
+// Bring every VRAM twin up to date: whole surfaces that were redrawn,
+// otherwise just the rectangles clients reported
+static void gpu_sync(void) {
+    gpu_sync_surface(&comp.wallpaper);
+    if (!comp.hw_cursor) gpu_sync_surface(&comp.cursor_surface);
+    for (int s = 0; s < comp.stack_count; s++) {
+        comp_window_t* win = &comp.windows[comp.stack[s]];
+        gpu_sync_surface(&win->decoration);
+        if (win->full_damage) win->surface.dirty = 1;
+        if (win->surface.dirty) {
+            gpu_sync_surface(&win->surface);
+        } else if (win->surface.bo.size) {
+            for (int i = 0; i < win->damage_count; i++)
+                gpu_upload(&win->surface, win->damage[i].x, win->damage[i].y,
+                           win->damage[i].w, win->damage[i].h);
+        }
+        win->damage_count = 0;
+        win->full_damage = 0;
+    }
+}
 
-                // Tick animation
-                tick_animation(win);
+// Blit a surface's VRAM twin into the composition buffer, clipped
+static void gpu_blit_surface(comp_surface_t* surf, int dx, int dy, comp_rect_t* clip, int blend) {
+    comp_rect_t r = { dx, dy, surf->width, surf->height };
+    comp_rect_t in;
+    if (!rect_intersect(&r, clip, &in)) return;
+    nv_2d_set_src(surf->bo.gpu_offset, surf->width, surf->height, surf->pitch * 4,
+                  NV50_2D_FMT_A8R8G8B8);
+    if (blend) nv_2d_blit_blend(in.x, in.y, in.x - dx, in.y - dy, in.w, in.h);
+    else nv_2d_blit(in.x, in.y, in.x - dx, in.y - dy, in.w, in.h);
+}
+
+static int gpu_has(comp_surface_t* surf) {
+    return !surf->pixels || surf->bo.size;
+}
+
+// The 2D engine blends by per-pixel alpha only, so a rectangle showing a
+// window at partial opacity, or a surface without a VRAM twin, is left to
+// the CPU
+static int gpu_can_composite(const uint8_t* eff_opacity) {
+    if (!gpu_has(&comp.wallpaper)) return 0;
+    if (comp.cursor_visible && !comp.hw_cursor && !gpu_has(&comp.cursor_surface)) return 0;
+    for (int s = 0; s < comp.stack_count; s++) {
+        if (vis_count[s] == 0) continue;
+        comp_window_t* win = &comp.windows[comp.stack[s]];
+        if (eff_opacity[s] != 255 || !gpu_has(&win->surface)) return 0;
+        if ((win->flags & COMP_WIN_DECORATED) && !gpu_has(&win->decoration)) return 0;
+    }
+    return 1;
+}
+
+// Uncovered parts of the rectangle being repainted (the background's share)
+static comp_rect_t uncovered[COMP_REGION_RECTS];
+static int uncovered_count;
+
+// Share a damaged rectangle out among the windows. Walking the stack front
+// to back, each window's share is what is still uncovered within its
+// bounds; only opaque windows cover anything. The shares are then painted
+// back to front, so translucent windows blend over what they let through
+// and nothing under an opaque window is drawn.
+static void compute_visibility(comp_rect_t* clip, const int* eff_x, const int* eff_y,
+                               const uint8_t* eff_opacity) {
+    uncovered_count = 1;
+    uncovered[0] = *clip;
+    int used = 0;
+
+    for (int s = comp.stack_count - 1; s >= 0; s--) {
+        comp_window_t* win = &comp.windows[comp.stack[s]];
+        vis_count[s] = 0;
+        if (!(win->flags & COMP_WIN_VISIBLE) || eff_opacity[s] == 0 || uncovered_count == 0) continue;
+
+        comp_rect_t b;
+        window_bounds(win, eff_x[s], eff_y[s], &b);
+        vis_start[s] = used;
+        for (int i = 0; i < uncovered_count; i++) {
+            if (used == COMP_VIS_RECTS) {
+                vis_count[s] = -1;
+                break;
+            }
+            if (rect_intersect(&uncovered[i], &b, &vis_pool[used])) {
+                used++;
+                vis_count[s]++;
             }
         }
+        if (window_opaque(win, eff_opacity[s])) region_subtract(uncovered, &uncovered_count, &b);
     }
+}
 
-    // Step 3: Draw cursor
-    if (comp.cursor_visible && comp.cursor_surface.pixels) {
-        blit_surface(&comp.cursor_surface, comp.cursor_x, comp.cursor_y, 255, 0);
+static void paint_cpu(comp_rect_t* clip, const int* eff_x, const int* eff_y,
+                      const uint8_t* eff_opacity) {
+    // Background, where no opaque window covers it
+    for (int i = 0; i < uncovered_count; i++) {
+        comp_rect_t* u = &uncovered[i];
+        if (comp.wallpaper.pixels) {
+            blit_surface(&comp.wallpaper, 0, 0, 255, u, 1);
+        } else {
+            for (int y = u->y; y < u->y + u->h; y++) {
+                uint32_t* row = &backbuf[y * screen_width];
+                for (int x = u->x; x < u->x + u->w; x++) row[x] = comp.bg_color;
+            }
+        }
     }
 
+    for (int s = 0; s < comp.stack_count; s++) {
+        if (vis_count[s] == 0) continue;
+        comp_window_t* win = &comp.windows[comp.stack[s]];
+        int opaque = window_opaque(win, eff_opacity[s]);
+        if (vis_count[s] < 0) {
+            blit_window(win, clip, eff_x[s], eff_y[s], eff_opacity[s], opaque);
+            continue;
+        }
+        for (int i = 0; i < vis_count[s]; i++)
+            blit_window(win, &vis_pool[vis_start[s] + i], eff_x[s], eff_y[s], eff_opacity[s], opaque);
+    }
+
+    if (comp.cursor_visible && !comp.hw_cursor && comp.cursor_surface.pixels) {
+        blit_surface(&comp.cursor_surface, comp.cursor_x, comp.cursor_y, 255, clip, 0);
+    }
+}
+
+// The same painting with 2D-engine fills and blits into the VRAM
+// composition buffer. Every window in the rectangle is at full opacity
+// (gpu_can_composite), so blending is by per-pixel alpha alone.
+static void gpu_window(comp_window_t* win, comp_rect_t* clip, int ex, int ey, int blend) {
+    comp_rect_t b;
+    window_bounds(win, ex, ey, &b);
+    if ((win->flags & COMP_WIN_DECORATED) && win->decoration.pixels)
+        gpu_blit_surface(&win->decoration, b.x, b.y, clip, blend);
+    gpu_blit_surface(&win->surface, ex, ey, clip, blend);
+}
+
+static void paint_gpu(comp_rect_t* clip, const int* eff_x, const int* eff_y) {
+    gpu_set_target();
+    for (int i = 0; i < uncovered_count; i++) {
+        if (comp.wallpaper.pixels) gpu_blit_surface(&comp.wallpaper, 0, 0, &uncovered[i], 0);
+        else nv_2d_rect_fill(uncovered[i].x, uncovered[i].y, uncovered[i].w, uncovered[i].h, comp.bg_color);
+    }
+
+    for (int s = 0; s < comp.stack_count; s++) {
+        if (vis_count[s] == 0) continue;
+        comp_window_t* win = &comp.windows[comp.stack[s]];
+        int blend = (win->flags & COMP_WIN_TRANSPARENT) != 0;
+        if (vis_count[s] < 0) {
+            gpu_window(win, clip, eff_x[s], eff_y[s], blend);
+            continue;
+        }
+        for (int i = 0; i < vis_count[s]; i++)
+            gpu_window(win, &vis_pool[vis_start[s] + i], eff_x[s], eff_y[s], blend);
+    }
+
+    if (comp.cursor_visible && !comp.hw_cursor && comp.cursor_surface.pixels)
+        gpu_blit_surface(&comp.cursor_surface, comp.cursor_x, comp.cursor_y, clip, 1);
+}
+
+static void composite_rect(comp_rect_t* clip, const int* eff_x, const int* eff_y,
+                           const uint8_t* eff_opacity) {
+    compute_visibility(clip, eff_x, eff_y, eff_opacity);
+    if (!comp.use_gpu) {
+        paint_cpu(clip, eff_x, eff_y, eff_opacity);
+    } else if (gpu_can_composite(eff_opacity)) {
+        paint_gpu(clip, eff_x, eff_y);
+    } else {
+        // Composite on the CPU, then hand the result to the VRAM buffer
+        paint_cpu(clip, eff_x, eff_y, eff_opacity);
+        gpu_upload(&comp.backbuf, clip->x, clip->y, clip->w, clip->h);
+    }
+}
+
+// Only the damaged parts of the screen are recomposited; the damage list
+// is kept for compositor_flip(), which copies just those rectangles out.
+void compositor_composite(void) {
+    if (!comp.initialized) return;
+    TRACE(TRACE_FRAME, comp.frame_count, TRACE_FRAME_BEGIN);
+    frame_begin(comp.use_gpu);
+    if (comp.stack_dirty) rebuild_stack();
+
+    // Animated windows change every frame (a finishing one damages itself)
+    for (int s = 0; s < comp.stack_count; s++) {
+        comp_window_t* win = &comp.windows[comp.stack[s]];
+        if (!(win->flags & COMP_WIN_VISIBLE)) continue;
+        tick_animation(win);
+        if (win->anim_type != ANIM_NONE) damage_window(win);
+    }
+
+    comp_rect_t screen = { 0, 0, comp.screen_w, comp.screen_h };
+    if (comp.full_redraw) {
+        comp.damage[0] = screen;
+        comp.damage_count = 1;
+    }
+
+    int eff_x[COMP_MAX_WINDOWS], eff_y[COMP_MAX_WINDOWS];
+    uint8_t eff_opacity[COMP_MAX_WINDOWS];
+    for (int s = 0; s < comp.stack_count; s++)
+        apply_animation(&comp.windows[comp.stack[s]], &eff_x[s], &eff_y[s], &eff_opacity[s]);
+
+    // Clip the damage to the screen, dropping what falls outside it
+    int n = 0;
+    for (int i = 0; i < comp.damage_count; i++) {
+        if (rect_intersect(&comp.damage[i], &screen, &comp.damage[n])) n++;
+    }
+    comp.damage_count = n;
+
+    if (comp.page_flip) {
+        // The back buffer still holds the frame before last, and may still
+        // be on screen until the queued flip happens. It needs last
+        // frame's damage as well as this one's.
+        frame_mark(FRAME_COMPOSITE);
+        nv_display_wait_flip(comp.flip_head);
+        frame_mark(FRAME_VBLANK);
+        TRACE(TRACE_FRAME, comp.frame_count, TRACE_FRAME_FLIPPED);
+        comp_rect_t fresh[COMP_DAMAGE_RECTS];
+        int nfresh = comp.damage_count;
+        memcpy(fresh, comp.damage, sizeof(comp_rect_t) * nfresh);
+        for (int i = 0; i < comp.prev_damage_count; i++)
+            add_damage(comp.damage, &comp.damage_count, COMP_DAMAGE_RECTS,
+                       comp.prev_damage[i].x, comp.prev_damage[i].y,
+                       comp.prev_damage[i].w, comp.prev_damage[i].h);
+        memcpy(comp.prev_damage, fresh, sizeof(comp_rect_t) * nfresh);
+        comp.prev_damage_count = nfresh;
+    }
+
+    TRACE(TRACE_FRAME, comp.frame_count, TRACE_FRAME_DRAW);
+    if (comp.use_gpu) gpu_sync();
+    for (int i = 0; i < comp.damage_count; i++)
+        composite_rect(&comp.damage[i], eff_x, eff_y, eff_opacity);
+
+    TRACE(TRACE_FRAME, comp.frame_count, TRACE_FRAME_DONE);
+    frame_mark(FRAME_COMPOSITE);
     comp.frame_count++;
     comp.full_redraw = 0;
 }
 
 void compositor_flip(void) {
-    // Copy backbuf to framebuffer (using existing graphics infrastructure)
-    // flip_buffer() in graphics.c does this
-    extern void flip_buffer(void);
-    flip_buffer();
+    TRACE(TRACE_FRAME, comp.frame_count - 1, TRACE_FRAME_PRESENT);
+    if (comp.page_flip) {
+        // Show the finished frame; the other buffer becomes the target
+        nv_2d_wait_idle();
+        frame_mark(FRAME_FLIP);
+        nv_display_flip(comp.flip_head, comp.vsync_enabled);
+        frame_mark(FRAME_VBLANK);
+        comp.backbuf.vram_offset = nv_display_back_offset(comp.flip_head);
+    } else if (comp.use_gpu) {
+        // VRAM composition buffer -> scanout, by the 2D engine
+        nv_2d_set_src(comp.backbuf.bo.gpu_offset, comp.screen_w, comp.screen_h,
+                      comp.screen_w * 4, NV50_2D_FMT_A8R8G8B8);
+        nv_2d_set_dst(gpu_state.fb_offset, comp.screen_w, comp.screen_h,
+                      gpu_state.display_pitch, NV50_2D_FMT_A8R8G8B8);
+        for (int i = 0; i < comp.damage_count; i++)
+            nv_2d_blit(comp.damage[i].x, comp.damage[i].y, comp.damage[i].x, comp.damage[i].y,
+                       comp.damage[i].w, comp.damage[i].h);
+        frame_mark(FRAME_FLIP);
+    } else {
+        for (int i = 0; i < comp.damage_count; i++)
+            gfx_damage(comp.damage[i].x, comp.damage[i].y, comp.damage[i].w, comp.damage[i].h);
+        flip_damage();
+        frame_mark(FRAME_FLIP);
+    }
+    comp.damage_count = 0;
+    frame_end();
 }
 
 // ============================================================
@@ -544,7 +900,8 @@ int compositor_create_window(int x, int y, int w, int h, uint32_t flags) {
     }
 
     comp.window_count++;
-    comp.full_redraw = 1;
+    comp.stack_dirty = 1;
+    damage_window(win);
 
     return win->id;
 }
@@ -552,18 +909,15 @@ int compositor_create_window(int x, int y, int w, int h, uint32_t flags) {
 void compositor_destroy_window(int win_id) {
     for (int i = 0; i < COMP_MAX_WINDOWS; i++) {
         if (comp.windows[i].active && comp.windows[i].id == win_id) {
-            // Add damage for the window area
+            // What it covered shows through
             comp_window_t* win = &comp.windows[i];
-            add_damage(comp.damage, &comp.damage_count, COMP_DAMAGE_RECTS,
-                      win->x - DECO_BORDER_WIDTH, win->y - DECO_TITLE_HEIGHT,
-                      win->width + 2 * DECO_BORDER_WIDTH,
-                      win->height + DECO_TITLE_HEIGHT + DECO_BORDER_WIDTH);
+            damage_window(win);
 
             surface_free(&win->surface);
             surface_free(&win->decoration);
             win->active = 0;
             comp.window_count--;
-            comp.full_redraw = 1;
+            comp.stack_dirty = 1;
             break;
         }
     }
@@ -573,25 +927,17 @@ void compositor_move_window(int win_id, int x, int y) {
     comp_window_t* win = compositor_get_window(win_id);
     if (!win) return;
 
-    // Damage old position
-    add_damage(comp.damage, &comp.damage_count, COMP_DAMAGE_RECTS,
-              win->x - DECO_BORDER_WIDTH, win->y - DECO_TITLE_HEIGHT,
-              win->width + 2 * DECO_BORDER_WIDTH,
-              win->height + DECO_TITLE_HEIGHT + DECO_BORDER_WIDTH);
-
+    // Damage old and new positions
+    damage_window(win);
     win->x = x;
     win->y = y;
-
-    // Damage new position
-    add_damage(comp.damage, &comp.damage_count, COMP_DAMAGE_RECTS,
-              x - DECO_BORDER_WIDTH, y - DECO_TITLE_HEIGHT,
-              win->width + 2 * DECO_BORDER_WIDTH,
-              win->height + DECO_TITLE_HEIGHT + DECO_BORDER_WIDTH);
+    damage_window(win);
 }
 
 void compositor_resize_window(int win_id, int w, int h) {
     comp_window_t* win = compositor_get_window(win_id);
     if (!win) return;
+    damage_window(win);
 
     surface_free(&win->surface);
     if (surface_alloc(&win->surface, w, h) < 0) return;
@@ -608,7 +954,7 @@ void compositor_resize_window(int win_id, int w, int h) {
 
     win->width = w;
     win->height = h;
-    comp.full_redraw = 1;
+    damage_window(win);
 }
 
 void compositor_set_title(int win_id, const char* title) {
@@ -617,6 +963,8 @@ void compositor_set_title(int win_id, const char* title) {
     str_copy(win->title, title, 64);
     if (win->flags & COMP_WIN_DECORATED) {
         draw_decoration(win);
+        damage_rect(win->x - DECO_BORDER_WIDTH, win->y - DECO_TITLE_HEIGHT,
+                    win->width + 2 * DECO_BORDER_WIDTH, DECO_TITLE_HEIGHT);
     }
 }
 
@@ -624,14 +972,14 @@ void compositor_show_window(int win_id) {
     comp_window_t* win = compositor_get_window(win_id);
     if (!win) return;
     win->flags |= COMP_WIN_VISIBLE;
-    comp.full_redraw = 1;
+    damage_window(win);
 }
 
 void compositor_hide_window(int win_id) {
     comp_window_t* win = compositor_get_window(win_id);
     if (!win) return;
     win->flags &= ~COMP_WIN_VISIBLE;
-    comp.full_redraw = 1;
+    damage_window(win);
 }
 
 void compositor_focus_window(int win_id) {
@@ -640,6 +988,7 @@ void compositor_focus_window(int win_id) {
     if (old) {
         old->flags &= ~COMP_WIN_FOCUSED;
         if (old->flags & COMP_WIN_DECORATED) draw_decoration(old);
+        damage_window(old);
     }
 
     comp.focused_id = win_id;
@@ -657,22 +1006,24 @@ void compositor_focus_window(int win_id) {
             }
         }
         win->z_order = max_z + 1;
+        damage_window(win);
+        comp.stack_dirty = 1;
     }
-    comp.full_redraw = 1;
 }
 
 void compositor_set_layer(int win_id, int layer) {
     comp_window_t* win = compositor_get_window(win_id);
     if (!win || layer < 0 || layer >= LAYER_NUM) return;
     win->layer = layer;
-    comp.full_redraw = 1;
+    damage_window(win);
+    comp.stack_dirty = 1;
 }
 
 void compositor_set_opacity(int win_id, uint8_t opacity) {
     comp_window_t* win = compositor_get_window(win_id);
     if (!win) return;
     win->opacity = opacity;
-    comp.full_redraw = 1;
+    damage_window(win);
 }
 
 // ============================================================
@@ -698,7 +1049,33 @@ void compositor_window_damage_full(int win_id) {
     comp_window_t* win = compositor_get_window(win_id);
     if (!win) return;
     win->full_damage = 1;
-    comp.full_redraw = 1;
+    damage_rect(win->x, win->y, win->width, win->height);
+}
+
+int compositor_attach_shm(int win_id, int shmid, int pitch) {
+    comp_window_t* win = compositor_get_window(win_id);
+    if (!win || pitch < win->width) return -1;
+    uint64_t phys, size;
+    if (shm_pin(shmid, &phys, &size) < 0) return -1;
+    if ((uint64_t)pitch * win->height * 4 > size) {
+        shm_unpin(shmid);
+        return -1;
+    }
+
+    // The segment is one physical run, reached through the identity map
+    comp_surface_t* surf = &win->surface;
+    surface_free(surf);
+    surf->width = win->width;
+    surf->height = win->height;
+    surf->pitch = pitch;
+    surf->format = SURFACE_FORMAT_ARGB8888;
+    surf->pixels = (uint32_t*)phys;
+    surf->shm_backed = 1;
+    surf->shm_id = shmid;
+    surf->dirty = 1;
+    surface_alloc_twin(surf);
+    compositor_window_damage_full(win_id);
+    return 0;
 }
 
 // ============================================================
@@ -723,31 +1100,47 @@ void compositor_set_bg_color(uint32_t color) {
 // Cursor
 // ============================================================
 
+// With hw_cursor the cursor is never in the composited image: changing it
+// writes the display's cursor registers (and its image to VRAM) only
+
 void compositor_set_cursor(const uint32_t* pixels, int w, int h) {
+    if (!comp.hw_cursor)
+        damage_rect(comp.cursor_x, comp.cursor_y, comp.cursor_surface.width, comp.cursor_surface.height);
     surface_free(&comp.cursor_surface);
     if (surface_alloc(&comp.cursor_surface, w, h) < 0) return;
     for (int i = 0; i < w * h; i++) {
         comp.cursor_surface.pixels[i] = pixels[i];
     }
+    if (comp.hw_cursor) nv_cursor_set_image(nv_display_active_head(), comp.cursor_surface.pixels, w, h);
+    else damage_rect(comp.cursor_x, comp.cursor_y, w, h);
 }
 
 void compositor_move_cursor(int x, int y) {
-    // Damage old cursor position
-    add_damage(comp.damage, &comp.damage_count, COMP_DAMAGE_RECTS,
-              comp.cursor_x, comp.cursor_y,
-              comp.cursor_surface.width, comp.cursor_surface.height);
-
+    if (comp.hw_cursor) {
+        comp.cursor_x = x;
+        comp.cursor_y = y;
+        nv_cursor_move(nv_display_active_head(), x, y);
+        return;
+    }
+    // Damage old and new cursor positions
+    damage_rect(comp.cursor_x, comp.cursor_y, comp.cursor_surface.width, comp.cursor_surface.height);
     comp.cursor_x = x;
     comp.cursor_y = y;
-
-    // Damage new cursor position
-    add_damage(comp.damage, &comp.damage_count, COMP_DAMAGE_RECTS,
-              x, y, comp.cursor_surface.width, comp.cursor_surface.height);
+    damage_rect(x, y, comp.cursor_surface.width, comp.cursor_surface.height);
 }
 
 void compositor_show_cursor(int show) {
     comp.cursor_visible = show;
-    comp.full_redraw = 1;
+    if (comp.hw_cursor) {
+        if (show) nv_cursor_show(nv_display_active_head());
+        else nv_cursor_hide(nv_display_active_head());
+        return;
+    }
+    damage_rect(comp.cursor_x, comp.cursor_y, comp.cursor_surface.width, comp.cursor_surface.height);
+}
+
+int compositor_hw_cursor(void) {
+    return comp.initialized && comp.hw_cursor;
 }
 
 // ============================================================
@@ -761,6 +1154,7 @@ void compositor_animate_window(int win_id, int anim_type, int frames) {
     win->anim_frame = 0;
     win->anim_total = frames;
     win->anim_progress = 0.0f;
+    damage_window(win);
 }
 
 // ============================================================
@@ -768,39 +1162,16 @@ void compositor_animate_window(int win_id, int anim_type, int frames) {
 // ============================================================
 
 int compositor_window_at(int x, int y) {
-    // Search front-to-back (highest z-order first)
-    int best_id = -1;
-    int best_z = -1;
-    int best_layer = -1;
-
-    for (int i = 0; i < COMP_MAX_WINDOWS; i++) {
-        comp_window_t* win = &comp.windows[i];
-        if (!win->active || !(win->flags & COMP_WIN_VISIBLE)) continue;
-
-        int wx = win->x;
-        int wy = win->y;
-        int ww = win->width;
-        int wh = win->height;
-
-        // Include decoration area
-        if (win->flags & COMP_WIN_DECORATED) {
-            wx -= DECO_BORDER_WIDTH;
-            wy -= DECO_TITLE_HEIGHT;
-            ww += 2 * DECO_BORDER_WIDTH;
-            wh += DECO_TITLE_HEIGHT + DECO_BORDER_WIDTH;
-        }
-
-        if (x >= wx && x < wx + ww && y >= wy && y < wy + wh) {
-            if (win->layer > best_layer ||
-                (win->layer == best_layer && win->z_order > best_z)) {
-                best_id = win->id;
-                best_z = win->z_order;
-                best_layer = win->layer;
-            }
-        }
+    // Search front-to-back
+    if (comp.stack_dirty) rebuild_stack();
+    for (int s = comp.stack_count - 1; s >= 0; s--) {
+        comp_window_t* win = &comp.windows[comp.stack[s]];
+        if (!(win->flags & COMP_WIN_VISIBLE)) continue;
+        comp_rect_t b;
+        window_bounds(win, win->x, win->y, &b);
+        if (x >= b.x && x < b.x + b.w && y >= b.y && y < b.y + b.h) return win->id;
     }
-
-    return best_id;
+    return -1;
 }
 
 comp_window_t* compositor_get_window(int win_id) {
@@ -4,6 +4,7 @@
 #define COMPOSITOR_H
 
 #include "stdint.h"
+#include "nv_mem.h"
 
 // ============================================================
 // Configuration
@@ -12,6 +13,8 @@
 #define COMP_MAX_WINDOWS        64
 #define COMP_MAX_LAYERS         8
 #define COMP_DAMAGE_RECTS       32
+#define COMP_REGION_RECTS       64      // Uncovered pieces of one damage rect
+#define COMP_VIS_RECTS          256     // Visible pieces of all windows, per damage rect
 
 // ============================================================
 // Surface Format
@@ -77,6 +80,9 @@ typedef struct {
     int       format;       // SURFACE_FORMAT_*
     uint32_t  vram_offset;  // GPU VRAM offset (0 = CPU only)
     int       dirty;        // Needs re-upload to GPU
+    nv_bo_t   bo;           // VRAM twin (GPU backend); size 0 if none
+    int       shm_backed;   // pixels is pinned shm segment shm_id, not kmalloc'd
+    int       shm_id;
 } comp_surface_t;
 
 // Window
@@ -118,6 +124,9 @@ typedef struct {
     // Windows
     comp_window_t   windows[COMP_MAX_WINDOWS];
     int             window_count;
+    int             stack[COMP_MAX_WINDOWS];    // Slots back to front (layer, then z-order)
+    int             stack_count;
+    int             stack_dirty;    // A window came, went or changed place
     int             focused_id;
     int             next_window_id;
 
@@ -133,8 +142,9 @@ typedef struct {
     int             cursor_x, cursor_y;
     comp_surface_t  cursor_surface;
     int             cursor_visible;
+    int             hw_cursor;      // Shown by the display's cursor plane, not composited
 
-    // Global damage
+    // Global damage: what the next composite repaints and flip copies out
     comp_rect_t     damage[COMP_DAMAGE_RECTS];
     int             damage_count;
     int             full_redraw;
@@ -146,8 +156,14 @@ typedef struct {
     // Vsync
     int             vsync_enabled;
 
-    // Use GPU acceleration
+    // GPU backend: composite in VRAM with the 2D engine (at
+    // backbuf.vram_offset: backbuf.bo, or with page_flip the display's
+    // back scanout buffer)
     int             use_gpu;
+    int             page_flip;
+    int             flip_head;
+    comp_rect_t     prev_damage[COMP_DAMAGE_RECTS];  // Last frame's, for page_flip
+    int             prev_damage_count;
 } comp_state_t;
 
 // ============================================================
@@ -177,6 +193,13 @@ comp_surface_t* compositor_get_surface(int win_id);
 void compositor_window_damage(int win_id, int x, int y, int w, int h);
 void compositor_window_damage_full(int win_id);
 
+// Use shm segment shmid (one contiguous run, see shm_pin) as the window's
+// client surface: the client draws into its attachment, reports damage as
+// usual and the compositor reads the segment in place. pitch is in pixels.
+// The window keeps it until it is resized, re-attached or destroyed.
+// Returns 0, or -1 if the segment is too small or cannot be pinned.
+int  compositor_attach_shm(int win_id, int shmid, int pitch);
+
 // ---- Background ----
 void compositor_set_wallpaper(const uint32_t* pixels, int w, int h);
 void compositor_set_bg_color(uint32_t color);
@@ -185,6 +208,9 @@ void compositor_set_bg_color(uint32_t color);
 void compositor_set_cursor(const uint32_t* pixels, int w, int h);
 void compositor_move_cursor(int x, int y);
 void compositor_show_cursor(int show);
+// 1 if the cursor is a hardware plane: moving it is a register write and
+// repaints nothing, so other renderers must not draw it either
+int  compositor_hw_cursor(void);
 
 // ---- Animation ----
 void compositor_animate_window(int win_id, int anim_type, int frames);
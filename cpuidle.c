@@ -0,0 +1,159 @@
+// cpuidle.c - CPU Idle States for Alteo OS
+// Each CPU's wake word sits alone on a cache line so that only a wake
+// (not unrelated per-CPU traffic) ends its MWAIT.
+#include "cpuidle.h"
+#include "acpi.h"
+#include "smp.h"
+#include "timer.h"
+
+#define IDLE_POLLING        1U      // In MWAIT on the wake word
+#define IDLE_WAKE           2U      // Woken while polling: look for work
+
+#define IDLE_TIMER_CPU      0       // Owns the LAPIC timer (timer.c)
+#define IDLE_AVG_START_NS   1000000ULL
+
+typedef struct {
+    volatile uint32_t word;         // IDLE_* bits
+    uint32_t pad0;
+    uint64_t avg_ns;                // Running average of idle lengths
+    cpuidle_usage_t usage[CPUIDLE_MAX_STATES];
+} __attribute__((aligned(64))) idle_cpu_t;
+
+static idle_cpu_t idle_cpus[SMP_MAX_CPUS];
+static cpuidle_state_t states[CPUIDLE_MAX_STATES];
+static int nstates = 0;
+static int has_mwait = 0;
+static int has_arat = 0;            // LAPIC timer runs in deep C-states
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static void add_state(const char* name, int use_mwait, uint32_t hint, uint32_t latency_ns) {
+    cpuidle_state_t* s = &states[nstates++];
+    s->name[0] = name[0];
+    s->name[1] = name[1];
+    s->name[2] = 0;
+    s->use_mwait = use_mwait;
+    s->mwait_hint = hint;
+    s->exit_latency_ns = latency_ns;
+    s->target_ns = latency_ns * 3;
+}
+
+void cpuidle_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(0, &a, &b, &c, &d);
+    uint32_t max_leaf = a;
+    cpuid(1, &a, &b, &c, &d);
+    has_mwait = (c >> 3) & 1;
+
+    // Leaf 5: EDX[4n+3:4n] = MWAIT sub-states of C-state n; ECX[1] =
+    // interrupts can be made to end MWAIT (ECX bit 0), relied on as a
+    // backstop to sti
+    uint32_t substates = 0;
+    if (has_mwait && max_leaf >= 5) {
+        cpuid(5, &a, &b, &c, &d);
+        if (!(c & 2)) has_mwait = 0;
+        substates = d;
+    } else {
+        has_mwait = 0;
+    }
+    if (max_leaf >= 6) {
+        cpuid(6, &a, &b, &c, &d);
+        has_arat = (a >> 2) & 1;
+    }
+
+    // FADT worst-case latencies in us; over 100 (C2) or 1000 (C3) means
+    // the state is not supported through the FADT
+    uint32_t c2_us = 50, c3_us = 200;
+    acpi_fadt_t* fadt = acpi_get_fadt();
+    if (fadt) {
+        if (fadt->worst_c2_latency && fadt->worst_c2_latency <= 100) c2_us = fadt->worst_c2_latency;
+        if (fadt->worst_c3_latency && fadt->worst_c3_latency <= 1000) c3_us = fadt->worst_c3_latency;
+    }
+
+    nstates = 0;
+    add_state("C1", has_mwait && ((substates >> 4) & 0xF), 0x00, 1000);
+    if (has_mwait && ((substates >> 8) & 0xF)) add_state("C2", 1, 0x10, c2_us * 1000);
+    if (has_mwait && ((substates >> 12) & 0xF)) add_state("C3", 1, 0x20, c3_us * 1000);
+
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        idle_cpus[i].word = 0;
+        idle_cpus[i].avg_ns = IDLE_AVG_START_NS;
+    }
+}
+
+// Deepest state the predicted idle length pays for
+static int pick_state(int cpu, uint64_t deadline_ns, uint64_t now) {
+    uint64_t predicted = idle_cpus[cpu].avg_ns;
+    if (deadline_ns != ~0ULL) {
+        uint64_t left = deadline_ns > now ? deadline_ns - now : 0;
+        if (left < predicted) predicted = left;
+    }
+    int limit = nstates - 1;
+    if (cpu == IDLE_TIMER_CPU && !has_arat) limit = 0;
+    int best = 0;
+    for (int i = 1; i <= limit; i++) {
+        if (states[i].target_ns <= predicted) best = i;
+    }
+    return best;
+}
+
+void cpuidle_enter(uint64_t deadline_ns) {
+    int cpu = smp_cpu_id();
+    idle_cpu_t* ic = &idle_cpus[cpu];
+    if (nstates == 0) {
+        __asm__ volatile("sti; hlt");
+        return;
+    }
+
+    uint64_t now = timer_now_ns();
+    if (cpu == IDLE_TIMER_CPU) {
+        uint64_t next = timer_next_deadline();
+        if (next < deadline_ns) deadline_ns = next;
+    }
+    int s = pick_state(cpu, deadline_ns, now);
+    const cpuidle_state_t* st = &states[s];
+
+    if (st->use_mwait) {
+        // Announce the poll before arming the monitor, and check for a
+        // wake that came first; one after MONITOR ends the MWAIT
+        __atomic_or_fetch(&ic->word, IDLE_POLLING, __ATOMIC_SEQ_CST);
+        __asm__ volatile("monitor" :: "a"(&ic->word), "c"(0), "d"(0));
+        if (!(ic->word & IDLE_WAKE)) {
+            // sti's one-instruction shadow covers mwait: an interrupt that
+            // is already pending ends it instead of being missed
+            __asm__ volatile("sti; mwait" :: "a"(st->mwait_hint), "c"(1) : "memory");
+        } else {
+            __asm__ volatile("sti");
+        }
+        __atomic_and_fetch(&ic->word, ~(IDLE_POLLING | IDLE_WAKE), __ATOMIC_SEQ_CST);
+    } else {
+        __asm__ volatile("sti; hlt");
+    }
+
+    uint64_t slept = timer_now_ns() - now;
+    ic->usage[s].usage++;
+    ic->usage[s].time_ns += slept;
+    ic->avg_ns = (ic->avg_ns * 3 + slept) / 4;
+}
+
+int cpuidle_wake(int cpu) {
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS) return 0;
+    uint32_t old = __atomic_fetch_or(&idle_cpus[cpu].word, IDLE_WAKE, __ATOMIC_SEQ_CST);
+    return (old & IDLE_POLLING) != 0;
+}
+
+int cpuidle_state_count(void) {
+    return nstates;
+}
+
+const cpuidle_state_t* cpuidle_get_state(int i) {
+    if (i < 0 || i >= nstates) return 0;
+    return &states[i];
+}
+
+const cpuidle_usage_t* cpuidle_get_usage(int cpu) {
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS) return 0;
+    return idle_cpus[cpu].usage;
+}
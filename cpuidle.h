@@ -0,0 +1,57 @@
+// cpuidle.h - CPU Idle States for Alteo OS
+// Puts a CPU with nothing to run into the deepest idle state worth its
+// exit latency. States are C1 (HLT, or MWAIT hint 0) and, where CPUID
+// leaf 5 enumerates them, MWAIT C2/C3 with the FADT's worst-case exit
+// latencies (conservative defaults when the FADT has none). _CST would
+// need an AML interpreter, so it is not read.
+//
+// The idle length is predicted from the next timer deadline (tickless,
+// BSP only) and a running average of how long this CPU's recent idle
+// periods lasted; a state is chosen only if the prediction covers three
+// times its exit latency. Without an always-running APIC timer (ARAT),
+// the CPU that owns the timer stays in C1 so the deadline still fires.
+//
+// A CPU in MWAIT watches its own wake word; cpuidle_wake() ends the wait
+// with a store, so a reschedule needs no IPI. A CPU in HLT still needs one.
+#ifndef CPUIDLE_H
+#define CPUIDLE_H
+
+#include "stdint.h"
+
+#define CPUIDLE_MAX_STATES  4
+
+// One idle state
+typedef struct {
+    char     name[4];           // "C1".. "C3"
+    uint32_t mwait_hint;        // EAX for MWAIT
+    int      use_mwait;         // 0 = HLT
+    uint32_t exit_latency_ns;
+    uint32_t target_ns;         // Shortest idle worth entering it for
+} cpuidle_state_t;
+
+// Per-CPU counters, per state
+typedef struct {
+    uint64_t usage;
+    uint64_t time_ns;
+} cpuidle_usage_t;
+
+// Build the state table (BSP, after acpi_init and timer_init)
+void cpuidle_init(void);
+
+// Idle until an interrupt, a cpuidle_wake() or deadline_ns (~0ULL for
+// none). Call with interrupts disabled after finding nothing to do;
+// returns with them enabled. The caller re-checks its work afterwards.
+void cpuidle_enter(uint64_t deadline_ns);
+
+// Wake CPU cpu from cpuidle_enter(). Returns 1 if it was in MWAIT and the
+// store woke it, 0 if it needs an IPI (or is not idle).
+int cpuidle_wake(int cpu);
+
+// State table
+int cpuidle_state_count(void);
+const cpuidle_state_t* cpuidle_get_state(int i);
+
+// Counters of CPU cpu
+const cpuidle_usage_t* cpuidle_get_usage(int cpu);
+
+#endif
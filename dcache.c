@@ -0,0 +1,185 @@
+// dcache.c - Directory Entry Cache for Alteo OS
+// Entries are chained in hash buckets keyed by (fs, parent, name) and sit
+// on one LRU list, most recently used first. Free entries are chained
+// through hash_next. Lookups may run on any CPU, so one spinlock guards
+// the whole cache; nothing under it sleeps.
+#include "dcache.h"
+#include "klib.h"
+#include "spinlock.h"
+
+typedef struct {
+    const void* fs;             // 0 if the entry is free
+    uint64_t    parent;
+    uint64_t    target;
+    uint32_t    hash;
+    uint8_t     negative;
+    char        name[DCACHE_NAME_MAX + 1];
+    int         hash_next;      // Next entry in the same bucket / free list
+    int         lru_prev;       // Towards the most recently used end
+    int         lru_next;       // Towards the eviction end
+} dcache_entry_t;
+
+static dcache_entry_t entries[DCACHE_ENTRIES];
+static int buckets[DCACHE_HASH_SIZE];
+static int free_head = -1;
+static int lru_head = -1;
+static int lru_tail = -1;
+static lockstat_t dc_lock_stat = LOCKSTAT_INIT("dcache");
+static spinlock_t dc_lock = SPINLOCK_INIT_STAT(dc_lock_stat);
+
+// ---------- Index (dc_lock held) ----------
+
+static uint32_t dc_hash(const void* fs, uint64_t parent, const char* name, int* len) {
+    // FNV-1a over the name, mixed with the directory
+    uint32_t h = 2166136261U;
+    int l = 0;
+    while (name[l]) {
+        h = (h ^ (uint8_t)name[l]) * 16777619U;
+        l++;
+    }
+    *len = l;
+    uint64_t k = (parent * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)(uintptr_t)fs ^ h;
+    k *= 0xFF51AFD7ED558CCDULL;
+    return (uint32_t)(k >> 32);
+}
+
+static int dc_name_eq(const char* a, const char* b) {
+    while (*a && *a == *b) { a++; b++; }
+    return *a == *b;
+}
+
+static int dc_find(const void* fs, uint64_t parent, const char* name, uint32_t h) {
+    int i = buckets[h & (DCACHE_HASH_SIZE - 1)];
+    while (i >= 0) {
+        dcache_entry_t* e = &entries[i];
+        if (e->hash == h && e->fs == fs && e->parent == parent && dc_name_eq(e->name, name)) return i;
+        i = e->hash_next;
+    }
+    return -1;
+}
+
+static void dc_lru_unlink(int i) {
+    dcache_entry_t* e = &entries[i];
+    if (e->lru_prev >= 0) entries[e->lru_prev].lru_next = e->lru_next;
+    else lru_head = e->lru_next;
+    if (e->lru_next >= 0) entries[e->lru_next].lru_prev = e->lru_prev;
+    else lru_tail = e->lru_prev;
+}
+
+static void dc_lru_push(int i) {
+    entries[i].lru_prev = -1;
+    entries[i].lru_next = lru_head;
+    if (lru_head >= 0) entries[lru_head].lru_prev = i;
+    lru_head = i;
+    if (lru_tail < 0) lru_tail = i;
+}
+
+// Unhash an entry and put it on the free list
+static void dc_remove(int i) {
+    dcache_entry_t* e = &entries[i];
+    int* link = &buckets[e->hash & (DCACHE_HASH_SIZE - 1)];
+    while (*link != i) link = &entries[*link].hash_next;
+    *link = e->hash_next;
+    dc_lru_unlink(i);
+    e->fs = 0;
+    e->hash_next = free_head;
+    free_head = i;
+}
+
+static void dc_set(const void* fs, uint64_t parent, const char* name, uint64_t target, int negative) {
+    int len;
+    uint32_t h = dc_hash(fs, parent, name, &len);
+    if (len == 0 || len > DCACHE_NAME_MAX) return;
+
+    spin_lock(&dc_lock);
+    int i = dc_find(fs, parent, name, h);
+    if (i >= 0) {
+        dc_lru_unlink(i);
+    } else {
+        if (free_head < 0) dc_remove(lru_tail);
+        i = free_head;
+        free_head = entries[i].hash_next;
+        dcache_entry_t* e = &entries[i];
+        e->fs = fs;
+        e->parent = parent;
+        e->hash = h;
+        memcpy(e->name, name, len + 1);
+        int b = h & (DCACHE_HASH_SIZE - 1);
+        e->hash_next = buckets[b];
+        buckets[b] = i;
+    }
+    entries[i].target = target;
+    entries[i].negative = (uint8_t)negative;
+    dc_lru_push(i);
+    spin_unlock(&dc_lock);
+}
+
+// ---------- Public API ----------
+
+void dcache_init(void) {
+    memset(entries, 0, sizeof(entries));
+    for (int b = 0; b < DCACHE_HASH_SIZE; b++) buckets[b] = -1;
+    free_head = -1;
+    for (int i = DCACHE_ENTRIES - 1; i >= 0; i--) {
+        entries[i].hash_next = free_head;
+        free_head = i;
+    }
+    lru_head = lru_tail = -1;
+}
+
+int dcache_lookup(const void* fs, uint64_t parent, const char* name, uint64_t* target) {
+    int len;
+    uint32_t h = dc_hash(fs, parent, name, &len);
+    if (len == 0 || len > DCACHE_NAME_MAX) return DCACHE_MISS;
+
+    spin_lock(&dc_lock);
+    int i = dc_find(fs, parent, name, h);
+    int result = DCACHE_MISS;
+    if (i >= 0) {
+        dc_lru_unlink(i);
+        dc_lru_push(i);
+        if (entries[i].negative) {
+            result = DCACHE_NEGATIVE;
+        } else {
+            *target = entries[i].target;
+            result = DCACHE_FOUND;
+        }
+    }
+    spin_unlock(&dc_lock);
+    return result;
+}
+
+void dcache_add(const void* fs, uint64_t parent, const char* name, uint64_t target) {
+    dc_set(fs, parent, name, target, 0);
+}
+
+void dcache_add_negative(const void* fs, uint64_t parent, const char* name) {
+    dc_set(fs, parent, name, 0, 1);
+}
+
+void dcache_forget(const void* fs, uint64_t parent, const char* name) {
+    int len;
+    uint32_t h = dc_hash(fs, parent, name, &len);
+    if (len == 0 || len > DCACHE_NAME_MAX) return;
+
+    spin_lock(&dc_lock);
+    int i = dc_find(fs, parent, name, h);
+    if (i >= 0) dc_remove(i);
+    spin_unlock(&dc_lock);
+}
+
+void dcache_forget_dir(const void* fs, uint64_t parent) {
+    spin_lock(&dc_lock);
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        if (entries[i].fs == fs && entries[i].parent == parent) dc_remove(i);
+    }
+    spin_unlock(&dc_lock);
+}
+
+void dcache_forget_fs(const void* fs) {
+    spin_lock(&dc_lock);
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        if (entries[i].fs == fs) dc_remove(i);
+    }
+    spin_unlock(&dc_lock);
+}
@@ -0,0 +1,49 @@
+// dcache.h - Directory Entry Cache for Alteo OS
+// Remembers the result of looking a name up in a directory, so resolving
+// a path costs one hash probe per component instead of a directory scan.
+// Entries are keyed by (fs, parent, name): fs is any pointer naming the
+// filesystem instance, parent the directory's node or inode number. A
+// name found missing is cached too (a negative entry), so repeated
+// lookups of absent files stay cheap.
+//
+// Filesystems keep the cache honest themselves: a new name replaces any
+// negative entry, a removed name is forgotten (with everything under it
+// if it was a directory). Names longer than DCACHE_NAME_MAX are never
+// cached. The least recently used entry is recycled when the pool is full.
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "stdint.h"
+
+#define DCACHE_ENTRIES      1024
+#define DCACHE_HASH_SIZE    512      // Buckets (power of two)
+#define DCACHE_NAME_MAX     59
+
+// dcache_lookup() results
+#define DCACHE_MISS         -1
+#define DCACHE_NEGATIVE     0        // Known not to exist
+#define DCACHE_FOUND        1
+
+// Set up the entry pool (before any filesystem)
+void dcache_init(void);
+
+// Look name up in directory parent. On DCACHE_FOUND, *target is the
+// cached child.
+int dcache_lookup(const void* fs, uint64_t parent, const char* name, uint64_t* target);
+
+// Record that name in parent is target
+void dcache_add(const void* fs, uint64_t parent, const char* name, uint64_t target);
+
+// Record that parent has no entry called name
+void dcache_add_negative(const void* fs, uint64_t parent, const char* name);
+
+// Drop the entry for name in parent, if cached
+void dcache_forget(const void* fs, uint64_t parent, const char* name);
+
+// Drop every entry inside directory parent (it was removed)
+void dcache_forget_dir(const void* fs, uint64_t parent);
+
+// Drop every entry of a filesystem (unmount, remount)
+void dcache_forget_fs(const void* fs);
+
+#endif
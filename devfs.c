@@ -1,7 +1,10 @@
 // devfs.c - Device Filesystem for Alteo OS
 // Implements /dev with null, zero, random, and console devices
 #include "devfs.h"
+#include "klib.h"
 #include "vfs.h"
+#include "klog.h"
+#include "random.h"
 
 // ---- String helpers ----
 static int dev_strlen(const char* s) { int l = 0; while (s[l]) l++; return l; }
@@ -15,11 +18,6 @@ static void dev_strncpy(char* d, const char* s, int n) {
     while (i < n - 1 && s[i]) { d[i] = s[i]; i++; }
     d[i] = 0;
 }
-static void dev_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
-}
-
 // ---- Device registry ----
 typedef struct {
     char       name[64];
@@ -28,6 +26,7 @@ typedef struct {
     int        minor;
     dev_ops_t  ops;
     int        active;
+    pollsrc_t  pollsrc;     // epoll registrations on this device
 } dev_entry_t;
 
 static dev_entry_t devices[DEVFS_MAX_DEVICES];
@@ -48,7 +47,7 @@ static int null_write(void* data, const void* buf, uint32_t count, uint32_t offs
 // /dev/zero: reads return zero bytes, writes succeed silently
 static int zero_read(void* data, void* buf, uint32_t count, uint32_t offset) {
     (void)data; (void)offset;
-    dev_memset(buf, 0, (int)count);
+    memset(buf, 0, (int)count);
     return (int)count;
 }
 static int zero_write(void* data, const void* buf, uint32_t count, uint32_t offset) {
@@ -56,40 +55,29 @@ static int zero_write(void* data, const void* buf, uint32_t count, uint32_t offs
     return (int)count;
 }
 
-// /dev/random and /dev/urandom: returns pseudo-random bytes
-static uint32_t rand_seed = 12345;
-static uint32_t dev_rand(void) {
-    rand_seed = rand_seed * 1103515245 + 12345;
-    return (rand_seed >> 16) & 0x7FFF;
-}
+// /dev/random and /dev/urandom: the kernel CSPRNG, which never blocks;
+// writes are mixed into its pool
 static int random_read(void* data, void* buf, uint32_t count, uint32_t offset) {
     (void)data; (void)offset;
-    uint8_t* b = (uint8_t*)buf;
-    for (uint32_t i = 0; i < count; i++) {
-        b[i] = (uint8_t)(dev_rand() & 0xFF);
-    }
+    random_get(buf, count);
     return (int)count;
 }
 static int random_write(void* data, const void* buf, uint32_t count, uint32_t offset) {
     (void)data; (void)offset;
-    // Writing to random adds entropy (simplified: update seed)
-    const uint8_t* b = (const uint8_t*)buf;
-    for (uint32_t i = 0; i < count; i++) {
-        rand_seed ^= ((uint32_t)b[i] << (i % 4 * 8));
-    }
+    random_add_bytes(buf, count);
     return (int)count;
 }
 
-// /dev/console: writes go to the VFS /dev/console file (for kernel log)
+// /dev/console: reads return the kernel log's console text from the file
+// offset on; writes are logged, one record per line
 static int console_read(void* data, void* buf, uint32_t count, uint32_t offset) {
-    (void)data; (void)buf; (void)count; (void)offset;
-    return 0; // No input from console device
+    (void)data;
+    uint64_t pos = offset;
+    return klog_console_read(buf, count, &pos);
 }
 static int console_write(void* data, const void* buf, uint32_t count, uint32_t offset) {
     (void)data; (void)offset;
-    // In a full implementation, this would write to the framebuffer terminal
-    // For now, just accept the data
-    (void)buf;
+    klog_write(KLOG_INFO, (const char*)buf, count);
     return (int)count;
 }
 
@@ -259,6 +247,7 @@ int devfs_unregister(const char* name) {
     if (!name) return -1;
     for (int i = 0; i < DEVFS_MAX_DEVICES; i++) {
         if (devices[i].active && dev_strcmp(devices[i].name, name) == 0) {
+            pollsrc_detach(&devices[i].pollsrc);
             devices[i].active = 0;
             char path[128];
             dev_strcpy(path, "/dev/");
@@ -271,9 +260,31 @@ int devfs_unregister(const char* name) {
     return -1;
 }
 
+int devfs_find(const char* name) {
+    if (!name) return -1;
+    return find_dev_by_name(name);
+}
+
+void devfs_notify(const char* name) {
+    int idx = devfs_find(name);
+    if (idx >= 0) pollsrc_notify(&devices[idx].pollsrc);
+}
+
+uint32_t devfs_poll_events(int dev_idx) {
+    if (dev_idx < 0 || dev_idx >= DEVFS_MAX_DEVICES || !devices[dev_idx].active) return EPOLLERR;
+    dev_entry_t* dev = &devices[dev_idx];
+    if (!dev->ops.poll) return EPOLLIN | EPOLLOUT;
+    return dev->ops.poll(dev->ops.dev_data);
+}
+
+pollsrc_t* devfs_get_pollsrc(int dev_idx) {
+    if (dev_idx < 0 || dev_idx >= DEVFS_MAX_DEVICES || !devices[dev_idx].active) return (pollsrc_t*)0;
+    return &devices[dev_idx].pollsrc;
+}
+
 void devfs_init(void) {
-    dev_memset(devices, 0, sizeof(devices));
-    dev_memset(devfs_fds, 0, sizeof(devfs_fds));
+    memset(devices, 0, sizeof(devices));
+    memset(devfs_fds, 0, sizeof(devfs_fds));
 
     // Register built-in devices
 
@@ -289,7 +300,7 @@ void devfs_init(void) {
     dev_ops_t random_ops = { .read = random_read, .write = random_write, .ioctl = 0, .dev_data = 0 };
     devfs_register("random", DEV_TYPE_CHAR, DEV_MAJOR_MEM, DEV_MINOR_RANDOM, &random_ops);
 
-    // /dev/urandom (same as random for now)
+    // /dev/urandom (the same generator)
     dev_ops_t urandom_ops = { .read = random_read, .write = random_write, .ioctl = 0, .dev_data = 0 };
     devfs_register("urandom", DEV_TYPE_CHAR, DEV_MAJOR_MEM, DEV_MINOR_URANDOM, &urandom_ops);
 
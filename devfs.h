@@ -5,6 +5,7 @@
 
 #include "stdint.h"
 #include "vfs.h"
+#include "epoll.h"
 
 // Device types
 #define DEV_TYPE_CHAR    1
@@ -14,6 +15,10 @@
 #define DEV_MAJOR_MEM     1    // /dev/null, /dev/zero, /dev/random
 #define DEV_MAJOR_TTY     5    // /dev/console, /dev/tty
 #define DEV_MAJOR_BLOCK   8    // /dev/sda, etc.
+#define DEV_MAJOR_NET    10    // /dev/netcap
+#define DEV_MAJOR_INPUT  13    // /dev/event0..3
+#define DEV_MAJOR_SOUND  14    // /dev/dsp
+#define DEV_MAJOR_TRACE  15    // /dev/trace, /dev/profile
 
 // Device minor numbers for memory devices
 #define DEV_MINOR_NULL    1
@@ -26,6 +31,7 @@ typedef struct {
     int  (*read)(void* dev_data, void* buf, uint32_t count, uint32_t offset);
     int  (*write)(void* dev_data, const void* buf, uint32_t count, uint32_t offset);
     int  (*ioctl)(void* dev_data, uint64_t request, uint64_t arg);
+    uint32_t (*poll)(void* dev_data);   // EPOLL* readiness (0 = always readable/writable)
     void* dev_data;
 } dev_ops_t;
 
@@ -41,6 +47,17 @@ int devfs_register(const char* name, int dev_type, int major, int minor, dev_ops
 // Unregister a device
 int devfs_unregister(const char* name);
 
+// Drivers call this when a device's readiness changes (input arrived,
+// output drained); epoll waiters registered on the device are woken
+void devfs_notify(const char* name);
+
+// Device index for a name, or -1
+int devfs_find(const char* name);
+
+// Current EPOLL* readiness and event source of a registered device
+uint32_t devfs_poll_events(int dev_idx);
+pollsrc_t* devfs_get_pollsrc(int dev_idx);
+
 // Get the VFS filesystem operations for devfs
 vfs_fs_ops_t* devfs_get_ops(void);
 
@@ -0,0 +1,532 @@
+// dynlink.c - Kernel-Assisted Dynamic Linker for Alteo OS
+// Maps DT_NEEDED libraries into a process and applies relocations; PLT
+// entries are bound on first call through the resolver stub
+#include "dynlink.h"
+#include "elf.h"
+#include "klib.h"
+#include "heap.h"
+#include "pmm.h"
+#include "vfs.h"
+#include "process.h"
+#include "syscall.h"
+
+// A parsed shared object (or executable), shared by every process using it
+typedef struct {
+    vfs_node_t* node;
+    uint32_t modified;       // node->modified when parsed
+    int      refs;           // Link map entries using it
+    int      in_use;
+    uint16_t type;           // ET_EXEC / ET_DYN
+    Elf64_Phdr* phdrs;       // PT_LOAD headers, to find file offsets
+    int      phnum;
+    uint64_t lo, hi;         // Page span of the PT_LOAD segments
+    // From the dynamic section (link-time addresses)
+    uint64_t symtab, syment, strtab, strsz;
+    uint64_t hash, gnu_hash;
+    uint64_t rela, relasz, relaent;
+    uint64_t jmprel, pltrelsz, pltgot;
+    int      bind_now;
+    uint32_t needed[DL_MAX_NEEDED];  // strtab offsets of DT_NEEDED names
+    int      nneeded;
+} dl_object_t;
+
+typedef struct {
+    int      obj;            // Index into dl_objects
+    uint64_t bias;           // Load address minus link-time address
+} dl_linked_t;
+
+// Link map of one process slot: [0] is the executable, then the libraries
+// breadth-first, which is also the symbol search order
+typedef struct {
+    int         count;
+    dl_linked_t linked[DL_MAX_LINKED];
+} dl_map_t;
+
+static dl_object_t dl_objects[DL_MAX_OBJECTS];
+static dl_map_t    dl_maps[MAX_PROCESSES];
+static uint8_t*    dl_stub_page;     // Frame holding the resolver stub
+
+// Lazy binding resolver, entered from PLT0 with GOT[1] (link map slot)
+// and the relocation index pushed above the caller's return address.
+// Saves everything the syscall clobbers, resolves, and returns into the
+// target with the caller's return address back on top of the stack.
+static const uint8_t dl_stub_code[] = {
+    0x50, 0x51, 0x52, 0x56, 0x57,           // push rax, rcx, rdx, rsi, rdi
+    0x41, 0x50, 0x41, 0x51, 0x41, 0x52,     // push r8, r9, r10
+    0x41, 0x53, 0x41, 0x57,                 // push r11, r15
+    0x48, 0x8B, 0x7C, 0x24, 0x50,           // mov rdi, [rsp+80]   (link map slot)
+    0x48, 0x8B, 0x74, 0x24, 0x58,           // mov rsi, [rsp+88]   (relocation index)
+    0xB8, SYS_DL_RESOLVE, 0x00, 0x00, 0x00, // mov eax, SYS_DL_RESOLVE
+    0x0F, 0x05,                             // syscall
+    0x48, 0x89, 0x44, 0x24, 0x58,           // mov [rsp+88], rax   (target)
+    0x41, 0x5F, 0x41, 0x5B,                 // pop r15, r11
+    0x41, 0x5A, 0x41, 0x59, 0x41, 0x58,     // pop r10, r9, r8
+    0x5F, 0x5E, 0x5A, 0x59, 0x58,           // pop rdi, rsi, rdx, rcx, rax
+    0x48, 0x83, 0xC4, 0x08,                 // add rsp, 8
+    0xC3                                    // ret                 (to the target)
+};
+
+// ---------- Reading objects ----------
+
+static int dl_strcmp(const char* a, const char* b) {
+    while (*a && *a == *b) { a++; b++; }
+    return (uint8_t)*a - (uint8_t)*b;
+}
+
+// Copy len bytes at offset off of node's file (holes read as zeros)
+static void dl_file_read(vfs_node_t* node, uint64_t off, void* buf, uint64_t len) {
+    uint8_t* dst = (uint8_t*)buf;
+    while (len) {
+        uint64_t in = off & (VFS_PAGE_SIZE - 1);
+        uint64_t n = VFS_PAGE_SIZE - in;
+        if (n > len) n = len;
+        const uint8_t* page = vfs_node_page(node, (uint32_t)(off / VFS_PAGE_SIZE), 0);
+        if (page) memcpy(dst, page + in, n);
+        else memset(dst, 0, n);
+        dst += n;
+        off += n;
+        len -= n;
+    }
+}
+
+// Read the object's image at link-time address addr from its file: the
+// tables the linker needs are read-only, so the file is what is mapped.
+// Returns -1 unless addr is file data of a segment.
+static int dl_read(const dl_object_t* o, uint64_t addr, void* buf, uint64_t len) {
+    for (int i = 0; i < o->phnum; i++) {
+        const Elf64_Phdr* p = &o->phdrs[i];
+        if (addr < p->p_vaddr || addr + len > p->p_vaddr + p->p_filesz) continue;
+        dl_file_read(o->node, p->p_offset + (addr - p->p_vaddr), buf, len);
+        return 0;
+    }
+    return -1;
+}
+
+// NUL-terminated string at strtab offset off
+static int dl_read_str(const dl_object_t* o, uint64_t off, char* buf) {
+    if (off >= o->strsz) return -1;
+    uint64_t n = o->strsz - off;
+    if (n > DL_MAX_NAME) n = DL_MAX_NAME;
+    if (dl_read(o, o->strtab + off, buf, n) < 0) return -1;
+    for (uint64_t i = 0; i < n; i++) if (!buf[i]) return 0;
+    return -1;   // Longer than DL_MAX_NAME
+}
+
+static int dl_read_sym(const dl_object_t* o, uint32_t index, Elf64_Sym* sym) {
+    return dl_read(o, o->symtab + (uint64_t)index * o->syment, sym, sizeof(*sym));
+}
+
+// Fill in o from node's ELF and dynamic headers
+static int dl_parse(dl_object_t* o, vfs_node_t* node) {
+    Elf64_Ehdr eh;
+    if (node->size < sizeof(eh)) return -1;
+    dl_file_read(node, 0, &eh, sizeof(eh));
+    if (!elf_validate(&eh, node->size) || eh.e_phentsize < sizeof(Elf64_Phdr)) return -1;
+
+    memset(o, 0, sizeof(*o));
+    o->node = node;
+    o->modified = node->modified;
+    o->type = eh.e_type;
+    o->phdrs = (Elf64_Phdr*)kmalloc((uint64_t)eh.e_phnum * sizeof(Elf64_Phdr));
+    if (!o->phdrs) return -1;
+    o->lo = 0xFFFFFFFFFFFFFFFF;
+
+    uint64_t dyn = 0, dynsz = 0;
+    for (int i = 0; i < eh.e_phnum; i++) {
+        Elf64_Phdr p;
+        dl_file_read(node, eh.e_phoff + (uint64_t)i * eh.e_phentsize, &p, sizeof(p));
+        if (p.p_type == PT_DYNAMIC) { dyn = p.p_vaddr; dynsz = p.p_filesz; }
+        if (p.p_type != PT_LOAD || p.p_memsz == 0) continue;
+        if (p.p_offset + p.p_filesz > node->size) goto fail;
+        o->phdrs[o->phnum++] = p;
+        uint64_t lo = p.p_vaddr & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+        uint64_t hi = (p.p_vaddr + p.p_memsz + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+        if (lo < o->lo) o->lo = lo;
+        if (hi > o->hi) o->hi = hi;
+    }
+    if (!dyn || !o->phnum) goto fail;
+
+    o->syment = sizeof(Elf64_Sym);
+    o->relaent = sizeof(Elf64_Rela);
+    for (uint64_t off = 0; off + sizeof(Elf64_Dyn) <= dynsz; off += sizeof(Elf64_Dyn)) {
+        Elf64_Dyn d;
+        if (dl_read(o, dyn + off, &d, sizeof(d)) < 0) goto fail;
+        if (d.d_tag == DT_NULL) break;
+        switch (d.d_tag) {
+            case DT_NEEDED:
+                if (o->nneeded == DL_MAX_NEEDED) goto fail;
+                o->needed[o->nneeded++] = (uint32_t)d.d_val;
+                break;
+            case DT_PLTRELSZ: o->pltrelsz = d.d_val; break;
+            case DT_PLTGOT:   o->pltgot = d.d_val;   break;
+            case DT_HASH:     o->hash = d.d_val;     break;
+            case DT_GNU_HASH: o->gnu_hash = d.d_val; break;
+            case DT_STRTAB:   o->strtab = d.d_val;   break;
+            case DT_SYMTAB:   o->symtab = d.d_val;   break;
+            case DT_STRSZ:    o->strsz = d.d_val;    break;
+            case DT_SYMENT:   o->syment = d.d_val;   break;
+            case DT_RELA:     o->rela = d.d_val;     break;
+            case DT_RELASZ:   o->relasz = d.d_val;   break;
+            case DT_RELAENT:  o->relaent = d.d_val;  break;
+            case DT_JMPREL:   o->jmprel = d.d_val;   break;
+            case DT_PLTREL:   if (d.d_val != DT_RELA) goto fail; break;
+            case DT_BIND_NOW: o->bind_now = 1;       break;
+            case DT_FLAGS:    if (d.d_val & DF_BIND_NOW) o->bind_now = 1; break;
+            case DT_FLAGS_1:  if (d.d_val & DF_1_NOW) o->bind_now = 1;    break;
+        }
+    }
+    if (!o->symtab || !o->strtab || o->syment < sizeof(Elf64_Sym) ||
+        o->relaent < sizeof(Elf64_Rela)) goto fail;
+
+    o->in_use = 1;
+    return 0;
+
+fail:
+    kfree(o->phdrs);
+    o->phdrs = 0;
+    return -1;
+}
+
+// Object for node, parsing it on first use. Entries nobody links against
+// stay cached until their file changes and the slot is wanted.
+static int dl_object_get(vfs_node_t* node) {
+    int free_idx = -1;
+    for (int i = 0; i < DL_MAX_OBJECTS; i++) {
+        dl_object_t* o = &dl_objects[i];
+        if (o->in_use && o->node == node && o->modified == node->modified && node->in_use) return i;
+        if (free_idx >= 0) continue;
+        if (!o->in_use) free_idx = i;
+        else if (!o->refs && (!o->node->in_use || o->node->modified != o->modified)) free_idx = i;
+    }
+    if (free_idx < 0) return -1;
+
+    dl_object_t* o = &dl_objects[free_idx];
+    if (o->in_use) {
+        kfree(o->phdrs);
+        o->in_use = 0;
+    }
+    return dl_parse(o, node) < 0 ? -1 : free_idx;
+}
+
+static dl_map_t* dl_map_for(int pid) {
+    process_t* p = process_get(pid);
+    return p ? &dl_maps[p - process_get_table()] : 0;
+}
+
+// ---------- Symbol lookup ----------
+
+static uint32_t dl_sysv_hash(const char* s) {
+    uint32_t h = 0;
+    while (*s) {
+        h = (h << 4) + (uint8_t)*s++;
+        uint32_t g = h & 0xF0000000;
+        if (g) h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+static uint32_t dl_gnu_hash(const char* s) {
+    uint32_t h = 5381;
+    while (*s) h = h * 33 + (uint8_t)*s++;
+    return h;
+}
+
+// Whether symbol index of o is a visible definition of name
+static int dl_sym_defines(const dl_object_t* o, uint32_t index, const char* name, Elf64_Sym* sym) {
+    char buf[DL_MAX_NAME];
+    if (dl_read_sym(o, index, sym) < 0 || sym->st_shndx == SHN_UNDEF) return 0;
+    int bind = ELF64_ST_BIND(sym->st_info);
+    if (bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE) return 0;
+    if (ELF64_ST_TYPE(sym->st_info) == STT_TLS) return 0;
+    return dl_read_str(o, sym->st_name, buf) == 0 && dl_strcmp(buf, name) == 0;
+}
+
+// Find name among o's exported symbols through its hash table
+static int dl_lookup_in(const dl_object_t* o, const char* name, Elf64_Sym* sym) {
+    if (o->gnu_hash) {
+        uint32_t hdr[4];   // nbuckets, symoffset, bloom words, bloom shift
+        if (dl_read(o, o->gnu_hash, hdr, sizeof(hdr)) < 0 || !hdr[0]) return 0;
+        uint32_t h = dl_gnu_hash(name);
+        uint64_t buckets = o->gnu_hash + sizeof(hdr) + (uint64_t)hdr[2] * 8;
+        uint64_t chains = buckets + (uint64_t)hdr[0] * 4;
+        uint32_t index;
+        if (dl_read(o, buckets + (uint64_t)(h % hdr[0]) * 4, &index, 4) < 0) return 0;
+        if (index < hdr[1]) return 0;
+        for (;; index++) {
+            uint32_t chain;
+            if (dl_read(o, chains + (uint64_t)(index - hdr[1]) * 4, &chain, 4) < 0) return 0;
+            if ((chain | 1) == (h | 1) && dl_sym_defines(o, index, name, sym)) return 1;
+            if (chain & 1) return 0;   // End of the bucket's chain
+        }
+    }
+    if (o->hash) {
+        uint32_t hdr[2];   // nbucket, nchain
+        if (dl_read(o, o->hash, hdr, sizeof(hdr)) < 0 || !hdr[0]) return 0;
+        uint64_t chains = o->hash + sizeof(hdr) + (uint64_t)hdr[0] * 4;
+        uint32_t index;
+        if (dl_read(o, o->hash + sizeof(hdr) + (uint64_t)(dl_sysv_hash(name) % hdr[0]) * 4,
+                    &index, 4) < 0) return 0;
+        for (uint32_t n = 0; index && index < hdr[1] && n < hdr[1]; n++) {
+            if (dl_sym_defines(o, index, name, sym)) return 1;
+            if (dl_read(o, chains + (uint64_t)index * 4, &index, 4) < 0) return 0;
+        }
+    }
+    return 0;
+}
+
+// Value of symbol index of linked object i as its relocations see it:
+// local symbols are its own, others the first definition in load order
+// (skipping i itself for COPY). Undefined weak symbols are 0.
+static int dl_symbol_value(const dl_map_t* m, int i, uint32_t index, int copy,
+                           uint64_t* value, uint64_t* size) {
+    const dl_object_t* o = &dl_objects[m->linked[i].obj];
+    Elf64_Sym sym;
+    *value = 0;
+    *size = 0;
+    if (index == 0) return 0;
+    if (dl_read_sym(o, index, &sym) < 0) return -1;
+    if (ELF64_ST_BIND(sym.st_info) == STB_LOCAL) {
+        *value = m->linked[i].bias + sym.st_value;
+        *size = sym.st_size;
+        return 0;
+    }
+
+    char name[DL_MAX_NAME];
+    if (dl_read_str(o, sym.st_name, name) < 0) return -1;
+    for (int j = 0; j < m->count; j++) {
+        if (copy && j == i) continue;
+        Elf64_Sym def;
+        if (dl_lookup_in(&dl_objects[m->linked[j].obj], name, &def)) {
+            *value = m->linked[j].bias + def.st_value;
+            *size = def.st_size;
+            return 0;
+        }
+    }
+    return ELF64_ST_BIND(sym.st_info) == STB_WEAK ? 0 : -1;
+}
+
+// ---------- Relocation ----------
+
+// Copy between the kernel and process memory a page at a time, faulting
+// pages in (and taking private copies of copy-on-write ones) as needed
+static int dl_copy(int pid, pte_t* pml4, uint64_t addr, void* buf, uint64_t len, int write) {
+    uint8_t* p = (uint8_t*)buf;
+    while (len) {
+        uint64_t n = VMM_PAGE_SIZE - (addr & (VMM_PAGE_SIZE - 1));
+        if (n > len) n = len;
+        uint8_t* mem = vmm_vma_touch(pid, pml4, addr, write);
+        if (!mem) return -1;
+        if (write) memcpy(mem, p, n);
+        else memcpy(p, mem, n);
+        p += n;
+        addr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int dl_relocate(const dl_map_t* m, int i, const Elf64_Rela* r, int pid, pte_t* pml4) {
+    uint64_t bias = m->linked[i].bias;
+    uint64_t where = bias + r->r_offset;
+    uint64_t value, size;
+
+    switch (ELF64_R_TYPE(r->r_info)) {
+        case R_X86_64_NONE:
+            return 0;
+        case R_X86_64_RELATIVE:
+            value = bias + r->r_addend;
+            break;
+        case R_X86_64_64:
+            if (dl_symbol_value(m, i, ELF64_R_SYM(r->r_info), 0, &value, &size) < 0) return -1;
+            value += r->r_addend;
+            break;
+        case R_X86_64_GLOB_DAT:
+        case R_X86_64_JUMP_SLOT:
+            if (dl_symbol_value(m, i, ELF64_R_SYM(r->r_info), 0, &value, &size) < 0) return -1;
+            break;
+        case R_X86_64_COPY: {
+            // The executable gets its own copy of a library's data object
+            if (dl_symbol_value(m, i, ELF64_R_SYM(r->r_info), 1, &value, &size) < 0) return -1;
+            uint8_t tmp[256];
+            for (uint64_t off = 0; off < size; off += sizeof(tmp)) {
+                uint64_t n = size - off < sizeof(tmp) ? size - off : sizeof(tmp);
+                if (dl_copy(pid, pml4, value + off, tmp, n, 0) < 0) return -1;
+                if (dl_copy(pid, pml4, where + off, tmp, n, 1) < 0) return -1;
+            }
+            return 0;
+        }
+        default:
+            return -1;   // TLS, IFUNC...
+    }
+    return dl_copy(pid, pml4, where, &value, sizeof(value), 1);
+}
+
+// Map the resolver stub's page read-only into pml4 (once)
+static int dl_map_stub(pte_t* pml4) {
+    if (vmm_get_physical(pml4, DL_STUB_ADDR)) return 0;
+    if (!dl_stub_page) {
+        dl_stub_page = (uint8_t*)pmm_alloc_block();
+        if (!dl_stub_page) return -1;
+        memset(dl_stub_page, 0xCC, VMM_PAGE_SIZE);   // int3 past the code
+        memcpy(dl_stub_page, dl_stub_code, sizeof(dl_stub_code));
+    }
+    pmm_page_ref(dl_stub_page);
+    if (vmm_map_page(pml4, DL_STUB_ADDR, (uint64_t)dl_stub_page,
+                     VMM_FLAG_PRESENT | VMM_FLAG_USER) < 0) {
+        pmm_free_block(dl_stub_page);
+        return -1;
+    }
+    return 0;
+}
+
+static int dl_relocate_object(const dl_map_t* m, int i, int pid, pte_t* pml4) {
+    const dl_object_t* o = &dl_objects[m->linked[i].obj];
+    uint64_t bias = m->linked[i].bias;
+    Elf64_Rela r;
+
+    for (uint64_t off = 0; off + o->relaent <= o->relasz; off += o->relaent) {
+        if (dl_read(o, o->rela + off, &r, sizeof(r)) < 0) return -1;
+        if (dl_relocate(m, i, &r, pid, pml4) < 0) return -1;
+    }
+    if (!o->jmprel) return 0;
+
+    int lazy = o->pltgot && !o->bind_now;
+    for (uint64_t off = 0; off + o->relaent <= o->pltrelsz; off += o->relaent) {
+        if (dl_read(o, o->jmprel + off, &r, sizeof(r)) < 0) return -1;
+        if (!lazy || ELF64_R_TYPE(r.r_info) != R_X86_64_JUMP_SLOT) {
+            if (dl_relocate(m, i, &r, pid, pml4) < 0) return -1;
+            continue;
+        }
+        // Unbound: the GOT entry goes back into the PLT, which pushes the
+        // index and jumps to PLT0; only a moved object has to adjust it
+        if (!bias) continue;
+        uint64_t value;
+        if (dl_read(o, r.r_offset, &value, sizeof(value)) < 0) return -1;
+        value += bias;
+        if (dl_copy(pid, pml4, bias + r.r_offset, &value, sizeof(value), 1) < 0) return -1;
+    }
+    if (!lazy) return 0;
+
+    // PLT0 pushes GOT[1] and jumps through GOT[2]
+    uint64_t got[2] = { (uint64_t)i, DL_STUB_ADDR };
+    if (dl_copy(pid, pml4, bias + o->pltgot + 8, got, sizeof(got), 1) < 0) return -1;
+    return dl_map_stub(pml4);
+}
+
+// ---------- Linking ----------
+
+// Open a DT_NEEDED library: a name with a slash as is, others in /lib
+// then /usr/lib
+static int dl_open_library(const char* name) {
+    static const char* const dirs[] = { "/lib/", "/usr/lib/" };
+    for (const char* c = name; *c; c++) {
+        if (*c == '/') return vfs_open(name, VFS_O_RDONLY);
+    }
+    char path[VFS_MAX_PATH];
+    for (int d = 0; d < 2; d++) {
+        int n = 0;
+        for (const char* c = dirs[d]; *c; c++) path[n++] = *c;
+        for (const char* c = name; *c && n < VFS_MAX_PATH - 1; c++) path[n++] = *c;
+        path[n] = 0;
+        int fd = vfs_open(path, VFS_O_RDONLY);
+        if (fd >= 0) return fd;
+    }
+    return -1;
+}
+
+// Map library name at *next (unless the process has it already)
+static int dl_map_library(dl_map_t* m, int pid, pte_t* pml4, const char* name, uint64_t* next) {
+    int fd = dl_open_library(name);
+    if (fd < 0) return -1;
+    vfs_node_t* node = vfs_fd_node(fd);
+    int ret = -1;
+
+    for (int j = 0; j < m->count; j++) {
+        if (dl_objects[m->linked[j].obj].node == node) { ret = 0; goto out; }
+    }
+    if (m->count == DL_MAX_LINKED) goto out;
+
+    int obj = dl_object_get(node);
+    if (obj < 0 || dl_objects[obj].type != ET_DYN) goto out;
+    dl_object_t* o = &dl_objects[obj];
+    uint64_t bias = *next - o->lo;
+    elf_load_result_t r;
+    if (elf_map_from_fd(fd, pid, pml4, bias, &r) < 0) goto out;
+
+    *next = (bias + o->hi + DL_LIB_ALIGN - 1) & ~(DL_LIB_ALIGN - 1);
+    m->linked[m->count].obj = obj;
+    m->linked[m->count].bias = bias;
+    m->count++;
+    o->refs++;
+    ret = 0;
+
+out:
+    vfs_close(fd);
+    return ret;
+}
+
+int dl_link(int pid, pte_t* pml4, vfs_node_t* node, uint64_t bias) {
+    dl_map_t* m = dl_map_for(pid);
+    if (!m || !pml4 || !node) return -1;
+    dl_release(pid);
+
+    int obj = dl_object_get(node);
+    if (obj < 0) return -1;
+    m->linked[0].obj = obj;
+    m->linked[0].bias = bias;
+    m->count = 1;
+    dl_objects[obj].refs++;
+
+    // Breadth-first over the needed lists, which is also lookup order
+    uint64_t next = DL_LIB_BASE;
+    for (int i = 0; i < m->count; i++) {
+        const dl_object_t* o = &dl_objects[m->linked[i].obj];
+        for (int n = 0; n < o->nneeded; n++) {
+            char name[DL_MAX_NAME];
+            if (dl_read_str(o, o->needed[n], name) < 0) return -1;
+            if (dl_map_library(m, pid, pml4, name, &next) < 0) return -1;
+        }
+    }
+
+    // Dependencies first, so COPY relocations see relocated library data
+    for (int i = m->count - 1; i >= 0; i--) {
+        if (dl_relocate_object(m, i, pid, pml4) < 0) return -1;
+    }
+    return 0;
+}
+
+uint64_t dl_resolve(int obj, uint64_t index) {
+    int pid = process_get_pid();
+    dl_map_t* m = dl_map_for(pid);
+    if (!m || obj < 0 || obj >= m->count) return 0;
+
+    const dl_object_t* o = &dl_objects[m->linked[obj].obj];
+    if (!o->relaent || index >= o->pltrelsz / o->relaent) return 0;
+    Elf64_Rela r;
+    if (dl_read(o, o->jmprel + index * o->relaent, &r, sizeof(r)) < 0) return 0;
+    if (ELF64_R_TYPE(r.r_info) != R_X86_64_JUMP_SLOT) return 0;
+
+    uint64_t value, size;
+    if (dl_symbol_value(m, obj, ELF64_R_SYM(r.r_info), 0, &value, &size) < 0) return 0;
+    // Later calls go straight to the target
+    if (dl_copy(pid, vmm_get_current_address_space(), m->linked[obj].bias + r.r_offset,
+                &value, sizeof(value), 1) < 0) return 0;
+    return value;
+}
+
+void dl_fork(int parent_pid, int child_pid) {
+    dl_map_t* src = dl_map_for(parent_pid);
+    dl_map_t* dst = dl_map_for(child_pid);
+    if (!src || !dst) return;
+    dl_release(child_pid);
+    *dst = *src;
+    for (int i = 0; i < dst->count; i++) dl_objects[dst->linked[i].obj].refs++;
+}
+
+void dl_release(int pid) {
+    dl_map_t* m = dl_map_for(pid);
+    if (!m) return;
+    for (int i = 0; i < m->count; i++) dl_objects[m->linked[i].obj].refs--;
+    m->count = 0;
+}
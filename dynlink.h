@@ -0,0 +1,50 @@
+// dynlink.h - Kernel-Assisted Dynamic Linker for Alteo OS
+// Links dynamically linked executables at exec time; the kernel stands in
+// for the program interpreter. Libraries named by DT_NEEDED are looked up
+// in /lib and /usr/lib and mapped like any other ELF (elf_map_from_fd), so
+// their read-only segments are the page cache's own frames, shared by
+// every process using them. Each file's dynamic section (symbol, string,
+// hash and relocation tables, needed list) is parsed once into a table of
+// objects shared by all processes, and read afterwards from the file's
+// pages rather than from any process.
+//
+// Data relocations are applied at load through vmm_vma_touch(), so only
+// the pages they hit become private copies. PLT relocations are bound
+// lazily: GOT[2] points at a resolver stub on a read-only page mapped at
+// DL_STUB_ADDR, which makes SYS_DL_RESOLVE with GOT[1] (the object's slot
+// in the process's link map) and the relocation index, then jumps to the
+// symbol with the GOT entry patched. Objects marked BIND_NOW are bound at
+// load. TLS and IFUNC relocations are not supported, and initializers are
+// left to the C runtime.
+#ifndef DYNLINK_H
+#define DYNLINK_H
+
+#include "stdint.h"
+#include "vmm.h"
+
+#define DL_MAX_OBJECTS      64      // Shared objects parsed (all processes)
+#define DL_MAX_LINKED       16      // Objects in one process (executable included)
+#define DL_MAX_NEEDED       16      // DT_NEEDED entries per object
+#define DL_MAX_NAME         128     // Longest symbol or library name
+#define DL_LIB_BASE         0x7F0000000000ULL   // First library's load address
+#define DL_LIB_ALIGN        0x200000ULL         // Libraries start on 2MB boundaries
+#define DL_STUB_ADDR        0x7FFF00000000ULL   // Lazy binding resolver stub
+
+struct vfs_node;
+
+// Map the libraries an executable needs into process pid and relocate
+// them and the executable (mapped from node at bias). Returns 0, or -1 if
+// a library is missing or a relocation cannot be applied.
+int dl_link(int pid, pte_t* pml4, struct vfs_node* node, uint64_t bias);
+
+// Bind PLT relocation index of link map slot obj for the current process:
+// patch its GOT entry and return the target (0 if it cannot be resolved)
+uint64_t dl_resolve(int obj, uint64_t index);
+
+// Give a forked child its parent's link map
+void dl_fork(int parent_pid, int child_pid);
+
+// Forget a process's link map (exec, exit)
+void dl_release(int pid);
+
+#endif
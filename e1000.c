@@ -1,7 +1,18 @@
 // e1000.c - Intel E1000 NIC Driver for Alteo OS
 #include "e1000.h"
 #include "heap.h"
+#include "klib.h"
+#include "pmm.h"
 #include "pci.h"
+#include "apic.h"
+#include "irq.h"
+#include "ethernet.h"
+#include "process.h"
+#include "scheduler.h"
+#include "waitq.h"
+#include "isr.h"
+#include "smp.h"
+#include "nettap.h"
 
 // Port I/O
 static inline uint8_t inb(uint16_t port) {
@@ -32,6 +43,20 @@ static inline void outl(uint16_t port, uint32_t val) {
 // Global device state
 static e1000_device_t e1000_dev;
 static int e1000_initialized = 0;
+static pci_device_t* e1000_pci = (pci_device_t*)0;
+
+// Each queue's e1000rx thread sleeps here between bursts
+static waitq_t rx_wq[E1000_MAX_RX_QUEUES] = { WAITQ_INIT, WAITQ_INIT };
+
+// Toeplitz key for the RSS hash (the common default key)
+static const uint32_t rss_key[10] = {
+    0xDA565A6D, 0xC20E5B25, 0x3D256741, 0xB08FA343, 0xCB2BCAD0,
+    0xB4307BAE, 0xA32DCB77, 0x0CF23080, 0x3BB7426A, 0xFA01ACBE
+};
+
+// Packet buffer pool (free buffers stacked in buf_free)
+static uint8_t* buf_free[E1000_POOL_BUFS];
+static int buf_free_count = 0;
 
 // MMIO read/write
 static void e1000_write_reg(uint32_t reg, uint32_t val) {
@@ -100,35 +125,79 @@ static void e1000_read_mac(void) {
     }
 }
 
-// Initialize RX ring
-static void e1000_init_rx(void) {
-    e1000_dev.rx_descs = (e1000_rx_desc_t*)kmalloc(sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC + 16);
+// ---- Packet buffer pool ----
+
+// Add n buffers to the pool
+static int e1000_pool_add(int n) {
+    const int per_page = PAGE_SIZE / E1000_RX_BUF_SIZE;
+    if (buf_free_count + n > E1000_POOL_BUFS) return -1;
+    for (int i = 0; i < n / per_page; i++) {
+        uint8_t* page = (uint8_t*)pmm_alloc_block();
+        if (!page) return -1;
+        for (int j = 0; j < per_page; j++) buf_free[buf_free_count++] = page + j * E1000_RX_BUF_SIZE;
+    }
+    return 0;
+}
+
+static uint8_t* e1000_buf_get(void) {
+    return buf_free_count ? buf_free[--buf_free_count] : (uint8_t*)0;
+}
+
+static void e1000_buf_put(uint8_t* buf) {
+    buf_free[buf_free_count++] = buf;
+}
+
+// Set up RX queue q: its ring of posted buffers and its registers
+static int e1000_init_rxq(int q) {
+    e1000_rxq_t* rxq = &e1000_dev.rxq[q];
+    uint32_t regs = q * E1000_RXQ_STRIDE;
+    rxq->descs = (e1000_rx_desc_t*)pmm_alloc_block();
+    if (!rxq->descs) return -1;
+    memset(rxq->descs, 0, PAGE_SIZE);
 
     for (int i = 0; i < E1000_NUM_RX_DESC; i++) {
-        e1000_dev.rx_bufs[i] = (uint8_t*)kmalloc(E1000_RX_BUF_SIZE + 16);
-        e1000_dev.rx_descs[i].addr = (uint64_t)(uintptr_t)e1000_dev.rx_bufs[i];
-        e1000_dev.rx_descs[i].status = 0;
+        rxq->bufs[i] = e1000_buf_get();
+        if (!rxq->bufs[i]) return -1;
+        rxq->descs[i].addr = (uint64_t)(uintptr_t)rxq->bufs[i];
+        rxq->descs[i].status = 0;
     }
 
-    e1000_write_reg(E1000_RDBAL, (uint32_t)(uintptr_t)e1000_dev.rx_descs);
-    e1000_write_reg(E1000_RDBAH, 0);
-    e1000_write_reg(E1000_RDLEN, sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC);
-    e1000_write_reg(E1000_RDH, 0);
-    e1000_write_reg(E1000_RDT, E1000_NUM_RX_DESC - 1);
+    e1000_write_reg(E1000_RDBAL + regs, (uint32_t)(uintptr_t)rxq->descs);
+    e1000_write_reg(E1000_RDBAH + regs, 0);
+    e1000_write_reg(E1000_RDLEN + regs, sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC);
+    e1000_write_reg(E1000_RDH + regs, 0);
+    e1000_write_reg(E1000_RDT + regs, E1000_NUM_RX_DESC - 1);
+
+    rxq->cur = 0;
+    rxq->cpu = 0;
+    rxq->vector = -1;
+    rxq->pending = 0;
+    rxq->irqs = 0;
+    rxq->polls = 0;
+    return 0;
+}
 
-    e1000_dev.rx_cur = 0;
+// Initialize the receiver with queue 0
+static int e1000_init_rx(void) {
+    if (e1000_init_rxq(0) < 0) return -1;
+    e1000_dev.num_rxq = 1;
+
+    // Have the NIC verify IP and TCP/UDP checksums of received frames
+    e1000_write_reg(E1000_RXCSUM, E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL);
 
     uint32_t rctl = E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_BSIZE_2048 | E1000_RCTL_SECRC;
     e1000_write_reg(E1000_RCTL, rctl);
+    return 0;
 }
 
 // Initialize TX ring
-static void e1000_init_tx(void) {
-    e1000_dev.tx_descs = (e1000_tx_desc_t*)kmalloc(sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC + 16);
+static int e1000_init_tx(void) {
+    e1000_dev.tx_descs = (e1000_tx_desc_t*)pmm_alloc_block();
+    if (!e1000_dev.tx_descs) return -1;
+    memset(e1000_dev.tx_descs, 0, PAGE_SIZE);
 
     for (int i = 0; i < E1000_NUM_TX_DESC; i++) {
-        e1000_dev.tx_bufs[i] = (uint8_t*)kmalloc(E1000_TX_BUF_SIZE + 16);
-        e1000_dev.tx_descs[i].addr = (uint64_t)(uintptr_t)e1000_dev.tx_bufs[i];
+        e1000_dev.tx_bufs[i] = 0;
         e1000_dev.tx_descs[i].status = E1000_TXD_STAT_DD; // Mark as done
         e1000_dev.tx_descs[i].cmd = 0;
     }
@@ -140,11 +209,16 @@ static void e1000_init_tx(void) {
     e1000_write_reg(E1000_TDT, 0);
 
     e1000_dev.tx_cur = 0;
+    e1000_dev.tx_clean = 0;
+    e1000_dev.tx_tail = 0;
+    e1000_dev.tx_batch = 0;
+    e1000_dev.tx_ctx_valid = 0;
 
     uint32_t tctl = E1000_TCTL_EN | E1000_TCTL_PSP |
                     (15 << E1000_TCTL_CT_SHIFT) |
                     (64 << E1000_TCTL_COLD_SHIFT);
     e1000_write_reg(E1000_TCTL, tctl);
+    return 0;
 }
 
 // Scan PCI bus for E1000 (uses central PCI enumerator)
@@ -159,6 +233,9 @@ static int e1000_pci_scan(void) {
     }
 
     if (!dev) return 0;
+    e1000_pci = dev;
+    e1000_dev.irq = dev->irq_line;
+    e1000_dev.multiqueue = dev->device_id == E1000_DEVICE_ID3;
 
     // Get BAR0
     if (pci_bar_is_io(dev, 0)) {
@@ -184,7 +261,11 @@ int e1000_init(void) {
     e1000_dev.packets_tx = 0;
     e1000_dev.bytes_rx = 0;
     e1000_dev.bytes_tx = 0;
+    e1000_dev.tx_kicks = 0;
     e1000_dev.errors = 0;
+    e1000_dev.rx_csum_errs = 0;
+    e1000_dev.rx_irq_ok = 0;
+    e1000_dev.num_rxq = 0;
 
     // Scan PCI for E1000
     if (!e1000_pci_scan()) {
@@ -215,8 +296,12 @@ int e1000_init(void) {
     e1000_write_reg(E1000_CTRL, ctrl);
 
     // Initialize TX and RX
-    e1000_init_rx();
-    e1000_init_tx();
+    buf_free_count = 0;
+    if (e1000_pool_add(E1000_NUM_RX_DESC + E1000_NUM_TX_DESC / 2) < 0 ||
+        e1000_init_rx() < 0 || e1000_init_tx() < 0) {
+        e1000_initialized = 0;
+        return -1;
+    }
 
     // Enable interrupts
     e1000_write_reg(E1000_IMS, 0x1F6DC);
@@ -240,38 +325,208 @@ void e1000_get_mac(uint8_t mac[6]) {
 }
 
 int e1000_send(const uint8_t* data, uint16_t length) {
-    if (!e1000_initialized || !data || length == 0 || length > E1000_MAX_PKT_SIZE)
-        return -1;
+    if (!data) return -1;
+    return e1000_send_gather(data, length, 0, 0, 0);
+}
 
-    uint16_t cur = e1000_dev.tx_cur;
-    e1000_tx_desc_t* desc = &e1000_dev.tx_descs[cur];
+// Wait for a TX descriptor to be written back (DD)
+static void e1000_tx_wait(uint16_t idx) {
+    volatile uint8_t* status = &e1000_dev.tx_descs[idx].status;
+    while (!(*status & E1000_TXD_STAT_DD)) __asm__ volatile("pause");
+}
 
-    // Wait for descriptor to be available
-    while (!(desc->status & E1000_TXD_STAT_DD));
+// Retire the descriptors the NIC is done with, oldest first, and return
+// their buffers to the pool
+static void e1000_tx_reclaim(void) {
+    while (e1000_dev.tx_clean != e1000_dev.tx_cur) {
+        uint16_t i = e1000_dev.tx_clean;
+        volatile uint8_t* status = &e1000_dev.tx_descs[i].status;
+        if (!(*status & E1000_TXD_STAT_DD)) break;
+        if (e1000_dev.tx_bufs[i]) {
+            e1000_buf_put(e1000_dev.tx_bufs[i]);
+            e1000_dev.tx_bufs[i] = 0;
+        }
+        e1000_dev.tx_clean = (i + 1) % E1000_NUM_TX_DESC;
+    }
+}
 
-    // Copy data to TX buffer
-    uint8_t* buf = e1000_dev.tx_bufs[cur];
-    for (uint16_t i = 0; i < length; i++)
-        buf[i] = data[i];
+// Hand the NIC everything queued so far
+static void e1000_tx_kick(void) {
+    if (e1000_dev.tx_tail == e1000_dev.tx_cur) return;
+    e1000_write_reg(E1000_TDT, e1000_dev.tx_cur);
+    e1000_dev.tx_tail = e1000_dev.tx_cur;
+    e1000_dev.tx_kicks++;
+}
+
+// Make room for n descriptors and nbufs buffers; only waits for the NIC
+// when the ring or the pool is exhausted
+static void e1000_tx_reserve(int n, int nbufs) {
+    for (;;) {
+        e1000_tx_reclaim();
+        int used = (e1000_dev.tx_cur - e1000_dev.tx_clean + E1000_NUM_TX_DESC) % E1000_NUM_TX_DESC;
+        if (E1000_NUM_TX_DESC - 1 - used >= n && buf_free_count >= nbufs) return;
+        e1000_tx_kick();   // A deferred batch must go out before it can complete
+        __asm__ volatile("pause");
+    }
+}
 
-    desc->length = length;
-    desc->cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS;
+// Work out the offload context for a frame whose hdr holds exactly the
+// Ethernet, IPv4 and TCP/UDP headers
+static int e1000_tx_context(e1000_tx_ctx_desc_t* ctx, const uint8_t* hdr, uint16_t hdr_len,
+                            uint16_t payload_len, int flags) {
+    if (hdr_len < ETH_HLEN + 20 || (hdr[ETH_HLEN] >> 4) != 4) return -1;
+    uint32_t l4 = ETH_HLEN + (hdr[ETH_HLEN] & 0xF) * 4;
+    uint8_t proto = hdr[ETH_HLEN + 9];
+    uint8_t tucmd = E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS | E1000_TUCMD_IP;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->ipcss = ETH_HLEN;
+    ctx->ipcso = ETH_HLEN + 10;
+    ctx->ipcse = (uint16_t)(l4 - 1);
+    ctx->tucss = (uint8_t)l4;
+    if (proto == 6) {
+        if (hdr_len < l4 + 20 || hdr_len != l4 + (hdr[l4 + 12] >> 4) * 4) return -1;
+        ctx->tucso = (uint8_t)(l4 + 16);
+        tucmd |= E1000_TUCMD_TCP;
+    } else if (proto == 17 && !(flags & E1000_TX_TSO)) {
+        if (hdr_len != l4 + 8) return -1;
+        ctx->tucso = (uint8_t)(l4 + 6);
+    } else {
+        return -1;
+    }
+
+    if (flags & E1000_TX_TSO) {
+        uint16_t mss = (uint16_t)((uint32_t)flags >> E1000_TX_MSS_SHIFT);
+        if (mss == 0) return -1;
+        tucmd |= E1000_TXD_CMD_TSE;
+        ctx->hdrlen = (uint8_t)hdr_len;
+        ctx->mss = mss;
+        ctx->cmd_len = payload_len;
+    }
+    ctx->cmd_len |= (uint32_t)tucmd << E1000_TXD_CMD_SHIFT;
+    return 0;
+}
+
+// Fill data descriptor idx: legacy without offload, extended with it
+static void e1000_tx_fill(uint16_t idx, const uint8_t* addr, uint32_t len,
+                          int eop, int offload, int tso) {
+    if (!offload) {
+        e1000_tx_desc_t* desc = &e1000_dev.tx_descs[idx];
+        desc->addr = (uint64_t)(uintptr_t)addr;   // Kernel memory is identity mapped
+        desc->length = (uint16_t)len;
+        desc->cmd = E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS | (eop ? E1000_TXD_CMD_EOP : 0);
+        desc->status = 0;
+        return;
+    }
+    e1000_tx_data_desc_t* desc = (e1000_tx_data_desc_t*)&e1000_dev.tx_descs[idx];
+    uint8_t dcmd = E1000_TXD_CMD_DEXT | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS;
+    if (eop) dcmd |= E1000_TXD_CMD_EOP;
+    if (tso) dcmd |= E1000_TXD_CMD_TSE;
+    desc->addr = (uint64_t)(uintptr_t)addr;
+    desc->cmd_len = len | E1000_TXD_DTYP_D | ((uint32_t)dcmd << E1000_TXD_CMD_SHIFT);
     desc->status = 0;
+    desc->popts = E1000_TXD_POPTS_IXSM | E1000_TXD_POPTS_TXSM;
+}
+
+int e1000_send_gather(const uint8_t* hdr, uint16_t hdr_len,
+                      const uint8_t* payload, uint16_t payload_len, int flags) {
+    uint32_t length = (uint32_t)hdr_len + payload_len;
+    uint32_t max = (flags & E1000_TX_TSO) ? E1000_TSO_MAX : E1000_MAX_PKT_SIZE;
+    if (!e1000_initialized || length == 0 || length > max) return -1;
+    if (hdr_len && !hdr) return -1;
+    if (payload_len && !payload) return -1;
+    if (!payload_len || !hdr_len) flags &= ~E1000_TX_ZEROCOPY;
+
+    int offload = flags & (E1000_TX_CSUM | E1000_TX_TSO);
+    int tso = flags & E1000_TX_TSO;
+    e1000_tx_ctx_desc_t ctx;
+    if (offload && e1000_tx_context(&ctx, hdr, hdr_len, payload_len, flags) < 0) return -1;
+    int load_ctx = offload && !(e1000_dev.tx_ctx_valid &&
+                                memcmp(&ctx, &e1000_dev.tx_ctx, sizeof(ctx)) == 0);
+
+    // Copied payload fills the header's buffer, then buffers of its own;
+    // a zero-copy payload is split only at the descriptor size limit
+    int zerocopy = flags & E1000_TX_ZEROCOPY;
+    uint32_t inline_len = 0;
+    if (!zerocopy) {
+        inline_len = E1000_TX_BUF_SIZE - hdr_len;
+        if (inline_len > payload_len) inline_len = payload_len;
+    }
+    uint32_t rest = payload_len - inline_len;
+    int pieces = (int)((rest + E1000_TX_BUF_SIZE - 1) / E1000_TX_BUF_SIZE);
+    e1000_tx_reserve(load_ctx + 1 + pieces, 1 + (zerocopy ? 0 : pieces));
 
+    uint16_t cur = e1000_dev.tx_cur;
+    if (load_ctx) {
+        e1000_tx_ctx_desc_t* cdesc = (e1000_tx_ctx_desc_t*)&e1000_dev.tx_descs[cur];
+        *cdesc = ctx;
+        cdesc->status = 0;
+        e1000_dev.tx_ctx = ctx;
+        e1000_dev.tx_ctx_valid = 1;
+        cur = (cur + 1) % E1000_NUM_TX_DESC;
+    }
+
+    uint8_t* buf = e1000_buf_get();
+    memcpy(buf, hdr, hdr_len);
+    memcpy(buf + hdr_len, payload, inline_len);
+    e1000_dev.tx_bufs[cur] = buf;
+    e1000_tx_fill(cur, buf, hdr_len + inline_len, pieces == 0, offload, tso);
+
+    const uint8_t* p = payload + inline_len;
+    for (int i = 0; i < pieces; i++) {
+        uint32_t n = rest < E1000_TX_BUF_SIZE ? rest : E1000_TX_BUF_SIZE;
+        cur = (cur + 1) % E1000_NUM_TX_DESC;
+        const uint8_t* addr = p;
+        if (!zerocopy) {
+            uint8_t* pbuf = e1000_buf_get();
+            memcpy(pbuf, p, n);
+            e1000_dev.tx_bufs[cur] = pbuf;
+            addr = pbuf;
+        }
+        e1000_tx_fill(cur, addr, n, i == pieces - 1, offload, tso);
+        p += n;
+        rest -= n;
+    }
+
+    // Short frames are padded by the NIC (TCTL.PSP)
     e1000_dev.tx_cur = (cur + 1) % E1000_NUM_TX_DESC;
-    e1000_write_reg(E1000_TDT, e1000_dev.tx_cur);
+    if (!e1000_dev.tx_batch) e1000_tx_kick();
 
     e1000_dev.packets_tx++;
     e1000_dev.bytes_tx += length;
+    nettap_capture(hdr, hdr_len, payload, payload_len);
+
+    return (int)length;
+}
+
+int e1000_offload_caps(void) {
+    // Every supported 8254x model has checksum offload and TSO
+    return e1000_initialized ? (E1000_TX_CSUM | E1000_TX_TSO) : 0;
+}
 
-    return length;
+void e1000_tx_batch_begin(void) {
+    e1000_dev.tx_batch++;
+}
+
+void e1000_tx_batch_end(void) {
+    if (e1000_dev.tx_batch > 0 && --e1000_dev.tx_batch == 0 && e1000_initialized)
+        e1000_tx_kick();
+}
+
+void e1000_tx_flush(void) {
+    if (!e1000_initialized) return;
+    e1000_tx_kick();
+    // Descriptors complete in order: the last one queued finishes last
+    e1000_tx_wait((e1000_dev.tx_cur + E1000_NUM_TX_DESC - 1) % E1000_NUM_TX_DESC);
+    e1000_tx_reclaim();
 }
 
 int e1000_receive(uint8_t* buffer, uint16_t max_len) {
     if (!e1000_initialized || !buffer) return 0;
 
-    uint16_t cur = e1000_dev.rx_cur;
-    e1000_rx_desc_t* desc = &e1000_dev.rx_descs[cur];
+    e1000_rxq_t* rxq = &e1000_dev.rxq[0];
+    uint16_t cur = rxq->cur;
+    e1000_rx_desc_t* desc = &rxq->descs[cur];
 
     if (!(desc->status & E1000_RXD_STAT_DD))
         return 0; // No packet available
@@ -280,15 +535,14 @@ int e1000_receive(uint8_t* buffer, uint16_t max_len) {
     if (len > max_len) len = max_len;
 
     // Copy data from RX buffer
-    uint8_t* src = e1000_dev.rx_bufs[cur];
-    for (uint16_t i = 0; i < len; i++)
-        buffer[i] = src[i];
+    memcpy(buffer, rxq->bufs[cur], len);
+    nettap_capture(buffer, len, 0, 0);
 
     // Reset descriptor
     desc->status = 0;
 
     uint16_t old_cur = cur;
-    e1000_dev.rx_cur = (cur + 1) % E1000_NUM_RX_DESC;
+    rxq->cur = (cur + 1) % E1000_NUM_RX_DESC;
     e1000_write_reg(E1000_RDT, old_cur);
 
     e1000_dev.packets_rx++;
@@ -297,20 +551,232 @@ int e1000_receive(uint8_t* buffer, uint16_t max_len) {
     return len;
 }
 
+// Hand up to budget frames from one queue to the stack
+static int e1000_rxq_poll(e1000_rxq_t* rxq, int budget) {
+    int done = 0;
+    uint16_t cur = rxq->cur;
+    while (done < budget) {
+        e1000_rx_desc_t* desc = &rxq->descs[cur];
+        if (!(desc->status & E1000_RXD_STAT_DD)) break;
+
+        uint16_t len = desc->length;
+        if (len > E1000_RX_BUF_SIZE) len = E1000_RX_BUF_SIZE;
+        uint8_t status = desc->status;
+        int bad = 0, rx_flags = 0;
+        if (!(status & E1000_RXD_STAT_IXSM)) {
+            bad = ((status & E1000_RXD_STAT_IPCS) && (desc->errors & E1000_RXD_ERR_IPE)) ||
+                  ((status & E1000_RXD_STAT_TCPCS) && (desc->errors & E1000_RXD_ERR_TCPE));
+            if (status & E1000_RXD_STAT_IPCS) rx_flags = ETH_RX_CSUM_OK;
+        }
+        if (bad) {
+            e1000_dev.rx_csum_errs++;
+            e1000_dev.errors++;
+        } else {
+            nettap_capture(rxq->bufs[cur], len, 0, 0);
+            eth_receive(rxq->bufs[cur], len, rx_flags);
+            e1000_dev.packets_rx++;
+            e1000_dev.bytes_rx += len;
+        }
+
+        desc->status = 0;
+        cur = (cur + 1) % E1000_NUM_RX_DESC;
+        done++;
+    }
+    if (done) {
+        // Give the drained descriptors back in one tail update
+        rxq->cur = cur;
+        e1000_write_reg(E1000_RDT + (uint32_t)(rxq - e1000_dev.rxq) * E1000_RXQ_STRIDE,
+                        (cur + E1000_NUM_RX_DESC - 1) % E1000_NUM_RX_DESC);
+    }
+    return done;
+}
+
+int e1000_rx_poll(int budget) {
+    if (!e1000_initialized) return 0;
+    return e1000_rxq_poll(&e1000_dev.rxq[0], budget);
+}
+
+// Interrupt cause bits of a queue: its own with MSI-X, else all of RX
+static uint32_t e1000_rxq_causes(e1000_rxq_t* rxq) {
+    return rxq->vector >= 0 ? E1000_ICR_RXQ(rxq - e1000_dev.rxq) : E1000_ICR_RX;
+}
+
+static int e1000_rx_due(void* arg) {
+    return ((e1000_rxq_t*)arg)->pending;
+}
+
+// RX bottom half of queue q: runs with its interrupt masked until the
+// ring is empty
+static void e1000_rx_loop(int q) {
+    e1000_rxq_t* rxq = &e1000_dev.rxq[q];
+    uint32_t causes = e1000_rxq_causes(rxq);
+    for (;;) {
+        waitq_wait(&rx_wq[q], e1000_rx_due, rxq);
+        rxq->pending = 0;
+
+        for (;;) {
+            if (e1000_rxq_poll(rxq, E1000_RX_BUDGET) == E1000_RX_BUDGET) {
+                // Under load: stay in polling mode, let others run
+                rxq->polls++;
+                scheduler_yield();
+                continue;
+            }
+            e1000_write_reg(E1000_IMS, causes);
+            // A frame that landed before the unmask may not interrupt
+            if (!(rxq->descs[rxq->cur].status & E1000_RXD_STAT_DD)) break;
+            e1000_write_reg(E1000_IMC, causes);
+        }
+    }
+}
+
+static void e1000_rx_thread0(void) { e1000_rx_loop(0); }
+static void e1000_rx_thread1(void) { e1000_rx_loop(1); }
+static void (*const rx_threads[E1000_MAX_RX_QUEUES])(void) = {
+    e1000_rx_thread0, e1000_rx_thread1
+};
+
+// Queue interrupt taken: mask it until the bottom half has drained the ring
+static void e1000_rxq_kick(e1000_rxq_t* rxq) {
+    e1000_write_reg(E1000_IMC, e1000_rxq_causes(rxq));
+    rxq->irqs++;
+    rxq->pending = 1;
+    waitq_wake_all(&rx_wq[rxq - e1000_dev.rxq]);
+}
+
+static void e1000_irq(registers_t* regs) {
+    (void)regs;
+    e1000_irq_handler();
+}
+
+static void e1000_msi_irq(void* ctx) {
+    (void)ctx;
+    e1000_irq_handler();
+}
+
+static void e1000_msix_irq(void* ctx) {
+    e1000_rxq_kick((e1000_rxq_t*)ctx);
+}
+
+// Program RSS to spread flows over the first nq queues
+static void e1000_setup_rss(int nq) {
+    for (int i = 0; i < 10; i++) e1000_write_reg(E1000_RSSRK + i * 4, rss_key[i]);
+    for (int r = 0; r < E1000_RETA_ENTRIES / 4; r++) {
+        uint32_t val = 0;
+        for (int j = 0; j < 4; j++) {
+            if ((r * 4 + j) % nq) val |= (uint32_t)E1000_RETA_QUEUE << (8 * j);
+        }
+        e1000_write_reg(E1000_RETA + r * 4, val);
+    }
+    e1000_write_reg(E1000_MRQC, E1000_MRQC_RSS | E1000_MRQC_TCP4 | E1000_MRQC_IP4);
+}
+
+// 82574 on SMP: an RX queue per CPU, each with an MSI-X vector aimed at
+// that CPU. Returns the number of queues running, 0 if not possible.
+static int e1000_start_multiqueue(void) {
+    int nq = smp_cpu_count();
+    if (nq > E1000_MAX_RX_QUEUES) nq = E1000_MAX_RX_QUEUES;
+    if (!e1000_dev.multiqueue || nq < 2 || !e1000_pci || pci_msix_count(e1000_pci) < nq)
+        return 0;
+
+    // Extra rings come out of the pool, stopped receiver
+    uint32_t rctl = e1000_read_reg(E1000_RCTL);
+    e1000_write_reg(E1000_RCTL, rctl & ~E1000_RCTL_EN);
+    int ok = 1;
+    for (int q = 1; q < nq && ok; q++) {
+        ok = e1000_pool_add(E1000_NUM_RX_DESC) == 0 && e1000_init_rxq(q) == 0;
+    }
+    if (!ok) {
+        e1000_write_reg(E1000_RCTL, rctl);
+        return 0;
+    }
+
+    // Vectors first: enabling MSI-X turns the INTx line off
+    int vec[E1000_MAX_RX_QUEUES];
+    for (int q = 0; q < nq; q++) {
+        vec[q] = isr_alloc_msi(e1000_msix_irq, &e1000_dev.rxq[q]);
+        if (vec[q] < 0) {
+            while (q > 0) isr_free_vector(vec[--q]);
+            e1000_write_reg(E1000_RCTL, rctl);
+            return 0;
+        }
+    }
+
+    uint32_t ivar = 0;
+    for (int q = 0; q < nq; q++) {
+        e1000_rxq_t* rxq = &e1000_dev.rxq[q];
+        rxq->cpu = q;
+        rxq->vector = vec[q];
+        pci_msix_set(e1000_pci, q, (uint8_t)vec[q], smp_cpu_apic_id(q));
+        ivar |= (uint32_t)(q | E1000_IVAR_VALID) << (4 * q);
+    }
+    e1000_write_reg(E1000_CTRL_EXT, e1000_read_reg(E1000_CTRL_EXT) | E1000_CTRL_EXT_PBA);
+    e1000_write_reg(E1000_IVAR, ivar);
+    e1000_write_reg(E1000_EIAC, E1000_ICR_RXQ(0) | E1000_ICR_RXQ(1));
+
+    // The descriptor's checksum field carries the RSS hash instead
+    e1000_write_reg(E1000_RXCSUM, E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL | E1000_RXCSUM_PCSD);
+    e1000_setup_rss(nq);
+    e1000_dev.num_rxq = nq;
+    e1000_write_reg(E1000_RCTL, rctl);
+    return nq;
+}
+
+void e1000_start_rx(void) {
+    if (!e1000_initialized || e1000_dev.rx_irq_ok) return;
+
+    e1000_write_reg(E1000_IMC, E1000_ICR_RX);
+    if (!e1000_start_multiqueue()) {
+        // One vector: MSI where the function has it, else the INTx line
+        // if the MADT says where it lands. Otherwise RX stays polled.
+        if (!apic_is_active() || !e1000_pci) return;
+        int msi = pci_find_capability(e1000_pci, PCI_CAP_ID_MSI) != 0;
+        if (!msi && (e1000_dev.irq == 0 || e1000_dev.irq >= 16 ||
+                     !ioapic_irq_level_override(e1000_dev.irq))) return;
+        int v = msi ? isr_alloc_msi(e1000_msi_irq, 0) : 0;
+        if (v < 0) return;
+        if (process_create("e1000rx", e1000_rx_thread0, PRIORITY_HIGH) < 0) {
+            if (msi) isr_free_vector(v);
+            return;
+        }
+        if (msi && pci_msi_enable(e1000_pci, (uint8_t)v, (uint8_t)lapic_get_id()) < 0) {
+            isr_free_vector(v);   // The thread just sleeps; RX stays polled
+            return;
+        }
+        if (!msi) {
+            irq_install_handler(e1000_dev.irq, e1000_irq);
+            ioapic_set_irq(e1000_dev.irq, APIC_IRQ_BASE + e1000_dev.irq, lapic_get_id(), 0);
+        }
+    } else {
+        for (int q = 0; q < e1000_dev.num_rxq; q++) {
+            process_create_on(q ? "e1000rx1" : "e1000rx0", rx_threads[q], PRIORITY_HIGH,
+                              e1000_dev.rxq[q].cpu);
+        }
+    }
+    e1000_dev.rx_irq_ok = 1;
+
+    // Frames that arrived while polled are picked up by the first pass
+    for (int q = 0; q < e1000_dev.num_rxq; q++) {
+        e1000_dev.rxq[q].pending = 1;
+        waitq_wake_all(&rx_wq[q]);
+    }
+}
+
+int e1000_rx_irq_active(void) {
+    return e1000_dev.rx_irq_ok;
+}
+
 void e1000_irq_handler(void) {
     if (!e1000_initialized) return;
 
     uint32_t icr = e1000_read_reg(E1000_ICR);
 
-    if (icr & 0x04) {
+    if (icr & E1000_ICR_LSC) {
         // Link status change
         uint32_t status = e1000_read_reg(E1000_STATUS);
         e1000_dev.link_up = (status & 2) ? 1 : 0;
     }
 
-    if (icr & 0x80) {
-        // Packet received - will be handled by polling
-    }
+    if ((icr & E1000_ICR_RX) && e1000_dev.rx_irq_ok) e1000_rxq_kick(&e1000_dev.rxq[0]);
 }
 
 int e1000_link_status(void) {
@@ -327,3 +793,26 @@ uint32_t e1000_get_rx_count(void) {
 uint32_t e1000_get_tx_count(void) {
     return e1000_dev.packets_tx;
 }
+
+void e1000_get_stats(e1000_stats_t* out) {
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+    if (!e1000_initialized) return;
+    // The hardware counters clear on read: fold them into ours
+    e1000_dev.rx_missed += e1000_read_reg(E1000_MPC);
+    e1000_dev.rx_no_bufs += e1000_read_reg(E1000_RNBC);
+
+    out->rx_packets = e1000_dev.packets_rx;
+    out->rx_bytes = e1000_dev.bytes_rx;
+    out->tx_packets = e1000_dev.packets_tx;
+    out->tx_bytes = e1000_dev.bytes_tx;
+    out->tx_kicks = e1000_dev.tx_kicks;
+    out->errors = e1000_dev.errors;
+    out->rx_csum_errs = e1000_dev.rx_csum_errs;
+    out->rx_missed = e1000_dev.rx_missed;
+    out->rx_no_bufs = e1000_dev.rx_no_bufs;
+    for (int q = 0; q < e1000_dev.num_rxq; q++) {
+        out->rx_irqs += e1000_dev.rxq[q].irqs;
+        out->rx_busy_polls += e1000_dev.rxq[q].polls;
+    }
+}
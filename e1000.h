@@ -1,4 +1,35 @@
 // e1000.h - Intel E1000 NIC Driver for Alteo OS
+// Received frames are handed to the network stack in place, straight from
+// the RX ring. Once e1000_start_rx() has run (and the I/O APIC routes the
+// NIC's PCI interrupt) an e1000rx kernel thread does this NAPI-style: an
+// RX interrupt masks further RX interrupts and wakes the thread, which
+// drains up to E1000_RX_BUDGET frames per pass. While passes keep using
+// their whole budget it stays in polling mode, yielding between passes;
+// once the ring is empty it unmasks RX interrupts and sleeps. Without
+// interrupts, socket_poll() drains the ring from the main loop instead.
+//
+// An 82574 on an SMP machine gets one RX queue per CPU (up to
+// E1000_MAX_RX_QUEUES): receive-side scaling hashes each TCP/IPv4 flow to
+// a queue, and each queue has its own MSI-X vector aimed at its CPU and
+// its own e1000rx thread pinned there, so a flow is always processed on
+// the same CPU. There is a single TX queue.
+//
+// Every ring is one page of descriptors each. Packet buffers are halves
+// of PMM pages kept in a pool: RX descriptors own theirs and re-post it
+// once the stack has consumed the frame, TX descriptors take one per frame
+// and give it back when the NIC reports the descriptor done. The pool has
+// fewer TX buffers than TX descriptors, since zero-copy payloads need none.
+//
+// The NIC can fill in IPv4 and TCP/UDP checksums and cut one large TCP
+// send into MSS-sized segments (TSO). Both are asked for per frame: a
+// context descriptor ahead of the data describes where the headers are,
+// and is only re-sent when the parameters change. On receive the NIC
+// verifies checksums too; frames it finds corrupt are dropped here.
+//
+// Queuing a frame normally ends with a write of the TX tail register. A
+// sender with several frames in hand brackets them with
+// e1000_tx_batch_begin() / e1000_tx_batch_end(), and the tail is written
+// once for the lot (or earlier, if the ring fills and the NIC must run).
 #ifndef E1000_H
 #define E1000_H
 
@@ -13,11 +44,14 @@
 // Register offsets
 #define E1000_CTRL          0x0000  // Device Control
 #define E1000_STATUS        0x0008  // Device Status
+#define E1000_CTRL_EXT      0x0018  // Extended Device Control
 #define E1000_EECD          0x0010  // EEPROM Control
 #define E1000_EERD          0x0014  // EEPROM Read
 #define E1000_ICR           0x00C0  // Interrupt Cause Read
 #define E1000_IMS           0x00D0  // Interrupt Mask Set
 #define E1000_IMC           0x00D8  // Interrupt Mask Clear
+#define E1000_EIAC          0x00DC  // Interrupt Auto Clear (82574, MSI-X)
+#define E1000_IVAR          0x00E4  // Interrupt Vector Allocation (82574)
 #define E1000_RCTL          0x0100  // Receive Control
 #define E1000_TCTL          0x0400  // Transmit Control
 #define E1000_RDBAL         0x2800  // RX Descriptor Base Low
@@ -25,6 +59,7 @@
 #define E1000_RDLEN         0x2808  // RX Descriptor Length
 #define E1000_RDH           0x2810  // RX Descriptor Head
 #define E1000_RDT           0x2818  // RX Descriptor Tail
+#define E1000_RXQ_STRIDE    0x0100  // Register offset of the next RX queue
 #define E1000_TDBAL         0x3800  // TX Descriptor Base Low
 #define E1000_TDBAH         0x3804  // TX Descriptor Base High
 #define E1000_TDLEN         0x3808  // TX Descriptor Length
@@ -33,6 +68,29 @@
 #define E1000_RAL           0x5400  // Receive Address Low
 #define E1000_RAH           0x5404  // Receive Address High
 #define E1000_MTA           0x5200  // Multicast Table Array
+#define E1000_RXCSUM        0x5000  // Receive Checksum Control
+#define E1000_MRQC          0x5818  // Multiple Receive Queues Command
+#define E1000_RETA          0x5C00  // RSS redirection table (32 registers)
+#define E1000_RSSRK         0x5C80  // RSS random key (10 registers)
+#define E1000_MPC           0x4010  // Missed Packets Count (clears on read)
+#define E1000_RNBC          0x40A0  // Receive No Buffers Count (clears on read)
+
+// Interrupt causes (ICR / IMS / IMC)
+#define E1000_ICR_LSC       (1 << 2)   // Link Status Change
+#define E1000_ICR_RXDMT0    (1 << 4)   // RX Descriptor Minimum Threshold
+#define E1000_ICR_RXO       (1 << 6)   // Receiver Overrun
+#define E1000_ICR_RXT0      (1 << 7)   // Receiver Timer (frame received)
+#define E1000_ICR_RX        (E1000_ICR_RXDMT0 | E1000_ICR_RXO | E1000_ICR_RXT0)
+#define E1000_ICR_RXQ(q)    (1 << (20 + (q)))  // 82574 MSI-X: RX queue q
+
+// 82574 multi-queue
+#define E1000_CTRL_EXT_PBA  (1U << 31)  // PBA support, required for MSI-X
+#define E1000_IVAR_VALID    0x8         // Per 4-bit IVAR field: vector is used
+#define E1000_MRQC_RSS      0x1         // Spread receive over queues by RSS hash
+#define E1000_MRQC_TCP4     (1 << 16)   // Hash TCP/IPv4 by addresses and ports
+#define E1000_MRQC_IP4      (1 << 17)   // Hash other IPv4 by addresses
+#define E1000_RETA_ENTRIES  128
+#define E1000_RETA_QUEUE    0x80        // Queue-index bit of a RETA entry
 
 // Control register bits
 #define E1000_CTRL_SLU      (1 << 6)   // Set Link Up
@@ -61,19 +119,43 @@
 // TX descriptor command bits
 #define E1000_TXD_CMD_EOP   (1 << 0)  // End of Packet
 #define E1000_TXD_CMD_IFCS  (1 << 1)  // Insert FCS
+#define E1000_TXD_CMD_TSE   (1 << 2)  // TCP Segmentation Enable
 #define E1000_TXD_CMD_RS    (1 << 3)  // Report Status
+#define E1000_TXD_CMD_DEXT  (1 << 5)  // Extended descriptor
 #define E1000_TXD_STAT_DD   (1 << 0)  // Descriptor Done
 
+// Extended TX descriptor fields
+#define E1000_TXD_DTYP_D    (1 << 20) // Data descriptor (context is 0)
+#define E1000_TXD_CMD_SHIFT 24        // DCMD / TUCMD in cmd_len
+#define E1000_TUCMD_TCP     (1 << 0)  // Context: L4 is TCP (else UDP)
+#define E1000_TUCMD_IP      (1 << 1)  // Context: L3 is IPv4
+#define E1000_TXD_POPTS_IXSM (1 << 0) // Insert IP checksum
+#define E1000_TXD_POPTS_TXSM (1 << 1) // Insert TCP/UDP checksum
+
+// Receive checksum control bits
+#define E1000_RXCSUM_IPOFL  (1 << 8)  // IP checksum offload
+#define E1000_RXCSUM_TUOFL  (1 << 9)  // TCP/UDP checksum offload
+#define E1000_RXCSUM_PCSD   (1 << 13) // Report the RSS hash, not the packet checksum
+
 // RX descriptor status bits
 #define E1000_RXD_STAT_DD   (1 << 0)  // Descriptor Done
 #define E1000_RXD_STAT_EOP  (1 << 1)  // End of Packet
+#define E1000_RXD_STAT_IXSM (1 << 2)  // Checksum indication not valid
+#define E1000_RXD_STAT_TCPCS (1 << 5) // TCP/UDP checksum checked
+#define E1000_RXD_STAT_IPCS (1 << 6)  // IP checksum checked
+#define E1000_RXD_ERR_TCPE  (1 << 5)  // TCP/UDP checksum error
+#define E1000_RXD_ERR_IPE   (1 << 6)  // IP checksum error
 
 // Ring buffer sizes
-#define E1000_NUM_RX_DESC   32
-#define E1000_NUM_TX_DESC   32
+#define E1000_NUM_RX_DESC   256     // 16-byte descriptors: one page per ring
+#define E1000_NUM_TX_DESC   256
 #define E1000_RX_BUF_SIZE   2048
 #define E1000_TX_BUF_SIZE   2048
+#define E1000_MAX_RX_QUEUES 2       // 82574: two RX queues
+#define E1000_POOL_BUFS     (E1000_MAX_RX_QUEUES * E1000_NUM_RX_DESC + E1000_NUM_TX_DESC / 2)
 #define E1000_MAX_PKT_SIZE  1518
+#define E1000_TSO_MAX       65535   // Largest frame handed over for TSO
+#define E1000_RX_BUDGET     16      // Frames handed up per polling pass
 
 // RX Descriptor
 typedef struct __attribute__((packed)) {
@@ -96,6 +178,42 @@ typedef struct __attribute__((packed)) {
     uint16_t special;
 } e1000_tx_desc_t;
 
+// TX context descriptor: checksum and segmentation parameters for the
+// data descriptors that follow it
+typedef struct __attribute__((packed)) {
+    uint8_t  ipcss;      // IP checksum start
+    uint8_t  ipcso;      // IP checksum offset
+    uint16_t ipcse;      // IP checksum end (inclusive)
+    uint8_t  tucss;      // TCP/UDP checksum start
+    uint8_t  tucso;      // TCP/UDP checksum offset
+    uint16_t tucse;      // TCP/UDP checksum end (0: end of frame)
+    uint32_t cmd_len;    // TSO payload length, TUCMD
+    uint8_t  status;     // Status
+    uint8_t  hdrlen;     // TSO: header bytes repeated in every segment
+    uint16_t mss;        // TSO: payload bytes per segment
+} e1000_tx_ctx_desc_t;
+
+// TX extended data descriptor
+typedef struct __attribute__((packed)) {
+    uint64_t addr;       // Buffer address
+    uint32_t cmd_len;    // Data length, DTYP, DCMD
+    uint8_t  status;     // Status
+    uint8_t  popts;      // Checksums to insert
+    uint16_t special;
+} e1000_tx_data_desc_t;
+
+// One RX queue: its ring and the e1000rx thread draining it
+typedef struct {
+    e1000_rx_desc_t* descs;
+    uint8_t* bufs[E1000_NUM_RX_DESC];
+    uint16_t cur;
+    int      cpu;           // CPU its thread is pinned to
+    int      vector;        // MSI-X vector, -1 on the shared INTx line
+    volatile int pending;   // Interrupt seen, ring not drained yet
+    uint32_t irqs;          // Interrupts taken
+    uint32_t polls;         // Polling passes that used their whole budget
+} e1000_rxq_t;
+
 // E1000 device structure
 typedef struct {
     uint32_t mmio_base;     // MMIO base address
@@ -104,25 +222,51 @@ typedef struct {
     uint8_t  mac[6];        // MAC address
     int      has_eeprom;    // EEPROM present
     int      link_up;       // Link status
+    uint8_t  irq;           // PCI interrupt line
+    int      rx_irq_ok;     // RX interrupts drive the e1000rx threads
+    int      multiqueue;    // 82574: RSS and MSI-X are available
 
-    // RX ring buffer
-    e1000_rx_desc_t* rx_descs;
-    uint8_t* rx_bufs[E1000_NUM_RX_DESC];
-    uint16_t rx_cur;
+    // RX queues (more than one only with RSS)
+    e1000_rxq_t rxq[E1000_MAX_RX_QUEUES];
+    int      num_rxq;
 
     // TX ring buffer
     e1000_tx_desc_t* tx_descs;
-    uint8_t* tx_bufs[E1000_NUM_TX_DESC];
-    uint16_t tx_cur;
+    uint8_t* tx_bufs[E1000_NUM_TX_DESC];   // Pool buffer held until done, or 0
+    uint16_t tx_cur;        // Next descriptor to fill
+    uint16_t tx_clean;      // Oldest descriptor not yet reclaimed
+    uint16_t tx_tail;       // Tail last written to TDT
+    int      tx_batch;      // Open batch depth: TDT writes are deferred
+    e1000_tx_ctx_desc_t tx_ctx;  // Offload context the NIC last loaded
+    int      tx_ctx_valid;
 
     // Statistics
     uint32_t packets_rx;
     uint32_t packets_tx;
     uint32_t bytes_rx;
     uint32_t bytes_tx;
+    uint32_t tx_kicks;      // TDT writes
     uint32_t errors;
+    uint32_t rx_csum_errs;  // Frames dropped for a bad checksum
+    uint32_t rx_missed;     // Frames the NIC dropped: RX ring full (MPC)
+    uint32_t rx_no_bufs;    // Times the NIC found no free RX descriptor (RNBC)
 } e1000_device_t;
 
+// Counters for /proc/net/dev
+typedef struct {
+    uint32_t rx_packets;
+    uint32_t rx_bytes;
+    uint32_t tx_packets;
+    uint32_t tx_bytes;
+    uint32_t tx_kicks;
+    uint32_t errors;
+    uint32_t rx_csum_errs;
+    uint32_t rx_missed;
+    uint32_t rx_no_bufs;
+    uint32_t rx_irqs;       // Over all RX queues
+    uint32_t rx_busy_polls;
+} e1000_stats_t;
+
 // Initialize E1000 driver (scan PCI, set up rings)
 int  e1000_init(void);
 
@@ -135,9 +279,48 @@ void e1000_get_mac(uint8_t mac[6]);
 // Send a raw ethernet frame
 int  e1000_send(const uint8_t* data, uint16_t length);
 
+// e1000_send_gather flags
+#define E1000_TX_ZEROCOPY   0x1   // DMA the payload in place (second descriptor)
+#define E1000_TX_CSUM       0x2   // NIC inserts the IPv4 and TCP/UDP checksums
+#define E1000_TX_TSO        0x4   // NIC segments a TCP frame of up to E1000_TSO_MAX
+#define E1000_TX_MSS_SHIFT  16    // TSO segment payload size, in the upper bits
+
+// Send a frame made of a header (copied into the TX buffer) and a payload.
+// With E1000_TX_ZEROCOPY the NIC reads the payload where it lies, which
+// must be identity-mapped kernel memory left unchanged until
+// e1000_tx_flush(); otherwise it is copied behind the header.
+// With E1000_TX_CSUM or E1000_TX_TSO the header must hold exactly the
+// Ethernet, IPv4 and transport headers; the IP checksum is left for the
+// NIC and the transport checksum field seeded with the pseudo-header sum
+// (without the length for TSO). Returns the frame length, or -1.
+int  e1000_send_gather(const uint8_t* hdr, uint16_t hdr_len,
+                       const uint8_t* payload, uint16_t payload_len, int flags);
+
+// E1000_TX_CSUM / E1000_TX_TSO if the NIC is up to offer them
+int  e1000_offload_caps(void);
+
+// Defer TDT writes until the matching e1000_tx_batch_end() (batches nest)
+void e1000_tx_batch_begin(void);
+void e1000_tx_batch_end(void);
+
+// Wait until every queued frame has been read by the NIC
+void e1000_tx_flush(void);
+
 // Receive a raw ethernet frame (returns bytes read, 0 if none)
 int  e1000_receive(uint8_t* buffer, uint16_t max_len);
 
+// Hand up to budget received frames to eth_receive() in place. Returns
+// the number delivered.
+int  e1000_rx_poll(int budget);
+
+// Route the NIC interrupt and start the e1000rx threads (after smp_init).
+// An 82574 with MSI-X gets an RSS queue per CPU; otherwise one queue on
+// the I/O APIC, and without one receive stays polled.
+void e1000_start_rx(void);
+
+// Whether the e1000rx threads own the RX rings
+int  e1000_rx_irq_active(void);
+
 // Handle E1000 interrupt
 void e1000_irq_handler(void);
 
@@ -147,5 +330,6 @@ int  e1000_link_status(void);
 // Get statistics
 uint32_t e1000_get_rx_count(void);
 uint32_t e1000_get_tx_count(void);
+void e1000_get_stats(e1000_stats_t* out);
 
 #endif
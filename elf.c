@@ -1,23 +1,16 @@
 // elf.c - ELF64 Loader for Alteo OS
 // Parses ELF64 binaries and maps segments into process address spaces
 #include "elf.h"
+#include "klib.h"
 #include "vmm.h"
 #include "pmm.h"
 #include "vfs.h"
+#include "heap.h"
+#include "dynlink.h"
+#include "vdso.h"
 
 // ---------- Helpers ----------
 
-static void elf_memset(void* ptr, int val, uint64_t size) {
-    uint8_t* p = (uint8_t*)ptr;
-    for (uint64_t i = 0; i < size; i++) p[i] = (uint8_t)val;
-}
-
-static void elf_memcpy(void* dst, const void* src, uint64_t size) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (uint64_t i = 0; i < size; i++) d[i] = s[i];
-}
-
 // Convert ELF program header flags to VMM page flags
 static uint64_t elf_flags_to_vmm(uint32_t p_flags) {
     uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_USER;
@@ -65,7 +58,7 @@ int elf_validate(const void* data, uint64_t size) {
 int elf_load(const void* data, uint64_t size, pte_t* pml4, elf_load_result_t* result) {
     if (!data || !pml4 || !result) return -1;
 
-    elf_memset(result, 0, sizeof(elf_load_result_t));
+    memset(result, 0, sizeof(elf_load_result_t));
 
     // Validate ELF header
     if (!elf_validate(data, size)) return -1;
@@ -111,7 +104,7 @@ int elf_load(const void* data, uint64_t size, pte_t* pml4, elf_load_result_t* re
             // Allocate a physical page
             void* phys = pmm_alloc_block();
             if (!phys) return -1;
-            elf_memset(phys, 0, VMM_PAGE_SIZE);
+            memset(phys, 0, VMM_PAGE_SIZE);
 
             // Map it into the process address space
             if (vmm_map_page(pml4, page, (uint64_t)phys, flags) < 0) {
@@ -125,7 +118,7 @@ int elf_load(const void* data, uint64_t size, pte_t* pml4, elf_load_result_t* re
         if (filesz > 0) {
             const uint8_t* src = file + phdr->p_offset;
             uint8_t* dst = (uint8_t*)vaddr;
-            elf_memcpy(dst, src, filesz);
+            memcpy(dst, src, filesz);
         }
 
         // BSS: the region from filesz to memsz is already zeroed (pages were zeroed)
@@ -139,50 +132,197 @@ int elf_load(const void* data, uint64_t size, pte_t* pml4, elf_load_result_t* re
     return 0;
 }
 
-int elf_load_from_fd(int fd, pte_t* pml4, elf_load_result_t* result) {
-    if (fd < 0 || !pml4 || !result) return -1;
+// ---------- Demand-paged loading ----------
 
-    elf_memset(result, 0, sizeof(elf_load_result_t));
+#define ELF_PAGE_MASK   (~(uint64_t)(VMM_PAGE_SIZE - 1))
 
-    // Read the full file into a temporary buffer
-    // First, get the file size by seeking to end
-    int old_pos = vfs_tell(fd);
-    vfs_seek(fd, 0, VFS_SEEK_END);
-    int file_size = vfs_tell(fd);
-    vfs_seek(fd, 0, VFS_SEEK_SET);
+// Pages [*lo, *hi) a PT_LOAD segment occupies
+static void elf_seg_pages(const Elf64_Phdr* ph, uint64_t* lo, uint64_t* hi) {
+    *lo = ph->p_vaddr & ELF_PAGE_MASK;
+    *hi = (ph->p_vaddr + ph->p_memsz + VMM_PAGE_SIZE - 1) & ELF_PAGE_MASK;
+}
+
+// Whether page has to be filled at load time rather than faulted in: it
+// is shared by two segments (one VMA cannot map both), or a segment's file
+// data ends inside it and .bss follows (the file page goes on with
+// whatever comes next in the file, not zeros)
+static int elf_page_eager(const Elf64_Phdr* ph, int phnum, uint64_t page) {
+    int segs = 0;
+    for (int i = 0; i < phnum; i++) {
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue;
+        uint64_t lo, hi;
+        elf_seg_pages(&ph[i], &lo, &hi);
+        if (page < lo || page >= hi) continue;
+        if (++segs > 1) return 1;
+        uint64_t file_end = ph[i].p_vaddr + ph[i].p_filesz;
+        if (ph[i].p_filesz && ph[i].p_memsz > ph[i].p_filesz &&
+            (file_end & ~ELF_PAGE_MASK) && (file_end & ELF_PAGE_MASK) == page) return 1;
+    }
+    return 0;
+}
 
-    if (file_size <= 0 || file_size > 4 * 1024 * 1024) {
-        // File too large or empty (max 4MB for now)
+// Build page from the file bytes of every segment that touches it, with
+// zeros everywhere else, and map it at page + bias with the union of
+// their permissions
+static int elf_fill_page(int fd, const Elf64_Phdr* ph, int phnum, pte_t* pml4,
+                         uint64_t bias, uint64_t page) {
+    uint8_t* frame = (uint8_t*)pmm_alloc_block();
+    if (!frame) return -1;
+    memset(frame, 0, VMM_PAGE_SIZE);
+
+    uint64_t flags = 0;
+    for (int i = 0; i < phnum; i++) {
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue;
+        uint64_t lo, hi;
+        elf_seg_pages(&ph[i], &lo, &hi);
+        if (page < lo || page >= hi) continue;
+        flags |= elf_flags_to_vmm(ph[i].p_flags);
+
+        uint64_t a = ph[i].p_vaddr > page ? ph[i].p_vaddr : page;
+        uint64_t b = ph[i].p_vaddr + ph[i].p_filesz;
+        if (b > page + VMM_PAGE_SIZE) b = page + VMM_PAGE_SIZE;
+        if (a >= b) continue;
+        uint32_t n = (uint32_t)(b - a);
+        if (vfs_pread(fd, frame + (a - page), n,
+                      (uint32_t)(ph[i].p_offset + (a - ph[i].p_vaddr))) != (int)n) {
+            pmm_free_block(frame);
+            return -1;
+        }
+    }
+
+    if (vmm_map_page(pml4, page + bias, (uint64_t)frame, flags) < 0) {
+        pmm_free_block(frame);
         return -1;
     }
+    return 0;
+}
 
-    // Allocate temporary buffer for the file
-    // Use physical pages directly since we're identity-mapped
-    uint64_t pages_needed = ((uint64_t)file_size + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
-    void* buf = pmm_alloc_block(); // First page for small files
-    if (!buf) return -1;
+// Drop eager pages from both ends of [*a, *b)
+static void elf_trim_eager(const Elf64_Phdr* ph, int phnum, uint64_t* a, uint64_t* b) {
+    while (*a < *b && elf_page_eager(ph, phnum, *a)) *a += VMM_PAGE_SIZE;
+    while (*b > *a && elf_page_eager(ph, phnum, *b - VMM_PAGE_SIZE)) *b -= VMM_PAGE_SIZE;
+}
 
-    // For simplicity, only support files up to one page (4KB) in this initial version
-    // TODO: Support larger files by allocating multiple pages
-    int bytes_to_read = file_size;
-    if (bytes_to_read > (int)VMM_PAGE_SIZE) bytes_to_read = (int)VMM_PAGE_SIZE;
+int elf_map_from_fd(int fd, int pid, pte_t* pml4, uint64_t bias, elf_load_result_t* result) {
+    if (fd < 0 || !pml4 || !result || (bias & ~ELF_PAGE_MASK)) return -1;
 
-    (void)pages_needed;
+    memset(result, 0, sizeof(elf_load_result_t));
 
-    int n = vfs_read(fd, buf, bytes_to_read);
-    if (n <= 0) {
-        pmm_free_block(buf);
-        return -1;
+    vfs_node_t* node = vfs_fd_node(fd);
+    if (!node || node->type != VFS_FILE) return -1;
+
+    Elf64_Ehdr ehdr;
+    if (vfs_pread(fd, &ehdr, sizeof(ehdr), 0) != (int)sizeof(ehdr)) return -1;
+    if (!elf_validate(&ehdr, node->size)) return -1;
+    if (ehdr.e_phentsize < sizeof(Elf64_Phdr)) return -1;
+
+    int phnum = ehdr.e_phnum;
+    Elf64_Phdr* ph = (Elf64_Phdr*)kmalloc((uint64_t)phnum * sizeof(Elf64_Phdr));
+    if (!ph) return -1;
+    for (int i = 0; i < phnum; i++) {
+        uint32_t off = (uint32_t)(ehdr.e_phoff + (uint64_t)i * ehdr.e_phentsize);
+        if (vfs_pread(fd, &ph[i], sizeof(Elf64_Phdr), off) != (int)sizeof(Elf64_Phdr)) {
+            kfree(ph);
+            return -1;
+        }
     }
 
-    // Restore file position
-    vfs_seek(fd, old_pos, VFS_SEEK_SET);
+    result->entry_point = ehdr.e_entry + bias;
+    result->bias = bias;
+    result->load_base = 0xFFFFFFFFFFFFFFFF;
+    result->load_end = 0;
+
+    const vmm_pager_t* pager = vfs_get_pager();
+    int ret = -1;
+
+    for (int i = 0; i < phnum; i++) {
+        const Elf64_Phdr* p = &ph[i];
+        if (p->p_type == PT_DYNAMIC) result->dynamic = p->p_vaddr + bias;
+        if (p->p_type != PT_LOAD) continue;
+        if (p->p_memsz == 0) continue;
+
+        // File data has to sit at the same page offset as its address
+        if (p->p_filesz > p->p_memsz) goto out;
+        if (p->p_filesz && p->p_offset + p->p_filesz > node->size) goto out;
+        if ((p->p_offset ^ p->p_vaddr) & ~ELF_PAGE_MASK) goto out;
+
+        uint64_t vaddr = p->p_vaddr;
+        uint64_t filesz = p->p_filesz;
+        uint64_t flags = elf_flags_to_vmm(p->p_flags);
+        uint64_t lo, hi;
+        elf_seg_pages(p, &lo, &hi);
+
+        if (vaddr + bias < result->load_base) result->load_base = vaddr + bias;
+        if (vaddr + bias + p->p_memsz > result->load_end) result->load_end = vaddr + bias + p->p_memsz;
+
+        // File pages, mapped copy-on-write: read-only text keeps pointing
+        // at the page cache frame, so every process running it shares it
+        uint64_t file_lo = lo;
+        uint64_t file_hi = (vaddr + filesz + VMM_PAGE_SIZE - 1) & ELF_PAGE_MASK;
+        if (!filesz) file_hi = lo;
+        uint64_t a = file_lo, b = file_hi;
+        elf_trim_eager(ph, phnum, &a, &b);
+        if (a < b && vmm_vma_reserve_file(pid, a + bias, b - a, flags, pager, node,
+                                          (p->p_offset & ELF_PAGE_MASK) / VMM_PAGE_SIZE
+                                          + (a - lo) / VMM_PAGE_SIZE) < 0) goto out;
+
+        // .bss pages past the file data, zero-filled on first touch
+        a = file_hi;
+        b = hi;
+        elf_trim_eager(ph, phnum, &a, &b);
+        if (a < b && vmm_vma_reserve(pid, a + bias, b - a, flags, VMM_VMA_ANON) < 0) goto out;
+
+        if (p->p_memsz > filesz) {
+            result->bss_start = vaddr + bias + filesz;
+            result->bss_end = vaddr + bias + p->p_memsz;
+        }
+    }
 
-    // Load the ELF
-    int ret = elf_load(buf, (uint64_t)n, pml4, result);
+    // The few pages no VMA covers are read in now
+    for (int i = 0; i < phnum; i++) {
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue;
+        uint64_t lo, hi;
+        elf_seg_pages(&ph[i], &lo, &hi);
+        uint64_t edge[3] = { lo, hi - VMM_PAGE_SIZE,
+                             (ph[i].p_vaddr + ph[i].p_filesz) & ELF_PAGE_MASK };
+        for (int e = 0; e < 3; e++) {
+            if (edge[e] < lo || edge[e] >= hi) continue;
+            if (!elf_page_eager(ph, phnum, edge[e])) continue;
+            if (vmm_get_physical(pml4, edge[e] + bias)) continue;   // Filled for another segment
+            if (elf_fill_page(fd, ph, phnum, pml4, bias, edge[e]) < 0) goto out;
+        }
+    }
 
-    // Free temporary buffer
-    pmm_free_block(buf);
+    result->success = 1;
+    ret = 0;
 
+out:
+    // Pages already filled in go with the address space; drop the VMAs
+    if (ret < 0 && result->load_end > result->load_base) {
+        uint64_t base = result->load_base & ELF_PAGE_MASK;
+        vmm_vma_release(pid, pml4, base, result->load_end - base);
+    }
+    kfree(ph);
     return ret;
 }
+
+int elf_load_from_fd(int fd, int pid, pte_t* pml4, elf_load_result_t* result) {
+    if (fd < 0 || !pml4 || !result) return -1;
+
+    // Position-independent executables go at ELF_PIE_BASE
+    Elf64_Ehdr ehdr;
+    if (vfs_pread(fd, &ehdr, sizeof(ehdr), 0) != (int)sizeof(ehdr)) return -1;
+    uint64_t bias = ehdr.e_type == ET_DYN ? ELF_PIE_BASE : 0;
+
+    dl_release(pid);
+    if (elf_map_from_fd(fd, pid, pml4, bias, result) < 0) return -1;
+
+    // Dynamically linked: the kernel is the interpreter, whatever
+    // PT_INTERP names
+    if (result->dynamic && dl_link(pid, pml4, vfs_fd_node(fd), bias) < 0) {
+        result->success = 0;
+        return -1;
+    }
+    vdso_map(pml4, pid);
+    return 0;
+}
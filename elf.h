@@ -22,6 +22,9 @@
 // ELF Machine types
 #define EM_X86_64       62  // AMD x86-64
 
+// Where a position-independent executable is loaded
+#define ELF_PIE_BASE    0x555555554000ULL
+
 // Program header types
 #define PT_NULL         0
 #define PT_LOAD         1   // Loadable segment
@@ -86,6 +89,72 @@ typedef struct {
     uint64_t sh_entsize;     // Entry size (if section holds table)
 } __attribute__((packed)) Elf64_Shdr;
 
+// Dynamic section tags
+#define DT_NULL         0
+#define DT_NEEDED       1   // Name (strtab offset) of a needed library
+#define DT_PLTRELSZ     2   // Size of the PLT relocations
+#define DT_PLTGOT       3   // Address of the GOT (GOT[1], GOT[2] reserved)
+#define DT_HASH         4   // SysV symbol hash table
+#define DT_STRTAB       5
+#define DT_SYMTAB       6
+#define DT_RELA         7
+#define DT_RELASZ       8
+#define DT_RELAENT      9
+#define DT_STRSZ        10
+#define DT_SYMENT       11
+#define DT_PLTREL       20
+#define DT_JMPREL       23  // PLT relocations
+#define DT_BIND_NOW     24
+#define DT_FLAGS        30
+#define DT_GNU_HASH     0x6FFFFEF5
+#define DT_FLAGS_1      0x6FFFFFFB
+
+#define DF_BIND_NOW     0x8
+#define DF_1_NOW        0x1
+
+// Symbol binding / type / section
+#define STB_LOCAL       0
+#define STB_GLOBAL      1
+#define STB_WEAK        2
+#define STB_GNU_UNIQUE  10
+#define STT_TLS         6
+#define SHN_UNDEF       0
+#define ELF64_ST_BIND(i)    ((i) >> 4)
+#define ELF64_ST_TYPE(i)    ((i) & 0xF)
+
+// x86-64 relocation types
+#define R_X86_64_NONE       0
+#define R_X86_64_64         1   // S + A
+#define R_X86_64_COPY       5   // Copy the symbol's data into the executable
+#define R_X86_64_GLOB_DAT   6   // S
+#define R_X86_64_JUMP_SLOT  7   // S (PLT entry)
+#define R_X86_64_RELATIVE   8   // B + A
+#define ELF64_R_SYM(i)      ((uint32_t)((i) >> 32))
+#define ELF64_R_TYPE(i)     ((uint32_t)(i))
+
+// Dynamic section entry
+typedef struct {
+    int64_t  d_tag;
+    uint64_t d_val;          // Value or address, depending on the tag
+} __attribute__((packed)) Elf64_Dyn;
+
+// Symbol table entry
+typedef struct {
+    uint32_t st_name;        // String table offset
+    uint8_t  st_info;        // Binding and type
+    uint8_t  st_other;
+    uint16_t st_shndx;       // Section (SHN_UNDEF if undefined)
+    uint64_t st_value;
+    uint64_t st_size;
+} __attribute__((packed)) Elf64_Sym;
+
+// Relocation with addend
+typedef struct {
+    uint64_t r_offset;       // Address to patch
+    uint64_t r_info;         // Symbol index and type
+    int64_t  r_addend;
+} __attribute__((packed)) Elf64_Rela;
+
 // ELF load result
 typedef struct {
     uint64_t entry_point;    // Entry point address
@@ -93,6 +162,8 @@ typedef struct {
     uint64_t load_end;       // Highest mapped virtual address + size
     uint64_t bss_start;      // Start of BSS segment
     uint64_t bss_end;        // End of BSS segment
+    uint64_t bias;           // Added to the file's addresses (0 for ET_EXEC)
+    uint64_t dynamic;        // Address of the dynamic section (0 if static)
     int      success;        // 1 if loaded successfully, 0 otherwise
 } elf_load_result_t;
 
@@ -106,10 +177,24 @@ int elf_validate(const void* data, uint64_t size);
 // result: output structure with entry point and memory layout
 int elf_load(const void* data, uint64_t size, pte_t* pml4, elf_load_result_t* result);
 
-// Load an ELF64 binary from a VFS file descriptor
+// Map an ELF64 object's PT_LOAD segments from a VFS file descriptor,
+// moved up by bias (page aligned), as elf_load_from_fd() describes. Used
+// by the dynamic linker for shared objects.
+int elf_map_from_fd(int fd, int pid, pte_t* pml4, uint64_t bias, elf_load_result_t* result);
+
+// Load an ELF64 binary from a VFS file descriptor without reading it in.
+// PT_LOAD segments are reserved as private file-backed VMAs of process pid
+// that fault their pages in from the file's page cache, so read-only text
+// maps the file's own frames and is shared by every process running the
+// binary; writable data is copied on write and .bss is zero-filled on
+// first touch. Only pages holding the end of a segment's file data next
+// to .bss, or shared by two segments, are filled in here. ET_DYN binaries
+// load at ELF_PIE_BASE, and binaries with a PT_DYNAMIC segment are linked
+// against their shared libraries by dl_link().
 // fd: open file descriptor to read the ELF from
+// pid: process owning the VMAs (the one pml4 belongs to)
 // pml4: process's page table
 // result: output structure
-int elf_load_from_fd(int fd, pte_t* pml4, elf_load_result_t* result);
+int elf_load_from_fd(int fd, int pid, pte_t* pml4, elf_load_result_t* result);
 
 #endif
@@ -0,0 +1,312 @@
+// epoll.c - Readiness Notification for Alteo OS
+// Registrations come from a fixed pool. Each one is linked on its
+// source's list (for notify) and, while possibly ready, on its instance's
+// ready list (FIFO). epoll_wait() confirms readiness with the source's
+// poll function and keeps level-triggered entries queued, so a wait costs
+// O(ready) regardless of how many sources are registered.
+#include "epoll.h"
+#include "klib.h"
+#include "waitq.h"
+#include "timer.h"
+#include "spinlock.h"
+
+typedef struct {
+    int           in_use;
+    int           ep;           // Owning instance
+    int           key;          // User fd
+    uint32_t      events;       // Interest mask (+ EPOLLET)
+    uint64_t      data;
+    pollsrc_t*    src;
+    epoll_poll_fn fn;
+    uint64_t      arg;
+    int           src_next;     // Next registration on the same source (-1 = end)
+    int           rdy_next;     // Next on the instance's ready list (-1 = end)
+    int           on_ready;
+} epoll_item_t;
+
+typedef struct {
+    int          in_use;
+    int          rdy_head;      // -1 = empty
+    int          rdy_tail;
+    int          rdy_count;
+    waitq_t      waitq;         // Processes in epoll_wait()
+    volatile int expired;       // Timeout of the current wait fired
+    uint32_t     gen;           // Bumped per timed wait (stale timers are ignored)
+} epoll_inst_t;
+
+static epoll_item_t items[EPOLL_MAX_ITEMS];
+static epoll_inst_t insts[EPOLL_MAX_INSTANCES];
+static lockstat_t epoll_lock_stat = LOCKSTAT_INIT("epoll");
+static spinlock_t epoll_lock = SPINLOCK_INIT_STAT(epoll_lock_stat);
+
+static int epoll_valid(int ep) {
+    return ep >= 0 && ep < EPOLL_MAX_INSTANCES && insts[ep].in_use;
+}
+
+// ---------- Lists (epoll_lock held) ----------
+
+static void ready_push(int i) {
+    epoll_inst_t* in = &insts[items[i].ep];
+    if (items[i].on_ready) return;
+    items[i].on_ready = 1;
+    items[i].rdy_next = -1;
+    if (in->rdy_head < 0) in->rdy_head = i;
+    else items[in->rdy_tail].rdy_next = i;
+    in->rdy_tail = i;
+    in->rdy_count++;
+}
+
+static int ready_pop(epoll_inst_t* in) {
+    int i = in->rdy_head;
+    if (i < 0) return -1;
+    in->rdy_head = items[i].rdy_next;
+    if (in->rdy_head < 0) in->rdy_tail = -1;
+    in->rdy_count--;
+    items[i].on_ready = 0;
+    return i;
+}
+
+static void ready_remove(int i) {
+    if (!items[i].on_ready) return;
+    epoll_inst_t* in = &insts[items[i].ep];
+    int prev = -1;
+    for (int j = in->rdy_head; j >= 0; prev = j, j = items[j].rdy_next) {
+        if (j != i) continue;
+        if (prev < 0) in->rdy_head = items[i].rdy_next;
+        else items[prev].rdy_next = items[i].rdy_next;
+        if (in->rdy_tail == i) in->rdy_tail = prev;
+        in->rdy_count--;
+        break;
+    }
+    items[i].on_ready = 0;
+}
+
+static void src_unlink(int i) {
+    pollsrc_t* src = items[i].src;
+    int head = src->first - 1;
+    if (head == i) {
+        src->first = items[i].src_next + 1;
+        return;
+    }
+    for (int j = head; j >= 0; j = items[j].src_next) {
+        if (items[j].src_next == i) {
+            items[j].src_next = items[i].src_next;
+            return;
+        }
+    }
+}
+
+static void item_free(int i) {
+    ready_remove(i);
+    src_unlink(i);
+    items[i].in_use = 0;
+}
+
+static int item_find(int ep, int key) {
+    for (int i = 0; i < EPOLL_MAX_ITEMS; i++) {
+        if (items[i].in_use && items[i].ep == ep && items[i].key == key) return i;
+    }
+    return -1;
+}
+
+// ---------- Instances ----------
+
+void epoll_init(void) {
+    memset(items, 0, sizeof(items));
+    memset(insts, 0, sizeof(insts));
+}
+
+int epoll_create(void) {
+    uint64_t flags = spin_lock_irqsave(&epoll_lock);
+    for (int ep = 0; ep < EPOLL_MAX_INSTANCES; ep++) {
+        if (insts[ep].in_use) continue;
+        insts[ep].in_use = 1;
+        insts[ep].rdy_head = -1;
+        insts[ep].rdy_tail = -1;
+        insts[ep].rdy_count = 0;
+        insts[ep].expired = 0;
+        waitq_init(&insts[ep].waitq);
+        spin_unlock_irqrestore(&epoll_lock, flags);
+        return ep;
+    }
+    spin_unlock_irqrestore(&epoll_lock, flags);
+    return -1;
+}
+
+void epoll_destroy(int ep) {
+    uint64_t flags = spin_lock_irqsave(&epoll_lock);
+    if (!epoll_valid(ep)) {
+        spin_unlock_irqrestore(&epoll_lock, flags);
+        return;
+    }
+    for (int i = 0; i < EPOLL_MAX_ITEMS; i++) {
+        if (items[i].in_use && items[i].ep == ep) item_free(i);
+    }
+    insts[ep].in_use = 0;
+    spin_unlock_irqrestore(&epoll_lock, flags);
+    waitq_wake_all(&insts[ep].waitq);   // Waiters see the instance is gone
+}
+
+int epoll_add(int ep, int key, const epoll_event_t* ev,
+              pollsrc_t* src, epoll_poll_fn fn, uint64_t arg) {
+    if (!ev || !src) return -1;
+    uint64_t flags = spin_lock_irqsave(&epoll_lock);
+    if (!epoll_valid(ep)) {
+        spin_unlock_irqrestore(&epoll_lock, flags);
+        return -1;
+    }
+    if (item_find(ep, key) >= 0) {
+        spin_unlock_irqrestore(&epoll_lock, flags);
+        return -2;
+    }
+    int i = -1;
+    for (int j = 0; j < EPOLL_MAX_ITEMS; j++) {
+        if (!items[j].in_use) { i = j; break; }
+    }
+    if (i < 0) {
+        spin_unlock_irqrestore(&epoll_lock, flags);
+        return -1;
+    }
+
+    epoll_item_t* it = &items[i];
+    it->in_use = 1;
+    it->ep = ep;
+    it->key = key;
+    it->events = ev->events;
+    it->data = ev->data;
+    it->src = src;
+    it->fn = fn;
+    it->arg = arg;
+    it->on_ready = 0;
+    it->src_next = src->first - 1;
+    src->first = i + 1;
+
+    // The source may already be ready: let the next wait find out
+    ready_push(i);
+    spin_unlock_irqrestore(&epoll_lock, flags);
+    waitq_wake_all(&insts[ep].waitq);
+    return 0;
+}
+
+int epoll_mod(int ep, int key, const epoll_event_t* ev) {
+    if (!ev) return -1;
+    uint64_t flags = spin_lock_irqsave(&epoll_lock);
+    int i = epoll_valid(ep) ? item_find(ep, key) : -1;
+    if (i < 0) {
+        spin_unlock_irqrestore(&epoll_lock, flags);
+        return -1;
+    }
+    items[i].events = ev->events;
+    items[i].data = ev->data;
+    ready_push(i);
+    spin_unlock_irqrestore(&epoll_lock, flags);
+    waitq_wake_all(&insts[ep].waitq);
+    return 0;
+}
+
+int epoll_del(int ep, int key) {
+    uint64_t flags = spin_lock_irqsave(&epoll_lock);
+    int i = epoll_valid(ep) ? item_find(ep, key) : -1;
+    if (i >= 0) item_free(i);
+    spin_unlock_irqrestore(&epoll_lock, flags);
+    return i >= 0 ? 0 : -1;
+}
+
+int epoll_has_ready(int ep) {
+    return epoll_valid(ep) && insts[ep].rdy_head >= 0;
+}
+
+// ---------- Waiting ----------
+
+// Pop up to max entries that are still ready; level-triggered ones go back
+// on the tail. Each queued entry is examined at most once per call.
+static int epoll_collect(int ep, epoll_event_t* out, int max) {
+    uint64_t flags = spin_lock_irqsave(&epoll_lock);
+    if (!epoll_valid(ep)) {
+        spin_unlock_irqrestore(&epoll_lock, flags);
+        return -1;
+    }
+    epoll_inst_t* in = &insts[ep];
+    int n = 0;
+    for (int todo = in->rdy_count; todo > 0 && n < max; todo--) {
+        int i = ready_pop(in);
+        if (i < 0) break;
+        epoll_item_t* it = &items[i];
+        uint32_t got = it->fn ? it->fn(it->arg) : it->events;
+        got &= (it->events & ~EPOLLET) | EPOLLERR | EPOLLHUP;
+        if (!got) continue;   // Not ready after all; the source will notify again
+
+        out[n].events = got;
+        out[n].data = it->data;
+        n++;
+        if (!(it->events & EPOLLET)) ready_push(i);
+    }
+    spin_unlock_irqrestore(&epoll_lock, flags);
+    return n;
+}
+
+static int epoll_wait_cond(void* arg) {
+    epoll_inst_t* in = (epoll_inst_t*)arg;
+    return !in->in_use || in->rdy_head >= 0 || in->expired;
+}
+
+static void epoll_timeout(uint64_t arg) {
+    epoll_inst_t* in = &insts[arg & 0xFF];
+    if (in->gen != (uint32_t)(arg >> 8)) return;   // Left over from an earlier wait
+    in->expired = 1;
+    waitq_wake_all(&in->waitq);
+}
+
+int epoll_wait(int ep, epoll_event_t* out, int max, int timeout_ms) {
+    if (!epoll_valid(ep) || !out || max <= 0) return -1;
+    epoll_inst_t* in = &insts[ep];
+
+    // Without the clock a timed wait degrades to a poll
+    if (timeout_ms > 0 && !timer_is_active()) timeout_ms = 0;
+    int tid = -1;
+    in->expired = 0;
+    if (timeout_ms > 0) {
+        in->gen++;
+        uint64_t deadline = timer_now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+        tid = timer_add(deadline, epoll_timeout, ((uint64_t)in->gen << 8) | (uint64_t)ep);
+    }
+
+    if (max > EPOLL_MAX_EVENTS) max = EPOLL_MAX_EVENTS;
+    epoll_event_t batch[EPOLL_MAX_EVENTS];
+    int n;
+    for (;;) {
+        n = epoll_collect(ep, batch, max);
+        if (n != 0 || timeout_ms == 0 || in->expired) break;
+        if (waitq_wait(&in->waitq, epoll_wait_cond, in) < 0) break;   // Kernel process: poll only
+    }
+    if (tid >= 0) timer_cancel(tid);
+
+    for (int i = 0; i < n; i++) out[i] = batch[i];
+    return n;
+}
+
+// ---------- Sources ----------
+
+void pollsrc_notify(pollsrc_t* src) {
+    if (!src->first) return;   // Nobody registered: no lock taken
+    uint32_t wake = 0;         // Instances to wake (EPOLL_MAX_INSTANCES <= 32)
+    uint64_t flags = spin_lock_irqsave(&epoll_lock);
+    for (int i = src->first - 1; i >= 0; i = items[i].src_next) {
+        ready_push(i);
+        wake |= 1U << items[i].ep;
+    }
+    spin_unlock_irqrestore(&epoll_lock, flags);
+
+    while (wake) {
+        int ep = __builtin_ctz(wake);
+        wake &= wake - 1;
+        waitq_wake_all(&insts[ep].waitq);
+    }
+}
+
+void pollsrc_detach(pollsrc_t* src) {
+    if (!src->first) return;
+    uint64_t flags = spin_lock_irqsave(&epoll_lock);
+    while (src->first) item_free(src->first - 1);
+    spin_unlock_irqrestore(&epoll_lock, flags);
+}
@@ -0,0 +1,75 @@
+// epoll.h - Readiness Notification for Alteo OS
+// An epoll instance holds an interest set of event sources. Sources
+// (pipes, TCP connections, devfs devices) embed a pollsrc_t and call
+// pollsrc_notify() when their state changes; that moves the interested
+// entries onto their instance's ready list and wakes its waiters, so
+// epoll_wait() only looks at entries that may be ready.
+#ifndef EPOLL_H
+#define EPOLL_H
+
+#include "stdint.h"
+
+// Event bits (same values as the POLL* bits in syscall.h)
+#define EPOLLIN       0x001
+#define EPOLLOUT      0x004
+#define EPOLLERR      0x008
+#define EPOLLHUP      0x010
+#define EPOLLET       0x80000000U   // Edge-triggered: report once per notify
+
+// epoll_ctl operations
+#define EPOLL_CTL_ADD  1
+#define EPOLL_CTL_DEL  2
+#define EPOLL_CTL_MOD  3
+
+// Limits
+#define EPOLL_MAX_INSTANCES  32
+#define EPOLL_MAX_ITEMS      256    // Registrations across all instances
+#define EPOLL_MAX_EVENTS     32     // Events returned by one epoll_wait()
+
+typedef struct {
+    uint32_t events;        // Requested events / reported events
+    uint64_t data;          // Returned unchanged with each event
+} epoll_event_t;
+
+// Embedded in every event source; zero-initialized = no registrations
+typedef struct {
+    int first;              // 1 + first registration on this source, 0 = none
+} pollsrc_t;
+
+// Returns the source's current readiness (EPOLL* bits)
+typedef uint32_t (*epoll_poll_fn)(uint64_t arg);
+
+void epoll_init(void);
+
+// Create an instance. Returns its id, or -1 if none are free.
+int epoll_create(void);
+
+// Drop an instance and all of its registrations
+void epoll_destroy(int ep);
+
+// Register a source under 'key' (the user fd). fn(arg) is called to
+// confirm readiness. Returns 0, -1 on bad arguments/full table,
+// -2 if the key is already registered.
+int epoll_add(int ep, int key, const epoll_event_t* ev,
+              pollsrc_t* src, epoll_poll_fn fn, uint64_t arg);
+
+// Change/remove a registration. Return 0, or -1 if the key is unknown.
+int epoll_mod(int ep, int key, const epoll_event_t* ev);
+int epoll_del(int ep, int key);
+
+// Collect up to max (at most EPOLL_MAX_EVENTS) ready events. timeout_ms:
+// -1 = wait forever, 0 = do not wait. Events are gathered under the lock
+// and copied to 'out' afterwards, so 'out' may be user memory.
+// Returns the number of events, or -1 on a bad instance.
+int epoll_wait(int ep, epoll_event_t* out, int max, int timeout_ms);
+
+// 1 if the instance has entries on its ready list
+int epoll_has_ready(int ep);
+
+// Called by a source whenever its readiness may have changed
+void pollsrc_notify(pollsrc_t* src);
+
+// Called before a source is freed or reused: drops its registrations
+void pollsrc_detach(pollsrc_t* src);
+
+#endif
@@ -1,11 +1,14 @@
 // ethernet.c - Ethernet Frame Layer for Alteo OS
 #include "ethernet.h"
+#include "klib.h"
 #include "e1000.h"
 #include "ip.h"
+#include "timer.h"
 
 static uint8_t our_mac[ETH_ALEN] = {0};
 static arp_entry_t arp_cache[ARP_CACHE_SIZE];
 static int eth_ready = 0;
+static eth_stats_t eth_stats;
 
 // Byte swap helpers
 uint16_t htons(uint16_t val) {
@@ -27,32 +30,7 @@ uint32_t ntohl(uint32_t val) {
     return htonl(val);
 }
 
-// Memory helpers
-static void eth_memcpy(void* dst, const void* src, int n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (int i = 0; i < n; i++) d[i] = s[i];
-}
-
-static void eth_memset(void* dst, uint8_t val, int n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (int i = 0; i < n; i++) d[i] = val;
-}
-
-static int eth_memcmp(const void* a, const void* b, int n) {
-    const uint8_t* p = (const uint8_t*)a;
-    const uint8_t* q = (const uint8_t*)b;
-    for (int i = 0; i < n; i++) {
-        if (p[i] != q[i]) return p[i] - q[i];
-    }
-    return 0;
-}
-
 void eth_init(void) {
-    // Initialize ARP cache
-    for (int i = 0; i < ARP_CACHE_SIZE; i++)
-        arp_cache[i].valid = 0;
-
     // Get MAC from NIC driver
     if (e1000_is_available()) {
         e1000_get_mac(our_mac);
@@ -63,37 +41,72 @@ void eth_init(void) {
 }
 
 void eth_get_mac(uint8_t mac[6]) {
-    eth_memcpy(mac, our_mac, 6);
+    memcpy(mac, our_mac, 6);
 }
 
 int eth_send(const uint8_t dest_mac[6], uint16_t ethertype,
              const uint8_t* payload, uint16_t payload_len) {
-    if (!eth_ready || !payload || payload_len > ETH_MTU)
+    if (!payload) return -1;
+    return eth_send_gather(dest_mac, ethertype, 0, 0, payload, payload_len, 0);
+}
+
+int eth_send_gather(const uint8_t dest_mac[6], uint16_t ethertype,
+                    const uint8_t* hdr, uint16_t hdr_len,
+                    const uint8_t* payload, uint16_t payload_len, int flags) {
+    uint32_t max = (flags & ETH_TX_TSO) ? 0xFFFF : ETH_MTU;
+    if (!eth_ready || hdr_len > ETH_TX_HDR_MAX || (uint32_t)hdr_len + payload_len > max) {
+        eth_stats.tx_errors++;
         return -1;
+    }
 
-    uint8_t frame[ETH_FRAME_MAX];
-    eth_header_t* hdr = (eth_header_t*)frame;
+    // Only the headers are assembled here; the NIC driver copies or
+    // references the payload directly (short frames are padded by the NIC)
+    uint8_t head[ETH_HLEN + ETH_TX_HDR_MAX];
+    eth_header_t* eh = (eth_header_t*)head;
+    memcpy(eh->dest, dest_mac, ETH_ALEN);
+    memcpy(eh->src, our_mac, ETH_ALEN);
+    eh->ethertype = htons(ethertype);
+    if (hdr_len) memcpy(head + ETH_HLEN, hdr, hdr_len);
+
+    int nic_flags = 0;
+    if (flags & ETH_TX_ZEROCOPY) nic_flags |= E1000_TX_ZEROCOPY;
+    if (flags & ETH_TX_CSUM) nic_flags |= E1000_TX_CSUM;
+    if (flags & ETH_TX_TSO) {
+        uint32_t mss = (uint32_t)flags >> ETH_TX_MSS_SHIFT;
+        nic_flags |= E1000_TX_TSO | (int)(mss << E1000_TX_MSS_SHIFT);
+    }
+    int r = e1000_send_gather(head, ETH_HLEN + hdr_len, payload, payload_len, nic_flags);
+    if (r < 0) eth_stats.tx_errors++;
+    else eth_stats.tx_frames++;
+    return r;
+}
 
-    // Build header
-    eth_memcpy(hdr->dest, dest_mac, ETH_ALEN);
-    eth_memcpy(hdr->src, our_mac, ETH_ALEN);
-    hdr->ethertype = htons(ethertype);
+int eth_tx_offloads(void) {
+    if (!eth_ready) return 0;
+    int caps = e1000_offload_caps();
+    return ((caps & E1000_TX_CSUM) ? ETH_TX_CSUM : 0) |
+           ((caps & E1000_TX_TSO) ? ETH_TX_TSO : 0);
+}
 
-    // Copy payload
-    eth_memcpy(frame + ETH_HLEN, payload, payload_len);
+void eth_tx_batch_begin(void) {
+    e1000_tx_batch_begin();
+}
 
-    // Pad if necessary
-    uint16_t frame_len = ETH_HLEN + payload_len;
-    if (frame_len < ETH_FRAME_MIN) {
-        eth_memset(frame + frame_len, 0, ETH_FRAME_MIN - frame_len);
-        frame_len = ETH_FRAME_MIN;
-    }
+void eth_tx_batch_end(void) {
+    e1000_tx_batch_end();
+}
 
-    return e1000_send(frame, frame_len);
+void eth_tx_flush(void) {
+    e1000_tx_flush();
 }
 
-void eth_receive(const uint8_t* frame, uint16_t length) {
-    if (!frame || length < ETH_HLEN) return;
+void eth_receive(const uint8_t* frame, uint16_t length, int flags) {
+    if (!frame || length < ETH_HLEN) {
+        eth_stats.rx_runts++;
+        return;
+    }
+    eth_stats.rx_frames++;
+    uint64_t t0 = timer_now_ns();
 
     const eth_header_t* hdr = (const eth_header_t*)frame;
     uint16_t ethertype = ntohs(hdr->ethertype);
@@ -105,57 +118,281 @@ void eth_receive(const uint8_t* frame, uint16_t length) {
             arp_process(payload, payload_len);
             break;
         case ETH_TYPE_IPV4:
-            ip_receive(payload, payload_len);
+            ip_receive(payload, payload_len, flags);
             break;
         default:
+            eth_stats.rx_unknown++;
             break;
     }
+
+    // Time the frame spent going up the stack (including any replies sent)
+    uint64_t dt = timer_now_ns() - t0;
+    eth_stats.rx_ns += dt;
+    if (dt > eth_stats.rx_ns_max) eth_stats.rx_ns_max = dt;
+}
+
+void eth_get_stats(eth_stats_t* out) {
+    if (out) *out = eth_stats;
 }
 
 // ---- ARP ----
 
+// Neighbour cache: entries are found through a hash on the IP address and
+// kept on an LRU list (head = most recently used) so a full cache evicts
+// the neighbour idle longest. An unresolved neighbour holds a few packets
+// from a shared pool and sends them once the reply arrives.
+
+typedef struct {
+    int      next;              // Next packet of the same neighbour, or the free list
+    uint16_t hdr_len;
+    uint16_t payload_len;
+    uint16_t ethertype;
+    int      flags;
+    uint8_t  data[ETH_TX_HDR_MAX + ETH_MTU];
+} arp_pending_t;
+
+static int arp_hash[ARP_HASH_SIZE];
+static int arp_lru_head, arp_lru_tail;
+static int arp_free;            // Unused cache entries, chained via hash_next
+static arp_pending_t arp_pending[ARP_PENDING_MAX];
+static int arp_pending_free;
+static uint32_t arp_last_scan;
+
+static uint32_t arp_now_ms(void) {
+    return (uint32_t)(timer_now_ns() / 1000000ULL);
+}
+
+static int arp_bucket(uint32_t ip) {
+    return (int)((ip * 2654435761u) >> 26) & (ARP_HASH_SIZE - 1);
+}
+
+static int arp_find(uint32_t ip) {
+    for (int i = arp_hash[arp_bucket(ip)]; i >= 0; i = arp_cache[i].hash_next) {
+        if (arp_cache[i].ip == ip) return i;
+    }
+    return -1;
+}
+
+static void arp_lru_unlink(int i) {
+    arp_entry_t* e = &arp_cache[i];
+    if (e->lru_prev >= 0) arp_cache[e->lru_prev].lru_next = e->lru_next;
+    else arp_lru_head = e->lru_next;
+    if (e->lru_next >= 0) arp_cache[e->lru_next].lru_prev = e->lru_prev;
+    else arp_lru_tail = e->lru_prev;
+}
+
+static void arp_lru_push(int i) {
+    arp_entry_t* e = &arp_cache[i];
+    e->lru_prev = -1;
+    e->lru_next = arp_lru_head;
+    if (arp_lru_head >= 0) arp_cache[arp_lru_head].lru_prev = i;
+    else arp_lru_tail = i;
+    arp_lru_head = i;
+}
+
+static void arp_touch(int i) {
+    if (arp_lru_head == i) return;
+    arp_lru_unlink(i);
+    arp_lru_push(i);
+}
+
+// Take the oldest queued packet off a neighbour
+static int arp_dequeue(arp_entry_t* e) {
+    int p = e->queue_head;
+    if (p < 0) return -1;
+    e->queue_head = arp_pending[p].next;
+    if (e->queue_head < 0) e->queue_tail = -1;
+    e->queue_len--;
+    return p;
+}
+
+static void arp_pending_put(int p) {
+    arp_pending[p].next = arp_pending_free;
+    arp_pending_free = p;
+}
+
+// Forget a neighbour, dropping what it has queued
+static void arp_remove(int i) {
+    arp_entry_t* e = &arp_cache[i];
+    int p;
+    while ((p = arp_dequeue(e)) >= 0) {
+        arp_pending_put(p);
+        eth_stats.arp_held_drops++;
+    }
+
+    int* link = &arp_hash[arp_bucket(e->ip)];
+    while (*link != i) link = &arp_cache[*link].hash_next;
+    *link = e->hash_next;
+    arp_lru_unlink(i);
+
+    e->state = ARP_STATE_FREE;
+    e->hash_next = arp_free;
+    arp_free = i;
+}
+
+// Entry for ip, new or recycled from the least recently used neighbour
+static int arp_create(uint32_t ip) {
+    if (arp_free < 0) {
+        arp_remove(arp_lru_tail);
+        eth_stats.arp_evictions++;
+    }
+    int i = arp_free;
+    arp_entry_t* e = &arp_cache[i];
+    arp_free = e->hash_next;
+
+    memset(e->mac, 0, 6);
+    e->ip = ip;
+    e->state = ARP_STATE_INCOMPLETE;
+    e->updated_ms = e->sent_ms = e->used_ms = arp_now_ms();
+    e->retries = 0;
+    e->queue_head = e->queue_tail = -1;
+    e->queue_len = 0;
+    int b = arp_bucket(ip);
+    e->hash_next = arp_hash[b];
+    arp_hash[b] = i;
+    arp_lru_push(i);
+    return i;
+}
+
 void arp_init(void) {
-    for (int i = 0; i < ARP_CACHE_SIZE; i++)
-        arp_cache[i].valid = 0;
+    for (int b = 0; b < ARP_HASH_SIZE; b++) arp_hash[b] = -1;
+    arp_lru_head = arp_lru_tail = -1;
+    arp_free = -1;
+    for (int i = ARP_CACHE_SIZE - 1; i >= 0; i--) {
+        arp_cache[i].state = ARP_STATE_FREE;
+        arp_cache[i].hash_next = arp_free;
+        arp_free = i;
+    }
+    arp_pending_free = -1;
+    for (int p = ARP_PENDING_MAX - 1; p >= 0; p--) arp_pending_put(p);
+    arp_last_scan = 0;
 }
 
 void arp_add_entry(uint32_t ip, const uint8_t mac[6]) {
-    // Check for existing entry
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].valid && arp_cache[i].ip == ip) {
-            eth_memcpy(arp_cache[i].mac, mac, 6);
-            return;
-        }
+    int i = arp_find(ip);
+    if (i < 0) i = arp_create(ip);
+    arp_entry_t* e = &arp_cache[i];
+    memcpy(e->mac, mac, 6);
+    e->state = ARP_STATE_REACHABLE;
+    e->updated_ms = arp_now_ms();
+    e->retries = 0;
+    arp_touch(i);
+
+    // Release what was waiting for this neighbour, in order
+    int p;
+    if (e->queue_head < 0) return;
+    eth_tx_batch_begin();
+    while ((p = arp_dequeue(e)) >= 0) {
+        arp_pending_t* pk = &arp_pending[p];
+        eth_send_gather(e->mac, pk->ethertype, pk->data, pk->hdr_len,
+                        pk->data + pk->hdr_len, pk->payload_len, pk->flags);
+        arp_pending_put(p);
     }
-    // Find empty slot
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (!arp_cache[i].valid) {
-            arp_cache[i].ip = ip;
-            eth_memcpy(arp_cache[i].mac, mac, 6);
-            arp_cache[i].valid = 1;
-            return;
-        }
-    }
-    // Cache full, overwrite first entry
-    arp_cache[0].ip = ip;
-    eth_memcpy(arp_cache[0].mac, mac, 6);
-    arp_cache[0].valid = 1;
+    eth_tx_batch_end();
 }
 
 int arp_resolve(uint32_t ip, uint8_t mac[6]) {
+    int i = arp_find(ip);
+    if (i >= 0 && arp_cache[i].state == ARP_STATE_REACHABLE) {
+        memcpy(mac, arp_cache[i].mac, 6);
+        arp_cache[i].used_ms = arp_now_ms();
+        arp_touch(i);
+        return 0;
+    }
+    // Start resolving; arp_timer repeats the request until it is answered
+    if (i < 0) {
+        arp_create(ip);
+        arp_send_request(ip);
+    }
+    return -1;
+}
+
+int arp_resolve_slot(uint32_t ip, uint8_t mac[6], int* slot) {
+    int i = *slot;
+    if (i >= 0 && i < ARP_CACHE_SIZE && arp_cache[i].ip == ip &&
+        arp_cache[i].state == ARP_STATE_REACHABLE) {
+        memcpy(mac, arp_cache[i].mac, 6);
+        arp_cache[i].used_ms = arp_now_ms();
+        arp_touch(i);
+        return 0;
+    }
+    int r = arp_resolve(ip, mac);
+    *slot = arp_find(ip);
+    return r;
+}
+
+int arp_queue(uint32_t ip, uint16_t ethertype, const uint8_t* hdr, uint16_t hdr_len,
+              const uint8_t* payload, uint16_t payload_len, int flags) {
+    int i = arp_find(ip);
+    if (i < 0 || arp_cache[i].state != ARP_STATE_INCOMPLETE ||
+        hdr_len > ETH_TX_HDR_MAX || payload_len > ETH_MTU) {    // TSO-sized
+        eth_stats.arp_held_drops++;
+        return -2;
+    }
+    arp_entry_t* e = &arp_cache[i];
+
+    // A full queue (or pool) makes room by dropping this neighbour's oldest
+    int p = -1;
+    if (e->queue_len < ARP_QUEUE_MAX && arp_pending_free >= 0) {
+        p = arp_pending_free;
+        arp_pending_free = arp_pending[p].next;
+    } else {
+        p = arp_dequeue(e);
+        eth_stats.arp_held_drops++;
+        if (p < 0) return -2;
+    }
+
+    // The payload is copied, so it no longer has to stay put for the NIC
+    arp_pending_t* pk = &arp_pending[p];
+    pk->hdr_len = hdr_len;
+    pk->payload_len = payload_len;
+    pk->ethertype = ethertype;
+    pk->flags = flags & ~ETH_TX_ZEROCOPY;
+    eth_stats.arp_held++;
+    memcpy(pk->data, hdr, hdr_len);
+    memcpy(pk->data + hdr_len, payload, payload_len);
+
+    pk->next = -1;
+    if (e->queue_tail >= 0) arp_pending[e->queue_tail].next = p;
+    else e->queue_head = p;
+    e->queue_tail = p;
+    e->queue_len++;
+    return 0;
+}
+
+void arp_timer(void) {
+    uint32_t now = arp_now_ms();
+    if (now - arp_last_scan < ARP_RETRY_MS / 4) return;
+    arp_last_scan = now;
+
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].valid && arp_cache[i].ip == ip) {
-            eth_memcpy(mac, arp_cache[i].mac, 6);
-            return 0;
+        arp_entry_t* e = &arp_cache[i];
+        if (e->state == ARP_STATE_FREE) continue;
+        if (e->state == ARP_STATE_REACHABLE) {
+            if (now - e->updated_ms < ARP_TIMEOUT_MS) continue;
+            if (now - e->used_ms >= ARP_TIMEOUT_MS) {
+                arp_remove(i);      // Aged out and idle: nothing to refresh
+                continue;
+            }
         }
+
+        // Unanswered (or aged out while in use): ask again a few times,
+        // then give up. An aged entry keeps its MAC in use until then.
+        if (now - e->sent_ms < ARP_RETRY_MS) continue;
+        if (e->retries >= ARP_MAX_RETRIES) {
+            arp_remove(i);
+            eth_stats.arp_failures++;
+            continue;
+        }
+        e->retries++;
+        e->sent_ms = now;
+        arp_send_request(e->ip);
     }
-    // Not found, send ARP request
-    arp_send_request(ip);
-    return -1;
 }
 
 void arp_send_request(uint32_t target_ip) {
     if (!eth_ready) return;
+    eth_stats.arp_requests++;
 
     net_config_t* cfg = ip_get_config();
     arp_header_t arp;
@@ -164,9 +401,9 @@ void arp_send_request(uint32_t target_ip) {
     arp.hw_len = 6;
     arp.proto_len = 4;
     arp.opcode = htons(ARP_REQUEST);
-    eth_memcpy(arp.sender_mac, our_mac, 6);
+    memcpy(arp.sender_mac, our_mac, 6);
     arp.sender_ip = htonl(cfg->ip_addr);
-    eth_memset(arp.target_mac, 0, 6);
+    memset(arp.target_mac, 0, 6);
     arp.target_ip = htonl(target_ip);
 
     uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
@@ -179,12 +416,16 @@ void arp_process(const uint8_t* data, uint16_t len) {
     const arp_header_t* arp = (const arp_header_t*)data;
     uint16_t opcode = ntohs(arp->opcode);
 
-    // Add sender to our cache regardless
-    arp_add_entry(ntohl(arp->sender_ip), arp->sender_mac);
+    // Refresh a neighbour we know; learn a new one only if it is talking
+    // to us, so broadcast chatter on a busy subnet cannot churn the cache
+    net_config_t* cfg = ip_get_config();
+    uint32_t sender = ntohl(arp->sender_ip);
+    int for_us = ntohl(arp->target_ip) == cfg->ip_addr;
+    if (sender && (for_us || arp_find(sender) >= 0))
+        arp_add_entry(sender, arp->sender_mac);
 
     if (opcode == ARP_REQUEST) {
-        net_config_t* cfg = ip_get_config();
-        if (ntohl(arp->target_ip) == cfg->ip_addr) {
+        if (for_us) {
             // It's for us, send reply
             arp_header_t reply;
             reply.hw_type = htons(ARP_HW_ETHER);
@@ -192,12 +433,13 @@ void arp_process(const uint8_t* data, uint16_t len) {
             reply.hw_len = 6;
             reply.proto_len = 4;
             reply.opcode = htons(ARP_REPLY);
-            eth_memcpy(reply.sender_mac, our_mac, 6);
+            memcpy(reply.sender_mac, our_mac, 6);
             reply.sender_ip = htonl(cfg->ip_addr);
-            eth_memcpy(reply.target_mac, arp->sender_mac, 6);
+            memcpy(reply.target_mac, arp->sender_mac, 6);
             reply.target_ip = arp->sender_ip;
 
             eth_send(arp->sender_mac, ETH_TYPE_ARP, (uint8_t*)&reply, sizeof(reply));
+            eth_stats.arp_replies++;
         }
     }
 }
@@ -50,16 +50,50 @@ typedef struct __attribute__((packed)) {
 #define ARP_REQUEST     1
 #define ARP_REPLY       2
 #define ARP_HW_ETHER    1
-#define ARP_CACHE_SIZE  32
+#define ARP_CACHE_SIZE  64
+#define ARP_HASH_SIZE   64      // Buckets (power of two)
+#define ARP_TIMEOUT_MS  60000   // A reply is trusted this long, then re-asked
+#define ARP_RETRY_MS    1000    // Between requests to an unanswering neighbour
+#define ARP_MAX_RETRIES 3
+#define ARP_QUEUE_MAX   4       // Packets held per unresolved neighbour
+#define ARP_PENDING_MAX 32      // Packets held in all
+
+// ARP cache entry states
+#define ARP_STATE_FREE        0
+#define ARP_STATE_INCOMPLETE  1 // Request sent, no reply yet
+#define ARP_STATE_REACHABLE   2
 
 // ARP cache entry
 typedef struct {
     uint32_t ip;
     uint8_t  mac[6];
-    uint32_t timestamp;
-    int      valid;
+    int      state;
+    uint32_t updated_ms;    // Last reply
+    uint32_t sent_ms;       // Last request
+    uint32_t used_ms;       // Last lookup that found it
+    int      retries;       // Requests since the last reply
+    int      hash_next;
+    int      lru_prev, lru_next;
+    int      queue_head, queue_tail, queue_len;
 } arp_entry_t;
 
+// Counters for /proc/net/snmp
+typedef struct {
+    uint64_t rx_frames;
+    uint64_t rx_runts;          // Shorter than an Ethernet header
+    uint64_t rx_unknown;        // EtherType not handled
+    uint64_t rx_ns;             // Time spent handing frames up the stack
+    uint64_t rx_ns_max;         // ... by the slowest frame
+    uint64_t tx_frames;
+    uint64_t tx_errors;         // Refused here or by the NIC
+    uint64_t arp_requests;      // Requests sent
+    uint64_t arp_replies;       // Replies sent
+    uint64_t arp_held;          // Packets held for an unresolved neighbour
+    uint64_t arp_held_drops;    // Held (or to be held) packets dropped
+    uint64_t arp_evictions;     // Neighbours pushed out of a full cache
+    uint64_t arp_failures;      // Neighbours given up on, unanswered
+} eth_stats_t;
+
 // Initialize ethernet layer
 void eth_init(void);
 
@@ -67,8 +101,38 @@ void eth_init(void);
 int  eth_send(const uint8_t dest_mac[6], uint16_t ethertype,
               const uint8_t* payload, uint16_t payload_len);
 
-// Process a received ethernet frame
-void eth_receive(const uint8_t* frame, uint16_t length);
+// Gather send: upper-layer headers (at most ETH_TX_HDR_MAX bytes) followed
+// by a payload that is not copied between layers. With ETH_TX_ZEROCOPY
+// the NIC reads the payload in place; keep it unchanged until eth_tx_flush().
+// ETH_TX_CSUM leaves the IPv4 and TCP/UDP checksums to the NIC; with
+// ETH_TX_TSO it also cuts a TCP frame of up to 64KB into segments of the MSS
+// given in the bits from ETH_TX_MSS_SHIFT up. Use them only if
+// eth_tx_offloads() reports them.
+#define ETH_TX_HDR_MAX   96
+#define ETH_TX_ZEROCOPY  0x1
+#define ETH_TX_CSUM      0x2
+#define ETH_TX_TSO       0x4
+#define ETH_TX_MSS_SHIFT 16
+int  eth_send_gather(const uint8_t dest_mac[6], uint16_t ethertype,
+                     const uint8_t* hdr, uint16_t hdr_len,
+                     const uint8_t* payload, uint16_t payload_len, int flags);
+
+// ETH_TX_CSUM / ETH_TX_TSO if the NIC offers them
+int  eth_tx_offloads(void);
+
+// Bracket a run of sends so the NIC is notified once, at the end
+void eth_tx_batch_begin(void);
+void eth_tx_batch_end(void);
+
+// Wait until all queued frames have left the TX ring
+void eth_tx_flush(void);
+
+// Process a received ethernet frame. ETH_RX_CSUM_OK: the NIC has already
+// verified the IPv4 header checksum.
+#define ETH_RX_CSUM_OK   0x1
+void eth_receive(const uint8_t* frame, uint16_t length, int flags);
+
+void eth_get_stats(eth_stats_t* out);
 
 // Get our MAC address
 void eth_get_mac(uint8_t mac[6]);
@@ -81,7 +145,19 @@ uint32_t ntohl(uint32_t val);
 
 // ARP operations
 void arp_init(void);
+// Fill mac and return 0 if ip is resolved; otherwise start resolving it
+// and return -1
 int  arp_resolve(uint32_t ip, uint8_t mac[6]);
+// As arp_resolve, trying cache slot *slot first; *slot is updated to
+// where ip lives (a hint kept by the route cache)
+int  arp_resolve_slot(uint32_t ip, uint8_t mac[6], int* slot);
+// Hold a frame (as for eth_send_gather) for a neighbour arp_resolve is
+// still resolving; it is sent when the reply arrives. Returns 0, or -2 if
+// it cannot be held.
+int  arp_queue(uint32_t ip, uint16_t ethertype, const uint8_t* hdr, uint16_t hdr_len,
+               const uint8_t* payload, uint16_t payload_len, int flags);
+// Retry unanswered requests and age out old entries (from socket_poll)
+void arp_timer(void);
 void arp_send_request(uint32_t target_ip);
 void arp_process(const uint8_t* data, uint16_t len);
 void arp_add_entry(uint32_t ip, const uint8_t mac[6]);
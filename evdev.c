@@ -0,0 +1,142 @@
+// evdev.c - Input Event Devices for Alteo OS
+// The producer owns tail and the consumer owns head; each reads the
+// other's with acquire and publishes its own with release, so events are
+// in the ring before the tail that covers them is seen, and a slot is
+// read out before the head that frees it is. read_lock only keeps two
+// readers from both being the consumer; producers never take it.
+#include "evdev.h"
+#include "devfs.h"
+#include "epoll.h"
+#include "mouse.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "waitq.h"
+
+#define EVDEV_MASK      (EVDEV_RING_SIZE - 1)
+
+typedef struct {
+    evdev_event_t ring[EVDEV_RING_SIZE];
+    volatile uint32_t head;         // Next event to read (consumer)
+    volatile uint32_t tail;         // Next slot to fill (producer)
+    uint32_t lost;                  // Reports dropped since the last EVDEV_SYN_DROPPED
+    volatile uint32_t dropped;      // Reports dropped since boot
+    uint8_t  buttons;               // Last buttons reported
+    spinlock_t read_lock;
+    waitq_t  wq;                    // Readers waiting for a report
+} evdev_t;
+
+static evdev_t devs[EVDEV_DEVICES];      // Zeroed locks and wait queues are ready
+static const char* dev_names[EVDEV_DEVICES] = { "event0", "event1", "event2", "event3" };
+
+// ---- Producer ----
+
+static inline void ring_put(evdev_t* d, uint32_t pos, uint64_t now, uint16_t type, uint16_t code, int32_t value) {
+    evdev_event_t* e = &d->ring[pos & EVDEV_MASK];
+    e->time_ns = now;
+    e->type = type;
+    e->code = code;
+    e->value = value;
+}
+
+void evdev_report(int dev, const evdev_event_t* ev, int n) {
+    if (dev < 0 || dev >= EVDEV_DEVICES || n < 0 || n >= EVDEV_REPORT_MAX) return;
+    evdev_t* d = &devs[dev];
+    uint64_t now = timer_now_ns();
+    uint32_t tail = d->tail;
+    uint32_t head = __atomic_load_n(&d->head, __ATOMIC_ACQUIRE);
+    uint32_t need = (uint32_t)n + 1 + (d->lost ? 1 : 0);
+    if (EVDEV_RING_SIZE - (tail - head) < need) {
+        d->lost++;
+        d->dropped++;
+        return;
+    }
+
+    if (d->lost) {
+        ring_put(d, tail++, now, EVDEV_SYN, EVDEV_SYN_DROPPED, (int32_t)d->lost);
+        d->lost = 0;
+    }
+    for (int i = 0; i < n; i++) ring_put(d, tail++, now, ev[i].type, ev[i].code, ev[i].value);
+    ring_put(d, tail++, now, EVDEV_SYN, EVDEV_SYN_REPORT, 0);
+    __atomic_store_n(&d->tail, tail, __ATOMIC_RELEASE);
+
+    waitq_wake_all(&d->wq);
+    devfs_notify(dev_names[dev]);
+}
+
+void evdev_key(int dev, uint16_t code, int down, char c) {
+    evdev_event_t ev[2] = {
+        { 0, EVDEV_KEY, code, down ? 1 : 0 },
+        { 0, EVDEV_CHAR, 0, (uint8_t)c },
+    };
+    evdev_report(dev, ev, down && c ? 2 : 1);
+}
+
+void evdev_pointer(int dev, int dx, int dy, int wheel, uint8_t buttons) {
+    if (dev < 0 || dev >= EVDEV_DEVICES) return;
+    evdev_t* d = &devs[dev];
+    evdev_event_t ev[8];
+    int n = 0;
+
+    if (dx) ev[n++] = (evdev_event_t){ 0, EVDEV_REL, EVDEV_AXIS_X, dx };
+    if (dy) ev[n++] = (evdev_event_t){ 0, EVDEV_REL, EVDEV_AXIS_Y, dy };
+    if (wheel) ev[n++] = (evdev_event_t){ 0, EVDEV_REL, EVDEV_AXIS_WHEEL, wheel };
+    uint8_t changed = (buttons ^ d->buttons) & 0x07;
+    for (int b = 0; b < 3; b++) {
+        if (changed & (1 << b))
+            ev[n++] = (evdev_event_t){ 0, EVDEV_KEY, (uint16_t)(EVDEV_BTN_LEFT + b), (buttons >> b) & 1 };
+    }
+    d->buttons = buttons;
+    if (dx || dy) {
+        mouse_state_t m;
+        mouse_get_state(&m);
+        ev[n++] = (evdev_event_t){ 0, EVDEV_ABS, EVDEV_AXIS_X, m.x };
+        ev[n++] = (evdev_event_t){ 0, EVDEV_ABS, EVDEV_AXIS_Y, m.y };
+    }
+    if (n) evdev_report(dev, ev, n);
+}
+
+uint32_t evdev_dropped(int dev) {
+    return dev >= 0 && dev < EVDEV_DEVICES ? devs[dev].dropped : 0;
+}
+
+// ---- /dev/eventN ----
+
+static int evdev_ready(void* arg) {
+    evdev_t* d = (evdev_t*)arg;
+    return d->tail != d->head;
+}
+
+// Whole events only, as many as are waiting; sleeps while there are none
+// (a caller that cannot sleep gets 0)
+static int evdev_dev_read(void* data, void* buf, uint32_t count, uint32_t offset) {
+    (void)offset;
+    evdev_t* d = &devs[(int)(uint64_t)data];
+    evdev_event_t* out = (evdev_event_t*)buf;
+    uint32_t max = count / sizeof(evdev_event_t);
+    if (!max) return -1;
+
+    for (;;) {
+        uint64_t irq = spin_lock_irqsave(&d->read_lock);
+        uint32_t head = d->head;
+        uint32_t n = __atomic_load_n(&d->tail, __ATOMIC_ACQUIRE) - head;
+        if (n > max) n = max;
+        for (uint32_t i = 0; i < n; i++) out[i] = d->ring[(head + i) & EVDEV_MASK];
+        __atomic_store_n(&d->head, head + n, __ATOMIC_RELEASE);
+        spin_unlock_irqrestore(&d->read_lock, irq);
+        if (n) return (int)(n * sizeof(evdev_event_t));
+        if (waitq_wait(&d->wq, evdev_ready, d) < 0) return 0;
+    }
+}
+
+static uint32_t evdev_dev_poll(void* data) {
+    evdev_t* d = &devs[(int)(uint64_t)data];
+    return d->tail != d->head ? EPOLLIN : 0;
+}
+
+void evdev_init(void) {
+    for (int i = 0; i < EVDEV_DEVICES; i++) {
+        dev_ops_t ops = { .read = evdev_dev_read, .write = 0, .ioctl = 0,
+                          .poll = evdev_dev_poll, .dev_data = (void*)(uint64_t)i };
+        devfs_register(dev_names[i], DEV_TYPE_CHAR, DEV_MAJOR_INPUT, 64 + i, &ops);
+    }
+}
@@ -0,0 +1,81 @@
+// evdev.h - Input Event Devices for Alteo OS
+// Each input device has its own ring of timestamped events, read through
+// /dev/eventN. The device's interrupt handler is the ring's only producer
+// and fills it without a lock: it stamps a whole report with one
+// timer_now_ns() reading, copies it in and publishes it with a single
+// store of the tail. Readers take events out one reader at a time, so
+// the ring stays single-producer/single-consumer; a blocking read sleeps
+// until the producer's next report, and epoll sees EPOLLIN while events
+// are waiting.
+//
+// Every report ends with an EVDEV_SYN event. A report that does not fit
+// is dropped whole; the next one that does is preceded by
+// EVDEV_SYN_DROPPED, after which a reader should assume it missed key
+// and button changes.
+//
+// The desktop keeps its own queue (input.h) fed by the same handlers;
+// these rings are for processes that want every event.
+#ifndef EVDEV_H
+#define EVDEV_H
+
+#include "stdint.h"
+
+// Devices (/dev/event0 .. event3)
+#define EVDEV_PS2_KBD       0
+#define EVDEV_PS2_MOUSE     1
+#define EVDEV_USB_KBD       2
+#define EVDEV_USB_MOUSE     3
+#define EVDEV_DEVICES       4
+
+#define EVDEV_RING_SIZE     256     // Events per device; a power of two
+#define EVDEV_REPORT_MAX    40      // Events in one report, EVDEV_SYN included
+
+// Event types
+#define EVDEV_SYN           0       // End of a report
+#define EVDEV_KEY           1       // code: key or button, value: 1 down, 0 up
+#define EVDEV_REL           2       // code: axis, value: delta
+#define EVDEV_ABS           3       // code: axis, value: pointer position after the report
+#define EVDEV_CHAR          4       // value: ASCII of a key press that has one
+
+// EVDEV_SYN codes
+#define EVDEV_SYN_REPORT    0
+#define EVDEV_SYN_DROPPED   3       // value: reports lost before this one
+
+// EVDEV_KEY codes: keyboards report their own key numbers (PS/2 set 1
+// make codes, 0x80 added for 0xE0-prefixed keys; HID usage IDs), mice
+// these
+#define EVDEV_BTN_LEFT      0x110
+#define EVDEV_BTN_RIGHT     0x111
+#define EVDEV_BTN_MIDDLE    0x112
+
+// EVDEV_REL / EVDEV_ABS codes
+#define EVDEV_AXIS_X        0
+#define EVDEV_AXIS_Y        1
+#define EVDEV_AXIS_WHEEL    8
+
+typedef struct {
+    uint64_t time_ns;           // timer_now_ns() when the report came in
+    uint16_t type;
+    uint16_t code;
+    int32_t  value;
+} evdev_event_t;
+
+// Register /dev/event0 .. event3 (after devfs_init)
+void evdev_init(void);
+
+// Queue a report of n events (the device's interrupt handler only). The
+// timestamp and the closing EVDEV_SYN are added here.
+void evdev_report(int dev, const evdev_event_t* ev, int n);
+
+// One key changing state, with the character a press types (0 = none)
+void evdev_key(int dev, uint16_t code, int down, char c);
+
+// A pointer report: motion, wheel and buttons (bit 0 left, 1 right,
+// 2 middle) as the device gave them; the position is the pointer's after
+// mouse_move() has applied them
+void evdev_pointer(int dev, int dx, int dy, int wheel, uint8_t buttons);
+
+// Reports dropped on a full ring since boot
+uint32_t evdev_dropped(int dev);
+
+#endif
@@ -1,8 +1,22 @@
 // ext2.c - ext2 Filesystem Driver for Alteo OS
-// Reads ext2 superblock, block groups, inodes, and directories from blkdev
+// Reads ext2 superblock, block groups, inodes, and directories from blkdev.
+// Metadata (inodes, directories, bitmaps, indirect blocks) is modified in
+// the device cache; file data goes through the file page cache and is
+// written around the device cache, like it is read. Blocks are allocated
+// near the previous block of the file, in the inode's own group first,
+// with a small run preallocated ahead of a file being written. Runs of
+// contiguous blocks found in the block map are cached, so file pages are
+// read and written one device request per run. Names are looked up
+// through the dentry cache, and hash-indexed (htree) directories are
+// searched through their index.
 #include "ext2.h"
+#include "klib.h"
 #include "blkdev.h"
 #include "vfs.h"
+#include "heap.h"
+#include "timer.h"
+#include "scheduler.h"
+#include "dcache.h"
 
 // ---- String / memory helpers (no libc) ----
 static int e2_strlen(const char* s) { int l = 0; while (s[l]) l++; return l; }
@@ -23,32 +37,39 @@ static void e2_strncpy(char* d, const char* s, int n) {
     while (i < n - 1 && s[i]) { d[i] = s[i]; i++; }
     d[i] = 0;
 }
-static void e2_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
-}
-static void e2_memcpy(void* d, const void* s, int n) {
-    unsigned char* dd = (unsigned char*)d;
-    const unsigned char* ss = (const unsigned char*)s;
-    for (int i = 0; i < n; i++) dd[i] = ss[i];
-}
-
 // ---- ext2 state ----
 static ext2_state_t ext2_state;
 static int ext2_initialized = 0;
 
-// Temporary block buffer (statically allocated to avoid heap in early init)
-static uint8_t block_buf[4096] __attribute__((aligned(4)));
-static uint8_t block_buf2[4096] __attribute__((aligned(4)));
-
 // ---- Block I/O helpers ----
 
-// Read a single ext2 block from the block device
-static int ext2_read_block(ext2_state_t* st, uint32_t block_num, void* buf) {
-    if (block_num == 0) return -1;
+// Pin an ext2 block in the device's cache and return its bytes (an ext2
+// block never straddles a cache block). Release with blkdev_unmap().
+static const uint8_t* ext2_map_block(ext2_state_t* st, uint32_t block_num,
+                                     pagecache_page_t** page) {
+    *page = (pagecache_page_t*)0;
+    if (block_num == 0) return (const uint8_t*)0;
+    uint32_t sectors_per_block = st->block_size / BLKDEV_SECTOR_SIZE;
+    return blkdev_map(st->block_device, block_num * sectors_per_block, page);
+}
+
+// ext2_map_block() for modifying the block: release with blkdev_unmap_dirty()
+static uint8_t* ext2_map_block_rw(ext2_state_t* st, uint32_t block_num,
+                                  pagecache_page_t** page) {
+    *page = (pagecache_page_t*)0;
+    if (block_num == 0) return (uint8_t*)0;
     uint32_t sectors_per_block = st->block_size / BLKDEV_SECTOR_SIZE;
-    uint32_t lba = block_num * sectors_per_block;
-    return blkdev_read(st->block_device, lba, sectors_per_block, buf);
+    return blkdev_map_rw(st->block_device, block_num * sectors_per_block, page);
+}
+
+// Entry idx of an indirect (pointer) block, 0 on error
+static uint32_t ext2_block_ptr(ext2_state_t* st, uint32_t block_num, uint32_t idx) {
+    pagecache_page_t* page;
+    const uint8_t* data = ext2_map_block(st, block_num, &page);
+    if (!data) return 0;
+    uint32_t ptr = ((const uint32_t*)data)[idx];
+    blkdev_unmap(page);
+    return ptr;
 }
 
 // Read the superblock from disk
@@ -60,7 +81,7 @@ static int ext2_read_superblock(ext2_state_t* st) {
     if (blkdev_read(st->block_device, 2, 2, sector_buf) < 0)
         return -1;
 
-    e2_memcpy(&st->sb, sector_buf, sizeof(ext2_superblock_t));
+    memcpy(&st->sb, sector_buf, sizeof(ext2_superblock_t));
 
     // Verify magic number
     if (st->sb.s_magic != EXT2_SUPER_MAGIC)
@@ -89,14 +110,23 @@ static int ext2_read_superblock(ext2_state_t* st) {
 // Read a block group descriptor
 static int ext2_read_group_desc(ext2_state_t* st, uint32_t group,
                                  ext2_group_desc_t* desc) {
+    if (group >= st->group_count) return -1;
+    if (st->groups) {
+        *desc = st->groups[group].desc;
+        return 0;
+    }
+
     // Block group descriptor table starts at block (first_data_block + 1)
     uint32_t desc_block = st->first_data_block + 1;
     uint32_t descs_per_block = st->block_size / sizeof(ext2_group_desc_t);
     uint32_t block_idx = desc_block + group / descs_per_block;
     uint32_t offset_in_block = (group % descs_per_block) * sizeof(ext2_group_desc_t);
 
-    if (ext2_read_block(st, block_idx, block_buf) < 0) return -1;
-    e2_memcpy(desc, block_buf + offset_in_block, sizeof(ext2_group_desc_t));
+    pagecache_page_t* page;
+    const uint8_t* data = ext2_map_block(st, block_idx, &page);
+    if (!data) return -1;
+    memcpy(desc, data + offset_in_block, sizeof(ext2_group_desc_t));
+    blkdev_unmap(page);
     return 0;
 }
 
@@ -120,53 +150,68 @@ int ext2_read_inode(ext2_state_t* st, uint32_t inode_num, ext2_inode_t* inode) {
     uint32_t offset_in_block = (index % inodes_per_block) * st->inode_size;
 
     // Read the block containing the inode
-    if (ext2_read_block(st, inode_table_block + block_offset, block_buf) < 0)
-        return -1;
+    pagecache_page_t* page;
+    const uint8_t* data = ext2_map_block(st, inode_table_block + block_offset, &page);
+    if (!data) return -1;
 
-    e2_memcpy(inode, block_buf + offset_in_block, sizeof(ext2_inode_t));
+    memcpy(inode, data + offset_in_block, sizeof(ext2_inode_t));
+    blkdev_unmap(page);
     return 0;
 }
 
-// Resolve a block number within a file (handles indirect blocks)
-static uint32_t ext2_get_block(ext2_state_t* st, ext2_inode_t* inode, uint32_t file_block) {
+// The run of back-to-back blocks around entry idx of a pointer array:
+// returns ptrs[idx], with how many entries of the run come before idx in
+// *back and the run's length in *count
+static uint32_t ext2_ptr_run(const uint32_t* ptrs, uint32_t n, uint32_t idx,
+                             uint32_t* back, uint32_t* count) {
+    uint32_t lo = idx, hi = idx + 1;
+    if (!ptrs[idx]) return 0;
+    while (lo > 0 && ptrs[lo - 1] && ptrs[lo - 1] + 1 == ptrs[lo]) lo--;
+    while (hi < n && ptrs[hi] == ptrs[hi - 1] + 1) hi++;
+    *back = idx - lo;
+    *count = hi - lo;
+    return ptrs[idx];
+}
+
+// Run around entry idx of pointer block block_num (see ext2_ptr_run)
+static uint32_t ext2_block_run(ext2_state_t* st, uint32_t block_num, uint32_t idx,
+                               uint32_t* back, uint32_t* count) {
+    pagecache_page_t* page;
+    const uint8_t* data = ext2_map_block(st, block_num, &page);
+    if (!data) return 0;
+    uint32_t ptr = ext2_ptr_run((const uint32_t*)data, st->block_size / 4, idx, back, count);
+    blkdev_unmap(page);
+    return ptr;
+}
+
+// Walk the block map for file_block, also reporting the run of contiguous
+// blocks it belongs to (as far as one pointer block reaches)
+static uint32_t ext2_walk(ext2_state_t* st, ext2_inode_t* inode, uint32_t file_block,
+                          uint32_t* back, uint32_t* count) {
     uint32_t ptrs_per_block = st->block_size / 4;
 
     // Direct blocks (0-11)
     if (file_block < EXT2_NDIR_BLOCKS) {
-        return inode->i_block[file_block];
+        uint32_t direct[EXT2_NDIR_BLOCKS];
+        memcpy(direct, inode->i_block, sizeof(direct));
+        return ext2_ptr_run(direct, EXT2_NDIR_BLOCKS, file_block, back, count);
     }
 
     file_block -= EXT2_NDIR_BLOCKS;
 
     // Singly indirect (12 - 12+ptrs-1)
     if (file_block < ptrs_per_block) {
-        uint32_t ind_block = inode->i_block[EXT2_IND_BLOCK];
-        if (ind_block == 0) return 0;
-        if (ext2_read_block(st, ind_block, block_buf2) < 0) return 0;
-        uint32_t* ptrs = (uint32_t*)block_buf2;
-        return ptrs[file_block];
+        return ext2_block_run(st, inode->i_block[EXT2_IND_BLOCK], file_block, back, count);
     }
 
     file_block -= ptrs_per_block;
 
     // Doubly indirect
     if (file_block < ptrs_per_block * ptrs_per_block) {
-        uint32_t dind_block = inode->i_block[EXT2_DIND_BLOCK];
-        if (dind_block == 0) return 0;
-        if (ext2_read_block(st, dind_block, block_buf2) < 0) return 0;
-        uint32_t* l1_ptrs = (uint32_t*)block_buf2;
-
         uint32_t l1_idx = file_block / ptrs_per_block;
         uint32_t l2_idx = file_block % ptrs_per_block;
-
-        uint32_t l2_block = l1_ptrs[l1_idx];
-        if (l2_block == 0) return 0;
-
-        // Need a separate buffer for second level (reuse block_buf carefully)
-        uint8_t l2_buf[4096];
-        if (ext2_read_block(st, l2_block, l2_buf) < 0) return 0;
-        uint32_t* l2_ptrs = (uint32_t*)l2_buf;
-        return l2_ptrs[l2_idx];
+        uint32_t l2_block = ext2_block_ptr(st, inode->i_block[EXT2_DIND_BLOCK], l1_idx);
+        return ext2_block_run(st, l2_block, l2_idx, back, count);
     }
 
     // Triply indirect (not commonly needed for small files)
@@ -174,10 +219,587 @@ static uint32_t ext2_get_block(ext2_state_t* st, ext2_inode_t* inode, uint32_t f
     return 0;
 }
 
+// Resolve a block number within a file (handles indirect blocks)
+static uint32_t ext2_get_block(ext2_state_t* st, ext2_inode_t* inode, uint32_t file_block) {
+    uint32_t back, count;
+    return ext2_walk(st, inode, file_block, &back, &count);
+}
+
+// ---- Extent Cache ----
+
+// Runs found by walking the block map are kept so later lookups in the
+// same run cost no pointer-block access. Only mapped blocks are cached;
+// mapped blocks only change when a file is truncated, which drops its
+// runs.
+
+static ext2_extent_t* ext2_extent_find(ext2_state_t* st, uint32_t inode_num, uint32_t file_block) {
+    for (int i = 0; i < EXT2_EXTENT_CACHE; i++) {
+        ext2_extent_t* e = &st->extents[i];
+        if (e->inode == inode_num && file_block >= e->file_block &&
+            file_block - e->file_block < e->count) return e;
+    }
+    return (ext2_extent_t*)0;
+}
+
+static void ext2_extent_add(ext2_state_t* st, uint32_t inode_num, uint32_t file_block,
+                            uint32_t disk_block, uint32_t count) {
+    ext2_extent_t* victim = &st->extents[0];
+    for (int i = 0; i < EXT2_EXTENT_CACHE; i++) {
+        ext2_extent_t* e = &st->extents[i];
+        if (!e->inode) { victim = e; break; }
+        if (e->last_used < victim->last_used) victim = e;
+    }
+    victim->inode = inode_num;
+    victim->file_block = file_block;
+    victim->disk_block = disk_block;
+    victim->count = count;
+    victim->last_used = ++st->extent_clock;
+}
+
+static void ext2_extent_forget(ext2_state_t* st, uint32_t inode_num) {
+    for (int i = 0; i < EXT2_EXTENT_CACHE; i++) {
+        if (st->extents[i].inode == inode_num) st->extents[i].inode = 0;
+    }
+    st->extent_gen++;
+}
+
+// Disk block of file_block (0 for a hole), with the number of blocks from
+// it on that follow back to back on disk in *run
+static uint32_t ext2_map(ext2_state_t* st, uint32_t inode_num, ext2_inode_t* inode,
+                         uint32_t file_block, uint32_t* run) {
+    ext2_extent_t* e = ext2_extent_find(st, inode_num, file_block);
+    if (e) {
+        e->last_used = ++st->extent_clock;
+        *run = e->count - (file_block - e->file_block);
+        return e->disk_block + (file_block - e->file_block);
+    }
+
+    // The walk may sleep on I/O; a truncate meanwhile makes its run stale
+    uint32_t gen = st->extent_gen;
+    uint32_t back = 0, count = 0;
+    uint32_t block = ext2_walk(st, inode, file_block, &back, &count);
+    if (!block) {
+        *run = 0;
+        return 0;
+    }
+    if (gen == st->extent_gen) ext2_extent_add(st, inode_num, file_block - back, block - back, count);
+    *run = count - back;
+    return block;
+}
+
+// ---- Locking ----
+
+static int ext2_idle(void* arg) {
+    return !((ext2_state_t*)arg)->busy;
+}
+
+// Modifications sleep on I/O, so the big kernel lock alone does not keep
+// two of them apart
+static void ext2_lock(ext2_state_t* st) {
+    for (;;) {
+        if (!st->busy) {
+            st->busy = 1;
+            return;
+        }
+        if (waitq_wait(&st->wq, ext2_idle, st) < 0) {
+            if (scheduler_is_running()) scheduler_yield();
+            else __asm__ volatile("pause");
+        }
+    }
+}
+
+static void ext2_unlock(ext2_state_t* st) {
+    st->busy = 0;
+    waitq_wake_all(&st->wq);
+}
+
+static uint32_t ext2_now(ext2_state_t* st) {
+    return st->time_base + (uint32_t)(timer_now_ns() / 1000000000ULL);
+}
+
+// ---- Metadata Write-back ----
+
+static int ext2_write_inode(ext2_state_t* st, uint32_t inode_num, const ext2_inode_t* inode) {
+    if (inode_num == 0) return -1;
+    uint32_t group = (inode_num - 1) / st->inodes_per_group;
+    uint32_t index = (inode_num - 1) % st->inodes_per_group;
+    if (group >= st->group_count) return -1;
+
+    uint32_t inodes_per_block = st->block_size / st->inode_size;
+    uint32_t block = st->groups[group].desc.bg_inode_table + index / inodes_per_block;
+    pagecache_page_t* page;
+    uint8_t* data = ext2_map_block_rw(st, block, &page);
+    if (!data) return -1;
+    memcpy(data + (index % inodes_per_block) * st->inode_size, inode, sizeof(ext2_inode_t));
+    blkdev_unmap_dirty(page);
+    return 0;
+}
+
+// Write back changed group descriptors and the superblock
+static int ext2_commit(ext2_state_t* st) {
+    uint32_t descs_per_block = st->block_size / sizeof(ext2_group_desc_t);
+    int result = 0;
+    for (uint32_t g = 0; g < st->group_count; g++) {
+        if (!st->groups[g].dirty) continue;
+        pagecache_page_t* page;
+        uint8_t* data = ext2_map_block_rw(st, st->first_data_block + 1 + g / descs_per_block, &page);
+        if (!data) { result = -1; continue; }
+        memcpy(data + (g % descs_per_block) * sizeof(ext2_group_desc_t),
+               &st->groups[g].desc, sizeof(ext2_group_desc_t));
+        blkdev_unmap_dirty(page);
+        st->groups[g].dirty = 0;
+    }
+    if (st->sb_dirty) {
+        st->sb.s_wtime = ext2_now(st);
+        if (blkdev_write(st->block_device, EXT2_SUPER_OFFSET / BLKDEV_SECTOR_SIZE,
+                         sizeof(ext2_superblock_t) / BLKDEV_SECTOR_SIZE, &st->sb) < 0) result = -1;
+        else st->sb_dirty = 0;
+    }
+    return result;
+}
+
+// ---- Bitmaps ----
+
+static int bm_test(const uint8_t* bm, uint32_t bit) {
+    return (bm[bit >> 3] >> (bit & 7)) & 1;
+}
+
+// First clear bit in [from, count), or -1. With whole_byte set, only a
+// bit starting a fully clear byte counts (a free run of 8).
+static int bm_find_zero(const uint8_t* bm, uint32_t from, uint32_t count, int whole_byte) {
+    uint32_t bit = from;
+    if (whole_byte) bit = (from + 7) & ~7U;
+    while (bit < count) {
+        uint8_t b = bm[bit >> 3];
+        if (whole_byte) {
+            if (b == 0 && bit + 8 <= count) return (int)bit;
+            bit += 8;
+            continue;
+        }
+        if (b == 0xFF) {
+            bit = (bit | 7) + 1;
+            continue;
+        }
+        if (!((b >> (bit & 7)) & 1)) return (int)bit;
+        bit++;
+    }
+    return -1;
+}
+
+static uint32_t ext2_group_first_block(ext2_state_t* st, uint32_t group) {
+    return st->first_data_block + group * st->blocks_per_group;
+}
+
+static uint32_t ext2_group_block_count(ext2_state_t* st, uint32_t group) {
+    uint32_t first = ext2_group_first_block(st, group);
+    uint32_t left = st->sb.s_blocks_count - first;
+    return left < st->blocks_per_group ? left : st->blocks_per_group;
+}
+
+static uint8_t* ext2_load_bitmap(ext2_state_t* st, uint32_t block) {
+    uint8_t* bm = (uint8_t*)kmalloc(st->block_size);
+    if (!bm) return (uint8_t*)0;
+    pagecache_page_t* page;
+    const uint8_t* data = ext2_map_block(st, block, &page);
+    if (!data) {
+        kfree(bm);
+        return (uint8_t*)0;
+    }
+    memcpy(bm, data, st->block_size);
+    blkdev_unmap(page);
+    return bm;
+}
+
+// Bring a group's bitmaps into memory. Returns 0 or -1.
+static int ext2_group_load(ext2_state_t* st, uint32_t group) {
+    ext2_group_t* g = &st->groups[group];
+    if (!g->block_bitmap) g->block_bitmap = ext2_load_bitmap(st, g->desc.bg_block_bitmap);
+    if (!g->inode_bitmap) g->inode_bitmap = ext2_load_bitmap(st, g->desc.bg_inode_bitmap);
+    return g->block_bitmap && g->inode_bitmap ? 0 : -1;
+}
+
+// Set or clear a bit in both copies of a bitmap
+static int ext2_bitmap_update(ext2_state_t* st, uint8_t* bm, uint32_t disk_block, uint32_t bit, int set) {
+    pagecache_page_t* page;
+    uint8_t* data = ext2_map_block_rw(st, disk_block, &page);
+    if (!data) return -1;
+    uint8_t mask = (uint8_t)(1 << (bit & 7));
+    if (set) {
+        bm[bit >> 3] |= mask;
+        data[bit >> 3] |= mask;
+    } else {
+        bm[bit >> 3] &= (uint8_t)~mask;
+        data[bit >> 3] &= (uint8_t)~mask;
+    }
+    blkdev_unmap_dirty(page);
+    return 0;
+}
+
+// ---- Block Allocation ----
+
+static int ext2_claim_block(ext2_state_t* st, uint32_t group, uint32_t bit) {
+    ext2_group_t* g = &st->groups[group];
+    if (ext2_bitmap_update(st, g->block_bitmap, g->desc.bg_block_bitmap, bit, 1) < 0) return -1;
+    g->desc.bg_free_blocks_count--;
+    g->dirty = 1;
+    st->sb.s_free_blocks_count--;
+    st->sb_dirty = 1;
+    return 0;
+}
+
+static void ext2_free_block(ext2_state_t* st, uint32_t block) {
+    if (block < st->first_data_block || block >= st->sb.s_blocks_count) return;
+    uint32_t group = (block - st->first_data_block) / st->blocks_per_group;
+    uint32_t bit = (block - st->first_data_block) % st->blocks_per_group;
+    if (ext2_group_load(st, group) < 0) return;
+    ext2_group_t* g = &st->groups[group];
+    if (!bm_test(g->block_bitmap, bit)) return;
+    if (ext2_bitmap_update(st, g->block_bitmap, g->desc.bg_block_bitmap, bit, 0) < 0) return;
+    g->desc.bg_free_blocks_count++;
+    g->dirty = 1;
+    st->sb.s_free_blocks_count++;
+    st->sb_dirty = 1;
+}
+
+// A free block: the goal itself, else the next free run of 8 after it in
+// its group, else the next free block there, else the same in the
+// following groups. Returns 0 when the filesystem is full.
+static uint32_t ext2_alloc_block(ext2_state_t* st, uint32_t goal) {
+    if (goal < st->first_data_block || goal >= st->sb.s_blocks_count) goal = st->first_data_block;
+    uint32_t start_group = (goal - st->first_data_block) / st->blocks_per_group;
+
+    for (uint32_t k = 0; k < st->group_count; k++) {
+        uint32_t group = (start_group + k) % st->group_count;
+        ext2_group_t* g = &st->groups[group];
+        if (g->desc.bg_free_blocks_count == 0 || ext2_group_load(st, group) < 0) continue;
+
+        uint32_t count = ext2_group_block_count(st, group);
+        uint32_t from = k == 0 ? (goal - st->first_data_block) % st->blocks_per_group : 0;
+        int bit = -1;
+        if (from < count && !bm_test(g->block_bitmap, from)) bit = (int)from;
+        if (bit < 0) bit = bm_find_zero(g->block_bitmap, from, count, 1);
+        if (bit < 0) bit = bm_find_zero(g->block_bitmap, from, count, 0);
+        if (bit < 0 && from) bit = bm_find_zero(g->block_bitmap, 0, from, 0);
+        if (bit < 0) continue;
+        if (ext2_claim_block(st, group, (uint32_t)bit) < 0) return 0;
+        return ext2_group_first_block(st, group) + (uint32_t)bit;
+    }
+    return 0;
+}
+
+static void ext2_discard_prealloc(ext2_state_t* st, ext2_alloc_t* a) {
+    while (a->prealloc_count) {
+        ext2_free_block(st, a->prealloc_block++);
+        a->prealloc_count--;
+    }
+}
+
+// Reserve up to EXT2_PREALLOC_BLOCKS free blocks right after block
+static void ext2_prealloc(ext2_state_t* st, ext2_alloc_t* a, uint32_t block) {
+    uint32_t group = (block - st->first_data_block) / st->blocks_per_group;
+    uint32_t bit = (block - st->first_data_block) % st->blocks_per_group + 1;
+    uint32_t count = ext2_group_block_count(st, group);
+    ext2_group_t* g = &st->groups[group];
+    a->prealloc_block = block + 1;
+    a->prealloc_count = 0;
+    while (a->prealloc_count < EXT2_PREALLOC_BLOCKS && bit < count &&
+           !bm_test(g->block_bitmap, bit) && ext2_claim_block(st, group, bit) == 0) {
+        a->prealloc_count++;
+        bit++;
+    }
+}
+
+// A new block for a file, taken from its preallocation when that continues
+// at the goal. Counts the block in i_blocks. Returns 0 when full.
+static uint32_t ext2_new_block(ext2_state_t* st, ext2_inode_t* inode, ext2_alloc_t* a, uint32_t goal) {
+    uint32_t block;
+    if (a->prealloc_count && a->prealloc_block == goal) {
+        block = a->prealloc_block++;
+        a->prealloc_count--;
+    } else {
+        ext2_discard_prealloc(st, a);
+        block = ext2_alloc_block(st, goal);
+        if (!block) return 0;
+        ext2_prealloc(st, a, block);
+    }
+    inode->i_blocks += st->block_size / BLKDEV_SECTOR_SIZE;
+    a->goal = block + 1;
+    return block;
+}
+
+// ---- Inode Allocation ----
+
+// Directories go to a group with more free inodes than average and the
+// most free blocks, spreading the tree; files stay in their parent's group
+static uint32_t ext2_pick_group(ext2_state_t* st, uint32_t parent_group, int is_dir) {
+    if (is_dir) {
+        uint32_t avg = st->sb.s_free_inodes_count / st->group_count;
+        int best = -1;
+        for (uint32_t g = 0; g < st->group_count; g++) {
+            ext2_group_desc_t* d = &st->groups[g].desc;
+            if (d->bg_free_inodes_count == 0 || d->bg_free_inodes_count < avg) continue;
+            if (best < 0 || d->bg_free_blocks_count > st->groups[best].desc.bg_free_blocks_count) best = (int)g;
+        }
+        if (best >= 0) return (uint32_t)best;
+    }
+    for (uint32_t k = 0; k < st->group_count; k++) {
+        uint32_t g = (parent_group + k) % st->group_count;
+        ext2_group_desc_t* d = &st->groups[g].desc;
+        if (d->bg_free_inodes_count && (d->bg_free_blocks_count || k == st->group_count - 1)) return g;
+    }
+    return parent_group;
+}
+
+// Returns the new inode number, or 0
+static uint32_t ext2_alloc_inode(ext2_state_t* st, uint32_t parent, int is_dir) {
+    uint32_t parent_group = parent ? (parent - 1) / st->inodes_per_group : 0;
+    if (parent_group >= st->group_count) parent_group = 0;
+    uint32_t first_ino = st->sb.s_rev_level >= 1 ? st->sb.s_first_ino : EXT2_GOOD_OLD_FIRST_INO;
+
+    uint32_t start = ext2_pick_group(st, parent_group, is_dir);
+    for (uint32_t k = 0; k < st->group_count; k++) {
+        uint32_t group = (start + k) % st->group_count;
+        ext2_group_t* g = &st->groups[group];
+        if (g->desc.bg_free_inodes_count == 0 || ext2_group_load(st, group) < 0) continue;
+
+        uint32_t from = group == 0 ? first_ino - 1 : 0;
+        int bit = bm_find_zero(g->inode_bitmap, from, st->inodes_per_group, 0);
+        if (bit < 0) continue;
+        if (ext2_bitmap_update(st, g->inode_bitmap, g->desc.bg_inode_bitmap, (uint32_t)bit, 1) < 0) return 0;
+        g->desc.bg_free_inodes_count--;
+        if (is_dir) g->desc.bg_used_dirs_count++;
+        g->dirty = 1;
+        st->sb.s_free_inodes_count--;
+        st->sb_dirty = 1;
+        return group * st->inodes_per_group + (uint32_t)bit + 1;
+    }
+    return 0;
+}
+
+static void ext2_free_inode(ext2_state_t* st, uint32_t inode_num, int is_dir) {
+    uint32_t group = (inode_num - 1) / st->inodes_per_group;
+    uint32_t bit = (inode_num - 1) % st->inodes_per_group;
+    if (group >= st->group_count || ext2_group_load(st, group) < 0) return;
+    ext2_group_t* g = &st->groups[group];
+    if (!bm_test(g->inode_bitmap, bit)) return;
+    if (ext2_bitmap_update(st, g->inode_bitmap, g->desc.bg_inode_bitmap, bit, 0) < 0) return;
+    g->desc.bg_free_inodes_count++;
+    if (is_dir && g->desc.bg_used_dirs_count) g->desc.bg_used_dirs_count--;
+    g->dirty = 1;
+    st->sb.s_free_inodes_count++;
+    st->sb_dirty = 1;
+}
+
+// ---- Block Mapping for Writes ----
+
+static int ext2_zero_block(ext2_state_t* st, uint32_t block) {
+    pagecache_page_t* page;
+    uint8_t* data = ext2_map_block_rw(st, block, &page);
+    if (!data) return -1;
+    memset(data, 0, st->block_size);
+    blkdev_unmap_dirty(page);
+    return 0;
+}
+
+static int ext2_set_ptr(ext2_state_t* st, uint32_t block, uint32_t idx, uint32_t value) {
+    pagecache_page_t* page;
+    uint8_t* data = ext2_map_block_rw(st, block, &page);
+    if (!data) return -1;
+    ((uint32_t*)data)[idx] = value;
+    blkdev_unmap_dirty(page);
+    return 0;
+}
+
+// Entry idx of pointer block *slot (allocating a zeroed one into the slot
+// if needed), allocating a new block for the entry if it is empty - zeroed
+// when it is a pointer block itself
+static uint32_t ext2_ptr_alloc(ext2_state_t* st, ext2_inode_t* inode, ext2_alloc_t* a,
+                               uint32_t* slot, uint32_t idx, uint32_t goal, int zero) {
+    if (!*slot) {
+        uint32_t ind = ext2_new_block(st, inode, a, goal);
+        if (!ind || ext2_zero_block(st, ind) < 0) return 0;
+        *slot = ind;
+        goal = ind + 1;
+    }
+    uint32_t block = ext2_block_ptr(st, *slot, idx);
+    if (block) return block;
+    block = ext2_new_block(st, inode, a, goal);
+    if (!block || (zero && ext2_zero_block(st, block) < 0)) return 0;
+    if (ext2_set_ptr(st, *slot, idx, block) < 0) return 0;
+    return block;
+}
+
+// Disk block of file_block, allocated (with any pointer blocks on the way)
+// if the file has a hole there. Returns 0 if the disk is full.
+static uint32_t ext2_bmap_alloc(ext2_state_t* st, uint32_t inode_num, ext2_inode_t* inode,
+                                ext2_alloc_t* a, uint32_t file_block) {
+    uint32_t block = ext2_get_block(st, inode, file_block);
+    if (block) return block;
+
+    // Continue after the previous block of the file, else start in its group
+    uint32_t goal = file_block ? ext2_get_block(st, inode, file_block - 1) : 0;
+    if (goal) goal++;
+    else if (a->goal) goal = a->goal;
+    else goal = ext2_group_first_block(st, (inode_num - 1) / st->inodes_per_group);
+
+    uint32_t ptrs_per_block = st->block_size / 4;
+    if (file_block < EXT2_NDIR_BLOCKS) {
+        block = ext2_new_block(st, inode, a, goal);
+        inode->i_block[file_block] = block;
+        return block;
+    }
+    file_block -= EXT2_NDIR_BLOCKS;
+    if (file_block < ptrs_per_block) {
+        uint32_t ind = inode->i_block[EXT2_IND_BLOCK];
+        block = ext2_ptr_alloc(st, inode, a, &ind, file_block, goal, 0);
+        inode->i_block[EXT2_IND_BLOCK] = ind;
+        return block;
+    }
+    file_block -= ptrs_per_block;
+    if (file_block < ptrs_per_block * ptrs_per_block) {
+        uint32_t blocks = inode->i_blocks;
+        uint32_t dind = inode->i_block[EXT2_DIND_BLOCK];
+        uint32_t l2_block = ext2_ptr_alloc(st, inode, a, &dind, file_block / ptrs_per_block, goal, 1);
+        inode->i_block[EXT2_DIND_BLOCK] = dind;
+        if (!l2_block) return 0;
+        if (inode->i_blocks != blocks) goal = a->goal;   // Data follows the new pointer blocks
+        return ext2_ptr_alloc(st, inode, a, &l2_block, file_block % ptrs_per_block, goal, 0);
+    }
+    return 0;   // Triply indirect: unsupported, as for reading
+}
+
+// Free a block and, for pointer blocks (depth > 0), everything below it
+static void ext2_free_tree(ext2_state_t* st, uint32_t block, int depth) {
+    if (!block) return;
+    if (depth > 0) {
+        uint32_t ptrs_per_block = st->block_size / 4;
+        for (uint32_t i = 0; i < ptrs_per_block; i++) {
+            uint32_t child = ext2_block_ptr(st, block, i);
+            if (child) ext2_free_tree(st, child, depth - 1);
+        }
+    }
+    ext2_free_block(st, block);
+}
+
+// Drop every block of a file and its cached pages
+static void ext2_truncate(ext2_state_t* st, uint32_t inode_num, ext2_inode_t* inode) {
+    pagecache_invalidate(st->cache_space, inode_num);
+    for (int i = 0; i < EXT2_NDIR_BLOCKS; i++) ext2_free_tree(st, inode->i_block[i], 0);
+    ext2_free_tree(st, inode->i_block[EXT2_IND_BLOCK], 1);
+    ext2_free_tree(st, inode->i_block[EXT2_DIND_BLOCK], 2);
+    ext2_free_tree(st, inode->i_block[EXT2_TIND_BLOCK], 3);
+    memset(inode->i_block, 0, sizeof(inode->i_block));
+    inode->i_blocks = 0;
+    inode->i_size = 0;
+    ext2_extent_forget(st, inode_num);
+}
+
 // ---- File Reading ----
 
-int ext2_read_file(ext2_state_t* st, ext2_inode_t* inode, void* buf,
-                   uint32_t offset, uint32_t count) {
+// Page cache fill for file pages (owner = ext2_state_t*, object = inode).
+// Data blocks are read around the device cache so they are cached once.
+static int ext2_readpage(void* owner, uint64_t object, uint32_t index, void* page) {
+    ext2_state_t* st = (ext2_state_t*)owner;
+    ext2_inode_t inode;
+    if (ext2_read_inode(st, (uint32_t)object, &inode) < 0) return -1;
+
+    // One device read per run of contiguous blocks in the page
+    uint8_t* dst = (uint8_t*)page;
+    uint32_t per_page = PAGECACHE_PAGE_SIZE / st->block_size;
+    uint32_t sectors_per_block = st->block_size / BLKDEV_SECTOR_SIZE;
+    uint32_t k = 0;
+    while (k < per_page) {
+        uint32_t file_block = index * per_page + k;
+        uint8_t* out = dst + k * st->block_size;
+        uint32_t disk_block = 0, run = 0;
+        if ((uint64_t)file_block * st->block_size < inode.i_size) {
+            disk_block = ext2_map(st, (uint32_t)object, &inode, file_block, &run);
+        }
+        if (disk_block == 0) {
+            memset(out, 0, st->block_size);   // Hole or past EOF
+            k++;
+            continue;
+        }
+        uint32_t eof_blocks = (uint32_t)((inode.i_size + st->block_size - 1) / st->block_size) - file_block;
+        if (run > per_page - k) run = per_page - k;
+        if (run > eof_blocks) run = eof_blocks;
+        if (blkdev_read_direct(st->block_device, disk_block * sectors_per_block,
+                               run * sectors_per_block, out) < 0) return -1;
+        k += run;
+    }
+    return 0;
+}
+
+static void ext2_readahead_done(void* arg, int status) {
+    pagecache_fill_done((pagecache_page_t*)arg, status);
+}
+
+// Readahead fill: a page whose blocks lie back to back on disk becomes one
+// asynchronous device read; holes, the EOF page and fragmented pages are
+// filled synchronously. Fails once too many reads are in flight.
+static int ext2_readahead(void* owner, uint64_t object, uint32_t index, pagecache_page_t* page) {
+    ext2_state_t* st = (ext2_state_t*)owner;
+    ext2_inode_t inode;
+    if (ext2_read_inode(st, (uint32_t)object, &inode) < 0) return -1;
+    if ((uint64_t)index * PAGECACHE_PAGE_SIZE >= inode.i_size) return -1;   // Past EOF
+
+    uint32_t per_page = PAGECACHE_PAGE_SIZE / st->block_size;
+    uint32_t sectors_per_block = st->block_size / BLKDEV_SECTOR_SIZE;
+    uint32_t first = 0, run = 0;
+    int contiguous = (uint64_t)(index + 1) * PAGECACHE_PAGE_SIZE <= inode.i_size;
+    if (contiguous) {
+        first = ext2_map(st, (uint32_t)object, &inode, index * per_page, &run);
+        contiguous = first && run >= per_page;
+    }
+
+    if (contiguous) {
+        return blkdev_read_async(st->block_device, first * sectors_per_block,
+                                 per_page * sectors_per_block, page->data,
+                                 ext2_readahead_done, page);
+    }
+    pagecache_fill_done(page, ext2_readpage(owner, object, index, page->data));
+    return 0;
+}
+
+// Write a dirty file page back around the device cache, one device write
+// per run of contiguous blocks. Blocks past EOF (or unmapped after a
+// truncate) are skipped.
+static int ext2_writepage(void* owner, uint64_t object, uint32_t index, const void* page) {
+    ext2_state_t* st = (ext2_state_t*)owner;
+    ext2_inode_t inode;
+    if (ext2_read_inode(st, (uint32_t)object, &inode) < 0) return -1;
+
+    const uint8_t* src = (const uint8_t*)page;
+    uint32_t per_page = PAGECACHE_PAGE_SIZE / st->block_size;
+    uint32_t sectors_per_block = st->block_size / BLKDEV_SECTOR_SIZE;
+    uint32_t k = 0;
+    while (k < per_page) {
+        uint32_t file_block = index * per_page + k;
+        if ((uint64_t)file_block * st->block_size >= inode.i_size) break;
+        uint32_t run = 0;
+        uint32_t disk_block = ext2_map(st, (uint32_t)object, &inode, file_block, &run);
+        if (disk_block == 0) {
+            k++;
+            continue;
+        }
+        uint32_t eof_blocks = (uint32_t)((inode.i_size + st->block_size - 1) / st->block_size) - file_block;
+        if (run > per_page - k) run = per_page - k;
+        if (run > eof_blocks) run = eof_blocks;
+        if (blkdev_write_direct(st->block_device, disk_block * sectors_per_block,
+                                run * sectors_per_block, src + k * st->block_size) < 0) return -1;
+        k += run;
+    }
+    return 0;
+}
+
+static const pagecache_ops_t ext2_cache_ops = {
+    .readpage  = ext2_readpage,
+    .writepage = ext2_writepage,
+    .readahead = ext2_readahead,
+};
+
+int ext2_read_file(ext2_state_t* st, uint32_t inode_num, ext2_inode_t* inode,
+                   void* buf, uint32_t offset, uint32_t count) {
     uint32_t file_size = inode->i_size;
     if (offset >= file_size) return 0;
     if (offset + count > file_size) count = file_size - offset;
@@ -188,25 +810,338 @@ int ext2_read_file(ext2_state_t* st, ext2_inode_t* inode, void* buf,
 
     while (bytes_read < count) {
         uint32_t pos = offset + bytes_read;
-        uint32_t file_block = pos / st->block_size;
-        uint32_t offset_in_blk = pos % st->block_size;
-
-        uint32_t disk_block = ext2_get_block(st, inode, file_block);
-        if (disk_block == 0) break; // Sparse file or error
+        uint32_t offset_in_page = pos % PAGECACHE_PAGE_SIZE;
 
-        uint8_t read_buf[4096];
-        if (ext2_read_block(st, disk_block, read_buf) < 0) break;
+        pagecache_page_t* page = pagecache_get(st->cache_space, inode_num,
+                                               pos / PAGECACHE_PAGE_SIZE, PAGECACHE_SEQ);
+        if (!page) break;
 
-        uint32_t to_copy = st->block_size - offset_in_blk;
+        uint32_t to_copy = PAGECACHE_PAGE_SIZE - offset_in_page;
         if (to_copy > count - bytes_read) to_copy = count - bytes_read;
 
-        e2_memcpy(dst + bytes_read, read_buf + offset_in_blk, (int)to_copy);
+        memcpy(dst + bytes_read, page->data + offset_in_page, to_copy);
+        pagecache_put(page);
         bytes_read += to_copy;
     }
 
     return (int)bytes_read;
 }
 
+int ext2_write_file(ext2_state_t* st, uint32_t inode_num, ext2_inode_t* inode,
+                    ext2_alloc_t* alloc, const void* buf, uint32_t offset, uint32_t count) {
+    if (!st->writable) return -1;
+    if (count == 0) return 0;
+    if (offset + count < offset) count = 0xFFFFFFFFU - offset;
+
+    // Pages the write only partly covers are read before any block is
+    // allocated, so blocks the write adds to them (holes, or past the old
+    // EOF) read as zeros rather than as whatever the disk held there
+    uint32_t edge_index[2] = { offset / PAGECACHE_PAGE_SIZE, (offset + count - 1) / PAGECACHE_PAGE_SIZE };
+    pagecache_page_t* edge[2] = { 0, 0 };
+    if (offset % PAGECACHE_PAGE_SIZE) {
+        edge[0] = pagecache_get(st->cache_space, inode_num, edge_index[0], 0);
+        if (!edge[0]) return -1;
+    }
+    if ((offset + count) % PAGECACHE_PAGE_SIZE && !(edge[0] && edge_index[1] == edge_index[0])) {
+        edge[1] = pagecache_get(st->cache_space, inode_num, edge_index[1], 0);
+        if (!edge[1]) {
+            pagecache_put(edge[0]);
+            return -1;
+        }
+    }
+
+    // Map every block first and record them (and the new size) in the
+    // inode before any data page can be written back
+    uint32_t first = offset / st->block_size;
+    uint32_t last = (offset + count - 1) / st->block_size;
+    for (uint32_t fb = first; fb <= last; fb++) {
+        if (!ext2_bmap_alloc(st, inode_num, inode, alloc, fb)) {
+            // Disk full: write what fits
+            uint32_t fits = fb * st->block_size > offset ? fb * st->block_size - offset : 0;
+            count = fits < count ? fits : count;
+            break;
+        }
+    }
+    uint32_t old_size = inode->i_size;
+    if (count && offset + count > inode->i_size) inode->i_size = offset + count;
+    inode->i_mtime = inode->i_ctime = ext2_now(st);
+    if (ext2_write_inode(st, inode_num, inode) < 0) count = 0;
+    ext2_commit(st);
+
+    const uint8_t* src = (const uint8_t*)buf;
+    uint32_t written = 0;
+    while (written < count) {
+        uint32_t pos = offset + written;
+        uint32_t index = pos / PAGECACHE_PAGE_SIZE;
+        uint32_t offset_in_page = pos % PAGECACHE_PAGE_SIZE;
+        uint32_t n = PAGECACHE_PAGE_SIZE - offset_in_page;
+        if (n > count - written) n = count - written;
+
+        // Pages wholly overwritten need no read. A partial page that is
+        // not an edge one only comes from a write cut short by a full
+        // disk; its new blocks all lie inside the write.
+        uint32_t page_start = index * PAGECACHE_PAGE_SIZE;
+        pagecache_page_t* page;
+        if (edge[0] && index == edge_index[0]) page = edge[0];
+        else if (edge[1] && index == edge_index[1]) page = edge[1];
+        else page = pagecache_get(st->cache_space, inode_num, index,
+                                  n == PAGECACHE_PAGE_SIZE ? PAGECACHE_NOFILL : 0);
+        if (!page) break;
+        if (old_size < pos) {
+            // Bytes between the old EOF and the write, within its last block
+            uint32_t z = old_size > page_start ? old_size - page_start : 0;
+            memset(page->data + z, 0, offset_in_page - z);
+        }
+        memcpy(page->data + offset_in_page, src + written, n);
+        pagecache_mark_dirty(page);
+        if (page != edge[0] && page != edge[1]) pagecache_put(page);
+        written += n;
+    }
+    pagecache_put(edge[0]);
+    pagecache_put(edge[1]);
+    return written ? (int)written : -1;
+}
+
+// ---- Hashed Directories ----
+
+static uint32_t ext2_rol32(uint32_t x, int s) {
+    return (x << s) | (x >> (32 - s));
+}
+
+// Name bytes as hash input words, padded with the length
+static void ext2_str2hashbuf(const char* msg, int len, uint32_t* buf, int num, int unsigned_chars) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+    uint32_t val = pad;
+    if (len > num * 4) len = num * 4;
+    for (int i = 0; i < len; i++) {
+        int c = unsigned_chars ? (int)(uint8_t)msg[i] : (int)(int8_t)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) *buf++ = val;
+    while (--num >= 0) *buf++ = pad;
+}
+
+static void ext2_tea_transform(uint32_t* buf, const uint32_t* in) {
+    uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ext2_rol32(a, s))
+
+static void ext2_half_md4_transform(uint32_t* buf, const uint32_t* in) {
+    const uint32_t k2 = 0x5A827999, k3 = 0x6ED9EBA1;
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    DX_ROUND(DX_F, a, b, c, d, in[0], 3);
+    DX_ROUND(DX_F, d, a, b, c, in[1], 7);
+    DX_ROUND(DX_F, c, d, a, b, in[2], 11);
+    DX_ROUND(DX_F, b, c, d, a, in[3], 19);
+    DX_ROUND(DX_F, a, b, c, d, in[4], 3);
+    DX_ROUND(DX_F, d, a, b, c, in[5], 7);
+    DX_ROUND(DX_F, c, d, a, b, in[6], 11);
+    DX_ROUND(DX_F, b, c, d, a, in[7], 19);
+
+    DX_ROUND(DX_G, a, b, c, d, in[1] + k2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[3] + k2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[5] + k2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[7] + k2, 13);
+    DX_ROUND(DX_G, a, b, c, d, in[0] + k2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[2] + k2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[4] + k2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[6] + k2, 13);
+
+    DX_ROUND(DX_H, a, b, c, d, in[3] + k3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[7] + k3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[2] + k3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[6] + k3, 15);
+    DX_ROUND(DX_H, a, b, c, d, in[1] + k3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[5] + k3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[0] + k3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[4] + k3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// The original ext3 directory hash
+static uint32_t ext2_dx_hack_hash(const char* name, int len, int unsigned_chars) {
+    uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+    for (int i = 0; i < len; i++) {
+        int c = unsigned_chars ? (int)(uint8_t)name[i] : (int)(int8_t)name[i];
+        uint32_t hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000) hash -= 0x7FFFFFFF;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// Hash of a name as the index stores it (low bit clear)
+static uint32_t ext2_dx_hash(ext2_state_t* st, int version, const char* name, int len) {
+    int unsigned_chars = version >= EXT2_DX_HASH_UNSIGNED;
+    uint32_t buf[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    uint32_t seed[4];
+    memcpy(seed, st->sb.s_hash_seed, sizeof(seed));
+    if (seed[0] | seed[1] | seed[2] | seed[3]) memcpy(buf, seed, sizeof(buf));
+
+    uint32_t in[8];
+    uint32_t hash;
+    switch (version % EXT2_DX_HASH_UNSIGNED) {
+    case EXT2_DX_HASH_HALF_MD4:
+        for (int off = 0; off < len; off += 32) {
+            ext2_str2hashbuf(name + off, len - off, in, 8, unsigned_chars);
+            ext2_half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case EXT2_DX_HASH_TEA:
+        for (int off = 0; off < len; off += 16) {
+            ext2_str2hashbuf(name + off, len - off, in, 4, unsigned_chars);
+            ext2_tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        hash = ext2_dx_hack_hash(name, len, unsigned_chars);
+        break;
+    }
+    hash &= ~1U;
+    if (hash == (0x7FFFFFFFU << 1)) hash = (0x7FFFFFFFU - 1) << 1;   // Reserved end-of-directory value
+    return hash;
+}
+
+// Position of a probe in the index: the entry followed at each level
+typedef struct {
+    uint32_t hash;
+    int      levels;            // Index levels below the root
+    uint32_t node[EXT2_DX_MAX_LEVELS];
+    uint32_t at[EXT2_DX_MAX_LEVELS];
+    uint32_t count[EXT2_DX_MAX_LEVELS];
+} ext2_dx_path_t;
+
+static int ext2_dx_indexed(ext2_state_t* st, const ext2_inode_t* dir) {
+    return (st->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+           (dir->i_flags & EXT2_INDEX_FL) && dir->i_size >= 2 * st->block_size;
+}
+
+// Map index node fb (the root at level 0) and find its entry array.
+// Returns 0 if the node does not look like one.
+static const ext2_dx_entry_t* ext2_dx_node(ext2_state_t* st, uint32_t ino, ext2_inode_t* dir,
+                                           uint32_t fb, int level, pagecache_page_t** page,
+                                           uint32_t* count) {
+    uint32_t run;
+    uint32_t block = ext2_map(st, ino, dir, fb, &run);
+    const uint8_t* data = block ? ext2_map_block(st, block, page) : (const uint8_t*)0;
+    if (!data) return (const ext2_dx_entry_t*)0;
+
+    uint32_t offset = 8;    // Past the empty entry spanning a node
+    if (level == 0) {
+        const ext2_dx_root_info_t* info = (const ext2_dx_root_info_t*)(data + 24);
+        offset = 24 + info->info_length;
+    }
+    const ext2_dx_entry_t* entries = (const ext2_dx_entry_t*)(data + offset);
+    uint32_t limit = entries[0].hash & 0xFFFF;
+    *count = entries[0].hash >> 16;
+    if (*count == 0 || *count > limit || offset + limit * sizeof(ext2_dx_entry_t) > st->block_size) {
+        blkdev_unmap(*page);
+        return (const ext2_dx_entry_t*)0;
+    }
+    return entries;
+}
+
+// Walk the index down to the leaf block that holds name, if present.
+// Returns the leaf (file-relative), or -1 if the index is unusable.
+static int64_t ext2_dx_probe(ext2_state_t* st, uint32_t ino, ext2_inode_t* dir,
+                             const char* name, int name_len, ext2_dx_path_t* path) {
+    uint32_t run;
+    uint32_t root = ext2_map(st, ino, dir, 0, &run);
+    pagecache_page_t* page;
+    const uint8_t* data = root ? ext2_map_block(st, root, &page) : (const uint8_t*)0;
+    if (!data) return -1;
+    const ext2_dx_root_info_t* info = (const ext2_dx_root_info_t*)(data + 24);
+    int ok = info->reserved_zero == 0 && info->info_length == 8 &&
+             info->hash_version <= EXT2_DX_HASH_TEA && info->indirect_levels < EXT2_DX_MAX_LEVELS;
+    int version = info->hash_version;
+    path->levels = info->indirect_levels;
+    blkdev_unmap(page);
+    if (!ok) return -1;
+
+    if (st->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH) version += EXT2_DX_HASH_UNSIGNED;
+    path->hash = ext2_dx_hash(st, version, name, name_len);
+
+    uint32_t fb = 0;
+    for (int level = 0; level <= path->levels; level++) {
+        uint32_t count;
+        const ext2_dx_entry_t* entries = ext2_dx_node(st, ino, dir, fb, level, &page, &count);
+        if (!entries) return -1;
+
+        // Last entry whose hash is <= ours (entry 0 covers everything below entry 1)
+        uint32_t lo = 1, hi = count;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (entries[mid].hash <= path->hash) lo = mid + 1;
+            else hi = mid;
+        }
+        path->node[level] = fb;
+        path->at[level] = lo - 1;
+        path->count[level] = count;
+        fb = entries[lo - 1].block & 0x0FFFFFFF;
+        blkdev_unmap(page);
+    }
+    return fb;
+}
+
+// The leaf after the one probed, if names with our hash may continue
+// there (a hash collision split across blocks). Returns -1 if not.
+static int64_t ext2_dx_next(ext2_state_t* st, uint32_t ino, ext2_inode_t* dir, ext2_dx_path_t* path) {
+    int level = path->levels;
+    while (level >= 0 && path->at[level] + 1 >= path->count[level]) level--;
+    if (level < 0) return -1;
+    path->at[level]++;
+
+    pagecache_page_t* page;
+    uint32_t count;
+    const ext2_dx_entry_t* entries = ext2_dx_node(st, ino, dir, path->node[level], level, &page, &count);
+    if (!entries || path->at[level] >= count) {
+        if (entries) blkdev_unmap(page);
+        return -1;
+    }
+    uint32_t next_hash = entries[path->at[level]].hash;
+    uint32_t fb = entries[path->at[level]].block & 0x0FFFFFFF;
+    blkdev_unmap(page);
+    if ((next_hash & ~1U) != path->hash) return -1;
+
+    // Down the leftmost edge below the entry we moved to
+    for (int l = level + 1; l <= path->levels; l++) {
+        entries = ext2_dx_node(st, ino, dir, fb, l, &page, &count);
+        if (!entries) return -1;
+        path->node[l] = fb;
+        path->at[l] = 0;
+        path->count[l] = count;
+        fb = entries[0].block & 0x0FFFFFFF;
+        blkdev_unmap(page);
+    }
+    return fb;
+}
+
 // ---- Directory Operations ----
 
 int ext2_read_dir(ext2_state_t* st, uint32_t dir_inode_num,
@@ -224,17 +1159,19 @@ int ext2_read_dir(ext2_state_t* st, uint32_t dir_inode_num,
         uint32_t file_block = pos / st->block_size;
         uint32_t offset_in_blk = pos % st->block_size;
 
-        uint32_t disk_block = ext2_get_block(st, &dir_inode, file_block);
+        uint32_t run;
+        uint32_t disk_block = ext2_map(st, dir_inode_num, &dir_inode, file_block, &run);
         if (disk_block == 0) break;
 
-        uint8_t dir_buf[4096];
-        if (ext2_read_block(st, disk_block, dir_buf) < 0) break;
+        pagecache_page_t* page;
+        const uint8_t* dir_buf = ext2_map_block(st, disk_block, &page);
+        if (!dir_buf) break;
 
         // Process directory entries within this block
         while (offset_in_blk < st->block_size && pos < dir_size && count < max_entries) {
-            ext2_dir_entry_t* de = (ext2_dir_entry_t*)(dir_buf + offset_in_blk);
+            const ext2_dir_entry_t* de = (const ext2_dir_entry_t*)(dir_buf + offset_in_blk);
 
-            if (de->rec_len == 0) break; // Invalid
+            if (de->rec_len == 0) { pos = dir_size; break; } // Invalid
             if (de->inode != 0 && de->name_len > 0) {
                 // Skip "." and ".."
                 int skip = 0;
@@ -245,7 +1182,7 @@ int ext2_read_dir(ext2_state_t* st, uint32_t dir_inode_num,
                     // Copy name
                     int nl = de->name_len;
                     if (nl >= VFS_MAX_NAME) nl = VFS_MAX_NAME - 1;
-                    e2_memcpy(entries[count].name, de->name, nl);
+                    memcpy(entries[count].name, de->name, nl);
                     entries[count].name[nl] = 0;
 
                     // Map file type
@@ -280,46 +1217,84 @@ int ext2_read_dir(ext2_state_t* st, uint32_t dir_inode_num,
             pos += de->rec_len;
             offset_in_blk += de->rec_len;
         }
+        blkdev_unmap(page);
     }
 
     return count;
 }
 
+// Inode of the entry called name in one directory block, 0 if none
+static uint32_t ext2_block_find(ext2_state_t* st, uint32_t disk_block, const char* name, int name_len) {
+    pagecache_page_t* page;
+    const uint8_t* dir_buf = ext2_map_block(st, disk_block, &page);
+    if (!dir_buf) return 0;
+
+    uint32_t ino = 0;
+    uint32_t offset_in_blk = 0;
+    while (offset_in_blk + 8 <= st->block_size) {
+        const ext2_dir_entry_t* de = (const ext2_dir_entry_t*)(dir_buf + offset_in_blk);
+        if (de->rec_len == 0) break;
+
+        if (de->inode != 0 && de->name_len == (uint8_t)name_len &&
+            e2_strncmp(de->name, name, name_len) == 0) {
+            ino = de->inode;
+            break;
+        }
+        offset_in_blk += de->rec_len;
+    }
+    blkdev_unmap(page);
+    return ino;
+}
+
+// Search an indexed directory: only the leaf the name hashes to (and any
+// that continue its hash). Returns -1 if the index cannot be used.
+static int64_t ext2_dx_lookup(ext2_state_t* st, uint32_t dir_inode, ext2_inode_t* dir,
+                              const char* name, int name_len) {
+    ext2_dx_path_t path;
+    int64_t leaf = ext2_dx_probe(st, dir_inode, dir, name, name_len, &path);
+    if (leaf < 0) return -1;
+    while (leaf >= 0) {
+        uint32_t run;
+        uint32_t block = ext2_map(st, dir_inode, dir, (uint32_t)leaf, &run);
+        if (!block) return -1;
+        uint32_t ino = ext2_block_find(st, block, name, name_len);
+        if (ino) return ino;
+        leaf = ext2_dx_next(st, dir_inode, dir, &path);
+    }
+    return 0;
+}
+
 uint32_t ext2_lookup(ext2_state_t* st, uint32_t dir_inode, const char* name) {
+    uint64_t cached;
+    int hit = dcache_lookup(st, dir_inode, name, &cached);
+    if (hit == DCACHE_NEGATIVE) return 0;
+    if (hit == DCACHE_FOUND) return (uint32_t)cached;
+
+    // A directory change while this scan sleeps makes its answer stale
+    uint32_t gen = st->dir_gen;
     ext2_inode_t inode;
     if (ext2_read_inode(st, dir_inode, &inode) < 0) return 0;
     if (!(inode.i_mode & EXT2_S_IFDIR)) return 0;
 
     int name_len = e2_strlen(name);
-    uint32_t dir_size = inode.i_size;
-    uint32_t pos = 0;
-
-    while (pos < dir_size) {
-        uint32_t file_block = pos / st->block_size;
-        uint32_t offset_in_blk = pos % st->block_size;
-
-        uint32_t disk_block = ext2_get_block(st, &inode, file_block);
-        if (disk_block == 0) break;
-
-        uint8_t dir_buf[4096];
-        if (ext2_read_block(st, disk_block, dir_buf) < 0) break;
-
-        while (offset_in_blk < st->block_size && pos < dir_size) {
-            ext2_dir_entry_t* de = (ext2_dir_entry_t*)(dir_buf + offset_in_blk);
-            if (de->rec_len == 0) break;
-
-            if (de->inode != 0 && de->name_len == (uint8_t)name_len) {
-                if (e2_strncmp(de->name, name, name_len) == 0) {
-                    return de->inode;
-                }
-            }
-
-            pos += de->rec_len;
-            offset_in_blk += de->rec_len;
+    int64_t found = ext2_dx_indexed(st, &inode) ?
+                    ext2_dx_lookup(st, dir_inode, &inode, name, name_len) : -1;
+    if (found < 0) {
+        found = 0;
+        uint32_t blocks = inode.i_size / st->block_size;
+        for (uint32_t fb = 0; fb < blocks && !found; fb++) {
+            uint32_t run;
+            uint32_t disk_block = ext2_map(st, dir_inode, &inode, fb, &run);
+            if (disk_block == 0) break;
+            found = ext2_block_find(st, disk_block, name, name_len);
         }
     }
 
-    return 0; // Not found
+    if (gen == st->dir_gen) {
+        if (found) dcache_add(st, dir_inode, name, (uint64_t)found);
+        else dcache_add_negative(st, dir_inode, name);
+    }
+    return (uint32_t)found;
 }
 
 uint32_t ext2_resolve_path(ext2_state_t* st, const char* path) {
@@ -362,6 +1337,282 @@ uint32_t ext2_resolve_path(ext2_state_t* st, const char* path) {
     return current_inode;
 }
 
+// ---- Directory Updates ----
+
+static uint16_t ext2_dirent_size(uint32_t name_len) {
+    return (uint16_t)((8 + name_len + 3) & ~3U);
+}
+
+static int ext2_has_filetype(ext2_state_t* st) {
+    return st->sb.s_rev_level >= 1 && (st->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE);
+}
+
+static void ext2_fill_dirent(ext2_state_t* st, ext2_dir_entry_t* de, uint32_t ino,
+                             const char* name, int name_len, uint8_t file_type) {
+    de->inode = ino;
+    de->name_len = (uint8_t)name_len;
+    de->file_type = ext2_has_filetype(st) ? file_type : 0;
+    memcpy(de->name, name, name_len);
+}
+
+// Put an entry into the slack of one directory block. Returns 0, or -1
+// if no entry there has room.
+static int ext2_block_insert(ext2_state_t* st, uint32_t disk_block, const char* name,
+                             int name_len, uint32_t ino, uint8_t file_type) {
+    uint16_t need = ext2_dirent_size(name_len);
+    pagecache_page_t* page;
+    uint8_t* buf = ext2_map_block_rw(st, disk_block, &page);
+    if (!buf) return -1;
+    uint32_t off = 0;
+    while (off + 8 <= st->block_size) {
+        ext2_dir_entry_t* de = (ext2_dir_entry_t*)(buf + off);
+        if (de->rec_len < 8 || off + de->rec_len > st->block_size) break;
+        uint16_t used = de->inode ? ext2_dirent_size(de->name_len) : 0;
+        if (de->rec_len - used >= need) {
+            if (used) {
+                ext2_dir_entry_t* next = (ext2_dir_entry_t*)(buf + off + used);
+                next->rec_len = de->rec_len - used;
+                de->rec_len = used;
+                de = next;
+            }
+            ext2_fill_dirent(st, de, ino, name, name_len, file_type);
+            blkdev_unmap_dirty(page);
+            return 0;
+        }
+        off += de->rec_len;
+    }
+    blkdev_unmap(page);
+    return -1;
+}
+
+// Link name to ino in a directory: into the slack of an existing entry
+// if one has room, else in a new block appended to the directory. An
+// indexed directory takes the entry in the leaf its hash belongs to; when
+// that leaf is full the index is dropped (leaf splitting is not done) and
+// the directory carries on as a linear one.
+static int ext2_add_entry(ext2_state_t* st, uint32_t dir_ino, ext2_inode_t* dir,
+                          const char* name, uint32_t ino, uint8_t file_type) {
+    int name_len = e2_strlen(name);
+    if (name_len == 0 || name_len > EXT2_NAME_LEN) return -1;
+    uint32_t blocks = dir->i_size / st->block_size;
+
+    if (ext2_dx_indexed(st, dir)) {
+        ext2_dx_path_t path;
+        int64_t leaf = ext2_dx_probe(st, dir_ino, dir, name, name_len, &path);
+        uint32_t run;
+        uint32_t block = leaf > 0 ? ext2_map(st, dir_ino, dir, (uint32_t)leaf, &run) : 0;
+        if (block && ext2_block_insert(st, block, name, name_len, ino, file_type) == 0) return 0;
+        dir->i_flags &= ~EXT2_INDEX_FL;
+    }
+
+    for (uint32_t fb = 0; fb < blocks; fb++) {
+        uint32_t block = ext2_get_block(st, dir, fb);
+        if (block && ext2_block_insert(st, block, name, name_len, ino, file_type) == 0) return 0;
+    }
+
+    ext2_alloc_t a;
+    memset(&a, 0, sizeof(a));
+    uint32_t block = ext2_bmap_alloc(st, dir_ino, dir, &a, blocks);
+    ext2_discard_prealloc(st, &a);
+    if (!block) return -1;
+    pagecache_page_t* page;
+    uint8_t* buf = ext2_map_block_rw(st, block, &page);
+    if (!buf) return -1;
+    memset(buf, 0, st->block_size);
+    ext2_dir_entry_t* de = (ext2_dir_entry_t*)buf;
+    de->rec_len = (uint16_t)st->block_size;
+    ext2_fill_dirent(st, de, ino, name, name_len, file_type);
+    blkdev_unmap_dirty(page);
+    dir->i_size += st->block_size;
+    return 0;
+}
+
+// Unlink name from a directory: the entry's space goes to the one before
+// it, or the entry is just cleared at the start of a block. Returns the
+// inode it pointed to, or 0.
+static uint32_t ext2_remove_entry(ext2_state_t* st, ext2_inode_t* dir, const char* name) {
+    int name_len = e2_strlen(name);
+    uint32_t blocks = dir->i_size / st->block_size;
+    for (uint32_t fb = 0; fb < blocks; fb++) {
+        pagecache_page_t* page;
+        uint8_t* buf = ext2_map_block_rw(st, ext2_get_block(st, dir, fb), &page);
+        if (!buf) continue;
+        ext2_dir_entry_t* prev = (ext2_dir_entry_t*)0;
+        uint32_t off = 0;
+        while (off + 8 <= st->block_size) {
+            ext2_dir_entry_t* de = (ext2_dir_entry_t*)(buf + off);
+            if (de->rec_len < 8 || off + de->rec_len > st->block_size) break;
+            if (de->inode && de->name_len == (uint8_t)name_len &&
+                e2_strncmp(de->name, name, name_len) == 0) {
+                uint32_t ino = de->inode;
+                if (prev) prev->rec_len += de->rec_len;
+                else de->inode = 0;
+                blkdev_unmap_dirty(page);
+                return ino;
+            }
+            prev = de;
+            off += de->rec_len;
+        }
+        blkdev_unmap(page);
+    }
+    return 0;
+}
+
+// A directory holding nothing but "." and ".."
+static int ext2_dir_empty(ext2_state_t* st, ext2_inode_t* dir) {
+    uint32_t blocks = dir->i_size / st->block_size;
+    for (uint32_t fb = 0; fb < blocks; fb++) {
+        pagecache_page_t* page;
+        const uint8_t* buf = ext2_map_block(st, ext2_get_block(st, dir, fb), &page);
+        if (!buf) return 0;
+        uint32_t off = 0;
+        while (off + 8 <= st->block_size) {
+            const ext2_dir_entry_t* de = (const ext2_dir_entry_t*)(buf + off);
+            if (de->rec_len < 8) break;
+            int dot = (de->name_len == 1 && de->name[0] == '.') ||
+                      (de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.');
+            if (de->inode && !dot) {
+                blkdev_unmap(page);
+                return 0;
+            }
+            off += de->rec_len;
+        }
+        blkdev_unmap(page);
+    }
+    return 1;
+}
+
+// Split "/a/b/c" into parent "/a/b" and name "c". Returns 0 or -1.
+static int ext2_split_path(const char* path, char* parent, char* name) {
+    int len = e2_strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    int slash = len - 1;
+    while (slash >= 0 && path[slash] != '/') slash--;
+    int name_len = len - slash - 1;
+    if (name_len <= 0 || name_len > EXT2_NAME_LEN || slash + 1 >= VFS_MAX_PATH) return -1;
+    memcpy(name, path + slash + 1, name_len);
+    name[name_len] = 0;
+    if (slash <= 0) {
+        parent[0] = '/';
+        parent[1] = 0;
+    } else {
+        memcpy(parent, path, slash);
+        parent[slash] = 0;
+    }
+    return 0;
+}
+
+static uint16_t ext2_mode_from_perms(uint8_t perms) {
+    uint16_t mode = 0;
+    if (perms & VFS_PERM_READ) mode |= EXT2_S_IRUSR | EXT2_S_IRGRP | EXT2_S_IROTH;
+    if (perms & VFS_PERM_WRITE) mode |= EXT2_S_IWUSR;
+    if (perms & VFS_PERM_EXEC) mode |= EXT2_S_IXUSR | EXT2_S_IXGRP | EXT2_S_IXOTH;
+    return mode;
+}
+
+// Create a file or directory (st locked). Returns its inode, or 0.
+static uint32_t ext2_create_node(ext2_state_t* st, const char* path, uint8_t type, uint8_t perms) {
+    if (type != VFS_FILE && type != VFS_DIRECTORY) return 0;
+    char parent_path[VFS_MAX_PATH];
+    char name[EXT2_NAME_LEN + 1];
+    if (ext2_split_path(path, parent_path, name) < 0) return 0;
+
+    uint32_t parent = ext2_resolve_path(st, parent_path);
+    ext2_inode_t dir;
+    if (!parent || ext2_read_inode(st, parent, &dir) < 0 || !(dir.i_mode & EXT2_S_IFDIR)) return 0;
+    if (ext2_lookup(st, parent, name)) return 0;
+
+    int is_dir = type == VFS_DIRECTORY;
+    uint32_t ino = ext2_alloc_inode(st, parent, is_dir);
+    if (!ino) return 0;
+
+    ext2_inode_t inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.i_mode = (uint16_t)((is_dir ? EXT2_S_IFDIR : EXT2_S_IFREG) | ext2_mode_from_perms(perms));
+    inode.i_links_count = is_dir ? 2 : 1;
+    inode.i_atime = inode.i_ctime = inode.i_mtime = ext2_now(st);
+
+    if (is_dir) {
+        // "." and ".." fill the first block
+        ext2_alloc_t a;
+        memset(&a, 0, sizeof(a));
+        uint32_t block = ext2_bmap_alloc(st, ino, &inode, &a, 0);
+        ext2_discard_prealloc(st, &a);
+        pagecache_page_t* page;
+        uint8_t* buf = block ? ext2_map_block_rw(st, block, &page) : (uint8_t*)0;
+        if (!buf) {
+            ext2_truncate(st, ino, &inode);
+            ext2_free_inode(st, ino, 1);
+            ext2_commit(st);
+            return 0;
+        }
+        memset(buf, 0, st->block_size);
+        ext2_dir_entry_t* dot = (ext2_dir_entry_t*)buf;
+        ext2_fill_dirent(st, dot, ino, ".", 1, EXT2_FT_DIR);
+        dot->rec_len = ext2_dirent_size(1);
+        ext2_dir_entry_t* dotdot = (ext2_dir_entry_t*)(buf + dot->rec_len);
+        ext2_fill_dirent(st, dotdot, parent, "..", 2, EXT2_FT_DIR);
+        dotdot->rec_len = (uint16_t)(st->block_size - dot->rec_len);
+        blkdev_unmap_dirty(page);
+        inode.i_size = st->block_size;
+        dir.i_links_count++;
+    }
+
+    if (ext2_write_inode(st, ino, &inode) < 0 ||
+        ext2_add_entry(st, parent, &dir, name, ino, is_dir ? EXT2_FT_DIR : EXT2_FT_REG_FILE) < 0) {
+        ext2_truncate(st, ino, &inode);
+        ext2_free_inode(st, ino, is_dir);
+        ext2_commit(st);
+        return 0;
+    }
+    st->dir_gen++;
+    dcache_add(st, parent, name, ino);
+    dir.i_mtime = dir.i_ctime = ext2_now(st);
+    ext2_write_inode(st, parent, &dir);
+    ext2_commit(st);
+    return ino;
+}
+
+// Remove a file or an empty directory (st locked). Returns 0 or -1.
+static int ext2_delete_node(ext2_state_t* st, const char* path) {
+    char parent_path[VFS_MAX_PATH];
+    char name[EXT2_NAME_LEN + 1];
+    if (ext2_split_path(path, parent_path, name) < 0) return -1;
+    if (e2_strcmp(name, ".") == 0 || e2_strcmp(name, "..") == 0) return -1;
+
+    uint32_t parent = ext2_resolve_path(st, parent_path);
+    ext2_inode_t dir;
+    if (!parent || ext2_read_inode(st, parent, &dir) < 0) return -1;
+    uint32_t ino = ext2_lookup(st, parent, name);
+    ext2_inode_t inode;
+    if (!ino || ext2_read_inode(st, ino, &inode) < 0) return -1;
+
+    int is_dir = (inode.i_mode & 0xF000) == EXT2_S_IFDIR;
+    if (is_dir && !ext2_dir_empty(st, &inode)) return -1;
+    if (ext2_remove_entry(st, &dir, name) != ino) return -1;
+    st->dir_gen++;
+    dcache_add_negative(st, parent, name);
+    if (is_dir) dcache_forget_dir(st, ino);
+
+    uint32_t now = ext2_now(st);
+    if (is_dir && dir.i_links_count > 1) dir.i_links_count--;
+    dir.i_mtime = dir.i_ctime = now;
+    ext2_write_inode(st, parent, &dir);
+
+    if (inode.i_links_count) inode.i_links_count--;
+    if (is_dir || inode.i_links_count == 0) {
+        ext2_truncate(st, ino, &inode);
+        inode.i_links_count = 0;
+        inode.i_dtime = now;
+        ext2_write_inode(st, ino, &inode);
+        ext2_free_inode(st, ino, is_dir);
+    } else {
+        inode.i_ctime = now;
+        ext2_write_inode(st, ino, &inode);
+    }
+    return ext2_commit(st);
+}
+
 // ---- VFS Integration ----
 
 // Per-open-file state for ext2
@@ -369,38 +1620,65 @@ typedef struct {
     uint32_t     inode_num;
     ext2_inode_t inode;
     uint32_t     offset;
+    int          flags;
+    ext2_alloc_t alloc;
     int          in_use;
 } ext2_fd_t;
 
 static ext2_fd_t ext2_fds[EXT2_MAX_OPEN];
 
 static int ext2_vfs_open(void* fs_data, const char* path, int flags) {
-    (void)flags;
     ext2_state_t* st = (ext2_state_t*)fs_data;
     if (!st) st = &ext2_state;
 
-    uint32_t ino = ext2_resolve_path(st, path);
-    if (ino == 0) return -1;
+    int fd = -1;
+    for (int i = 0; i < EXT2_MAX_OPEN; i++) {
+        if (!ext2_fds[i].in_use) { fd = i; break; }
+    }
+    if (fd < 0) return -1;
 
-    ext2_inode_t inode;
-    if (ext2_read_inode(st, ino, &inode) < 0) return -1;
+    int modify = flags & (VFS_O_CREAT | VFS_O_TRUNC);
+    if (modify) {
+        if (!st->writable) return -1;
+        ext2_lock(st);
+    }
 
-    // Find a free fd
-    for (int i = 0; i < EXT2_MAX_OPEN; i++) {
-        if (!ext2_fds[i].in_use) {
-            ext2_fds[i].inode_num = ino;
-            ext2_fds[i].inode = inode;
-            ext2_fds[i].offset = 0;
-            ext2_fds[i].in_use = 1;
-            return i;
-        }
+    uint32_t ino = ext2_resolve_path(st, path);
+    if (ino == 0 && (flags & VFS_O_CREAT)) ino = ext2_create_node(st, path, VFS_FILE, VFS_PERM_READ | VFS_PERM_WRITE);
+    ext2_inode_t inode;
+    if (ino == 0 || ext2_read_inode(st, ino, &inode) < 0) {
+        if (modify) ext2_unlock(st);
+        return -1;
     }
-    return -1;
+    if ((flags & VFS_O_TRUNC) && (inode.i_mode & 0xF000) == EXT2_S_IFREG && inode.i_size) {
+        ext2_truncate(st, ino, &inode);
+        inode.i_mtime = inode.i_ctime = ext2_now(st);
+        ext2_write_inode(st, ino, &inode);
+        ext2_commit(st);
+    }
+    if (modify) ext2_unlock(st);
+
+    ext2_fds[fd].inode_num = ino;
+    ext2_fds[fd].inode = inode;
+    ext2_fds[fd].offset = 0;
+    ext2_fds[fd].flags = flags;
+    memset(&ext2_fds[fd].alloc, 0, sizeof(ext2_alloc_t));
+    ext2_fds[fd].in_use = 1;
+    return fd;
 }
 
 static int ext2_vfs_close(void* fs_data, int fd) {
-    (void)fs_data;
+    ext2_state_t* st = (ext2_state_t*)fs_data;
+    if (!st) st = &ext2_state;
     if (fd < 0 || fd >= EXT2_MAX_OPEN || !ext2_fds[fd].in_use) return -1;
+
+    // Hand back blocks reserved past the end of the file
+    if (ext2_fds[fd].alloc.prealloc_count) {
+        ext2_lock(st);
+        ext2_discard_prealloc(st, &ext2_fds[fd].alloc);
+        ext2_commit(st);
+        ext2_unlock(st);
+    }
     ext2_fds[fd].in_use = 0;
     return 0;
 }
@@ -410,17 +1688,30 @@ static int ext2_vfs_read(void* fs_data, int fd, void* buf, uint32_t count) {
     if (!st) st = &ext2_state;
     if (fd < 0 || fd >= EXT2_MAX_OPEN || !ext2_fds[fd].in_use) return -1;
 
-    int ret = ext2_read_file(st, &ext2_fds[fd].inode, buf,
+    // Another descriptor may have written the file since
+    if (st->writable) ext2_read_inode(st, ext2_fds[fd].inode_num, &ext2_fds[fd].inode);
+    int ret = ext2_read_file(st, ext2_fds[fd].inode_num, &ext2_fds[fd].inode, buf,
                               ext2_fds[fd].offset, count);
     if (ret > 0) ext2_fds[fd].offset += (uint32_t)ret;
     return ret;
 }
 
 static int ext2_vfs_write(void* fs_data, int fd, const void* buf, uint32_t count) {
-    (void)fs_data; (void)fd; (void)buf; (void)count;
-    // ext2 write support would require bitmap allocation, inode update, etc.
-    // Implement as read-only for now
-    return -1;
+    ext2_state_t* st = (ext2_state_t*)fs_data;
+    if (!st) st = &ext2_state;
+    if (fd < 0 || fd >= EXT2_MAX_OPEN || !ext2_fds[fd].in_use || !st->writable) return -1;
+
+    ext2_fd_t* f = &ext2_fds[fd];
+    ext2_lock(st);
+    int ret = -1;
+    if (ext2_read_inode(st, f->inode_num, &f->inode) == 0 &&
+        (f->inode.i_mode & 0xF000) == EXT2_S_IFREG) {
+        if (f->flags & VFS_O_APPEND) f->offset = f->inode.i_size;
+        ret = ext2_write_file(st, f->inode_num, &f->inode, &f->alloc, buf, f->offset, count);
+        if (ret > 0) f->offset += (uint32_t)ret;
+    }
+    ext2_unlock(st);
+    return ret;
 }
 
 static int ext2_vfs_readdir(void* fs_data, const char* path,
@@ -434,9 +1725,11 @@ static int ext2_vfs_readdir(void* fs_data, const char* path,
     return ext2_read_dir(st, ino, entries, max);
 }
 
+static int ext2_vfs_create(void* fs_data, const char* path, uint8_t type, uint8_t perms);
+
 static int ext2_vfs_mkdir(void* fs_data, const char* path) {
-    (void)fs_data; (void)path;
-    return -1; // Read-only for now
+    return ext2_vfs_create(fs_data, path, VFS_DIRECTORY,
+                           VFS_PERM_READ | VFS_PERM_WRITE | VFS_PERM_EXEC);
 }
 
 static int ext2_vfs_stat(void* fs_data, const char* path, vfs_dirent_t* out) {
@@ -473,13 +1766,32 @@ static int ext2_vfs_stat(void* fs_data, const char* path, vfs_dirent_t* out) {
 }
 
 static int ext2_vfs_create(void* fs_data, const char* path, uint8_t type, uint8_t perms) {
-    (void)fs_data; (void)path; (void)type; (void)perms;
-    return -1; // Read-only
+    ext2_state_t* st = (ext2_state_t*)fs_data;
+    if (!st) st = &ext2_state;
+    if (!st->writable) return -1;
+
+    ext2_lock(st);
+    uint32_t ino = ext2_create_node(st, path, type, perms);
+    ext2_unlock(st);
+    return ino ? 0 : -1;
 }
 
 static int ext2_vfs_delete(void* fs_data, const char* path) {
-    (void)fs_data; (void)path;
-    return -1; // Read-only
+    ext2_state_t* st = (ext2_state_t*)fs_data;
+    if (!st) st = &ext2_state;
+    if (!st->writable) return -1;
+
+    // Not while a descriptor still has it open
+    uint32_t ino = ext2_resolve_path(st, path);
+    if (ino == 0) return -1;
+    for (int i = 0; i < EXT2_MAX_OPEN; i++) {
+        if (ext2_fds[i].in_use && ext2_fds[i].inode_num == ino) return -1;
+    }
+
+    ext2_lock(st);
+    int ret = ext2_delete_node(st, path);
+    ext2_unlock(st);
+    return ret;
 }
 
 static vfs_fs_ops_t ext2_ops = {
@@ -500,8 +1812,9 @@ vfs_fs_ops_t* ext2_get_ops(void) { return &ext2_ops; }
 ext2_state_t* ext2_get_state(void) { return &ext2_state; }
 
 int ext2_init(int blkdev_id) {
-    e2_memset(&ext2_state, 0, sizeof(ext2_state_t));
-    e2_memset(ext2_fds, 0, sizeof(ext2_fds));
+    dcache_forget_fs(&ext2_state);
+    memset(&ext2_state, 0, sizeof(ext2_state_t));
+    memset(ext2_fds, 0, sizeof(ext2_fds));
     ext2_state.block_device = blkdev_id;
 
     // Try to read the superblock
@@ -511,6 +1824,37 @@ int ext2_init(int blkdev_id) {
         return -1;
     }
 
+    // Keep the group descriptors in memory; allocation works on them
+    ext2_state.groups = (ext2_group_t*)kmalloc(ext2_state.group_count * sizeof(ext2_group_t));
+    if (ext2_state.groups) {
+        for (uint32_t g = 0; g < ext2_state.group_count; g++) {
+            ext2_group_desc_t desc;
+            if (ext2_read_group_desc(&ext2_state, g, &desc) < 0) {
+                kfree(ext2_state.groups);
+                ext2_state.groups = (ext2_group_t*)0;
+                break;
+            }
+            memset(&ext2_state.groups[g], 0, sizeof(ext2_group_t));
+            ext2_state.groups[g].desc = desc;
+        }
+    }
+
+    // Mount read-only if the filesystem uses features writes would break
+    const ext2_superblock_t* sb = &ext2_state.sb;
+    ext2_state.writable = ext2_state.groups &&
+        (sb->s_rev_level == 0 ||
+         ((sb->s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_FILETYPE) == 0 &&
+          (sb->s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER |
+                                       EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) == 0));
+    ext2_state.time_base = sb->s_wtime > sb->s_mtime ? sb->s_wtime : sb->s_mtime;
+    waitq_init(&ext2_state.wq);
+
+    // File pages are cached per inode in their own page cache space
+    ext2_state.cache_space = pagecache_register(&ext2_cache_ops, &ext2_state);
+    if (ext2_state.cache_space < 0) {
+        ext2_initialized = 0;
+        return -1;
+    }
     ext2_initialized = 1;
 
     // Auto-mount at /mnt/ext2 if successful
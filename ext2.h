@@ -5,6 +5,7 @@
 
 #include "stdint.h"
 #include "vfs.h"
+#include "waitq.h"
 
 // ---- ext2 On-Disk Structures ----
 
@@ -12,6 +13,16 @@
 #define EXT2_SUPER_OFFSET    1024
 #define EXT2_SUPER_MAGIC     0xEF53
 
+// Features this driver can write with (others mount read-only)
+#define EXT2_FEATURE_INCOMPAT_FILETYPE     0x0002  // file_type in directory entries
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
+#define EXT2_GOOD_OLD_FIRST_INO            11      // First usable inode in revision 0
+#define EXT2_FEATURE_COMPAT_DIR_INDEX      0x0020  // Hashed (htree) directories
+
+#define EXT2_FLAGS_SIGNED_HASH             0x0001  // s_flags: how htree hashes treat chars
+#define EXT2_FLAGS_UNSIGNED_HASH           0x0002
+
 typedef struct {
     uint32_t s_inodes_count;        // Total number of inodes
     uint32_t s_blocks_count;        // Total number of blocks
@@ -58,8 +69,19 @@ typedef struct {
     uint32_t s_journal_inum;
     uint32_t s_journal_dev;
     uint32_t s_last_orphan;
+    // Directory indexing
+    uint32_t s_hash_seed[4];
+    uint8_t  s_def_hash_version;
+    uint8_t  s_reserved_char_pad;
+    uint16_t s_desc_size;
+    uint32_t s_default_mount_opts;
+    uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint8_t  s_reserved_64bit[16];
+    uint32_t s_flags;               // EXT2_FLAGS_*
     // Padding to 1024 bytes
-    uint8_t  s_padding2[788];
+    uint8_t  s_padding2[668];
 } __attribute__((packed)) ext2_superblock_t;
 
 // Block Group Descriptor
@@ -92,7 +114,7 @@ typedef struct {
     uint16_t i_gid;                 // Group ID
     uint16_t i_links_count;         // Hard links count
     uint32_t i_blocks;              // 512-byte blocks count
-    uint32_t i_flags;               // File flags
+    uint32_t i_flags;               // File flags (EXT2_INDEX_FL)
     uint32_t i_osd1;               // OS-dependent
     uint32_t i_block[EXT2_N_BLOCKS]; // Block pointers
     uint32_t i_generation;          // File generation (for NFS)
@@ -102,6 +124,8 @@ typedef struct {
     uint8_t  i_osd2[12];          // OS-dependent
 } __attribute__((packed)) ext2_inode_t;
 
+#define EXT2_INDEX_FL      0x00001000   // Directory is hash-indexed
+
 // Inode types (i_mode upper 4 bits)
 #define EXT2_S_IFSOCK  0xC000
 #define EXT2_S_IFLNK   0xA000
@@ -143,6 +167,30 @@ typedef struct {
 #define EXT2_FT_SOCK      6
 #define EXT2_FT_SYMLINK   7
 
+// Hashed directory index (htree). Block 0 of an indexed directory holds
+// "." and "..", whose record covers the dx_root that follows; interior
+// index blocks look like one empty entry spanning the block. Both carry an
+// array of (hash, block) pairs sorted by hash, the first of which holds
+// the limit/count header in place of its hash.
+#define EXT2_DX_HASH_LEGACY    0
+#define EXT2_DX_HASH_HALF_MD4  1
+#define EXT2_DX_HASH_TEA       2
+#define EXT2_DX_HASH_UNSIGNED  3        // Added to the above for unsigned chars
+#define EXT2_DX_MAX_LEVELS     2        // Root plus one level of index nodes
+
+typedef struct {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;
+    uint8_t  info_length;       // 8
+    uint8_t  indirect_levels;
+    uint8_t  unused_flags;
+} __attribute__((packed)) ext2_dx_root_info_t;
+
+typedef struct {
+    uint32_t hash;              // In entry 0: limit (low 16) and count (high 16)
+    uint32_t block;             // Directory block (file-relative)
+} __attribute__((packed)) ext2_dx_entry_t;
+
 // Well-known inodes
 #define EXT2_ROOT_INO     2     // Root directory inode
 
@@ -150,9 +198,37 @@ typedef struct {
 
 #define EXT2_MAX_OPEN     16    // Max open files on ext2
 #define EXT2_READ_BUF     4096  // Read buffer size
+#define EXT2_PREALLOC_BLOCKS 8  // Blocks reserved ahead of a file being written
+#define EXT2_EXTENT_CACHE 64    // Cached runs of file blocks (all inodes)
+
+// A run of file blocks that lie back to back on disk
+typedef struct {
+    uint32_t inode;             // 0 if the slot is free
+    uint32_t file_block;
+    uint32_t disk_block;
+    uint32_t count;
+    uint32_t last_used;
+} ext2_extent_t;
+
+// In-memory block group: descriptor and (once allocation touches the
+// group) copies of both bitmaps, kept in step with the on-disk ones
+typedef struct {
+    ext2_group_desc_t desc;
+    uint8_t* block_bitmap;      // kmalloc'd, 0 until loaded
+    uint8_t* inode_bitmap;
+    int      dirty;             // desc differs from disk
+} ext2_group_t;
+
+// Allocation state of a file being written
+typedef struct {
+    uint32_t goal;              // Block after the last one allocated
+    uint32_t prealloc_block;    // Run reserved in the bitmap after it
+    uint32_t prealloc_count;
+} ext2_alloc_t;
 
 typedef struct {
     int      block_device;      // blkdev ID
+    int      cache_space;       // Page cache space for file pages (object = inode)
     uint32_t block_size;        // Block size (1024, 2048, or 4096)
     uint32_t inodes_per_group;
     uint32_t blocks_per_group;
@@ -160,6 +236,16 @@ typedef struct {
     uint32_t group_count;
     uint32_t first_data_block;
     ext2_superblock_t sb;       // Cached superblock
+    ext2_group_t* groups;       // group_count entries, 0 if not loaded
+    int      writable;          // Features allow writing, groups loaded
+    int      sb_dirty;
+    uint32_t time_base;         // Timestamp at mount (no wall clock)
+    volatile int busy;          // Serializes modifications
+    waitq_t  wq;
+    ext2_extent_t extents[EXT2_EXTENT_CACHE];
+    uint32_t extent_clock;      // LRU stamp
+    uint32_t extent_gen;        // Bumped when a file loses blocks
+    uint32_t dir_gen;           // Bumped when a directory changes
 } ext2_state_t;
 
 // ---- API ----
@@ -176,9 +262,9 @@ ext2_state_t* ext2_get_state(void);
 // Read an inode from the filesystem
 int ext2_read_inode(ext2_state_t* state, uint32_t inode_num, ext2_inode_t* inode);
 
-// Read data from a file inode (returns bytes read)
-int ext2_read_file(ext2_state_t* state, ext2_inode_t* inode, void* buf,
-                   uint32_t offset, uint32_t count);
+// Read data from a file inode through the page cache (returns bytes read)
+int ext2_read_file(ext2_state_t* state, uint32_t inode_num, ext2_inode_t* inode,
+                   void* buf, uint32_t offset, uint32_t count);
 
 // List directory entries
 int ext2_read_dir(ext2_state_t* state, uint32_t dir_inode,
@@ -190,4 +276,9 @@ uint32_t ext2_lookup(ext2_state_t* state, uint32_t dir_inode, const char* name);
 // Resolve a full path to an inode number
 uint32_t ext2_resolve_path(ext2_state_t* state, const char* path);
 
+// Write data to a file inode through the page cache, allocating blocks as
+// needed (returns bytes written, or -1)
+int ext2_write_file(ext2_state_t* state, uint32_t inode_num, ext2_inode_t* inode,
+                    ext2_alloc_t* alloc, const void* buf, uint32_t offset, uint32_t count);
+
 #endif
@@ -1,18 +1,11 @@
 // fat32.c - FAT32 File System for Alteo OS
-// Provides FAT32 filesystem support on top of ATA driver
+// Provides FAT32 filesystem support on top of the block device layer
 #include "fat32.h"
-#include "ata.h"
+#include "klib.h"
+#include "blkdev.h"
+#include "pagecache.h"
 
 // String helpers
-static void fat_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
-}
-static void fat_memcpy(void* dst, const void* src, int n) {
-    unsigned char* d = (unsigned char*)dst;
-    const unsigned char* s = (const unsigned char*)src;
-    for (int i = 0; i < n; i++) d[i] = s[i];
-}
 static int fat_strcmp(const char* a, const char* b) {
     while (*a && *a == *b) { a++; b++; }
     return *(unsigned char*)a - *(unsigned char*)b;
@@ -28,25 +21,229 @@ static void fat_strncpy(char* d, const char* s, int n) {
 static fat32_fs_t fs;
 static uint8_t sector_buf[FAT32_SECTOR_SIZE];
 
+// A pinned device cache block of the FAT
+typedef struct {
+    uint32_t lba;               // First sector of the block
+    pagecache_page_t* page;     // 0 if the window is unused
+    uint8_t* data;
+    uint32_t last_used;
+} fat32_window_t;
+
+// Clusters [cluster, cluster + count) hold clusters [index, index + count)
+// of the file whose chain starts at first
+typedef struct {
+    uint32_t first;             // 0 if the slot is free
+    uint32_t index;
+    uint32_t cluster;
+    uint32_t count;
+    uint32_t last_used;
+} fat32_run_t;
+
+// Where a directory entry lives
+typedef struct {
+    fat32_dir_entry_t entry;
+    uint32_t lba;               // Sector holding it
+    int      index;             // Entry within the sector
+} fat32_loc_t;
+
+static fat32_window_t windows[FAT32_FAT_WINDOWS];
+static fat32_run_t runs[FAT32_RUN_CACHE];
+static uint32_t cache_clock = 0;
+
 // Convert cluster number to LBA
 static uint32_t cluster_to_lba(uint32_t cluster) {
     return fs.data_start_lba + (cluster - 2) * fs.sectors_per_cluster;
 }
 
+static int cluster_valid(uint32_t cluster) {
+    return cluster >= 2 && cluster < fs.total_clusters + 2;
+}
+
+static uint32_t entry_cluster(const fat32_dir_entry_t* e) {
+    return ((uint32_t)e->first_cluster_hi << 16) | e->first_cluster_lo;
+}
+
+// ---- FAT Access ----
+
+// The FAT entry of cluster in copy fat, inside a pinned window (0 on
+// error). *win receives the window.
+static uint32_t* fat32_fat_slot(uint32_t fat, uint32_t cluster, fat32_window_t** win) {
+    uint32_t byte = cluster * 4;
+    uint32_t lba = fs.fat_start_lba + fat * fs.fat_size + byte / FAT32_SECTOR_SIZE;
+    uint32_t base = lba - lba % BLKDEV_SECTORS_PER_BLOCK;
+
+    fat32_window_t* w = (fat32_window_t*)0;
+    for (int i = 0; i < FAT32_FAT_WINDOWS && !w; i++) {
+        if (windows[i].page && windows[i].lba == base) w = &windows[i];
+    }
+    if (!w) {
+        // Recycle an unused or the least recently used window
+        w = &windows[0];
+        for (int i = 0; i < FAT32_FAT_WINDOWS; i++) {
+            if (!windows[i].page) { w = &windows[i]; break; }
+            if (windows[i].last_used < w->last_used) w = &windows[i];
+        }
+        if (w->page) blkdev_unmap(w->page);
+        w->data = blkdev_map_rw(fs.blkdev, base, &w->page);
+        if (!w->data) {
+            w->page = (pagecache_page_t*)0;
+            return (uint32_t*)0;
+        }
+        w->lba = base;
+    }
+    w->last_used = ++cache_clock;
+    *win = w;
+    return (uint32_t*)(w->data + (lba - base) * FAT32_SECTOR_SIZE + byte % FAT32_SECTOR_SIZE);
+}
+
 // Read a single entry from the FAT
 static uint32_t fat32_read_fat_entry(uint32_t cluster) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fs.fat_start_lba + (fat_offset / FAT32_SECTOR_SIZE);
-    uint32_t entry_offset = fat_offset % FAT32_SECTOR_SIZE;
+    fat32_window_t* w;
+    uint32_t* slot = fat32_fat_slot(0, cluster, &w);
+    if (!slot) return FAT32_CLUSTER_BAD;
+    return *slot & 0x0FFFFFFF;
+}
+
+// Set an entry in every copy of the FAT (the top 4 bits are reserved)
+static int fat32_write_fat_entry(uint32_t cluster, uint32_t value) {
+    for (uint32_t f = 0; f < fs.num_fats; f++) {
+        fat32_window_t* w;
+        uint32_t* slot = fat32_fat_slot(f, cluster, &w);
+        if (!slot) return -1;
+        *slot = (*slot & 0xF0000000) | (value & 0x0FFFFFFF);
+        pagecache_mark_dirty(w->page);
+    }
+    return 0;
+}
+
+// A free cluster, searching from goal. Returns 0 if the disk is full.
+static uint32_t fat32_alloc_cluster(uint32_t goal) {
+    if (!cluster_valid(goal)) goal = fs.next_free;
+    if (!cluster_valid(goal)) goal = 2;
+    for (uint32_t n = 0; n < fs.total_clusters; n++) {
+        uint32_t c = 2 + (goal - 2 + n) % fs.total_clusters;
+        if (fat32_read_fat_entry(c) != FAT32_CLUSTER_FREE) continue;
+        if (fat32_write_fat_entry(c, FAT32_CLUSTER_LAST) < 0) return 0;
+        fs.next_free = c + 1;
+        return c;
+    }
+    return 0;
+}
+
+static void fat32_free_chain(uint32_t cluster) {
+    for (uint32_t n = 0; cluster_valid(cluster) && n < fs.total_clusters; n++) {
+        uint32_t next = fat32_read_fat_entry(cluster);
+        fat32_write_fat_entry(cluster, FAT32_CLUSTER_FREE);
+        cluster = next;
+    }
+}
+
+// ---- Cluster Runs ----
+
+static void fat32_run_add(uint32_t first, uint32_t index, uint32_t cluster, uint32_t count) {
+    fat32_run_t* victim = (fat32_run_t*)0;
+    for (int i = 0; i < FAT32_RUN_CACHE; i++) {
+        fat32_run_t* r = &runs[i];
+        if (r->first == first && r->index + r->count == index && r->cluster + r->count == cluster) {
+            r->count += count;      // Continues a run cached earlier
+            r->last_used = ++cache_clock;
+            return;
+        }
+        // Prefer a free slot, else the least recently used
+        if (!victim || (victim->first && (!r->first || r->last_used < victim->last_used))) victim = r;
+    }
+    victim->first = first;
+    victim->index = index;
+    victim->cluster = cluster;
+    victim->count = count;
+    victim->last_used = ++cache_clock;
+}
+
+// Drop the runs of a chain that is about to change
+static void fat32_run_forget(uint32_t first) {
+    for (int i = 0; i < FAT32_RUN_CACHE; i++) {
+        if (runs[i].first == first) runs[i].first = 0;
+    }
+}
+
+// Disk cluster of cluster k of the chain starting at first (0 past its
+// end), with the number of clusters from it on that follow back to back
+// in *run. The chain is followed from the nearest cached run before k and
+// only as far as want clusters past k.
+static uint32_t fat32_map(uint32_t first, uint32_t k, uint32_t want, uint32_t* run) {
+    fat32_run_t* best = (fat32_run_t*)0;
+    for (int i = 0; i < FAT32_RUN_CACHE; i++) {
+        fat32_run_t* r = &runs[i];
+        if (r->first != first) continue;
+        if (k >= r->index && k - r->index < r->count) {
+            r->last_used = ++cache_clock;
+            *run = r->count - (k - r->index);
+            return r->cluster + (k - r->index);
+        }
+        if (r->index + r->count <= k && (!best || r->index > best->index)) best = r;
+    }
+
+    uint32_t index = 0, cluster = first;
+    if (best) {
+        index = best->index + best->count;
+        cluster = fat32_read_fat_entry(best->cluster + best->count - 1);
+    }
+    *run = 0;
+    if (want == 0) want = 1;
+    for (uint32_t steps = 0; cluster_valid(cluster) && steps < fs.total_clusters; ) {
+        uint32_t count = 1;
+        uint32_t next = fat32_read_fat_entry(cluster);
+        while (next == cluster + count && !(k < index + count && index + count - k >= want)) {
+            count++;
+            next = fat32_read_fat_entry(cluster + count - 1);
+        }
+        fat32_run_add(first, index, cluster, count);
+        if (k < index + count) {
+            *run = index + count - k;
+            return cluster + (k - index);
+        }
+        steps += count;
+        index += count;
+        cluster = next;
+    }
+    return 0;
+}
 
-    if (ata_read_sectors(fs.drive, fat_sector, 1, sector_buf) < 0) {
-        return FAT32_CLUSTER_BAD;
+// Make the chain starting at *first exactly n clusters long, growing it
+// with free clusters placed right after its end where possible. Returns
+// 0, or -1 if the disk filled up (the chain then holds what was had).
+static int fat32_resize_chain(uint32_t* first, uint32_t n) {
+    fat32_run_forget(*first);
+    if (n == 0) {
+        fat32_free_chain(*first);
+        *first = 0;
+        return 0;
     }
 
-    uint32_t val = *(uint32_t*)(sector_buf + entry_offset);
-    return val & 0x0FFFFFFF;
+    uint32_t prev = 0, cur = *first, count = 0;
+    while (cluster_valid(cur) && count < n) {
+        uint32_t next = fat32_read_fat_entry(cur);
+        prev = cur;
+        count++;
+        if (count == n) {
+            if (cluster_valid(next)) fat32_free_chain(next);
+            if (next != FAT32_CLUSTER_LAST) fat32_write_fat_entry(cur, FAT32_CLUSTER_LAST);
+            return 0;
+        }
+        cur = next;
+    }
+    for (; count < n; count++) {
+        uint32_t c = fat32_alloc_cluster(prev ? prev + 1 : fs.next_free);
+        if (!c) return -1;
+        if (prev) fat32_write_fat_entry(prev, c);
+        else *first = c;
+        prev = c;
+    }
+    return 0;
 }
 
+// ---- Directories ----
+
 // Convert 8.3 name from directory entry to readable string
 static void fat32_decode_name(const fat32_dir_entry_t* entry, char* out) {
     int i, j = 0;
@@ -74,7 +271,7 @@ static void fat32_decode_name(const fat32_dir_entry_t* entry, char* out) {
 
 // Encode a filename to 8.3 format
 static void fat32_encode_name(const char* name, char* out) {
-    fat_memset(out, ' ', 11);
+    memset(out, ' ', 11);
 
     int i = 0, j = 0;
     // Find the dot
@@ -103,13 +300,160 @@ static void fat32_encode_name(const char* name, char* out) {
     }
 }
 
+// Find the entry called name83 in a directory, or with name83 = 0 its
+// first free slot (growing the directory by a cluster if it is full).
+// Returns 0 with *loc filled, or -1.
+static int fat32_dir_search(uint32_t dir_cluster, const char* name83, fat32_loc_t* loc) {
+    uint32_t cluster = dir_cluster, prev = 0;
+    for (uint32_t n = 0; cluster_valid(cluster) && n < fs.total_clusters; n++) {
+        uint32_t lba = cluster_to_lba(cluster);
+        for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+            pagecache_page_t* page;
+            const uint8_t* data = blkdev_map(fs.blkdev, lba + s, &page);
+            if (!data) return -1;
+            const fat32_dir_entry_t* dir = (const fat32_dir_entry_t*)data;
+            for (int i = 0; i < FAT32_ENTRIES_PER_SEC; i++) {
+                uint8_t first = (uint8_t)dir[i].name[0];
+                int match;
+                if (!name83) {
+                    match = first == 0x00 || first == 0xE5;
+                } else {
+                    if (first == 0x00) { blkdev_unmap(page); return -1; }   // End of directory
+                    match = first != 0xE5 && dir[i].attr != FAT32_ATTR_LONG_NAME &&
+                            !(dir[i].attr & FAT32_ATTR_VOLUME_ID) &&
+                            memcmp(dir[i].name, name83, FAT32_MAX_FILENAME) == 0;
+                }
+                if (match) {
+                    loc->entry = dir[i];
+                    loc->lba = lba + s;
+                    loc->index = i;
+                    blkdev_unmap(page);
+                    return 0;
+                }
+            }
+            blkdev_unmap(page);
+        }
+        prev = cluster;
+        cluster = fat32_read_fat_entry(cluster);
+    }
+    if (name83 || !prev) return -1;
+
+    // Directory full: chain on a zeroed cluster
+    uint32_t c = fat32_alloc_cluster(prev + 1);
+    if (!c) return -1;
+    fat32_write_fat_entry(prev, c);
+    memset(sector_buf, 0, FAT32_SECTOR_SIZE);
+    for (uint32_t s = 0; s < fs.sectors_per_cluster; s++) {
+        if (blkdev_write(fs.blkdev, cluster_to_lba(c) + s, 1, sector_buf) < 0) return -1;
+    }
+    memset(&loc->entry, 0, sizeof(loc->entry));
+    loc->lba = cluster_to_lba(c);
+    loc->index = 0;
+    return 0;
+}
+
+// Write a changed entry back in place
+static int fat32_dir_update(const fat32_loc_t* loc) {
+    pagecache_page_t* page;
+    uint8_t* data = blkdev_map_rw(fs.blkdev, loc->lba, &page);
+    if (!data) return -1;
+    memcpy(data + loc->index * sizeof(fat32_dir_entry_t), &loc->entry, sizeof(fat32_dir_entry_t));
+    blkdev_unmap_dirty(page);
+    return 0;
+}
+
+// Resolve a path to its directory entry. The root, which has none, comes
+// back as a directory entry naming root_cluster (with lba 0).
+static int fat32_lookup(const char* path, fat32_loc_t* loc) {
+    memset(loc, 0, sizeof(*loc));
+    loc->entry.attr = FAT32_ATTR_DIRECTORY;
+    loc->entry.first_cluster_hi = (uint16_t)(fs.root_cluster >> 16);
+    loc->entry.first_cluster_lo = (uint16_t)fs.root_cluster;
+    if (!path) return -1;
+
+    const char* p = path;
+    char component[FAT32_LONG_NAME + 1];
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        int ci = 0;
+        while (*p && *p != '/') {
+            if (ci < FAT32_LONG_NAME) component[ci++] = *p;
+            p++;
+        }
+        component[ci] = 0;
+        if (fat_strcmp(component, ".") == 0) continue;
+        if (!(loc->entry.attr & FAT32_ATTR_DIRECTORY)) return -1;
+
+        char name83[FAT32_MAX_FILENAME];
+        if (fat_strcmp(component, "..") == 0) memcpy(name83, "..         ", FAT32_MAX_FILENAME);
+        else fat32_encode_name(component, name83);
+        uint32_t dir = entry_cluster(&loc->entry);
+        if (fat32_dir_search(dir ? dir : fs.root_cluster, name83, loc) < 0) return -1;
+    }
+    return 0;
+}
+
+// Split a path at its last component
+static int fat32_split_path(const char* path, char* parent, char* name) {
+    int len = fat_strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    int slash = len - 1;
+    while (slash >= 0 && path[slash] != '/') slash--;
+    int name_len = len - slash - 1;
+    if (name_len <= 0 || name_len > FAT32_LONG_NAME || slash + 2 > FAT32_LONG_NAME) return -1;
+    memcpy(name, path + slash + 1, name_len);
+    name[name_len] = 0;
+    if (slash < 0) slash = 0;
+    memcpy(parent, path, slash);
+    parent[slash] = 0;
+    return 0;
+}
+
+// Add an empty file entry. Returns 0 with *loc filled, or -1.
+static int fat32_new_entry(const char* path, uint8_t attr, fat32_loc_t* loc) {
+    char parent[FAT32_LONG_NAME + 1];
+    char name[FAT32_LONG_NAME + 1];
+    if (fat32_split_path(path, parent, name) < 0) return -1;
+    if (fat_strcmp(name, ".") == 0 || fat_strcmp(name, "..") == 0) return -1;
+
+    fat32_loc_t dir;
+    if (fat32_lookup(parent, &dir) < 0 || !(dir.entry.attr & FAT32_ATTR_DIRECTORY)) return -1;
+    uint32_t dir_cluster = entry_cluster(&dir.entry);
+    if (!dir_cluster) dir_cluster = fs.root_cluster;
+
+    char name83[FAT32_MAX_FILENAME];
+    fat32_encode_name(name, name83);
+    if (fat32_dir_search(dir_cluster, name83, loc) == 0) return -1;   // Exists
+    if (fat32_dir_search(dir_cluster, 0, loc) < 0) return -1;
+
+    memset(&loc->entry, 0, sizeof(loc->entry));
+    memcpy(loc->entry.name, name83, FAT32_MAX_FILENAME);
+    loc->entry.attr = attr;
+    loc->entry.create_date = loc->entry.write_date = loc->entry.access_date = 0x0021;   // 1980-01-01 (no clock)
+    return fat32_dir_update(loc);
+}
+
+// ---- Public API ----
+
 int fat32_init(int drive) {
-    fat_memset(&fs, 0, sizeof(fs));
+    for (int i = 0; i < FAT32_FAT_WINDOWS; i++) {
+        if (windows[i].page) blkdev_unmap(windows[i].page);
+    }
+    memset(windows, 0, sizeof(windows));
+    memset(runs, 0, sizeof(runs));
+    memset(&fs, 0, sizeof(fs));
     fs.drive = drive;
     fs.mounted = 0;
 
+    // Sectors go through the block layer (and its cache) as "ataN"
+    char name[8] = "ata0";
+    name[3] = (char)('0' + drive);
+    fs.blkdev = blkdev_find(name);
+    if (fs.blkdev < 0) return -1;
+
     // Read boot sector
-    if (ata_read_sectors(drive, 0, 1, sector_buf) < 0) {
+    if (blkdev_read(fs.blkdev, 0, 1, sector_buf) < 0) {
         return -1;
     }
 
@@ -127,6 +471,8 @@ int fat32_init(int drive) {
     fs.data_start_lba = bpb->reserved_sectors + (bpb->num_fats * bpb->fat_size_32);
     fs.root_cluster = bpb->root_cluster;
     fs.bytes_per_cluster = fs.sectors_per_cluster * FAT32_SECTOR_SIZE;
+    fs.num_fats = bpb->num_fats;
+    fs.next_free = 2;
 
     uint32_t data_sectors = bpb->total_sectors_32 - fs.data_start_lba;
     fs.total_clusters = data_sectors / fs.sectors_per_cluster;
@@ -141,31 +487,98 @@ int fat32_is_mounted(void) {
 
 int fat32_read_file(const char* path, void* buf, uint32_t max_size) {
     if (!fs.mounted) return -1;
-    (void)path; (void)buf; (void)max_size;
-    // TODO: Traverse directory tree to find file, then read cluster chain
-    return -1;
+    fat32_loc_t loc;
+    if (fat32_lookup(path, &loc) < 0 || (loc.entry.attr & FAT32_ATTR_DIRECTORY)) return -1;
+
+    uint32_t size = loc.entry.file_size < max_size ? loc.entry.file_size : max_size;
+    uint32_t first = entry_cluster(&loc.entry);
+    uint8_t* dst = (uint8_t*)buf;
+    uint32_t done = 0, k = 0;
+
+    // One device read per run of contiguous clusters
+    while (done < size) {
+        uint32_t left = (size - done + fs.bytes_per_cluster - 1) / fs.bytes_per_cluster;
+        uint32_t run;
+        uint32_t cluster = fat32_map(first, k, left, &run);
+        if (!cluster) break;    // Chain shorter than the size says
+        if (run > left) run = left;
+
+        uint32_t bytes = run * fs.bytes_per_cluster;
+        if (bytes > size - done) bytes = size - done;
+        uint32_t lba = cluster_to_lba(cluster);
+        uint32_t full = bytes / FAT32_SECTOR_SIZE;
+        if (full && blkdev_read_direct(fs.blkdev, lba, full, dst + done) < 0) return -1;
+        if (bytes % FAT32_SECTOR_SIZE) {
+            if (blkdev_read_direct(fs.blkdev, lba + full, 1, sector_buf) < 0) return -1;
+            memcpy(dst + done + full * FAT32_SECTOR_SIZE, sector_buf, bytes % FAT32_SECTOR_SIZE);
+        }
+        done += bytes;
+        k += run;
+    }
+    return (int)done;
 }
 
 int fat32_write_file(const char* path, const void* buf, uint32_t size) {
     if (!fs.mounted) return -1;
-    (void)path; (void)buf; (void)size;
-    // TODO: Find or create file entry, allocate clusters, write data
-    return -1;
+    fat32_loc_t loc;
+    if (fat32_lookup(path, &loc) < 0 && fat32_new_entry(path, FAT32_ATTR_ARCHIVE, &loc) < 0) return -1;
+    if ((loc.entry.attr & FAT32_ATTR_DIRECTORY) || loc.lba == 0) return -1;
+
+    // Size the chain first, so the data goes out in the runs it ends up in
+    uint32_t first = entry_cluster(&loc.entry);
+    uint32_t clusters = (size + fs.bytes_per_cluster - 1) / fs.bytes_per_cluster;
+    int result = fat32_resize_chain(&first, clusters);
+
+    const uint8_t* src = (const uint8_t*)buf;
+    uint32_t done = 0, k = 0;
+    while (result == 0 && done < size) {
+        uint32_t left = (size - done + fs.bytes_per_cluster - 1) / fs.bytes_per_cluster;
+        uint32_t run;
+        uint32_t cluster = fat32_map(first, k, left, &run);
+        if (!cluster) { result = -1; break; }
+        if (run > left) run = left;
+
+        uint32_t bytes = run * fs.bytes_per_cluster;
+        if (bytes > size - done) bytes = size - done;
+        uint32_t lba = cluster_to_lba(cluster);
+        uint32_t full = bytes / FAT32_SECTOR_SIZE;
+        if (full && blkdev_write_direct(fs.blkdev, lba, full, src + done) < 0) { result = -1; break; }
+        if (bytes % FAT32_SECTOR_SIZE) {
+            memset(sector_buf, 0, FAT32_SECTOR_SIZE);
+            memcpy(sector_buf, src + done + full * FAT32_SECTOR_SIZE, bytes % FAT32_SECTOR_SIZE);
+            if (blkdev_write_direct(fs.blkdev, lba + full, 1, sector_buf) < 0) { result = -1; break; }
+        }
+        done += bytes;
+        k += run;
+    }
+
+    // A failed write leaves an empty file rather than stale contents
+    if (result < 0) {
+        fat32_resize_chain(&first, 0);
+        size = 0;
+    }
+    loc.entry.first_cluster_hi = (uint16_t)(first >> 16);
+    loc.entry.first_cluster_lo = (uint16_t)first;
+    loc.entry.file_size = size;
+    loc.entry.attr |= FAT32_ATTR_ARCHIVE;
+    if (fat32_dir_update(&loc) < 0) result = -1;
+    return result < 0 ? -1 : (int)size;
 }
 
 int fat32_list_dir(const char* path, fat32_dir_entry_t* entries, int max) {
     if (!fs.mounted) return -1;
-    (void)path;
 
-    // For now, list root directory
-    uint32_t cluster = fs.root_cluster;
+    fat32_loc_t loc;
+    if (fat32_lookup(path, &loc) < 0 || !(loc.entry.attr & FAT32_ATTR_DIRECTORY)) return -1;
+    uint32_t cluster = entry_cluster(&loc.entry);
+    if (!cluster) cluster = fs.root_cluster;
     int count = 0;
 
-    while (cluster < FAT32_CLUSTER_EOF && count < max) {
+    while (cluster_valid(cluster) && count < max) {
         uint32_t lba = cluster_to_lba(cluster);
 
         for (uint32_t s = 0; s < fs.sectors_per_cluster && count < max; s++) {
-            if (ata_read_sectors(fs.drive, lba + s, 1, sector_buf) < 0) {
+            if (blkdev_read(fs.blkdev, lba + s, 1, sector_buf) < 0) {
                 return count;
             }
 
@@ -176,7 +589,7 @@ int fat32_list_dir(const char* path, fat32_dir_entry_t* entries, int max) {
                 if (dir[i].attr == FAT32_ATTR_LONG_NAME) continue; // LFN
                 if (dir[i].attr & FAT32_ATTR_VOLUME_ID) continue;
 
-                fat_memcpy(&entries[count], &dir[i], sizeof(fat32_dir_entry_t));
+                memcpy(&entries[count], &dir[i], sizeof(fat32_dir_entry_t));
                 count++;
             }
         }
@@ -189,9 +602,8 @@ int fat32_list_dir(const char* path, fat32_dir_entry_t* entries, int max) {
 
 int fat32_create_file(const char* path) {
     if (!fs.mounted) return -1;
-    (void)path;
-    // TODO: Implement file creation
-    return -1;
+    fat32_loc_t loc;
+    return fat32_new_entry(path, FAT32_ATTR_ARCHIVE, &loc);
 }
 
 int fat32_mkdir(const char* path) {
@@ -1,4 +1,8 @@
 // fat32.h - FAT32 File System for Alteo OS
+// Files are read and written a run of contiguous clusters at a time, one
+// device request per run. The FAT is accessed through a few device cache
+// blocks kept pinned, and the cluster runs found while following a
+// file's chain are cached, so a file's chain is walked once.
 #ifndef FAT32_H
 #define FAT32_H
 
@@ -23,6 +27,11 @@
 #define FAT32_CLUSTER_FREE    0x00000000
 #define FAT32_CLUSTER_BAD     0x0FFFFFF7
 #define FAT32_CLUSTER_EOF     0x0FFFFFF8
+#define FAT32_CLUSTER_LAST    0x0FFFFFFF     // Written to end a chain
+
+// Cache sizes
+#define FAT32_FAT_WINDOWS     8      // FAT blocks (4KB = 1024 entries each) kept pinned
+#define FAT32_RUN_CACHE       32     // Cached cluster runs, all files
 
 // Boot sector / BPB
 typedef struct {
@@ -75,6 +84,7 @@ typedef struct {
 // FAT32 filesystem info
 typedef struct {
     int drive;                     // ATA drive index
+    int blkdev;                    // Block device ID of that drive
     uint32_t fat_start_lba;        // LBA of first FAT
     uint32_t data_start_lba;       // LBA of data region
     uint32_t root_cluster;         // Root directory cluster
@@ -82,6 +92,8 @@ typedef struct {
     uint32_t fat_size;             // FAT size in sectors
     uint32_t total_clusters;
     uint32_t bytes_per_cluster;
+    uint32_t num_fats;             // FAT copies kept in step
+    uint32_t next_free;            // Where the free cluster search resumes
     int mounted;                   // Is filesystem mounted?
 } fat32_fs_t;
 
@@ -91,16 +103,16 @@ int fat32_init(int drive);
 // Check if FAT32 is mounted
 int fat32_is_mounted(void);
 
-// Read a file's contents
+// Read up to max_size bytes of a file. Returns the bytes read, or -1.
 int fat32_read_file(const char* path, void* buf, uint32_t max_size);
 
-// Write to a file
+// Replace a file's contents (creating it if missing). Returns size, or -1.
 int fat32_write_file(const char* path, const void* buf, uint32_t size);
 
 // List directory contents
 int fat32_list_dir(const char* path, fat32_dir_entry_t* entries, int max);
 
-// Create a file
+// Create an empty file
 int fat32_create_file(const char* path);
 
 // Create a directory
@@ -1,6 +1,7 @@
 // font.c - Alteo OS 8x16 Bitmap Font (clean, readable)
 #include "font.h"
 #include "graphics.h"
+#include "klib.h"
 
 // 8x16 Font Bitmap Data (ASCII 32-127)
 // Each character = 16 bytes, each byte = one row of 8 pixels (MSB first)
@@ -103,25 +104,191 @@ static const uint8_t font_data[96][16] = {
     {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // DEL
 };
 
+// ============================================================
+// Glyph Atlas
+// ============================================================
+
+// Every glyph pre-expanded to one 32-bit mask per pixel (all ones where
+// there is ink), so a row is drawn with AND/OR rather than bit tests, plus
+// the inked column range of each row so blank columns are never touched
+static uint32_t glyph_mask[96][16][8];
+static uint8_t glyph_ink[96][16][2];    // [first, last) column; equal if blank
+static int atlas_ready = 0;
+
+static void atlas_build(void) {
+    for (int g = 0; g < 96; g++) {
+        for (int row = 0; row < 16; row++) {
+            uint8_t bits = font_data[g][row];
+            int first = 8, last = 0;
+            for (int col = 0; col < 8; col++) {
+                int on = (bits >> (7 - col)) & 1;
+                glyph_mask[g][row][col] = on ? 0xFFFFFFFF : 0;
+                if (on) {
+                    if (col < first) first = col;
+                    last = col + 1;
+                }
+            }
+            if (first > last) first = last = 0;
+            glyph_ink[g][row][0] = (uint8_t)first;
+            glyph_ink[g][row][1] = (uint8_t)last;
+        }
+    }
+    atlas_ready = 1;
+}
+
+static inline int glyph_index(char c) {
+    unsigned char u = (unsigned char)c;
+    if (u < 32 || u > 127) u = '?';
+    return u - 32;
+}
+
+const uint8_t* font_glyph(char c) {
+    return font_data[glyph_index(c)];
+}
+
+// ============================================================
+// Span Blits
+// ============================================================
+
+// One line of len glyphs at (x, y) on a w x h surface. The line is clipped
+// once: rows for all glyphs together, columns only for the glyphs that
+// straddle the left or right edge.
+static void text_line(uint32_t* surf, int pitch, int w, int h, int x, int y,
+                      const char* s, int len, uint32_t color) {
+    int r0 = y < 0 ? -y : 0;
+    int r1 = y + 16 > h ? h - y : 16;
+    if (r0 >= r1 || x >= w || x + len * 8 <= 0) return;
+    if (!atlas_ready) atlas_build();
+
+    int i0 = x < 0 ? -x / 8 : 0;
+    int i1 = (w - x + 7) / 8;
+    if (i1 > len) i1 = len;
+
+    for (int i = i0; i < i1; i++) {
+        int gx = x + i * 8;
+        int c0 = gx < 0 ? -gx : 0;
+        int c1 = gx + 8 > w ? w - gx : 8;
+        int g = glyph_index(s[i]);
+        for (int row = r0; row < r1; row++) {
+            int a = glyph_ink[g][row][0], b = glyph_ink[g][row][1];
+            if (a < c0) a = c0;
+            if (b > c1) b = c1;
+            const uint32_t* m = glyph_mask[g][row];
+            uint32_t* d = surf + (long)(y + row) * pitch + gx;
+            for (int col = a; col < b; col++)
+                d[col] = (d[col] & ~m[col]) | (color & m[col]);
+        }
+    }
+}
+
+void font_draw_text(uint32_t* surf, int pitch, int w, int h, int x, int y,
+                    const char* str, int len, uint32_t color) {
+    int start = 0;
+    for (int i = 0; i <= len; i++) {
+        if (i == len || str[i] == '\n') {
+            text_line(surf, pitch, w, h, x, y, str + start, i - start, color);
+            y += 18;
+            start = i + 1;
+        }
+    }
+}
+
 void draw_char(int x, int y, char c, uint32_t color) {
-    if ((unsigned char)c < 32 || (unsigned char)c > 127) c = '?';
-    const uint8_t* glyph = font_data[c - 32];
+    int w = get_screen_width(), h = get_screen_height();
+    text_line(get_backbuf(), w, w, h, x, y, &c, 1, color);
+}
+
+void draw_string(int x, int y, const char* str, uint32_t color) {
+    int len = 0;
+    while (str[len]) len++;
+    int w = get_screen_width(), h = get_screen_height();
+    font_draw_text(get_backbuf(), w, w, h, x, y, str, len, color);
+}
+
+// ============================================================
+// Rendered String Cache
+// ============================================================
+
+// A cached string is its ink as horizontal runs, row by row, with runs
+// that continue across glyph boundaries merged. Drawing one is a handful
+// of solid fills per row, with no mask reads at all.
+typedef struct {
+    char     text[FONT_CACHE_CHARS];
+    uint32_t stamp;                      // Last use; 0 = free
+    uint16_t row_start[17];              // Runs of row r: [row_start[r], row_start[r + 1])
+    uint16_t run_x[FONT_CACHE_RUNS];
+    uint16_t run_len[FONT_CACHE_RUNS];
+} text_entry_t;
+
+static text_entry_t text_cache[FONT_CACHE_ENTRIES];
+static uint32_t text_clock = 0;
+
+// Render str (single line, shorter than FONT_CACHE_CHARS) into e. Returns
+// 0 if it has more runs than an entry holds.
+static int text_render(text_entry_t* e, const char* str, int len) {
+    int n = 0;
     for (int row = 0; row < 16; row++) {
-        uint8_t bits = glyph[row];
-        if (bits == 0) continue;
-        for (int col = 0; col < 8; col++) {
-            if (bits & (1 << (7 - col)))
-                put_pixel(x + col, y + row, color);
+        e->row_start[row] = (uint16_t)n;
+        int open = 0;                    // A run is still growing at px
+        for (int i = 0; i < len; i++) {
+            uint8_t bits = font_glyph(str[i])[row];
+            for (int col = 0; col < 8; col++) {
+                if (bits & (0x80 >> col)) {
+                    if (!open) {
+                        if (n == FONT_CACHE_RUNS) return 0;
+                        e->run_x[n] = (uint16_t)(i * 8 + col);
+                        e->run_len[n++] = 0;
+                        open = 1;
+                    }
+                    e->run_len[n - 1]++;
+                } else {
+                    open = 0;
+                }
+            }
         }
     }
+    e->row_start[16] = (uint16_t)n;
+    memcpy(e->text, str, (size_t)len);
+    e->text[len] = 0;
+    return 1;
 }
 
-void draw_string(int x, int y, const char* str, uint32_t color) {
-    int cx = x;
-    while (*str) {
-        if (*str == '\n') { y += 18; cx = x; str++; continue; }
-        draw_char(cx, y, *str, color);
-        cx += 8;
-        str++;
+static text_entry_t* text_lookup(const char* str, int len) {
+    text_entry_t* victim = &text_cache[0];
+    for (int i = 0; i < FONT_CACHE_ENTRIES; i++) {
+        text_entry_t* e = &text_cache[i];
+        if (e->stamp && memcmp(e->text, str, (size_t)len + 1) == 0) {
+            e->stamp = ++text_clock;
+            return e;
+        }
+        if (e->stamp < victim->stamp) victim = e;
+    }
+    victim->stamp = 0;
+    if (!text_render(victim, str, len)) return 0;
+    victim->stamp = ++text_clock;
+    return victim;
+}
+
+void draw_string_cached(int x, int y, const char* str, uint32_t color) {
+    int len = 0;
+    while (str[len] && str[len] != '\n') len++;
+    text_entry_t* e = (!str[len] && len < FONT_CACHE_CHARS) ? text_lookup(str, len) : 0;
+    if (!e) {
+        draw_string(x, y, str, color);
+        return;
+    }
+
+    uint32_t* buf = get_backbuf();
+    int w = get_screen_width(), h = get_screen_height();
+    int r0 = y < 0 ? -y : 0;
+    int r1 = y + 16 > h ? h - y : 16;
+    for (int row = r0; row < r1; row++) {
+        uint32_t* d = buf + (long)(y + row) * w;
+        for (int k = e->row_start[row]; k < e->row_start[row + 1]; k++) {
+            int a = x + e->run_x[k], b = a + e->run_len[k];
+            if (a < 0) a = 0;
+            if (b > w) b = w;
+            for (; a < b; a++) d[a] = color;
+        }
     }
 }
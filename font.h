@@ -3,7 +3,28 @@
 #include "stdint.h"
 
 // 8x16 Bitmap Font
+// Text is drawn from an atlas of pre-expanded glyph masks, clipped once
+// per line. '\n' starts a new line 18 pixels down.
 void draw_char(int x, int y, char c, uint32_t color);
 void draw_string(int x, int y, const char* str, uint32_t color);
 
-#endif
\ No newline at end of file
+// The first len characters of str into any 32-bit surface (pitch in
+// pixels), clipped to w x h
+void font_draw_text(uint32_t* surf, int pitch, int w, int h, int x, int y,
+                    const char* str, int len, uint32_t color);
+
+// Rendered string cache: FONT_CACHE_ENTRIES strings kept as runs of ink,
+// least recently used replaced first
+#define FONT_CACHE_ENTRIES 16
+#define FONT_CACHE_CHARS   64      // Longest cached string, terminator included
+#define FONT_CACHE_RUNS    1024    // Runs per string over all 16 rows
+
+// draw_string for single-line labels redrawn unchanged every frame, such
+// as window titles; anything the cache can't hold is drawn uncached
+void draw_string_cached(int x, int y, const char* str, uint32_t color);
+
+// 16 rows of a character's glyph, MSB leftmost (for drawing into surfaces
+// other than the backbuffer)
+const uint8_t* font_glyph(char c);
+
+#endif
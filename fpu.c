@@ -0,0 +1,190 @@
+// fpu.c - Lazy FPU/SSE Context Switching for Alteo OS
+// Each CPU remembers which process's state its FPU registers hold
+// (fpu_owner). That is only trusted while the process agrees
+// (process_t.fpu_cpu), since it may have run and changed its state on
+// another CPU in between.
+#include "fpu.h"
+#include "isr.h"
+#include "heap.h"
+#include "klib.h"
+#include "smp.h"
+
+static int use_xsave = 0;
+static uint64_t xcr0 = 0;
+static uint32_t area_size = 512;
+
+// Registers after FNINIT with the default MXCSR (all exceptions masked);
+// every new process starts from a copy
+static uint8_t init_area[FPU_AREA_MAX] __attribute__((aligned(64)));
+
+static process_t* fpu_owner[SMP_MAX_CPUS];
+
+// ---------- Register access ----------
+
+static inline uint64_t read_cr0(void) {
+    uint64_t val;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(val));
+    return val;
+}
+
+static inline void write_cr0(uint64_t val) {
+    __asm__ volatile("mov %0, %%cr0" :: "r"(val) : "memory");
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t sub, uint32_t* a, uint32_t* b,
+                         uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+static void fpu_save(uint8_t* area) {
+    if (use_xsave)
+        __asm__ volatile("xsave64 (%0)" :: "r"(area), "a"((uint32_t)xcr0),
+                         "d"((uint32_t)(xcr0 >> 32)) : "memory");
+    else
+        __asm__ volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+}
+
+static void fpu_restore(const uint8_t* area) {
+    if (use_xsave)
+        __asm__ volatile("xrstor64 (%0)" :: "r"(area), "a"((uint32_t)xcr0),
+                         "d"((uint32_t)(xcr0 >> 32)) : "memory");
+    else
+        __asm__ volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+}
+
+// ---------- #NM ----------
+
+// First FPU/SSE instruction since CR0.TS was set: load the current
+// process's state
+static void fpu_nm_handler(registers_t* regs) {
+    (void)regs;
+    __asm__ volatile("clts");
+
+    int cpu = smp_cpu_id();
+    process_t* p = process_get_current();
+    if (!p || !p->fpu_area) {
+        // Idle loop or a dying process: scratch registers, owned by nobody
+        fpu_restore(init_area);
+        fpu_owner[cpu] = 0;
+        return;
+    }
+    if (fpu_owner[cpu] != p || p->fpu_cpu != cpu) {
+        fpu_restore(p->fpu_area);
+        fpu_owner[cpu] = p;
+        p->fpu_cpu = cpu;
+    }
+}
+
+// ---------- Setup ----------
+
+static void fpu_setup_cpu(void) {
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~(CR0_EM | CR0_TS);   // No x87 emulation, no pending trap
+    cr0 |= CR0_MP;               // WAIT/FWAIT honour TS too
+    write_cr0(cr0);
+
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (use_xsave) cr4 |= CR4_OSXSAVE;
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4));
+
+    if (use_xsave)
+        __asm__ volatile("xsetbv" :: "c"(0), "a"((uint32_t)xcr0),
+                         "d"((uint32_t)(xcr0 >> 32)));
+    __asm__ volatile("fninit");
+}
+
+void fpu_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (c & (1u << 26)) {        // XSAVE
+        use_xsave = 1;
+        xcr0 = XCR0_X87 | XCR0_SSE;
+        if (c & (1u << 28)) xcr0 |= XCR0_AVX;
+    }
+    fpu_setup_cpu();
+
+    if (use_xsave) {
+        // EBX: bytes needed for the components now enabled in XCR0
+        cpuid(0xD, 0, &a, &b, &c, &d);
+        area_size = b;
+        if (area_size > FPU_AREA_MAX) {
+            // More than we keep room for: stay with x87 + SSE
+            xcr0 = XCR0_X87 | XCR0_SSE;
+            __asm__ volatile("xsetbv" :: "c"(0), "a"((uint32_t)xcr0), "d"(0));
+            cpuid(0xD, 0, &a, &b, &c, &d);
+            area_size = b;
+        }
+    }
+
+    uint32_t mxcsr = 0x1F80;
+    __asm__ volatile("ldmxcsr %0" :: "m"(mxcsr));
+    fpu_save(init_area);
+
+    isr_register_handler(7, fpu_nm_handler);
+}
+
+void fpu_init_ap(void) {
+    fpu_setup_cpu();
+    fpu_restore(init_area);
+}
+
+// ---------- Per-process state ----------
+
+int fpu_alloc(process_t* p) {
+    void* block = kmalloc(area_size + 63);
+    if (!block) return -1;
+    p->fpu_alloc = block;
+    p->fpu_area = (uint8_t*)(((uint64_t)block + 63) & ~63ULL);
+    p->fpu_cpu = -1;
+    memcpy(p->fpu_area, init_area, area_size);
+    return 0;
+}
+
+void fpu_free(process_t* p) {
+    if (p->fpu_alloc) kfree(p->fpu_alloc);
+    p->fpu_alloc = 0;
+    p->fpu_area = 0;
+    p->fpu_cpu = -1;
+}
+
+// CR0.TS is clear only while the FPU holds the current process's state:
+// after its #NM, after a switch back to a process whose registers were
+// still loaded, or before the first switch at boot
+static int fpu_loaded(void) {
+    return !(read_cr0() & CR0_TS);
+}
+
+void fpu_fork(process_t* parent, process_t* child) {
+    if (!parent->fpu_area || !child->fpu_area) return;
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    if (fpu_loaded()) fpu_save(parent->fpu_area);
+    memcpy(child->fpu_area, parent->fpu_area, area_size);
+    if (flags & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+}
+
+void fpu_switch(process_t* prev, process_t* next) {
+    int cpu = smp_cpu_id();
+    if (prev && prev->fpu_area && fpu_loaded()) {
+        // Used the FPU this slice. The registers stay valid, so if nobody
+        // else touches them before prev is back, it skips the #NM.
+        fpu_save(prev->fpu_area);
+        fpu_owner[cpu] = prev;
+        prev->fpu_cpu = cpu;
+    }
+
+    uint64_t cr0 = read_cr0();
+    uint64_t want = (fpu_owner[cpu] == next && next->fpu_cpu == cpu) ? cr0 & ~CR0_TS
+                                                                     : cr0 | CR0_TS;
+    if (want != cr0) write_cr0(want);
+}
+
+uint32_t fpu_area_size(void) {
+    return area_size;
+}
+
+int fpu_uses_xsave(void) {
+    return use_xsave;
+}
@@ -0,0 +1,54 @@
+// fpu.h - Lazy FPU/SSE Context Switching for Alteo OS
+// Every process has its own XSAVE (or FXSAVE) image. A context switch
+// saves the outgoing process's registers only if it used the FPU during
+// its slice, and sets CR0.TS; the first FPU/SSE instruction of the new
+// process raises #NM, whose handler loads that process's image. A
+// process that comes back to the CPU still holding its registers skips
+// the trap. Processes that never touch the FPU never pay for it.
+#ifndef FPU_H
+#define FPU_H
+
+#include "stdint.h"
+#include "process.h"
+
+#define CR0_MP          (1UL << 1)
+#define CR0_EM          (1UL << 2)
+#define CR0_TS          (1UL << 3)
+#define CR4_OSFXSR      (1UL << 9)
+#define CR4_OSXMMEXCPT  (1UL << 10)
+#define CR4_OSXSAVE     (1UL << 18)
+
+// XCR0 state components
+#define XCR0_X87        (1ULL << 0)
+#define XCR0_SSE        (1ULL << 1)
+#define XCR0_AVX        (1ULL << 2)
+
+// Largest image kept (x87 + SSE + AVX is 832 bytes)
+#define FPU_AREA_MAX    1024
+
+// Boot CPU: enable SSE (and XSAVE/AVX where present), build the initial
+// FPU image and install the #NM handler. Call after isr_init().
+void fpu_init(void);
+
+// Application processors: same register setup, using what fpu_init found
+void fpu_init_ap(void);
+
+// Give p a fresh FPU image (default control words, empty registers).
+// Returns 0, or -1 if out of memory.
+int fpu_alloc(process_t* p);
+
+// Drop p's image; p must not use the FPU again
+void fpu_free(process_t* p);
+
+// Copy parent's current FPU state into child's image (fork)
+void fpu_fork(process_t* parent, process_t* child);
+
+// Context switch on this CPU from prev (NULL = idle loop) to next.
+// Call with interrupts disabled, before next becomes current.
+void fpu_switch(process_t* prev, process_t* next);
+
+// Size of a process's FPU image, and whether it is an XSAVE image
+uint32_t fpu_area_size(void);
+int fpu_uses_xsave(void);
+
+#endif
@@ -0,0 +1,154 @@
+// frametime.c - Frame Timing and Pacing for Alteo OS
+// Frames are begun, marked and ended by one renderer at a time; ft_lock
+// keeps readers from seeing a frame half recorded.
+#include "frametime.h"
+#include "klib.h"
+#include "gpu.h"
+#include "nv_display.h"
+#include "spinlock.h"
+#include "timer.h"
+
+extern gpu_state_t gpu_state;
+
+typedef struct {
+    // Frame in progress
+    int      gpu_clock;
+    uint64_t last;              // Clock at the previous mark
+    uint64_t phase_ns[FRAME_PHASES];
+    uint64_t target;            // Vblank it is meant for (0 = unpaced)
+
+    // Scheduler
+    uint64_t next_target;       // Vblank the pending frame_due() aimed at
+    uint64_t last_target;       // Vblank the last frame was for
+
+    frame_sample_t recent[FRAME_RECENT];
+    uint32_t recent_head;       // Next slot to fill
+    frame_stats_t stats;
+} frame_state_t;
+
+static frame_state_t ft;
+static spinlock_t ft_lock = SPINLOCK_INIT;
+
+static const char* phase_names[FRAME_PHASES] = { "composite", "flip", "vblank" };
+
+static uint64_t frame_clock(void) {
+    return ft.gpu_clock ? gpu_timer_read() : timer_now_ns();
+}
+
+static int hist_bucket(uint32_t us) {
+    int b = us ? 31 - __builtin_clz(us) : 0;
+    return b < FRAME_HIST_BUCKETS ? b : FRAME_HIST_BUCKETS - 1;
+}
+
+static void hist_add(int row, uint32_t us) {
+    ft.stats.hist[row][hist_bucket(us)]++;
+    ft.stats.sum_us[row] += us;
+    if (us > ft.stats.max_us[row]) ft.stats.max_us[row] = us;
+}
+
+// Most the recent frames took to draw and flip, plus the slack
+static void update_estimate(void) {
+    uint32_t worst = 0;
+    int n = ft.stats.frames < FRAME_ESTIMATE_SPAN ? (int)ft.stats.frames : FRAME_ESTIMATE_SPAN;
+    for (int i = 1; i <= n; i++) {
+        const frame_sample_t* f = &ft.recent[(ft.recent_head - i) % FRAME_RECENT];
+        uint32_t work = f->phase_us[FRAME_COMPOSITE] + f->phase_us[FRAME_FLIP];
+        if (work > worst) worst = work;
+    }
+    ft.stats.estimate_ns = (uint64_t)worst * 1000 + FRAME_SLACK_NS;
+}
+
+// Vblank the display last reported, or 0 to use the timer's grid
+static uint64_t last_vblank(void) {
+    if (!gpu_state.display_active) return 0;
+    return nv_display_vblank_time(nv_display_active_head());
+}
+
+void frame_init(void) {
+    uint64_t irq = spin_lock_irqsave(&ft_lock);
+    memset(&ft, 0, sizeof(ft));
+    ft.stats.period_ns = FRAME_DEFAULT_PERIOD_NS;
+    if (gpu_state.display_active) {
+        nv_display_mode_t mode;
+        nv_display_get_mode(nv_display_active_head(), &mode);
+        uint64_t pixels = (uint64_t)mode.htotal * (uint64_t)mode.vtotal;
+        if (mode.clock > 0 && pixels) {
+            uint64_t period = pixels * 1000000ULL / (uint64_t)mode.clock;   // clock in kHz
+            if (period >= 4000000ULL && period <= 34000000ULL) ft.stats.period_ns = period;
+        }
+    }
+    ft.stats.estimate_ns = FRAME_SLACK_NS;
+    spin_unlock_irqrestore(&ft_lock, irq);
+}
+
+void frame_begin(int gpu_clock) {
+    ft.gpu_clock = gpu_clock && gpu_state.mmio_mapped;
+    for (int p = 0; p < FRAME_PHASES; p++) ft.phase_ns[p] = 0;
+    ft.target = ft.next_target > ft.last_target ? ft.next_target : 0;
+    ft.last = frame_clock();
+}
+
+void frame_mark(int phase) {
+    uint64_t now = frame_clock();
+    if (phase >= 0 && phase < FRAME_PHASES && now > ft.last) ft.phase_ns[phase] += now - ft.last;
+    ft.last = now;
+}
+
+void frame_end(void) {
+    uint64_t end = timer_now_ns();
+    uint64_t irq = spin_lock_irqsave(&ft_lock);
+    frame_sample_t* f = &ft.recent[ft.recent_head % FRAME_RECENT];
+    f->total_us = 0;
+    for (int p = 0; p < FRAME_PHASES; p++) {
+        f->phase_us[p] = (uint32_t)(ft.phase_ns[p] / 1000);
+        f->total_us += f->phase_us[p];
+        hist_add(p, f->phase_us[p]);
+    }
+    hist_add(FRAME_PHASES, f->total_us);
+    f->end_ns = end;
+    f->missed = ft.target && end > ft.target;
+    ft.recent_head++;
+    ft.stats.frames++;
+    ft.stats.missed += f->missed;
+    if (ft.target) ft.last_target = ft.target;
+    update_estimate();
+    spin_unlock_irqrestore(&ft_lock, irq);
+}
+
+uint64_t frame_due(uint64_t now) {
+    uint64_t period = ft.stats.period_ns;
+    uint64_t cost = ft.stats.estimate_ns;
+    if (cost > period) cost = period;       // Then a frame per refresh is all there is
+    // Keep aiming at the vblank picked last time while it can still be met
+    if (ft.next_target > ft.last_target && now + cost <= ft.next_target + period / 4)
+        return ft.next_target > cost ? ft.next_target - cost : 0;
+
+    uint64_t base = last_vblank();
+    ft.stats.vblank_irq = base != 0;
+    uint64_t t = now + cost;
+    uint64_t v = t <= base ? base : base + (t - base + period - 1) / period * period;
+    if (ft.last_target && v < ft.last_target + period) v = ft.last_target + period;
+    ft.next_target = v;
+    return v - cost;
+}
+
+void frame_get_stats(frame_stats_t* out) {
+    if (!out) return;
+    uint64_t irq = spin_lock_irqsave(&ft_lock);
+    *out = ft.stats;
+    spin_unlock_irqrestore(&ft_lock, irq);
+}
+
+int frame_get_recent(frame_sample_t* out, int max) {
+    if (!out || max <= 0) return 0;
+    uint64_t irq = spin_lock_irqsave(&ft_lock);
+    int n = ft.stats.frames < FRAME_RECENT ? (int)ft.stats.frames : FRAME_RECENT;
+    if (n > max) n = max;
+    for (int i = 0; i < n; i++) out[i] = ft.recent[(ft.recent_head - n + i) % FRAME_RECENT];
+    spin_unlock_irqrestore(&ft_lock, irq);
+    return n;
+}
+
+const char* frame_phase_name(int phase) {
+    return phase >= 0 && phase < FRAME_PHASES ? phase_names[phase] : "total";
+}
@@ -0,0 +1,68 @@
+// frametime.h - Frame Timing and Pacing for Alteo OS
+// A renderer brackets each frame with frame_begin() and frame_end() and
+// marks where each phase ends: composition, the flip to the screen and any
+// wait for vblank. Phase times go into log2 histograms and a ring of
+// recent frames, read through /proc/frametime and shown by the desktop's
+// overlay (terminal command "fps").
+//
+// frame_due() is the frame scheduler. From what recent frames cost it
+// picks the next vblank that can still be met and returns when to start
+// so the frame is done just before it: one frame per refresh at most,
+// started as late as it safely can be, so input arriving in the meantime
+// still makes it in. Vblanks come from the display's interrupt where there
+// is one, else from a grid at the refresh rate.
+#ifndef FRAMETIME_H
+#define FRAMETIME_H
+
+#include "stdint.h"
+
+// Phases
+#define FRAME_COMPOSITE     0       // Drawing the frame
+#define FRAME_FLIP          1       // Getting it to the screen
+#define FRAME_VBLANK        2       // Waiting for the display
+#define FRAME_PHASES        3
+
+#define FRAME_HIST_BUCKETS  16      // Bucket b: [2^b, 2^(b+1)) us (0 also < 1us)
+#define FRAME_RECENT        64      // Frames kept for the estimate and overlay
+#define FRAME_ESTIMATE_SPAN 16      // Recent frames the cost estimate covers
+#define FRAME_SLACK_NS      1000000ULL                  // Margin on the estimate
+#define FRAME_DEFAULT_PERIOD_NS (1000000000ULL / 60)    // Without a display mode
+
+typedef struct {
+    uint32_t phase_us[FRAME_PHASES];
+    uint32_t total_us;
+    uint64_t end_ns;            // timer_now_ns() at frame_end()
+    uint8_t  missed;            // Done after the vblank it was started for
+} frame_sample_t;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t missed;
+    uint64_t hist[FRAME_PHASES + 1][FRAME_HIST_BUCKETS];   // Phases, then total
+    uint64_t sum_us[FRAME_PHASES + 1];
+    uint32_t max_us[FRAME_PHASES + 1];
+    uint64_t period_ns;         // Refresh interval
+    uint64_t estimate_ns;       // Expected cost of the next frame, slack included
+    int      vblank_irq;        // Vblank times come from the display
+} frame_stats_t;
+
+// Take the refresh rate from the display mode (after nv_display_init)
+void frame_init(void);
+
+// Start a frame; phases are timed with the GPU's PTIMER if gpu_clock is
+// set (the compositor's GPU path), else with the TSC clock
+void frame_begin(int gpu_clock);
+// The given phase ends now (a phase may be marked more than once)
+void frame_mark(int phase);
+// Record the frame
+void frame_end(void);
+
+// When to start the next frame, given it is wanted from now on
+uint64_t frame_due(uint64_t now_ns);
+
+void frame_get_stats(frame_stats_t* out);
+// Copy up to max recent frames, oldest first; returns how many
+int  frame_get_recent(frame_sample_t* out, int max);
+const char* frame_phase_name(int phase);
+
+#endif
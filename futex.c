@@ -0,0 +1,175 @@
+// futex.c - Fast User-space Mutexes for Alteo OS
+// One waiter record per process table slot (a process waits on at most one
+// word). A waiter sleeps on the wait queue of the bucket it started in,
+// even after a requeue moves it to another bucket's list, so wakers always
+// wake w->wq.
+#include "futex.h"
+#include "klib.h"
+#include "process.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "waitq.h"
+#include "timer.h"
+#include "syscall.h"
+
+typedef struct {
+    int      next;          // Next waiter (slot) in the bucket, -1 = last
+    int      bucket;        // Bucket whose list holds it, -1 = none
+    uint64_t key;           // Physical address waited on
+    waitq_t* wq;            // Queue it sleeps on
+    volatile int woken;
+    volatile int timed_out;
+    uint32_t seq;           // Tells a stale timeout from the current wait
+} futex_waiter_t;
+
+typedef struct {
+    int     head;           // First waiter (slot), -1 = empty
+    waitq_t wq;
+} futex_bucket_t;
+
+static futex_waiter_t waiters[MAX_PROCESSES];
+static futex_bucket_t buckets[FUTEX_HASH_BUCKETS];
+
+// ---------- Buckets ----------
+
+static int futex_hash(uint64_t key) {
+    return (int)(((key >> 2) * 0x9E3779B97F4A7C15ULL) >> 58);   // Top 6 bits
+}
+
+static void bucket_append(int b, int slot) {
+    waiters[slot].next = -1;
+    waiters[slot].bucket = b;
+    int* link = &buckets[b].head;
+    while (*link >= 0) link = &waiters[*link].next;
+    *link = slot;
+}
+
+static void bucket_remove(int slot) {
+    futex_waiter_t* w = &waiters[slot];
+    if (w->bucket < 0) return;
+    int* link = &buckets[w->bucket].head;
+    while (*link >= 0 && *link != slot) link = &waiters[*link].next;
+    if (*link == slot) *link = w->next;
+    w->bucket = -1;
+    w->next = -1;
+}
+
+// Kernel address of the word at addr in the slot's process, after making
+// its page private if it is copy-on-write (so the key stays put)
+static uint32_t* futex_word(int slot, uint64_t addr) {
+    if (addr & 3) return 0;
+    process_t* p = &process_get_table()[slot];
+    pte_t* pml4 = p->page_table ? (pte_t*)p->page_table : vmm_get_current_address_space();
+    return (uint32_t*)vmm_vma_touch(p->pid, pml4, addr, 1);
+}
+
+// ---------- Operations ----------
+
+void futex_init(void) {
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        memset(&waiters[i], 0, sizeof(waiters[i]));
+        waiters[i].next = -1;
+        waiters[i].bucket = -1;
+    }
+    for (int i = 0; i < FUTEX_HASH_BUCKETS; i++) {
+        buckets[i].head = -1;
+        waitq_init(&buckets[i].wq);
+    }
+}
+
+static int futex_done(void* arg) {
+    futex_waiter_t* w = (futex_waiter_t*)arg;
+    return w->woken || w->timed_out;
+}
+
+// Timer event: arg = slot | seq << 8
+static void futex_timeout(uint64_t arg) {
+    futex_waiter_t* w = &waiters[arg & 0xFF];
+    if (w->seq != (uint32_t)(arg >> 8) || w->bucket < 0) return;
+    w->timed_out = 1;
+    waitq_wake_all(w->wq);
+}
+
+int futex_wait(int slot, uint64_t addr, uint32_t expected, uint64_t timeout_ns) {
+    uint32_t* word = futex_word(slot, addr);
+    if (!word) return addr & 3 ? SYSCALL_EINVAL : SYSCALL_EFAULT;
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != expected) return SYSCALL_EAGAIN;
+
+    // The key is the word's frame: keep zswap from moving it while we wait
+    void* frame = (void*)((uint64_t)word & ~(uint64_t)(PAGE_SIZE - 1));
+    pmm_page_ref(frame);
+
+    futex_waiter_t* w = &waiters[slot];
+    int b = futex_hash((uint64_t)word);
+    w->key = (uint64_t)word;
+    w->wq = &buckets[b].wq;
+    w->woken = 0;
+    w->timed_out = 0;
+    w->seq++;
+    bucket_append(b, slot);
+
+    int timer = -1;
+    if (timeout_ns) {
+        timer = timer_add(timer_now_ns() + timeout_ns, futex_timeout,
+                          (uint64_t)slot | ((uint64_t)w->seq << 8));
+    }
+    int rc = waitq_wait(w->wq, futex_done, w);
+    if (timer >= 0) timer_cancel(timer);
+    bucket_remove(slot);    // Timed out, or could not block
+    pmm_free_block(frame);
+
+    if (w->woken) return 0;
+    return rc < 0 ? SYSCALL_EAGAIN : SYSCALL_ETIMEDOUT;
+}
+
+int futex_wake(int slot, uint64_t addr, uint32_t count) {
+    uint32_t* word = futex_word(slot, addr);
+    if (!word) return addr & 3 ? SYSCALL_EINVAL : SYSCALL_EFAULT;
+    uint64_t key = (uint64_t)word;
+
+    int woken = 0;
+    int s = buckets[futex_hash(key)].head;
+    while (s >= 0 && (uint32_t)woken < count) {
+        int next = waiters[s].next;
+        if (waiters[s].key == key) {
+            bucket_remove(s);
+            waiters[s].woken = 1;
+            waitq_wake_all(waiters[s].wq);
+            woken++;
+        }
+        s = next;
+    }
+    return woken;
+}
+
+int futex_requeue(int slot, uint64_t addr, uint32_t wake, uint64_t addr2,
+                  uint32_t requeue, int cmp, uint32_t expected) {
+    uint32_t* word = futex_word(slot, addr);
+    uint32_t* word2 = futex_word(slot, addr2);
+    if (!word || !word2) return (addr & 3) || (addr2 & 3) ? SYSCALL_EINVAL : SYSCALL_EFAULT;
+    if (cmp && __atomic_load_n(word, __ATOMIC_ACQUIRE) != expected) return SYSCALL_EAGAIN;
+
+    int woken = futex_wake(slot, addr, wake);
+    uint64_t key = (uint64_t)word, key2 = (uint64_t)word2;
+    if (key == key2) return woken;
+
+    int moved = 0;
+    int b2 = futex_hash(key2);
+    int s = buckets[futex_hash(key)].head;
+    while (s >= 0 && (uint32_t)moved < requeue) {
+        int next = waiters[s].next;
+        if (waiters[s].key == key) {
+            bucket_remove(s);
+            waiters[s].key = key2;
+            bucket_append(b2, s);
+            moved++;
+        }
+        s = next;
+    }
+    return woken + moved;
+}
+
+void futex_release(int pid) {
+    process_t* p = process_get(pid);
+    if (p) bucket_remove((int)(p - process_get_table()));
+}
@@ -0,0 +1,57 @@
+// futex.h - Fast User-space Mutexes for Alteo OS
+// Lets a process sleep until a 32-bit word in its memory changes. Locks
+// and condition variables live in user memory and are taken and released
+// with atomic instructions alone; only a thread that finds one contended
+// calls SYS_FUTEX to sleep, and the releaser calls it only when someone
+// may be sleeping.
+//
+// A waiter is keyed by the physical address of its word, so processes
+// sharing the page (shm, shared mappings) meet on the same key. Waiters
+// hang off FUTEX_HASH_BUCKETS hashed buckets, each with a FIFO list and a
+// wait queue. The value check and the enqueue happen under the big
+// kernel lock, so a wake cannot slip between them.
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include "stdint.h"
+
+#define FUTEX_HASH_BUCKETS  64
+
+// SYS_FUTEX(addr, op, arg) operations
+#define FUTEX_WAIT          0   // arg = expected value: sleep while *addr == arg
+#define FUTEX_WAKE          1   // arg = most waiters to wake
+#define FUTEX_WAIT_TIMEOUT  2   // arg = futex_wait_t*
+#define FUTEX_REQUEUE       3   // arg = futex_requeue_t*
+
+typedef struct {
+    uint32_t expected;
+    uint32_t reserved;
+    uint64_t timeout_ns;    // Relative; 0 = no timeout
+} futex_wait_t;
+
+// Wake up to 'wake' waiters on addr and move up to 'requeue' of the rest
+// onto addr2 (a condition variable handing its waiters to the mutex).
+// With cmp set, fails with SYSCALL_EAGAIN unless *addr == expected.
+typedef struct {
+    uint32_t  wake;
+    uint32_t  requeue;
+    uint32_t* addr2;
+    int32_t   cmp;
+    uint32_t  expected;
+} futex_requeue_t;
+
+void futex_init(void);
+
+// For the process in table slot 'slot'. Results are SYSCALL_* codes:
+// wait returns 0 once woken, SYSCALL_EAGAIN if *addr != expected and
+// SYSCALL_ETIMEDOUT; wake and requeue return how many waiters they woke
+// (and moved).
+int futex_wait(int slot, uint64_t addr, uint32_t expected, uint64_t timeout_ns);
+int futex_wake(int slot, uint64_t addr, uint32_t count);
+int futex_requeue(int slot, uint64_t addr, uint32_t wake, uint64_t addr2,
+                  uint32_t requeue, int cmp, uint32_t expected);
+
+// Drop the process's wait (exit)
+void futex_release(int pid);
+
+#endif
@@ -18,15 +18,15 @@ typedef struct {
     uint64_t base;
 } __attribute__((packed)) gdt_ptr_t;
 
-// GDT entries (7 slots: null, kcode, kdata, udata, ucode, tss_lo, tss_hi)
+// GDT entries (null, kcode, kdata, udata, ucode, then 2 slots per CPU TSS)
 static gdt_entry_t gdt_entries[GDT_ENTRY_COUNT] __attribute__((aligned(16)));
 static gdt_ptr_t gdt_ptr;
 
-// Task State Segment
-static tss_t tss __attribute__((aligned(16)));
+// Task State Segment (one per CPU: RSP0 follows the process running there)
+static tss_t tss[SMP_MAX_CPUS] __attribute__((aligned(16)));
 
-// Kernel interrupt stack (used by TSS RSP0 when transitioning from Ring 3)
-static uint8_t kernel_interrupt_stack[8192] __attribute__((aligned(16)));
+// Kernel interrupt stacks (used by TSS RSP0 when transitioning from Ring 3)
+static uint8_t kernel_interrupt_stack[SMP_MAX_CPUS][8192] __attribute__((aligned(16)));
 
 // Helper: set a standard GDT entry
 static void gdt_set_entry(int index, uint32_t base, uint32_t limit,
@@ -39,15 +39,38 @@ static void gdt_set_entry(int index, uint32_t base, uint32_t limit,
     gdt_entries[index].base_high   = (base >> 24) & 0xFF;
 }
 
-void gdt_init(void) {
+// Write the 16-byte TSS descriptor for a CPU's TSS into its GDT slots
+static void gdt_set_tss(int cpu) {
+    int slot = GDT_TSS / 8 + cpu * 2;
+    uint64_t tss_addr = (uint64_t)&tss[cpu];
+    uint32_t tss_limit = sizeof(tss_t) - 1;
+
     // Clear TSS
-    uint8_t* tss_ptr = (uint8_t*)&tss;
+    uint8_t* tss_ptr = (uint8_t*)&tss[cpu];
     for (uint64_t i = 0; i < sizeof(tss_t); i++) tss_ptr[i] = 0;
 
-    // Set TSS RSP0 to kernel interrupt stack
-    tss.rsp0 = (uint64_t)&kernel_interrupt_stack[8192];
-    tss.iomap_base = sizeof(tss_t);
+    // Set TSS RSP0 to this CPU's kernel interrupt stack
+    tss[cpu].rsp0 = (uint64_t)&kernel_interrupt_stack[cpu][8192];
+    tss[cpu].iomap_base = sizeof(tss_t);
+
+    // Low 8 bytes of TSS descriptor
+    // Access: P=1, DPL=00, S=0, Type=1001 (Available 64-bit TSS) = 0x89
+    // Flags:  G=0, D=0, L=0, AVL=0 = 0x00
+    gdt_entries[slot].limit_low   = tss_limit & 0xFFFF;
+    gdt_entries[slot].base_low    = tss_addr & 0xFFFF;
+    gdt_entries[slot].base_mid    = (tss_addr >> 16) & 0xFF;
+    gdt_entries[slot].access      = 0x89;
+    gdt_entries[slot].flags_limit = ((tss_limit >> 16) & 0x0F);
+    gdt_entries[slot].base_high   = (tss_addr >> 24) & 0xFF;
+
+    // High 8 bytes of TSS descriptor (base bits 32-63 + reserved)
+    // We cast the GDT entry slot to raw uint32_t* to write the upper base
+    uint32_t* tss_high = (uint32_t*)&gdt_entries[slot + 1];
+    tss_high[0] = (uint32_t)(tss_addr >> 32);  // Base 32:63
+    tss_high[1] = 0;                            // Reserved
+}
 
+void gdt_init(void) {
     // --- GDT Entries ---
 
     // Entry 0: Null descriptor
@@ -73,26 +96,9 @@ void gdt_init(void) {
     // Flags:  G=0, D=0, L=1 (Long mode), AVL=0 = 0x02
     gdt_set_entry(4, 0, 0, 0xFA, 0x02);
 
-    // Entry 5-6 (0x28): TSS descriptor (16 bytes in 64-bit mode)
-    // The TSS descriptor is a system segment (S=0) and takes two GDT slots
-    uint64_t tss_addr = (uint64_t)&tss;
-    uint32_t tss_limit = sizeof(tss_t) - 1;
-
-    // Low 8 bytes of TSS descriptor
-    // Access: P=1, DPL=00, S=0, Type=1001 (Available 64-bit TSS) = 0x89
-    // Flags:  G=0, D=0, L=0, AVL=0 = 0x00
-    gdt_entries[5].limit_low   = tss_limit & 0xFFFF;
-    gdt_entries[5].base_low    = tss_addr & 0xFFFF;
-    gdt_entries[5].base_mid    = (tss_addr >> 16) & 0xFF;
-    gdt_entries[5].access      = 0x89;
-    gdt_entries[5].flags_limit = ((tss_limit >> 16) & 0x0F);
-    gdt_entries[5].base_high   = (tss_addr >> 24) & 0xFF;
-
-    // High 8 bytes of TSS descriptor (base bits 32-63 + reserved)
-    // We cast the GDT entry slot to raw uint32_t* to write the upper base
-    uint32_t* tss_high = (uint32_t*)&gdt_entries[6];
-    tss_high[0] = (uint32_t)(tss_addr >> 32);  // Base 32:63
-    tss_high[1] = 0;                            // Reserved
+    // Entries 5.. (0x28 + 16*cpu): TSS descriptors (16 bytes in 64-bit mode)
+    // A TSS descriptor is a system segment (S=0) and takes two GDT slots
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) gdt_set_tss(cpu);
 
     // Set up GDT pointer
     gdt_ptr.limit = (sizeof(gdt_entry_t) * GDT_ENTRY_COUNT) - 1;
@@ -105,10 +111,14 @@ void gdt_init(void) {
     tss_flush(GDT_TSS);
 }
 
+tss_t* gdt_cpu_tss(int cpu) {
+    return &tss[cpu];
+}
+
 void tss_set_rsp0(uint64_t rsp0) {
-    tss.rsp0 = rsp0;
+    ((tss_t*)smp_this_cpu()->tss)->rsp0 = rsp0;
 }
 
 uint64_t tss_get_rsp0(void) {
-    return tss.rsp0;
+    return ((tss_t*)smp_this_cpu()->tss)->rsp0;
 }
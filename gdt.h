@@ -4,6 +4,7 @@
 #define GDT_H
 
 #include "stdint.h"
+#include "smp.h"
 
 // Segment selectors
 #define GDT_NULL          0x00
@@ -11,14 +12,15 @@
 #define GDT_KERNEL_DATA   0x10   // Ring 0 data
 #define GDT_USER_DATA     0x18   // Ring 3 data (SS for SYSRET)
 #define GDT_USER_CODE     0x20   // Ring 3 code (CS for SYSRET)
-#define GDT_TSS           0x28   // Task State Segment (16 bytes, spans 2 GDT slots)
+#define GDT_TSS           0x28   // CPU 0 TSS (16 bytes, spans 2 GDT slots); CPU n at 0x28 + 16*n
 
 // User-mode selectors with RPL=3
 #define GDT_USER_DATA_RPL3  (GDT_USER_DATA | 3)  // 0x1B
 #define GDT_USER_CODE_RPL3  (GDT_USER_CODE | 3)  // 0x23
 
-// GDT entry count: null + kernel_code + kernel_data + user_data + user_code + tss(2 slots)
-#define GDT_ENTRY_COUNT 7
+// GDT entry count: null + kernel_code + kernel_data + user_data + user_code
+// + one TSS (2 slots) per CPU
+#define GDT_ENTRY_COUNT (5 + 2 * SMP_MAX_CPUS)
 
 // Task State Segment (64-bit)
 typedef struct {
@@ -42,7 +44,10 @@ typedef struct {
 // Initialize GDT with all required segments and TSS
 void gdt_init(void);
 
-// Update TSS RSP0 (called during context switch to set kernel stack for current process)
+// TSS of CPU 'cpu' (smp_percpu_init keeps it in the per-CPU block)
+tss_t* gdt_cpu_tss(int cpu);
+
+// Update the calling CPU's TSS RSP0 (called during context switch to set kernel stack for current process)
 void tss_set_rsp0(uint64_t rsp0);
 
 // Get current TSS RSP0
@@ -4,27 +4,21 @@
 // Falls back gracefully if no NVIDIA GPU or unsupported generation
 
 #include "gpu.h"
+#include "klib.h"
 #include "pci.h"
 #include "vmm.h"
 #include "heap.h"
 #include "graphics.h"
+#include "irq.h"
+#include "isr.h"
+#include "apic.h"
+#include "nv_display.h"
 
 // ---- String helpers (freestanding) ----
 static void gpu_strcpy(char* d, const char* s) {
     while ((*d++ = *s++));
 }
 
-static void gpu_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
-static void gpu_memcpy(void* dst, const void* src, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (uint64_t i = 0; i < n; i++) d[i] = s[i];
-}
-
 // ---- Global GPU state ----
 gpu_state_t gpu_state;
 
@@ -95,16 +89,10 @@ int gpu_map_mmio(void) {
 
     // Map BAR0 (MMIO registers) into kernel virtual address space
     // MMIO must be uncacheable (write-through or uncacheable)
+    // BARs are naturally aligned, so vmm_map_range can use 2MB pages here
     uint64_t vbase = GPU_MMIO_VBASE;
-    uint64_t pages = (gpu_state.mmio_size + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
-    pte_t* pml4 = vmm_get_kernel_pml4();
-
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t phys = gpu_state.mmio_phys + (i * VMM_PAGE_SIZE);
-        uint64_t virt = vbase + (i * VMM_PAGE_SIZE);
-        vmm_map_page(pml4, virt, phys,
-                      VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
-    }
+    vmm_map_range(vmm_get_kernel_pml4(), vbase, gpu_state.mmio_phys, gpu_state.mmio_size,
+                  VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
 
     gpu_state.mmio = (volatile uint32_t*)vbase;
     gpu_state.mmio_mapped = 1;
@@ -114,25 +102,18 @@ int gpu_map_mmio(void) {
 int gpu_map_vram(void) {
     if (gpu_state.vram_phys == 0 || gpu_state.vram_size == 0) return -1;
 
-    // Map BAR1 (VRAM aperture) into kernel virtual address space
-    // VRAM can be write-combining for better performance, but we use uncacheable for safety
+    // Map BAR1 (VRAM aperture) into kernel virtual address space,
+    // write-combining: it holds pixels and push buffers, never registers
     uint64_t vbase = GPU_VRAM_VBASE;
     uint64_t size = gpu_state.vram_size;
 
-    // Limit mapping to 256 MB to avoid excessive page table entries
+    // Limit mapping to 256 MB: the window ends where GPU_RAMIN_VBASE begins
     if (size > 256 * 1024 * 1024) {
         size = 256 * 1024 * 1024;
     }
 
-    uint64_t pages = (size + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
-    pte_t* pml4 = vmm_get_kernel_pml4();
-
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t phys = gpu_state.vram_phys + (i * VMM_PAGE_SIZE);
-        uint64_t virt = vbase + (i * VMM_PAGE_SIZE);
-        vmm_map_page(pml4, virt, phys,
-                      VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
-    }
+    vmm_map_range(vmm_get_kernel_pml4(), vbase, gpu_state.vram_phys, size,
+                  VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_WC);
 
     gpu_state.vram = (volatile uint32_t*)vbase;
     gpu_state.vram_mapped = 1;
@@ -143,15 +124,8 @@ int gpu_map_ramin(void) {
     if (gpu_state.ramin_phys == 0 || gpu_state.ramin_size == 0) return -1;
 
     uint64_t vbase = GPU_RAMIN_VBASE;
-    uint64_t pages = (gpu_state.ramin_size + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
-    pte_t* pml4 = vmm_get_kernel_pml4();
-
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t phys = gpu_state.ramin_phys + (i * VMM_PAGE_SIZE);
-        uint64_t virt = vbase + (i * VMM_PAGE_SIZE);
-        vmm_map_page(pml4, virt, phys,
-                      VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
-    }
+    vmm_map_range(vmm_get_kernel_pml4(), vbase, gpu_state.ramin_phys, gpu_state.ramin_size,
+                  VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
 
     gpu_state.ramin = (volatile uint32_t*)vbase;
     return 0;
@@ -343,18 +317,61 @@ void gpu_disable_interrupts(void) {
 void gpu_enable_interrupts(void) {
     if (!gpu_state.mmio_mapped) return;
 
-    // Enable relevant interrupts
-    uint32_t mask = NV_PMC_INTR_PFIFO | NV_PMC_INTR_PGRAPH | NV_PMC_INTR_PTIMER;
-
+    // Only sources gpu_irq() handles: an unserviced source would keep a
+    // level-triggered INTx line asserted
+    uint32_t mask;
     if (gpu_state.arch >= NV_ARCH_NV50) {
-        mask |= NV_PMC_INTR_PDISPLAY;  // NV50+ uses unified display engine
+        mask = NV_PMC_INTR_PDISPLAY;  // NV50+ uses unified display engine
     } else {
-        mask |= NV_PMC_INTR_PCRTC;     // Pre-NV50 uses PCRTC
+        mask = NV_PMC_INTR_PCRTC;     // Pre-NV50 uses PCRTC
     }
 
     nv_wr32(gpu_state.mmio, NV_PMC_INTR_EN_0, mask);
 }
 
+static void gpu_intr(void) {
+    uint32_t pending = nv_rd32(gpu_state.mmio, NV_PMC_INTR_0);
+    if (pending & (NV_PMC_INTR_PDISPLAY | NV_PMC_INTR_PCRTC)) nv_display_intr();
+}
+
+static void gpu_irq(registers_t* regs) {
+    (void)regs;
+    gpu_intr();
+}
+
+static void gpu_msi_irq(void* ctx) {
+    (void)ctx;
+    gpu_intr();
+}
+
+int gpu_irq_init(void) {
+    if (!gpu_state.mmio_mapped) return -1;
+    if (gpu_state.irq_routed) return 0;
+    if (!apic_is_active()) return -1;
+
+    // MSI where the function has it, else the INTx line if the MADT says
+    // where it lands; otherwise vblank stays polled
+    pci_device_t* dev = gpu_find_nvidia();
+    uint8_t irq = gpu_state.pci_irq;
+    gpu_state.msi_vector = -1;
+    if (dev && pci_find_capability(dev, PCI_CAP_ID_MSI)) {
+        int v = isr_alloc_msi(gpu_msi_irq, 0);
+        if (v < 0) return -1;
+        if (pci_msi_enable(dev, (uint8_t)v, (uint8_t)lapic_get_id()) < 0) {
+            isr_free_vector(v);
+            return -1;
+        }
+        gpu_state.msi_vector = v;
+    } else {
+        if (irq == 0 || irq >= 16 || !ioapic_irq_level_override(irq)) return -1;
+        irq_install_handler(irq, gpu_irq);
+        ioapic_set_irq(irq, APIC_IRQ_BASE + irq, lapic_get_id(), 0);
+    }
+    gpu_enable_interrupts();
+    gpu_state.irq_routed = 1;
+    return 0;
+}
+
 // ============================================================
 // Timer
 // ============================================================
@@ -479,7 +496,7 @@ void gpu_flip(uint32_t* src, int width, int height) {
 
 int gpu_init(void) {
     // Clear state
-    gpu_memset(&gpu_state, 0, sizeof(gpu_state_t));
+    memset(&gpu_state, 0, sizeof(gpu_state_t));
 
     // --- Step 1: Find NVIDIA GPU on PCI bus ---
     pci_device_t* dev = gpu_find_nvidia();
@@ -568,6 +585,15 @@ void gpu_shutdown(void) {
     if (!gpu_state.initialized) return;
 
     gpu_disable_interrupts();
+    if (gpu_state.irq_routed) {
+        if (gpu_state.msi_vector >= 0) {
+            isr_free_vector(gpu_state.msi_vector);   // The source is off above
+        } else {
+            ioapic_mask_irq(gpu_state.pci_irq);
+            irq_uninstall_handler(gpu_state.pci_irq);
+        }
+        gpu_state.irq_routed = 0;
+    }
 
     // Disable engines
     if (gpu_state.mmio_mapped) {
@@ -108,6 +108,8 @@ typedef struct {
     uint8_t  pci_dev;
     uint8_t  pci_func;
     uint8_t  pci_irq;
+    int      irq_routed;        // gpu_irq_init() installed the handler
+    int      msi_vector;        // Its MSI vector, -1 = INTx line
 
     // Chip identification (from BOOT_0)
     uint32_t chipset;           // Full chipset ID from PMC.BOOT_0
@@ -189,6 +191,7 @@ void gpu_engine_reset(void);                // Reset all GPU engines via PMC
 void gpu_enable_engines(void);              // Enable PFIFO + PGRAPH
 void gpu_disable_interrupts(void);          // Mask all GPU interrupts
 void gpu_enable_interrupts(void);           // Unmask GPU interrupts
+int  gpu_irq_init(void);                    // Route MSI or the PCI line, enable display IRQs
 
 // ---- Memory Detection ----
 uint64_t gpu_detect_vram_size(void);        // Query PFB for VRAM amount
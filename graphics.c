@@ -1,11 +1,27 @@
 #include "graphics.h"
 #include "font.h"
+#include "klib.h"
+#include "pixel.h"
+#include "vmm.h"
 
 uint32_t* framebuffer;
 static int fb_width, fb_height;
 int fb_pitch;
 uint32_t backbuf[1024 * 768];
 
+// What the framebuffer holds, kept in cacheable memory so a flip can skip
+// spans that haven't changed without reading the (uncached) framebuffer
+static uint32_t frontbuf[1024 * 768];
+
+// Pending damage, merged as it is added
+typedef struct { int x0, y0, x1, y1; } gfx_rect_t;
+static gfx_rect_t damage[GFX_DAMAGE_MAX];
+static int damage_count = 0;
+
+// The nebula background is the same every frame; it is drawn once
+static uint32_t bg_cache[1024 * 768];
+static int bg_cached = 0;
+
 // Aliases for GPU driver layer
 int screen_width = 1024;
 int screen_height = 768;
@@ -34,8 +50,8 @@ static const uint8_t cursor_bmp[19][12] = {
     {1,0,0,0,0,0,1,2,2,1,0,0},
     {0,0,0,0,0,0,0,1,1,1,0,0},
 };
-#define CUR_W 12
-#define CUR_H 19
+#define CUR_W CURSOR_W
+#define CUR_H CURSOR_H
 
 static uint32_t rng_state = 12345;
 static uint32_t rng(void) {
@@ -54,6 +70,17 @@ void init_graphics(uint64_t addr) {
     fb_pitch = mb->framebuffer_pitch;
     screen_width = fb_width;
     screen_height = fb_height;
+    bg_cached = 0;
+}
+
+// The boot identity map gives the framebuffer whatever type the firmware's
+// MTRRs say, often UC. Remapped WC, flips become burst writes.
+void gfx_map_framebuffer(void) {
+    if (!framebuffer) return;
+    uint64_t start = (uint64_t)framebuffer & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    uint64_t end = (uint64_t)framebuffer + (uint64_t)fb_pitch * fb_height;
+    vmm_map_range(vmm_get_kernel_pml4(), start, start, end - start,
+                  VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_WC);
 }
 
 int get_screen_width(void) { return fb_width; }
@@ -62,11 +89,81 @@ uint32_t* get_backbuf(void) { return backbuf; }
 
 void flip_buffer(void) {
     int stride = fb_pitch / 4;
+    uint32_t row = (uint32_t)fb_width * 4;
     for (int y = 0; y < fb_height; y++) {
-        uint32_t* src = &backbuf[y * fb_width];
-        uint32_t* dst = &framebuffer[y * stride];
-        for (int x = 0; x < fb_width; x++) dst[x] = src[x];
+        memcpy(&framebuffer[y * stride], &backbuf[y * fb_width], row);
+        memcpy(&frontbuf[y * fb_width], &backbuf[y * fb_width], row);
+    }
+    damage_count = 0;
+}
+
+// ---- Damage tracking ----
+
+static int rects_touch(const gfx_rect_t* a, const gfx_rect_t* b) {
+    return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+static void rect_union(gfx_rect_t* a, const gfx_rect_t* b) {
+    if (b->x0 < a->x0) a->x0 = b->x0;
+    if (b->y0 < a->y0) a->y0 = b->y0;
+    if (b->x1 > a->x1) a->x1 = b->x1;
+    if (b->y1 > a->y1) a->y1 = b->y1;
+}
+
+void gfx_damage(int x, int y, int w, int h) {
+    gfx_rect_t r = { x, y, x + w, y + h };
+    if (r.x0 < 0) r.x0 = 0;
+    if (r.y0 < 0) r.y0 = 0;
+    if (r.x1 > fb_width) r.x1 = fb_width;
+    if (r.y1 > fb_height) r.y1 = fb_height;
+    if (r.x0 >= r.x1 || r.y0 >= r.y1) return;
+
+    // Absorb every rect this one overlaps or abuts; the grown rect may now
+    // reach others, so start over until nothing more merges
+    for (int i = 0; i < damage_count; ) {
+        if (rects_touch(&damage[i], &r)) {
+            rect_union(&r, &damage[i]);
+            damage[i] = damage[--damage_count];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+    if (damage_count == GFX_DAMAGE_MAX) {
+        // Out of slots: fold everything into one bounding rect
+        for (int i = 0; i < damage_count; i++) rect_union(&r, &damage[i]);
+        damage_count = 0;
     }
+    damage[damage_count++] = r;
+}
+
+void gfx_damage_all(void) {
+    damage[0].x0 = damage[0].y0 = 0;
+    damage[0].x1 = fb_width;
+    damage[0].y1 = fb_height;
+    damage_count = fb_width > 0 && fb_height > 0;
+}
+
+// Copy the part of one damaged row that differs from what is on screen.
+// The backbuffer and shadow are compared in cacheable memory from both
+// ends; only the span in between is written to the framebuffer.
+static void flip_span(int y, int x0, int x1) {
+    uint32_t* src = &backbuf[y * fb_width];
+    uint32_t* shadow = &frontbuf[y * fb_width];
+    while (x0 < x1 && src[x0] == shadow[x0]) x0++;
+    while (x1 > x0 && src[x1 - 1] == shadow[x1 - 1]) x1--;
+    if (x0 == x1) return;
+    uint32_t n = (uint32_t)(x1 - x0) * 4;
+    memcpy(&framebuffer[y * (fb_pitch / 4) + x0], src + x0, n);
+    memcpy(shadow + x0, src + x0, n);
+}
+
+void flip_damage(void) {
+    for (int i = 0; i < damage_count; i++) {
+        for (int y = damage[i].y0; y < damage[i].y1; y++)
+            flip_span(y, damage[i].x0, damage[i].x1);
+    }
+    damage_count = 0;
 }
 
 void put_pixel(int x, int y, uint32_t color) {
@@ -92,20 +189,29 @@ void put_pixel_alpha(int x, int y, uint32_t color, int alpha) {
     backbuf[y * fb_width + x] = 0xFF000000 | (r << 16) | (g << 8) | b;
 }
 
+// Clip a rectangle to the screen; 0 if nothing is left
+static int clip_rect(int* x, int* y, int* w, int* h) {
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*x + *w > fb_width) *w = fb_width - *x;
+    if (*y + *h > fb_height) *h = fb_height - *y;
+    return *w > 0 && *h > 0;
+}
+
 void draw_rect(int x, int y, int w, int h, uint32_t color) {
-    for (int j = 0; j < h; j++)
-        for (int i = 0; i < w; i++)
-            put_pixel(x + i, y + j, color);
+    if (!clip_rect(&x, &y, &w, &h)) return;
+    pixel_fill(&backbuf[y * fb_width + x], fb_width, w, h, color);
 }
 
 void draw_rect_alpha(int x, int y, int w, int h, uint32_t color, int alpha) {
-    for (int j = 0; j < h; j++)
-        for (int i = 0; i < w; i++)
-            put_pixel_alpha(x + i, y + j, color, alpha);
+    if (alpha <= 0) return;
+    if (alpha >= 255) { draw_rect(x, y, w, h, color); return; }
+    if (!clip_rect(&x, &y, &w, &h)) return;
+    pixel_blend_color(&backbuf[y * fb_width + x], fb_width, w, h, color, alpha);
 }
 
 void clear_screen_gfx(uint32_t color) {
-    for (int i = 0; i < fb_width * fb_height; i++) backbuf[i] = color;
+    pixel_fill(backbuf, fb_width, fb_width, fb_height, color);
     flip_buffer();
 }
 
@@ -174,6 +280,11 @@ void draw_shadow(int x, int y, int w, int h, int layers) {
 
 // Deep space nebula desktop background
 void draw_gradient_bg(void) {
+    uint32_t size = (uint32_t)(fb_width * fb_height) * 4;
+    if (bg_cached) {
+        memcpy(backbuf, bg_cache, size);
+        return;
+    }
     rng_state = 42;
     for (int y = 0; y < fb_height; y++) {
         int ratio = (y * 255) / fb_height;
@@ -224,6 +335,8 @@ void draw_gradient_bg(void) {
         uint32_t c = acols[i%4];
         put_pixel(sx,sy,c); put_pixel(sx+1,sy,c);
     }
+    memcpy(bg_cache, backbuf, size);
+    bg_cached = 1;
 }
 
 // Mouse
@@ -247,3 +360,10 @@ void render_cursor_graphic(int x, int y) {
             else if (p == 2) put_pixel(x+i, y+j, 0xFF000000);  // black fill
         }
 }
+void cursor_graphic_argb(uint32_t* out) {
+    for (int j = 0; j < CUR_H; j++)
+        for (int i = 0; i < CUR_W; i++) {
+            uint8_t p = cursor_bmp[j][i];
+            out[j*CUR_W+i] = p == 1 ? 0xFFFFFFFF : p == 2 ? 0xFF000000 : 0x00000000;
+        }
+}
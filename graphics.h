@@ -32,7 +32,17 @@ typedef struct {
     uint8_t  framebuffer_type;
 } __attribute__((packed)) multiboot_info_t;
 
+// Entry of the mods_addr array (flags bit 3)
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;           // Exclusive
+    uint32_t cmdline;
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_module_t;
+
 void init_graphics(uint64_t addr);
+// Remap the framebuffer write-combining; call after vmm_init()
+void gfx_map_framebuffer(void);
 int get_screen_width(void);
 int get_screen_height(void);
 
@@ -55,8 +65,24 @@ void draw_shadow(int x, int y, int w, int h, int layers);
 void save_mouse_bg(int x, int y);
 void restore_mouse_bg(int x, int y);
 void render_cursor_graphic(int x, int y);
+// The same arrow as a CURSOR_W x CURSOR_H ARGB image, for a hardware cursor
+#define CURSOR_W 12
+#define CURSOR_H 19
+void cursor_graphic_argb(uint32_t* out);
 
 uint32_t* get_backbuf(void);
+
+// Copy the whole backbuffer to the screen. Also the way to resync after
+// something has drawn straight into the framebuffer.
 void flip_buffer(void);
 
+// Damage: mark backbuffer rectangles as changed, then flip_damage() copies
+// only those (and, within them, only the spans of each row that differ
+// from what the screen already shows). Overlapping rectangles are merged;
+// past GFX_DAMAGE_MAX they collapse into one bounding rectangle.
+#define GFX_DAMAGE_MAX  32
+void gfx_damage(int x, int y, int w, int h);
+void gfx_damage_all(void);
+void flip_damage(void);
+
 #endif
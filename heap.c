@@ -1,67 +1,226 @@
-// heap.c - Simple Kernel Heap
+// heap.c - Kernel Heap
+// Small requests are served from per-size-class free lists (8..4096 bytes),
+// larger ones fall back to the linear block list at HEAP_START.
 #include "heap.h"
 #include "pmm.h"
+#include "spinlock.h"
 
-// Header for each heap block
+// Tags stored in the 8 bytes immediately before every returned pointer,
+// so kfree() can tell which allocator a block came from.
+#define HEAP_TAG_LARGE   0x4C524745ULL                // "LRGE"
+#define HEAP_TAG_SLAB    0x534C4142ULL                // "SLAB" (| class << 32)
+#define HEAP_TAG_MASK    0xFFFFFFFFULL
+
+// Header for each large heap block
 typedef struct header {
     size_t size;
     uint8_t is_free;
     struct header* next;
+    struct header* prev;
+    uint64_t tag;            // HEAP_TAG_LARGE (must be last)
 } header_t;
 
 static header_t* head;
 
+// One lock for both allocators; kmalloc/kfree may be called from any CPU
+static lockstat_t heap_lock_stat = LOCKSTAT_INIT("heap");
+static spinlock_t heap_lock = SPINLOCK_INIT_STAT(heap_lock_stat);
+
+// Smallest remainder worth splitting off into its own free block
+#define HEAP_MIN_SPLIT   (sizeof(header_t) + 32)
+
 // Start heap at 100MB
-#define HEAP_START 0x6400000 
+#define HEAP_START 0x6400000
+
+// ---- Size-class (slab) allocator ----
+
+// Classes are powers of two: 8, 16, 32, ... 4096
+#define SLAB_MIN_SHIFT   3
+#define SLAB_MAX_SHIFT   12
+#define SLAB_NUM_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_MAX_SIZE    (1UL << SLAB_MAX_SHIFT)
+
+// Bytes carved from the large heap each time a class runs dry
+#define SLAB_REFILL_SIZE (16 * 1024)
+
+// A free object reuses its payload as the free-list link
+typedef struct slab_obj {
+    struct slab_obj* next;
+} slab_obj_t;
+
+static slab_obj_t* slab_free[SLAB_NUM_CLASSES];
+static uint64_t slab_cached_bytes = 0;   // Bytes sitting on class free lists
+
+static void* kmalloc_large(size_t size);
+
+// Map a request size to its class index (smallest class >= size)
+static inline int slab_class_for(size_t size) {
+    if (size <= (1UL << SLAB_MIN_SHIFT)) return 0;
+    int shift = 64 - __builtin_clzll((uint64_t)(size - 1));
+    return shift - SLAB_MIN_SHIFT;
+}
+
+// Carve a fresh batch of objects for a class out of the large heap
+static int slab_refill(int cls) {
+    size_t obj_size = 1UL << (cls + SLAB_MIN_SHIFT);
+    size_t stride = obj_size + sizeof(uint64_t);
+    size_t count = SLAB_REFILL_SIZE / stride;
+    if (count < 4) count = 4;
+
+    uint8_t* chunk = (uint8_t*)kmalloc_large(count * stride);
+    if (!chunk) return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t* tag = (uint64_t*)(chunk + i * stride);
+        *tag = HEAP_TAG_SLAB | ((uint64_t)cls << 32);
+        slab_obj_t* obj = (slab_obj_t*)(tag + 1);
+        obj->next = slab_free[cls];
+        slab_free[cls] = obj;
+    }
+    slab_cached_bytes += count * obj_size;
+    return 0;
+}
 
 void heap_init() {
     head = (header_t*)HEAP_START;
     head->size = 0; // Initial empty state
     head->is_free = 0;
     head->next = 0;
+    head->prev = 0;
+    head->tag = HEAP_TAG_LARGE;
+
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) slab_free[i] = 0;
 }
 
 void* kmalloc(size_t size) {
     if (size == 0) return 0;
-    
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    void* ptr;
+    if (size > SLAB_MAX_SIZE) {
+        ptr = kmalloc_large(size);
+    } else {
+        int cls = slab_class_for(size);
+        if (!slab_free[cls] && slab_refill(cls) < 0) {
+            ptr = 0;
+        } else {
+            slab_obj_t* obj = slab_free[cls];
+            slab_free[cls] = obj->next;
+            slab_cached_bytes -= 1UL << (cls + SLAB_MIN_SHIFT);
+            ptr = (void*)obj;
+        }
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return ptr;
+}
+
+// Linear free-list allocator for requests above the largest size class
+static void* kmalloc_large(size_t size) {
     // Align size to 8 bytes
     size_t aligned_size = (size + 7) & ~7;
-    size_t total_size = aligned_size + sizeof(header_t);
-    
+
     header_t* curr = head;
-    
+
     // 1. Find a free block
     while (curr) {
-        if (curr->is_free && curr->size >= total_size) {
-            // Split block logic could go here
+        if (curr->is_free && curr->size >= aligned_size) {
+            // Split off the tail if it is big enough to be useful on its own
+            if (curr->size >= aligned_size + HEAP_MIN_SPLIT) {
+                header_t* rest = (header_t*)((uint64_t)(curr + 1) + aligned_size);
+                rest->size = curr->size - aligned_size - sizeof(header_t);
+                rest->is_free = 1;
+                rest->next = curr->next;
+                rest->prev = curr;
+                rest->tag = HEAP_TAG_LARGE;
+                if (rest->next) rest->next->prev = rest;
+                curr->next = rest;
+                curr->size = aligned_size;
+            }
             curr->is_free = 0;
             return (void*)(curr + 1);
         }
         if (curr->next == 0) break; // Reached end
         curr = curr->next;
     }
-    
+
     // 2. No free block, extend heap (Ask PMM for more RAM)
     // For simplicity, we just increment the pointer in our large identity mapped space
     // In a full VMM, we would map a new page here.
-    
+
     header_t* new_block = (curr == head && curr->size == 0) ? head : (header_t*)((uint64_t)curr + sizeof(header_t) + curr->size);
-    
+
     new_block->size = aligned_size;
     new_block->is_free = 0;
     new_block->next = 0;
-    
+    new_block->prev = (curr != new_block) ? curr : 0;
+    new_block->tag = HEAP_TAG_LARGE;
+
     if (curr != new_block) {
         curr->next = new_block;
     }
-    
+
     return (void*)(new_block + 1);
 }
 
+static void kfree_locked(void* ptr);
+
 void kfree(void* ptr) {
     if (!ptr) return;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    kfree_locked(ptr);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+static void kfree_locked(void* ptr) {
+    uint64_t tag = ((uint64_t*)ptr)[-1];
+
+    // Small object: push back onto its class free list
+    if ((tag & HEAP_TAG_MASK) == HEAP_TAG_SLAB) {
+        int cls = (int)(tag >> 32);
+        if (cls >= SLAB_NUM_CLASSES) return;
+        slab_obj_t* obj = (slab_obj_t*)ptr;
+        obj->next = slab_free[cls];
+        slab_free[cls] = obj;
+        slab_cached_bytes += 1UL << (cls + SLAB_MIN_SHIFT);
+        return;
+    }
+    if (tag != HEAP_TAG_LARGE) return; // Not a heap pointer
+
     header_t* header = (header_t*)ptr - 1;
+    if (header->is_free) return; // Double free
     header->is_free = 1;
-    
-    // TODO: Merge adjacent free blocks to prevent fragmentation
-}
\ No newline at end of file
+
+    // The block list is address-ordered and contiguous, so list neighbours
+    // are also physical neighbours and can be merged directly.
+    header_t* next = header->next;
+    if (next && next->is_free) {
+        header->size += sizeof(header_t) + next->size;
+        header->next = next->next;
+        if (header->next) header->next->prev = header;
+    }
+    header_t* prev = header->prev;
+    if (prev && prev->is_free) {
+        prev->size += sizeof(header_t) + header->size;
+        prev->next = header->next;
+        if (prev->next) prev->next->prev = prev;
+    }
+}
+
+heap_stats_t heap_get_stats(void) {
+    heap_stats_t st = {0};
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    for (header_t* curr = head; curr; curr = curr->next) {
+        if (curr == head && curr->size == 0 && !curr->next) break; // Empty heap
+        st.total_bytes += sizeof(header_t) + curr->size;
+        st.block_count++;
+        if (curr->is_free) {
+            st.free_bytes += curr->size;
+            st.free_blocks++;
+            if (curr->size > st.largest_free) st.largest_free = curr->size;
+        } else {
+            st.used_bytes += curr->size;
+        }
+    }
+    st.slab_cached_bytes = slab_cached_bytes;
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return st;
+}
@@ -4,8 +4,20 @@
 
 #include "stdint.h"
 
+// Heap usage / fragmentation snapshot (large block list + slab caches)
+typedef struct {
+    uint64_t total_bytes;        // Bytes spanned by the block list (incl. headers)
+    uint64_t used_bytes;         // Payload bytes in allocated blocks
+    uint64_t free_bytes;         // Payload bytes in free blocks
+    uint64_t largest_free;       // Largest single free block
+    uint64_t slab_cached_bytes;  // Free objects held on size-class lists
+    uint32_t block_count;        // Blocks in the list
+    uint32_t free_blocks;        // Free blocks in the list
+} heap_stats_t;
+
 void heap_init();
 void* kmalloc(size_t size);
 void kfree(void* ptr);
+heap_stats_t heap_get_stats(void);
 
 #endif
\ No newline at end of file
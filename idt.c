@@ -31,4 +31,5 @@ void idt_init() {
 
     // Load the IDT
     idt_flush((uint64_t)&idtp);
-}
\ No newline at end of file
+}
+
@@ -0,0 +1,74 @@
+// input.c - Desktop Input Queue for Alteo OS
+// A ring of events under an IRQ-safe lock. Producers are IRQ handlers;
+// the one consumer is the desktop loop on the BSP.
+#include "input.h"
+#include "spinlock.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "cpuidle.h"
+
+static input_event_t queue[INPUT_QUEUE_SIZE];
+static uint32_t head = 0, tail = 0;      // Free-running; tail - head = queued
+static spinlock_t input_lock = SPINLOCK_INIT;
+
+// Append ev (input_lock held); dropped if the queue is full
+static void push_locked(const input_event_t* ev) {
+    if (tail - head < INPUT_QUEUE_SIZE) queue[tail++ & (INPUT_QUEUE_SIZE - 1)] = *ev;
+}
+
+void input_push_key(char c) {
+    input_event_t ev = { INPUT_KEY, c, 0, 0, 0 };
+    uint64_t flags = spin_lock_irqsave(&input_lock);
+    push_locked(&ev);
+    spin_unlock_irqrestore(&input_lock, flags);
+}
+
+void input_push_mouse(int x, int y, uint8_t buttons) {
+    uint64_t flags = spin_lock_irqsave(&input_lock);
+    input_event_t* last = &queue[(tail - 1) & (INPUT_QUEUE_SIZE - 1)];
+    if (tail != head && last->type == INPUT_MOUSE && last->buttons == buttons) {
+        last->x = x;
+        last->y = y;
+    } else {
+        input_event_t ev = { INPUT_MOUSE, 0, buttons, x, y };
+        push_locked(&ev);
+    }
+    spin_unlock_irqrestore(&input_lock, flags);
+}
+
+int input_pop(input_event_t* ev) {
+    uint64_t flags = spin_lock_irqsave(&input_lock);
+    int got = tail != head;
+    if (got) *ev = queue[head++ & (INPUT_QUEUE_SIZE - 1)];
+    spin_unlock_irqrestore(&input_lock, flags);
+    return got;
+}
+
+// Nothing to do: the timer interrupt that runs it has already ended the hlt
+static void input_timer_fn(uint64_t arg) {
+    (void)arg;
+}
+
+void input_wait(uint64_t deadline_ns) {
+    int id = -1;
+    if (deadline_ns != ~0ULL) id = timer_add(deadline_ns, input_timer_fn, 0);
+    // Without a timer event to end it, a hlt could outlast the deadline
+    int can_halt = deadline_ns == ~0ULL || id >= 0;
+
+    for (;;) {
+        __asm__ volatile("cli");
+        if (tail != head || timer_now_ns() >= deadline_ns) break;
+        if (scheduler_ready_count() > 0) {
+            __asm__ volatile("sti");
+            scheduler_yield();
+        } else if (can_halt) {
+            // Enabling interrupts is the idle entry's last step, so an IRQ
+            // that lands after the check still ends the idle
+            cpuidle_enter(deadline_ns);
+        } else {
+            __asm__ volatile("sti; pause");
+        }
+    }
+    __asm__ volatile("sti");
+    if (id >= 0) timer_cancel(id);
+}
@@ -0,0 +1,40 @@
+// input.h - Desktop Input Queue for Alteo OS
+// The keyboard and mouse IRQ handlers queue events here instead of acting
+// on them. The desktop loop drains the queue and sleeps in input_wait
+// until the next event or deadline, so an idle desktop leaves the CPU
+// halted instead of spinning.
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "stdint.h"
+
+#define INPUT_QUEUE_SIZE 256    // Events; a power of two
+
+// Event types
+#define INPUT_KEY        1
+#define INPUT_MOUSE      2
+
+typedef struct {
+    uint8_t type;
+    char    key;                // INPUT_KEY: ASCII
+    uint8_t buttons;            // INPUT_MOUSE: bit 0 left, 1 right, 2 middle
+    int     x, y;               // INPUT_MOUSE: absolute position
+} input_event_t;
+
+// Queue a key press (IRQ context). Dropped if the queue is full.
+void input_push_key(char c);
+
+// Queue the mouse position and buttons (IRQ context). A move with the
+// same buttons as a move still in the queue replaces it, so the desktop
+// sees the latest position and every button change, however far behind.
+void input_push_mouse(int x, int y, uint8_t buttons);
+
+// Take the oldest event; 0 if the queue is empty
+int input_pop(input_event_t* ev);
+
+// Sleep until an event is queued or timer_now_ns() reaches deadline_ns
+// (~0ULL: no deadline). Other processes ready on this CPU run meanwhile;
+// it halts only when there are none.
+void input_wait(uint64_t deadline_ns);
+
+#endif
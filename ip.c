@@ -1,24 +1,20 @@
 // ip.c - IPv4 Network Layer for Alteo OS
 #include "ip.h"
+#include "klib.h"
 #include "ethernet.h"
 #include "tcp.h"
+#include "udp.h"
+#include "loopback.h"
+#include "spinlock.h"
+#include "rcu.h"
 
 // Network configuration
 static net_config_t net_cfg = {0};
-static route_entry_t route_table[MAX_ROUTES];
 static uint16_t ip_id_counter = 0;
+static ip_stats_t ip_stats;
 
-// Memory helper
-static void ip_memcpy(void* dst, const void* src, int n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (int i = 0; i < n; i++) d[i] = s[i];
-}
-
-static void ip_memset(void* dst, uint8_t val, int n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (int i = 0; i < n; i++) d[i] = val;
-}
+static void route_reset(void);
+static uint32_t route_next_hop(uint32_t dest_ip, int** neigh);
 
 void ip_init(void) {
     // Default configuration (10.0.2.15 for QEMU)
@@ -28,13 +24,7 @@ void ip_init(void) {
     net_cfg.dns_server = IP_ADDR(10, 0, 2, 3);
     net_cfg.broadcast = IP_ADDR(10, 0, 2, 255);
 
-    // Clear route table
-    for (int i = 0; i < MAX_ROUTES; i++)
-        route_table[i].active = 0;
-
-    // Add default route
-    route_add(IP_ADDR(10, 0, 2, 0), IP_ADDR(255, 255, 255, 0), 0, 0);
-    route_add(0, 0, IP_ADDR(10, 0, 2, 2), 100); // Default gateway
+    route_reset();
 }
 
 void ip_configure(uint32_t ip, uint32_t netmask, uint32_t gateway, uint32_t dns) {
@@ -43,6 +33,7 @@ void ip_configure(uint32_t ip, uint32_t netmask, uint32_t gateway, uint32_t dns)
     net_cfg.gateway = gateway;
     net_cfg.dns_server = dns;
     net_cfg.broadcast = (ip & netmask) | (~netmask);
+    route_reset();
 }
 
 net_config_t* ip_get_config(void) {
@@ -67,75 +58,124 @@ uint16_t ip_checksum(const void* data, uint16_t length) {
     return (uint16_t)(~sum);
 }
 
+int ip_is_local(uint32_t ip) {
+    return IP_IS_LOOPBACK(ip) || ip == net_cfg.ip_addr;
+}
+
+uint32_t ip_source_addr(uint32_t dest_ip) {
+    return IP_IS_LOOPBACK(dest_ip) ? IP_LOOPBACK_ADDR : net_cfg.ip_addr;
+}
+
+int ip_tx_offloads(uint32_t dest_ip) {
+    if (ip_is_local(dest_ip)) return ETH_TX_CSUM | ETH_TX_TSO;
+    return eth_tx_offloads();
+}
+
 int ip_send(uint32_t dest_ip, uint8_t protocol, const uint8_t* data, uint16_t length) {
-    if (length + IP_HEADER_LEN > ETH_MTU) return -1;
+    return ip_send_gather(dest_ip, protocol, 0, 0, data, length, 0);
+}
+
+int ip_send_gather(uint32_t dest_ip, uint8_t protocol,
+                   const uint8_t* thdr, uint16_t thdr_len,
+                   const uint8_t* payload, uint16_t payload_len, int flags) {
+    uint32_t length = (uint32_t)thdr_len + payload_len;
+    ip_stats.out_requests++;
+    if (length + IP_HEADER_LEN > ((flags & ETH_TX_TSO) ? 0xFFFFu : ETH_MTU) ||
+        IP_HEADER_LEN + thdr_len > ETH_TX_HDR_MAX) {
+        ip_stats.out_discards++;
+        return -1;
+    }
 
-    uint8_t packet[ETH_MTU];
+    // IP header plus transport header; the payload is not copied here
+    uint8_t packet[ETH_TX_HDR_MAX];
     ip_header_t* hdr = (ip_header_t*)packet;
 
     // Build IP header
     hdr->version_ihl = (IP_VERSION_4 << 4) | (IP_HEADER_LEN / 4);
     hdr->tos = 0;
-    hdr->total_length = htons(IP_HEADER_LEN + length);
+    hdr->total_length = htons((uint16_t)(IP_HEADER_LEN + length));
     hdr->id = htons(ip_id_counter++);
     hdr->flags_frag = htons(IP_FLAG_DF);
     hdr->ttl = 64;
     hdr->protocol = protocol;
     hdr->checksum = 0;
-    hdr->src_ip = htonl(net_cfg.ip_addr);
+    hdr->src_ip = htonl(ip_source_addr(dest_ip));
     hdr->dst_ip = htonl(dest_ip);
+    int local = ip_is_local(dest_ip);
 
-    // Calculate checksum
-    hdr->checksum = ip_checksum(hdr, IP_HEADER_LEN);
+    // Calculate checksum, unless the NIC fills it in (per segment with TSO,
+    // which also rewrites the length and id) or loopback delivers it as verified
+    if (!local && !(flags & (ETH_TX_CSUM | ETH_TX_TSO)))
+        hdr->checksum = ip_checksum(hdr, IP_HEADER_LEN);
 
-    // Copy payload
-    ip_memcpy(packet + IP_HEADER_LEN, data, length);
+    // Copy the transport header behind ours
+    if (thdr_len) memcpy(packet + IP_HEADER_LEN, thdr, thdr_len);
 
-    // Determine next hop
-    uint32_t next_hop = dest_ip;
-    if ((dest_ip & net_cfg.netmask) != (net_cfg.ip_addr & net_cfg.netmask)) {
-        next_hop = net_cfg.gateway; // Use gateway for different subnet
+    // Local traffic never reaches the NIC
+    if (local) {
+        ip_stats.out_local++;
+        return lo_xmit(packet, IP_HEADER_LEN + thdr_len, payload, payload_len);
     }
 
     // Resolve MAC via ARP
     uint8_t dest_mac[6];
     if (dest_ip == net_cfg.broadcast || dest_ip == 0xFFFFFFFF) {
         // Broadcast
-        ip_memset(dest_mac, 0xFF, 6);
+        memset(dest_mac, 0xFF, 6);
     } else {
-        if (arp_resolve(next_hop, dest_mac) != 0) {
-            return -2; // ARP resolution pending
+        // Next hop and its ARP slot from the route cache
+        int* neigh;
+        uint32_t next_hop = route_next_hop(dest_ip, &neigh);
+        if (arp_resolve_slot(next_hop, dest_mac, neigh) != 0) {
+            // Held until the reply arrives; -2 if it cannot be
+            int r = arp_queue(next_hop, ETH_TYPE_IPV4, packet, IP_HEADER_LEN + thdr_len,
+                              payload, payload_len, flags);
+            if (r < 0) ip_stats.out_no_neigh++;
+            return r;
         }
     }
 
-    return eth_send(dest_mac, ETH_TYPE_IPV4, packet, IP_HEADER_LEN + length);
+    return eth_send_gather(dest_mac, ETH_TYPE_IPV4, packet, IP_HEADER_LEN + thdr_len,
+                           payload, payload_len, flags);
 }
 
-void ip_receive(const uint8_t* data, uint16_t length) {
-    if (length < IP_HEADER_LEN) return;
+void ip_receive(const uint8_t* data, uint16_t length, int flags) {
+    ip_stats.in_receives++;
+    if (length < IP_HEADER_LEN) {
+        ip_stats.in_hdr_errors++;
+        return;
+    }
 
     const ip_header_t* hdr = (const ip_header_t*)data;
 
-    // Verify version
+    // Verify version and lengths
     uint8_t version = (hdr->version_ihl >> 4) & 0xF;
-    if (version != 4) return;
-
-    // Get header length
     uint8_t ihl = (hdr->version_ihl & 0xF) * 4;
-    if (ihl < IP_HEADER_LEN || ihl > length) return;
+    uint16_t total = ntohs(hdr->total_length);
+    if (version != 4 || ihl < IP_HEADER_LEN || ihl > total || total > length) {
+        ip_stats.in_hdr_errors++;
+        return;
+    }
 
     // Verify checksum
-    if (ip_checksum(hdr, ihl) != 0) return;
+    if (!(flags & ETH_RX_CSUM_OK) && ip_checksum(hdr, ihl) != 0) {
+        ip_stats.in_csum_errors++;
+        return;
+    }
 
     uint32_t dest = ntohl(hdr->dst_ip);
     // Check if packet is for us
-    if (dest != net_cfg.ip_addr && dest != net_cfg.broadcast && dest != 0xFFFFFFFF)
+    if (dest != net_cfg.ip_addr && dest != net_cfg.broadcast && dest != 0xFFFFFFFF &&
+        !IP_IS_LOOPBACK(dest)) {
+        ip_stats.in_addr_errors++;
         return;
+    }
 
     uint32_t src = ntohl(hdr->src_ip);
-    uint16_t payload_len = ntohs(hdr->total_length) - ihl;
+    uint16_t payload_len = total - ihl;
     const uint8_t* payload = data + ihl;
 
+    ip_stats.in_delivers++;
     switch (hdr->protocol) {
         case IP_PROTO_ICMP:
             icmp_process(src, payload, payload_len);
@@ -144,13 +184,19 @@ void ip_receive(const uint8_t* data, uint16_t length) {
             tcp_receive(src, dest, payload, payload_len);
             break;
         case IP_PROTO_UDP:
-            // UDP handling (future)
+            udp_receive(src, dest, payload, payload_len);
             break;
         default:
+            ip_stats.in_delivers--;
+            ip_stats.in_unknown_protos++;
             break;
     }
 }
 
+void ip_get_stats(ip_stats_t* out) {
+    if (out) *out = ip_stats;
+}
+
 // ---- ICMP ----
 
 static uint16_t ping_id = 1;
@@ -197,7 +243,7 @@ void icmp_process(uint32_t src_ip, const uint8_t* data, uint16_t length) {
             if (copy_len > 0) {
                 if (copy_len > (int)(ETH_MTU - sizeof(icmp_header_t)))
                     copy_len = ETH_MTU - sizeof(icmp_header_t);
-                ip_memcpy(reply + sizeof(icmp_header_t),
+                memcpy(reply + sizeof(icmp_header_t),
                           data + sizeof(icmp_header_t), copy_len);
             }
 
@@ -235,45 +281,210 @@ int ping(uint32_t dest_ip, int count) {
 
 // ---- Routing ----
 
-void route_add(uint32_t network, uint32_t netmask, uint32_t gateway, int metric) {
-    for (int i = 0; i < MAX_ROUTES; i++) {
-        if (!route_table[i].active) {
-            route_table[i].network = network;
-            route_table[i].netmask = netmask;
-            route_table[i].gateway = gateway;
-            route_table[i].metric = metric;
-            route_table[i].active = 1;
+// Path-compressed binary trie over the active prefixes: a node stands for
+// the first plen bits of prefix and carries the best route for exactly
+// that prefix, if any. Children differ in bit plen. The table is small and
+// rarely changes, so the trie is rebuilt from scratch on every change.
+typedef struct {
+    uint32_t prefix;
+    uint8_t  plen;
+    int      route;             // Index into the set's table, -1 for a branch point
+    int      child[2];
+} route_node_t;
+
+// One version of the table and its trie. Lookups read the published set
+// under rcu_read_lock() without locking; a change is made on the other
+// set, published, and the old one is reused only after a grace period.
+typedef struct {
+    route_entry_t table[MAX_ROUTES];
+    route_node_t  nodes[2 * MAX_ROUTES];
+    int           node_count;
+    int           root;
+    uint32_t      gen;          // Bumped on every change; 0 never matches
+} route_set_t;
+
+// Cached lookup result for one destination
+typedef struct {
+    uint32_t dest;
+    uint32_t next_hop;
+    uint32_t gen;               // Set's gen when filled
+    int      neigh;             // ARP cache slot hint for next_hop
+} route_cache_t;
+
+static route_set_t route_sets[2] = { { .root = -1 }, { .root = -1 } };
+static route_set_t* routes = &route_sets[0];    // Published set (RCU)
+static spinlock_t route_lock = SPINLOCK_INIT;   // Serializes changes
+// Per CPU, so lookups only write lines their own CPU owns
+static route_cache_t route_cache[SMP_MAX_CPUS][ROUTE_CACHE_SIZE];
+
+static uint32_t prefix_mask(int plen) {
+    return plen ? 0xFFFFFFFFu << (32 - plen) : 0;
+}
+
+static int prefix_bit(uint32_t addr, int pos) {
+    return (int)((addr >> (31 - pos)) & 1);
+}
+
+static int prefix_len(uint32_t netmask) {
+    int n = 0;
+    while (n < 32 && (netmask & (0x80000000u >> n))) n++;
+    return n;
+}
+
+static int route_node_new(route_set_t* s, uint32_t prefix, int plen, int route) {
+    route_node_t* n = &s->nodes[s->node_count];
+    n->prefix = prefix & prefix_mask(plen);
+    n->plen = (uint8_t)plen;
+    n->route = route;
+    n->child[0] = n->child[1] = -1;
+    return s->node_count++;
+}
+
+static void route_trie_insert(route_set_t* s, uint32_t prefix, int plen, int route) {
+    int* link = &s->root;
+    for (;;) {
+        if (*link < 0) {
+            *link = route_node_new(s, prefix, plen, route);
             return;
         }
+        route_node_t* n = &s->nodes[*link];
+
+        // Bits the node's prefix and the new one share
+        int max = n->plen < plen ? n->plen : plen;
+        uint32_t diff = (n->prefix ^ prefix) & prefix_mask(max);
+        int common = diff ? __builtin_clz(diff) : max;
+
+        if (common == n->plen && common == plen) {
+            // Same prefix: keep the lower metric
+            if (n->route < 0 || s->table[route].metric < s->table[n->route].metric)
+                n->route = route;
+            return;
+        }
+        if (common == n->plen) {
+            link = &n->child[prefix_bit(prefix, n->plen)];
+            continue;
+        }
+
+        // The new prefix ends or branches off inside this node's
+        int old = *link;
+        int mid;
+        if (common == plen) {
+            mid = route_node_new(s, prefix, plen, route);
+        } else {
+            mid = route_node_new(s, prefix, common, -1);
+            s->nodes[mid].child[prefix_bit(prefix, common)] = route_node_new(s, prefix, plen, route);
+        }
+        s->nodes[mid].child[prefix_bit(s->nodes[old].prefix, common)] = old;
+        *link = mid;
+        return;
     }
 }
 
-void route_remove(uint32_t network) {
+// Start a change: lock out other writers and copy the published table
+// into the spare set
+static route_set_t* route_begin(void) {
+    spin_lock(&route_lock);
+    route_set_t* s = routes == &route_sets[0] ? &route_sets[1] : &route_sets[0];
+    memcpy(s->table, routes->table, sizeof(s->table));
+    s->gen = routes->gen;
+    return s;
+}
+
+// Build the spare set's trie, publish it and wait out readers of the old one
+static void route_commit(route_set_t* s) {
+    s->node_count = 0;
+    s->root = -1;
+    for (int i = 0; i < MAX_ROUTES; i++) {
+        if (!s->table[i].active) continue;
+        int plen = prefix_len(s->table[i].netmask);
+        route_trie_insert(s, s->table[i].network, plen, i);
+    }
+    s->gen++;
+    if (s->gen == 0) s->gen = 1;
+    rcu_assign_pointer(routes, s);
+    synchronize_rcu();
+    spin_unlock(&route_lock);
+}
+
+static void route_set_add(route_set_t* s, uint32_t network, uint32_t netmask,
+                          uint32_t gateway, int metric) {
     for (int i = 0; i < MAX_ROUTES; i++) {
-        if (route_table[i].active && route_table[i].network == network) {
-            route_table[i].active = 0;
+        if (!s->table[i].active) {
+            s->table[i].network = network & netmask;
+            s->table[i].netmask = netmask;
+            s->table[i].gateway = gateway;
+            s->table[i].metric = metric;
+            s->table[i].active = 1;
             return;
         }
     }
 }
 
-uint32_t route_lookup(uint32_t dest_ip) {
-    uint32_t best_gw = net_cfg.gateway;
-    int best_metric = 999999;
-    uint32_t longest_mask = 0;
+// Connected subnet and default gateway for the current configuration
+static void route_reset(void) {
+    route_set_t* s = route_begin();
+    for (int i = 0; i < MAX_ROUTES; i++)
+        s->table[i].active = 0;
+    route_set_add(s, net_cfg.ip_addr & net_cfg.netmask, net_cfg.netmask, 0, 0);
+    route_set_add(s, 0, 0, net_cfg.gateway, 100); // Default gateway
+    route_commit(s);
+}
+
+// Longest-prefix match in set s
+static uint32_t route_set_lookup(const route_set_t* s, uint32_t dest_ip) {
+    // Deepest node on the path that carries a route
+    int best = -1;
+    for (int i = s->root; i >= 0; ) {
+        const route_node_t* n = &s->nodes[i];
+        if ((dest_ip & prefix_mask(n->plen)) != n->prefix) break;
+        if (n->route >= 0) best = n->route;
+        if (n->plen == 32) break;
+        i = n->child[prefix_bit(dest_ip, n->plen)];
+    }
+    if (best < 0) return net_cfg.gateway;
+    return s->table[best].gateway ? s->table[best].gateway : dest_ip;
+}
+
+// Next hop for dest through the route cache; *neigh is the entry's ARP hint
+static uint32_t route_next_hop(uint32_t dest_ip, int** neigh) {
+    uint64_t flags = rcu_read_lock();
+    const route_set_t* s = rcu_dereference(routes);
+    route_cache_t* rc = &route_cache[smp_this_cpu()->cpu]
+                                    [((dest_ip * 2654435761u) >> 24) & (ROUTE_CACHE_SIZE - 1)];
+    if (rc->gen != s->gen || rc->dest != dest_ip) {
+        rc->dest = dest_ip;
+        rc->next_hop = route_set_lookup(s, dest_ip);
+        rc->gen = s->gen;
+        rc->neigh = -1;
+    }
+    uint32_t next_hop = rc->next_hop;
+    rcu_read_unlock(flags);
+    *neigh = &rc->neigh;
+    return next_hop;
+}
+
+void route_add(uint32_t network, uint32_t netmask, uint32_t gateway, int metric) {
+    route_set_t* s = route_begin();
+    route_set_add(s, network, netmask, gateway, metric);
+    route_commit(s);
+}
 
+void route_remove(uint32_t network) {
+    route_set_t* s = route_begin();
     for (int i = 0; i < MAX_ROUTES; i++) {
-        if (!route_table[i].active) continue;
-        if ((dest_ip & route_table[i].netmask) == route_table[i].network) {
-            if (route_table[i].netmask > longest_mask ||
-                (route_table[i].netmask == longest_mask && route_table[i].metric < best_metric)) {
-                longest_mask = route_table[i].netmask;
-                best_metric = route_table[i].metric;
-                best_gw = route_table[i].gateway ? route_table[i].gateway : dest_ip;
-            }
+        if (s->table[i].active && s->table[i].network == network) {
+            s->table[i].active = 0;
+            break;
         }
     }
-    return best_gw;
+    route_commit(s);
+}
+
+uint32_t route_lookup(uint32_t dest_ip) {
+    uint64_t flags = rcu_read_lock();
+    uint32_t next_hop = route_set_lookup(rcu_dereference(routes), dest_ip);
+    rcu_read_unlock(flags);
+    return next_hop;
 }
 
 // ---- Utility ----
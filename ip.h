@@ -25,7 +25,8 @@
 #define ICMP_TIME_EXCEEDED  11
 
 // Maximum route table entries
-#define MAX_ROUTES      8
+#define MAX_ROUTES      64
+#define ROUTE_CACHE_SIZE 256    // Per-destination next hops (power of two)
 
 // IPv4 header
 typedef struct __attribute__((packed)) {
@@ -75,20 +76,56 @@ typedef struct {
 #define IP_C(ip) (((ip)>>8)&0xFF)
 #define IP_D(ip) ((ip)&0xFF)
 
+// Counters for /proc/net/snmp
+typedef struct {
+    uint64_t in_receives;
+    uint64_t in_hdr_errors;     // Bad version or lengths
+    uint64_t in_csum_errors;
+    uint64_t in_addr_errors;    // Not addressed to us
+    uint64_t in_unknown_protos;
+    uint64_t in_delivers;       // Handed to ICMP, TCP or UDP
+    uint64_t out_requests;
+    uint64_t out_discards;      // Too long
+    uint64_t out_no_neigh;      // Next hop unresolved, packet not held
+    uint64_t out_local;         // Sent over loopback
+} ip_stats_t;
+
 // Initialize IP layer
 void ip_init(void);
 
-// Configure network
+// Configure network (replaces the table with the connected and default routes)
 void ip_configure(uint32_t ip, uint32_t netmask, uint32_t gateway, uint32_t dns);
 
 // Get current network configuration
 net_config_t* ip_get_config(void);
 
+void ip_get_stats(ip_stats_t* out);
+
+// Loopback: 127.0.0.0/8 and our own address go through loopback.c
+#define IP_LOOPBACK_ADDR IP_ADDR(127, 0, 0, 1)
+#define IP_IS_LOOPBACK(ip) (((ip) >> 24) == 127)
+int ip_is_local(uint32_t ip);
+
+// Source address for packets to dest_ip (127.0.0.1 toward 127.0.0.0/8)
+uint32_t ip_source_addr(uint32_t dest_ip);
+
+// ETH_TX_CSUM / ETH_TX_TSO available on the way to dest_ip: both for
+// local destinations, else what the NIC offers
+int ip_tx_offloads(uint32_t dest_ip);
+
 // Send an IP packet
 int ip_send(uint32_t dest_ip, uint8_t protocol, const uint8_t* data, uint16_t length);
 
-// Process a received IP packet
-void ip_receive(const uint8_t* data, uint16_t length);
+// Send an IP packet whose transport header and payload are separate
+// buffers (flags: ETH_TX_ZEROCOPY passes the payload by reference,
+// ETH_TX_CSUM / ETH_TX_TSO leave the header checksum to the NIC)
+int ip_send_gather(uint32_t dest_ip, uint8_t protocol,
+                   const uint8_t* hdr, uint16_t hdr_len,
+                   const uint8_t* payload, uint16_t payload_len, int flags);
+
+// Process a received IP packet (flags: ETH_RX_CSUM_OK skips the header
+// checksum the NIC has already verified)
+void ip_receive(const uint8_t* data, uint16_t length, int flags);
 
 // Calculate IP checksum
 uint16_t ip_checksum(const void* data, uint16_t length);
@@ -100,7 +137,10 @@ void icmp_process(uint32_t src_ip, const uint8_t* data, uint16_t length);
 // Ping utility
 int  ping(uint32_t dest_ip, int count);
 
-// Route management
+// Route management. Lookups walk a path-compressed binary trie over the
+// prefixes (rebuilt when the table changes); ip_send_gather goes through a
+// per-destination cache of the result, which also remembers the next
+// hop's ARP entry.
 void route_add(uint32_t network, uint32_t netmask, uint32_t gateway, int metric);
 void route_remove(uint32_t network);
 uint32_t route_lookup(uint32_t dest_ip);
@@ -3,6 +3,7 @@
 #include "idt.h"
 #include "isr.h"
 #include "apic.h"
+#include "random.h"
 
 // PIC Ports
 #define PIC1_COMMAND 0x20
@@ -96,6 +97,7 @@ void irq_enable_all() {
 // Main Handler called from Assembly
 void irq_handler(registers_t* regs) {
     int irq = regs->int_no - 32;
+    random_add_irq(irq);
     
     // Call the specific handler if it exists
     if (irq_handlers[irq] != 0) {
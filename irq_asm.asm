@@ -30,6 +30,11 @@ IRQ 14, 46
 IRQ 15, 47
 
 irq_common_stub:
+    test byte [rsp + 24], 3 ; From ring 3: switch to the kernel GS base
+    jz .kernel_gs
+    swapgs
+.kernel_gs:
+
     ; Push all general purpose registers
     push rax
     push rbx
@@ -76,5 +81,9 @@ irq_common_stub:
     pop rax
     
     add rsp, 16
+    test byte [rsp + 8], 3  ; Back to ring 3: user GS base
+    jz .user_gs
+    swapgs
+.user_gs:
     sti
     iretq
\ No newline at end of file
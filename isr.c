@@ -1,6 +1,9 @@
 // isr.c - ISR implementation
 #include "isr.h"
 #include "idt.h"
+#include "apic.h"
+#include "spinlock.h"
+#include "random.h"
 
 // Interrupt handler array
 isr_handler_t interrupt_handlers[256];
@@ -18,6 +21,56 @@ void isr_register_handler(uint8_t n, isr_handler_t handler) {
     interrupt_handlers[n] = handler;
 }
 
+static spinlock_t vector_lock = SPINLOCK_INIT;
+static isr_msi_fn msi_fn[ISR_MSI_COUNT];
+static void* msi_ctx[ISR_MSI_COUNT];
+
+int isr_alloc_vector(isr_handler_t handler) {
+    if (!handler) return -1;
+    uint64_t flags = spin_lock_irqsave(&vector_lock);
+    for (int v = ISR_MSI_BASE; v < ISR_MSI_BASE + ISR_MSI_COUNT; v++) {
+        if (!interrupt_handlers[v]) {
+            interrupt_handlers[v] = handler;
+            spin_unlock_irqrestore(&vector_lock, flags);
+            return v;
+        }
+    }
+    spin_unlock_irqrestore(&vector_lock, flags);
+    return -1;
+}
+
+static void isr_msi_dispatch(registers_t* regs) {
+    int i = (int)regs->int_no - ISR_MSI_BASE;
+    random_add_irq((int)regs->int_no);
+    if (msi_fn[i]) msi_fn[i](msi_ctx[i]);
+    lapic_eoi();
+}
+
+int isr_alloc_msi(isr_msi_fn fn, void* ctx) {
+    if (!fn) return -1;
+    uint64_t flags = spin_lock_irqsave(&vector_lock);
+    for (int v = ISR_MSI_BASE; v < ISR_MSI_BASE + ISR_MSI_COUNT; v++) {
+        if (!interrupt_handlers[v]) {
+            msi_fn[v - ISR_MSI_BASE] = fn;
+            msi_ctx[v - ISR_MSI_BASE] = ctx;
+            interrupt_handlers[v] = isr_msi_dispatch;
+            spin_unlock_irqrestore(&vector_lock, flags);
+            return v;
+        }
+    }
+    spin_unlock_irqrestore(&vector_lock, flags);
+    return -1;
+}
+
+void isr_free_vector(int vector) {
+    if (vector < ISR_MSI_BASE || vector >= ISR_MSI_BASE + ISR_MSI_COUNT) return;
+    uint64_t flags = spin_lock_irqsave(&vector_lock);
+    interrupt_handlers[vector] = 0;
+    msi_fn[vector - ISR_MSI_BASE] = 0;
+    msi_ctx[vector - ISR_MSI_BASE] = 0;
+    spin_unlock_irqrestore(&vector_lock, flags);
+}
+
 // Initialize ISRs
 void isr_init() {
     // Set up ISR gates in IDT (0x08 = code segment, 0x8E = present, ring 0, 64-bit interrupt gate)
@@ -53,6 +106,11 @@ void isr_init() {
     idt_set_gate(29, (uint64_t)isr29, 0x08, 0x8E);
     idt_set_gate(30, (uint64_t)isr30, 0x08, 0x8E);
     idt_set_gate(31, (uint64_t)isr31, 0x08, 0x8E);
+
+    // MSI vectors
+    for (int i = 0; i < ISR_MSI_COUNT; i++) {
+        idt_set_gate(ISR_MSI_BASE + i, (uint64_t)isr_msi_stubs[i], 0x08, 0x8E);
+    }
     
     // Initialize handler array
     for(int i = 0; i < 256; i++) {
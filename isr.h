@@ -22,6 +22,26 @@ void isr_init();
 // Register interrupt handler
 void isr_register_handler(uint8_t n, isr_handler_t handler);
 
+// Vectors for message-signalled interrupts (MSI/MSI-X); their handlers
+// must send the LAPIC EOI themselves
+#define ISR_MSI_BASE   0x40
+#define ISR_MSI_COUNT  64
+
+// Claim a free MSI vector and install handler on it. Returns the vector,
+// or -1 if all are taken.
+int isr_alloc_vector(isr_handler_t handler);
+
+// Per-vector handler: called with the context it was allocated with, the
+// EOI is sent for it. Each queue of a device can have its own vector and
+// context, so nothing has to work out which queue interrupted.
+typedef void (*isr_msi_fn)(void* ctx);
+
+// Claim a free MSI vector for fn(ctx). Returns the vector, or -1.
+int isr_alloc_msi(isr_msi_fn fn, void* ctx);
+
+// Give back a vector from isr_alloc_vector() or isr_alloc_msi()
+void isr_free_vector(int vector);
+
 // ISR declarations (0-31 are CPU exceptions)
 extern void isr0();
 extern void isr1();
@@ -56,4 +76,7 @@ extern void isr29();
 extern void isr30();
 extern void isr31();
 
+// MSI vector stubs, ISR_MSI_BASE onwards
+extern void (*isr_msi_stubs[ISR_MSI_COUNT])();
+
 #endif
\ No newline at end of file
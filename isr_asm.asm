@@ -56,8 +56,31 @@ ISR_NOERRCODE 29  ; Reserved
 ISR_ERRCODE   30  ; Security exception
 ISR_NOERRCODE 31  ; Reserved
 
+; Message-signalled interrupt vectors (handed out by isr_alloc_vector)
+%assign vec 64
+%rep 64
+ISR_NOERRCODE vec
+%assign vec vec + 1
+%endrep
+
+; Their addresses, for isr_init()
+section .rodata
+global isr_msi_stubs
+isr_msi_stubs:
+%assign vec 64
+%rep 64
+    dq isr %+ vec
+%assign vec vec + 1
+%endrep
+section .text
+
 ; Common ISR stub - saves state and calls C handler (64-bit)
 isr_common_stub:
+    test byte [rsp + 24], 3 ; From ring 3: switch to the kernel GS base
+    jz .kernel_gs
+    swapgs
+.kernel_gs:
+
     ; Push all general purpose registers
     push rax
     push rbx
@@ -104,5 +127,9 @@ isr_common_stub:
     pop rax
     
     add rsp, 16        ; Clean up error code and ISR number
+    test byte [rsp + 8], 3  ; Back to ring 3: user GS base
+    jz .user_gs
+    swapgs
+.user_gs:
     sti
     iretq              ; Return from interrupt (64-bit)
\ No newline at end of file
@@ -1,5 +1,6 @@
 // kernel.c - Alteo OS v5.0 Desktop Environment
 #include "graphics.h"
+#include "klib.h"
 #include "font.h"
 #include "keyboard.h"
 #include "mouse.h"
@@ -12,12 +13,21 @@
 #include "scheduler.h"
 #include "syscall.h"
 #include "vfs.h"
+#include "dcache.h"
 #include "e1000.h"
 #include "ethernet.h"
 #include "ip.h"
 #include "tcp.h"
+#include "udp.h"
+#include "loopback.h"
 #include "socket.h"
+#include "nettap.h"
+#include "trace.h"
+#include "profile.h"
+#include "bench.h"
+#include "boottime.h"
 #include "ac97.h"
+#include "mixer.h"
 #include "gdt.h"
 #include "vmm.h"
 #include "elf.h"
@@ -27,11 +37,28 @@
 #include "pci.h"
 #include "acpi.h"
 #include "apic.h"
+#include "smp.h"
+#include "fpu.h"
+#include "timer.h"
+#include "cpuidle.h"
+#include "vdso.h"
+#include "uring.h"
+#include "input.h"
+#include "evdev.h"
 #include "usb.h"
 #include "usb_hid.h"
+#include "usb_storage.h"
 #include "xhci.h"
 #include "blkdev.h"
+#include "ramdisk.h"
+#include "zswap.h"
+#include "klog.h"
+#include "random.h"
+#include "frametime.h"
+#include "ahci.h"
+#include "nvme.h"
 #include "pipe.h"
+#include "epoll.h"
 #include "signal.h"
 #include "shm.h"
 #include "devfs.h"
@@ -90,6 +117,7 @@ static int mx = 512, my = 384, old_mx = 512, old_my = 384;
 static int mouse_left = 0, mouse_left_prev = 0;
 static int mouse_right = 0, mouse_right_prev = 0;
 static int ctx_open = 0, ctx_x, ctx_y;
+static int frame_overlay = 0;   // Frame timing overlay ("fps" in the terminal)
 
 // Terminal
 #define TERM_LINES 30
@@ -139,9 +167,6 @@ static int my_strcmp(const char* a, const char* b) {
 static int my_strncmp(const char* a, const char* b, int n) {
     for(int i=0;i<n;i++) { if(a[i]!=b[i]) return a[i]-b[i]; if(!a[i]) return 0; } return 0;
 }
-static void my_memset(void* d, int v, int n) {
-    unsigned char* p = (unsigned char*)d; for(int i=0;i<n;i++) p[i]=(unsigned char)v;
-}
 static void int_to_str(int val, char* buf) {
     if (val < 0) { *buf++ = '-'; val = -val; }
     if (val == 0) { buf[0]='0'; buf[1]=0; return; }
@@ -154,7 +179,7 @@ static void two_digit(int v, char* b) { b[0]='0'+v/10; b[1]='0'+v%10; }
 
 // ---- Terminal ----
 static void term_clear(void) {
-    for (int i = 0; i < TERM_LINES; i++) my_memset(term_buf[i], 0, TERM_COLS+1);
+    for (int i = 0; i < TERM_LINES; i++) memset(term_buf[i], 0, TERM_COLS+1);
     term_row = 0; term_col = 0;
 }
 static void term_putchar(char c) {
@@ -162,7 +187,7 @@ static void term_putchar(char c) {
         term_col = 0; term_row++;
         if (term_row >= TERM_LINES) {
             for (int i = 0; i < TERM_LINES-1; i++) my_strcpy(term_buf[i], term_buf[i+1]);
-            my_memset(term_buf[TERM_LINES-1], 0, TERM_COLS+1);
+            memset(term_buf[TERM_LINES-1], 0, TERM_COLS+1);
             term_row = TERM_LINES - 1;
         }
         return;
@@ -171,6 +196,19 @@ static void term_putchar(char c) {
     if (term_col < TERM_COLS) { term_buf[term_row][term_col] = c; term_col++; }
 }
 static void term_print(const char* s) { while (*s) term_putchar(*s++); }
+
+// Show kernel log lines that reached the console since the last call;
+// 1 if there were any
+static uint64_t term_klog_pos = 0;
+static int term_klog_poll(void) {
+    char buf[128];
+    int n, any = 0;
+    while ((n = klog_console_read(buf, sizeof(buf), &term_klog_pos)) > 0) {
+        for (int i = 0; i < n; i++) term_putchar(buf[i]);
+        any = 1;
+    }
+    return any;
+}
 static void term_prompt(void) { term_print("alteo> "); }
 
 static void term_exec(void) {
@@ -180,7 +218,8 @@ static void term_exec(void) {
         term_print("Commands: help, clear, about, uname, uptime,\n");
         term_print("  echo <text>, date, whoami, ls, cat <file>,\n");
         term_print("  cd <dir>, pwd, mkdir <dir>, touch <file>,\n");
-        term_print("  rm <file>, mem, cpu, ps, neofetch, exit\n");
+        term_print("  rm <file>, mem, cpu, ps, neofetch, sysbench,\n");
+        term_print("  fps, exit\n");
     } else if (my_strcmp(term_input, "clear") == 0) {
         term_clear();
     } else if (my_strcmp(term_input, "about") == 0) {
@@ -274,6 +313,18 @@ static void term_exec(void) {
             term_print(pt[pi].name);
             term_print("\n");
         }
+    } else if (my_strcmp(term_input, "sysbench") == 0) {
+        syscall_bench_t sb;
+        syscall_bench(10000, &sb);
+        const char* names[3] = { "getpid: ", "isatty: ", "enosys: " };
+        uint64_t ns[3] = { sb.getpid_ns, sb.isatty_ns, sb.enosys_ns };
+        for (int bi = 0; bi < 3; bi++) {
+            char nb[16]; int_to_str((int)ns[bi], nb);
+            term_print(names[bi]); term_print(nb); term_print(" ns/call\n");
+        }
+    } else if (my_strcmp(term_input, "fps") == 0) {
+        frame_overlay = !frame_overlay;
+        term_print(frame_overlay ? "Frame overlay on\n" : "Frame overlay off\n");
     } else if (my_strcmp(term_input, "exit") == 0) {
         for (int i = 0; i < window_count; i++)
             if (windows[i].active && windows[i].app_type == APP_TERMINAL) { windows[i].active = 0; break; }
@@ -308,7 +359,7 @@ static int create_window(int app_type, const char* title, int w, int h) {
     for (int i = 0; i < tl; i++) win->title[i] = title[i];
     win->title[tl] = 0;
     if (app_type == APP_TERMINAL) { term_clear(); term_print("Alteo Terminal v5.0\n"); term_print("Type 'help' for commands.\n\n"); term_prompt(); }
-    if (app_type == APP_SCRIBE) { scribe_len = 0; my_memset(scribe_buf, 0, 4096); }
+    if (app_type == APP_SCRIBE) { scribe_len = 0; memset(scribe_buf, 0, 4096); }
     if (app_type == APP_CALCULATOR) { my_strcpy(calc_display, "0"); calc_val1=0; calc_val2=0; calc_op=0; calc_new=1; }
     if (app_type == APP_PAINT && !paint_inited) { for (int i=0;i<200*150;i++) paint_canvas[i]=0xFFFFFFFF; paint_inited=1; }
     focused_win = idx;
@@ -565,10 +616,10 @@ static void draw_window_frame(window_t* w) {
 
     // Title text with subtle shadow
     if (is_focused) {
-        draw_string(x + 32, y + 10, w->title, 0xFF111122);  // shadow
+        draw_string_cached(x + 32, y + 10, w->title, 0xFF111122);  // shadow
     }
     uint32_t title_col = is_focused ? 0xFFE8E8FF : 0xFF888899;
-    draw_string(x + 31, y + 9, w->title, title_col);
+    draw_string_cached(x + 31, y + 9, w->title, title_col);
 
     // Window control buttons (macOS style traffic lights, refined)
     int bx = x + ww - 28, by = y + 10;
@@ -1639,7 +1690,9 @@ static void draw_desktop_branding(void) {
     draw_rounded_rect(wx + 50, wy + 34, 136, 10, 0xFF1A1A2A);
     // Pseudo-random CPU usage simulation
     static int cpu_pct_smooth = 18;
-    if ((tick_count % 25) == 0) {
+    static uint32_t cpu_step = 0;
+    if (tick_count / 25 != cpu_step) {
+        cpu_step = tick_count / 25;
         uint32_t rng = tick_count * 1103515245u + 12345u;
         rng = (rng >> 16) & 0x7FFF;
         int delta = (int)(rng % 11) - 5; // -5 to +5
@@ -1747,8 +1800,62 @@ static void draw_boot_splash(void) {
     for (volatile int d = 0; d < 5000000; d++);
 }
 
+// ---- Frame timing overlay ----
+// Milliseconds with one decimal
+static void ms_to_str(uint32_t us, char* buf) {
+    int_to_str((int)(us / 1000), buf);
+    int l = my_strlen(buf);
+    buf[l] = '.'; buf[l+1] = (char)('0' + (us / 100) % 10); buf[l+2] = 0;
+}
+
+// Top right: rate, last frame's phases, the scheduler's budget, and a bar
+// per recent frame against the refresh interval (red: missed its vblank)
+static void draw_frame_overlay(void) {
+    static frame_sample_t rec[FRAME_RECENT];
+    frame_stats_t st;
+    frame_get_stats(&st);
+    int n = frame_get_recent(rec, FRAME_RECENT);
+    int ow = FRAME_RECENT * 3 + 16, oh = 100;
+    int ox = SCR_W - ow - 12, oy = 12;
+    draw_rounded_rect_alpha(ox, oy, ow, oh, 0xFF101018, 210);
+
+    char line[64], num[16];
+    int fps = 0;
+    if (n >= 2 && rec[n-1].end_ns > rec[0].end_ns)
+        fps = (int)((uint64_t)(n - 1) * 1000000000ULL / (rec[n-1].end_ns - rec[0].end_ns));
+    my_strcpy(line, "fps "); int_to_str(fps, num); my_strcpy(line + my_strlen(line), num);
+    my_strcpy(line + my_strlen(line), "  missed "); int_to_str((int)st.missed, num);
+    my_strcpy(line + my_strlen(line), num);
+    draw_string(ox + 8, oy + 6, line, 0xFFFFFFFF);
+
+    const frame_sample_t* last = n ? &rec[n-1] : 0;
+    my_strcpy(line, "draw "); ms_to_str(last ? last->phase_us[FRAME_COMPOSITE] : 0, num);
+    my_strcpy(line + my_strlen(line), num);
+    my_strcpy(line + my_strlen(line), " flip "); ms_to_str(last ? last->phase_us[FRAME_FLIP] : 0, num);
+    my_strcpy(line + my_strlen(line), num);
+    draw_string(ox + 8, oy + 24, line, 0xFFCCCCDD);
+
+    my_strcpy(line, "budget "); ms_to_str((uint32_t)(st.estimate_ns / 1000), num);
+    my_strcpy(line + my_strlen(line), num);
+    my_strcpy(line + my_strlen(line), " / "); ms_to_str((uint32_t)(st.period_ns / 1000), num);
+    my_strcpy(line + my_strlen(line), num);
+    my_strcpy(line + my_strlen(line), " ms");
+    draw_string(ox + 8, oy + 42, line, 0xFFCCCCDD);
+
+    int base = oy + oh - 8, span = 30;
+    uint32_t period_us = (uint32_t)(st.period_ns / 1000);
+    if (!period_us) period_us = 1;
+    for (int i = 0; i < n; i++) {
+        uint32_t us = rec[i].total_us < period_us ? rec[i].total_us : period_us;
+        int bh = (int)(us * (uint32_t)span / period_us);
+        if (bh < 1) bh = 1;
+        draw_rect(ox + 8 + i * 3, base - bh, 2, bh, rec[i].missed ? 0xFFE04040 : 0xFF40C060);
+    }
+}
+
 // ---- Full desktop render ----
 static void render_desktop(void) {
+    frame_begin(0);
     draw_gradient_bg();
     draw_desktop_branding();
     draw_desktop_icons();
@@ -1767,12 +1874,22 @@ static void render_desktop(void) {
     draw_taskbar();
     draw_start_menu();
     draw_context_menu();
+    if (frame_overlay) draw_frame_overlay();
+
+    // Cursor (unless the display's cursor plane shows it)
+    if (!compositor_hw_cursor()) {
+        save_mouse_bg(mx, my);
+        render_cursor_graphic(mx, my);
+    }
 
-    // Cursor
-    save_mouse_bg(mx, my);
-    render_cursor_graphic(mx, my);
+    frame_mark(FRAME_COMPOSITE);
 
-    flip_buffer();
+    // The scene is rebuilt every time, but only what changed since the
+    // last frame reaches the framebuffer
+    gfx_damage_all();
+    flip_damage();
+    frame_mark(FRAME_FLIP);
+    frame_end();
 }
 
 // ---- Calculator logic ----
@@ -2148,6 +2265,89 @@ void process_key(char c) {
 
 void update_status_line(void) { }
 
+// ---- Desktop events ----
+#define DESKTOP_POLL_NS       TIMER_TICK_NS             // Polled network receive
+#define DESKTOP_NET_TIMER_NS  (10 * TIMER_TICK_NS)      // ARP/TCP timers only
+
+// tick_count follows the scheduler clock (100 per second); the wall clock
+// advances once per 100 ticks crossed
+static void desktop_clock(uint32_t ticks) {
+    static uint32_t clock_ticks = 0;
+    tick_count = ticks;
+    while (ticks - clock_ticks >= 100) {
+        clock_ticks += 100;
+        sys_sec++;
+        if (sys_sec >= 60) { sys_sec = 0; sys_min++; }
+        if (sys_min >= 60) { sys_min = 0; sys_hour++; }
+        if (sys_hour >= 24) sys_hour = 0;
+    }
+}
+
+// First tick after 'ticks' at which an animation changes: the monitor
+// widget steps every 25 ticks, text cursors blink every 30 and the clock
+// colon every 50 (the clock's seconds fall on these too)
+static uint64_t desktop_next_anim(uint64_t ticks) {
+    static const int periods[] = { 25, 30, 50 };
+    uint64_t next = ~0ULL;
+    for (int i = 0; i < 3; i++) {
+        uint64_t t = (ticks / periods[i] + 1) * periods[i];
+        if (t < next) next = t;
+    }
+    return next;
+}
+
+// One queued mouse event: position and buttons as of that packet
+static void desktop_mouse(int x, int y, uint8_t buttons) {
+    old_mx = mx; old_my = my;
+    mx = x; my = y;
+    if (mx < 0) mx = 0;
+    if (mx >= SCR_W) mx = SCR_W - 1;
+    if (my < 0) my = 0;
+    if (my >= SCR_H) my = SCR_H - 1;
+    if (compositor_hw_cursor()) compositor_move_cursor(mx, my);
+
+    mouse_left_prev = mouse_left;
+    mouse_right_prev = mouse_right;
+    mouse_left = (buttons & 1);
+    mouse_right = (buttons & 2);
+
+    // Left click
+    if (mouse_left && !mouse_left_prev) {
+        handle_click(mx, my);
+    }
+
+    // Right click - desktop context menu
+    if (mouse_right && !mouse_right_prev) {
+        int on_win = 0;
+        for (int i = 0; i < MAX_WINDOWS; i++) {
+            if (!windows[i].active || windows[i].minimized) continue;
+            if (mx >= windows[i].x && mx < windows[i].x + windows[i].w &&
+                my >= windows[i].y && my < windows[i].y + windows[i].h) { on_win = 1; break; }
+        }
+        if (!on_win && my < TASKBAR_Y) {
+            ctx_open = 1; ctx_x = mx; ctx_y = my;
+            start_menu_open = 0;
+        }
+    }
+
+    // Window dragging
+    if (dragging && mouse_left) {
+        if (drag_win >= 0 && windows[drag_win].active) {
+            windows[drag_win].x = mx - drag_ox;
+            windows[drag_win].y = my - drag_oy;
+            if (windows[drag_win].y < 0) windows[drag_win].y = 0;
+            if (windows[drag_win].y > TASKBAR_Y - TITLE_H)
+                windows[drag_win].y = TASKBAR_Y - TITLE_H;
+        }
+    }
+    if (!mouse_left) { dragging = 0; drag_win = -1; }
+
+    // Paint drawing
+    if (focused_win >= 0 && windows[focused_win].active &&
+        windows[focused_win].app_type == APP_PAINT)
+        paint_check_draw();
+}
+
 // ---- IRQ Handlers (CRITICAL for input to work) ----
 // MUST check port 0x64 status bit 5 to know if data is from keyboard or mouse.
 // Without this check, mouse bytes leak into keyboard handler (wrong keys)
@@ -2176,12 +2376,31 @@ static void mouse_irq_handler(registers_t* regs) {
     mouse_handle_byte(data);
 }
 
+// Deferred probes (boot_defer). USB input devices and disks show up
+// once xHCI enumeration finishes.
+static void kinit_usb(void) {
+    usb_init();                 // xHCI + device enumeration
+    usb_hid_init();
+    usb_storage_init();         // Bulk-only disks register with blkdev as usb0...
+}
+
+static void kinit_audio(void) {
+    ac97_init();                // AC97 audio codec
+    mixer_init();               // Software mixer, /dev/dsp nodes
+    mixer_start();              // Audio mixing bottom half (mixer thread)
+}
+
 // ---- Main ----
 void kernel_main(uint64_t multiboot_addr) {
+    boot_phase("graphics");
     init_graphics(multiboot_addr);
+    int bench_mode = bench_requested(multiboot_addr);  // Before the PMM reuses the info
+    ramdisk_probe(multiboot_addr);
 
     // Phase 1: Set up GDT with kernel/user segments and TSS
+    boot_phase("cpu");
     gdt_init();
+    smp_percpu_init();  // GS base for per-CPU data (RCU readers); again in syscall_init
 
     idt_init();
 
@@ -2191,24 +2410,16 @@ void kernel_main(uint64_t multiboot_addr) {
     irq_init();
     // NOTE: Do NOT sti here! Install handlers first.
 
-    // Enable SSE/SSE2 instructions (needed by GPU driver code compiled with SSE)
-    {
-        uint64_t cr0, cr4;
-        __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
-        cr0 &= ~(1UL << 2);  // Clear CR0.EM (disable x87 emulation)
-        cr0 |= (1UL << 1);   // Set CR0.MP (monitor coprocessor)
-        __asm__ volatile("mov %0, %%cr0" : : "r"(cr0));
-
-        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
-        cr4 |= (1UL << 9);   // Set CR4.OSFXSR (enable FXSAVE/FXRSTOR)
-        cr4 |= (1UL << 10);  // Set CR4.OSXMMEXCPT (enable SSE exceptions)
-        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
-    }
+    // Enable SSE (and AVX via XSAVE where present), with per-process FPU
+    // state switched lazily through #NM
+    fpu_init();
+    random_init();     // CSPRNG, seeded from RDSEED/RDRAND and the TSC
 
     // Show boot splash with ALTEO branding (no interrupts needed)
     draw_boot_splash();
 
     // Phase 1: Initialize Physical Memory Manager (needed before VMM)
+    boot_phase("memory");
     pmm_init(multiboot_addr);
 
     // Initialize memory subsystems (heap needed before process management)
@@ -2217,36 +2428,56 @@ void kernel_main(uint64_t multiboot_addr) {
     // Phase 1: Initialize Virtual Memory Manager
     // Creates proper 4-level page tables and replaces boot.asm's 1GB huge pages
     vmm_init();
+    gfx_map_framebuffer();
 
-    // Initialize Virtual File System (in-memory)
+    // Initialize Virtual File System (in-memory) and the lookup cache in front of it
+    boot_phase("vfs");
+    dcache_init();
     vfs_init();
 
     // Phase 3: Initialize IPC and signal subsystems
     pipe_init();
+    epoll_init();
     signal_init();
     shm_init();
 
     // Phase 3: Mount pseudo-filesystems (/dev, /proc)
     devfs_init();
     procfs_init();
+    trace_init();      // /dev/trace kernel tracepoints
+    profile_init();    // /dev/profile sampling profiler, /proc/profile
+    evdev_init();      // /dev/event0..3 input event rings
 
     // Phase 2: Initialize PCI bus enumerator (must come before all PCI device drivers)
+    boot_phase("pci");
     pci_init();
 
     // Phase 2: Parse ACPI tables (MADT, FADT - needed for APIC and power management)
+    boot_phase("acpi");
     acpi_init();
 
     // Phase 2: Initialize APIC (replaces legacy 8259 PIC if available)
     // Falls back to PIC if APIC not present
+    boot_phase("apic");
     apic_init();
 
     // Initialize ATA driver and block device layer
+    boot_phase("ata");
     ata_init();
 
-    // Phase 2: Initialize block device layer (wraps ATA with cache)
+    // Phase 2: Initialize block device layer (wraps ATA with the page cache)
+    boot_phase("blkdev");
+    pagecache_init();
+    zswap_init();      // Under pressure anonymous pages are compressed in RAM
     blkdev_init();
+    boot_phase("ahci");
+    ahci_init();       // SATA disks register with blkdev as ahci0...
+    boot_phase("nvme");
+    nvme_init();       // NVMe namespaces as nvme0n1... (boot CPU queue only)
+    int initrd = ramdisk_init();   // GRUB modules as ram0...
 
     // Attempt FAT32 mount
+    boot_phase("mount");
     if (ata_get_drive_count() > 0) {
         if (fat32_init(0) == 0) {
             // FAT32 filesystem detected - mount it at /mnt/disk
@@ -2254,48 +2485,76 @@ void kernel_main(uint64_t multiboot_addr) {
         }
     }
 
-    // Phase 3: Attempt ext2 filesystem mount on first ATA drive
-    ext2_init(0);
+    // Phase 3: Attempt ext2 filesystem mount, from the initrd if GRUB loaded
+    // one, else from the first ATA drive
+    ext2_init(initrd >= 0 ? initrd : 0);
 
     // Initialize networking stack (e1000 now uses central PCI layer)
+    boot_phase("e1000");
     e1000_init();      // NIC driver (uses pci_find_device)
+    boot_phase("net");
     eth_init();        // Ethernet layer
     arp_init();        // ARP cache
     ip_init();         // IPv4 layer (QEMU default: 10.0.2.15)
     tcp_init();        // TCP transport
+    udp_init();        // UDP transport
     socket_init();     // Socket API
-
-    // Initialize audio (ac97 now uses central PCI layer)
-    ac97_init();       // AC97 audio codec
+    nettap_init();     // /dev/netcap packet capture
 
     // Phase 4: Initialize NVIDIA GPU driver stack
+    boot_phase("gpu");
     gpu_init();                 // PCI discovery, BAR mapping, chip ID
     nv_mem_init();              // GPU memory management (VRAM allocator, VM)
     nv_power_init();            // Power/thermal management, clock control
     nv_fifo_init();             // PFIFO command submission engine
+    boot_phase("nv_display");
     nv_display_init();          // Display engine, mode setting
+    boot_phase("gpu_accel");
     nv_2d_init();               // 2D acceleration engine
     nv_3d_init();               // 3D graphics engine
     gl_init();                  // OpenGL 1.x subset API
     compositor_init();          // Window compositor
-
-    // Phase 2: Initialize USB subsystem (xHCI + device enumeration)
-    usb_init();
-    usb_hid_init();
+    frame_init();               // Frame timing, paced to the display's refresh
+    if (compositor_hw_cursor()) {
+        // The desktop's arrow on the cursor plane, not the compositor's
+        static uint32_t arrow[CURSOR_W * CURSOR_H];
+        cursor_graphic_argb(arrow);
+        compositor_set_cursor(arrow, CURSOR_W, CURSOR_H);
+        compositor_move_cursor(mx, my);
+    }
 
     // Initialize process management subsystem
+    boot_phase("sched");
     process_init();
     scheduler_init();
 
+    // High-resolution timers: TSC clock and one-shot LAPIC deadlines (tickless)
+    timer_init();
+    cpuidle_init();             // C-states for idle CPUs (MWAIT where available)
+    vdso_init();
+
     // Phase 1: Initialize syscall interface (sets up SYSCALL/SYSRET MSRs)
     syscall_init();
 
+    // CPU numbering and the big kernel lock; only the BSP is brought online
+    boot_phase("smp");
+    smp_init();
+    boot_phase("threads");
+    nvme_init_cpus();  // An NVMe I/O queue pair per online CPU
+    blkdev_start_worker();  // kblockd dispatches queued block requests
+    klog_start();               // klogd writes the kernel log out
+    pagecache_start_flusher();  // kflushd writes dirty pages back in the background
+    e1000_start_rx();           // Interrupt-driven NIC receive (e1000rx thread)
+    lo_start();                 // Loopback delivery (lo thread)
+    uring_start();              // Asynchronous ring completions (uring thread)
+
     // Create system daemon processes
     process_create("desktop", (void(*)(void))0, PRIORITY_HIGH);
     process_create("input", (void(*)(void))0, PRIORITY_HIGH);
     process_create("display", (void(*)(void))0, PRIORITY_NORMAL);
 
     // --- PS/2 Initialization (all done with interrupts disabled) ---
+    boot_phase("ps2");
     keyboard_init();
     mouse_init();
 
@@ -2337,83 +2596,64 @@ void kernel_main(uint64_t multiboot_addr) {
     __asm__ __volatile__("sti");
 
     // Init windows
+    boot_phase("desktop");
     for (int i=0; i<MAX_WINDOWS; i++) windows[i].active=0;
     window_count=0; focused_win=-1;
 
     // Initial desktop render
     draw_gradient_bg();
     flip_buffer();
+    boot_ready();
+
+    if (bench_mode) bench_run();
+
+    // Nothing above waits for these: probe them on kernel threads while
+    // the desktop runs
+    boot_defer("usb", kinit_usb);
+    boot_defer("audio", kinit_audio);
+    nv_power_set_governor(1);   // GPU P-state follows load (samples on timer events)
 
     // ---- Main loop ----
+    // Runs when something happens: input from the IRQ handlers, or the
+    // deadline for the next frame, animation step or network poll. In
+    // between the BSP runs other processes or halts.
+    uint64_t next_anim = 0, next_net = 0;
+    int dirty = 1;
     while (1) {
-        tick_count++;
-
-        // Update clock
-        if (tick_count % 100 == 0) {
-            sys_sec++;
-            if (sys_sec >= 60) { sys_sec = 0; sys_min++; }
-            if (sys_min >= 60) { sys_min = 0; sys_hour++; }
-            if (sys_hour >= 24) sys_hour = 0;
+        uint64_t now = timer_now_ns();
+        desktop_clock((uint32_t)timer_ticks());
+
+        input_event_t ev;
+        while (input_pop(&ev)) {
+            if (ev.type == INPUT_KEY) process_key(ev.key);
+            else desktop_mouse(ev.x, ev.y, ev.buttons);
+            dirty = 1;
         }
 
-        // Poll mouse state
-        mouse_state_t ms;
-        mouse_get_state(&ms);
-        old_mx = mx; old_my = my;
-        mx = ms.x; my = ms.y;
-        if (mx < 0) mx = 0;
-        if (mx >= SCR_W) mx = SCR_W - 1;
-        if (my < 0) my = 0;
-        if (my >= SCR_H) my = SCR_H - 1;
-
-        mouse_left_prev = mouse_left;
-        mouse_right_prev = mouse_right;
-        mouse_left = (ms.buttons & 1);
-        mouse_right = (ms.buttons & 2);
-
-        // Left click
-        if (mouse_left && !mouse_left_prev) {
-            handle_click(mx, my);
-        }
+        if (term_klog_poll()) dirty = 1;
 
-        // Right click - desktop context menu
-        if (mouse_right && !mouse_right_prev) {
-            int on_win = 0;
-            for (int i = 0; i < MAX_WINDOWS; i++) {
-                if (!windows[i].active || windows[i].minimized) continue;
-                if (mx >= windows[i].x && mx < windows[i].x + windows[i].w &&
-                    my >= windows[i].y && my < windows[i].y + windows[i].h) { on_win = 1; break; }
-            }
-            if (!on_win && my < TASKBAR_Y) {
-                ctx_open = 1; ctx_x = mx; ctx_y = my;
-                start_menu_open = 0;
-            }
+        // Receive packets (if the NIC has no RX interrupt) and run TCP timers
+        if (now >= next_net) {
+            socket_poll();
+            int polled = (e1000_is_available() && !e1000_rx_irq_active()) || !lo_thread_active();
+            next_net = now + (polled ? DESKTOP_POLL_NS : DESKTOP_NET_TIMER_NS);
         }
 
-        // Window dragging
-        if (dragging && mouse_left) {
-            if (drag_win >= 0 && windows[drag_win].active) {
-                windows[drag_win].x = mx - drag_ox;
-                windows[drag_win].y = my - drag_oy;
-                if (windows[drag_win].y < 0) windows[drag_win].y = 0;
-                if (windows[drag_win].y > TASKBAR_Y - TITLE_H)
-                    windows[drag_win].y = TASKBAR_Y - TITLE_H;
-            }
+        // Clock, cursor blinks and the monitor widget
+        if (now >= next_anim) {
+            dirty = 1;
+            next_anim = desktop_next_anim(now / TIMER_TICK_NS) * TIMER_TICK_NS;
         }
-        if (!mouse_left) { dragging = 0; drag_win = -1; }
-
-        // Paint drawing
-        if (focused_win >= 0 && windows[focused_win].active &&
-            windows[focused_win].app_type == APP_PAINT)
-            paint_check_draw();
 
-        // Poll network (receive packets, TCP timers)
-        socket_poll();
-
-        // Render every 2 ticks
-        if (tick_count % 2 == 0) render_desktop();
-
-        // Small delay for loop pacing
-        for (volatile int d = 0; d < 50000; d++);
+        // At most one frame per refresh, started so it is done just before
+        // the vblank (frametime.h); input arriving sooner is merged into it
+        uint64_t due = dirty ? frame_due(now) : 0;
+        if (dirty && now >= due) {
+            render_desktop();
+            dirty = 0;
+        }
+        uint64_t deadline = next_net < next_anim ? next_net : next_anim;
+        if (dirty && due < deadline) deadline = due;
+        input_wait(deadline);
     }
 }
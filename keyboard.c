@@ -1,5 +1,7 @@
 // keyboard.c - Processing Logic Only
 #include "keyboard.h"
+#include "input.h"
+#include "evdev.h"
 
 // Scancodes
 #define SCANCODE_LSHIFT_PRESS   0x2A
@@ -7,12 +9,13 @@
 #define SCANCODE_RSHIFT_PRESS   0x36
 #define SCANCODE_RSHIFT_RELEASE 0xB6
 #define SCANCODE_CAPSLOCK       0x3A
+#define SCANCODE_EXTENDED       0xE0
 
-extern void process_key(char c); // In kernel.c
 extern void update_status_line(); // In kernel.c
 
 int shift_pressed = 0;
 int caps_lock = 0;
+static int extended = 0;         // Last byte was the 0xE0 prefix
 
 // Maps
 unsigned char keyboard_map_normal[128] = {
@@ -47,28 +50,36 @@ void keyboard_init() {
 
 // This function is called by the Kernel when it knows data is for the keyboard
 void keyboard_handle_byte(uint8_t scancode) {
+    if (scancode == SCANCODE_EXTENDED) {
+        extended = 1; return;
+    }
+    uint16_t code = (scancode & 0x7F) | (extended ? 0x80 : 0);
+    int down = !(scancode & 0x80);
+    extended = 0;
+
     // Handle Modifiers
     if (scancode == SCANCODE_LSHIFT_PRESS || scancode == SCANCODE_RSHIFT_PRESS) {
-        shift_pressed = 1; return;
+        shift_pressed = 1; evdev_key(EVDEV_PS2_KBD, code, 1, 0); return;
     }
     if (scancode == SCANCODE_LSHIFT_RELEASE || scancode == SCANCODE_RSHIFT_RELEASE) {
-        shift_pressed = 0; return;
+        shift_pressed = 0; evdev_key(EVDEV_PS2_KBD, code, 0, 0); return;
     }
     if (scancode == SCANCODE_CAPSLOCK) {
-        caps_lock = !caps_lock; update_status_line(); return;
+        caps_lock = !caps_lock; update_status_line(); evdev_key(EVDEV_PS2_KBD, code, 1, 0); return;
     }
 
-    // Ignore key releases (high bit set)
-    if (scancode & 0x80) return;
+    // Key releases (high bit set) only go to the event device
+    if (!down) {
+        evdev_key(EVDEV_PS2_KBD, code, 0, 0); return;
+    }
 
     // Convert to ASCII
-    if (scancode < 128) {
-        char c;
-        if (shift_pressed) c = keyboard_map_shifted[scancode];
-        else c = keyboard_map_normal[scancode];
-        
-        if (!shift_pressed) c = apply_caps_lock(c);
-        
-        if (c != 0) process_key(c);
-    }
-}
\ No newline at end of file
+    char c;
+    if (shift_pressed) c = keyboard_map_shifted[scancode];
+    else c = keyboard_map_normal[scancode];
+
+    if (!shift_pressed) c = apply_caps_lock(c);
+
+    evdev_key(EVDEV_PS2_KBD, code, 1, c);
+    if (c != 0) input_push_key(c);
+}
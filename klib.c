@@ -0,0 +1,85 @@
+// klib.c - Kernel Memory Primitives for Alteo OS
+// Plain string instructions only: the kernel is built without SSE, and
+// rep movs/stos does not get rewritten by GCC into a call to itself.
+#include "klib.h"
+
+// CPUID.(EAX=7,ECX=0):EBX[9] - enhanced rep movsb/stosb (cached after first query)
+static int klib_erms = -1;
+
+// Bytes moved per interrupts-off stretch of a backward memmove
+#define KLIB_MOVE_CHUNK 4096
+
+// Word loads over arbitrary byte buffers
+typedef uint64_t __attribute__((may_alias)) klib_word_t;
+
+static int klib_has_erms(void) {
+    if (klib_erms < 0) {
+        uint32_t eax = 0, ebx, ecx = 0, edx;
+        __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        klib_erms = 0;
+        if (eax >= 7) {
+            eax = 7;
+            ecx = 0;
+            __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+            klib_erms = (ebx >> 9) & 1;
+        }
+    }
+    return klib_erms;
+}
+
+void* memcpy(void* dst, const void* src, size_t n) {
+    void* ret = dst;
+    if (n >= KLIB_WIDE_MIN && !klib_has_erms()) {
+        size_t q = n >> 3;
+        __asm__ volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(q) :: "memory");
+        n &= 7;
+    }
+    __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) :: "memory");
+    return ret;
+}
+
+void* memmove(void* dst, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    // Forward copies are safe unless dst starts inside [src, src + n)
+    if (d <= s || d >= s + n) return memcpy(dst, src, n);
+    // Copy backwards with DF set. The interrupt and IRQ stubs do not cld,
+    // so interrupts are held off while DF is set; the copy goes in
+    // KLIB_MOVE_CHUNK pieces (highest first) to bound how long.
+    d += n - 1;
+    s += n - 1;
+    while (n) {
+        size_t c = n < KLIB_MOVE_CHUNK ? n : KLIB_MOVE_CHUNK;
+        n -= c;
+        __asm__ volatile("pushfq\n\tcli\n\tstd\n\trep movsb\n\tpopfq"
+                         : "+D"(d), "+S"(s), "+c"(c) :: "memory", "cc");
+    }
+    return dst;
+}
+
+void* memset(void* dst, int val, size_t n) {
+    void* ret = dst;
+    if (n >= KLIB_WIDE_MIN && !klib_has_erms()) {
+        uint64_t v = (uint64_t)(uint8_t)val * 0x0101010101010101ULL;
+        size_t q = n >> 3;
+        __asm__ volatile("rep stosq" : "+D"(dst), "+c"(q) : "a"(v) : "memory");
+        n &= 7;
+    }
+    __asm__ volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(val) : "memory");
+    return ret;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* p = (const uint8_t*)a;
+    const uint8_t* q = (const uint8_t*)b;
+    // Skip equal 8-byte words, then find the differing byte
+    while (n >= 8 && *(const klib_word_t*)p == *(const klib_word_t*)q) {
+        p += 8;
+        q += 8;
+        n -= 8;
+    }
+    for (; n > 0; n--, p++, q++) {
+        if (*p != *q) return (int)*p - (int)*q;
+    }
+    return 0;
+}
@@ -0,0 +1,18 @@
+// klib.h - Kernel Memory Primitives for Alteo OS
+// The one memcpy/memset/memcmp/memmove for the whole kernel. They also
+// satisfy the calls GCC may emit for struct copies under -ffreestanding.
+#ifndef KLIB_H
+#define KLIB_H
+
+#include "stdint.h"
+
+// Copies of at least this many bytes use the wide path: rep movsb/stosb on
+// CPUs with ERMS (enhanced rep movsb), rep movsq/stosq plus a tail otherwise
+#define KLIB_WIDE_MIN   64
+
+void* memcpy(void* dst, const void* src, size_t n);
+void* memmove(void* dst, const void* src, size_t n);
+void* memset(void* dst, int val, size_t n);
+int   memcmp(const void* a, const void* b, size_t n);
+
+#endif
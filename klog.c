@@ -0,0 +1,323 @@
+// klog.c - Kernel Log for Alteo OS
+// A slot's state is (seq + 1) << 1 once record seq is committed to it,
+// with bit 0 set while a producer writes it. The consumer copies a record
+// out and checks the state again, so a slot overwritten meanwhile reads
+// as lost rather than torn. A producer that finds its slot still being
+// written by one a whole ring behind drops its record.
+#include "klog.h"
+#include "klib.h"
+#include "process.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "waitq.h"
+
+#define COM1            0x3F8
+#define KLOG_MASK       (KLOG_RECORDS - 1)
+
+typedef struct {
+    volatile uint64_t state;
+    uint64_t ts_ns;
+    uint8_t  level;
+    uint8_t  cpu;
+    uint16_t len;
+    char     text[KLOG_TEXT_MAX];
+} klog_rec_t;
+
+static klog_rec_t ring[KLOG_RECORDS];
+static volatile uint64_t klog_head = 0;     // Next sequence to reserve
+static uint64_t klog_tail = 0;              // Next sequence to output (consumer)
+static volatile uint64_t klog_lost = 0;     // Records dropped or overwritten
+static uint64_t lost_reported = 0;
+static volatile int draining = 0;           // A consumer is running
+
+static waitq_t klog_wq = WAITQ_INIT;        // klogd sleeps here
+static volatile int klogd_running = 0;
+static volatile int flush_kick = 0;
+static volatile int flush_timer_armed = 0;
+static int serial_ready = 0;
+
+// Console text: a byte ring, positions count every byte ever written
+static char console[KLOG_CONSOLE_SIZE];
+static uint64_t console_end = 0;
+static spinlock_t console_lock = SPINLOCK_INIT;
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// ---- Formatting ----
+
+typedef struct {
+    char* out;
+    int   len;
+    int   size;
+} klog_buf_t;
+
+static void kb_putc(klog_buf_t* b, char c) {
+    if (b->len < b->size) b->out[b->len] = c;
+    b->len++;
+}
+
+static void kb_putu(klog_buf_t* b, uint64_t v, int base, int upper, int width, char pad) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[20];
+    int n = 0;
+    do { tmp[n++] = digits[v % (uint64_t)base]; v /= (uint64_t)base; } while (v);
+    while (width-- > n) kb_putc(b, pad);
+    while (n) kb_putc(b, tmp[--n]);
+}
+
+// vsnprintf for the conversions klog.h lists; the formatted length
+static int klog_format(char* out, int size, const char* fmt, __builtin_va_list ap) {
+    klog_buf_t b = { out, 0, size };
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') { kb_putc(&b, *fmt); continue; }
+        fmt++;
+        char pad = ' ';
+        int width = 0, lng = 0;
+        if (*fmt == '0') { pad = '0'; fmt++; }
+        while (*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+        while (*fmt == 'l' || *fmt == 'z') { lng = 1; fmt++; }
+
+        switch (*fmt) {
+        case 'd': case 'i': {
+            int64_t v = lng ? __builtin_va_arg(ap, int64_t) : __builtin_va_arg(ap, int);
+            if (v < 0) { kb_putc(&b, '-'); v = -v; if (width) width--; }
+            kb_putu(&b, (uint64_t)v, 10, 0, width, pad);
+            break;
+        }
+        case 'u': case 'x': case 'X': {
+            uint64_t v = lng ? __builtin_va_arg(ap, uint64_t) : __builtin_va_arg(ap, unsigned int);
+            kb_putu(&b, v, *fmt == 'u' ? 10 : 16, *fmt == 'X', width, pad);
+            break;
+        }
+        case 'p':
+            kb_putc(&b, '0'); kb_putc(&b, 'x');
+            kb_putu(&b, (uint64_t)__builtin_va_arg(ap, void*), 16, 0, 0, ' ');
+            break;
+        case 's': {
+            const char* s = __builtin_va_arg(ap, const char*);
+            if (!s) s = "(null)";
+            int n = 0;
+            while (s[n]) n++;
+            while (width-- > n) kb_putc(&b, ' ');
+            while (*s) kb_putc(&b, *s++);
+            break;
+        }
+        case 'c':
+            kb_putc(&b, (char)__builtin_va_arg(ap, int));
+            break;
+        case '%':
+            kb_putc(&b, '%');
+            break;
+        default:
+            if (!*fmt) return b.len;
+            kb_putc(&b, '%');
+            kb_putc(&b, *fmt);
+            break;
+        }
+    }
+    return b.len;
+}
+
+// ---- Producers ----
+
+static void klog_commit(int level, const char* text, uint32_t len) {
+    if (len > KLOG_TEXT_MAX) len = KLOG_TEXT_MAX;
+    uint64_t irq;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(irq) :: "memory");
+
+    uint64_t seq = __atomic_fetch_add(&klog_head, 1, __ATOMIC_RELAXED);
+    klog_rec_t* r = &ring[seq & KLOG_MASK];
+    uint64_t old = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+    if ((old & 1) || !__atomic_compare_exchange_n(&r->state, &old, old | 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&klog_lost, 1, __ATOMIC_RELAXED);
+    } else {
+        r->ts_ns = timer_now_ns();
+        r->level = (uint8_t)level;
+        r->cpu = (uint8_t)smp_cpu_id();
+        r->len = (uint16_t)len;
+        memcpy(r->text, text, len);
+        __atomic_store_n(&r->state, (seq + 1) << 1, __ATOMIC_RELEASE);
+    }
+
+    if (irq & (1 << 9)) {
+        __asm__ volatile("sti" ::: "memory");
+        // No spinlock is held with interrupts on: safe to wake klogd now.
+        // Records logged with interrupts off wait for its periodic wakeup.
+        if (klogd_running) waitq_wake_all(&klog_wq);
+    }
+}
+
+void klog(int level, const char* fmt, ...) {
+    char text[KLOG_TEXT_MAX];
+    __builtin_va_list ap;
+    __builtin_va_start(ap, fmt);
+    int n = klog_format(text, KLOG_TEXT_MAX, fmt, ap);
+    __builtin_va_end(ap);
+    klog_commit(level, text, n < KLOG_TEXT_MAX ? (uint32_t)n : KLOG_TEXT_MAX);
+}
+
+void klog_write(int level, const char* text, uint32_t len) {
+    while (len) {
+        uint32_t n = 0;
+        while (n < len && n < KLOG_TEXT_MAX && text[n] != '\n') n++;
+        if (n) klog_commit(level, text, n);
+        if (n < len && text[n] == '\n') n++;
+        text += n;
+        len -= n;
+    }
+}
+
+// ---- Consumer ----
+
+// Copy out record seq: 1 if read, 0 if not committed yet, -1 if lost
+static int klog_fetch(uint64_t seq, klog_rec_t* out) {
+    klog_rec_t* r = &ring[seq & KLOG_MASK];
+    uint64_t want = (seq + 1) << 1;
+    uint64_t st = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+    if (st == want) {
+        out->ts_ns = r->ts_ns;
+        out->level = r->level;
+        out->cpu = r->cpu;
+        out->len = r->len <= KLOG_TEXT_MAX ? r->len : KLOG_TEXT_MAX;
+        memcpy(out->text, r->text, out->len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&r->state, __ATOMIC_RELAXED) == want ? 1 : -1;
+    }
+    // Our record committed and now being overwritten, or a later one there
+    if ((st & ~1ULL) >= want) return -1;
+    // Not written yet, unless the producers have lapped us
+    return klog_head - seq > KLOG_RECORDS ? -1 : 0;
+}
+
+static void serial_putc(char c) {
+    int spin = 100000;
+    while (spin-- > 0 && !(inb(COM1 + 5) & 0x20)) {}
+    outb(COM1, (uint8_t)c);
+}
+
+static void serial_init(void) {
+    outb(COM1 + 1, 0x00);       // No interrupts
+    outb(COM1 + 3, 0x80);       // DLAB
+    outb(COM1 + 0, 0x01);       // 115200 baud
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03);       // 8N1
+    outb(COM1 + 2, 0xC7);       // FIFO on, cleared
+    outb(COM1 + 4, 0x03);       // DTR, RTS
+    serial_ready = 1;
+}
+
+static void console_append(const char* s, int n) {
+    uint64_t irq = spin_lock_irqsave(&console_lock);
+    for (int i = 0; i < n; i++) console[(console_end + (uint64_t)i) % KLOG_CONSOLE_SIZE] = s[i];
+    console_end += (uint64_t)n;
+    spin_unlock_irqrestore(&console_lock, irq);
+}
+
+// "[seconds.micros] text\n" to COM1, and to the console if severe enough
+static void klog_output(const klog_rec_t* r, int to_console) {
+    char line[KLOG_TEXT_MAX + 24];
+    klog_buf_t b = { line, 0, (int)sizeof(line) };
+    kb_putc(&b, '[');
+    kb_putu(&b, r->ts_ns / 1000000000ULL, 10, 0, 5, ' ');
+    kb_putc(&b, '.');
+    kb_putu(&b, r->ts_ns / 1000 % 1000000, 10, 0, 6, '0');
+    kb_putc(&b, ']');
+    kb_putc(&b, ' ');
+    for (int i = 0; i < r->len; i++) kb_putc(&b, r->text[i]);
+    kb_putc(&b, '\n');
+
+    for (int i = 0; i < b.len; i++) {
+        if (line[i] == '\n') serial_putc('\r');
+        serial_putc(line[i]);
+    }
+    if (to_console && r->level <= KLOG_CONSOLE_LEVEL) console_append(line, b.len);
+}
+
+// Output every committed record; stops at the first one still being written
+static void klog_drain(int to_console) {
+    if (!serial_ready) serial_init();
+    klog_rec_t rec;
+    while (klog_tail != klog_head) {
+        int rc = klog_fetch(klog_tail, &rec);
+        if (rc == 0) break;
+        if (rc < 0) __atomic_fetch_add(&klog_lost, 1, __ATOMIC_RELAXED);
+        else klog_output(&rec, to_console);
+        klog_tail++;
+    }
+    if (klog_lost != lost_reported) {
+        rec.ts_ns = timer_now_ns();
+        rec.level = KLOG_WARN;
+        rec.cpu = (uint8_t)smp_cpu_id();
+        klog_buf_t b = { rec.text, 0, KLOG_TEXT_MAX };
+        const char* msg = "klog: records lost: ";
+        while (*msg) kb_putc(&b, *msg++);
+        kb_putu(&b, klog_lost - lost_reported, 10, 0, 0, ' ');
+        rec.len = (uint16_t)(b.len < KLOG_TEXT_MAX ? b.len : KLOG_TEXT_MAX);
+        lost_reported = klog_lost;
+        klog_output(&rec, to_console);
+    }
+}
+
+static void klog_tick(uint64_t arg) {
+    (void)arg;
+    flush_timer_armed = 0;
+    flush_kick = 1;
+    waitq_wake_all(&klog_wq);
+}
+
+static int klog_pending(void* arg) {
+    (void)arg;
+    return flush_kick || klog_tail != klog_head;
+}
+
+static void klogd(void) {
+    for (;;) {
+        if (!flush_timer_armed && timer_is_active() &&
+            timer_add(timer_now_ns() + KLOG_FLUSH_INTERVAL_NS, klog_tick, 0) >= 0) {
+            flush_timer_armed = 1;
+        }
+        waitq_wait(&klog_wq, klog_pending, 0);
+        flush_kick = 0;
+        if (__atomic_exchange_n(&draining, 1, __ATOMIC_ACQUIRE)) continue;
+        klog_drain(1);
+        __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// ---- Public API ----
+
+void klog_start(void) {
+    if (klogd_running) return;
+    if (process_create("klogd", klogd, PRIORITY_LOW) >= 0) klogd_running = 1;
+}
+
+void klog_flush(void) {
+    // Whoever else was draining is not coming back on this path
+    __atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
+    klog_drain(0);
+    __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+}
+
+int klog_console_read(void* buf, uint32_t count, uint64_t* pos) {
+    if (!buf || !pos) return 0;
+    uint64_t irq = spin_lock_irqsave(&console_lock);
+    uint64_t oldest = console_end > KLOG_CONSOLE_SIZE ? console_end - KLOG_CONSOLE_SIZE : 0;
+    if (*pos < oldest) *pos = oldest;
+    if (*pos > console_end) *pos = console_end;
+    uint32_t n = 0;
+    for (; n < count && *pos + n < console_end; n++) {
+        ((char*)buf)[n] = console[(*pos + n) % KLOG_CONSOLE_SIZE];
+    }
+    *pos += n;
+    spin_unlock_irqrestore(&console_lock, irq);
+    return (int)n;
+}
@@ -0,0 +1,49 @@
+// klog.h - Kernel Log for Alteo OS
+// klog() formats a message and stores it as one record of a lock-free
+// ring, with a timestamp, the CPU and a level. A producer reserves a
+// sequence number with a single atomic add and fills the slot it names
+// with interrupts off for just that copy, so any context may log,
+// interrupt handlers included, and no caller ever waits on a device.
+//
+// Output is deferred to the klogd thread. It drains the ring to COM1 and,
+// for records at KLOG_CONSOLE_LEVEL or more severe, to the console text
+// buffer behind /dev/console, which the desktop terminal also shows.
+// When producers outrun klogd, the oldest records are overwritten and
+// counted as lost.
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "stdint.h"
+
+// Levels (as in syslog: lower is more severe)
+#define KLOG_EMERG      0
+#define KLOG_ERR        3
+#define KLOG_WARN       4
+#define KLOG_INFO       6
+#define KLOG_DEBUG      7
+
+#define KLOG_RECORDS        512         // Ring slots (power of two)
+#define KLOG_TEXT_MAX       120         // Longer messages are cut
+#define KLOG_CONSOLE_LEVEL  KLOG_INFO   // Least severe level on the console
+#define KLOG_CONSOLE_SIZE   16384       // Console text kept for readers
+#define KLOG_FLUSH_INTERVAL_NS  100000000ULL    // klogd's periodic wakeup
+
+// Log a printf-style message: %d %i %u %x %X %p %s %c %%, with 0-padding,
+// a width and the l, ll and z size prefixes
+void klog(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Log text as is, one record per line (e.g. writes to /dev/console)
+void klog_write(int level, const char* text, uint32_t len);
+
+// Start klogd (after process_init). Records logged before are kept.
+void klog_start(void);
+
+// Drain the ring to COM1 from the caller, for paths that never return
+void klog_flush(void);
+
+// Read console text from *pos (a byte position since boot, advanced past
+// what was read; text that was already overwritten is skipped). Returns
+// the number of bytes read, 0 at the end.
+int klog_console_read(void* buf, uint32_t count, uint64_t* pos);
+
+#endif
@@ -0,0 +1,31 @@
+// lockstat.c - Lock statistics for Alteo OS
+// Keeps the list of lockstat_t blocks (spinlock.h) that have been used,
+// for /proc/lockstat. Blocks are pushed once and never removed.
+#include "spinlock.h"
+
+static lockstat_t* volatile lockstat_head;
+
+void lockstat_list(lockstat_t* st) {
+    // Whoever flips listed pushes it; the push is lock-free since this
+    // runs inside other locks' acquisition paths
+    if (__atomic_exchange_n(&st->listed, 1, __ATOMIC_ACQ_REL)) return;
+    lockstat_t* head = lockstat_head;
+    do {
+        st->next = head;
+    } while (!__atomic_compare_exchange_n(&lockstat_head, &head, st, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+lockstat_t* lockstat_first(void) {
+    return __atomic_load_n(&lockstat_head, __ATOMIC_ACQUIRE);
+}
+
+void lockstat_reset(void) {
+    for (lockstat_t* st = lockstat_first(); st; st = st->next) {
+        st->acquired = 0;
+        st->contended = 0;
+        st->spin_cycles = 0;
+        st->hold_cycles = 0;
+        st->max_hold_cycles = 0;
+    }
+}
@@ -0,0 +1,35 @@
+// loopback.h - Loopback Interface for Alteo OS
+// Packets addressed to 127.0.0.0/8 or to our own address never reach the
+// NIC: ip_send_gather hands them here and they come back up through
+// ip_receive. There is no ARP, no Ethernet header and no checksum work
+// (delivered packets count as verified), and TCP may send frames of up to
+// 64KB as if the interface did TSO. Delivery is deferred to a "lo" kernel
+// thread (or socket_poll before it runs), so a sender is never re-entered
+// from its own output path.
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include "stdint.h"
+
+#define LO_QUEUE_MAX    64      // Packets in flight (power of two)
+#define LO_BUDGET       16      // Packets delivered per pass
+
+// Start the delivery thread (needs the scheduler)
+void lo_start(void);
+
+// Queue an IP packet made of an IP header (with the transport header
+// behind it) and a payload; both are copied. Returns 0, or -1 if the
+// queue is full.
+int  lo_xmit(const uint8_t* hdr, uint16_t hdr_len, const uint8_t* payload, uint16_t payload_len);
+
+// Deliver up to budget queued packets; returns the number delivered
+int  lo_poll(int budget);
+
+// Nonzero once the delivery thread runs
+int  lo_thread_active(void);
+
+// Packets delivered / dropped on a full queue
+uint32_t lo_get_packets(void);
+uint32_t lo_get_drops(void);
+
+#endif
@@ -0,0 +1,345 @@
+// mixer.c - Software Audio Mixer for Alteo OS
+// Writers own a stream's ring tail and the mixer thread its head and
+// resampling position, so data moves without a lock; mix_lock covers a
+// stream's format and state.
+#include "mixer.h"
+#include "ac97.h"
+#include "pcm.h"
+#include "klib.h"
+#include "heap.h"
+#include "spinlock.h"
+#include "waitq.h"
+#include "devfs.h"
+#include "epoll.h"
+#include "process.h"
+#include "scheduler.h"
+
+#define MIX_FREE    0
+#define MIX_OPEN    1
+#define MIX_CLOSING 2       // Freed by the mixer once drained
+
+typedef struct {
+    int       state;
+    uint32_t  rate;
+    int       channels;
+    uint32_t  step;         // Input frames per output frame (16.16)
+    uint32_t  pos;          // Position from the ring head, in input frames (16.16)
+    uint8_t*  ring;         // 0 for a tone
+    uint32_t  head, tail;   // Free-running byte offsets
+
+    // Tone generator
+    uint32_t  tone_period, tone_phase, tone_left;
+    int16_t   tone_amp;
+} mix_stream_t;
+
+static mix_stream_t streams[MIXER_MAX_STREAMS];
+static spinlock_t mix_lock = SPINLOCK_INIT;
+
+static waitq_t mix_wq = WAITQ_INIT;         // The mixer thread
+static waitq_t space_wq = WAITQ_INIT;       // Writers waiting for ring space
+static volatile int mix_pending = 0;
+static int mix_running = 0;
+
+// Output of one pass (stereo), and one stream's share of it
+static int16_t mix_acc[MIXER_BLOCK_FRAMES * 2];
+static int16_t mix_tmp[MIXER_BLOCK_FRAMES * 2];
+
+static int dsp_stream[MIXER_DSP_NODES];
+
+static int mixer_valid(int id) {
+    return id >= 0 && id < MIXER_MAX_STREAMS && streams[id].state == MIX_OPEN;
+}
+
+// Input frames per output frame at the codec's current rate
+static uint32_t mixer_step(uint32_t rate) {
+    uint32_t out = ac97_get_sample_rate();
+    if (!out) out = AUDIO_SAMPLE_RATE_48000;
+    return (uint32_t)(((uint64_t)rate << 16) / out);
+}
+
+// ---------- Mixing ----------
+
+static void mix_frame(mix_stream_t* s, uint32_t idx, int16_t* l, int16_t* r) {
+    uint32_t fb = (uint32_t)s->channels * 2;
+    const int16_t* p = (const int16_t*)(s->ring + ((s->head + idx * fb) & (MIXER_STREAM_BYTES - 1)));
+    *l = p[0];
+    *r = s->channels == 2 ? p[1] : p[0];
+}
+
+// Resample up to n output frames of s into out by linear interpolation,
+// consuming the input frames passed over. Returns the frames produced.
+static int mix_resample(mix_stream_t* s, int16_t* out, int n) {
+    uint32_t fb = (uint32_t)s->channels * 2;
+    uint32_t avail = (__atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) - s->head) / fb;
+    uint32_t pos = s->pos;
+    int i = 0;
+
+    for (; i < n; i++) {
+        uint32_t idx = pos >> 16, frac = pos & 0xFFFF;
+        if (idx + (frac ? 1 : 0) >= avail) break;
+        int16_t l, r;
+        mix_frame(s, idx, &l, &r);
+        if (frac) {
+            int16_t l1, r1;
+            mix_frame(s, idx + 1, &l1, &r1);
+            l = (int16_t)(l + (int32_t)(((int64_t)(l1 - l) * frac) >> 16));
+            r = (int16_t)(r + (int32_t)(((int64_t)(r1 - r) * frac) >> 16));
+        }
+        out[2 * i] = l;
+        out[2 * i + 1] = r;
+        pos += s->step;
+    }
+
+    uint32_t used = pos >> 16;
+    if (used > avail) used = avail;
+    s->pos = pos - (used << 16);
+    __atomic_store_n(&s->head, s->head + used * fb, __ATOMIC_RELEASE);
+    return i;
+}
+
+static int mix_tone(mix_stream_t* s, int16_t* out, int n) {
+    int i = 0;
+    for (; i < n && s->tone_left; i++, s->tone_left--) {
+        int16_t v = s->tone_phase < s->tone_period / 2 ? s->tone_amp : (int16_t)-s->tone_amp;
+        out[2 * i] = out[2 * i + 1] = v;
+        if (++s->tone_phase >= s->tone_period) s->tone_phase = 0;
+    }
+    return i;
+}
+
+// Mix one block of every stream into mix_acc. Streams with less queued
+// than the block contribute what they have. Returns the frames produced.
+static int mixer_mix_block(void) {
+    int frames = 0;
+    memset(mix_acc, 0, sizeof(mix_acc));
+
+    for (int id = 0; id < MIXER_MAX_STREAMS; id++) {
+        mix_stream_t* s = &streams[id];
+        uint8_t* drained = 0;
+        uint64_t flags = spin_lock_irqsave(&mix_lock);
+        if (s->state == MIX_FREE) {
+            spin_unlock_irqrestore(&mix_lock, flags);
+            continue;
+        }
+        int n = s->ring ? mix_resample(s, mix_tmp, MIXER_BLOCK_FRAMES)
+                        : mix_tone(s, mix_tmp, MIXER_BLOCK_FRAMES);
+        if (!n && s->state == MIX_CLOSING) {
+            drained = s->ring;
+            s->ring = 0;
+            s->state = MIX_FREE;
+        }
+        spin_unlock_irqrestore(&mix_lock, flags);
+        if (drained) kfree(drained);
+
+        if (n) {
+            pcm_mix(mix_acc, mix_tmp, n * 2);
+            if (n > frames) frames = n;
+        }
+    }
+    return frames;
+}
+
+static void mixer_notify_writers(void) {
+    waitq_wake_all(&space_wq);
+    char name[8] = "dsp0";
+    devfs_notify("dsp");
+    for (int i = 1; i < MIXER_DSP_NODES; i++) {
+        name[3] = (char)('0' + i);
+        devfs_notify(name);
+    }
+}
+
+static int mixer_due(void* arg) {
+    (void)arg;
+    return mix_pending;
+}
+
+// Bottom half of the AC97 refill: top the output up to the lead
+static void mixer_thread(void) {
+    for (;;) {
+        waitq_wait(&mix_wq, mixer_due, 0);
+        mix_pending = 0;
+
+        int mixed = 0;
+        while (ac97_stream_queued() < MIXER_LEAD_BYTES) {
+            int frames = mixer_mix_block();
+            if (!frames) break;
+            ac97_stream_write(mix_acc, (uint32_t)frames * 4);
+            mixed = 1;
+        }
+        if (mixed) mixer_notify_writers();
+    }
+}
+
+// Output drained or input arrived (safe from IRQ context)
+static void mixer_kick(void) {
+    mix_pending = 1;
+    waitq_wake_all(&mix_wq);
+}
+
+// ---------- Streams ----------
+
+int mixer_open(uint32_t rate, int channels) {
+    if (!ac97_is_available() || !rate || (channels != 1 && channels != 2)) return -1;
+    uint8_t* ring = (uint8_t*)kmalloc(MIXER_STREAM_BYTES);
+    if (!ring) return -1;
+
+    uint64_t flags = spin_lock_irqsave(&mix_lock);
+    for (int id = 0; id < MIXER_MAX_STREAMS; id++) {
+        mix_stream_t* s = &streams[id];
+        if (s->state != MIX_FREE) continue;
+        memset(s, 0, sizeof(*s));
+        s->state = MIX_OPEN;
+        s->rate = rate;
+        s->channels = channels;
+        s->step = mixer_step(rate);
+        s->ring = ring;
+        spin_unlock_irqrestore(&mix_lock, flags);
+        return id;
+    }
+    spin_unlock_irqrestore(&mix_lock, flags);
+    kfree(ring);
+    return -1;
+}
+
+int mixer_set_format(int id, uint32_t rate, int channels) {
+    if (!rate || (channels != 1 && channels != 2)) return -1;
+    uint64_t flags = spin_lock_irqsave(&mix_lock);
+    if (!mixer_valid(id) || !streams[id].ring) {
+        spin_unlock_irqrestore(&mix_lock, flags);
+        return -1;
+    }
+    mix_stream_t* s = &streams[id];
+    s->rate = rate;
+    s->channels = channels;
+    s->step = mixer_step(rate);
+    s->pos = 0;
+    s->head = s->tail;
+    spin_unlock_irqrestore(&mix_lock, flags);
+    return 0;
+}
+
+uint32_t mixer_space(int id) {
+    if (!mixer_valid(id) || !streams[id].ring) return 0;
+    mix_stream_t* s = &streams[id];
+    return MIXER_STREAM_BYTES - (s->tail - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE));
+}
+
+int mixer_write(int id, const void* data, uint32_t bytes) {
+    if (!mixer_valid(id) || !streams[id].ring || !data) return -1;
+    mix_stream_t* s = &streams[id];
+    uint32_t n = mixer_space(id);
+    if (n > bytes) n = bytes;
+    if (!n) return 0;
+
+    uint32_t off = s->tail & (MIXER_STREAM_BYTES - 1);
+    uint32_t first = MIXER_STREAM_BYTES - off;
+    if (first > n) first = n;
+    memcpy(s->ring + off, data, first);
+    if (n > first) memcpy(s->ring, (const uint8_t*)data + first, n - first);
+    __atomic_store_n(&s->tail, s->tail + n, __ATOMIC_RELEASE);
+    mixer_kick();
+    return (int)n;
+}
+
+void mixer_close(int id) {
+    uint64_t flags = spin_lock_irqsave(&mix_lock);
+    if (mixer_valid(id)) streams[id].state = MIX_CLOSING;
+    spin_unlock_irqrestore(&mix_lock, flags);
+    mixer_kick();
+}
+
+int mixer_tone(uint32_t freq, uint32_t duration_ms, int volume) {
+    if (!ac97_is_available() || !freq) return -1;
+    if (volume < 0) volume = 0;
+    if (volume > 100) volume = 100;
+    uint32_t rate = ac97_get_sample_rate();
+
+    uint64_t flags = spin_lock_irqsave(&mix_lock);
+    for (int id = 0; id < MIXER_MAX_STREAMS; id++) {
+        mix_stream_t* s = &streams[id];
+        if (s->state != MIX_FREE) continue;
+        memset(s, 0, sizeof(*s));
+        s->state = MIX_CLOSING;     // Freed when the tone ends
+        s->tone_period = rate / freq ? rate / freq : 1;
+        s->tone_left = (uint32_t)(((uint64_t)rate * duration_ms) / 1000);
+        s->tone_amp = (int16_t)((32767 * volume) / 100);
+        spin_unlock_irqrestore(&mix_lock, flags);
+        mixer_kick();
+        return 0;
+    }
+    spin_unlock_irqrestore(&mix_lock, flags);
+    return -1;
+}
+
+// ---------- /dev/dsp ----------
+
+static int dsp_space_available(void* arg) {
+    return mixer_space(*(int*)arg) > 0;
+}
+
+// Opened on first use at the codec's rate in stereo
+static int dsp_get_stream(int node) {
+    if (dsp_stream[node] < 0) dsp_stream[node] = mixer_open(ac97_get_sample_rate(), 2);
+    return dsp_stream[node];
+}
+
+// Blocks only while the stream's own ring is full
+static int dsp_write(void* data, const void* buf, uint32_t count, uint32_t offset) {
+    (void)offset;
+    int id = dsp_get_stream((int)(uint64_t)data);
+    if (id < 0) return -1;
+
+    uint32_t done = 0;
+    while (done < count) {
+        int n = mixer_write(id, (const uint8_t*)buf + done, count - done);
+        if (n < 0) return done ? (int)done : -1;
+        done += (uint32_t)n;
+        if (done < count && waitq_wait(&space_wq, dsp_space_available, &id) < 0) {
+            if (scheduler_is_running()) scheduler_yield();
+            else __asm__ volatile("pause");
+        }
+    }
+    return (int)done;
+}
+
+static int dsp_ioctl(void* data, uint64_t request, uint64_t arg) {
+    int id = dsp_get_stream((int)(uint64_t)data);
+    if (id < 0) return -1;
+    mix_stream_t* s = &streams[id];
+    switch (request) {
+        case MIXER_IOCTL_SET_RATE: return mixer_set_format(id, (uint32_t)arg, s->channels);
+        case MIXER_IOCTL_SET_CHANNELS: return mixer_set_format(id, s->rate, (int)arg);
+        case MIXER_IOCTL_GET_SPACE: return (int)mixer_space(id);
+        default: return -1;
+    }
+}
+
+static uint32_t dsp_poll(void* data) {
+    int id = dsp_stream[(int)(uint64_t)data];
+    return (id < 0 || mixer_space(id)) ? EPOLLOUT : 0;
+}
+
+// ---------- Initialization ----------
+
+void mixer_init(void) {
+    memset(streams, 0, sizeof(streams));
+    for (int i = 0; i < MIXER_DSP_NODES; i++) dsp_stream[i] = -1;
+    if (!ac97_is_available()) return;
+
+    ac97_stream_set_notify(mixer_kick);
+    char name[8] = "dsp0";
+    for (int i = 0; i < MIXER_DSP_NODES; i++) {
+        dev_ops_t ops = { .read = 0, .write = dsp_write, .ioctl = dsp_ioctl,
+                          .poll = dsp_poll, .dev_data = (void*)(uint64_t)i };
+        name[3] = (char)('0' + i);
+        devfs_register(i ? name : "dsp", DEV_TYPE_CHAR, DEV_MAJOR_SOUND, 3 + 16 * i, &ops);
+    }
+}
+
+void mixer_start(void) {
+    if (!ac97_is_available() || mix_running) return;
+    if (process_create("mixer", mixer_thread, PRIORITY_HIGH) < 0) return;
+    mix_running = 1;
+    mixer_kick();   // Tones queued during boot
+}
@@ -0,0 +1,55 @@
+// mixer.h - Software Audio Mixer for Alteo OS
+// Several clients play at once. Each stream has its own sample rate and
+// channel count and a ring that writes go into without blocking. The
+// "mixer" kernel thread, woken as the AC97 buffer completion interrupt
+// drains the output, resamples every stream to the codec's rate, sums
+// them with saturating SIMD adds (pcm_mix) and feeds the AC97 streaming
+// ring. It keeps only MIXER_LEAD_BYTES queued ahead of the DMA engine, so
+// a new stream is heard within a few blocks.
+//
+// /dev/dsp, /dev/dsp1... each play as one stream of signed 16-bit PCM,
+// stereo at the codec's rate unless changed by ioctl.
+#ifndef MIXER_H
+#define MIXER_H
+
+#include "stdint.h"
+
+#define MIXER_MAX_STREAMS   8
+#define MIXER_STREAM_BYTES  32768                       // Per stream ring (power of two)
+#define MIXER_BLOCK_FRAMES  1024                        // Output frames per mixing pass
+#define MIXER_LEAD_BYTES    (4 * MIXER_BLOCK_FRAMES * 4) // Output queued ahead of the DMA
+#define MIXER_DSP_NODES     4
+
+// /dev/dsp ioctls
+#define MIXER_IOCTL_SET_RATE     1      // arg = sample rate in Hz
+#define MIXER_IOCTL_SET_CHANNELS 2      // arg = 1 or 2
+#define MIXER_IOCTL_GET_SPACE    3      // Returns bytes writable without blocking
+
+// Register the /dev/dsp nodes and hook the AC97 refill (after ac97_init
+// and devfs_init)
+void mixer_init(void);
+
+// Start the mixer thread (after process_init)
+void mixer_start(void);
+
+// Open a stream of 16-bit PCM at rate Hz with 1 or 2 channels.
+// Returns its id, or -1.
+int mixer_open(uint32_t rate, int channels);
+
+// Change a stream's format; anything still queued is dropped
+int mixer_set_format(int id, uint32_t rate, int channels);
+
+// Queue up to bytes of PCM without blocking. Returns the bytes taken
+// (0 when the stream's ring is full), or -1.
+int mixer_write(int id, const void* data, uint32_t bytes);
+
+// Bytes mixer_write() would take now
+uint32_t mixer_space(int id);
+
+// Close a stream; what it has queued still plays
+void mixer_close(int id);
+
+// Mix a square wave into the output and return at once. volume 0-100.
+int mixer_tone(uint32_t freq, uint32_t duration_ms, int volume);
+
+#endif
@@ -1,6 +1,8 @@
 // mouse.c - High Res Mouse
 #include "mouse.h"
 #include "graphics.h"
+#include "input.h"
+#include "evdev.h"
 
 // IO
 static inline void outb(uint16_t port, uint8_t val) { asm volatile("outb %0, %1" : : "a"(val), "Nd"(port)); }
@@ -42,27 +44,32 @@ void mouse_handle_byte(uint8_t data) {
         mouse_cycle = 0;
         if (!(mouse_byte[0] & 0x08)) return;
         
-        mouse_buttons = mouse_byte[0] & 0x07;
-        
         // FIX: Cast to signed char.
         // X grows right (+), Y grows down (+). Mouse Y sends up as positive.
         int dx = (int8_t)mouse_byte[1]; 
         int dy = (int8_t)mouse_byte[2];
-        
-        mouse_x += dx;
-        mouse_y -= dy; // Subtract Y because screen Y grows downwards
-        
-        // Clamp bounds
-        int max_w = get_screen_width();
-        int max_h = get_screen_height();
-        
-        if (mouse_x < 0) mouse_x = 0;
-        if (mouse_x >= max_w) mouse_x = max_w - 1;
-        if (mouse_y < 0) mouse_y = 0;
-        if (mouse_y >= max_h) mouse_y = max_h - 1;
+        mouse_move(dx, -dy, mouse_byte[0] & 0x07);
+        evdev_pointer(EVDEV_PS2_MOUSE, dx, -dy, 0, mouse_byte[0] & 0x07);
     }
 }
 
+void mouse_move(int dx, int dy, uint8_t buttons) {
+    mouse_buttons = buttons;
+    mouse_x += dx;
+    mouse_y += dy;
+
+    // Clamp bounds
+    int max_w = get_screen_width();
+    int max_h = get_screen_height();
+
+    if (mouse_x < 0) mouse_x = 0;
+    if (mouse_x >= max_w) mouse_x = max_w - 1;
+    if (mouse_y < 0) mouse_y = 0;
+    if (mouse_y >= max_h) mouse_y = max_h - 1;
+
+    input_push_mouse(mouse_x, mouse_y, mouse_buttons);
+}
+
 void mouse_get_state(mouse_state_t* state) {
     state->x = mouse_x;
     state->y = mouse_y;
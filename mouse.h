@@ -4,5 +4,8 @@
 typedef struct { int x; int y; uint8_t buttons; } mouse_state_t;
 void mouse_init();
 void mouse_handle_byte(uint8_t data);
+// Move by (dx, dy) pixels (y grows down) with the given buttons held, and
+// queue the result for the desktop; shared by PS/2 and USB mice
+void mouse_move(int dx, int dy, uint8_t buttons);
 void mouse_get_state(mouse_state_t* state);
 #endif
\ No newline at end of file
@@ -0,0 +1,148 @@
+// nettap.c - Packet Capture for Alteo OS
+#include "nettap.h"
+#include "klib.h"
+#include "heap.h"
+#include "timer.h"
+#include "spinlock.h"
+#include "devfs.h"
+#include "epoll.h"
+
+static uint8_t* tap_ring;               // Allocated on the first start
+static uint32_t tap_head, tap_tail;     // Free-running byte offsets
+static uint32_t tap_snaplen;
+static volatile int tap_on;
+static uint32_t tap_captured, tap_dropped;
+static spinlock_t tap_lock = SPINLOCK_INIT;
+
+static void tap_ring_put(const uint8_t* src, uint32_t len) {
+    uint32_t off = tap_tail & (NETTAP_RING_BYTES - 1);
+    uint32_t first = NETTAP_RING_BYTES - off;
+    if (first > len) first = len;
+    memcpy(tap_ring + off, src, first);
+    if (len > first) memcpy(tap_ring, src + first, len - first);
+    tap_tail += len;
+}
+
+int nettap_start(uint32_t snaplen) {
+    if (!tap_ring) {
+        tap_ring = (uint8_t*)kmalloc(NETTAP_RING_BYTES);
+        if (!tap_ring) return -1;
+    }
+    uint64_t irq = spin_lock_irqsave(&tap_lock);
+    tap_head = tap_tail = 0;
+    tap_snaplen = snaplen ? (snaplen < NETTAP_SNAPLEN_MAX ? snaplen : NETTAP_SNAPLEN_MAX) : NETTAP_SNAPLEN;
+    tap_captured = tap_dropped = 0;
+    tap_on = 1;
+    spin_unlock_irqrestore(&tap_lock, irq);
+    return 0;
+}
+
+void nettap_stop(void) {
+    tap_on = 0;     // What is in the ring stays readable
+}
+
+int nettap_active(void) {
+    return tap_on;
+}
+
+void nettap_capture(const uint8_t* hdr, uint32_t hdr_len, const uint8_t* payload, uint32_t payload_len) {
+    if (!tap_on) return;
+    uint32_t len = hdr_len + payload_len;
+    uint32_t incl = len < tap_snaplen ? len : tap_snaplen;
+    uint64_t now = timer_now_ns();
+
+    pcap_record_t rec;
+    rec.ts_sec = (uint32_t)(now / 1000000000ULL);
+    rec.ts_usec = (uint32_t)((now % 1000000000ULL) / 1000);
+    rec.incl_len = incl;
+    rec.orig_len = len;
+
+    uint64_t irq = spin_lock_irqsave(&tap_lock);
+    if (NETTAP_RING_BYTES - (tap_tail - tap_head) < sizeof(rec) + incl) {
+        tap_dropped++;
+        spin_unlock_irqrestore(&tap_lock, irq);
+        return;
+    }
+    tap_ring_put((const uint8_t*)&rec, sizeof(rec));
+    uint32_t h = hdr_len < incl ? hdr_len : incl;
+    if (h) tap_ring_put(hdr, h);
+    if (incl > h) tap_ring_put(payload, incl - h);
+    tap_captured++;
+    spin_unlock_irqrestore(&tap_lock, irq);
+    devfs_notify("netcap");
+}
+
+uint32_t nettap_get_captured(void) {
+    return tap_captured;
+}
+
+uint32_t nettap_get_dropped(void) {
+    return tap_dropped;
+}
+
+// ---- /dev/netcap ----
+
+// A reader starting at offset 0 gets the file header first, then the
+// records in the ring (which it consumes)
+static int netcap_read(void* data, void* buf, uint32_t count, uint32_t offset) {
+    (void)data;
+    uint8_t* dst = (uint8_t*)buf;
+    uint32_t done = 0;
+
+    if (offset < sizeof(pcap_file_header_t)) {
+        pcap_file_header_t fh;
+        fh.magic = PCAP_MAGIC;
+        fh.version_major = 2;
+        fh.version_minor = 4;
+        fh.thiszone = 0;
+        fh.sigfigs = 0;
+        fh.snaplen = tap_snaplen ? tap_snaplen : NETTAP_SNAPLEN;
+        fh.linktype = PCAP_LINKTYPE_ETH;
+        uint32_t n = sizeof(fh) - offset;
+        if (n > count) n = count;
+        memcpy(dst, (const uint8_t*)&fh + offset, n);
+        done = n;
+    }
+    if (!tap_ring) return (int)done;
+
+    uint64_t irq = spin_lock_irqsave(&tap_lock);
+    uint32_t n = tap_tail - tap_head;
+    if (n > count - done) n = count - done;
+    uint32_t off = tap_head & (NETTAP_RING_BYTES - 1);
+    uint32_t first = NETTAP_RING_BYTES - off;
+    if (first > n) first = n;
+    memcpy(dst + done, tap_ring + off, first);
+    if (n > first) memcpy(dst + done + first, tap_ring, n - first);
+    tap_head += n;
+    spin_unlock_irqrestore(&tap_lock, irq);
+    return (int)(done + n);
+}
+
+// "1" [snaplen] starts a capture, "0" stops it
+static int netcap_write(void* data, const void* buf, uint32_t count, uint32_t offset) {
+    (void)data; (void)offset;
+    const char* s = (const char*)buf;
+    if (count == 0) return 0;
+    if (s[0] == '0') {
+        nettap_stop();
+        return (int)count;
+    }
+    if (s[0] != '1') return -1;
+    uint32_t snaplen = 0;
+    for (uint32_t i = 1; i < count; i++) {
+        if (s[i] >= '0' && s[i] <= '9') snaplen = snaplen * 10 + (uint32_t)(s[i] - '0');
+        else if (snaplen) break;
+    }
+    return nettap_start(snaplen) < 0 ? -1 : (int)count;
+}
+
+static uint32_t netcap_poll(void* data) {
+    (void)data;
+    return tap_tail != tap_head ? EPOLLIN | EPOLLOUT : EPOLLOUT;
+}
+
+void nettap_init(void) {
+    dev_ops_t ops = { .read = netcap_read, .write = netcap_write, .ioctl = 0,
+                      .poll = netcap_poll, .dev_data = 0 };
+    devfs_register("netcap", DEV_TYPE_CHAR, DEV_MAJOR_NET, 0, &ops);
+}
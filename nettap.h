@@ -0,0 +1,55 @@
+// nettap.h - Packet Capture for Alteo OS
+// A tap on the e1000 RX and TX paths. While capture is on, every frame
+// the NIC receives or is handed is copied (up to the snap length) into a
+// byte ring that already holds a pcap stream: /dev/netcap reads out the
+// pcap file header followed by records, consumed as they are read.
+// Frames arriving at a full ring are counted and dropped from the capture
+// (never from the network). Writing "1" [snaplen] to /dev/netcap starts
+// a capture, "0" stops it.
+#ifndef NETTAP_H
+#define NETTAP_H
+
+#include "stdint.h"
+
+#define NETTAP_RING_BYTES   (256 * 1024)    // Power of two
+#define NETTAP_SNAPLEN      256             // Default bytes kept per frame
+#define NETTAP_SNAPLEN_MAX  65535
+
+// pcap file format (little-endian, microsecond timestamps, Ethernet)
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_LINKTYPE_ETH   1
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_t;
+
+// Register /dev/netcap (after devfs_init)
+void nettap_init(void);
+
+// Start capturing with the given snap length (0: NETTAP_SNAPLEN). Returns
+// 0, or -1 if the ring cannot be allocated.
+int  nettap_start(uint32_t snaplen);
+void nettap_stop(void);
+int  nettap_active(void);
+
+// A frame made of hdr followed by payload (either may be empty) went by
+void nettap_capture(const uint8_t* hdr, uint32_t hdr_len, const uint8_t* payload, uint32_t payload_len);
+
+// Frames captured / lost to a full ring since the capture started
+uint32_t nettap_get_captured(void);
+uint32_t nettap_get_dropped(void);
+
+#endif
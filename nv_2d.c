@@ -5,6 +5,7 @@
 // Reference: envytools 2D engine documentation
 
 #include "nv_2d.h"
+#include "klib.h"
 #include "gpu.h"
 #include "heap.h"
 
@@ -16,11 +17,6 @@ nv_2d_state_t* nv_2d_get_state(void) {
 }
 
 // ---- Helpers ----
-static void _2d_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
 // Write a method to the 2D engine (NV50+ direct method kick)
 // On real hardware this would go through a FIFO push buffer channel.
 // For simplicity, we write methods directly to PGRAPH subchannel registers.
@@ -186,9 +182,9 @@ void nv_2d_rect_fill(int x, int y, int w, int h, uint32_t color) {
 // Blit (Screen-to-Screen Copy)
 // ============================================================
 
-static void nv50_blit(int dst_x, int dst_y, int src_x, int src_y, int w, int h) {
-    // Set operation to SRCCOPY
-    nv50_2d_method(NV50_2D_OPERATION, NV50_2D_OP_SRCCOPY);
+static void nv50_blit(int dst_x, int dst_y, int src_x, int src_y, int w, int h, uint32_t op) {
+    // Set operation (SRCCOPY or BLEND)
+    nv50_2d_method(NV50_2D_OPERATION, op);
 
     // Set destination position
     nv50_2d_method(NV50_2D_BLIT_DST_X, (uint32_t)dst_x);
@@ -244,7 +240,7 @@ void nv_2d_blit(int dst_x, int dst_y, int src_x, int src_y, int w, int h) {
     if (!state_2d.initialized) return;
 
     if (state_2d.use_nv50_engine) {
-        nv50_blit(dst_x, dst_y, src_x, src_y, w, h);
+        nv50_blit(dst_x, dst_y, src_x, src_y, w, h, NV50_2D_OP_SRCCOPY);
     } else {
         legacy_blit(dst_x, dst_y, src_x, src_y, w, h);
     }
@@ -257,6 +253,19 @@ void nv_2d_copy_rect(int dst_x, int dst_y, int src_x, int src_y, int w, int h) {
     nv_2d_blit(dst_x, dst_y, src_x, src_y, w, h);
 }
 
+void nv_2d_blit_blend(int dst_x, int dst_y, int src_x, int src_y, int w, int h) {
+    if (!state_2d.initialized) return;
+
+    if (state_2d.use_nv50_engine) {
+        nv50_blit(dst_x, dst_y, src_x, src_y, w, h, NV50_2D_OP_BLEND);
+        nv50_2d_method(NV50_2D_OPERATION, NV50_2D_OP_SRCCOPY);  // The default
+    } else {
+        legacy_blit(dst_x, dst_y, src_x, src_y, w, h);
+    }
+
+    state_2d.blits_count++;
+}
+
 // ============================================================
 // CPU-to-VRAM Copy
 // ============================================================
@@ -348,7 +357,7 @@ int nv_2d_init(void) {
     gpu_state_t* g = gpu_get_state();
     if (!g->initialized) return -1;
 
-    _2d_memset(&state_2d, 0, sizeof(nv_2d_state_t));
+    memset(&state_2d, 0, sizeof(nv_2d_state_t));
 
     // Select 2D class based on architecture
     if (g->arch >= NV_ARCH_NVE0) {
@@ -157,6 +157,9 @@ void nv_2d_rect_fill(int x, int y, int w, int h, uint32_t color);
 void nv_2d_blit(int dst_x, int dst_y, int src_x, int src_y, int w, int h);
 void nv_2d_copy_from_cpu(int dst_x, int dst_y, int w, int h, uint32_t* pixels);
 void nv_2d_copy_rect(int dst_x, int dst_y, int src_x, int src_y, int w, int h);
+// Blit blending the source over the destination by its per-pixel alpha
+// (NV50+; earlier chips copy)
+void nv_2d_blit_blend(int dst_x, int dst_y, int src_x, int src_y, int w, int h);
 
 // ---- Flip Integration ----
 // Replaces software flip_buffer() with GPU-accelerated VRAM blit
@@ -5,22 +5,12 @@
 // Reference: envytools graph engine documentation
 
 #include "nv_3d.h"
+#include "klib.h"
 #include "nv_fifo.h"
 #include "gpu.h"
 #include "heap.h"
 
 // ---- Helpers ----
-static void _3d_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
-static void _3d_memcpy(void* dst, const void* src, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (uint64_t i = 0; i < n; i++) d[i] = s[i];
-}
-
 // Minimal float helpers (kernel has no math library)
 static float _3d_fabs(float x) { return x < 0 ? -x : x; }
 
@@ -64,13 +54,25 @@ nv_3d_state_t* nv_3d_get_state(void) {
 }
 
 // ---- Push helper (uses default FIFO channel 0, subchannel 3 for 3D) ----
+// Methods are recorded into cmd_3d and submitted in batches
+static nv_fifo_cmdbuf_t cmd_3d;
+
 static void push_3d(uint32_t method, uint32_t data) {
     nv_fifo_state_t* fifo = nv_fifo_get_state();
     if (fifo->initialized && fifo->channels[0].active) {
-        nv_fifo_push_method(0, NV_FIFO_SUBCHAN_3D, method, data);
+        nv_fifo_cmdbuf_method(&cmd_3d, NV_FIFO_SUBCHAN_3D, method, data);
     }
 }
 
+uint32_t nv_3d_flush(void) {
+    return nv_fifo_cmdbuf_submit(&cmd_3d);
+}
+
+void nv_3d_finish(void) {
+    uint32_t seq = nv_3d_flush();
+    if (seq) nv_fifo_wait_fence(0, seq);
+}
+
 // Push float as uint32 (bitwise reinterpret)
 static void push_3d_float(uint32_t method, float val) {
     union { float f; uint32_t u; } conv;
@@ -83,7 +85,7 @@ static void push_3d_float(uint32_t method, float val) {
 // ============================================================
 
 void nv_3d_load_identity(nv_mat4_t* mat) {
-    _3d_memset(mat, 0, sizeof(nv_mat4_t));
+    memset(mat, 0, sizeof(nv_mat4_t));
     mat->m[0]  = 1.0f;
     mat->m[5]  = 1.0f;
     mat->m[10] = 1.0f;
@@ -91,7 +93,7 @@ void nv_3d_load_identity(nv_mat4_t* mat) {
 }
 
 void nv_3d_load_ortho(nv_mat4_t* mat, float l, float r, float b, float t, float n, float f) {
-    _3d_memset(mat, 0, sizeof(nv_mat4_t));
+    memset(mat, 0, sizeof(nv_mat4_t));
 
     float rl = r - l;
     float tb = t - b;
@@ -111,7 +113,7 @@ void nv_3d_load_ortho(nv_mat4_t* mat, float l, float r, float b, float t, float
 }
 
 void nv_3d_load_perspective(nv_mat4_t* mat, float fov_deg, float aspect, float near, float far) {
-    _3d_memset(mat, 0, sizeof(nv_mat4_t));
+    memset(mat, 0, sizeof(nv_mat4_t));
 
     float half_fov = fov_deg / 2.0f;
     float t = _3d_tanf_approx(half_fov);
@@ -139,16 +141,16 @@ void nv_3d_multiply_mat4(nv_mat4_t* result, const nv_mat4_t* a, const nv_mat4_t*
                 a->m[3 * 4 + row] * b->m[col * 4 + 3];
         }
     }
-    _3d_memcpy(result, &tmp, sizeof(nv_mat4_t));
+    memcpy(result, &tmp, sizeof(nv_mat4_t));
 }
 
 void nv_3d_set_modelview(const nv_mat4_t* mat) {
-    _3d_memcpy(&state_3d.modelview, mat, sizeof(nv_mat4_t));
+    memcpy(&state_3d.modelview, mat, sizeof(nv_mat4_t));
     nv_3d_update_mvp();
 }
 
 void nv_3d_set_projection(const nv_mat4_t* mat) {
-    _3d_memcpy(&state_3d.projection, mat, sizeof(nv_mat4_t));
+    memcpy(&state_3d.projection, mat, sizeof(nv_mat4_t));
     nv_3d_update_mvp();
 }
 
@@ -160,31 +162,109 @@ void nv_3d_update_mvp(void) {
 // Pipeline State
 // ============================================================
 
+static int hw_3d_ready(void) {
+    nv_fifo_state_t* fifo = nv_fifo_get_state();
+    return fifo->initialized && fifo->channels[0].active;
+}
+
+// Send a state register unless the GPU already holds 'data'
+static void set_reg(uint32_t method, uint32_t data) {
+    uint32_t i = method >> 2;
+    uint32_t bit = 1u << (i & 31);
+    if ((state_3d.shadow_valid[i >> 5] & bit) && state_3d.shadow[i] == data) {
+        state_3d.state_skipped++;
+        return;
+    }
+    push_3d(method, data);
+    state_3d.shadow[i] = data;
+    state_3d.shadow_valid[i >> 5] |= bit;
+    state_3d.state_methods++;
+}
+
+static const uint32_t vtx_formats[5] = {
+    0, NV50_3D_VTX_FMT_32, NV50_3D_VTX_FMT_32_32,
+    NV50_3D_VTX_FMT_32_32_32, NV50_3D_VTX_FMT_32_32_32_32
+};
+
+// Bring the GPU up to date with every dirty group; called before
+// anything that renders
+static void emit_state(void) {
+    uint32_t d = state_3d.dirty;
+    if (!d || !hw_3d_ready()) return;
+    state_3d.dirty = 0;
+
+    gpu_state_t* g = gpu_get_state();
+    int nv50 = g->initialized && g->arch >= NV_ARCH_NV50;
+
+    if ((d & NV_3D_DIRTY_RT) && nv50) {
+        set_reg(NV50_3D_RT_ADDRESS_HI(0), (uint32_t)(state_3d.rt_address >> 32));
+        set_reg(NV50_3D_RT_ADDRESS_LO(0), (uint32_t)(state_3d.rt_address & 0xFFFFFFFF));
+        set_reg(NV50_3D_RT_FORMAT(0), state_3d.rt_format);
+        set_reg(NV50_3D_RT_PITCH(0), (uint32_t)state_3d.rt_pitch);
+    }
+    if ((d & NV_3D_DIRTY_ZETA) && nv50 && state_3d.depth_address) {
+        set_reg(NV50_3D_ZETA_ADDRESS_HI, (uint32_t)(state_3d.depth_address >> 32));
+        set_reg(NV50_3D_ZETA_ADDRESS_LO, (uint32_t)(state_3d.depth_address & 0xFFFFFFFF));
+        set_reg(NV50_3D_ZETA_FORMAT, 0x0A);  // Z24S8 (24-bit depth + 8-bit stencil)
+    }
+    if ((d & NV_3D_DIRTY_VIEWPORT) && nv50) {
+        uint32_t horiz = (uint32_t)state_3d.vp_x | ((uint32_t)state_3d.vp_w << 16);
+        uint32_t vert = (uint32_t)state_3d.vp_y | ((uint32_t)state_3d.vp_h << 16);
+        set_reg(NV50_3D_VIEWPORT_HORIZ, horiz);
+        set_reg(NV50_3D_VIEWPORT_VERT, vert);
+        set_reg(NV50_3D_SCISSOR_HORIZ, horiz);
+        set_reg(NV50_3D_SCISSOR_VERT, vert);
+    }
+    if (d & NV_3D_DIRTY_DEPTH) {
+        set_reg(NV50_3D_DEPTH_TEST_ENABLE, state_3d.depth_enabled ? 1 : 0);
+        set_reg(NV50_3D_DEPTH_WRITE_ENABLE, state_3d.depth_write ? 1 : 0);
+        set_reg(NV50_3D_DEPTH_TEST_FUNC, state_3d.depth_func);
+    }
+    if (d & NV_3D_DIRTY_BLEND) {
+        set_reg(NV50_3D_BLEND_ENABLE(0), state_3d.blend_enabled ? 1 : 0);
+        set_reg(NV50_3D_BLEND_EQUATION_RGB, state_3d.blend_eq_rgb);
+        set_reg(NV50_3D_BLEND_FUNC_SRC_RGB, state_3d.blend_src_rgb);
+        set_reg(NV50_3D_BLEND_FUNC_DST_RGB, state_3d.blend_dst_rgb);
+        set_reg(NV50_3D_BLEND_EQUATION_A, state_3d.blend_eq_a);
+        set_reg(NV50_3D_BLEND_FUNC_SRC_A, state_3d.blend_src_a);
+        set_reg(NV50_3D_BLEND_FUNC_DST_A, state_3d.blend_dst_a);
+    }
+    if (d & NV_3D_DIRTY_CULL) {
+        set_reg(NV50_3D_CULL_FACE_ENABLE, state_3d.cull_enabled ? 1 : 0);
+        if (state_3d.cull_enabled) set_reg(NV50_3D_CULL_FACE, state_3d.cull_face);
+        set_reg(NV50_3D_FRONT_FACE, state_3d.front_face);
+    }
+    if ((d & NV_3D_DIRTY_ARRAYS) && nv50) {
+        for (int i = 0; i < NV_3D_MAX_ATTRIBS; i++) {
+            nv_3d_vertex_array_t* va = &state_3d.arrays[i];
+            if (!va->enabled) {
+                set_reg(NV50_3D_VERTEX_ARRAY_FETCH(i), 0);
+                continue;
+            }
+            set_reg(NV50_3D_VERTEX_ARRAY_ATTRIB(i),
+                    (uint32_t)i | vtx_formats[va->size] | NV50_3D_VTX_TYPE_FLOAT);
+            set_reg(NV50_3D_VERTEX_ARRAY_START_HI(i), (uint32_t)(va->address >> 32));
+            set_reg(NV50_3D_VERTEX_ARRAY_START_LO(i), (uint32_t)(va->address & 0xFFFFFFFF));
+            set_reg(NV50_3D_VERTEX_ARRAY_LIMIT_HI(i), (uint32_t)(va->limit >> 32));
+            set_reg(NV50_3D_VERTEX_ARRAY_LIMIT_LO(i), (uint32_t)(va->limit & 0xFFFFFFFF));
+            set_reg(NV50_3D_VERTEX_ARRAY_FETCH(i),
+                    NV50_3D_VERTEX_ARRAY_FETCH_ENABLE | (uint32_t)va->stride);
+        }
+    }
+}
+
 void nv_3d_set_render_target(uint64_t vram_addr, int width, int height, int pitch) {
     state_3d.rt_address = vram_addr;
     state_3d.rt_width = width;
     state_3d.rt_height = height;
     state_3d.rt_pitch = pitch;
     state_3d.rt_format = 0xCF;  // XRGB8888
-
-    gpu_state_t* g = gpu_get_state();
-    if (g->initialized && g->arch >= NV_ARCH_NV50) {
-        push_3d(NV50_3D_RT_ADDRESS_HI(0), (uint32_t)(vram_addr >> 32));
-        push_3d(NV50_3D_RT_ADDRESS_LO(0), (uint32_t)(vram_addr & 0xFFFFFFFF));
-        push_3d(NV50_3D_RT_FORMAT(0), 0xCF);  // XRGB8888
-        push_3d(NV50_3D_RT_PITCH(0), (uint32_t)pitch);
-    }
+    state_3d.dirty |= NV_3D_DIRTY_RT;
 }
 
 void nv_3d_set_depth_buffer(uint64_t vram_addr) {
     state_3d.depth_address = vram_addr;
-
-    gpu_state_t* g = gpu_get_state();
-    if (g->initialized && g->arch >= NV_ARCH_NV50) {
-        push_3d(NV50_3D_ZETA_ADDRESS_HI, (uint32_t)(vram_addr >> 32));
-        push_3d(NV50_3D_ZETA_ADDRESS_LO, (uint32_t)(vram_addr & 0xFFFFFFFF));
-        push_3d(NV50_3D_ZETA_FORMAT, 0x0A);  // Z24S8 (24-bit depth + 8-bit stencil)
-    }
+    state_3d.dirty |= NV_3D_DIRTY_ZETA;
 }
 
 void nv_3d_set_viewport(int x, int y, int w, int h) {
@@ -192,14 +272,7 @@ void nv_3d_set_viewport(int x, int y, int w, int h) {
     state_3d.vp_y = y;
     state_3d.vp_w = w;
     state_3d.vp_h = h;
-
-    gpu_state_t* g = gpu_get_state();
-    if (g->initialized && g->arch >= NV_ARCH_NV50) {
-        push_3d(NV50_3D_VIEWPORT_HORIZ, (uint32_t)x | ((uint32_t)w << 16));
-        push_3d(NV50_3D_VIEWPORT_VERT, (uint32_t)y | ((uint32_t)h << 16));
-        push_3d(NV50_3D_SCISSOR_HORIZ, (uint32_t)x | ((uint32_t)w << 16));
-        push_3d(NV50_3D_SCISSOR_VERT, (uint32_t)y | ((uint32_t)h << 16));
-    }
+    state_3d.dirty |= NV_3D_DIRTY_VIEWPORT;
 }
 
 void nv_3d_set_depth_range(float near, float far) {
@@ -209,22 +282,22 @@ void nv_3d_set_depth_range(float near, float far) {
 
 void nv_3d_depth_test(int enable) {
     state_3d.depth_enabled = enable;
-    push_3d(NV50_3D_DEPTH_TEST_ENABLE, enable ? 1 : 0);
+    state_3d.dirty |= NV_3D_DIRTY_DEPTH;
 }
 
 void nv_3d_depth_write(int enable) {
     state_3d.depth_write = enable;
-    push_3d(NV50_3D_DEPTH_WRITE_ENABLE, enable ? 1 : 0);
+    state_3d.dirty |= NV_3D_DIRTY_DEPTH;
 }
 
 void nv_3d_depth_func(uint32_t func) {
     state_3d.depth_func = func;
-    push_3d(NV50_3D_DEPTH_TEST_FUNC, func);
+    state_3d.dirty |= NV_3D_DIRTY_DEPTH;
 }
 
 void nv_3d_blend_enable(int enable) {
     state_3d.blend_enabled = enable;
-    push_3d(NV50_3D_BLEND_ENABLE(0), enable ? 1 : 0);
+    state_3d.dirty |= NV_3D_DIRTY_BLEND;
 }
 
 void nv_3d_blend_func(uint32_t src_rgb, uint32_t dst_rgb, uint32_t src_a, uint32_t dst_a) {
@@ -232,30 +305,24 @@ void nv_3d_blend_func(uint32_t src_rgb, uint32_t dst_rgb, uint32_t src_a, uint32
     state_3d.blend_dst_rgb = dst_rgb;
     state_3d.blend_src_a = src_a;
     state_3d.blend_dst_a = dst_a;
-
-    push_3d(NV50_3D_BLEND_FUNC_SRC_RGB, src_rgb);
-    push_3d(NV50_3D_BLEND_FUNC_DST_RGB, dst_rgb);
-    push_3d(NV50_3D_BLEND_FUNC_SRC_A, src_a);
-    push_3d(NV50_3D_BLEND_FUNC_DST_A, dst_a);
+    state_3d.dirty |= NV_3D_DIRTY_BLEND;
 }
 
 void nv_3d_blend_equation(uint32_t eq_rgb, uint32_t eq_a) {
     state_3d.blend_eq_rgb = eq_rgb;
     state_3d.blend_eq_a = eq_a;
-    push_3d(NV50_3D_BLEND_EQUATION_RGB, eq_rgb);
-    push_3d(NV50_3D_BLEND_EQUATION_A, eq_a);
+    state_3d.dirty |= NV_3D_DIRTY_BLEND;
 }
 
 void nv_3d_cull_face(int enable, uint32_t face) {
     state_3d.cull_enabled = enable;
     state_3d.cull_face = face;
-    push_3d(NV50_3D_CULL_FACE_ENABLE, enable ? 1 : 0);
-    if (enable) push_3d(NV50_3D_CULL_FACE, face);
+    state_3d.dirty |= NV_3D_DIRTY_CULL;
 }
 
 void nv_3d_front_face(uint32_t winding) {
     state_3d.front_face = winding;
-    push_3d(NV50_3D_FRONT_FACE, winding);
+    state_3d.dirty |= NV_3D_DIRTY_CULL;
 }
 
 // ============================================================
@@ -278,6 +345,7 @@ void nv_3d_clear(uint32_t buffers) {
 
     if (g->initialized && g->arch >= NV_ARCH_NV50) {
         // Hardware clear via 3D engine
+        emit_state();
         push_3d_float(NV50_3D_CLEAR_COLOR(0), state_3d.clear_color[0]);
         push_3d_float(NV50_3D_CLEAR_COLOR(1), state_3d.clear_color[1]);
         push_3d_float(NV50_3D_CLEAR_COLOR(2), state_3d.clear_color[2]);
@@ -285,7 +353,7 @@ void nv_3d_clear(uint32_t buffers) {
         push_3d_float(NV50_3D_CLEAR_DEPTH, state_3d.clear_depth);
         push_3d(NV50_3D_CLEAR_STENCIL, (uint32_t)state_3d.clear_stencil);
         push_3d(NV50_3D_CLEAR_BUFFERS, buffers);
-        nv_fifo_kick(0);
+        nv_3d_flush();
     } else if (g->vram_mapped && g->vram && (buffers & NV50_3D_CLEAR_BUF_COLOR)) {
         // Software clear fallback
         uint8_t r = (uint8_t)(state_3d.clear_color[0] * 255.0f);
@@ -306,40 +374,78 @@ void nv_3d_clear(uint32_t buffers) {
 // ============================================================
 
 void nv_3d_draw_begin(uint32_t primitive) {
+    emit_state();
     push_3d(NV50_3D_VERTEX_BEGIN_GL, primitive);
 }
 
+// Send an immediate-mode attribute. Writing attribute 0 emits a vertex,
+// so it always goes out; any other attribute is skipped when it already
+// holds the same value (e.g. a color shared by every vertex).
+static void push_attr(int attr, uint32_t method, const float* v, int n) {
+    uint32_t bits[4];
+    memcpy(bits, v, (size_t)n * 4);
+    if (attr > 0 && attr < NV_3D_MAX_ATTRIBS) {
+        if (state_3d.attr_method[attr] == method &&
+            memcmp(state_3d.attr_value[attr], bits, (size_t)n * 4) == 0)
+            return;
+        state_3d.attr_method[attr] = method;
+        memcpy(state_3d.attr_value[attr], bits, (size_t)n * 4);
+    }
+    for (int i = 0; i < n; i++) push_3d(method + (uint32_t)i * 4, bits[i]);
+}
+
 void nv_3d_draw_vertex_4f(int attr, float x, float y, float z, float w) {
-    // Write 4 floats to vertex attribute register
-    push_3d_float(NV50_3D_VTX_ATTR_4F(attr) + 0x00, x);
-    push_3d_float(NV50_3D_VTX_ATTR_4F(attr) + 0x04, y);
-    push_3d_float(NV50_3D_VTX_ATTR_4F(attr) + 0x08, z);
-    push_3d_float(NV50_3D_VTX_ATTR_4F(attr) + 0x0C, w);
+    float v[4] = { x, y, z, w };
+    push_attr(attr, NV50_3D_VTX_ATTR_4F(attr), v, 4);
 }
 
 void nv_3d_draw_vertex_3f(int attr, float x, float y, float z) {
-    push_3d_float(NV50_3D_VTX_ATTR_3F(attr) + 0x00, x);
-    push_3d_float(NV50_3D_VTX_ATTR_3F(attr) + 0x04, y);
-    push_3d_float(NV50_3D_VTX_ATTR_3F(attr) + 0x08, z);
+    float v[3] = { x, y, z };
+    push_attr(attr, NV50_3D_VTX_ATTR_3F(attr), v, 3);
 }
 
 void nv_3d_draw_vertex_2f(int attr, float x, float y) {
-    push_3d_float(NV50_3D_VTX_ATTR_2F(attr) + 0x00, x);
-    push_3d_float(NV50_3D_VTX_ATTR_2F(attr) + 0x04, y);
+    float v[2] = { x, y };
+    push_attr(attr, NV50_3D_VTX_ATTR_2F(attr), v, 2);
 }
 
 void nv_3d_draw_end(void) {
     push_3d(NV50_3D_VERTEX_END_GL, 0);
-    nv_fifo_kick(0);
     state_3d.draw_calls++;
 }
 
+// ============================================================
+// Vertex Arrays
+// ============================================================
+
+int nv_3d_vertex_array(int attr, const nv_bo_t* bo, uint64_t offset, int size, int stride) {
+    if (attr < 0 || attr >= NV_3D_MAX_ATTRIBS || !bo) return -1;
+    if (size < 1 || size > 4 || stride < 0 || stride > 0xFFF) return -1;
+    if (offset >= bo->size) return -1;
+
+    nv_3d_vertex_array_t* va = &state_3d.arrays[attr];
+    va->enabled = 1;
+    va->size = size;
+    va->stride = stride;
+    va->address = bo->gpu_offset + offset;
+    va->limit = bo->gpu_offset + bo->size - 1;
+    state_3d.dirty |= NV_3D_DIRTY_ARRAYS;
+    return 0;
+}
+
+void nv_3d_vertex_array_disable(int attr) {
+    if (attr < 0 || attr >= NV_3D_MAX_ATTRIBS) return;
+    state_3d.arrays[attr].enabled = 0;
+    state_3d.dirty |= NV_3D_DIRTY_ARRAYS;
+}
+
 void nv_3d_draw_arrays(uint32_t primitive, int first, int count) {
+    if (count <= 0) return;
+    emit_state();
     push_3d(NV50_3D_VERTEX_BEGIN_GL, primitive);
     push_3d(NV50_3D_VERTEX_ARRAY_START, (uint32_t)first);
     push_3d(NV50_3D_VERTEX_ARRAY_COUNT, (uint32_t)count);
     push_3d(NV50_3D_VERTEX_END_GL, 0);
-    nv_fifo_kick(0);
     state_3d.draw_calls++;
     state_3d.triangles_drawn += (uint64_t)(count / 3);
 }
@@ -432,7 +538,8 @@ void nv_3d_sw_draw_triangle(nv_vertex_t* v0, nv_vertex_t* v1, nv_vertex_t* v2,
 int nv_3d_init(void) {
     gpu_state_t* g = gpu_get_state();
 
-    _3d_memset(&state_3d, 0, sizeof(nv_3d_state_t));
+    memset(&state_3d, 0, sizeof(nv_3d_state_t));
+    nv_fifo_cmdbuf_init(&cmd_3d, 0);
 
     // Select 3D class
     if (g->initialized) {
@@ -464,6 +571,14 @@ int nv_3d_init(void) {
     state_3d.depth_far = 1.0f;
     state_3d.clear_depth = 1.0f;
     state_3d.front_face = 0x0901;  // CCW
+    state_3d.blend_eq_rgb = NV50_3D_BLEND_EQ_ADD;
+    state_3d.blend_eq_a = NV50_3D_BLEND_EQ_ADD;
+    state_3d.blend_src_rgb = NV50_3D_BLEND_FUNC_ONE;
+    state_3d.blend_src_a = NV50_3D_BLEND_FUNC_ONE;
+    state_3d.cull_face = 0x0404;  // BACK
+
+    // The GPU's state is unknown: send everything with the first draw
+    state_3d.dirty = NV_3D_DIRTY_ALL;
 
     // Set default render target to GPU scanout buffer
     if (g->initialized && g->vram_mapped) {
@@ -486,6 +601,7 @@ void nv_3d_shutdown(void) {
     // Flush any remaining commands
     nv_fifo_state_t* fifo = nv_fifo_get_state();
     if (fifo->initialized && fifo->channels[0].active) {
+        nv_3d_flush();
         nv_fifo_wait_idle(0);
     }
 
@@ -6,6 +6,7 @@
 
 #include "stdint.h"
 #include "gpu.h"
+#include "nv_mem.h"
 
 // ============================================================
 // 3D Object Classes
@@ -52,6 +53,22 @@
 #define NV50_3D_VERTEX_ARRAY_START 0x1700   // Draw arrays start
 #define NV50_3D_VERTEX_ARRAY_COUNT 0x1704   // Draw arrays count
 
+// Vertex array bindings (one buffer per attribute)
+#define NV50_3D_VERTEX_ARRAY_FETCH(i)     (0x0900 + (i)*0x10)  // Enable | stride
+#define NV50_3D_VERTEX_ARRAY_START_HI(i)  (0x0904 + (i)*0x10)
+#define NV50_3D_VERTEX_ARRAY_START_LO(i)  (0x0908 + (i)*0x10)
+#define NV50_3D_VERTEX_ARRAY_LIMIT_HI(i)  (0x1080 + (i)*0x08)  // Last valid byte
+#define NV50_3D_VERTEX_ARRAY_LIMIT_LO(i)  (0x1084 + (i)*0x08)
+#define NV50_3D_VERTEX_ARRAY_ATTRIB(i)    (0x1AC0 + (i)*4)     // Buffer | format | type
+#define NV50_3D_VERTEX_ARRAY_FETCH_ENABLE 0x20000000
+
+// Vertex attribute formats (float components)
+#define NV50_3D_VTX_FMT_32          0x01200000
+#define NV50_3D_VTX_FMT_32_32       0x00800000
+#define NV50_3D_VTX_FMT_32_32_32    0x00400000
+#define NV50_3D_VTX_FMT_32_32_32_32 0x00200000
+#define NV50_3D_VTX_TYPE_FLOAT      0x7E000000
+
 // Primitive types (GL-compatible)
 #define NV50_3D_PRIM_POINTS        0x01
 #define NV50_3D_PRIM_LINES         0x02
@@ -179,6 +196,30 @@ typedef struct {
 // 3D Pipeline State
 // ============================================================
 
+#define NV_3D_MAX_ATTRIBS     16
+
+// Vertex array bound to an attribute (see nv_3d_vertex_array)
+typedef struct {
+    int      enabled;
+    int      size;              // Float components (1-4)
+    int      stride;            // Bytes between consecutive vertices
+    uint64_t address;           // GPU address of the first vertex
+    uint64_t limit;             // GPU address of the last valid byte
+} nv_3d_vertex_array_t;
+
+// State groups changed since they were last sent (nv_3d_state_t.dirty)
+#define NV_3D_DIRTY_RT        (1u << 0)
+#define NV_3D_DIRTY_ZETA      (1u << 1)
+#define NV_3D_DIRTY_VIEWPORT  (1u << 2)
+#define NV_3D_DIRTY_DEPTH     (1u << 3)
+#define NV_3D_DIRTY_BLEND     (1u << 4)
+#define NV_3D_DIRTY_CULL      (1u << 5)
+#define NV_3D_DIRTY_ARRAYS    (1u << 6)
+#define NV_3D_DIRTY_ALL       0x7F
+
+// Shadow of the 3D object's state registers (methods 0x0000-0x1FFC)
+#define NV_3D_SHADOW_REGS     (0x2000 / 4)
+
 typedef struct {
     int      initialized;
     uint32_t class_3d;          // Active 3D engine class
@@ -211,6 +252,21 @@ typedef struct {
     uint32_t cull_face;
     uint32_t front_face;
 
+    // Vertex arrays
+    nv_3d_vertex_array_t arrays[NV_3D_MAX_ATTRIBS];
+
+    // Setters only record state and mark its group dirty; draws and
+    // clears send the dirty groups, and only registers whose value
+    // differs from what the GPU already holds go into the FIFO.
+    uint32_t dirty;
+    uint32_t shadow[NV_3D_SHADOW_REGS];
+    uint32_t shadow_valid[NV_3D_SHADOW_REGS / 32];
+
+    // Last immediate-mode value of each attribute; unchanged non-position
+    // attributes are not re-sent per vertex
+    uint32_t attr_method[NV_3D_MAX_ATTRIBS];
+    uint32_t attr_value[NV_3D_MAX_ATTRIBS][4];
+
     // Transform matrices (software fixed-function pipeline)
     nv_mat4_t modelview;
     nv_mat4_t projection;
@@ -224,6 +280,8 @@ typedef struct {
     // Statistics
     uint64_t triangles_drawn;
     uint64_t draw_calls;
+    uint64_t state_methods;     // State registers sent
+    uint64_t state_skipped;     // State registers already current
 } nv_3d_state_t;
 
 // ---- 3D Engine Initialization ----
@@ -231,6 +289,14 @@ int  nv_3d_init(void);
 void nv_3d_shutdown(void);
 nv_3d_state_t* nv_3d_get_state(void);
 
+// ---- Submission ----
+// 3D methods are recorded and go to the GPU in batches: when the command
+// buffer fills, on nv_3d_clear() (the start of a new frame) and here.
+// nv_3d_flush() returns the batch's fence (0 if nothing was pending);
+// nv_3d_finish() also waits for it.
+uint32_t nv_3d_flush(void);
+void     nv_3d_finish(void);
+
 // ---- Render Target ----
 void nv_3d_set_render_target(uint64_t vram_addr, int width, int height, int pitch);
 void nv_3d_set_depth_buffer(uint64_t vram_addr);
@@ -272,6 +338,11 @@ void nv_3d_draw_vertex_4f(int attr, float x, float y, float z, float w);
 void nv_3d_draw_vertex_3f(int attr, float x, float y, float z);
 void nv_3d_draw_vertex_2f(int attr, float x, float y);
 void nv_3d_draw_end(void);
+// Source attribute 'attr' from 'size' floats per vertex, 'stride' bytes
+// apart, starting 'offset' bytes into 'bo'
+int  nv_3d_vertex_array(int attr, const nv_bo_t* bo, uint64_t offset, int size, int stride);
+void nv_3d_vertex_array_disable(int attr);
+// Draw 'count' vertices from the enabled arrays in one submission
 void nv_3d_draw_arrays(uint32_t primitive, int first, int count);
 
 // ---- Software Rasterizer (fallback if no GPU) ----
@@ -4,24 +4,17 @@
 // Reference: envytools display documentation
 
 #include "nv_display.h"
+#include "klib.h"
 #include "gpu.h"
 #include "heap.h"
-
-// ---- String/mem helpers ----
-static void disp_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
-static void disp_memcpy(void* dst, const void* src, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (uint64_t i = 0; i < n; i++) d[i] = s[i];
-}
+#include "waitq.h"
+#include "timer.h"
 
 // ---- Global display state ----
 static nv_display_state_t display;
 
+static void flip_release(int head);
+
 // ---- Standard VESA modes ----
 // Clock values are pixel clock in kHz
 static nv_display_mode_t standard_modes[] = {
@@ -265,9 +258,10 @@ int nv_display_set_mode(int head, nv_display_mode_t* mode) {
 
     if (ret == 0) {
         // Update software state
-        disp_memcpy(&display.current_mode, mode, sizeof(nv_display_mode_t));
+        memcpy(&display.current_mode, mode, sizeof(nv_display_mode_t));
         display.active_head = head;
         display.mode_set = 1;
+        flip_release(head);     // Sized for the old mode
 
         // Also update GPU state
         g->display_width = mode->hdisplay;
@@ -286,7 +280,7 @@ int nv_display_set_resolution(int width, int height, int bpp) {
 
     // Override bpp if specified
     nv_display_mode_t m;
-    disp_memcpy(&m, mode, sizeof(nv_display_mode_t));
+    memcpy(&m, mode, sizeof(nv_display_mode_t));
     if (bpp > 0) m.bpp = bpp;
 
     return nv_display_set_mode(display.active_head, &m);
@@ -295,7 +289,11 @@ int nv_display_set_resolution(int width, int height, int bpp) {
 void nv_display_get_mode(int head, nv_display_mode_t* mode) {
     if (!mode) return;
     (void)head;
-    disp_memcpy(mode, &display.current_mode, sizeof(nv_display_mode_t));
+    memcpy(mode, &display.current_mode, sizeof(nv_display_mode_t));
+}
+
+int nv_display_active_head(void) {
+    return display.active_head;
 }
 
 // ============================================================
@@ -352,11 +350,12 @@ void nv_display_set_fb_depth(int head, int bpp) {
 int nv_cursor_init(int head) {
     if (head < 0 || head >= NV_MAX_HEADS) return -1;
 
+    // Only the NV50+ cursor registers are driven here
     gpu_state_t* g = gpu_get_state();
-    if (!g->vram_mapped) return -1;
+    if (!g->vram_mapped || !g->mmio_mapped || g->arch < NV_ARCH_NV50) return -1;
 
     nv_cursor_t* cursor = &display.cursors[head];
-    disp_memset(cursor, 0, sizeof(nv_cursor_t));
+    memset(cursor, 0, sizeof(nv_cursor_t));
 
     cursor->width = 64;
     cursor->height = 64;
@@ -450,7 +449,7 @@ void nv_cursor_set_image(int head, uint32_t* argb, int w, int h) {
     }
 
     // Also keep a software copy
-    disp_memcpy(cursor->image, argb,
+    memcpy(cursor->image, argb,
                 (uint64_t)(copy_w * copy_h) * sizeof(uint32_t));
 
     // Update cursor offset in hardware
@@ -536,42 +535,167 @@ int nv_detect_outputs(void) {
 // ============================================================
 // VBlank
 // ============================================================
+// In interrupt mode every vblank is counted by nv_display_intr(), which
+// also latches a queued flip and wakes the head's waiters.
 
-void nv_display_wait_vblank(int head) {
-    gpu_state_t* g = gpu_get_state();
-    if (!g->mmio_mapped) return;
+static waitq_t vblank_wq[NV_MAX_HEADS];
 
+// Status register and vblank bit of a head
+static void vblank_reg(int head, uint32_t* reg, uint32_t* bit) {
+    gpu_state_t* g = gpu_get_state();
     if (g->arch >= NV_ARCH_NV50) {
-        // NV50+: Read display interrupt status, wait for vblank bit
-        uint32_t vblank_bit = (1 << (head * 2));
+        *reg = NV50_DISP_INTR_0;
+        *bit = 1u << (head * 2);
+    } else {
+        *reg = 0x600000 + (uint32_t)(head * 0x2000) + 0x100;
+        *bit = 0x00000001;
+    }
+}
+
+static void vblank_irq_enable(int head) {
+    gpu_state_t* g = gpu_get_state();
+    uint32_t reg, bit;
+    vblank_reg(head, &reg, &bit);
+    nv_wr32(g->mmio, reg, bit);                     // Drop a stale one
+    uint32_t en = g->arch >= NV_ARCH_NV50 ? NV50_DISP_INTR_EN : reg + 0x40;
+    nv_wr32(g->mmio, en, nv_rd32(g->mmio, en) | bit);
+}
 
-        // Clear existing vblank interrupt
-        nv_wr32(g->mmio, NV50_DISP_INTR_0, vblank_bit);
+// Without the interrupt: clear the status bit and poll until it is set again
+static void poll_vblank(int head) {
+    gpu_state_t* g = gpu_get_state();
+    uint32_t reg, bit;
+    vblank_reg(head, &reg, &bit);
+    nv_wr32(g->mmio, reg, bit);
+    int timeout = 1000000;
+    while (timeout-- > 0) {
+        if (nv_rd32(g->mmio, reg) & bit) break;
+    }
+    nv_wr32(g->mmio, reg, bit);
+}
 
-        // Wait for next vblank (with timeout)
-        int timeout = 1000000;
-        while (timeout-- > 0) {
-            uint32_t intr = nv_rd32(g->mmio, NV50_DISP_INTR_0);
-            if (intr & vblank_bit) break;
+void nv_display_intr(void) {
+    gpu_state_t* g = gpu_get_state();
+    for (int h = 0; h < NV_MAX_HEADS; h++) {
+        uint32_t reg, bit;
+        vblank_reg(h, &reg, &bit);
+        if (!(nv_rd32(g->mmio, reg) & bit)) continue;
+        nv_wr32(g->mmio, reg, bit);
+
+        if (display.flip_pending[h]) {
+            nv_display_set_fb_offset(h, display.scanout[h][display.front[h]]);
+            display.flip_pending[h] = 0;
         }
+        display.vblank_count[h]++;
+        display.vblank_ns[h] = timer_now_ns();
+        waitq_wake_all(&vblank_wq[h]);
+    }
+}
 
-        // Clear the interrupt
-        nv_wr32(g->mmio, NV50_DISP_INTR_0, vblank_bit);
-    } else {
-        // Pre-NV50: PCRTC interrupt-based vblank
-        uint32_t crtc_base = 0x600000 + (uint32_t)(head * 0x2000);
+typedef struct {
+    int      head;
+    uint32_t seen;
+} vblank_wait_t;
 
-        // Clear vblank interrupt
-        nv_wr32(g->mmio, crtc_base + 0x100, 0x00000001);
+static int vblank_passed(void* arg) {
+    vblank_wait_t* w = (vblank_wait_t*)arg;
+    return display.vblank_count[w->head] != w->seen;
+}
 
-        // Wait for it to fire
-        int timeout = 1000000;
-        while (timeout-- > 0) {
-            uint32_t intr = nv_rd32(g->mmio, crtc_base + 0x100);
-            if (intr & 0x00000001) break;
-        }
+static int flip_done(void* arg) {
+    return !display.flip_pending[*(int*)arg];
+}
+
+void nv_display_wait_vblank(int head) {
+    gpu_state_t* g = gpu_get_state();
+    if (!g->mmio_mapped || head < 0 || head >= NV_MAX_HEADS) return;
+
+    if (!display.vblank_irq) {
+        poll_vblank(head);
+        return;
+    }
+    vblank_wait_t w = { head, display.vblank_count[head] };
+    if (waitq_wait(&vblank_wq[head], vblank_passed, &w) == 0) return;
+
+    // Cannot sleep here (boot, kernel process): spin on the count, which
+    // the interrupt still advances
+    int timeout = 1000000;
+    while (!vblank_passed(&w) && timeout-- > 0) __asm__ volatile("pause");
+}
+
+uint32_t nv_display_vblank_count(int head) {
+    if (head < 0 || head >= NV_MAX_HEADS) return 0;
+    return display.vblank_count[head];
+}
+
+uint64_t nv_display_vblank_time(int head) {
+    if (head < 0 || head >= NV_MAX_HEADS || !display.vblank_irq) return 0;
+    return display.vblank_ns[head];
+}
+
+// ============================================================
+// Page Flipping
+// ============================================================
+
+static void flip_release(int head) {
+    if (display.scanout_bo[head].size) {
+        nv_display_wait_flip(head);
+        if (display.front[head] != 0) nv_display_set_fb_offset(head, display.scanout[head][0]);
+        nv_bo_del(&display.scanout_bo[head]);
+    }
+    memset(&display.scanout_bo[head], 0, sizeof(nv_bo_t));
+    display.front[head] = 0;
+}
 
-        nv_wr32(g->mmio, crtc_base + 0x100, 0x00000001);
+int nv_display_flip_init(int head) {
+    gpu_state_t* g = gpu_get_state();
+    if (head < 0 || head >= NV_MAX_HEADS) return -1;
+    if (!g->mmio_mapped || !g->vram_mapped || !g->display_active) return -1;
+    if (display.scanout_bo[head].size) return 0;
+
+    // The buffer being shown now is the first; the second comes from the
+    // VRAM heap
+    uint64_t size = (uint64_t)g->display_pitch * (uint64_t)g->display_height;
+    if (nv_bo_new(size, NV_MEM_VRAM, &display.scanout_bo[head]) != 0) {
+        memset(&display.scanout_bo[head], 0, sizeof(nv_bo_t));
+        return -1;
+    }
+    display.scanout[head][0] = g->fb_offset;
+    display.scanout[head][1] = (uint32_t)display.scanout_bo[head].gpu_offset;
+    display.front[head] = 0;
+    display.flip_pending[head] = 0;
+    return 0;
+}
+
+uint32_t nv_display_back_offset(int head) {
+    if (head < 0 || head >= NV_MAX_HEADS || !display.scanout_bo[head].size)
+        return gpu_get_state()->fb_offset;
+    return display.scanout[head][display.front[head] ^ 1];
+}
+
+void nv_display_flip(int head, int vsync) {
+    if (head < 0 || head >= NV_MAX_HEADS || !display.scanout_bo[head].size) return;
+    nv_display_wait_flip(head);
+    display.front[head] ^= 1;
+    uint32_t offset = display.scanout[head][display.front[head]];
+
+    if (vsync && display.vblank_irq) {
+        display.flip_pending[head] = 1;     // nv_display_intr() does the rest
+        return;
+    }
+    if (vsync) poll_vblank(head);
+    nv_display_set_fb_offset(head, offset);
+}
+
+void nv_display_wait_flip(int head) {
+    if (head < 0 || head >= NV_MAX_HEADS || !display.flip_pending[head]) return;
+    if (waitq_wait(&vblank_wq[head], flip_done, &head) == 0) return;
+    int timeout = 1000000;
+    while (!flip_done(&head) && timeout-- > 0) __asm__ volatile("pause");
+    if (display.flip_pending[head]) {
+        // No vblank interrupt came: flip now rather than never
+        nv_display_set_fb_offset(head, display.scanout[head][display.front[head]]);
+        display.flip_pending[head] = 0;
     }
 }
 
@@ -583,9 +707,10 @@ int nv_display_init(void) {
     gpu_state_t* g = gpu_get_state();
     if (!g->initialized) return -1;
 
-    disp_memset(&display, 0, sizeof(nv_display_state_t));
+    memset(&display, 0, sizeof(nv_display_state_t));
 
     display.num_heads = NV_MAX_HEADS;
+    for (int h = 0; h < NV_MAX_HEADS; h++) waitq_init(&vblank_wq[h]);
 
     // Detect connected outputs
     int num_outputs = nv_detect_outputs();
@@ -596,12 +721,18 @@ int nv_display_init(void) {
         nv_cursor_init(0);
     }
 
+    // Vblank as an interrupt, if the GPU's line can be routed
+    if (g->mmio_mapped && gpu_irq_init() == 0) {
+        for (int h = 0; h < NV_MAX_HEADS; h++) vblank_irq_enable(h);
+        display.vblank_irq = 1;
+    }
+
     // If no outputs detected, set up default mode anyway
     // (display will use whatever output the VBIOS configured)
     if (!display.mode_set) {
         nv_display_mode_t* default_mode = nv_display_find_mode(1024, 768);
         if (default_mode) {
-            disp_memcpy(&display.current_mode, default_mode, sizeof(nv_display_mode_t));
+            memcpy(&display.current_mode, default_mode, sizeof(nv_display_mode_t));
         }
     }
 
@@ -609,9 +740,10 @@ int nv_display_init(void) {
 }
 
 void nv_display_shutdown(void) {
-    // Hide cursors
+    // Hide cursors, scan out of the first buffer again
     for (int h = 0; h < NV_MAX_HEADS; h++) {
         nv_cursor_hide(h);
+        flip_release(h);
     }
 
     gpu_state_t* g = gpu_get_state();
@@ -621,6 +753,7 @@ void nv_display_shutdown(void) {
     if (g->arch >= NV_ARCH_NV50) {
         nv_wr32(g->mmio, NV50_DISP_INTR_EN, 0x00000000);
     }
+    display.vblank_irq = 0;
 
     display.mode_set = 0;
 }
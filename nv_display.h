@@ -6,6 +6,7 @@
 
 #include "stdint.h"
 #include "gpu.h"
+#include "nv_mem.h"
 
 // ============================================================
 // Pre-NV50 Display Registers (PCRTC + PRAMDAC)
@@ -163,6 +164,16 @@ typedef struct {
     nv_display_mode_t current_mode;
     int            active_head;
     int            mode_set;
+
+    // Page flipping: scanout[h][front[h]] is (or is queued to be) shown
+    nv_bo_t        scanout_bo[NV_MAX_HEADS];    // Second buffer per head
+    uint32_t       scanout[NV_MAX_HEADS][2];    // VRAM offsets
+    int            front[NV_MAX_HEADS];
+    volatile int   flip_pending[NV_MAX_HEADS];  // Latched at the next vblank
+
+    volatile uint32_t vblank_count[NV_MAX_HEADS];
+    volatile uint64_t vblank_ns[NV_MAX_HEADS];  // timer_now_ns() at the last one
+    int            vblank_irq;                  // Vblank arrives as an interrupt
 } nv_display_state_t;
 
 // ---- Display Initialization ----
@@ -173,6 +184,7 @@ void nv_display_shutdown(void);             // Disable display outputs
 int  nv_display_set_mode(int head, nv_display_mode_t* mode);  // Program CRTC timing
 int  nv_display_set_resolution(int width, int height, int bpp);
 void nv_display_get_mode(int head, nv_display_mode_t* mode);  // Read current mode
+int  nv_display_active_head(void);          // Head driving the main output
 nv_display_mode_t* nv_display_find_mode(int width, int height); // Find standard mode
 
 // ---- PLL ----
@@ -184,8 +196,19 @@ void nv_display_set_fb_offset(int head, uint32_t offset);  // Set VRAM scanout b
 void nv_display_set_fb_pitch(int head, uint32_t pitch);    // Set scanout pitch
 void nv_display_set_fb_depth(int head, int bpp);           // Set pixel format
 
+// ---- Page Flipping ----
+// Two scanout buffers per head: one is shown while the next frame is
+// drawn into the other, and a flip swaps them at vblank, so nothing is
+// copied and the picture never tears. After nv_display_flip() the old
+// front buffer is the back buffer, but it stays on screen until the flip
+// happens: wait with nv_display_wait_flip() before drawing into it.
+int      nv_display_flip_init(int head);      // Add the second buffer; 0 on success
+uint32_t nv_display_back_offset(int head);    // VRAM offset to draw the next frame in
+void     nv_display_flip(int head, int vsync); // Show it (at the next vblank if vsync)
+void     nv_display_wait_flip(int head);      // Until a queued flip has happened
+
 // ---- Hardware Cursor ----
-int  nv_cursor_init(int head);                              // Allocate cursor VRAM
+int  nv_cursor_init(int head);                              // Allocate cursor VRAM; -1 if no cursor plane
 void nv_cursor_show(int head);
 void nv_cursor_hide(int head);
 void nv_cursor_move(int head, int x, int y);
@@ -197,6 +220,11 @@ int  nv_dac_load_detect(int dac);           // Check if CRT is connected to DAC
 int  nv_sor_detect(int sor);                // Check SOR connection (DVI/HDMI/DP)
 
 // ---- VBlank ----
-void nv_display_wait_vblank(int head);      // Wait for vertical blank period
+// With the GPU's interrupt line routed, waiters sleep until the vblank
+// interrupt; otherwise they poll the status register.
+void     nv_display_wait_vblank(int head);  // Wait for vertical blank period
+uint32_t nv_display_vblank_count(int head); // Vblanks seen (interrupt mode)
+uint64_t nv_display_vblank_time(int head);  // When the last was seen (interrupt mode, else 0)
+void     nv_display_intr(void);             // From the GPU interrupt handler
 
 #endif
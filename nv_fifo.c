@@ -5,17 +5,13 @@
 // Reference: envytools PFIFO documentation
 
 #include "nv_fifo.h"
+#include "klib.h"
 #include "gpu.h"
+#include "nv_power.h"
 #include "vmm.h"
 #include "pmm.h"
 #include "heap.h"
 
-// ---- Helpers ----
-static void fifo_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
 // ---- Global state ----
 static nv_fifo_state_t fifo_state;
 
@@ -27,19 +23,65 @@ nv_fifo_state_t* nv_fifo_get_state(void) {
 // Push Buffer Operations
 // ============================================================
 
-void nv_fifo_push(int channel_id, uint32_t data) {
-    if (channel_id < 0 || channel_id >= NV_FIFO_MAX_CHANNELS) return;
+// ---- Ring space ----
+// PUT chases GET around the ring; GET only advances when the fence of an
+// older submission signals, so nothing the GPU may still fetch is
+// overwritten. One dword at the end is kept for the wrap jump.
 
-    nv_fifo_channel_t* ch = &fifo_state.channels[channel_id];
-    if (!ch->active || !ch->pushbuf) return;
+static int fifo_fence_done(nv_fifo_channel_t* ch, uint32_t seq) {
+    return (int32_t)(*ch->fence_mem - seq) >= 0;
+}
+
+// Move GET past every submission whose fence has signalled
+static void fifo_retire(nv_fifo_channel_t* ch) {
+    while (ch->inflight_count &&
+           fifo_fence_done(ch, ch->inflight[ch->inflight_head].seq)) {
+        ch->pushbuf_get = ch->inflight[ch->inflight_head].end;
+        ch->inflight_head = (ch->inflight_head + 1) % NV_FIFO_MAX_INFLIGHT;
+        ch->inflight_count--;
+    }
+}
 
+// Wait for the oldest in-flight submission; -1 if there is none or the
+// GPU did not get there
+static int fifo_wait_oldest(nv_fifo_channel_t* ch) {
+    if (!ch->inflight_count) return -1;
+    nv_fifo_wait_fence(ch->channel_id, ch->inflight[ch->inflight_head].seq);
+    int before = ch->inflight_count;
+    fifo_retire(ch);
+    return ch->inflight_count < before ? 0 : -1;
+}
+
+// Dwords that can be written contiguously at PUT
+static uint32_t fifo_contig_space(nv_fifo_channel_t* ch) {
     uint32_t max_dwords = ch->pushbuf_size / 4;
+    if (ch->pushbuf_put >= ch->pushbuf_get)
+        return max_dwords - 1 - ch->pushbuf_put;
+    return ch->pushbuf_get - ch->pushbuf_put - 1;
+}
 
-    // Check for wrap-around
-    if (ch->pushbuf_put >= max_dwords) {
-        // Wrap to beginning (would need a jump command in production)
-        ch->pushbuf_put = 0;
+// Make room for n contiguous dwords at PUT, wrapping with a jump when the
+// tail is too short. Returns 0, or -1 if the space cannot be had.
+static int fifo_reserve(nv_fifo_channel_t* ch, uint32_t n) {
+    if (n >= ch->pushbuf_size / 4 - 1) return -1;
+    for (;;) {
+        fifo_retire(ch);
+        if (fifo_contig_space(ch) >= n) return 0;
+        if (ch->pushbuf_put >= ch->pushbuf_get && ch->pushbuf_get > n) {
+            ch->pushbuf[ch->pushbuf_put] = NV_FIFO_JUMP(0);
+            ch->pushbuf_put = 0;
+            continue;
+        }
+        if (fifo_wait_oldest(ch) < 0) return -1;
     }
+}
+
+void nv_fifo_push(int channel_id, uint32_t data) {
+    if (channel_id < 0 || channel_id >= NV_FIFO_MAX_CHANNELS) return;
+
+    nv_fifo_channel_t* ch = &fifo_state.channels[channel_id];
+    if (!ch->active || !ch->pushbuf) return;
+    if (fifo_reserve(ch, 1) < 0) return;
 
     ch->pushbuf[ch->pushbuf_put] = data;
     ch->pushbuf_put++;
@@ -72,6 +114,11 @@ void nv_fifo_kick(int channel_id) {
     gpu_state_t* g = gpu_get_state();
     if (!g->mmio_mapped) return;
 
+    // Push buffers are written through WC mappings, whose stores can still
+    // sit in the CPU's write-combining buffers; drain them before the GPU
+    // is told to fetch
+    __asm__ volatile("sfence" ::: "memory");
+
     if (g->arch >= NV_ARCH_NV50) {
         // NV50+: Write PUT to the channel's doorbell/update register
         // Channel control area is at BAR0 + 0xC00000 + channel_id * 0x1000
@@ -83,18 +130,70 @@ void nv_fifo_kick(int channel_id) {
         uint32_t put_bytes = ch->pushbuf_put * 4;
         nv_wr32(g->mmio, NV_PFIFO_CACHE1_DMA_PUT, put_bytes);
     }
+
+    // Wake the reclocking governor if it parked while the GPU was idle
+    nv_power_governor_kick();
+}
+
+// ============================================================
+// Command Buffers
+// ============================================================
+
+void nv_fifo_cmdbuf_init(nv_fifo_cmdbuf_t* cb, int channel_id) {
+    cb->channel_id = channel_id;
+    cb->count = 0;
+    cb->run_len = 0;
+}
+
+void nv_fifo_cmdbuf_method(nv_fifo_cmdbuf_t* cb, int subchan, uint32_t method, uint32_t data) {
+    // Next register of the open run: one more dword under its header
+    if (cb->run_len && cb->subchan == subchan && cb->run_len < NV_FIFO_MAX_COUNT &&
+        method == cb->method + cb->run_len * 4 && cb->count < NV_FIFO_CMDBUF_DWORDS) {
+        cb->run_len++;
+        cb->data[cb->hdr] = NV_FIFO_MTHD_INC(subchan, cb->method, cb->run_len);
+        cb->data[cb->count++] = data;
+        return;
+    }
+
+    if (cb->count + 2 > NV_FIFO_CMDBUF_DWORDS) nv_fifo_cmdbuf_submit(cb);
+    cb->hdr = cb->count;
+    cb->subchan = subchan;
+    cb->method = method;
+    cb->run_len = 1;
+    cb->data[cb->count++] = NV_FIFO_MTHD(subchan, method, 1);
+    cb->data[cb->count++] = data;
+}
+
+uint32_t nv_fifo_cmdbuf_submit(nv_fifo_cmdbuf_t* cb) {
+    uint32_t n = cb->count;
+    cb->count = 0;
+    cb->run_len = 0;
+    if (n == 0) return 0;
+    if (cb->channel_id < 0 || cb->channel_id >= NV_FIFO_MAX_CHANNELS) return 0;
+
+    nv_fifo_channel_t* ch = &fifo_state.channels[cb->channel_id];
+    if (!ch->active || !ch->pushbuf) return 0;
+
+    // Commands and their fence go in as one contiguous piece
+    if (fifo_reserve(ch, n + NV_FIFO_FENCE_DWORDS) < 0) return 0;
+    memcpy(&ch->pushbuf[ch->pushbuf_put], cb->data, n * 4);
+    ch->pushbuf_put += n;
+
+    nv_fifo_emit_fence(cb->channel_id);
+    return ch->fence_sequence;
 }
 
 uint32_t nv_fifo_space_available(int channel_id) {
     if (channel_id < 0 || channel_id >= NV_FIFO_MAX_CHANNELS) return 0;
 
     nv_fifo_channel_t* ch = &fifo_state.channels[channel_id];
-    if (!ch->active) return 0;
+    if (!ch->active || !ch->pushbuf) return 0;
 
+    fifo_retire(ch);
     uint32_t max_dwords = ch->pushbuf_size / 4;
-    uint32_t used = ch->pushbuf_put;  // Simplified: assume GET == 0 or lags behind
-    if (used >= max_dwords) return 0;
-    return max_dwords - used;
+    if (ch->pushbuf_put >= ch->pushbuf_get)
+        return max_dwords - 1 - (ch->pushbuf_put - ch->pushbuf_get);
+    return ch->pushbuf_get - ch->pushbuf_put - 1;
 }
 
 // ============================================================
@@ -107,6 +206,10 @@ void nv_fifo_emit_fence(int channel_id) {
     nv_fifo_channel_t* ch = &fifo_state.channels[channel_id];
     if (!ch->active || !ch->fence_mem) return;
 
+    // Every fence marks a submission whose ring space it frees
+    if (ch->inflight_count == NV_FIFO_MAX_INFLIGHT && fifo_wait_oldest(ch) < 0) return;
+    if (fifo_reserve(ch, NV_FIFO_FENCE_DWORDS) < 0) return;
+
     ch->fence_sequence++;
 
     gpu_state_t* g = gpu_get_state();
@@ -128,6 +231,11 @@ void nv_fifo_emit_fence(int channel_id) {
         nv_fifo_push_method(channel_id, 0, 0x0104, ch->fence_sequence);
     }
 
+    int slot = (ch->inflight_head + ch->inflight_count) % NV_FIFO_MAX_INFLIGHT;
+    ch->inflight[slot].end = ch->pushbuf_put;
+    ch->inflight[slot].seq = ch->fence_sequence;
+    ch->inflight_count++;
+
     nv_fifo_kick(channel_id);
 }
 
@@ -137,8 +245,9 @@ int nv_fifo_fence_completed(int channel_id, uint32_t seq) {
     nv_fifo_channel_t* ch = &fifo_state.channels[channel_id];
     if (!ch->active || !ch->fence_mem) return 1;
 
-    // GPU writes the sequence number to fence_mem when it processes the fence command
-    return (*ch->fence_mem >= seq);
+    // GPU writes the sequence number to fence_mem when it processes the
+    // fence command (compared modulo 2^32)
+    return fifo_fence_done(ch, seq);
 }
 
 void nv_fifo_wait_fence(int channel_id, uint32_t seq) {
@@ -170,7 +279,7 @@ int nv_fifo_channel_alloc(int channel_id) {
     if (!g->initialized) return -1;
 
     nv_fifo_channel_t* ch = &fifo_state.channels[channel_id];
-    fifo_memset(ch, 0, sizeof(nv_fifo_channel_t));
+    memset(ch, 0, sizeof(nv_fifo_channel_t));
 
     ch->channel_id = channel_id;
 
@@ -201,7 +310,7 @@ int nv_fifo_channel_alloc(int channel_id) {
     }
 
     ch->pushbuf = (uint32_t*)pb_virt;
-    fifo_memset(ch->pushbuf, 0, NV_FIFO_PUSHBUF_SIZE);
+    memset(ch->pushbuf, 0, NV_FIFO_PUSHBUF_SIZE);
     ch->pushbuf_put = 0;
     ch->pushbuf_get = 0;
 
@@ -329,7 +438,7 @@ int nv_fifo_init(void) {
     gpu_state_t* g = gpu_get_state();
     if (!g->initialized) return -1;
 
-    fifo_memset(&fifo_state, 0, sizeof(nv_fifo_state_t));
+    memset(&fifo_state, 0, sizeof(nv_fifo_state_t));
 
     // Reset PFIFO engine
     uint32_t pmc_enable = nv_rd32(g->mmio, NV_PMC_ENABLE);
@@ -66,6 +66,18 @@
 #define NV_FIFO_MTHD_NI(subchan, method, count) \
     (0x40000000 | ((uint32_t)(count) << 18) | ((uint32_t)(subchan) << 13) | ((uint32_t)(method) & 0x1FFC))
 
+// Jump to a byte offset in the push buffer (NV11+ style); used to wrap
+#define NV_FIFO_JUMP(offset)     ((uint32_t)(offset) | 0x00000001)
+
+// Largest count a method header can carry (11-bit field)
+#define NV_FIFO_MAX_COUNT        2047
+
+// Dwords nv_fifo_emit_fence() writes (NV50+ semaphore release)
+#define NV_FIFO_FENCE_DWORDS     5
+
+// Submissions whose ring space is awaiting their fence, per channel
+#define NV_FIFO_MAX_INFLIGHT     32
+
 // Subchannel assignments (convention)
 #define NV_FIFO_SUBCHAN_NULL     0   // Null/NOP object
 #define NV_FIFO_SUBCHAN_2D       1   // 2D engine
@@ -98,7 +110,16 @@ typedef struct {
     uint64_t  pushbuf_phys;     // Physical address of push buffer
     uint32_t  pushbuf_size;     // Size in bytes
     uint32_t  pushbuf_put;      // Current PUT position (dwords offset)
-    uint32_t  pushbuf_get;      // Last known GET position
+    uint32_t  pushbuf_get;      // GPU is done with everything before PUT up to here
+
+    // Fenced submissions not yet seen complete, oldest first. Ring space
+    // up to 'end' can be rewritten once fence 'seq' has signalled.
+    struct {
+        uint32_t end;
+        uint32_t seq;
+    } inflight[NV_FIFO_MAX_INFLIGHT];
+    int       inflight_head;
+    int       inflight_count;
 
     // Subchannel object bindings
     uint32_t  subchan_class[NV_FIFO_MAX_SUBCHANNELS];
@@ -109,6 +130,22 @@ typedef struct {
     uint64_t  fence_mem_phys;
 } nv_fifo_channel_t;
 
+// Command buffer: methods are recorded in cached system memory and copied
+// into the channel's ring in one go by nv_fifo_cmdbuf_submit(), followed
+// by a fence and a single kick. Consecutive methods on the same subchannel
+// share one incrementing header.
+#define NV_FIFO_CMDBUF_DWORDS    2048
+
+typedef struct {
+    int       channel_id;
+    uint32_t  count;            // Dwords recorded
+    uint32_t  hdr;              // Index of the open run's header (valid if run_len)
+    int       subchan;          // Open run: subchannel, first method, length
+    uint32_t  method;
+    uint32_t  run_len;
+    uint32_t  data[NV_FIFO_CMDBUF_DWORDS];
+} nv_fifo_cmdbuf_t;
+
 // FIFO global state
 typedef struct {
     int      initialized;
@@ -133,6 +170,14 @@ void nv_fifo_push_method(int channel_id, int subchan, uint32_t method, uint32_t
 void nv_fifo_push_method_n(int channel_id, int subchan, uint32_t method, uint32_t* data, int count);
 void nv_fifo_kick(int channel_id);                      // Flush push buffer to GPU
 
+// ---- Command Buffers ----
+void     nv_fifo_cmdbuf_init(nv_fifo_cmdbuf_t* cb, int channel_id);
+void     nv_fifo_cmdbuf_method(nv_fifo_cmdbuf_t* cb, int subchan, uint32_t method, uint32_t data);
+// Copy the recorded methods into the ring (waiting only for the fences of
+// older submissions whose space is needed), fence and kick. Returns the
+// fence sequence, or 0 if there was nothing to submit.
+uint32_t nv_fifo_cmdbuf_submit(nv_fifo_cmdbuf_t* cb);
+
 // ---- Synchronization ----
 void nv_fifo_emit_fence(int channel_id);                // Insert fence in command stream
 int  nv_fifo_fence_completed(int channel_id, uint32_t seq);  // Check if fence was reached
@@ -5,6 +5,7 @@
 #include "pmm.h"
 #include "vmm.h"
 #include "heap.h"
+#include "klib.h"
 
 // ============================================================
 // External State
@@ -26,48 +27,141 @@ nv_mem_state_t nv_mem_state;
 // VRAM Allocator
 // ============================================================
 
-// Simple bump allocator with free list for VRAM
-
 static uint64_t align_up_64(uint64_t val, uint64_t align) {
     return (val + align - 1) & ~(align - 1);
 }
 
+// Size class: floor(log2(size)) relative to the 4KB granule
+static int vram_class(uint64_t size) {
+    int c = 63 - __builtin_clzll(size) - NV_VRAM_MIN_SHIFT;
+    if (c < 0) c = 0;
+    if (c >= NV_VRAM_CLASSES) c = NV_VRAM_CLASSES - 1;
+    return c;
+}
+
+static void vram_list_add(int i) {
+    nv_vram_block_t* blk = &nv_mem_state.vram_blocks[i];
+    int c = vram_class(blk->size);
+    blk->is_free = 1;
+    blk->free_prev = -1;
+    blk->free_next = nv_mem_state.vram_free_head[c];
+    if (blk->free_next >= 0) nv_mem_state.vram_blocks[blk->free_next].free_prev = i;
+    nv_mem_state.vram_free_head[c] = i;
+    nv_mem_state.vram_free_bitmap |= 1u << c;
+}
+
+static void vram_list_remove(int i) {
+    nv_vram_block_t* blk = &nv_mem_state.vram_blocks[i];
+    int c = vram_class(blk->size);
+    if (blk->free_prev >= 0) nv_mem_state.vram_blocks[blk->free_prev].free_next = blk->free_next;
+    else nv_mem_state.vram_free_head[c] = blk->free_next;
+    if (blk->free_next >= 0) nv_mem_state.vram_blocks[blk->free_next].free_prev = blk->free_prev;
+    if (nv_mem_state.vram_free_head[c] < 0) nv_mem_state.vram_free_bitmap &= ~(1u << c);
+    blk->is_free = 0;
+}
+
+static int vram_desc_get(void) {
+    int i = nv_mem_state.vram_spare;
+    if (i < 0) return -1;
+    nv_mem_state.vram_spare = nv_mem_state.vram_blocks[i].free_next;
+    nv_mem_state.vram_blocks[i].in_use = 1;
+    return i;
+}
+
+static void vram_desc_put(int i) {
+    nv_vram_block_t* blk = &nv_mem_state.vram_blocks[i];
+    blk->in_use = 0;
+    blk->is_free = 0;
+    blk->free_next = nv_mem_state.vram_spare;
+    nv_mem_state.vram_spare = i;
+}
+
+// New block [offset, offset + size) linked into the address list after
+// 'prev' (-1 = at the front)
+static int vram_insert_after(int prev, int idx, uint64_t offset, uint64_t size) {
+    nv_vram_block_t* blk = &nv_mem_state.vram_blocks[idx];
+    blk->offset = offset;
+    blk->size = size;
+    blk->flags = 0;
+    blk->phys_prev = prev;
+    blk->phys_next = prev >= 0 ? nv_mem_state.vram_blocks[prev].phys_next : -1;
+    if (prev >= 0) nv_mem_state.vram_blocks[prev].phys_next = idx;
+    if (blk->phys_next >= 0) nv_mem_state.vram_blocks[blk->phys_next].phys_prev = idx;
+    return idx;
+}
+
+// Absorb the address successor of 'i' (already off any class list)
+static void vram_absorb_next(int i) {
+    nv_vram_block_t* blk = &nv_mem_state.vram_blocks[i];
+    int n = blk->phys_next;
+    blk->size += nv_mem_state.vram_blocks[n].size;
+    blk->phys_next = nv_mem_state.vram_blocks[n].phys_next;
+    if (blk->phys_next >= 0) nv_mem_state.vram_blocks[blk->phys_next].phys_prev = i;
+    vram_desc_put(n);
+}
+
+// Reset the heap to one free block covering [base, total)
+static void vram_heap_init(uint64_t base, uint64_t total) {
+    for (int c = 0; c < NV_VRAM_CLASSES; c++) nv_mem_state.vram_free_head[c] = -1;
+    nv_mem_state.vram_free_bitmap = 0;
+    nv_mem_state.vram_spare = -1;
+    for (int i = NV_VRAM_MAX_BLOCKS - 1; i >= 0; i--) vram_desc_put(i);
+    nv_mem_state.vram_base = base;
+    nv_mem_state.vram_used = 0;
+    if (total > base) {
+        int i = vram_insert_after(-1, vram_desc_get(), base, total - base);
+        vram_list_add(i);
+    }
+}
+
 int nv_vram_alloc(uint64_t size, uint32_t alignment, uint32_t flags,
                   uint64_t* offset) {
-    (void)flags;
     if (!nv_mem_state.initialized || size == 0) return -1;
 
     if (alignment < NV_MEM_ALIGN_4K) alignment = NV_MEM_ALIGN_4K;
-
-    // First, check free list for a suitable block
-    for (int i = 0; i < NV_VRAM_MAX_BLOCKS; i++) {
-        nv_vram_block_t* blk = &nv_mem_state.vram_blocks[i];
-        if (!blk->in_use) continue;
-        // We don't reuse freed blocks in simple allocator; skip
+    if (alignment & (alignment - 1)) alignment = 1u << (32 - __builtin_clz(alignment));
+    size = align_up_64(size, NV_MEM_ALIGN_4K);
+
+    // First fit within the request's own class, then the first block that
+    // fits (alignment included) in the smallest larger class
+    int found = -1;
+    uint64_t start = 0;
+    uint32_t classes = nv_mem_state.vram_free_bitmap & ~((1u << vram_class(size)) - 1);
+    while (classes && found < 0) {
+        int c = __builtin_ctz(classes);
+        classes &= classes - 1;
+        for (int i = nv_mem_state.vram_free_head[c]; i >= 0; i = nv_mem_state.vram_blocks[i].free_next) {
+            nv_vram_block_t* blk = &nv_mem_state.vram_blocks[i];
+            start = align_up_64(blk->offset, alignment);
+            if (start + size <= blk->offset + blk->size) { found = i; break; }
+        }
     }
-
-    // Bump allocator
-    uint64_t aligned_off = align_up_64(nv_mem_state.vram_free_offset, alignment);
-    if (aligned_off + size > nv_mem_state.vram_total) {
-        return -1; // Out of VRAM
+    if (found < 0) return -1; // Out of VRAM (or too fragmented)
+
+    // Split off the alignment gap in front and the remainder behind as
+    // free blocks of their own
+    nv_vram_block_t* blk = &nv_mem_state.vram_blocks[found];
+    uint64_t lead = start - blk->offset;
+    uint64_t tail = blk->offset + blk->size - (start + size);
+    int li = -1, ti = -1;
+    if (lead && (li = vram_desc_get()) < 0) return -1;
+    if (tail && (ti = vram_desc_get()) < 0) {
+        if (li >= 0) vram_desc_put(li);
+        return -1;
     }
-
-    // Record allocation
-    int slot = -1;
-    for (int i = 0; i < NV_VRAM_MAX_BLOCKS; i++) {
-        if (!nv_mem_state.vram_blocks[i].in_use) {
-            slot = i;
-            break;
-        }
+    vram_list_remove(found);
+    if (li >= 0) {
+        vram_insert_after(blk->phys_prev, li, blk->offset, lead);
+        vram_list_add(li);
+    }
+    blk->offset = start;
+    blk->size = size;
+    blk->flags = flags;
+    if (ti >= 0) {
+        vram_insert_after(found, ti, start + size, tail);
+        vram_list_add(ti);
     }
-    if (slot < 0) return -1;
-
-    nv_mem_state.vram_blocks[slot].offset = aligned_off;
-    nv_mem_state.vram_blocks[slot].size = size;
-    nv_mem_state.vram_blocks[slot].flags = flags;
-    nv_mem_state.vram_blocks[slot].in_use = 1;
 
-    nv_mem_state.vram_free_offset = aligned_off + size;
     nv_mem_state.vram_used += size;
     nv_mem_state.alloc_count++;
 
@@ -75,30 +169,66 @@ int nv_vram_alloc(uint64_t size, uint32_t alignment, uint32_t flags,
         nv_mem_state.peak_usage = nv_mem_state.vram_used;
     }
 
-    *offset = aligned_off;
+    *offset = start;
     return 0;
 }
 
 void nv_vram_free(uint64_t offset) {
     for (int i = 0; i < NV_VRAM_MAX_BLOCKS; i++) {
         nv_vram_block_t* blk = &nv_mem_state.vram_blocks[i];
-        if (blk->in_use && blk->offset == offset) {
+        if (blk->in_use && !blk->is_free && blk->offset == offset) {
             nv_mem_state.vram_used -= blk->size;
-            blk->in_use = 0;
             nv_mem_state.free_count++;
+
+            // Coalesce with free neighbours, then back on a class list
+            int n = blk->phys_next;
+            if (n >= 0 && nv_mem_state.vram_blocks[n].is_free) {
+                vram_list_remove(n);
+                vram_absorb_next(i);
+            }
+            int p = blk->phys_prev;
+            if (p >= 0 && nv_mem_state.vram_blocks[p].is_free) {
+                vram_list_remove(p);
+                vram_absorb_next(p);
+                i = p;
+            }
+            vram_list_add(i);
             return;
         }
     }
 }
 
 uint64_t nv_vram_available(void) {
-    return nv_mem_state.vram_total - nv_mem_state.vram_used;
+    if (nv_mem_state.vram_total <= nv_mem_state.vram_base) return 0;
+    return nv_mem_state.vram_total - nv_mem_state.vram_base - nv_mem_state.vram_used;
 }
 
 uint64_t nv_vram_used_bytes(void) {
     return nv_mem_state.vram_used;
 }
 
+void nv_vram_get_stats(nv_vram_stats_t* st) {
+    for (int i = 0; i < (int)sizeof(*st); i++) ((char*)st)[i] = 0;
+    if (!nv_mem_state.initialized) return;
+
+    st->used_bytes = nv_mem_state.vram_used;
+    st->peak_used = nv_mem_state.peak_usage;
+    for (int i = 0; i < NV_VRAM_MAX_BLOCKS; i++) {
+        nv_vram_block_t* blk = &nv_mem_state.vram_blocks[i];
+        if (!blk->in_use) continue;
+        st->total_bytes += blk->size;
+        if (!blk->is_free) {
+            st->used_blocks++;
+            continue;
+        }
+        st->free_blocks++;
+        st->free_bytes += blk->size;
+        if (blk->size > st->largest_free) st->largest_free = blk->size;
+    }
+    if (st->free_bytes)
+        st->fragmentation = (uint32_t)(100 - st->largest_free * 100 / st->free_bytes);
+}
+
 // ============================================================
 // GPU Virtual Memory (NV50+)
 // ============================================================
@@ -146,107 +276,71 @@ int nv_vm_init(void) {
     return 0;
 }
 
-int nv_vm_map(uint64_t gpu_va, uint64_t phys_addr, uint64_t size, uint32_t flags) {
-    if (!nv_mem_state.vm_enabled) return -1;
+// Each PDE's page table (NV50_VM_PTE_COUNT small-page PTEs) is one
+// physically contiguous run, mapped uncached at its own window after the PD
+#define NV50_VM_PT_BYTES    (NV50_VM_PTE_COUNT * sizeof(uint64_t))
+#define GPU_PT_VBASE(pde)   (GPU_PD_VBASE + 0x1000 + (uint64_t)(pde) * NV50_VM_PT_BYTES)
 
+// The page table covering va, allocated if alloc is set; 0 if there is none
+static uint64_t* vm_pt(uint64_t va, int alloc) {
     uint64_t* pd = (uint64_t*)nv_mem_state.pd_virt;
-    uint64_t va = gpu_va;
-    uint64_t pa = phys_addr;
-
-    while (size > 0) {
-        // PDE index
-        int pde_idx = (int)(va / NV50_VM_BLOCK_SIZE);
-        if (pde_idx >= NV50_VM_PDE_COUNT) return -1;
-
-        // Ensure PDE exists
-        if (!(pd[pde_idx] & NV50_PDE_PRESENT)) {
-            // Allocate a page table page
-            void* pt_page = pmm_alloc_block();
-            if (!pt_page) return -1;
-
-            uint64_t pt_phys = (uint64_t)(uintptr_t)pt_page;
-
-            // Map PT to CPU space for initialization
-            uint64_t pt_virt = GPU_PD_VBASE + 0x1000 + (uint64_t)pde_idx * 0x1000;
-            vmm_map_page(vmm_get_kernel_pml4(), pt_virt, pt_phys,
-                         VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
-
-            // Clear page table
-            uint64_t* pt = (uint64_t*)pt_virt;
-            for (int i = 0; i < (int)(0x1000 / sizeof(uint64_t)); i++) {
-                pt[i] = 0;
-            }
-
-            // Set PDE
-            pd[pde_idx] = NV50_PDE_PRESENT | (pt_phys & 0xFFFFFFF000ULL);
-        }
-
-        // Get page table
-        uint64_t pt_phys = pd[pde_idx] & 0xFFFFFFF000ULL;
-        uint64_t pt_virt = GPU_PD_VBASE + 0x1000 + (uint64_t)pde_idx * 0x1000;
-
-        // PTE index within this PDE's coverage
-        uint64_t va_in_block = va - (uint64_t)pde_idx * NV50_VM_BLOCK_SIZE;
-        int pte_idx = (int)(va_in_block / NV50_VM_SMALL_PAGE);
-
-        // Set PTE
-        uint64_t* pt = (uint64_t*)pt_virt;
-        uint64_t pte = NV50_PTE_PRESENT | (pa & 0xFFFFFFF000ULL);
-        if (flags & NV_MEM_ACCESS_RO) {
-            pte |= NV50_PTE_READ_ONLY;
-        }
-        pt[pte_idx] = pte;
-
-        va += NV50_VM_SMALL_PAGE;
-        pa += NV50_VM_SMALL_PAGE;
-        if (size >= NV50_VM_SMALL_PAGE) {
-            size -= NV50_VM_SMALL_PAGE;
-        } else {
-            size = 0;
-        }
+    uint64_t pde_idx = va / NV50_VM_BLOCK_SIZE;
+    if (pde_idx >= NV50_VM_PDE_COUNT) return 0;
+    uint64_t pt_virt = GPU_PT_VBASE(pde_idx);
+    if (pd[pde_idx] & NV50_PDE_PRESENT) return (uint64_t*)pt_virt;
+    if (!alloc) return 0;
+
+    uint64_t pages = NV50_VM_PT_BYTES / 4096;
+    void* pt_page = pmm_alloc_blocks(pages, 0);
+    if (!pt_page) return 0;
+    uint64_t pt_phys = (uint64_t)(uintptr_t)pt_page;
+    for (uint64_t p = 0; p < pages; p++) {
+        vmm_map_page(vmm_get_kernel_pml4(), pt_virt + p * 4096, pt_phys + p * 4096,
+                     VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
     }
+    memset((void*)pt_virt, 0, NV50_VM_PT_BYTES);
+    pd[pde_idx] = NV50_PDE_PRESENT | (pt_phys & 0xFFFFFFF000ULL);
+    return (uint64_t*)pt_virt;
+}
 
-    // Flush GPU TLB
+// Write one PTE (pte 0 clears it). No TLB flush: callers batch their
+// writes and flush once.
+static int vm_set_pte(uint64_t va, uint64_t pte) {
+    uint64_t* pt = vm_pt(va, pte != 0);
+    if (!pt) return pte ? -1 : 0;
+    pt[(va % NV50_VM_BLOCK_SIZE) / NV50_VM_SMALL_PAGE] = pte;
+    return 0;
+}
+
+static void vm_flush(void) {
     if (gpu_state.mmio) {
         // NV50_VM_TLB_FLUSH = 0x100C80
         GPU_WR32(0x100C80, 0x00000001);
     }
+}
 
-    return 0;
+static uint64_t vm_pte(uint64_t pa, uint32_t flags) {
+    uint64_t pte = NV50_PTE_PRESENT | (pa & 0xFFFFFFF000ULL);
+    if (flags & NV_MEM_ACCESS_RO) pte |= NV50_PTE_READ_ONLY;
+    return pte;
 }
 
-int nv_vm_unmap(uint64_t gpu_va, uint64_t size) {
+int nv_vm_map(uint64_t gpu_va, uint64_t phys_addr, uint64_t size, uint32_t flags) {
     if (!nv_mem_state.vm_enabled) return -1;
 
-    uint64_t* pd = (uint64_t*)nv_mem_state.pd_virt;
-    uint64_t va = gpu_va;
-
-    while (size > 0) {
-        int pde_idx = (int)(va / NV50_VM_BLOCK_SIZE);
-        if (pde_idx >= NV50_VM_PDE_COUNT) return -1;
-
-        if (pd[pde_idx] & NV50_PDE_PRESENT) {
-            uint64_t pt_virt = GPU_PD_VBASE + 0x1000 + (uint64_t)pde_idx * 0x1000;
-            uint64_t va_in_block = va - (uint64_t)pde_idx * NV50_VM_BLOCK_SIZE;
-            int pte_idx = (int)(va_in_block / NV50_VM_SMALL_PAGE);
-
-            uint64_t* pt = (uint64_t*)pt_virt;
-            pt[pte_idx] = 0;
-        }
-
-        va += NV50_VM_SMALL_PAGE;
-        if (size >= NV50_VM_SMALL_PAGE) {
-            size -= NV50_VM_SMALL_PAGE;
-        } else {
-            size = 0;
-        }
-    }
+    int rc = 0;
+    for (uint64_t off = 0; off < size && rc == 0; off += NV50_VM_SMALL_PAGE)
+        rc = vm_set_pte(gpu_va + off, vm_pte(phys_addr + off, flags));
+    vm_flush();
+    return rc;
+}
 
-    // Flush GPU TLB
-    if (gpu_state.mmio) {
-        GPU_WR32(0x100C80, 0x00000001);
-    }
+int nv_vm_unmap(uint64_t gpu_va, uint64_t size) {
+    if (!nv_mem_state.vm_enabled) return -1;
 
+    for (uint64_t off = 0; off < size; off += NV50_VM_SMALL_PAGE)
+        vm_set_pte(gpu_va + off, 0);
+    vm_flush();
     return 0;
 }
 
@@ -265,60 +359,139 @@ int nv_vm_alloc_va(uint64_t size, uint64_t alignment, uint64_t* gpu_va) {
 // GART (Graphics Address Remapping Table)
 // ============================================================
 
-int nv_gart_map(uint64_t cpu_phys, uint64_t size, uint64_t* gpu_addr) {
-    if (!nv_mem_state.initialized) return -1;
-
-    // Find free GART slot
-    int slot = -1;
-    for (int i = 0; i < NV_GART_MAX_PAGES; i++) {
-        if (!nv_mem_state.gart_entries[i].in_use) {
-            slot = i;
-            break;
-        }
-    }
-    if (slot < 0) return -1;
+// The aperture is a bitmap of pages, searched next-fit from where the last
+// allocation ended. Each mapping has an entry, found from its first page
+// through gart_head; gart_pfn remembers the frame behind every page.
 
-    uint64_t ga = align_up_64(nv_mem_state.gart_next_addr, NV50_VM_SMALL_PAGE);
+static int gart_bit(uint32_t i) {
+    return (nv_mem_state.gart_bitmap[i / 64] >> (i % 64)) & 1;
+}
 
-    nv_mem_state.gart_entries[slot].gpu_addr = ga;
-    nv_mem_state.gart_entries[slot].cpu_phys = cpu_phys;
-    nv_mem_state.gart_entries[slot].size = size;
-    nv_mem_state.gart_entries[slot].in_use = 1;
+static void gart_bits(uint32_t first, uint32_t count, int set) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (set) nv_mem_state.gart_bitmap[i / 64] |= 1ULL << (i % 64);
+        else nv_mem_state.gart_bitmap[i / 64] &= ~(1ULL << (i % 64));
+    }
+}
 
-    nv_mem_state.gart_next_addr = ga + align_up_64(size, NV50_VM_SMALL_PAGE);
+// Claim count consecutive aperture pages; the first, or -1
+static int gart_range_alloc(uint32_t count) {
+    if (count == 0 || count > NV_GART_PAGES - nv_mem_state.gart_used) return -1;
+
+    uint32_t i = nv_mem_state.gart_hint, start = 0, run = 0;
+    for (uint32_t scanned = 0; scanned < NV_GART_PAGES + count; ) {
+        if (i >= NV_GART_PAGES) { i = 0; run = 0; }     // Runs do not wrap
+        uint64_t w = nv_mem_state.gart_bitmap[i / 64];
+        if (i % 64 == 0 && w == ~0ULL) {                // Skip full words
+            i += 64; scanned += 64; run = 0;
+            continue;
+        }
+        if (gart_bit(i)) run = 0;
+        else if (run++ == 0) start = i;
+        i++; scanned++;
+        if (run == count) {
+            gart_bits(start, count, 1);
+            nv_mem_state.gart_used += count;
+            nv_mem_state.gart_hint = start + count < NV_GART_PAGES ? start + count : 0;
+            return (int)start;
+        }
+    }
+    return -1;
+}
 
-    // If VM is available, create GPU page table mapping
-    if (nv_mem_state.vm_enabled) {
-        nv_vm_map(ga, cpu_phys, size, NV_MEM_ACCESS_RW);
-    } else {
-        // Pre-NV50: Program GART table directly
-        // PGARTTABLE at 0x10000 in BAR2
-        if (gpu_state.ramin) {
-            uint64_t pages = (size + NV50_VM_SMALL_PAGE - 1) / NV50_VM_SMALL_PAGE;
-            for (uint64_t i = 0; i < pages; i++) {
-                // Each GART entry maps one page
-                uint32_t entry_offset = (uint32_t)((ga / NV50_VM_SMALL_PAGE + i) * 4);
-                volatile uint32_t* gart = (volatile uint32_t*)((uint64_t)gpu_state.ramin + 0x10000);
-                gart[entry_offset / 4] = (uint32_t)((cpu_phys + i * NV50_VM_SMALL_PAGE) >> 12) | 0x01;
-            }
+// Map count pages: pages[i], or base + i pages when pages is 0. All PTEs
+// (or pre-NV50 GART entries) are written first, then flushed once.
+static int gart_map(const uint64_t* pages, uint64_t base, uint32_t count, uint64_t* gpu_addr) {
+    if (!nv_mem_state.initialized || nv_mem_state.gart_free < 0) return -1;
+
+    int first = gart_range_alloc(count);
+    if (first < 0) return -1;
+    int slot = nv_mem_state.gart_free;
+    nv_gart_entry_t* e = &nv_mem_state.gart_entries[slot];
+    nv_mem_state.gart_free = e->next_free;
+
+    uint64_t ga = NV_GPU_GART_START + (uint64_t)first * NV50_VM_SMALL_PAGE;
+    e->gpu_addr = ga;
+    e->size = (uint64_t)count * NV50_VM_SMALL_PAGE;
+    e->in_use = 1;
+    nv_mem_state.gart_head[first] = (uint16_t)(slot + 1);
+
+    volatile uint32_t* gart = gpu_state.ramin ?
+        (volatile uint32_t*)((uint64_t)gpu_state.ramin + 0x10000) : 0;     // Pre-NV50 PGARTTABLE
+    int rc = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t phys = pages ? pages[i] : base + (uint64_t)i * NV50_VM_SMALL_PAGE;
+        nv_mem_state.gart_pfn[first + i] = (uint32_t)(phys >> 12);
+        if (nv_mem_state.vm_enabled) {
+            if (rc == 0) rc = vm_set_pte(ga + (uint64_t)i * NV50_VM_SMALL_PAGE,
+                                         vm_pte(phys, NV_MEM_ACCESS_RW));
+        } else if (gart) {
+            gart[first + i] = (uint32_t)(phys >> 12) | 0x01;
         }
     }
+    if (nv_mem_state.vm_enabled) vm_flush();
+    else if (gart) (void)gart[first + count - 1];     // Post the table writes
 
     *gpu_addr = ga;
+    if (rc < 0) {
+        nv_gart_unmap(ga);
+        return -1;
+    }
     return 0;
 }
 
+int nv_gart_map(uint64_t cpu_phys, uint64_t size, uint64_t* gpu_addr) {
+    if (size == 0) return -1;
+    return gart_map(0, cpu_phys, (uint32_t)((size + NV50_VM_SMALL_PAGE - 1) / NV50_VM_SMALL_PAGE),
+                    gpu_addr);
+}
+
+int nv_gart_map_sg(const uint64_t* pages, uint32_t count, uint64_t* gpu_addr) {
+    if (!pages) return -1;
+    return gart_map(pages, 0, count, gpu_addr);
+}
+
+uint64_t nv_gart_page(uint64_t gpu_addr) {
+    if (gpu_addr < NV_GPU_GART_START) return 0;
+    uint64_t i = (gpu_addr - NV_GPU_GART_START) / NV50_VM_SMALL_PAGE;
+    if (i >= NV_GART_PAGES || !gart_bit((uint32_t)i)) return 0;
+    return (uint64_t)nv_mem_state.gart_pfn[i] << 12;
+}
+
 void nv_gart_unmap(uint64_t gpu_addr) {
-    for (int i = 0; i < NV_GART_MAX_PAGES; i++) {
-        nv_gart_entry_t* e = &nv_mem_state.gart_entries[i];
-        if (e->in_use && e->gpu_addr == gpu_addr) {
-            if (nv_mem_state.vm_enabled) {
-                nv_vm_unmap(gpu_addr, e->size);
-            }
-            e->in_use = 0;
-            return;
-        }
+    if (gpu_addr < NV_GPU_GART_START) return;
+    uint64_t first = (gpu_addr - NV_GPU_GART_START) / NV50_VM_SMALL_PAGE;
+    if (first >= NV_GART_PAGES || !nv_mem_state.gart_head[first]) return;
+
+    int slot = nv_mem_state.gart_head[first] - 1;
+    nv_gart_entry_t* e = &nv_mem_state.gart_entries[slot];
+    uint32_t count = (uint32_t)(e->size / NV50_VM_SMALL_PAGE);
+    if (nv_mem_state.vm_enabled) {
+        nv_vm_unmap(gpu_addr, e->size);
+    } else if (gpu_state.ramin) {
+        volatile uint32_t* gart = (volatile uint32_t*)((uint64_t)gpu_state.ramin + 0x10000);
+        for (uint32_t i = 0; i < count; i++) gart[first + i] = 0;
     }
+
+    gart_bits((uint32_t)first, count, 0);
+    nv_mem_state.gart_used -= count;
+    nv_mem_state.gart_head[first] = 0;
+    e->in_use = 0;
+    e->next_free = nv_mem_state.gart_free;
+    nv_mem_state.gart_free = slot;
+}
+
+// Reset the aperture to empty, every entry on the free list
+static void gart_init(void) {
+    memset(nv_mem_state.gart_bitmap, 0, sizeof(nv_mem_state.gart_bitmap));
+    memset(nv_mem_state.gart_head, 0, sizeof(nv_mem_state.gart_head));
+    for (int i = 0; i < NV_GART_MAX_MAPPINGS; i++) {
+        nv_mem_state.gart_entries[i].in_use = 0;
+        nv_mem_state.gart_entries[i].next_free = i + 1 < NV_GART_MAX_MAPPINGS ? i + 1 : -1;
+    }
+    nv_mem_state.gart_free = 0;
+    nv_mem_state.gart_used = 0;
+    nv_mem_state.gart_hint = 0;
 }
 
 // ============================================================
@@ -333,26 +506,35 @@ int nv_bo_new(uint64_t size, uint32_t flags, nv_bo_t* bo) {
     bo->cpu_addr = 0;
 
     if (flags & NV_MEM_VRAM) {
-        // Allocate in VRAM
+        // Allocate in VRAM. Large buffers get large-page (64KB) or 1MB
+        // alignment, which also keeps small ones from splitting them up.
+        uint32_t align = size >= NV_MEM_ALIGN_1M  ? NV_MEM_ALIGN_1M :
+                         size >= NV_MEM_ALIGN_64K ? NV_MEM_ALIGN_64K : NV_MEM_ALIGN_4K;
         uint64_t offset;
-        if (nv_vram_alloc(size, NV_MEM_ALIGN_4K, flags, &offset) < 0) {
+        if (nv_vram_alloc(size, align, flags, &offset) < 0) {
             return -1;
         }
         bo->gpu_offset = offset;
         bo->domain = NV_MEM_VRAM;
     } else {
-        // Allocate in system memory and map through GART
-        uint64_t pages = (size + 4095) / 4096;
-        // Allocate contiguous physical pages
-        // For simplicity, allocate one page at a time
-        void* phys = pmm_alloc_block();
+        // System memory pages, anywhere, mapped as one GART range
+        uint32_t pages = (uint32_t)((size + 4095) / 4096);
+        uint64_t* phys = (uint64_t*)kmalloc((uint64_t)pages * sizeof(uint64_t));
         if (!phys) return -1;
+        uint32_t n = 0;
+        for (; n < pages; n++) {
+            void* page = pmm_alloc_block();
+            if (!page) break;
+            phys[n] = (uint64_t)(uintptr_t)page;
+        }
 
         uint64_t gpu_addr;
-        if (nv_gart_map((uint64_t)(uintptr_t)phys, pages * 4096, &gpu_addr) < 0) {
-            pmm_free_block(phys);
+        if (n < pages || nv_gart_map_sg(phys, pages, &gpu_addr) < 0) {
+            while (n) pmm_free_block((void*)(uintptr_t)phys[--n]);
+            kfree(phys);
             return -1;
         }
+        kfree(phys);
         bo->gpu_offset = gpu_addr;
         bo->domain = NV_MEM_GART;
     }
@@ -370,6 +552,10 @@ void nv_bo_del(nv_bo_t* bo) {
     if (bo->domain == NV_MEM_VRAM) {
         nv_vram_free(bo->gpu_offset);
     } else if (bo->domain == NV_MEM_GART) {
+        for (uint64_t off = 0; off < bo->size; off += 4096) {
+            uint64_t phys = nv_gart_page(bo->gpu_offset + off);
+            if (phys) pmm_free_block((void*)(uintptr_t)phys);
+        }
         nv_gart_unmap(bo->gpu_offset);
     }
 
@@ -388,24 +574,19 @@ int nv_bo_map(nv_bo_t* bo) {
         }
         return -1;
     } else {
-        // GART buffers are in system memory, find the physical address
-        for (int i = 0; i < NV_GART_MAX_PAGES; i++) {
-            nv_gart_entry_t* e = &nv_mem_state.gart_entries[i];
-            if (e->in_use && e->gpu_addr == bo->gpu_offset) {
-                // Map the physical memory to a CPU virtual address
-                uint64_t virt = 0xFFFF8000E0000000ULL + bo->gpu_offset;
-                uint64_t pages = (bo->size + 4095) / 4096;
-                for (uint64_t p = 0; p < pages; p++) {
-                    vmm_map_page(vmm_get_kernel_pml4(),
-                                virt + p * 4096,
-                                e->cpu_phys + p * 4096,
-                                VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
-                }
-                bo->cpu_addr = virt;
-                return 0;
-            }
+        // GART buffers are system memory pages. Map them write-combining:
+        // GPU reads of GART are not snooped, so CPU writes must not linger
+        // in the cache
+        uint64_t virt = 0xFFFF8000E0000000ULL + bo->gpu_offset;
+        uint64_t pages = (bo->size + 4095) / 4096;
+        for (uint64_t p = 0; p < pages; p++) {
+            uint64_t phys = nv_gart_page(bo->gpu_offset + p * 4096);
+            if (!phys) return -1;
+            vmm_map_page(vmm_get_kernel_pml4(), virt + p * 4096, phys,
+                         VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_WC);
         }
-        return -1;
+        bo->cpu_addr = virt;
+        return 0;
     }
 }
 
@@ -434,13 +615,13 @@ int nv_mem_init(void) {
     nv_mem_state.vram_total = gpu_state.vram_total;
 
     // Reserve first 16MB for display scanout
-    nv_mem_state.vram_free_offset = 16 * 1024 * 1024;
+    vram_heap_init(16 * 1024 * 1024, nv_mem_state.vram_total);
 
     // Initialize GPU virtual memory if NV50+
     nv_vm_init();
 
     // Initialize GART space
-    nv_mem_state.gart_next_addr = NV_GPU_GART_START;
+    gart_init();
 
     nv_mem_state.initialized = 1;
     return 0;
@@ -448,12 +629,8 @@ int nv_mem_init(void) {
 
 void nv_mem_shutdown(void) {
     // Free all VRAM allocations (tracking only)
-    for (int i = 0; i < NV_VRAM_MAX_BLOCKS; i++) {
-        nv_mem_state.vram_blocks[i].in_use = 0;
-    }
+    vram_heap_init(nv_mem_state.vram_base, nv_mem_state.vram_total);
     // Free GART entries
-    for (int i = 0; i < NV_GART_MAX_PAGES; i++) {
-        nv_mem_state.gart_entries[i].in_use = 0;
-    }
+    gart_init();
     nv_mem_state.initialized = 0;
 }
@@ -29,15 +29,40 @@
 // VRAM Allocator
 // ============================================================
 
-#define NV_VRAM_MAX_BLOCKS  256
+// VRAM is managed as a list of blocks in address order, each either free
+// or allocated, described in system memory (nothing is written to VRAM).
+// Free blocks are also on a list per power-of-two size class, with a
+// bitmap of non-empty classes. Freeing merges a block with free
+// neighbours, so freed VRAM is reused and does not fragment into
+// unusable pieces.
+#define NV_VRAM_MAX_BLOCKS  512     // Block descriptors (free + allocated)
+#define NV_VRAM_MIN_SHIFT   12      // 4KB granule; class 0 is [4KB, 8KB)
+#define NV_VRAM_CLASSES     32
 
 typedef struct {
     uint64_t offset;        // Offset within VRAM
     uint64_t size;          // Size in bytes
     uint32_t flags;         // NV_MEM_* flags
-    int      in_use;
+    int      in_use;        // Descriptor holds a block
+    int      is_free;       // Block is free (on a class list)
+    int      phys_prev;     // Neighbouring blocks by address (-1 = none)
+    int      phys_next;
+    int      free_prev;     // Class list linkage (-1 = none); free_next
+    int      free_next;     //   also links unused descriptors
 } nv_vram_block_t;
 
+// VRAM usage / fragmentation snapshot
+typedef struct {
+    uint64_t total_bytes;       // Managed VRAM (excluding the scanout reserve)
+    uint64_t used_bytes;        // Allocated, rounded to the 4KB granule
+    uint64_t free_bytes;
+    uint64_t largest_free;      // Largest single free block
+    uint64_t peak_used;
+    uint32_t used_blocks;
+    uint32_t free_blocks;
+    uint32_t fragmentation;     // 100 * (1 - largest_free / free_bytes)
+} nv_vram_stats_t;
+
 // ============================================================
 // GPU Virtual Address Space (NV50+)
 // ============================================================
@@ -76,13 +101,16 @@ typedef struct {
 // GART (Graphics Address Remapping Table)
 // ============================================================
 
-#define NV_GART_MAX_PAGES   1024    // Max system pages mapped to GPU
+// GART addresses start at NV_GPU_GART_START and are handed out in 4KB
+// pages from an aperture of NV_GART_PAGES; unmapping returns them.
+#define NV_GART_PAGES           16384   // 64MB aperture
+#define NV_GART_MAX_MAPPINGS    1024
 
 typedef struct {
     uint64_t gpu_addr;      // GPU virtual address
-    uint64_t cpu_phys;      // CPU physical address
-    uint64_t size;          // Mapping size
+    uint64_t size;          // Mapping size (whole pages)
     int      in_use;
+    int      next_free;     // Unused entries, from gart_free (-1 = end)
 } nv_gart_entry_t;
 
 // ============================================================
@@ -96,7 +124,10 @@ typedef struct {
     nv_vram_block_t vram_blocks[NV_VRAM_MAX_BLOCKS];
     uint64_t        vram_total;
     uint64_t        vram_used;
-    uint64_t        vram_free_offset;   // Simple bump allocator watermark
+    uint64_t        vram_base;          // First managed offset (after scanout)
+    int             vram_free_head[NV_VRAM_CLASSES];
+    uint32_t        vram_free_bitmap;   // Bit n set = class n non-empty
+    int             vram_spare;         // Unused descriptors, via free_next
 
     // GPU virtual address space (NV50+)
     int             vm_enabled;
@@ -105,8 +136,13 @@ typedef struct {
     uint64_t        vm_next_addr;       // Next free GPU VA
 
     // GART
-    nv_gart_entry_t gart_entries[NV_GART_MAX_PAGES];
-    uint64_t        gart_next_addr;
+    nv_gart_entry_t gart_entries[NV_GART_MAX_MAPPINGS];
+    int             gart_free;                          // First unused entry
+    uint64_t        gart_bitmap[NV_GART_PAGES / 64];    // Bit set = page in use
+    uint32_t        gart_pfn[NV_GART_PAGES];            // Frame mapped at each page
+    uint16_t        gart_head[NV_GART_PAGES];           // Entry + 1 at a mapping's first page
+    uint32_t        gart_used;                          // Pages in use
+    uint32_t        gart_hint;                          // Where the next search starts
 
     // Stats
     uint32_t        alloc_count;
@@ -128,6 +164,7 @@ int      nv_vram_alloc(uint64_t size, uint32_t alignment, uint32_t flags,
 void     nv_vram_free(uint64_t offset);
 uint64_t nv_vram_available(void);
 uint64_t nv_vram_used_bytes(void);
+void     nv_vram_get_stats(nv_vram_stats_t* st);
 
 // ---- GPU Virtual Memory (NV50+) ----
 int  nv_vm_init(void);
@@ -136,8 +173,13 @@ int  nv_vm_unmap(uint64_t gpu_va, uint64_t size);
 int  nv_vm_alloc_va(uint64_t size, uint64_t alignment, uint64_t* gpu_va);
 
 // ---- GART ----
+// Map a physically contiguous range, or count separate 4KB pages, at one
+// run of GART addresses. Page table updates are flushed once per call.
 int  nv_gart_map(uint64_t cpu_phys, uint64_t size, uint64_t* gpu_addr);
+int  nv_gart_map_sg(const uint64_t* pages, uint32_t count, uint64_t* gpu_addr);
 void nv_gart_unmap(uint64_t gpu_addr);
+// Physical page behind a mapped GART address, or 0
+uint64_t nv_gart_page(uint64_t gpu_addr);
 
 // ---- Buffer Objects ----
 typedef struct {
@@ -2,6 +2,9 @@
 // Clock reading/setting, thermal monitoring, fan control, P-state management
 #include "nv_power.h"
 #include "gpu.h"
+#include "nv_2d.h"
+#include "timer.h"
+#include "spinlock.h"
 
 // ============================================================
 // External State
@@ -407,6 +410,174 @@ void nv_power_update(void) {
     }
 }
 
+// ============================================================
+// Reclocking Governor
+// ============================================================
+
+// Guards gov_timer and the window counters: sampling runs in timer
+// interrupt context, kicks come from whichever CPU submits
+static spinlock_t gov_lock = SPINLOCK_INIT;
+
+static int gov_index_of(int pstate_id) {
+    for (int i = 0; i < nv_power_state.pstate_count; i++) {
+        if (nv_power_state.pstates[i].id == pstate_id) return i;
+    }
+    return 0;
+}
+
+// PTIMER, or the CPU clock when BAR0 is not mapped
+static uint64_t gov_now(void) {
+    uint64_t t = gpu_timer_read();
+    return t ? t : timer_now_ns();
+}
+
+static void gov_window_reset(uint64_t now) {
+    nv_power_state.gov_samples = 0;
+    nv_power_state.gov_busy = 0;
+    nv_power_state.gov_fences = 0;
+    nv_power_state.gov_window_start = now;
+}
+
+// One sample: is the GPU working, and how many fences signalled since the
+// last one. Returns 1 if any channel still has fences outstanding.
+static int gov_sample(int* busy) {
+    nv_fifo_state_t* fifo = nv_fifo_get_state();
+    int pending = 0;
+    *busy = (GPU_RD32(NV04_PGRAPH_STATUS) & 1) != 0;
+    for (int i = 0; i < NV_FIFO_MAX_CHANNELS; i++) {
+        nv_fifo_channel_t* ch = &fifo->channels[i];
+        if (!ch->active || !ch->fence_mem) continue;
+        uint32_t done = *ch->fence_mem;
+        nv_power_state.gov_fences += done - nv_power_state.gov_fence_seen[i];
+        nv_power_state.gov_fence_seen[i] = done;
+        if ((int32_t)(ch->fence_sequence - done) > 0) pending = 1;
+    }
+    if (pending) *busy = 1;
+    return pending;
+}
+
+// Temperature cap, one step per window: shed a P-state while within
+// NV_GOV_TEMP_HYST of the throttle threshold, so the hardware never has to
+// throttle, and win it back once comfortably below
+static void gov_thermal(int top) {
+    int temp = nv_power_state.temp_celsius;
+    int t1 = nv_power_state.temp_threshold_1;
+    if (temp >= nv_power_state.temp_threshold_2) {
+        nv_power_state.gov_cap = 0;
+    } else if (temp >= t1 - NV_GOV_TEMP_HYST) {
+        if (nv_power_state.gov_cap > 0) nv_power_state.gov_cap--;
+    } else if (temp < t1 - 2 * NV_GOV_TEMP_HYST) {
+        if (nv_power_state.gov_cap < top) nv_power_state.gov_cap++;
+    }
+}
+
+static void gov_window(uint64_t now) {
+    uint64_t elapsed = now - nv_power_state.gov_window_start;
+    uint32_t samples = nv_power_state.gov_samples;
+    uint32_t util = samples ? nv_power_state.gov_busy * 100 / samples : 0;
+    uint32_t hz = elapsed ? (uint32_t)((uint64_t)nv_power_state.gov_fences * 1000000000ULL / elapsed) : 0;
+    nv_power_state.gov_util = util;
+    nv_power_state.gov_fence_hz = hz;
+
+    nv_power_update();
+    int top = nv_power_state.pstate_count - 1;
+    gov_thermal(top);
+
+    int cur = gov_index_of(nv_power_state.current_pstate);
+    int target = cur;
+    if (util >= NV_GOV_UP_PCT) {
+        target = top;
+        nv_power_state.gov_low_windows = 0;
+    } else if (util < NV_GOV_DOWN_PCT && hz < NV_GOV_FENCE_HZ) {
+        if (++nv_power_state.gov_low_windows >= NV_GOV_DOWN_WINDOWS) {
+            target = cur > 0 ? cur - 1 : 0;
+            nv_power_state.gov_low_windows = 0;
+        }
+    } else {
+        nv_power_state.gov_low_windows = 0;
+    }
+    if (target > nv_power_state.gov_cap) target = nv_power_state.gov_cap;
+    nv_power_state.gov_target = target;
+
+    gov_window_reset(now);
+}
+
+// The PLLs stop while they are reprogrammed, so the switch waits for a
+// sample that finds PGRAPH idle
+static void gov_apply(void) {
+    int target = nv_power_state.gov_target;
+    if (target == gov_index_of(nv_power_state.current_pstate)) return;
+    if (GPU_RD32(NV04_PGRAPH_STATUS) & 1) return;
+    nv_power_set_pstate(nv_power_state.pstates[target].id);
+}
+
+static void gov_tick(uint64_t arg) {
+    (void)arg;
+    uint64_t flags = spin_lock_irqsave(&gov_lock);
+    nv_power_state.gov_timer = -1;
+    if (!nv_power_state.gov_enabled) {
+        spin_unlock_irqrestore(&gov_lock, flags);
+        return;
+    }
+
+    int busy;
+    int pending = gov_sample(&busy);
+    nv_power_state.gov_samples++;
+    if (busy) nv_power_state.gov_busy++;
+
+    uint64_t now = gov_now();
+    if (now - nv_power_state.gov_window_start >= NV_GOV_WINDOW_NS) gov_window(now);
+    gov_apply();
+
+    // Park at the lowest state once the GPU has nothing in flight; the
+    // next kick resumes sampling, so an idle GPU costs no wakeups
+    int idle = !pending && nv_power_state.gov_busy == 0 && nv_power_state.gov_util == 0 &&
+               nv_power_state.gov_target == 0 && gov_index_of(nv_power_state.current_pstate) == 0;
+    if (!idle) {
+        nv_power_state.gov_timer = timer_add(timer_now_ns() + NV_GOV_SAMPLE_NS, gov_tick, 0);
+    }
+    spin_unlock_irqrestore(&gov_lock, flags);
+}
+
+// Caller holds gov_lock
+static void gov_arm(void) {
+    if (nv_power_state.gov_timer >= 0) return;
+    gov_window_reset(gov_now());
+    nv_power_state.gov_low_windows = 0;
+    nv_power_state.gov_timer = timer_add(timer_now_ns() + NV_GOV_SAMPLE_NS, gov_tick, 0);
+}
+
+void nv_power_set_governor(int enable) {
+    if (!nv_power_state.initialized || !gpu_state.initialized || !gpu_state.mmio) return;
+    uint64_t flags = spin_lock_irqsave(&gov_lock);
+    nv_power_state.gov_enabled = enable;
+    if (enable) {
+        nv_power_state.gov_cap = nv_power_state.pstate_count - 1;
+        nv_power_state.gov_target = gov_index_of(nv_power_state.current_pstate);
+        nv_fifo_state_t* fifo = nv_fifo_get_state();
+        for (int i = 0; i < NV_FIFO_MAX_CHANNELS; i++) {
+            nv_fifo_channel_t* ch = &fifo->channels[i];
+            nv_power_state.gov_fence_seen[i] = (ch->active && ch->fence_mem) ? *ch->fence_mem : 0;
+        }
+        gov_arm();
+    } else if (nv_power_state.gov_timer >= 0) {
+        timer_cancel(nv_power_state.gov_timer);
+        nv_power_state.gov_timer = -1;
+    }
+    spin_unlock_irqrestore(&gov_lock, flags);
+}
+
+int nv_power_governor_enabled(void) {
+    return nv_power_state.gov_enabled;
+}
+
+void nv_power_governor_kick(void) {
+    if (!nv_power_state.gov_enabled || nv_power_state.gov_timer >= 0) return;
+    uint64_t flags = spin_lock_irqsave(&gov_lock);
+    if (nv_power_state.gov_enabled) gov_arm();
+    spin_unlock_irqrestore(&gov_lock, flags);
+}
+
 // ============================================================
 // Initialization
 // ============================================================
@@ -424,6 +595,7 @@ int nv_power_init(void) {
 
     nv_power_state.fan_mode = NV_FAN_MODE_AUTO;
     nv_power_state.power_limit_mw = 150000; // 150W default TDP
+    nv_power_state.gov_timer = -1;
 
     // Initialize default P-states
     init_default_pstates();
@@ -454,6 +626,7 @@ int nv_power_init(void) {
 }
 
 void nv_power_shutdown(void) {
+    nv_power_set_governor(0);
     if (gpu_state.initialized && gpu_state.mmio) {
         // Set minimum clocks
         nv_power_set_pstate(0);
@@ -4,6 +4,7 @@
 #define NV_POWER_H
 
 #include "stdint.h"
+#include "nv_fifo.h"
 
 // ============================================================
 // NVIDIA Clock Domains
@@ -112,6 +113,22 @@ typedef struct {
     uint32_t pll_p;
 } nv_clock_t;
 
+// ============================================================
+// Reclocking Governor
+// ============================================================
+
+// Busy is sampled every NV_GOV_SAMPLE_NS (PGRAPH not idle, or a fence not
+// yet signalled); every NV_GOV_WINDOW_NS the share of busy samples picks
+// the P-state. A busy window jumps straight to the highest allowed state;
+// only NV_GOV_DOWN_WINDOWS quiet windows in a row step one state down.
+#define NV_GOV_SAMPLE_NS        2000000ULL      // 2 ms
+#define NV_GOV_WINDOW_NS        50000000ULL     // 50 ms
+#define NV_GOV_UP_PCT           70              // Busy share that raises clocks
+#define NV_GOV_DOWN_PCT         30              // Busy share that may lower them
+#define NV_GOV_DOWN_WINDOWS     4
+#define NV_GOV_FENCE_HZ         20              // Fences/s that still count as active
+#define NV_GOV_TEMP_HYST        5               // °C below a threshold to lift its cap
+
 // ============================================================
 // P-State Entry
 // ============================================================
@@ -160,6 +177,20 @@ typedef struct {
     // Power limit
     uint32_t    power_limit_mw;     // TDP in milliwatts
     uint32_t    power_current_mw;   // Current power draw estimate
+
+    // Governor (P-states are referred to by index into pstates[])
+    int         gov_enabled;
+    int         gov_timer;          // Sampling event, -1 when parked
+    int         gov_cap;            // Highest index allowed by temperature
+    int         gov_target;         // Index to switch to once PGRAPH is idle
+    int         gov_low_windows;    // Consecutive quiet windows
+    uint32_t    gov_samples;        // This window: samples taken
+    uint32_t    gov_busy;           //   ... of which busy
+    uint32_t    gov_fences;         //   ... fences signalled
+    uint64_t    gov_window_start;   // PTIMER ns
+    uint32_t    gov_util;           // Last window: busy percent
+    uint32_t    gov_fence_hz;       //   ... fences per second
+    uint32_t    gov_fence_seen[NV_FIFO_MAX_CHANNELS];
 } nv_power_state_t;
 
 // ============================================================
@@ -193,4 +224,14 @@ void nv_power_enable_cg(int enable);
 // ---- Monitoring ----
 void nv_power_update(void);    // Call periodically to update stats
 
+// ---- Governor ----
+// Enable or disable load-driven P-state selection (needs timer_init).
+// Disabling leaves the current P-state in place.
+void nv_power_set_governor(int enable);
+int  nv_power_governor_enabled(void);
+
+// A channel was kicked: resume sampling if the governor parked at the
+// lowest P-state while the GPU was idle
+void nv_power_governor_kick(void);
+
 #endif
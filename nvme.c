@@ -0,0 +1,736 @@
+// nvme.c - NVMe Block Driver for Alteo OS
+// BAR0 is used through the identity map. The admin queue is polled and
+// only used at init. I/O queue pair N+1 belongs to CPU N: a request is
+// split into commands of up to the controller's transfer limit, all
+// submitted on the caller's CPU queue, then the caller sleeps until each
+// command id has completed. A request takes all the ids it needs at once
+// and never waits for more while it holds some, so requests sharing a
+// queue cannot deadlock on each other's ids. Completions arrive by MSI-X (one vector per
+// queue, aimed at its CPU), by one shared MSI vector, or - without
+// either - by a timer event polling the completion queue.
+#include "nvme.h"
+#include "klib.h"
+#include "apic.h"
+#include "blkdev.h"
+#include "isr.h"
+#include "pci.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "smp.h"
+#include "timer.h"
+#include "waitq.h"
+#include "scheduler.h"
+#include "spinlock.h"
+
+typedef struct {
+    uint64_t*    prp_list;   // Page of PRP entries, allocated on first use
+    volatile int done;
+    uint16_t     status;     // Status field without the phase bit
+    uint32_t     result;
+} nvme_cmd_t;
+
+struct nvme_ctrl;
+
+typedef struct {
+    struct nvme_ctrl*  ctrl;
+    int                qid;
+    nvme_sqe_t*        sq;
+    volatile nvme_cqe_t* cq;
+    uint16_t           depth;
+    uint16_t           sq_tail;
+    uint16_t           cq_head;
+    uint16_t           phase;
+    volatile uint32_t* sq_db;
+    volatile uint32_t* cq_db;
+    spinlock_t         lock;
+    waitq_t            wq;           // Waiting for command ids or completions
+    uint64_t           busy;         // Command ids in use
+    nvme_cmd_t         cmds[NVME_QUEUE_DEPTH];
+    int                vector;      // Interrupt vector, -1 = polled
+    int                poll_armed;
+} nvme_queue_t;
+
+typedef struct nvme_ctrl {
+    volatile uint8_t*  regs;
+    pci_device_t*      pci;
+    uint32_t           dstrd;        // Doorbell stride: 4 << dstrd bytes
+    uint32_t           mqes;         // Max queue entries
+    uint32_t           timeout_ms;   // CAP.TO
+    uint32_t           max_sectors;  // 512-byte sectors per command
+    int                msix;         // Per-queue MSI-X vectors available
+    int                shared_vector; // Single MSI vector for all queues, -1 = none
+    int                max_io;       // I/O queue pairs granted
+    int                nio;          // I/O queue pairs created
+    nvme_queue_t       admin;
+    nvme_queue_t       io[NVME_MAX_IO_QUEUES];
+} nvme_ctrl_t;
+
+static nvme_ctrl_t ctrls[NVME_MAX_CONTROLLERS];
+static int ctrl_count = 0;
+static nvme_disk_t disks[NVME_MAX_DISKS];
+static int disk_count = 0;
+
+static inline uint32_t nvme_read32(nvme_ctrl_t* c, uint32_t reg) {
+    return *(volatile uint32_t*)(c->regs + reg);
+}
+static inline void nvme_write32(nvme_ctrl_t* c, uint32_t reg, uint32_t val) {
+    *(volatile uint32_t*)(c->regs + reg) = val;
+}
+static inline uint64_t nvme_read64(nvme_ctrl_t* c, uint32_t reg) {
+    return (uint64_t)nvme_read32(c, reg) | ((uint64_t)nvme_read32(c, reg + 4) << 32);
+}
+static inline void nvme_write64(nvme_ctrl_t* c, uint32_t reg, uint64_t val) {
+    nvme_write32(c, reg, (uint32_t)val);
+    nvme_write32(c, reg + 4, (uint32_t)(val >> 32));
+}
+
+// ---------- Queues ----------
+
+static int nvme_queue_alloc(nvme_ctrl_t* c, nvme_queue_t* q, int qid, uint16_t depth) {
+    void* sq = pmm_alloc_block();
+    void* cq = pmm_alloc_block();
+    if (!sq || !cq) {
+        if (sq) pmm_free_block(sq);
+        if (cq) pmm_free_block(cq);
+        return -1;
+    }
+    memset(sq, 0, PAGE_SIZE);
+    memset(cq, 0, PAGE_SIZE);
+    memset(q, 0, sizeof(*q));
+    q->ctrl = c;
+    q->qid = qid;
+    q->sq = (nvme_sqe_t*)sq;
+    q->cq = (volatile nvme_cqe_t*)cq;
+    q->depth = depth;
+    q->phase = 1;
+    q->sq_db = (volatile uint32_t*)(c->regs + NVME_REG_DOORBELLS + (2 * qid) * (4U << c->dstrd));
+    q->cq_db = (volatile uint32_t*)(c->regs + NVME_REG_DOORBELLS + (2 * qid + 1) * (4U << c->dstrd));
+    q->vector = -1;
+    waitq_init(&q->wq);
+    return 0;
+}
+
+// Consume new completion entries (q->lock held)
+static void nvme_reap(nvme_queue_t* q) {
+    int consumed = 0;
+    while ((q->cq[q->cq_head].status & 1) == q->phase) {
+        volatile nvme_cqe_t* e = &q->cq[q->cq_head];
+        uint16_t cid = e->cid;
+        if (cid < q->depth) {
+            q->cmds[cid].status = e->status >> 1;
+            q->cmds[cid].result = e->result;
+            q->cmds[cid].done = 1;
+        }
+        if (++q->cq_head == q->depth) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+        consumed = 1;
+    }
+    if (consumed) *q->cq_db = q->cq_head;
+
+    // A dead controller completes nothing more: fail what is in flight
+    if (q->busy && (nvme_read32(q->ctrl, NVME_REG_CSTS) & NVME_CSTS_CFS)) {
+        for (uint64_t m = q->busy; m; m &= m - 1) {
+            nvme_cmd_t* cmd = &q->cmds[__builtin_ctzll(m)];
+            if (!cmd->done) {
+                cmd->status = 0x7FFF;
+                cmd->done = 1;
+            }
+        }
+    }
+}
+
+static void nvme_reap_wake(nvme_queue_t* q) {
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    nvme_reap(q);
+    spin_unlock_irqrestore(&q->lock, flags);
+    waitq_wake_all(&q->wq);
+}
+
+// A queue's own MSI-X vector
+static void nvme_queue_irq(void* ctx) {
+    nvme_reap_wake((nvme_queue_t*)ctx);
+}
+
+// The single MSI vector every queue shares
+static void nvme_ctrl_irq(void* ctx) {
+    nvme_ctrl_t* c = (nvme_ctrl_t*)ctx;
+    for (int i = 0; i < c->nio; i++) nvme_reap_wake(&c->io[i]);
+}
+
+// Timer event for queues without an interrupt (arg = queue pointer)
+static void nvme_poll_event(uint64_t arg) {
+    nvme_queue_t* q = (nvme_queue_t*)arg;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    nvme_reap(q);
+    q->poll_armed = 0;
+    if (q->busy && timer_add(timer_now_ns() + NVME_POLL_NS, nvme_poll_event, arg) >= 0) {
+        q->poll_armed = 1;
+    }
+    spin_unlock_irqrestore(&q->lock, flags);
+    waitq_wake_all(&q->wq);
+}
+
+static void nvme_submit(nvme_queue_t* q, nvme_sqe_t* sqe, int cid) {
+    sqe->cdw0 = (sqe->cdw0 & 0xFFFF) | ((uint32_t)cid << 16);
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    q->cmds[cid].done = 0;
+    memcpy(&q->sq[q->sq_tail], sqe, sizeof(*sqe));
+    if (++q->sq_tail == q->depth) q->sq_tail = 0;
+    *q->sq_db = q->sq_tail;
+    if (q->vector < 0 && !q->poll_armed && timer_is_active() &&
+        timer_add(timer_now_ns() + NVME_POLL_NS, nvme_poll_event, (uint64_t)q) >= 0) {
+        q->poll_armed = 1;
+    }
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+// Admin commands run one at a time at init, polled. Returns 0 on success.
+static int nvme_admin(nvme_ctrl_t* c, nvme_sqe_t* sqe, uint32_t* result) {
+    nvme_queue_t* q = &c->admin;
+    q->busy = 1;
+    nvme_submit(q, sqe, 0);
+    uint32_t waited = 0;
+    while (!q->cmds[0].done) {
+        uint64_t flags = spin_lock_irqsave(&q->lock);
+        nvme_reap(q);
+        spin_unlock_irqrestore(&q->lock, flags);
+        if (q->cmds[0].done) break;
+        if (++waited > c->timeout_ms * 1000U) {
+            q->busy = 0;
+            return -1;
+        }
+        for (int i = 0; i < 1000; i++) __asm__ volatile("pause");
+    }
+    q->busy = 0;
+    if (result) *result = q->cmds[0].result;
+    return q->cmds[0].status ? -1 : 0;
+}
+
+// ---------- Requests ----------
+
+typedef struct {
+    nvme_queue_t* q;
+    uint64_t      mask;      // Command ids of this request
+    uint32_t      need;      // Ids it is asking for
+} nvme_req_t;
+
+// Ids the queue can hand out (one entry stays empty: a full ring would
+// look empty to the controller)
+static uint64_t nvme_usable(nvme_queue_t* q) {
+    return (1ULL << (q->depth - 1)) - 1;
+}
+
+// At least need ids are free (q->lock held)
+static int nvme_cids_free(nvme_queue_t* q, uint32_t need) {
+    uint32_t n = 0;
+    for (uint64_t m = nvme_usable(q) & ~q->busy; m && n < need; m &= m - 1) n++;
+    return n >= need;
+}
+
+static int nvme_cid_available(void* arg) {
+    nvme_req_t* r = (nvme_req_t*)arg;
+    nvme_queue_t* q = r->q;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    nvme_reap(q);
+    int ok = nvme_cids_free(q, r->need);
+    spin_unlock_irqrestore(&q->lock, flags);
+    return ok;
+}
+
+static int nvme_cmds_done(void* arg) {
+    nvme_req_t* r = (nvme_req_t*)arg;
+    nvme_queue_t* q = r->q;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    nvme_reap(q);
+    int done = 1;
+    for (uint64_t m = r->mask; m; m &= m - 1) {
+        if (!q->cmds[__builtin_ctzll(m)].done) { done = 0; break; }
+    }
+    spin_unlock_irqrestore(&q->lock, flags);
+    return done;
+}
+
+// Sleep until cond(arg) holds; poll it when nothing would wake us
+static void nvme_wait(nvme_queue_t* q, waitq_cond_t cond, void* arg) {
+    if ((q->vector >= 0 || q->poll_armed) && waitq_wait(&q->wq, cond, arg) == 0) return;
+    while (!cond(arg)) {
+        if (scheduler_is_running()) scheduler_yield();
+        else __asm__ volatile("pause");
+    }
+}
+
+// Take 'need' command ids (at most the queue's) for r and return them. A
+// request that holds none sleeps until they are free; one that already
+// holds some gets 0 instead and must finish those first, since its own
+// would otherwise be what another request is waiting for.
+static uint64_t nvme_alloc_cids(nvme_req_t* r, uint32_t need) {
+    nvme_queue_t* q = r->q;
+    r->need = need;
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&q->lock);
+        if (nvme_cids_free(q, need)) {
+            uint64_t free_mask = nvme_usable(q) & ~q->busy, got = 0;
+            for (uint32_t k = 0; k < need; k++) {
+                got |= free_mask & -free_mask;
+                free_mask &= free_mask - 1;
+            }
+            q->busy |= got;
+            spin_unlock_irqrestore(&q->lock, flags);
+            return got;
+        }
+        spin_unlock_irqrestore(&q->lock, flags);
+        if (r->mask) return 0;
+        nvme_wait(q, nvme_cid_available, r);
+    }
+}
+
+// Wait for the request's commands, release their ids and return those
+// that failed
+static uint64_t nvme_finish(nvme_req_t* r) {
+    nvme_queue_t* q = r->q;
+    if (!r->mask) return 0;
+    nvme_wait(q, nvme_cmds_done, r);
+    uint64_t result = 0;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    for (uint64_t m = r->mask; m; m &= m - 1) {
+        int cid = __builtin_ctzll(m);
+        if (q->cmds[cid].status) result |= 1ULL << cid;
+    }
+    q->busy &= ~r->mask;
+    spin_unlock_irqrestore(&q->lock, flags);
+    r->mask = 0;
+    waitq_wake_all(&q->wq);
+    return result;
+}
+
+// PRP1 holds the first (possibly offset) page, PRP2 the second page or,
+// for longer transfers, the cid's PRP list. Returns 0 or -1.
+static int nvme_build_prp(nvme_queue_t* q, int cid, void* buf, uint32_t bytes, nvme_sqe_t* sqe) {
+    pte_t* pml4 = vmm_get_current_address_space();
+    uint64_t va = (uint64_t)buf;
+    uint64_t pa = vmm_get_physical(pml4, va);
+    if (!pa) return -1;
+    sqe->prp1 = pa;
+    sqe->prp2 = 0;
+
+    uint32_t first = PAGE_SIZE - (uint32_t)(va & (PAGE_SIZE - 1));
+    if (bytes <= first) return 0;
+    va += first;
+    bytes -= first;
+    if (bytes <= PAGE_SIZE) {
+        sqe->prp2 = vmm_get_physical(pml4, va);
+        return sqe->prp2 ? 0 : -1;
+    }
+
+    nvme_cmd_t* cmd = &q->cmds[cid];
+    if (!cmd->prp_list) {
+        cmd->prp_list = (uint64_t*)pmm_alloc_block();
+        if (!cmd->prp_list) return -1;
+    }
+    int n = 0;
+    while (bytes) {
+        uint64_t p = vmm_get_physical(pml4, va);
+        if (!p || n == (int)(PAGE_SIZE / sizeof(uint64_t))) return -1;
+        cmd->prp_list[n++] = p;
+        uint32_t len = bytes < PAGE_SIZE ? bytes : PAGE_SIZE;
+        va += len;
+        bytes -= len;
+    }
+    sqe->prp2 = (uint64_t)cmd->prp_list;   // Identity mapped
+    return 0;
+}
+
+static nvme_queue_t* nvme_cpu_queue(nvme_ctrl_t* c) {
+    return &c->io[smp_cpu_id() % c->nio];
+}
+
+static uint32_t nvme_cmds_needed(nvme_disk_t* d, uint32_t count) {
+    uint32_t max = ctrls[d->controller].max_sectors;
+    return (count + max - 1) / max;
+}
+
+// Submit commands for count sectors (at most the queue's ids' worth) onto
+// request r. Returns 0, -1 on error, or 1 if r holds ids and the rest are
+// busy: finish r and submit again.
+static int nvme_queue_io(nvme_disk_t* d, nvme_req_t* r, uint64_t lba, uint32_t count, uint8_t* buf, int write) {
+    nvme_ctrl_t* c = &ctrls[d->controller];
+    uint32_t shift = d->lba_shift - 9;
+
+    uint64_t cids = nvme_alloc_cids(r, nvme_cmds_needed(d, count));
+    if (!cids) return 1;
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t n = count - done;
+        if (n > c->max_sectors) n = c->max_sectors;
+        int cid = __builtin_ctzll(cids);
+
+        nvme_sqe_t sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.cdw0 = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+        sqe.nsid = d->nsid;
+        uint64_t slba = (lba + done) >> shift;
+        sqe.cdw10 = (uint32_t)slba;
+        sqe.cdw11 = (uint32_t)(slba >> 32);
+        sqe.cdw12 = (n >> shift) - 1;
+        if (nvme_build_prp(r->q, cid, buf + (uint64_t)done * BLKDEV_SECTOR_SIZE,
+                           n * BLKDEV_SECTOR_SIZE, &sqe) < 0) {
+            uint64_t flags = spin_lock_irqsave(&r->q->lock);
+            r->q->busy &= ~cids;
+            spin_unlock_irqrestore(&r->q->lock, flags);
+            waitq_wake_all(&r->q->wq);
+            return -1;
+        }
+        nvme_submit(r->q, &sqe, cid);
+        r->mask |= 1ULL << cid;
+        cids &= cids - 1;
+        done += n;
+    }
+    return 0;
+}
+
+static int nvme_transfer(nvme_disk_t* d, uint64_t lba, uint32_t count, uint8_t* buf, int write) {
+    nvme_ctrl_t* c = &ctrls[d->controller];
+    nvme_queue_t* q = nvme_cpu_queue(c);
+    // Never ask for more command ids than the queue has: our own are
+    // not released until the request finishes
+    uint32_t window = (uint32_t)(q->depth - 1) * c->max_sectors;
+    int result = 0;
+    for (uint32_t done = 0; done < count && result == 0; ) {
+        uint32_t n = count - done < window ? count - done : window;
+        nvme_req_t r = { q, 0, 0 };
+        if (nvme_queue_io(d, &r, lba + done, n, buf + (uint64_t)done * BLKDEV_SECTOR_SIZE, write) < 0) {
+            result = -1;
+        }
+        if (nvme_finish(&r)) result = -1;
+        done += n;
+    }
+    return result;
+}
+
+// PRPs need dword-aligned buffers: others go through a bounce page
+static int nvme_transfer_bounce(nvme_disk_t* d, uint64_t lba, uint32_t count, uint8_t* buf, int write) {
+    uint8_t* bounce = (uint8_t*)pmm_alloc_block();
+    if (!bounce) return -1;
+    uint32_t step = PAGE_SIZE / BLKDEV_SECTOR_SIZE;
+    int result = 0;
+    for (uint32_t done = 0; done < count && result == 0; done += step) {
+        uint32_t n = count - done < step ? count - done : step;
+        uint8_t* at = buf + (uint64_t)done * BLKDEV_SECTOR_SIZE;
+        if (write) memcpy(bounce, at, n * BLKDEV_SECTOR_SIZE);
+        result = nvme_transfer(d, lba + done, n, bounce, write);
+        if (!write && result == 0) memcpy(at, bounce, n * BLKDEV_SECTOR_SIZE);
+    }
+    pmm_free_block(bounce);
+    return result;
+}
+
+static int nvme_rw(int disk, uint64_t lba, uint32_t count, void* buf, int write) {
+    if (disk < 0 || disk >= disk_count || !buf) return -1;
+    nvme_disk_t* d = &disks[disk];
+    if (count == 0) return 0;
+    if (lba + count > d->sectors) return -1;
+    uint32_t align = (1U << (d->lba_shift - 9)) - 1;
+    if ((lba & align) || (count & align)) return -1;
+
+    int r = ((uint64_t)buf & 3) ? nvme_transfer_bounce(d, lba, count, (uint8_t*)buf, write)
+                                : nvme_transfer(d, lba, count, (uint8_t*)buf, write);
+    return r < 0 ? -1 : (int)count;
+}
+
+int nvme_read_sectors(int disk, uint64_t lba, uint32_t count, void* buf) {
+    return nvme_rw(disk, lba, count, buf, 0);
+}
+
+int nvme_write_sectors(int disk, uint64_t lba, uint32_t count, const void* buf) {
+    return nvme_rw(disk, lba, count, (void*)buf, 1);
+}
+
+int nvme_flush(int disk) {
+    if (disk < 0 || disk >= disk_count) return -1;
+    nvme_disk_t* d = &disks[disk];
+    nvme_req_t r = { nvme_cpu_queue(&ctrls[d->controller]), 0, 0 };
+    int cid = __builtin_ctzll(nvme_alloc_cids(&r, 1));
+    nvme_sqe_t sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_CMD_FLUSH;
+    sqe.nsid = d->nsid;
+    nvme_submit(r.q, &sqe, cid);
+    r.mask = 1ULL << cid;
+    return nvme_finish(&r) ? -1 : 0;
+}
+
+nvme_disk_t* nvme_get_disk(int index) {
+    if (index < 0 || index >= disk_count) return (nvme_disk_t*)0;
+    return &disks[index];
+}
+
+int nvme_get_disk_count(void) {
+    return disk_count;
+}
+
+// ---------- Block device adapters ----------
+
+static int nvme_blkdev_read(void* driver_data, uint32_t lba, uint32_t count, void* buf) {
+    return nvme_read_sectors((int)(uint64_t)driver_data, lba, count, buf);
+}
+
+static int nvme_blkdev_write(void* driver_data, uint32_t lba, uint32_t count, const void* buf) {
+    return nvme_write_sectors((int)(uint64_t)driver_data, lba, count, buf);
+}
+
+static int nvme_blkdev_flush(void* driver_data) {
+    return nvme_flush((int)(uint64_t)driver_data);
+}
+
+// Complete the batch's submitted transfers [0, n) and fail those whose
+// commands reported an error
+static void nvme_batch_finish(nvme_req_t* r, blkdev_io_t* ios, uint64_t* masks, int n) {
+    uint64_t failed = nvme_finish(r);
+    for (int i = 0; i < n; i++) {
+        if (masks[i] & failed) ios[i].status = -1;
+        masks[i] = 0;
+    }
+}
+
+// Put a whole batch on this CPU's submission queue before waiting, so the
+// controller works on all of it at once. Transfers that need a bounce
+// page or more command ids than the queue has run on their own.
+static int nvme_blkdev_submit(void* driver_data, blkdev_io_t* ios, int count) {
+    int disk = (int)(uint64_t)driver_data;
+    if (disk < 0 || disk >= disk_count || count > BLKDEV_BATCH_MAX) return -1;
+    nvme_disk_t* d = &disks[disk];
+    nvme_req_t r = { nvme_cpu_queue(&ctrls[d->controller]), 0, 0 };
+    uint32_t depth = (uint32_t)r.q->depth - 1;
+    uint32_t align = (1U << (d->lba_shift - 9)) - 1;
+    uint64_t masks[BLKDEV_BATCH_MAX];
+    uint32_t used = 0;
+
+    for (int i = 0; i < count; i++) {
+        blkdev_io_t* io = &ios[i];
+        uint8_t* buf = (uint8_t*)io->buf;
+        uint32_t need = nvme_cmds_needed(d, io->count);
+        int alone = ((uint64_t)buf & 3) || need > depth;
+        masks[i] = 0;
+        io->status = 0;
+        if (r.mask && (alone || used + need > depth)) {
+            nvme_batch_finish(&r, ios, masks, i);
+            used = 0;
+        }
+
+        if (!buf || (uint64_t)io->lba + io->count > d->sectors || (io->lba & align) || (io->count & align)) {
+            io->status = -1;
+        } else if (alone) {
+            io->status = ((uint64_t)buf & 3) ? nvme_transfer_bounce(d, io->lba, io->count, buf, io->write)
+                                             : nvme_transfer(d, io->lba, io->count, buf, io->write);
+        } else {
+            uint64_t before = r.mask;
+            int q = nvme_queue_io(d, &r, io->lba, io->count, buf, io->write);
+            if (q > 0) {
+                // Other requests have the ids: complete ours before waiting
+                nvme_batch_finish(&r, ios, masks, i);
+                used = 0;
+                before = 0;
+                q = nvme_queue_io(d, &r, io->lba, io->count, buf, io->write);
+            }
+            if (q < 0) io->status = -1;
+            masks[i] = r.mask & ~before;
+            used += need;
+        }
+    }
+    nvme_batch_finish(&r, ios, masks, count);
+    return 0;
+}
+
+// ---------- Initialization ----------
+
+// Create I/O queue pair qid with its completions aimed at apic_id
+static int nvme_create_io_queue(nvme_ctrl_t* c, int qid, uint8_t apic_id) {
+    nvme_queue_t* q = &c->io[qid - 1];
+    uint16_t depth = NVME_QUEUE_DEPTH;
+    if (depth > c->mqes) depth = (uint16_t)c->mqes;
+    if (nvme_queue_alloc(c, q, qid, depth) < 0) return -1;
+
+    // Interrupt vector: this queue's own MSI-X entry, else the shared one
+    uint32_t iv = 0, ien = 0;
+    if (qid < c->msix) {
+        int v = pci_irq_alloc(c->pci, qid, nvme_queue_irq, q, apic_id);
+        if (v >= 0) {
+            q->vector = v;
+            iv = (uint32_t)qid;
+            ien = 1;
+        }
+    }
+    if (!ien && c->shared_vector >= 0) {
+        q->vector = c->shared_vector;
+        ien = 1;
+    }
+
+    nvme_sqe_t sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_CREATE_CQ;
+    sqe.prp1 = (uint64_t)q->cq;
+    sqe.cdw10 = ((uint32_t)(depth - 1) << 16) | (uint32_t)qid;
+    sqe.cdw11 = (iv << 16) | (ien << 1) | 1;   // Physically contiguous
+    if (nvme_admin(c, &sqe, 0) < 0) return -1;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_CREATE_SQ;
+    sqe.prp1 = (uint64_t)q->sq;
+    sqe.cdw10 = ((uint32_t)(depth - 1) << 16) | (uint32_t)qid;
+    sqe.cdw11 = ((uint32_t)qid << 16) | 1;     // Completes on CQ qid
+    if (nvme_admin(c, &sqe, 0) < 0) return -1;
+
+    c->nio = qid;
+    return 0;
+}
+
+static int nvme_identify(nvme_ctrl_t* c, uint32_t cns, uint32_t nsid, void* buf) {
+    nvme_sqe_t sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_IDENTIFY;
+    sqe.nsid = nsid;
+    sqe.prp1 = (uint64_t)buf;
+    sqe.cdw10 = cns;
+    return nvme_admin(c, &sqe, 0);
+}
+
+static int nvme_wait_ready(nvme_ctrl_t* c, int ready) {
+    for (uint32_t ms = 0; ms <= c->timeout_ms; ms += 10) {
+        uint32_t csts = nvme_read32(c, NVME_REG_CSTS);
+        if (csts & NVME_CSTS_CFS) return -1;
+        if (((csts & NVME_CSTS_RDY) != 0) == ready) return 0;
+        apic_delay_ms(10);
+    }
+    return -1;
+}
+
+static void nvme_register_namespaces(nvme_ctrl_t* c, int index, uint32_t nn, uint8_t* id) {
+    for (uint32_t nsid = 1; nsid <= nn && disk_count < NVME_MAX_DISKS; nsid++) {
+        if (nvme_identify(c, 0, nsid, id) < 0) continue;
+        uint64_t nsze = *(uint64_t*)id;
+        uint8_t flbas = id[26] & 0x0F;
+        uint32_t lbads = id[128 + flbas * 4 + 2];
+        if (!nsze || lbads < 9 || lbads > 12) continue;
+
+        nvme_disk_t* d = &disks[disk_count];
+        d->present = 1;
+        d->controller = index;
+        d->nsid = nsid;
+        d->lba_shift = lbads;
+        d->sectors = nsze << (lbads - 9);
+
+        blkdev_ops_t ops;
+        ops.read_sectors = nvme_blkdev_read;
+        ops.write_sectors = nvme_blkdev_write;
+        ops.flush = nvme_blkdev_flush;
+        ops.submit = nvme_blkdev_submit;
+        char name[16] = "nvme0n1";
+        name[4] = '0' + (char)index;
+        name[6] = '0' + (char)(nsid % 10);
+        d->blkdev_id = blkdev_register(name, BLKDEV_TYPE_NVME, d->sectors, BLKDEV_SECTOR_SIZE,
+                                       (void*)(uint64_t)disk_count, &ops);
+        disk_count++;
+    }
+}
+
+static void nvme_init_ctrl(pci_device_t* dev) {
+    uint64_t bar0 = pci_get_bar_base(dev, 0);
+    if (!bar0 || ctrl_count >= NVME_MAX_CONTROLLERS) return;
+    int index = ctrl_count;
+    nvme_ctrl_t* c = &ctrls[index];
+    memset(c, 0, sizeof(*c));
+    c->regs = (volatile uint8_t*)(uintptr_t)bar0;
+    c->pci = dev;
+    c->shared_vector = -1;
+    pci_enable_bus_master(dev);
+    pci_enable_mem_space(dev);
+
+    uint64_t cap = nvme_read64(c, NVME_REG_CAP);
+    c->mqes = (uint32_t)(cap & 0xFFFF) + 1;
+    c->dstrd = (uint32_t)(cap >> 32) & 0xF;
+    c->timeout_ms = (((uint32_t)(cap >> 24) & 0xFF) + 1) * 500;
+    if (((cap >> 48) & 0xF) != 0) return;   // 4KB pages unsupported
+
+    // Reset, then bring up the admin queue
+    nvme_write32(c, NVME_REG_CC, nvme_read32(c, NVME_REG_CC) & ~NVME_CC_EN);
+    if (nvme_wait_ready(c, 0) < 0) return;
+    uint16_t adepth = NVME_ADMIN_DEPTH;
+    if (adepth > c->mqes) adepth = (uint16_t)c->mqes;
+    if (nvme_queue_alloc(c, &c->admin, 0, adepth) < 0) return;
+    nvme_write32(c, NVME_REG_AQA, ((uint32_t)(adepth - 1) << 16) | (adepth - 1));
+    nvme_write64(c, NVME_REG_ASQ, (uint64_t)c->admin.sq);
+    nvme_write64(c, NVME_REG_ACQ, (uint64_t)c->admin.cq);
+    nvme_write32(c, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    if (nvme_wait_ready(c, 1) < 0) return;
+
+    uint8_t* id = (uint8_t*)pmm_alloc_block();
+    if (!id) return;
+    if (nvme_identify(c, 1, 0, id) < 0) {
+        pmm_free_block(id);
+        return;
+    }
+    // MDTS is a power of two in minimum pages (4KB); 0 = no limit
+    uint8_t mdts = id[77];
+    c->max_sectors = NVME_MAX_SECTORS;
+    if (mdts && mdts < 8 && (uint32_t)(PAGE_SIZE << mdts) / BLKDEV_SECTOR_SIZE < c->max_sectors) {
+        c->max_sectors = (PAGE_SIZE << mdts) / BLKDEV_SECTOR_SIZE;
+    }
+    uint32_t nn = *(uint32_t*)(id + 516);
+
+    // Ask for an I/O queue pair per possible CPU
+    nvme_sqe_t sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.cdw0 = NVME_ADMIN_SET_FEATURES;
+    sqe.cdw10 = NVME_FEAT_NUM_QUEUES;
+    sqe.cdw11 = ((uint32_t)(NVME_MAX_IO_QUEUES - 1) << 16) | (NVME_MAX_IO_QUEUES - 1);
+    uint32_t granted = 0;
+    if (nvme_admin(c, &sqe, &granted) < 0) {
+        pmm_free_block(id);
+        return;
+    }
+    uint32_t nsq = (granted & 0xFFFF) + 1, ncq = (granted >> 16) + 1;
+    c->max_io = (int)(nsq < ncq ? nsq : ncq);
+    if (c->max_io > NVME_MAX_IO_QUEUES) c->max_io = NVME_MAX_IO_QUEUES;
+
+    // MSI-X gives each queue its own vector (entry 0 stays with the
+    // polled admin queue); plain MSI gives one vector for all of them
+    if (apic_is_active()) {
+        c->msix = pci_msix_count(dev);
+        if (c->msix < 2) {
+            c->msix = 0;
+            int v = pci_irq_alloc(dev, 0, nvme_ctrl_irq, c, (uint8_t)lapic_get_id());
+            if (v >= 0) {
+                c->shared_vector = v;
+            }
+        }
+    }
+
+    ctrl_count++;
+    if (nvme_create_io_queue(c, 1, (uint8_t)lapic_get_id()) < 0) {
+        ctrl_count--;
+        pmm_free_block(id);
+        return;
+    }
+    nvme_register_namespaces(c, index, nn, id);
+    pmm_free_block(id);
+}
+
+int nvme_init(void) {
+    ctrl_count = 0;
+    disk_count = 0;
+    pci_device_t* dev = (pci_device_t*)0;
+    while ((dev = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVMe, dev)) != 0) {
+        nvme_init_ctrl(dev);
+    }
+    return disk_count;
+}
+
+void nvme_init_cpus(void) {
+    for (int i = 0; i < ctrl_count; i++) {
+        nvme_ctrl_t* c = &ctrls[i];
+        for (int cpu = 1; cpu < smp_cpu_count() && c->nio < c->max_io; cpu++) {
+            if (nvme_create_io_queue(c, c->nio + 1, smp_cpu_apic_id(cpu)) < 0) break;
+        }
+    }
+}
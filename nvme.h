@@ -0,0 +1,100 @@
+// nvme.h - NVMe Block Driver for Alteo OS
+// Drives NVM Express controllers found on PCI (class 0x01 / 0x08). Each
+// CPU submits I/O on its own submission/completion queue pair, whose
+// completions raise an MSI-X vector aimed at that CPU. Namespaces are
+// registered with the block layer as "nvme<controller>n<nsid>".
+#ifndef NVME_H
+#define NVME_H
+
+#include "stdint.h"
+
+// Controller registers (offsets from BAR0)
+#define NVME_REG_CAP            0x00    // 64-bit
+#define NVME_REG_VS             0x08
+#define NVME_REG_INTMS          0x0C
+#define NVME_REG_INTMC          0x10
+#define NVME_REG_CC             0x14
+#define NVME_REG_CSTS           0x1C
+#define NVME_REG_AQA            0x24
+#define NVME_REG_ASQ            0x28    // 64-bit
+#define NVME_REG_ACQ            0x30    // 64-bit
+#define NVME_REG_DOORBELLS      0x1000
+
+#define NVME_CC_EN              (1U << 0)
+#define NVME_CC_IOSQES          (6U << 16)    // 64-byte submission entries
+#define NVME_CC_IOCQES          (4U << 20)    // 16-byte completion entries
+#define NVME_CSTS_RDY           (1U << 0)
+#define NVME_CSTS_CFS           (1U << 1)     // Controller fatal status
+
+// Admin opcodes
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_FEAT_NUM_QUEUES    0x07
+
+// I/O opcodes
+#define NVME_CMD_FLUSH          0x00
+#define NVME_CMD_WRITE          0x01
+#define NVME_CMD_READ           0x02
+
+// Submission queue entry (64 bytes)
+typedef struct __attribute__((packed)) {
+    uint32_t cdw0;           // Opcode | command id << 16
+    uint32_t nsid;
+    uint32_t reserved[2];
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+} nvme_sqe_t;
+
+// Completion queue entry (16 bytes)
+typedef struct __attribute__((packed)) {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;         // Bit 0: phase tag
+} nvme_cqe_t;
+
+// Driver limits
+#define NVME_MAX_CONTROLLERS    2
+#define NVME_MAX_DISKS          4
+#define NVME_MAX_IO_QUEUES      16      // One per CPU (SMP_MAX_CPUS)
+#define NVME_ADMIN_DEPTH        16
+#define NVME_QUEUE_DEPTH        64      // Entries; one less may be in flight
+#define NVME_MAX_SECTORS        1024    // 512-byte sectors per command (512KB)
+#define NVME_POLL_NS            100000ULL     // Completion poll for queues without a vector
+
+// One namespace
+typedef struct {
+    int      present;
+    int      controller;
+    uint32_t nsid;
+    uint32_t lba_shift;      // log2 of the namespace's LBA size
+    uint64_t sectors;        // In 512-byte sectors
+    int      blkdev_id;
+} nvme_disk_t;
+
+// Find NVMe controllers, set up their admin queue and an I/O queue pair
+// for the boot CPU, and register every namespace with the block layer
+// (after blkdev_init). Returns the number of namespaces found.
+int nvme_init(void);
+
+// Give every other online CPU its own I/O queue pair (after smp_init)
+void nvme_init_cpus(void);
+
+// Disk info, or 0 if index is not a disk
+nvme_disk_t* nvme_get_disk(int index);
+int nvme_get_disk_count(void);
+
+// Sector I/O in 512-byte sectors. On namespaces with larger LBAs, lba and
+// count must be LBA-aligned (block-layer requests are page-aligned).
+// Returns count, or -1 on error.
+int nvme_read_sectors(int disk, uint64_t lba, uint32_t count, void* buf);
+int nvme_write_sectors(int disk, uint64_t lba, uint32_t count, const void* buf);
+int nvme_flush(int disk);
+
+#endif
@@ -6,6 +6,7 @@
 #include "gpu.h"
 #include "graphics.h"
 #include "heap.h"
+#include "klib.h"
 
 // ============================================================
 // Internal State
@@ -70,18 +71,95 @@ typedef struct {
     float nx, ny, nz;
 } gl_vertex_t;
 
+// Vertex after modelview-projection, perspective divide and viewport
+// mapping: all the rasterizer needs
+typedef struct {
+    float sx, sy;               // Window coordinates
+    float r, g, b, a;
+    float s, t;
+} gl_xvertex_t;
+
+// One mipmap level. Texels are ARGB in 4x4 blocks of 16 (64 bytes, one
+// cache line), blocks in row order, so a filter footprint or a short run
+// along either axis stays within a line or two.
+typedef struct {
+    int       width, height;
+    int       blocks_x;         // Blocks per block row
+    uint32_t* data;
+} gl_tex_level_t;
+
 // GL texture object
 typedef struct {
     uint32_t id;
-    int      width, height;
-    uint32_t* data;          // RGBA pixel data
+    gl_tex_level_t level[GL_MAX_TEXTURE_LEVELS];
+    int      nlevels;           // Complete chain length from level 0
     int      min_filter;
     int      mag_filter;
     int      wrap_s;
     int      wrap_t;
+    int      generate_mipmap;
     int      active;
 } gl_texture_t;
 
+// Transformed vertices kept for reuse, valid while the key matches
+typedef struct {
+    float    mv[16], pr[16];
+    int      vp[4];
+    uint64_t src[7];            // What the vertices were built from
+} gl_vkey_t;
+
+typedef struct {
+    gl_vkey_t     key;
+    int           valid;
+    gl_xvertex_t* xv;
+    int           cap;
+} gl_vcache_t;
+
+// Buffer object
+typedef struct {
+    uint32_t    id;
+    uint8_t*    data;
+    uint32_t    size;
+    uint32_t    version;        // Bumped on every data change
+    gl_vcache_t cache;          // Vertices last drawn from this buffer
+} gl_buffer_t;
+
+// Vertex array (glVertexPointer / glColorPointer)
+typedef struct {
+    int         enabled;
+    int         size;
+    GLenum      type;
+    int         stride;
+    const void* pointer;        // Offset into 'buffer' if one was bound
+    uint32_t    buffer;         // 0: client memory
+} gl_array_t;
+
+// Display list commands
+#define GL_LIST_DRAW            0
+#define GL_LIST_COLOR           1
+#define GL_LIST_MULT            2
+#define GL_LIST_LOAD_IDENTITY   3
+#define GL_LIST_PUSH            4
+#define GL_LIST_POP             5
+#define GL_LIST_MATRIX_MODE     6
+#define GL_LIST_CALL            7
+
+typedef struct {
+    int          op;
+    GLenum       mode;          // DRAW: primitive; MATRIX_MODE: mode
+    uint32_t     first, count;  // DRAW: vertex range; CALL: list in 'first'
+    float        m[16];         // MULT: matrix; COLOR: RGBA in m[0..3]
+    gl_vcache_t* cache;         // DRAW: transformed vertices
+} gl_list_op_t;
+
+typedef struct {
+    uint32_t      id;           // 0 = free slot
+    gl_list_op_t* ops;
+    int           nops, ops_cap;
+    gl_vertex_t*  verts;        // Object-space vertices of all DRAWs
+    int           nverts, verts_cap;
+} gl_list_t;
+
 // Global GL context
 static struct {
     int initialized;
@@ -129,6 +207,22 @@ static struct {
     uint32_t     bound_texture;
     uint32_t     next_texture_id;
 
+    // Vertex arrays and buffer objects
+    gl_array_t  vertex_array;
+    gl_array_t  color_array;
+    gl_buffer_t buffers[GL_MAX_BUFFERS];
+    uint32_t    array_buffer;           // Bound to GL_ARRAY_BUFFER
+    uint32_t    element_buffer;         // Bound to GL_ELEMENT_ARRAY_BUFFER
+    uint32_t    next_buffer_id;
+
+    // Display lists
+    gl_list_t   lists[GL_MAX_LISTS];
+    gl_list_t   compiling;              // List being recorded (id != 0)
+    GLenum      list_mode;
+    float       list_color[4];          // Current color at glNewList
+    int         list_depth;             // glCallList nesting
+    uint32_t    next_list_id;
+
     // Error
     GLenum error;
 
@@ -217,132 +311,570 @@ static void gl_put_pixel(int x, int y, uint32_t color) {
     backbuf[y * screen_width + x] = color;
 }
 
-// Transform vertex through modelview-projection
-static void transform_vertex(gl_vertex_t* v, float* out_x, float* out_y, float* out_z, float* out_w) {
-    float* mv = gl_ctx.modelview.mat[gl_ctx.modelview.top];
-    float* pr = gl_ctx.projection.mat[gl_ctx.projection.top];
-
-    // Modelview transform
-    float ex = mv[0]*v->x + mv[4]*v->y + mv[8]*v->z + mv[12];
-    float ey = mv[1]*v->x + mv[5]*v->y + mv[9]*v->z + mv[13];
-    float ez = mv[2]*v->x + mv[6]*v->y + mv[10]*v->z + mv[14];
-    float ew = mv[3]*v->x + mv[7]*v->y + mv[11]*v->z + mv[15];
-
-    // Projection transform
-    *out_x = pr[0]*ex + pr[4]*ey + pr[8]*ez + pr[12]*ew;
-    *out_y = pr[1]*ex + pr[5]*ey + pr[9]*ez + pr[13]*ew;
-    *out_z = pr[2]*ex + pr[6]*ey + pr[10]*ez + pr[14]*ew;
-    *out_w = pr[3]*ex + pr[7]*ey + pr[11]*ez + pr[15]*ew;
-}
-
-// Rasterize a single triangle (software)
-static void rasterize_triangle(gl_vertex_t* v0, gl_vertex_t* v1, gl_vertex_t* v2) {
-    // Transform vertices
-    float x0, y0, z0, w0;
-    float x1, y1, z1, w1;
-    float x2, y2, z2, w2;
-
-    transform_vertex(v0, &x0, &y0, &z0, &w0);
-    transform_vertex(v1, &x1, &y1, &z1, &w1);
-    transform_vertex(v2, &x2, &y2, &z2, &w2);
-
-    // Perspective divide
-    if (gl_fabsf(w0) < 0.0001f) w0 = 0.0001f;
-    if (gl_fabsf(w1) < 0.0001f) w1 = 0.0001f;
-    if (gl_fabsf(w2) < 0.0001f) w2 = 0.0001f;
-
-    float ndcx0 = x0/w0, ndcy0 = y0/w0;
-    float ndcx1 = x1/w1, ndcy1 = y1/w1;
-    float ndcx2 = x2/w2, ndcy2 = y2/w2;
-
-    // NDC to screen coordinates
-    float vp_x = (float)gl_ctx.vp_x;
-    float vp_y = (float)gl_ctx.vp_y;
-    float vp_w = (float)gl_ctx.vp_w;
-    float vp_h = (float)gl_ctx.vp_h;
-
-    float sx0 = vp_x + (ndcx0 + 1.0f) * 0.5f * vp_w;
-    float sy0 = vp_y + (1.0f - ndcy0) * 0.5f * vp_h;
-    float sx1 = vp_x + (ndcx1 + 1.0f) * 0.5f * vp_w;
-    float sy1 = vp_y + (1.0f - ndcy1) * 0.5f * vp_h;
-    float sx2 = vp_x + (ndcx2 + 1.0f) * 0.5f * vp_w;
-    float sy2 = vp_y + (1.0f - ndcy2) * 0.5f * vp_h;
-
-    // Bounding box
-    int minx = (int)sx0; if ((int)sx1 < minx) minx = (int)sx1; if ((int)sx2 < minx) minx = (int)sx2;
-    int maxx = (int)sx0; if ((int)sx1 > maxx) maxx = (int)sx1; if ((int)sx2 > maxx) maxx = (int)sx2;
-    int miny = (int)sy0; if ((int)sy1 < miny) miny = (int)sy1; if ((int)sy2 < miny) miny = (int)sy2;
-    int maxy = (int)sy0; if ((int)sy1 > maxy) maxy = (int)sy1; if ((int)sy2 > maxy) maxy = (int)sy2;
-
-    // Clamp to viewport
-    if (minx < gl_ctx.vp_x) minx = gl_ctx.vp_x;
-    if (miny < gl_ctx.vp_y) miny = gl_ctx.vp_y;
-    if (maxx >= gl_ctx.vp_x + gl_ctx.vp_w) maxx = gl_ctx.vp_x + gl_ctx.vp_w - 1;
-    if (maxy >= gl_ctx.vp_y + gl_ctx.vp_h) maxy = gl_ctx.vp_y + gl_ctx.vp_h - 1;
-
-    // Edge function rasterization
-    float area = (sx1 - sx0) * (sy2 - sy0) - (sx2 - sx0) * (sy1 - sy0);
-    if (gl_fabsf(area) < 0.001f) return; // degenerate
-
-    float inv_area = 1.0f / area;
-
-    for (int py = miny; py <= maxy; py++) {
-        for (int px = minx; px <= maxx; px++) {
-            float fpx = (float)px + 0.5f;
-            float fpy = (float)py + 0.5f;
-
-            float e0 = (sx1 - sx0) * (fpy - sy0) - (sy1 - sy0) * (fpx - sx0);
-            float e1 = (sx2 - sx1) * (fpy - sy1) - (sy2 - sy1) * (fpx - sx1);
-            float e2 = (sx0 - sx2) * (fpy - sy2) - (sy0 - sy2) * (fpx - sx2);
-
-            // Check winding
-            int inside;
-            if (area > 0) {
-                inside = (e0 >= 0 && e1 >= 0 && e2 >= 0);
-            } else {
-                inside = (e0 <= 0 && e1 <= 0 && e2 <= 0);
-            }
+// ============================================================
+// Vertex Transform
+// ============================================================
+
+// Combined transform for one draw
+typedef struct {
+    float m[16];                // projection * modelview
+    float vx, vy, hw, hh;       // Viewport origin and half size
+} gl_xform_t;
+
+static void xform_setup(gl_xform_t* xf) {
+    mat4_multiply(xf->m, gl_ctx.projection.mat[gl_ctx.projection.top],
+                  gl_ctx.modelview.mat[gl_ctx.modelview.top]);
+    xf->vx = (float)gl_ctx.vp_x;
+    xf->vy = (float)gl_ctx.vp_y;
+    xf->hw = (float)gl_ctx.vp_w * 0.5f;
+    xf->hh = (float)gl_ctx.vp_h * 0.5f;
+}
+
+// Object space to window coordinates, carrying the color along
+static void xform_vertex(const gl_xform_t* xf, const gl_vertex_t* v, gl_xvertex_t* out) {
+    const float* m = xf->m;
+    float cx = m[0]*v->x + m[4]*v->y + m[8]*v->z  + m[12];
+    float cy = m[1]*v->x + m[5]*v->y + m[9]*v->z  + m[13];
+    float cw = m[3]*v->x + m[7]*v->y + m[11]*v->z + m[15];
+    if (gl_fabsf(cw) < 0.0001f) cw = 0.0001f;
+
+    out->sx = xf->vx + (cx / cw + 1.0f) * xf->hw;
+    out->sy = xf->vy + (1.0f - cy / cw) * xf->hh;
+    out->r = v->r; out->g = v->g; out->b = v->b; out->a = v->a;
+    out->s = v->s; out->t = v->t;
+}
+
+static void xform_vertices(const gl_vertex_t* v, gl_xvertex_t* out, int n) {
+    gl_xform_t xf;
+    xform_setup(&xf);
+    for (int i = 0; i < n; i++) xform_vertex(&xf, &v[i], &out[i]);
+}
+
+// ============================================================
+// Texture Sampling
+// ============================================================
+// Texture coordinates reach the sampler as 16.16 fixed point in level-0
+// texels; level L sees them shifted right by L.
+
+static gl_texture_t* find_texture(uint32_t id) {
+    if (id == 0) return 0;
+    for (int i = 0; i < GL_MAX_TEXTURES; i++) {
+        if (gl_ctx.textures[i].active && gl_ctx.textures[i].id == id)
+            return &gl_ctx.textures[i];
+    }
+    return 0;
+}
+
+static inline uint32_t* texel_addr(const gl_tex_level_t* l, int x, int y) {
+    return &l->data[(((y >> 2) * l->blocks_x + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3)];
+}
+
+static inline int tex_wrap(int v, int size, int mode) {
+    if (mode == GL_CLAMP) return v < 0 ? 0 : (v >= size ? size - 1 : v);
+    if ((size & (size - 1)) == 0) return v & (size - 1);
+    v %= size;
+    return v < 0 ? v + size : v;
+}
+
+// a + (b - a) * f / 256 on all four channels (f 0..256)
+static inline uint32_t lerp_argb(uint32_t a, uint32_t b, uint32_t f) {
+    uint32_t rb = (((a & 0x00FF00FF) * (256 - f) + (b & 0x00FF00FF) * f) >> 8) & 0x00FF00FF;
+    uint32_t ag = (((a >> 8) & 0x00FF00FF) * (256 - f) + ((b >> 8) & 0x00FF00FF) * f) & 0xFF00FF00;
+    return rb | ag;
+}
+
+static uint32_t sample_level(const gl_texture_t* tex, int lvl, int64_t u, int64_t v, int linear) {
+    const gl_tex_level_t* l = &tex->level[lvl];
+    u >>= lvl;
+    v >>= lvl;
+    if (!linear) {
+        int x = tex_wrap((int)(u >> 16), l->width, tex->wrap_s);
+        int y = tex_wrap((int)(v >> 16), l->height, tex->wrap_t);
+        return *texel_addr(l, x, y);
+    }
+
+    // Bilinear between the four texel centers around (u, v)
+    u -= 0x8000;
+    v -= 0x8000;
+    int x = (int)(u >> 16), y = (int)(v >> 16);
+    uint32_t fx = (uint32_t)(u >> 8) & 0xFF, fy = (uint32_t)(v >> 8) & 0xFF;
+    int xa = tex_wrap(x, l->width, tex->wrap_s), xb = tex_wrap(x + 1, l->width, tex->wrap_s);
+    int ya = tex_wrap(y, l->height, tex->wrap_t), yb = tex_wrap(y + 1, l->height, tex->wrap_t);
+    uint32_t top = lerp_argb(*texel_addr(l, xa, ya), *texel_addr(l, xb, ya), fx);
+    uint32_t bot = lerp_argb(*texel_addr(l, xa, yb), *texel_addr(l, xb, yb), fx);
+    return lerp_argb(top, bot, fy);
+}
+
+// log2(x) for x > 0, linear between powers of two (within 0.09)
+static float log2_approx(float x) {
+    union { float f; uint32_t u; } b = { x };
+    return (float)(int)((b.u >> 23) & 0xFF) - 127.0f + (float)(b.u & 0x7FFFFF) / 8388608.0f;
+}
+
+// ============================================================
+// Tiled Triangle Rasterizer
+// ============================================================
+// A glBegin/glEnd batch of triangles is set up once, binned into 64x64
+// screen tiles and then drawn tile by tile, skipping tiles no triangle
+// touches. Within a tile triangles are drawn in submission order, which
+// keeps blending correct.
+//
+// Vertices are snapped to 1/16 pixel and edges are integer functions
+// E = A*x + B*y + C (top-left fill rule, so shared edges are drawn once).
+// Each row's span comes straight from the three edges, the edge values
+// stepping by B per row; colors are 16.16 fixed-point planes, four pixels
+// per SSE2 step. Texture coordinates are planes too, so the texels per
+// pixel are the same all over a triangle and the mipmap level is picked
+// once per triangle.
+
+#define GL_TILE_SHIFT      6
+#define GL_TILE_SIZE       (1 << GL_TILE_SHIFT)
+#define GL_SUBPIXEL_SHIFT  4
+#define GL_SUBPIXEL        (1 << GL_SUBPIXEL_SHIFT)
+#define GL_GUARD_BAND      8388608.0f   // Farther out (w near 0) is dropped
+
+typedef int32_t v4i   __attribute__((vector_size(16)));
+typedef int32_t v4i_u __attribute__((vector_size(16), aligned(4)));  // Unaligned
+
+typedef struct {
+    int64_t a[3], b[3], c[3];   // Edges in subpixels, fill-rule bias in c
+    int     minx, miny, maxx, maxy;
+    int64_t col[4];             // B, G, R, A (16.16, 0..255) at (minx, miny)
+    int32_t dcdx[4], dcdy[4];   // Per pixel
+
+    const gl_texture_t* tex;    // 0: untextured
+    int64_t uv[2];              // 16.16 level-0 texels at (minx, miny)
+    int32_t duvdx[2], duvdy[2];
+    uint8_t lvl0, lvl1;         // Levels sampled; lvl1 weighs in by mip_frac
+    uint8_t linear;             // Bilinear within a level
+    uint16_t mip_frac;          // 0..255
+} gl_tri_t;
+
+static struct {
+    gl_tri_t* tris;             // GL_MAX_IMMEDIATE_VERTICES entries
+    int       ntris;
+    int       cx0, cy0, cx1, cy1;   // Clip rectangle (exclusive max)
+    const gl_texture_t* tex;    // Texture for this batch, if any
+    int       tx0, ty0, tiles_x, tiles_y;
+
+    uint32_t* bin_start;        // tiles + 1 offsets into bin_tri
+    uint16_t* bin_tri;          // Triangle indices, per tile in order
+    uint32_t  bin_cap;
+    int       tile_cap;
+    uint16_t* busy;             // Tiles with work
+    int       nbusy;
+} raster;
+
+static int64_t floor_div(int64_t n, int64_t d) {     // d > 0
+    int64_t q = n / d;
+    if ((n % d) != 0 && n < 0) q--;
+    return q;
+}
+
+static void raster_begin(void) {
+    raster.ntris = 0;
+    raster.cx0 = gl_ctx.vp_x;
+    raster.cy0 = gl_ctx.vp_y;
+    raster.cx1 = gl_ctx.vp_x + gl_ctx.vp_w;
+    raster.cy1 = gl_ctx.vp_y + gl_ctx.vp_h;
+    if (gl_ctx.scissor_test) {
+        if (raster.cx0 < gl_ctx.sc_x) raster.cx0 = gl_ctx.sc_x;
+        if (raster.cy0 < gl_ctx.sc_y) raster.cy0 = gl_ctx.sc_y;
+        if (raster.cx1 > gl_ctx.sc_x + gl_ctx.sc_w) raster.cx1 = gl_ctx.sc_x + gl_ctx.sc_w;
+        if (raster.cy1 > gl_ctx.sc_y + gl_ctx.sc_h) raster.cy1 = gl_ctx.sc_y + gl_ctx.sc_h;
+    }
+    if (raster.cx0 < 0) raster.cx0 = 0;
+    if (raster.cy0 < 0) raster.cy0 = 0;
+    if (raster.cx1 > screen_width) raster.cx1 = screen_width;
+    if (raster.cy1 > screen_height) raster.cy1 = screen_height;
+
+    raster.tex = 0;
+    if (gl_ctx.texture_2d) {
+        gl_texture_t* tex = find_texture(gl_ctx.bound_texture);
+        if (tex && tex->nlevels > 0) raster.tex = tex;
+    }
 
-            if (inside) {
-                // Barycentric coordinates
-                float w_v2 = e0 * inv_area;
-                float w_v0 = e1 * inv_area;
-                float w_v1 = e2 * inv_area;
-                if (area < 0) { w_v0 = -w_v0; w_v1 = -w_v1; w_v2 = -w_v2; }
-
-                // Interpolate color
-                float r = w_v0 * v0->r + w_v1 * v1->r + w_v2 * v2->r;
-                float g = w_v0 * v0->g + w_v1 * v1->g + w_v2 * v2->g;
-                float b = w_v0 * v0->b + w_v1 * v1->b + w_v2 * v2->b;
-                float a = w_v0 * v0->a + w_v1 * v1->a + w_v2 * v2->a;
-
-                uint32_t color = pack_color(r, g, b, a);
-                gl_put_pixel(px, py, color);
+    if (!raster.tris)
+        raster.tris = (gl_tri_t*)kmalloc(sizeof(gl_tri_t) * GL_MAX_IMMEDIATE_VERTICES);
+}
+
+static float clamp01(float v) {
+    return v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+}
+
+static void raster_end(void);
+
+// Plane through the values c[] at the snapped vertices: per-pixel steps,
+// and the value at the center of pixel (ref_x, ref_y) from vertex 0
+static int64_t tri_plane(const float* c, const float* fx, const float* fy, float farea,
+                         float ref_x, float ref_y, int32_t* dcdx, int32_t* dcdy) {
+    float dx = ((c[1] - c[0]) * (fy[2] - fy[0]) - (c[2] - c[0]) * (fy[1] - fy[0])) / farea;
+    float dy = ((c[2] - c[0]) * (fx[1] - fx[0]) - (c[1] - c[0]) * (fx[2] - fx[0])) / farea;
+    if (c[0] == c[1] && c[0] == c[2]) dx = dy = 0.0f;   // Flat: exact
+    if (dx > 2e9f) dx = 2e9f;
+    if (dx < -2e9f) dx = -2e9f;
+    if (dy > 2e9f) dy = 2e9f;
+    if (dy < -2e9f) dy = -2e9f;
+    *dcdx = (int32_t)dx;
+    *dcdy = (int32_t)dy;
+    float ref = c[0] + dx * ref_x + dy * ref_y;
+    if (ref > 1e15f) ref = 1e15f;
+    if (ref < -1e15f) ref = -1e15f;
+    return (int64_t)ref;
+}
+
+// Pick the mipmap level(s) and filter from the texels per pixel
+static void tri_texture_lod(gl_tri_t* t) {
+    const gl_texture_t* tex = t->tex;
+    float sx = (float)t->duvdx[0], tx = (float)t->duvdx[1];
+    float sy = (float)t->duvdy[0], ty = (float)t->duvdy[1];
+    float rx = sx * sx + tx * tx, ry = sy * sy + ty * ty;
+    float rho2 = (rx > ry ? rx : ry) / (65536.0f * 65536.0f);
+    float lambda = rho2 > 0.0f ? 0.5f * log2_approx(rho2) : 0.0f;
+
+    int filter = lambda > 0.0f ? tex->min_filter : tex->mag_filter;
+    t->linear = filter == GL_LINEAR || filter == GL_LINEAR_MIPMAP_NEAREST ||
+                filter == GL_LINEAR_MIPMAP_LINEAR;
+    t->lvl0 = t->lvl1 = 0;
+    t->mip_frac = 0;
+    if (lambda <= 0.0f) return;
+
+    int top = tex->nlevels - 1;
+    if (filter == GL_NEAREST_MIPMAP_NEAREST || filter == GL_LINEAR_MIPMAP_NEAREST) {
+        int l = (int)(lambda + 0.5f);
+        t->lvl0 = (uint8_t)(l < top ? l : top);
+    } else if (filter == GL_NEAREST_MIPMAP_LINEAR || filter == GL_LINEAR_MIPMAP_LINEAR) {
+        int l = (int)lambda;
+        if (l >= top) {
+            t->lvl0 = (uint8_t)top;
+        } else {
+            t->lvl0 = (uint8_t)l;
+            t->lvl1 = (uint8_t)(l + 1);
+            t->mip_frac = (uint16_t)((lambda - (float)l) * 255.0f);
+        }
+    }
+}
+
+// Snap and set up one triangle for the batch
+static void rasterize_triangle(const gl_xvertex_t* v0, const gl_xvertex_t* v1,
+                               const gl_xvertex_t* v2) {
+    if (!raster.tris) return;
+    if (raster.cx0 >= raster.cx1 || raster.cy0 >= raster.cy1) return;
+    if (raster.ntris >= GL_MAX_IMMEDIATE_VERTICES) {
+        // Batch full: draw what is set up so far and start another
+        raster_end();
+        raster.ntris = 0;
+    }
+
+    const gl_xvertex_t* v[3] = { v0, v1, v2 };
+    int64_t X[3], Y[3];
+    for (int i = 0; i < 3; i++) {
+        float sx = v[i]->sx, sy = v[i]->sy;
+        if (!(sx > -GL_GUARD_BAND && sx < GL_GUARD_BAND &&
+              sy > -GL_GUARD_BAND && sy < GL_GUARD_BAND)) return;
+        X[i] = (int64_t)(sx * (float)GL_SUBPIXEL);
+        Y[i] = (int64_t)(sy * (float)GL_SUBPIXEL);
+    }
+
+    // Counter-clockwise on screen, so inside is E >= 0 for every edge
+    int64_t area = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+    if (area == 0) return;
+    if (area < 0) {
+        int64_t t;
+        t = X[1]; X[1] = X[2]; X[2] = t;
+        t = Y[1]; Y[1] = Y[2]; Y[2] = t;
+        const gl_xvertex_t* tv = v[1]; v[1] = v[2]; v[2] = tv;
+        area = -area;
+    }
+
+    gl_tri_t* t = &raster.tris[raster.ntris];
+
+    // Bounding box in pixels whose centers may be covered, clipped
+    int64_t lo_x = X[0], hi_x = X[0], lo_y = Y[0], hi_y = Y[0];
+    for (int i = 1; i < 3; i++) {
+        if (X[i] < lo_x) lo_x = X[i];
+        if (X[i] > hi_x) hi_x = X[i];
+        if (Y[i] < lo_y) lo_y = Y[i];
+        if (Y[i] > hi_y) hi_y = Y[i];
+    }
+    int64_t minx = floor_div(lo_x, GL_SUBPIXEL), maxx = floor_div(hi_x, GL_SUBPIXEL);
+    int64_t miny = floor_div(lo_y, GL_SUBPIXEL), maxy = floor_div(hi_y, GL_SUBPIXEL);
+    if (minx < raster.cx0) minx = raster.cx0;
+    if (miny < raster.cy0) miny = raster.cy0;
+    if (maxx >= raster.cx1) maxx = raster.cx1 - 1;
+    if (maxy >= raster.cy1) maxy = raster.cy1 - 1;
+    if (minx > maxx || miny > maxy) return;
+    t->minx = (int)minx; t->maxx = (int)maxx;
+    t->miny = (int)miny; t->maxy = (int)maxy;
+
+    // Edge k runs from vertex k to vertex k+1. A pixel center exactly on
+    // an edge belongs to the triangle only for "left" edges (A > 0) and
+    // horizontal edges with B < 0; the neighbour across sees (-A, -B).
+    for (int k = 0; k < 3; k++) {
+        int j = (k + 1) % 3;
+        int64_t A = Y[k] - Y[j];
+        int64_t B = X[j] - X[k];
+        int owned = A > 0 || (A == 0 && B < 0);
+        t->a[k] = A;
+        t->b[k] = B;
+        t->c[k] = -(A * X[k] + B * Y[k]) - (owned ? 0 : 1);
+    }
+
+    // Color planes, from the snapped positions
+    float fx[3], fy[3];
+    for (int i = 0; i < 3; i++) {
+        fx[i] = (float)X[i] / (float)GL_SUBPIXEL;
+        fy[i] = (float)Y[i] / (float)GL_SUBPIXEL;
+    }
+    float farea = (float)area / (float)(GL_SUBPIXEL * GL_SUBPIXEL);
+    float ref_x = (float)t->minx + 0.5f - fx[0];
+    float ref_y = (float)t->miny + 0.5f - fy[0];
+    for (int k = 0; k < 4; k++) {
+        float c[3];
+        for (int i = 0; i < 3; i++) {
+            float ch = k == 0 ? v[i]->b : k == 1 ? v[i]->g : k == 2 ? v[i]->r : v[i]->a;
+            c[i] = clamp01(ch) * (255.0f * 65536.0f);
+        }
+        t->col[k] = tri_plane(c, fx, fy, farea, ref_x, ref_y, &t->dcdx[k], &t->dcdy[k]);
+    }
+
+    t->tex = raster.tex;
+    if (t->tex) {
+        float size[2] = { (float)t->tex->level[0].width, (float)t->tex->level[0].height };
+        for (int k = 0; k < 2; k++) {
+            float c[3];
+            for (int i = 0; i < 3; i++)
+                c[i] = (k == 0 ? v[i]->s : v[i]->t) * size[k] * 65536.0f;
+            t->uv[k] = tri_plane(c, fx, fy, farea, ref_x, ref_y, &t->duvdx[k], &t->duvdy[k]);
+        }
+        tri_texture_lod(t);
+    }
+
+    raster.ntris++;
+}
+
+// Could triangle t cover any pixel of the tile starting at (x0, y0)?
+static int tri_touches_tile(const gl_tri_t* t, int x0, int y0) {
+    int64_t px0 = ((int64_t)x0 << GL_SUBPIXEL_SHIFT) + GL_SUBPIXEL / 2;
+    int64_t py0 = ((int64_t)y0 << GL_SUBPIXEL_SHIFT) + GL_SUBPIXEL / 2;
+    int64_t span = (int64_t)(GL_TILE_SIZE - 1) << GL_SUBPIXEL_SHIFT;
+    for (int k = 0; k < 3; k++) {
+        // Edge value at the tile corner where it is largest
+        int64_t px = t->a[k] > 0 ? px0 + span : px0;
+        int64_t py = t->b[k] > 0 ? py0 + span : py0;
+        if (t->a[k] * px + t->b[k] * py + t->c[k] < 0) return 0;
+    }
+    return 1;
+}
+
+// Sort the batch's triangles into per-tile lists (counting sort). Returns
+// 0 if out of memory.
+static int raster_bin(void) {
+    raster.tx0 = raster.cx0 >> GL_TILE_SHIFT;
+    raster.ty0 = raster.cy0 >> GL_TILE_SHIFT;
+    raster.tiles_x = ((raster.cx1 - 1) >> GL_TILE_SHIFT) - raster.tx0 + 1;
+    raster.tiles_y = ((raster.cy1 - 1) >> GL_TILE_SHIFT) - raster.ty0 + 1;
+    int tiles = raster.tiles_x * raster.tiles_y;
+
+    if (tiles > raster.tile_cap) {
+        if (raster.bin_start) kfree(raster.bin_start);
+        if (raster.busy) kfree(raster.busy);
+        raster.bin_start = (uint32_t*)kmalloc(sizeof(uint32_t) * (tiles + 1));
+        raster.busy = (uint16_t*)kmalloc(sizeof(uint16_t) * tiles);
+        raster.tile_cap = (raster.bin_start && raster.busy) ? tiles : 0;
+        if (!raster.tile_cap) return 0;
+    }
+    uint32_t* start = raster.bin_start;
+    memset(start, 0, sizeof(uint32_t) * (tiles + 1));
+
+    // Pass 1: count, with each tile's entries ending at start[tile + 1]
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < raster.ntris; i++) {
+            gl_tri_t* t = &raster.tris[i];
+            int bx0 = (t->minx >> GL_TILE_SHIFT) - raster.tx0;
+            int bx1 = (t->maxx >> GL_TILE_SHIFT) - raster.tx0;
+            int by0 = (t->miny >> GL_TILE_SHIFT) - raster.ty0;
+            int by1 = (t->maxy >> GL_TILE_SHIFT) - raster.ty0;
+            for (int ty = by0; ty <= by1; ty++) {
+                for (int tx = bx0; tx <= bx1; tx++) {
+                    int x0 = (raster.tx0 + tx) << GL_TILE_SHIFT;
+                    int y0 = (raster.ty0 + ty) << GL_TILE_SHIFT;
+                    if (bx0 != bx1 && by0 != by1 && !tri_touches_tile(t, x0, y0)) continue;
+                    int tile = ty * raster.tiles_x + tx;
+                    if (pass == 0) start[tile + 1]++;
+                    else raster.bin_tri[start[tile]++] = (uint16_t)i;
+                }
+            }
+        }
+        if (pass == 0) {
+            // Prefix sums: start[tile] is where its list begins
+            for (int k = 0; k < tiles; k++) start[k + 1] += start[k];
+            if (start[tiles] > raster.bin_cap) {
+                if (raster.bin_tri) kfree(raster.bin_tri);
+                raster.bin_tri = (uint16_t*)kmalloc(sizeof(uint16_t) * start[tiles]);
+                raster.bin_cap = raster.bin_tri ? start[tiles] : 0;
+                if (!raster.bin_tri) return 0;
             }
         }
     }
+    // Pass 2 advanced each start[tile] to its end, which is where the next
+    // tile begins: shift back by one
+    for (int k = tiles; k > 0; k--) start[k] = start[k - 1];
+    start[0] = 0;
+
+    raster.nbusy = 0;
+    for (int k = 0; k < tiles; k++)
+        if (start[k + 1] > start[k]) raster.busy[raster.nbusy++] = (uint16_t)k;
+    return 1;
 }
 
-// Rasterize a line
-static void rasterize_line(gl_vertex_t* v0, gl_vertex_t* v1) {
-    float x0c, y0c, z0c, w0c;
-    float x1c, y1c, z1c, w1c;
+// ---- Spans ----
+
+static inline v4i chan8(v4i c) {       // 16.16 -> 0..255
+    c >>= 16;
+    c &= ~(c < 0);
+    v4i over = c > 255;
+    return (c & ~over) | (255 & over);
+}
+
+static inline v4i div255_v(v4i x) {
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+// blend_pixel() on four pixels
+static inline v4i blend4(v4i d, v4i s) {
+    v4i sa = (s >> 24) & 0xFF, inv = 255 - sa;
+    v4i r = div255_v(((s >> 16) & 0xFF) * sa + ((d >> 16) & 0xFF) * inv);
+    v4i g = div255_v(((s >> 8) & 0xFF) * sa + ((d >> 8) & 0xFF) * inv);
+    v4i b = div255_v((s & 0xFF) * sa + (d & 0xFF) * inv);
+    v4i a = sa + div255_v(((d >> 24) & 0xFF) * inv);
+    return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+static void draw_span(uint32_t* row, int x0, int x1, int y, const gl_tri_t* t, int blend) {
+    int32_t c[4];
+    for (int k = 0; k < 4; k++)
+        c[k] = (int32_t)(t->col[k] + (int64_t)t->dcdx[k] * (x0 - t->minx) +
+                         (int64_t)t->dcdy[k] * (y - t->miny));
+
+    int x = x0;
+    if (x1 - x0 >= 4) {
+        v4i step = { 0, 1, 2, 3 };
+        v4i cb = c[0] + t->dcdx[0] * step, cg = c[1] + t->dcdx[1] * step;
+        v4i cr = c[2] + t->dcdx[2] * step, ca = c[3] + t->dcdx[3] * step;
+        int32_t db = t->dcdx[0] * 4, dg = t->dcdx[1] * 4;
+        int32_t dr = t->dcdx[2] * 4, da = t->dcdx[3] * 4;
+        for (; x + 4 <= x1; x += 4) {
+            v4i s = (chan8(ca) << 24) | (chan8(cr) << 16) | (chan8(cg) << 8) | chan8(cb);
+            v4i_u* p = (v4i_u*)&row[x];
+            *p = blend ? blend4(*p, s) : s;
+            cb += db; cg += dg; cr += dr; ca += da;
+        }
+        int n = x - x0;
+        for (int k = 0; k < 4; k++) c[k] += t->dcdx[k] * n;
+    }
+    for (; x < x1; x++) {
+        uint32_t ch[4];
+        for (int k = 0; k < 4; k++) {
+            int32_t v = c[k] >> 16;
+            ch[k] = v < 0 ? 0 : (v > 255 ? 255 : (uint32_t)v);
+            c[k] += t->dcdx[k];
+        }
+        uint32_t s = (ch[3] << 24) | (ch[2] << 16) | (ch[1] << 8) | ch[0];
+        row[x] = blend ? blend_pixel(row[x], s) : s;
+    }
+}
 
-    transform_vertex(v0, &x0c, &y0c, &z0c, &w0c);
-    transform_vertex(v1, &x1c, &y1c, &z1c, &w1c);
+// Textured span: the texture modulated by the color, a pixel at a time
+static void draw_span_tex(uint32_t* row, int x0, int x1, int y, const gl_tri_t* t, int blend) {
+    int32_t c[4];
+    for (int k = 0; k < 4; k++)
+        c[k] = (int32_t)(t->col[k] + (int64_t)t->dcdx[k] * (x0 - t->minx) +
+                         (int64_t)t->dcdy[k] * (y - t->miny));
+    int64_t u = t->uv[0] + (int64_t)t->duvdx[0] * (x0 - t->minx) +
+                (int64_t)t->duvdy[0] * (y - t->miny);
+    int64_t v = t->uv[1] + (int64_t)t->duvdx[1] * (x0 - t->minx) +
+                (int64_t)t->duvdy[1] * (y - t->miny);
+
+    for (int x = x0; x < x1; x++) {
+        uint32_t tc = sample_level(t->tex, t->lvl0, u, v, t->linear);
+        if (t->mip_frac)
+            tc = lerp_argb(tc, sample_level(t->tex, t->lvl1, u, v, t->linear), t->mip_frac);
+        uint32_t s = 0;
+        for (int k = 0; k < 4; k++) {
+            int32_t cv = c[k] >> 16;
+            uint32_t ch = cv < 0 ? 0 : (cv > 255 ? 255 : (uint32_t)cv);
+            uint32_t m = ch * ((tc >> (8 * k)) & 0xFF);
+            s |= ((m + 1 + (m >> 8)) >> 8) << (8 * k);
+            c[k] += t->dcdx[k];
+        }
+        row[x] = blend ? blend_pixel(row[x], s) : s;
+        u += t->duvdx[0];
+        v += t->duvdx[1];
+    }
+}
 
-    if (gl_fabsf(w0c) < 0.0001f) w0c = 0.0001f;
-    if (gl_fabsf(w1c) < 0.0001f) w1c = 0.0001f;
+static void draw_tile(int tile) {
+    int x0 = (raster.tx0 + tile % raster.tiles_x) << GL_TILE_SHIFT;
+    int y0 = (raster.ty0 + tile / raster.tiles_x) << GL_TILE_SHIFT;
+    int x1 = x0 + GL_TILE_SIZE, y1 = y0 + GL_TILE_SIZE;
+    if (x0 < raster.cx0) x0 = raster.cx0;
+    if (y0 < raster.cy0) y0 = raster.cy0;
+    if (x1 > raster.cx1) x1 = raster.cx1;
+    if (y1 > raster.cy1) y1 = raster.cy1;
+    int blend = gl_ctx.blend;
+
+    for (uint32_t e = raster.bin_start[tile]; e < raster.bin_start[tile + 1]; e++) {
+        const gl_tri_t* t = &raster.tris[raster.bin_tri[e]];
+        int ya = y0 > t->miny ? y0 : t->miny;
+        int yb = y1 - 1 < t->maxy ? y1 - 1 : t->maxy;
+        int xa = x0 > t->minx ? x0 : t->minx;
+        int xb = x1 - 1 < t->maxx ? x1 - 1 : t->maxx;
+        if (ya > yb || xa > xb) continue;
+
+        // E at pixel (x, y) = 16*A*x + K, K stepping by 16*B per row
+        int64_t K[3];
+        int64_t py = ((int64_t)ya << GL_SUBPIXEL_SHIFT) + GL_SUBPIXEL / 2;
+        for (int k = 0; k < 3; k++)
+            K[k] = t->a[k] * (GL_SUBPIXEL / 2) + t->b[k] * py + t->c[k];
+
+        for (int y = ya; y <= yb; y++) {
+            int64_t l = xa, r = xb;
+            for (int k = 0; k < 3; k++) {
+                int64_t a16 = t->a[k] << GL_SUBPIXEL_SHIFT;
+                if (a16 > 0) {
+                    int64_t b = -floor_div(K[k], a16);        // ceil(-K / a16)
+                    if (b > l) l = b;
+                } else if (a16 < 0) {
+                    int64_t b = floor_div(K[k], -a16);
+                    if (b < r) r = b;
+                } else if (K[k] < 0) {
+                    l = r + 1;
+                }
+                K[k] += t->b[k] << GL_SUBPIXEL_SHIFT;
+            }
+            if (l > r) continue;
+            if (t->tex) draw_span_tex(&backbuf[y * screen_width], (int)l, (int)r + 1, y, t, blend);
+            else draw_span(&backbuf[y * screen_width], (int)l, (int)r + 1, y, t, blend);
+        }
+    }
+}
 
-    float vp_w = (float)gl_ctx.vp_w;
-    float vp_h = (float)gl_ctx.vp_h;
-    float vp_x = (float)gl_ctx.vp_x;
-    float vp_y = (float)gl_ctx.vp_y;
+static void raster_tiles(void) {
+    for (int i = 0; i < raster.nbusy; i++) draw_tile(raster.busy[i]);
+}
+
+static void raster_end(void) {
+    if (raster.ntris == 0) return;
+    if (!raster_bin()) return;
 
-    int sx0 = (int)(vp_x + (x0c/w0c + 1.0f) * 0.5f * vp_w);
-    int sy0 = (int)(vp_y + (1.0f - y0c/w0c) * 0.5f * vp_h);
-    int sx1 = (int)(vp_x + (x1c/w1c + 1.0f) * 0.5f * vp_w);
-    int sy1 = (int)(vp_y + (1.0f - y1c/w1c) * 0.5f * vp_h);
+    raster_tiles();
+}
+
+// Rasterize a line
+static void rasterize_line(const gl_xvertex_t* v0, const gl_xvertex_t* v1) {
+    int sx0 = (int)v0->sx, sy0 = (int)v0->sy;
+    int sx1 = (int)v1->sx, sy1 = (int)v1->sy;
 
     // Bresenham line
     int dx = sx1 - sx0; if (dx < 0) dx = -dx;
@@ -369,84 +901,279 @@ static void rasterize_line(gl_vertex_t* v0, gl_vertex_t* v1) {
 }
 
 // Rasterize a point
-static void rasterize_point(gl_vertex_t* v) {
-    float xc, yc, zc, wc;
-    transform_vertex(v, &xc, &yc, &zc, &wc);
-    if (gl_fabsf(wc) < 0.0001f) wc = 0.0001f;
-
-    int sx = (int)((float)gl_ctx.vp_x + (xc/wc + 1.0f) * 0.5f * (float)gl_ctx.vp_w);
-    int sy = (int)((float)gl_ctx.vp_y + (1.0f - yc/wc) * 0.5f * (float)gl_ctx.vp_h);
-
-    gl_put_pixel(sx, sy, pack_color(v->r, v->g, v->b, v->a));
+static void rasterize_point(const gl_xvertex_t* v) {
+    gl_put_pixel((int)v->sx, (int)v->sy, pack_color(v->r, v->g, v->b, v->a));
 }
 
-// Flush the accumulated primitive batch
-static void flush_primitives(void) {
-    int n = gl_ctx.vertex_count;
-    gl_vertex_t* verts = gl_ctx.vertices;
-
-    switch (gl_ctx.prim_mode) {
+// Assemble 'n' transformed vertices into primitives of type 'mode' and
+// draw them. With 'idx', the i-th vertex is xv[idx[i]].
+static void draw_primitives(GLenum mode, const gl_xvertex_t* xv, const uint32_t* idx, int n) {
+#define V(i) (&xv[idx ? idx[i] : (uint32_t)(i)])
+    raster_begin();
+    switch (mode) {
     case GL_POINTS:
         for (int i = 0; i < n; i++) {
-            rasterize_point(&verts[i]);
+            rasterize_point(V(i));
         }
         break;
 
     case GL_LINES:
         for (int i = 0; i + 1 < n; i += 2) {
-            rasterize_line(&verts[i], &verts[i+1]);
+            rasterize_line(V(i), V(i+1));
         }
         break;
 
     case GL_LINE_STRIP:
         for (int i = 0; i + 1 < n; i++) {
-            rasterize_line(&verts[i], &verts[i+1]);
+            rasterize_line(V(i), V(i+1));
         }
         break;
 
     case GL_TRIANGLES:
         for (int i = 0; i + 2 < n; i += 3) {
-            rasterize_triangle(&verts[i], &verts[i+1], &verts[i+2]);
+            rasterize_triangle(V(i), V(i+1), V(i+2));
         }
         break;
 
     case GL_TRIANGLE_STRIP:
         for (int i = 0; i + 2 < n; i++) {
             if (i & 1) {
-                rasterize_triangle(&verts[i+1], &verts[i], &verts[i+2]);
+                rasterize_triangle(V(i+1), V(i), V(i+2));
             } else {
-                rasterize_triangle(&verts[i], &verts[i+1], &verts[i+2]);
+                rasterize_triangle(V(i), V(i+1), V(i+2));
             }
         }
         break;
 
     case GL_TRIANGLE_FAN:
         for (int i = 1; i + 1 < n; i++) {
-            rasterize_triangle(&verts[0], &verts[i], &verts[i+1]);
+            rasterize_triangle(V(0), V(i), V(i+1));
         }
         break;
 
     case GL_QUADS:
         for (int i = 0; i + 3 < n; i += 4) {
-            rasterize_triangle(&verts[i], &verts[i+1], &verts[i+2]);
-            rasterize_triangle(&verts[i], &verts[i+2], &verts[i+3]);
+            rasterize_triangle(V(i), V(i+1), V(i+2));
+            rasterize_triangle(V(i), V(i+2), V(i+3));
         }
         break;
 
     case GL_QUAD_STRIP:
         for (int i = 0; i + 3 < n; i += 2) {
-            rasterize_triangle(&verts[i], &verts[i+1], &verts[i+3]);
-            rasterize_triangle(&verts[i], &verts[i+3], &verts[i+2]);
+            rasterize_triangle(V(i), V(i+1), V(i+3));
+            rasterize_triangle(V(i), V(i+3), V(i+2));
         }
         break;
 
     case GL_POLYGON:
         // Triangulate as fan from vertex 0
         for (int i = 1; i + 1 < n; i++) {
-            rasterize_triangle(&verts[0], &verts[i], &verts[i+1]);
+            rasterize_triangle(V(0), V(i), V(i+1));
         }
         break;
     }
+    raster_end();
+#undef V
+}
+
+// ============================================================
+// Scratch Space
+// ============================================================
+
+// Grow a kmalloc'd array to hold at least 'need' elements, keeping the
+// first 'keep'. Returns 0, or -1 if out of memory (the array is intact).
+static int grow_array(void** buf, int* cap, int need, int keep, uint64_t elem) {
+    if (need <= *cap) return 0;
+    int n = *cap ? *cap : 64;
+    while (n < need) n *= 2;
+    void* nb = kmalloc((uint64_t)n * elem);
+    if (!nb) return -1;
+    if (*buf) {
+        memcpy(nb, *buf, (uint64_t)keep * elem);
+        kfree(*buf);
+    }
+    *buf = nb;
+    *cap = n;
+    return 0;
+}
+
+// Transformed vertices and indices for draws that are not cached
+static gl_xvertex_t* xv_scratch;
+static int           xv_scratch_cap;
+static uint32_t*     idx_scratch;
+static int           idx_scratch_cap;
+
+static gl_xvertex_t* scratch_xv(int n) {
+    if (grow_array((void**)&xv_scratch, &xv_scratch_cap, n, 0, sizeof(gl_xvertex_t)) < 0) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        return 0;
+    }
+    return xv_scratch;
+}
+
+// Draw the glBegin/glEnd batch
+static void flush_primitives(void) {
+    int n = gl_ctx.vertex_count;
+    if (n == 0) return;
+    gl_xvertex_t* xv = scratch_xv(n);
+    if (!xv) return;
+    xform_vertices(gl_ctx.vertices, xv, n);
+    draw_primitives(gl_ctx.prim_mode, xv, 0, n);
+}
+
+// ============================================================
+// Texture Storage
+// ============================================================
+
+static void tex_level_free(gl_tex_level_t* l) {
+    if (l->data) kfree(l->data);
+    memset(l, 0, sizeof(*l));
+}
+
+static void texture_free(gl_texture_t* tex) {
+    for (int i = 0; i < GL_MAX_TEXTURE_LEVELS; i++) tex_level_free(&tex->level[i]);
+    memset(tex, 0, sizeof(*tex));
+}
+
+// Zeroed storage for a w x h level, in whole blocks. Returns 0 if out of
+// memory, leaving the old contents.
+static int tex_level_alloc(gl_tex_level_t* l, int w, int h) {
+    int bx = (w + 3) >> 2, by = (h + 3) >> 2;
+    uint64_t bytes = (uint64_t)bx * by * 16 * sizeof(uint32_t);
+    uint32_t* data = (uint32_t*)kmalloc(bytes);
+    if (!data) return 0;
+    memset(data, 0, bytes);
+    tex_level_free(l);
+    l->width = w;
+    l->height = h;
+    l->blocks_x = bx;
+    l->data = data;
+    return 1;
+}
+
+// Level 'lvl' from the one above it, each texel the average of 2x2 (the
+// last row or column repeats where the size is odd)
+static int texture_build_level(gl_texture_t* tex, int lvl) {
+    const gl_tex_level_t* src = &tex->level[lvl - 1];
+    gl_tex_level_t* dst = &tex->level[lvl];
+    int w = src->width > 1 ? src->width >> 1 : 1;
+    int h = src->height > 1 ? src->height >> 1 : 1;
+    if (!tex_level_alloc(dst, w, h)) return 0;
+
+    for (int y = 0; y < h; y++) {
+        int y0 = y * 2, y1 = y0 + 1 < src->height ? y0 + 1 : y0;
+        for (int x = 0; x < w; x++) {
+            int x0 = x * 2, x1 = x0 + 1 < src->width ? x0 + 1 : x0;
+            uint32_t p0 = *texel_addr(src, x0, y0), p1 = *texel_addr(src, x1, y0);
+            uint32_t p2 = *texel_addr(src, x0, y1), p3 = *texel_addr(src, x1, y1);
+            uint32_t out = 0;
+            for (int k = 0; k < 32; k += 8) {
+                uint32_t sum = ((p0 >> k) & 0xFF) + ((p1 >> k) & 0xFF) +
+                               ((p2 >> k) & 0xFF) + ((p3 >> k) & 0xFF);
+                out |= ((sum + 2) >> 2) << k;
+            }
+            *texel_addr(dst, x, y) = out;
+        }
+    }
+    return 1;
+}
+
+// Rebuild every level below 0 down to 1x1
+static void texture_build_mipmaps(gl_texture_t* tex) {
+    int lvl = 1;
+    for (; lvl < GL_MAX_TEXTURE_LEVELS; lvl++) {
+        const gl_tex_level_t* above = &tex->level[lvl - 1];
+        if (above->width == 1 && above->height == 1) break;
+        if (!texture_build_level(tex, lvl)) {
+            gl_ctx.error = GL_OUT_OF_MEMORY;
+            break;
+        }
+    }
+    for (; lvl < GL_MAX_TEXTURE_LEVELS; lvl++) tex_level_free(&tex->level[lvl]);
+}
+
+// How many levels from 0 down have the sizes level 0 implies; sampling
+// stays within them
+static void texture_count_levels(gl_texture_t* tex) {
+    int w = tex->level[0].width, h = tex->level[0].height;
+    int n = 0;
+    while (n < GL_MAX_TEXTURE_LEVELS && tex->level[n].data &&
+           tex->level[n].width == w && tex->level[n].height == h) {
+        n++;
+        if (w == 1 && h == 1) break;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+    }
+    tex->nlevels = n;
+}
+
+// ============================================================
+// Vertex Caches, Buffers and Lists (storage)
+// ============================================================
+
+static void vcache_free(gl_vcache_t* c) {
+    if (c->xv) kfree(c->xv);
+    c->xv = 0;
+    c->cap = 0;
+    c->valid = 0;
+}
+
+// Key for vertices transformed with the current matrices and viewport
+// from the sources described by 'src'
+static void vcache_key(gl_vkey_t* k, const uint64_t* src) {
+    memset(k, 0, sizeof(*k));
+    mat4_copy(k->mv, gl_ctx.modelview.mat[gl_ctx.modelview.top]);
+    mat4_copy(k->pr, gl_ctx.projection.mat[gl_ctx.projection.top]);
+    k->vp[0] = gl_ctx.vp_x; k->vp[1] = gl_ctx.vp_y;
+    k->vp[2] = gl_ctx.vp_w; k->vp[3] = gl_ctx.vp_h;
+    if (src) memcpy(k->src, src, sizeof(k->src));
+}
+
+// 1 if 'c' already holds the vertices for 'key'. Otherwise makes room for
+// 'n' of them, takes the key and returns 0 for the caller to fill them
+// in; -1 if out of memory.
+static int vcache_lookup(gl_vcache_t* c, const gl_vkey_t* key, int n) {
+    if (c->valid && memcmp(&c->key, key, sizeof(*key)) == 0) return 1;
+    c->valid = 0;
+    if (grow_array((void**)&c->xv, &c->cap, n, 0, sizeof(gl_xvertex_t)) < 0) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        return -1;
+    }
+    memcpy(&c->key, key, sizeof(*key));
+    c->valid = 1;
+    return 0;
+}
+
+static gl_buffer_t* find_buffer(uint32_t id) {
+    if (id == 0) return 0;
+    for (int i = 0; i < GL_MAX_BUFFERS; i++)
+        if (gl_ctx.buffers[i].id == id) return &gl_ctx.buffers[i];
+    return 0;
+}
+
+static void buffer_free(gl_buffer_t* b) {
+    if (b->data) kfree(b->data);
+    vcache_free(&b->cache);
+    memset(b, 0, sizeof(*b));
+}
+
+static gl_list_t* find_list(uint32_t id) {
+    if (id == 0) return 0;
+    for (int i = 0; i < GL_MAX_LISTS; i++)
+        if (gl_ctx.lists[i].id == id) return &gl_ctx.lists[i];
+    return 0;
+}
+
+static void list_free(gl_list_t* l) {
+    for (int i = 0; i < l->nops; i++) {
+        if (l->ops[i].cache) {
+            vcache_free(l->ops[i].cache);
+            kfree(l->ops[i].cache);
+        }
+    }
+    if (l->ops) kfree(l->ops);
+    if (l->verts) kfree(l->verts);
+    memset(l, 0, sizeof(*l));
 }
 
 // ============================================================
@@ -489,6 +1216,8 @@ int gl_init(void) {
     gl_ctx.sc_h = screen_height;
 
     gl_ctx.next_texture_id = 1;
+    gl_ctx.next_buffer_id = 1;
+    gl_ctx.next_list_id = 1;
 
     // Check for GPU
     gl_ctx.use_gpu = gpu_state.initialized;
@@ -498,13 +1227,20 @@ int gl_init(void) {
 }
 
 void gl_shutdown(void) {
-    // Free texture data
-    for (int i = 0; i < GL_MAX_TEXTURES; i++) {
-        if (gl_ctx.textures[i].data) {
-            kfree(gl_ctx.textures[i].data);
-            gl_ctx.textures[i].data = 0;
-        }
-    }
+    for (int i = 0; i < GL_MAX_TEXTURES; i++) texture_free(&gl_ctx.textures[i]);
+    if (raster.tris) kfree(raster.tris);
+    if (raster.bin_start) kfree(raster.bin_start);
+    if (raster.bin_tri) kfree(raster.bin_tri);
+    if (raster.busy) kfree(raster.busy);
+    memset(&raster, 0, sizeof(raster));
+
+    for (int i = 0; i < GL_MAX_BUFFERS; i++) buffer_free(&gl_ctx.buffers[i]);
+    for (int i = 0; i < GL_MAX_LISTS; i++) list_free(&gl_ctx.lists[i]);
+    list_free(&gl_ctx.compiling);
+    if (xv_scratch) kfree(xv_scratch);
+    if (idx_scratch) kfree(idx_scratch);
+    xv_scratch = 0; xv_scratch_cap = 0;
+    idx_scratch = 0; idx_scratch_cap = 0;
     gl_ctx.initialized = 0;
 }
 
@@ -594,11 +1330,70 @@ GLenum glGetError(void) {
     return e;
 }
 
+// ============================================================
+// Display List Recording
+// ============================================================
+
+static int list_compiling(void) {
+    return gl_ctx.compiling.id && gl_ctx.list_depth == 0;
+}
+
+static gl_list_op_t* list_append(int op, GLenum mode, uint32_t first, const float* m, int nm) {
+    gl_list_t* l = &gl_ctx.compiling;
+    if (grow_array((void**)&l->ops, &l->ops_cap, l->nops + 1, l->nops,
+                   sizeof(gl_list_op_t)) < 0) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        return 0;
+    }
+    gl_list_op_t* o = &l->ops[l->nops++];
+    memset(o, 0, sizeof(*o));
+    o->op = op;
+    o->mode = mode;
+    o->first = first;
+    for (int i = 0; i < nm; i++) o->m[i] = m[i];
+    return o;
+}
+
+// While a list is being recorded, append a command to it (commands run
+// by glCallList are not recorded again). Returns 1 if the caller must
+// not also execute it (GL_COMPILE).
+static int list_record(int op, GLenum mode, uint32_t first, const float* m, int nm) {
+    if (!list_compiling()) return 0;
+    list_append(op, mode, first, m, nm);
+    return gl_ctx.list_mode == GL_COMPILE;
+}
+
+// Record a draw of 'n' object-space vertices; returns where to store
+// them, or 0 if out of memory
+static gl_vertex_t* list_record_draw(GLenum mode, int n) {
+    gl_list_t* l = &gl_ctx.compiling;
+    if (grow_array((void**)&l->verts, &l->verts_cap, l->nverts + n, l->nverts,
+                   sizeof(gl_vertex_t)) < 0) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        return 0;
+    }
+    gl_list_op_t* o = list_append(GL_LIST_DRAW, mode, (uint32_t)l->nverts, 0, 0);
+    if (!o) return 0;
+    o->count = (uint32_t)n;
+    l->nverts += n;
+    return &l->verts[o->first];
+}
+
 // ============================================================
 // Matrix Functions
 // ============================================================
 
+// Multiply the current matrix by m (recorded into a list being built)
+static void mult_current(const float* m) {
+    if (list_record(GL_LIST_MULT, 0, 0, m, 16)) return;
+    float* cur = current_matrix();
+    float tmp[16];
+    mat4_multiply(tmp, cur, m);
+    mat4_copy(cur, tmp);
+}
+
 void glMatrixMode(GLenum mode) {
+    if (list_record(GL_LIST_MATRIX_MODE, mode, 0, 0, 0)) return;
     gl_ctx.matrix_mode = mode;
     switch (mode) {
     case GL_MODELVIEW:  gl_ctx.current_stack = &gl_ctx.modelview; break;
@@ -611,10 +1406,12 @@ void glMatrixMode(GLenum mode) {
 }
 
 void glLoadIdentity(void) {
+    if (list_record(GL_LIST_LOAD_IDENTITY, 0, 0, 0, 0)) return;
     mat4_identity(current_matrix());
 }
 
 void glPushMatrix(void) {
+    if (list_record(GL_LIST_PUSH, 0, 0, 0, 0)) return;
     gl_matrix_stack_t* s = gl_ctx.current_stack;
     if (s->top >= GL_MAX_MATRIX_STACK_DEPTH - 1) {
         gl_ctx.error = GL_INVALID_OPERATION;
@@ -625,6 +1422,7 @@ void glPushMatrix(void) {
 }
 
 void glPopMatrix(void) {
+    if (list_record(GL_LIST_POP, 0, 0, 0, 0)) return;
     gl_matrix_stack_t* s = gl_ctx.current_stack;
     if (s->top <= 0) {
         gl_ctx.error = GL_INVALID_OPERATION;
@@ -648,10 +1446,7 @@ void glOrtho(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top,
     m[13] = -(t + b) / (t - b);
     m[14] = -(f + n) / (f - n);
 
-    float* cur = current_matrix();
-    float tmp[16];
-    mat4_multiply(tmp, cur, m);
-    mat4_copy(cur, tmp);
+    mult_current(m);
 }
 
 void glFrustum(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top,
@@ -670,10 +1465,7 @@ void glFrustum(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top,
     m[11] = -1.0f;
     m[14] = -(2.0f * f * n) / (f - n);
 
-    float* cur = current_matrix();
-    float tmp[16];
-    mat4_multiply(tmp, cur, m);
-    mat4_copy(cur, tmp);
+    mult_current(m);
 }
 
 void glTranslatef(GLfloat x, GLfloat y, GLfloat z) {
@@ -683,10 +1475,7 @@ void glTranslatef(GLfloat x, GLfloat y, GLfloat z) {
     m[13] = y;
     m[14] = z;
 
-    float* cur = current_matrix();
-    float tmp[16];
-    mat4_multiply(tmp, cur, m);
-    mat4_copy(cur, tmp);
+    mult_current(m);
 }
 
 void glRotatef(GLfloat angle, GLfloat x, GLfloat y, GLfloat z) {
@@ -707,10 +1496,7 @@ void glRotatef(GLfloat angle, GLfloat x, GLfloat y, GLfloat z) {
     m[2]  = z*x*nc - y*s;  m[6] = z*y*nc + x*s;    m[10] = z*z*nc + c;    m[14] = 0;
     m[3]  = 0;             m[7] = 0;               m[11] = 0;             m[15] = 1;
 
-    float* cur = current_matrix();
-    float tmp[16];
-    mat4_multiply(tmp, cur, m);
-    mat4_copy(cur, tmp);
+    mult_current(m);
 }
 
 void glScalef(GLfloat x, GLfloat y, GLfloat z) {
@@ -720,17 +1506,11 @@ void glScalef(GLfloat x, GLfloat y, GLfloat z) {
     m[5]  = y;
     m[10] = z;
 
-    float* cur = current_matrix();
-    float tmp[16];
-    mat4_multiply(tmp, cur, m);
-    mat4_copy(cur, tmp);
+    mult_current(m);
 }
 
 void glMultMatrixf(const GLfloat* m) {
-    float* cur = current_matrix();
-    float tmp[16];
-    mat4_multiply(tmp, cur, m);
-    mat4_copy(cur, tmp);
+    mult_current(m);
 }
 
 // ============================================================
@@ -753,6 +1533,14 @@ void glEnd(void) {
         return;
     }
     gl_ctx.in_begin = 0;
+    if (list_compiling()) {
+        gl_vertex_t* v = list_record_draw(gl_ctx.prim_mode, gl_ctx.vertex_count);
+        if (v) memcpy(v, gl_ctx.vertices, sizeof(gl_vertex_t) * gl_ctx.vertex_count);
+        if (gl_ctx.list_mode == GL_COMPILE) {
+            gl_ctx.vertex_count = 0;
+            return;
+        }
+    }
     flush_primitives();
     gl_ctx.vertex_count = 0;
 }
@@ -775,19 +1563,21 @@ void glVertex3f(GLfloat x, GLfloat y, GLfloat z) {
     emit_vertex(x, y, z);
 }
 
-void glColor3f(GLfloat r, GLfloat g, GLfloat b) {
-    gl_ctx.cur_r = r; gl_ctx.cur_g = g; gl_ctx.cur_b = b; gl_ctx.cur_a = 1.0f;
-}
-
 void glColor4f(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+    // Inside glBegin/glEnd the color goes with the vertices instead. It is
+    // applied even under GL_COMPILE, so that vertices recorded after it
+    // get it; glEndList puts the old color back.
+    float c[4] = { r, g, b, a };
+    if (!gl_ctx.in_begin) list_record(GL_LIST_COLOR, 0, 0, c, 4);
     gl_ctx.cur_r = r; gl_ctx.cur_g = g; gl_ctx.cur_b = b; gl_ctx.cur_a = a;
 }
 
+void glColor3f(GLfloat r, GLfloat g, GLfloat b) {
+    glColor4f(r, g, b, 1.0f);
+}
+
 void glColor3ub(GLubyte r, GLubyte g, GLubyte b) {
-    gl_ctx.cur_r = (float)r / 255.0f;
-    gl_ctx.cur_g = (float)g / 255.0f;
-    gl_ctx.cur_b = (float)b / 255.0f;
-    gl_ctx.cur_a = 1.0f;
+    glColor4f((float)r / 255.0f, (float)g / 255.0f, (float)b / 255.0f, 1.0f);
 }
 
 void glTexCoord2f(GLfloat s, GLfloat t) {
@@ -798,6 +1588,525 @@ void glNormal3f(GLfloat nx, GLfloat ny, GLfloat nz) {
     gl_ctx.cur_nx = nx; gl_ctx.cur_ny = ny; gl_ctx.cur_nz = nz;
 }
 
+// ============================================================
+// Vertex Arrays
+// ============================================================
+
+// Where an array draw reads its vertices from
+typedef struct {
+    const uint8_t* pos;
+    int      pos_stride, pos_size;
+    const uint8_t* col;         // 0: current color
+    int      col_stride, col_size;
+    GLenum   col_type;
+    int      count;             // Vertices the sources hold (-1: unbounded)
+    gl_buffer_t* buffer;        // Buffer object holding the positions
+    int      cacheable;         // Every source is a buffer object
+    uint64_t src[7];            // Cache key part describing the sources
+} gl_fetch_t;
+
+// Base address of an array and how many whole elements it holds
+static const uint8_t* array_source(const gl_array_t* a, int elem, int stride,
+                                   int* count, gl_buffer_t** buf) {
+    *buf = 0;
+    if (!a->buffer) {
+        *count = -1;
+        return (const uint8_t*)a->pointer;
+    }
+    gl_buffer_t* b = find_buffer(a->buffer);
+    uint64_t off = (uint64_t)(uintptr_t)a->pointer;
+    *buf = b;
+    if (!b || !b->data || off + (uint64_t)elem > b->size) {
+        *count = 0;
+        return 0;
+    }
+    *count = (int)((b->size - off - (uint64_t)elem) / (uint64_t)stride + 1);
+    return b->data + off;
+}
+
+static int fetch_setup(gl_fetch_t* f) {
+    memset(f, 0, sizeof(*f));
+    gl_array_t* va = &gl_ctx.vertex_array;
+    if (!va->enabled) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return -1;
+    }
+    int elem = va->size * 4;
+    f->pos_stride = va->stride ? va->stride : elem;
+    f->pos_size = va->size;
+    f->pos = array_source(va, elem, f->pos_stride, &f->count, &f->buffer);
+    if (!f->pos && f->count != 0) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return -1;
+    }
+    f->cacheable = f->buffer != 0;
+    f->src[0] = ((uint64_t)va->buffer << 32) | (f->buffer ? f->buffer->version : 0);
+    f->src[1] = (uint64_t)(uintptr_t)va->pointer;
+    f->src[2] = (uint64_t)va->size | ((uint64_t)f->pos_stride << 8);
+
+    gl_array_t* ca = &gl_ctx.color_array;
+    if (ca->enabled) {
+        elem = ca->size * (ca->type == GL_FLOAT ? 4 : 1);
+        f->col_stride = ca->stride ? ca->stride : elem;
+        f->col_size = ca->size;
+        f->col_type = ca->type;
+        int count;
+        gl_buffer_t* b;
+        f->col = array_source(ca, elem, f->col_stride, &count, &b);
+        if (!f->col && count != 0) {
+            gl_ctx.error = GL_INVALID_OPERATION;
+            return -1;
+        }
+        if (count >= 0 && (f->count < 0 || count < f->count)) f->count = count;
+        if (!b) f->cacheable = 0;
+        f->src[3] = ((uint64_t)ca->buffer << 32) | (b ? b->version : 0);
+        f->src[4] = (uint64_t)(uintptr_t)ca->pointer;
+        f->src[5] = (uint64_t)ca->size | ((uint64_t)f->col_stride << 8) |
+                    ((uint64_t)ca->type << 32);
+    } else {
+        // The current color is baked into the vertices
+        float c[4] = { gl_ctx.cur_r, gl_ctx.cur_g, gl_ctx.cur_b, gl_ctx.cur_a };
+        memcpy(&f->src[3], c, sizeof(c));
+        f->src[5] = 0;
+    }
+    // The current texture coordinate applies to every vertex
+    float st[2] = { gl_ctx.cur_s, gl_ctx.cur_t };
+    memcpy(&f->src[6], st, sizeof(st));
+    return 0;
+}
+
+static void fetch_vertex(const gl_fetch_t* f, uint32_t i, gl_vertex_t* v) {
+    memset(v, 0, sizeof(*v));
+    const float* p = (const float*)(f->pos + (uint64_t)i * f->pos_stride);
+    v->x = p[0];
+    v->y = p[1];
+    v->z = f->pos_size > 2 ? p[2] : 0.0f;
+    v->s = gl_ctx.cur_s;
+    v->t = gl_ctx.cur_t;
+
+    if (!f->col) {
+        v->r = gl_ctx.cur_r; v->g = gl_ctx.cur_g;
+        v->b = gl_ctx.cur_b; v->a = gl_ctx.cur_a;
+    } else if (f->col_type == GL_FLOAT) {
+        const float* c = (const float*)(f->col + (uint64_t)i * f->col_stride);
+        v->r = c[0]; v->g = c[1]; v->b = c[2];
+        v->a = f->col_size > 3 ? c[3] : 1.0f;
+    } else {
+        const uint8_t* c = f->col + (uint64_t)i * f->col_stride;
+        v->r = (float)c[0] / 255.0f;
+        v->g = (float)c[1] / 255.0f;
+        v->b = (float)c[2] / 255.0f;
+        v->a = f->col_size > 3 ? (float)c[3] / 255.0f : 1.0f;
+    }
+}
+
+static void fetch_xform(const gl_fetch_t* f, uint32_t first, int n, gl_xvertex_t* out) {
+    gl_xform_t xf;
+    xform_setup(&xf);
+    for (int i = 0; i < n; i++) {
+        gl_vertex_t v;
+        fetch_vertex(f, first + (uint32_t)i, &v);
+        xform_vertex(&xf, &v, &out[i]);
+    }
+}
+
+// All f->count vertices transformed, from the position buffer's cache
+// (filled if stale); 0 if the sources cannot be cached
+static const gl_xvertex_t* fetch_cached(gl_fetch_t* f) {
+    if (!f->cacheable || f->count <= 0) return 0;
+    gl_vkey_t key;
+    vcache_key(&key, f->src);
+    gl_vcache_t* c = &f->buffer->cache;
+    int r = vcache_lookup(c, &key, f->count);
+    if (r < 0) return 0;
+    if (r == 0) fetch_xform(f, 0, f->count, c->xv);
+    return c->xv;
+}
+
+void glEnableClientState(GLenum array) {
+    switch (array) {
+    case GL_VERTEX_ARRAY: gl_ctx.vertex_array.enabled = 1; break;
+    case GL_COLOR_ARRAY:  gl_ctx.color_array.enabled = 1; break;
+    default: gl_ctx.error = GL_INVALID_ENUM; break;
+    }
+}
+
+void glDisableClientState(GLenum array) {
+    switch (array) {
+    case GL_VERTEX_ARRAY: gl_ctx.vertex_array.enabled = 0; break;
+    case GL_COLOR_ARRAY:  gl_ctx.color_array.enabled = 0; break;
+    default: gl_ctx.error = GL_INVALID_ENUM; break;
+    }
+}
+
+static void set_array(gl_array_t* a, GLint size, GLenum type, GLsizei stride,
+                      const GLvoid* pointer) {
+    a->size = size;
+    a->type = type;
+    a->stride = stride;
+    a->pointer = pointer;
+    a->buffer = gl_ctx.array_buffer;
+}
+
+void glVertexPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* pointer) {
+    if (size < 2 || size > 4 || stride < 0) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+    if (type != GL_FLOAT) {
+        gl_ctx.error = GL_INVALID_ENUM;
+        return;
+    }
+    set_array(&gl_ctx.vertex_array, size, type, stride, pointer);
+}
+
+void glColorPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* pointer) {
+    if (size < 3 || size > 4 || stride < 0) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+    if (type != GL_FLOAT && type != GL_UNSIGNED_BYTE) {
+        gl_ctx.error = GL_INVALID_ENUM;
+        return;
+    }
+    set_array(&gl_ctx.color_array, size, type, stride, pointer);
+}
+
+void glDrawArrays(GLenum mode, GLint first, GLsizei count) {
+    if (gl_ctx.in_begin) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return;
+    }
+    if (first < 0 || count < 0) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+    gl_fetch_t f;
+    if (fetch_setup(&f) < 0) return;
+    if (f.count >= 0 && first + count > f.count)
+        count = first < f.count ? f.count - first : 0;
+    if (count == 0) return;
+
+    if (list_compiling()) {
+        gl_vertex_t* v = list_record_draw(mode, count);
+        if (v) {
+            for (int i = 0; i < count; i++) fetch_vertex(&f, (uint32_t)(first + i), &v[i]);
+        }
+        if (gl_ctx.list_mode == GL_COMPILE) return;
+    }
+
+    const gl_xvertex_t* xv = fetch_cached(&f);
+    if (xv) {
+        draw_primitives(mode, xv + first, 0, count);
+        return;
+    }
+    gl_xvertex_t* tmp = scratch_xv(count);
+    if (!tmp) return;
+    fetch_xform(&f, (uint32_t)first, count, tmp);
+    draw_primitives(mode, tmp, 0, count);
+}
+
+void glDrawElements(GLenum mode, GLsizei count, GLenum type, const GLvoid* indices) {
+    if (gl_ctx.in_begin) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return;
+    }
+    if (count < 0) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+    int isz = type == GL_UNSIGNED_BYTE ? 1 : type == GL_UNSIGNED_SHORT ? 2 :
+              type == GL_UNSIGNED_INT ? 4 : 0;
+    if (!isz) {
+        gl_ctx.error = GL_INVALID_ENUM;
+        return;
+    }
+    if (count == 0) return;
+
+    const uint8_t* ip = (const uint8_t*)indices;
+    if (gl_ctx.element_buffer) {
+        gl_buffer_t* b = find_buffer(gl_ctx.element_buffer);
+        uint64_t off = (uint64_t)(uintptr_t)indices;
+        if (!b || !b->data || off + (uint64_t)count * isz > b->size) {
+            gl_ctx.error = GL_INVALID_OPERATION;
+            return;
+        }
+        ip = b->data + off;
+    }
+    if (!ip) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+
+    gl_fetch_t f;
+    if (fetch_setup(&f) < 0) return;
+    if (grow_array((void**)&idx_scratch, &idx_scratch_cap, count, 0, sizeof(uint32_t)) < 0) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        return;
+    }
+    uint32_t* idx = idx_scratch;
+    uint32_t lo = 0xFFFFFFFF, hi = 0;
+    for (int i = 0; i < count; i++) {
+        uint32_t k = isz == 1 ? ip[i] : isz == 2 ? ((const uint16_t*)ip)[i]
+                                                 : ((const uint32_t*)ip)[i];
+        idx[i] = k;
+        if (k < lo) lo = k;
+        if (k > hi) hi = k;
+    }
+    if (f.count >= 0 && hi >= (uint32_t)f.count) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return;
+    }
+
+    if (list_compiling()) {
+        gl_vertex_t* v = list_record_draw(mode, count);
+        if (v) {
+            for (int i = 0; i < count; i++) fetch_vertex(&f, idx[i], &v[i]);
+        }
+        if (gl_ctx.list_mode == GL_COMPILE) return;
+    }
+
+    const gl_xvertex_t* xv = fetch_cached(&f);
+    if (xv) {
+        draw_primitives(mode, xv, idx, count);
+        return;
+    }
+
+    // Transform just the referenced range
+    if (hi - lo >= 0x7FFFFFFF) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        return;
+    }
+    int span = (int)(hi - lo + 1);
+    gl_xvertex_t* tmp = scratch_xv(span);
+    if (!tmp) return;
+    fetch_xform(&f, lo, span, tmp);
+    for (int i = 0; i < count; i++) idx[i] -= lo;
+    draw_primitives(mode, tmp, idx, count);
+}
+
+// ============================================================
+// Buffer Objects
+// ============================================================
+
+static uint32_t* buffer_binding(GLenum target) {
+    switch (target) {
+    case GL_ARRAY_BUFFER:         return &gl_ctx.array_buffer;
+    case GL_ELEMENT_ARRAY_BUFFER: return &gl_ctx.element_buffer;
+    default:
+        gl_ctx.error = GL_INVALID_ENUM;
+        return 0;
+    }
+}
+
+void glGenBuffers(GLsizei n, GLuint* buffers) {
+    for (int i = 0; i < n; i++) {
+        buffers[i] = gl_ctx.next_buffer_id++;
+    }
+}
+
+void glDeleteBuffers(GLsizei n, const GLuint* buffers) {
+    for (int i = 0; i < n; i++) {
+        gl_buffer_t* b = find_buffer(buffers[i]);
+        if (b) buffer_free(b);
+        if (gl_ctx.array_buffer == buffers[i]) gl_ctx.array_buffer = 0;
+        if (gl_ctx.element_buffer == buffers[i]) gl_ctx.element_buffer = 0;
+    }
+}
+
+void glBindBuffer(GLenum target, GLuint buffer) {
+    uint32_t* binding = buffer_binding(target);
+    if (binding) *binding = buffer;
+}
+
+void glBufferData(GLenum target, GLsizeiptr size, const GLvoid* data, GLenum usage) {
+    (void)usage;
+    uint32_t* binding = buffer_binding(target);
+    if (!binding) return;
+    if (*binding == 0) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return;
+    }
+    if (size < 0) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+    if (size > 0x7FFFFFFF) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        return;
+    }
+
+    gl_buffer_t* b = find_buffer(*binding);
+    if (!b) {
+        for (int i = 0; i < GL_MAX_BUFFERS && !b; i++)
+            if (gl_ctx.buffers[i].id == 0) b = &gl_ctx.buffers[i];
+        if (!b) {
+            gl_ctx.error = GL_OUT_OF_MEMORY;
+            return;
+        }
+        b->id = *binding;
+    }
+
+    uint8_t* nd = 0;
+    if (size > 0) {
+        nd = (uint8_t*)kmalloc((uint64_t)size);
+        if (!nd) {
+            gl_ctx.error = GL_OUT_OF_MEMORY;
+            return;
+        }
+        if (data) memcpy(nd, data, (uint64_t)size);
+        else memset(nd, 0, (uint64_t)size);
+    }
+    if (b->data) kfree(b->data);
+    b->data = nd;
+    b->size = (uint32_t)size;
+    b->version++;
+}
+
+void glBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const GLvoid* data) {
+    uint32_t* binding = buffer_binding(target);
+    if (!binding) return;
+    gl_buffer_t* b = find_buffer(*binding);
+    if (!b) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return;
+    }
+    if (offset < 0 || size < 0 || (uint64_t)offset + (uint64_t)size > b->size) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+    if (size == 0 || !data) return;
+    memcpy(b->data + offset, data, (uint64_t)size);
+    b->version++;
+}
+
+// ============================================================
+// Display Lists
+// ============================================================
+
+static void call_list(gl_list_t* l);
+
+// Draw a recorded batch, transforming it again only if the matrices or
+// viewport differ from last time
+static void list_draw(gl_list_t* l, gl_list_op_t* o) {
+    if (o->count == 0) return;
+    if (!o->cache) {
+        o->cache = (gl_vcache_t*)kmalloc(sizeof(gl_vcache_t));
+        if (!o->cache) {
+            gl_ctx.error = GL_OUT_OF_MEMORY;
+            return;
+        }
+        memset(o->cache, 0, sizeof(gl_vcache_t));
+    }
+    gl_vkey_t key;
+    vcache_key(&key, 0);
+    int r = vcache_lookup(o->cache, &key, (int)o->count);
+    if (r < 0) return;
+    if (r == 0) xform_vertices(&l->verts[o->first], o->cache->xv, (int)o->count);
+    draw_primitives(o->mode, o->cache->xv, 0, (int)o->count);
+}
+
+static void call_list(gl_list_t* l) {
+    if (gl_ctx.list_depth >= GL_MAX_LIST_NESTING) return;
+    gl_ctx.list_depth++;
+    for (int i = 0; i < l->nops; i++) {
+        gl_list_op_t* o = &l->ops[i];
+        switch (o->op) {
+        case GL_LIST_DRAW:          list_draw(l, o); break;
+        case GL_LIST_COLOR:         glColor4f(o->m[0], o->m[1], o->m[2], o->m[3]); break;
+        case GL_LIST_MULT:          mult_current(o->m); break;
+        case GL_LIST_LOAD_IDENTITY: glLoadIdentity(); break;
+        case GL_LIST_PUSH:          glPushMatrix(); break;
+        case GL_LIST_POP:           glPopMatrix(); break;
+        case GL_LIST_MATRIX_MODE:   glMatrixMode(o->mode); break;
+        case GL_LIST_CALL: {
+            gl_list_t* c = find_list(o->first);
+            if (c) call_list(c);
+            break;
+        }
+        }
+    }
+    gl_ctx.list_depth--;
+}
+
+GLuint glGenLists(GLsizei range) {
+    if (range < 0) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return 0;
+    }
+    if (range == 0) return 0;
+    GLuint first = gl_ctx.next_list_id;
+    gl_ctx.next_list_id += (uint32_t)range;
+    return first;
+}
+
+void glDeleteLists(GLuint list, GLsizei range) {
+    if (range < 0) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+    for (GLsizei i = 0; i < range; i++) {
+        gl_list_t* l = find_list(list + (GLuint)i);
+        if (l) list_free(l);
+    }
+}
+
+void glNewList(GLuint list, GLenum mode) {
+    if (list == 0) {
+        gl_ctx.error = GL_INVALID_VALUE;
+        return;
+    }
+    if (mode != GL_COMPILE && mode != GL_COMPILE_AND_EXECUTE) {
+        gl_ctx.error = GL_INVALID_ENUM;
+        return;
+    }
+    if (gl_ctx.compiling.id || gl_ctx.in_begin) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return;
+    }
+    memset(&gl_ctx.compiling, 0, sizeof(gl_list_t));
+    gl_ctx.compiling.id = list;
+    gl_ctx.list_mode = mode;
+    gl_ctx.list_color[0] = gl_ctx.cur_r;
+    gl_ctx.list_color[1] = gl_ctx.cur_g;
+    gl_ctx.list_color[2] = gl_ctx.cur_b;
+    gl_ctx.list_color[3] = gl_ctx.cur_a;
+}
+
+void glEndList(void) {
+    if (!gl_ctx.compiling.id || gl_ctx.in_begin) {
+        gl_ctx.error = GL_INVALID_OPERATION;
+        return;
+    }
+    if (gl_ctx.list_mode == GL_COMPILE) {
+        gl_ctx.cur_r = gl_ctx.list_color[0];
+        gl_ctx.cur_g = gl_ctx.list_color[1];
+        gl_ctx.cur_b = gl_ctx.list_color[2];
+        gl_ctx.cur_a = gl_ctx.list_color[3];
+    }
+
+    // The new contents replace the list's old ones
+    gl_list_t* slot = find_list(gl_ctx.compiling.id);
+    if (!slot) {
+        for (int i = 0; i < GL_MAX_LISTS && !slot; i++)
+            if (gl_ctx.lists[i].id == 0) slot = &gl_ctx.lists[i];
+    }
+    if (!slot) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        list_free(&gl_ctx.compiling);
+        return;
+    }
+    list_free(slot);
+    *slot = gl_ctx.compiling;
+    memset(&gl_ctx.compiling, 0, sizeof(gl_list_t));
+}
+
+void glCallList(GLuint list) {
+    if (list_record(GL_LIST_CALL, 0, list, 0, 0)) return;
+    gl_list_t* l = find_list(list);
+    if (l) call_list(l);
+}
+
 // ============================================================
 // Texture Functions
 // ============================================================
@@ -810,17 +2119,8 @@ void glGenTextures(GLsizei n, GLuint* textures) {
 
 void glDeleteTextures(GLsizei n, const GLuint* textures) {
     for (int i = 0; i < n; i++) {
-        for (int j = 0; j < GL_MAX_TEXTURES; j++) {
-            if (gl_ctx.textures[j].id == textures[i]) {
-                if (gl_ctx.textures[j].data) {
-                    kfree(gl_ctx.textures[j].data);
-                }
-                gl_ctx.textures[j].data = 0;
-                gl_ctx.textures[j].active = 0;
-                gl_ctx.textures[j].id = 0;
-                break;
-            }
-        }
+        gl_texture_t* tex = find_texture(textures[i]);
+        if (tex) texture_free(tex);
     }
 }
 
@@ -829,81 +2129,108 @@ void glBindTexture(GLenum target, GLuint texture) {
     gl_ctx.bound_texture = texture;
 }
 
-void glTexImage2D(GLenum target, GLint level, GLint internalformat,
-                  GLsizei width, GLsizei height, GLint border,
-                  GLenum format, GLenum type, const GLvoid* pixels) {
-    (void)target; (void)level; (void)internalformat; (void)border;
-    (void)format; (void)type;
-
-    if (gl_ctx.bound_texture == 0) return;
-
-    // Find or allocate slot
-    int slot = -1;
+// The bound texture object, created on first use
+static gl_texture_t* bound_texture_object(void) {
+    if (gl_ctx.bound_texture == 0) return 0;
+    gl_texture_t* tex = find_texture(gl_ctx.bound_texture);
+    if (tex) return tex;
     for (int i = 0; i < GL_MAX_TEXTURES; i++) {
-        if (gl_ctx.textures[i].id == gl_ctx.bound_texture) {
-            slot = i;
-            break;
+        if (!gl_ctx.textures[i].active) {
+            tex = &gl_ctx.textures[i];
+            memset(tex, 0, sizeof(*tex));
+            tex->id = gl_ctx.bound_texture;
+            tex->active = 1;
+            tex->min_filter = GL_NEAREST;
+            tex->mag_filter = GL_NEAREST;
+            tex->wrap_s = GL_REPEAT;
+            tex->wrap_t = GL_REPEAT;
+            tex->generate_mipmap = GL_TRUE;
+            return tex;
         }
     }
-    if (slot < 0) {
-        for (int i = 0; i < GL_MAX_TEXTURES; i++) {
-            if (!gl_ctx.textures[i].active) {
-                slot = i;
-                break;
-            }
-        }
+    gl_ctx.error = GL_OUT_OF_MEMORY;
+    return 0;
+}
+
+void glTexImage2D(GLenum target, GLint level, GLint internalformat,
+                  GLsizei width, GLsizei height, GLint border,
+                  GLenum format, GLenum type, const GLvoid* pixels) {
+    (void)internalformat;
+    if (target != GL_TEXTURE_2D ||
+        (format != GL_RGBA && format != GL_RGB) || type != GL_UNSIGNED_BYTE) {
+        gl_ctx.error = GL_INVALID_ENUM;
+        return;
     }
-    if (slot < 0) {
-        gl_ctx.error = GL_OUT_OF_MEMORY;
+    if (level < 0 || level >= GL_MAX_TEXTURE_LEVELS || border != 0 ||
+        width < 1 || height < 1 ||
+        width > GL_MAX_TEXTURE_SIZE || height > GL_MAX_TEXTURE_SIZE) {
+        gl_ctx.error = GL_INVALID_VALUE;
         return;
     }
 
-    // Free old data
-    if (gl_ctx.textures[slot].data) {
-        kfree(gl_ctx.textures[slot].data);
+    gl_texture_t* tex = bound_texture_object();
+    if (!tex) return;
+    gl_tex_level_t* l = &tex->level[level];
+    if (!tex_level_alloc(l, width, height)) {
+        gl_ctx.error = GL_OUT_OF_MEMORY;
+        return;
     }
 
-    gl_ctx.textures[slot].id = gl_ctx.bound_texture;
-    gl_ctx.textures[slot].width = width;
-    gl_ctx.textures[slot].height = height;
-    gl_ctx.textures[slot].active = 1;
-    gl_ctx.textures[slot].min_filter = GL_NEAREST;
-    gl_ctx.textures[slot].mag_filter = GL_NEAREST;
-    gl_ctx.textures[slot].wrap_s = GL_REPEAT;
-    gl_ctx.textures[slot].wrap_t = GL_REPEAT;
-
     if (pixels) {
-        int size = width * height * 4;
-        gl_ctx.textures[slot].data = (uint32_t*)kmalloc(size);
-        if (gl_ctx.textures[slot].data) {
-            const uint8_t* src = (const uint8_t*)pixels;
-            uint32_t* dst = gl_ctx.textures[slot].data;
-            for (int i = 0; i < width * height; i++) {
-                uint8_t r = src[i * 4 + 0];
-                uint8_t g = src[i * 4 + 1];
-                uint8_t b = src[i * 4 + 2];
-                uint8_t a = src[i * 4 + 3];
-                dst[i] = ((uint32_t)a << 24) | ((uint32_t)r << 16) |
-                         ((uint32_t)g << 8) | (uint32_t)b;
+        const uint8_t* src = (const uint8_t*)pixels;
+        int bpp = format == GL_RGBA ? 4 : 3;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++, src += bpp) {
+                uint32_t a = bpp == 4 ? src[3] : 0xFF;
+                *texel_addr(l, x, y) = (a << 24) | ((uint32_t)src[0] << 16) |
+                                       ((uint32_t)src[1] << 8) | (uint32_t)src[2];
             }
         }
-    } else {
-        gl_ctx.textures[slot].data = 0;
     }
+
+    if (level == 0 && tex->generate_mipmap) texture_build_mipmaps(tex);
+    texture_count_levels(tex);
 }
 
 void glTexParameteri(GLenum target, GLenum pname, GLint param) {
-    (void)target;
-    for (int i = 0; i < GL_MAX_TEXTURES; i++) {
-        if (gl_ctx.textures[i].id == gl_ctx.bound_texture) {
-            switch (pname) {
-            case GL_TEXTURE_MIN_FILTER: gl_ctx.textures[i].min_filter = param; break;
-            case GL_TEXTURE_MAG_FILTER: gl_ctx.textures[i].mag_filter = param; break;
-            case GL_TEXTURE_WRAP_S:     gl_ctx.textures[i].wrap_s = param; break;
-            case GL_TEXTURE_WRAP_T:     gl_ctx.textures[i].wrap_t = param; break;
-            }
-            break;
-        }
+    if (target != GL_TEXTURE_2D) {
+        gl_ctx.error = GL_INVALID_ENUM;
+        return;
+    }
+    int ok;
+    switch (pname) {
+    case GL_TEXTURE_MIN_FILTER:
+        ok = param == GL_NEAREST || param == GL_LINEAR ||
+             param == GL_NEAREST_MIPMAP_NEAREST || param == GL_LINEAR_MIPMAP_NEAREST ||
+             param == GL_NEAREST_MIPMAP_LINEAR || param == GL_LINEAR_MIPMAP_LINEAR;
+        break;
+    case GL_TEXTURE_MAG_FILTER:
+        ok = param == GL_NEAREST || param == GL_LINEAR;
+        break;
+    case GL_TEXTURE_WRAP_S:
+    case GL_TEXTURE_WRAP_T:
+        ok = param == GL_REPEAT || param == GL_CLAMP;
+        break;
+    case GL_GENERATE_MIPMAP:
+        ok = param == GL_TRUE || param == GL_FALSE;
+        break;
+    default:
+        ok = 0;
+        break;
+    }
+    if (!ok) {
+        gl_ctx.error = GL_INVALID_ENUM;
+        return;
+    }
+
+    gl_texture_t* tex = bound_texture_object();
+    if (!tex) return;
+    switch (pname) {
+    case GL_TEXTURE_MIN_FILTER: tex->min_filter = param; break;
+    case GL_TEXTURE_MAG_FILTER: tex->mag_filter = param; break;
+    case GL_TEXTURE_WRAP_S:     tex->wrap_s = param; break;
+    case GL_TEXTURE_WRAP_T:     tex->wrap_t = param; break;
+    case GL_GENERATE_MIPMAP:    tex->generate_mipmap = param; break;
     }
 }
 
@@ -912,13 +2239,12 @@ void glTexParameteri(GLenum target, GLenum pname, GLint param) {
 // ============================================================
 
 void glFlush(void) {
-    // In software mode, nothing to flush
-    // With GPU, would kick the pushbuffer
+    // In software mode, nothing to flush; with the GPU, submit the batch
+    nv_3d_flush();
 }
 
 void glFinish(void) {
-    glFlush();
-    // With GPU, would wait for fence
+    nv_3d_finish();
 }
 
 // ============================================================
@@ -980,10 +2306,7 @@ void gluPerspective(GLdouble fovy, GLdouble aspect, GLdouble zNear, GLdouble zFa
     m[11] = -1.0f;
     m[14] = -(2.0f * far_val * n) / (far_val - n);
 
-    float* cur = current_matrix();
-    float tmp[16];
-    mat4_multiply(tmp, cur, m);
-    mat4_copy(cur, tmp);
+    mult_current(m);
 }
 
 void gluLookAt(GLdouble eyeX, GLdouble eyeY, GLdouble eyeZ,
@@ -1021,10 +2344,7 @@ void gluLookAt(GLdouble eyeX, GLdouble eyeY, GLdouble eyeZ,
     m[2] = -fx; m[6] = -fy; m[10] = -fz; m[14] = 0;
     m[3] = 0;   m[7] = 0;   m[11] = 0;   m[15] = 1;
 
-    float* cur = current_matrix();
-    float tmp[16];
-    mat4_multiply(tmp, cur, m);
-    mat4_copy(cur, tmp);
+    mult_current(m);
 
     glTranslatef(-(float)eyeX, -(float)eyeY, -(float)eyeZ);
 }
@@ -22,6 +22,8 @@ typedef double          GLclampd;
 typedef unsigned char   GLubyte;
 typedef unsigned char   GLboolean;
 typedef void            GLvoid;
+typedef int64_t         GLsizeiptr;
+typedef int64_t         GLintptr;
 
 #define GL_FALSE        0
 #define GL_TRUE         1
@@ -120,11 +122,38 @@ typedef void            GLvoid;
 #define GL_TEXTURE_WRAP_T       0x2803
 #define GL_NEAREST              0x2600
 #define GL_LINEAR               0x2601
+#define GL_NEAREST_MIPMAP_NEAREST   0x2700
+#define GL_LINEAR_MIPMAP_NEAREST    0x2701
+#define GL_NEAREST_MIPMAP_LINEAR    0x2702
+#define GL_LINEAR_MIPMAP_LINEAR     0x2703
+#define GL_GENERATE_MIPMAP      0x8191
 #define GL_REPEAT               0x2901
 #define GL_CLAMP                0x2900
 #define GL_RGBA                 0x1908
 #define GL_RGB                  0x1907
 #define GL_UNSIGNED_BYTE        0x1401
+#define GL_UNSIGNED_SHORT       0x1403
+#define GL_UNSIGNED_INT         0x1405
+#define GL_FLOAT                0x1406
+
+// ============================================================
+// Vertex Arrays / Buffer Objects
+// ============================================================
+
+#define GL_VERTEX_ARRAY             0x8074
+#define GL_COLOR_ARRAY              0x8076
+#define GL_ARRAY_BUFFER             0x8892
+#define GL_ELEMENT_ARRAY_BUFFER     0x8893
+#define GL_STREAM_DRAW              0x88E0
+#define GL_STATIC_DRAW              0x88E4
+#define GL_DYNAMIC_DRAW             0x88E8
+
+// ============================================================
+// Display Lists
+// ============================================================
+
+#define GL_COMPILE                  0x1300
+#define GL_COMPILE_AND_EXECUTE      0x1301
 
 // ============================================================
 // Error Codes
@@ -151,7 +180,12 @@ typedef void            GLvoid;
 
 #define GL_MAX_MATRIX_STACK_DEPTH   16
 #define GL_MAX_TEXTURES             16
+#define GL_MAX_TEXTURE_LEVELS       12      // Up to 2048x2048
+#define GL_MAX_TEXTURE_SIZE         (1 << (GL_MAX_TEXTURE_LEVELS - 1))
 #define GL_MAX_IMMEDIATE_VERTICES   4096
+#define GL_MAX_BUFFERS              64
+#define GL_MAX_LISTS                64
+#define GL_MAX_LIST_NESTING         64
 
 // ============================================================
 // OpenGL API Functions
@@ -200,7 +234,41 @@ void glColor3ub(GLubyte r, GLubyte g, GLubyte b);
 void glTexCoord2f(GLfloat s, GLfloat t);
 void glNormal3f(GLfloat nx, GLfloat ny, GLfloat nz);
 
+// ---- Vertex Arrays ----
+// GL_FLOAT positions (2-4 components) and GL_FLOAT or GL_UNSIGNED_BYTE
+// colors (3-4). With a buffer bound to GL_ARRAY_BUFFER, 'pointer' is an
+// offset into it. Draws from buffer objects keep their transformed
+// vertices and reuse them until the matrices, viewport or data change.
+void glEnableClientState(GLenum array);
+void glDisableClientState(GLenum array);
+void glVertexPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* pointer);
+void glColorPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* pointer);
+void glDrawArrays(GLenum mode, GLint first, GLsizei count);
+void glDrawElements(GLenum mode, GLsizei count, GLenum type, const GLvoid* indices);
+
+// ---- Buffer Objects ----
+void glGenBuffers(GLsizei n, GLuint* buffers);
+void glDeleteBuffers(GLsizei n, const GLuint* buffers);
+void glBindBuffer(GLenum target, GLuint buffer);
+void glBufferData(GLenum target, GLsizeiptr size, const GLvoid* data, GLenum usage);
+void glBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const GLvoid* data);
+
+// ---- Display Lists ----
+// Geometry (glBegin/glEnd and array draws), colors, matrix operations and
+// glCallList are recorded; other calls take effect immediately. Each
+// recorded draw keeps its transformed vertices while the matrices and
+// viewport it ran with stay the same.
+GLuint glGenLists(GLsizei range);
+void   glDeleteLists(GLuint list, GLsizei range);
+void   glNewList(GLuint list, GLenum mode);
+void   glEndList(void);
+void   glCallList(GLuint list);
+
 // ---- Texture ----
+// GL_RGBA or GL_RGB, GL_UNSIGNED_BYTE, any size up to GL_MAX_TEXTURE_SIZE.
+// Loading level 0 builds the rest of the mipmap chain unless
+// GL_GENERATE_MIPMAP is set to GL_FALSE; other levels may be loaded over
+// it. Textures modulate the vertex color of filled primitives.
 void glGenTextures(GLsizei n, GLuint* textures);
 void glDeleteTextures(GLsizei n, const GLuint* textures);
 void glBindTexture(GLenum target, GLuint texture);
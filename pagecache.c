@@ -0,0 +1,665 @@
+// pagecache.c - Unified Page Cache for Alteo OS
+// Cached pages are chained in hash buckets keyed by (space, object, index)
+// and sit on one LRU list, most recently used first. Free descriptors are
+// chained through hash_next. I/O callbacks run with the lock dropped and
+// the page pinned, so reclaim from a PMM allocation can never free a page
+// that is being filled or written back. A page being read (on a miss or
+// ahead of a reader) stays pinned and PAGECACHE_LOCKED until its fill
+// completes; other readers of it sleep on pc_wait.
+#include "pagecache.h"
+#include "klib.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "waitq.h"
+#include "scheduler.h"
+#include "process.h"
+#include "timer.h"
+#include "trace.h"
+
+typedef struct {
+    int                    in_use;
+    const pagecache_ops_t* ops;
+    void*                  owner;
+} pagecache_space_t;
+
+// A sequential reader of one object
+typedef struct {
+    int      space;             // -1 = unused
+    uint64_t object;
+    uint32_t last;              // Page read last
+    uint32_t ra_end;            // End of the pages read ahead
+    uint32_t trigger;           // Reading this page starts the next window
+    uint32_t window;            // Current window, 0 = not sequential
+    uint64_t stamp;             // For recycling the least recently used
+} pagecache_stream_t;
+
+static pagecache_page_t pages[PAGECACHE_MAX_PAGES];
+static int hash[PAGECACHE_HASH_SIZE];           // Bucket heads
+static int free_head = -1;                      // Unused descriptors
+static int lru_head = -1;                       // Most recently used
+static int lru_tail = -1;                       // Next to evict
+static pagecache_space_t spaces[PAGECACHE_MAX_SPACES];
+static pagecache_stats_t stats;
+static lockstat_t pc_lock_stat = LOCKSTAT_INIT("pagecache");
+static spinlock_t pc_lock = SPINLOCK_INIT_STAT(pc_lock_stat);
+static waitq_t pc_wait = WAITQ_INIT;            // Readers of locked pages
+static pagecache_stream_t streams[PAGECACHE_RA_STREAMS];
+static uint64_t stream_clock = 0;
+static waitq_t flush_wq = WAITQ_INIT;           // kflushd sleeps here
+static volatile int flusher_running = 0;
+static volatile int flush_kick = 0;             // Periodic wakeup is due
+static volatile int flush_timer_armed = 0;
+
+// ---------- Index (pc_lock held) ----------
+
+static uint32_t pc_bucket(int space, uint64_t object, uint32_t index) {
+    uint64_t h = (object * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)space << 40) ^ index;
+    h *= 0xFF51AFD7ED558CCDULL;
+    return (uint32_t)(h >> 32) & (PAGECACHE_HASH_SIZE - 1);
+}
+
+static int pc_lookup(int space, uint64_t object, uint32_t index) {
+    int i = hash[pc_bucket(space, object, index)];
+    while (i >= 0) {
+        pagecache_page_t* p = &pages[i];
+        if (p->space == space && p->object == object && p->index == index) return i;
+        i = p->hash_next;
+    }
+    return -1;
+}
+
+static void pc_hash_insert(int i) {
+    uint32_t b = pc_bucket(pages[i].space, pages[i].object, pages[i].index);
+    pages[i].hash_next = hash[b];
+    hash[b] = i;
+}
+
+static void pc_hash_remove(int i) {
+    int* link = &hash[pc_bucket(pages[i].space, pages[i].object, pages[i].index)];
+    while (*link >= 0 && *link != i) link = &pages[*link].hash_next;
+    if (*link == i) *link = pages[i].hash_next;
+    pages[i].hash_next = -1;
+}
+
+static void pc_lru_unlink(int i) {
+    pagecache_page_t* p = &pages[i];
+    if (p->lru_prev >= 0) pages[p->lru_prev].lru_next = p->lru_next;
+    else lru_head = p->lru_next;
+    if (p->lru_next >= 0) pages[p->lru_next].lru_prev = p->lru_prev;
+    else lru_tail = p->lru_prev;
+    p->lru_prev = p->lru_next = -1;
+}
+
+static void pc_lru_push_front(int i) {
+    pages[i].lru_prev = -1;
+    pages[i].lru_next = lru_head;
+    if (lru_head >= 0) pages[lru_head].lru_prev = i;
+    else lru_tail = i;
+    lru_head = i;
+}
+
+// Take a page out of the index, keeping its frame
+static void pc_detach(int i) {
+    pc_hash_remove(i);
+    pc_lru_unlink(i);
+    if (pages[i].flags & PAGECACHE_DIRTY) stats.dirty--;
+    pages[i].flags = 0;
+    pages[i].space = -1;
+}
+
+// Return a detached descriptor and its frame
+static void pc_free(int i) {
+    pmm_free_block(pages[i].data);
+    pages[i].data = 0;
+    pages[i].hash_next = free_head;
+    free_head = i;
+    stats.pages--;
+}
+
+// Detach a page and return its frame and descriptor
+static void pc_release(int i) {
+    pc_detach(i);
+    pc_free(i);
+}
+
+// ---------- Allocation ----------
+
+// Write a dirty page back with the lock dropped. Returns 0 on success.
+static int pc_writeback(int i, uint64_t* irq) {
+    pagecache_page_t* p = &pages[i];
+    const pagecache_ops_t* ops = spaces[p->space].ops;
+    if (!ops->writepage) return -1;
+
+    p->pins++;
+    p->flags &= ~PAGECACHE_DIRTY;   // Re-dirtied if written to meanwhile
+    stats.dirty--;
+    spin_unlock_irqrestore(&pc_lock, *irq);
+    int r = ops->writepage(spaces[p->space].owner, p->object, p->index, p->data);
+    *irq = spin_lock_irqsave(&pc_lock);
+    p->pins--;
+    if (r < 0 && !(p->flags & PAGECACHE_DIRTY)) {
+        p->flags |= PAGECACHE_DIRTY;
+        p->dirtied = timer_now_ns();
+        stats.dirty++;
+    }
+    return r;
+}
+
+// A descriptor with a frame, detached from everything: a fresh one while
+// memory is plentiful, else the least recently used unpinned page.
+static int pc_alloc(uint64_t* irq) {
+    if (free_head >= 0 && pmm_get_free_memory() > PAGECACHE_RESERVE) {
+        void* frame = pmm_alloc_block();
+        if (frame) {
+            int i = free_head;
+            free_head = pages[i].hash_next;
+            pages[i].data = (uint8_t*)frame;
+            pages[i].hash_next = -1;
+            stats.pages++;
+            return i;
+        }
+    }
+
+    // Dirty victims are written back and reconsidered, so bound the passes
+    for (int pass = 0; pass < 8; pass++) {
+        int i = lru_tail;
+        while (i >= 0 && pages[i].pins) i = pages[i].lru_prev;
+        if (i < 0) return -1;
+        if (!(pages[i].flags & PAGECACHE_DIRTY)) {
+            TRACE(TRACE_CACHE_EVICT, pages[i].index, pages[i].space);
+            pc_detach(i);
+            stats.evictions++;
+            // A frame a process still maps (see pagecache_page_t) stays
+            // with its mappings; the descriptor gets a fresh one
+            if (pmm_page_refcount(pages[i].data) > 1) {
+                pmm_free_block(pages[i].data);
+                pages[i].data = (uint8_t*)pmm_alloc_block();
+                if (!pages[i].data) {
+                    pages[i].hash_next = free_head;
+                    free_head = i;
+                    stats.pages--;
+                    return -1;
+                }
+            }
+            return i;
+        }
+        if (pc_writeback(i, irq) < 0) {
+            // Keep unwritable data; try the next candidate later
+            if (!pages[i].pins) {
+                pc_lru_unlink(i);
+                pc_lru_push_front(i);
+            }
+        }
+    }
+    return -1;
+}
+
+// ---------- Readahead ----------
+
+static int pc_page_unlocked(void* arg) {
+    return !(*(volatile uint16_t*)&((pagecache_page_t*)arg)->flags & PAGECACHE_LOCKED);
+}
+
+// Wait out a pinned page's readahead; if it failed, read the page now.
+// Returns the page, or 0 (pin dropped) if it cannot be read.
+static pagecache_page_t* pc_settle(pagecache_page_t* p) {
+    if (!pc_page_unlocked(p) && waitq_wait(&pc_wait, pc_page_unlocked, p) < 0) {
+        while (!pc_page_unlocked(p)) {
+            if (scheduler_is_running()) scheduler_yield();
+            else __asm__ volatile("pause");
+        }
+    }
+    if (!(p->flags & PAGECACHE_ERROR)) return p;
+
+    pagecache_space_t* sp = &spaces[p->space];
+    if (sp->ops->readpage(sp->owner, p->object, p->index, p->data) < 0) {
+        pagecache_put(p);
+        return 0;
+    }
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    p->flags &= ~PAGECACHE_ERROR;
+    spin_unlock_irqrestore(&pc_lock, irq);
+    return p;
+}
+
+// The stream for (space, object), recycling the least recently used one
+// (pc_lock held)
+static pagecache_stream_t* pc_stream(int space, uint64_t object, int* fresh) {
+    pagecache_stream_t* victim = &streams[0];
+    for (int s = 0; s < PAGECACHE_RA_STREAMS; s++) {
+        if (streams[s].space == space && streams[s].object == object) {
+            *fresh = 0;
+            return &streams[s];
+        }
+        if (streams[s].stamp < victim->stamp) victim = &streams[s];
+    }
+    victim->space = space;
+    victim->object = object;
+    victim->window = 0;
+    victim->last = 0;
+    *fresh = 1;
+    return victim;
+}
+
+// Note an access at index by a sequential reader and pick the pages to
+// read ahead: a window starting next to the reader once it is sequential,
+// then the next, doubled window each time it reaches the last one issued.
+static uint32_t pc_stream_access(int space, uint64_t object, uint32_t index, uint32_t* start) {
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    int fresh;
+    pagecache_stream_t* st = pc_stream(space, object, &fresh);
+    st->stamp = ++stream_clock;
+    uint32_t count = 0;
+
+    if (!fresh && index == st->last) {
+        // Another read within the same page
+    } else if ((fresh && index == 0) || (!fresh && index == st->last + 1)) {
+        if (!st->window) {
+            st->window = PAGECACHE_RA_MIN;
+            *start = index + 1;
+            count = st->window;
+        } else if (index >= st->trigger) {
+            st->window = st->window * 2 > PAGECACHE_RA_MAX ? PAGECACHE_RA_MAX : st->window * 2;
+            *start = st->ra_end > index + 1 ? st->ra_end : index + 1;
+            count = st->window;
+        }
+        if (count) {
+            st->trigger = *start;
+            st->ra_end = *start + count;
+        }
+    } else {
+        st->window = 0;     // Random access
+    }
+    st->last = index;
+    spin_unlock_irqrestore(&pc_lock, irq);
+    return count;
+}
+
+// Start filling pages [start, start + count) that are not cached yet
+static void pc_readahead(int space, uint64_t object, uint32_t start, uint32_t count) {
+    pagecache_space_t* sp = &spaces[space];
+    if (!sp->ops->readahead) return;
+
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t index = start + k;
+        uint64_t irq = spin_lock_irqsave(&pc_lock);
+        if (pc_lookup(space, object, index) >= 0) {
+            spin_unlock_irqrestore(&pc_lock, irq);
+            continue;
+        }
+        int i = pc_alloc(&irq);
+        if (i < 0) {
+            spin_unlock_irqrestore(&pc_lock, irq);
+            return;
+        }
+        if (pc_lookup(space, object, index) >= 0) {
+            pc_free(i);
+            spin_unlock_irqrestore(&pc_lock, irq);
+            continue;
+        }
+        pagecache_page_t* p = &pages[i];
+        p->space = space;
+        p->object = object;
+        p->index = index;
+        p->pins = 1;
+        p->flags = PAGECACHE_LOCKED;
+        pc_hash_insert(i);
+        pc_lru_push_front(i);
+        stats.readahead++;
+        spin_unlock_irqrestore(&pc_lock, irq);
+
+        if (sp->ops->readahead(sp->owner, object, index, p) < 0) {
+            pagecache_fill_done(p, -1);
+            return;
+        }
+    }
+}
+
+// ---------- Background writeback ----------
+
+static int pc_over_ratio(void) {
+    return stats.dirty * 100 > stats.pages * PAGECACHE_DIRTY_RATIO;
+}
+
+static int pc_key_before(pagecache_page_t* a, pagecache_page_t* b) {
+    if (a->space != b->space) return a->space < b->space;
+    if (a->object != b->object) return a->object < b->object;
+    return a->index < b->index;
+}
+
+// The first PAGECACHE_FLUSH_BATCH pages due for writeback, in key order
+// (pc_lock held). Due means dirty for PAGECACHE_DIRTY_EXPIRE_NS, or - with
+// all set - dirtied before this pass started at now.
+static int pc_flush_collect(int* batch, uint64_t now, int all) {
+    int n = 0;
+    for (int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        pagecache_page_t* p = &pages[i];
+        if (!(p->flags & PAGECACHE_DIRTY) || !spaces[p->space].ops->writepage) continue;
+        if (all ? p->dirtied > now : now - p->dirtied < PAGECACHE_DIRTY_EXPIRE_NS) continue;
+        if (n == PAGECACHE_FLUSH_BATCH && !pc_key_before(p, &pages[batch[n - 1]])) continue;
+
+        int at = n < PAGECACHE_FLUSH_BATCH ? n++ : n - 1;
+        while (at > 0 && pc_key_before(p, &pages[batch[at - 1]])) {
+            batch[at] = batch[at - 1];
+            at--;
+        }
+        batch[at] = i;
+    }
+    return n;
+}
+
+static int pc_writeback_idle(void* arg) {
+    (void)arg;
+    return *(volatile uint64_t*)&stats.writeback == 0;
+}
+
+static void pc_wait_writeback(void) {
+    if (pc_writeback_idle(0) || waitq_wait(&pc_wait, pc_writeback_idle, 0) == 0) return;
+    while (!pc_writeback_idle(0)) {
+        if (scheduler_is_running()) scheduler_yield();
+        else __asm__ volatile("pause");
+    }
+}
+
+// Start every write of the batch, then wait for all of them, so a device
+// with a request queue sees the whole sorted batch at once
+static void pc_flush_batch(int* batch, int n) {
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    for (int k = 0; k < n; k++) {
+        pagecache_page_t* p = &pages[batch[k]];
+        p->pins++;
+        p->flags &= ~PAGECACHE_DIRTY;   // Re-dirtied if written to meanwhile
+        stats.dirty--;
+        stats.writeback++;
+    }
+    spin_unlock_irqrestore(&pc_lock, irq);
+
+    for (int k = 0; k < n; k++) {
+        pagecache_page_t* p = &pages[batch[k]];
+        pagecache_space_t* sp = &spaces[p->space];
+        if (sp->ops->writeback && sp->ops->writeback(sp->owner, p->object, p->index, p) == 0) continue;
+        pagecache_write_done(p, sp->ops->writepage(sp->owner, p->object, p->index, p->data));
+    }
+    pc_wait_writeback();
+}
+
+// Timer event (IRQ context)
+static void pc_flush_tick(uint64_t arg) {
+    (void)arg;
+    flush_timer_armed = 0;
+    flush_kick = 1;
+    waitq_wake_all(&flush_wq);
+}
+
+static int pc_flush_due(void* arg) {
+    (void)arg;
+    return flush_kick || pc_over_ratio();
+}
+
+static void pc_flusher(void) {
+    int batch[PAGECACHE_FLUSH_BATCH];
+    for (;;) {
+        if (!flush_timer_armed && timer_is_active() &&
+            timer_add(timer_now_ns() + PAGECACHE_FLUSH_INTERVAL_NS, pc_flush_tick, 0) >= 0) {
+            flush_timer_armed = 1;
+        }
+        waitq_wait(&flush_wq, pc_flush_due, 0);
+        flush_kick = 0;
+
+        uint64_t now = timer_now_ns();
+        for (;;) {
+            uint64_t irq = spin_lock_irqsave(&pc_lock);
+            int n = pc_flush_collect(batch, now, pc_over_ratio());
+            if (n) stats.flushed += n;
+            spin_unlock_irqrestore(&pc_lock, irq);
+            if (!n) break;
+            pc_flush_batch(batch, n);
+        }
+    }
+}
+
+// ---------- Public API ----------
+
+void pagecache_init(void) {
+    memset(spaces, 0, sizeof(spaces));
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; i < PAGECACHE_HASH_SIZE; i++) hash[i] = -1;
+    free_head = -1;
+    for (int i = PAGECACHE_MAX_PAGES - 1; i >= 0; i--) {
+        pages[i].data = 0;
+        pages[i].space = -1;
+        pages[i].pins = 0;
+        pages[i].flags = 0;
+        pages[i].lru_prev = pages[i].lru_next = -1;
+        pages[i].hash_next = free_head;
+        free_head = i;
+    }
+    lru_head = lru_tail = -1;
+    for (int s = 0; s < PAGECACHE_RA_STREAMS; s++) {
+        streams[s].space = -1;
+        streams[s].stamp = 0;
+    }
+    pmm_set_reclaim(pagecache_shrink);
+}
+
+int pagecache_register(const pagecache_ops_t* ops, void* owner) {
+    if (!ops || !ops->readpage) return -1;
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    for (int s = 0; s < PAGECACHE_MAX_SPACES; s++) {
+        if (!spaces[s].in_use) {
+            spaces[s].in_use = 1;
+            spaces[s].ops = ops;
+            spaces[s].owner = owner;
+            spin_unlock_irqrestore(&pc_lock, irq);
+            return s;
+        }
+    }
+    spin_unlock_irqrestore(&pc_lock, irq);
+    return -1;
+}
+
+void pagecache_unregister(int space) {
+    if (space < 0 || space >= PAGECACHE_MAX_SPACES || !spaces[space].in_use) return;
+    pagecache_sync(space);
+    // Let readahead in flight land before its pages go away
+    for (int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        uint64_t irq = spin_lock_irqsave(&pc_lock);
+        int busy = pages[i].space == space && (pages[i].flags & PAGECACHE_LOCKED);
+        if (busy) pages[i].pins++;
+        spin_unlock_irqrestore(&pc_lock, irq);
+        if (busy) pagecache_put(pc_settle(&pages[i]));
+    }
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    for (int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        if (pages[i].space == space) pc_release(i);
+    }
+    for (int s = 0; s < PAGECACHE_RA_STREAMS; s++) {
+        if (streams[s].space == space) streams[s].space = -1;
+    }
+    spaces[space].in_use = 0;
+    spin_unlock_irqrestore(&pc_lock, irq);
+}
+
+pagecache_page_t* pagecache_get(int space, uint64_t object, uint32_t index, int flags) {
+    if (space < 0 || space >= PAGECACHE_MAX_SPACES || !spaces[space].in_use) return 0;
+
+    // Queue the pages ahead first, so the device sees them with this one
+    if (flags & PAGECACHE_SEQ) {
+        uint32_t start = 0;
+        uint32_t count = pc_stream_access(space, object, index, &start);
+        if (count) pc_readahead(space, object, start, count);
+    }
+
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    int i = pc_lookup(space, object, index);
+    if (i >= 0) {
+        stats.hits++;
+        TRACE(TRACE_CACHE_HIT, index, space);
+        pages[i].pins++;
+        if (lru_head != i) {
+            pc_lru_unlink(i);
+            pc_lru_push_front(i);
+        }
+        spin_unlock_irqrestore(&pc_lock, irq);
+        return pc_settle(&pages[i]);
+    }
+    if (flags & PAGECACHE_PEEK) {
+        spin_unlock_irqrestore(&pc_lock, irq);
+        return 0;
+    }
+
+    stats.misses++;
+    TRACE(TRACE_CACHE_MISS, index, space);
+    process_t* cur = process_get_current();
+    if (cur) cur->acct.cache_misses++;
+    i = pc_alloc(&irq);
+    if (i < 0) {
+        spin_unlock_irqrestore(&pc_lock, irq);
+        return 0;
+    }
+    // A writeback in pc_alloc dropped the lock: someone may have cached it
+    int dup = pc_lookup(space, object, index);
+    if (dup >= 0) {
+        pc_free(i);
+        pages[dup].pins++;
+        spin_unlock_irqrestore(&pc_lock, irq);
+        return pc_settle(&pages[dup]);
+    }
+
+    // A page being read is hashed locked, with a second pin for the fill,
+    // exactly like a readahead page: readpage sleeps with the BKL
+    // dropped, and anyone finding the page meanwhile waits in pc_settle()
+    pagecache_page_t* p = &pages[i];
+    int fill = !(flags & PAGECACHE_NOFILL);
+    p->space = space;
+    p->object = object;
+    p->index = index;
+    p->pins = fill ? 2 : 1;
+    p->flags = fill ? PAGECACHE_LOCKED : 0;
+    pc_hash_insert(i);
+    pc_lru_push_front(i);
+    spin_unlock_irqrestore(&pc_lock, irq);
+    if (!fill) return p;
+
+    int r = spaces[space].ops->readpage(spaces[space].owner, object, index, p->data);
+    pagecache_fill_done(p, r < 0 ? -1 : 0);
+    if (r < 0) {
+        // Other readers of the page retry the read from pc_settle();
+        // the page goes away with the last pin
+        irq = spin_lock_irqsave(&pc_lock);
+        if (p->pins) p->pins--;
+        if (!p->pins && (p->flags & PAGECACHE_ERROR)) pc_release(i);
+        spin_unlock_irqrestore(&pc_lock, irq);
+        return 0;
+    }
+    return p;
+}
+
+void pagecache_fill_done(pagecache_page_t* page, int status) {
+    if (!page) return;
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    page->flags &= ~PAGECACHE_LOCKED;
+    if (status < 0) page->flags |= PAGECACHE_ERROR;
+    if (page->pins) page->pins--;
+    // Nobody is waiting for a failed page: just drop it
+    if ((page->flags & PAGECACHE_ERROR) && !page->pins) pc_release((int)(page - pages));
+    spin_unlock_irqrestore(&pc_lock, irq);
+    waitq_wake_all(&pc_wait);
+}
+
+void pagecache_put(pagecache_page_t* page) {
+    if (!page) return;
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    if (page->pins) page->pins--;
+    spin_unlock_irqrestore(&pc_lock, irq);
+}
+
+void pagecache_mark_dirty(pagecache_page_t* page) {
+    if (!page) return;
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    if (!(page->flags & PAGECACHE_DIRTY)) {
+        page->flags |= PAGECACHE_DIRTY;
+        page->dirtied = timer_now_ns();
+        stats.dirty++;
+    }
+    int kick = flusher_running && pc_over_ratio();
+    spin_unlock_irqrestore(&pc_lock, irq);
+    if (kick) waitq_wake_all(&flush_wq);
+}
+
+void pagecache_write_done(pagecache_page_t* page, int status) {
+    if (!page) return;
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    if (status < 0 && !(page->flags & PAGECACHE_DIRTY)) {
+        page->flags |= PAGECACHE_DIRTY;
+        page->dirtied = timer_now_ns();
+        stats.dirty++;
+    }
+    if (page->pins) page->pins--;
+    if (stats.writeback) stats.writeback--;
+    spin_unlock_irqrestore(&pc_lock, irq);
+    waitq_wake_all(&pc_wait);
+}
+
+void pagecache_start_flusher(void) {
+    if (flusher_running) return;
+    if (process_create("kflushd", pc_flusher, PRIORITY_NORMAL) >= 0) flusher_running = 1;
+}
+
+int pagecache_sync(int space) {
+    if (space < 0 || space >= PAGECACHE_MAX_SPACES || !spaces[space].in_use) return -1;
+    int result = 0;
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    for (int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        if (pages[i].space == space && (pages[i].flags & PAGECACHE_DIRTY)) {
+            if (pc_writeback(i, &irq) < 0) result = -1;
+        }
+    }
+    spin_unlock_irqrestore(&pc_lock, irq);
+    pc_wait_writeback();
+    return result;
+}
+
+void pagecache_invalidate(int space, uint64_t object) {
+    if (space < 0 || space >= PAGECACHE_MAX_SPACES) return;
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    for (int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        pagecache_page_t* p = &pages[i];
+        if (p->space != space || p->pins) continue;
+        if (object == PAGECACHE_ALL_OBJECTS || p->object == object) pc_release(i);
+    }
+    spin_unlock_irqrestore(&pc_lock, irq);
+}
+
+uint64_t pagecache_shrink(uint64_t want) {
+    // Called from PMM allocations anywhere, including under pc_lock on
+    // this CPU (pc_alloc): never wait for the lock
+    uint64_t irq;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(irq) :: "memory");
+    if (!spin_trylock(&pc_lock)) {
+        if (irq & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+        return 0;
+    }
+
+    uint64_t freed = 0;
+    int i = lru_tail;
+    while (i >= 0 && freed < want) {
+        int prev = pages[i].lru_prev;
+        if (!pages[i].pins && !(pages[i].flags & PAGECACHE_DIRTY)) {
+            TRACE(TRACE_CACHE_EVICT, pages[i].index, pages[i].space);
+            pc_release(i);
+            freed++;
+        }
+        i = prev;
+    }
+    stats.reclaimed += freed;
+    spin_unlock_irqrestore(&pc_lock, irq);
+    return freed;
+}
+
+void pagecache_get_stats(pagecache_stats_t* out) {
+    if (!out) return;
+    uint64_t irq = spin_lock_irqsave(&pc_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&pc_lock, irq);
+}
@@ -0,0 +1,154 @@
+// pagecache.h - Unified Page Cache for Alteo OS
+// Caches 4KB pages of block devices and files in PMM frames. A page is
+// named by (space, object, index): a space is registered by its owner (one
+// per block device or mounted filesystem) and supplies the I/O callbacks,
+// the object is owner-defined (0 for a raw device, the inode number for a
+// file) and the index is the page number within the object.
+//
+// The cache takes frames from the PMM while free memory stays above
+// PAGECACHE_RESERVE, recycles its least recently used pages beyond that,
+// and hands clean pages back when the PMM runs out. Callers are serialized
+// by the big kernel lock; the internal lock only fences off PMM reclaim
+// and asynchronous completions.
+//
+// Readers flagged PAGECACHE_SEQ are tracked per (space, object) stream:
+// once a stream reads sequentially, the pages ahead of it are filled
+// asynchronously through the space's readahead op, in a window that
+// doubles from PAGECACHE_RA_MIN to PAGECACHE_RA_MAX pages. A page still
+// being filled is returned by pagecache_get() only once its I/O is done.
+// blkdev_read() and ext2 file reads are marked sequential. ext2 is only
+// reached through its own mount ops: vfs_open()/vfs_read() work on the
+// in-memory tree and do not dispatch to mounted filesystems, so files
+// read through the VFS (ELF images included) get no readahead.
+//
+// The kflushd thread writes dirty pages back in the background, in
+// (space, object, index) order - LBA order for block devices: pages dirty
+// for longer than PAGECACHE_DIRTY_EXPIRE_NS, or every dirty page once they
+// make up more than PAGECACHE_DIRTY_RATIO percent of the cache. Eviction
+// then rarely has to write a victim back itself.
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "stdint.h"
+
+#define PAGECACHE_PAGE_SIZE     4096
+#define PAGECACHE_MAX_PAGES     65536    // Page descriptors (up to 256MB cached)
+#define PAGECACHE_HASH_SIZE     16384    // Lookup buckets (power of two)
+#define PAGECACHE_MAX_SPACES    32
+#define PAGECACHE_RESERVE       (16ULL * 1024 * 1024)   // Free memory the cache never takes
+#define PAGECACHE_RA_STREAMS    16       // Sequential streams tracked
+#define PAGECACHE_RA_MIN        4        // First readahead window (pages)
+#define PAGECACHE_RA_MAX        32       // Largest window (128KB)
+#define PAGECACHE_DIRTY_EXPIRE_NS   5000000000ULL   // Age at which a dirty page is written back
+#define PAGECACHE_DIRTY_RATIO       10              // Percent of cached pages
+#define PAGECACHE_FLUSH_INTERVAL_NS 1000000000ULL   // kflushd wakeup period
+#define PAGECACHE_FLUSH_BATCH       32              // Pages written back together
+
+// pagecache_get() flags
+#define PAGECACHE_NOFILL        0x1      // Caller overwrites the whole page: skip the read
+#define PAGECACHE_PEEK          0x2      // Only return a page that is already cached
+#define PAGECACHE_SEQ           0x4      // Part of a sequential read: track it and read ahead
+
+// pagecache_invalidate() wildcard
+#define PAGECACHE_ALL_OBJECTS   0xFFFFFFFFFFFFFFFFULL
+
+// Page flags
+#define PAGECACHE_DIRTY         0x1
+#define PAGECACHE_LOCKED        0x2      // Being filled (read or readahead)
+#define PAGECACHE_ERROR         0x4      // Fill failed: read again on use
+
+struct pagecache_page;
+
+typedef struct {
+    // Fill page with the object's data at index. Returns 0, or -1 on error.
+    int (*readpage)(void* owner, uint64_t object, uint32_t index, void* page);
+    // Write a dirty page back. Returns 0, or -1 on error. May be 0 for
+    // read-only spaces (their pages are never dirtied).
+    int (*writepage)(void* owner, uint64_t object, uint32_t index, const void* page);
+    // Optional: start filling a new, pinned page without waiting and call
+    // pagecache_fill_done() when the data is in (possibly before
+    // returning). Returns 0, or -1 without calling it if nothing was
+    // started, e.g. past the end of the object; readahead stops there.
+    int (*readahead)(void* owner, uint64_t object, uint32_t index, struct pagecache_page* page);
+    // Optional: start writing a pinned page back without waiting and call
+    // pagecache_write_done() when it is on disk (possibly before
+    // returning). Returns 0, or -1 without calling it; kflushd then uses
+    // writepage instead.
+    int (*writeback)(void* owner, uint64_t object, uint32_t index, struct pagecache_page* page);
+} pagecache_ops_t;
+
+// A cached page. Callers use data (valid while the page is pinned) and
+// treat the rest as private. A caller may also take a PMM reference on
+// data (pmm_page_ref) to map the frame into a process: the cache then
+// never reuses that frame for other data, and drops its own reference
+// when it lets go of the page.
+typedef struct pagecache_page {
+    uint8_t* data;              // PMM frame holding the page
+    uint64_t object;
+    uint32_t index;
+    int      space;             // Owning space, -1 if the descriptor is free
+    uint16_t pins;              // pagecache_get() references
+    uint16_t flags;             // PAGECACHE_DIRTY, PAGECACHE_LOCKED, ...
+    int      hash_next;         // Next page in the same bucket / free list
+    int      lru_prev;          // Towards the most recently used end
+    int      lru_next;          // Towards the eviction end
+    uint64_t dirtied;           // timer_now_ns() when it last became dirty
+} pagecache_page_t;
+
+typedef struct {
+    uint64_t pages;             // Pages currently cached
+    uint64_t dirty;             // ... of which not yet written back
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;         // Pages recycled for another block
+    uint64_t reclaimed;         // Frames handed back to the PMM
+    uint64_t readahead;         // Pages filled ahead of a sequential reader
+    uint64_t writeback;         // Pages being written back by kflushd
+    uint64_t flushed;           // Pages written back by kflushd
+} pagecache_stats_t;
+
+// Set up the descriptor pool and install the PMM reclaim hook
+void pagecache_init(void);
+
+// Register a cache space. Returns its id, or -1 if the table is full.
+int pagecache_register(const pagecache_ops_t* ops, void* owner);
+
+// Write back and drop every page of a space, then release the id
+void pagecache_unregister(int space);
+
+// Pinned page with the data at (space, object, index), read through the
+// space's readpage on a miss. Returns 0 on I/O error, when no page can be
+// had, or for an uncached page with PAGECACHE_PEEK.
+pagecache_page_t* pagecache_get(int space, uint64_t object, uint32_t index, int flags);
+
+// Complete a readahead fill started by the readahead op (status 0 or -1)
+// and drop the pin it was given. Safe from any thread, not from IRQs.
+void pagecache_fill_done(pagecache_page_t* page, int status);
+
+// Complete a background write started by the writeback op (status 0 or -1)
+void pagecache_write_done(pagecache_page_t* page, int status);
+
+// Start the kflushd thread (after process_init)
+void pagecache_start_flusher(void);
+
+// Drop a pin taken by pagecache_get()
+void pagecache_put(pagecache_page_t* page);
+
+// Note that a pinned page was modified (written back later)
+void pagecache_mark_dirty(pagecache_page_t* page);
+
+// Write back the dirty pages of a space, and wait for kflushd's writes in
+// flight. Returns 0, or -1 if any failed.
+int pagecache_sync(int space);
+
+// Drop the cached pages of one object (or PAGECACHE_ALL_OBJECTS) without
+// writing them back. Pinned pages are left alone.
+void pagecache_invalidate(int space, uint64_t object);
+
+// Free up to 'pages' clean, unpinned frames back to the PMM (least
+// recently used first). Returns the number freed.
+uint64_t pagecache_shrink(uint64_t pages);
+
+void pagecache_get_stats(pagecache_stats_t* out);
+
+#endif
@@ -1,6 +1,7 @@
 // pci.c - PCI Bus Enumerator for Alteo OS
 // Full bus/device/function enumeration with device tree and BAR mapping
 #include "pci.h"
+#include "klib.h"
 
 // ---- Port I/O ----
 static inline void outl(uint16_t port, uint32_t val) {
@@ -27,12 +28,6 @@ static inline uint8_t inb(uint16_t port) {
 static pci_device_t pci_devices[PCI_MAX_DEVICES];
 static int pci_device_count = 0;
 
-// Helper: zero memory
-static void pci_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
 // ---- PCI Config Space Access ----
 
 // Build a PCI config address
@@ -171,7 +166,7 @@ static void pci_probe_function(uint8_t bus, uint8_t dev, uint8_t func) {
     if (pci_device_count >= PCI_MAX_DEVICES) return;
 
     pci_device_t* d = &pci_devices[pci_device_count];
-    pci_memset(d, 0, sizeof(pci_device_t));
+    memset(d, 0, sizeof(pci_device_t));
 
     d->bus = bus;
     d->device = dev;
@@ -231,7 +226,7 @@ static void pci_probe_function(uint8_t bus, uint8_t dev, uint8_t func) {
 }
 
 void pci_init(void) {
-    pci_memset(pci_devices, 0, sizeof(pci_devices));
+    memset(pci_devices, 0, sizeof(pci_devices));
     pci_device_count = 0;
 
     // Enumerate all buses, devices, and functions
@@ -378,3 +373,126 @@ int pci_bar_is_io(pci_device_t* dev, int bar_index) {
     if (!dev->bars[bar_index].present) return 0;
     return dev->bars[bar_index].type == 1;
 }
+
+// ---- Message-Signalled Interrupts ----
+
+uint8_t pci_find_capability(pci_device_t* dev, uint8_t cap_id) {
+    if (!dev) return 0;
+    uint16_t status = pci_config_read16(dev->bus, dev->device, dev->function, PCI_STATUS);
+    if (!(status & PCI_STATUS_CAP_LIST)) return 0;
+    uint8_t ptr = pci_config_read8(dev->bus, dev->device, dev->function, PCI_CAP_PTR) & 0xFC;
+    for (int guard = 0; ptr && guard < 48; guard++) {
+        if (pci_config_read8(dev->bus, dev->device, dev->function, ptr) == cap_id) return ptr;
+        ptr = pci_config_read8(dev->bus, dev->device, dev->function, ptr + 1) & 0xFC;
+    }
+    return 0;
+}
+
+int pci_msix_count(pci_device_t* dev) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (!cap) return 0;
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->device, dev->function, cap + 2);
+    return (ctrl & 0x7FF) + 1;
+}
+
+// MSI-X table entry (16 bytes: address low/high, data, vector control)
+static volatile uint32_t* pci_msix_entry(pci_device_t* dev, uint8_t cap, int entry) {
+    if (!cap || entry < 0 || entry >= pci_msix_count(dev)) return 0;
+
+    // Table location: BIR in the low 3 bits, offset in the rest
+    uint32_t table = pci_config_read32(dev->bus, dev->device, dev->function, cap + 4);
+    uint64_t base = pci_get_bar_base(dev, table & 7);
+    if (!base) return 0;
+    return (volatile uint32_t*)(uintptr_t)(base + (table & ~7U) + entry * 16);
+}
+
+int pci_msix_set(pci_device_t* dev, int entry, uint8_t vector, uint8_t apic_id) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    volatile uint32_t* e = pci_msix_entry(dev, cap, entry);
+    if (!e) return -1;
+
+    e[0] = PCI_MSI_ADDR_BASE | ((uint32_t)apic_id << 12);
+    e[1] = 0;
+    e[2] = vector;
+    e[3] = 0;   // Unmask
+
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->device, dev->function, cap + 2);
+    ctrl = (ctrl | (1 << 15)) & ~(1 << 14);   // Enable, clear function mask
+    pci_config_write16(dev->bus, dev->device, dev->function, cap + 2, ctrl);
+    return 0;
+}
+
+int pci_msi_enable(pci_device_t* dev, uint8_t vector, uint8_t apic_id) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+    if (!cap) return -1;
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->device, dev->function, cap + 2);
+
+    pci_config_write32(dev->bus, dev->device, dev->function, cap + 4,
+                       PCI_MSI_ADDR_BASE | ((uint32_t)apic_id << 12));
+    if (ctrl & (1 << 7)) {   // 64-bit address
+        pci_config_write32(dev->bus, dev->device, dev->function, cap + 8, 0);
+        pci_config_write16(dev->bus, dev->device, dev->function, cap + 12, vector);
+    } else {
+        pci_config_write16(dev->bus, dev->device, dev->function, cap + 8, vector);
+    }
+    ctrl = (ctrl & ~(7 << 4)) | 1;   // One message, enabled
+    pci_config_write16(dev->bus, dev->device, dev->function, cap + 2, ctrl);
+    return 0;
+}
+
+void pci_msix_mask(pci_device_t* dev, int entry, int masked) {
+    volatile uint32_t* e = pci_msix_entry(dev, pci_find_capability(dev, PCI_CAP_ID_MSIX), entry);
+    if (e) e[3] = masked ? 1 : 0;
+}
+
+int pci_irq_alloc(pci_device_t* dev, int entry, isr_msi_fn fn, void* ctx, uint8_t apic_id) {
+    if (!dev) return -1;
+    int msix = pci_msix_count(dev) > 0;
+    if (msix ? entry >= pci_msix_count(dev) : entry != 0) return -1;
+    if (!msix && !pci_find_capability(dev, PCI_CAP_ID_MSI)) return -1;
+
+    int v = isr_alloc_msi(fn, ctx);
+    if (v < 0) return -1;
+    int r = msix ? pci_msix_set(dev, entry, (uint8_t)v, apic_id)
+                 : pci_msi_enable(dev, (uint8_t)v, apic_id);
+    if (r < 0) {
+        isr_free_vector(v);
+        return -1;
+    }
+    return v;
+}
+
+int pci_irq_set_affinity(pci_device_t* dev, int entry, uint8_t vector, uint8_t apic_id) {
+    if (!dev) return -1;
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (cap) {
+        // Masked while the address changes, so no message goes out half
+        // written; one raised meanwhile is held pending and sent on unmask
+        volatile uint32_t* e = pci_msix_entry(dev, cap, entry);
+        if (!e) return -1;
+        e[3] = 1;
+        e[0] = PCI_MSI_ADDR_BASE | ((uint32_t)apic_id << 12);
+        e[2] = vector;
+        e[3] = 0;
+        return 0;
+    }
+    cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+    if (!cap || entry != 0) return -1;
+    pci_config_write32(dev->bus, dev->device, dev->function, cap + 4,
+                       PCI_MSI_ADDR_BASE | ((uint32_t)apic_id << 12));
+    return 0;
+}
+
+void pci_irq_free(pci_device_t* dev, int entry, int vector) {
+    if (!dev) return;
+    if (pci_msix_count(dev) > 0) {
+        pci_msix_mask(dev, entry, 1);
+    } else {
+        uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+        if (cap) {
+            uint16_t ctrl = pci_config_read16(dev->bus, dev->device, dev->function, cap + 2);
+            pci_config_write16(dev->bus, dev->device, dev->function, cap + 2, ctrl & ~1);
+        }
+    }
+    isr_free_vector(vector);
+}
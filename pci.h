@@ -4,6 +4,7 @@
 #define PCI_H
 
 #include "stdint.h"
+#include "isr.h"
 
 // PCI Configuration Space ports
 #define PCI_CONFIG_ADDR     0xCF8
@@ -85,6 +86,14 @@
 #define PCI_PROG_IF_EHCI        0x20
 #define PCI_PROG_IF_XHCI        0x30
 
+// Capability IDs
+#define PCI_STATUS_CAP_LIST     (1 << 4)
+#define PCI_CAP_ID_MSI          0x05
+#define PCI_CAP_ID_MSIX         0x11
+
+// MSI message address: fixed delivery to one LAPIC
+#define PCI_MSI_ADDR_BASE       0xFEE00000U
+
 // BAR types
 #define PCI_BAR_IO              0x01    // I/O space BAR
 #define PCI_BAR_MEM32           0x00    // 32-bit memory BAR
@@ -204,4 +213,34 @@ uint64_t pci_get_bar_size(pci_device_t* dev, int bar_index);
 // Check if a BAR is I/O or memory
 int pci_bar_is_io(pci_device_t* dev, int bar_index);
 
+// ---- Message-Signalled Interrupts ----
+
+// Config space offset of a capability, or 0 if the device lacks it
+uint8_t pci_find_capability(pci_device_t* dev, uint8_t cap_id);
+
+// Number of MSI-X table entries (0 = no MSI-X)
+int pci_msix_count(pci_device_t* dev);
+
+// Point MSI-X table entry 'entry' at vector on the LAPIC apic_id, unmask
+// it and enable MSI-X (which turns off INTx). Returns 0 or -1.
+int pci_msix_set(pci_device_t* dev, int entry, uint8_t vector, uint8_t apic_id);
+
+// Enable single-message MSI for vector on apic_id. Returns 0 or -1.
+int pci_msi_enable(pci_device_t* dev, uint8_t vector, uint8_t apic_id);
+
+// Mask or unmask one MSI-X table entry
+void pci_msix_mask(pci_device_t* dev, int entry, int masked);
+
+// Give interrupt source 'entry' (an MSI-X table entry; 0 for a device
+// with MSI only) its own vector running fn(ctx), delivered to the LAPIC
+// apic_id. Returns the vector, or -1 if the device has no such source or
+// no vector is free.
+int pci_irq_alloc(pci_device_t* dev, int entry, isr_msi_fn fn, void* ctx, uint8_t apic_id);
+
+// Move an allocated source to another CPU's LAPIC. Returns 0 or -1.
+int pci_irq_set_affinity(pci_device_t* dev, int entry, uint8_t vector, uint8_t apic_id);
+
+// Silence a source and free its vector
+void pci_irq_free(pci_device_t* dev, int entry, int vector);
+
 #endif
@@ -0,0 +1,55 @@
+// pcm.c - SIMD PCM Kernels for Alteo OS
+#include "pcm.h"
+#include "smp.h"
+
+typedef int16_t v8s_u __attribute__((vector_size(16), aligned(2)));  // Unaligned
+
+// ============================================================
+// SSE State
+// ============================================================
+
+// FXSAVE area per CPU; see pixel.c. Interrupts stay off in between, so
+// nothing else on this CPU can be using it.
+static uint8_t fx_area[SMP_MAX_CPUS][512] __attribute__((aligned(16)));
+
+static uint64_t simd_begin(uint8_t** area) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    *area = fx_area[smp_cpu_id()];
+    __asm__ volatile("fxsave (%0)" :: "r"(*area) : "memory");
+    return flags;
+}
+
+static void simd_end(uint8_t* area, uint64_t flags) {
+    __asm__ volatile("fxrstor (%0)" :: "r"(area) : "memory");
+    if (flags & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+}
+
+// ============================================================
+// Band Kernels (run between simd_begin and simd_end)
+// ============================================================
+
+static __attribute__((noinline))
+void mix_band(int16_t* acc, const int16_t* src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        *(v8s_u*)&acc[i] = __builtin_ia32_paddsw128(*(v8s_u*)&acc[i], *(const v8s_u*)&src[i]);
+    for (; i < n; i++) {
+        int v = acc[i] + src[i];
+        acc[i] = (int16_t)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+    }
+}
+
+// ============================================================
+// Public API
+// ============================================================
+
+void pcm_mix(int16_t* acc, const int16_t* src, int n) {
+    for (int i = 0; i < n; i += PCM_BAND_SAMPLES) {
+        int len = n - i < PCM_BAND_SAMPLES ? n - i : PCM_BAND_SAMPLES;
+        uint8_t* area;
+        uint64_t flags = simd_begin(&area);
+        mix_band(acc + i, src + i, len);
+        simd_end(area, flags);
+    }
+}
@@ -0,0 +1,18 @@
+// pcm.h - SIMD PCM Kernels for Alteo OS
+// Operations on signed 16-bit samples, eight per SSE2 operation.
+//
+// pcm.c is built with SSE enabled. Like pixel.c, each call saves the
+// CPU's SSE state and runs with interrupts off (a band of samples at a
+// time), so these are safe to call from the -mno-sse parts of the kernel.
+#ifndef PCM_H
+#define PCM_H
+
+#include "stdint.h"
+
+// Samples processed per save/cli section; bounds interrupt latency
+#define PCM_BAND_SAMPLES 4096
+
+// acc[i] += src[i] for n samples, saturating at the int16 limits
+void pcm_mix(int16_t* acc, const int16_t* src, int n);
+
+#endif
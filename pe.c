@@ -1,23 +1,18 @@
 // pe.c - PE (Portable Executable) Loader for Alteo OS
 // Parses PE/PE32+ binaries and maps sections into process address spaces
 #include "pe.h"
+#include "klib.h"
 #include "vmm.h"
 #include "pmm.h"
 #include "vfs.h"
+#include "heap.h"
+#include "pagecache.h"
+#include "process.h"
+#include "syscall.h"
+#include "vdso.h"
 
 // ---------- Helpers ----------
 
-static void pe_memset(void* ptr, int val, uint64_t size) {
-    uint8_t* p = (uint8_t*)ptr;
-    for (uint64_t i = 0; i < size; i++) p[i] = (uint8_t)val;
-}
-
-static void pe_memcpy(void* dst, const void* src, uint64_t size) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (uint64_t i = 0; i < size; i++) d[i] = s[i];
-}
-
 // Convert PE section characteristics to VMM page flags
 static uint64_t pe_flags_to_vmm(uint32_t characteristics) {
     uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_USER;
@@ -119,7 +114,7 @@ static int pe_apply_relocations(const void* data, uint64_t size,
 int pe_load(const void* data, uint64_t size, pte_t* pml4, pe_load_result_t* result) {
     if (!data || !pml4 || !result) return -1;
 
-    pe_memset(result, 0, sizeof(pe_load_result_t));
+    memset(result, 0, sizeof(pe_load_result_t));
 
     // Validate PE header
     if (!pe_validate(data, size)) return -1;
@@ -151,7 +146,7 @@ int pe_load(const void* data, uint64_t size, pte_t* pml4, pe_load_result_t* resu
     for (uint64_t page = page_start; page < page_end; page += VMM_PAGE_SIZE) {
         void* phys = pmm_alloc_block();
         if (!phys) return -1;
-        pe_memset(phys, 0, VMM_PAGE_SIZE);
+        memset(phys, 0, VMM_PAGE_SIZE);
         if (vmm_map_page(pml4, page, (uint64_t)phys,
                          VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER) < 0) {
             pmm_free_block(phys);
@@ -162,7 +157,7 @@ int pe_load(const void* data, uint64_t size, pte_t* pml4, pe_load_result_t* resu
     // Copy PE headers to the base address
     uint32_t headers_size = opt->size_of_headers;
     if (headers_size > size) headers_size = (uint32_t)size;
-    pe_memcpy((void*)actual_base, file, headers_size);
+    memcpy((void*)actual_base, file, headers_size);
 
     // Copy sections
     uint64_t sections_offset = opt_offset + coff->size_of_optional_header;
@@ -179,13 +174,13 @@ int pe_load(const void* data, uint64_t size, pte_t* pml4, pe_load_result_t* resu
         // Copy raw data if present
         if (sec_rawsize > 0 && sec_rawptr > 0) {
             if ((uint64_t)sec_rawptr + sec_rawsize <= size) {
-                pe_memcpy((void*)sec_va, file + sec_rawptr, sec_rawsize);
+                memcpy((void*)sec_va, file + sec_rawptr, sec_rawsize);
             }
         }
 
         // Zero remaining bytes (BSS-like region within section)
         if (sec->virtual_size > sec_rawsize) {
-            pe_memset((void*)(sec_va + sec_rawsize), 0,
+            memset((void*)(sec_va + sec_rawsize), 0,
                       sec->virtual_size - sec_rawsize);
         }
     }
@@ -201,36 +196,600 @@ int pe_load(const void* data, uint64_t size, pte_t* pml4, pe_load_result_t* resu
     return 0;
 }
 
-int pe_load_from_fd(int fd, pte_t* pml4, pe_load_result_t* result) {
-    if (fd < 0 || !pml4 || !result) return -1;
+// ---------- Image cache ----------
+
+// A PE file prepared for one load address; its pages live in pe_space
+typedef struct {
+    vfs_node_t* node;
+    uint32_t modified;          // node->modified when parsed
+    uint64_t base;              // Load address the pages are relocated for
+    int      refs;              // Modules mapping it
+    int      in_use;
+    uint64_t image_base;        // Preferred base
+    uint32_t size_of_image;
+    uint32_t size_of_headers;
+    uint32_t section_alignment;
+    uint32_t entry;             // Entry point RVA
+    uint16_t characteristics;
+    pe_data_dir_t dirs[PE_NUM_DIRS];
+    pe_section_header_t* sections;
+    int      nsections;
+} pe_image_t;
+
+typedef struct {
+    int      image;             // Index into pe_images
+    uint64_t thunks;            // Address of its import thunks (0 if none)
+    char     name[PE_MAX_NAME]; // File name, for matching imports
+} pe_module_t;
+
+// Modules of one process slot; [0] is the EXE
+typedef struct {
+    int         count;
+    uint64_t    next_thunk;     // Where the next module's thunks go
+    pe_module_t mods[PE_MAX_MODULES];
+} pe_map_t;
+
+static pe_image_t pe_images[PE_MAX_IMAGES];
+static pe_map_t   pe_maps[MAX_PROCESSES];
+static int        pe_space = -1;
+
+// Shared tail of a module's thunks, entered with the import index pushed:
+// pushes the module slot (patched in at offset 1), saves what the syscall
+// clobbers, resolves, and returns into the target
+static const uint8_t pe_resolver_code[] = {
+    0x68, 0x00, 0x00, 0x00, 0x00,           // push slot
+    0x50, 0x51, 0x52, 0x56, 0x57,           // push rax, rcx, rdx, rsi, rdi
+    0x41, 0x50, 0x41, 0x51, 0x41, 0x52,     // push r8, r9, r10
+    0x41, 0x53, 0x41, 0x57,                 // push r11, r15
+    0x48, 0x8B, 0x7C, 0x24, 0x50,           // mov rdi, [rsp+80]   (module slot)
+    0x48, 0x8B, 0x74, 0x24, 0x58,           // mov rsi, [rsp+88]   (import index)
+    0xB8, SYS_PE_RESOLVE, 0x00, 0x00, 0x00, // mov eax, SYS_PE_RESOLVE
+    0x0F, 0x05,                             // syscall
+    0x48, 0x89, 0x44, 0x24, 0x58,           // mov [rsp+88], rax   (target)
+    0x41, 0x5F, 0x41, 0x5B,                 // pop r15, r11
+    0x41, 0x5A, 0x41, 0x59, 0x41, 0x58,     // pop r10, r9, r8
+    0x5F, 0x5E, 0x5A, 0x59, 0x58,           // pop rdi, rsi, rdx, rcx, rax
+    0x48, 0x83, 0xC4, 0x08,                 // add rsp, 8
+    0xC3                                    // ret                 (to the target)
+};
+
+// Copy len bytes at offset off of node's file (past the end reads as zeros)
+static void pe_file_read(vfs_node_t* node, uint64_t off, void* buf, uint64_t len) {
+    uint8_t* dst = (uint8_t*)buf;
+    while (len) {
+        uint64_t in = off & (VFS_PAGE_SIZE - 1);
+        uint64_t n = VFS_PAGE_SIZE - in;
+        if (n > len) n = len;
+        const uint8_t* page = off < node->size
+            ? vfs_node_page(node, (uint32_t)(off / VFS_PAGE_SIZE), 0) : 0;
+        if (page) memcpy(dst, page + in, n);
+        else memset(dst, 0, n);
+        dst += n;
+        off += n;
+        len -= n;
+    }
+}
+
+// Unrelocated image bytes at rva: headers, section data, zeros elsewhere
+static void pe_raw_read(const pe_image_t* img, uint32_t rva, void* buf, uint32_t len) {
+    uint8_t* dst = (uint8_t*)buf;
+    memset(dst, 0, len);
+    uint64_t end = (uint64_t)rva + len;
+
+    if (rva < img->size_of_headers) {
+        uint32_t n = img->size_of_headers - rva;
+        if (n > len) n = len;
+        pe_file_read(img->node, rva, dst, n);
+    }
+    for (int i = 0; i < img->nsections; i++) {
+        const pe_section_header_t* sec = &img->sections[i];
+        uint32_t raw = sec->size_of_raw_data;
+        if (sec->virtual_size && sec->virtual_size < raw) raw = sec->virtual_size;
+        uint64_t lo = sec->virtual_address > rva ? sec->virtual_address : rva;
+        uint64_t hi = (uint64_t)sec->virtual_address + raw;
+        if (hi > end) hi = end;
+        if (!sec->pointer_to_raw_data || lo >= hi) continue;
+        pe_file_read(img->node, sec->pointer_to_raw_data + (lo - sec->virtual_address),
+                     dst + (lo - rva), hi - lo);
+    }
+}
+
+// Apply the base relocations that land in the page at rva. A DIR64 may
+// start on the page before and run into this one.
+static void pe_relocate_page(const pe_image_t* img, uint32_t rva, uint8_t* page) {
+    const pe_data_dir_t* dir = &img->dirs[PE_DIR_BASERELOC];
+    uint64_t delta = img->base - img->image_base;
+    uint16_t entries[256];
+    uint32_t off = 0;
+
+    while (off + sizeof(pe_reloc_block_t) <= dir->size) {
+        pe_reloc_block_t block;
+        pe_raw_read(img, dir->virtual_address + off, &block, sizeof(block));
+        if (block.block_size < sizeof(block)) break;
+
+        if (block.page_rva + VMM_PAGE_SIZE + 8 > rva && block.page_rva < rva + VMM_PAGE_SIZE) {
+            uint32_t count = (block.block_size - sizeof(block)) / 2;
+            for (uint32_t first = 0; first < count; first += 256) {
+                uint32_t n = count - first < 256 ? count - first : 256;
+                pe_raw_read(img, dir->virtual_address + off + sizeof(block) + first * 2,
+                            entries, n * 2);
+                for (uint32_t i = 0; i < n; i++) {
+                    if ((entries[i] >> 12) != PE_REL_DIR64) continue;
+                    uint32_t target = block.page_rva + (entries[i] & 0xFFF);
+                    if (target + 8 <= rva || target >= rva + VMM_PAGE_SIZE) continue;
+                    uint64_t value;
+                    pe_raw_read(img, target, &value, sizeof(value));
+                    value += delta;
+                    for (uint32_t b = 0; b < 8; b++) {
+                        uint32_t at = target + b;
+                        if (at >= rva && at < rva + VMM_PAGE_SIZE) page[at - rva] = ((uint8_t*)&value)[b];
+                    }
+                }
+            }
+        }
+        off += block.block_size;
+    }
+}
 
-    pe_memset(result, 0, sizeof(pe_load_result_t));
+static int pe_readpage(void* owner, uint64_t object, uint32_t index, void* page) {
+    (void)owner;
+    const pe_image_t* img = &pe_images[object];
+    uint32_t rva = index * VMM_PAGE_SIZE;
+    pe_raw_read(img, rva, page, VMM_PAGE_SIZE);
+    if (img->base != img->image_base) pe_relocate_page(img, rva, (uint8_t*)page);
+    return 0;
+}
 
-    // Read file size
-    int old_pos = vfs_tell(fd);
-    vfs_seek(fd, 0, VFS_SEEK_END);
-    int file_size = vfs_tell(fd);
-    vfs_seek(fd, 0, VFS_SEEK_SET);
+static const pagecache_ops_t pe_cache_ops = { pe_readpage, 0, 0, 0 };
+
+// Mappings take a reference on the cache's frame (see pagecache_page_t)
+static void* pe_pager_get_page(void* object, uint64_t index, int write) {
+    pe_image_t* img = (pe_image_t*)object;
+    (void)write;
+    if (index >= ((uint64_t)img->size_of_image + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE) return 0;
+    pagecache_page_t* p = pagecache_get(pe_space, (uint64_t)(img - pe_images), (uint32_t)index, 0);
+    if (!p) return 0;
+    void* frame = p->data;
+    pmm_page_ref(frame);
+    pagecache_put(p);
+    return frame;
+}
 
-    if (file_size <= 0 || file_size > 4 * 1024 * 1024) return -1;
+static const vmm_pager_t pe_pager = { pe_pager_get_page };
 
-    // Allocate temporary buffer
-    void* buf = pmm_alloc_block();
-    if (!buf) return -1;
+// Read node's headers into img (not yet in the table)
+static int pe_parse(pe_image_t* img, vfs_node_t* node) {
+    uint8_t* hdr = (uint8_t*)kmalloc(VMM_PAGE_SIZE);
+    if (!hdr) return -1;
+    uint32_t n = node->size < VMM_PAGE_SIZE ? node->size : VMM_PAGE_SIZE;
+    pe_file_read(node, 0, hdr, n);
+    int ret = -1;
+    if (!pe_validate(hdr, n)) goto out;
 
-    int bytes_to_read = file_size;
-    if (bytes_to_read > (int)VMM_PAGE_SIZE) bytes_to_read = (int)VMM_PAGE_SIZE;
+    const pe_dos_header_t* dos = (const pe_dos_header_t*)hdr;
+    uint64_t coff_offset = dos->e_lfanew + 4;
+    const pe_coff_header_t* coff = (const pe_coff_header_t*)(hdr + coff_offset);
+    uint64_t opt_offset = coff_offset + sizeof(pe_coff_header_t);
+    const pe_opt_header_64_t* opt = (const pe_opt_header_64_t*)(hdr + opt_offset);
+
+    memset(img, 0, sizeof(*img));
+    img->node = node;
+    img->modified = node->modified;
+    img->image_base = opt->image_base;
+    img->size_of_image = opt->size_of_image;
+    img->size_of_headers = opt->size_of_headers;
+    img->section_alignment = opt->section_alignment;
+    img->entry = opt->address_of_entry_point;
+    img->characteristics = coff->characteristics;
+    uint32_t ndirs = opt->number_of_rva_and_sizes < PE_NUM_DIRS ? opt->number_of_rva_and_sizes : PE_NUM_DIRS;
+    for (uint32_t i = 0; i < ndirs; i++) img->dirs[i] = opt->data_directory[i];
+    if (img->image_base & (VMM_PAGE_SIZE - 1) || !img->size_of_image) goto out;
+
+    img->nsections = coff->number_of_sections;
+    img->sections = (pe_section_header_t*)kmalloc((uint64_t)img->nsections * sizeof(pe_section_header_t) + 1);
+    if (!img->sections) goto out;
+    pe_file_read(node, opt_offset + coff->size_of_optional_header, img->sections,
+                 (uint64_t)img->nsections * sizeof(pe_section_header_t));
+    ret = 0;
+
+out:
+    kfree(hdr);
+    return ret;
+}
 
-    int n = vfs_read(fd, buf, bytes_to_read);
-    if (n <= 0) {
-        pmm_free_block(buf);
+// Table entry for (node, base), taking over parsed's sections if a new
+// one is made. Unused entries stay cached until their slot is wanted.
+static int pe_image_get(pe_image_t* parsed, uint64_t base) {
+    vfs_node_t* node = parsed->node;
+    int free_idx = -1, idle_idx = -1;
+    for (int i = 0; i < PE_MAX_IMAGES; i++) {
+        pe_image_t* img = &pe_images[i];
+        if (img->in_use && img->node == node && img->modified == node->modified && img->base == base) {
+            kfree(parsed->sections);
+            return i;
+        }
+        if (!img->in_use) { if (free_idx < 0) free_idx = i; }
+        else if (!img->refs && idle_idx < 0) idle_idx = i;
+    }
+    if (free_idx < 0) free_idx = idle_idx;
+    if (free_idx < 0) {
+        kfree(parsed->sections);
         return -1;
     }
 
-    vfs_seek(fd, old_pos, VFS_SEEK_SET);
+    pe_image_t* img = &pe_images[free_idx];
+    if (img->in_use) {
+        pagecache_invalidate(pe_space, (uint64_t)free_idx);
+        kfree(img->sections);
+    }
+    *img = *parsed;
+    img->base = base;
+    img->refs = 0;
+    img->in_use = 1;
+    return free_idx;
+}
 
-    int ret = pe_load(buf, (uint64_t)n, pml4, result);
-    pmm_free_block(buf);
+// ---------- Modules ----------
 
-    return ret;
+static pe_map_t* pe_map_for(int pid) {
+    process_t* p = process_get(pid);
+    return p ? &pe_maps[p - process_get_table()] : 0;
+}
+
+static int pe_range_free(int pid, pte_t* pml4, uint64_t start, uint64_t size) {
+    if (start < VMM_USER_BASE || start + size < start || start + size > PE_THUNK_BASE) return 0;
+    for (uint64_t a = start; a < start + size; a += VMM_PAGE_SIZE) {
+        if (vmm_vma_find(pid, a) || vmm_get_physical(pml4, a)) return 0;
+    }
+    return 1;
+}
+
+// Preferred base if free, else the first free PE_ALT_BASE slot (always
+// the same one for the same address space layout, so the relocated pages
+// cached for it are found again). 0 if there is none.
+static uint64_t pe_choose_base(int pid, pte_t* pml4, const pe_image_t* img) {
+    uint64_t size = ((uint64_t)img->size_of_image + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    if (pe_range_free(pid, pml4, img->image_base, size)) return img->image_base;
+    if ((img->characteristics & PE_CHAR_RELOCS_STRIPPED) || !img->dirs[PE_DIR_BASERELOC].size) return 0;
+    if (size > PE_ALT_STRIDE) return 0;
+    for (int k = 0; k < PE_ALT_SLOTS; k++) {
+        uint64_t base = PE_ALT_BASE + (uint64_t)k * PE_ALT_STRIDE;
+        if (pe_range_free(pid, pml4, base, size)) return base;
+    }
+    return 0;
+}
+
+// Whether [rva, rva+len) overlaps an import address table, which the
+// loader writes
+static int pe_holds_iat(const pe_image_t* img, uint32_t rva, uint32_t len) {
+    const pe_data_dir_t* iat = &img->dirs[PE_DIR_IAT];
+    if (iat->size && iat->virtual_address < rva + len && iat->virtual_address + iat->size > rva) return 1;
+    const pe_data_dir_t* imp = &img->dirs[PE_DIR_IMPORT];
+    for (uint32_t off = 0; off + sizeof(pe_import_dir_t) <= imp->size; off += sizeof(pe_import_dir_t)) {
+        pe_import_dir_t d;
+        pe_raw_read(img, imp->virtual_address + off, &d, sizeof(d));
+        if (!d.name_rva) break;
+        if (d.import_address_table_rva >= rva && d.import_address_table_rva < rva + len) return 1;
+    }
+    return 0;
+}
+
+// Reserve the image's VMAs at its base: the headers read-only and each
+// section with its own permissions, or the whole image read-write when
+// sections are not page aligned
+static int pe_map_image(int pid, pe_image_t* img) {
+    uint64_t base = img->base;
+    uint64_t size = ((uint64_t)img->size_of_image + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    uint64_t rw = VMM_FLAG_PRESENT | VMM_FLAG_USER | VMM_FLAG_WRITABLE;
+
+    if (img->section_alignment < VMM_PAGE_SIZE || (img->section_alignment & (VMM_PAGE_SIZE - 1))) {
+        return vmm_vma_reserve_file(pid, base, size, rw, &pe_pager, img, 0);
+    }
+
+    uint64_t hdr = ((uint64_t)img->size_of_headers + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    if (hdr && vmm_vma_reserve_file(pid, base, hdr, pe_flags_to_vmm(0), &pe_pager, img, 0) < 0) return -1;
+    for (int i = 0; i < img->nsections; i++) {
+        const pe_section_header_t* sec = &img->sections[i];
+        uint64_t len = sec->virtual_size ? sec->virtual_size : sec->size_of_raw_data;
+        len = (len + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+        if (!len || sec->virtual_address < hdr || sec->virtual_address + len > size) continue;
+        uint64_t flags = pe_flags_to_vmm(sec->characteristics);
+        if (pe_holds_iat(img, sec->virtual_address, (uint32_t)len)) flags |= VMM_FLAG_WRITABLE;
+        if (vmm_vma_reserve_file(pid, base + sec->virtual_address, len, flags, &pe_pager, img,
+                                 sec->virtual_address / VMM_PAGE_SIZE) < 0) return -1;
+    }
+    return 0;
+}
+
+static char pe_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// DLL names match case-insensitively
+static int pe_name_eq(const char* a, const char* b) {
+    while (*a && pe_lower(*a) == pe_lower(*b)) { a++; b++; }
+    return *a == *b;
+}
+
+// NUL-terminated string at rva (-1 if longer than PE_MAX_NAME)
+static int pe_read_str(const pe_image_t* img, uint32_t rva, char* buf) {
+    pe_raw_read(img, rva, buf, PE_MAX_NAME);
+    for (int i = 0; i < PE_MAX_NAME; i++) if (!buf[i]) return 0;
+    return -1;
+}
+
+// Write into process memory, taking private copies of shared pages
+static int pe_poke(int pid, pte_t* pml4, uint64_t addr, uint64_t value) {
+    for (int b = 0; b < 8; b++) {
+        uint8_t* mem = vmm_vma_touch(pid, pml4, addr + b, 1);
+        if (!mem) return -1;
+        *mem = (uint8_t)(value >> (b * 8));
+    }
+    return 0;
+}
+
+// Place len bytes of code on fresh read-only user pages at addr
+static int pe_map_code(pte_t* pml4, uint64_t addr, const uint8_t* code, uint64_t len) {
+    for (uint64_t off = 0; off < len; off += VMM_PAGE_SIZE) {
+        uint8_t* frame = (uint8_t*)pmm_alloc_block();
+        if (!frame) return -1;
+        uint64_t n = len - off < VMM_PAGE_SIZE ? len - off : VMM_PAGE_SIZE;
+        memset(frame, 0xCC, VMM_PAGE_SIZE);   // int3 past the code
+        memcpy(frame, code + off, n);
+        if (vmm_map_page(pml4, addr + off, (uint64_t)frame, VMM_FLAG_PRESENT | VMM_FLAG_USER) < 0) {
+            pmm_free_block(frame);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int pe_load_module(pe_map_t* m, int pid, pte_t* pml4, vfs_node_t* node, const char* name);
+
+// Slot of DLL name in the process, loading it from PE_DLL_DIR first if needed
+static int pe_find_dll(pe_map_t* m, int pid, pte_t* pml4, const char* name) {
+    for (int j = 0; j < m->count; j++) {
+        if (pe_name_eq(m->mods[j].name, name)) return j;
+    }
+    char path[VFS_MAX_PATH];
+    int n = 0;
+    for (const char* c = PE_DLL_DIR; *c; c++) path[n++] = *c;
+    for (const char* c = name; *c && n < VFS_MAX_PATH - 1; c++) path[n++] = *c;
+    path[n] = 0;
+    int fd = vfs_open(path, VFS_O_RDONLY);
+    if (fd < 0) {
+        // Windows names are case-insensitive; files here usually lower case
+        for (int i = (int)sizeof(PE_DLL_DIR) - 1; i < n; i++) path[i] = pe_lower(path[i]);
+        fd = vfs_open(path, VFS_O_RDONLY);
+        if (fd < 0) return -1;
+    }
+    int slot = pe_load_module(m, pid, pml4, vfs_fd_node(fd), name);
+    vfs_close(fd);
+    return slot;
+}
+
+// Load the DLLs module slot imports and point its IAT at a thunk per import
+static int pe_bind_imports(pe_map_t* m, int slot, int pid, pte_t* pml4) {
+    const pe_image_t* img = &pe_images[m->mods[slot].image];
+    const pe_data_dir_t* imp = &img->dirs[PE_DIR_IMPORT];
+
+    // Count the imports, loading each DLL on the way
+    uint32_t total = 0;
+    for (uint32_t off = 0; off + sizeof(pe_import_dir_t) <= imp->size; off += sizeof(pe_import_dir_t)) {
+        pe_import_dir_t d;
+        pe_raw_read(img, imp->virtual_address + off, &d, sizeof(d));
+        if (!d.name_rva) break;
+        char dll[PE_MAX_NAME];
+        if (pe_read_str(img, d.name_rva, dll) < 0) return -1;
+        if (pe_find_dll(m, pid, pml4, dll) < 0) return -1;
+        uint32_t lookup = d.import_lookup_table_rva ? d.import_lookup_table_rva : d.import_address_table_rva;
+        for (uint32_t k = 0;; k++) {
+            uint64_t entry;
+            pe_raw_read(img, lookup + k * 8, &entry, sizeof(entry));
+            if (!entry) break;
+            total++;
+        }
+    }
+    if (!total) return 0;
+
+    // Resolver followed by one push/jmp thunk per import
+    uint64_t len = sizeof(pe_resolver_code) + (uint64_t)total * PE_THUNK_SIZE;
+    uint64_t pages = (len + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    uint8_t* code = (uint8_t*)kmalloc(len);
+    if (!code) return -1;
+    memcpy(code, pe_resolver_code, sizeof(pe_resolver_code));
+    *(uint32_t*)(code + 1) = (uint32_t)slot;
+    for (uint32_t i = 0; i < total; i++) {
+        uint8_t* t = code + sizeof(pe_resolver_code) + i * PE_THUNK_SIZE;
+        int32_t rel = -(int32_t)(sizeof(pe_resolver_code) + (i + 1) * PE_THUNK_SIZE);
+        t[0] = 0x68;                                // push i
+        *(uint32_t*)(t + 1) = i;
+        t[5] = 0xE9;                                // jmp resolver
+        *(int32_t*)(t + 6) = rel;
+    }
+    uint64_t thunks = m->next_thunk;
+    int r = pe_map_code(pml4, thunks, code, len);
+    kfree(code);
+    if (r < 0) return -1;
+    m->next_thunk += pages;
+    m->mods[slot].thunks = thunks;
+
+    uint32_t i = 0;
+    for (uint32_t off = 0; off + sizeof(pe_import_dir_t) <= imp->size; off += sizeof(pe_import_dir_t)) {
+        pe_import_dir_t d;
+        pe_raw_read(img, imp->virtual_address + off, &d, sizeof(d));
+        if (!d.name_rva) break;
+        uint32_t lookup = d.import_lookup_table_rva ? d.import_lookup_table_rva : d.import_address_table_rva;
+        for (uint32_t k = 0;; k++, i++) {
+            uint64_t entry;
+            pe_raw_read(img, lookup + k * 8, &entry, sizeof(entry));
+            if (!entry) break;
+            uint64_t thunk = thunks + sizeof(pe_resolver_code) + (uint64_t)i * PE_THUNK_SIZE;
+            if (pe_poke(pid, pml4, img->base + d.import_address_table_rva + k * 8, thunk) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Map node as a new module of the process and bind its imports. Returns
+// its slot, or -1.
+static int pe_load_module(pe_map_t* m, int pid, pte_t* pml4, vfs_node_t* node, const char* name) {
+    if (!node || node->type != VFS_FILE || m->count == PE_MAX_MODULES) return -1;
+    if (pe_space < 0) {
+        pe_space = pagecache_register(&pe_cache_ops, 0);
+        if (pe_space < 0) return -1;
+    }
+
+    pe_image_t parsed;
+    if (pe_parse(&parsed, node) < 0) return -1;
+    uint64_t base = pe_choose_base(pid, pml4, &parsed);
+    if (!base) {
+        kfree(parsed.sections);
+        return -1;
+    }
+    int image = pe_image_get(&parsed, base);
+    if (image < 0) return -1;
+    if (pe_map_image(pid, &pe_images[image]) < 0) return -1;
+
+    int slot = m->count++;
+    pe_module_t* mod = &m->mods[slot];
+    mod->image = image;
+    mod->thunks = 0;
+    int n = 0;
+    for (const char* c = name; *c && n < PE_MAX_NAME - 1; c++) mod->name[n++] = *c;
+    mod->name[n] = 0;
+    pe_images[image].refs++;
+
+    if (pe_bind_imports(m, slot, pid, pml4) < 0) return -1;
+    return slot;
+}
+
+int pe_load_from_fd(int fd, int pid, pte_t* pml4, pe_load_result_t* result) {
+    if (fd < 0 || !pml4 || !result) return -1;
+
+    memset(result, 0, sizeof(pe_load_result_t));
+
+    pe_map_t* m = pe_map_for(pid);
+    if (!m) return -1;
+    pe_release(pid);
+    m->next_thunk = PE_THUNK_BASE;
+
+    if (pe_load_module(m, pid, pml4, vfs_fd_node(fd), "") < 0) return -1;
+
+    const pe_image_t* img = &pe_images[m->mods[0].image];
+    result->image_base = img->base;
+    result->image_size = img->size_of_image;
+    result->entry_point = img->base + img->entry;
+    result->is_dll = (img->characteristics & PE_CHAR_DLL) ? 1 : 0;
+    result->success = 1;
+    vdso_map(pml4, pid);
+    return 0;
+}
+
+// ---------- Lazy import binding ----------
+
+// Address of export name (or ordinal, if name is 0) of img
+static uint64_t pe_lookup_export(const pe_image_t* img, const char* name, uint32_t ordinal) {
+    const pe_data_dir_t* dir = &img->dirs[PE_DIR_EXPORT];
+    if (!dir->size) return 0;
+    pe_export_dir_t exp;
+    pe_raw_read(img, dir->virtual_address, &exp, sizeof(exp));
+
+    uint32_t index;
+    if (name) {
+        // Names are sorted: binary search
+        uint32_t lo = 0, hi = exp.number_of_names;
+        for (;;) {
+            if (lo >= hi) return 0;
+            uint32_t mid = (lo + hi) / 2;
+            uint32_t rva;
+            char buf[PE_MAX_NAME];
+            pe_raw_read(img, exp.address_of_names + mid * 4, &rva, sizeof(rva));
+            if (pe_read_str(img, rva, buf) < 0) return 0;
+            const char* a = name;
+            const char* b = buf;
+            while (*a && *a == *b) { a++; b++; }
+            int c = (uint8_t)*a - (uint8_t)*b;
+            if (c == 0) {
+                uint16_t ord;
+                pe_raw_read(img, exp.address_of_name_ordinals + mid * 2, &ord, sizeof(ord));
+                index = ord;
+                break;
+            }
+            if (c < 0) hi = mid;
+            else lo = mid + 1;
+        }
+    } else {
+        index = ordinal - exp.ordinal_base;
+    }
+    if (index >= exp.number_of_functions) return 0;
+
+    uint32_t rva;
+    pe_raw_read(img, exp.address_of_functions + index * 4, &rva, sizeof(rva));
+    // An RVA inside the export directory is a forwarder string
+    if (!rva || (rva >= dir->virtual_address && rva < dir->virtual_address + dir->size)) return 0;
+    return img->base + rva;
+}
+
+uint64_t pe_resolve(int mod, uint64_t index) {
+    int pid = process_get_pid();
+    pe_map_t* m = pe_map_for(pid);
+    if (!m || mod < 0 || mod >= m->count) return 0;
+    const pe_image_t* img = &pe_images[m->mods[mod].image];
+    const pe_data_dir_t* imp = &img->dirs[PE_DIR_IMPORT];
+
+    // Find the descriptor and entry holding import index
+    uint64_t i = 0;
+    for (uint32_t off = 0; off + sizeof(pe_import_dir_t) <= imp->size; off += sizeof(pe_import_dir_t)) {
+        pe_import_dir_t d;
+        pe_raw_read(img, imp->virtual_address + off, &d, sizeof(d));
+        if (!d.name_rva) break;
+        uint32_t lookup = d.import_lookup_table_rva ? d.import_lookup_table_rva : d.import_address_table_rva;
+        for (uint32_t k = 0;; k++, i++) {
+            uint64_t entry;
+            pe_raw_read(img, lookup + k * 8, &entry, sizeof(entry));
+            if (!entry) break;
+            if (i != index) continue;
+
+            char dll[PE_MAX_NAME];
+            if (pe_read_str(img, d.name_rva, dll) < 0) return 0;
+            int slot = -1;
+            for (int j = 0; j < m->count; j++) {
+                if (pe_name_eq(m->mods[j].name, dll)) { slot = j; break; }
+            }
+            if (slot < 0) return 0;
+            const pe_image_t* target = &pe_images[m->mods[slot].image];
+
+            uint64_t addr;
+            if (entry & PE_IMPORT_ORDINAL) {
+                addr = pe_lookup_export(target, 0, (uint32_t)(entry & 0xFFFF));
+            } else {
+                char sym[PE_MAX_NAME];
+                if (pe_read_str(img, (uint32_t)entry + 2, sym) < 0) return 0;   // Past the hint
+                addr = pe_lookup_export(target, sym, 0);
+            }
+            if (!addr) return 0;
+            // Later calls go straight to the target
+            if (pe_poke(pid, vmm_get_current_address_space(),
+                        img->base + d.import_address_table_rva + k * 8, addr) < 0) return 0;
+            return addr;
+        }
+    }
+    return 0;
+}
+
+void pe_fork(int parent_pid, int child_pid) {
+    pe_map_t* src = pe_map_for(parent_pid);
+    pe_map_t* dst = pe_map_for(child_pid);
+    if (!src || !dst) return;
+    pe_release(child_pid);
+    *dst = *src;
+    for (int i = 0; i < dst->count; i++) pe_images[dst->mods[i].image].refs++;
+}
+
+void pe_release(int pid) {
+    pe_map_t* m = pe_map_for(pid);
+    if (!m) return;
+    for (int i = 0; i < m->count; i++) pe_images[m->mods[i].image].refs--;
+    m->count = 0;
 }
@@ -14,6 +14,7 @@
 #define PE_MACHINE_AMD64    0x8664
 
 // PE characteristics
+#define PE_CHAR_RELOCS_STRIPPED 0x0001
 #define PE_CHAR_EXECUTABLE  0x0002
 #define PE_CHAR_LARGE_ADDR  0x0020
 #define PE_CHAR_DLL         0x2000
@@ -143,6 +144,24 @@ typedef struct {
     uint32_t import_address_table_rva;
 } __attribute__((packed)) pe_import_dir_t;
 
+// Export Directory Table
+typedef struct {
+    uint32_t characteristics;
+    uint32_t time_date_stamp;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint32_t name_rva;
+    uint32_t ordinal_base;
+    uint32_t number_of_functions;
+    uint32_t number_of_names;
+    uint32_t address_of_functions;      // RVA of uint32_t function RVAs
+    uint32_t address_of_names;          // RVA of uint32_t name RVAs (sorted)
+    uint32_t address_of_name_ordinals;  // RVA of uint16_t indices into functions
+} __attribute__((packed)) pe_export_dir_t;
+
+// Import lookup table entry: import by ordinal when set
+#define PE_IMPORT_ORDINAL   0x8000000000000000ULL
+
 // Base Relocation Block
 typedef struct {
     uint32_t page_rva;
@@ -165,7 +184,45 @@ int pe_validate(const void* data, uint64_t size);
 // Load a PE binary from a buffer into a process address space
 int pe_load(const void* data, uint64_t size, pte_t* pml4, pe_load_result_t* result);
 
-// Load a PE binary from a VFS file descriptor
-int pe_load_from_fd(int fd, pte_t* pml4, pe_load_result_t* result);
+// ---- Demand-paged loading ----
+// pe_load_from_fd() maps an image without reading it in. Its pages are
+// built once per (file, load address) into a page cache space: headers and
+// section data at their RVA, zero-filled past the raw data, with the base
+// relocations for the page applied if the image is not at its preferred
+// base. Processes map the cache's frames through VMAs (private: writable
+// sections are copied on write), so running the same .exe again costs
+// neither reading nor relocating it. Images load at their preferred base
+// whenever that range is free, else at the first free PE_ALT_BASE slot so
+// the relocated pages are reused too.
+//
+// Imported DLLs are loaded from PE_DLL_DIR the same way. Every IAT entry
+// first points at a 10-byte thunk (push index; jmp) on read-only pages at
+// PE_THUNK_BASE, leading to a resolver that makes SYS_PE_RESOLVE: the
+// export is looked up on the first call and the IAT entry patched.
+// Forwarded exports are not supported.
+
+#define PE_MAX_IMAGES       32          // (file, base) images cached
+#define PE_MAX_MODULES      16          // Images in one process (EXE + DLLs)
+#define PE_MAX_NAME         64          // Longest DLL or import name
+#define PE_ALT_BASE         0x200000000ULL  // Slots for images that cannot have their base
+#define PE_ALT_STRIDE       0x10000000ULL
+#define PE_ALT_SLOTS        16
+#define PE_THUNK_BASE       0x7FFE00000000ULL
+#define PE_THUNK_SIZE       10          // push imm32; jmp rel32
+#define PE_DLL_DIR          "/lib/"
+
+// Load a PE binary from a VFS file descriptor into process pid (whose
+// page table is pml4), with the DLLs it imports
+int pe_load_from_fd(int fd, int pid, pte_t* pml4, pe_load_result_t* result);
+
+// Bind import index of module slot mod of the current process: patch its
+// IAT entry and return the target (0 if it cannot be resolved)
+uint64_t pe_resolve(int mod, uint64_t index);
+
+// Give a forked child its parent's module list
+void pe_fork(int parent_pid, int child_pid);
+
+// Forget a process's modules (exec, exit)
+void pe_release(int pid);
 
 #endif
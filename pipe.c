@@ -1,10 +1,20 @@
 // pipe.c - Kernel Pipe Implementation for Alteo OS
-// Circular buffer pipes for IPC between processes
+// Each pipe is a ring of page-sized slots. Pages are allocated from the PMM
+// the first time a slot is written, so the capacity only costs memory once
+// it is used, and copies run a page segment at a time instead of per byte.
+// A whole, page-aligned user page written into an empty slot is shared into
+// the ring copy-on-write rather than copied.
 #include "pipe.h"
+#include "klib.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "waitq.h"
+#include "epoll.h"
 
-// Pipe structure with circular buffer
+// Pipe structure: ring of pages, positions are byte offsets in [0, size)
 typedef struct {
-    uint8_t  buf[PIPE_BUF_SIZE];
+    uint8_t* pages[PIPE_MAX_PAGES];  // Slot pages (0 until first written)
+    int      npages;         // Ring size in pages
     int      head;           // Write position
     int      tail;           // Read position
     int      count;          // Bytes in buffer
@@ -13,27 +23,113 @@ typedef struct {
     int      write_open;     // Is the write end open?
     int      readers;        // Number of read end references
     int      writers;        // Number of write end references
+    waitq_t  readq;          // Readers waiting for data or EOF
+    waitq_t  writeq;         // Writers waiting for space or a closed reader
+    pollsrc_t pollsrc;       // epoll registrations on either end
 } pipe_t;
 
 static pipe_t pipes[MAX_PIPES];
 static int pipe_initialized = 0;
 
 // ---- Helpers ----
-static void pipe_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
+static inline int pipe_size(pipe_t* p) {
+    return p->npages * PIPE_PAGE_SIZE;
 }
 
-static void pipe_memcpy(void* dst, const void* src, int n) {
-    unsigned char* d = (unsigned char*)dst;
-    const unsigned char* s = (const unsigned char*)src;
-    for (int i = 0; i < n; i++) d[i] = s[i];
+static void pipe_free_pages(pipe_t* p) {
+    for (int i = 0; i < PIPE_MAX_PAGES; i++) {
+        if (p->pages[i]) pmm_free_block(p->pages[i]);
+        p->pages[i] = 0;
+    }
+}
+
+static void pipe_reverse_slots(pipe_t* p, int from, int to) {
+    while (from < --to) {
+        uint8_t* t = p->pages[from];
+        p->pages[from++] = p->pages[to];
+        p->pages[to] = t;
+    }
+}
+
+// Page for slot, writable by the pipe: allocated on first use, and taken
+// private (like a COW fault) if it was gifted and the writer still maps it
+static uint8_t* pipe_slot_own(pipe_t* p, int slot) {
+    uint8_t* page = p->pages[slot];
+    if (page && pmm_page_refcount(page) <= 1) return page;
+    uint8_t* fresh = (uint8_t*)pmm_alloc_block();
+    if (!fresh) return 0;
+    if (page) {
+        memcpy(fresh, page, PIPE_PAGE_SIZE);
+        pmm_free_block(page);
+    }
+    p->pages[slot] = fresh;
+    return fresh;
+}
+
+// Replace an empty slot with the writer's own frame for the page at src.
+// The writer's mapping becomes copy-on-write, so later stores to its
+// buffer cannot change what the reader sees.
+static int pipe_slot_gift(pipe_t* p, int slot, const uint8_t* src) {
+    if ((uint64_t)src & (PIPE_PAGE_SIZE - 1)) return 0;
+    void* frame = vmm_share_page(vmm_get_current_address_space(), (uint64_t)src);
+    if (!frame) return 0;
+    if (p->pages[slot]) pmm_free_block(p->pages[slot]);
+    p->pages[slot] = (uint8_t*)frame;
+    return 1;
+}
+
+// Append n bytes (n <= free space) at head, one page segment at a time.
+// Returns the bytes stored (short only if a page could not be allocated).
+static int pipe_fill(pipe_t* p, const uint8_t* src, int n) {
+    int done = 0;
+    while (done < n) {
+        int slot = p->head / PIPE_PAGE_SIZE;
+        int off = p->head % PIPE_PAGE_SIZE;
+        int chunk = PIPE_PAGE_SIZE - off;
+        if (chunk > n - done) chunk = n - done;
+
+        if (chunk < PIPE_PAGE_SIZE || !pipe_slot_gift(p, slot, src + done)) {
+            uint8_t* page = pipe_slot_own(p, slot);
+            if (!page) break;
+            memcpy(page + off, src + done, chunk);
+        }
+        p->head = (p->head + chunk) % pipe_size(p);
+        p->count += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+// Remove n bytes (n <= count) from tail into dst
+static void pipe_drain(pipe_t* p, uint8_t* dst, int n) {
+    int done = 0;
+    while (done < n) {
+        int off = p->tail % PIPE_PAGE_SIZE;
+        int chunk = PIPE_PAGE_SIZE - off;
+        if (chunk > n - done) chunk = n - done;
+        memcpy(dst + done, p->pages[p->tail / PIPE_PAGE_SIZE] + off, chunk);
+        p->tail = (p->tail + chunk) % pipe_size(p);
+        p->count -= chunk;
+        done += chunk;
+    }
+}
+
+// ---- Wait conditions ----
+
+static int pipe_readable(void* arg) {
+    pipe_t* p = (pipe_t*)arg;
+    return p->state != PIPE_STATE_ACTIVE || p->count > 0 || !p->write_open;
+}
+
+static int pipe_writable(void* arg) {
+    pipe_t* p = (pipe_t*)arg;
+    return p->state != PIPE_STATE_ACTIVE || p->count < pipe_size(p) || !p->read_open;
 }
 
 // ---- Public API ----
 
 void pipe_init(void) {
-    pipe_memset(pipes, 0, sizeof(pipes));
+    memset(pipes, 0, sizeof(pipes));
     for (int i = 0; i < MAX_PIPES; i++) {
         pipes[i].state = PIPE_STATE_FREE;
     }
@@ -43,11 +139,12 @@ void pipe_init(void) {
 int pipe_create(void) {
     if (!pipe_initialized) return -1;
 
-    // Find a free pipe slot
+    // Find a free pipe slot (its pages were released when it was freed)
     for (int i = 0; i < MAX_PIPES; i++) {
         if (pipes[i].state == PIPE_STATE_FREE) {
-            pipe_memset(&pipes[i], 0, sizeof(pipe_t));
+            memset(&pipes[i], 0, sizeof(pipe_t));
             pipes[i].state = PIPE_STATE_ACTIVE;
+            pipes[i].npages = PIPE_DEF_PAGES;
             pipes[i].head = 0;
             pipes[i].tail = 0;
             pipes[i].count = 0;
@@ -81,8 +178,15 @@ void pipe_close(int pipe_idx, int end) {
         }
     }
 
-    // If both ends closed, free the pipe
+    // EOF for readers, EPIPE for writers
+    waitq_wake_all(&pipes[pipe_idx].readq);
+    waitq_wake_all(&pipes[pipe_idx].writeq);
+    pollsrc_notify(&pipes[pipe_idx].pollsrc);
+
+    // If both ends closed, free the pipe and its pages
     if (!pipes[pipe_idx].read_open && !pipes[pipe_idx].write_open) {
+        pollsrc_detach(&pipes[pipe_idx].pollsrc);
+        pipe_free_pages(&pipes[pipe_idx]);
         pipes[pipe_idx].state = PIPE_STATE_FREE;
     }
 }
@@ -94,28 +198,52 @@ int pipe_read(int pipe_idx, void* buf, int count) {
 
     pipe_t* p = &pipes[pipe_idx];
 
-    // If buffer is empty
-    if (p->count == 0) {
-        // If write end is closed, return 0 (EOF)
-        if (!p->write_open) return 0;
-        // Otherwise, no data available (would block in a real impl)
-        return 0;
-    }
+    // Sleep until there is data or the last writer is gone. The kernel
+    // process cannot block and gets 0 from an empty pipe.
+    waitq_wait(&p->readq, pipe_readable, p);
+    if (p->state != PIPE_STATE_ACTIVE) return -1;
+
+    // If buffer is empty, the write end is closed (EOF) or we could not block
+    if (p->count == 0) return 0;
 
-    // Read up to count bytes from the circular buffer
     int to_read = count;
     if (to_read > p->count) to_read = p->count;
+    pipe_drain(p, (uint8_t*)buf, to_read);
 
-    uint8_t* dst = (uint8_t*)buf;
-    for (int i = 0; i < to_read; i++) {
-        dst[i] = p->buf[p->tail];
-        p->tail = (p->tail + 1) % PIPE_BUF_SIZE;
-    }
-    p->count -= to_read;
-
+    waitq_wake_all(&p->writeq);
+    pollsrc_notify(&p->pollsrc);
     return to_read;
 }
 
+int pipe_peek(int pipe_idx, const uint8_t** data, int block) {
+    if (pipe_idx < 0 || pipe_idx >= MAX_PIPES) return -1;
+    if (pipes[pipe_idx].state != PIPE_STATE_ACTIVE || !data) return -1;
+
+    pipe_t* p = &pipes[pipe_idx];
+    if (block) waitq_wait(&p->readq, pipe_readable, p);
+    if (p->state != PIPE_STATE_ACTIVE) return -1;
+    if (p->count == 0) return 0;
+
+    // Bytes from the tail up to the end of its page (or of the data)
+    int off = p->tail % PIPE_PAGE_SIZE;
+    int n = PIPE_PAGE_SIZE - off;
+    if (n > p->count) n = p->count;
+    *data = p->pages[p->tail / PIPE_PAGE_SIZE] + off;
+    return n;
+}
+
+void pipe_consume(int pipe_idx, int count) {
+    if (pipe_idx < 0 || pipe_idx >= MAX_PIPES) return;
+    pipe_t* p = &pipes[pipe_idx];
+    if (p->state != PIPE_STATE_ACTIVE || count <= 0) return;
+    if (count > p->count) count = p->count;
+    p->tail = (p->tail + count) % pipe_size(p);
+    p->count -= count;
+
+    waitq_wake_all(&p->writeq);
+    pollsrc_notify(&p->pollsrc);
+}
+
 int pipe_write(int pipe_idx, const void* buf, int count) {
     if (pipe_idx < 0 || pipe_idx >= MAX_PIPES) return -1;
     if (pipes[pipe_idx].state != PIPE_STATE_ACTIVE) return -1;
@@ -123,23 +251,67 @@ int pipe_write(int pipe_idx, const void* buf, int count) {
 
     pipe_t* p = &pipes[pipe_idx];
 
-    // If read end is closed, writing would cause SIGPIPE
-    if (!p->read_open) return -1;
+    // Write all count bytes, sleeping whenever the buffer is full
+    const uint8_t* src = (const uint8_t*)buf;
+    int written = 0;
+    while (written < count) {
+        // If read end is closed, writing would cause SIGPIPE
+        if (!p->read_open) return written > 0 ? written : -1;
 
-    // Write up to count bytes, limited by available space
-    int space = PIPE_BUF_SIZE - p->count;
-    int to_write = count;
-    if (to_write > space) to_write = space;
-    if (to_write == 0) return 0; // Buffer full (would block)
+        int space = pipe_size(p) - p->count;
+        if (space == 0) {
+            // Buffer full: the kernel process cannot block, return what fit
+            if (waitq_wait(&p->writeq, pipe_writable, p) < 0) break;
+            if (p->state != PIPE_STATE_ACTIVE) return written > 0 ? written : -1;
+            continue;
+        }
 
-    const uint8_t* src = (const uint8_t*)buf;
-    for (int i = 0; i < to_write; i++) {
-        p->buf[p->head] = src[i];
-        p->head = (p->head + 1) % PIPE_BUF_SIZE;
+        int to_write = count - written;
+        if (to_write > space) to_write = space;
+        int n = pipe_fill(p, src + written, to_write);
+        written += n;
+        if (n > 0) {
+            waitq_wake_all(&p->readq);
+            pollsrc_notify(&p->pollsrc);
+        }
+        if (n < to_write) break;   // Out of pages
     }
-    p->count += to_write;
 
-    return to_write;
+    return written;
+}
+
+int pipe_set_size(int pipe_idx, int size) {
+    if (pipe_idx < 0 || pipe_idx >= MAX_PIPES) return -1;
+    pipe_t* p = &pipes[pipe_idx];
+    if (p->state != PIPE_STATE_ACTIVE || size <= 0 || size > PIPE_MAX_SIZE) return -1;
+
+    int npages = (size + PIPE_PAGE_SIZE - 1) / PIPE_PAGE_SIZE;
+    int off = p->tail % PIPE_PAGE_SIZE;
+    if (off + p->count > npages * PIPE_PAGE_SIZE) return -2;
+
+    // Rotate the slots so the tail's page comes first. The buffered bytes
+    // then run linearly from slot 0, whatever the new ring size.
+    int first = p->tail / PIPE_PAGE_SIZE;
+    pipe_reverse_slots(p, 0, first);
+    pipe_reverse_slots(p, first, p->npages);
+    pipe_reverse_slots(p, 0, p->npages);
+    for (int i = npages; i < PIPE_MAX_PAGES; i++) {
+        if (p->pages[i]) pmm_free_block(p->pages[i]);
+        p->pages[i] = 0;
+    }
+
+    p->npages = npages;
+    p->tail = off;
+    p->head = (off + p->count) % pipe_size(p);
+    waitq_wake_all(&p->writeq);
+    pollsrc_notify(&p->pollsrc);
+    return pipe_size(p);
+}
+
+int pipe_get_size(int pipe_idx) {
+    if (pipe_idx < 0 || pipe_idx >= MAX_PIPES) return -1;
+    if (pipes[pipe_idx].state != PIPE_STATE_ACTIVE) return -1;
+    return pipe_size(&pipes[pipe_idx]);
 }
 
 int pipe_available(int pipe_idx) {
@@ -152,3 +324,23 @@ int pipe_is_active(int pipe_idx) {
     if (pipe_idx < 0 || pipe_idx >= MAX_PIPES) return 0;
     return pipes[pipe_idx].state == PIPE_STATE_ACTIVE;
 }
+
+uint32_t pipe_poll(int pipe_idx, int end) {
+    if (pipe_idx < 0 || pipe_idx >= MAX_PIPES) return EPOLLERR;
+    pipe_t* p = &pipes[pipe_idx];
+    if (p->state != PIPE_STATE_ACTIVE) return EPOLLHUP;
+    uint32_t ev = 0;
+    if (end == 0) {
+        if (p->count > 0) ev |= EPOLLIN;
+        if (!p->write_open) ev |= EPOLLHUP;
+    } else {
+        if (!p->read_open) ev |= EPOLLERR;
+        else if (p->count < pipe_size(p)) ev |= EPOLLOUT;
+    }
+    return ev;
+}
+
+pollsrc_t* pipe_get_pollsrc(int pipe_idx) {
+    if (pipe_idx < 0 || pipe_idx >= MAX_PIPES) return (pollsrc_t*)0;
+    return &pipes[pipe_idx].pollsrc;
+}
@@ -4,9 +4,14 @@
 #define PIPE_H
 
 #include "stdint.h"
+#include "epoll.h"
 
 // Pipe configuration
-#define PIPE_BUF_SIZE    4096   // Size of pipe circular buffer
+#define PIPE_PAGE_SIZE   4096   // Ring slot size (one PMM page)
+#define PIPE_DEF_PAGES   16     // Slots in a new pipe
+#define PIPE_MAX_PAGES   256    // Largest ring pipe_set_size() accepts
+#define PIPE_BUF_SIZE    (PIPE_DEF_PAGES * PIPE_PAGE_SIZE)   // Default capacity
+#define PIPE_MAX_SIZE    (PIPE_MAX_PAGES * PIPE_PAGE_SIZE)
 #define MAX_PIPES        32     // Maximum concurrent pipes
 
 // Pipe states
@@ -22,16 +27,44 @@ int pipe_create(void);
 // Close one end of a pipe (end: 0=read, 1=write)
 void pipe_close(int pipe_idx, int end);
 
-// Read from pipe's read end. Returns bytes read, 0 on EOF, -1 on error
+// Read from pipe's read end, sleeping while it is empty and a writer
+// remains. Returns bytes read, 0 on EOF, -1 on error
 int pipe_read(int pipe_idx, void* buf, int count);
 
-// Write to pipe's write end. Returns bytes written, -1 on error
+// Zero-copy read: point *data at the contiguous bytes at the read position
+// (never past the end of one page)
+// and return their count (0 on EOF or when empty and block is 0). With
+// block set, sleeps like pipe_read. The bytes stay in place until
+// pipe_consume(); -1 on error
+int pipe_peek(int pipe_idx, const uint8_t** data, int block);
+
+// Drop count bytes from the read position (after pipe_peek)
+void pipe_consume(int pipe_idx, int count);
+
+// Write to pipe's write end, sleeping while it is full and a reader
+// remains. Whole page-aligned pages of a user buffer are shared into the
+// ring copy-on-write instead of copied. Returns bytes written, -1 on error
+// (read end closed)
 int pipe_write(int pipe_idx, const void* buf, int count);
 
+// Resize the ring to size bytes (rounded up to whole pages, at most
+// PIPE_MAX_SIZE). Returns the new size, -1 if invalid, -2 if the buffered
+// data would not fit
+int pipe_set_size(int pipe_idx, int size);
+
+// Current capacity in bytes, -1 on error
+int pipe_get_size(int pipe_idx);
+
 // Get number of bytes available to read
 int pipe_available(int pipe_idx);
 
 // Check if pipe is still active (has at least one end open)
 int pipe_is_active(int pipe_idx);
 
+// Current EPOLL* readiness of one end (end: 0=read, 1=write)
+uint32_t pipe_poll(int pipe_idx, int end);
+
+// Event source notified on every read, write and close
+pollsrc_t* pipe_get_pollsrc(int pipe_idx);
+
 #endif
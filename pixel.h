@@ -0,0 +1,35 @@
+// pixel.h - SIMD Pixel Kernels for Alteo OS
+// Fill, copy and alpha blend over rectangles of ARGB8888 pixels, four
+// pixels per SSE2 operation. Callers clip first: every row of the
+// rectangle must be in bounds. Pitches are in pixels.
+//
+// pixel.c is built with SSE enabled. Each call saves the CPU's SSE state
+// and runs with interrupts off (a band of rows at a time), so these are
+// safe to call from the -mno-sse parts of the kernel.
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include "stdint.h"
+
+// Rows processed per save/cli section; bounds interrupt latency
+#define PIXEL_BAND_ROWS 64
+
+// Set every pixel to 'color'
+void pixel_fill(uint32_t* dst, int pitch, int w, int h, uint32_t color);
+
+// Copy src over dst (the rectangles must not overlap)
+void pixel_copy(uint32_t* dst, int dst_pitch, const uint32_t* src, int src_pitch,
+                int w, int h);
+
+// Blend src over dst by each source pixel's alpha scaled by 'opacity'.
+// Where the scaled alpha is 0 dst is left alone; elsewhere the result is
+// opaque.
+void pixel_blend(uint32_t* dst, int dst_pitch, const uint32_t* src, int src_pitch,
+                 int w, int h, uint8_t opacity);
+
+// Blend the single 'color' over dst at 'alpha' (1..254); the result is
+// opaque
+void pixel_blend_color(uint32_t* dst, int pitch, int w, int h,
+                       uint32_t color, int alpha);
+
+#endif
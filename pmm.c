@@ -1,6 +1,11 @@
 // pmm.c - Physical Memory Manager (Fixed)
+// Frame bitmap with a one-bit-per-word summary level: a set summary bit
+// means the corresponding 64-frame bitmap word is completely used, so the
+// allocator can skip 4096 frames per summary word it inspects.
 #include "pmm.h"
 #include "graphics.h" // Includes multiboot_info_t definition
+#include "smp.h"
+#include "spinlock.h"
 
 // Memory Map Entry (Specific to PMM logic)
 typedef struct {
@@ -10,27 +15,148 @@ typedef struct {
     uint32_t type;
 } __attribute__((packed)) mmap_entry_t;
 
+#define PMM_BITMAP_ADDR  0x1000000   // Bitmap at 16MB
+#define PMM_WORD_FULL    0xFFFFFFFFFFFFFFFFULL
+
 // Globals
-static uint8_t* bitmap = (uint8_t*)0x1000000; // Bitmap at 16MB
+static uint64_t* bitmap = (uint64_t*)PMM_BITMAP_ADDR; // Level 0: 1 bit per frame
+static uint64_t* summary = 0;                          // Level 1: 1 bit per bitmap word
 static uint64_t total_blocks = 0;
 static uint64_t used_blocks = 0;
-static uint64_t bitmap_size = 0;
+static uint64_t bitmap_words = 0;
+static uint64_t summary_words = 0;
+static uint64_t next_fit_word = 0;                     // Where the last search succeeded
+
+// Extra references per frame (0 = single owner). Shared copy-on-write
+// frames are only returned to the bitmap when the last reference is freed.
+static uint16_t* frame_refs = 0;
+
+// Frames parked in a CPU magazine: allocated in the bitmap but free, so a
+// second pmm_free_block() of one is caught here instead of by the bitmap.
+// Bits of one word belong to different CPUs' magazines, hence atomics.
+static uint64_t* parked = 0;
+
+// ---- Per-CPU frame magazines ----
+// Each CPU keeps two small stacks of free frames (the loaded and the
+// previous magazine). Allocations and frees hit the loaded magazine; when
+// it runs empty/full the two are swapped, and only when both are exhausted
+// does the CPU go to the global bitmap, moving half a magazine at a time.
+#define PMM_MAX_CPUS     16
+#define PMM_MAG_SIZE     32
+#define PMM_MAG_BATCH    (PMM_MAG_SIZE / 2)
+
+typedef struct {
+    uint64_t frames[PMM_MAG_SIZE];
+    int count;
+} pmm_magazine_t;
+
+typedef struct {
+    spinlock_t lock;                 // Owner CPU vs. pmm_drain_cpu_caches()
+    pmm_magazine_t* loaded;
+    pmm_magazine_t* previous;
+    pmm_magazine_t mags[2];
+} __attribute__((aligned(64))) pmm_cpu_cache_t;   // No cache lines shared between CPUs
 
-void pmm_set_bit(uint64_t bit) {
-    bitmap[bit / 8] |= (1 << (bit % 8));
+static pmm_cpu_cache_t cpu_caches[PMM_MAX_CPUS];
+static int pmm_ready = 0;
+
+// Guards the bitmap, summary, used_blocks and frame_refs. Taken after a
+// cache lock when both are needed.
+static lockstat_t pmm_lock_stat = LOCKSTAT_INIT("pmm");
+static spinlock_t pmm_lock = SPINLOCK_INIT_STAT(pmm_lock_stat);
+
+static inline void pmm_park(uint64_t addr) {
+    uint64_t f = addr / PAGE_SIZE;
+    __atomic_fetch_or(&parked[f / 64], 1ULL << (f % 64), __ATOMIC_RELAXED);
 }
 
-void pmm_unset_bit(uint64_t bit) {
-    bitmap[bit / 8] &= ~(1 << (bit % 8));
+static inline void pmm_unpark(uint64_t addr) {
+    uint64_t f = addr / PAGE_SIZE;
+    __atomic_fetch_and(&parked[f / 64], ~(1ULL << (f % 64)), __ATOMIC_RELAXED);
 }
 
-int pmm_test_bit(uint64_t bit) {
-    return bitmap[bit / 8] & (1 << (bit % 8));
+// Set the parked bit; 0 if it already was (the frame is freed twice)
+static inline int pmm_park_new(uint64_t addr) {
+    uint64_t f = addr / PAGE_SIZE;
+    uint64_t m = 1ULL << (f % 64);
+    return !(__atomic_fetch_or(&parked[f / 64], m, __ATOMIC_RELAXED) & m);
 }
 
-int64_t pmm_find_first_free() {
-    for (uint64_t i = 0; i < total_blocks; i++) {
-        if (!pmm_test_bit(i)) return i;
+static inline void pmm_summary_update(uint64_t word) {
+    uint64_t mask = 1ULL << (word % 64);
+    if (bitmap[word] == PMM_WORD_FULL) summary[word / 64] |= mask;
+    else summary[word / 64] &= ~mask;
+}
+
+static inline void pmm_set_bit(uint64_t bit) {
+    bitmap[bit / 64] |= (1ULL << (bit % 64));
+    if (bitmap[bit / 64] == PMM_WORD_FULL) pmm_summary_update(bit / 64);
+}
+
+static inline void pmm_unset_bit(uint64_t bit) {
+    bitmap[bit / 64] &= ~(1ULL << (bit % 64));
+    summary[bit / 64 / 64] &= ~(1ULL << ((bit / 64) % 64));
+}
+
+static inline int pmm_test_bit(uint64_t bit) {
+    return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline int pmm_popcount64(uint64_t v) {
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((v * 0x0101010101010101ULL) >> 56);
+}
+
+// Find a free frame, starting at the next-fit hint and wrapping once
+static int64_t pmm_find_first_free(void) {
+    if (summary_words == 0) return -1;
+
+    uint64_t start = next_fit_word / 64;
+    for (uint64_t n = 0; n <= summary_words; n++) {
+        uint64_t s = (start + n) % summary_words;
+        uint64_t avail = ~summary[s];
+        // On the first pass skip words before the hint; they are covered on wrap
+        if (n == 0) avail &= PMM_WORD_FULL << (next_fit_word % 64);
+        if (!avail) continue;
+
+        uint64_t word = s * 64 + (uint64_t)__builtin_ctzll(avail);
+        if (word >= bitmap_words) continue;
+        next_fit_word = word;
+        return (int64_t)(word * 64 + (uint64_t)__builtin_ctzll(~bitmap[word]));
+    }
+    return -1;
+}
+
+// First free frame at or after 'frame' (whole used words skipped via summary)
+static int64_t pmm_next_free_from(uint64_t frame) {
+    if (frame >= total_blocks) return -1;
+    uint64_t word = frame / 64;
+    uint64_t avail = ~bitmap[word] & (PMM_WORD_FULL << (frame % 64));
+    if (avail) return (int64_t)(word * 64 + (uint64_t)__builtin_ctzll(avail));
+
+    for (uint64_t s = (word + 1) / 64; s < summary_words; s++) {
+        uint64_t free_words = ~summary[s];
+        if (s == (word + 1) / 64) free_words &= PMM_WORD_FULL << ((word + 1) % 64);
+        if (!free_words) continue;
+        uint64_t w = s * 64 + (uint64_t)__builtin_ctzll(free_words);
+        if (w >= bitmap_words) return -1;
+        return (int64_t)(w * 64 + (uint64_t)__builtin_ctzll(~bitmap[w]));
+    }
+    return -1;
+}
+
+// First used frame in [frame, end), or -1 if the whole range is free
+static int64_t pmm_next_used_in(uint64_t frame, uint64_t end) {
+    while (frame < end) {
+        uint64_t word = frame / 64;
+        uint64_t used = bitmap[word] & (PMM_WORD_FULL << (frame % 64));
+        if (used) {
+            uint64_t bit = word * 64 + (uint64_t)__builtin_ctzll(used);
+            return bit < end ? (int64_t)bit : -1;
+        }
+        frame = (word + 1) * 64;
     }
     return -1;
 }
@@ -40,7 +166,7 @@ void pmm_init(uint64_t multiboot_info_addr) {
     if (multiboot_info_addr == 0 || multiboot_info_addr < 0x1000) {
         return; // Invalid address, skip PMM initialization
     }
-    
+
     multiboot_info_t* mb_info = (multiboot_info_t*)multiboot_info_addr;
     uint64_t mem_size = 0;
 
@@ -48,7 +174,7 @@ void pmm_init(uint64_t multiboot_info_addr) {
     if (mb_info->flags & (1 << 6)) {
         mmap_entry_t* entry = (mmap_entry_t*)(uint64_t)mb_info->mmap_addr;
         uint64_t end_addr = mb_info->mmap_addr + mb_info->mmap_length;
-        
+
         while ((uint64_t)entry < end_addr) {
             if (entry->type == 1) { // Available
                 uint64_t top = entry->addr + entry->len;
@@ -56,8 +182,8 @@ void pmm_init(uint64_t multiboot_info_addr) {
             }
             entry = (mmap_entry_t*)((uint64_t)entry + entry->size + 4);
         }
-    } 
-    
+    }
+
     // Method 2: Fallback to mem_upper (Bit 0)
     if (mem_size == 0 && (mb_info->flags & (1 << 0))) {
         mem_size = (mb_info->mem_upper * 1024) + 0x100000;
@@ -66,13 +192,27 @@ void pmm_init(uint64_t multiboot_info_addr) {
     // Default safety
     if (mem_size == 0) mem_size = 32 * 1024 * 1024;
 
-    // Initialize Bitmap
+    // Initialize Bitmap (summary level lives right after it)
     total_blocks = mem_size / PAGE_SIZE;
-    bitmap_size = total_blocks / 8;
+    bitmap_words = (total_blocks + 63) / 64;
+    summary_words = (bitmap_words + 63) / 64;
+    summary = bitmap + bitmap_words;
+    frame_refs = (uint16_t*)(summary + summary_words);
+    parked = (uint64_t*)(((uint64_t)(frame_refs + total_blocks) + 7) & ~7ULL);
+    next_fit_word = 0;
 
-    // 1. Mark EVERYTHING as used first
-    for (uint64_t i = 0; i < bitmap_size; i++) {
-        bitmap[i] = 0xFF; 
+    // 1. Mark EVERYTHING as used first (including padding bits past the end)
+    for (uint64_t i = 0; i < bitmap_words; i++) {
+        bitmap[i] = PMM_WORD_FULL;
+    }
+    for (uint64_t i = 0; i < summary_words; i++) {
+        summary[i] = PMM_WORD_FULL;
+    }
+    for (uint64_t i = 0; i < total_blocks; i++) {
+        frame_refs[i] = 0;
+    }
+    for (uint64_t i = 0; i < bitmap_words; i++) {
+        parked[i] = 0;
     }
 
     // 2. Mark available regions as free
@@ -97,19 +237,42 @@ void pmm_init(uint64_t multiboot_info_addr) {
         }
     }
 
-    // 3. Re-mark Kernel area (0-16MB) as used
-    uint64_t kernel_limit = 0x1000000 / PAGE_SIZE;
-    for (uint64_t i = 0; i < kernel_limit; i++) {
+    // 3. Re-mark Kernel area (0-16MB) and the bitmap/refcount/parked area as used
+    uint64_t bitmap_end = (uint64_t)(parked + bitmap_words);
+    uint64_t kernel_limit = (bitmap_end + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (uint64_t i = 0; i < kernel_limit && i < total_blocks; i++) {
         pmm_set_bit(i);
     }
-    
+
+    // 4. Multiboot modules stay where GRUB put them (ramdisk.c serves them)
+    if (mb_info->flags & (1 << 3)) {
+        multiboot_module_t* mods = (multiboot_module_t*)(uint64_t)mb_info->mods_addr;
+        for (uint32_t m = 0; m < mb_info->mods_count; m++) {
+            uint64_t end = (mods[m].mod_end + PAGE_SIZE - 1) / PAGE_SIZE;
+            for (uint64_t i = mods[m].mod_start / PAGE_SIZE; i < end && i < total_blocks; i++) {
+                pmm_set_bit(i);
+            }
+        }
+    }
+
     used_blocks = 0;
-    for(uint64_t i=0; i<total_blocks; i++) {
-        if(pmm_test_bit(i)) used_blocks++;
+    for (uint64_t i = 0; i < bitmap_words; i++) {
+        pmm_summary_update(i);
+        used_blocks += (uint64_t)pmm_popcount64(bitmap[i]);
     }
+    // Padding bits in the last word are not real frames
+    used_blocks -= bitmap_words * 64 - total_blocks;
+
+    for (int cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        cpu_caches[cpu].loaded = &cpu_caches[cpu].mags[0];
+        cpu_caches[cpu].previous = &cpu_caches[cpu].mags[1];
+        cpu_caches[cpu].mags[0].count = 0;
+        cpu_caches[cpu].mags[1].count = 0;
+    }
+    pmm_ready = 1;
 }
 
-void* pmm_alloc_block() {
+static void* pmm_global_alloc(void) {
     int64_t frame = pmm_find_first_free();
     if (frame == -1) return 0;
     pmm_set_bit(frame);
@@ -117,16 +280,223 @@ void* pmm_alloc_block() {
     return (void*)(frame * PAGE_SIZE);
 }
 
-void pmm_free_block(void* ptr) {
-    uint64_t frame = (uint64_t)ptr / PAGE_SIZE;
+static void pmm_global_free(uint64_t frame) {
+    if (frame >= total_blocks || !pmm_test_bit(frame)) return;
     pmm_unset_bit(frame);
     used_blocks--;
 }
 
+static inline uint64_t pmm_irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void pmm_irq_restore(uint64_t flags) {
+    if (flags & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+}
+
+// Call with interrupts off; returns the calling CPU's cache, locked
+static inline pmm_cpu_cache_t* pmm_this_cpu(void) {
+    pmm_cpu_cache_t* c = &cpu_caches[smp_cpu_id() % PMM_MAX_CPUS];
+    spin_lock(&c->lock);
+    return c;
+}
+
+static inline void pmm_mag_swap(pmm_cpu_cache_t* c) {
+    pmm_magazine_t* t = c->loaded;
+    c->loaded = c->previous;
+    c->previous = t;
+}
+
+#define PMM_RECLAIM_BATCH  PMM_MAG_SIZE
+
+static pmm_reclaim_fn pmm_reclaim = 0;
+
+void pmm_set_reclaim(pmm_reclaim_fn fn) {
+    pmm_reclaim = fn;
+}
+
+static void* pmm_alloc_cached(void) {
+    if (!pmm_ready) return pmm_global_alloc();
+
+    uint64_t irq = pmm_irq_save();
+    pmm_cpu_cache_t* c = pmm_this_cpu();
+
+    if (c->loaded->count == 0) {
+        if (c->previous->count > 0) {
+            pmm_mag_swap(c);
+        } else {
+            // Refill half a magazine from the global bitmap in one go
+            pmm_magazine_t* m = c->loaded;
+            spin_lock(&pmm_lock);
+            while (m->count < PMM_MAG_BATCH) {
+                void* f = pmm_global_alloc();
+                if (!f) break;
+                pmm_park((uint64_t)f);
+                m->frames[m->count++] = (uint64_t)f;
+            }
+            spin_unlock(&pmm_lock);
+            if (m->count == 0) { spin_unlock(&c->lock); pmm_irq_restore(irq); return 0; }
+        }
+    }
+
+    void* frame = (void*)c->loaded->frames[--c->loaded->count];
+    pmm_unpark((uint64_t)frame);
+    spin_unlock(&c->lock);
+    pmm_irq_restore(irq);
+    return frame;
+}
+
+void* pmm_alloc_block() {
+    void* frame = pmm_alloc_cached();
+    // Out of frames: let the reclaim hook free some (they land in this
+    // CPU's magazine) and try once more
+    if (!frame && pmm_reclaim && pmm_reclaim(PMM_RECLAIM_BATCH) > 0) frame = pmm_alloc_cached();
+    return frame;
+}
+
+void pmm_free_block(void* ptr) {
+    uint64_t frame = (uint64_t)ptr / PAGE_SIZE;
+    if (frame >= total_blocks || !pmm_test_bit(frame)) return;
+    if (!pmm_ready) { pmm_global_free(frame); return; }
+
+    uint64_t irq = pmm_irq_save();
+    spin_lock(&pmm_lock);
+    if (frame_refs[frame]) {
+        // Still shared: just drop this reference
+        frame_refs[frame]--;
+        spin_unlock(&pmm_lock);
+        pmm_irq_restore(irq);
+        return;
+    }
+    spin_unlock(&pmm_lock);
+    // Already parked in a magazine: a double free, ignored like one the
+    // bitmap catches
+    uint64_t addr = (uint64_t)ptr & ~(uint64_t)(PAGE_SIZE - 1);
+    if (!pmm_park_new(addr)) { pmm_irq_restore(irq); return; }
+    pmm_cpu_cache_t* c = pmm_this_cpu();
+
+    if (c->loaded->count == PMM_MAG_SIZE) {
+        if (c->previous->count < PMM_MAG_SIZE) {
+            pmm_mag_swap(c);
+        } else {
+            // Both full: return the oldest half to the global bitmap
+            pmm_magazine_t* m = c->loaded;
+            spin_lock(&pmm_lock);
+            for (int i = 0; i < PMM_MAG_BATCH; i++) {
+                pmm_unpark(m->frames[i]);
+                pmm_global_free(m->frames[i] / PAGE_SIZE);
+            }
+            spin_unlock(&pmm_lock);
+            for (int i = PMM_MAG_BATCH; i < m->count; i++) {
+                m->frames[i - PMM_MAG_BATCH] = m->frames[i];
+            }
+            m->count -= PMM_MAG_BATCH;
+        }
+    }
+
+    c->loaded->frames[c->loaded->count++] = addr;
+    spin_unlock(&c->lock);
+    pmm_irq_restore(irq);
+}
+
+void pmm_page_ref(void* ptr) {
+    uint64_t frame = (uint64_t)ptr / PAGE_SIZE;
+    if (frame >= total_blocks || !pmm_test_bit(frame)) return;
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    if (frame_refs[frame] < 0xFFFF) frame_refs[frame]++;
+    spin_unlock_irqrestore(&pmm_lock, irq);
+}
+
+uint32_t pmm_page_refcount(void* ptr) {
+    uint64_t frame = (uint64_t)ptr / PAGE_SIZE;
+    if (frame >= total_blocks || !pmm_test_bit(frame)) return 0;
+    return (uint32_t)frame_refs[frame] + 1;
+}
+
+void pmm_drain_cpu_caches(void) {
+    uint64_t irq = pmm_irq_save();
+    for (int cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        spin_lock(&cpu_caches[cpu].lock);
+        spin_lock(&pmm_lock);
+        for (int m = 0; m < 2; m++) {
+            pmm_magazine_t* mag = &cpu_caches[cpu].mags[m];
+            for (int i = 0; i < mag->count; i++) {
+                pmm_unpark(mag->frames[i]);
+                pmm_global_free(mag->frames[i] / PAGE_SIZE);
+            }
+            mag->count = 0;
+        }
+        spin_unlock(&pmm_lock);
+        spin_unlock(&cpu_caches[cpu].lock);
+    }
+    pmm_irq_restore(irq);
+}
+
+// Frames parked in magazines are allocated in the bitmap but free to callers
+static uint64_t pmm_cached_blocks(void) {
+    uint64_t n = 0;
+    for (int cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        n += (uint64_t)(cpu_caches[cpu].mags[0].count + cpu_caches[cpu].mags[1].count);
+    }
+    return n;
+}
+
+void* pmm_alloc_blocks(uint64_t count, uint64_t align) {
+    if (count == 0) return 0;
+    if (count == 1 && align <= PAGE_SIZE) return pmm_alloc_block();
+    if (align & (align - 1)) return 0; // Alignment must be a power of two
+
+    uint64_t step = align > PAGE_SIZE ? align / PAGE_SIZE : 1;
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    int drained = 0, reclaimed = 0;
+    uint64_t frame = 0;
+    for (;;) {
+        int64_t f = pmm_next_free_from(frame);
+        if (f >= 0) {
+            frame = ((uint64_t)f + step - 1) & ~(step - 1);
+            if (frame + count <= total_blocks) {
+                int64_t used = pmm_next_used_in(frame, frame + count);
+                if (used < 0) break;
+                frame = (uint64_t)used + 1;
+                continue;
+            }
+        }
+        // No run found: frames held in CPU magazines may be fragmenting
+        // the bitmap, so give them back once and retry from the start.
+        // If that fails too, reclaim (into the magazines) and drain again.
+        if (drained && (reclaimed || !pmm_reclaim)) { spin_unlock_irqrestore(&pmm_lock, irq); return 0; }
+        spin_unlock_irqrestore(&pmm_lock, irq);
+        if (drained) {
+            pmm_reclaim(count + PMM_RECLAIM_BATCH);
+            reclaimed = 1;
+        }
+        pmm_drain_cpu_caches();
+        irq = spin_lock_irqsave(&pmm_lock);
+        drained = 1;
+        frame = 0;
+    }
+
+    for (uint64_t i = 0; i < count; i++) pmm_set_bit(frame + i);
+    used_blocks += count;
+    spin_unlock_irqrestore(&pmm_lock, irq);
+    return (void*)(frame * PAGE_SIZE);
+}
+
+void pmm_free_blocks(void* ptr, uint64_t count) {
+    uint64_t frame = (uint64_t)ptr / PAGE_SIZE;
+    uint64_t irq = spin_lock_irqsave(&pmm_lock);
+    for (uint64_t i = 0; i < count; i++) {
+        pmm_global_free(frame + i);
+    }
+    spin_unlock_irqrestore(&pmm_lock, irq);
+}
+
 uint64_t pmm_get_free_memory() {
-    return (total_blocks - used_blocks) * PAGE_SIZE;
+    return (total_blocks - used_blocks + pmm_cached_blocks()) * PAGE_SIZE;
 }
 
 uint64_t pmm_get_total_memory() {
     return total_blocks * PAGE_SIZE;
-}
\ No newline at end of file
+}
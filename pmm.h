@@ -10,6 +10,27 @@
 void pmm_init(uint64_t multiboot_info_addr);
 void* pmm_alloc_block();
 void pmm_free_block(void* ptr);
+
+// Allocate 'count' physically contiguous frames whose base is aligned to
+// 'align' bytes (power of two; 0 or PAGE_SIZE for no extra alignment).
+// Returns the physical base address, or 0 if no such run exists.
+void* pmm_alloc_blocks(uint64_t count, uint64_t align);
+void pmm_free_blocks(void* ptr, uint64_t count);
+
+// Per-frame reference counts for shared (copy-on-write) pages.
+// pmm_page_ref() adds a reference; pmm_free_block() drops one and only
+// releases the frame once no references remain.
+void pmm_page_ref(void* ptr);
+uint32_t pmm_page_refcount(void* ptr);
+
+// Reclaim hook for when no frame is free: release up to 'pages' frames
+// (with pmm_free_block) and return how many were released. Runs in the
+// allocating context, so it must not sleep or wait for locks.
+typedef uint64_t (*pmm_reclaim_fn)(uint64_t pages);
+void pmm_set_reclaim(pmm_reclaim_fn fn);
+
+// Return every frame parked in the per-CPU magazines to the global bitmap
+void pmm_drain_cpu_caches(void);
 uint64_t pmm_get_free_memory();
 uint64_t pmm_get_total_memory();
 
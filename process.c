@@ -1,12 +1,36 @@
 // process.c - Process Management for Alteo OS
 #include "process.h"
+#include "klib.h"
 #include "heap.h"
+#include "vmm.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "timer.h"
+#include "fpu.h"
+#include "dynlink.h"
+#include "pe.h"
+#include "uring.h"
+#include "futex.h"
+#include "shm.h"
+#include "pmm.h"
 
 // Process table
 static process_t proc_table[MAX_PROCESSES];
-static int current_pid = -1;
+// PID running on each CPU (-1 = idle), kept with its slot in the per-CPU
+// block so the syscall path reads both through GS
+#define current_pid (smp_this_cpu()->pid)
 static int next_pid = 1;
+
+// PID hash: chains of slots through process_t.hash_next. Chains change
+// only under the BKL; an insert links a fully set-up slot at the head, so
+// IRQ-time lookups never see a half-built entry.
+static int pid_hash[PID_HASH_SIZE];
+
+// Free slots, most recently freed on top (its stack is still cache-warm)
+static int free_slots[MAX_PROCESSES];
+static int free_count;
 static int proc_initialized = 0;
+static uint64_t next_wake_tick = ~0ULL;   // Earliest sleep_until of any tick-scanned sleeper
 
 // Simple string helpers (no libc)
 static void proc_strcpy(char* dst, const char* src) {
@@ -14,11 +38,6 @@ static void proc_strcpy(char* dst, const char* src) {
     while (src[i] && i < PROC_NAME_MAX - 1) { dst[i] = src[i]; i++; }
     dst[i] = 0;
 }
-static void proc_memset(void* ptr, int val, int size) {
-    unsigned char* p = (unsigned char*)ptr;
-    for (int i = 0; i < size; i++) p[i] = (unsigned char)val;
-}
-
 // Trampoline: when a process's entry function returns, exit cleanly
 static void process_exit_trampoline(void) {
     process_exit(0);
@@ -26,14 +45,74 @@ static void process_exit_trampoline(void) {
     for (;;) { __asm__ volatile("hlt"); }
 }
 
+// ---------- PID hash ----------
+
+static int pid_bucket(int pid) {
+    return (int)(((uint32_t)pid * 2654435761u) >> 24) & (PID_HASH_SIZE - 1);
+}
+
+static void pid_hash_insert(int slot) {
+    int b = pid_bucket(proc_table[slot].pid);
+    proc_table[slot].hash_next = pid_hash[b];
+    __atomic_store_n(&pid_hash[b], slot, __ATOMIC_RELEASE);
+}
+
+static void pid_hash_remove(int slot) {
+    int* link = &pid_hash[pid_bucket(proc_table[slot].pid)];
+    while (*link >= 0 && *link != slot) link = &proc_table[*link].hash_next;
+    if (*link == slot) *link = proc_table[slot].hash_next;
+}
+
+// ---------- Kernel stack pool ----------
+
+static uint64_t kstack_top(int slot) {
+    return KSTACK_POOL_BASE + (uint64_t)slot * KSTACK_STRIDE + KSTACK_STRIDE;
+}
+
+// Stack of a slot, backing it with zeroed pages on its first use
+static int kstack_get(int slot, uint64_t* base) {
+    uint64_t b = kstack_top(slot) - KERNEL_STACK_SZ;
+    pte_t* kpml4 = vmm_get_kernel_pml4();
+    if (!vmm_get_physical(kpml4, b)) {
+        for (uint64_t off = 0; off < KERNEL_STACK_SZ; off += VMM_PAGE_SIZE) {
+            if (vmm_get_physical(kpml4, b + off)) continue;
+            void* page = pmm_alloc_block();
+            if (!page) return -1;   // Pages mapped so far stay with the slot
+            memset(page, 0, VMM_PAGE_SIZE);
+            if (vmm_map_page(kpml4, b + off, (uint64_t)page,
+                             VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NX) < 0) {
+                pmm_free_block(page);
+                return -1;
+            }
+        }
+    }
+    *base = b;
+    return 0;
+}
+
+// ---------- Table ----------
+
 // Initialize the process subsystem
 void process_init(void) {
-    proc_memset(proc_table, 0, sizeof(proc_table));
+    memset(proc_table, 0, sizeof(proc_table));
     for (int i = 0; i < MAX_PROCESSES; i++) {
         proc_table[i].pid = -1;
         proc_table[i].state = PROC_STATE_UNUSED;
+        proc_table[i].hash_next = -1;
+    }
+    for (int i = 0; i < PID_HASH_SIZE; i++) pid_hash[i] = -1;
+    free_count = 0;
+    for (int i = MAX_PROCESSES - 1; i > 0; i--) free_slots[free_count++] = i;
+
+    // Back slot 1's stack now: this also builds the pool's page tables in
+    // the kernel PML4 before any address space copies its entries
+    uint64_t base;
+    kstack_get(1, &base);
+
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        smp_cpu_data(i)->pid = -1;
+        smp_cpu_data(i)->slot = -1;
     }
-    current_pid = -1;
     next_pid = 1;
     proc_initialized = 1;
 
@@ -50,30 +129,46 @@ void process_init(void) {
     proc_table[0].page_table = 0;  // Uses kernel page table
     proc_table[0].is_user = 0;
     proc_strcpy(proc_table[0].name, "kernel");
-    current_pid = 0;
+    proc_table[0].fpu_cpu = -1;
+    fpu_alloc(&proc_table[0]);   // Without one it just gets scratch FPU registers
+    pid_hash_insert(0);
+    process_set_current(0);
 }
 
-// Find a free slot in the process table
-static int find_free_slot(void) {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].state == PROC_STATE_UNUSED) return i;
-    }
-    return -1;
+void process_free(process_t* p) {
+    int slot = (int)(p - proc_table);
+    if (slot <= 0 || p->state == PROC_STATE_UNUSED) return;
+    process_change_state(p, PROC_STATE_UNUSED);
+    pid_hash_remove(slot);
+    p->pid = -1;
+    if (p->stack_base) memset((void*)p->stack_base, 0, KERNEL_STACK_SZ);
+    p->stack_base = p->stack_top = 0;
+    free_slots[free_count++] = slot;
 }
 
 // Create a new process
 int process_create(const char* name, void (*entry)(void), int priority) {
+    return process_create_on(name, entry, priority, -1);
+}
+
+// Create a new process on cpu, or on the least loaded CPU if cpu < 0
+int process_create_on(const char* name, void (*entry)(void), int priority, int cpu) {
     if (!proc_initialized) return -1;
 
-    int slot = find_free_slot();
-    if (slot < 0) return -1;   // No free slot
+    if (free_count == 0) return -1;   // No free slot
+    int slot = free_slots[free_count - 1];
+
+    // Backed and zeroed when the slot was last freed (or on first use)
+    uint64_t stack;
+    if (kstack_get(slot, &stack) < 0) return -1;
+    free_count--;
 
     process_t* p = &proc_table[slot];
-    proc_memset(p, 0, sizeof(process_t));
+    memset(p, 0, sizeof(process_t));
+    waitq_init(&p->child_exit);
 
     p->pid = next_pid++;
     p->ppid = (current_pid >= 0) ? current_pid : 0;
-    p->state = PROC_STATE_READY;
     p->priority = priority;
     p->exit_code = 0;
     p->is_user = 0;          // Kernel-mode by default
@@ -81,18 +176,20 @@ int process_create(const char* name, void (*entry)(void), int priority) {
     p->entry_point = (uint64_t)entry;
     proc_strcpy(p->name, name);
 
-    // Allocate kernel stack
-    void* stack = kmalloc(KERNEL_STACK_SZ);
-    if (!stack) {
+    p->stack_base = stack;
+    p->stack_top = p->stack_base + KERNEL_STACK_SZ;
+
+    // FPU image, loaded on the process's first FPU/SSE instruction
+    if (fpu_alloc(p) < 0) {
+        p->stack_base = p->stack_top = 0;
         p->state = PROC_STATE_UNUSED;
         p->pid = -1;
+        free_slots[free_count++] = slot;
         return -1;
     }
-    p->stack_base = (uint64_t)stack;
-    p->stack_top = p->stack_base + KERNEL_STACK_SZ;
 
     // Initialize CPU context for first switch
-    proc_memset(&p->context, 0, sizeof(cpu_context_t));
+    memset(&p->context, 0, sizeof(cpu_context_t));
     p->context.rip = (uint64_t)entry;
     p->context.rsp = p->stack_top - 8;  // Align stack
     p->context.rflags = 0x202;           // IF flag set (interrupts enabled)
@@ -141,33 +238,46 @@ int process_create(const char* name, void (*entry)(void), int priority) {
     p->cpu_time = 0;
     p->created_at = 0;  // Will be set by caller if needed
 
+    p->sleep_timer = -1;
+    p->cpu = cpu >= 0 ? cpu : scheduler_pick_cpu();
+    p->pinned = cpu >= 0;
+    pid_hash_insert(slot);
+    process_change_state(p, PROC_STATE_READY);
     return p->pid;
 }
 
 // Terminate a process by PID
 void process_terminate(int pid, int exit_code) {
     if (pid <= 0) return;  // Can't kill kernel process
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].pid == pid && proc_table[i].state != PROC_STATE_UNUSED) {
-            proc_table[i].state = PROC_STATE_ZOMBIE;
-            proc_table[i].exit_code = exit_code;
-
-            // Free kernel stack
-            if (proc_table[i].stack_base) {
-                kfree((void*)proc_table[i].stack_base);
-                proc_table[i].stack_base = 0;
-                proc_table[i].stack_top = 0;
-            }
+    int i = process_slot(pid);
+    if (i < 0) return;
+    // Drop demand-paged regions (and whatever was faulted in)
+    pte_t* pml4 = proc_table[i].page_table ? (pte_t*)proc_table[i].page_table
+                                           : vmm_get_kernel_pml4();
+    vmm_vma_release_all(pid, pml4);
+    dl_release(pid);
+    pe_release(pid);
+    uring_release(pid);
+    futex_release(pid);
+    shm_release(pid);
 
-            // Reparent children to kernel (PID 0)
-            for (int j = 0; j < MAX_PROCESSES; j++) {
-                if (proc_table[j].ppid == pid && proc_table[j].state != PROC_STATE_UNUSED) {
-                    proc_table[j].ppid = 0;
-                }
-            }
-            return;
+    proc_table[i].exit_code = exit_code;
+    process_change_state(&proc_table[i], PROC_STATE_ZOMBIE);
+
+    // The kernel stack stays with the slot (we may be running on it) and
+    // is cleared by process_free() when the zombie is reaped
+    fpu_free(&proc_table[i]);
+
+    // Reparent children to kernel (PID 0)
+    for (int j = 0; j < MAX_PROCESSES; j++) {
+        if (proc_table[j].ppid == pid && proc_table[j].state != PROC_STATE_UNUSED) {
+            proc_table[j].ppid = 0;
         }
     }
+
+    // Let a parent sleeping in wait() reap us
+    process_t* parent = process_get(proc_table[i].ppid);
+    if (parent) waitq_wake_all(&parent->child_exit);
 }
 
 // Current process exits
@@ -177,53 +287,105 @@ void process_exit(int exit_code) {
     }
 }
 
+void process_change_state(process_t* p, int state) {
+    if (p->state == state) return;
+
+    // Charge the time since the last change to the state being left
+    uint64_t now = timer_now_ns();
+    uint64_t spent = now - p->acct.state_since;
+    p->acct.state_since = now;
+    switch (p->state) {
+        case PROC_STATE_READY:    p->acct.wait_ns += spent;    break;
+        case PROC_STATE_BLOCKED:  p->acct.blocked_ns += spent; break;
+        case PROC_STATE_SLEEPING: p->acct.sleep_ns += spent;   break;
+    }
+
+    if (p->state == PROC_STATE_READY) scheduler_dequeue(p);
+    if (p->state == PROC_STATE_SLEEPING && p->sleep_timer >= 0) {
+        timer_cancel(p->sleep_timer);   // Woken or killed before the deadline
+        p->sleep_timer = -1;
+    }
+    p->state = state;
+    if (state == PROC_STATE_READY) scheduler_enqueue(p);
+}
+
 // Set process state
 void process_set_state(int pid, int state) {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].pid == pid) {
-            proc_table[i].state = state;
-            return;
-        }
+    process_t* p = process_get(pid);
+    if (p) process_change_state(p, state);
+}
+
+// Timer callback: wake a sleeper whose deadline passed
+static void process_sleep_expired(uint64_t pid) {
+    process_t* p = process_get((int)pid);
+    if (p && p->state == PROC_STATE_SLEEPING) {
+        p->sleep_timer = -1;
+        p->time_slice = p->default_slice;
+        process_change_state(p, PROC_STATE_READY);
     }
 }
 
-// Put a process to sleep for N ticks
+// Put a process to sleep until an absolute tick count
 void process_sleep(int pid, uint64_t ticks) {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].pid == pid) {
-            proc_table[i].state = PROC_STATE_SLEEPING;
-            proc_table[i].sleep_until = ticks;  // Absolute tick value
-            return;
-        }
-    }
+    process_sleep_ns(pid, ticks * TIMER_TICK_NS);
+}
+
+// Put a process to sleep until timer_now_ns() reaches deadline_ns. The wakeup
+// is a timer event; without one (timer not running or its table full) the
+// sleeper is picked up by the tick scan in process_wake_sleepers().
+void process_sleep_ns(int pid, uint64_t deadline_ns) {
+    process_t* p = process_get(pid);
+    if (!p) return;
+    process_change_state(p, PROC_STATE_SLEEPING);
+    uint64_t ticks = (deadline_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+    p->sleep_until = ticks;  // Absolute tick value
+    p->sleep_timer = timer_is_active()
+        ? timer_add(deadline_ns, process_sleep_expired, (uint64_t)pid) : -1;
+    if (p->sleep_timer < 0 && ticks < next_wake_tick) next_wake_tick = ticks;
 }
 
-// Wake up sleeping processes whose timer has expired
+// Wake up sleeping processes whose timer has expired. Timed sleepers are
+// woken by their timer event; this runs any that are overdue and scans
+// only for sleepers that have no event (returns at once until the earliest
+// of those deadlines passes).
 void process_wake_sleepers(uint64_t current_tick) {
+    timer_poll();
+    if (current_tick < next_wake_tick) return;
+
+    uint64_t next = ~0ULL;
     for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].state == PROC_STATE_SLEEPING) {
+        if (proc_table[i].state == PROC_STATE_SLEEPING && proc_table[i].sleep_timer < 0) {
             if (current_tick >= proc_table[i].sleep_until) {
-                proc_table[i].state = PROC_STATE_READY;
                 proc_table[i].time_slice = proc_table[i].default_slice;
+                process_change_state(&proc_table[i], PROC_STATE_READY);
+            } else if (proc_table[i].sleep_until < next) {
+                next = proc_table[i].sleep_until;
             }
         }
     }
+    next_wake_tick = next;
 }
 
 // Get process by PID
-process_t* process_get(int pid) {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].pid == pid && proc_table[i].state != PROC_STATE_UNUSED) {
-            return &proc_table[i];
-        }
+int process_slot(int pid) {
+    if (pid < 0) return -1;
+    int s = __atomic_load_n(&pid_hash[pid_bucket(pid)], __ATOMIC_ACQUIRE);
+    for (; s >= 0; s = proc_table[s].hash_next) {
+        if (proc_table[s].pid == pid && proc_table[s].state != PROC_STATE_UNUSED) return s;
     }
-    return (process_t*)0;
+    return -1;
+}
+
+process_t* process_get(int pid) {
+    int s = process_slot(pid);
+    return s >= 0 ? &proc_table[s] : (process_t*)0;
 }
 
 // Get current running process
 process_t* process_get_current(void) {
-    if (current_pid < 0) return (process_t*)0;
-    return process_get(current_pid);
+    int slot = smp_this_cpu()->slot;
+    if (slot < 0) return (process_t*)0;
+    return &proc_table[slot];
 }
 
 // Get current PID
@@ -271,7 +433,9 @@ int process_get_max(void) {
     return MAX_PROCESSES;
 }
 
-// Set the current process PID (called by scheduler during context switch)
-void process_set_current(int pid) {
-    current_pid = pid;
+// Set the current process (called by scheduler during context switch)
+void process_set_current(int slot) {
+    smp_percpu_t* pc = smp_this_cpu();
+    pc->slot = slot;
+    pc->pid = slot >= 0 ? proc_table[slot].pid : -1;
 }
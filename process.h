@@ -3,6 +3,7 @@
 #define PROCESS_H
 
 #include "stdint.h"
+#include "waitq.h"
 
 // Process states
 #define PROC_STATE_UNUSED    0
@@ -13,8 +14,9 @@
 #define PROC_STATE_ZOMBIE    5
 
 // Limits
-#define MAX_PROCESSES    64
+#define MAX_PROCESSES    256
 #define KERNEL_STACK_SZ  8192
+#define PID_HASH_SIZE    256    // process_get() buckets (power of two)
 #define USER_STACK_SZ    (64 * 1024)   // 64KB user stack
 #define PROC_NAME_MAX    32
 
@@ -27,6 +29,24 @@
 // User-space stack location (per-process, mapped at this virtual address)
 #define USER_STACK_TOP   0x7FFFFFFFE000ULL
 
+// User heap and mmap() areas, above the kernel's identity map
+// (VMM_USER_BASE) so their page tables are the process's own
+#define USER_BRK_BASE    0x1000000000ULL    // brk heap start (64GB)
+#define USER_MMAP_BASE   0x2000000000ULL    // mmap() without an address: 128GB..256GB
+#define USER_MMAP_END    0x4000000000ULL
+
+// Kernel stacks: slot i's stack sits at KSTACK_POOL_BASE + i * KSTACK_STRIDE
+// above an unmapped guard page, so an overflow faults instead of running
+// into a neighbour. Stack pages stay mapped to their slot once allocated
+// and are zeroed when the slot is freed, so creating a process neither
+// allocates nor clears a stack after the slot's first use.
+#define KSTACK_POOL_BASE 0xFFFF800000000000ULL
+#define KSTACK_STRIDE    (KERNEL_STACK_SZ + 4096)
+
+#if MAX_PROCESSES > WAITQ_MAX_SLOTS
+#error "wait queue bitmaps cannot hold every process slot"
+#endif
+
 // CPU context saved during context switch
 typedef struct {
     uint64_t rax, rbx, rcx, rdx;
@@ -37,6 +57,22 @@ typedef struct {
     uint64_t cs, ss;
 } cpu_context_t;
 
+// Resource usage, for /proc/<pid>/status. Times are ns, from
+// process_change_state() (the only place states change).
+typedef struct {
+    uint64_t nvcsw;              // Switched out blocked, sleeping or exiting
+    uint64_t nivcsw;             // Switched out still runnable (preempted, yielded)
+    uint64_t min_flt;            // Page faults served from memory
+    uint64_t maj_flt;            // Page faults that had to read from a device
+    uint64_t cache_misses;       // Page cache misses taken in this process's context
+    uint64_t read_bytes;         // read/readv/pread/recv* and sendfile/splice input
+    uint64_t write_bytes;        // write/writev/pwrite/send* and sendfile/splice output
+    uint64_t wait_ns;            // Runnable but not running (scheduling latency)
+    uint64_t blocked_ns;         // Blocked on a wait queue (I/O, pipes, sockets)
+    uint64_t sleep_ns;           // Sleeping until a deadline
+    uint64_t state_since;        // timer_now_ns() at the last state change
+} proc_acct_t;
+
 // Process Control Block (PCB)
 typedef struct {
     int pid;                     // Process ID
@@ -49,6 +85,7 @@ typedef struct {
     uint64_t stack_base;         // Base of kernel stack
     uint64_t stack_top;          // Top of kernel stack (initial RSP)
     uint64_t sleep_until;        // Tick count to wake up (if sleeping)
+    int sleep_timer;             // Pending wakeup timer event id (-1 = none)
     uint64_t cpu_time;           // Total CPU ticks consumed
     uint64_t created_at;         // Tick when process was created
     int time_slice;              // Remaining time quantum (ticks)
@@ -61,19 +98,54 @@ typedef struct {
     uint64_t user_stack_base;    // Base of user-mode stack
     uint64_t user_stack_top;     // Top of user-mode stack
     uint64_t entry_point;        // Entry point address (for ELF/PE loaded processes)
+
+    // Ready queue linkage (owned by scheduler.c)
+    int rq_next;                 // Next slot on the same ready queue (-1 = tail)
+    int rq_prev;                 // Previous slot (-1 = head)
+    int rq_level;                // Queue the process is linked on (-1 = fair heap)
+    int rq_pos;                  // Index in the fair heap
+    uint64_t vruntime;           // SCHED_FAIR: weighted run time in ns
+    uint64_t exec_start;         // timer_now_ns() when last made current
+    uint8_t on_rq;               // 1 while linked on a ready queue
+    int cpu;                     // CPU whose run queue owns the process
+    uint8_t on_cpu;              // 1 until its context is saved after a switch away
+    uint8_t pinned;              // Never stolen by another CPU
+
+    // FPU/SSE state (owned by fpu.c)
+    uint8_t* fpu_area;           // XSAVE/FXSAVE image, 64-byte aligned (0 = none)
+    void* fpu_alloc;             // kmalloc block holding fpu_area
+    int fpu_cpu;                 // CPU whose registers may still hold it (-1 = none)
+
+    proc_acct_t acct;            // Resource usage
+
+    waitq_t child_exit;          // Woken when a child becomes a zombie (wait())
+    int hash_next;               // Next slot in the same PID hash chain (-1 = last)
 } process_t;
 
 // Process table and management
 void process_init(void);
 int process_create(const char* name, void (*entry)(void), int priority);
+// Create a kernel thread bound to cpu (falls back to the BSP while that
+// CPU is offline)
+int process_create_on(const char* name, void (*entry)(void), int priority, int cpu);
 void process_terminate(int pid, int exit_code);
 void process_exit(int exit_code);
 void process_set_state(int pid, int state);
+
+// Change a process's state, keeping the scheduler's ready queues in sync.
+// All state changes after process_init() must go through this.
+void process_change_state(process_t* p, int state);
 void process_sleep(int pid, uint64_t ticks);
+void process_sleep_ns(int pid, uint64_t deadline_ns);
 void process_wake_sleepers(uint64_t current_tick);
 
+// Release a reaped (or never started) process's slot: unhash it, clear
+// its kernel stack and make the slot reusable
+void process_free(process_t* p);
+
 // Process queries
 process_t* process_get(int pid);
+int process_slot(int pid);          // Table slot of pid, -1 if none
 process_t* process_get_current(void);
 int process_get_pid(void);
 int process_count(void);
@@ -84,10 +156,14 @@ const char* process_state_name(int state);
 process_t* process_get_table(void);
 int process_get_max(void);
 
-// Set the current process PID (called by scheduler during context switch)
-void process_set_current(int pid);
+// Set the current process by table slot, -1 = idle (called by scheduler
+// during context switch)
+void process_set_current(int slot);
 
 // Context switch support
 extern void switch_context(uint64_t* old_rsp, uint64_t new_rsp);
 
+// Resume a forked child in user mode (switch.asm)
+extern void fork_child_return(void);
+
 #endif
@@ -1,10 +1,31 @@
 // procfs.c - Process Filesystem for Alteo OS
-// Implements /proc with meminfo, cpuinfo, uptime, and per-process status
+// Implements /proc with meminfo, cpuinfo, uptime, per-process status and
+// the network counters under /proc/net
 #include "procfs.h"
+#include "klib.h"
 #include "vfs.h"
 #include "process.h"
 #include "scheduler.h"
 #include "pmm.h"
+#include "heap.h"
+#include "pagecache.h"
+#include "e1000.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "tcp.h"
+#include "udp.h"
+#include "loopback.h"
+#include "nettap.h"
+#include "nv_mem.h"
+#include "spinlock.h"
+#include "rcu.h"
+#include "timer.h"
+#include "smp.h"
+#include "cpuidle.h"
+#include "profile.h"
+#include "boottime.h"
+#include "zswap.h"
+#include "frametime.h"
 
 // ---- String helpers ----
 static int pfs_strlen(const char* s) { int l = 0; while (s[l]) l++; return l; }
@@ -18,16 +39,6 @@ static void pfs_strncpy(char* d, const char* s, int n) {
     while (i < n - 1 && s[i]) { d[i] = s[i]; i++; }
     d[i] = 0;
 }
-static void pfs_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
-}
-static void pfs_memcpy(void* d, const void* s, int n) {
-    unsigned char* dd = (unsigned char*)d;
-    const unsigned char* ss = (const unsigned char*)s;
-    for (int i = 0; i < n; i++) dd[i] = ss[i];
-}
-
 // Integer to string
 static int pfs_itoa(int64_t val, char* buf, int bufsize) {
     if (bufsize <= 0) return 0;
@@ -50,141 +61,574 @@ static int pfs_itoa(int64_t val, char* buf, int bufsize) {
     return len;
 }
 
-// Append string to buffer
-static int pfs_append(char* buf, int pos, int max, const char* str) {
-    while (*str && pos < max - 1) {
-        buf[pos++] = *str++;
+// ---- Output streams ----
+// Generators write through a pfs_seq_t and run again on every read: what
+// comes before the read offset is dropped, what falls in the reader's
+// buffer is copied there, and once that is full the rest is ignored (long
+// generators stop at pfs_seq_full()). Nothing is kept between reads, so a
+// file costs nothing until it is read and has no size limit; a reader
+// taking it in pieces sees each piece from a fresh pass, as with Linux's
+// seq_file.
+typedef struct {
+    char*    out;
+    uint64_t skip;          // Output still to drop before the read offset
+    uint32_t room;          // Space left in out
+    uint32_t done;          // Bytes stored in out
+    int      pid;           // Process of a /proc/<pid>/ file
+} pfs_seq_t;
+
+static void pfs_write(pfs_seq_t* s, const char* str, uint32_t n) {
+    if (s->skip) {
+        uint32_t drop = s->skip < n ? (uint32_t)s->skip : n;
+        s->skip -= drop;
+        str += drop;
+        n -= drop;
     }
-    buf[pos] = 0;
-    return pos;
+    if (n > s->room) n = s->room;
+    memcpy(s->out + s->done, str, (int)n);
+    s->done += n;
+    s->room -= n;
+}
+
+static int pfs_seq_full(const pfs_seq_t* s) {
+    return s->room == 0;
+}
+
+// Append string
+static void pfs_puts(pfs_seq_t* s, const char* str) {
+    pfs_write(s, str, (uint32_t)pfs_strlen(str));
 }
 
-// Append number to buffer
-static int pfs_append_num(char* buf, int pos, int max, int64_t val) {
+// Append number
+static void pfs_put_num(pfs_seq_t* s, int64_t val) {
     char tmp[24];
-    pfs_itoa(val, tmp, sizeof(tmp));
-    return pfs_append(buf, pos, max, tmp);
+    pfs_write(s, tmp, (uint32_t)pfs_itoa(val, tmp, sizeof(tmp)));
+}
+
+// Append number in hex (no prefix)
+static void pfs_put_hex(pfs_seq_t* s, uint64_t val) {
+    char tmp[17];
+    int n = 16;
+    tmp[n] = 0;
+    do {
+        tmp[--n] = "0123456789abcdef"[val & 0xF];
+        val >>= 4;
+    } while (val);
+    pfs_puts(s, tmp + n);
 }
 
 // ---- Procfs content generators ----
 
 // Generate /proc/meminfo content
-static int generate_meminfo(char* buf, int bufsize) {
+static void generate_meminfo(pfs_seq_t* s) {
     uint64_t total = 512 * 1024; // KB (512MB)
     uint64_t used  = 24 * 1024;  // KB (approximate)
     uint64_t free_mem = total - used;
 
-    int pos = 0;
-    pos = pfs_append(buf, pos, bufsize, "MemTotal:       ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)total);
-    pos = pfs_append(buf, pos, bufsize, " kB\n");
-    pos = pfs_append(buf, pos, bufsize, "MemFree:        ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)free_mem);
-    pos = pfs_append(buf, pos, bufsize, " kB\n");
-    pos = pfs_append(buf, pos, bufsize, "MemUsed:        ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)used);
-    pos = pfs_append(buf, pos, bufsize, " kB\n");
-    pos = pfs_append(buf, pos, bufsize, "Buffers:        0 kB\n");
-    pos = pfs_append(buf, pos, bufsize, "Cached:         0 kB\n");
-    return pos;
+    pfs_puts(s, "MemTotal:       ");
+    pfs_put_num(s, (int64_t)total);
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "MemFree:        ");
+    pfs_put_num(s, (int64_t)free_mem);
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "MemUsed:        ");
+    pfs_put_num(s, (int64_t)used);
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "Buffers:        0 kB\n");
+    pagecache_stats_t pc;
+    pagecache_get_stats(&pc);
+    pfs_puts(s, "Cached:         ");
+    pfs_put_num(s, (int64_t)(pc.pages * PAGECACHE_PAGE_SIZE / 1024));
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "Dirty:          ");
+    pfs_put_num(s, (int64_t)(pc.dirty * PAGECACHE_PAGE_SIZE / 1024));
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "Writeback:      ");
+    pfs_put_num(s, (int64_t)(pc.writeback * PAGECACHE_PAGE_SIZE / 1024));
+    pfs_puts(s, " kB\n");
+
+    // Compressed swap: pool size, and the anonymous memory it holds
+    zswap_stats_t zs;
+    zswap_get_stats(&zs);
+    pfs_puts(s, "Zswap:          ");
+    pfs_put_num(s, (int64_t)(zs.pool_pages * PAGECACHE_PAGE_SIZE / 1024));
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "Zswapped:       ");
+    pfs_put_num(s, (int64_t)(zs.stored * PAGECACHE_PAGE_SIZE / 1024));
+    pfs_puts(s, " kB\n");
+
+    // Kernel heap usage and fragmentation
+    heap_stats_t hs = heap_get_stats();
+    pfs_puts(s, "HeapTotal:      ");
+    pfs_put_num(s, (int64_t)(hs.total_bytes / 1024));
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "HeapUsed:       ");
+    pfs_put_num(s, (int64_t)(hs.used_bytes / 1024));
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "HeapFree:       ");
+    pfs_put_num(s, (int64_t)(hs.free_bytes / 1024));
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "HeapLargestFree:");
+    pfs_put_num(s, (int64_t)(hs.largest_free / 1024));
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "HeapSlabCached: ");
+    pfs_put_num(s, (int64_t)(hs.slab_cached_bytes / 1024));
+    pfs_puts(s, " kB\n");
+    pfs_puts(s, "HeapFreeBlocks: ");
+    pfs_put_num(s, (int64_t)hs.free_blocks);
+    pfs_puts(s, "\n");
+
+    // GPU VRAM heap, when a GPU was found
+    nv_vram_stats_t vs;
+    nv_vram_get_stats(&vs);
+    if (vs.total_bytes) {
+        pfs_puts(s, "VramTotal:      ");
+        pfs_put_num(s, (int64_t)(vs.total_bytes / 1024));
+        pfs_puts(s, " kB\n");
+        pfs_puts(s, "VramUsed:       ");
+        pfs_put_num(s, (int64_t)(vs.used_bytes / 1024));
+        pfs_puts(s, " kB\n");
+        pfs_puts(s, "VramPeak:       ");
+        pfs_put_num(s, (int64_t)(vs.peak_used / 1024));
+        pfs_puts(s, " kB\n");
+        pfs_puts(s, "VramLargestFree:");
+        pfs_put_num(s, (int64_t)(vs.largest_free / 1024));
+        pfs_puts(s, " kB\n");
+        pfs_puts(s, "VramFreeBlocks: ");
+        pfs_put_num(s, (int64_t)vs.free_blocks);
+        pfs_puts(s, "\n");
+        pfs_puts(s, "VramFragPct:    ");
+        pfs_put_num(s, (int64_t)vs.fragmentation);
+        pfs_puts(s, "\n");
+    }
 }
 
 // Generate /proc/cpuinfo content
-static int generate_cpuinfo(char* buf, int bufsize) {
-    int pos = 0;
-    pos = pfs_append(buf, pos, bufsize, "processor\t: 0\n");
-    pos = pfs_append(buf, pos, bufsize, "vendor_id\t: AlteoOS\n");
-    pos = pfs_append(buf, pos, bufsize, "model name\t: Alteo Virtual CPU\n");
-    pos = pfs_append(buf, pos, bufsize, "cpu MHz\t\t: 3000.000\n");
-    pos = pfs_append(buf, pos, bufsize, "cache size\t: 4096 KB\n");
-    pos = pfs_append(buf, pos, bufsize, "flags\t\t: fpu vme de pse tsc msr pae mce cx8 apic\n");
-    pos = pfs_append(buf, pos, bufsize, "bogomips\t: 6000.00\n");
-    pos = pfs_append(buf, pos, bufsize, "address sizes\t: 48 bits virtual, 40 bits physical\n");
-    return pos;
+static void generate_cpuinfo(pfs_seq_t* s) {
+    pfs_puts(s, "processor\t: 0\n");
+    pfs_puts(s, "vendor_id\t: AlteoOS\n");
+    pfs_puts(s, "model name\t: Alteo Virtual CPU\n");
+    pfs_puts(s, "cpu MHz\t\t: 3000.000\n");
+    pfs_puts(s, "cache size\t: 4096 KB\n");
+    pfs_puts(s, "flags\t\t: fpu vme de pse tsc msr pae mce cx8 apic\n");
+    pfs_puts(s, "bogomips\t: 6000.00\n");
+    pfs_puts(s, "address sizes\t: 48 bits virtual, 40 bits physical\n");
 }
 
 // Generate /proc/uptime content
-static int generate_uptime(char* buf, int bufsize) {
+static void generate_uptime(pfs_seq_t* s) {
     scheduler_stats_t st = scheduler_get_stats();
     uint64_t seconds = st.total_ticks / 100; // Assuming 100Hz timer
     uint64_t idle_sec = st.idle_ticks / 100;
 
-    int pos = 0;
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)seconds);
-    pos = pfs_append(buf, pos, bufsize, ".");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)(st.total_ticks % 100));
-    pos = pfs_append(buf, pos, bufsize, " ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)idle_sec);
-    pos = pfs_append(buf, pos, bufsize, ".");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)(st.idle_ticks % 100));
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    return pos;
+    pfs_put_num(s, (int64_t)seconds);
+    pfs_puts(s, ".");
+    pfs_put_num(s, (int64_t)(st.total_ticks % 100));
+    pfs_puts(s, " ");
+    pfs_put_num(s, (int64_t)idle_sec);
+    pfs_puts(s, ".");
+    pfs_put_num(s, (int64_t)(st.idle_ticks % 100));
+    pfs_puts(s, "\n");
 }
 
 // Generate /proc/version content
-static int generate_version(char* buf, int bufsize) {
-    return pfs_append(buf, 0, bufsize, "Alteo OS v5.0 (x86_64) #1 SMP\n");
+static void generate_version(pfs_seq_t* s) {
+    pfs_puts(s, "Alteo OS v5.0 (x86_64) #1 SMP\n");
 }
 
 // Generate /proc/stat content
-static int generate_stat(char* buf, int bufsize) {
+static void generate_stat(pfs_seq_t* s) {
     scheduler_stats_t st = scheduler_get_stats();
-    int pos = 0;
-    pos = pfs_append(buf, pos, bufsize, "cpu  ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)(st.total_ticks - st.idle_ticks));
-    pos = pfs_append(buf, pos, bufsize, " 0 0 ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)st.idle_ticks);
-    pos = pfs_append(buf, pos, bufsize, " 0 0 0 0 0 0\n");
-    pos = pfs_append(buf, pos, bufsize, "processes ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)process_count());
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    pos = pfs_append(buf, pos, bufsize, "procs_running ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)process_count_by_state(PROC_STATE_RUNNING));
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    pos = pfs_append(buf, pos, bufsize, "ctxt ");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)st.total_switches);
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    return pos;
+    pfs_puts(s, "cpu  ");
+    pfs_put_num(s, (int64_t)(st.total_ticks - st.idle_ticks));
+    pfs_puts(s, " 0 0 ");
+    pfs_put_num(s, (int64_t)st.idle_ticks);
+    pfs_puts(s, " 0 0 0 0 0 0\n");
+    pfs_puts(s, "processes ");
+    pfs_put_num(s, (int64_t)process_count());
+    pfs_puts(s, "\n");
+    pfs_puts(s, "procs_running ");
+    pfs_put_num(s, (int64_t)process_count_by_state(PROC_STATE_RUNNING));
+    pfs_puts(s, "\n");
+    pfs_puts(s, "ctxt ");
+    pfs_put_num(s, (int64_t)st.total_switches);
+    pfs_puts(s, "\n");
+
+    // Per CPU: "cpuN_activity ticks switches syscalls"
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu > 0 && !smp_cpu_online(cpu)) continue;
+        const smp_percpu_t* pc = smp_cpu_data(cpu);
+        const uint64_t v[3] = {pc->ticks, pc->switches, pc->syscalls};
+        pfs_puts(s, "cpu");
+        pfs_put_num(s, cpu);
+        pfs_puts(s, "_activity");
+        for (int i = 0; i < 3; i++) {
+            pfs_puts(s, " ");
+            pfs_put_num(s, (int64_t)v[i]);
+        }
+        pfs_puts(s, "\n");
+    }
+
+    // Per CPU: "cpuN_idle C1 usage time_us C2 usage time_us ..."
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu > 0 && !smp_cpu_online(cpu)) continue;
+        const cpuidle_usage_t* u = cpuidle_get_usage(cpu);
+        pfs_puts(s, "cpu");
+        pfs_put_num(s, cpu);
+        pfs_puts(s, "_idle");
+        for (int i = 0; i < cpuidle_state_count(); i++) {
+            pfs_puts(s, " ");
+            pfs_puts(s, cpuidle_get_state(i)->name);
+            pfs_puts(s, " ");
+            pfs_put_num(s, (int64_t)u[i].usage);
+            pfs_puts(s, " ");
+            pfs_put_num(s, (int64_t)(u[i].time_ns / 1000));
+        }
+        pfs_puts(s, "\n");
+    }
+}
+
+// ---- /proc/net ----
+
+// One "Name: field field ...\nName: value value ...\n" pair, as in
+// Linux's /proc/net/snmp
+static void pfs_put_row(pfs_seq_t* s, const char* prefix,
+                        const char* const* names, const uint64_t* vals, int n) {
+    pfs_puts(s, prefix);
+    for (int i = 0; i < n; i++) {
+        pfs_puts(s, " ");
+        pfs_puts(s, names[i]);
+    }
+    pfs_puts(s, "\n");
+    pfs_puts(s, prefix);
+    for (int i = 0; i < n; i++) {
+        pfs_puts(s, " ");
+        pfs_put_num(s, (int64_t)vals[i]);
+    }
+    pfs_puts(s, "\n");
+}
+
+static void pfs_put_dev(pfs_seq_t* s, const char* name,
+                        uint64_t rx_bytes, uint64_t rx_packets, uint64_t rx_errs, uint64_t rx_drop,
+                        uint64_t tx_bytes, uint64_t tx_packets, uint64_t tx_errs) {
+    const uint64_t v[7] = {rx_bytes, rx_packets, rx_errs, rx_drop, tx_bytes, tx_packets, tx_errs};
+    pfs_puts(s, name);
+    pfs_puts(s, ":");
+    for (int i = 0; i < 7; i++) {
+        pfs_puts(s, " ");
+        pfs_put_num(s, (int64_t)v[i]);
+    }
+    pfs_puts(s, "\n");
+}
+
+// Generate /proc/net/dev content
+static void generate_net_dev(pfs_seq_t* s) {
+    pfs_puts(s, "Inter-|   Receive               |  Transmit\n"
+                " face |bytes packets errs drop|bytes packets errs\n");
+    if (e1000_is_available()) {
+        e1000_stats_t st;
+        e1000_get_stats(&st);
+        pfs_put_dev(s, "  eth0", st.rx_bytes, st.rx_packets, st.rx_csum_errs,
+                    (uint64_t)st.rx_missed, st.tx_bytes, st.tx_packets, st.errors);
+    }
+    pfs_put_dev(s, "    lo", 0, lo_get_packets(), 0, lo_get_drops(),
+                0, lo_get_packets(), 0);
+}
+
+// Generate /proc/net/snmp content
+static void generate_net_snmp(pfs_seq_t* s) {
+    ip_stats_t ip;
+    ip_get_stats(&ip);
+    static const char* const ip_names[] = {
+        "InReceives", "InHdrErrors", "InCsumErrors", "InAddrErrors", "InUnknownProtos",
+        "InDelivers", "OutRequests", "OutDiscards", "OutNoRoutes", "OutLocal",
+    };
+    const uint64_t ip_vals[] = {
+        ip.in_receives, ip.in_hdr_errors, ip.in_csum_errors, ip.in_addr_errors, ip.in_unknown_protos,
+        ip.in_delivers, ip.out_requests, ip.out_discards, ip.out_no_neigh, ip.out_local,
+    };
+    pfs_put_row(s, "Ip:", ip_names, ip_vals, 10);
+
+    tcp_stats_t tcp;
+    tcp_get_stats(&tcp);
+    static const char* const tcp_names[] = {
+        "ActiveOpens", "PassiveOpens", "Aborts", "InSegs", "InErrs", "NoConn", "OutSegs", "RetransSegs",
+    };
+    const uint64_t tcp_vals[] = {
+        tcp.active_opens, tcp.passive_opens, tcp.aborts, tcp.in_segs, tcp.in_errs, tcp.no_conn,
+        tcp.out_segs, tcp.retrans_segs,
+    };
+    pfs_put_row(s, "Tcp:", tcp_names, tcp_vals, 8);
+
+    udp_stats_t udp;
+    udp_get_stats(&udp);
+    static const char* const udp_names[] = {
+        "InDatagrams", "NoPorts", "InErrors", "InCsumErrors", "RcvbufErrors", "OutDatagrams", "OutErrors",
+    };
+    const uint64_t udp_vals[] = {
+        udp.in_datagrams, udp.no_ports, udp.in_errors, udp.csum_errors, udp.rcvbuf_errors,
+        udp.out_datagrams, udp.out_errors,
+    };
+    pfs_put_row(s, "Udp:", udp_names, udp_vals, 7);
+
+    eth_stats_t eth;
+    eth_get_stats(&eth);
+    static const char* const eth_names[] = {
+        "InFrames", "InRunts", "InUnknownTypes", "RxStackNsAvg", "RxStackNsMax", "OutFrames", "OutErrors",
+    };
+    const uint64_t eth_vals[] = {
+        eth.rx_frames, eth.rx_runts, eth.rx_unknown, eth.rx_frames ? eth.rx_ns / eth.rx_frames : 0,
+        eth.rx_ns_max, eth.tx_frames, eth.tx_errors,
+    };
+    pfs_put_row(s, "Eth:", eth_names, eth_vals, 7);
+
+    static const char* const arp_names[] = {
+        "Requests", "Replies", "Held", "HeldDrops", "Evictions", "Failures",
+    };
+    const uint64_t arp_vals[] = {
+        eth.arp_requests, eth.arp_replies, eth.arp_held, eth.arp_held_drops, eth.arp_evictions,
+        eth.arp_failures,
+    };
+    pfs_put_row(s, "Arp:", arp_names, arp_vals, 6);
+}
+
+// Generate /proc/net/netstat content
+static void generate_net_netstat(pfs_seq_t* s) {
+
+    tcp_stats_t tcp;
+    tcp_get_stats(&tcp);
+    static const char* const ext_names[] = {
+        "TCPFastRetrans", "TCPTimeouts", "TCPOFOQueue", "TCPRcvPruned", "SyncookiesSent",
+        "ListenOverflows", "TCPRttSamples", "TCPRttAvgMs",
+    };
+    const uint64_t ext_vals[] = {
+        tcp.fast_retrans, tcp.timeouts, tcp.ofo_segs, tcp.rcv_pruned, tcp.syncookies_sent,
+        tcp.accept_overflows, tcp.rtt_samples, tcp.rtt_samples ? tcp.rtt_sum_ms / tcp.rtt_samples : 0,
+    };
+    pfs_put_row(s, "TcpExt:", ext_names, ext_vals, 8);
+
+    e1000_stats_t nic;
+    memset(&nic, 0, sizeof(nic));
+    if (e1000_is_available()) e1000_get_stats(&nic);
+    static const char* const nic_names[] = {
+        "RxMissed", "RxNoBufs", "RxCsumErrors", "RxIrqs", "RxBusyPolls", "TxKicks",
+    };
+    const uint64_t nic_vals[] = {
+        nic.rx_missed, nic.rx_no_bufs, nic.rx_csum_errs, nic.rx_irqs, nic.rx_busy_polls, nic.tx_kicks,
+    };
+    pfs_put_row(s, "NicExt:", nic_names, nic_vals, 6);
+
+    static const char* const cap_names[] = {"Active", "Captured", "Dropped"};
+    const uint64_t cap_vals[] = {
+        (uint64_t)nettap_active(), nettap_get_captured(), nettap_get_dropped(),
+    };
+    pfs_put_row(s, "Capture:", cap_names, cap_vals, 3);
+}
+
+// Generate /proc/lockstat content: one line per lock that has statistics
+// and has been taken, times in TSC cycles (tsc_hz converts them)
+static void generate_lockstat(pfs_seq_t* s) {
+    uint64_t base, hz;
+    timer_get_tsc(&base, &hz);
+    rcu_stats_t rcu = rcu_get_stats();
+
+    pfs_puts(s, "tsc_hz ");
+    pfs_put_num(s, (int64_t)hz);
+    pfs_puts(s, "\nrcu grace_periods ");
+    pfs_put_num(s, (int64_t)rcu.grace_periods);
+    pfs_puts(s, " wait_cycles ");
+    pfs_put_num(s, (int64_t)rcu.wait_cycles);
+    pfs_puts(s, "\nlock acquired contended spin_cycles hold_cycles max_hold_cycles\n");
+    for (lockstat_t* st = lockstat_first(); st; st = st->next) {
+        const uint64_t vals[] = {
+            st->acquired, st->contended, st->spin_cycles, st->hold_cycles, st->max_hold_cycles,
+        };
+        pfs_puts(s, st->name);
+        for (int i = 0; i < 5; i++) {
+            pfs_puts(s, " ");
+            pfs_put_num(s, (int64_t)vals[i]);
+        }
+        pfs_puts(s, "\n");
+    }
+}
+
+// Generate /proc/profile: histogram buckets by self samples, hottest
+// first, until the reader's buffer is full. Callers only seen on stacks have self 0.
+static void generate_profile(pfs_seq_t* s) {
+    static const char* const sources[] = { "none", "pmu", "timer" };
+    profile_stats_t st;
+    profile_get_stats(&st);
+
+    pfs_puts(s, "source ");
+    pfs_puts(s, sources[st.source]);
+    pfs_puts(s, " hz ");
+    pfs_put_num(s, st.hz);
+    pfs_puts(s, " samples ");
+    pfs_put_num(s, (int64_t)st.samples);
+    pfs_puts(s, " dropped ");
+    pfs_put_num(s, (int64_t)st.dropped);
+    pfs_puts(s, " overflow ");
+    pfs_put_num(s, (int64_t)st.overflow);
+    pfs_puts(s, "\naddr pid mode self total\n");
+
+    // Each pass picks the largest bucket ordered after the previous one
+    // (self descending, then index)
+    uint32_t last_self = ~0U;
+    int last_i = -1;
+    while (!pfs_seq_full(s)) {
+        int best = -1;
+        uint32_t best_self = 0;
+        for (int i = 0; i < PROFILE_HIST_SLOTS; i++) {
+            const profile_entry_t* e = profile_get_entry(i);
+            if (!e) continue;
+            if (e->self > last_self || (e->self == last_self && i <= last_i)) continue;
+            if (best < 0 || e->self > best_self) {
+                best = i;
+                best_self = e->self;
+            }
+        }
+        if (best < 0) break;
+        const profile_entry_t* e = profile_get_entry(best);
+        pfs_put_hex(s, e->addr);
+        pfs_puts(s, " ");
+        pfs_put_num(s, e->pid);
+        pfs_puts(s, e->user ? " u " : " k ");
+        pfs_put_num(s, e->self);
+        pfs_puts(s, " ");
+        pfs_put_num(s, e->total);
+        pfs_puts(s, "\n");
+        last_self = best_self;
+        last_i = best;
+    }
+}
+
+// Generate /proc/boottime: each init phase with the CPU it ran on, its
+// start relative to kernel entry and its length, in us (TSC cycles if the
+// TSC clock is not calibrated). "ready" is the first desktop frame.
+static void generate_boottime(pfs_seq_t* s) {
+    uint64_t base, hz;
+    timer_get_tsc(&base, &hz);
+    uint64_t t0 = boot_start_tsc();
+    uint64_t now = lock_tsc();
+
+    pfs_puts(s, hz ? "unit us ready " : "unit cycles ready ");
+    uint64_t ready = boot_ready_tsc() ? boot_ready_tsc() - t0 : 0;
+    pfs_put_num(s, (int64_t)(hz ? ready * 1000000 / hz : ready));
+    pfs_puts(s, "\nphase cpu start duration\n");
+    for (int i = 0; i < boot_phase_count(); i++) {
+        const boot_phase_t* ph = boot_get_phase(i);
+        uint64_t start = ph->start_tsc - t0;
+        uint64_t len = (ph->end_tsc ? ph->end_tsc : now) - ph->start_tsc;
+        if (hz) {
+            start = start * 1000000 / hz;
+            len = len * 1000000 / hz;
+        }
+        pfs_puts(s, ph->name);
+        pfs_puts(s, " ");
+        pfs_put_num(s, ph->cpu);
+        pfs_puts(s, " ");
+        pfs_put_num(s, (int64_t)start);
+        pfs_puts(s, " ");
+        pfs_put_num(s, (int64_t)len);
+        if (ph->deferred) pfs_puts(s, ph->end_tsc ? " deferred" : " deferred running");
+        pfs_puts(s, "\n");
+    }
+}
+
+// Generate /proc/frametime: frame counts, the scheduler's refresh interval
+// and budget, average and worst time per phase, then the histograms (row
+// b counts frames taking [2^b, 2^(b+1)) us, the last row all longer ones)
+static void generate_frametime(pfs_seq_t* s) {
+    frame_stats_t st;
+    frame_get_stats(&st);
+    pfs_puts(s, "frames ");        pfs_put_num(s, (int64_t)st.frames);
+    pfs_puts(s, "\nmissed ");      pfs_put_num(s, (int64_t)st.missed);
+    pfs_puts(s, "\nperiod_us ");   pfs_put_num(s, (int64_t)(st.period_ns / 1000));
+    pfs_puts(s, "\nestimate_us "); pfs_put_num(s, (int64_t)(st.estimate_ns / 1000));
+    pfs_puts(s, st.vblank_irq ? "\nvblank irq\n" : "\nvblank timer\n");
+
+    pfs_puts(s, "phase avg_us max_us\n");
+    for (int p = 0; p <= FRAME_PHASES; p++) {
+        pfs_puts(s, frame_phase_name(p));
+        pfs_puts(s, " ");
+        pfs_put_num(s, st.frames ? (int64_t)(st.sum_us[p] / st.frames) : 0);
+        pfs_puts(s, " ");
+        pfs_put_num(s, st.max_us[p]);
+        pfs_puts(s, "\n");
+    }
+
+    pfs_puts(s, "bucket_us");
+    for (int p = 0; p <= FRAME_PHASES; p++) {
+        pfs_puts(s, " ");
+        pfs_puts(s, frame_phase_name(p));
+    }
+    pfs_puts(s, "\n");
+    for (int b = 0; b < FRAME_HIST_BUCKETS; b++) {
+        pfs_put_num(s, b ? 1LL << b : 0);
+        for (int p = 0; p <= FRAME_PHASES; p++) {
+            pfs_puts(s, " ");
+            pfs_put_num(s, (int64_t)st.hist[p][b]);
+        }
+        pfs_puts(s, "\n");
+    }
 }
 
 // Generate /proc/<pid>/status content
-static int generate_pid_status(int pid, char* buf, int bufsize) {
-    process_t* p = process_get(pid);
-    if (!p) return 0;
-
-    int pos = 0;
-    pos = pfs_append(buf, pos, bufsize, "Name:\t");
-    pos = pfs_append(buf, pos, bufsize, p->name);
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    pos = pfs_append(buf, pos, bufsize, "State:\t");
-    pos = pfs_append(buf, pos, bufsize, process_state_name(p->state));
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    pos = pfs_append(buf, pos, bufsize, "Pid:\t");
-    pos = pfs_append_num(buf, pos, bufsize, p->pid);
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    pos = pfs_append(buf, pos, bufsize, "PPid:\t");
-    pos = pfs_append_num(buf, pos, bufsize, p->ppid);
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    pos = pfs_append(buf, pos, bufsize, "Priority:\t");
-    pos = pfs_append_num(buf, pos, bufsize, p->priority);
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    pos = pfs_append(buf, pos, bufsize, "CpuTime:\t");
-    pos = pfs_append_num(buf, pos, bufsize, (int64_t)p->cpu_time);
-    pos = pfs_append(buf, pos, bufsize, "\n");
-    return pos;
+static void generate_pid_status(pfs_seq_t* s) {
+    process_t* p = process_get(s->pid);
+    if (!p) return;
+
+    pfs_puts(s, "Name:\t");
+    pfs_puts(s, p->name);
+    pfs_puts(s, "\n");
+    pfs_puts(s, "State:\t");
+    pfs_puts(s, process_state_name(p->state));
+    pfs_puts(s, "\n");
+    pfs_puts(s, "Pid:\t");
+    pfs_put_num(s, p->pid);
+    pfs_puts(s, "\n");
+    pfs_puts(s, "PPid:\t");
+    pfs_put_num(s, p->ppid);
+    pfs_puts(s, "\n");
+    pfs_puts(s, "Priority:\t");
+    pfs_put_num(s, p->priority);
+    pfs_puts(s, "\n");
+    pfs_puts(s, "CpuTime:\t");
+    pfs_put_num(s, (int64_t)p->cpu_time);
+    pfs_puts(s, "\n");
+
+    // Resource usage; times in us. A state the process is in right now
+    // has not been charged yet, so add its time so far.
+    proc_acct_t a = p->acct;
+    uint64_t now_ns = timer_now_ns() - a.state_since;
+    if (p->state == PROC_STATE_READY) a.wait_ns += now_ns;
+    if (p->state == PROC_STATE_BLOCKED) a.blocked_ns += now_ns;
+    if (p->state == PROC_STATE_SLEEPING) a.sleep_ns += now_ns;
+    static const char* const names[] = {
+        "voluntary_ctxt_switches:\t", "nonvoluntary_ctxt_switches:\t", "MinFlt:\t", "MajFlt:\t",
+        "ReadBytes:\t", "WriteBytes:\t", "WaitTime:\t", "BlockedTime:\t", "SleepTime:\t",
+    };
+    const uint64_t vals[] = {
+        a.nvcsw, a.nivcsw, a.min_flt, a.maj_flt, a.read_bytes, a.write_bytes,
+        a.wait_ns / 1000, a.blocked_ns / 1000, a.sleep_ns / 1000,
+    };
+    for (int i = 0; i < 9; i++) {
+        pfs_puts(s, names[i]);
+        pfs_put_num(s, (int64_t)vals[i]);
+        pfs_puts(s, "\n");
+    }
 }
 
 // ---- procfs VFS integration ----
 
-// Content cache for procfs files (regenerated on open)
+// Open procfs files: just what to generate and how far it was read
 #define PROCFS_MAX_FDS     16
-#define PROCFS_BUF_SIZE    2048
 
 typedef struct {
-    char     buf[PROCFS_BUF_SIZE];
-    int      size;
-    uint32_t offset;
+    int      type;          // PROCFS_*
     int      in_use;
+    int      pid;           // For PROCFS_PID_STATUS
+    uint64_t offset;
 } procfs_fd_t;
 
 static procfs_fd_t procfs_fds[PROCFS_MAX_FDS];
@@ -197,9 +641,36 @@ enum {
     PROCFS_VERSION,
     PROCFS_STAT,
     PROCFS_PID_STATUS,
+    PROCFS_NET_DEV,
+    PROCFS_NET_SNMP,
+    PROCFS_NET_NETSTAT,
+    PROCFS_LOCKSTAT,
+    PROCFS_PROFILE,
+    PROCFS_BOOTTIME,
+    PROCFS_FRAMETIME,
 };
 
+// "<pid>" or "<pid>/<rest>" (under "/proc/" or "/"): the pid, with *rest
+// pointing behind it; -1 if the path does not start with a live pid
+static int pfs_pid_path(const char* path, const char** rest) {
+    const char* p = path;
+    if (p[0] == '/') p++;
+    if (p[0] == 'p' && p[1] == 'r' && p[2] == 'o' && p[3] == 'c' && p[4] == '/') p += 5;
+    if (*p < '0' || *p > '9') return -1;
+    int pid = 0;
+    while (*p >= '0' && *p <= '9') pid = pid * 10 + (*p++ - '0');
+    if (*p && *p != '/') return -1;
+    if (!process_get(pid)) return -1;
+    *rest = *p ? p + 1 : p;
+    return pid;
+}
+
 static int identify_proc_file(const char* path) {
+    const char* rest;
+    if (pfs_pid_path(path, &rest) >= 0) {
+        return pfs_strcmp(rest, "status") == 0 ? PROCFS_PID_STATUS : 0;
+    }
+
     // Strip leading "/proc/" or "/"
     const char* p = path;
     if (p[0] == '/') p++;
@@ -208,14 +679,38 @@ static int identify_proc_file(const char* path) {
     if (pfs_strcmp(p, "uptime") == 0 || pfs_strcmp(p, "proc/uptime") == 0)   return PROCFS_UPTIME;
     if (pfs_strcmp(p, "version") == 0 || pfs_strcmp(p, "proc/version") == 0) return PROCFS_VERSION;
     if (pfs_strcmp(p, "stat") == 0 || pfs_strcmp(p, "proc/stat") == 0)       return PROCFS_STAT;
+    if (pfs_strcmp(p, "lockstat") == 0 || pfs_strcmp(p, "proc/lockstat") == 0) return PROCFS_LOCKSTAT;
+    if (pfs_strcmp(p, "profile") == 0 || pfs_strcmp(p, "proc/profile") == 0) return PROCFS_PROFILE;
+    if (pfs_strcmp(p, "boottime") == 0 || pfs_strcmp(p, "proc/boottime") == 0) return PROCFS_BOOTTIME;
+    if (pfs_strcmp(p, "frametime") == 0 || pfs_strcmp(p, "proc/frametime") == 0) return PROCFS_FRAMETIME;
+    if (pfs_strcmp(p, "net/dev") == 0 || pfs_strcmp(p, "proc/net/dev") == 0) return PROCFS_NET_DEV;
+    if (pfs_strcmp(p, "net/snmp") == 0 || pfs_strcmp(p, "proc/net/snmp") == 0) return PROCFS_NET_SNMP;
+    if (pfs_strcmp(p, "net/netstat") == 0 || pfs_strcmp(p, "proc/net/netstat") == 0) return PROCFS_NET_NETSTAT;
     return 0;
 }
 
+// Generator per PROCFS_* type
+static void (*const generators[])(pfs_seq_t*) = {
+    [PROCFS_MEMINFO]     = generate_meminfo,
+    [PROCFS_CPUINFO]     = generate_cpuinfo,
+    [PROCFS_UPTIME]      = generate_uptime,
+    [PROCFS_VERSION]     = generate_version,
+    [PROCFS_STAT]        = generate_stat,
+    [PROCFS_PID_STATUS]  = generate_pid_status,
+    [PROCFS_NET_DEV]     = generate_net_dev,
+    [PROCFS_NET_SNMP]    = generate_net_snmp,
+    [PROCFS_NET_NETSTAT] = generate_net_netstat,
+    [PROCFS_LOCKSTAT]    = generate_lockstat,
+    [PROCFS_PROFILE]     = generate_profile,
+    [PROCFS_BOOTTIME]    = generate_boottime,
+    [PROCFS_FRAMETIME]   = generate_frametime,
+};
+
 static int procfs_open(void* fs_data, const char* path, int flags) {
     (void)fs_data; (void)flags;
 
     int type = identify_proc_file(path);
-    if (type == 0) return -1;
+    if (type == 0 || !generators[type]) return -1;
 
     // Find a free fd
     int fd = -1;
@@ -225,30 +720,12 @@ static int procfs_open(void* fs_data, const char* path, int flags) {
     if (fd < 0) return -1;
 
     procfs_fds[fd].in_use = 1;
+    procfs_fds[fd].type = type;
     procfs_fds[fd].offset = 0;
-
-    // Generate content
-    switch (type) {
-        case PROCFS_MEMINFO:
-            procfs_fds[fd].size = generate_meminfo(procfs_fds[fd].buf, PROCFS_BUF_SIZE);
-            break;
-        case PROCFS_CPUINFO:
-            procfs_fds[fd].size = generate_cpuinfo(procfs_fds[fd].buf, PROCFS_BUF_SIZE);
-            break;
-        case PROCFS_UPTIME:
-            procfs_fds[fd].size = generate_uptime(procfs_fds[fd].buf, PROCFS_BUF_SIZE);
-            break;
-        case PROCFS_VERSION:
-            procfs_fds[fd].size = generate_version(procfs_fds[fd].buf, PROCFS_BUF_SIZE);
-            break;
-        case PROCFS_STAT:
-            procfs_fds[fd].size = generate_stat(procfs_fds[fd].buf, PROCFS_BUF_SIZE);
-            break;
-        default:
-            procfs_fds[fd].in_use = 0;
-            return -1;
+    if (type == PROCFS_PID_STATUS) {
+        const char* rest;
+        procfs_fds[fd].pid = pfs_pid_path(path, &rest);
     }
-
     return fd;
 }
 
@@ -263,14 +740,12 @@ static int procfs_read(void* fs_data, int fd, void* buf, uint32_t count) {
     (void)fs_data;
     if (fd < 0 || fd >= PROCFS_MAX_FDS || !procfs_fds[fd].in_use) return -1;
 
+    // Generated afresh from the start, keeping only [offset, offset + count)
     procfs_fd_t* pfd = &procfs_fds[fd];
-    uint32_t avail = (uint32_t)pfd->size - pfd->offset;
-    if (count > avail) count = avail;
-    if (count == 0) return 0;
-
-    pfs_memcpy(buf, pfd->buf + pfd->offset, (int)count);
-    pfd->offset += count;
-    return (int)count;
+    pfs_seq_t seq = { .out = (char*)buf, .skip = pfd->offset, .room = count, .done = 0, .pid = pfd->pid };
+    generators[pfd->type](&seq);
+    pfd->offset += seq.done;
+    return (int)seq.done;
 }
 
 static int procfs_write(void* fs_data, int fd, const void* buf, uint32_t count) {
@@ -278,13 +753,43 @@ static int procfs_write(void* fs_data, int fd, const void* buf, uint32_t count)
     return -1; // procfs is read-only
 }
 
+static int procfs_is_net_dir(const char* path) {
+    const char* p = path;
+    if (p[0] == '/') p++;
+    return pfs_strcmp(p, "net") == 0 || pfs_strcmp(p, "proc/net") == 0 ||
+           pfs_strcmp(p, "net/") == 0 || pfs_strcmp(p, "proc/net/") == 0;
+}
+
 static int procfs_readdir(void* fs_data, const char* path, vfs_dirent_t* entries, int max) {
-    (void)fs_data; (void)path;
+    (void)fs_data;
     int count = 0;
 
+    const char* rest;
+    if (path && pfs_pid_path(path, &rest) >= 0 && !*rest) {
+        if (max < 1) return 0;
+        pfs_strncpy(entries[0].name, "status", VFS_MAX_NAME);
+        entries[0].type = VFS_FILE;
+        entries[0].size = 0;
+        entries[0].perms = VFS_PERM_READ;
+        return 1;
+    }
+
+    if (path && procfs_is_net_dir(path)) {
+        const char* net_names[] = {"dev", "snmp", "netstat"};
+        for (int i = 0; i < 3 && count < max; i++) {
+            pfs_strncpy(entries[count].name, net_names[i], VFS_MAX_NAME);
+            entries[count].type = VFS_FILE;
+            entries[count].size = 0;
+            entries[count].perms = VFS_PERM_READ;
+            count++;
+        }
+        return count;
+    }
+
     // Static entries
-    const char* names[] = {"meminfo", "cpuinfo", "uptime", "version", "stat"};
-    for (int i = 0; i < 5 && count < max; i++) {
+    const char* names[] = {"meminfo", "cpuinfo", "uptime", "version", "stat", "lockstat", "profile", "boottime",
+                           "frametime"};
+    for (int i = 0; i < 9 && count < max; i++) {
         pfs_strncpy(entries[count].name, names[i], VFS_MAX_NAME);
         entries[count].type = VFS_FILE;
         entries[count].size = 0;
@@ -306,6 +811,14 @@ static int procfs_readdir(void* fs_data, const char* path, vfs_dirent_t* entries
         }
     }
 
+    if (count < max) {
+        pfs_strncpy(entries[count].name, "net", VFS_MAX_NAME);
+        entries[count].type = VFS_DIRECTORY;
+        entries[count].size = 0;
+        entries[count].perms = VFS_PERM_READ | VFS_PERM_EXEC;
+        count++;
+    }
+
     return count;
 }
 
@@ -324,6 +837,22 @@ static int procfs_stat_op(void* fs_data, const char* path, vfs_dirent_t* out) {
         out->perms = VFS_PERM_READ;
         return 0;
     }
+    const char* rest;
+    int pid = pfs_pid_path(path, &rest);
+    if (pid >= 0 && !*rest) {
+        pfs_itoa(pid, out->name, VFS_MAX_NAME);
+        out->type = VFS_DIRECTORY;
+        out->size = 0;
+        out->perms = VFS_PERM_READ | VFS_PERM_EXEC;
+        return 0;
+    }
+    if (procfs_is_net_dir(path)) {
+        pfs_strncpy(out->name, "net", VFS_MAX_NAME);
+        out->type = VFS_DIRECTORY;
+        out->size = 0;
+        out->perms = VFS_PERM_READ | VFS_PERM_EXEC;
+        return 0;
+    }
     return -1;
 }
 
@@ -361,7 +890,7 @@ vfs_fs_ops_t* procfs_get_ops(void) {
 }
 
 void procfs_init(void) {
-    pfs_memset(procfs_fds, 0, sizeof(procfs_fds));
+    memset(procfs_fds, 0, sizeof(procfs_fds));
 
     // Ensure /proc exists in VFS
     if (!vfs_exists("/proc")) {
@@ -374,6 +903,15 @@ void procfs_init(void) {
     vfs_create("/proc/uptime", VFS_FILE, VFS_PERM_READ);
     vfs_create("/proc/version", VFS_FILE, VFS_PERM_READ);
     vfs_create("/proc/stat", VFS_FILE, VFS_PERM_READ);
+    vfs_create("/proc/lockstat", VFS_FILE, VFS_PERM_READ);
+    vfs_create("/proc/profile", VFS_FILE, VFS_PERM_READ);
+    vfs_create("/proc/boottime", VFS_FILE, VFS_PERM_READ);
+    if (!vfs_exists("/proc/net")) {
+        vfs_mkdir("/proc/net");
+    }
+    vfs_create("/proc/net/dev", VFS_FILE, VFS_PERM_READ);
+    vfs_create("/proc/net/snmp", VFS_FILE, VFS_PERM_READ);
+    vfs_create("/proc/net/netstat", VFS_FILE, VFS_PERM_READ);
 
     // Pre-populate /proc/version content into VFS node
     {
@@ -388,38 +926,3 @@ void procfs_init(void) {
     // Mount procfs
     vfs_mount("/proc", "procfs", &procfs_ops, 0);
 }
-
-void procfs_refresh(void) {
-    // Update /proc/meminfo content in VFS
-    {
-        char buf[PROCFS_BUF_SIZE];
-        int len = generate_meminfo(buf, PROCFS_BUF_SIZE);
-        int fd = vfs_open("/proc/meminfo", VFS_O_WRONLY | VFS_O_TRUNC);
-        if (fd >= 0) {
-            vfs_write(fd, buf, (uint32_t)len);
-            vfs_close(fd);
-        }
-    }
-
-    // Update /proc/uptime
-    {
-        char buf[PROCFS_BUF_SIZE];
-        int len = generate_uptime(buf, PROCFS_BUF_SIZE);
-        int fd = vfs_open("/proc/uptime", VFS_O_WRONLY | VFS_O_TRUNC);
-        if (fd >= 0) {
-            vfs_write(fd, buf, (uint32_t)len);
-            vfs_close(fd);
-        }
-    }
-
-    // Update /proc/stat
-    {
-        char buf[PROCFS_BUF_SIZE];
-        int len = generate_stat(buf, PROCFS_BUF_SIZE);
-        int fd = vfs_open("/proc/stat", VFS_O_WRONLY | VFS_O_TRUNC);
-        if (fd >= 0) {
-            vfs_write(fd, buf, (uint32_t)len);
-            vfs_close(fd);
-        }
-    }
-}
@@ -12,7 +12,4 @@ void procfs_init(void);
 // Get the VFS filesystem operations for procfs
 vfs_fs_ops_t* procfs_get_ops(void);
 
-// Refresh procfs entries (call periodically or on process changes)
-void procfs_refresh(void);
-
 #endif
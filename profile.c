@@ -0,0 +1,314 @@
+// profile.c - Sampling Profiler for Alteo OS
+#include "profile.h"
+#include "klib.h"
+#include "heap.h"
+#include "isr.h"
+#include "vmm.h"
+#include "apic.h"
+#include "smp.h"
+#include "timer.h"
+#include "spinlock.h"
+#include "devfs.h"
+
+// Architectural performance monitoring (Intel SDM vol. 3, ch. 20)
+#define MSR_PMC0                    0x0C1
+#define MSR_PERFEVTSEL0             0x186
+#define MSR_PERF_GLOBAL_STATUS      0x38E
+#define MSR_PERF_GLOBAL_CTRL        0x38F
+#define MSR_PERF_GLOBAL_OVF_CTRL    0x390
+
+#define PERFEVT_CORE_CYCLES         0x3C        // UnHalted Core Cycles, umask 0
+#define PERFEVT_USR                 (1U << 16)
+#define PERFEVT_OS                  (1U << 17)
+#define PERFEVT_INT                 (1U << 20)  // Interrupt on overflow
+#define PERFEVT_EN                  (1U << 22)
+
+#define LAPIC_LVT_MASKED            0x00010000
+
+extern char _text_start[], _text_end[];         // linker.ld
+
+typedef struct {
+    profile_sample_t* buf;              // Allocated on the first start
+    volatile uint32_t head;             // Only this CPU writes it
+    volatile uint32_t tail;             // Advanced by the drain (hist_lock)
+    uint64_t dropped;                   // Only this CPU writes it
+} __attribute__((aligned(64))) profile_cpu_t;
+
+static profile_cpu_t prof_cpus[SMP_MAX_CPUS];
+static profile_entry_t* hist;
+static spinlock_t hist_lock = SPINLOCK_INIT;
+static profile_stats_t stats;
+static uint64_t dropped_base;           // Per-CPU drops before the last reset
+static volatile int prof_on = 0;
+static uint32_t run_gen = 0;            // Events of an earlier run retire
+
+static int pmu_version = 0;             // 0 = no usable counter
+static uint64_t pmu_mask;               // Counter width
+static int pmu_vector = -1;
+static uint64_t pmu_period;             // Core cycles per sample
+
+static uint64_t timer_period_ns;
+static int sample_event = -1;
+static int drain_event = -1;
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+// ---- Sampling (interrupts off) ----
+
+static void profile_record(registers_t* regs) {
+    smp_percpu_t* pc = smp_this_cpu();
+    profile_cpu_t* c = &prof_cpus[pc->cpu];
+    if (!c->buf) return;
+    if (c->head - c->tail >= PROFILE_BUF_SAMPLES) {
+        c->dropped++;
+        return;
+    }
+
+    profile_sample_t* s = &c->buf[c->head & (PROFILE_BUF_SAMPLES - 1)];
+    s->rip = regs->rip;
+    s->pid = pc->pid;
+    s->user = (regs->cs & 3) != 0;
+    s->depth = 0;
+    if (!s->user) {
+        // Words of the interrupted stack that point into .text; stay in
+        // the page rsp is in, the next one may be a guard page
+        uint64_t* sp = (uint64_t*)regs->rsp;
+        uint64_t* end = (uint64_t*)((regs->rsp | (VMM_PAGE_SIZE - 1)) + 1);
+        for (int i = 0; i < PROFILE_STACK_SCAN && sp + i < end; i++) {
+            uint64_t v = sp[i];
+            if (v < (uint64_t)_text_start || v >= (uint64_t)_text_end) continue;
+            s->stack[s->depth++] = v;
+            if (s->depth == PROFILE_STACK_DEPTH) break;
+        }
+    }
+    __asm__ volatile("" ::: "memory");
+    c->head++;
+}
+
+static uint64_t pmu_reload(void) {
+    return (uint64_t)(-(int64_t)pmu_period) & pmu_mask;
+}
+
+// Counter overflow. Delivery sets the LVT mask bit on many CPUs, so the
+// entry is rewritten each time.
+static void pmu_irq(registers_t* regs) {
+    if (pmu_version >= 2) wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, rdmsr(MSR_PERF_GLOBAL_STATUS) & 1);
+    if (prof_on) {
+        profile_record(regs);
+        wrmsr(MSR_PMC0, pmu_reload());
+        lapic_write(LAPIC_PERF, (uint32_t)pmu_vector);
+    }
+    lapic_eoi();
+}
+
+static void profile_timer_tick(uint64_t arg) {
+    if (!prof_on || arg != run_gen) return;
+    registers_t* regs = timer_irq_frame();
+    if (regs) profile_record(regs);
+    sample_event = timer_add(timer_now_ns() + timer_period_ns, profile_timer_tick, arg);
+}
+
+// ---- Counter setup ----
+
+// Start or stop the counter to match prof_on. Only the BSP is online, so
+// its counter is the only one to program.
+static void pmu_reprogram(void) {
+    wrmsr(MSR_PERFEVTSEL0, 0);
+    if (prof_on) {
+        wrmsr(MSR_PMC0, pmu_reload());
+        lapic_write(LAPIC_PERF, (uint32_t)pmu_vector);
+        if (pmu_version >= 2) wrmsr(MSR_PERF_GLOBAL_CTRL, rdmsr(MSR_PERF_GLOBAL_CTRL) | 1);
+        wrmsr(MSR_PERFEVTSEL0, PERFEVT_CORE_CYCLES | PERFEVT_USR | PERFEVT_OS |
+                               PERFEVT_INT | PERFEVT_EN);
+    } else {
+        lapic_write(LAPIC_PERF, LAPIC_LVT_MASKED | (uint32_t)pmu_vector);
+    }
+}
+
+// ---- Histogram (hist_lock held) ----
+
+static profile_entry_t* hist_find(uint64_t addr, int32_t pid, uint16_t user) {
+    uint32_t h = (uint32_t)((addr * 0x9E3779B97F4A7C15ULL) >> 32) ^ ((uint32_t)pid * 0x85EBCA6BU) ^ user;
+    for (int probe = 0; probe < 32; probe++) {
+        profile_entry_t* e = &hist[(h + (uint32_t)probe) & (PROFILE_HIST_SLOTS - 1)];
+        if (!e->used) {
+            e->used = 1;
+            e->addr = addr;
+            e->pid = pid;
+            e->user = user;
+            return e;
+        }
+        if (e->addr == addr && e->pid == pid && e->user == user) return e;
+    }
+    stats.overflow++;
+    return 0;
+}
+
+static void profile_drain_locked(void) {
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        profile_cpu_t* c = &prof_cpus[cpu];
+        if (!c->buf) continue;
+        uint32_t head = c->head;
+        while (c->tail != head) {
+            profile_sample_t* s = &c->buf[c->tail & (PROFILE_BUF_SAMPLES - 1)];
+            profile_entry_t* e = hist_find(s->rip, s->pid, s->user);
+            if (e) {
+                e->self++;
+                e->total++;
+            }
+            // Each caller counts once per sample
+            for (int d = 0; d < s->depth; d++) {
+                int seen = s->stack[d] == s->rip;
+                for (int k = 0; k < d && !seen; k++) seen = s->stack[k] == s->stack[d];
+                if (seen) continue;
+                e = hist_find(s->stack[d], s->pid, 0);
+                if (e) e->total++;
+            }
+            stats.samples++;
+            c->tail++;
+        }
+    }
+}
+
+static void profile_drain_tick(uint64_t arg) {
+    if (!prof_on || arg != run_gen) return;
+    uint64_t flags = spin_lock_irqsave(&hist_lock);
+    profile_drain_locked();
+    spin_unlock_irqrestore(&hist_lock, flags);
+    drain_event = timer_add(timer_now_ns() + PROFILE_DRAIN_NS, profile_drain_tick, arg);
+}
+
+// ---- Control ----
+
+int profile_start(uint32_t hz) {
+    if (!timer_is_active()) return -1;
+    if (prof_on) profile_stop();
+    if (hz == 0) hz = PROFILE_DEFAULT_HZ;
+    if (hz > PROFILE_MAX_HZ) hz = PROFILE_MAX_HZ;
+
+    if (!hist) {
+        hist = (profile_entry_t*)kmalloc(PROFILE_HIST_SLOTS * sizeof(profile_entry_t));
+        if (!hist) return -1;
+        memset(hist, 0, PROFILE_HIST_SLOTS * sizeof(profile_entry_t));
+    }
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (prof_cpus[cpu].buf || (cpu > 0 && !smp_cpu_online(cpu))) continue;
+        profile_sample_t* buf = (profile_sample_t*)kmalloc(PROFILE_BUF_SAMPLES * sizeof(profile_sample_t));
+        if (!buf) return -1;
+        prof_cpus[cpu].buf = buf;
+    }
+
+    uint64_t tsc_base, tsc_hz;
+    timer_get_tsc(&tsc_base, &tsc_hz);
+    stats.hz = hz;
+    run_gen++;
+    prof_on = 1;
+    if (pmu_version && pmu_vector >= 0 && tsc_hz) {
+        // Core cycles at the TSC's nominal rate; legacy PMC writes
+        // sign-extend bit 31, so the reload must fit in 31 bits
+        pmu_period = tsc_hz / hz;
+        if (pmu_period > 0x7FFFFFFF) pmu_period = 0x7FFFFFFF;
+        stats.source = PROFILE_SRC_PMU;
+        pmu_reprogram();
+    } else {
+        timer_period_ns = TIMER_NS_PER_SEC / hz;
+        stats.source = PROFILE_SRC_TIMER;
+        sample_event = timer_add(timer_now_ns() + timer_period_ns, profile_timer_tick, run_gen);
+    }
+    drain_event = timer_add(timer_now_ns() + PROFILE_DRAIN_NS, profile_drain_tick, run_gen);
+    return 0;
+}
+
+void profile_stop(void) {
+    if (!prof_on) return;
+    prof_on = 0;
+    if (sample_event >= 0) timer_cancel(sample_event);
+    if (drain_event >= 0) timer_cancel(drain_event);
+    sample_event = drain_event = -1;
+    if (stats.source == PROFILE_SRC_PMU) pmu_reprogram();
+    stats.source = PROFILE_SRC_NONE;
+
+    uint64_t flags = spin_lock_irqsave(&hist_lock);
+    profile_drain_locked();
+    spin_unlock_irqrestore(&hist_lock, flags);
+}
+
+void profile_reset(void) {
+    uint64_t flags = spin_lock_irqsave(&hist_lock);
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) prof_cpus[cpu].tail = prof_cpus[cpu].head;
+    if (hist) memset(hist, 0, PROFILE_HIST_SLOTS * sizeof(profile_entry_t));
+    stats.samples = 0;
+    stats.overflow = 0;
+    dropped_base = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) dropped_base += prof_cpus[cpu].dropped;
+    spin_unlock_irqrestore(&hist_lock, flags);
+}
+
+void profile_get_stats(profile_stats_t* out) {
+    uint64_t flags = spin_lock_irqsave(&hist_lock);
+    profile_drain_locked();
+    *out = stats;
+    out->dropped = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) out->dropped += prof_cpus[cpu].dropped;
+    out->dropped -= dropped_base;
+    spin_unlock_irqrestore(&hist_lock, flags);
+}
+
+const profile_entry_t* profile_get_entry(int i) {
+    if (!hist || i < 0 || i >= PROFILE_HIST_SLOTS || !hist[i].used) return 0;
+    return &hist[i];
+}
+
+// ---- /dev/profile ----
+
+// A rate in Hz starts profiling, "0" stops it, "reset" clears the histogram
+static int profile_dev_write(void* data, const void* buf, uint32_t count, uint32_t offset) {
+    (void)data; (void)offset;
+    const char* s = (const char*)buf;
+    if (count == 0) return 0;
+    if (count >= 5 && s[0] == 'r' && s[1] == 'e' && s[2] == 's' && s[3] == 'e' && s[4] == 't') {
+        profile_reset();
+        return (int)count;
+    }
+    if (s[0] < '0' || s[0] > '9') return -1;
+    uint32_t hz = 0;
+    for (uint32_t i = 0; i < count && s[i] >= '0' && s[i] <= '9'; i++)
+        hz = hz * 10 + (uint32_t)(s[i] - '0');
+    if (hz == 0) {
+        profile_stop();
+        return (int)count;
+    }
+    return profile_start(hz) < 0 ? -1 : (int)count;
+}
+
+void profile_init(void) {
+    // Leaf 0xA: version, general counters, their width; EBX bit 0 set
+    // means the core-cycles event is not available
+    uint32_t a, b, c, d;
+    cpuid(0, &a, &b, &c, &d);
+    if (a >= 0xA) {
+        cpuid(0xA, &a, &b, &c, &d);
+        uint32_t width = (a >> 16) & 0xFF;
+        if ((a & 0xFF) >= 1 && ((a >> 8) & 0xFF) >= 1 && width >= 32 && !(b & 1)) {
+            pmu_version = (int)(a & 0xFF);
+            pmu_mask = width >= 64 ? ~0ULL : (1ULL << width) - 1;
+            pmu_vector = isr_alloc_vector(pmu_irq);
+        }
+    }
+
+    dev_ops_t ops = { .read = 0, .write = profile_dev_write, .ioctl = 0,
+                      .poll = 0, .dev_data = 0 };
+    devfs_register("profile", DEV_TYPE_CHAR, DEV_MAJOR_TRACE, 1, &ops);
+}
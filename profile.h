@@ -0,0 +1,80 @@
+// profile.h - Sampling Profiler for Alteo OS
+// Takes the interrupted RIP, pid and, for kernel code, a few return
+// addresses at a fixed rate. On CPUs with architectural performance
+// monitoring (CPUID leaf 0xA) every online CPU counts unhalted core cycles
+// and samples on counter overflow, delivered as an ordinary interrupt, so
+// code running with interrupts off is charged to the point where it
+// re-enables them. Without it, a timer event samples the BSP only.
+//
+// Samples go into per-CPU buffers that only their own CPU writes; they are
+// folded into a histogram keyed by (address, pid, kernel/user) every
+// PROFILE_DRAIN_NS and whenever /proc/profile is read. The kernel's
+// return addresses are found by scanning the interrupted stack for words
+// inside .text (the kernel is built without frame pointers), so callers
+// are approximate; they only feed the inclusive counts. Addresses are
+// symbolized offline against the kernel ELF.
+//
+// Writing a rate in Hz to /dev/profile starts profiling, "0" stops it and
+// "reset" clears the histogram.
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "stdint.h"
+
+#define PROFILE_DEFAULT_HZ  1000
+#define PROFILE_MAX_HZ      10000
+#define PROFILE_STACK_DEPTH 4           // Return addresses kept per sample
+#define PROFILE_STACK_SCAN  64          // Stack words examined for them
+#define PROFILE_BUF_SAMPLES 1024        // Per CPU, power of two
+#define PROFILE_HIST_SLOTS  4096        // Power of two
+#define PROFILE_DRAIN_NS    100000000ULL
+
+#define PROFILE_SRC_NONE    0
+#define PROFILE_SRC_PMU     1           // Core-cycle counter overflow, all CPUs
+#define PROFILE_SRC_TIMER   2           // Timer event, BSP only
+
+typedef struct {
+    uint64_t rip;
+    uint64_t stack[PROFILE_STACK_DEPTH];
+    int32_t  pid;                       // -1 = idle
+    uint16_t depth;                     // Entries of stack[] used
+    uint16_t user;                      // Interrupted ring 3
+} profile_sample_t;
+
+// One histogram bucket
+typedef struct {
+    uint64_t addr;
+    int32_t  pid;
+    uint16_t user;
+    uint16_t used;
+    uint32_t self;                      // Samples taken at addr
+    uint32_t total;                     // ... plus those with addr on the stack
+} profile_entry_t;
+
+typedef struct {
+    int      source;                    // PROFILE_SRC_*
+    uint32_t hz;
+    uint64_t samples;                   // Folded into the histogram
+    uint64_t dropped;                   // Lost to a full per-CPU buffer
+    uint64_t overflow;                  // No free histogram bucket
+} profile_stats_t;
+
+// Register /dev/profile (after devfs_init)
+void profile_init(void);
+
+// Start sampling at hz (0: PROFILE_DEFAULT_HZ; needs timer_init). Returns
+// 0, or -1 if the buffers cannot be allocated.
+int  profile_start(uint32_t hz);
+void profile_stop(void);
+
+// Clear the histogram and counters
+void profile_reset(void);
+
+// Fold pending samples into the histogram and copy out the stats
+void profile_get_stats(profile_stats_t* out);
+
+// Histogram bucket i (0 .. PROFILE_HIST_SLOTS-1), or 0 if unused. Call
+// profile_get_stats() first so the buckets are current.
+const profile_entry_t* profile_get_entry(int i);
+
+#endif
@@ -0,0 +1,63 @@
+// ramdisk.c - Multiboot Module Ramdisks for Alteo OS
+#include "ramdisk.h"
+#include "blkdev.h"
+#include "graphics.h"   // multiboot_info_t
+#include "klib.h"
+
+#define RAMDISK_LIMIT   0x1000000   // PMM bitmap, see pmm.c
+
+typedef struct {
+    uint8_t* base;
+    uint64_t sectors;
+} ramdisk_t;
+
+static ramdisk_t disks[RAMDISK_MAX];
+static int disk_count = 0;
+
+// blkdev ops, used for requests that come through the queue (blkdev_submit)
+static int ramdisk_read(void* driver_data, uint32_t lba, uint32_t count, void* buf) {
+    ramdisk_t* rd = (ramdisk_t*)driver_data;
+    if ((uint64_t)lba + count > rd->sectors) return -1;
+    memcpy(buf, rd->base + (uint64_t)lba * BLKDEV_SECTOR_SIZE, count * BLKDEV_SECTOR_SIZE);
+    return (int)count;
+}
+
+static int ramdisk_write(void* driver_data, uint32_t lba, uint32_t count, const void* buf) {
+    ramdisk_t* rd = (ramdisk_t*)driver_data;
+    if ((uint64_t)lba + count > rd->sectors) return -1;
+    memcpy(rd->base + (uint64_t)lba * BLKDEV_SECTOR_SIZE, buf, count * BLKDEV_SECTOR_SIZE);
+    return (int)count;
+}
+
+void ramdisk_probe(uint64_t multiboot_addr) {
+    multiboot_info_t* mbi = (multiboot_info_t*)multiboot_addr;
+    if (!mbi || !(mbi->flags & (1 << 3))) return;
+    multiboot_module_t* mods = (multiboot_module_t*)(uint64_t)mbi->mods_addr;
+    for (uint32_t m = 0; m < mbi->mods_count && disk_count < RAMDISK_MAX; m++) {
+        uint64_t start = mods[m].mod_start, end = mods[m].mod_end;
+        if (end <= start || end > RAMDISK_LIMIT) continue;
+        disks[disk_count].base = (uint8_t*)start;   // Identity-mapped
+        disks[disk_count].sectors = (end - start) / BLKDEV_SECTOR_SIZE;
+        if (disks[disk_count].sectors) disk_count++;
+    }
+}
+
+int ramdisk_init(void) {
+    int first = -1;
+    for (int i = 0; i < disk_count; i++) {
+        blkdev_ops_t ops;
+        ops.read_sectors = ramdisk_read;
+        ops.write_sectors = ramdisk_write;
+        ops.flush = 0;
+        ops.submit = 0;
+
+        char name[16] = "ram0";
+        name[3] = '0' + (char)i;
+        int id = blkdev_register(name, BLKDEV_TYPE_RAMDISK, disks[i].sectors,
+                                 BLKDEV_SECTOR_SIZE, &disks[i], &ops);
+        if (id < 0) continue;
+        blkdev_get(id)->mem = disks[i].base;
+        if (first < 0) first = id;
+    }
+    return first;
+}
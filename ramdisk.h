@@ -0,0 +1,25 @@
+// ramdisk.h - Multiboot Module Ramdisks for Alteo OS
+// Every module GRUB loads next to the kernel (grub.cfg: "module
+// /boot/initrd.img initrd") becomes a block device ram0, ram1, ... that
+// reads and writes the module's memory in place. The PMM keeps the modules
+// reserved, and blkdev serves these devices without the page cache or the
+// request queue, so an ext2 image loaded as an initrd is used with no copy
+// and no disk I/O.
+//
+// GRUB puts modules just above the kernel; an image reaching 16MB would
+// overlap the PMM bitmap and is ignored.
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include "stdint.h"
+
+#define RAMDISK_MAX     4
+
+// Record the modules (before the PMM reuses the multiboot info)
+void ramdisk_probe(uint64_t multiboot_addr);
+
+// Register the recorded modules with blkdev (after blkdev_init). Returns
+// the device ID of ram0, or -1 if there is none.
+int ramdisk_init(void);
+
+#endif
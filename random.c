@@ -0,0 +1,232 @@
+// random.c - Kernel Random Number Generator for Alteo OS
+// rnd_lock guards the input pool and the base key. A CPU's own key and
+// fast pool are only touched on that CPU with interrupts off.
+#include "random.h"
+#include "klib.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+
+typedef struct {
+    uint32_t key[8];            // ChaCha20 key, replaced on every request
+    uint64_t generation;        // Base key it was derived from
+    uint64_t fast[4];           // Interrupt timing, folded by random_add_irq()
+    uint64_t irqs;
+} __attribute__((aligned(64))) random_cpu_t;
+
+static random_cpu_t cpus[SMP_MAX_CPUS];
+static uint32_t pool[16];                   // Input pool: 32-byte rate, 32-byte capacity
+static uint32_t base_key[8];
+static volatile uint64_t base_generation;
+static volatile uint64_t next_reseed_ns;
+static uint64_t reseed_interval = RANDOM_RESEED_MIN_NS;
+static int have_rdrand, have_rdseed;
+static spinlock_t rnd_lock = SPINLOCK_INIT;
+
+// ---- ChaCha20 ----
+
+#define ROTL32(v, n)    ((v) << (n) | (v) >> (32 - (n)))
+#define QR(a, b, c, d)                                  \
+    a += b; d ^= a; d = ROTL32(d, 16);                  \
+    c += d; b ^= c; b = ROTL32(b, 12);                  \
+    a += b; d ^= a; d = ROTL32(d, 8);                   \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+static void chacha_permute(uint32_t x[16]) {
+    for (int i = 0; i < 10; i++) {
+        QR(x[0], x[4], x[8],  x[12]);
+        QR(x[1], x[5], x[9],  x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[8],  x[13]);
+        QR(x[3], x[4], x[9],  x[14]);
+    }
+}
+
+// One 64-byte keystream block (zero nonce) stored to out as bytes
+static void chacha_block(const uint32_t key[8], uint64_t counter, uint8_t* out) {
+    uint32_t in[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,    // "expand 32-byte k"
+        key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+        (uint32_t)counter, (uint32_t)(counter >> 32), 0, 0
+    };
+    uint32_t x[16];
+    for (int i = 0; i < 16; i++) x[i] = in[i];
+    chacha_permute(x);
+    for (int i = 0; i < 16; i++) {
+        uint32_t w = x[i] + in[i];
+        memcpy(out + i * 4, &w, 4);
+    }
+    memset(x, 0, sizeof(x));
+}
+
+// ---- Entropy sources ----
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+// A word from RDSEED, else RDRAND; 0 if neither delivers
+static int hw_random(uint64_t* v) {
+    for (int tries = 0; tries < 10; tries++) {
+        uint8_t ok = 0;
+        if (have_rdseed) __asm__ volatile("rdseed %0; setc %1" : "=r"(*v), "=qm"(ok));
+        if (ok) return 1;
+        if (have_rdrand) __asm__ volatile("rdrand %0; setc %1" : "=r"(*v), "=qm"(ok));
+        if (ok) return 1;
+        if (!have_rdseed && !have_rdrand) break;
+    }
+    return 0;
+}
+
+#define ROTL64(v, n)    ((v) << (n) | (v) >> (64 - (n)))
+
+// One SipHash round over the fast pool
+static inline void fast_mix(uint64_t v[4]) {
+    v[0] += v[1]; v[1] = ROTL64(v[1], 13); v[1] ^= v[0]; v[0] = ROTL64(v[0], 32);
+    v[2] += v[3]; v[3] = ROTL64(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = ROTL64(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = ROTL64(v[1], 17); v[1] ^= v[2]; v[2] = ROTL64(v[2], 32);
+}
+
+// ---- Input pool (under rnd_lock) ----
+// A sponge over the ChaCha permutation: input is XORed into the first 8
+// words, 32 bytes at a time, with a permutation after each.
+
+static void pool_absorb(const void* buf, uint32_t len) {
+    const uint8_t* p = (const uint8_t*)buf;
+    while (len) {
+        uint32_t n = len < 32 ? len : 32;
+        uint32_t w[8] = {0};
+        memcpy(w, p, n);
+        for (int i = 0; i < 8; i++) pool[i] ^= w[i];
+        chacha_permute(pool);
+        p += n;
+        len -= n;
+    }
+}
+
+static void pool_absorb_u64(uint64_t v) {
+    pool_absorb(&v, sizeof(v));
+}
+
+// Gather fresh input and extract a new base key from the pool
+static void rnd_reseed(void) {
+    pool_absorb_u64(lock_tsc());
+    pool_absorb_u64(timer_now_ns());
+    for (int i = 0; i < 8; i++) {
+        uint64_t v;
+        if (hw_random(&v)) pool_absorb_u64(v);
+    }
+    // Other CPUs' fast pools are read as they are; a torn read only
+    // mixes in different bits
+    for (int c = 0; c < SMP_MAX_CPUS; c++) {
+        if (cpus[c].irqs) pool_absorb((const void*)cpus[c].fast, sizeof(cpus[c].fast));
+    }
+
+    chacha_permute(pool);
+    memcpy(base_key, pool, sizeof(base_key));
+    memset(pool, 0, 8 * sizeof(uint32_t));  // The key cannot be recomputed from the pool
+    chacha_permute(pool);
+    base_generation++;
+
+    uint64_t now = timer_now_ns();
+    next_reseed_ns = now + reseed_interval;
+    if (now && reseed_interval < RANDOM_RESEED_MAX_NS) reseed_interval *= 2;
+}
+
+// Give CPU c a key from the base key, which is replaced in the same step
+static void rnd_rekey(random_cpu_t* c) {
+    uint8_t blk[64];
+    uint64_t irq = spin_lock_irqsave(&rnd_lock);
+    uint64_t now = timer_now_ns();
+    if (now && now >= next_reseed_ns) rnd_reseed();
+    chacha_block(base_key, 0, blk);
+    memcpy(base_key, blk, 32);
+    memcpy(c->key, blk + 32, 32);
+    c->generation = base_generation;
+    spin_unlock_irqrestore(&rnd_lock, irq);
+    memset(blk, 0, sizeof(blk));
+}
+
+// ---- Public API ----
+
+void random_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(0, &a, &b, &c, &d);
+    uint32_t max_leaf = a;
+    cpuid(1, &a, &b, &c, &d);
+    have_rdrand = (c >> 30) & 1;
+    if (max_leaf >= 7) {
+        cpuid(7, &a, &b, &c, &d);
+        have_rdseed = (b >> 18) & 1;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&rnd_lock);
+    // Without RDRAND/RDSEED only the TSC is left this early; interrupt
+    // timing makes up for it from the first reseed on
+    for (int i = 0; i < 4; i++) pool_absorb_u64(lock_tsc());
+    rnd_reseed();
+    spin_unlock_irqrestore(&rnd_lock, irq);
+}
+
+void random_get(void* buf, uint64_t len) {
+    if (!len) return;
+    uint8_t blk[64];
+
+    uint64_t irq;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(irq) :: "memory");
+    random_cpu_t* c = &cpus[smp_cpu_id()];
+    uint64_t now = timer_now_ns();
+    if (c->generation != base_generation || (now && now >= next_reseed_ns)) rnd_rekey(c);
+    // Fast key erasure: half a block replaces the key, the other half keys
+    // this request (or is the output, if that is all it takes)
+    chacha_block(c->key, 0, blk);
+    memcpy(c->key, blk, 32);
+    if (irq & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+
+    uint8_t* out = (uint8_t*)buf;
+    if (len <= 32) {
+        memcpy(out, blk + 32, len);
+    } else {
+        uint32_t key[8];
+        memcpy(key, blk + 32, 32);
+        uint64_t ctr = 0;
+        for (; len >= 64; len -= 64, out += 64) chacha_block(key, ctr++, out);
+        if (len) {
+            chacha_block(key, ctr, blk);
+            memcpy(out, blk, len);
+        }
+        memset(key, 0, sizeof(key));
+    }
+    memset(blk, 0, sizeof(blk));
+}
+
+uint32_t random_u32(void) {
+    uint32_t v;
+    random_get(&v, sizeof(v));
+    return v;
+}
+
+uint64_t random_u64(void) {
+    uint64_t v;
+    random_get(&v, sizeof(v));
+    return v;
+}
+
+void random_add_bytes(const void* buf, uint32_t len) {
+    if (!buf || !len) return;
+    uint64_t irq = spin_lock_irqsave(&rnd_lock);
+    pool_absorb(buf, len);
+    spin_unlock_irqrestore(&rnd_lock, irq);
+}
+
+void random_add_irq(int irq) {
+    random_cpu_t* c = &cpus[smp_cpu_id()];
+    c->fast[0] ^= lock_tsc();
+    c->fast[1] ^= (uint64_t)irq << 32 | (uint32_t)c->irqs;
+    fast_mix(c->fast);
+    c->irqs++;
+}
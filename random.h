@@ -0,0 +1,35 @@
+// random.h - Kernel Random Number Generator for Alteo OS
+// A ChaCha20 generator per CPU, each keyed from a base key that is in turn
+// extracted from an input pool. The pool takes RDSEED/RDRAND output, TSC
+// readings, interrupt timing and whatever is written to /dev/random; it
+// reseeds the base key after 1s, then at doubling intervals up to a
+// minute, and every CPU rekeys from the new base on its next request.
+//
+// Every request replaces the CPU's key with fresh keystream before any
+// output is made (fast key erasure), so a leaked key reveals nothing that
+// was generated before. Output is made 64-byte block by block straight
+// into the caller's buffer, with interrupts on.
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include "stdint.h"
+
+#define RANDOM_RESEED_MIN_NS    1000000000ULL       // First reseed after boot
+#define RANDOM_RESEED_MAX_NS    60000000000ULL      // Longest interval
+
+// Seed the pool (before anything asks for random bytes)
+void random_init(void);
+
+// Fill buf with len random bytes. Any context; never blocks.
+void random_get(void* buf, uint64_t len);
+uint32_t random_u32(void);
+uint64_t random_u64(void);
+
+// Mix bytes into the pool (writes to /dev/random, /dev/urandom)
+void random_add_bytes(const void* buf, uint32_t len);
+
+// Mix the arrival time of an interrupt into this CPU's fast pool
+// (interrupt handlers, interrupts off)
+void random_add_irq(int irq);
+
+#endif
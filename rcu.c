@@ -0,0 +1,26 @@
+// rcu.c - Read-Copy-Update for Alteo OS
+// A grace period ends for a CPU when its nesting count is zero or its
+// section sequence has moved since synchronize_rcu() looked, i.e. every
+// section open at that moment has closed.
+#include "rcu.h"
+#include "spinlock.h"
+
+static rcu_stats_t rcu_stats;
+
+void synchronize_rcu(void) {
+    uint64_t start = lock_tsc();
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);    // Publish before sampling
+    int me = smp_cpu_id();
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu == me || !smp_cpu_online(cpu)) continue;
+        smp_percpu_t* pc = smp_cpu_data(cpu);
+        uint32_t seq = pc->rcu_seq;
+        while (pc->rcu_nest && pc->rcu_seq == seq) __asm__ volatile("pause");
+    }
+    __atomic_add_fetch(&rcu_stats.grace_periods, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&rcu_stats.wait_cycles, lock_tsc() - start, __ATOMIC_RELAXED);
+}
+
+rcu_stats_t rcu_get_stats(void) {
+    return rcu_stats;
+}
@@ -0,0 +1,49 @@
+// rcu.h - Read-Copy-Update for Alteo OS
+// For read-mostly tables (routes, mounts). Readers bracket a lookup with
+// rcu_read_lock()/rcu_read_unlock() and never take a lock or write shared
+// data: the section only bumps the CPU's own nesting counter, with
+// interrupts off so it can be neither preempted nor migrated. Readers must
+// not sleep inside it.
+//
+// Writers, serialized among themselves by their own lock or the BKL,
+// build the new version beside the old one, publish it with
+// rcu_assign_pointer(), then call synchronize_rcu(), which returns once
+// every CPU that was inside a read section has left it. Nothing can still
+// see the old version after that, so it may be reused or freed.
+#ifndef RCU_H
+#define RCU_H
+
+#include "stdint.h"
+#include "smp.h"
+
+#define rcu_assign_pointer(p, v)  __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define rcu_dereference(p)        __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+// Returns the interrupt flag to hand back to rcu_read_unlock()
+static inline uint64_t rcu_read_lock(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    // Locked add: the count is visible before any load in the section
+    __atomic_add_fetch(&smp_this_cpu()->rcu_nest, 1, __ATOMIC_SEQ_CST);
+    return flags;
+}
+
+static inline void rcu_read_unlock(uint64_t flags) {
+    smp_percpu_t* pc = smp_this_cpu();
+    __asm__ volatile("" ::: "memory");
+    if (--pc->rcu_nest == 0) pc->rcu_seq++;
+    if (flags & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+}
+
+// Wait for every read section in progress on another CPU to end. Must not
+// be called from inside a read section.
+void synchronize_rcu(void);
+
+typedef struct {
+    uint64_t grace_periods;     // synchronize_rcu() calls
+    uint64_t wait_cycles;       // TSC cycles spent waiting in them
+} rcu_stats_t;
+
+rcu_stats_t rcu_get_stats(void);
+
+#endif
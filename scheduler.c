@@ -1,8 +1,17 @@
 // scheduler.c - CPU Scheduler for Alteo OS
-// Implements Round-Robin and Priority-based scheduling with real context switching
+// Implements Round-Robin, Priority and Fair (vruntime) scheduling with real context switching,
+// with a run queue per CPU and work stealing between them (only the BSP's
+// queue is in use until application processors are brought up)
 #include "scheduler.h"
 #include "process.h"
 #include "gdt.h"
+#include "vmm.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "vdso.h"
+#include "fpu.h"
+#include "trace.h"
 
 static int sched_initialized = 0;
 static int sched_running = 0;
@@ -11,12 +20,48 @@ static int sched_algorithm = SCHED_PRIORITY;
 // Statistics
 static scheduler_stats_t stats;
 
-// Current process index in process table
-static int current_slot = 0;
-
 // Forward declaration of external IRQ EOI function
 extern void irq_send_eoi(uint8_t irq);
 
+// Load the next process's address space (kernel PML4 for kernel threads)
+static void sched_switch_address_space(process_t* next) {
+    pte_t* target = next->page_table ? (pte_t*)next->page_table : vmm_get_kernel_pml4();
+    if (target && target != vmm_get_current_address_space()) {
+        vmm_switch_address_space(target);
+    }
+}
+
+// ---------- Ready queues ----------
+// Each CPU has one FIFO per priority level, linked through
+// process_t.rq_next/rq_prev (slot indices), plus a bitmap of non-empty
+// levels, so picking the next task never scans the process table. Every
+// READY process is on exactly one queue, that of process_t.cpu;
+// process_change_state() keeps them in sync. Round-robin mode puts every
+// process on level 0. A CPU whose queue is empty steals from the busiest.
+
+#define SCHED_LEVELS  (PRIORITY_REALTIME + 1)
+
+typedef struct {
+    spinlock_t lock;              // Guards the queue fields below
+    int head[SCHED_LEVELS];
+    int tail[SCHED_LEVELS];
+    uint32_t bitmap;              // Bit n set = level n non-empty
+    volatile int count;
+    int fair[MAX_PROCESSES];      // SCHED_FAIR: min-heap of slots by vruntime
+    int fair_count;
+    uint64_t fair_weight;         // Sum of weights on the heap
+    uint64_t min_vruntime;        // Monotonic floor for placing woken tasks
+    int current_slot;             // Slot running here (-1 = CPU not online)
+    int prev_slot;                // Slot switched away from, until its context is saved
+} sched_cpu_t;
+
+static sched_cpu_t rqs[SMP_MAX_CPUS];
+
+// Calling CPU's run queue: one GS-relative load (runq is set by scheduler_init)
+static inline sched_cpu_t* this_rq(void) {
+    return (sched_cpu_t*)smp_this_cpu()->runq;
+}
+
 void scheduler_init(void) {
     stats.total_switches = 0;
     stats.total_ticks = 0;
@@ -24,56 +69,293 @@ void scheduler_init(void) {
     stats.algorithm = sched_algorithm;
     stats.current_pid = 0;
     stats.ready_count = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        rqs[cpu].current_slot = cpu == 0 ? 0 : -1;
+        rqs[cpu].prev_slot = -1;
+        smp_cpu_data(cpu)->runq = &rqs[cpu];
+    }
     sched_initialized = 1;
     sched_running = 1;
 }
 
-// Round-robin: pick next READY process after current
-static int select_round_robin(void) {
+static int sched_level_for(process_t* p) {
+    if (sched_algorithm == SCHED_ROUND_ROBIN) return 0;
+    if (p->priority < 0) return 0;
+    if (p->priority >= SCHED_LEVELS) return SCHED_LEVELS - 1;
+    return p->priority;
+}
+
+// Ticks are derived from the timer clock when it runs (there is no
+// periodic interrupt to count); otherwise counted by the tick handlers
+static uint64_t sched_now_ticks(void) {
+    return timer_is_active() ? timer_ticks() : stats.total_ticks;
+}
+
+static int sched_total_ready(void) {
+    int n = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) n += rqs[cpu].count;
+    return n;
+}
+
+// ---------- Fair class ----------
+// SCHED_FAIR orders ready tasks by virtual runtime: CPU time scaled by
+// NICE_0 / weight, so a heavier task accrues vruntime more slowly and gets
+// a larger share. The task with the least vruntime runs next; nobody
+// starves, since everyone else's vruntime stays put while they wait.
+
+#define SCHED_FAIR_LEVEL       (-1)          // rq_level of tasks on the fair heap
+#define SCHED_NICE0_WEIGHT     1024
+#define SCHED_FAIR_LATENCY_NS  40000000ULL   // Period in which every task runs once
+#define SCHED_FAIR_WAKEUP_NS   20000000ULL   // Head start kept by a waking sleeper
+
+// Nice-style weights (~1.25x CPU share per nice step): LOW = nice 5,
+// NORMAL = nice 0, HIGH = nice -5, REALTIME = nice -10
+static const uint32_t sched_prio_weight[SCHED_LEVELS] = { 335, 1024, 3121, 9548 };
+
+static uint32_t sched_weight(process_t* p) {
+    int prio = p->priority;
+    if (prio < 0) prio = 0;
+    if (prio >= SCHED_LEVELS) prio = SCHED_LEVELS - 1;
+    return sched_prio_weight[prio];
+}
+
+// Charge the time p ran since it was made current to its vruntime
+static void sched_charge(process_t* p) {
+    if (!timer_is_active() || !p->exec_start) return;
+    uint64_t now = timer_now_ns();
+    if (now > p->exec_start) {
+        p->vruntime += (now - p->exec_start) * SCHED_NICE0_WEIGHT / sched_weight(p);
+    }
+    p->exec_start = now;
+}
+
+static void fair_swap(sched_cpu_t* rq, process_t* table, int a, int b) {
+    int t = rq->fair[a];
+    rq->fair[a] = rq->fair[b];
+    rq->fair[b] = t;
+    table[rq->fair[a]].rq_pos = a;
+    table[rq->fair[b]].rq_pos = b;
+}
+
+static void fair_up(sched_cpu_t* rq, process_t* table, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (table[rq->fair[parent]].vruntime <= table[rq->fair[i]].vruntime) break;
+        fair_swap(rq, table, i, parent);
+        i = parent;
+    }
+}
+
+static void fair_down(sched_cpu_t* rq, process_t* table, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < rq->fair_count && table[rq->fair[l]].vruntime < table[rq->fair[min]].vruntime) min = l;
+        if (r < rq->fair_count && table[rq->fair[r]].vruntime < table[rq->fair[min]].vruntime) min = r;
+        if (min == i) break;
+        fair_swap(rq, table, i, min);
+        i = min;
+    }
+}
+
+// Stealing CPUs read min_vruntime without this queue's lock, so it is
+// published with an atomic store
+static void fair_update_min(sched_cpu_t* rq, process_t* table) {
+    if (rq->fair_count && table[rq->fair[0]].vruntime > rq->min_vruntime) {
+        __atomic_store_n(&rq->min_vruntime, table[rq->fair[0]].vruntime, __ATOMIC_RELAXED);
+    }
+}
+
+// Add p to the heap (lock held). A task returning from a long sleep is
+// moved up to just behind the pack instead of keeping its old lead.
+static void fair_insert(sched_cpu_t* rq, process_t* table, process_t* p) {
+    uint64_t floor = rq->min_vruntime > SCHED_FAIR_WAKEUP_NS
+                   ? rq->min_vruntime - SCHED_FAIR_WAKEUP_NS : 0;
+    if (p->vruntime < floor) p->vruntime = floor;
+
+    p->rq_level = SCHED_FAIR_LEVEL;
+    p->rq_pos = rq->fair_count;
+    rq->fair[rq->fair_count++] = (int)(p - table);
+    rq->fair_weight += sched_weight(p);
+    fair_up(rq, table, p->rq_pos);
+}
+
+static void fair_remove(sched_cpu_t* rq, process_t* table, process_t* p) {
+    int pos = p->rq_pos;
+    rq->fair_count--;
+    rq->fair_weight -= sched_weight(p);
+    if (pos != rq->fair_count) {
+        rq->fair[pos] = rq->fair[rq->fair_count];
+        table[rq->fair[pos]].rq_pos = pos;
+        fair_up(rq, table, pos);
+        fair_down(rq, table, table[rq->fair[pos]].rq_pos);
+    }
+    fair_update_min(rq, table);
+}
+
+// Slice in ticks: the latency period split by weight, at least one tick
+static int sched_fair_slice(sched_cpu_t* rq, process_t* p) {
+    uint64_t w = sched_weight(p);
+    uint64_t ns = SCHED_FAIR_LATENCY_NS * w / (rq->fair_weight + w);
+    int ticks = (int)(ns / TIMER_TICK_NS);
+    return ticks > 0 ? ticks : 1;
+}
+
+// Unlink p from rq (lock held)
+static void sched_unlink(sched_cpu_t* rq, process_t* p) {
     process_t* table = process_get_table();
-    int max = process_get_max();
-    int start = current_slot;
-
-    // Try from current+1 to end, then wrap to 0
-    for (int attempts = 0; attempts < max; attempts++) {
-        int idx = (start + 1 + attempts) % max;
-        if (table[idx].state == PROC_STATE_READY) {
-            return idx;
-        }
+    int level = p->rq_level;
+
+    if (level == SCHED_FAIR_LEVEL) {
+        fair_remove(rq, table, p);
+        p->on_rq = 0;
+        rq->count--;
+        return;
+    }
+
+    if (p->rq_prev >= 0) table[p->rq_prev].rq_next = p->rq_next;
+    else rq->head[level] = p->rq_next;
+    if (p->rq_next >= 0) table[p->rq_next].rq_prev = p->rq_prev;
+    else rq->tail[level] = p->rq_prev;
+    if (rq->head[level] < 0) rq->bitmap &= ~(1U << level);
+
+    p->on_rq = 0;
+    rq->count--;
+}
+
+void scheduler_enqueue(process_t* p) {
+    process_t* table = process_get_table();
+    int slot = (int)(p - table);
+
+    // The kernel process stays on the BSP; others go to their owning CPU
+    int cpu = p->cpu;
+    if (slot == 0 || cpu < 0 || cpu >= SMP_MAX_CPUS || (cpu != 0 && !smp_cpu_online(cpu))) cpu = 0;
+
+    sched_cpu_t* rq = &rqs[cpu];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    if (p->on_rq) { spin_unlock_irqrestore(&rq->lock, flags); return; }
+    p->cpu = cpu;
+    if (sched_algorithm == SCHED_FAIR) {
+        fair_insert(rq, table, p);
+        p->on_rq = 1;
+        rq->count++;
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
     }
-    // If nothing ready, stay on current if it's running
-    if (table[current_slot].state == PROC_STATE_RUNNING) {
-        return current_slot;
+
+    int level = sched_level_for(p);
+    p->rq_level = level;
+    p->rq_next = -1;
+    if (rq->bitmap & (1U << level)) {
+        p->rq_prev = rq->tail[level];
+        table[rq->tail[level]].rq_next = slot;
+    } else {
+        p->rq_prev = -1;
+        rq->head[level] = slot;
+        rq->bitmap |= 1U << level;
     }
-    return 0;  // Fall back to kernel/idle
+    rq->tail[level] = slot;
+    p->on_rq = 1;
+    rq->count++;
+    spin_unlock_irqrestore(&rq->lock, flags);
 }
 
-// Priority-based: pick highest priority READY process
-static int select_priority(void) {
+void scheduler_dequeue(process_t* p) {
+    int cpu = p->cpu;
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS) return;
+    sched_cpu_t* rq = &rqs[cpu];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    if (p->on_rq && p->cpu == cpu) sched_unlink(rq, p);
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+// Least-loaded online CPU, for placing a new process
+int scheduler_pick_cpu(void) {
+    int best = 0, best_load = 0x7FFFFFFF;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu != 0 && !smp_cpu_online(cpu)) continue;
+        int load = rqs[cpu].count + (rqs[cpu].current_slot >= 0 ? 1 : 0);
+        if (load < best_load) { best = cpu; best_load = load; }
+    }
+    return best;
+}
+
+// A stolen process must have a saved context it can be resumed from and
+// must not be pinned to its CPU
+static int sched_can_migrate(process_t* table, int slot) {
+    return slot != 0 && table[slot].kernel_rsp != 0 && !table[slot].on_cpu && !table[slot].pinned;
+}
+
+// Pop the head of the highest non-empty level of cpu's queue. When
+// stealing, skip processes that cannot move to another CPU.
+static int sched_pop(int cpu, int steal) {
+    sched_cpu_t* rq = &rqs[cpu];
     process_t* table = process_get_table();
-    int max = process_get_max();
-    int best_slot = -1;
-    int best_prio = -1;
-
-    for (int i = 0; i < max; i++) {
-        if (table[i].state == PROC_STATE_READY) {
-            if (table[i].priority > best_prio) {
-                best_prio = table[i].priority;
-                best_slot = i;
-            } else if (table[i].priority == best_prio && best_slot >= 0) {
-                // Same priority: round-robin among them (pick one after current)
-                if (i > current_slot && (best_slot <= current_slot || best_slot > i)) {
-                    best_slot = i;
-                }
+    int found = -1;
+
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+
+    // Fair heap: the root, or when stealing the least vruntime that can move
+    if (rq->fair_count && !steal) found = rq->fair[0];
+    for (int i = 0; steal && i < rq->fair_count; i++) {
+        int s = rq->fair[i];
+        if (sched_can_migrate(table, s) &&
+            (found < 0 || table[s].vruntime < table[found].vruntime)) found = s;
+    }
+
+    uint32_t bits = found < 0 ? rq->bitmap : 0;
+    while (bits && found < 0) {
+        int level = 31 - __builtin_clz(bits);
+        for (int s = rq->head[level]; s >= 0; s = table[s].rq_next) {
+            if (!steal || sched_can_migrate(table, s)) { found = s; break; }
+        }
+        bits &= ~(1U << level);
+    }
+    if (found >= 0) {
+        int fair = table[found].rq_level == SCHED_FAIR_LEVEL;
+        sched_unlink(rq, &table[found]);
+        if (steal) {
+            // vruntime is relative to each CPU's clock: rebase onto ours.
+            // Our queue's lock is not taken under the victim's (the two
+            // could be taken in opposite orders), so its floor is read
+            // atomically; a slightly old value only shifts the lag.
+            sched_cpu_t* dst = this_rq();
+            if (fair) {
+                uint64_t lag = table[found].vruntime > rq->min_vruntime
+                             ? table[found].vruntime - rq->min_vruntime : 0;
+                table[found].vruntime = __atomic_load_n(&dst->min_vruntime, __ATOMIC_RELAXED) + lag;
             }
+            table[found].cpu = smp_this_cpu()->cpu;
         }
     }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return found;
+}
+
+// Next process for the calling CPU, taken off its queue: local work
+// first, then one task stolen from the CPU with the longest queue
+static int sched_take(int me) {
+    int slot = sched_pop(me, 0);
+    if (slot >= 0) return slot;
+
+    int victim = -1, most = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu == me || !smp_cpu_online(cpu)) continue;
+        if (rqs[cpu].count > most) { victim = cpu; most = rqs[cpu].count; }
+    }
+    return victim >= 0 ? sched_pop(victim, 1) : -1;
+}
 
-    if (best_slot >= 0) return best_slot;
+// Head of the highest non-empty local level; a process that just gave up
+// the CPU sits at the tail of its level, so equal priorities take turns
+static int select_from_queues(void) {
+    sched_cpu_t* rq = this_rq();
+    if (rq->fair_count) return rq->fair[0];
+    if (rq->bitmap) return rq->head[31 - __builtin_clz(rq->bitmap)];
 
     // No ready process - stay on current or idle
-    if (table[current_slot].state == PROC_STATE_RUNNING) {
-        return current_slot;
+    process_t* table = process_get_table();
+    if (rq->current_slot >= 0 && table[rq->current_slot].state == PROC_STATE_RUNNING) {
+        return rq->current_slot;
     }
     return 0;  // kernel/idle
 }
@@ -82,11 +364,7 @@ static int select_priority(void) {
 int scheduler_select_next(void) {
     if (!sched_initialized) return 0;
 
-    if (sched_algorithm == SCHED_ROUND_ROBIN) {
-        return select_round_robin();
-    } else {
-        return select_priority();
-    }
+    return select_from_queues();
 }
 
 // Main scheduler tick - called from timer IRQ (IRQ0)
@@ -94,11 +372,15 @@ void scheduler_tick(uint64_t current_tick) {
     if (!sched_initialized || !sched_running) return;
 
     stats.total_ticks++;
+    smp_this_cpu()->ticks++;
+    if (!timer_is_active()) vdso_set_ticks(stats.total_ticks);
 
     process_t* table = process_get_table();
+    sched_cpu_t* rq = this_rq();
+    if (rq->current_slot < 0) return;   // CPU not online
 
     // Wake up sleeping processes
-    process_wake_sleepers(current_tick);
+    process_wake_sleepers(timer_is_active() ? timer_ticks() : current_tick);
 
     // Update current process CPU time
     process_t* current = process_get_current();
@@ -112,26 +394,28 @@ void scheduler_tick(uint64_t current_tick) {
 
         if (current->time_slice <= 0) {
             // Time quantum expired - move to ready, pick next
-            current->state = PROC_STATE_READY;
+            sched_charge(current);
+            process_change_state(current, PROC_STATE_READY);
             current->time_slice = current->default_slice;
 
             int next_slot = scheduler_select_next();
-            if (next_slot != current_slot) {
+            if (next_slot != rq->current_slot) {
                 // Context switch needed
                 stats.total_switches++;
 
                 // Mark old process as ready (if not already changed)
-                if (table[current_slot].state == PROC_STATE_RUNNING) {
-                    table[current_slot].state = PROC_STATE_READY;
+                if (table[rq->current_slot].state == PROC_STATE_RUNNING) {
+                    process_change_state(&table[rq->current_slot], PROC_STATE_READY);
                 }
 
                 // Mark new process as running
-                table[next_slot].state = PROC_STATE_RUNNING;
-                current_slot = next_slot;
+                process_change_state(&table[next_slot], PROC_STATE_RUNNING);
+                table[next_slot].exec_start = timer_now_ns();
+                rq->current_slot = next_slot;
                 stats.current_pid = table[next_slot].pid;
             } else {
                 // Same process continues
-                current->state = PROC_STATE_RUNNING;
+                process_change_state(current, PROC_STATE_RUNNING);
                 current->time_slice = current->default_slice;
             }
         }
@@ -141,69 +425,153 @@ void scheduler_tick(uint64_t current_tick) {
 
         int next_slot = scheduler_select_next();
         if (table[next_slot].state == PROC_STATE_READY) {
-            table[next_slot].state = PROC_STATE_RUNNING;
-            current_slot = next_slot;
+            process_change_state(&table[next_slot], PROC_STATE_RUNNING);
+            table[next_slot].exec_start = timer_now_ns();
+            rq->current_slot = next_slot;
             stats.current_pid = table[next_slot].pid;
             stats.total_switches++;
         }
     }
 
     // Update ready count
-    stats.ready_count = process_count_by_state(PROC_STATE_READY);
+    stats.ready_count = sched_total_ready();
+}
+
+// Called on the context that was switched to: the previous process's
+// registers are now saved, so another CPU may pick it up
+static void sched_finish_switch(void) {
+    sched_cpu_t* rq = this_rq();
+    if (rq->prev_slot >= 0) {
+        process_get_table()[rq->prev_slot].on_cpu = 0;
+        rq->prev_slot = -1;
+    }
+}
+
+// Count a switch away from prev: involuntary if it is still runnable
+static inline void sched_count_switch(process_t* prev) {
+    if (prev->state == PROC_STATE_READY) prev->acct.nivcsw++;
+    else prev->acct.nvcsw++;
+}
+
+// Point TSS RSP0 and syscall_entry at p's kernel stack, so interrupts from
+// user mode and syscalls both land there. A syscall that sleeps keeps its
+// frame on that stack while the next process's syscalls use their own.
+// Processes without a stack of their own fall back to the CPU's.
+static void sched_set_kernel_stack(process_t* p) {
+    if (p->stack_top) {
+        tss_set_rsp0(p->stack_top);
+        smp_this_cpu()->syscall_stack_top = p->stack_top;
+    } else {
+        smp_this_cpu()->syscall_stack_top = smp_syscall_stack_top();
+    }
+}
+
+// Make 'next' current on this CPU (already off its queue)
+static void sched_set_current(sched_cpu_t* rq, process_t* table, int next) {
+    if (rq->current_slot >= 0 && rq->current_slot != next) sched_count_switch(&table[rq->current_slot]);
+    fpu_switch(rq->current_slot >= 0 ? &table[rq->current_slot] : 0, &table[next]);
+    process_change_state(&table[next], PROC_STATE_RUNNING);
+    table[next].on_cpu = 1;
+    table[next].exec_start = timer_now_ns();
+    if (sched_algorithm == SCHED_FAIR) table[next].time_slice = sched_fair_slice(rq, &table[next]);
+    TRACE(TRACE_SCHED_SWITCH, table[next].pid, rq->current_slot >= 0 ? table[rq->current_slot].pid : -1);
+    rq->current_slot = next;
+    stats.current_pid = table[next].pid;
+    stats.total_switches++;
+    smp_this_cpu()->switches++;
+
+    // Update the current PID in the process subsystem
+    process_set_current(next);
+
+    sched_set_kernel_stack(&table[next]);
+    sched_switch_address_space(&table[next]);
 }
 
 // Cooperative yield - give up remaining time slice (with real context switch)
 void scheduler_yield(void) {
     if (!sched_initialized) return;
 
+    // Run overdue timer events (the only expiry path without a LAPIC timer)
+    timer_poll();
+
     process_t* table = process_get_table();
+    uint64_t irq;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(irq) :: "memory");
+    int me = smp_this_cpu()->cpu;
+    sched_cpu_t* rq = this_rq();
+    int old_slot = rq->current_slot;
+    sched_finish_switch();   // Covers switches that resumed a brand-new context
+    sched_charge(&table[old_slot]);
 
     // Move current to ready
-    if (table[current_slot].state == PROC_STATE_RUNNING) {
-        table[current_slot].state = PROC_STATE_READY;
-        table[current_slot].time_slice = table[current_slot].default_slice;
+    if (table[old_slot].state == PROC_STATE_RUNNING) {
+        process_change_state(&table[old_slot], PROC_STATE_READY);
+        table[old_slot].time_slice = table[old_slot].default_slice;
     }
 
-    int next = scheduler_select_next();
-    if (next >= 0 && next != current_slot) {
-        int old_slot = current_slot;
-
-        table[next].state = PROC_STATE_RUNNING;
-        current_slot = next;
-        stats.current_pid = table[next].pid;
-        stats.total_switches++;
-
-        // Update the current PID in the process subsystem
-        process_set_current(table[next].pid);
+    int next = sched_take(me);
+    if (next < 0) {
+        // Nothing runnable: fall back to the kernel process
+        next = 0;
+        scheduler_dequeue(&table[0]);
+    }
 
-        // Update TSS RSP0 so interrupts from user mode land on the right kernel stack
-        if (table[next].stack_top) {
-            tss_set_rsp0(table[next].stack_top);
-        }
+    // Only switch between processes that have valid stacks
+    int can_save = table[old_slot].kernel_rsp != 0 || old_slot == 0;
+    if (next != old_slot && !(can_save && table[next].kernel_rsp != 0)) {
+        if (table[next].state == PROC_STATE_READY) scheduler_enqueue(&table[next]);
+        next = old_slot;
+    }
 
-        // Perform the actual context switch only if both processes have valid stacks
-        if (table[old_slot].kernel_rsp != 0 || old_slot == 0) {
-            if (table[next].kernel_rsp != 0) {
-                switch_context(&table[old_slot].kernel_rsp, table[next].kernel_rsp);
-            }
+    if (next == old_slot) {
+        // Same process continues (it may have been put back on the queue)
+        if (table[old_slot].state == PROC_STATE_READY) {
+            process_change_state(&table[old_slot], PROC_STATE_RUNNING);
         }
-    } else if (next == current_slot) {
-        // Same process continues
-        table[current_slot].state = PROC_STATE_RUNNING;
+        if (irq & (1 << 9)) __asm__ volatile("sti");
+        return;
     }
+
+    // Another CPU may steal the outgoing process once switch_context has
+    // saved it; syscalls on other CPUs may run while this one is away
+    int bkl = smp_bkl_held();
+    if (bkl) smp_bkl_unlock();
+    rq->prev_slot = old_slot;
+
+    sched_set_current(rq, table, next);
+    switch_context(&table[old_slot].kernel_rsp, table[next].kernel_rsp);
+
+    // Resumed, possibly on another CPU
+    sched_finish_switch();
+    if (bkl) smp_bkl_lock();
+    if (irq & (1 << 9)) __asm__ volatile("sti");
 }
 
 // Set scheduling algorithm
 void scheduler_set_algorithm(int algo) {
-    if (algo == SCHED_ROUND_ROBIN || algo == SCHED_PRIORITY) {
+    if (algo == SCHED_ROUND_ROBIN || algo == SCHED_PRIORITY || algo == SCHED_FAIR) {
+        if (algo == sched_algorithm) return;
         sched_algorithm = algo;
         stats.algorithm = algo;
+
+        // Levels (or the fair heap) depend on the algorithm: requeue
+        // everything that is ready
+        process_t* table = process_get_table();
+        for (int i = 0; i < process_get_max(); i++) {
+            if (table[i].on_rq) {
+                scheduler_dequeue(&table[i]);
+                scheduler_enqueue(&table[i]);
+            }
+        }
     }
 }
 
 // Get statistics
 scheduler_stats_t scheduler_get_stats(void) {
-    return stats;
+    scheduler_stats_t st = stats;
+    st.total_ticks = sched_now_ticks();
+    st.ready_count = sched_total_ready();
+    return st;
 }
 
 // Block a process
@@ -230,6 +598,10 @@ int scheduler_is_running(void) {
     return sched_initialized && sched_running;
 }
 
+int scheduler_ready_count(void) {
+    return sched_initialized ? this_rq()->count : 0;
+}
+
 // ---------- Preemptive Timer IRQ Handler ----------
 // Called from irq0_switch in switch.asm.
 // Takes the current stack pointer (pointing to saved registers_t frame),
@@ -244,45 +616,53 @@ uint64_t timer_irq_handler(uint64_t current_rsp) {
     irq_send_eoi(0);
 
     process_t* table = process_get_table();
+    sched_cpu_t* rq = this_rq();
+    if (rq->current_slot < 0) return current_rsp;   // CPU not online
 
     stats.total_ticks++;
+    smp_this_cpu()->ticks++;
+    if (!timer_is_active()) vdso_set_ticks(stats.total_ticks);
 
     // Wake up sleeping processes
-    process_wake_sleepers(stats.total_ticks);
+    process_wake_sleepers(sched_now_ticks());
 
     // Save current process's register frame RSP
-    if (table[current_slot].state == PROC_STATE_RUNNING ||
-        table[current_slot].state == PROC_STATE_READY) {
-        table[current_slot].kernel_rsp = current_rsp;
+    if (table[rq->current_slot].state == PROC_STATE_RUNNING ||
+        table[rq->current_slot].state == PROC_STATE_READY) {
+        table[rq->current_slot].kernel_rsp = current_rsp;
     }
 
     // Update current process CPU time
-    if (table[current_slot].state == PROC_STATE_RUNNING) {
-        table[current_slot].cpu_time++;
-        table[current_slot].time_slice--;
+    if (table[rq->current_slot].state == PROC_STATE_RUNNING) {
+        table[rq->current_slot].cpu_time++;
+        table[rq->current_slot].time_slice--;
 
-        if (table[current_slot].time_slice <= 0) {
+        if (table[rq->current_slot].time_slice <= 0) {
             // Time quantum expired
-            table[current_slot].state = PROC_STATE_READY;
-            table[current_slot].time_slice = table[current_slot].default_slice;
+            sched_charge(&table[rq->current_slot]);
+            process_change_state(&table[rq->current_slot], PROC_STATE_READY);
+            table[rq->current_slot].time_slice = table[rq->current_slot].default_slice;
 
             int next = scheduler_select_next();
-            if (next != current_slot && table[next].kernel_rsp != 0) {
-                table[next].state = PROC_STATE_RUNNING;
-                current_slot = next;
+            if (next != rq->current_slot && table[next].kernel_rsp != 0) {
+                sched_count_switch(&table[rq->current_slot]);
+                fpu_switch(&table[rq->current_slot], &table[next]);
+                process_change_state(&table[next], PROC_STATE_RUNNING);
+                table[next].exec_start = timer_now_ns();
+                TRACE(TRACE_SCHED_SWITCH, table[next].pid, table[rq->current_slot].pid);
+                rq->current_slot = next;
                 stats.current_pid = table[next].pid;
                 stats.total_switches++;
-                process_set_current(table[next].pid);
+                process_set_current(next);
 
-                if (table[next].stack_top) {
-                    tss_set_rsp0(table[next].stack_top);
-                }
+                sched_set_kernel_stack(&table[next]);
+                sched_switch_address_space(&table[next]);
 
                 return table[next].kernel_rsp;
             } else {
                 // No switch - same process continues
-                table[current_slot].state = PROC_STATE_RUNNING;
-                table[current_slot].time_slice = table[current_slot].default_slice;
+                process_change_state(&table[rq->current_slot], PROC_STATE_RUNNING);
+                table[rq->current_slot].time_slice = table[rq->current_slot].default_slice;
             }
         }
     } else {
@@ -292,20 +672,25 @@ uint64_t timer_irq_handler(uint64_t current_rsp) {
         int next = scheduler_select_next();
         if (next >= 0 && table[next].state == PROC_STATE_READY &&
             table[next].kernel_rsp != 0) {
-            table[next].state = PROC_STATE_RUNNING;
-            current_slot = next;
+            if (next != rq->current_slot) {
+                sched_count_switch(&table[rq->current_slot]);
+                fpu_switch(&table[rq->current_slot], &table[next]);
+            }
+            process_change_state(&table[next], PROC_STATE_RUNNING);
+            table[next].exec_start = timer_now_ns();
+            TRACE(TRACE_SCHED_SWITCH, table[next].pid, table[rq->current_slot].pid);
+            rq->current_slot = next;
             stats.current_pid = table[next].pid;
             stats.total_switches++;
-            process_set_current(table[next].pid);
+            process_set_current(next);
 
-            if (table[next].stack_top) {
-                tss_set_rsp0(table[next].stack_top);
-            }
+            sched_set_kernel_stack(&table[next]);
+            sched_switch_address_space(&table[next]);
 
             return table[next].kernel_rsp;
         }
     }
 
-    stats.ready_count = process_count_by_state(PROC_STATE_READY);
+    stats.ready_count = sched_total_ready();
     return current_rsp;
 }
@@ -8,6 +8,7 @@
 // Scheduler algorithms
 #define SCHED_ROUND_ROBIN    0
 #define SCHED_PRIORITY       1
+#define SCHED_FAIR           2    // Weighted virtual runtime (CFS-style)
 
 // Time quantum defaults (in ticks)
 #define QUANTUM_LOW       20
@@ -37,6 +38,14 @@ void scheduler_yield(void);
 // Select next process to run
 int scheduler_select_next(void);
 
+// Ready queue maintenance (called by process_change_state). A process is
+// queued on the CPU in process_t.cpu.
+void scheduler_enqueue(process_t* p);
+void scheduler_dequeue(process_t* p);
+
+// Least-loaded online CPU (where new processes are placed)
+int scheduler_pick_cpu(void);
+
 // Set scheduling algorithm
 void scheduler_set_algorithm(int algo);
 
@@ -50,6 +59,9 @@ void scheduler_unblock(int pid);
 // Check if scheduler is active
 int scheduler_is_running(void);
 
+// Processes waiting on the calling CPU's run queue
+int scheduler_ready_count(void);
+
 // Timer IRQ handler for preemptive context switching
 // Called from irq0_switch in switch.asm
 // Returns the RSP to restore (may be different process)
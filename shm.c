@@ -1,10 +1,14 @@
 // shm.c - SysV Shared Memory for Alteo OS
-// Physical page-backed shared memory segments mapped into process address spaces
+// Physically contiguous runs of frames mapped into process address spaces
 #include "shm.h"
+#include "klib.h"
+#include "heap.h"
 #include "vmm.h"
 #include "pmm.h"
 #include "process.h"
 
+#define SHM_LARGE_PAGES   (VMM_LARGE_PAGE_SIZE / VMM_PAGE_SIZE)   // Frames per 2MB page
+
 // Attachment record: which process has this segment mapped where
 typedef struct {
     int      pid;
@@ -12,44 +16,140 @@ typedef struct {
     int      active;
 } shm_attachment_t;
 
+// Physically contiguous part of a segment
+typedef struct {
+    uint64_t phys;
+    uint64_t pages;
+} shm_run_t;
+
 // Shared memory segment descriptor
 typedef struct {
     uint64_t key;                          // IPC key
     uint64_t size;                         // Segment size (bytes)
-    uint64_t phys_pages[256];              // Physical page addresses (up to 1MB / 4KB = 256)
-    int      num_pages;                    // Number of physical pages
+    uint64_t num_pages;                    // Number of physical pages
+    shm_run_t* runs;                       // Backing frames, in order (kmalloc'd)
+    int      num_runs;
+    int      max_runs;                     // Capacity of runs[]
     int      active;                       // Is this segment allocated?
     int      marked_for_delete;            // Pending removal when nattach == 0
     shm_attachment_t attachments[SHM_MAX_ATTACH];
     int      nattach;                      // Current attachment count
+    int      pins;                         // Kernel users (shm_pin)
 } shm_segment_t;
 
 static shm_segment_t segments[SHM_MAX_SEGMENTS];
 static int shm_initialized = 0;
-static uint64_t shm_vaddr_next = 0x50000000;  // Virtual address allocation region
+static uint64_t shm_vaddr_next = SHM_VADDR_BASE;  // Virtual address allocation region
+
+// ---- Backing frames ----
+
+static int shm_add_run(shm_segment_t* seg, uint64_t phys, uint64_t pages) {
+    if (seg->num_runs == seg->max_runs) {
+        int cap = seg->max_runs ? seg->max_runs * 2 : 4;
+        shm_run_t* runs = (shm_run_t*)kmalloc(cap * sizeof(shm_run_t));
+        if (!runs) return -1;
+        if (seg->runs) {
+            memcpy(runs, seg->runs, seg->num_runs * sizeof(shm_run_t));
+            kfree(seg->runs);
+        }
+        seg->runs = runs;
+        seg->max_runs = cap;
+    }
+    seg->runs[seg->num_runs].phys = phys;
+    seg->runs[seg->num_runs].pages = pages;
+    seg->num_runs++;
+    return 0;
+}
+
+// A forked child may still hold references to 4KB-mapped frames; those
+// are dropped one at a time so the frames outlive the segment
+static void shm_free_run(shm_run_t* r) {
+    for (uint64_t i = 0; i < r->pages; i++) {
+        if (pmm_page_refcount((void*)(r->phys + i * VMM_PAGE_SIZE)) > 1) {
+            for (uint64_t j = 0; j < r->pages; j++)
+                pmm_free_block((void*)(r->phys + j * VMM_PAGE_SIZE));
+            return;
+        }
+    }
+    pmm_free_blocks((void*)r->phys, r->pages);
+}
+
+static void shm_free_segment(shm_segment_t* seg) {
+    for (int i = 0; i < seg->num_runs; i++) shm_free_run(&seg->runs[i]);
+    if (seg->runs) kfree(seg->runs);
+    seg->runs = 0;
+    seg->num_runs = 0;
+    seg->max_runs = 0;
+    seg->active = 0;
+}
+
+// Back the segment with as few runs as memory allows: try the whole
+// remainder, halving on failure. Runs of 2MB or more are 2MB aligned and
+// a whole number of 2MB pages, so shm_attach() can map them large.
+static int shm_alloc_frames(shm_segment_t* seg) {
+    uint64_t left = seg->num_pages;
+    uint64_t want = left;
+    while (left) {
+        if (want > left) want = left;
+        if (want > SHM_LARGE_PAGES) want &= ~(uint64_t)(SHM_LARGE_PAGES - 1);
+        uint64_t align = want >= SHM_LARGE_PAGES ? VMM_LARGE_PAGE_SIZE : 0;
+        void* base = pmm_alloc_blocks(want, align);
+        if (!base) {
+            if (want == 1) return -1;
+            want /= 2;
+            continue;
+        }
+        if (shm_add_run(seg, (uint64_t)base, want) < 0) {
+            pmm_free_blocks(base, want);
+            return -1;
+        }
+        memset(base, 0, want * VMM_PAGE_SIZE);
+        left -= want;
+    }
+    return 0;
+}
+
+static pte_t* shm_pml4_of(int pid) {
+    // For kernel-mode processes, use the kernel PML4
+    pte_t* pml4 = vmm_get_current_address_space();
+    process_t* p = process_get(pid);
+    if (p && p->page_table) {
+        pml4 = (pte_t*)p->page_table;
+    }
+    return pml4;
+}
 
-// ---- Helpers ----
-static void shm_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
+static void shm_put(shm_segment_t* seg) {
+    if (seg->marked_for_delete && seg->nattach == 0 && seg->pins == 0) {
+        shm_free_segment(seg);
+    }
+}
+
+static void shm_unmap(shm_segment_t* seg, int a) {
+    vmm_unmap_range(shm_pml4_of(seg->attachments[a].pid), seg->attachments[a].virt_addr,
+                    seg->num_pages * VMM_PAGE_SIZE);
+    seg->attachments[a].active = 0;
+    seg->nattach--;
 }
 
 // ---- Public API ----
 
 void shm_init(void) {
-    shm_memset(segments, 0, sizeof(segments));
+    memset(segments, 0, sizeof(segments));
     shm_initialized = 1;
 }
 
 int shm_get(uint64_t key, uint64_t size, int flags) {
     if (!shm_initialized) return -1;
-    if (size == 0 || size > SHM_MAX_SIZE) return -1;
+    if (size == 0) return -1;
 
     // If key != IPC_PRIVATE, search for existing segment with this key
     if (key != (uint64_t)IPC_PRIVATE) {
         for (int i = 0; i < SHM_MAX_SEGMENTS; i++) {
-            if (segments[i].active && segments[i].key == key) {
+            if (segments[i].active && !segments[i].marked_for_delete &&
+                segments[i].key == key) {
                 if (flags & IPC_EXCL) return -1; // Already exists
+                if (size > segments[i].size) return -1;
                 return i;
             }
         }
@@ -65,30 +165,19 @@ int shm_get(uint64_t key, uint64_t size, int flags) {
     }
     if (slot < 0) return -1;
 
-    // Allocate physical pages for the segment
-    uint64_t page_size = VMM_PAGE_SIZE;
-    int num_pages = (int)((size + page_size - 1) / page_size);
-    if (num_pages > 256) return -1;
-
-    shm_memset(&segments[slot], 0, sizeof(shm_segment_t));
-    segments[slot].key = key;
-    segments[slot].size = size;
-    segments[slot].num_pages = num_pages;
-    segments[slot].active = 1;
-    segments[slot].nattach = 0;
-
-    // Allocate physical pages
-    for (int i = 0; i < num_pages; i++) {
-        uint64_t page = (uint64_t)pmm_alloc_block();
-        if (page == 0) {
-            // Failed — free already allocated pages
-            for (int j = 0; j < i; j++) {
-                pmm_free_block((void*)segments[slot].phys_pages[j]);
-            }
-            segments[slot].active = 0;
-            return -1;
-        }
-        segments[slot].phys_pages[i] = page;
+    uint64_t num_pages = (size + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
+    if (num_pages * VMM_PAGE_SIZE > pmm_get_free_memory()) return -1;
+
+    shm_segment_t* seg = &segments[slot];
+    memset(seg, 0, sizeof(shm_segment_t));
+    seg->key = key;
+    seg->size = size;
+    seg->num_pages = num_pages;
+    seg->active = 1;
+
+    if (shm_alloc_frames(seg) < 0) {
+        shm_free_segment(seg);
+        return -1;
     }
 
     return slot;
@@ -100,6 +189,7 @@ uint64_t shm_attach(int shmid, int pid, uint64_t addr) {
     if (!segments[shmid].active) return 0;
 
     shm_segment_t* seg = &segments[shmid];
+    uint64_t bytes = seg->num_pages * VMM_PAGE_SIZE;
 
     // Find a free attachment slot
     int aslot = -1;
@@ -108,26 +198,29 @@ uint64_t shm_attach(int shmid, int pid, uint64_t addr) {
     }
     if (aslot < 0) return 0;
 
-    // Choose virtual address if not specified
+    // Choose virtual address if not specified; 2MB aligned so that large
+    // runs line up with 2MB pages
     uint64_t vaddr = addr;
     if (vaddr == 0) {
         vaddr = shm_vaddr_next;
-        shm_vaddr_next += (uint64_t)seg->num_pages * VMM_PAGE_SIZE;
-        // Align to next 4KB boundary (already aligned since num_pages * 4K)
-    }
-
-    // Map physical pages into the process's address space
-    // For kernel-mode processes, use the kernel PML4
-    pte_t* pml4 = vmm_get_current_address_space();
-    process_t* p = process_get(pid);
-    if (p && p->page_table) {
-        pml4 = (pte_t*)p->page_table;
+        shm_vaddr_next = (vaddr + bytes + VMM_LARGE_PAGE_SIZE - 1) &
+                         ~(uint64_t)(VMM_LARGE_PAGE_SIZE - 1);
+    } else if (vaddr & (VMM_PAGE_SIZE - 1)) {
+        return 0;
     }
 
-    uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER;
-    for (int i = 0; i < seg->num_pages; i++) {
-        vmm_map_page(pml4, vaddr + (uint64_t)i * VMM_PAGE_SIZE,
-                      seg->phys_pages[i], flags);
+    // One mapping per run. VMM_FLAG_SHARED keeps fork() from turning the
+    // 4KB pages copy-on-write.
+    pte_t* pml4 = shm_pml4_of(pid);
+    uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER | VMM_FLAG_SHARED;
+    uint64_t va = vaddr;
+    for (int i = 0; i < seg->num_runs; i++) {
+        uint64_t len = seg->runs[i].pages * VMM_PAGE_SIZE;
+        if (vmm_map_range(pml4, va, seg->runs[i].phys, len, flags) < 0) {
+            vmm_unmap_range(pml4, vaddr, va + len - vaddr);
+            return 0;
+        }
+        va += len;
     }
 
     // Record attachment
@@ -151,31 +244,8 @@ int shm_detach(int pid, uint64_t addr) {
             if (seg->attachments[a].active &&
                 seg->attachments[a].pid == pid &&
                 seg->attachments[a].virt_addr == addr) {
-
-                // Unmap pages from process address space
-                pte_t* pml4 = vmm_get_current_address_space();
-                process_t* p = process_get(pid);
-                if (p && p->page_table) {
-                    pml4 = (pte_t*)p->page_table;
-                }
-
-                for (int i = 0; i < seg->num_pages; i++) {
-                    uint64_t va = addr + (uint64_t)i * VMM_PAGE_SIZE;
-                    vmm_unmap_page(pml4, va);
-                    vmm_invlpg(va);
-                }
-
-                seg->attachments[a].active = 0;
-                seg->nattach--;
-
-                // If marked for deletion and no more attachments, free it
-                if (seg->marked_for_delete && seg->nattach == 0) {
-                    for (int i = 0; i < seg->num_pages; i++) {
-                        pmm_free_block((void*)seg->phys_pages[i]);
-                    }
-                    seg->active = 0;
-                }
-
+                shm_unmap(seg, a);
+                shm_put(seg);
                 return 0;
             }
         }
@@ -184,31 +254,54 @@ int shm_detach(int pid, uint64_t addr) {
     return -1; // Not found
 }
 
+void shm_release(int pid) {
+    if (!shm_initialized) return;
+    for (int s = 0; s < SHM_MAX_SEGMENTS; s++) {
+        shm_segment_t* seg = &segments[s];
+        if (!seg->active) continue;
+        for (int a = 0; a < SHM_MAX_ATTACH; a++) {
+            if (seg->attachments[a].active && seg->attachments[a].pid == pid) {
+                shm_unmap(seg, a);
+            }
+        }
+        shm_put(seg);
+    }
+}
+
 int shm_remove(int shmid) {
     if (!shm_initialized) return -1;
     if (shmid < 0 || shmid >= SHM_MAX_SEGMENTS) return -1;
     if (!segments[shmid].active) return -1;
 
-    if (segments[shmid].nattach == 0) {
-        // No attachments — free immediately
-        for (int i = 0; i < segments[shmid].num_pages; i++) {
-            pmm_free_block((void*)segments[shmid].phys_pages[i]);
-        }
-        segments[shmid].active = 0;
-    } else {
-        // Mark for deletion when all processes detach
-        segments[shmid].marked_for_delete = 1;
-    }
-
+    // Freed now if nothing uses it, otherwise on the last detach or unpin
+    segments[shmid].marked_for_delete = 1;
+    shm_put(&segments[shmid]);
     return 0;
 }
 
-int shm_get_size(int shmid) {
+uint64_t shm_get_size(int shmid) {
     if (shmid < 0 || shmid >= SHM_MAX_SEGMENTS || !segments[shmid].active) return 0;
-    return (int)segments[shmid].size;
+    return segments[shmid].size;
 }
 
 int shm_get_nattach(int shmid) {
     if (shmid < 0 || shmid >= SHM_MAX_SEGMENTS || !segments[shmid].active) return 0;
     return segments[shmid].nattach;
 }
+
+int shm_pin(int shmid, uint64_t* phys, uint64_t* size) {
+    if (shmid < 0 || shmid >= SHM_MAX_SEGMENTS || !segments[shmid].active) return -1;
+    shm_segment_t* seg = &segments[shmid];
+    if (seg->num_runs != 1) return -1;
+    seg->pins++;
+    if (phys) *phys = seg->runs[0].phys;
+    if (size) *size = seg->size;
+    return 0;
+}
+
+void shm_unpin(int shmid) {
+    if (shmid < 0 || shmid >= SHM_MAX_SEGMENTS || !segments[shmid].active) return;
+    shm_segment_t* seg = &segments[shmid];
+    if (seg->pins > 0) seg->pins--;
+    shm_put(seg);
+}
@@ -1,14 +1,19 @@
 // shm.h - SysV Shared Memory for Alteo OS
-// Provides shared memory segments for inter-process communication
+// Provides shared memory segments for inter-process communication.
+// A segment is backed by a few physically contiguous runs of frames,
+// 2MB aligned where possible, and each run is mapped with one
+// vmm_map_range() call, so large segments get 2MB pages. Kernel clients
+// (the compositor) can pin a single-run segment and use it in place
+// through the identity map.
 #ifndef SHM_H
 #define SHM_H
 
 #include "stdint.h"
 
 // Shared memory configuration
-#define SHM_MAX_SEGMENTS   16         // Maximum shared memory segments
-#define SHM_MAX_ATTACH     8          // Max attachments per segment
-#define SHM_MAX_SIZE       (1024*1024) // 1MB max per segment
+#define SHM_MAX_SEGMENTS   64         // Maximum shared memory segments
+#define SHM_MAX_ATTACH     32         // Max attachments per segment
+#define SHM_VADDR_BASE     0x4000000000ULL    // Where shm_attach() places segments (256GB)
 
 // shmget flags
 #define IPC_CREAT     0x0200   // Create segment if it doesn't exist
@@ -33,7 +38,16 @@ int shm_detach(int pid, uint64_t addr);
 int shm_remove(int shmid);
 
 // Get info about a shared memory segment
-int shm_get_size(int shmid);
+uint64_t shm_get_size(int shmid);
 int shm_get_nattach(int shmid);
 
+// Detach every segment process pid has attached (exit)
+void shm_release(int pid);
+
+// Keep a segment alive for the kernel and return its physical base and
+// size. Only segments in one contiguous run can be pinned. Returns 0, or
+// -1. A removed segment is freed once it has no attachments and no pins.
+int shm_pin(int shmid, uint64_t* phys, uint64_t* size);
+void shm_unpin(int shmid);
+
 #endif
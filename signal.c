@@ -1,6 +1,7 @@
 // signal.c - POSIX Signal Implementation for Alteo OS
 // Signal delivery, handler registration, masking, and default actions
 #include "signal.h"
+#include "klib.h"
 #include "process.h"
 
 // Per-process signal state
@@ -16,17 +17,8 @@ static signal_state_t sig_states[MAX_PROCESSES];
 static int signal_initialized = 0;
 
 // ---- Helpers ----
-static void sig_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
-}
-
 static int proc_slot_for_signal(int pid) {
-    process_t* table = process_get_table();
-    for (int i = 0; i < process_get_max(); i++) {
-        if (table[i].pid == pid && table[i].state != PROC_STATE_UNUSED) return i;
-    }
-    return -1;
+    return process_slot(pid);
 }
 
 // Get default action for standard POSIX signals
@@ -58,7 +50,7 @@ int signal_default_action(int sig) {
 // ---- Public API ----
 
 void signal_init(void) {
-    sig_memset(sig_states, 0, sizeof(sig_states));
+    memset(sig_states, 0, sizeof(sig_states));
 
     // Set all handlers to SIG_DFL for all processes
     for (int i = 0; i < MAX_PROCESSES; i++) {
@@ -0,0 +1,126 @@
+// smp.c - Symmetric Multiprocessing for Alteo OS
+// Sets up CPU numbering, the BSP's per-CPU data and the big kernel lock.
+// Application processors are not started (there is no AP trampoline), so
+// the BSP is the only CPU online; per-CPU tables are indexed by
+// smp_cpu_id() so that they stay correct once APs are brought up.
+#include "smp.h"
+#include "klib.h"
+#include "apic.h"
+#include "gdt.h"
+#include "syscall.h"
+#include "spinlock.h"
+
+extern uint64_t kernel_syscall_stack_top;
+
+typedef struct {
+    uint8_t  apic_id;
+    volatile int online;
+} smp_cpu_t;
+
+static smp_cpu_t cpus[SMP_MAX_CPUS];
+static volatile int cpus_online = 1;
+static uint8_t apic_to_cpu[256];             // APIC ID -> CPU index
+
+// Each CPU's own syscall stack top, by APIC ID, and the LAPIC ID register
+// (0 until smp_init, when the BSP's kernel_syscall_stack_top is used)
+uint64_t smp_syscall_stacks[256];
+volatile uint32_t* smp_lapic_id_reg = 0;
+
+static smp_percpu_t percpu[SMP_MAX_CPUS];
+
+static lockstat_t bkl_stat = LOCKSTAT_INIT("bkl");
+static ticketlock_t bkl = TICKETLOCK_INIT_STAT(bkl_stat);  // FIFO between CPUs
+static volatile int bkl_owner = -1;
+static int bkl_depth = 0;
+
+#define MSR_GS_BASE     0xC0000101
+#define MSR_KERNEL_GS   0xC0000102
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+// ---------- CPU identity ----------
+
+int smp_cpu_id(void) {
+    if (!smp_lapic_id_reg) return 0;
+    return apic_to_cpu[(*smp_lapic_id_reg >> 24) & 0xFF];
+}
+
+int smp_cpu_count(void) {
+    return cpus_online;
+}
+
+int smp_cpu_online(int cpu) {
+    return cpu >= 0 && cpu < SMP_MAX_CPUS && cpus[cpu].online;
+}
+
+uint8_t smp_cpu_apic_id(int cpu) {
+    if (!smp_lapic_id_reg) return (uint8_t)lapic_get_id();   // Before smp_init: only the BSP
+    if (!smp_cpu_online(cpu)) return cpus[0].apic_id;
+    return cpus[cpu].apic_id;
+}
+
+uint64_t smp_syscall_stack_top(void) {
+    if (!smp_lapic_id_reg) return kernel_syscall_stack_top;
+    return smp_syscall_stacks[(*smp_lapic_id_reg >> 24) & 0xFF];
+}
+
+// ---------- Per-CPU data ----------
+
+smp_percpu_t* smp_cpu_data(int cpu) {
+    return &percpu[cpu];
+}
+
+void smp_percpu_init(void) {
+    smp_percpu_t* pc = &percpu[smp_cpu_id()];
+    pc->self = pc;
+    pc->cpu = smp_cpu_id();
+    pc->syscall_stack_top = smp_syscall_stack_top();
+    pc->tss = gdt_cpu_tss(pc->cpu);
+    wrmsr(MSR_GS_BASE, (uint64_t)pc);
+    wrmsr(MSR_KERNEL_GS, 0);    // User GS base, swapped in on the way out
+}
+
+// ---------- Big kernel lock ----------
+
+void smp_bkl_lock(void) {
+    int me = smp_cpu_id();
+    if (bkl_owner == me) { bkl_depth++; return; }
+    uint32_t t = ticket_draw(&bkl);
+    uint64_t start = 0;
+    while (!ticket_served(&bkl, t)) {
+        if (!start) start = lock_tsc();
+        __asm__ volatile("pause");
+    }
+    ticket_got(&bkl, start);
+    bkl_owner = me;
+    bkl_depth = 1;
+}
+
+void smp_bkl_unlock(void) {
+    if (bkl_owner != smp_cpu_id()) return;
+    if (--bkl_depth > 0) return;
+    bkl_owner = -1;
+    ticket_unlock(&bkl);
+}
+
+int smp_bkl_held(void) {
+    return bkl_owner == smp_cpu_id();
+}
+
+// ---------- Bring-up ----------
+
+int smp_init(void) {
+    if (!apic_is_active()) return 1;
+
+    uint8_t bsp_id = (uint8_t)lapic_get_id();
+    cpus[0].apic_id = bsp_id;
+    cpus[0].online = 1;
+    apic_to_cpu[bsp_id] = 0;
+    smp_syscall_stacks[bsp_id] = kernel_syscall_stack_top;
+
+    // From here on smp_cpu_id() and syscall_entry use the LAPIC ID
+    smp_lapic_id_reg = (volatile uint32_t*)(lapic_get_base() + LAPIC_ID);
+    return cpus_online;
+}
@@ -0,0 +1,72 @@
+// smp.h - Symmetric Multiprocessing for Alteo OS
+// Provides CPU numbering, per-CPU data and the big kernel lock. Only the
+// BSP is brought online: there is no AP trampoline, so nothing here sends
+// inter-processor interrupts.
+#ifndef SMP_H
+#define SMP_H
+
+#include "stdint.h"
+
+#define SMP_MAX_CPUS          16
+
+// Set up the BSP's CPU numbering. Returns the number of CPUs online.
+int smp_init(void);
+
+// Index of the calling CPU (0 = BSP, 1.. = APs in MADT order)
+int smp_cpu_id(void);
+
+// Number of CPUs currently online
+int smp_cpu_count(void);
+
+// 1 if CPU 'cpu' has finished bring-up
+int smp_cpu_online(int cpu);
+
+// Local APIC ID of CPU 'cpu' (for directing device interrupts at it)
+uint8_t smp_cpu_apic_id(int cpu);
+
+// Top of the calling CPU's own syscall stack, used by processes that have
+// no kernel stack of their own (the scheduler points syscall_entry at the
+// running process's stack otherwise)
+uint64_t smp_syscall_stack_top(void);
+
+// Per-CPU data. In kernel mode the GS base points at the calling CPU's
+// block; syscall_entry and the interrupt stubs swapgs on entry from and
+// exit to ring 3. Field offsets are used by switch.asm (PERCPU_*). Hot
+// paths asking "who is running here" or "which run queue" read it with a
+// single GS-relative load instead of going through the LAPIC ID.
+typedef struct smp_percpu {
+    struct smp_percpu* self;
+    int32_t  cpu;
+    int32_t  pid;                   // Process running here (-1 = idle)
+    int32_t  slot;                  // Its process table slot (-1 = idle)
+    int32_t  reserved;
+    uint64_t syscall_stack_top;     // Running process's kernel stack, loaded by syscall_entry
+    volatile uint32_t rcu_nest;     // rcu_read_lock() depth
+    volatile uint32_t rcu_seq;      // Read sections completed (rcu.h)
+    void*    runq;                  // Scheduler run queue (scheduler.c)
+    void*    tss;                   // This CPU's TSS (gdt.c)
+    uint64_t ticks;                 // Scheduler ticks taken here
+    uint64_t switches;              // Context switches here
+    uint64_t syscalls;              // Syscalls dispatched here
+} smp_percpu_t;
+
+// Block of CPU 'cpu', for code that may run before its GS base is set
+smp_percpu_t* smp_cpu_data(int cpu);
+
+// Point the calling CPU's GS base at its block (syscall_init_ap)
+void smp_percpu_init(void);
+
+// Calling CPU's block through GS (after smp_percpu_init on this CPU)
+static inline smp_percpu_t* smp_this_cpu(void) {
+    smp_percpu_t* p;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(p));
+    return p;
+}
+
+// Big kernel lock: serializes syscalls across CPUs. It is dropped while a
+// process sleeps in scheduler_yield() and retaken when it resumes.
+void smp_bkl_lock(void);
+void smp_bkl_unlock(void);
+int smp_bkl_held(void);      // Held by the calling CPU
+
+#endif
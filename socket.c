@@ -1,24 +1,102 @@
 
 // socket.c - BSD-style Socket API for Alteo OS
 #include "socket.h"
+#include "klib.h"
+#include "heap.h"
 #include "tcp.h"
+#include "udp.h"
+#include "loopback.h"
 #include "ip.h"
 #include "ethernet.h"
 #include "e1000.h"
 
 static socket_t sockets[MAX_SOCKETS];
 
-// Memory helpers
-static void sock_memset(void* dst, uint8_t val, int n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (int i = 0; i < n; i++) d[i] = val;
+// ---- Wait conditions (arg = TCP connection id) ----
+
+static int sock_acceptable(void* arg) {
+    int id = (int)(uint64_t)arg;
+    return tcp_get_state(id) != TCP_STATE_LISTEN || tcp_accept_ready(id);
+}
+
+static int sock_readable(void* arg) {
+    int id = (int)(uint64_t)arg;
+    return tcp_data_available(id) > 0 || tcp_get_state(id) != TCP_STATE_ESTABLISHED;
+}
+
+static int sock_writable(void* arg) {
+    return tcp_send_space((int)(uint64_t)arg) != 0;
+}
+
+// Queue all of len on a TCP connection, sleeping while its send ring is
+// full. Segments go out as the windows allow; returns the bytes queued.
+static int sock_tcp_write(int id, const uint8_t* data, uint32_t len, int push) {
+    uint32_t done = 0;
+    while (done < len) {
+        int n = tcp_queue(id, data + done, len - done);
+        if (n < 0) break;
+        done += (uint32_t)n;
+        if (done < len) {
+            tcp_push(id);
+            waitq_wait(tcp_get_waitq(id), sock_writable, (void*)(uint64_t)id);
+        }
+    }
+    if (push) tcp_push(id);
+    if (done == 0 && len > 0) return SOCK_ERR_NOTCONN;
+    return (int)done;
+}
+
+// ---- Datagrams ----
+
+static int sock_dgram_ready(void* arg) {
+    int id = (int)(uint64_t)arg;
+    return udp_pending(id) > 0 || udp_local_port(id) == 0;
+}
+
+// Give a datagram socket its endpoint (port 0: ephemeral)
+static int sock_udp_bind(socket_t* s, uint16_t port) {
+    if (s->udp_id >= 0) return SOCK_ERR_INVAL;
+    s->udp_id = udp_open(port);
+    if (s->udp_id < 0) return port ? SOCK_ERR_ADDRINUSE : SOCK_ERR_NOBUFS;
+    s->local_port = udp_local_port(s->udp_id);
+    s->bound = 1;
+    return SOCK_ERR_NONE;
+}
+
+static int sock_udp_send(socket_t* s, const void* data, uint32_t len, uint32_t ip, uint16_t port) {
+    if (len > UDP_MAX_PAYLOAD) return SOCK_ERR_INVAL;
+    if (s->udp_id < 0) {
+        int r = sock_udp_bind(s, 0);
+        if (r != SOCK_ERR_NONE) return r;
+    }
+    int r = udp_sendto(s->udp_id, ip, port, (const uint8_t*)data, len);
+    if (r == -2) return SOCK_ERR_WOULDBLOCK;    // Next hop not resolved yet
+    if (r < 0) return SOCK_ERR_NOBUFS;
+    return r;
+}
+
+static int sock_udp_recv(socket_t* s, void* buf, uint32_t len, int flags, sockaddr_in_t* src_addr) {
+    if (s->udp_id < 0) return SOCK_ERR_NOTCONN;
+    if (!(flags & MSG_DONTWAIT))
+        waitq_wait(udp_get_waitq(s->udp_id), sock_dgram_ready, (void*)(uint64_t)s->udp_id);
+    uint32_t ip;
+    uint16_t port;
+    int n = udp_recvfrom(s->udp_id, (uint8_t*)buf, len, &ip, &port);
+    if (n < 0) return SOCK_ERR_WOULDBLOCK;
+    if (src_addr) {
+        src_addr->sin_family = AF_INET;
+        src_addr->sin_addr = htonl(ip);
+        src_addr->sin_port = htons(port);
+    }
+    return n;
 }
 
 void socket_init(void) {
     for (int i = 0; i < MAX_SOCKETS; i++) {
-        sock_memset(&sockets[i], 0, sizeof(socket_t));
+        memset(&sockets[i], 0, sizeof(socket_t));
         sockets[i].active = 0;
         sockets[i].tcp_conn_id = -1;
+        sockets[i].udp_id = -1;
     }
 }
 
@@ -30,13 +108,14 @@ int socket_create(int family, int type, int protocol) {
     // Find free socket
     for (int i = 0; i < MAX_SOCKETS; i++) {
         if (!sockets[i].active) {
-            sock_memset(&sockets[i], 0, sizeof(socket_t));
+            memset(&sockets[i], 0, sizeof(socket_t));
             sockets[i].active = 1;
             sockets[i].family = family;
             sockets[i].type = type;
             sockets[i].protocol = protocol ? protocol :
                 (type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP);
             sockets[i].tcp_conn_id = -1;
+            sockets[i].udp_id = -1;
             return i;
         }
     }
@@ -48,6 +127,13 @@ int socket_bind(int sockfd, const sockaddr_in_t* addr) {
     socket_t* s = &sockets[sockfd];
     if (!s->active) return SOCK_ERR_INVAL;
 
+    // The UDP endpoint table owns datagram ports
+    if (s->type == SOCK_DGRAM) {
+        int r = sock_udp_bind(s, ntohs(addr->sin_port));
+        if (r == SOCK_ERR_NONE) s->local_ip = ntohl(addr->sin_addr);
+        return r;
+    }
+
     // Check for port conflicts
     if (addr->sin_port != 0) {
         for (int i = 0; i < MAX_SOCKETS; i++) {
@@ -70,10 +156,8 @@ int socket_listen(int sockfd, int backlog) {
     if (!s->active || s->type != SOCK_STREAM) return SOCK_ERR_INVAL;
     if (!s->bound) return SOCK_ERR_INVAL;
 
-    (void)backlog;
-
     // Create TCP listener
-    s->tcp_conn_id = tcp_listen(s->local_port);
+    s->tcp_conn_id = tcp_listen(s->local_port, backlog);
     if (s->tcp_conn_id < 0) return SOCK_ERR_NOBUFS;
 
     s->listening = 1;
@@ -85,6 +169,8 @@ int socket_accept(int sockfd, sockaddr_in_t* addr) {
     socket_t* s = &sockets[sockfd];
     if (!s->active || !s->listening) return SOCK_ERR_INVAL;
 
+    // Sleep until a connection is established (the kernel process polls)
+    waitq_wait(tcp_get_waitq(s->tcp_conn_id), sock_acceptable, (void*)(uint64_t)s->tcp_conn_id);
     int tcp_id = tcp_accept(s->tcp_conn_id);
     if (tcp_id < 0) return SOCK_ERR_WOULDBLOCK;
 
@@ -131,7 +217,11 @@ int socket_connect(int sockfd, const sockaddr_in_t* addr) {
         }
         return SOCK_ERR_TIMEOUT;
     } else {
-        // UDP - just record the destination
+        // UDP - record the destination; send() and recv() then work
+        if (s->type == SOCK_DGRAM && s->udp_id < 0) {
+            int r = sock_udp_bind(s, 0);
+            if (r != SOCK_ERR_NONE) return r;
+        }
         s->connected = 1;
         return SOCK_ERR_NONE;
     }
@@ -145,24 +235,57 @@ int socket_send(int sockfd, const void* data, uint32_t len, int flags) {
     (void)flags;
 
     if (s->type == SOCK_STREAM) {
-        return tcp_send(s->tcp_conn_id, (const uint8_t*)data, (uint16_t)len);
+        return sock_tcp_write(s->tcp_conn_id, (const uint8_t*)data, len, 1);
+    }
+    if (s->type == SOCK_DGRAM) {
+        return sock_udp_send(s, data, len, s->remote_ip, s->remote_port);
     }
-    // UDP send would go here
     return SOCK_ERR_INVAL;
 }
 
+int socket_sendv(int sockfd, const sock_iov_t* iov, int count) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKETS || count < 0) return SOCK_ERR_INVAL;
+    socket_t* s = &sockets[sockfd];
+    if (!s->active || !s->connected) return SOCK_ERR_NOTCONN;
+    if (s->type != SOCK_STREAM) return SOCK_ERR_INVAL;
+
+    // The pieces are queued back to back in the send ring and only then
+    // pushed, so they go out as full segments in one TX batch. (No batch
+    // is held open here: a full ring sleeps for ACKs to what was pushed.)
+    int sent = 0;
+    int ret = 0;
+    for (int i = 0; i < count; i++) {
+        ret = sock_tcp_write(s->tcp_conn_id, (const uint8_t*)iov[i].data, iov[i].len, 0);
+        if (ret < 0) break;
+        sent += ret;
+    }
+    tcp_push(s->tcp_conn_id);
+    return sent > 0 ? sent : ret;
+}
+
+int socket_send_zerocopy(int sockfd, const void* data, uint32_t len) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKETS) return SOCK_ERR_INVAL;
+    socket_t* s = &sockets[sockfd];
+    if (!s->active || !s->connected) return SOCK_ERR_NOTCONN;
+    if (s->type != SOCK_STREAM) return SOCK_ERR_INVAL;
+    return sock_tcp_write(s->tcp_conn_id, (const uint8_t*)data, len, 1);
+}
+
 int socket_recv(int sockfd, void* buf, uint32_t len, int flags) {
     if (sockfd < 0 || sockfd >= MAX_SOCKETS) return SOCK_ERR_INVAL;
     socket_t* s = &sockets[sockfd];
     if (!s->active) return SOCK_ERR_INVAL;
 
-    (void)flags;
+    if (s->type == SOCK_DGRAM) {
+        return sock_udp_recv(s, buf, len, flags, (sockaddr_in_t*)0);
+    }
 
     if (s->type == SOCK_STREAM) {
         if (s->tcp_conn_id < 0) return SOCK_ERR_NOTCONN;
-        return tcp_recv(s->tcp_conn_id, (uint8_t*)buf, (uint16_t)len);
+        // Sleep until data arrives or the peer closes (0 = EOF)
+        waitq_wait(tcp_get_waitq(s->tcp_conn_id), sock_readable, (void*)(uint64_t)s->tcp_conn_id);
+        return tcp_recv(s->tcp_conn_id, (uint8_t*)buf, len);
     }
-    // UDP recv would go here
     return SOCK_ERR_INVAL;
 }
 
@@ -172,16 +295,9 @@ int socket_sendto(int sockfd, const void* data, uint32_t len,
     socket_t* s = &sockets[sockfd];
     if (!s->active) return SOCK_ERR_INVAL;
 
-    (void)flags;
-    (void)dest_addr;
-
     if (s->type == SOCK_DGRAM) {
-        // UDP implementation placeholder
-        uint32_t dest_ip = ntohl(dest_addr->sin_addr);
-        (void)dest_ip;
-        (void)data;
-        (void)len;
-        return SOCK_ERR_INVAL; // Not yet implemented
+        if (!dest_addr) return socket_send(sockfd, data, len, flags);
+        return sock_udp_send(s, data, len, ntohl(dest_addr->sin_addr), ntohs(dest_addr->sin_port));
     }
 
     return socket_send(sockfd, data, len, flags);
@@ -193,27 +309,54 @@ int socket_recvfrom(int sockfd, void* buf, uint32_t len,
     socket_t* s = &sockets[sockfd];
     if (!s->active) return SOCK_ERR_INVAL;
 
-    (void)flags;
-
     if (s->type == SOCK_DGRAM) {
-        if (!s->dgram_ready) return SOCK_ERR_WOULDBLOCK;
+        return sock_udp_recv(s, buf, len, flags, src_addr);
+    }
 
-        uint32_t copy_len = s->dgram_len < len ? s->dgram_len : len;
-        uint8_t* dst = (uint8_t*)buf;
-        for (uint32_t i = 0; i < copy_len; i++)
-            dst[i] = s->dgram_buf[i];
+    return socket_recv(sockfd, buf, len, flags);
+}
 
-        if (src_addr) {
-            src_addr->sin_family = AF_INET;
-            src_addr->sin_addr = htonl(s->dgram_src_ip);
-            src_addr->sin_port = htons(s->dgram_src_port);
+int socket_sendmmsg(int sockfd, sock_mmsg_t* msgs, int count) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKETS || count < 0) return SOCK_ERR_INVAL;
+    socket_t* s = &sockets[sockfd];
+    if (!s->active || s->type != SOCK_DGRAM) return SOCK_ERR_INVAL;
+
+    // One doorbell for the whole run (datagrams are copied into the TX
+    // ring, so nothing here waits on the NIC)
+    int sent = 0;
+    int ret = 0;
+    eth_tx_batch_begin();
+    for (int i = 0; i < count; i++) {
+        sock_mmsg_t* m = &msgs[i];
+        if (m->addr.sin_port) {
+            ret = sock_udp_send(s, m->data, m->len, ntohl(m->addr.sin_addr), ntohs(m->addr.sin_port));
+        } else if (s->connected) {
+            ret = sock_udp_send(s, m->data, m->len, s->remote_ip, s->remote_port);
+        } else {
+            ret = SOCK_ERR_NOTCONN;
         }
-
-        s->dgram_ready = 0;
-        return (int)copy_len;
+        if (ret < 0) break;
+        m->done = (uint32_t)ret;
+        sent++;
     }
+    eth_tx_batch_end();
+    return sent > 0 ? sent : ret;
+}
 
-    return socket_recv(sockfd, buf, len, flags);
+int socket_recvmmsg(int sockfd, sock_mmsg_t* msgs, int count, int flags) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKETS || count <= 0) return SOCK_ERR_INVAL;
+    socket_t* s = &sockets[sockfd];
+    if (!s->active || s->type != SOCK_DGRAM) return SOCK_ERR_INVAL;
+
+    int got = 0;
+    for (int i = 0; i < count; i++) {
+        sock_mmsg_t* m = &msgs[i];
+        int n = sock_udp_recv(s, m->data, m->len, i ? flags | MSG_DONTWAIT : flags, &m->addr);
+        if (n < 0) return got > 0 ? got : n;
+        m->done = (uint32_t)n;
+        got++;
+    }
+    return got;
 }
 
 int socket_close(int sockfd) {
@@ -224,9 +367,13 @@ int socket_close(int sockfd) {
     if (s->type == SOCK_STREAM && s->tcp_conn_id >= 0) {
         tcp_close(s->tcp_conn_id);
     }
+    if (s->udp_id >= 0) {
+        udp_close(s->udp_id);
+    }
 
-    sock_memset(s, 0, sizeof(socket_t));
+    memset(s, 0, sizeof(socket_t));
     s->tcp_conn_id = -1;
+    s->udp_id = -1;
     return SOCK_ERR_NONE;
 }
 
@@ -323,16 +470,41 @@ int net_tcp_listen(uint16_t port) {
     return fd;
 }
 
+uint32_t socket_poll_events(int sockfd) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKETS) return EPOLLERR;
+    socket_t* s = &sockets[sockfd];
+    if (!s->active) return EPOLLHUP;
+    if (s->type != SOCK_STREAM) return udp_pending(s->udp_id) > 0 ? EPOLLIN | EPOLLOUT : EPOLLOUT;
+    if (s->tcp_conn_id < 0) return 0;
+
+    int id = s->tcp_conn_id;
+    int state = tcp_get_state(id);
+    if (s->listening) return tcp_accept_ready(id) ? EPOLLIN : 0;
+
+    uint32_t ev = 0;
+    if (tcp_data_available(id) > 0) ev |= EPOLLIN;
+    if (state == TCP_STATE_ESTABLISHED && tcp_send_space(id) > 0) ev |= EPOLLOUT;
+    else if (state != TCP_STATE_SYN_SENT && state != TCP_STATE_SYN_RECEIVED)
+        ev |= EPOLLIN | EPOLLHUP;   // Peer closed: reads return EOF
+    return ev;
+}
+
+pollsrc_t* socket_get_pollsrc(int sockfd) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKETS || !sockets[sockfd].active) return (pollsrc_t*)0;
+    if (sockets[sockfd].type == SOCK_DGRAM) return udp_get_pollsrc(sockets[sockfd].udp_id);
+    return tcp_get_pollsrc(sockets[sockfd].tcp_conn_id);
+}
+
 void socket_poll(void) {
-    // Poll NIC for incoming packets
-    if (e1000_is_available()) {
-        uint8_t pkt_buf[2048];
-        int len = e1000_receive(pkt_buf, sizeof(pkt_buf));
-        if (len > 0) {
-            eth_receive(pkt_buf, (uint16_t)len);
-        }
+    // Poll NIC for incoming packets, unless its RX interrupt does
+    if (e1000_is_available() && !e1000_rx_irq_active()) {
+        e1000_rx_poll(E1000_RX_BUDGET);
     }
 
-    // Run TCP timer
+    // Deliver loopback traffic, unless the lo thread does
+    if (!lo_thread_active()) lo_poll(LO_BUDGET);
+
+    // Run ARP and TCP timers
+    arp_timer();
     tcp_timer();
 }
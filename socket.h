@@ -3,6 +3,7 @@
 #define SOCKET_H
 
 #include "stdint.h"
+#include "epoll.h"
 
 // Address families
 #define AF_INET     2       // IPv4
@@ -25,6 +26,9 @@
 #define SO_RCVBUF       8
 #define SO_SNDBUF       7
 
+// send/recv flags
+#define MSG_DONTWAIT    0x40    // Fail with SOCK_ERR_WOULDBLOCK instead of sleeping
+
 // Shutdown flags
 #define SHUT_RD     0
 #define SHUT_WR     1
@@ -77,12 +81,8 @@ typedef struct {
     // TCP connection (for SOCK_STREAM)
     int      tcp_conn_id;   // TCP connection ID
 
-    // Receive buffer (for SOCK_DGRAM)
-    uint8_t  dgram_buf[2048];
-    uint16_t dgram_len;
-    uint32_t dgram_src_ip;
-    uint16_t dgram_src_port;
-    int      dgram_ready;
+    // UDP endpoint (for SOCK_DGRAM), -1 until bound
+    int      udp_id;
 
     // Options
     int      reuse_addr;
@@ -113,6 +113,20 @@ int  socket_connect(int sockfd, const sockaddr_in_t* addr);
 // Send data
 int  socket_send(int sockfd, const void* data, uint32_t len, int flags);
 
+// One piece of a gathered send
+typedef struct {
+    const void* data;
+    uint32_t    len;
+} sock_iov_t;
+
+// Send several buffers as one stream (TCP): the pieces are packed into
+// full-sized segments instead of one segment (or more) per piece
+int  socket_sendv(int sockfd, const sock_iov_t* iov, int count);
+
+// Send kernel memory (TCP); returns once all of it is in the send ring,
+// which the NIC reads segments from in place. Used by sendfile/splice.
+int  socket_send_zerocopy(int sockfd, const void* data, uint32_t len);
+
 // Receive data
 int  socket_recv(int sockfd, void* buf, uint32_t len, int flags);
 
@@ -124,6 +138,25 @@ int  socket_sendto(int sockfd, const void* data, uint32_t len,
 int  socket_recvfrom(int sockfd, void* buf, uint32_t len,
                      int flags, sockaddr_in_t* src_addr);
 
+// One datagram of a batched send/receive: len is the datagram (send) or
+// the buffer size (receive); done is what was sent or received, addr the
+// destination or source
+typedef struct {
+    void*         data;
+    uint32_t      len;
+    uint32_t      done;
+    sockaddr_in_t addr;
+} sock_mmsg_t;
+
+// Send count datagrams (UDP) in one TX batch, each to its own address (or
+// the connected peer if its addr has no port). Returns the number sent;
+// stops at the first that fails.
+int  socket_sendmmsg(int sockfd, sock_mmsg_t* msgs, int count);
+
+// Receive up to count datagrams (UDP): sleeps for the first unless
+// MSG_DONTWAIT, then takes what is already queued. Returns the number received.
+int  socket_recvmmsg(int sockfd, sock_mmsg_t* msgs, int count, int flags);
+
 // Close socket
 int  socket_close(int sockfd);
 
@@ -144,6 +177,12 @@ int  net_tcp_connect(uint32_t ip, uint16_t port);
 // Network helper - create a TCP server
 int  net_tcp_listen(uint16_t port);
 
+// Current EPOLL* readiness of a socket
+uint32_t socket_poll_events(int sockfd);
+
+// Event source for epoll registration (NULL for sockets without one)
+pollsrc_t* socket_get_pollsrc(int sockfd);
+
 // Process network events (call from main loop)
 void socket_poll(void);
 
@@ -0,0 +1,181 @@
+// spinlock.h - Spinlocks for Alteo OS
+// Test-and-test-and-set locks for data shared between CPUs. The _irqsave
+// variants also disable interrupts, for data touched from IRQ handlers.
+// Ticket locks hand the lock out in arrival order, for contended paths
+// where a test-and-set lock would let one CPU starve the others.
+//
+// Either kind may carry a lockstat_t (lockstat.c) counting acquisitions,
+// contention, cycles spent spinning and cycles held. Locks without one pay
+// a single pointer test; /proc/lockstat lists every block once used.
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "stdint.h"
+
+// ---- Lock statistics ----
+
+// Counters are only written by the lock's holder, so they need no locking
+typedef struct lockstat {
+    const char* name;
+    uint64_t acquired;
+    uint64_t contended;         // Acquisitions that had to spin
+    uint64_t spin_cycles;       // TSC cycles spent spinning
+    uint64_t hold_cycles;       // TSC cycles held, in total
+    uint64_t max_hold_cycles;
+    uint64_t since;             // TSC at the current acquisition
+    struct lockstat* next;      // Listed blocks (lockstat_first)
+    volatile uint32_t listed;
+} lockstat_t;
+
+#define LOCKSTAT_INIT(n) { n, 0, 0, 0, 0, 0, 0, 0, 0 }
+
+// Add a block to the list (done on its first acquisition)
+void lockstat_list(lockstat_t* st);
+
+// First listed block; follow ->next for the rest
+lockstat_t* lockstat_first(void);
+
+// Zero every listed block's counters
+void lockstat_reset(void);
+
+static inline uint64_t lock_tsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// start = TSC when spinning began, 0 if the lock was free
+static inline void lockstat_acquired(lockstat_t* st, uint64_t start) {
+    uint64_t now = lock_tsc();
+    if (!st->listed) lockstat_list(st);
+    st->acquired++;
+    if (start) {
+        st->contended++;
+        st->spin_cycles += now - start;
+    }
+    st->since = now;
+}
+
+static inline void lockstat_released(lockstat_t* st) {
+    uint64_t held = lock_tsc() - st->since;
+    st->hold_cycles += held;
+    if (held > st->max_hold_cycles) st->max_hold_cycles = held;
+}
+
+// ---- Spinlocks ----
+
+typedef struct {
+    volatile uint32_t locked;
+    lockstat_t* stat;           // Optional
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0, 0 }
+#define SPINLOCK_INIT_STAT(st) { 0, &(st) }
+
+static inline void spin_init(spinlock_t* lock) {
+    lock->locked = 0;
+    lock->stat = 0;
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+    uint64_t start = 0;
+    for (;;) {
+        uint32_t old = 1;
+        __asm__ volatile("xchgl %0, %1" : "+r"(old), "+m"(lock->locked) :: "memory");
+        if (old == 0) break;
+        if (!start) start = lock_tsc();
+        while (lock->locked) __asm__ volatile("pause");
+    }
+    if (lock->stat) lockstat_acquired(lock->stat, start);
+}
+
+static inline int spin_trylock(spinlock_t* lock) {
+    uint32_t old = 1;
+    __asm__ volatile("xchgl %0, %1" : "+r"(old), "+m"(lock->locked) :: "memory");
+    if (old != 0) return 0;
+    if (lock->stat) lockstat_acquired(lock->stat, 0);
+    return 1;
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    if (lock->stat) lockstat_released(lock->stat);
+    __asm__ volatile("" ::: "memory");
+    lock->locked = 0;
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spin_unlock(lock);
+    if (flags & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+}
+
+// ---- Ticket locks ----
+
+typedef struct {
+    volatile uint32_t next;     // Next ticket to hand out
+    volatile uint32_t owner;    // Ticket being served
+    lockstat_t* stat;           // Optional
+} ticketlock_t;
+
+#define TICKETLOCK_INIT { 0, 0, 0 }
+#define TICKETLOCK_INIT_STAT(st) { 0, 0, &(st) }
+
+// Take a ticket; the lock is held once ticket_served() (then ticket_got())
+static inline uint32_t ticket_draw(ticketlock_t* lock) {
+    return __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline int ticket_served(ticketlock_t* lock, uint32_t ticket) {
+    return __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) == ticket;
+}
+
+static inline void ticket_got(ticketlock_t* lock, uint64_t start) {
+    if (lock->stat) lockstat_acquired(lock->stat, start);
+}
+
+static inline void ticket_lock(ticketlock_t* lock) {
+    uint32_t t = ticket_draw(lock);
+    uint64_t start = 0;
+    if (!ticket_served(lock, t)) {
+        start = lock_tsc();
+        while (!ticket_served(lock, t)) __asm__ volatile("pause");
+    }
+    ticket_got(lock, start);
+}
+
+static inline int ticket_trylock(ticketlock_t* lock) {
+    uint32_t t = lock->owner;
+    if (!__atomic_compare_exchange_n(&lock->next, &t, t + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+    ticket_got(lock, 0);
+    return 1;
+}
+
+static inline void ticket_unlock(ticketlock_t* lock) {
+    if (lock->stat) lockstat_released(lock->stat);
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline int ticket_is_locked(ticketlock_t* lock) {
+    return lock->next != lock->owner;
+}
+
+static inline uint64_t ticket_lock_irqsave(ticketlock_t* lock) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    ticket_lock(lock);
+    return flags;
+}
+
+static inline void ticket_unlock_irqrestore(ticketlock_t* lock, uint64_t flags) {
+    ticket_unlock(lock);
+    if (flags & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+}
+
+#endif
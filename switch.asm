@@ -2,6 +2,9 @@
 ; Implements cooperative and preemptive context switching
 bits 64
 
+; Offset of syscall_stack_top in smp_percpu_t (smp.h)
+PERCPU_STACK_TOP equ 24
+
 ; ---------------------------------------------------------------------------
 ; void switch_context(uint64_t* old_rsp, uint64_t new_rsp)
 ;   RDI = pointer to save location for current RSP
@@ -55,6 +58,10 @@ extern timer_irq_handler
 global irq0_switch
 irq0_switch:
     cli
+    test byte [rsp + 8], 3  ; From ring 3: switch to the kernel GS base
+    jz .kernel_gs
+    swapgs
+.kernel_gs:
 
     ; Push dummy error code and interrupt number (matches registers_t layout)
     push qword 0           ; Dummy error code
@@ -115,6 +122,12 @@ irq0_switch:
     ; Skip interrupt number and error code
     add rsp, 16
 
+    ; Checked on the frame being resumed, which may belong to another process
+    test byte [rsp + 8], 3  ; Back to ring 3: user GS base
+    jz .user_gs
+    swapgs
+.user_gs:
+
     sti
     iretq
 
@@ -135,14 +148,11 @@ extern syscall_dispatch
 global syscall_entry
 syscall_entry:
     ; We're now in Ring 0 with kernel CS/SS
-    ; Swap to kernel stack (RSP0 from TSS)
-    ; Save user RSP in a scratch register
+    ; GS base -> this CPU's smp_percpu_t, which holds the running process's
+    ; kernel stack (the scheduler updates it on every switch, like TSS RSP0)
+    swapgs
     mov r15, rsp            ; Save user RSP temporarily
-
-    ; Load kernel stack from TSS RSP0
-    ; We store the kernel stack pointer in a known location
-    extern kernel_syscall_stack_top
-    mov rsp, [rel kernel_syscall_stack_top]
+    mov rsp, [gs:PERCPU_STACK_TOP]
 
     ; Push user context for SYSRET
     push r15                ; User RSP
@@ -195,4 +205,31 @@ syscall_entry:
 
     ; Return to user mode
     ; SYSRET sets CS = STAR[63:48]+16, SS = STAR[63:48]+8 with RPL=3
+    swapgs
+    o64 sysret
+
+; ---------------------------------------------------------------------------
+; First return to user mode for a forked child.
+; sys_fork() builds the child's kernel stack so that switch_context's 'ret'
+; lands here with RSP pointing at a copy of the parent's syscall frame:
+;   r15, r14, r13, r12, rbp, rbx, user RIP, user RFLAGS, user RSP
+; The child then leaves the syscall exactly like the parent, with RAX = 0.
+; ---------------------------------------------------------------------------
+global fork_child_return
+fork_child_return:
+    cli
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+
+    pop rcx                 ; User RIP (for SYSRET)
+    pop r11                 ; User RFLAGS (for SYSRET)
+    pop rsp                 ; User RSP
+
+    xor eax, eax            ; fork() returns 0 in the child
+    swapgs
     o64 sysret
@@ -1,6 +1,7 @@
 // syscall.c - POSIX-compatible System Call Interface for Alteo OS
 // Provides libc-compatible syscall layer with VFS, pipe, signal, and IPC support
 #include "syscall.h"
+#include "klib.h"
 #include "process.h"
 #include "scheduler.h"
 #include "gdt.h"
@@ -10,6 +11,18 @@
 #include "pipe.h"
 #include "signal.h"
 #include "shm.h"
+#include "smp.h"
+#include "timer.h"
+#include "waitq.h"
+#include "epoll.h"
+#include "devfs.h"
+#include "fpu.h"
+#include "dynlink.h"
+#include "pe.h"
+#include "vdso.h"
+#include "heap.h"
+#include "blkdev.h"
+#include "trace.h"
 
 static int syscall_initialized = 0;
 
@@ -21,6 +34,9 @@ uint64_t kernel_syscall_stack_top = 0;
 // Maps process-local fd -> VFS fd (or pipe fd with high bit set)
 #define PROC_MAX_FDS    64
 #define PIPE_FD_FLAG    0x40000000
+#define EPOLL_FD_FLAG   0x20000000
+#define SOCKET_FD_FLAG  0x10000000
+#define URING_FD_FLAG   0x08000000
 
 typedef struct {
     int vfs_fd;
@@ -56,19 +72,17 @@ static void sys_strcpy(char* dst, const char* src, int max) {
     dst[i] = 0;
 }
 static int sys_strlen(const char* s) { int l = 0; while (s[l]) l++; return l; }
-static void sys_memset(void* p, int v, uint64_t n) {
-    unsigned char* b = (unsigned char*)p;
-    for (uint64_t i = 0; i < n; i++) b[i] = (unsigned char)v;
+// ---- Current process ----
+// Read from the per-CPU block, which the scheduler keeps up to date, so
+// no handler scans the process table to find its caller
+static inline int cur_slot(void) { return smp_this_cpu()->slot; }
+static inline int cur_pid(void)  { return smp_this_cpu()->pid; }
+static inline process_t* cur_proc(void) {
+    int slot = cur_slot();
+    return slot >= 0 ? &process_get_table()[slot] : (process_t*)0;
 }
 
 // ---- Per-process FD helpers ----
-static int proc_slot_for_pid(int pid) {
-    process_t* table = process_get_table();
-    for (int i = 0; i < process_get_max(); i++) {
-        if (table[i].pid == pid && table[i].state != PROC_STATE_UNUSED) return i;
-    }
-    return -1;
-}
 
 static int alloc_proc_fd(int slot) {
     for (int i = 0; i < PROC_MAX_FDS; i++) {
@@ -77,13 +91,38 @@ static int alloc_proc_fd(int slot) {
     return -1;
 }
 
+// Map a SOCK_ERR_* result onto a syscall result
+static int sock_result(int r) {
+    if (r >= 0) return r;
+    switch (r) {
+        case SOCK_ERR_INVAL:       return SYSCALL_EINVAL;
+        case SOCK_ERR_NOBUFS:      return SYSCALL_ENOMEM;
+        case SOCK_ERR_CONNREFUSED: return SYSCALL_ECONNREFUSED;
+        case SOCK_ERR_NOTCONN:     return SYSCALL_ENOTCONN;
+        case SOCK_ERR_ADDRINUSE:   return SYSCALL_EADDRINUSE;
+        case SOCK_ERR_WOULDBLOCK:  return SYSCALL_EAGAIN;
+        default:                   return SYSCALL_ERROR;
+    }
+}
+
+static int64_t uring_exec_op(uring_op_t* op, int slot, int may_sleep);
+
 // ---- Init ----
 void syscall_init(void) {
     kernel_syscall_stack_top = (uint64_t)&kernel_syscall_stack_data[8192];
-    sys_memset(proc_fds, 0, sizeof(proc_fds));
-    sys_memset(proc_brk, 0, sizeof(proc_brk));
-    for (int i = 0; i < MAX_PROCESSES; i++) proc_brk[i] = 0x400000;
+    memset(proc_fds, 0, sizeof(proc_fds));
+    memset(proc_brk, 0, sizeof(proc_brk));
+    for (int i = 0; i < MAX_PROCESSES; i++) proc_brk[i] = USER_BRK_BASE;
+
+    uring_init(uring_exec_op);
+    futex_init();
+
+    syscall_init_ap();
+    syscall_initialized = 1;
+}
 
+// Program the SYSCALL MSRs on the calling CPU (the BSP's via syscall_init)
+void syscall_init_ap(void) {
     uint64_t efer = rdmsr(MSR_EFER);
     efer |= EFER_SCE;
     wrmsr(MSR_EFER, efer);
@@ -91,13 +130,13 @@ void syscall_init(void) {
     wrmsr(MSR_STAR, star);
     wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
     wrmsr(MSR_SFMASK, (1 << 9) | (1 << 8) | (1 << 10));
-    syscall_initialized = 1;
+    smp_percpu_init();
 }
 
 // ============ Process Management ============
 
 int sys_exit(int exit_code) {
-    int pid = process_get_pid();
+    int pid = cur_pid();
     if (pid > 0) {
         process_t* p = process_get(pid);
         if (p) signal_send(p->ppid, SIGCHLD);
@@ -107,11 +146,11 @@ int sys_exit(int exit_code) {
     return SYSCALL_OK;
 }
 
-int sys_getpid(void) { return process_get_pid(); }
+int sys_getpid(void) { return cur_pid(); }
 int sys_yield(void)  { scheduler_yield(); return SYSCALL_OK; }
 
 int sys_sleep(uint64_t ticks) {
-    int pid = process_get_pid();
+    int pid = cur_pid();
     if (pid < 0) return SYSCALL_ERROR;
     scheduler_stats_t st = scheduler_get_stats();
     process_sleep(pid, st.total_ticks + ticks);
@@ -119,30 +158,92 @@ int sys_sleep(uint64_t ticks) {
     return SYSCALL_OK;
 }
 
+// Sleep with nanosecond resolution (the wakeup is a one-shot timer event)
+int sys_nanosleep(uint64_t ns) {
+    int pid = cur_pid();
+    if (pid < 0) return SYSCALL_ERROR;
+    if (!timer_is_active()) return sys_sleep((ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS);
+    process_sleep_ns(pid, timer_now_ns() + ns);
+    scheduler_yield();
+    return SYSCALL_OK;
+}
+
+// Number of qwords syscall_entry pushes below the process's stack_top:
+// user RSP, RFLAGS, RIP, then rbx, rbp, r12, r13, r14, r15
+#define SYSCALL_FRAME_QWORDS 9
+
 int sys_fork(void) {
-    process_t* current = process_get_current();
+    process_t* current = cur_proc();
     if (!current) return SYSCALL_ERROR;
     int child_pid = process_create(current->name, (void(*)(void))0, current->priority);
     if (child_pid < 0) return SYSCALL_ENOMEM;
-    int ps = proc_slot_for_pid(current->pid);
-    int cs = proc_slot_for_pid(child_pid);
+    process_t* child = process_get(child_pid);
+
+    // Duplicate the address space copy-on-write: nothing is copied until
+    // one side writes to a page
+    pte_t* parent_pml4 = current->page_table ? (pte_t*)current->page_table
+                                             : vmm_get_current_address_space();
+    pte_t* child_pml4 = vmm_clone_address_space(parent_pml4);
+    if (!child_pml4) {
+        process_terminate(child_pid, 0);
+        process_free(child);
+        return SYSCALL_ENOMEM;
+    }
+    child->page_table = (uint64_t)child_pml4;
+    child->is_user = current->is_user;
+    child->user_stack_base = current->user_stack_base;
+    child->user_stack_top = current->user_stack_top;
+    vmm_vma_copy(current->pid, child_pid);
+    dl_fork(current->pid, child_pid);
+    pe_fork(current->pid, child_pid);
+    vdso_map(child_pml4, child_pid);
+    fpu_fork(current, child);
+
+    int ps = cur_slot();
+    int cs = (int)(child - process_get_table());
     if (ps >= 0 && cs >= 0) {
         for (int i = 0; i < PROC_MAX_FDS; i++) proc_fds[cs][i] = proc_fds[ps][i];
         proc_brk[cs] = proc_brk[ps];
     }
+
+    // A user-mode parent entered through syscall_entry: give the child a
+    // kernel stack that resumes at fork_child_return with the same frame
+    if (current->is_user && current->stack_top && child->stack_top) {
+        uint64_t* frame = (uint64_t*)current->stack_top - SYSCALL_FRAME_QWORDS;
+        uint64_t* sp = (uint64_t*)child->stack_top;
+        for (int i = SYSCALL_FRAME_QWORDS - 1; i >= 0; i--) *(--sp) = frame[i];
+        *(--sp) = (uint64_t)fork_child_return;   // switch_context 'ret'
+        *(--sp) = 0x202;                         // rflags (IF set)
+        for (int i = 0; i < 6; i++) *(--sp) = 0; // r15, r14, r13, r12, rbx, rbp
+        child->kernel_rsp = (uint64_t)sp;
+    }
     return child_pid;
 }
 
+// wait() condition: the child exited (or is gone)
+static int sys_wait_done(void* arg) {
+    process_t* target = process_get((int)(uint64_t)arg);
+    return !target || target->state == PROC_STATE_ZOMBIE;
+}
+
 int sys_wait(int pid) {
     process_t* target = process_get(pid);
     if (!target) return SYSCALL_ENOENT;
-    process_t* current = process_get_current();
+    process_t* current = cur_proc();
     if (!current) return SYSCALL_ERROR;
     if (target->ppid != current->pid) return SYSCALL_EPERM;
+
+    // Sleep until process_terminate() wakes us; the kernel process polls
+    waitq_wait(&current->child_exit, sys_wait_done, (void*)(uint64_t)pid);
+    target = process_get(pid);
+    if (!target) return SYSCALL_ENOENT;
     if (target->state == PROC_STATE_ZOMBIE) {
         int code = target->exit_code;
-        target->state = PROC_STATE_UNUSED;
-        target->pid = -1;
+        if (target->page_table) {
+            vmm_destroy_address_space((pte_t*)target->page_table);
+            target->page_table = 0;
+        }
+        process_free(target);
         return code;
     }
     return SYSCALL_OK;
@@ -169,7 +270,7 @@ int sys_kill(int pid, int sig) {
 }
 
 int sys_getppid(void) {
-    process_t* c = process_get_current();
+    process_t* c = cur_proc();
     return c ? c->ppid : SYSCALL_ERROR;
 }
 
@@ -187,7 +288,11 @@ int sys_setprio(int pid, int priority) {
     if (priority < PRIORITY_LOW || priority > PRIORITY_REALTIME) return SYSCALL_EINVAL;
     process_t* p = process_get(pid);
     if (!p) return SYSCALL_ENOENT;
+    // A ready process has to move to the queue for its new level
+    int queued = p->on_rq;
+    if (queued) scheduler_dequeue(p);
     p->priority = priority;
+    if (queued) scheduler_enqueue(p);
     switch (priority) {
         case PRIORITY_REALTIME: p->default_slice = 2;  break;
         case PRIORITY_HIGH:     p->default_slice = 5;  break;
@@ -222,7 +327,7 @@ int sys_meminfo(meminfo_t* info) {
 
 int sys_open(const char* path, int flags) {
     if (!path) return SYSCALL_EINVAL;
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     int pfd = alloc_proc_fd(slot);
     if (pfd < 0) return SYSCALL_EMFILE;
@@ -241,13 +346,29 @@ int sys_open(const char* path, int flags) {
     return pfd;
 }
 
+// Drop fd's registrations from every epoll instance the process holds,
+// so a later fd with the same number does not inherit them
+static void epoll_forget_fd(int slot, int fd) {
+    for (int i = 0; i < PROC_MAX_FDS; i++) {
+        if (!proc_fds[slot][i].in_use || !(proc_fds[slot][i].vfs_fd & EPOLL_FD_FLAG)) continue;
+        epoll_del(proc_fds[slot][i].vfs_fd & ~EPOLL_FD_FLAG, fd);
+    }
+}
+
 int sys_close(int fd) {
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+    epoll_forget_fd(slot, fd);
     int vfd = proc_fds[slot][fd].vfs_fd;
     if (vfd & PIPE_FD_FLAG) {
         pipe_close(vfd & ~PIPE_FD_FLAG, (proc_fds[slot][fd].flags & 0x01) ? 1 : 0);
+    } else if (vfd & EPOLL_FD_FLAG) {
+        epoll_destroy(vfd & ~EPOLL_FD_FLAG);
+    } else if (vfd & SOCKET_FD_FLAG) {
+        socket_close(vfd & ~SOCKET_FD_FLAG);
+    } else if (vfd & URING_FD_FLAG) {
+        uring_destroy(vfd & ~URING_FD_FLAG, cur_pid());
     } else {
         vfs_close(vfd);
     }
@@ -257,37 +378,119 @@ int sys_close(int fd) {
 
 int64_t sys_read(int fd, void* buf, uint64_t count) {
     if (!buf || count == 0) return SYSCALL_EINVAL;
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
     int vfd = proc_fds[slot][fd].vfs_fd;
     if (vfd & PIPE_FD_FLAG) return pipe_read(vfd & ~PIPE_FD_FLAG, buf, (int)count);
+    if (vfd & (EPOLL_FD_FLAG | URING_FD_FLAG)) return SYSCALL_EINVAL;
+    if (vfd & SOCKET_FD_FLAG) return sock_result(socket_recv(vfd & ~SOCKET_FD_FLAG, buf, (uint32_t)count, 0));
     return vfs_read(vfd, buf, (uint32_t)count);
 }
 
 int64_t sys_write(int fd, const void* buf, uint64_t count) {
     if (!buf || count == 0) return SYSCALL_EINVAL;
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
     int vfd = proc_fds[slot][fd].vfs_fd;
     if (vfd & PIPE_FD_FLAG) return pipe_write(vfd & ~PIPE_FD_FLAG, buf, (int)count);
+    if (vfd & (EPOLL_FD_FLAG | URING_FD_FLAG)) return SYSCALL_EINVAL;
+    if (vfd & SOCKET_FD_FLAG) return sock_result(socket_send(vfd & ~SOCKET_FD_FLAG, buf, (uint32_t)count, 0));
     return vfs_write(vfd, buf, (uint32_t)count);
 }
 
+// Whether a read of a pipe or socket would return data without sleeping
+static int fd_read_ready(int vfd) {
+    if (vfd & PIPE_FD_FLAG) return pipe_available(vfd & ~PIPE_FD_FLAG) > 0;
+    if (vfd & SOCKET_FD_FLAG) return (socket_poll_events(vfd & ~SOCKET_FD_FLAG) & EPOLLIN) != 0;
+    return 1;
+}
+
+int64_t sys_readv(int fd, const iovec_t* iov, int iovcnt) {
+    if (!iov || iovcnt <= 0 || iovcnt > SYSCALL_IOV_MAX) return SYSCALL_EINVAL;
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+    int vfd = proc_fds[slot][fd].vfs_fd;
+    if (vfd & EPOLL_FD_FLAG) return SYSCALL_EINVAL;
+
+    int64_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) continue;
+        // Only the first buffer may wait for data
+        if (total > 0 && !fd_read_ready(vfd)) break;
+        int64_t n = sys_read(fd, iov[i].base, iov[i].len);
+        if (n < 0) return total > 0 ? total : n;
+        total += n;
+        if ((uint64_t)n < iov[i].len) break;
+    }
+    return total;
+}
+
+int64_t sys_writev(int fd, const iovec_t* iov, int iovcnt) {
+    if (!iov || iovcnt <= 0 || iovcnt > SYSCALL_IOV_MAX) return SYSCALL_EINVAL;
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+    int vfd = proc_fds[slot][fd].vfs_fd;
+    if (vfd & EPOLL_FD_FLAG) return SYSCALL_EINVAL;
+
+    if (vfd & SOCKET_FD_FLAG) {
+        sock_iov_t pieces[SYSCALL_IOV_MAX];
+        for (int i = 0; i < iovcnt; i++) {
+            pieces[i].data = iov[i].base;
+            pieces[i].len = (uint32_t)iov[i].len;
+        }
+        return sock_result(socket_sendv(vfd & ~SOCKET_FD_FLAG, pieces, iovcnt));
+    }
+
+    int64_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) continue;
+        int64_t n = sys_write(fd, iov[i].base, iov[i].len);
+        if (n < 0) return total > 0 ? total : n;
+        total += n;
+        if ((uint64_t)n < iov[i].len) break;
+    }
+    return total;
+}
+
+int64_t sys_pread(int fd, const pio_args_t* args) {
+    if (!args || !args->buf || args->count == 0) return SYSCALL_EINVAL;
+    if (args->offset > 0x7FFFFFFFULL) return SYSCALL_EINVAL;
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+    int vfd = proc_fds[slot][fd].vfs_fd;
+    if (vfd & (PIPE_FD_FLAG | EPOLL_FD_FLAG | SOCKET_FD_FLAG)) return SYSCALL_ESPIPE;
+    return vfs_pread(vfd, args->buf, (uint32_t)args->count, (uint32_t)args->offset);
+}
+
+int64_t sys_pwrite(int fd, const pio_args_t* args) {
+    if (!args || !args->buf || args->count == 0) return SYSCALL_EINVAL;
+    if (args->offset > 0x7FFFFFFFULL) return SYSCALL_EINVAL;
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+    int vfd = proc_fds[slot][fd].vfs_fd;
+    if (vfd & (PIPE_FD_FLAG | EPOLL_FD_FLAG | SOCKET_FD_FLAG)) return SYSCALL_ESPIPE;
+    return vfs_pwrite(vfd, args->buf, (uint32_t)args->count, (uint32_t)args->offset);
+}
+
 int64_t sys_lseek(int fd, int64_t offset, int whence) {
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
     int vfd = proc_fds[slot][fd].vfs_fd;
-    if (vfd & PIPE_FD_FLAG) return SYSCALL_ESPIPE;
+    if (vfd & (PIPE_FD_FLAG | EPOLL_FD_FLAG | SOCKET_FD_FLAG)) return SYSCALL_ESPIPE;
     if (vfs_seek(vfd, (int32_t)offset, whence) < 0) return SYSCALL_EINVAL;
     return vfs_tell(vfd);
 }
 
 static void fill_stat(stat_t* buf, const char* path) {
     vfs_dirent_t ent;
-    sys_memset(buf, 0, sizeof(stat_t));
+    memset(buf, 0, sizeof(stat_t));
     if (vfs_stat(path, &ent) == 0) {
         buf->st_size = ent.size;
         buf->st_mtime = ent.modified;
@@ -316,17 +519,17 @@ int sys_stat(const char* path, stat_t* buf) {
 
 int sys_fstat(int fd, stat_t* buf) {
     if (!buf) return SYSCALL_EINVAL;
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
     int vfd = proc_fds[slot][fd].vfs_fd;
     if (vfd & PIPE_FD_FLAG) {
-        sys_memset(buf, 0, sizeof(stat_t));
+        memset(buf, 0, sizeof(stat_t));
         buf->st_mode = S_IFIFO | 0600;
         buf->st_blksize = 4096;
         return SYSCALL_OK;
     }
-    sys_memset(buf, 0, sizeof(stat_t));
+    memset(buf, 0, sizeof(stat_t));
     buf->st_mode = S_IFREG | 0644;
     buf->st_blksize = 4096;
     return SYSCALL_OK;
@@ -335,7 +538,7 @@ int sys_fstat(int fd, stat_t* buf) {
 // ============ FD Manipulation ============
 
 int sys_dup(int oldfd) {
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     if (oldfd < 0 || oldfd >= PROC_MAX_FDS || !proc_fds[slot][oldfd].in_use) return SYSCALL_EBADF;
     int newfd = alloc_proc_fd(slot);
@@ -345,7 +548,7 @@ int sys_dup(int oldfd) {
 }
 
 int sys_dup2(int oldfd, int newfd) {
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     if (oldfd < 0 || oldfd >= PROC_MAX_FDS || !proc_fds[slot][oldfd].in_use) return SYSCALL_EBADF;
     if (newfd < 0 || newfd >= PROC_MAX_FDS) return SYSCALL_EINVAL;
@@ -357,7 +560,7 @@ int sys_dup2(int oldfd, int newfd) {
 
 int sys_pipe(int pipefd[2]) {
     if (!pipefd) return SYSCALL_EINVAL;
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     int rfd = alloc_proc_fd(slot);
     if (rfd < 0) return SYSCALL_EMFILE;
@@ -422,21 +625,49 @@ int sys_readdir(int fd, sys_dirent_t* entry) {
 
 uint64_t sys_mmap(mmap_args_t* args) {
     if (!args || args->length == 0) return (uint64_t)SYSCALL_EINVAL;
-    if (!(args->flags & MMAP_MAP_ANON)) return (uint64_t)SYSCALL_ENOSYS;
     uint64_t size = (args->length + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
     uint64_t addr = args->addr;
+    int pid = cur_pid();
+
+    // File mappings: validate the fd before touching the address space
+    vfs_node_t* node = (vfs_node_t*)0;
+    int shared = (args->flags & MMAP_MAP_SHARED) != 0;
+    if (!(args->flags & MMAP_MAP_ANON)) {
+        if (args->offset & (VMM_PAGE_SIZE - 1)) return (uint64_t)SYSCALL_EINVAL;
+        int slot = cur_slot();
+        if (slot < 0) return (uint64_t)SYSCALL_ERROR;
+        int fd = args->fd;
+        if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return (uint64_t)SYSCALL_EBADF;
+        int vfd = proc_fds[slot][fd].vfs_fd;
+        if (vfd & (PIPE_FD_FLAG | EPOLL_FD_FLAG | SOCKET_FD_FLAG)) return (uint64_t)SYSCALL_ENODEV;
+        node = vfs_fd_node(vfd);
+        if (!node || node->type != VFS_FILE) return (uint64_t)SYSCALL_ENODEV;
+        // Writing through a shared mapping needs a writable fd
+        if (shared && (args->prot & MMAP_PROT_WRITE) && !(proc_fds[slot][fd].flags & 0x03)) {
+            return (uint64_t)SYSCALL_EACCES;
+        }
+    }
     if (!addr || !(args->flags & MMAP_MAP_FIXED)) {
-        static uint64_t mmap_next = 0x10000000;
+        static uint64_t mmap_next = USER_MMAP_BASE;
         addr = mmap_next;
         mmap_next += size;
-        if (mmap_next >= 0x40000000) return (uint64_t)SYSCALL_ENOMEM;
+        if (mmap_next >= USER_MMAP_END) return (uint64_t)SYSCALL_ENOMEM;
+    } else {
+        // MAP_FIXED replaces whatever was reserved there before
+        vmm_vma_release(pid, vmm_get_current_address_space(), addr, size);
     }
     uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_USER;
     if (args->prot & MMAP_PROT_WRITE) flags |= VMM_FLAG_WRITABLE;
     if (!(args->prot & MMAP_PROT_EXEC)) flags |= VMM_FLAG_NX;
-    pte_t* pml4 = vmm_get_current_address_space();
-    if (vmm_alloc_pages(pml4, addr, size, flags) < 0) return (uint64_t)SYSCALL_ENOMEM;
-    sys_memset((void*)addr, 0, size);
+    if (node) {
+        // Pages come from the file on first touch
+        if (shared) flags |= VMM_FLAG_SHARED;
+        if (vmm_vma_reserve_file(pid, addr, size, flags, vfs_get_pager(), node,
+                                 args->offset / VMM_PAGE_SIZE) < 0) return (uint64_t)SYSCALL_ENOMEM;
+        return addr;
+    }
+    // Reserve only; pages are zero-filled by the fault handler on first touch
+    if (vmm_vma_reserve(pid, addr, size, flags, VMM_VMA_ANON) < 0) return (uint64_t)SYSCALL_ENOMEM;
     return addr;
 }
 
@@ -445,26 +676,25 @@ int sys_munmap(uint64_t addr, uint64_t length) {
     if (addr & (VMM_PAGE_SIZE - 1)) return SYSCALL_EINVAL;
     uint64_t size = (length + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
     pte_t* pml4 = vmm_get_current_address_space();
-    for (uint64_t off = 0; off < size; off += VMM_PAGE_SIZE) {
-        vmm_unmap_page(pml4, addr + off);
-        vmm_invlpg(addr + off);
-    }
+    vmm_vma_release(cur_pid(), pml4, addr, size);
+    vmm_unmap_range(pml4, addr, size);
     return SYSCALL_OK;
 }
 
 uint64_t sys_brk(uint64_t addr) {
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return 0;
     uint64_t current_brk = proc_brk[slot];
     if (addr == 0) return current_brk;
     uint64_t new_brk = (addr + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
     uint64_t old_brk_a = (current_brk + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
     if (new_brk > old_brk_a) {
-        pte_t* pml4 = vmm_get_current_address_space();
         uint64_t fl = VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER;
-        for (uint64_t pg = old_brk_a; pg < new_brk; pg += VMM_PAGE_SIZE) {
-            if (vmm_alloc_pages(pml4, pg, VMM_PAGE_SIZE, fl) < 0) return current_brk;
-        }
+        if (vmm_vma_reserve(cur_pid(), old_brk_a, new_brk - old_brk_a,
+                            fl, VMM_VMA_HEAP) < 0) return current_brk;
+    } else if (new_brk < old_brk_a) {
+        vmm_vma_release(cur_pid(), vmm_get_current_address_space(),
+                        new_brk, old_brk_a - new_brk);
     }
     proc_brk[slot] = addr;
     return addr;
@@ -478,7 +708,7 @@ int sys_ioctl(int fd, uint64_t request, uint64_t arg) {
 }
 
 int sys_fcntl(int fd, int cmd, uint64_t arg) {
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
     switch (cmd) {
@@ -487,14 +717,66 @@ int sys_fcntl(int fd, int cmd, uint64_t arg) {
         case F_SETFD:  return SYSCALL_OK;
         case F_GETFL:  return proc_fds[slot][fd].flags;
         case F_SETFL:  proc_fds[slot][fd].flags = (int)arg; return SYSCALL_OK;
+        case F_SETPIPE_SZ:
+        case F_GETPIPE_SZ: {
+            int vfd = proc_fds[slot][fd].vfs_fd;
+            if (!(vfd & PIPE_FD_FLAG)) return SYSCALL_EBADF;
+            if (cmd == F_GETPIPE_SZ) return pipe_get_size(vfd & ~PIPE_FD_FLAG);
+            if (arg > PIPE_MAX_SIZE) return SYSCALL_EPERM;
+            int r = pipe_set_size(vfd & ~PIPE_FD_FLAG, (int)arg);
+            if (r == -2) return SYSCALL_EBUSY;
+            return r < 0 ? SYSCALL_EINVAL : r;
+        }
         default:       return SYSCALL_EINVAL;
     }
 }
 
+// ---- Readiness of a process fd (shared by poll and epoll) ----
+
+// epoll poll-function arguments: kind in the high word, object below
+#define FD_POLL_PIPE    (1ULL << 32)   // (pipe index << 1) | end
+#define FD_POLL_DEV     (2ULL << 32)   // devfs device index
+#define FD_POLL_SOCK    (3ULL << 32)   // socket index
+
+static uint32_t fd_poll_source(uint64_t arg) {
+    uint32_t obj = (uint32_t)arg;
+    if ((arg & ~0xFFFFFFFFULL) == FD_POLL_PIPE) return pipe_poll((int)(obj >> 1), (int)(obj & 1));
+    if ((arg & ~0xFFFFFFFFULL) == FD_POLL_DEV) return devfs_poll_events((int)obj);
+    if ((arg & ~0xFFFFFFFFULL) == FD_POLL_SOCK) return socket_poll_events((int)obj);
+    return EPOLLIN | EPOLLOUT;
+}
+
+// Find the event source behind a fd. Returns 0 and fills src/arg, or -1
+// for fds that are always ready (regular files) or cannot be watched
+static int fd_poll_lookup(int slot, int fd, pollsrc_t** src, uint64_t* arg) {
+    int vfd = proc_fds[slot][fd].vfs_fd;
+    if (vfd & PIPE_FD_FLAG) {
+        int pidx = vfd & ~PIPE_FD_FLAG;
+        *src = pipe_get_pollsrc(pidx);
+        *arg = FD_POLL_PIPE | ((uint64_t)pidx << 1) | (uint64_t)(proc_fds[slot][fd].flags & 0x01);
+        return *src ? 0 : -1;
+    }
+    if (vfd & (EPOLL_FD_FLAG | URING_FD_FLAG)) return -1;
+    if (vfd & SOCKET_FD_FLAG) {
+        int sock = vfd & ~SOCKET_FD_FLAG;
+        *src = socket_get_pollsrc(sock);
+        *arg = FD_POLL_SOCK | (uint64_t)(uint32_t)sock;
+        return *src ? 0 : -1;
+    }
+    vfs_node_t* node = vfs_fd_node(vfd);
+    if (node && node->type == VFS_DEVICE) {
+        int dev = devfs_find(node->name);
+        *src = devfs_get_pollsrc(dev);
+        *arg = FD_POLL_DEV | (uint64_t)(uint32_t)dev;
+        return *src ? 0 : -1;
+    }
+    return -1;
+}
+
 int sys_poll(pollfd_t* fds, int nfds, int timeout) {
     (void)timeout;
     if (!fds || nfds <= 0) return SYSCALL_EINVAL;
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return SYSCALL_ERROR;
     int ready = 0;
     for (int i = 0; i < nfds; i++) {
@@ -504,46 +786,399 @@ int sys_poll(pollfd_t* fds, int nfds, int timeout) {
             fds[i].revents = POLLNVAL; continue;
         }
         int vfd = proc_fds[slot][pfd].vfs_fd;
-        if (vfd & PIPE_FD_FLAG) {
-            int avail = pipe_available(vfd & ~PIPE_FD_FLAG);
-            if ((fds[i].events & POLLIN) && avail > 0) fds[i].revents |= POLLIN;
-            if (fds[i].events & POLLOUT) fds[i].revents |= POLLOUT;
-        } else {
-            if (fds[i].events & POLLIN)  fds[i].revents |= POLLIN;
-            if (fds[i].events & POLLOUT) fds[i].revents |= POLLOUT;
-        }
+        pollsrc_t* src;
+        uint64_t arg;
+        uint32_t ev;
+        if (vfd & EPOLL_FD_FLAG) ev = epoll_has_ready(vfd & ~EPOLL_FD_FLAG) ? POLLIN : 0;
+        else if (fd_poll_lookup(slot, pfd, &src, &arg) == 0) ev = fd_poll_source(arg);
+        else ev = POLLIN | POLLOUT;
+        fds[i].revents = (short)(ev & ((uint32_t)fds[i].events | POLLERR | POLLHUP));
         if (fds[i].revents) ready++;
     }
     return ready;
 }
 
+// ============ Readiness Notification ============
+
+int sys_epoll_create(int flags) {
+    (void)flags;
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    int fd = alloc_proc_fd(slot);
+    if (fd < 0) return SYSCALL_EMFILE;
+    int ep = epoll_create();
+    if (ep < 0) return SYSCALL_ENOMEM;
+    proc_fds[slot][fd].vfs_fd = ep | EPOLL_FD_FLAG;
+    proc_fds[slot][fd].flags = 0;
+    proc_fds[slot][fd].in_use = 1;
+    return fd;
+}
+
+// Instance behind an epoll fd of the calling process, or -1
+static int epoll_from_fd(int slot, int epfd) {
+    if (epfd < 0 || epfd >= PROC_MAX_FDS || !proc_fds[slot][epfd].in_use) return -1;
+    int vfd = proc_fds[slot][epfd].vfs_fd;
+    if (!(vfd & EPOLL_FD_FLAG)) return -1;
+    return vfd & ~EPOLL_FD_FLAG;
+}
+
+int sys_epoll_ctl(int epfd, int op, const epoll_ctl_args_t* args) {
+    if (!args) return SYSCALL_EFAULT;
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    int ep = epoll_from_fd(slot, epfd);
+    if (ep < 0) return SYSCALL_EBADF;
+    int fd = args->fd;
+    if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+
+    switch (op) {
+        case EPOLL_CTL_ADD: {
+            pollsrc_t* src;
+            uint64_t arg;
+            // Regular files are always ready: there is nothing to wait for
+            if (fd_poll_lookup(slot, fd, &src, &arg) < 0) return SYSCALL_EPERM;
+            int r = epoll_add(ep, fd, &args->event, src, fd_poll_source, arg);
+            if (r == -2) return SYSCALL_EEXIST;
+            return r < 0 ? SYSCALL_ENOSPC : SYSCALL_OK;
+        }
+        case EPOLL_CTL_MOD:
+            return epoll_mod(ep, fd, &args->event) < 0 ? SYSCALL_ENOENT : SYSCALL_OK;
+        case EPOLL_CTL_DEL:
+            return epoll_del(ep, fd) < 0 ? SYSCALL_ENOENT : SYSCALL_OK;
+        default:
+            return SYSCALL_EINVAL;
+    }
+}
+
+int sys_epoll_wait(int epfd, epoll_wait_args_t* args) {
+    if (!args || !args->events || args->maxevents <= 0) return SYSCALL_EINVAL;
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    int ep = epoll_from_fd(slot, epfd);
+    if (ep < 0) return SYSCALL_EBADF;
+    int n = epoll_wait(ep, args->events, args->maxevents, args->timeout);
+    return n < 0 ? SYSCALL_EBADF : n;
+}
+
+// ============ Sockets ============
+
+// Socket behind a fd of the calling process, or SYSCALL_EBADF/ENOTSOCK
+static int sock_from_fd(int fd) {
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+    int vfd = proc_fds[slot][fd].vfs_fd;
+    if (!(vfd & SOCKET_FD_FLAG)) return SYSCALL_ENOTSOCK;
+    return vfd & ~SOCKET_FD_FLAG;
+}
+
+// Give a socket a process fd (closes the socket if the table is full)
+static int sock_install(int slot, int sock) {
+    int fd = slot < 0 ? -1 : alloc_proc_fd(slot);
+    if (fd < 0) {
+        socket_close(sock);
+        return SYSCALL_EMFILE;
+    }
+    proc_fds[slot][fd].vfs_fd = sock | SOCKET_FD_FLAG;
+    proc_fds[slot][fd].flags = 0x02;   // Read/write
+    proc_fds[slot][fd].in_use = 1;
+    return fd;
+}
+
+int sys_socket(int family, int type, int protocol) {
+    int sock = socket_create(family, type, protocol);
+    if (sock < 0) return sock_result(sock);
+    return sock_install(cur_slot(), sock);
+}
+
+int sys_bind(int fd, const sockaddr_in_t* addr) {
+    if (!addr) return SYSCALL_EFAULT;
+    int sock = sock_from_fd(fd);
+    if (sock < 0) return sock;
+    return sock_result(socket_bind(sock, addr));
+}
+
+int sys_listen(int fd, int backlog) {
+    int sock = sock_from_fd(fd);
+    if (sock < 0) return sock;
+    return sock_result(socket_listen(sock, backlog));
+}
+
+int sys_accept(int fd, sockaddr_in_t* addr) {
+    int sock = sock_from_fd(fd);
+    if (sock < 0) return sock;
+    int conn = socket_accept(sock, addr);
+    if (conn < 0) return sock_result(conn);
+    return sock_install(cur_slot(), conn);
+}
+
+int sys_connect(int fd, const sockaddr_in_t* addr) {
+    if (!addr) return SYSCALL_EFAULT;
+    int sock = sock_from_fd(fd);
+    if (sock < 0) return sock;
+    return sock_result(socket_connect(sock, addr));
+}
+
+int sys_sendmmsg(int fd, sock_mmsg_t* msgs, int count) {
+    if (!msgs) return SYSCALL_EFAULT;
+    if (count <= 0 || count > SYSCALL_MMSG_MAX) return SYSCALL_EINVAL;
+    int sock = sock_from_fd(fd);
+    if (sock < 0) return sock;
+    return sock_result(socket_sendmmsg(sock, msgs, count));
+}
+
+int sys_recvmmsg(int fd, sock_mmsg_t* msgs, int count) {
+    if (!msgs) return SYSCALL_EFAULT;
+    if (count <= 0 || count > SYSCALL_MMSG_MAX) return SYSCALL_EINVAL;
+    int sock = sock_from_fd(fd);
+    if (sock < 0) return sock;
+    return sock_result(socket_recvmmsg(sock, msgs, count, 0));
+}
+
+// ============ Dynamic Linking ============
+
+// 0 sends the stub to address 0, which faults the process
+uint64_t sys_dl_resolve(uint64_t obj, uint64_t index) {
+    return dl_resolve((int)obj, index);
+}
+
+uint64_t sys_pe_resolve(uint64_t mod, uint64_t index) {
+    return pe_resolve((int)mod, index);
+}
+
+// ============ Zero-copy Transfer ============
+
+// Move up to count bytes from in_fd (file or pipe) to out_fd (socket, pipe
+// or file). The source is read in place: file contents and pipe ring
+// bytes are handed to the destination directly, and a socket queues them
+// for DMA without copying. Pipe bytes are only consumed once written.
+static int64_t fd_transfer(int out_fd, int in_fd, uint64_t count) {
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (in_fd < 0 || in_fd >= PROC_MAX_FDS || !proc_fds[slot][in_fd].in_use) return SYSCALL_EBADF;
+    if (out_fd < 0 || out_fd >= PROC_MAX_FDS || !proc_fds[slot][out_fd].in_use) return SYSCALL_EBADF;
+    int in = proc_fds[slot][in_fd].vfs_fd;
+    int out = proc_fds[slot][out_fd].vfs_fd;
+    if ((in & (EPOLL_FD_FLAG | SOCKET_FD_FLAG | URING_FD_FLAG)) ||
+        (out & (EPOLL_FD_FLAG | URING_FD_FLAG))) return SYSCALL_EINVAL;
+    if (in == out) return SYSCALL_EINVAL;
+    if ((in & PIPE_FD_FLAG) && (proc_fds[slot][in_fd].flags & 0x01)) return SYSCALL_EBADF;
+
+    int64_t done = 0;
+    while ((uint64_t)done < count) {
+        const uint8_t* src;
+        int avail;
+        if (in & PIPE_FD_FLAG) avail = pipe_peek(in & ~PIPE_FD_FLAG, &src, done == 0);
+        else avail = vfs_peek(in, &src);
+        if (avail <= 0) break;   // EOF, empty pipe after a partial transfer, or error
+        if ((uint64_t)avail > count - (uint64_t)done) avail = (int)(count - (uint64_t)done);
+
+        int n;
+        if (out & SOCKET_FD_FLAG) {
+            n = sock_result(socket_send_zerocopy(out & ~SOCKET_FD_FLAG, src, (uint32_t)avail));
+        } else if (out & PIPE_FD_FLAG) {
+            n = pipe_write(out & ~PIPE_FD_FLAG, src, avail);
+            if (n < 0) n = SYSCALL_EPIPE;
+        } else {
+            n = vfs_write(out, src, (uint32_t)avail);
+            if (n < 0) n = SYSCALL_ERROR;
+        }
+        if (n <= 0) {
+            if (done == 0) done = n;
+            break;
+        }
+
+        if (in & PIPE_FD_FLAG) pipe_consume(in & ~PIPE_FD_FLAG, n);
+        else vfs_seek(in, n, VFS_SEEK_CUR);
+        done += n;
+        if (n < avail) break;
+    }
+    return done;
+}
+
+int64_t sys_sendfile(int out_fd, int in_fd, uint64_t count) {
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (in_fd < 0 || in_fd >= PROC_MAX_FDS || !proc_fds[slot][in_fd].in_use) return SYSCALL_EBADF;
+    if (proc_fds[slot][in_fd].vfs_fd & PIPE_FD_FLAG) return SYSCALL_EINVAL;   // Source must be a file
+    return fd_transfer(out_fd, in_fd, count);
+}
+
+int64_t sys_splice(int in_fd, int out_fd, uint64_t count) {
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (in_fd < 0 || in_fd >= PROC_MAX_FDS || !proc_fds[slot][in_fd].in_use) return SYSCALL_EBADF;
+    if (out_fd < 0 || out_fd >= PROC_MAX_FDS || !proc_fds[slot][out_fd].in_use) return SYSCALL_EBADF;
+    // One end must be a pipe
+    if (!((proc_fds[slot][in_fd].vfs_fd | proc_fds[slot][out_fd].vfs_fd) & PIPE_FD_FLAG)) return SYSCALL_EINVAL;
+    return fd_transfer(out_fd, in_fd, count);
+}
+
+// ============ Submission Rings ============
+
+int sys_uring_setup(uring_params_t* params) {
+    if (!params) return SYSCALL_EINVAL;
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    int fd = alloc_proc_fd(slot);
+    if (fd < 0) return SYSCALL_EMFILE;
+    process_t* p = cur_proc();
+    pte_t* pml4 = p->page_table ? (pte_t*)p->page_table : vmm_get_current_address_space();
+    int ring = uring_create(cur_pid(), slot, pml4, params);
+    if (ring < 0) return SYSCALL_ENOMEM;
+    proc_fds[slot][fd].vfs_fd = ring | URING_FD_FLAG;
+    proc_fds[slot][fd].flags = 0;
+    proc_fds[slot][fd].in_use = 1;
+    return fd;
+}
+
+int sys_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete) {
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+    int vfd = proc_fds[slot][fd].vfs_fd;
+    if (!(vfd & URING_FD_FLAG)) return SYSCALL_EINVAL;
+    int n = uring_enter(vfd & ~URING_FD_FLAG, cur_pid(), to_submit, min_complete);
+    return n < 0 ? SYSCALL_EBADF : n;   // A ring inherited through fork
+}
+
+// SYS_FUTEX(addr, op, arg): see futex.h
+int sys_futex(uint32_t* addr, int op, uint64_t arg) {
+    int slot = cur_slot();
+    if (slot < 0) return SYSCALL_ERROR;
+    uint64_t a = (uint64_t)addr;
+    switch (op) {
+        case FUTEX_WAIT:
+            return futex_wait(slot, a, (uint32_t)arg, 0);
+        case FUTEX_WAKE:
+            return futex_wake(slot, a, (uint32_t)arg);
+        case FUTEX_WAIT_TIMEOUT: {
+            const futex_wait_t* w = (const futex_wait_t*)arg;
+            if (!w) return SYSCALL_EFAULT;
+            return futex_wait(slot, a, w->expected, w->timeout_ns);
+        }
+        case FUTEX_REQUEUE: {
+            const futex_requeue_t* r = (const futex_requeue_t*)arg;
+            if (!r) return SYSCALL_EFAULT;
+            return futex_requeue(slot, a, r->wake, (uint64_t)r->addr2, r->requeue,
+                                 r->cmp, r->expected);
+        }
+        default:
+            return SYSCALL_EINVAL;
+    }
+}
+
+// One ring operation for the process in table slot 'slot'. Pipes, sockets
+// and devices are only touched once their event source reports them ready,
+// so nothing here sleeps unless may_sleep is set (files and fsync, run
+// from the uring thread). Data moves through a kernel bounce buffer since
+// the worker is not in the owner's address space.
+static int64_t uring_exec_op(uring_op_t* op, int slot, int may_sleep) {
+    const uring_sqe_t* sqe = &op->sqe;
+    int code = sqe->opcode;
+    if (code == URING_OP_NOP) return SYSCALL_OK;
+    if (code > URING_OP_FSYNC) return SYSCALL_EINVAL;
+    if (code == URING_OP_FSYNC) {
+        if (!may_sleep) return URING_DEFER;
+        blkdev_flush_all();
+        return SYSCALL_OK;
+    }
+
+    // First run: resolve the fd (later runs keep the object it named)
+    if (op->handle < 0) {
+        int fd = sqe->fd;
+        if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return SYSCALL_EBADF;
+        op->handle = proc_fds[slot][fd].vfs_fd;
+        if (op->handle & (EPOLL_FD_FLAG | URING_FD_FLAG)) return SYSCALL_EINVAL;
+        if ((op->handle & PIPE_FD_FLAG) && (code == URING_OP_READ || code == URING_OP_WRITE) &&
+            ((code == URING_OP_READ) == ((proc_fds[slot][fd].flags & 0x01) != 0))) return SYSCALL_EBADF;
+        if (fd_poll_lookup(slot, fd, &op->src, &op->poll_arg) == 0) op->poll_fn = fd_poll_source;
+        else op->src = 0;
+    }
+    int h = op->handle;
+    int sock = (h & SOCKET_FD_FLAG) ? h & ~SOCKET_FD_FLAG : -1;
+    if ((code == URING_OP_SEND || code == URING_OP_RECV || code == URING_OP_ACCEPT) && sock < 0)
+        return SYSCALL_ENOTSOCK;
+    int in = code == URING_OP_READ || code == URING_OP_RECV || code == URING_OP_ACCEPT;
+
+    // Not ready yet: wait on the event source
+    if (op->src) {
+        uint32_t want = in ? EPOLLIN : EPOLLOUT;
+        if (!(op->poll_fn(op->poll_arg) & (want | EPOLLERR | EPOLLHUP))) {
+            op->events = want;
+            return URING_WAIT;
+        }
+    } else if (!may_sleep) {
+        return URING_DEFER;     // Regular file: may sleep in the block layer
+    }
+
+    if (code == URING_OP_ACCEPT) {
+        int conn = socket_accept(sock, (sockaddr_in_t*)0);
+        if (conn < 0) return sock_result(conn);
+        return sock_install(slot, conn);
+    }
+
+    uint32_t len = sqe->len < URING_MAX_IO ? sqe->len : URING_MAX_IO;
+    if (len == 0) return 0;
+    if (!in && (h & PIPE_FD_FLAG)) {
+        int pidx = h & ~PIPE_FD_FLAG;
+        int space = pipe_get_size(pidx) - pipe_available(pidx);
+        if (space > 0 && (uint32_t)space < len) len = (uint32_t)space;   // Never block on a full ring
+    }
+    uint8_t* buf = (uint8_t*)kmalloc(len);
+    if (!buf) return SYSCALL_ENOMEM;
+
+    int64_t n;
+    if (in) {
+        if (sock >= 0) n = sock_result(socket_recv(sock, buf, len, MSG_DONTWAIT));
+        else if (h & PIPE_FD_FLAG) n = pipe_read(h & ~PIPE_FD_FLAG, buf, (int)len);
+        else if (op->src) n = vfs_read(h, buf, len);
+        else n = vfs_pread(h, buf, len, (uint32_t)sqe->off);
+        if (n > 0 && uring_copy_out(op, sqe->addr, buf, (uint32_t)n) < 0) n = SYSCALL_EFAULT;
+    } else if (uring_copy_in(op, buf, sqe->addr, len) < 0) {
+        n = SYSCALL_EFAULT;
+    } else {
+        if (sock >= 0) n = sock_result(socket_send(sock, buf, len, MSG_DONTWAIT));
+        else if (h & PIPE_FD_FLAG) n = pipe_write(h & ~PIPE_FD_FLAG, buf, (int)len);
+        else if (op->src) n = vfs_write(h, buf, len);
+        else n = vfs_pwrite(h, buf, len, (uint32_t)sqe->off);
+        if ((h & PIPE_FD_FLAG) && n < 0) n = SYSCALL_EPIPE;
+    }
+    kfree(buf);
+    if (n == SYSCALL_EAGAIN && op->src) {
+        op->events = in ? EPOLLIN : EPOLLOUT;
+        return URING_WAIT;
+    }
+    return n;
+}
+
 // ============ Signals ============
 
 int sys_sigaction(int sig, const sigaction_t* act, sigaction_t* oldact) {
     if (sig < 1 || sig >= NSIG || sig == SIGKILL || sig == SIGSTOP) return SYSCALL_EINVAL;
-    return signal_sigaction(process_get_pid(), sig, act, oldact);
+    return signal_sigaction(cur_pid(), sig, act, oldact);
 }
 
-int sys_sigreturn(void) { return signal_return(process_get_pid()); }
+int sys_sigreturn(void) { return signal_return(cur_pid()); }
 
 int sys_sigprocmask(int how, const uint64_t* set, uint64_t* oldset) {
-    return signal_procmask(process_get_pid(), how, set, oldset);
+    return signal_procmask(cur_pid(), how, set, oldset);
 }
 
 // ============ Shared Memory ============
 
 int sys_shmget(uint64_t key, uint64_t size, int flags) { return shm_get(key, size, flags); }
 uint64_t sys_shmat(int shmid, uint64_t addr, int flags) {
-    (void)flags; return shm_attach(shmid, process_get_pid(), addr);
+    (void)flags; return shm_attach(shmid, cur_pid(), addr);
 }
-int sys_shmdt(uint64_t addr) { return shm_detach(process_get_pid(), addr); }
+int sys_shmdt(uint64_t addr) { return shm_detach(cur_pid(), addr); }
 
 // ============ Misc ============
 
 int sys_getuid(void) { return 0; }
 int sys_getgid(void) { return 0; }
 int sys_isatty(int fd) {
-    int slot = proc_slot_for_pid(process_get_pid());
+    int slot = cur_slot();
     if (slot < 0) return 0;
     if (fd < 0 || fd >= PROC_MAX_FDS || !proc_fds[slot][fd].in_use) return 0;
     return (fd <= 2) ? 1 : 0;
@@ -552,54 +1187,196 @@ uint64_t sys_clock(void) { scheduler_stats_t st = scheduler_get_stats(); return
 
 // ============ Dispatcher ============
 
-int64_t syscall_dispatch(uint64_t num, uint64_t a1, uint64_t a2, uint64_t a3) {
-    switch (num) {
-        case SYS_EXIT:       return (int64_t)sys_exit((int)a1);
-        case SYS_GETPID:     return (int64_t)sys_getpid();
-        case SYS_YIELD:      return (int64_t)sys_yield();
-        case SYS_SLEEP:      return (int64_t)sys_sleep(a1);
-        case SYS_FORK:       return (int64_t)sys_fork();
-        case SYS_WAIT:       return (int64_t)sys_wait((int)a1);
-        case SYS_EXECVE:     return (int64_t)sys_execve((const char*)a1, (const char**)a2, (const char**)a3);
-        case SYS_KILL:       return (int64_t)sys_kill((int)a1, (int)a2);
-        case SYS_GETPPID:    return (int64_t)sys_getppid();
-        case SYS_UPTIME:     return (int64_t)sys_uptime();
-        case SYS_GETPRIO:    return (int64_t)sys_getprio((int)a1);
-        case SYS_SETPRIO:    return (int64_t)sys_setprio((int)a1, (int)a2);
-        case SYS_PROCINFO:   return (int64_t)sys_procinfo((int)a1, (procinfo_t*)a2);
-        case SYS_MEMINFO:    return (int64_t)sys_meminfo((meminfo_t*)a1);
-        case SYS_WRITE:      return sys_write((int)a1, (const void*)a2, a3);
-        case SYS_READ:       return sys_read((int)a1, (void*)a2, a3);
-        case SYS_OPEN:       return (int64_t)sys_open((const char*)a1, (int)a2);
-        case SYS_CLOSE:      return (int64_t)sys_close((int)a1);
-        case SYS_LSEEK:      return sys_lseek((int)a1, (int64_t)a2, (int)a3);
-        case SYS_STAT:       return (int64_t)sys_stat((const char*)a1, (stat_t*)a2);
-        case SYS_FSTAT:      return (int64_t)sys_fstat((int)a1, (stat_t*)a2);
-        case SYS_DUP:        return (int64_t)sys_dup((int)a1);
-        case SYS_DUP2:       return (int64_t)sys_dup2((int)a1, (int)a2);
-        case SYS_PIPE:       return (int64_t)sys_pipe((int*)a1);
-        case SYS_GETCWD:     return (int64_t)sys_getcwd((char*)a1, a2);
-        case SYS_CHDIR:      return (int64_t)sys_chdir((const char*)a1);
-        case SYS_MKDIR:      return (int64_t)sys_mkdir((const char*)a1, (uint32_t)a2);
-        case SYS_RMDIR:      return (int64_t)sys_rmdir((const char*)a1);
-        case SYS_UNLINK:     return (int64_t)sys_unlink((const char*)a1);
-        case SYS_READDIR:    return (int64_t)sys_readdir((int)a1, (sys_dirent_t*)a2);
-        case SYS_MMAP:       return (int64_t)sys_mmap((mmap_args_t*)a1);
-        case SYS_MUNMAP:     return (int64_t)sys_munmap(a1, a2);
-        case SYS_BRK:        return (int64_t)sys_brk(a1);
-        case SYS_IOCTL:      return (int64_t)sys_ioctl((int)a1, a2, a3);
-        case SYS_FCNTL:      return (int64_t)sys_fcntl((int)a1, (int)a2, a3);
-        case SYS_POLL:       return (int64_t)sys_poll((pollfd_t*)a1, (int)a2, (int)a3);
-        case SYS_SIGACTION:  return (int64_t)sys_sigaction((int)a1, (const sigaction_t*)a2, (sigaction_t*)a3);
-        case SYS_SIGRETURN:  return (int64_t)sys_sigreturn();
-        case SYS_SIGPROCMASK:return (int64_t)sys_sigprocmask((int)a1, (const uint64_t*)a2, (uint64_t*)a3);
-        case SYS_SHMGET:     return (int64_t)sys_shmget(a1, a2, (int)a3);
-        case SYS_SHMAT:      return (int64_t)sys_shmat((int)a1, a2, (int)a3);
-        case SYS_SHMDT:      return (int64_t)sys_shmdt(a1);
-        case SYS_GETUID:     return (int64_t)sys_getuid();
-        case SYS_GETGID:     return (int64_t)sys_getgid();
-        case SYS_ISATTY:     return (int64_t)sys_isatty((int)a1);
-        case SYS_CLOCK:      return (int64_t)sys_clock();
-        default:             return (int64_t)SYSCALL_ENOSYS;
+// Each entry adapts one handler to the common signature; the casts are the
+// ones the handler's argument types need
+typedef int64_t (*syscall_fn_t)(uint64_t a1, uint64_t a2, uint64_t a3);
+
+// Charge bytes moved by a read- or write-type call to the caller
+static int64_t acct_io(int64_t n, int read, int write) {
+    process_t* p = process_get_current();
+    if (n > 0 && p) {
+        if (read) p->acct.read_bytes += (uint64_t)n;
+        if (write) p->acct.write_bytes += (uint64_t)n;
     }
+    return n;
+}
+
+// Same for a batch of datagrams: n of them went through
+static int64_t acct_mmsg(int64_t n, const sock_mmsg_t* msgs, int write) {
+    uint64_t bytes = 0;
+    for (int64_t i = 0; i < n; i++) bytes += msgs[i].done;
+    acct_io((int64_t)bytes, !write, write);
+    return n;
+}
+
+#define SYSCALL_FN(name, call) \
+    static int64_t sc_##name(uint64_t a1, uint64_t a2, uint64_t a3) { \
+        (void)a1; (void)a2; (void)a3; return call; }
+
+SYSCALL_FN(exit, (int64_t)sys_exit((int)a1))
+SYSCALL_FN(getpid, (int64_t)sys_getpid())
+SYSCALL_FN(yield, (int64_t)sys_yield())
+SYSCALL_FN(sleep, (int64_t)sys_sleep(a1))
+SYSCALL_FN(fork, (int64_t)sys_fork())
+SYSCALL_FN(wait, (int64_t)sys_wait((int)a1))
+SYSCALL_FN(execve, (int64_t)sys_execve((const char*)a1, (const char**)a2, (const char**)a3))
+SYSCALL_FN(kill, (int64_t)sys_kill((int)a1, (int)a2))
+SYSCALL_FN(getppid, (int64_t)sys_getppid())
+SYSCALL_FN(uptime, (int64_t)sys_uptime())
+SYSCALL_FN(getprio, (int64_t)sys_getprio((int)a1))
+SYSCALL_FN(setprio, (int64_t)sys_setprio((int)a1, (int)a2))
+SYSCALL_FN(procinfo, (int64_t)sys_procinfo((int)a1, (procinfo_t*)a2))
+SYSCALL_FN(meminfo, (int64_t)sys_meminfo((meminfo_t*)a1))
+SYSCALL_FN(write, acct_io(sys_write((int)a1, (const void*)a2, a3), 0, 1))
+SYSCALL_FN(read, acct_io(sys_read((int)a1, (void*)a2, a3), 1, 0))
+SYSCALL_FN(open, (int64_t)sys_open((const char*)a1, (int)a2))
+SYSCALL_FN(close, (int64_t)sys_close((int)a1))
+SYSCALL_FN(lseek, sys_lseek((int)a1, (int64_t)a2, (int)a3))
+SYSCALL_FN(stat, (int64_t)sys_stat((const char*)a1, (stat_t*)a2))
+SYSCALL_FN(fstat, (int64_t)sys_fstat((int)a1, (stat_t*)a2))
+SYSCALL_FN(dup, (int64_t)sys_dup((int)a1))
+SYSCALL_FN(dup2, (int64_t)sys_dup2((int)a1, (int)a2))
+SYSCALL_FN(pipe, (int64_t)sys_pipe((int*)a1))
+SYSCALL_FN(getcwd, (int64_t)sys_getcwd((char*)a1, a2))
+SYSCALL_FN(chdir, (int64_t)sys_chdir((const char*)a1))
+SYSCALL_FN(mkdir, (int64_t)sys_mkdir((const char*)a1, (uint32_t)a2))
+SYSCALL_FN(rmdir, (int64_t)sys_rmdir((const char*)a1))
+SYSCALL_FN(unlink, (int64_t)sys_unlink((const char*)a1))
+SYSCALL_FN(readdir, (int64_t)sys_readdir((int)a1, (sys_dirent_t*)a2))
+SYSCALL_FN(mmap, (int64_t)sys_mmap((mmap_args_t*)a1))
+SYSCALL_FN(munmap, (int64_t)sys_munmap(a1, a2))
+SYSCALL_FN(brk, (int64_t)sys_brk(a1))
+SYSCALL_FN(ioctl, (int64_t)sys_ioctl((int)a1, a2, a3))
+SYSCALL_FN(fcntl, (int64_t)sys_fcntl((int)a1, (int)a2, a3))
+SYSCALL_FN(poll, (int64_t)sys_poll((pollfd_t*)a1, (int)a2, (int)a3))
+SYSCALL_FN(sigaction, (int64_t)sys_sigaction((int)a1, (const sigaction_t*)a2, (sigaction_t*)a3))
+SYSCALL_FN(sigreturn, (int64_t)sys_sigreturn())
+SYSCALL_FN(sigprocmask, (int64_t)sys_sigprocmask((int)a1, (const uint64_t*)a2, (uint64_t*)a3))
+SYSCALL_FN(shmget, (int64_t)sys_shmget(a1, a2, (int)a3))
+SYSCALL_FN(shmat, (int64_t)sys_shmat((int)a1, a2, (int)a3))
+SYSCALL_FN(shmdt, (int64_t)sys_shmdt(a1))
+SYSCALL_FN(getuid, (int64_t)sys_getuid())
+SYSCALL_FN(getgid, (int64_t)sys_getgid())
+SYSCALL_FN(isatty, (int64_t)sys_isatty((int)a1))
+SYSCALL_FN(clock, (int64_t)sys_clock())
+SYSCALL_FN(nanosleep, (int64_t)sys_nanosleep(a1))
+SYSCALL_FN(epoll_create, (int64_t)sys_epoll_create((int)a1))
+SYSCALL_FN(epoll_ctl, (int64_t)sys_epoll_ctl((int)a1, (int)a2, (const epoll_ctl_args_t*)a3))
+SYSCALL_FN(epoll_wait, (int64_t)sys_epoll_wait((int)a1, (epoll_wait_args_t*)a2))
+SYSCALL_FN(socket, (int64_t)sys_socket((int)a1, (int)a2, (int)a3))
+SYSCALL_FN(bind, (int64_t)sys_bind((int)a1, (const sockaddr_in_t*)a2))
+SYSCALL_FN(listen, (int64_t)sys_listen((int)a1, (int)a2))
+SYSCALL_FN(accept, (int64_t)sys_accept((int)a1, (sockaddr_in_t*)a2))
+SYSCALL_FN(connect, (int64_t)sys_connect((int)a1, (const sockaddr_in_t*)a2))
+SYSCALL_FN(sendfile, acct_io(sys_sendfile((int)a1, (int)a2, a3), 1, 1))
+SYSCALL_FN(splice, acct_io(sys_splice((int)a1, (int)a2, a3), 1, 1))
+SYSCALL_FN(readv, acct_io(sys_readv((int)a1, (const iovec_t*)a2, (int)a3), 1, 0))
+SYSCALL_FN(writev, acct_io(sys_writev((int)a1, (const iovec_t*)a2, (int)a3), 0, 1))
+SYSCALL_FN(pread, acct_io(sys_pread((int)a1, (const pio_args_t*)a2), 1, 0))
+SYSCALL_FN(pwrite, acct_io(sys_pwrite((int)a1, (const pio_args_t*)a2), 0, 1))
+SYSCALL_FN(sendmmsg, acct_mmsg(sys_sendmmsg((int)a1, (sock_mmsg_t*)a2, (int)a3), (sock_mmsg_t*)a2, 1))
+SYSCALL_FN(recvmmsg, acct_mmsg(sys_recvmmsg((int)a1, (sock_mmsg_t*)a2, (int)a3), (sock_mmsg_t*)a2, 0))
+SYSCALL_FN(dl_resolve, (int64_t)sys_dl_resolve(a1, a2))
+SYSCALL_FN(pe_resolve, (int64_t)sys_pe_resolve(a1, a2))
+SYSCALL_FN(uring_setup, (int64_t)sys_uring_setup((uring_params_t*)a1))
+SYSCALL_FN(uring_enter, (int64_t)sys_uring_enter((int)a1, (uint32_t)a2, (uint32_t)a3))
+SYSCALL_FN(futex, (int64_t)sys_futex((uint32_t*)a1, (int)a2, a3))
+
+static const syscall_fn_t syscall_table[NUM_SYSCALLS] = {
+    [SYS_EXIT]         = sc_exit,
+    [SYS_GETPID]       = sc_getpid,
+    [SYS_YIELD]        = sc_yield,
+    [SYS_SLEEP]        = sc_sleep,
+    [SYS_FORK]         = sc_fork,
+    [SYS_WAIT]         = sc_wait,
+    [SYS_EXECVE]       = sc_execve,
+    [SYS_KILL]         = sc_kill,
+    [SYS_GETPPID]      = sc_getppid,
+    [SYS_UPTIME]       = sc_uptime,
+    [SYS_GETPRIO]      = sc_getprio,
+    [SYS_SETPRIO]      = sc_setprio,
+    [SYS_PROCINFO]     = sc_procinfo,
+    [SYS_MEMINFO]      = sc_meminfo,
+    [SYS_WRITE]        = sc_write,
+    [SYS_READ]         = sc_read,
+    [SYS_OPEN]         = sc_open,
+    [SYS_CLOSE]        = sc_close,
+    [SYS_LSEEK]        = sc_lseek,
+    [SYS_STAT]         = sc_stat,
+    [SYS_FSTAT]        = sc_fstat,
+    [SYS_DUP]          = sc_dup,
+    [SYS_DUP2]         = sc_dup2,
+    [SYS_PIPE]         = sc_pipe,
+    [SYS_GETCWD]       = sc_getcwd,
+    [SYS_CHDIR]        = sc_chdir,
+    [SYS_MKDIR]        = sc_mkdir,
+    [SYS_RMDIR]        = sc_rmdir,
+    [SYS_UNLINK]       = sc_unlink,
+    [SYS_READDIR]      = sc_readdir,
+    [SYS_MMAP]         = sc_mmap,
+    [SYS_MUNMAP]       = sc_munmap,
+    [SYS_BRK]          = sc_brk,
+    [SYS_IOCTL]        = sc_ioctl,
+    [SYS_FCNTL]        = sc_fcntl,
+    [SYS_POLL]         = sc_poll,
+    [SYS_SIGACTION]    = sc_sigaction,
+    [SYS_SIGRETURN]    = sc_sigreturn,
+    [SYS_SIGPROCMASK]  = sc_sigprocmask,
+    [SYS_SHMGET]       = sc_shmget,
+    [SYS_SHMAT]        = sc_shmat,
+    [SYS_SHMDT]        = sc_shmdt,
+    [SYS_GETUID]       = sc_getuid,
+    [SYS_GETGID]       = sc_getgid,
+    [SYS_ISATTY]       = sc_isatty,
+    [SYS_CLOCK]        = sc_clock,
+    [SYS_NANOSLEEP]    = sc_nanosleep,
+    [SYS_EPOLL_CREATE] = sc_epoll_create,
+    [SYS_EPOLL_CTL]    = sc_epoll_ctl,
+    [SYS_EPOLL_WAIT]   = sc_epoll_wait,
+    [SYS_SOCKET]       = sc_socket,
+    [SYS_BIND]         = sc_bind,
+    [SYS_LISTEN]       = sc_listen,
+    [SYS_ACCEPT]       = sc_accept,
+    [SYS_CONNECT]      = sc_connect,
+    [SYS_SENDFILE]     = sc_sendfile,
+    [SYS_SPLICE]       = sc_splice,
+    [SYS_READV]        = sc_readv,
+    [SYS_WRITEV]       = sc_writev,
+    [SYS_PREAD]        = sc_pread,
+    [SYS_PWRITE]       = sc_pwrite,
+    [SYS_SENDMMSG]     = sc_sendmmsg,
+    [SYS_RECVMMSG]     = sc_recvmmsg,
+    [SYS_DL_RESOLVE]   = sc_dl_resolve,
+    [SYS_PE_RESOLVE]   = sc_pe_resolve,
+    [SYS_URING_SETUP]  = sc_uring_setup,
+    [SYS_URING_ENTER]  = sc_uring_enter,
+    [SYS_FUTEX]        = sc_futex,
+};
+
+// Syscalls run under the big kernel lock; the handlers assume a single
+// CPU in the kernel at a time
+int64_t syscall_dispatch(uint64_t num, uint64_t a1, uint64_t a2, uint64_t a3) {
+    smp_this_cpu()->syscalls++;
+    if (num >= NUM_SYSCALLS || !syscall_table[num]) return (int64_t)SYSCALL_ENOSYS;
+    TRACE(TRACE_SYSCALL_ENTER, a1, num);
+    smp_bkl_lock();
+    int64_t ret = syscall_table[num](a1, a2, a3);
+    smp_bkl_unlock();
+    TRACE(TRACE_SYSCALL_EXIT, ret, num);
+    return ret;
+}
+
+// ============ Benchmark ============
+
+static uint64_t syscall_bench_one(int iterations, uint64_t num, uint64_t a1) {
+    uint64_t t0 = timer_now_ns();
+    for (int i = 0; i < iterations; i++) syscall_dispatch(num, a1, 0, 0);
+    return (timer_now_ns() - t0) / (uint64_t)iterations;
+}
+
+void syscall_bench(int iterations, syscall_bench_t* out) {
+    if (iterations <= 0) iterations = 1;
+    out->getpid_ns = syscall_bench_one(iterations, SYS_GETPID, 0);
+    out->isatty_ns = syscall_bench_one(iterations, SYS_ISATTY, 1);
+    out->enosys_ns = syscall_bench_one(iterations, NUM_SYSCALLS, 0);
 }
@@ -4,6 +4,10 @@
 #define SYSCALL_H
 
 #include "stdint.h"
+#include "epoll.h"
+#include "socket.h"
+#include "uring.h"
+#include "futex.h"
 
 // ---- System Call Numbers ----
 // Process management
@@ -69,8 +73,46 @@
 #define SYS_GETGID       43
 #define SYS_ISATTY       44
 #define SYS_CLOCK        45
+#define SYS_NANOSLEEP    46
 
-#define NUM_SYSCALLS     46
+// Readiness notification
+#define SYS_EPOLL_CREATE 47
+#define SYS_EPOLL_CTL    48
+#define SYS_EPOLL_WAIT   49
+
+// Sockets
+#define SYS_SOCKET       50
+#define SYS_BIND         51
+#define SYS_LISTEN       52
+#define SYS_ACCEPT       53
+#define SYS_CONNECT      54
+
+// Zero-copy transfer
+#define SYS_SENDFILE     55
+#define SYS_SPLICE       56
+
+// Vectored / positional I/O
+#define SYS_READV        57
+#define SYS_WRITEV       58
+#define SYS_PREAD        59
+#define SYS_PWRITE       60
+
+// Batched datagrams
+#define SYS_SENDMMSG     61
+#define SYS_RECVMMSG     62
+
+// Dynamic linking
+#define SYS_DL_RESOLVE   63
+#define SYS_PE_RESOLVE   64
+
+// Submission/completion rings (uring.h)
+#define SYS_URING_SETUP  65
+#define SYS_URING_ENTER  66
+
+// Futexes (futex.h)
+#define SYS_FUTEX        67
+
+#define NUM_SYSCALLS     68
 
 // ---- Result Codes (POSIX-inspired errno values) ----
 #define SYSCALL_OK        0
@@ -93,11 +135,18 @@
 #define SYSCALL_ENOSPC   -17   // No space left on device
 #define SYSCALL_ESPIPE   -18   // Illegal seek (on pipe)
 #define SYSCALL_ECHILD   -19   // No child processes
+#define SYSCALL_ENOTSOCK -20   // Not a socket
+#define SYSCALL_ENOTCONN -21   // Socket not connected
+#define SYSCALL_EADDRINUSE -22 // Address already in use
+#define SYSCALL_ECONNREFUSED -23 // Connection refused
+#define SYSCALL_EBUSY    -24   // Resource busy
+#define SYSCALL_ETIMEDOUT -25  // Timed out
 
 // ---- mmap flags ----
 #define MMAP_PROT_READ    0x1
 #define MMAP_PROT_WRITE   0x2
 #define MMAP_PROT_EXEC    0x4
+#define MMAP_MAP_SHARED   0x01
 #define MMAP_MAP_PRIVATE  0x02
 #define MMAP_MAP_ANON     0x20
 #define MMAP_MAP_FIXED    0x10
@@ -108,6 +157,8 @@
 #define F_SETFD   2
 #define F_GETFL   3
 #define F_SETFL   4
+#define F_SETPIPE_SZ 1031    // Resize a pipe's buffer (arg = bytes)
+#define F_GETPIPE_SZ 1032
 
 // ---- poll events ----
 #define POLLIN    0x001
@@ -122,6 +173,18 @@ typedef struct {
     short revents;
 } pollfd_t;
 
+// ---- epoll arguments (packed into structs like mmap_args_t) ----
+typedef struct {
+    int           fd;       // Descriptor to add/modify/remove
+    epoll_event_t event;    // Ignored for EPOLL_CTL_DEL
+} epoll_ctl_args_t;
+
+typedef struct {
+    epoll_event_t* events;  // Output array
+    int            maxevents;
+    int            timeout; // Milliseconds, -1 = forever, 0 = poll
+} epoll_wait_args_t;
+
 // ---- mmap arguments (packed into struct since we only have 4 args) ----
 typedef struct {
     uint64_t addr;
@@ -132,6 +195,24 @@ typedef struct {
     uint64_t offset;
 } mmap_args_t;
 
+// ---- readv/writev buffer list ----
+#define SYSCALL_IOV_MAX   32     // Most buffers in one call
+
+typedef struct {
+    void*    base;
+    uint64_t len;
+} iovec_t;
+
+// ---- sendmmsg/recvmmsg ----
+#define SYSCALL_MMSG_MAX  64     // Most datagrams in one call
+
+// ---- pread/pwrite arguments ----
+typedef struct {
+    void*    buf;
+    uint64_t count;
+    uint64_t offset;
+} pio_args_t;
+
 // ---- stat structure ----
 typedef struct {
     uint32_t st_mode;       // File type and permissions
@@ -231,14 +312,30 @@ typedef struct {
 // Initialize system call interface
 void syscall_init(void);
 
+// Set up the SYSCALL MSRs on the calling CPU (syscall_init does the BSP's)
+void syscall_init_ap(void);
+
 // System call dispatcher (called from switch.asm syscall_entry)
 int64_t syscall_dispatch(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uint64_t arg3);
 
+// Syscall latency microbenchmark: average ns per syscall_dispatch() round
+// trip (lock, table lookup, handler) for calls that do almost no work, so
+// the dispatch path itself dominates. The SYSCALL/SYSRET transition is not
+// included. All 0 without the TSC clock.
+typedef struct {
+    uint64_t getpid_ns;     // Per-CPU current process read
+    uint64_t isatty_ns;     // Fd table lookup
+    uint64_t enosys_ns;     // Rejected number (no lock taken)
+} syscall_bench_t;
+
+void syscall_bench(int iterations, syscall_bench_t* out);
+
 // Process management syscalls
 int      sys_exit(int exit_code);
 int      sys_getpid(void);
 int      sys_yield(void);
 int      sys_sleep(uint64_t ticks);
+int      sys_nanosleep(uint64_t ns);
 int      sys_fork(void);
 int      sys_wait(int pid);
 int      sys_execve(const char* path, const char** argv, const char** envp);
@@ -256,6 +353,13 @@ int      sys_close(int fd);
 int64_t  sys_read(int fd, void* buf, uint64_t count);
 int64_t  sys_write(int fd, const void* buf, uint64_t count);
 int64_t  sys_lseek(int fd, int64_t offset, int whence);
+// Scatter/gather over up to SYSCALL_IOV_MAX buffers; stop early on a short
+// transfer. Sockets pack a writev into as few TCP segments as possible.
+int64_t  sys_readv(int fd, const iovec_t* iov, int iovcnt);
+int64_t  sys_writev(int fd, const iovec_t* iov, int iovcnt);
+// Transfer at args->offset without moving the file position (files only)
+int64_t  sys_pread(int fd, const pio_args_t* args);
+int64_t  sys_pwrite(int fd, const pio_args_t* args);
 int      sys_stat(const char* path, stat_t* buf);
 int      sys_fstat(int fd, stat_t* buf);
 
@@ -282,6 +386,40 @@ int      sys_ioctl(int fd, uint64_t request, uint64_t arg);
 int      sys_fcntl(int fd, int cmd, uint64_t arg);
 int      sys_poll(pollfd_t* fds, int nfds, int timeout);
 
+// Readiness notification
+int      sys_epoll_create(int flags);
+int      sys_epoll_ctl(int epfd, int op, const epoll_ctl_args_t* args);
+int      sys_epoll_wait(int epfd, epoll_wait_args_t* args);
+
+// Sockets
+int      sys_socket(int family, int type, int protocol);
+int      sys_bind(int fd, const sockaddr_in_t* addr);
+int      sys_listen(int fd, int backlog);
+int      sys_accept(int fd, sockaddr_in_t* addr);
+int      sys_connect(int fd, const sockaddr_in_t* addr);
+// Up to SYSCALL_MMSG_MAX datagrams per call; each message's done field
+// gets its length. recvmmsg sleeps for the first datagram only.
+int      sys_sendmmsg(int fd, sock_mmsg_t* msgs, int count);
+int      sys_recvmmsg(int fd, sock_mmsg_t* msgs, int count);
+
+// Bind a lazily linked PLT entry (called by the resolver stub, see dynlink.h)
+uint64_t sys_dl_resolve(uint64_t obj, uint64_t index);
+// Bind a PE import on its first call (called by the import thunks, see pe.h)
+uint64_t sys_pe_resolve(uint64_t mod, uint64_t index);
+
+// Map a ring pair into the caller (see uring.h). Returns its fd.
+int      sys_uring_setup(uring_params_t* params);
+// Submit up to to_submit SQEs, then wait for min_complete unread CQEs.
+// Returns the number of SQEs consumed.
+int      sys_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete);
+// Futex wait/wake/requeue (see futex.h)
+int      sys_futex(uint32_t* addr, int op, uint64_t arg);
+
+// Zero-copy transfer: file data and pipe buffers go to the destination
+// without a user-space bounce; sockets get them by reference
+int64_t  sys_sendfile(int out_fd, int in_fd, uint64_t count);
+int64_t  sys_splice(int in_fd, int out_fd, uint64_t count);
+
 // Signals
 int      sys_sigaction(int sig, const sigaction_t* act, sigaction_t* oldact);
 int      sys_sigreturn(void);
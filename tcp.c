@@ -1,48 +1,198 @@
 // tcp.c - TCP Transport Layer for Alteo OS
+// Sent data is copied into the connection's send ring and stays there
+// until acknowledged; tcp_output() hands segments to the NIC by reference
+// into the ring, as many as min(peer window, cwnd) allows. Received data
+// is written to the receive ring at its sequence offset, so segments past
+// a gap are kept (and reported with SACK) until the gap fills.
 #include "tcp.h"
+#include "klib.h"
+#include "heap.h"
 #include "ip.h"
 #include "ethernet.h"
+#include "timer.h"
+#include "trace.h"
+#include "random.h"
+
+// Connection ids index a table of TCBs that grows a slab at a time. A TCB
+// is never given back to the heap (its wait queue and poll source may
+// still be reached through the id); closed ones wait on tcb_free for reuse.
+static tcp_connection_t* slabs[TCP_MAX_CONNECTIONS / TCP_CONN_SLAB];
+static int tcb_high = 0;          // Ids below this have a TCB
+static int tcb_free = -1;
+
+// Demux: connected TCBs by (remote ip, remote port, local port), listeners
+// by local port
+static int conn_hash[TCP_HASH_SIZE];
+static int listen_hash[TCP_LISTEN_HASH_SIZE];
+
+#define TCP_UNHASHED    0
+#define TCP_HASHED_CONN 1
+#define TCP_HASHED_LISTEN 2
 
-static tcp_connection_t connections[TCP_MAX_CONNECTIONS];
 static uint16_t next_ephemeral_port = 49152;
+static tcp_stats_t tcp_stats;
 
-// Memory helpers
-static void tcp_memcpy(void* dst, const void* src, int n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (int i = 0; i < n; i++) d[i] = s[i];
-}
+// Sequence number comparisons, modulo 2^32
+#define SEQ_LT(a, b)    ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)   ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)    ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b)   ((int32_t)((a) - (b)) >= 0)
+
+#define TCP_TS_LEN      12      // Timestamp option with its padding
 
-static void tcp_memset(void* dst, uint8_t val, int n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (int i = 0; i < n; i++) d[i] = val;
+static uint64_t tcp_now_ms(void) {
+    return timer_now_ns() / 1000000ULL;
 }
 
-// Simple pseudo-random ISN
+static void tcp_free_bufs(tcp_connection_t* conn);
+static void tcp_syn_forget(int listener);
+static void tcp_syn_init(void);
+
+// Initial sequence number, unpredictable to off-path attackers
 static uint32_t tcp_gen_isn(void) {
-    static uint32_t seed = 0x12345678;
-    seed = seed * 1103515245 + 12345;
-    return seed;
+    return random_u32();
 }
 
 void tcp_init(void) {
-    for (int i = 0; i < TCP_MAX_CONNECTIONS; i++) {
-        connections[i].active = 0;
-        connections[i].state = TCP_STATE_CLOSED;
+    for (int i = 0; i < tcb_high; i++) {
+        tcp_free_bufs(&slabs[i / TCP_CONN_SLAB][i % TCP_CONN_SLAB]);
+        slabs[i / TCP_CONN_SLAB][i % TCP_CONN_SLAB].active = 0;
+        slabs[i / TCP_CONN_SLAB][i % TCP_CONN_SLAB].state = TCP_STATE_CLOSED;
+    }
+    // Fresh ids are handed out again from the bottom, TCBs kept
+    tcb_free = -1;
+    for (int i = tcb_high - 1; i >= 0; i--) {
+        slabs[i / TCP_CONN_SLAB][i % TCP_CONN_SLAB].hash_next = tcb_free;
+        tcb_free = i;
+    }
+    for (int b = 0; b < TCP_HASH_SIZE; b++) conn_hash[b] = -1;
+    for (int b = 0; b < TCP_LISTEN_HASH_SIZE; b++) listen_hash[b] = -1;
+    tcp_syn_init();
+    tcp_cc_init();
+}
+
+// TCB of a connection id, 0 if the id was never used
+static tcp_connection_t* tcp_conn(int id) {
+    if (id < 0 || id >= tcb_high) return (tcp_connection_t*)0;
+    return &slabs[id / TCP_CONN_SLAB][id % TCP_CONN_SLAB];
+}
+
+static void tcp_set_state(tcp_connection_t* conn, int state) {
+    TRACE(TRACE_TCP_STATE, ((uint32_t)conn->local_port << 16) | conn->remote_port,
+          (conn->state << 8) | state);
+    conn->state = state;
+}
+
+// TCB of an open connection id, or 0
+static tcp_connection_t* tcp_conn_active(int id) {
+    tcp_connection_t* conn = tcp_conn(id);
+    return (conn && conn->active) ? conn : (tcp_connection_t*)0;
+}
+
+// Wake blocked readers/acceptors and epoll waiters of a connection
+static void tcp_notify(tcp_connection_t* conn) {
+    waitq_wake_all(&conn->waitq);
+    pollsrc_notify(&conn->pollsrc);
+}
+
+// ---- Connection table ----
+
+static uint32_t tcp_tuple_hash(uint32_t remote_ip, uint16_t remote_port, uint16_t local_port) {
+    uint32_t h = (remote_ip ^ ((uint32_t)remote_port << 16 | local_port)) * 0x9E3779B1U;
+    return (h ^ (h >> 16)) & (TCP_HASH_SIZE - 1);
+}
+
+static int* tcp_bucket(tcp_connection_t* conn, int table) {
+    if (table == TCP_HASHED_LISTEN) return &listen_hash[conn->local_port & (TCP_LISTEN_HASH_SIZE - 1)];
+    return &conn_hash[tcp_tuple_hash(conn->remote_ip, conn->remote_port, conn->local_port)];
+}
+
+// Link a connection on the 4-tuple table, or the listener table
+static void tcp_hash_insert(tcp_connection_t* conn, int table) {
+    int* bucket = tcp_bucket(conn, table);
+    conn->hash_next = *bucket;
+    *bucket = conn->id;
+    conn->hashed = (uint8_t)table;
+}
+
+static void tcp_hash_remove(tcp_connection_t* conn) {
+    if (conn->hashed == TCP_UNHASHED) return;
+    int* link = tcp_bucket(conn, conn->hashed);
+    while (*link >= 0 && *link != conn->id) link = &tcp_conn(*link)->hash_next;
+    if (*link >= 0) *link = conn->hash_next;
+    conn->hashed = TCP_UNHASHED;
+}
+
+// Take a child off its listener's accept queue
+static void tcp_accept_unlink(tcp_connection_t* conn) {
+    if (!conn->queued) return;
+    conn->queued = 0;
+    tcp_connection_t* l = tcp_conn(conn->listener);
+    int prev = -1;
+    for (int i = l->accept_head; i >= 0; prev = i, i = tcp_conn(i)->accept_next) {
+        if (i != conn->id) continue;
+        if (prev >= 0) tcp_conn(prev)->accept_next = conn->accept_next;
+        else l->accept_head = conn->accept_next;
+        if (l->accept_tail == i) l->accept_tail = prev;
+        l->accept_count--;
+        return;
     }
 }
 
 static int tcp_alloc_conn(void) {
-    for (int i = 0; i < TCP_MAX_CONNECTIONS; i++) {
-        if (!connections[i].active) {
-            tcp_memset(&connections[i], 0, sizeof(tcp_connection_t));
-            connections[i].active = 1;
-            connections[i].state = TCP_STATE_CLOSED;
-            connections[i].rcv_wnd = TCP_WINDOW_SIZE;
-            return i;
+    int id = tcb_free;
+    if (id >= 0) {
+        tcb_free = tcp_conn(id)->hash_next;
+    } else {
+        if (tcb_high >= TCP_MAX_CONNECTIONS) return -1;
+        id = tcb_high;
+        if (id % TCP_CONN_SLAB == 0) {
+            tcp_connection_t* slab = (tcp_connection_t*)kmalloc(TCP_CONN_SLAB * sizeof(tcp_connection_t));
+            if (!slab) return -1;
+            memset(slab, 0, TCP_CONN_SLAB * sizeof(tcp_connection_t));
+            slabs[id / TCP_CONN_SLAB] = slab;
         }
+        tcb_high++;
     }
-    return -1;
+
+    tcp_connection_t* conn = tcp_conn(id);
+    pollsrc_detach(&conn->pollsrc);   // Registrations on the old connection
+    memset(conn, 0, sizeof(tcp_connection_t));
+    conn->id = id;
+    conn->active = 1;
+    conn->state = TCP_STATE_CLOSED;
+    conn->mss = TCP_DEFAULT_MSS;
+    conn->ssthresh = 0x7FFFFFFF;
+    conn->cc = tcp_cc_default();
+    conn->rto_ms = TCP_RTO_INIT_MS;
+    conn->listener = -1;
+    conn->accept_head = conn->accept_tail = -1;
+    return id;
+}
+
+// Close out a connection: unhash it and put its TCB up for reuse
+static void tcp_free_conn(tcp_connection_t* conn) {
+    if (!conn->active) return;
+    tcp_free_bufs(conn);
+    tcp_hash_remove(conn);
+    tcp_accept_unlink(conn);
+    // A listener's half-open requests and unaccepted children go with it
+    if (conn->state == TCP_STATE_LISTEN) {
+        tcp_syn_forget(conn->id);
+        int i = conn->accept_head;
+        conn->accept_head = conn->accept_tail = -1;
+        conn->accept_count = 0;
+        while (i >= 0) {
+            tcp_connection_t* child = tcp_conn(i);
+            i = child->accept_next;
+            child->queued = 0;
+            tcp_close(child->id);
+        }
+    }
+    tcp_set_state(conn, TCP_STATE_CLOSED);
+    conn->active = 0;
+    conn->hash_next = tcb_free;
+    tcb_free = conn->id;
 }
 
 static uint16_t tcp_alloc_port(void) {
@@ -52,28 +202,43 @@ static uint16_t tcp_alloc_port(void) {
 }
 
 // Calculate TCP checksum
-static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip,
-                             const uint8_t* tcp_data, uint16_t tcp_len) {
-    uint32_t sum = 0;
+// Ones'-complement sum of 16-bit words; only the last part may be odd-sized
+static uint32_t tcp_sum(uint32_t sum, const uint8_t* data, uint16_t len) {
+    const uint16_t* ptr = (const uint16_t*)data;
+    int remaining = len;
+    while (remaining > 1) {
+        sum += *ptr++;
+        remaining -= 2;
+    }
+    if (remaining == 1) {
+        sum += *(const uint8_t*)ptr;
+    }
+    return sum;
+}
 
-    // Pseudo-header
+// Pseudo-header sum, folded (not complemented)
+static uint16_t tcp_pseudo_sum(uint32_t src_ip, uint32_t dst_ip, uint16_t tcp_len) {
+    uint32_t sum = 0;
     sum += (src_ip >> 16) & 0xFFFF;
     sum += src_ip & 0xFFFF;
     sum += (dst_ip >> 16) & 0xFFFF;
     sum += dst_ip & 0xFFFF;
     sum += htons(IP_PROTO_TCP);
     sum += htons(tcp_len);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)sum;
+}
 
-    // TCP segment
-    const uint16_t* ptr = (const uint16_t*)tcp_data;
-    int remaining = tcp_len;
-    while (remaining > 1) {
-        sum += *ptr++;
-        remaining -= 2;
-    }
-    if (remaining == 1) {
-        sum += *(const uint8_t*)ptr;
-    }
+// Checksum over the pseudo-header, the TCP header and the payload
+static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip,
+                             const uint8_t* hdr, uint16_t hdr_len,
+                             const uint8_t* payload, uint16_t payload_len) {
+    uint32_t sum = tcp_pseudo_sum(src_ip, dst_ip, hdr_len + payload_len);
+
+    // TCP segment (the header length is even, so the payload continues the word stream)
+    sum = tcp_sum(sum, hdr, hdr_len);
+    if (payload_len) sum = tcp_sum(sum, payload, payload_len);
 
     while (sum >> 16)
         sum = (sum & 0xFFFF) + (sum >> 16);
@@ -81,192 +246,1070 @@ static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip,
     return (uint16_t)(~sum);
 }
 
-// Send a TCP segment
-static int tcp_send_segment(tcp_connection_t* conn, uint8_t flags,
-                            const uint8_t* data, uint16_t data_len) {
-    uint8_t buf[TCP_MAX_SEGMENT + TCP_HEADER_LEN];
+// ---- Rings ----
+
+// Copy into or out of a ring at offset off, wrapping at its end
+static void ring_write(uint8_t* ring, uint32_t size, uint32_t off, const uint8_t* src, uint32_t len) {
+    off &= size - 1;
+    uint32_t first = size - off < len ? size - off : len;
+    memcpy(ring + off, src, first);
+    if (len > first) memcpy(ring, src + first, len - first);
+}
+
+static void ring_read(const uint8_t* ring, uint32_t size, uint32_t off, uint8_t* dst, uint32_t len) {
+    off &= size - 1;
+    uint32_t first = size - off < len ? size - off : len;
+    memcpy(dst, ring + off, first);
+    if (len > first) memcpy(dst + first, ring, len - first);
+}
+
+// Double a ring, moving the 'used' bytes at head to the start of the new one
+static int ring_grow(uint8_t** ring, uint32_t* size, uint32_t* head, uint32_t used) {
+    if (*size >= TCP_BUF_MAX) return -1;
+    uint8_t* bigger = (uint8_t*)kmalloc(*size * 2);
+    if (!bigger) return -1;
+    ring_read(*ring, *size, *head, bigger, used);
+    eth_tx_flush();     // The NIC may still be reading segments out of the old one
+    kfree(*ring);
+    *ring = bigger;
+    *size *= 2;
+    *head = 0;
+    return 0;
+}
+
+// Rings for a connection about to carry data
+static int tcp_alloc_bufs(tcp_connection_t* conn) {
+    conn->snd_buf = (uint8_t*)kmalloc(TCP_BUF_MIN);
+    conn->rcv_buf = (uint8_t*)kmalloc(TCP_BUF_MIN);
+    if (!conn->snd_buf || !conn->rcv_buf) {
+        tcp_free_bufs(conn);
+        return -1;
+    }
+    conn->snd_size = conn->rcv_size = TCP_BUF_MIN;
+    return 0;
+}
+
+static void tcp_free_bufs(tcp_connection_t* conn) {
+    if (conn->snd_buf) eth_tx_flush();
+    kfree(conn->snd_buf);
+    kfree(conn->rcv_buf);
+    conn->snd_buf = conn->rcv_buf = (uint8_t*)0;
+    conn->snd_size = conn->rcv_size = 0;
+    conn->snd_len = conn->rcv_len = 0;
+}
+
+// ---- Sequence ranges ----
+
+// Add [start, end) to a set, merging whatever it overlaps or touches. The
+// merged range goes first (SACK reports the newest block first); the
+// oldest falls off a full set.
+static void range_add(tcp_range_t* set, int* count, uint32_t start, uint32_t end) {
+    tcp_range_t keep[TCP_SACK_BLOCKS];
+    int n = 0;
+    for (int i = 0; i < *count; i++) {
+        if (SEQ_LEQ(set[i].start, end) && SEQ_GEQ(set[i].end, start)) {
+            if (SEQ_LT(set[i].start, start)) start = set[i].start;
+            if (SEQ_GT(set[i].end, end)) end = set[i].end;
+        } else {
+            keep[n++] = set[i];
+        }
+    }
+    if (n > TCP_SACK_BLOCKS - 1) n = TCP_SACK_BLOCKS - 1;
+    set[0].start = start;
+    set[0].end = end;
+    for (int i = 0; i < n; i++) set[i + 1] = keep[i];
+    *count = n + 1;
+}
+
+// Drop everything below seq
+static void range_trim(tcp_range_t* set, int* count, uint32_t seq) {
+    int n = 0;
+    for (int i = 0; i < *count; i++) {
+        if (SEQ_LEQ(set[i].end, seq)) continue;
+        set[n] = set[i];
+        if (SEQ_LT(set[n].start, seq)) set[n].start = seq;
+        n++;
+    }
+    *count = n;
+}
+
+// Range holding seq, or 0
+static const tcp_range_t* range_find(const tcp_range_t* set, int count, uint32_t seq) {
+    for (int i = 0; i < count; i++) {
+        if (SEQ_LEQ(set[i].start, seq) && SEQ_LT(seq, set[i].end)) return &set[i];
+    }
+    return (const tcp_range_t*)0;
+}
+
+// Start of the first range beginning after seq, or limit if that is nearer
+static uint32_t range_next(const tcp_range_t* set, int count, uint32_t seq, uint32_t limit) {
+    for (int i = 0; i < count; i++) {
+        if (SEQ_GT(set[i].start, seq) && SEQ_LT(set[i].start, limit)) limit = set[i].start;
+    }
+    return limit;
+}
+
+// ---- Options ----
+
+typedef struct {
+    uint16_t mss;               // 0 if absent
+    int      wscale;            // -1 if absent
+    uint8_t  sack_perm;
+    uint8_t  has_ts;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int      nsack;
+    tcp_range_t sack[TCP_SACK_BLOCKS];
+} tcp_opts_t;
+
+static uint32_t get32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void tcp_parse_options(const uint8_t* p, int len, tcp_opts_t* o) {
+    memset(o, 0, sizeof(*o));
+    o->wscale = -1;
+    while (len > 0) {
+        if (p[0] == TCPOPT_EOL) break;
+        if (p[0] == TCPOPT_NOP) { p++; len--; continue; }
+        if (len < 2 || p[1] < 2 || p[1] > len) break;
+        int olen = p[1];
+        switch (p[0]) {
+            case TCPOPT_MSS:
+                if (olen == 4) o->mss = (uint16_t)(p[2] << 8 | p[3]);
+                break;
+            case TCPOPT_WSCALE:
+                if (olen == 3) o->wscale = p[2] > 14 ? 14 : p[2];
+                break;
+            case TCPOPT_SACK_PERM:
+                if (olen == 2) o->sack_perm = 1;
+                break;
+            case TCPOPT_TIMESTAMP:
+                if (olen == 10) {
+                    o->has_ts = 1;
+                    o->tsval = get32(p + 2);
+                    o->tsecr = get32(p + 6);
+                }
+                break;
+            case TCPOPT_SACK:
+                for (int i = 2; i + 8 <= olen && o->nsack < TCP_SACK_BLOCKS; i += 8) {
+                    o->sack[o->nsack].start = get32(p + i);
+                    o->sack[o->nsack].end = get32(p + i + 4);
+                    o->nsack++;
+                }
+                break;
+        }
+        p += olen;
+        len -= olen;
+    }
+}
+
+// Options for an outgoing segment; returns their length (a multiple of 4).
+// A SYN offers everything we support, a SYN-ACK what the peer's SYN
+// offered. After that, every segment carries a timestamp if both sides
+// agreed, and pure ACKs carry SACK blocks while data past a gap is held.
+static int tcp_build_options(tcp_connection_t* conn, uint8_t flags, int has_data, uint8_t* p) {
+    int n = 0;
+    int syn = flags & TCP_SYN;
+    int offer = syn && !(flags & TCP_ACK);
+    if (syn) {
+        p[n++] = TCPOPT_MSS;
+        p[n++] = 4;
+        p[n++] = TCP_MAX_SEGMENT >> 8;
+        p[n++] = TCP_MAX_SEGMENT & 0xFF;
+        if (offer || conn->rcv_wscale) {
+            p[n++] = TCPOPT_NOP;
+            p[n++] = TCPOPT_WSCALE;
+            p[n++] = 3;
+            p[n++] = TCP_WSCALE;
+        }
+        if (offer || conn->sack_ok) {
+            p[n++] = TCPOPT_NOP;
+            p[n++] = TCPOPT_NOP;
+            p[n++] = TCPOPT_SACK_PERM;
+            p[n++] = 2;
+        }
+    }
+    if (offer || conn->ts_ok) {
+        p[n++] = TCPOPT_NOP;
+        p[n++] = TCPOPT_NOP;
+        p[n++] = TCPOPT_TIMESTAMP;
+        p[n++] = 10;
+        put32(p + n, (uint32_t)tcp_now_ms());
+        put32(p + n + 4, conn->ts_recent);
+        n += 8;
+    }
+    if (!syn && !has_data && conn->sack_ok && conn->ooo_count) {
+        int blocks = conn->ooo_count;
+        int room = (TCP_OPTIONS_MAX - n - 4) / 8;
+        if (blocks > room) blocks = room;
+        p[n++] = TCPOPT_NOP;
+        p[n++] = TCPOPT_NOP;
+        p[n++] = TCPOPT_SACK;
+        p[n++] = (uint8_t)(2 + 8 * blocks);
+        for (int i = 0; i < blocks; i++) {
+            put32(p + n, conn->ooo[i].start);
+            put32(p + n + 4, conn->ooo[i].end);
+            n += 8;
+        }
+    }
+    return n;
+}
+
+// Take up what the peer's SYN (or SYN-ACK) negotiated
+static void tcp_negotiate(tcp_connection_t* conn, const tcp_opts_t* o) {
+    conn->mss = o->mss ? o->mss : TCP_DEFAULT_MSS;
+    if (conn->mss < 64) conn->mss = 64;
+    if (o->wscale >= 0) {
+        conn->snd_wscale = (uint8_t)o->wscale;
+        conn->rcv_wscale = TCP_WSCALE;
+    }
+    conn->sack_ok = o->sack_perm;
+    conn->ts_ok = o->has_ts;
+    if (o->has_ts) conn->ts_recent = o->tsval;
+}
+
+// ---- Output ----
+
+// Payload per segment: the peer's MSS, less the timestamp every segment carries
+static uint32_t tcp_seg_size(tcp_connection_t* conn) {
+    uint32_t mss = conn->mss < TCP_MAX_SEGMENT ? conn->mss : TCP_MAX_SEGMENT;
+    return conn->ts_ok ? mss - TCP_TS_LEN : mss;
+}
+
+// Window field to advertise: the room left in the receive ring (unscaled
+// in a SYN). Remembers the right edge it announces.
+static uint16_t tcp_window_field(tcp_connection_t* conn, int syn) {
+    uint32_t room = conn->rcv_size - conn->rcv_len;
+    int shift = syn ? 0 : conn->rcv_wscale;
+    uint32_t w = room >> shift;
+    if (w > 0xFFFF) w = 0xFFFF;
+    conn->rcv_adv = conn->rcv_nxt + (w << shift);
+    return (uint16_t)w;
+}
+
+// Send one segment starting at seq. The header is built here; the payload
+// goes down the stack by pointer (tx_flags: ETH_TX_ZEROCOPY lets the NIC
+// read it in place). A payload over one segment needs TSO: the NIC then
+// sends it as a run of segments, sequence numbers and checksums filled in
+// per segment.
+static int tcp_xmit(tcp_connection_t* conn, uint8_t flags, uint32_t seq,
+                    const uint8_t* data, uint32_t data_len, int tx_flags) {
+    uint8_t buf[TCP_HEADER_LEN + TCP_OPTIONS_MAX];
     tcp_header_t* hdr = (tcp_header_t*)buf;
 
+    if (!data) data_len = 0;
+    uint16_t hdr_len = TCP_HEADER_LEN + tcp_build_options(conn, flags, data_len > 0, buf + TCP_HEADER_LEN);
+
     hdr->src_port = htons(conn->local_port);
     hdr->dst_port = htons(conn->remote_port);
-    hdr->seq_num = htonl(conn->snd_nxt);
+    hdr->seq_num = htonl(seq);
     hdr->ack_num = htonl(conn->rcv_nxt);
-    hdr->data_offset = (TCP_HEADER_LEN / 4) << 4;
+    hdr->data_offset = (uint8_t)((hdr_len / 4) << 4);
     hdr->flags = flags;
-    hdr->window = htons((uint16_t)conn->rcv_wnd);
+    hdr->window = htons(tcp_window_field(conn, flags & TCP_SYN));
     hdr->checksum = 0;
     hdr->urgent_ptr = 0;
 
-    if (data && data_len > 0) {
-        tcp_memcpy(buf + TCP_HEADER_LEN, data, data_len);
+    // Calculate checksum, or seed it for the NIC with the pseudo-header
+    // (whose length it adds itself for each TSO segment)
+    uint32_t src = htonl(ip_source_addr(conn->remote_ip)), dst = htonl(conn->remote_ip);
+    int offloads = ip_tx_offloads(conn->remote_ip);
+    uint32_t seg = tcp_seg_size(conn);
+    if (data_len > seg) {
+        if (!(offloads & ETH_TX_TSO)) return -1;
+        hdr->checksum = tcp_pseudo_sum(src, dst, 0);
+        tx_flags |= ETH_TX_TSO | (int)(seg << ETH_TX_MSS_SHIFT);
+    } else if (offloads & ETH_TX_CSUM) {
+        hdr->checksum = tcp_pseudo_sum(src, dst, (uint16_t)(hdr_len + data_len));
+        tx_flags |= ETH_TX_CSUM;
+    } else {
+        hdr->checksum = tcp_checksum(src, dst, buf, hdr_len, data, (uint16_t)data_len);
     }
 
-    uint16_t total_len = TCP_HEADER_LEN + data_len;
+    tcp_stats.out_segs++;
+    return ip_send_gather(conn->remote_ip, IP_PROTO_TCP, buf, hdr_len,
+                          data, (uint16_t)data_len, tx_flags);
+}
 
-    // Calculate checksum
-    net_config_t* cfg = ip_get_config();
-    hdr->checksum = tcp_checksum(htonl(cfg->ip_addr), htonl(conn->remote_ip),
-                                  buf, total_len);
+static void tcp_send_ack(tcp_connection_t* conn) {
+    tcp_xmit(conn, TCP_ACK, conn->snd_nxt, 0, 0, 0);
+}
+
+static void tcp_arm_rto(tcp_connection_t* conn) {
+    conn->rto_deadline = tcp_now_ms() + conn->rto_ms;
+}
+
+// Send from the ring at snd_nxt as far as min(peer window, cwnd) allows,
+// skipping what the peer has SACKed, then the FIN once the ring is drained
+// and a close is pending. 'probe' lets one segment past a closed window.
+// Segments that fail to go out count as sent: the timer resends them.
+static void tcp_output(tcp_connection_t* conn, int probe) {
+    int st = conn->state;
+    if (!conn->snd_buf) return;
+    if (st != TCP_STATE_ESTABLISHED && st != TCP_STATE_CLOSE_WAIT && st != TCP_STATE_FIN_WAIT_1 &&
+        st != TCP_STATE_CLOSING && st != TCP_STATE_LAST_ACK) return;
+
+    uint32_t seg = tcp_seg_size(conn);
+    uint32_t max = (ip_tx_offloads(conn->remote_ip) & ETH_TX_TSO) ? TCP_TSO_MAX / seg * seg : seg;
+    uint32_t wnd = conn->snd_wnd < conn->cwnd ? conn->snd_wnd : conn->cwnd;
+    if (probe && wnd == 0) wnd = 1;
+    uint32_t end = conn->snd_una + conn->snd_len;
+
+    eth_tx_batch_begin();
+    while (SEQ_LT(conn->snd_nxt, end)) {
+        const tcp_range_t* r = range_find(conn->sacked, conn->sack_count, conn->snd_nxt);
+        if (r) {
+            conn->snd_nxt = SEQ_LT(r->end, end) ? r->end : end;
+            continue;
+        }
+        uint32_t flight = conn->snd_nxt - conn->snd_una;
+        if (flight >= wnd) break;
+        uint32_t left = end - conn->snd_nxt;
+        uint32_t n = left < wnd - flight ? left : wnd - flight;
+        // Rather than a runt to fill the window, wait for the next ACK
+        if (n < seg && n < left && flight > 0) break;
+        if (n > max) n = max;
+        n = range_next(conn->sacked, conn->sack_count, conn->snd_nxt, conn->snd_nxt + n) - conn->snd_nxt;
+        uint32_t off = (conn->snd_head + flight) & (conn->snd_size - 1);
+        if (n > conn->snd_size - off) n = conn->snd_size - off;
+
+        uint8_t flags = TCP_ACK | (n == left ? TCP_PSH : 0);
+        tcp_xmit(conn, flags, conn->snd_nxt, conn->snd_buf + off, n, ETH_TX_ZEROCOPY);
+        conn->snd_nxt += n;
+        if (SEQ_GT(conn->snd_nxt, conn->snd_max)) conn->snd_max = conn->snd_nxt;
+        if (!conn->rto_deadline) tcp_arm_rto(conn);
+    }
+
+    if (conn->fin_pending && !conn->fin_sent && conn->snd_nxt == end) {
+        tcp_xmit(conn, TCP_FIN | TCP_ACK, end, 0, 0, 0);
+        conn->fin_sent = 1;
+        conn->snd_nxt = end + 1;
+        if (SEQ_GT(conn->snd_nxt, conn->snd_max)) conn->snd_max = conn->snd_nxt;
+        if (!conn->rto_deadline) tcp_arm_rto(conn);
+    }
+    // Data held back by a closed window: the timer probes it
+    if (SEQ_LT(conn->snd_nxt, end) && !conn->rto_deadline) tcp_arm_rto(conn);
+    eth_tx_batch_end();
+}
+
+// Resend the first segment the peer is missing (fast retransmit)
+static void tcp_retransmit(tcp_connection_t* conn) {
+    uint32_t end = conn->snd_una + conn->snd_len;
+    uint32_t seq = conn->snd_una;
+    const tcp_range_t* r;
+    while ((r = range_find(conn->sacked, conn->sack_count, seq)) != 0) seq = r->end;
+    if (SEQ_GEQ(seq, end)) {
+        if (conn->fin_sent && SEQ_GT(conn->snd_max, end)) tcp_xmit(conn, TCP_FIN | TCP_ACK, end, 0, 0, 0);
+        return;
+    }
+    if (SEQ_GEQ(seq, conn->snd_max)) return;
+
+    uint32_t n = conn->snd_max - seq;
+    if (SEQ_LT(end, conn->snd_max)) n = end - seq;
+    uint32_t seg = tcp_seg_size(conn);
+    if (n > seg) n = seg;
+    n = range_next(conn->sacked, conn->sack_count, seq, seq + n) - seq;
+    uint32_t off = (conn->snd_head + (seq - conn->snd_una)) & (conn->snd_size - 1);
+    if (n > conn->snd_size - off) n = conn->snd_size - off;
+    tcp_stats.retrans_segs++;
+    tcp_xmit(conn, TCP_ACK, seq, conn->snd_buf + off, n, ETH_TX_ZEROCOPY);
+}
+
+// ---- Acknowledgments and timers ----
+
+// Retransmit timeout from the smoothed RTT (RFC 6298), without any backoff
+static uint32_t tcp_rto_calc(tcp_connection_t* conn) {
+    if (!conn->srtt_ms) return TCP_RTO_INIT_MS;
+    uint32_t var = 4 * conn->rttvar_ms;
+    uint32_t rto = conn->srtt_ms + (var > 1 ? var : 1);
+    if (rto < TCP_RTO_MIN_MS) rto = TCP_RTO_MIN_MS;
+    if (rto > TCP_RTO_MAX_MS) rto = TCP_RTO_MAX_MS;
+    return rto;
+}
+
+static void tcp_rtt_sample(tcp_connection_t* conn, uint32_t rtt) {
+    if (rtt == 0) rtt = 1;
+    if (rtt > TCP_RTO_MAX_MS) return;   // Not an echo of ours
+    tcp_stats.rtt_samples++;
+    tcp_stats.rtt_sum_ms += rtt;
+    if (!conn->srtt_ms) {
+        conn->srtt_ms = rtt;
+        conn->rttvar_ms = rtt / 2;
+    } else {
+        uint32_t d = conn->srtt_ms > rtt ? conn->srtt_ms - rtt : rtt - conn->srtt_ms;
+        conn->rttvar_ms = (3 * conn->rttvar_ms + d) / 4;
+        conn->srtt_ms = (7 * conn->srtt_ms + rtt) / 8;
+        if (!conn->srtt_ms) conn->srtt_ms = 1;
+    }
+}
+
+// Take in a segment's acknowledgment and window (already scaled): free
+// acknowledged ring space, note SACKed ranges, sample the RTT from the
+// echoed timestamp, and grow or cut cwnd (RFC 5681: slow start,
+// congestion avoidance, fast retransmit after three duplicate ACKs, with
+// NewReno partial ACKs resending the next hole during recovery).
+static void tcp_ack(tcp_connection_t* conn, uint32_t ack, uint32_t wnd,
+                    const tcp_opts_t* o, uint32_t payload_len) {
+    if (SEQ_GT(ack, conn->snd_max) || SEQ_LT(ack, conn->snd_una)) return;
+    uint32_t seg = tcp_seg_size(conn);
+
+    if (conn->sack_ok) {
+        for (int i = 0; i < o->nsack; i++) {
+            const tcp_range_t* b = &o->sack[i];
+            if (SEQ_GT(b->start, ack) && SEQ_LT(b->start, b->end) && SEQ_LEQ(b->end, conn->snd_max))
+                range_add(conn->sacked, &conn->sack_count, b->start, b->end);
+        }
+    }
+
+    if (SEQ_GT(ack, conn->snd_una)) {
+        uint32_t acked = ack - conn->snd_una;
+        uint32_t data = acked < conn->snd_len ? acked : conn->snd_len;   // Past the data: our FIN
+        conn->snd_head = (conn->snd_head + data) & (conn->snd_size - 1);
+        conn->snd_len -= data;
+        conn->snd_una = ack;
+        if (SEQ_LT(conn->snd_nxt, ack)) conn->snd_nxt = ack;
+        range_trim(conn->sacked, &conn->sack_count, ack);
+        if (conn->ts_ok && o->has_ts && o->tsecr) tcp_rtt_sample(conn, (uint32_t)tcp_now_ms() - o->tsecr);
+        conn->rto_ms = tcp_rto_calc(conn);
+        conn->retransmit_count = 0;
+
+        if (conn->dupacks >= 3) {
+            if (SEQ_GEQ(ack, conn->recover)) {
+                conn->cwnd = conn->ssthresh;
+                conn->dupacks = 0;
+            } else {
+                tcp_retransmit(conn);
+            }
+        } else {
+            conn->dupacks = 0;
+            if (conn->cwnd < conn->ssthresh) conn->cwnd += acked < seg ? acked : seg;
+            else conn->cc->cong_avoid(conn, acked, seg);
+            if (conn->cwnd > 2 * TCP_BUF_MAX) conn->cwnd = 2 * TCP_BUF_MAX;
+        }
+        conn->rto_deadline = 0;
+        if (conn->snd_una != conn->snd_max) tcp_arm_rto(conn);
+    } else if (payload_len == 0 && wnd == conn->snd_wnd && conn->snd_una != conn->snd_max) {
+        if (++conn->dupacks == 3) {
+            tcp_stats.fast_retrans++;
+            conn->ssthresh = conn->cc->ssthresh(conn, seg);
+            conn->cwnd = conn->ssthresh + 3 * seg;
+            conn->recover = conn->snd_max;
+            tcp_retransmit(conn);
+        } else if (conn->dupacks > 3) {
+            conn->cwnd += seg;      // Each further dup ACK is a segment that left the network
+        }
+    }
+    conn->snd_wnd = wnd;
+}
+
+// The connection is gone (reset, or the peer stopped answering). One the
+// application still holds stays as CLOSED until it calls tcp_close().
+static void tcp_abort(tcp_connection_t* conn) {
+    int st = conn->state;
+    tcp_stats.aborts++;
+    if (st == TCP_STATE_ESTABLISHED || st == TCP_STATE_CLOSE_WAIT || st == TCP_STATE_SYN_SENT) {
+        tcp_set_state(conn, TCP_STATE_CLOSED);
+        conn->rto_deadline = 0;
+    } else {
+        tcp_free_conn(conn);
+    }
+    tcp_notify(conn);
+}
+
+// Retransmit timer expired: resend the SYN, or presume everything in
+// flight lost and go back to snd_una with a one-segment window (RFC 5681
+// 3.1). What the peer SACKed may have been dropped since (RFC 2018 8), so
+// that's forgotten too. With nothing in flight this is a zero-window probe.
+static void tcp_timeout(tcp_connection_t* conn) {
+    int in_flight = conn->snd_una != conn->snd_max;
+    tcp_stats.timeouts++;
+    if (in_flight && ++conn->retransmit_count > TCP_MAX_RETRIES) {
+        tcp_abort(conn);
+        return;
+    }
+    conn->rto_ms = conn->rto_ms * 2 < TCP_RTO_MAX_MS ? conn->rto_ms * 2 : TCP_RTO_MAX_MS;
+    tcp_arm_rto(conn);
+
+    if (conn->state == TCP_STATE_SYN_SENT) {
+        tcp_xmit(conn, TCP_SYN, conn->iss, 0, 0, 0);
+        return;
+    }
+
+    if (in_flight) {
+        uint32_t seg = tcp_seg_size(conn);
+        tcp_stats.retrans_segs++;
+        conn->ssthresh = conn->cc->ssthresh(conn, seg);
+        conn->cwnd = seg;
+        if (conn->fin_sent) conn->fin_sent = 0;     // The FIN is unacknowledged too
+    }
+    conn->dupacks = 0;
+    conn->sack_count = 0;
+    conn->snd_nxt = conn->snd_una;
+    conn->rto_deadline = 0;
+    tcp_output(conn, 1);
+    if (!conn->rto_deadline && in_flight) tcp_arm_rto(conn);
+}
+
+// ---- Input ----
+
+// Receive ring auto-tuning: if the peer got more than half the ring
+// across in one round trip, the window is what limits it, so double the
+// ring (up to TCP_BUF_MAX). Data held past a gap moves along with it.
+static void tcp_rcv_tune(tcp_connection_t* conn) {
+    uint64_t now = tcp_now_ms();
+    uint32_t rtt = conn->srtt_ms ? conn->srtt_ms : TCP_RTO_MIN_MS;
+    if (now - conn->rcv_mark_ms < rtt) return;
+    uint32_t got = conn->rcv_nxt - conn->rcv_mark;
+    conn->rcv_mark = conn->rcv_nxt;
+    conn->rcv_mark_ms = now;
+    if (got <= conn->rcv_size / 2) return;
+
+    uint32_t used = conn->rcv_len;
+    for (int i = 0; i < conn->ooo_count; i++) {
+        uint32_t e = conn->rcv_len + (conn->ooo[i].end - conn->rcv_nxt);
+        if (e > used) used = e;
+    }
+    ring_grow(&conn->rcv_buf, &conn->rcv_size, &conn->rcv_head, used);
+}
+
+// Store a segment's payload at its offset in the receive ring. In-order
+// data becomes readable, along with any held range it now reaches; data
+// past a gap is held and reported in SACK blocks.
+static void tcp_rcv_data(tcp_connection_t* conn, uint32_t seq, const uint8_t* data, uint32_t len) {
+    if (SEQ_LT(seq, conn->rcv_nxt)) {
+        uint32_t dup = conn->rcv_nxt - seq;
+        if (dup >= len) return;
+        seq += dup;
+        data += dup;
+        len -= dup;
+    }
+    uint32_t room = conn->rcv_size - conn->rcv_len;
+    uint32_t off = seq - conn->rcv_nxt;
+    if (off >= room || len > room - off) {
+        tcp_stats.rcv_pruned++;     // Past our window: the peer resends it
+        if (off >= room) return;
+        len = room - off;
+    }
+    ring_write(conn->rcv_buf, conn->rcv_size, conn->rcv_head + conn->rcv_len + off, data, len);
+
+    if (off) {
+        tcp_stats.ofo_segs++;
+        range_add(conn->ooo, &conn->ooo_count, seq, seq + len);
+        return;
+    }
+    conn->rcv_nxt += len;
+    conn->rcv_len += len;
+    const tcp_range_t* r = range_find(conn->ooo, conn->ooo_count, conn->rcv_nxt);
+    if (r) {
+        conn->rcv_len += r->end - conn->rcv_nxt;
+        conn->rcv_nxt = r->end;
+    }
+    range_trim(conn->ooo, &conn->ooo_count, conn->rcv_nxt);
+    tcp_rcv_tune(conn);
+}
+
+// A segment on a synchronized connection
+static void tcp_segment(tcp_connection_t* conn, uint32_t seq, uint32_t ack, uint8_t flags,
+                        uint32_t wnd, const tcp_opts_t* o, const uint8_t* payload, uint32_t len) {
+    if (conn->ts_ok && o->has_ts && SEQ_LEQ(seq, conn->rcv_nxt)) conn->ts_recent = o->tsval;
+    if (flags & TCP_ACK) tcp_ack(conn, ack, wnd << conn->snd_wscale, o, len);
+    int fin_acked = conn->fin_sent && conn->snd_una == conn->snd_max;
+
+    int st = conn->state;
+    int receiving = st == TCP_STATE_ESTABLISHED || st == TCP_STATE_FIN_WAIT_1 || st == TCP_STATE_FIN_WAIT_2;
+    if (len && receiving) tcp_rcv_data(conn, seq, payload, len);
+
+    // A FIN counts once everything before it has arrived
+    if ((flags & TCP_FIN) && receiving && seq + len == conn->rcv_nxt) {
+        conn->rcv_nxt++;
+        if (st == TCP_STATE_ESTABLISHED) tcp_set_state(conn, TCP_STATE_CLOSE_WAIT);
+        else if (st == TCP_STATE_FIN_WAIT_1) tcp_set_state(conn, fin_acked ? TCP_STATE_TIME_WAIT : TCP_STATE_CLOSING);
+        else tcp_set_state(conn, TCP_STATE_TIME_WAIT);
+    }
+    if (fin_acked) {
+        if (conn->state == TCP_STATE_FIN_WAIT_1) {
+            tcp_set_state(conn, TCP_STATE_FIN_WAIT_2);
+        } else if (conn->state == TCP_STATE_CLOSING) {
+            tcp_set_state(conn, TCP_STATE_TIME_WAIT);
+        } else if (conn->state == TCP_STATE_LAST_ACK) {
+            tcp_free_conn(conn);
+            return;
+        }
+    }
+
+    if (len || (flags & TCP_FIN)) tcp_send_ack(conn);
+    tcp_output(conn, 0);
+}
+
+// ---- Listen queues ----
+
+// A SYN on a listener costs only a request here, not a TCB and rings: the
+// connection is made when the handshake's ACK arrives. Once a listener
+// has 'backlog' requests (or the pool is empty), SYNs are answered with a
+// SYN cookie instead: the ISS encodes a time slot, the MSS and a keyed
+// hash of the 4-tuple, so the ACK alone proves the handshake. Cookie
+// connections carry no window scaling, SACK or timestamps, which the ISS
+// has no room for.
+
+typedef struct {
+    int      listener;          // -1 if the request is free
+    uint32_t remote_ip;
+    uint16_t remote_port;
+    uint16_t local_port;
+    uint32_t irs;               // Peer's initial sequence
+    uint32_t iss;
+    tcp_opts_t opts;            // From the SYN
+    uint64_t deadline;          // Next SYN-ACK resend (ms)
+    int      retries;
+    int      hash_next;         // Bucket chain / free list
+} tcp_syn_req_t;
+
+static tcp_syn_req_t syn_reqs[TCP_SYN_QUEUE_MAX];
+static int syn_hash[TCP_SYN_HASH_SIZE];
+static int syn_free = -1;
+static uint64_t cookie_secret;
+
+// SYN cookie MSS values; the cookie stores an index
+static const uint16_t cookie_mss[] = { 536, 1220, 1440, 1460 };
+#define COOKIE_MSS_COUNT    4
+#define COOKIE_SLOT_SHIFT   16  // Time slot: ~65 s of milliseconds
+
+static void tcp_syn_init(void) {
+    for (int b = 0; b < TCP_SYN_HASH_SIZE; b++) syn_hash[b] = -1;
+    syn_free = -1;
+    for (int i = TCP_SYN_QUEUE_MAX - 1; i >= 0; i--) {
+        syn_reqs[i].listener = -1;
+        syn_reqs[i].hash_next = syn_free;
+        syn_free = i;
+    }
+    cookie_secret = random_u64();
+}
+
+static int* syn_bucket(uint32_t ip, uint16_t port, uint16_t local_port) {
+    return &syn_hash[tcp_tuple_hash(ip, port, local_port) & (TCP_SYN_HASH_SIZE - 1)];
+}
+
+static tcp_syn_req_t* tcp_syn_find(uint32_t ip, uint16_t port, uint16_t local_port) {
+    for (int i = *syn_bucket(ip, port, local_port); i >= 0; i = syn_reqs[i].hash_next) {
+        tcp_syn_req_t* r = &syn_reqs[i];
+        if (r->remote_ip == ip && r->remote_port == port && r->local_port == local_port) return r;
+    }
+    return (tcp_syn_req_t*)0;
+}
+
+static void tcp_syn_drop(tcp_syn_req_t* r) {
+    int i = (int)(r - syn_reqs);
+    int* link = syn_bucket(r->remote_ip, r->remote_port, r->local_port);
+    while (*link != i) link = &syn_reqs[*link].hash_next;
+    *link = r->hash_next;
+    tcp_connection_t* l = tcp_conn(r->listener);
+    if (l) l->syn_count--;
+    r->listener = -1;
+    r->hash_next = syn_free;
+    syn_free = i;
+}
+
+// Drop every request of a listener that is going away
+static void tcp_syn_forget(int listener) {
+    for (int i = 0; i < TCP_SYN_QUEUE_MAX; i++) {
+        if (syn_reqs[i].listener == listener) tcp_syn_drop(&syn_reqs[i]);
+    }
+}
+
+// Send a SYN-ACK for a connection that has no TCB yet, from a scratch one
+static void tcp_syn_ack(tcp_connection_t* l, uint32_t ip, uint16_t port,
+                        uint32_t irs, uint32_t iss, const tcp_opts_t* o) {
+    tcp_connection_t tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.local_port = l->local_port;
+    tmp.remote_ip = ip;
+    tmp.remote_port = port;
+    tmp.rcv_nxt = irs + 1;
+    tmp.rcv_size = TCP_BUF_MIN;     // The window the connection will start with
+    tcp_negotiate(&tmp, o);
+    tcp_xmit(&tmp, TCP_SYN | TCP_ACK, iss, 0, 0, 0);
+}
+
+static uint32_t tcp_cookie_hash(uint32_t ip, uint16_t port, uint16_t local_port,
+                                uint32_t irs, uint32_t slot_mss) {
+    uint64_t k = ((uint64_t)ip << 32 | (uint32_t)port << 16 | local_port) ^ cookie_secret;
+    k = (k ^ (k >> 33)) * 0xFF51AFD7ED558CCDULL;
+    k ^= (uint64_t)irs << 32 | slot_mss;
+    k = (k ^ (k >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    k ^= cookie_secret >> 17;
+    k = (k ^ (k >> 33)) * 0xFF51AFD7ED558CCDULL;
+    return (uint32_t)(k >> 32) & 0xFFFFFF;
+}
+
+// ISS for a cookie SYN-ACK: slot (5 bits) | MSS index (3) | hash (24)
+static uint32_t tcp_cookie_make(uint32_t ip, uint16_t port, uint16_t local_port,
+                                uint32_t irs, uint16_t mss) {
+    uint32_t idx = COOKIE_MSS_COUNT - 1;
+    while (idx > 0 && cookie_mss[idx] > mss) idx--;     // Largest the peer takes
+    uint32_t slot = (uint32_t)(tcp_now_ms() >> COOKIE_SLOT_SHIFT) & 31;
+    uint32_t sm = slot << 3 | idx;
+    return sm << 24 | tcp_cookie_hash(ip, port, local_port, irs, sm);
+}
+
+// Check the cookie an ACK returns (ack - 1); valid for this time slot and
+// the one before. Returns the MSS it encodes, or 0.
+static uint16_t tcp_cookie_check(uint32_t ip, uint16_t port, uint16_t local_port,
+                                 uint32_t irs, uint32_t cookie) {
+    uint32_t sm = cookie >> 24;
+    uint32_t idx = sm & 7;
+    uint32_t age = ((uint32_t)(tcp_now_ms() >> COOKIE_SLOT_SHIFT) - (sm >> 3)) & 31;
+    if (idx >= COOKIE_MSS_COUNT || age > 1) return 0;
+    if (tcp_cookie_hash(ip, port, local_port, irs, sm) != (cookie & 0xFFFFFF)) return 0;
+    return cookie_mss[idx];
+}
+
+// A child connection reached ESTABLISHED: queue it for accept() on its
+// listener and wake the listener
+static void tcp_child_established(tcp_connection_t* conn) {
+    tcp_connection_t* l = tcp_conn_active(conn->listener);
+    if (!l || l->state != TCP_STATE_LISTEN || conn->queued) return;
+    conn->accept_next = -1;
+    if (l->accept_tail >= 0) tcp_conn(l->accept_tail)->accept_next = conn->id;
+    else l->accept_head = conn->id;
+    l->accept_tail = conn->id;
+    l->accept_count++;
+    conn->queued = 1;
+    tcp_notify(l);
+}
+
+// The handshake completed: make the connection, queue it for accept().
+// 'syn' holds what the peer's SYN negotiated, 'o' the ACK's own options.
+// Returns the connection, or 0 (accept queue full, out of TCBs): the
+// peer's retransmission tries again.
+static tcp_connection_t* tcp_syn_complete(tcp_connection_t* l, uint32_t ip, uint16_t port,
+                                          uint32_t irs, uint32_t iss, const tcp_opts_t* syn,
+                                          uint32_t wnd, const tcp_opts_t* o) {
+    if (l->accept_count >= l->backlog) {
+        tcp_stats.accept_overflows++;
+        return (tcp_connection_t*)0;
+    }
+    int id = tcp_alloc_conn();
+    if (id < 0) return (tcp_connection_t*)0;
+    tcp_connection_t* nc = tcp_conn(id);
+    if (tcp_alloc_bufs(nc) < 0) {
+        tcp_free_conn(nc);
+        return (tcp_connection_t*)0;
+    }
+
+    nc->local_ip = l->local_ip;
+    nc->local_port = l->local_port;
+    nc->remote_ip = ip;
+    nc->remote_port = port;
+    nc->listener = l->id;
+    tcp_hash_insert(nc, TCP_HASHED_CONN);
+    tcp_negotiate(nc, syn);
+    nc->cwnd = TCP_INIT_CWND * tcp_seg_size(nc);
+    if (nc->cc->init) nc->cc->init(nc);
+    nc->rcv_nxt = irs + 1;
+    nc->rcv_mark = nc->rcv_nxt;
+    nc->rcv_mark_ms = tcp_now_ms();
+    nc->iss = iss;
+    nc->snd_una = nc->snd_nxt = nc->snd_max = iss + 1;
+    nc->snd_wnd = wnd << nc->snd_wscale;
+    if (nc->ts_ok && o->has_ts) {
+        nc->ts_recent = o->tsval;
+        if (o->tsecr) tcp_rtt_sample(nc, (uint32_t)tcp_now_ms() - o->tsecr);
+    }
+    nc->rto_ms = tcp_rto_calc(nc);
+    tcp_set_state(nc, TCP_STATE_ESTABLISHED);
+    tcp_stats.passive_opens++;
+    tcp_child_established(nc);
+    return nc;
+}
+
+// A segment for a listener: a SYN opens a request (or gets a cookie), the
+// ACK that completes a handshake makes the connection
+static void tcp_listen_input(tcp_connection_t* l, uint32_t ip, uint16_t port, uint32_t seq,
+                             uint32_t ack, uint8_t flags, uint32_t wnd, const tcp_opts_t* o,
+                             const uint8_t* payload, uint32_t len) {
+    tcp_syn_req_t* r = tcp_syn_find(ip, port, l->local_port);
+
+    if ((flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN) {
+        if (r) {
+            tcp_syn_ack(l, ip, port, r->irs, r->iss, &r->opts);     // Our SYN-ACK was lost
+            return;
+        }
+        if (l->syn_count >= l->backlog || syn_free < 0) {
+            tcp_opts_t co;
+            memset(&co, 0, sizeof(co));
+            co.wscale = -1;
+            co.mss = o->mss ? o->mss : TCP_DEFAULT_MSS;
+            tcp_syn_ack(l, ip, port, seq, tcp_cookie_make(ip, port, l->local_port, seq, co.mss), &co);
+            tcp_stats.syncookies_sent++;
+            return;
+        }
+        int i = syn_free;
+        r = &syn_reqs[i];
+        syn_free = r->hash_next;
+        r->listener = l->id;
+        r->remote_ip = ip;
+        r->remote_port = port;
+        r->local_port = l->local_port;
+        r->irs = seq;
+        r->iss = tcp_gen_isn();
+        r->opts = *o;
+        r->retries = 0;
+        r->deadline = tcp_now_ms() + TCP_RTO_INIT_MS;
+        int* bucket = syn_bucket(ip, port, l->local_port);
+        r->hash_next = *bucket;
+        *bucket = i;
+        l->syn_count++;
+        tcp_syn_ack(l, ip, port, r->irs, r->iss, &r->opts);
+        return;
+    }
 
-    // Update sequence number
-    if (flags & TCP_SYN) conn->snd_nxt++;
-    if (flags & TCP_FIN) conn->snd_nxt++;
-    conn->snd_nxt += data_len;
+    if ((flags & (TCP_SYN | TCP_ACK | TCP_RST)) != TCP_ACK) return;
+    tcp_connection_t* nc;
+    if (r) {
+        if (ack != r->iss + 1 || seq != r->irs + 1) return;
+        nc = tcp_syn_complete(l, ip, port, r->irs, r->iss, &r->opts, wnd, o);
+        if (nc) tcp_syn_drop(r);
+    } else {
+        uint16_t mss = tcp_cookie_check(ip, port, l->local_port, seq - 1, ack - 1);
+        if (!mss) return;
+        tcp_opts_t co;
+        memset(&co, 0, sizeof(co));
+        co.wscale = -1;
+        co.mss = mss;
+        nc = tcp_syn_complete(l, ip, port, seq - 1, ack - 1, &co, wnd, o);
+    }
+    // The handshake's last ACK may already carry data
+    if (nc && (len || (flags & TCP_FIN))) {
+        tcp_segment(nc, seq, ack, flags, wnd, o, payload, len);
+        tcp_notify(nc);
+    }
+}
 
-    return ip_send(conn->remote_ip, IP_PROTO_TCP, buf, total_len);
+// Resend SYN-ACKs that went unanswered, with backoff; give up after
+// TCP_SYN_RETRIES
+static void tcp_syn_timer(uint64_t now) {
+    for (int i = 0; i < TCP_SYN_QUEUE_MAX; i++) {
+        tcp_syn_req_t* r = &syn_reqs[i];
+        if (r->listener < 0 || now < r->deadline) continue;
+        if (++r->retries > TCP_SYN_RETRIES) {
+            tcp_syn_drop(r);
+            continue;
+        }
+        r->deadline = now + ((uint64_t)TCP_RTO_INIT_MS << r->retries);
+        tcp_syn_ack(tcp_conn(r->listener), r->remote_ip, r->remote_port, r->irs, r->iss, &r->opts);
+    }
+}
+
+// ---- Public API ----
+
+void tcp_get_stats(tcp_stats_t* out) {
+    if (out) *out = tcp_stats;
 }
 
 int tcp_connect(uint32_t remote_ip, uint16_t remote_port) {
     int id = tcp_alloc_conn();
     if (id < 0) return -1;
 
-    tcp_connection_t* conn = &connections[id];
-    net_config_t* cfg = ip_get_config();
-
-    conn->local_ip = cfg->ip_addr;
+    tcp_connection_t* conn = tcp_conn(id);
+    if (tcp_alloc_bufs(conn) < 0) {
+        tcp_free_conn(conn);
+        return -1;
+    }
+    conn->local_ip = ip_source_addr(remote_ip);
     conn->local_port = tcp_alloc_port();
     conn->remote_ip = remote_ip;
     conn->remote_port = remote_port;
+    tcp_hash_insert(conn, TCP_HASHED_CONN);
+    tcp_stats.active_opens++;
 
     // Generate ISN
     conn->iss = tcp_gen_isn();
-    conn->snd_nxt = conn->iss;
     conn->snd_una = conn->iss;
-    conn->snd_wnd = TCP_WINDOW_SIZE;
+    conn->snd_nxt = conn->snd_max = conn->iss + 1;
 
     // Send SYN
-    conn->state = TCP_STATE_SYN_SENT;
-    tcp_send_segment(conn, TCP_SYN, 0, 0);
+    tcp_set_state(conn, TCP_STATE_SYN_SENT);
+    tcp_xmit(conn, TCP_SYN, conn->iss, 0, 0, 0);
+    tcp_arm_rto(conn);
 
     return id;
 }
 
-int tcp_listen(uint16_t port) {
+int tcp_listen(uint16_t port, int backlog) {
     int id = tcp_alloc_conn();
     if (id < 0) return -1;
 
-    tcp_connection_t* conn = &connections[id];
+    tcp_connection_t* conn = tcp_conn(id);
     net_config_t* cfg = ip_get_config();
 
     conn->local_ip = cfg->ip_addr;
     conn->local_port = port;
-    conn->state = TCP_STATE_LISTEN;
+    tcp_set_state(conn, TCP_STATE_LISTEN);
+    conn->backlog = backlog < 1 ? 1 : backlog > TCP_BACKLOG_MAX ? TCP_BACKLOG_MAX : backlog;
+    tcp_hash_insert(conn, TCP_HASHED_LISTEN);
 
     return id;
 }
 
 int tcp_accept(int listen_id) {
-    if (listen_id < 0 || listen_id >= TCP_MAX_CONNECTIONS) return -1;
-    tcp_connection_t* lconn = &connections[listen_id];
-    if (!lconn->active || lconn->state != TCP_STATE_LISTEN) return -1;
-
-    // Check for established connections from this listener
-    for (int i = 0; i < TCP_MAX_CONNECTIONS; i++) {
-        if (i == listen_id) continue;
-        if (connections[i].active && connections[i].state == TCP_STATE_ESTABLISHED &&
-            connections[i].local_port == lconn->local_port) {
-            return i;
-        }
-    }
-    return -1; // No pending connections
-}
-
-int tcp_send(int conn_id, const uint8_t* data, uint16_t length) {
-    if (conn_id < 0 || conn_id >= TCP_MAX_CONNECTIONS) return -1;
-    tcp_connection_t* conn = &connections[conn_id];
-    if (!conn->active || conn->state != TCP_STATE_ESTABLISHED) return -1;
+    tcp_connection_t* lconn = tcp_conn_active(listen_id);
+    if (!lconn || lconn->state != TCP_STATE_LISTEN) return -1;
 
-    uint16_t sent = 0;
-    while (sent < length) {
-        uint16_t chunk = length - sent;
-        if (chunk > TCP_MAX_SEGMENT) chunk = TCP_MAX_SEGMENT;
+    int id = lconn->accept_head;
+    if (id < 0) return -1; // No pending connections
+    tcp_accept_unlink(tcp_conn(id));
+    return id;
+}
 
-        int ret = tcp_send_segment(conn, TCP_ACK | TCP_PSH, data + sent, chunk);
-        if (ret < 0) return sent > 0 ? (int)sent : ret;
+int tcp_accept_ready(int listen_id) {
+    tcp_connection_t* lconn = tcp_conn_active(listen_id);
+    return lconn && lconn->state == TCP_STATE_LISTEN && lconn->accept_head >= 0;
+}
 
-        sent += chunk;
-    }
-    return sent;
+// Open for sending: data may still follow what is queued
+static tcp_connection_t* tcp_conn_sendable(int conn_id) {
+    tcp_connection_t* conn = tcp_conn_active(conn_id);
+    if (!conn || !conn->snd_buf || conn->fin_pending) return (tcp_connection_t*)0;
+    if (conn->state != TCP_STATE_ESTABLISHED && conn->state != TCP_STATE_CLOSE_WAIT) return (tcp_connection_t*)0;
+    return conn;
 }
 
-int tcp_recv(int conn_id, uint8_t* buffer, uint16_t max_len) {
-    if (conn_id < 0 || conn_id >= TCP_MAX_CONNECTIONS) return -1;
-    tcp_connection_t* conn = &connections[conn_id];
-    if (!conn->active) return -1;
+int tcp_queue(int conn_id, const uint8_t* data, uint32_t length) {
+    tcp_connection_t* conn = tcp_conn_sendable(conn_id);
+    if (!conn) return -1;
+
+    // Send ring auto-tuning: a full ring while the windows would let at
+    // least half of it more be in flight is what limits the sender
+    uint32_t room = conn->snd_size - conn->snd_len;
+    uint32_t wnd = conn->snd_wnd < conn->cwnd ? conn->snd_wnd : conn->cwnd;
+    while (room < length && wnd >= conn->snd_size / 2 &&
+           ring_grow(&conn->snd_buf, &conn->snd_size, &conn->snd_head, conn->snd_len) == 0)
+        room = conn->snd_size - conn->snd_len;
+
+    if (length > room) length = room;
+    ring_write(conn->snd_buf, conn->snd_size, conn->snd_head + conn->snd_len, data, length);
+    conn->snd_len += length;
+    return (int)length;
+}
 
-    if (conn->recv_len == 0) return 0; // No data available
+void tcp_push(int conn_id) {
+    tcp_connection_t* conn = tcp_conn_active(conn_id);
+    if (conn) tcp_output(conn, 0);
+}
 
-    uint16_t to_read = conn->recv_len - conn->recv_read_pos;
-    if (to_read > max_len) to_read = max_len;
+int tcp_send(int conn_id, const uint8_t* data, uint32_t length) {
+    int n = tcp_queue(conn_id, data, length);
+    if (n > 0) tcp_push(conn_id);
+    return n;
+}
 
-    tcp_memcpy(buffer, conn->recv_buf + conn->recv_read_pos, to_read);
-    conn->recv_read_pos += to_read;
+int tcp_send_space(int conn_id) {
+    tcp_connection_t* conn = tcp_conn_sendable(conn_id);
+    if (!conn) return -1;
+    return (int)(conn->snd_size - conn->snd_len);
+}
 
-    // Reset buffer if fully read
-    if (conn->recv_read_pos >= conn->recv_len) {
-        conn->recv_len = 0;
-        conn->recv_read_pos = 0;
-    }
+int tcp_set_congestion(int conn_id, const char* name) {
+    tcp_connection_t* conn = tcp_conn_active(conn_id);
+    const tcp_cc_ops_t* ops = tcp_cc_find(name);
+    if (!conn || !ops) return -1;
+    conn->cc = ops;
+    memset(conn->cc_data, 0, sizeof(conn->cc_data));
+    if (ops->init) ops->init(conn);
+    return 0;
+}
 
-    return to_read;
+int tcp_recv(int conn_id, uint8_t* buffer, uint32_t max_len) {
+    tcp_connection_t* conn = tcp_conn_active(conn_id);
+    if (!conn || !conn->rcv_buf) return -1;
+
+    uint32_t n = conn->rcv_len < max_len ? conn->rcv_len : max_len;
+    if (n == 0) return 0; // No data available
+    ring_read(conn->rcv_buf, conn->rcv_size, conn->rcv_head, buffer, n);
+    conn->rcv_head = (conn->rcv_head + n) & (conn->rcv_size - 1);
+    conn->rcv_len -= n;
+
+    // Announce the window once it has opened by a useful amount (receiver
+    // silly window avoidance, RFC 1122 4.2.3.3)
+    uint32_t edge = conn->rcv_nxt + (conn->rcv_size - conn->rcv_len);
+    uint32_t step = conn->rcv_size / 2 < 2 * TCP_MAX_SEGMENT ? conn->rcv_size / 2 : 2 * TCP_MAX_SEGMENT;
+    int st = conn->state;
+    if ((st == TCP_STATE_ESTABLISHED || st == TCP_STATE_FIN_WAIT_1 || st == TCP_STATE_FIN_WAIT_2) &&
+        SEQ_GEQ(edge, conn->rcv_adv + step))
+        tcp_send_ack(conn);
+
+    return (int)n;
 }
 
 void tcp_close(int conn_id) {
-    if (conn_id < 0 || conn_id >= TCP_MAX_CONNECTIONS) return;
-    tcp_connection_t* conn = &connections[conn_id];
-    if (!conn->active) return;
+    tcp_connection_t* conn = tcp_conn_active(conn_id);
+    if (!conn) return;
+    tcp_notify(conn);
 
+    // The FIN goes out behind whatever is still queued
     if (conn->state == TCP_STATE_ESTABLISHED) {
-        conn->state = TCP_STATE_FIN_WAIT_1;
-        tcp_send_segment(conn, TCP_FIN | TCP_ACK, 0, 0);
+        tcp_set_state(conn, TCP_STATE_FIN_WAIT_1);
+        conn->fin_pending = 1;
+        tcp_output(conn, 0);
     } else if (conn->state == TCP_STATE_CLOSE_WAIT) {
-        conn->state = TCP_STATE_LAST_ACK;
-        tcp_send_segment(conn, TCP_FIN | TCP_ACK, 0, 0);
+        tcp_set_state(conn, TCP_STATE_LAST_ACK);
+        conn->fin_pending = 1;
+        tcp_output(conn, 0);
     } else {
-        conn->state = TCP_STATE_CLOSED;
-        conn->active = 0;
+        tcp_free_conn(conn);
     }
 }
 
-// Find connection matching incoming segment
-static int tcp_find_conn(uint32_t src_ip, uint16_t src_port, uint16_t dst_port) {
-    // First try exact match
-    for (int i = 0; i < TCP_MAX_CONNECTIONS; i++) {
-        if (!connections[i].active) continue;
-        if (connections[i].remote_ip == src_ip &&
-            connections[i].remote_port == src_port &&
-            connections[i].local_port == dst_port) {
-            return i;
-        }
+// Find connection matching incoming segment: the connected 4-tuple, else
+// a listener on the port
+static tcp_connection_t* tcp_find_conn(uint32_t src_ip, uint16_t src_port, uint16_t dst_port) {
+    for (int i = conn_hash[tcp_tuple_hash(src_ip, src_port, dst_port)]; i >= 0; i = tcp_conn(i)->hash_next) {
+        tcp_connection_t* c = tcp_conn(i);
+        if (c->remote_ip == src_ip && c->remote_port == src_port && c->local_port == dst_port)
+            return c;
     }
-    // Then try listening socket
-    for (int i = 0; i < TCP_MAX_CONNECTIONS; i++) {
-        if (!connections[i].active) continue;
-        if (connections[i].state == TCP_STATE_LISTEN &&
-            connections[i].local_port == dst_port) {
-            return i;
-        }
+    for (int i = listen_hash[dst_port & (TCP_LISTEN_HASH_SIZE - 1)]; i >= 0; i = tcp_conn(i)->hash_next) {
+        tcp_connection_t* c = tcp_conn(i);
+        if (c->local_port == dst_port) return c;
     }
-    return -1;
+    return (tcp_connection_t*)0;
 }
 
 void tcp_receive(uint32_t src_ip, uint32_t dst_ip, const uint8_t* data, uint16_t length) {
-    if (length < TCP_HEADER_LEN) return;
+    tcp_stats.in_segs++;
+    if (length < TCP_HEADER_LEN) {
+        tcp_stats.in_errs++;
+        return;
+    }
 
     const tcp_header_t* hdr = (const tcp_header_t*)data;
     uint16_t src_port = ntohs(hdr->src_port);
     uint16_t dst_port = ntohs(hdr->dst_port);
     uint32_t seq = ntohl(hdr->seq_num);
     uint32_t ack = ntohl(hdr->ack_num);
+    uint32_t wnd = ntohs(hdr->window);
     uint8_t flags = hdr->flags;
     uint8_t data_off = (hdr->data_offset >> 4) * 4;
+    if (data_off < TCP_HEADER_LEN || data_off > length) {
+        tcp_stats.in_errs++;
+        return;
+    }
     uint16_t payload_len = length - data_off;
     const uint8_t* payload = data + data_off;
 
     (void)dst_ip;
 
-    int conn_id = tcp_find_conn(src_ip, src_port, dst_port);
-    if (conn_id < 0) {
+    tcp_connection_t* conn = tcp_find_conn(src_ip, src_port, dst_port);
+    if (!conn) {
+        tcp_stats.no_conn++;
         // No matching connection, send RST if not RST already
         if (!(flags & TCP_RST)) {
             // Would send RST here in full implementation
@@ -274,134 +1317,95 @@ void tcp_receive(uint32_t src_ip, uint32_t dst_ip, const uint8_t* data, uint16_t
         return;
     }
 
-    tcp_connection_t* conn = &connections[conn_id];
+    tcp_opts_t opts;
+    tcp_parse_options(data + TCP_HEADER_LEN, data_off - TCP_HEADER_LEN, &opts);
+
+    if ((flags & TCP_RST) && conn->state != TCP_STATE_LISTEN) {
+        tcp_abort(conn);
+        return;
+    }
 
     switch (conn->state) {
         case TCP_STATE_LISTEN:
-            if (flags & TCP_SYN) {
-                // Create new connection for incoming SYN
-                int new_id = tcp_alloc_conn();
-                if (new_id < 0) return;
-
-                tcp_connection_t* nc = &connections[new_id];
-                nc->local_ip = conn->local_ip;
-                nc->local_port = conn->local_port;
-                nc->remote_ip = src_ip;
-                nc->remote_port = src_port;
-                nc->rcv_nxt = seq + 1;
-                nc->iss = tcp_gen_isn();
-                nc->snd_nxt = nc->iss;
-                nc->snd_una = nc->iss;
-                nc->state = TCP_STATE_SYN_RECEIVED;
-
-                tcp_send_segment(nc, TCP_SYN | TCP_ACK, 0, 0);
-            }
+            tcp_listen_input(conn, src_ip, src_port, seq, ack, flags, wnd, &opts, payload, payload_len);
             break;
 
         case TCP_STATE_SYN_SENT:
-            if ((flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK)) {
+            if ((flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK) && ack == conn->iss + 1) {
+                tcp_negotiate(conn, &opts);
+                conn->cwnd = TCP_INIT_CWND * tcp_seg_size(conn);
+                if (conn->cc->init) conn->cc->init(conn);
                 conn->rcv_nxt = seq + 1;
+                conn->rcv_mark = conn->rcv_nxt;
+                conn->rcv_mark_ms = tcp_now_ms();
                 conn->snd_una = ack;
-                conn->state = TCP_STATE_ESTABLISHED;
-                tcp_send_segment(conn, TCP_ACK, 0, 0);
-            }
-            break;
-
-        case TCP_STATE_SYN_RECEIVED:
-            if (flags & TCP_ACK) {
-                conn->snd_una = ack;
-                conn->state = TCP_STATE_ESTABLISHED;
-            }
-            break;
-
-        case TCP_STATE_ESTABLISHED:
-            if (flags & TCP_FIN) {
-                conn->rcv_nxt = seq + payload_len + 1;
-                conn->state = TCP_STATE_CLOSE_WAIT;
-                tcp_send_segment(conn, TCP_ACK, 0, 0);
-            } else {
-                // Process incoming data
-                if (payload_len > 0 && seq == conn->rcv_nxt) {
-                    uint16_t space = TCP_RECV_BUF_SIZE - conn->recv_len;
-                    uint16_t to_copy = payload_len < space ? payload_len : space;
-                    tcp_memcpy(conn->recv_buf + conn->recv_len, payload, to_copy);
-                    conn->recv_len += to_copy;
-                    conn->rcv_nxt += to_copy;
-
-                    // Send ACK
-                    tcp_send_segment(conn, TCP_ACK, 0, 0);
-                }
-                if (flags & TCP_ACK) {
-                    conn->snd_una = ack;
-                }
-            }
-            break;
-
-        case TCP_STATE_FIN_WAIT_1:
-            if (flags & TCP_ACK) {
-                conn->snd_una = ack;
-                if (flags & TCP_FIN) {
-                    conn->rcv_nxt = seq + 1;
-                    conn->state = TCP_STATE_TIME_WAIT;
-                    tcp_send_segment(conn, TCP_ACK, 0, 0);
-                } else {
-                    conn->state = TCP_STATE_FIN_WAIT_2;
-                }
+                conn->snd_wnd = wnd;    // Never scaled in a SYN
+                if (opts.has_ts && opts.tsecr) tcp_rtt_sample(conn, (uint32_t)tcp_now_ms() - opts.tsecr);
+                conn->rto_ms = tcp_rto_calc(conn);
+                conn->rto_deadline = 0;
+                conn->retransmit_count = 0;
+                tcp_set_state(conn, TCP_STATE_ESTABLISHED);
+                tcp_send_ack(conn);
             }
             break;
 
-        case TCP_STATE_FIN_WAIT_2:
-            if (flags & TCP_FIN) {
-                conn->rcv_nxt = seq + 1;
-                conn->state = TCP_STATE_TIME_WAIT;
-                tcp_send_segment(conn, TCP_ACK, 0, 0);
-            }
-            break;
-
-        case TCP_STATE_CLOSE_WAIT:
-            // Waiting for application to close
-            break;
-
-        case TCP_STATE_LAST_ACK:
-            if (flags & TCP_ACK) {
-                conn->state = TCP_STATE_CLOSED;
-                conn->active = 0;
-            }
+        case TCP_STATE_CLOSED:
             break;
 
         case TCP_STATE_TIME_WAIT:
             // Would set timer to clean up
-            conn->state = TCP_STATE_CLOSED;
-            conn->active = 0;
+            tcp_free_conn(conn);
             break;
 
         default:
+            tcp_segment(conn, seq, ack, flags, wnd, &opts, payload, payload_len);
             break;
     }
+
+    // New data, freed send space, FIN or a state change: let blocked
+    // readers and writers re-check
+    tcp_notify(conn);
 }
 
 void tcp_timer(void) {
-    for (int i = 0; i < TCP_MAX_CONNECTIONS; i++) {
-        if (!connections[i].active) continue;
+    uint64_t now = tcp_now_ms();
+    tcp_syn_timer(now);
+    for (int i = 0; i < tcb_high; i++) {
+        tcp_connection_t* conn = tcp_conn(i);
+        if (!conn->active) continue;
 
         // Clean up TIME_WAIT connections
-        if (connections[i].state == TCP_STATE_TIME_WAIT) {
-            connections[i].state = TCP_STATE_CLOSED;
-            connections[i].active = 0;
+        if (conn->state == TCP_STATE_TIME_WAIT) {
+            tcp_free_conn(conn);
+            tcp_notify(conn);
+            continue;
+        }
+        if (conn->rto_deadline && now >= conn->rto_deadline) {
+            tcp_timeout(conn);
+            tcp_notify(conn);
         }
     }
 }
 
 int tcp_get_state(int conn_id) {
-    if (conn_id < 0 || conn_id >= TCP_MAX_CONNECTIONS) return TCP_STATE_CLOSED;
-    return connections[conn_id].state;
+    tcp_connection_t* conn = tcp_conn(conn_id);
+    return conn ? conn->state : TCP_STATE_CLOSED;
 }
 
 int tcp_data_available(int conn_id) {
-    if (conn_id < 0 || conn_id >= TCP_MAX_CONNECTIONS) return 0;
-    tcp_connection_t* conn = &connections[conn_id];
-    if (!conn->active) return 0;
-    return conn->recv_len - conn->recv_read_pos;
+    tcp_connection_t* conn = tcp_conn_active(conn_id);
+    if (!conn) return 0;
+    return (int)conn->rcv_len;
+}
+
+waitq_t* tcp_get_waitq(int conn_id) {
+    tcp_connection_t* conn = tcp_conn(conn_id);
+    return conn ? &conn->waitq : (waitq_t*)0;
+}
+
+pollsrc_t* tcp_get_pollsrc(int conn_id) {
+    tcp_connection_t* conn = tcp_conn(conn_id);
+    return conn ? &conn->pollsrc : (pollsrc_t*)0;
 }
 
 const char* tcp_state_name(int state) {
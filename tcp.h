@@ -1,8 +1,15 @@
 // tcp.h - TCP Transport Layer for Alteo OS
+// Connections keep many segments in flight: data waits in a per-connection
+// send ring until acknowledged, bounded by the peer's window and a
+// congestion window. Window scaling, timestamps and SACK are used when the
+// peer's SYN offers them, and both rings grow while they limit a transfer.
 #ifndef TCP_H
 #define TCP_H
 
 #include "stdint.h"
+#include "waitq.h"
+#include "epoll.h"
+#include "tcp_cc.h"
 
 // TCP flags
 #define TCP_FIN     0x01
@@ -27,13 +34,36 @@
 
 // TCP constants
 #define TCP_HEADER_LEN      20      // Minimum header size
-#define TCP_WINDOW_SIZE     8192    // Default window size
+#define TCP_OPTIONS_MAX     40      // Option bytes a header can carry
 #define TCP_MAX_SEGMENT     1460    // MSS for Ethernet
-#define TCP_MAX_CONNECTIONS 16      // Max simultaneous connections
-#define TCP_SEND_BUF_SIZE  4096    // Send buffer per connection
-#define TCP_RECV_BUF_SIZE  4096    // Receive buffer per connection
-#define TCP_RETRANSMIT_MS  1000    // Retransmit timeout
-#define TCP_MAX_RETRIES    5       // Max retransmit attempts
+#define TCP_DEFAULT_MSS     536     // Assumed when the peer's SYN names none
+#define TCP_TSO_MAX         (44 * TCP_MAX_SEGMENT)  // Payload per TSO frame (< 64KB)
+#define TCP_MAX_CONNECTIONS 4096    // Max simultaneous connections
+#define TCP_CONN_SLAB       8       // TCBs allocated together as the table grows
+#define TCP_HASH_SIZE       1024    // 4-tuple buckets (power of two)
+#define TCP_LISTEN_HASH_SIZE 64     // Listener buckets by port (power of two)
+#define TCP_SYN_QUEUE_MAX   256     // Half-open connections, all listeners together
+#define TCP_SYN_HASH_SIZE   256     // Their buckets (power of two)
+#define TCP_SYN_RETRIES     5       // SYN-ACK resends before a request is dropped
+#define TCP_BACKLOG_MAX     128     // Cap on a listener's backlog
+#define TCP_BUF_MIN         16384   // Send/receive ring to start with (power of two)
+#define TCP_BUF_MAX         (1024 * 1024)  // Auto-tuning stops here
+#define TCP_WSCALE          5       // Our window shift (TCP_BUF_MAX >> 5 fits 16 bits)
+#define TCP_INIT_CWND       10      // Initial congestion window, in segments
+#define TCP_SACK_BLOCKS     4       // Ranges kept for SACK, each way
+#define TCP_RTO_INIT_MS     1000    // Retransmit timeout before an RTT sample
+#define TCP_RTO_MIN_MS      200
+#define TCP_RTO_MAX_MS      60000
+#define TCP_MAX_RETRIES     8       // Timeouts in a row before giving up
+
+// TCP options
+#define TCPOPT_EOL          0
+#define TCPOPT_NOP          1
+#define TCPOPT_MSS          2
+#define TCPOPT_WSCALE       3
+#define TCPOPT_SACK_PERM    4
+#define TCPOPT_SACK         5
+#define TCPOPT_TIMESTAMP    8
 
 // TCP header
 typedef struct __attribute__((packed)) {
@@ -57,8 +87,14 @@ typedef struct __attribute__((packed)) {
     uint16_t tcp_length;
 } tcp_pseudo_header_t;
 
-// TCP connection (TCB - Transmission Control Block)
+// A sequence range [start, end)
 typedef struct {
+    uint32_t start;
+    uint32_t end;
+} tcp_range_t;
+
+// TCP connection (TCB - Transmission Control Block)
+typedef struct tcp_connection {
     int      state;             // Connection state
     uint32_t local_ip;          // Local IP
     uint16_t local_port;        // Local port
@@ -68,42 +104,137 @@ typedef struct {
     // Sequence numbers
     uint32_t snd_una;           // Send unacknowledged
     uint32_t snd_nxt;           // Send next
-    uint32_t snd_wnd;           // Send window
+    uint32_t snd_max;           // Highest sequence sent (snd_nxt rewinds on timeout)
+    uint32_t snd_wnd;           // Peer's window, scaled
     uint32_t rcv_nxt;           // Receive next
-    uint32_t rcv_wnd;           // Receive window
+    uint32_t rcv_adv;           // Right edge of the window last advertised
     uint32_t iss;               // Initial send sequence
 
-    // Buffers
-    uint8_t  send_buf[TCP_SEND_BUF_SIZE];
-    uint16_t send_len;
-    uint8_t  recv_buf[TCP_RECV_BUF_SIZE];
-    uint16_t recv_len;
-    uint16_t recv_read_pos;     // Read position in recv buffer
+    // Negotiated in the SYNs (RFC 7323, RFC 2018)
+    uint16_t mss;               // Peer's MSS
+    uint8_t  snd_wscale;        // Shift applied to the peer's window field
+    uint8_t  rcv_wscale;        // Shift applied to ours
+    uint8_t  ts_ok;             // Timestamps on every segment
+    uint8_t  sack_ok;
+    uint32_t ts_recent;         // Peer's timestamp to echo
+
+    // Send ring: bytes from snd_una on, until acknowledged. The NIC reads
+    // segments straight out of it.
+    uint8_t* snd_buf;
+    uint32_t snd_size;          // Power of two
+    uint32_t snd_head;          // Ring offset of snd_una
+    uint32_t snd_len;           // Bytes queued (sent or not)
+    uint8_t  fin_pending;       // Close requested: FIN follows the data
+    uint8_t  fin_sent;
+    tcp_range_t sacked[TCP_SACK_BLOCKS];  // Peer holds these beyond snd_una
+    int      sack_count;
 
-    // Retransmission
-    uint32_t retransmit_time;   // When to retransmit
-    int      retransmit_count;  // Retry counter
+    // Receive ring: readable bytes, then out-of-order data at its offset
+    uint8_t* rcv_buf;
+    uint32_t rcv_size;          // Power of two
+    uint32_t rcv_head;          // Ring offset of the next byte to read
+    uint32_t rcv_len;           // Readable bytes (they end at rcv_nxt)
+    tcp_range_t ooo[TCP_SACK_BLOCKS];     // Held beyond rcv_nxt, newest first
+    int      ooo_count;
+    uint32_t rcv_mark;          // Auto-tuning: rcv_nxt when the current RTT began
+    uint64_t rcv_mark_ms;
+
+    // Congestion control (RFC 5681, the module in tcp_cc.c) and
+    // retransmission (RFC 6298)
+    const tcp_cc_ops_t* cc;
+    uint64_t cc_data[4];        // Private to the module
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;           // snd_max when fast recovery began
+    int      dupacks;           // >= 3 while in fast recovery
+    uint32_t srtt_ms;           // 0 until the first sample
+    uint32_t rttvar_ms;
+    uint32_t rto_ms;
+    uint64_t rto_deadline;      // Milliseconds; 0 when nothing is timed
+    int      retransmit_count;  // Timeouts in a row
 
     int      active;            // Slot in use
+
+    // Lookup: connected TCBs hash by 4-tuple, listeners by port; free TCBs
+    // are chained through hash_next too
+    int      id;                // Connection id (index in the TCB table)
+    int      hash_next;
+    uint8_t  hashed;            // Which table it is linked on
+    int      listener;          // Listener whose SYN created it, or -1
+    int      accept_next;       // Next on the listener's accept queue
+    uint8_t  queued;            // On the listener's accept queue
+    int      accept_head;       // Listener: established, not yet accepted
+    int      accept_tail;
+    int      accept_count;
+    int      syn_count;         // Listener: half-open requests
+    int      backlog;           // Bound on each of the two
+
+    // Readers, and accept() on a listener, sleep here until a segment
+    // changes the connection (data, state change, new child established)
+    waitq_t  waitq;
+    pollsrc_t pollsrc;          // epoll registrations, notified alongside waitq
 } tcp_connection_t;
 
+// Counters for /proc/net/snmp and /proc/net/netstat
+typedef struct {
+    uint64_t active_opens;
+    uint64_t passive_opens;
+    uint64_t aborts;            // Reset, or the peer stopped answering
+    uint64_t in_segs;
+    uint64_t in_errs;           // Malformed
+    uint64_t no_conn;           // No connection or listener for it
+    uint64_t out_segs;          // Frames (one TSO frame counts once)
+    uint64_t retrans_segs;
+    uint64_t fast_retrans;      // Recoveries entered on three duplicate ACKs
+    uint64_t timeouts;          // Retransmit timer expiries
+    uint64_t ofo_segs;          // Held past a gap
+    uint64_t rcv_pruned;        // Data past the receive window, dropped
+    uint64_t syncookies_sent;   // SYN queue full: answered with a cookie
+    uint64_t accept_overflows;  // Handshakes refused, accept queue full
+    uint64_t rtt_samples;
+    uint64_t rtt_sum_ms;
+} tcp_stats_t;
+
 // Initialize TCP layer
 void tcp_init(void);
 
+void tcp_get_stats(tcp_stats_t* out);
+
 // Create a new TCP connection (returns connection ID or -1)
 int  tcp_connect(uint32_t remote_ip, uint16_t remote_port);
 
-// Listen on a port (returns connection ID or -1)
-int  tcp_listen(uint16_t port);
+// Listen on a port (returns connection ID or -1). Up to 'backlog'
+// handshakes may be in progress and as many connections wait for
+// accept(); past that, SYNs are answered with SYN cookies and no state is
+// kept until the handshake completes.
+int  tcp_listen(uint16_t port, int backlog);
 
-// Accept incoming connection on listening socket
+// Take the oldest established connection off a listener's accept queue
+// (-1 if none)
 int  tcp_accept(int listen_id);
 
-// Send data on a connection
-int  tcp_send(int conn_id, const uint8_t* data, uint16_t length);
+// Whether tcp_accept() would return a connection
+int  tcp_accept_ready(int listen_id);
+
+// Queue data on a connection and send what the windows allow. Returns the
+// bytes taken (fewer than length when the send ring is full, 0 if it is)
+// or -1 if the connection cannot send.
+int  tcp_send(int conn_id, const uint8_t* data, uint32_t length);
+
+// Queue data without sending it yet; tcp_push() sends. Lets a caller
+// gather several pieces into full segments.
+int  tcp_queue(int conn_id, const uint8_t* data, uint32_t length);
+void tcp_push(int conn_id);
+
+// Room in the send ring (-1 if the connection cannot send)
+int  tcp_send_space(int conn_id);
+
+// Choose the congestion control module of a connection ("newreno",
+// "cubic"). Returns 0, or -1 if the connection or module is unknown.
+int  tcp_set_congestion(int conn_id, const char* name);
 
 // Receive data from a connection (returns bytes received)
-int  tcp_recv(int conn_id, uint8_t* buffer, uint16_t max_len);
+int  tcp_recv(int conn_id, uint8_t* buffer, uint32_t max_len);
 
 // Close a connection gracefully
 void tcp_close(int conn_id);
@@ -120,6 +251,12 @@ int  tcp_get_state(int conn_id);
 // Check if data is available to read
 int  tcp_data_available(int conn_id);
 
+// Wait queue woken whenever the connection's data or state changes
+waitq_t* tcp_get_waitq(int conn_id);
+
+// Event source notified at the same points as the wait queue
+pollsrc_t* tcp_get_pollsrc(int conn_id);
+
 // Get connection info for debugging
 const char* tcp_state_name(int state);
 
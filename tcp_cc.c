@@ -0,0 +1,157 @@
+// tcp_cc.c - TCP Congestion Control for Alteo OS
+// cwnd and ssthresh are in bytes throughout; modules keep their own state
+// in the connection's cc_data.
+#include "tcp_cc.h"
+#include "tcp.h"
+#include "klib.h"
+#include "timer.h"
+
+static const tcp_cc_ops_t* modules[TCP_CC_MAX];
+static int module_count = 0;
+static const tcp_cc_ops_t* default_cc = 0;
+
+static int cc_name_eq(const char* a, const char* b) {
+    while (*a && *a == *b) { a++; b++; }
+    return *a == *b;
+}
+
+// ---- NewReno (RFC 5681) ----
+
+// One segment per round trip: each ACK adds its share of a segment
+static void reno_cong_avoid(tcp_connection_t* conn, uint32_t acked, uint32_t seg) {
+    uint32_t step = (uint32_t)((uint64_t)seg * acked / conn->cwnd);
+    conn->cwnd += step ? step : 1;
+}
+
+// Half of what was in flight
+static uint32_t reno_ssthresh(tcp_connection_t* conn, uint32_t seg) {
+    uint32_t flight = conn->snd_max - conn->snd_una;
+    return flight / 2 > 2 * seg ? flight / 2 : 2 * seg;
+}
+
+static const tcp_cc_ops_t newreno_ops = {
+    .name = "newreno",
+    .init = 0,
+    .cong_avoid = reno_cong_avoid,
+    .ssthresh = reno_ssthresh,
+};
+
+// ---- CUBIC (RFC 8312) ----
+
+// After a loss cwnd follows W(t) = C (t - K)^3 + W_max from the start of
+// the epoch: a concave climb back to the window where the loss happened,
+// a plateau around it, then a convex probe beyond. C = 0.4 segments/s^3,
+// beta = 0.7. Where plain Reno would be faster (short RTTs), cwnd follows
+// Reno's estimate instead.
+
+typedef struct {
+    uint32_t w_max;             // cwnd just before the last loss
+    uint32_t origin;            // Plateau of the current curve
+    uint32_t k_ms;              // Epoch start to the plateau
+    uint32_t epoch_ms;          // Start of the current epoch, 0 if none yet
+} cubic_t;
+
+// Integer cube root
+static uint32_t cubic_cbrt(uint64_t x) {
+    uint64_t r = 0;
+    for (int s = 63; s >= 0; s -= 3) {
+        r <<= 1;
+        uint64_t b = 3 * r * (r + 1) + 1;
+        if ((x >> s) >= b) {
+            x -= b << s;
+            r++;
+        }
+    }
+    return (uint32_t)r;
+}
+
+static void cubic_init(tcp_connection_t* conn) {
+    memset(conn->cc_data, 0, sizeof(cubic_t));
+}
+
+static void cubic_cong_avoid(tcp_connection_t* conn, uint32_t acked, uint32_t seg) {
+    cubic_t* c = (cubic_t*)conn->cc_data;
+    uint32_t now = (uint32_t)(timer_now_ns() / 1000000ULL);
+    if (!c->epoch_ms) {
+        c->epoch_ms = now ? now : 1;
+        if (conn->cwnd < c->w_max) {
+            // K = cbrt((W_max - cwnd) / C), in ms: segments * 1e9 / 0.4
+            c->k_ms = cubic_cbrt((uint64_t)((c->w_max - conn->cwnd) / seg) * 2500000000ULL);
+            c->origin = c->w_max;
+        } else {
+            c->k_ms = 0;
+            c->origin = conn->cwnd;
+        }
+    }
+
+    // Aim for W one RTT from now
+    uint32_t rtt = conn->srtt_ms ? conn->srtt_ms : TCP_RTO_MIN_MS;
+    int64_t t = (int64_t)(uint32_t)(now - c->epoch_ms) + rtt;
+    int64_t d = t - (int64_t)c->k_ms;
+    if (d > 100000) d = 100000;
+    if (d < -100000) d = -100000;
+    int64_t target = (int64_t)c->origin + d * d * d * seg * 4 / 10000000000LL;
+
+    // Reno's window over the same time (RFC 8312 4.2)
+    int64_t est = (int64_t)c->w_max * 7 / 10 + t * seg * 529 / (1000LL * rtt);
+    if (est > target) target = est;
+
+    // At most 1.5x per round trip
+    int64_t cap = (int64_t)conn->cwnd * 3 / 2;
+    if (target > cap) target = cap;
+    if (target > conn->cwnd) {
+        uint32_t inc = (uint32_t)((target - conn->cwnd) * acked / conn->cwnd);
+        conn->cwnd += inc ? inc : 1;
+    }
+}
+
+static uint32_t cubic_ssthresh(tcp_connection_t* conn, uint32_t seg) {
+    cubic_t* c = (cubic_t*)conn->cc_data;
+    // Fast convergence: losing again below the last W_max, give up some
+    // bandwidth to newer flows
+    if (conn->cwnd < c->w_max) c->w_max = conn->cwnd * 17 / 20;
+    else c->w_max = conn->cwnd;
+    c->epoch_ms = 0;
+    uint32_t th = conn->cwnd * 7 / 10;
+    return th > 2 * seg ? th : 2 * seg;
+}
+
+static const tcp_cc_ops_t cubic_ops = {
+    .name = "cubic",
+    .init = cubic_init,
+    .cong_avoid = cubic_cong_avoid,
+    .ssthresh = cubic_ssthresh,
+};
+
+// ---- Registry ----
+
+void tcp_cc_init(void) {
+    module_count = 0;
+    tcp_cc_register(&newreno_ops);
+    tcp_cc_register(&cubic_ops);
+    default_cc = &cubic_ops;
+}
+
+int tcp_cc_register(const tcp_cc_ops_t* ops) {
+    if (module_count >= TCP_CC_MAX || tcp_cc_find(ops->name)) return -1;
+    modules[module_count++] = ops;
+    return 0;
+}
+
+const tcp_cc_ops_t* tcp_cc_find(const char* name) {
+    for (int i = 0; i < module_count; i++) {
+        if (cc_name_eq(modules[i]->name, name)) return modules[i];
+    }
+    return (const tcp_cc_ops_t*)0;
+}
+
+int tcp_cc_set_default(const char* name) {
+    const tcp_cc_ops_t* ops = tcp_cc_find(name);
+    if (!ops) return -1;
+    default_cc = ops;
+    return 0;
+}
+
+const tcp_cc_ops_t* tcp_cc_default(void) {
+    return default_cc ? default_cc : &newreno_ops;
+}
@@ -0,0 +1,41 @@
+// tcp_cc.h - TCP Congestion Control for Alteo OS
+// tcp.c runs slow start, fast retransmit/recovery and the retransmit
+// timer itself; a congestion control module decides how cwnd grows once
+// past ssthresh and where ssthresh goes after a loss. NewReno (RFC 5681)
+// and CUBIC (RFC 8312) are built in, CUBIC being the default. A
+// connection keeps the module it was opened with.
+#ifndef TCP_CC_H
+#define TCP_CC_H
+
+#include "stdint.h"
+
+#define TCP_CC_MAX      8       // Modules that can be registered
+
+struct tcp_connection;
+
+typedef struct tcp_cc_ops {
+    const char* name;
+    // Connection established, cwnd at its initial value. Optional.
+    void (*init)(struct tcp_connection* conn);
+    // New data acknowledged while cwnd >= ssthresh: grow cwnd. 'seg' is
+    // the connection's segment size.
+    void (*cong_avoid)(struct tcp_connection* conn, uint32_t acked, uint32_t seg);
+    // Loss seen (three duplicate ACKs or a timeout): return the new
+    // ssthresh. tcp.c sets cwnd from it.
+    uint32_t (*ssthresh)(struct tcp_connection* conn, uint32_t seg);
+} tcp_cc_ops_t;
+
+// Register the built-in modules (from tcp_init)
+void tcp_cc_init(void);
+
+// Add a module. Returns 0, or -1 if the table is full or the name taken.
+int tcp_cc_register(const tcp_cc_ops_t* ops);
+
+// Module by name, or 0
+const tcp_cc_ops_t* tcp_cc_find(const char* name);
+
+// Module for connections opened from now on. Returns 0, or -1 if unknown.
+int tcp_cc_set_default(const char* name);
+const tcp_cc_ops_t* tcp_cc_default(void);
+
+#endif
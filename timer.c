@@ -0,0 +1,217 @@
+// timer.c - High-resolution Timers for Alteo OS
+// Events live in a fixed pool and are ordered by deadline in a binary
+// min-heap of pool indices. After every change to the earliest deadline
+// the LAPIC timer is re-armed for exactly that moment; with no events
+// pending it is stopped.
+#include "timer.h"
+#include "apic.h"
+#include "irq.h"
+#include "spinlock.h"
+#include "smp.h"
+
+typedef struct {
+    uint64_t   deadline;     // timer_now_ns() value to fire at
+    timer_fn_t fn;
+    uint64_t   arg;
+    int        heap_pos;     // Index in heap[], -1 when free
+    uint32_t   gen;          // Bumped on every reuse (stale ids fail to cancel)
+} timer_event_t;
+
+static timer_event_t events[TIMER_MAX_EVENTS];
+static int heap[TIMER_MAX_EVENTS];           // Event indices, earliest deadline first
+static int heap_size = 0;
+static lockstat_t timer_lock_stat = LOCKSTAT_INIT("timer");
+static spinlock_t timer_lock = SPINLOCK_INIT_STAT(timer_lock_stat);
+
+static int timer_active = 0;
+static int timer_hw = 0;                     // LAPIC timer drives expiry
+static uint64_t tsc_base = 0;
+static uint64_t tsc_hz = 0;
+static registers_t* irq_frame[SMP_MAX_CPUS];  // Set while timer_irq runs events
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// ---------- Clock ----------
+
+uint64_t timer_now_ns(void) {
+    if (!timer_active) return 0;
+    uint64_t d = rdtsc() - tsc_base;
+    return (d / tsc_hz) * TIMER_NS_PER_SEC + (d % tsc_hz) * TIMER_NS_PER_SEC / tsc_hz;
+}
+
+uint64_t timer_ticks(void) {
+    return timer_now_ns() / TIMER_TICK_NS;
+}
+
+void timer_get_tsc(uint64_t* base, uint64_t* hz) {
+    *base = timer_active ? tsc_base : 0;
+    *hz = timer_active ? tsc_hz : 0;
+}
+
+int timer_is_active(void) {
+    return timer_active;
+}
+
+// ---------- Heap (timer_lock held) ----------
+
+static void heap_swap(int a, int b) {
+    int t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    events[heap[a]].heap_pos = a;
+    events[heap[b]].heap_pos = b;
+}
+
+static void heap_up(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (events[heap[parent]].deadline <= events[heap[i]].deadline) break;
+        heap_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void heap_down(int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < heap_size && events[heap[l]].deadline < events[heap[min]].deadline) min = l;
+        if (r < heap_size && events[heap[r]].deadline < events[heap[min]].deadline) min = r;
+        if (min == i) break;
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+static void heap_remove(int pos) {
+    int ev = heap[pos];
+    heap_size--;
+    if (pos != heap_size) {
+        heap[pos] = heap[heap_size];
+        events[heap[pos]].heap_pos = pos;
+        heap_up(pos);
+        heap_down(events[heap[pos]].heap_pos);
+    }
+    events[ev].heap_pos = -1;
+}
+
+// Arm the LAPIC for the earliest deadline, or stop it (tickless idle)
+static void timer_program(void) {
+    if (!timer_hw) return;
+    if (heap_size == 0) {
+        lapic_timer_stop();
+        return;
+    }
+    uint64_t now = timer_now_ns();
+    uint64_t when = events[heap[0]].deadline;
+    lapic_timer_arm(when > now ? when - now : 0);
+}
+
+// ---------- Events ----------
+
+int timer_add(uint64_t deadline_ns, timer_fn_t fn, uint64_t arg) {
+    if (!fn) return -1;
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+    int ev = -1;
+    for (int i = 0; i < TIMER_MAX_EVENTS; i++) {
+        if (events[i].heap_pos < 0) { ev = i; break; }
+    }
+    if (ev < 0) {
+        spin_unlock_irqrestore(&timer_lock, flags);
+        return -1;
+    }
+
+    events[ev].deadline = deadline_ns;
+    events[ev].fn = fn;
+    events[ev].arg = arg;
+    events[ev].gen++;
+    heap[heap_size] = ev;
+    events[ev].heap_pos = heap_size++;
+    heap_up(events[ev].heap_pos);
+
+    if (heap[0] == ev) timer_program();   // New earliest deadline
+    int id = (int)((events[ev].gen & 0x7FFFFF) * TIMER_MAX_EVENTS) + ev;
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return id;
+}
+
+int timer_cancel(int id) {
+    if (id < 0) return -1;
+    int ev = id % TIMER_MAX_EVENTS;
+    uint32_t gen = (uint32_t)(id / TIMER_MAX_EVENTS);
+
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+    if (events[ev].heap_pos < 0 || (events[ev].gen & 0x7FFFFF) != gen) {
+        spin_unlock_irqrestore(&timer_lock, flags);
+        return -1;
+    }
+    int was_first = events[ev].heap_pos == 0;
+    heap_remove(events[ev].heap_pos);
+    if (was_first) timer_program();
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return 0;
+}
+
+uint64_t timer_next_deadline(void) {
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+    uint64_t next = heap_size ? events[heap[0]].deadline : ~0ULL;
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return next;
+}
+
+// Pop and run every expired event, then re-arm for the next one
+void timer_poll(void) {
+    if (!timer_active) return;
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+    while (heap_size && events[heap[0]].deadline <= timer_now_ns()) {
+        int ev = heap[0];
+        timer_fn_t fn = events[ev].fn;
+        uint64_t arg = events[ev].arg;
+        heap_remove(0);
+
+        spin_unlock_irqrestore(&timer_lock, flags);
+        fn(arg);
+        flags = spin_lock_irqsave(&timer_lock);
+    }
+    timer_program();
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+// APIC_TIMER_VECTOR (irq_handler sends the EOI)
+static void timer_irq(registers_t* regs) {
+    int cpu = smp_cpu_id();
+    irq_frame[cpu] = regs;
+    timer_poll();
+    irq_frame[cpu] = 0;
+}
+
+registers_t* timer_irq_frame(void) {
+    return irq_frame[smp_cpu_id()];
+}
+
+// ---------- Init ----------
+
+void timer_init(void) {
+    for (int i = 0; i < TIMER_MAX_EVENTS; i++) {
+        events[i].heap_pos = -1;
+        events[i].gen = 0;
+    }
+    heap_size = 0;
+
+    lapic_timer_calibrate();
+    tsc_hz = lapic_tsc_hz();
+    if (!tsc_hz) return;
+    tsc_base = rdtsc();
+    timer_active = 1;
+
+    if (apic_is_active()) {
+        // The LAPIC timer replaces the PIT on vector 0x20: no periodic IRQ0
+        ioapic_mask_irq(0);
+        irq_install_handler(0, timer_irq);
+        lapic_timer_stop();
+        timer_hw = 1;
+    }
+}
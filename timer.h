@@ -0,0 +1,56 @@
+// timer.h - High-resolution Timers for Alteo OS
+// Nanosecond clock from the TSC plus a min-heap of one-shot deadlines.
+// The BSP's LAPIC timer is programmed for the earliest deadline only, so
+// an idle system takes no periodic timer interrupts (tickless).
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "stdint.h"
+#include "isr.h"
+
+// Length of a scheduler tick; tick counts (sleep, uptime) derive from the clock
+#define TIMER_TICK_NS      10000000ULL   // 10ms = 100Hz
+#define TIMER_NS_PER_SEC   1000000000ULL
+
+// Maximum pending timer events
+#define TIMER_MAX_EVENTS   128
+
+// Event callback; runs in interrupt context (or from timer_poll) with the
+// timer lock released
+typedef void (*timer_fn_t)(uint64_t arg);
+
+// Calibrate the clock and take over the timer vector (BSP, after apic_init).
+// Masks the PIT interrupt when the LAPIC timer is available.
+void timer_init(void);
+
+// 1 once timer_init has calibrated the clock
+int timer_is_active(void);
+
+// Nanoseconds since timer_init
+uint64_t timer_now_ns(void);
+
+// Scheduler ticks since timer_init (timer_now_ns / TIMER_TICK_NS)
+uint64_t timer_ticks(void);
+
+// TSC value at timer_init and TSC frequency behind timer_now_ns (both 0
+// until the clock runs)
+void timer_get_tsc(uint64_t* base, uint64_t* hz);
+
+// Call fn(arg) once timer_now_ns() >= deadline_ns.
+// Returns an event id for timer_cancel, or -1 if the event table is full.
+int timer_add(uint64_t deadline_ns, timer_fn_t fn, uint64_t arg);
+
+// Remove a pending event. Returns 0, or -1 if it already fired or is unknown.
+int timer_cancel(int id);
+
+// Run expired events (for callers polling without a timer interrupt)
+void timer_poll(void);
+
+// Earliest pending deadline, or ~0ULL if none
+uint64_t timer_next_deadline(void);
+
+// For an event callback: the register frame the timer interrupt it runs
+// from interrupted on this CPU, or 0 when run by timer_poll() elsewhere
+registers_t* timer_irq_frame(void);
+
+#endif
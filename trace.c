@@ -0,0 +1,169 @@
+// trace.c - Kernel Tracepoints for Alteo OS
+#include "trace.h"
+#include "klib.h"
+#include "heap.h"
+#include "smp.h"
+#include "timer.h"
+#include "spinlock.h"
+#include "devfs.h"
+#include "epoll.h"
+
+typedef struct {
+    volatile uint64_t head;     // Slots claimed (only this CPU writes it)
+    uint64_t tail;              // Events consumed (readers, under read_lock)
+    uint64_t lost;              // Overwritten before being read
+    trace_event_t* ring;        // Allocated on the first enable
+} __attribute__((aligned(64))) trace_cpu_t;
+
+volatile uint32_t trace_mask = 0;
+static trace_cpu_t trace_cpus[SMP_MAX_CPUS];
+static spinlock_t read_lock = SPINLOCK_INIT;    // Readers only
+
+void trace_emit(uint32_t event, uint64_t arg0, uint32_t arg1) {
+    smp_percpu_t* pc = smp_this_cpu();
+    trace_cpu_t* tc = &trace_cpus[pc->cpu];
+    if (!tc->ring) return;
+
+    // Without a lock prefix xadd is still one instruction, so an interrupt
+    // tracing on this CPU claims the next slot, not the same one
+    uint64_t pos = 1;
+    __asm__ volatile("xaddq %0, %1" : "+r"(pos), "+m"(tc->head) :: "memory");
+
+    trace_event_t* e = &tc->ring[pos & (TRACE_RING_EVENTS - 1)];
+    e->seq = 0;
+    __asm__ volatile("" ::: "memory");
+    e->tsc = lock_tsc();
+    e->event = (uint16_t)event;
+    e->cpu = (uint8_t)pc->cpu;
+    e->reserved = 0;
+    e->pid = pc->pid;
+    e->arg1 = arg1;
+    e->arg0 = arg0;
+    __asm__ volatile("" ::: "memory");
+    e->seq = (uint32_t)(pos + 1);
+}
+
+int trace_set_mask(uint32_t mask) {
+    mask &= TRACE_ALL;
+    if (mask) {
+        for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            if (trace_cpus[cpu].ring || (cpu > 0 && !smp_cpu_online(cpu))) continue;
+            trace_event_t* ring = (trace_event_t*)kmalloc(TRACE_RING_EVENTS * sizeof(trace_event_t));
+            if (!ring) return -1;
+            memset(ring, 0, TRACE_RING_EVENTS * sizeof(trace_event_t));
+            trace_cpus[cpu].ring = ring;
+        }
+    }
+    trace_mask = mask;
+    return 0;
+}
+
+// Move the committed events of one CPU to dst, oldest first, and return
+// how many. A slot whose sequence number changed while it was copied was
+// being rewritten; one not yet committed ends the batch (its writer was
+// interrupted and will finish) unless the ring has lapped it.
+static uint32_t trace_drain(trace_cpu_t* tc, uint8_t* dst, uint32_t max) {
+    uint64_t head = tc->head;
+    if (head - tc->tail > TRACE_RING_EVENTS) {
+        tc->lost += head - TRACE_RING_EVENTS - tc->tail;
+        tc->tail = head - TRACE_RING_EVENTS;
+    }
+
+    uint32_t n = 0;
+    while (n < max && tc->tail < head) {
+        volatile trace_event_t* e = &tc->ring[tc->tail & (TRACE_RING_EVENTS - 1)];
+        uint32_t want = (uint32_t)(tc->tail + 1);
+        uint32_t s1 = e->seq;
+        __asm__ volatile("" ::: "memory");
+        memcpy(dst + n * sizeof(trace_event_t), (const void*)e, sizeof(trace_event_t));
+        __asm__ volatile("" ::: "memory");
+        uint32_t s2 = e->seq;
+        if (s1 == want && s2 == want) {
+            n++;
+            tc->tail++;
+        } else if (tc->head - tc->tail >= TRACE_RING_EVENTS) {
+            tc->lost++;
+            tc->tail++;
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+// ---- /dev/trace ----
+
+static int trace_dev_read(void* data, void* buf, uint32_t count, uint32_t offset) {
+    (void)data;
+    uint8_t* dst = (uint8_t*)buf;
+    uint32_t done = 0;
+
+    uint64_t irq = spin_lock_irqsave(&read_lock);
+    if (offset < sizeof(trace_file_header_t)) {
+        trace_file_header_t fh;
+        memset(&fh, 0, sizeof(fh));
+        fh.magic = TRACE_MAGIC;
+        fh.version = 1;
+        fh.event_size = sizeof(trace_event_t);
+        timer_get_tsc(&fh.tsc_base, &fh.tsc_hz);
+        fh.cpus = (uint32_t)smp_cpu_count();
+        fh.mask = trace_mask;
+        for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) fh.lost += trace_cpus[cpu].lost;
+        uint32_t n = sizeof(fh) - offset;
+        if (n > count) n = count;
+        memcpy(dst, (const uint8_t*)&fh + offset, n);
+        done = n;
+    }
+
+    // Whole records only
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        trace_cpu_t* tc = &trace_cpus[cpu];
+        if (!tc->ring) continue;
+        uint32_t room = (count - done) / sizeof(trace_event_t);
+        if (room == 0) break;
+        done += trace_drain(tc, dst + done, room) * sizeof(trace_event_t);
+    }
+    spin_unlock_irqrestore(&read_lock, irq);
+    return (int)done;
+}
+
+// Event mask in decimal or 0x hex, or "all"; "0" stops tracing
+static int trace_dev_write(void* data, const void* buf, uint32_t count, uint32_t offset) {
+    (void)data; (void)offset;
+    const char* s = (const char*)buf;
+    if (count == 0) return 0;
+    uint32_t mask = 0;
+    if (count >= 3 && s[0] == 'a' && s[1] == 'l' && s[2] == 'l') {
+        mask = TRACE_ALL;
+    } else if (count >= 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        for (uint32_t i = 2; i < count; i++) {
+            char c = s[i];
+            uint32_t d;
+            if (c >= '0' && c <= '9') d = (uint32_t)(c - '0');
+            else if (c >= 'a' && c <= 'f') d = (uint32_t)(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') d = (uint32_t)(c - 'A' + 10);
+            else break;
+            mask = (mask << 4) | d;
+        }
+    } else if (s[0] >= '0' && s[0] <= '9') {
+        for (uint32_t i = 0; i < count && s[i] >= '0' && s[i] <= '9'; i++)
+            mask = mask * 10 + (uint32_t)(s[i] - '0');
+    } else {
+        return -1;
+    }
+    return trace_set_mask(mask) < 0 ? -1 : (int)count;
+}
+
+static uint32_t trace_dev_poll(void* data) {
+    (void)data;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (trace_cpus[cpu].head != trace_cpus[cpu].tail) return EPOLLIN | EPOLLOUT;
+    }
+    return EPOLLOUT;
+}
+
+void trace_init(void) {
+    dev_ops_t ops = { .read = trace_dev_read, .write = trace_dev_write, .ioctl = 0,
+                      .poll = trace_dev_poll, .dev_data = 0 };
+    devfs_register("trace", DEV_TYPE_CHAR, DEV_MAJOR_TRACE, 0, &ops);
+}
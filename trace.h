@@ -0,0 +1,85 @@
+// trace.h - Kernel Tracepoints for Alteo OS
+// Static tracepoints at context switches, syscall entry/exit, block cache
+// hits/misses/evictions, TCP state changes, page faults and compositor
+// frame phases. A disabled tracepoint costs one test of trace_mask; an
+// enabled one writes a TSC-stamped record into the calling CPU's ring.
+//
+// Each CPU only ever writes its own ring, so writers take no lock: a slot
+// is claimed with a single (interrupt-safe, unlocked) xadd and committed
+// by storing its sequence number last. The rings keep the newest events;
+// whatever a reader did not get to in time is overwritten and counted.
+//
+// /dev/trace reads out a trace_file_header_t followed by records, consumed
+// as they are read, CPU by CPU (sort by tsc to merge). Writing an event
+// mask (decimal or 0x hex, "all") to /dev/trace enables those events,
+// "0" disables tracing.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "stdint.h"
+
+#define TRACE_RING_EVENTS   4096        // Per CPU, power of two
+
+// Events (bit numbers in trace_mask)     arg0            arg1
+#define TRACE_SCHED_SWITCH  0           // next pid        prev pid
+#define TRACE_SYSCALL_ENTER 1           // first argument  number
+#define TRACE_SYSCALL_EXIT  2           // return value    number
+#define TRACE_CACHE_HIT     3           // page index      cache space
+#define TRACE_CACHE_MISS    4           // page index      cache space
+#define TRACE_CACHE_EVICT   5           // page index      cache space
+#define TRACE_TCP_STATE     6           // ports (l<<16|r) old << 8 | new
+#define TRACE_PAGE_FAULT    7           // address         error code
+#define TRACE_FRAME         8           // frame number    TRACE_FRAME_*
+#define TRACE_NUM_EVENTS    9
+
+#define TRACE_ALL           ((1U << TRACE_NUM_EVENTS) - 1)
+
+// Compositor frame phases
+#define TRACE_FRAME_BEGIN   0           // compositor_composite() entered
+#define TRACE_FRAME_FLIPPED 1           // Previous flip done, back buffer free
+#define TRACE_FRAME_DRAW    2           // Damage known, compositing starts
+#define TRACE_FRAME_DONE    3           // Frame composited
+#define TRACE_FRAME_PRESENT 4           // compositor_flip() presenting it
+
+typedef struct {
+    uint64_t tsc;
+    uint32_t seq;               // Ring position + 1, written last
+    uint16_t event;             // TRACE_*
+    uint8_t  cpu;
+    uint8_t  reserved;
+    int32_t  pid;               // Running on that CPU (-1 = idle)
+    uint32_t arg1;
+    uint64_t arg0;
+} trace_event_t;
+
+#define TRACE_MAGIC         0x45435254  // "TRCE"
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t event_size;        // sizeof(trace_event_t)
+    uint64_t tsc_hz;            // TSC frequency (0 if unknown)
+    uint64_t tsc_base;          // TSC at timer_now_ns() == 0
+    uint32_t cpus;
+    uint32_t mask;              // Events enabled
+    uint64_t lost;              // Overwritten before being read, all CPUs
+} trace_file_header_t;
+
+// Enabled events; tested inline by TRACE()
+extern volatile uint32_t trace_mask;
+
+void trace_emit(uint32_t event, uint64_t arg0, uint32_t arg1);
+
+#define TRACE(ev, a0, a1) do {                                          \
+    if (__builtin_expect(trace_mask & (1U << (ev)), 0))                 \
+        trace_emit((ev), (uint64_t)(a0), (uint32_t)(a1));               \
+} while (0)
+
+// Register /dev/trace (after devfs_init)
+void trace_init(void);
+
+// Enable the events in mask (0 disables). Returns 0, or -1 if the rings
+// cannot be allocated.
+int trace_set_mask(uint32_t mask);
+
+#endif
@@ -0,0 +1,240 @@
+// udp.c - UDP Transport Layer for Alteo OS
+#include "udp.h"
+#include "klib.h"
+#include "heap.h"
+#include "ip.h"
+#include "ethernet.h"
+
+typedef struct {
+    uint32_t src_ip;
+    uint16_t src_port;
+    uint16_t len;
+} udp_dgram_t;
+
+typedef struct {
+    int       active;
+    uint16_t  port;
+    int       hash_next;        // Next endpoint on the same port bucket
+    uint8_t*  ring;             // UDP_RCVQ_BYTES of payload
+    uint32_t  ring_head;        // Offset of the oldest datagram's payload
+    uint32_t  ring_used;
+    udp_dgram_t q[UDP_RCVQ_MAX];
+    uint32_t  q_head;           // Oldest (free-running; masked on use)
+    uint32_t  q_tail;
+    uint32_t  drops;
+    waitq_t   waitq;
+    pollsrc_t pollsrc;
+} udp_endpoint_t;
+
+static udp_endpoint_t endpoints[UDP_MAX_ENDPOINTS];
+static int port_hash[UDP_HASH_SIZE];
+static uint16_t next_ephemeral_port = 49152;
+static udp_stats_t udp_stats;
+
+void udp_init(void) {
+    for (int i = 0; i < UDP_MAX_ENDPOINTS; i++) {
+        kfree(endpoints[i].ring);
+        endpoints[i].ring = (uint8_t*)0;
+        endpoints[i].active = 0;
+    }
+    for (int b = 0; b < UDP_HASH_SIZE; b++) port_hash[b] = -1;
+}
+
+static udp_endpoint_t* udp_ep(int id) {
+    if (id < 0 || id >= UDP_MAX_ENDPOINTS || !endpoints[id].active) return (udp_endpoint_t*)0;
+    return &endpoints[id];
+}
+
+static int udp_find(uint16_t port) {
+    for (int i = port_hash[port & (UDP_HASH_SIZE - 1)]; i >= 0; i = endpoints[i].hash_next) {
+        if (endpoints[i].port == port) return i;
+    }
+    return -1;
+}
+
+// Ones'-complement checksum over the pseudo-header, UDP header and payload
+static uint16_t udp_checksum(uint32_t src_ip, uint32_t dst_ip, const uint8_t* hdr,
+                             const uint8_t* payload, uint32_t payload_len) {
+    uint32_t sum = 0;
+    sum += (src_ip >> 16) & 0xFFFF;
+    sum += src_ip & 0xFFFF;
+    sum += (dst_ip >> 16) & 0xFFFF;
+    sum += dst_ip & 0xFFFF;
+    sum += htons(IP_PROTO_UDP);
+    sum += htons((uint16_t)(UDP_HEADER_LEN + payload_len));
+
+    const uint16_t* p = (const uint16_t*)hdr;
+    for (int i = 0; i < UDP_HEADER_LEN / 2; i++) sum += p[i];
+    p = (const uint16_t*)payload;
+    uint32_t n = payload_len;
+    while (n > 1) {
+        sum += *p++;
+        n -= 2;
+    }
+    if (n) sum += *(const uint8_t*)p;
+
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+int udp_open(uint16_t port) {
+    if (port == 0) {
+        // Next free ephemeral port
+        for (int tries = 0; tries < 16384 && port == 0; tries++) {
+            uint16_t p = next_ephemeral_port++;
+            if (next_ephemeral_port > 65530) next_ephemeral_port = 49152;
+            if (udp_find(p) < 0) port = p;
+        }
+        if (port == 0) return -1;
+    } else if (udp_find(port) >= 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < UDP_MAX_ENDPOINTS; i++) {
+        udp_endpoint_t* ep = &endpoints[i];
+        if (ep->active) continue;
+        if (!ep->ring) {
+            ep->ring = (uint8_t*)kmalloc(UDP_RCVQ_BYTES);
+            if (!ep->ring) return -1;
+        }
+        pollsrc_detach(&ep->pollsrc);   // Registrations on the previous user
+        ep->active = 1;
+        ep->port = port;
+        ep->ring_head = ep->ring_used = 0;
+        ep->q_head = ep->q_tail = 0;
+        ep->drops = 0;
+        int b = port & (UDP_HASH_SIZE - 1);
+        ep->hash_next = port_hash[b];
+        port_hash[b] = i;
+        return i;
+    }
+    return -1;
+}
+
+void udp_close(int id) {
+    udp_endpoint_t* ep = udp_ep(id);
+    if (!ep) return;
+    int* link = &port_hash[ep->port & (UDP_HASH_SIZE - 1)];
+    while (*link != id) link = &endpoints[*link].hash_next;
+    *link = ep->hash_next;
+    ep->active = 0;             // The ring is kept for the next endpoint
+    waitq_wake_all(&ep->waitq);
+    pollsrc_notify(&ep->pollsrc);
+}
+
+uint16_t udp_local_port(int id) {
+    udp_endpoint_t* ep = udp_ep(id);
+    return ep ? ep->port : 0;
+}
+
+int udp_sendto(int id, uint32_t dst_ip, uint16_t dst_port, const uint8_t* data, uint32_t len) {
+    udp_endpoint_t* ep = udp_ep(id);
+    if (!ep || len > UDP_MAX_PAYLOAD) return -1;
+
+    uint8_t buf[UDP_HEADER_LEN];
+    udp_header_t* hdr = (udp_header_t*)buf;
+    hdr->src_port = htons(ep->port);
+    hdr->dst_port = htons(dst_port);
+    hdr->length = htons((uint16_t)(UDP_HEADER_LEN + len));
+    hdr->checksum = 0;
+    uint16_t sum = udp_checksum(htonl(ip_source_addr(dst_ip)), htonl(dst_ip), buf, data, len);
+    hdr->checksum = sum ? sum : 0xFFFF;     // 0 would mean "no checksum"
+
+    int ret = ip_send_gather(dst_ip, IP_PROTO_UDP, buf, UDP_HEADER_LEN, data, (uint16_t)len, 0);
+    if (ret < 0) {
+        udp_stats.out_errors++;
+        return ret == -2 ? -2 : -1;
+    }
+    udp_stats.out_datagrams++;
+    return (int)len;
+}
+
+int udp_recvfrom(int id, uint8_t* buf, uint32_t len, uint32_t* src_ip, uint16_t* src_port) {
+    udp_endpoint_t* ep = udp_ep(id);
+    if (!ep || ep->q_head == ep->q_tail) return -1;
+
+    udp_dgram_t* d = &ep->q[ep->q_head & (UDP_RCVQ_MAX - 1)];
+    uint32_t n = d->len < len ? d->len : len;
+    uint32_t first = UDP_RCVQ_BYTES - ep->ring_head;
+    if (first > n) first = n;
+    memcpy(buf, ep->ring + ep->ring_head, first);
+    if (n > first) memcpy(buf + first, ep->ring, n - first);
+    if (src_ip) *src_ip = d->src_ip;
+    if (src_port) *src_port = d->src_port;
+
+    ep->ring_head = (ep->ring_head + d->len) & (UDP_RCVQ_BYTES - 1);
+    ep->ring_used -= d->len;
+    ep->q_head++;
+    return (int)n;
+}
+
+int udp_pending(int id) {
+    udp_endpoint_t* ep = udp_ep(id);
+    return ep ? (int)(ep->q_tail - ep->q_head) : 0;
+}
+
+uint32_t udp_drops(int id) {
+    udp_endpoint_t* ep = udp_ep(id);
+    return ep ? ep->drops : 0;
+}
+
+waitq_t* udp_get_waitq(int id) {
+    if (id < 0 || id >= UDP_MAX_ENDPOINTS) return (waitq_t*)0;
+    return &endpoints[id].waitq;
+}
+
+pollsrc_t* udp_get_pollsrc(int id) {
+    if (id < 0 || id >= UDP_MAX_ENDPOINTS) return (pollsrc_t*)0;
+    return &endpoints[id].pollsrc;
+}
+
+void udp_receive(uint32_t src_ip, uint32_t dst_ip, const uint8_t* data, uint16_t length) {
+    const udp_header_t* hdr = (const udp_header_t*)data;
+    uint16_t ulen = length >= UDP_HEADER_LEN ? ntohs(hdr->length) : 0;
+    if (ulen < UDP_HEADER_LEN || ulen > length) {
+        udp_stats.in_errors++;
+        return;
+    }
+    uint32_t len = ulen - UDP_HEADER_LEN;
+    const uint8_t* payload = data + UDP_HEADER_LEN;
+
+    int id = udp_find(ntohs(hdr->dst_port));
+    if (id < 0) {
+        udp_stats.no_ports++;
+        return;
+    }
+    udp_endpoint_t* ep = &endpoints[id];
+
+    if (hdr->checksum && udp_checksum(htonl(src_ip), htonl(dst_ip), data, payload, len) != 0) {
+        udp_stats.in_errors++;
+        udp_stats.csum_errors++;
+        return;
+    }
+
+    if (ep->q_tail - ep->q_head >= UDP_RCVQ_MAX || len > UDP_RCVQ_BYTES - ep->ring_used) {
+        ep->drops++;
+        udp_stats.rcvbuf_errors++;
+        return;
+    }
+    uint32_t off = (ep->ring_head + ep->ring_used) & (UDP_RCVQ_BYTES - 1);
+    uint32_t first = UDP_RCVQ_BYTES - off;
+    if (first > len) first = len;
+    memcpy(ep->ring + off, payload, first);
+    if (len > first) memcpy(ep->ring, payload + first, len - first);
+    ep->ring_used += len;
+
+    udp_dgram_t* d = &ep->q[ep->q_tail & (UDP_RCVQ_MAX - 1)];
+    d->src_ip = src_ip;
+    d->src_port = ntohs(hdr->src_port);
+    d->len = (uint16_t)len;
+    ep->q_tail++;
+    udp_stats.in_datagrams++;
+
+    waitq_wake_all(&ep->waitq);
+    pollsrc_notify(&ep->pollsrc);
+}
+
+void udp_get_stats(udp_stats_t* out) {
+    *out = udp_stats;
+}
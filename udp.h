@@ -0,0 +1,76 @@
+// udp.h - UDP Transport Layer for Alteo OS
+// An endpoint is a bound local port with a queue of received datagrams.
+// Endpoints are found by port through a hash table; each keeps its
+// datagrams back to back in a byte ring (with a small descriptor ring
+// beside it), so a burst of small datagrams costs no per-packet
+// allocation. Datagrams arriving at a full queue are dropped and counted.
+#ifndef UDP_H
+#define UDP_H
+
+#include "stdint.h"
+#include "waitq.h"
+#include "epoll.h"
+
+#define UDP_HEADER_LEN      8
+#define UDP_MAX_PAYLOAD     1472    // One Ethernet frame; no fragmentation
+#define UDP_MAX_ENDPOINTS   64
+#define UDP_HASH_SIZE       64      // Port buckets (power of two)
+#define UDP_RCVQ_BYTES      65536   // Queued payload per endpoint (power of two)
+#define UDP_RCVQ_MAX        128     // Queued datagrams per endpoint (power of two)
+
+typedef struct __attribute__((packed)) {
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t length;        // Header and payload
+    uint16_t checksum;      // 0: none
+} udp_header_t;
+
+// Counters for /proc/net/snmp
+typedef struct {
+    uint64_t in_datagrams;      // Queued on an endpoint
+    uint64_t no_ports;          // Nothing bound to the destination port
+    uint64_t in_errors;         // Malformed or bad checksum
+    uint64_t csum_errors;
+    uint64_t rcvbuf_errors;     // Endpoint queue full
+    uint64_t out_datagrams;
+    uint64_t out_errors;
+} udp_stats_t;
+
+// Set up the endpoint table
+void udp_init(void);
+
+// Bind a local port (0 picks an ephemeral one). Returns an endpoint id, or
+// -1 if the port is taken or the table is full.
+int  udp_open(uint16_t port);
+
+// Release an endpoint and drop what it has queued
+void udp_close(int id);
+
+// Local port of an endpoint
+uint16_t udp_local_port(int id);
+
+// Send one datagram from an endpoint. Returns len, -1 on error (too long,
+// bad id) or -2 if the next hop is unresolved and its ARP queue is full.
+int  udp_sendto(int id, uint32_t dst_ip, uint16_t dst_port, const uint8_t* data, uint32_t len);
+
+// Take the oldest queued datagram: up to len bytes are copied (the rest of
+// a longer datagram is discarded) and its source stored if requested.
+// Returns the bytes copied, or -1 if the queue is empty.
+int  udp_recvfrom(int id, uint8_t* buf, uint32_t len, uint32_t* src_ip, uint16_t* src_port);
+
+// Datagrams queued on an endpoint
+int  udp_pending(int id);
+
+// Datagrams dropped because the endpoint's queue was full
+uint32_t udp_drops(int id);
+
+// Wait queue / event source woken when a datagram is queued
+waitq_t* udp_get_waitq(int id);
+pollsrc_t* udp_get_pollsrc(int id);
+
+// Process an incoming UDP datagram (from ip_receive)
+void udp_receive(uint32_t src_ip, uint32_t dst_ip, const uint8_t* data, uint16_t length);
+
+void udp_get_stats(udp_stats_t* out);
+
+#endif
@@ -0,0 +1,332 @@
+// uring.c - Submission/Completion Rings for Alteo OS
+// Ring regions are physically contiguous frames, mapped shared into the
+// owner so fork never copies them. Operations that cannot finish at once
+// sit in one table for all rings. The worker waits on a private epoll
+// instance that holds each waiting operation's event source, plus a kick
+// source that turns ready whenever work is deferred to the thread.
+#include "uring.h"
+#include "klib.h"
+#include "pmm.h"
+#include "process.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "syscall.h"
+
+#define URING_KICK_KEY  URING_MAX_PENDING   // epoll key of the kick source
+
+typedef struct {
+    int         in_use;
+    int         pid;            // Owner
+    int         slot;           // Owner's process table slot
+    pte_t*      pml4;           // Owner's address space
+    uint8_t*    mem;            // Region (kernel address)
+    uint32_t    pages;
+    uint64_t    addr;           // Region (user address)
+    uring_hdr_t* hdr;
+    // Kernel copies of the header's geometry (the process can write it)
+    uint32_t    sq_mask, cq_mask, cq_entries;
+    uint32_t    sqes_off, cqes_off;
+    uint32_t    inflight;       // Submitted, not yet completed
+    uint32_t    cq_target;      // Unread completions uring_enter waits for
+    waitq_t     cq_wait;        // Woken when a completion is posted
+} uring_t;
+
+static uring_t rings[URING_MAX_RINGS];
+static uring_op_t ops[URING_MAX_PENDING];
+static uring_exec_fn uring_exec;
+static int uring_ep = -1;
+static pollsrc_t kick_src;
+static int deferred_count;
+static int worker_running;
+
+// ---------- Helpers ----------
+
+static uint32_t kick_poll(uint64_t arg) {
+    (void)arg;
+    return deferred_count ? EPOLLIN : 0;
+}
+
+static uring_sqe_t* ring_sqe(uring_t* r, uint32_t i) {
+    return (uring_sqe_t*)(r->mem + r->sqes_off) + (i & r->sq_mask);
+}
+
+static uring_cqe_t* ring_cqe(uring_t* r, uint32_t i) {
+    return (uring_cqe_t*)(r->mem + r->cqes_off) + (i & r->cq_mask);
+}
+
+static uint32_t cq_unread(uring_t* r) {
+    return r->hdr->cq_tail - r->hdr->cq_head;
+}
+
+static void post_cqe(uring_t* r, uint64_t user_data, int64_t res) {
+    uring_hdr_t* h = r->hdr;
+    uint32_t tail = h->cq_tail;
+    if (tail - h->cq_head >= r->cq_entries) {
+        h->cq_overflow++;       // Only if the process moved cq_head past cq_tail
+    } else {
+        uring_cqe_t* c = ring_cqe(r, tail);
+        c->user_data = user_data;
+        c->res = (int32_t)res;
+        c->flags = 0;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        h->cq_tail = tail + 1;
+    }
+    waitq_wake_all(&r->cq_wait);
+}
+
+static void op_free(uring_op_t* op) {
+    if (op->waiting) epoll_del(uring_ep, (int)(op - ops));
+    if (op->deferred) deferred_count--;
+    memset(op, 0, sizeof(*op));
+}
+
+static void op_complete(uring_op_t* op, int64_t res) {
+    uring_t* r = &rings[op->ring];
+    post_cqe(r, op->sqe.user_data, res);
+    r->inflight--;
+    op_free(op);
+}
+
+// Run op outside the worker's deferred pass: complete it, or park it on
+// its event source or the deferred list
+static void op_run(uring_op_t* op) {
+    int64_t res = uring_exec(op, rings[op->ring].slot, 0);
+    if (res == URING_WAIT) {
+        if (op->waiting) return;    // Still registered: next notify retries
+        epoll_event_t ev = { op->events | EPOLLET, (uint64_t)(op - ops) };
+        if (uring_ep >= 0 && op->src &&
+            epoll_add(uring_ep, (int)(op - ops), &ev, op->src, op->poll_fn, op->poll_arg) == 0) {
+            op->waiting = 1;
+            return;
+        }
+        res = SYSCALL_EAGAIN;       // Nothing to wait with
+    } else if (res == URING_DEFER) {
+        if (worker_running) {
+            if (!op->deferred) deferred_count++;
+            op->deferred = 1;
+            pollsrc_notify(&kick_src);
+            return;
+        }
+        res = uring_exec(op, rings[op->ring].slot, 1);   // Before the worker: run here
+        if (res == URING_WAIT || res == URING_DEFER) res = SYSCALL_EAGAIN;
+    }
+    op_complete(op, res);
+}
+
+// ---------- Worker ----------
+
+static void uring_thread(void) {
+    epoll_event_t evs[EPOLL_MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(uring_ep, evs, EPOLL_MAX_EVENTS, -1);
+        smp_bkl_lock();
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data >= URING_MAX_PENDING) continue;    // Kick
+            uring_op_t* op = &ops[evs[i].data];
+            if (op->in_use && op->waiting) op_run(op);
+        }
+        for (int i = 0; i < URING_MAX_PENDING; i++) {
+            uring_op_t* op = &ops[i];
+            if (!op->in_use || !op->deferred) continue;
+            op->deferred = 0;
+            deferred_count--;
+            op->running = 1;
+            int64_t res = uring_exec(op, rings[op->ring].slot, 1);
+            op->running = 0;
+            if (op->cancelled) {
+                memset(op, 0, sizeof(*op));
+                continue;
+            }
+            if (res == URING_WAIT || res == URING_DEFER) res = SYSCALL_EAGAIN;
+            op_complete(op, res);
+        }
+        smp_bkl_unlock();
+    }
+}
+
+// ---------- Rings ----------
+
+void uring_init(uring_exec_fn exec) {
+    memset(rings, 0, sizeof(rings));
+    memset(ops, 0, sizeof(ops));
+    uring_exec = exec;
+}
+
+void uring_start(void) {
+    if (worker_running) return;
+    uring_ep = epoll_create();
+    if (uring_ep < 0) return;
+    epoll_event_t ev = { EPOLLIN | EPOLLET, URING_KICK_KEY };
+    if (epoll_add(uring_ep, URING_KICK_KEY, &ev, &kick_src, kick_poll, 0) < 0 ||
+        process_create("uring", uring_thread, PRIORITY_HIGH) < 0) {
+        epoll_destroy(uring_ep);
+        uring_ep = -1;
+        return;
+    }
+    worker_running = 1;
+}
+
+int uring_create(int pid, int slot, pte_t* pml4, uring_params_t* params) {
+    if (!uring_exec || !pml4 || !params) return -1;
+    int id = -1;
+    for (int i = 0; i < URING_MAX_RINGS; i++) {
+        if (!rings[i].in_use) { id = i; break; }
+    }
+    if (id < 0) return -1;
+
+    uint32_t sq = 1;
+    while (sq < params->sq_entries && sq < URING_MAX_ENTRIES) sq <<= 1;
+    uint32_t cq = sq * 2;
+    uint32_t sq_pages = (uint32_t)((sq * sizeof(uring_sqe_t) + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE);
+    uint32_t cq_pages = (uint32_t)((cq * sizeof(uring_cqe_t) + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE);
+    uint32_t pages = 1 + sq_pages + cq_pages;
+
+    uint8_t* mem = (uint8_t*)pmm_alloc_blocks(pages, 0);
+    if (!mem) return -1;
+    memset(mem, 0, (uint64_t)pages * VMM_PAGE_SIZE);
+
+    uint64_t addr = URING_BASE + (uint64_t)id * URING_SPAN;
+    uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER |
+                     VMM_FLAG_NX | VMM_FLAG_SHARED;
+    for (uint32_t i = 0; i < pages; i++) {
+        uint8_t* frame = mem + (uint64_t)i * VMM_PAGE_SIZE;
+        pmm_page_ref(frame);
+        if (vmm_map_page(pml4, addr + (uint64_t)i * VMM_PAGE_SIZE, (uint64_t)frame, flags) < 0) {
+            pmm_free_block(frame);
+            for (uint32_t j = 0; j < i; j++) {
+                vmm_unmap_page(pml4, addr + (uint64_t)j * VMM_PAGE_SIZE);
+                pmm_free_block(mem + (uint64_t)j * VMM_PAGE_SIZE);
+            }
+            for (uint32_t j = 0; j < pages; j++) pmm_free_block(mem + (uint64_t)j * VMM_PAGE_SIZE);
+            return -1;
+        }
+    }
+
+    uring_t* r = &rings[id];
+    memset(r, 0, sizeof(*r));
+    r->in_use = 1;
+    r->pid = pid;
+    r->slot = slot;
+    r->pml4 = pml4;
+    r->mem = mem;
+    r->pages = pages;
+    r->addr = addr;
+    r->hdr = (uring_hdr_t*)mem;
+    waitq_init(&r->cq_wait);
+    r->sq_mask = sq - 1;
+    r->cq_mask = cq - 1;
+    r->cq_entries = cq;
+    r->sqes_off = VMM_PAGE_SIZE;
+    r->cqes_off = (1 + sq_pages) * VMM_PAGE_SIZE;
+    r->hdr->sq_mask = sq - 1;
+    r->hdr->sq_entries = sq;
+    r->hdr->cq_mask = cq - 1;
+    r->hdr->cq_entries = cq;
+    r->hdr->sqes_off = VMM_PAGE_SIZE;
+    r->hdr->cqes_off = (1 + sq_pages) * VMM_PAGE_SIZE;
+
+    params->sq_entries = sq;
+    params->cq_entries = cq;
+    params->ring_addr = addr;
+    params->ring_size = (uint64_t)pages * VMM_PAGE_SIZE;
+    return id;
+}
+
+static int cq_has(void* arg) {
+    uring_t* r = (uring_t*)arg;
+    return !r->in_use || cq_unread(r) >= r->cq_target || !r->inflight;
+}
+
+int uring_enter(int ring, int pid, uint32_t to_submit, uint32_t min_complete) {
+    if (ring < 0 || ring >= URING_MAX_RINGS || !rings[ring].in_use || rings[ring].pid != pid) return -1;
+    uring_t* r = &rings[ring];
+    uring_hdr_t* h = r->hdr;
+
+    int submitted = 0;
+    while ((uint32_t)submitted < to_submit) {
+        uint32_t head = h->sq_head;
+        uint32_t tail = h->sq_tail;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (head == tail) break;
+        if (r->inflight + cq_unread(r) >= r->cq_entries) break;   // No room to complete into
+
+        uring_op_t* op = 0;
+        for (int i = 0; i < URING_MAX_PENDING; i++) {
+            if (!ops[i].in_use) { op = &ops[i]; break; }
+        }
+        if (!op) break;
+
+        memset(op, 0, sizeof(*op));
+        op->in_use = 1;
+        op->ring = ring;
+        op->handle = -1;
+        op->sqe = *ring_sqe(r, head);
+        h->sq_head = head + 1;
+        r->inflight++;
+        submitted++;
+        op_run(op);
+    }
+
+    // Wait for min_complete unread completions, or for everything in flight
+    if (min_complete) {
+        r->cq_target = min_complete < r->cq_entries ? min_complete : r->cq_entries;
+        waitq_wait(&r->cq_wait, cq_has, r);
+    }
+    return submitted;
+}
+
+void uring_destroy(int ring, int pid) {
+    if (ring < 0 || ring >= URING_MAX_RINGS || !rings[ring].in_use || rings[ring].pid != pid) return;
+    uring_t* r = &rings[ring];
+
+    for (int i = 0; i < URING_MAX_PENDING; i++) {
+        uring_op_t* op = &ops[i];
+        if (!op->in_use || op->ring != ring) continue;
+        if (op->running) op->cancelled = 1;     // The worker drops it
+        else op_free(op);
+    }
+
+    for (uint32_t i = 0; i < r->pages; i++) {
+        uint64_t va = r->addr + (uint64_t)i * VMM_PAGE_SIZE;
+        if (vmm_get_physical(r->pml4, va)) {
+            vmm_unmap_page(r->pml4, va);
+            pmm_free_block(r->mem + (uint64_t)i * VMM_PAGE_SIZE);   // The mapping's reference
+        }
+        pmm_free_block(r->mem + (uint64_t)i * VMM_PAGE_SIZE);
+    }
+    r->in_use = 0;
+    waitq_wake_all(&r->cq_wait);
+}
+
+void uring_release(int pid) {
+    for (int i = 0; i < URING_MAX_RINGS; i++) {
+        if (rings[i].in_use && rings[i].pid == pid) uring_destroy(i, pid);
+    }
+}
+
+// ---------- Owner memory ----------
+
+static int uring_copy(const uring_op_t* op, uint64_t uaddr, uint8_t* kbuf, uint32_t len, int write) {
+    const uring_t* r = &rings[op->ring];
+    if (op->cancelled || !r->in_use) return -1;
+    while (len) {
+        uint8_t* p = vmm_vma_touch(r->pid, r->pml4, uaddr, write);
+        if (!p) return -1;
+        uint32_t n = VMM_PAGE_SIZE - (uint32_t)(uaddr & (VMM_PAGE_SIZE - 1));
+        if (n > len) n = len;
+        if (write) memcpy(p, kbuf, n);
+        else memcpy(kbuf, p, n);
+        uaddr += n;
+        kbuf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int uring_copy_in(const uring_op_t* op, void* dst, uint64_t src, uint32_t len) {
+    return uring_copy(op, src, (uint8_t*)dst, len, 0);
+}
+
+int uring_copy_out(const uring_op_t* op, uint64_t dst, const void* src, uint32_t len) {
+    return uring_copy(op, dst, (uint8_t*)src, len, 1);
+}
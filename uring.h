@@ -0,0 +1,138 @@
+// uring.h - Submission/Completion Rings for Alteo OS
+// Asynchronous I/O without a syscall per operation. SYS_URING_SETUP maps
+// a ring region into the caller: a header, an array of submission entries
+// (SQEs) the process fills and a ring of completion entries (CQEs) the
+// kernel fills. The process queues any number of SQEs, advances sq_tail
+// and calls SYS_URING_ENTER once for the batch; completions appear in the
+// CQ ring as operations finish, and are read by advancing cq_head with no
+// syscall at all.
+//
+// SYS_URING_ENTER runs each operation that can finish without sleeping
+// and returns. The rest complete from the "uring" kernel thread: pipe,
+// socket and device operations wait on the object's event source (the
+// same ones epoll uses), and file reads, writes and fsync, which may sleep
+// in the block layer's request queue, are handed to the thread outright.
+// Ring state is only touched under the big kernel lock.
+#ifndef URING_H
+#define URING_H
+
+#include "stdint.h"
+#include "vmm.h"
+#include "epoll.h"
+#include "waitq.h"
+
+#define URING_MAX_RINGS     16
+#define URING_MAX_ENTRIES   256     // SQ entries per ring (CQ has twice as many)
+#define URING_MAX_PENDING   64      // Operations waiting, all rings
+#define URING_MAX_IO        65536   // Largest read/write/send/recv
+#define URING_BASE          0x7FFD00000000ULL   // Ring i is mapped at
+#define URING_SPAN          0x100000ULL         //  URING_BASE + i * URING_SPAN
+
+// Opcodes
+#define URING_OP_NOP        0
+#define URING_OP_READ       1       // pread on files, read otherwise
+#define URING_OP_WRITE      2       // pwrite on files, write otherwise
+#define URING_OP_SEND       3
+#define URING_OP_RECV       4
+#define URING_OP_ACCEPT     5       // res = new fd
+#define URING_OP_FSYNC      6       // Write dirty blocks back
+
+// Submission entry (64 bytes; entries never straddle a page)
+typedef struct {
+    uint8_t  opcode;
+    uint8_t  flags;
+    uint16_t reserved;
+    int32_t  fd;
+    uint64_t off;           // File offset (READ/WRITE on files)
+    uint64_t addr;          // Buffer
+    uint32_t len;
+    uint32_t op_flags;      // Unused, 0
+    uint64_t user_data;     // Copied to the completion
+    uint64_t pad[3];
+} uring_sqe_t;
+
+// Completion entry
+typedef struct {
+    uint64_t user_data;
+    int32_t  res;           // Result, or a negative SYSCALL_E* code
+    uint32_t flags;
+} uring_cqe_t;
+
+// Ring header at the start of the region. SQEs start at sqes_off and CQEs
+// at cqes_off (both page aligned). Index i refers to entry i & mask.
+typedef struct {
+    volatile uint32_t sq_head;      // Advanced by the kernel
+    volatile uint32_t sq_tail;      // Advanced by the process
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    volatile uint32_t cq_head;      // Advanced by the process
+    volatile uint32_t cq_tail;      // Advanced by the kernel
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+    volatile uint32_t cq_overflow;  // Completions dropped on a full CQ
+    uint32_t sqes_off;
+    uint32_t cqes_off;
+    uint32_t reserved;
+} uring_hdr_t;
+
+// SYS_URING_SETUP argument
+typedef struct {
+    uint32_t sq_entries;    // In: rounded up to a power of two
+    uint32_t cq_entries;    // Out
+    uint64_t ring_addr;     // Out: the region's address
+    uint64_t ring_size;     // Out: its size in bytes
+} uring_params_t;
+
+// ---- Kernel side ----
+
+// An operation in flight
+typedef struct uring_op {
+    int         ring;
+    uring_sqe_t sqe;        // Kernel copy, checked once at submission
+    int         handle;     // Object behind sqe.fd (set by the executor)
+    // Set by the executor when it returns URING_WAIT
+    pollsrc_t*  src;
+    epoll_poll_fn poll_fn;
+    uint64_t    poll_arg;
+    uint32_t    events;
+    int         waiting;    // Registered with the worker's epoll instance
+    int         deferred;   // On the worker's list (URING_DEFER)
+    int         running;    // Deferred and being executed (may be asleep)
+    int         cancelled;  // Ring destroyed while running: drop the result
+    int         in_use;
+} uring_op_t;
+
+// Executor results besides a completion value
+#define URING_WAIT   (-1000)    // Wait on op->src for op->events, then retry
+#define URING_DEFER  (-1001)    // Must sleep: retry from the worker thread
+
+// Runs one operation for the ring's owner process. may_sleep is set only
+// on the worker thread for deferred operations. The first call (may_sleep
+// 0, handle -1) resolves sqe.fd. Buffers are copied with uring_copy_in/out.
+typedef int64_t (*uring_exec_fn)(uring_op_t* op, int owner_slot, int may_sleep);
+
+void uring_init(uring_exec_fn exec);
+
+// Start the uring worker thread (after process_init)
+void uring_start(void);
+
+// Create a ring for process pid (address space pml4, table slot slot).
+// Fills params and returns the ring id, or -1.
+int uring_create(int pid, int slot, pte_t* pml4, uring_params_t* params);
+
+// Submit up to to_submit queued SQEs, then wait until min_complete CQEs
+// are unread. Returns the number of SQEs consumed, or -1 on a bad ring.
+int uring_enter(int ring, int pid, uint32_t to_submit, uint32_t min_complete);
+
+// Cancel pending operations, unmap and free the ring (owner only)
+void uring_destroy(int ring, int pid);
+
+// Destroy every ring process pid owns (exit)
+void uring_release(int pid);
+
+// Copy between kernel memory and the owner of op's ring. Return 0, or -1
+// if part of the range is not mapped.
+int uring_copy_in(const uring_op_t* op, void* dst, uint64_t src, uint32_t len);
+int uring_copy_out(const uring_op_t* op, uint64_t dst, const void* src, uint32_t len);
+
+#endif
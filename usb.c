@@ -1,18 +1,14 @@
 // usb.c - USB Core Layer for Alteo OS
 // Manages device enumeration and tracking
 #include "usb.h"
+#include "klib.h"
 #include "xhci.h"
 
 static usb_device_t usb_devices[USB_MAX_DEVICES];
 static int usb_device_count = 0;
 
-static void usb_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
 void usb_init(void) {
-    usb_memset(usb_devices, 0, sizeof(usb_devices));
+    memset(usb_devices, 0, sizeof(usb_devices));
     usb_device_count = 0;
 
     // Try to initialize xHCI
@@ -27,7 +23,7 @@ void usb_init(void) {
             // Reset port
             if (xhci_port_reset(p) == 0) {
                 usb_device_t* dev = &usb_devices[usb_device_count];
-                usb_memset(dev, 0, sizeof(usb_device_t));
+                memset(dev, 0, sizeof(usb_device_t));
                 dev->present = 1;
                 dev->speed = (uint8_t)xhci_port_speed(p);
                 dev->slot_id = usb_device_count + 1; // Simplified
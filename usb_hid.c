@@ -1,6 +1,11 @@
 // usb_hid.c - USB HID (Human Interface Device) Driver for Alteo OS
 #include "usb_hid.h"
+#include "klib.h"
 #include "xhci.h"
+#include "heap.h"
+#include "input.h"
+#include "evdev.h"
+#include "mouse.h"
 
 static int hid_keyboard_slot = -1;
 static int hid_keyboard_ep = 0;
@@ -10,10 +15,11 @@ static int hid_mouse_ep = 0;
 static usb_hid_keyboard_report_t last_kb_report;
 static usb_hid_mouse_report_t last_mouse_report;
 
-static void hid_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
+// Reports arrive by interrupt into these DMA buffers; the completion
+// callbacks turn them into input events and queue the next transfer
+static usb_hid_keyboard_report_t* kb_buf = 0;
+static usb_hid_mouse_report_t* mouse_buf = 0;
+static volatile int kb_new = 0, mouse_new = 0;
 
 // HID Usage ID to ASCII conversion table (US QWERTY)
 // Index = HID usage code (0x04 = 'a', etc.)
@@ -55,9 +61,11 @@ static const char hid_keymap_upper[128] = {
     0,   0,   0,   0,   0,   0,   0,   0,
 };
 
+static void hid_start(void);
+
 void usb_hid_init(void) {
-    hid_memset(&last_kb_report, 0, sizeof(last_kb_report));
-    hid_memset(&last_mouse_report, 0, sizeof(last_mouse_report));
+    memset(&last_kb_report, 0, sizeof(last_kb_report));
+    memset(&last_mouse_report, 0, sizeof(last_mouse_report));
 
     hid_keyboard_slot = -1;
     hid_mouse_slot = -1;
@@ -96,7 +104,7 @@ void usb_hid_init(void) {
     // Set boot protocol for discovered HID devices
     if (hid_keyboard_slot >= 0) {
         usb_setup_packet_t setup;
-        hid_memset(&setup, 0, sizeof(setup));
+        memset(&setup, 0, sizeof(setup));
         setup.bmRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_OUT;
         setup.bRequest = USB_HID_SET_PROTOCOL;
         setup.wValue = 0; // Boot protocol
@@ -105,7 +113,7 @@ void usb_hid_init(void) {
         xhci_control_transfer(hid_keyboard_slot, &setup, (void*)0, 0);
 
         // Set idle (suppress duplicate reports)
-        hid_memset(&setup, 0, sizeof(setup));
+        memset(&setup, 0, sizeof(setup));
         setup.bmRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_OUT;
         setup.bRequest = USB_HID_SET_IDLE;
         setup.wValue = 0;
@@ -116,7 +124,7 @@ void usb_hid_init(void) {
 
     if (hid_mouse_slot >= 0) {
         usb_setup_packet_t setup;
-        hid_memset(&setup, 0, sizeof(setup));
+        memset(&setup, 0, sizeof(setup));
         setup.bmRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_OUT;
         setup.bRequest = USB_HID_SET_PROTOCOL;
         setup.wValue = 0; // Boot protocol
@@ -124,6 +132,8 @@ void usb_hid_init(void) {
         setup.wLength = 0;
         xhci_control_transfer(hid_mouse_slot, &setup, (void*)0, 0);
     }
+
+    hid_start();
 }
 
 int usb_hid_keyboard_available(void) {
@@ -135,47 +145,104 @@ int usb_hid_mouse_available(void) {
 }
 
 int usb_hid_keyboard_poll(usb_hid_keyboard_report_t* report) {
-    if (hid_keyboard_slot < 0 || !report) return 0;
+    if (hid_keyboard_slot < 0 || !report || !kb_new) return 0;
+    kb_new = 0;
+    *report = last_kb_report;
+    return 1;
+}
 
-    usb_hid_keyboard_report_t new_report;
-    hid_memset(&new_report, 0, sizeof(new_report));
+int usb_hid_mouse_poll(usb_hid_mouse_report_t* report) {
+    if (hid_mouse_slot < 0 || !report || !mouse_new) return 0;
+    mouse_new = 0;
+    *report = last_mouse_report;
+    return 1;
+}
 
-    int ret = xhci_interrupt_transfer(hid_keyboard_slot, hid_keyboard_ep,
-                                       &new_report, sizeof(new_report));
-    if (ret != 0) return 0;
+char usb_hid_to_ascii(uint8_t keycode, uint8_t modifiers) {
+    if (keycode >= 128) return 0;
+    int shift = (modifiers & (USB_HID_MOD_LSHIFT | USB_HID_MOD_RSHIFT)) ? 1 : 0;
+    return shift ? hid_keymap_upper[keycode] : hid_keymap_lower[keycode];
+}
 
-    // Check if report changed
-    const uint8_t* a = (const uint8_t*)&new_report;
-    const uint8_t* b = (const uint8_t*)&last_kb_report;
-    int changed = 0;
-    for (int i = 0; i < (int)sizeof(usb_hid_keyboard_report_t); i++) {
-        if (a[i] != b[i]) { changed = 1; break; }
-    }
+// ---- Asynchronous reports ----
 
-    if (changed) {
-        last_kb_report = new_report;
-        *report = new_report;
-        return 1;
-    }
-    return 0;
+static void hid_keyboard_done(void* ctx, int status, uint32_t length);
+static void hid_mouse_done(void* ctx, int status, uint32_t length);
+
+static void hid_keyboard_submit(void) {
+    xhci_submit_interrupt(hid_keyboard_slot, (uint8_t)hid_keyboard_ep, kb_buf,
+                          sizeof(*kb_buf), hid_keyboard_done, 0);
 }
 
-int usb_hid_mouse_poll(usb_hid_mouse_report_t* report) {
-    if (hid_mouse_slot < 0 || !report) return 0;
+static void hid_mouse_submit(void) {
+    xhci_submit_interrupt(hid_mouse_slot, (uint8_t)hid_mouse_ep, mouse_buf,
+                          sizeof(*mouse_buf), hid_mouse_done, 0);
+}
 
-    usb_hid_mouse_report_t new_report;
-    hid_memset(&new_report, 0, sizeof(new_report));
+static int hid_key_in(const usb_hid_keyboard_report_t* r, uint8_t code) {
+    for (int j = 0; j < 6; j++) if (r->keys[j] == code) return 1;
+    return 0;
+}
 
-    int ret = xhci_interrupt_transfer(hid_mouse_slot, hid_mouse_ep,
-                                       &new_report, sizeof(new_report));
-    if (ret != 0) return 0;
+// Keys in the new report that weren't down in the last one are presses,
+// keys gone from it releases; modifier bits are keys 0xE0-0xE7
+static void hid_keyboard_done(void* ctx, int status, uint32_t length) {
+    (void)ctx;
+    // A failing endpoint would complete again at once: stop listening
+    if (status != 0) return;
+    if (length >= sizeof(*kb_buf)) {
+        usb_hid_keyboard_report_t r = *kb_buf;
+        evdev_event_t ev[EVDEV_REPORT_MAX - 1];
+        int n = 0;
+        uint8_t mods = r.modifiers ^ last_kb_report.modifiers;
+        for (int b = 0; b < 8; b++) {
+            if (mods & (1 << b))
+                ev[n++] = (evdev_event_t){ 0, EVDEV_KEY, (uint16_t)(0xE0 + b), (r.modifiers >> b) & 1 };
+        }
+        for (int i = 0; i < 6; i++) {
+            uint8_t code = last_kb_report.keys[i];
+            if (code >= 4 && !hid_key_in(&r, code)) ev[n++] = (evdev_event_t){ 0, EVDEV_KEY, code, 0 };
+        }
+        for (int i = 0; i < 6; i++) {
+            uint8_t code = r.keys[i];
+            if (code < 4) continue;          // None, or a rollover error
+            if (hid_key_in(&last_kb_report, code)) continue;
+            char c = usb_hid_to_ascii(code, r.modifiers);
+            ev[n++] = (evdev_event_t){ 0, EVDEV_KEY, code, 1 };
+            if (c) ev[n++] = (evdev_event_t){ 0, EVDEV_CHAR, 0, (uint8_t)c };
+            if (c) input_push_key(c);
+        }
+        if (n) evdev_report(EVDEV_USB_KBD, ev, n);
+        last_kb_report = r;
+        kb_new = 1;
+    }
+    hid_keyboard_submit();
+}
 
-    *report = new_report;
-    return 1; // Mouse reports are always "new" (they contain deltas)
+static void hid_mouse_done(void* ctx, int status, uint32_t length) {
+    (void)ctx;
+    if (status != 0) return;
+    if (length >= 3) {
+        usb_hid_mouse_report_t r = *mouse_buf;
+        if (length < sizeof(r)) r.wheel = 0;
+        mouse_move(r.x_movement, r.y_movement, r.buttons & 0x07);
+        evdev_pointer(EVDEV_USB_MOUSE, r.x_movement, r.y_movement, r.wheel, r.buttons & 0x07);
+        last_mouse_report = r;
+        mouse_new = 1;
+    }
+    hid_mouse_submit();
 }
 
-char usb_hid_to_ascii(uint8_t keycode, uint8_t modifiers) {
-    if (keycode >= 128) return 0;
-    int shift = (modifiers & (USB_HID_MOD_LSHIFT | USB_HID_MOD_RSHIFT)) ? 1 : 0;
-    return shift ? hid_keymap_upper[keycode] : hid_keymap_lower[keycode];
+// Keep one report transfer in flight per device. Only with interrupts:
+// polled, nothing would ever complete them.
+static void hid_start(void) {
+    if (!xhci_irq_active()) return;
+    if (hid_keyboard_slot >= 0) {
+        if (!kb_buf) kb_buf = (usb_hid_keyboard_report_t*)kmalloc(sizeof(*kb_buf));
+        if (kb_buf) hid_keyboard_submit();
+    }
+    if (hid_mouse_slot >= 0) {
+        if (!mouse_buf) mouse_buf = (usb_hid_mouse_report_t*)kmalloc(sizeof(*mouse_buf));
+        if (mouse_buf) hid_mouse_submit();
+    }
 }
@@ -1,5 +1,5 @@
 // usb_hid.h - USB HID (Human Interface Device) Driver for Alteo OS
-// Supports USB keyboard and mouse via HID protocol
+// Supports USB keyboard and mouse via HID protocol (boot reports)
 #ifndef USB_HID_H
 #define USB_HID_H
 
@@ -46,10 +46,10 @@ int usb_hid_keyboard_available(void);
 // Check if USB mouse is available
 int usb_hid_mouse_available(void);
 
-// Poll USB keyboard (returns 1 if new data, 0 if no change)
+// Reports arrive by xHCI interrupt: key presses and mouse motion go
+// straight to the desktop input queue. These return the latest report
+// (1 if new since the last call, 0 if not) without touching the device.
 int usb_hid_keyboard_poll(usb_hid_keyboard_report_t* report);
-
-// Poll USB mouse (returns 1 if new data, 0 if no change)
 int usb_hid_mouse_poll(usb_hid_mouse_report_t* report);
 
 // Convert HID usage code to ASCII (basic mapping)
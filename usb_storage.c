@@ -0,0 +1,394 @@
+// usb_storage.c - USB Mass Storage (Bulk-Only Transport) Driver for Alteo OS
+// A device runs one chain of commands at a time: a blkdev batch, or a
+// single command during setup. The chain is advanced by the CSW
+// completion callbacks, under the device lock; the thread that started it
+// sleeps until the last one (or a timeout).
+#include "usb_storage.h"
+#include "usb.h"
+#include "xhci.h"
+#include "blkdev.h"
+#include "heap.h"
+#include "klib.h"
+#include "spinlock.h"
+#include "waitq.h"
+#include "timer.h"
+#include "scheduler.h"
+
+typedef struct {
+    int           present;
+    int           slot_id;
+    uint8_t       ep_in, ep_out;        // Endpoint addresses
+    uint8_t       interface;
+    uint64_t      sectors;
+    int           blkdev_id;
+    volatile int  failed;               // Lost sync with the device: every request fails
+
+    // DMA buffers for the command in flight
+    usb_ms_cbw_t* cbw;
+    usb_ms_csw_t* csw;
+    uint32_t      tag;
+
+    spinlock_t    lock;
+    waitq_t       wq;                   // Device idle, or chain finished
+    int           busy;                 // A chain owns the device
+    int           running;              // Its starter is still waiting for it
+    volatile int  finished;
+    uint64_t      deadline;             // For the whole chain
+
+    // The chain: ios[index..count) of a batch, or one command (ios = 0)
+    blkdev_io_t*  ios;
+    int           count, index;
+    uint32_t      done_sectors;         // Of ios[index]
+    uint32_t      cmd_sectors;          // In the command in flight
+    volatile int  xfer_error;           // A TD of the command in flight failed
+    int           status;               // Result of a single command
+} ms_dev_t;
+
+static ms_dev_t ms_devs[USB_MS_MAX_DEVICES];
+static int ms_count = 0;
+
+static void put_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t get_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// ---------- Command chain ----------
+
+static void ms_xfer_done(void* ctx, int status, uint32_t length);
+static void ms_csw_done(void* ctx, int status, uint32_t length);
+
+// Queue a command's CBW, data TDs and CSW together (d->lock held). The IN
+// pipe then has every buffer of the command posted before the device
+// starts its data phase.
+static int ms_issue(ms_dev_t* d, const uint8_t* cdb, int cdb_len, void* buf, uint32_t len, int in) {
+    usb_ms_cbw_t* cbw = d->cbw;
+    memset(cbw, 0, sizeof(*cbw));
+    cbw->signature = USB_MS_CBW_SIGNATURE;
+    cbw->tag = ++d->tag;
+    cbw->data_length = len;
+    cbw->flags = in ? USB_MS_CBW_IN : 0;
+    cbw->cb_length = (uint8_t)cdb_len;
+    memcpy(cbw->cb, cdb, (uint32_t)cdb_len);
+    d->xfer_error = 0;
+
+    if (xhci_submit_bulk(d->slot_id, d->ep_out, cbw, USB_MS_CBW_SIZE, ms_xfer_done, d) < 0)
+        return -1;
+    uint8_t data_ep = in ? d->ep_in : d->ep_out;
+    for (uint32_t off = 0; off < len; off += USB_MS_TD_BYTES) {
+        uint32_t n = len - off < USB_MS_TD_BYTES ? len - off : USB_MS_TD_BYTES;
+        if (xhci_submit_bulk(d->slot_id, data_ep, (uint8_t*)buf + off, n, ms_xfer_done, d) < 0)
+            return -1;
+    }
+    return xhci_submit_bulk(d->slot_id, d->ep_in, d->csw, USB_MS_CSW_SIZE, ms_csw_done, d);
+}
+
+// Issue the next READ(10)/WRITE(10) of the batch, skipping transfers that
+// already failed. Returns 1 if one was issued, 0 at the end, -1 on error.
+static int ms_issue_next(ms_dev_t* d) {
+    while (d->index < d->count && (d->ios[d->index].status < 0 || !d->ios[d->index].count)) {
+        d->index++;
+        d->done_sectors = 0;
+    }
+    if (d->index >= d->count) return 0;
+
+    blkdev_io_t* io = &d->ios[d->index];
+    uint32_t n = io->count - d->done_sectors;
+    if (n > USB_MS_CMD_SECTORS) n = USB_MS_CMD_SECTORS;
+    uint8_t cdb[10] = { 0 };
+    cdb[0] = io->write ? SCSI_WRITE_10 : SCSI_READ_10;
+    put_be32(&cdb[2], io->lba + d->done_sectors);
+    cdb[7] = (uint8_t)(n >> 8);
+    cdb[8] = (uint8_t)n;
+    d->cmd_sectors = n;
+    uint8_t* buf = (uint8_t*)io->buf + (uint64_t)d->done_sectors * BLKDEV_SECTOR_SIZE;
+    return ms_issue(d, cdb, 10, buf, n * BLKDEV_SECTOR_SIZE, !io->write) < 0 ? -1 : 1;
+}
+
+// End the chain, failing what it did not get to (d->lock held)
+static void ms_finish(ms_dev_t* d) {
+    if (d->ios) {
+        for (int i = d->index; i < d->count; i++) d->ios[i].status = -1;
+        d->index = d->count;
+    }
+    d->finished = 1;
+    waitq_wake_all(&d->wq);
+}
+
+// The command in flight completed with result (d->lock held)
+static void ms_advance(ms_dev_t* d, int result) {
+    if (!d->ios) {
+        d->status = result;
+        d->finished = 1;
+        waitq_wake_all(&d->wq);
+        return;
+    }
+
+    blkdev_io_t* io = &d->ios[d->index];
+    if (result < 0) io->status = -1;
+    else d->done_sectors += d->cmd_sectors;
+    if (result < 0 || d->done_sectors >= io->count) {
+        d->index++;
+        d->done_sectors = 0;
+    }
+
+    int r = d->failed ? -1 : ms_issue_next(d);
+    if (r < 0) d->failed = 1;
+    if (r <= 0) ms_finish(d);
+}
+
+// CBW and data TDs: only their failure matters, seen when the CSW lands
+static void ms_xfer_done(void* ctx, int status, uint32_t length) {
+    (void)length;
+    if (status < 0) ((ms_dev_t*)ctx)->xfer_error = 1;
+}
+
+static void ms_csw_done(void* ctx, int status, uint32_t length) {
+    ms_dev_t* d = (ms_dev_t*)ctx;
+    usb_ms_csw_t* csw = d->csw;
+    uint64_t flags = spin_lock_irqsave(&d->lock);
+    if (!d->running) {
+        // Its starter gave up on it
+        spin_unlock_irqrestore(&d->lock, flags);
+        return;
+    }
+
+    int valid = status == 0 && length == USB_MS_CSW_SIZE &&
+                csw->signature == USB_MS_CSW_SIGNATURE && csw->tag == d->tag;
+    // Without a valid CSW, or on a phase error, the pipes are out of step
+    // with the device and only a reset recovery would bring them back
+    if (!valid || csw->status == USB_MS_CSW_PHASE_ERROR) d->failed = 1;
+    int ok = valid && !d->xfer_error && csw->status == USB_MS_CSW_PASSED && csw->residue == 0;
+    ms_advance(d, ok ? 0 : -1);
+    spin_unlock_irqrestore(&d->lock, flags);
+}
+
+// ---------- Waiting ----------
+
+static int ms_idle(void* arg) {
+    return !((ms_dev_t*)arg)->busy;
+}
+
+static int ms_over(void* arg) {
+    ms_dev_t* d = (ms_dev_t*)arg;
+    return d->finished || (timer_is_active() && timer_now_ns() >= d->deadline);
+}
+
+static void ms_timeout(uint64_t arg) {
+    waitq_wake_all(&((ms_dev_t*)arg)->wq);
+}
+
+// Take the device for a chain of 'commands' (BOT runs one command at a
+// time)
+static void ms_acquire(ms_dev_t* d, int commands) {
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&d->lock);
+        if (!d->busy) {
+            d->busy = 1;
+            d->running = 1;
+            d->finished = 0;
+            if (timer_is_active())
+                d->deadline = timer_now_ns() + USB_MS_TIMEOUT_NS * (uint64_t)commands;
+            spin_unlock_irqrestore(&d->lock, flags);
+            return;
+        }
+        spin_unlock_irqrestore(&d->lock, flags);
+        if (waitq_wait(&d->wq, ms_idle, d) < 0) {
+            if (scheduler_is_running()) scheduler_yield();
+            else __asm__ volatile("pause");
+        }
+    }
+}
+
+// Wait for the chain to finish or time out, then release the device. A
+// timed-out chain is abandoned: its transfers may still complete, but its
+// callbacks no longer touch the caller's batch. Returns the result of a
+// single command.
+static int ms_wait_release(ms_dev_t* d) {
+    if (xhci_irq_active() && timer_is_active()) {
+        int id = timer_add(d->deadline, ms_timeout, (uint64_t)d);
+        if (id >= 0) {
+            waitq_wait(&d->wq, ms_over, d);
+            timer_cancel(id);
+        }
+    }
+    // No interrupt, or no process to put to sleep: drain the event ring
+    for (uint32_t spins = 0; !ms_over(d); spins++) {
+        if (!timer_is_active() && spins >= USB_MS_POLL_SPINS) break;
+        xhci_irq_handler();
+        if (scheduler_is_running()) scheduler_yield();
+        else __asm__ volatile("pause");
+    }
+
+    uint64_t flags = spin_lock_irqsave(&d->lock);
+    if (!d->finished) {
+        d->failed = 1;
+        ms_finish(d);
+    }
+    int status = d->failed ? -1 : d->status;
+    d->running = 0;
+    d->busy = 0;
+    spin_unlock_irqrestore(&d->lock, flags);
+    waitq_wake_all(&d->wq);
+    return status;
+}
+
+// Run one command. Returns 0 if the device reports it passed, else -1.
+static int ms_command(ms_dev_t* d, const uint8_t* cdb, int cdb_len, void* buf, uint32_t len, int in) {
+    ms_acquire(d, 1);
+    uint64_t flags = spin_lock_irqsave(&d->lock);
+    d->ios = (blkdev_io_t*)0;
+    d->status = -1;
+    if (d->failed || ms_issue(d, cdb, cdb_len, buf, len, in) < 0) {
+        d->failed = 1;
+        ms_finish(d);
+    }
+    spin_unlock_irqrestore(&d->lock, flags);
+    return ms_wait_release(d);
+}
+
+// ---------- Block device adapters ----------
+
+// Run a batch of transfers back to back: each command is issued from the
+// previous one's CSW completion, with its whole data phase queued
+static int ms_blkdev_submit(void* driver_data, blkdev_io_t* ios, int count) {
+    int index = (int)(uint64_t)driver_data;
+    if (index < 0 || index >= ms_count) return -1;
+    ms_dev_t* d = &ms_devs[index];
+
+    int commands = 1;
+    for (int i = 0; i < count; i++) {
+        blkdev_io_t* io = &ios[i];
+        io->status = (!io->buf || (uint64_t)io->lba + io->count > d->sectors) ? -1 : 0;
+        commands += (int)((io->count + USB_MS_CMD_SECTORS - 1) / USB_MS_CMD_SECTORS);
+    }
+
+    ms_acquire(d, commands);
+    uint64_t flags = spin_lock_irqsave(&d->lock);
+    d->ios = ios;
+    d->count = count;
+    d->index = 0;
+    d->done_sectors = 0;
+    int r = d->failed ? -1 : ms_issue_next(d);
+    if (r < 0) d->failed = 1;
+    if (r <= 0) ms_finish(d);
+    spin_unlock_irqrestore(&d->lock, flags);
+    ms_wait_release(d);
+    return 0;
+}
+
+static int ms_blkdev_read(void* driver_data, uint32_t lba, uint32_t count, void* buf) {
+    blkdev_io_t io = { lba, count, buf, 0, 0 };
+    if (ms_blkdev_submit(driver_data, &io, 1) < 0 || io.status < 0) return -1;
+    return (int)count;
+}
+
+static int ms_blkdev_write(void* driver_data, uint32_t lba, uint32_t count, const void* buf) {
+    blkdev_io_t io = { lba, count, (void*)buf, 1, 0 };
+    if (ms_blkdev_submit(driver_data, &io, 1) < 0 || io.status < 0) return -1;
+    return (int)count;
+}
+
+static int ms_blkdev_flush(void* driver_data) {
+    int index = (int)(uint64_t)driver_data;
+    if (index < 0 || index >= ms_count) return -1;
+    ms_dev_t* d = &ms_devs[index];
+    uint8_t cdb[10] = { SCSI_SYNC_CACHE_10 };
+    // Sticks without a write cache reject the command; only a lost device
+    // is an error
+    ms_command(d, cdb, 10, (void*)0, 0, 0);
+    return d->failed ? -1 : 0;
+}
+
+// ---------- Initialization ----------
+
+// Wait for the medium: a fresh device reports a unit attention first,
+// which REQUEST SENSE clears
+static int ms_unit_ready(ms_dev_t* d, uint8_t* scratch) {
+    for (int i = 0; i < 5; i++) {
+        uint8_t tur[6] = { SCSI_TEST_UNIT_READY };
+        if (ms_command(d, tur, 6, (void*)0, 0, 0) == 0) return 0;
+        if (d->failed) return -1;
+        uint8_t sense[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, 18, 0 };
+        ms_command(d, sense, 6, scratch, 18, 1);
+    }
+    return -1;
+}
+
+// Set up one bulk-only SCSI device. Returns 0 if it is usable.
+static int ms_probe(ms_dev_t* d, usb_device_t* dev) {
+    memset(d, 0, sizeof(*d));
+    waitq_init(&d->wq);
+    d->slot_id = dev->slot_id;
+    for (int e = 0; e < dev->num_endpoints && e < USB_MAX_ENDPOINTS; e++) {
+        if ((dev->endpoints[e].type & USB_EP_TYPE_MASK) != USB_EP_TYPE_BULK) continue;
+        uint8_t addr = dev->endpoints[e].address;
+        if (addr & USB_EP_DIR_IN) { if (!d->ep_in) d->ep_in = addr; }
+        else if (!d->ep_out) d->ep_out = addr;
+    }
+    if (!d->ep_in || !d->ep_out) return -1;
+    if (!xhci_open_endpoint(d->slot_id, d->ep_in) || !xhci_open_endpoint(d->slot_id, d->ep_out))
+        return -1;
+
+    d->cbw = (usb_ms_cbw_t*)kmalloc(sizeof(usb_ms_cbw_t));
+    d->csw = (usb_ms_csw_t*)kmalloc(sizeof(usb_ms_csw_t));
+    uint8_t* scratch = (uint8_t*)kmalloc(64);
+    if (!d->cbw || !d->csw || !scratch) goto fail;
+
+    // Start from a clean transport state
+    usb_setup_packet_t reset = { USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+                                 USB_MS_REQ_RESET, 0, d->interface, 0 };
+    xhci_control_transfer(d->slot_id, &reset, (void*)0, 0);
+
+    if (ms_unit_ready(d, scratch) < 0) goto fail;
+    uint8_t cap[10] = { SCSI_READ_CAPACITY_10 };
+    if (ms_command(d, cap, 10, scratch, 8, 1) < 0) goto fail;
+    // Last LBA and block length; only 512-byte blocks map onto blkdev
+    d->sectors = (uint64_t)get_be32(scratch) + 1;
+    if (get_be32(scratch + 4) != BLKDEV_SECTOR_SIZE) goto fail;
+
+    kfree(scratch);
+    return 0;
+
+fail:
+    if (scratch) kfree(scratch);
+    if (d->cbw) kfree(d->cbw);
+    if (d->csw) kfree(d->csw);
+    return -1;
+}
+
+int usb_storage_init(void) {
+    ms_count = 0;
+    int count = usb_get_device_count();
+    for (int i = 0; i < count && ms_count < USB_MS_MAX_DEVICES; i++) {
+        usb_device_t* dev = usb_get_device(i);
+        if (!dev || dev->class_code != USB_CLASS_MASS_STORAGE ||
+            dev->subclass != USB_MS_SUBCLASS_SCSI || dev->protocol != USB_MS_PROTOCOL_BOT)
+            continue;
+
+        ms_dev_t* d = &ms_devs[ms_count];
+        if (ms_probe(d, dev) < 0) continue;
+        d->present = 1;
+        int index = ms_count++;
+
+        blkdev_ops_t ops;
+        ops.read_sectors = ms_blkdev_read;
+        ops.write_sectors = ms_blkdev_write;
+        ops.flush = ms_blkdev_flush;
+        ops.submit = ms_blkdev_submit;
+        char name[16] = "usb0";
+        name[3] = '0' + (char)index;
+        d->blkdev_id = blkdev_register(name, BLKDEV_TYPE_USB_MASS, d->sectors,
+                                       BLKDEV_SECTOR_SIZE, (void*)(uint64_t)index, &ops);
+    }
+    return ms_count;
+}
+
+int usb_storage_get_count(void) {
+    return ms_count;
+}
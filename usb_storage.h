@@ -0,0 +1,72 @@
+// usb_storage.h - USB Mass Storage (Bulk-Only Transport) Driver for Alteo OS
+// Drives SCSI disks behind the bulk-only transport: each command is a
+// 31-byte wrapper (CBW) on the bulk OUT pipe, an optional data phase and
+// a 13-byte status (CSW) on the bulk IN pipe. The transport allows one
+// command at a time, so a command's whole data phase (as 64KB TDs) and
+// its CSW are queued with its CBW, and the next command is issued from the
+// CSW's completion: a batch of reads streams without a thread in the loop.
+// Disks register with blkdev as usb0, usb1...
+#ifndef USB_STORAGE_H
+#define USB_STORAGE_H
+
+#include "stdint.h"
+
+// Interface subclass / protocol
+#define USB_MS_SUBCLASS_SCSI    0x06
+#define USB_MS_PROTOCOL_BOT     0x50
+
+// Class requests
+#define USB_MS_REQ_RESET        0xFF    // Bulk-Only Mass Storage Reset
+#define USB_MS_REQ_GET_MAX_LUN  0xFE
+
+// Command block wrapper
+#define USB_MS_CBW_SIGNATURE    0x43425355  // "USBC"
+#define USB_MS_CBW_SIZE         31
+#define USB_MS_CBW_IN           0x80        // Flags: data phase is device to host
+
+typedef struct __attribute__((packed)) {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_length;
+    uint8_t  flags;
+    uint8_t  lun;
+    uint8_t  cb_length;
+    uint8_t  cb[16];
+} usb_ms_cbw_t;
+
+// Command status wrapper
+#define USB_MS_CSW_SIGNATURE    0x53425355  // "USBS"
+#define USB_MS_CSW_SIZE         13
+#define USB_MS_CSW_PASSED       0
+#define USB_MS_CSW_FAILED       1
+#define USB_MS_CSW_PHASE_ERROR  2
+
+typedef struct __attribute__((packed)) {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t residue;
+    uint8_t  status;
+} usb_ms_csw_t;
+
+// SCSI operation codes
+#define SCSI_TEST_UNIT_READY    0x00
+#define SCSI_REQUEST_SENSE      0x03
+#define SCSI_READ_CAPACITY_10   0x25
+#define SCSI_READ_10            0x28
+#define SCSI_WRITE_10           0x2A
+#define SCSI_SYNC_CACHE_10      0x35
+
+#define USB_MS_MAX_DEVICES      4
+#define USB_MS_CMD_SECTORS      1024        // Per READ(10)/WRITE(10): 512KB
+#define USB_MS_TD_BYTES         65536       // Data phase queued in TDs of this size
+#define USB_MS_TIMEOUT_NS       5000000000ULL   // Per command of a chain
+#define USB_MS_POLL_SPINS       50000000    // Timeout before timer_init
+
+// Find bulk-only SCSI disks among the enumerated USB devices and register
+// them with blkdev (after usb_init and blkdev_init). Returns the count.
+int usb_storage_init(void);
+
+// Number of disks registered
+int usb_storage_get_count(void);
+
+#endif
@@ -0,0 +1,126 @@
+// vdso.c - Virtual Dynamic Shared Object for Alteo OS
+// The code page is hand-assembled and position independent apart from the
+// two data page addresses patched in by vdso_init.
+#include "vdso.h"
+#include "klib.h"
+#include "pmm.h"
+#include "timer.h"
+
+static uint8_t*     vdso_code;   // Frames shared by every mapping
+static vdso_data_t* vdso_data;
+
+// uint64_t clock_ns(void)
+static const uint8_t vdso_clock_ns[] = {
+    0x48, 0xBE, 0, 0, 0, 0, 0, 0, 0, 0,     // movabs rsi, VDSO_DATA_ADDR
+    0x8B, 0x0E,                             // 1: mov ecx, [rsi]          (seq)
+    0xF7, 0xC1, 0x01, 0x00, 0x00, 0x00,     // test ecx, 1
+    0x75, 0x42,                             // jnz 2f                     (update running)
+    0x4C, 0x8B, 0x46, 0x08,                 // mov r8, [rsi+8]            (tsc_base)
+    0x4C, 0x8B, 0x4E, 0x10,                 // mov r9, [rsi+16]           (tsc_hz)
+    0x4C, 0x8B, 0x56, 0x18,                 // mov r10, [rsi+24]          (ticks)
+    0x3B, 0x0E,                             // cmp ecx, [rsi]
+    0x75, 0xE6,                             // jne 1b                     (changed: retry)
+    0x4D, 0x85, 0xC9,                       // test r9, r9
+    0x74, 0x31,                             // jz 3f                      (no TSC clock)
+    0x0F, 0xAE, 0xE8,                       // lfence
+    0x0F, 0x31,                             // rdtsc
+    0x48, 0xC1, 0xE2, 0x20,                 // shl rdx, 32
+    0x48, 0x09, 0xD0,                       // or rax, rdx
+    0x4C, 0x29, 0xC0,                       // sub rax, r8
+    0x31, 0xD2,                             // xor edx, edx
+    0x49, 0xF7, 0xF1,                       // div r9                     (seconds, remainder)
+    0x4C, 0x69, 0xD0, 0x00, 0xCA, 0x9A, 0x3B, // imul r10, rax, 1000000000
+    0x48, 0x89, 0xD0,                       // mov rax, rdx
+    0xB9, 0x00, 0xCA, 0x9A, 0x3B,           // mov ecx, 1000000000
+    0x48, 0xF7, 0xE1,                       // mul rcx
+    0x49, 0xF7, 0xF1,                       // div r9
+    0x4C, 0x01, 0xD0,                       // add rax, r10
+    0xC3,                                   // ret
+    0xF3, 0x90,                             // 2: pause
+    0xEB, 0xB0,                             // jmp 1b
+    0x49, 0x69, 0xC2, 0x80, 0x96, 0x98, 0x00, // 3: imul rax, r10, TIMER_TICK_NS
+    0xC3                                    // ret
+};
+
+// uint64_t ticks(void), at VDSO_FN_TICKS
+static const uint8_t vdso_ticks[] = {
+    0xE8, 0x7B, 0xFF, 0xFF, 0xFF,           // call clock_ns
+    0x31, 0xD2,                             // xor edx, edx
+    0xB9, 0x80, 0x96, 0x98, 0x00,           // mov ecx, TIMER_TICK_NS
+    0x48, 0xF7, 0xF1,                       // div rcx
+    0xC3                                    // ret
+};
+
+// int getpid(void), at VDSO_FN_GETPID
+static const uint8_t vdso_getpid[] = {
+    0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0,     // movabs rax, VDSO_PROC_ADDR
+    0x48, 0x63, 0x00,                       // movsxd rax, dword [rax]    (pid)
+    0xC3                                    // ret
+};
+
+void vdso_init(void) {
+    vdso_code = (uint8_t*)pmm_alloc_block();
+    vdso_data = (vdso_data_t*)pmm_alloc_block();
+    if (!vdso_code || !vdso_data) return;
+
+    memset(vdso_code, 0xCC, VMM_PAGE_SIZE);   // int3 between the functions
+    memcpy(vdso_code + VDSO_FN_CLOCK_NS, vdso_clock_ns, sizeof(vdso_clock_ns));
+    memcpy(vdso_code + VDSO_FN_TICKS, vdso_ticks, sizeof(vdso_ticks));
+    memcpy(vdso_code + VDSO_FN_GETPID, vdso_getpid, sizeof(vdso_getpid));
+    uint64_t data = VDSO_DATA_ADDR, proc = VDSO_PROC_ADDR;
+    memcpy(vdso_code + VDSO_FN_CLOCK_NS + 2, &data, sizeof(data));
+    memcpy(vdso_code + VDSO_FN_GETPID + 2, &proc, sizeof(proc));
+
+    memset(vdso_data, 0, VMM_PAGE_SIZE);
+    uint64_t base, hz;
+    timer_get_tsc(&base, &hz);
+    vdso_data->seq = 1;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vdso_data->tsc_base = base;
+    vdso_data->tsc_hz = hz;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vdso_data->seq = 2;
+}
+
+void vdso_set_ticks(uint64_t ticks) {
+    if (!vdso_data) return;
+    vdso_data->seq++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vdso_data->ticks = ticks;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vdso_data->seq++;
+}
+
+// Map a shared frame read-only unless pml4 already has it
+static int vdso_map_shared(pte_t* pml4, uint64_t virt, void* frame) {
+    if (vmm_get_physical(pml4, virt)) return 0;
+    pmm_page_ref(frame);
+    if (vmm_map_page(pml4, virt, (uint64_t)frame, VMM_FLAG_PRESENT | VMM_FLAG_USER) < 0) {
+        pmm_free_block(frame);
+        return -1;
+    }
+    return 0;
+}
+
+int vdso_map(pte_t* pml4, int pid) {
+    if (!vdso_code || !vdso_data || !pml4) return -1;
+    if (vdso_map_shared(pml4, VDSO_CODE_ADDR, vdso_code) < 0) return -1;
+    if (vdso_map_shared(pml4, VDSO_DATA_ADDR, vdso_data) < 0) return -1;
+
+    // A fork child starts with its parent's page
+    uint64_t old = vmm_get_physical(pml4, VDSO_PROC_ADDR);
+    vdso_proc_t* proc = (vdso_proc_t*)pmm_alloc_block();
+    if (!proc) return -1;
+    memset(proc, 0, VMM_PAGE_SIZE);
+    proc->pid = pid;
+    if (old) {
+        vmm_unmap_page(pml4, VDSO_PROC_ADDR);
+        pmm_free_block((void*)old);
+    }
+    if (vmm_map_page(pml4, VDSO_PROC_ADDR, (uint64_t)proc,
+                     VMM_FLAG_PRESENT | VMM_FLAG_USER | VMM_FLAG_NX) < 0) {
+        pmm_free_block(proc);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+// vdso.h - Virtual Dynamic Shared Object for Alteo OS
+// Three read-only pages mapped into every process image let the clock,
+// uptime and getpid calls run in user space without a mode switch:
+//   VDSO_CODE_ADDR  code, one function at each VDSO_FN_* offset
+//   VDSO_DATA_ADDR  vdso_data_t, shared by all processes
+//   VDSO_PROC_ADDR  vdso_proc_t, private to the process
+// The kernel publishes the TSC calibration (and, without the TSC clock,
+// the tick count) under a sequence counter; readers retry while it is odd
+// or changes under them. The code computes exactly what timer_now_ns()
+// and the scheduler tick count do.
+#ifndef VDSO_H
+#define VDSO_H
+
+#include "stdint.h"
+#include "vmm.h"
+
+#define VDSO_CODE_ADDR      0x7FFF00010000ULL
+#define VDSO_DATA_ADDR      (VDSO_CODE_ADDR + 0x1000)
+#define VDSO_PROC_ADDR      (VDSO_CODE_ADDR + 0x2000)
+
+// Entry points (offsets into the code page), SysV calling convention
+#define VDSO_FN_CLOCK_NS    0x00    // uint64_t clock_ns(void): ns since boot
+#define VDSO_FN_TICKS       0x80    // uint64_t ticks(void): SYS_CLOCK / SYS_UPTIME
+#define VDSO_FN_GETPID      0xC0    // int getpid(void): SYS_GETPID
+
+typedef struct {
+    volatile uint32_t seq;  // Odd while the kernel is updating
+    uint32_t reserved;
+    uint64_t tsc_base;      // TSC at timer_init
+    uint64_t tsc_hz;        // 0 until the TSC clock runs: use ticks
+    uint64_t ticks;         // Scheduler ticks, counted without the TSC clock
+} vdso_data_t;
+
+typedef struct {
+    int32_t pid;
+} vdso_proc_t;
+
+// Build the shared pages (after timer_init)
+void vdso_init(void);
+
+// Publish the tick count (tick handlers, only while the TSC clock is off)
+void vdso_set_ticks(uint64_t ticks);
+
+// Map the vDSO into pml4 for process pid, replacing a per-process page
+// inherited through fork. Returns 0, or -1 out of memory.
+int vdso_map(pte_t* pml4, int pid);
+
+#endif
@@ -1,6 +1,12 @@
 // vfs.c - Virtual File System Layer for Alteo OS
 // Provides an in-memory filesystem with directories, files, and permissions
 #include "vfs.h"
+#include "klib.h"
+#include "dcache.h"
+#include "heap.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "rcu.h"
 
 // ---- String helpers (no libc) ----
 static int vfs_strlen(const char* s) { int l = 0; while (s[l]) l++; return l; }
@@ -15,36 +21,148 @@ static int vfs_strncpy(char* d, const char* s, int n) {
     d[i] = 0;
     return i;
 }
-static void vfs_memset(void* p, int v, int n) {
-    unsigned char* b = (unsigned char*)p;
-    for (int i = 0; i < n; i++) b[i] = (unsigned char)v;
-}
-static void vfs_memcpy(void* dst, const void* src, int n) {
-    unsigned char* d = (unsigned char*)dst;
-    const unsigned char* s = (const unsigned char*)src;
-    for (int i = 0; i < n; i++) d[i] = s[i];
-}
-
 // ---- Node storage ----
+// Free nodes and fds are chained through node_next / fd_next (-1 ends a
+// list), so allocating either is a pop instead of a table scan.
 static vfs_node_t nodes[VFS_MAX_FILES];
 static vfs_fd_t fds[VFS_MAX_OPEN];
+static int node_next[VFS_MAX_FILES];
+static int fd_next[VFS_MAX_OPEN];
+static int node_free = -1;
+static int fd_free = -1;
+static int node_count = 0;
 static char cwd[VFS_MAX_PATH] = "/";
 static int vfs_initialized = 0;
 static vfs_mount_t mounts[VFS_MAX_MOUNTS];
+static uint8_t zero_page[VFS_PAGE_SIZE];   // What holes read as
+
+// ---- Page storage ----
+// A file's data pages hang off a radix tree of PMM pages, each holding
+// 512 pointers (all identity-mapped). A tree of height h covers 512^h
+// pages. It grows upwards when a write lands past its reach, and missing
+// pages are holes that read as zeros.
+
+#define RADIX_SLOTS (1 << VFS_RADIX_SHIFT)
+
+static uint64_t* radix_alloc(void) {
+    uint64_t* page = (uint64_t*)pmm_alloc_block();
+    if (page) memset(page, 0, VFS_PAGE_SIZE);
+    return page;
+}
+
+static void radix_free(uint64_t* table, int level) {
+    for (int i = 0; i < RADIX_SLOTS; i++) {
+        if (!table[i]) continue;
+        if (level > 0) radix_free((uint64_t*)(uintptr_t)table[i], level - 1);
+        else pmm_free_block((void*)(uintptr_t)table[i]);
+    }
+    pmm_free_block(table);
+}
+
+// Release every data page of a file
+static void node_free_pages(vfs_node_t* node) {
+    if (node->pages) radix_free(node->pages, node->height - 1);
+    node->pages = 0;
+    node->height = 0;
+    node->page_count = 0;
+}
+
+uint8_t* vfs_node_page(vfs_node_t* node, uint32_t index, int alloc) {
+    if (!node || !node->in_use || node->type != VFS_FILE) return 0;
+
+    int need = 1;
+    while (need < VFS_RADIX_MAX_HEIGHT && (index >> (VFS_RADIX_SHIFT * need))) need++;
+    if (need > node->height) {
+        if (!alloc) return 0;
+        // Grow upwards: the old root becomes slot 0 of a new one
+        while (node->height < need) {
+            uint64_t* root = radix_alloc();
+            if (!root) return 0;
+            if (node->pages) root[0] = (uint64_t)(uintptr_t)node->pages;
+            node->pages = root;
+            node->height++;
+        }
+    }
+
+    uint64_t* table = node->pages;
+    for (int level = node->height - 1; level > 0; level--) {
+        int slot = (index >> (VFS_RADIX_SHIFT * level)) & (RADIX_SLOTS - 1);
+        if (!table[slot]) {
+            if (!alloc) return 0;
+            uint64_t* next = radix_alloc();
+            if (!next) return 0;
+            table[slot] = (uint64_t)(uintptr_t)next;
+        }
+        table = (uint64_t*)(uintptr_t)table[slot];
+    }
+    int slot = index & (RADIX_SLOTS - 1);
+    if (!table[slot]) {
+        if (!alloc) return 0;
+        uint8_t* page = (uint8_t*)radix_alloc();
+        if (!page) return 0;
+        table[slot] = (uint64_t)(uintptr_t)page;
+        node->page_count++;
+    }
+    return (uint8_t*)(uintptr_t)table[slot];
+}
+
+// mmap: a mapping takes its own reference on the file's frame, so a
+// truncate or delete leaves mapped pages valid (though detached from the
+// file). Holes inside the file are filled in when they are mapped.
+static void* vfs_pager_get_page(void* object, uint64_t index, int write) {
+    vfs_node_t* node = (vfs_node_t*)object;
+    (void)write;   // Shared mappings write straight into the file's pages
+    if (!node->in_use) return 0;
+    if (index >= ((uint64_t)node->size + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE) return 0;
+    uint8_t* page = vfs_node_page(node, (uint32_t)index, 1);
+    if (page) pmm_page_ref(page);
+    return page;
+}
+
+static const vmm_pager_t vfs_pager = { vfs_pager_get_page };
+
+const struct vmm_pager* vfs_get_pager(void) {
+    return &vfs_pager;
+}
 
 // ---- Internal helpers ----
 static int alloc_node(void) {
-    for (int i = 0; i < VFS_MAX_FILES; i++) {
-        if (!nodes[i].in_use) return i;
+    int i = node_free;
+    if (i < 0) return -1;
+    node_free = node_next[i];
+    node_count++;
+    return i;
+}
+
+static void free_node(int i) {
+    nodes[i].in_use = 0;
+    node_next[i] = node_free;
+    node_free = i;
+    node_count--;
+}
+
+// Append nid to a directory's child list, growing it as needed
+static int add_child(vfs_node_t* dir, int nid) {
+    if (dir->child_count == dir->child_cap) {
+        int cap = dir->child_cap ? dir->child_cap * 2 : 8;
+        int* grown = (int*)kmalloc(cap * sizeof(int));
+        if (!grown) return -1;
+        if (dir->children) {
+            memcpy(grown, dir->children, dir->child_count * sizeof(int));
+            kfree(dir->children);
+        }
+        dir->children = grown;
+        dir->child_cap = cap;
     }
-    return -1;
+    dir->children[dir->child_count++] = nid;
+    return 0;
 }
 
 static int alloc_fd(void) {
-    for (int i = 0; i < VFS_MAX_OPEN; i++) {
-        if (!fds[i].in_use) return i;
-    }
-    return -1;
+    int i = fd_free;
+    if (i < 0) return -1;
+    fd_free = fd_next[i];
+    return i;
 }
 
 // Parse path into components, resolve node
@@ -88,6 +206,13 @@ static int resolve_path(const char* path) {
         }
 
         // Find child named component
+        uint64_t cached;
+        int hit = dcache_lookup(nodes, (uint64_t)cur, component, &cached);
+        if (hit == DCACHE_NEGATIVE) return -1;
+        if (hit == DCACHE_FOUND) {
+            cur = (int)cached;
+            continue;
+        }
         int found = -1;
         for (int i = 0; i < nodes[cur].child_count; i++) {
             int child = nodes[cur].children[i];
@@ -97,7 +222,11 @@ static int resolve_path(const char* path) {
                 break;
             }
         }
-        if (found < 0) return -1; // not found
+        if (found < 0) {
+            dcache_add_negative(nodes, (uint64_t)cur, component);
+            return -1; // not found
+        }
+        dcache_add(nodes, (uint64_t)cur, component, (uint64_t)found);
         cur = found;
     }
     return cur;
@@ -138,15 +267,129 @@ static int resolve_parent(const char* path, char* last_component) {
     return resolve_path(buf);
 }
 
+// ---- Mount tree ----
+// Mount points indexed by path component. Node 0 is "/"; each node chains
+// its children through sibling. Finding the mount for a path is one walk
+// down the tree followed by a climb to the nearest mounted node.
+//
+// Lookups run as RCU readers and take no lock. Mount and umount (under
+// the BKL) fill a node or mount entry before linking it in, and umount
+// waits out readers before an unlinked node or entry can be reused.
+#define MOUNT_TREE_NODES (VFS_MAX_MOUNTS * 8)
+
+typedef struct {
+    char name[VFS_MAX_NAME];
+    int parent;
+    int child;             // First child, -1 if none
+    int sibling;           // Next child of the same parent, -1 if last
+    int mount;             // Index into mounts[], -1 if nothing mounted here
+    int in_use;
+} mount_node_t;
+
+static mount_node_t mtree[MOUNT_TREE_NODES];
+
+static void mount_tree_init(void) {
+    memset(mtree, 0, sizeof(mtree));
+    mtree[0].in_use = 1;
+    mtree[0].parent = -1;
+    mtree[0].child = -1;
+    mtree[0].sibling = -1;
+    mtree[0].mount = -1;
+}
+
+// Copy the next component of *p into name (truncated to VFS_MAX_NAME) and
+// step past it. Returns 0 once the path is used up.
+static int next_component(const char** p, char* name) {
+    const char* s = *p;
+    while (*s == '/') s++;
+    int n = 0;
+    for (; *s && *s != '/'; s++) {
+        if (n < VFS_MAX_NAME - 1) name[n++] = *s;
+    }
+    name[n] = 0;
+    *p = s;
+    return n > 0;
+}
+
+static int mount_tree_child(int parent, const char* name) {
+    for (int c = mtree[parent].child; c >= 0; c = mtree[c].sibling) {
+        if (vfs_strcmp(mtree[c].name, name) == 0) return c;
+    }
+    return -1;
+}
+
+// Node for an absolute mount point, created along with any missing
+// ancestors. Returns -1 if the pool runs out.
+static int mount_tree_insert(const char* path) {
+    int cur = 0;
+    char name[VFS_MAX_NAME];
+    while (next_component(&path, name)) {
+        if (vfs_strcmp(name, ".") == 0) continue;
+        int c = mount_tree_child(cur, name);
+        if (c < 0) {
+            for (c = 1; c < MOUNT_TREE_NODES && mtree[c].in_use; c++) {}
+            if (c == MOUNT_TREE_NODES) return -1;
+            vfs_strcpy(mtree[c].name, name);
+            mtree[c].in_use = 1;
+            mtree[c].parent = cur;
+            mtree[c].child = -1;
+            mtree[c].mount = -1;
+            mtree[c].sibling = mtree[cur].child;
+            rcu_assign_pointer(mtree[cur].child, c);
+        }
+        cur = c;
+    }
+    return cur;
+}
+
+// Free n and any ancestors left with neither a mount nor children
+static void mount_tree_prune(int n) {
+    while (n > 0 && mtree[n].mount < 0 && mtree[n].child < 0) {
+        int p = mtree[n].parent;
+        int* link = &mtree[p].child;
+        while (*link != n) link = &mtree[*link].sibling;
+        *link = mtree[n].sibling;
+        mtree[n].in_use = 0;
+        n = p;
+    }
+}
+
+// Walk path from node cur. Components below the tree's leaves are
+// counted in *below, so ".." climbs back out of them first.
+static int mount_tree_walk(int cur, const char* path, int* below) {
+    char name[VFS_MAX_NAME];
+    while (next_component(&path, name)) {
+        if (vfs_strcmp(name, ".") == 0) continue;
+        if (vfs_strcmp(name, "..") == 0) {
+            if (*below > 0) (*below)--;
+            else if (mtree[cur].parent >= 0) cur = mtree[cur].parent;
+            continue;
+        }
+        int c = *below ? -1 : mount_tree_child(cur, name);
+        if (c < 0) (*below)++;
+        else cur = c;
+    }
+    return cur;
+}
+
 // ---- Public API ----
 
 void vfs_init(void) {
-    vfs_memset(nodes, 0, sizeof(nodes));
-    vfs_memset(fds, 0, sizeof(fds));
-    vfs_memset(mounts, 0, sizeof(mounts));
+    memset(nodes, 0, sizeof(nodes));
+    dcache_forget_fs(nodes);
+    memset(fds, 0, sizeof(fds));
+    memset(mounts, 0, sizeof(mounts));
+    mount_tree_init();
     vfs_strcpy(cwd, "/");
 
+    // Chain every slot onto the free lists, lowest index first
+    node_free = fd_free = -1;
+    for (int i = VFS_MAX_FILES - 1; i >= 0; i--) { node_next[i] = node_free; node_free = i; }
+    for (int i = VFS_MAX_OPEN - 1; i >= 0; i--) { fd_next[i] = fd_free; fd_free = i; }
+    node_count = 0;
+
     // Create root directory (node 0)
+    alloc_node();
     nodes[0].in_use = 1;
     nodes[0].node_id = 0;
     nodes[0].type = VFS_DIRECTORY;
@@ -238,8 +481,8 @@ int vfs_open(const char* path, int flags) {
 
     // Truncate if requested
     if (flags & VFS_O_TRUNC) {
+        node_free_pages(&nodes[nid]);
         nodes[nid].size = 0;
-        vfs_memset(nodes[nid].data, 0, VFS_MAX_DATA);
     }
 
     // Append mode: start at end
@@ -253,21 +496,64 @@ int vfs_open(const char* path, int flags) {
 int vfs_close(int fd) {
     if (fd < 0 || fd >= VFS_MAX_OPEN || !fds[fd].in_use) return -1;
     fds[fd].in_use = 0;
+    fd_next[fd] = fd_free;
+    fd_free = fd;
     return 0;
 }
 
+// Copy up to count bytes at pos out of a file. Returns the bytes read.
+static int node_read(vfs_node_t* node, uint32_t pos, void* buf, uint32_t count) {
+    if (pos >= node->size) return 0;
+    uint32_t available = node->size - pos;
+    if (count > available) count = available;
+
+    uint8_t* out = (uint8_t*)buf;
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t in_page = (pos + done) % VFS_PAGE_SIZE;
+        uint32_t chunk = VFS_PAGE_SIZE - in_page;
+        if (chunk > count - done) chunk = count - done;
+        const uint8_t* page = vfs_node_page(node, (pos + done) / VFS_PAGE_SIZE, 0);
+        if (page) memcpy(out + done, page + in_page, chunk);
+        else memset(out + done, 0, chunk);
+        done += chunk;
+    }
+    return (int)count;
+}
+
+// Copy count bytes into a file at pos, extending it. Returns the bytes
+// written, short (or -1 for none) when memory runs out.
+static int node_write(vfs_node_t* node, uint32_t pos, const void* buf, uint32_t count) {
+    uint32_t space = 0x7FFFFFFFU - pos;   // Offsets stay seekable
+    if (pos > 0x7FFFFFFFU) space = 0;
+    if (count > space) count = space;
+    if (count == 0) return 0;
+
+    const uint8_t* in = (const uint8_t*)buf;
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t in_page = (pos + done) % VFS_PAGE_SIZE;
+        uint32_t chunk = VFS_PAGE_SIZE - in_page;
+        if (chunk > count - done) chunk = count - done;
+        uint8_t* page = vfs_node_page(node, (pos + done) / VFS_PAGE_SIZE, 1);
+        if (!page) break;   // Out of memory
+        memcpy(page + in_page, in + done, chunk);
+        done += chunk;
+    }
+    if (done == 0) return -1;
+
+    if (pos + done > node->size) node->size = pos + done;
+    return (int)done;
+}
+
 int vfs_read(int fd, void* buf, uint32_t count) {
     if (fd < 0 || fd >= VFS_MAX_OPEN || !fds[fd].in_use) return -1;
     vfs_node_t* node = &nodes[fds[fd].node_id];
     if (!node->in_use) return -1;
 
-    uint32_t available = node->size - fds[fd].offset;
-    if (count > available) count = available;
-    if (count == 0) return 0;
-
-    vfs_memcpy(buf, node->data + fds[fd].offset, count);
-    fds[fd].offset += count;
-    return (int)count;
+    int n = node_read(node, fds[fd].offset, buf, count);
+    fds[fd].offset += n;
+    return n;
 }
 
 int vfs_write(int fd, const void* buf, uint32_t count) {
@@ -275,16 +561,23 @@ int vfs_write(int fd, const void* buf, uint32_t count) {
     vfs_node_t* node = &nodes[fds[fd].node_id];
     if (!node->in_use) return -1;
 
-    uint32_t space = VFS_MAX_DATA - fds[fd].offset;
-    if (count > space) count = space;
-    if (count == 0) return 0;
+    int n = node_write(node, fds[fd].offset, buf, count);
+    if (n > 0) fds[fd].offset += n;
+    return n;
+}
 
-    vfs_memcpy(node->data + fds[fd].offset, buf, count);
-    fds[fd].offset += count;
-    if (fds[fd].offset > node->size) {
-        node->size = fds[fd].offset;
-    }
-    return (int)count;
+int vfs_pread(int fd, void* buf, uint32_t count, uint32_t offset) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !fds[fd].in_use) return -1;
+    vfs_node_t* node = &nodes[fds[fd].node_id];
+    if (!node->in_use) return -1;
+    return node_read(node, offset, buf, count);
+}
+
+int vfs_pwrite(int fd, const void* buf, uint32_t count, uint32_t offset) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !fds[fd].in_use) return -1;
+    vfs_node_t* node = &nodes[fds[fd].node_id];
+    if (!node->in_use) return -1;
+    return node_write(node, offset, buf, count);
 }
 
 int vfs_seek(int fd, int32_t offset, int whence) {
@@ -298,7 +591,6 @@ int vfs_seek(int fd, int32_t offset, int whence) {
         default: return -1;
     }
     if (new_off < 0) new_off = 0;
-    if (new_off > (int32_t)VFS_MAX_DATA) new_off = VFS_MAX_DATA;
     fds[fd].offset = (uint32_t)new_off;
     return 0;
 }
@@ -308,6 +600,25 @@ int vfs_tell(int fd) {
     return (int)fds[fd].offset;
 }
 
+int vfs_peek(int fd, const uint8_t** data) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !fds[fd].in_use || !data) return -1;
+    vfs_node_t* node = &nodes[fds[fd].node_id];
+    if (!node->in_use) return -1;
+    uint32_t pos = fds[fd].offset;
+    if (pos >= node->size) return 0;
+    uint32_t in_page = pos % VFS_PAGE_SIZE;
+    uint32_t span = VFS_PAGE_SIZE - in_page;
+    if (span > node->size - pos) span = node->size - pos;
+    const uint8_t* page = vfs_node_page(node, pos / VFS_PAGE_SIZE, 0);
+    *data = (page ? page : zero_page) + in_page;
+    return (int)span;
+}
+
+vfs_node_t* vfs_fd_node(int fd) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !fds[fd].in_use) return (vfs_node_t*)0;
+    return &nodes[fds[fd].node_id];
+}
+
 int vfs_create(const char* path, uint8_t type, uint8_t perms) {
     if (!vfs_initialized) return -1;
 
@@ -318,12 +629,11 @@ int vfs_create(const char* path, uint8_t type, uint8_t perms) {
     int parent_id = resolve_parent(path, last);
     if (parent_id < 0) return -1;
     if (nodes[parent_id].type != VFS_DIRECTORY) return -1;
-    if (nodes[parent_id].child_count >= VFS_MAX_CHILDREN) return -1;
 
     int nid = alloc_node();
     if (nid < 0) return -1;
 
-    vfs_memset(&nodes[nid], 0, sizeof(vfs_node_t));
+    memset(&nodes[nid], 0, sizeof(vfs_node_t));
     nodes[nid].in_use = 1;
     nodes[nid].node_id = nid;
     nodes[nid].type = type;
@@ -333,7 +643,11 @@ int vfs_create(const char* path, uint8_t type, uint8_t perms) {
     vfs_strncpy(nodes[nid].name, last, VFS_MAX_NAME);
 
     // Add to parent
-    nodes[parent_id].children[nodes[parent_id].child_count++] = nid;
+    if (add_child(&nodes[parent_id], nid) < 0) {
+        free_node(nid);
+        return -1;
+    }
+    dcache_add(nodes, (uint64_t)parent_id, nodes[nid].name, (uint64_t)nid);
 
     return nid;
 }
@@ -355,9 +669,15 @@ int vfs_delete(const char* path) {
                 break;
             }
         }
+        dcache_add_negative(nodes, (uint64_t)pid, nodes[nid].name);
     }
+    dcache_forget_dir(nodes, (uint64_t)nid);
 
-    nodes[nid].in_use = 0;
+    node_free_pages(&nodes[nid]);
+    if (nodes[nid].children) kfree(nodes[nid].children);
+    nodes[nid].children = 0;
+    nodes[nid].child_cap = 0;
+    free_node(nid);
     return 0;
 }
 
@@ -371,7 +691,10 @@ int vfs_rename(const char* oldpath, const char* newpath) {
     if (new_parent < 0) return -1;
 
     // Simple rename (same directory)
+    int pid = nodes[nid].parent;
+    if (pid >= 0) dcache_add_negative(nodes, (uint64_t)pid, nodes[nid].name);
     vfs_strncpy(nodes[nid].name, newname, VFS_MAX_NAME);
+    if (pid >= 0) dcache_add(nodes, (uint64_t)pid, nodes[nid].name, (uint64_t)nid);
     return 0;
 }
 
@@ -468,29 +791,14 @@ vfs_node_t* vfs_resolve(const char* path) {
 }
 
 int vfs_get_node_count(void) {
-    int count = 0;
-    for (int i = 0; i < VFS_MAX_FILES; i++) {
-        if (nodes[i].in_use) count++;
-    }
-    return count;
+    return node_count;
 }
 
 // ---- Mount Support ----
 
-// String helper for mount checking
-static int vfs_starts_with(const char* str, const char* prefix) {
-    while (*prefix) {
-        if (*str != *prefix) return 0;
-        str++;
-        prefix++;
-    }
-    // Check that str continues with '/' or ends (exact match)
-    return (*str == '/' || *str == '\0');
-}
-
 int vfs_mount(const char* mount_point, const char* fs_type,
               vfs_fs_ops_t* ops, void* fs_data) {
-    if (!mount_point || !fs_type || !ops) return -1;
+    if (!mount_point || !fs_type || !ops || mount_point[0] != '/') return -1;
 
     // Find a free mount slot
     int slot = -1;
@@ -499,12 +807,9 @@ int vfs_mount(const char* mount_point, const char* fs_type,
     }
     if (slot < 0) return -1; // No free slots
 
-    // Check if mount point already in use
-    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
-        if (mounts[i].active && vfs_strcmp(mounts[i].mount_point, mount_point) == 0) {
-            return -1; // Already mounted
-        }
-    }
+    int node = mount_tree_insert(mount_point);
+    if (node < 0) return -1;
+    if (mtree[node].mount >= 0) return -1; // Already mounted
 
     // Ensure the mount point directory exists in the VFS
     if (!vfs_exists(mount_point)) {
@@ -517,42 +822,42 @@ int vfs_mount(const char* mount_point, const char* fs_type,
     mounts[slot].ops = ops;
     mounts[slot].fs_data = fs_data;
     mounts[slot].active = 1;
+    rcu_assign_pointer(mtree[node].mount, slot);
 
     return 0;
 }
 
 int vfs_umount(const char* mount_point) {
-    if (!mount_point) return -1;
-
-    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
-        if (mounts[i].active && vfs_strcmp(mounts[i].mount_point, mount_point) == 0) {
-            mounts[i].active = 0;
-            mounts[i].ops = (vfs_fs_ops_t*)0;
-            mounts[i].fs_data = (void*)0;
-            return 0;
-        }
-    }
-    return -1; // Not found
+    if (!mount_point || mount_point[0] != '/') return -1;
+
+    int below = 0;
+    int node = mount_tree_walk(0, mount_point, &below);
+    if (below || mtree[node].mount < 0) return -1; // Not found
+
+    int i = mtree[node].mount;
+    mtree[node].mount = -1;
+    mount_tree_prune(node);
+    synchronize_rcu();
+    mounts[i].active = 0;
+    mounts[i].ops = (vfs_fs_ops_t*)0;
+    mounts[i].fs_data = (void*)0;
+    return 0;
 }
 
 int vfs_find_mount(const char* path) {
     if (!path) return -1;
 
-    int best = -1;
-    int best_len = 0;
-
-    // Find the longest matching mount point (most specific mount)
-    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
-        if (!mounts[i].active) continue;
-        int mlen = vfs_strlen(mounts[i].mount_point);
-        if (vfs_starts_with(path, mounts[i].mount_point)) {
-            if (mlen > best_len) {
-                best_len = mlen;
-                best = i;
-            }
-        }
-    }
-    return best;
+    // The most specific mount is the nearest mounted node at or above
+    // where the path leaves the tree. Relative paths start from cwd.
+    uint64_t flags = rcu_read_lock();
+    int below = 0;
+    int node = 0;
+    if (path[0] != '/') node = mount_tree_walk(0, cwd, &below);
+    node = mount_tree_walk(node, path, &below);
+    while (node >= 0 && mtree[node].mount < 0) node = mtree[node].parent;
+    int mount = node >= 0 ? mtree[node].mount : -1;
+    rcu_read_unlock(flags);
+    return mount;
 }
 
 const vfs_mount_t* vfs_get_mounts(void) {
@@ -1,4 +1,8 @@
 // vfs.h - Virtual File System Layer for Alteo OS
+// The in-memory tree is a tmpfs: file contents live in PMM pages found
+// through a per-file radix tree, allocated as they are written, so files
+// grow as far as memory allows and holes cost nothing. Directories hold
+// any number of children.
 #ifndef VFS_H
 #define VFS_H
 
@@ -31,10 +35,11 @@
 // Limits
 #define VFS_MAX_NAME    64
 #define VFS_MAX_PATH    256
-#define VFS_MAX_FILES   128
+#define VFS_MAX_FILES   4096
 #define VFS_MAX_OPEN    32
-#define VFS_MAX_CHILDREN 32
-#define VFS_MAX_DATA    4096
+#define VFS_PAGE_SIZE   4096
+#define VFS_RADIX_SHIFT 9       // 512 entries per radix tree page
+#define VFS_RADIX_MAX_HEIGHT 3  // 2^27 pages, more than a 32-bit size needs
 
 // Directory entry (returned by readdir)
 typedef struct {
@@ -56,11 +61,15 @@ typedef struct vfs_node {
     uint32_t modified;     // modification tick
     uint16_t uid;          // owner user id
     uint16_t gid;          // owner group id
-    // For files: inline data storage
-    uint8_t data[VFS_MAX_DATA];
+    // For files: radix tree of data pages (each level a page of 512
+    // pointers; height 0 = no pages)
+    uint64_t* pages;
+    uint8_t  height;
+    uint32_t page_count;   // data pages allocated
     // For directories: children
     int child_count;
-    int children[VFS_MAX_CHILDREN]; // indices into node table
+    int child_cap;
+    int* children;         // indices into node table (kmalloc'd)
     int parent;            // parent node index (-1 for root)
     int node_id;           // index in node table
     int in_use;            // is this node allocated
@@ -82,8 +91,22 @@ int vfs_open(const char* path, int flags);
 int vfs_close(int fd);
 int vfs_read(int fd, void* buf, uint32_t count);
 int vfs_write(int fd, const void* buf, uint32_t count);
+// Read/write at offset without using or moving the fd's position
+int vfs_pread(int fd, void* buf, uint32_t count, uint32_t offset);
+int vfs_pwrite(int fd, const void* buf, uint32_t count, uint32_t offset);
 int vfs_seek(int fd, int32_t offset, int whence);
 int vfs_tell(int fd);
+vfs_node_t* vfs_fd_node(int fd);   // Node an open fd refers to (NULL if closed)
+// Zero-copy read: point *data at the file contents from the fd's offset and
+// return the byte count up to the end of that page (0 at EOF, -1 on
+// error). Advance with vfs_seek.
+int vfs_peek(int fd, const uint8_t** data);
+// Data page index of a file (for mapping it directly), allocated zeroed
+// if alloc is set. Returns 0 for a hole (without alloc) or out of memory.
+uint8_t* vfs_node_page(vfs_node_t* node, uint32_t index, int alloc);
+// Pager for file-backed mmap of a node (object = vfs_node_t*)
+struct vmm_pager;
+const struct vmm_pager* vfs_get_pager(void);
 
 // File management
 int vfs_create(const char* path, uint8_t type, uint8_t perms);
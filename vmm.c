@@ -1,24 +1,31 @@
 // vmm.c - Virtual Memory Manager for Alteo OS
 // Implements 4-level page tables with identity mapping and per-process address spaces
 #include "vmm.h"
+#include "klib.h"
 #include "pmm.h"
 #include "isr.h"
+#include "process.h"
+#include "scheduler.h"
+#include "signal.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "trace.h"
+#include "zswap.h"
+#include "klog.h"
 
 // Kernel PML4 - shared across all address spaces
 static pte_t* kernel_pml4 = 0;
 
-// ---------- Helpers ----------
+// Per-process VMA tables (indexed by process table slot)
+static vmm_vma_t proc_vmas[MAX_PROCESSES][VMM_MAX_VMAS];
 
-static void vmm_memset(void* ptr, int val, uint64_t size) {
-    uint8_t* p = (uint8_t*)ptr;
-    for (uint64_t i = 0; i < size; i++) p[i] = (uint8_t)val;
-}
+// ---------- Helpers ----------
 
 // Allocate a zeroed 4KB page for use as a page table
 static pte_t* vmm_alloc_table(void) {
     void* page = pmm_alloc_block();
     if (!page) return 0;
-    vmm_memset(page, 0, VMM_PAGE_SIZE);
+    memset(page, 0, VMM_PAGE_SIZE);
     return (pte_t*)page;
 }
 
@@ -40,12 +47,567 @@ static inline void write_cr3(uint64_t val) {
     __asm__ volatile("mov %0, %%cr3" :: "r"(val) : "memory");
 }
 
+static inline uint64_t read_cr4(void) {
+    uint64_t val;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(val));
+    return val;
+}
+
+static inline void write_cr4(uint64_t val) {
+    __asm__ volatile("mov %0, %%cr4" :: "r"(val) : "memory");
+}
+
 void vmm_invlpg(uint64_t addr) {
     __asm__ volatile("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
+// CPUID.80000001h:EDX[26] - 1GB pages supported (cached after first query)
+static int vmm_gb_pages = -1;
+
+static int vmm_has_gb_pages(void) {
+    if (vmm_gb_pages < 0) {
+        uint32_t eax = 0x80000000, ebx, ecx, edx;
+        __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+        vmm_gb_pages = 0;
+        if (eax >= 0x80000001) {
+            eax = 0x80000001;
+            __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+            vmm_gb_pages = (edx >> 26) & 1;
+        }
+    }
+    return vmm_gb_pages;
+}
+
+// ---------- PAT ----------
+// IA32_PAT holds the memory type for each PAT/PCD/PWT combination. The
+// power-on layout is WB, WT, UC-, UC, repeated; entry 1 (and its PAT-bit
+// twin, entry 5) becomes WC, so VMM_FLAG_WC maps write-combining on 4KB
+// and large pages alike. Entries 0, 2 and 3 keep their meanings, so
+// existing NOCACHE and default mappings are unchanged.
+#define IA32_PAT_MSR    0x277
+#define VMM_PAT_VALUE   0x0007010600070106ULL
+
+// Every CPU has its own IA32_PAT and must agree with the others
+static void vmm_pat_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1u << 16))) return;
+
+    // Write back anything cached under the old types, then drop any TLB
+    // entries that still carry them
+    __asm__ volatile("wbinvd" ::: "memory");
+    __asm__ volatile("wrmsr" :: "c"(IA32_PAT_MSR), "a"((uint32_t)VMM_PAT_VALUE),
+                     "d"((uint32_t)(VMM_PAT_VALUE >> 32)) : "memory");
+    write_cr3(read_cr3());
+}
+
+// ---------- PCID / TLB invalidation ----------
+// With CR4.PCIDE set, TLB entries are tagged with the 12-bit PCID in CR3,
+// so switching address spaces keeps other spaces' entries alive. PCID 0
+// belongs to the kernel PML4; user address spaces get one on first switch.
+//
+// Kernel space (PML4 entry 0 and supervisor entries) is shared by every
+// address space, so a change there can be stale under any PCID. Rather
+// than flushing them all, vmm_shared_gen is bumped and each PCID does a
+// full (non-NOFLUSH) CR3 load the next time it is switched in with an
+// older generation. This state is per-CPU once APs run address spaces.
+
+#define CR4_PCIDE           (1ULL << 17)
+#define VMM_CR3_NOFLUSH     (1ULL << 63)
+#define VMM_PCID_COUNT      64       // Tags in use (hardware allows 4096)
+#define VMM_TLB_FLUSH_MAX   32       // Beyond this many pages, flush the whole context
+
+static int vmm_pcid_enabled = 0;
+static uint64_t vmm_shared_gen = 1;
+
+// PCID tags are per CPU: each TLB caches its own contexts. pcid_lock guards
+// these tables, which other CPUs mark stale when they change a mapping.
+static spinlock_t pcid_lock = SPINLOCK_INIT;
+static pte_t* pcid_owner[SMP_MAX_CPUS][VMM_PCID_COUNT];  // PML4 tagged with each PCID
+static uint64_t pcid_gen[SMP_MAX_CPUS][VMM_PCID_COUNT];  // vmm_shared_gen at last full flush
+static int pcid_victim[SMP_MAX_CPUS];                    // Round-robin eviction cursor
+static pte_t* cpu_loaded[SMP_MAX_CPUS];                  // PML4 in each CPU's CR3
+
+// PCID currently tagging pml4 on a CPU, or -1 if it has none
+static int vmm_pcid_of(int cpu, pte_t* pml4) {
+    if (pml4 == kernel_pml4) return 0;
+    for (int i = 1; i < VMM_PCID_COUNT; i++) {
+        if (pcid_owner[cpu][i] == pml4) return i;
+    }
+    return -1;
+}
+
+// Tag pml4 with a PCID, evicting another address space if all are taken.
+// A new tag may cover stale entries of its previous owner: force a flush.
+static int vmm_pcid_assign(int cpu, pte_t* pml4) {
+    int cur = vmm_pcid_of(cpu, vmm_get_current_address_space());
+    int pcid = -1;
+    for (int i = 1; i < VMM_PCID_COUNT; i++) {
+        if (!pcid_owner[cpu][i]) { pcid = i; break; }
+    }
+    if (pcid < 0) {
+        int* victim = &pcid_victim[cpu];
+        if (*victim == 0 || *victim == cur) *victim = *victim % (VMM_PCID_COUNT - 1) + 1;
+        pcid = *victim;
+        *victim = *victim % (VMM_PCID_COUNT - 1) + 1;
+    }
+    pcid_owner[cpu][pcid] = pml4;
+    pcid_gen[cpu][pcid] = 0;
+    return pcid;
+}
+
+// Does [start, end) touch an entry shared by every address space?
+static int vmm_range_is_shared(pte_t* pml4, uint64_t start, uint64_t end) {
+    if (pml4 == kernel_pml4 || start < VMM_USER_BASE) return 1;
+    for (uint64_t i = VMM_PML4_INDEX(start); i <= VMM_PML4_INDEX(end - 1); i++) {
+        if ((pml4[i] & VMM_FLAG_PRESENT) && !(pml4[i] & VMM_FLAG_USER)) return 1;
+    }
+    return 0;
+}
+
+// Can virt be mapped or unmapped in pml4? Below VMM_USER_BASE a
+// process's tables are the kernel's.
+static inline int vmm_range_private(pte_t* pml4, uint64_t virt) {
+    return pml4 == kernel_pml4 || virt >= VMM_USER_BASE;
+}
+
+// Is e, an entry of the PDPT under PML4 entry i, kernel space shared by
+// every address space? Under entry 0 only user entries are private.
+static inline int vmm_kernel_pdpte(int i, pte_t e) {
+    return i == 0 && !(e & VMM_FLAG_USER);
+}
+
+// Invalidate translations for [start, end) in pml4 after its entries changed
+static void vmm_tlb_invalidate(pte_t* pml4, uint64_t start, uint64_t end) {
+    if (!pml4 || end <= start) return;
+    pte_t* cur = vmm_get_current_address_space();
+    int shared = vmm_range_is_shared(pml4, start, end);
+    int me = smp_cpu_id();
+
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    if (shared) vmm_shared_gen++;
+
+    if (pml4 == cur || shared) {
+        if ((end - start) / VMM_PAGE_SIZE > VMM_TLB_FLUSH_MAX) {
+            write_cr3(read_cr3());   // Flushes the current PCID only
+        } else {
+            for (uint64_t va = start; va < end; va += VMM_PAGE_SIZE) vmm_invlpg(va);
+        }
+        // The loaded context is now clean with respect to this change
+        if (vmm_pcid_enabled && shared) {
+            int pcid = vmm_pcid_of(me, cur);
+            if (pcid >= 0 && pcid_gen[me][pcid] == vmm_shared_gen - 1) pcid_gen[me][pcid] = vmm_shared_gen;
+        }
+        if (vmm_pcid_enabled && pml4 != cur) {
+            int pcid = vmm_pcid_of(me, pml4);
+            if (pcid >= 0) pcid_gen[me][pcid] = 0;
+        }
+    } else if (vmm_pcid_enabled) {
+        // Not loaded: its tagged entries are dropped on the next switch-in
+        int pcid = vmm_pcid_of(me, pml4);
+        if (pcid >= 0) pcid_gen[me][pcid] = 0;
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+void vmm_tlb_batch_init(vmm_tlb_batch_t* batch, pte_t* pml4) {
+    batch->pml4 = pml4;
+    batch->count = 0;
+    batch->pages = 0;
+    batch->lo = ~0ULL;
+    batch->hi = 0;
+}
+
+void vmm_tlb_batch_add(vmm_tlb_batch_t* batch, uint64_t addr, uint64_t size) {
+    uint64_t start = addr & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    uint64_t end = (addr + size + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    if (end <= start) return;
+
+    if (start < batch->lo) batch->lo = start;
+    if (end > batch->hi) batch->hi = end;
+    batch->pages += (end - start) / VMM_PAGE_SIZE;
+
+    // Sequential unmaps extend the last range
+    if (batch->count > 0 && batch->ranges[batch->count - 1].end == start) {
+        batch->ranges[batch->count - 1].end = end;
+        return;
+    }
+    if (batch->count < VMM_TLB_BATCH_RANGES) {
+        batch->ranges[batch->count].start = start;
+        batch->ranges[batch->count].end = end;
+    }
+    batch->count++;   // Past VMM_TLB_BATCH_RANGES the flush covers [lo, hi)
+}
+
+void vmm_tlb_batch_flush(vmm_tlb_batch_t* batch) {
+    if (batch->count == 0) return;
+    if (batch->count > VMM_TLB_BATCH_RANGES || batch->pages > VMM_TLB_FLUSH_MAX) {
+        vmm_tlb_invalidate(batch->pml4, batch->lo, batch->hi);
+    } else {
+        for (int i = 0; i < batch->count; i++) {
+            vmm_tlb_invalidate(batch->pml4, batch->ranges[i].start, batch->ranges[i].end);
+        }
+    }
+    vmm_tlb_batch_init(batch, batch->pml4);
+}
+
+// ---------- VMA helpers ----------
+
+// Find the 4KB PTE for virt (0 if not mapped through a page table)
+static pte_t* vmm_walk(pte_t* pml4, uint64_t virt) {
+    if (!pml4 || !(pml4[VMM_PML4_INDEX(virt)] & VMM_FLAG_PRESENT)) return 0;
+    pte_t* pdpt = (pte_t*)(pml4[VMM_PML4_INDEX(virt)] & VMM_ADDR_MASK);
+    pte_t e = pdpt[VMM_PDPT_INDEX(virt)];
+    if (!(e & VMM_FLAG_PRESENT) || (e & VMM_FLAG_HUGE)) return 0;
+    pte_t* pd = (pte_t*)(e & VMM_ADDR_MASK);
+    e = pd[VMM_PD_INDEX(virt)];
+    if (!(e & VMM_FLAG_PRESENT) || (e & VMM_FLAG_HUGE)) return 0;
+    pte_t* pt = (pte_t*)(e & VMM_ADDR_MASK);
+    return &pt[VMM_PT_INDEX(virt)];
+}
+
+static int vmm_slot_for_pid(int pid) {
+    return process_slot(pid);
+}
+
+// Unmap and free every faulted-in page in [start, end). Frames are only
+// returned to the PMM after the TLB flush that drops their translations.
+#define VMM_FREE_BATCH 64
+
+static void vmm_free_range(pte_t* pml4, uint64_t start, uint64_t end) {
+    if (!pml4) return;
+    if (!vmm_range_private(pml4, start)) start = VMM_USER_BASE;
+    vmm_tlb_batch_t batch;
+    void* frames[VMM_FREE_BATCH];
+    int nframes = 0;
+    vmm_tlb_batch_init(&batch, pml4);
+
+    for (uint64_t va = start; va < end; va += VMM_PAGE_SIZE) {
+        pte_t* pte = vmm_walk(pml4, va);
+        if (pte && (*pte & VMM_FLAG_SWAPPED)) {
+            zswap_free((uint32_t)((*pte & VMM_ADDR_MASK) >> 12));
+            *pte = 0;
+            continue;
+        }
+        if (!pte || !(*pte & VMM_FLAG_PRESENT)) continue;
+        frames[nframes++] = (void*)(*pte & VMM_ADDR_MASK);
+        *pte = 0;
+        vmm_tlb_batch_add(&batch, va, VMM_PAGE_SIZE);
+
+        if (nframes == VMM_FREE_BATCH) {
+            vmm_tlb_batch_flush(&batch);
+            for (int i = 0; i < nframes; i++) pmm_free_block(frames[i]);
+            nframes = 0;
+        }
+    }
+    vmm_tlb_batch_flush(&batch);
+    for (int i = 0; i < nframes; i++) pmm_free_block(frames[i]);
+}
+
+vmm_vma_t* vmm_vma_find(int pid, uint64_t addr) {
+    int slot = vmm_slot_for_pid(pid);
+    if (slot < 0) return 0;
+    for (int i = 0; i < VMM_MAX_VMAS; i++) {
+        vmm_vma_t* v = &proc_vmas[slot][i];
+        if (v->in_use && addr >= v->start && addr < v->end) return v;
+    }
+    return 0;
+}
+
+// Claim a VMA slot for [start, start+size), merging into a neighbour of
+// the same kind unless it is file-backed. 0 if it overlaps, lies below
+// VMM_USER_BASE or the table is full.
+static vmm_vma_t* vmm_vma_insert(int pid, uint64_t start, uint64_t size, uint64_t flags, int type) {
+    int slot = vmm_slot_for_pid(pid);
+    if (slot < 0 || size == 0 || start < VMM_USER_BASE) return 0;
+
+    uint64_t end = (start + size + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    start &= ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    vmm_vma_t* vmas = proc_vmas[slot];
+
+    int free_idx = -1;
+    for (int i = 0; i < VMM_MAX_VMAS; i++) {
+        if (!vmas[i].in_use) { if (free_idx < 0) free_idx = i; continue; }
+        if (start < vmas[i].end && end > vmas[i].start) return 0; // Overlap
+    }
+
+    // Extend a neighbour instead of using a new slot where possible
+    for (int i = 0; i < VMM_MAX_VMAS && type != VMM_VMA_FILE; i++) {
+        vmm_vma_t* v = &vmas[i];
+        if (!v->in_use || v->type != type || v->flags != flags) continue;
+        if (v->end == start) { v->end = end; return v; }
+        if (v->start == end) { v->start = start; return v; }
+    }
+
+    if (free_idx < 0) return 0;
+    vmm_vma_t* v = &vmas[free_idx];
+    memset(v, 0, sizeof(*v));
+    v->start = start;
+    v->end = end;
+    v->flags = flags;
+    v->type = type;
+    v->in_use = 1;
+    return v;
+}
+
+int vmm_vma_reserve(int pid, uint64_t start, uint64_t size, uint64_t flags, int type) {
+    return vmm_vma_insert(pid, start, size, flags, type) ? 0 : -1;
+}
+
+int vmm_vma_reserve_file(int pid, uint64_t start, uint64_t size, uint64_t flags,
+                         const vmm_pager_t* pager, void* object, uint64_t pgoff) {
+    if (!pager) return -1;
+    vmm_vma_t* v = vmm_vma_insert(pid, start, size, flags, VMM_VMA_FILE);
+    if (!v) return -1;
+    v->pager = pager;
+    v->object = object;
+    v->pgoff = pgoff;
+    return 0;
+}
+
+int vmm_vma_release(int pid, pte_t* pml4, uint64_t start, uint64_t size) {
+    int slot = vmm_slot_for_pid(pid);
+    if (slot < 0) return -1;
+
+    uint64_t end = (start + size + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    start &= ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    vmm_vma_t* vmas = proc_vmas[slot];
+
+    for (int i = 0; i < VMM_MAX_VMAS; i++) {
+        vmm_vma_t* v = &vmas[i];
+        if (!v->in_use || start >= v->end || end <= v->start) continue;
+
+        uint64_t lo = start > v->start ? start : v->start;
+        uint64_t hi = end < v->end ? end : v->end;
+        vmm_free_range(pml4, lo, hi);
+
+        if (lo == v->start && hi == v->end) {
+            v->in_use = 0;
+        } else if (lo == v->start) {
+            v->pgoff += (hi - v->start) / VMM_PAGE_SIZE;
+            v->start = hi;
+        } else if (hi == v->end) {
+            v->end = lo;
+        } else {
+            // Hole in the middle: split into two areas
+            int j;
+            for (j = 0; j < VMM_MAX_VMAS; j++) if (!vmas[j].in_use) break;
+            if (j == VMM_MAX_VMAS) return -1;
+            vmas[j] = *v;
+            vmas[j].pgoff += (hi - v->start) / VMM_PAGE_SIZE;
+            vmas[j].start = hi;
+            v->end = lo;
+        }
+    }
+    return 0;
+}
+
+void vmm_vma_copy(int src_pid, int dst_pid) {
+    int src = vmm_slot_for_pid(src_pid);
+    int dst = vmm_slot_for_pid(dst_pid);
+    if (src < 0 || dst < 0) return;
+    for (int i = 0; i < VMM_MAX_VMAS; i++) proc_vmas[dst][i] = proc_vmas[src][i];
+}
+
+void vmm_vma_release_all(int pid, pte_t* pml4) {
+    vmm_vma_release(pid, pml4, 0, 0xFFFFFFFFFFFFF000ULL);
+}
+
+// ---------- Anonymous page reclaim ----------
+
+#define VMM_RECLAIM_STEPS   32768   // Clock steps (pages or areas) per call
+
+static int clock_slot = 0;
+static int clock_vma = 0;
+static uint64_t clock_addr = 0;
+
+// Make the present page at pte not present without a shootdown: pml4
+// must not be loaded on another CPU, and its PCIDs elsewhere are marked
+// stale. Returns -1 if another CPU has it loaded.
+static int vmm_swap_unmap(pte_t* pml4, pte_t* pte, uint64_t va) {
+    int me = smp_cpu_id();
+    pte_t* cur = vmm_get_current_address_space();
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu != me && smp_cpu_online(cpu) && cpu_loaded[cpu] == pml4) {
+            spin_unlock_irqrestore(&pcid_lock, flags);
+            return -1;
+        }
+    }
+    *pte &= ~VMM_FLAG_PRESENT;
+    if (pml4 == cur) vmm_invlpg(va);
+    for (int cpu = 0; cpu < SMP_MAX_CPUS && vmm_pcid_enabled; cpu++) {
+        if (cpu == me && pml4 == cur) continue;
+        int pcid = vmm_pcid_of(cpu, pml4);
+        if (pcid >= 0) pcid_gen[cpu][pcid] = 0;
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+    return 0;
+}
+
+// Compress the page at pte into zswap. Returns 1 if a frame was freed.
+static int vmm_swap_out(pte_t* pml4, pte_t* pte, uint64_t va) {
+    pte_t old = *pte;
+    if (vmm_swap_unmap(pml4, pte, va) < 0) return 0;
+    uint32_t slot;
+    int freed = zswap_store((void*)(old & VMM_ADDR_MASK), &slot);
+    if (freed < 0) {
+        *pte = old | VMM_FLAG_ACCESSED;   // Kept: pass it over next sweep
+        return 0;
+    }
+    *pte = ((uint64_t)slot << 12) | VMM_FLAG_SWAPPED |
+           (old & ~VMM_ADDR_MASK & ~(VMM_FLAG_PRESENT | VMM_FLAG_ACCESSED | VMM_FLAG_DIRTY));
+    return freed;
+}
+
+uint64_t vmm_reclaim_anon(uint64_t want) {
+    if (!kernel_pml4 || !smp_bkl_held()) return 0;
+    process_t* table = process_get_table();
+    uint64_t freed = 0;
+
+    for (int step = 0; step < VMM_RECLAIM_STEPS && freed < want; step++) {
+        process_t* p = &table[clock_slot];
+        pte_t* pml4 = (pte_t*)p->page_table;
+        if (p->state == PROC_STATE_UNUSED || !pml4 || pml4 == kernel_pml4 ||
+            clock_vma >= VMM_MAX_VMAS) {
+            clock_slot = (clock_slot + 1) % MAX_PROCESSES;
+            clock_vma = 0;
+            clock_addr = 0;
+            continue;
+        }
+        vmm_vma_t* v = &proc_vmas[clock_slot][clock_vma];
+        if (!v->in_use || v->type == VMM_VMA_FILE || (v->flags & VMM_FLAG_SHARED) ||
+            clock_addr >= v->end) {
+            clock_vma++;
+            clock_addr = 0;
+            continue;
+        }
+        if (clock_addr < v->start) clock_addr = v->start;
+        uint64_t va = clock_addr;
+        clock_addr += VMM_PAGE_SIZE;
+
+        // Private 4KB user pages only: a frame with other references is
+        // shared copy-on-write, lent to a pipe or pinned by a futex waiter
+        pte_t* pte = vmm_walk(pml4, va);
+        if (!pte || (*pte & (VMM_FLAG_PRESENT | VMM_FLAG_USER)) != (VMM_FLAG_PRESENT | VMM_FLAG_USER)) continue;
+        if (*pte & VMM_FLAG_SHARED) continue;
+        if (pmm_page_refcount((void*)(*pte & VMM_ADDR_MASK)) > 1) continue;
+        if (*pte & VMM_FLAG_ACCESSED) {
+            *pte &= ~VMM_FLAG_ACCESSED;   // Second chance
+            continue;
+        }
+        freed += (uint64_t)vmm_swap_out(pml4, pte, va);
+    }
+    return freed;
+}
+
 // ---------- Page fault handler ----------
 
+// Write to a copy-on-write page: take a private copy, or just make the
+// page writable again if this address space is the last one sharing it
+static int vmm_cow_fault(pte_t* pml4, uint64_t fault_addr) {
+    pte_t* pte = vmm_walk(pml4, fault_addr);
+    if (!pte || !(*pte & VMM_FLAG_PRESENT) || !(*pte & VMM_FLAG_COW)) return -1;
+
+    uint64_t page = fault_addr & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    void* old = (void*)(*pte & VMM_ADDR_MASK);
+    uint64_t flags = (*pte & ~VMM_ADDR_MASK & ~VMM_FLAG_COW) | VMM_FLAG_WRITABLE;
+
+    if (pmm_page_refcount(old) > 1) {
+        void* copy = pmm_alloc_block();
+        if (!copy) return -1;
+        const uint64_t* s = (const uint64_t*)old;
+        uint64_t* d = (uint64_t*)copy;
+        for (int i = 0; i < VMM_PAGE_SIZE / 8; i++) d[i] = s[i];
+        *pte = (uint64_t)copy | flags;
+        pmm_free_block(old);  // Drop our reference to the shared frame
+    } else {
+        *pte = (uint64_t)old | flags;
+    }
+    // Other CPUs may still cache the read-only entry under this PML4's PCID
+    vmm_tlb_invalidate(pml4, page, page + VMM_PAGE_SIZE);
+    return 0;
+}
+
+// Map the file page behind a not-present page of a file-backed VMA.
+// Private mappings get it copy-on-write, so a write faults again and
+// takes a copy while the file keeps its own reference.
+static int vmm_file_fault(pte_t* pml4, vmm_vma_t* vma, uint64_t page, int write) {
+    int shared = (vma->flags & VMM_FLAG_SHARED) != 0;
+    uint64_t index = vma->pgoff + (page - vma->start) / VMM_PAGE_SIZE;
+    void* frame = vma->pager->get_page(vma->object, index, write && shared);
+    if (!frame) return -1;
+
+    uint64_t flags = vma->flags;
+    if (!shared && (flags & VMM_FLAG_WRITABLE)) {
+        flags = (flags & ~VMM_FLAG_WRITABLE) | VMM_FLAG_COW;
+    }
+    if (vmm_map_page(pml4, page, (uint64_t)frame, flags) < 0) {
+        pmm_free_block(frame);
+        return -1;
+    }
+    return 0;
+}
+
+// Decompress a swapped-out page back into a new frame
+static int vmm_swap_in(pte_t* pte) {
+    void* frame = pmm_alloc_block();
+    if (!frame) return -1;
+    pte_t e = *pte;
+    if (zswap_load((uint32_t)((e & VMM_ADDR_MASK) >> 12), frame) < 0) {
+        pmm_free_block(frame);
+        return -1;
+    }
+    *pte = (uint64_t)frame | (e & ~VMM_ADDR_MASK & ~VMM_FLAG_SWAPPED) | VMM_FLAG_PRESENT;
+    return 0;
+}
+
+// Back a not-present page inside a VMA with a fresh zeroed frame, or
+// the page it held before it was swapped out
+static int vmm_demand_fault(int pid, pte_t* pml4, uint64_t fault_addr, int write) {
+    pte_t* pte = vmm_walk(pml4, fault_addr);
+    if (pte && (*pte & VMM_FLAG_SWAPPED)) return vmm_swap_in(pte);
+
+    vmm_vma_t* vma = vmm_vma_find(pid, fault_addr);
+    if (!vma) return -1;
+    if (write && !(vma->flags & VMM_FLAG_WRITABLE)) return -1;
+    if (vma->type == VMM_VMA_FILE) {
+        return vmm_file_fault(pml4, vma, fault_addr & ~(uint64_t)(VMM_PAGE_SIZE - 1), write);
+    }
+
+    void* frame = pmm_alloc_block();
+    if (!frame) return -1;
+    memset(frame, 0, VMM_PAGE_SIZE);
+
+    uint64_t page = fault_addr & ~(uint64_t)(VMM_PAGE_SIZE - 1);
+    if (vmm_map_page(pml4, page, (uint64_t)frame, vma->flags) < 0) {
+        pmm_free_block(frame);
+        return -1;
+    }
+    return 0;
+}
+
+uint8_t* vmm_vma_touch(int pid, pte_t* pml4, uint64_t addr, int write) {
+    pte_t* pte = vmm_walk(pml4, addr);
+    if (!pte || !(*pte & VMM_FLAG_PRESENT)) {
+        if (vmm_demand_fault(pid, pml4, addr, write) < 0) return 0;
+        pte = vmm_walk(pml4, addr);
+        if (!pte) return 0;
+    }
+    if (!(*pte & VMM_FLAG_USER)) return 0;   // Kernel mapping: not the process's to name
+    if (write && !(*pte & VMM_FLAG_WRITABLE)) {
+        if (vmm_cow_fault(pml4, addr) < 0) return 0;
+    }
+    *pte |= VMM_FLAG_ACCESSED;   // Used through the kernel mapping: not cold
+    return (uint8_t*)((*pte & VMM_ADDR_MASK) + (addr & (VMM_PAGE_SIZE - 1)));
+}
+
+static void vmm_count_fault(process_t* p, uint64_t misses_before) {
+    if (!p) return;
+    if (p->acct.cache_misses != misses_before) p->acct.maj_flt++;
+    else p->acct.min_flt++;
+}
+
 static void page_fault_handler(registers_t* regs) {
     uint64_t fault_addr = read_cr2();
     uint64_t err = regs->err_code;
@@ -57,22 +619,54 @@ static void page_fault_handler(registers_t* regs) {
     int reserved = err & 0x8;  // Reserved bit overwrite
     int ifetch   = err & 0x10; // Instruction fetch caused the fault
 
-    (void)present;
-    (void)write;
-    (void)user;
-    (void)reserved;
     (void)ifetch;
-    (void)fault_addr;
+    TRACE(TRACE_PAGE_FAULT, fault_addr, err);
 
-    // TODO: Handle demand paging, copy-on-write, stack growth, mmap, etc.
-    // For now, page faults in kernel mode are fatal
-    // In the future:
-    //   - Check if fault_addr is in a valid VMA for the process
-    //   - If demand paging: allocate a physical page and map it
-    //   - If COW: copy the page and remap with write permission
-    //   - If invalid: send SIGSEGV to the process (or panic if in kernel)
+    // VMAs and page tables are shared with syscalls: fault handling runs under
+    // the big kernel lock (already held for faults taken inside a syscall)
+    smp_bkl_lock();
+
+    // A fault that missed the page cache (a file page read in) is major
+    process_t* cur = process_get_current();
+    uint64_t misses = cur ? cur->acct.cache_misses : 0;
+
+    // Demand paging: first touch of a reserved-but-unbacked page.
+    // Kernel-mode faults count too (syscalls writing into user buffers).
+    if (!present && !reserved) {
+        if (vmm_demand_fault(process_get_pid(), vmm_get_current_address_space(),
+                             fault_addr, write) == 0) {
+            vmm_count_fault(cur, misses);
+            smp_bkl_unlock();
+            return;
+        }
+    }
 
-    // Fatal: halt the system
+    // Copy-on-write: write to a present page shared after fork()
+    if (present && write && !reserved) {
+        if (vmm_cow_fault(vmm_get_current_address_space(), fault_addr) == 0) {
+            vmm_count_fault(cur, misses);
+            smp_bkl_unlock();
+            return;
+        }
+    }
+
+    // Invalid access from user mode: deliver SIGSEGV and reschedule. If
+    // it is blocked, ignored or handled the process would only fault again
+    // on return, so it is terminated either way; it never gets back here.
+    int pid = process_get_pid();
+    if (user && pid > 0) {
+        klog(KLOG_WARN, "pid %d: segfault at %llx ip %llx error %llx", pid, fault_addr, regs->rip, err);
+        signal_send(pid, SIGSEGV);
+        signal_check_pending(pid);
+        process_t* p = process_get(pid);
+        if (p && p->state != PROC_STATE_ZOMBIE) process_terminate(pid, 128 + SIGSEGV);
+        smp_bkl_unlock();
+        for (;;) scheduler_yield();
+    }
+
+    // Fatal (a supervisor-mode fault): halt the system
+    klog(KLOG_EMERG, "kernel page fault at %llx ip %llx error %llx", fault_addr, regs->rip, err);
+    klog_flush();
     __asm__ volatile("cli; hlt");
 }
 
@@ -83,23 +677,25 @@ void vmm_init(void) {
     kernel_pml4 = vmm_alloc_table();
     if (!kernel_pml4) return;
 
-    // Identity-map the first 4GB using 2MB large pages
+    // Identity-map the first 4GB using 2MB pages
     // This covers: kernel code/data (~1MB-16MB), PMM bitmap (16MB),
     // heap (100MB+), framebuffer (typically ~0xFD000000), and MMIO regions
     //
-    // Structure: PML4[0] -> PDPT -> PD[0..3] (each PD covers 1GB via 512 x 2MB pages)
+    // Structure: PML4[0] -> PDPT -> PD[0..3] of 512 x 2MB. Every address
+    // space's PDPT points at these four PDs, so they are never replaced
+    // (no 1GB pages): a change in them shows in every process.
 
     pte_t* pdpt = vmm_alloc_table();
     if (!pdpt) return;
     kernel_pml4[0] = (uint64_t)pdpt | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE;
 
-    for (int gb = 0; gb < 4; gb++) {
+    for (int gb = 0; gb < (int)(VMM_USER_BASE / VMM_HUGE_PAGE_SIZE); gb++) {
         pte_t* pd = vmm_alloc_table();
         if (!pd) return;
         pdpt[gb] = (uint64_t)pd | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE;
 
         for (int i = 0; i < 512; i++) {
-            uint64_t phys = (uint64_t)gb * 0x40000000ULL + (uint64_t)i * VMM_LARGE_PAGE_SIZE;
+            uint64_t phys = (uint64_t)gb * VMM_HUGE_PAGE_SIZE + (uint64_t)i * VMM_LARGE_PAGE_SIZE;
             pd[i] = phys | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_HUGE;
         }
     }
@@ -111,12 +707,51 @@ void vmm_init(void) {
     // Since we identity-mapped the same 0-4GB range that boot.asm did,
     // this transition is seamless — all current pointers remain valid.
     write_cr3((uint64_t)kernel_pml4);
+
+    // Enable PCIDs (CPUID.01h:ECX[17]); CR3 must hold PCID 0 when PCIDE is set
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (ecx & (1U << 17)) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        vmm_pcid_enabled = 1;
+    }
+    vmm_init_ap();
+}
+
+// Per-CPU PAT setup and TLB bookkeeping for the calling CPU (CR3 = kernel
+// PML4, PCID 0); the BSP's runs from vmm_init()
+void vmm_init_ap(void) {
+    vmm_pat_init();
+    int cpu = smp_cpu_id();
+    cpu_loaded[cpu] = kernel_pml4;
+    pcid_victim[cpu] = 1;
+    if (vmm_pcid_enabled) {
+        pcid_owner[cpu][0] = kernel_pml4;
+        pcid_gen[cpu][0] = vmm_shared_gen;
+    }
 }
 
 // ---------- Page mapping ----------
 
+// Replace a 1GB PDPT entry with a PD of 512 x 2MB pages mapping the same
+// range. No-op for entries that are not 1GB pages.
+static int vmm_split_gb_page(pte_t* entry, uint64_t flags) {
+    if (!(*entry & VMM_FLAG_PRESENT) || !(*entry & VMM_FLAG_HUGE)) return 0;
+    pte_t* pd = vmm_alloc_table();
+    if (!pd) return -1;
+
+    uint64_t base_phys = *entry & VMM_HUGE_ADDR_MASK;
+    uint64_t old_flags = *entry & 0xFFF; // Keeps HUGE for the 2MB entries
+
+    for (int i = 0; i < VMM_ENTRIES_PER_TABLE; i++) {
+        pd[i] = (base_phys + (uint64_t)i * VMM_LARGE_PAGE_SIZE) | old_flags;
+    }
+    *entry = (uint64_t)pd | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | (flags & VMM_FLAG_USER);
+    return 0;
+}
+
 int vmm_map_page(pte_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
-    if (!pml4) return -1;
+    if (!pml4 || !vmm_range_private(pml4, virt)) return -1;
 
     uint64_t pml4_idx = VMM_PML4_INDEX(virt);
     uint64_t pdpt_idx = VMM_PDPT_INDEX(virt);
@@ -134,11 +769,12 @@ int vmm_map_page(pte_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
                         | (flags & VMM_FLAG_USER);
     }
 
+    // Handle 1GB huge page — split into 2MB pages, then fall through below
+    if (vmm_split_gb_page(&pdpt[pdpt_idx], flags) < 0) return -1;
+
     // Ensure PD exists
     pte_t* pd;
     if (pdpt[pdpt_idx] & VMM_FLAG_PRESENT) {
-        // Check for 1GB huge page — can't map 4KB inside one
-        if (pdpt[pdpt_idx] & VMM_FLAG_HUGE) return -1;
         pd = (pte_t*)(pdpt[pdpt_idx] & VMM_ADDR_MASK);
     } else {
         pd = vmm_alloc_table();
@@ -148,7 +784,9 @@ int vmm_map_page(pte_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
     }
 
     // Handle 2MB huge page — must split into 4KB pages first
+    int split = 0;
     if (pd[pd_idx] & VMM_FLAG_HUGE) {
+        split = 1;
         pte_t* pt = vmm_alloc_table();
         if (!pt) return -1;
 
@@ -177,16 +815,87 @@ int vmm_map_page(pte_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
     }
 
     // Set the page table entry
+    pte_t old = pt[pt_idx];
     pt[pt_idx] = (phys & VMM_ADDR_MASK) | flags;
 
-    // Flush TLB for this virtual address
-    vmm_invlpg(virt);
+    // Not-present entries are never cached, so only a replaced mapping or
+    // a split large page needs invalidating
+    if ((old & VMM_FLAG_PRESENT) || split) {
+        vmm_tlb_invalidate(pml4, virt, virt + VMM_PAGE_SIZE);
+    }
+
+    return 0;
+}
+
+// Free the page tables below a PDPT/PD entry that is being replaced by a
+// large mapping. Only table pages are freed; the frames they mapped are not.
+static void vmm_free_subtables(pte_t entry, int level) {
+    if (!(entry & VMM_FLAG_PRESENT) || (entry & VMM_FLAG_HUGE)) return;
+    pte_t* table = (pte_t*)(entry & VMM_ADDR_MASK);
+    if (level > 1) {
+        for (int i = 0; i < VMM_ENTRIES_PER_TABLE; i++) {
+            vmm_free_subtables(table[i], level - 1);
+        }
+    }
+    pmm_free_block(table);
+}
+
+int vmm_map_large(pte_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags,
+                  uint64_t page_size) {
+    if (!pml4 || !vmm_range_private(pml4, virt)) return -1;
+    if (page_size != VMM_LARGE_PAGE_SIZE && page_size != VMM_HUGE_PAGE_SIZE) return -1;
+    // The identity map's PDPT entries are shared by every address space
+    if (page_size == VMM_HUGE_PAGE_SIZE && virt < VMM_USER_BASE) return -1;
+    if ((virt | phys) & (page_size - 1)) return -1;
+    if (page_size == VMM_HUGE_PAGE_SIZE && !vmm_has_gb_pages()) return -1;
+
+    uint64_t pml4_idx = VMM_PML4_INDEX(virt);
+    uint64_t pdpt_idx = VMM_PDPT_INDEX(virt);
+
+    pte_t* pdpt;
+    if (pml4[pml4_idx] & VMM_FLAG_PRESENT) {
+        pdpt = (pte_t*)(pml4[pml4_idx] & VMM_ADDR_MASK);
+    } else {
+        pdpt = vmm_alloc_table();
+        if (!pdpt) return -1;
+        pml4[pml4_idx] = (uint64_t)pdpt | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE
+                        | (flags & VMM_FLAG_USER);
+    }
+
+    pte_t* slot;
+    pte_t old;
+    if (page_size == VMM_HUGE_PAGE_SIZE) {
+        slot = &pdpt[pdpt_idx];
+        old = *slot;
+        vmm_free_subtables(old, 2);
+    } else {
+        // Reuse an existing PD; a 1GB page here is split so its other
+        // 2MB slices stay mapped
+        if (vmm_split_gb_page(&pdpt[pdpt_idx], flags) < 0) return -1;
+        pte_t* pd;
+        if (pdpt[pdpt_idx] & VMM_FLAG_PRESENT) {
+            pd = (pte_t*)(pdpt[pdpt_idx] & VMM_ADDR_MASK);
+        } else {
+            pd = vmm_alloc_table();
+            if (!pd) return -1;
+            pdpt[pdpt_idx] = (uint64_t)pd | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE
+                            | (flags & VMM_FLAG_USER);
+        }
+        slot = &pd[VMM_PD_INDEX(virt)];
+        old = *slot;
+        vmm_free_subtables(old, 1);
+    }
+
+    *slot = (phys & (page_size == VMM_HUGE_PAGE_SIZE ? VMM_HUGE_ADDR_MASK : VMM_LARGE_ADDR_MASK))
+          | flags | VMM_FLAG_HUGE;
 
+    // A replaced entry may have cached translations for any page in the range
+    if (old & VMM_FLAG_PRESENT) vmm_tlb_invalidate(pml4, virt, virt + page_size);
     return 0;
 }
 
 void vmm_unmap_page(pte_t* pml4, uint64_t virt) {
-    if (!pml4) return;
+    if (!pml4 || !vmm_range_private(pml4, virt)) return;
 
     uint64_t pml4_idx = VMM_PML4_INDEX(virt);
     uint64_t pdpt_idx = VMM_PDPT_INDEX(virt);
@@ -204,8 +913,54 @@ void vmm_unmap_page(pte_t* pml4, uint64_t virt) {
     if (pd[pd_idx] & VMM_FLAG_HUGE) return; // Can't unmap from 2MB huge page
     pte_t* pt = (pte_t*)(pd[pd_idx] & VMM_ADDR_MASK);
 
+    if (!(pt[pt_idx] & VMM_FLAG_PRESENT)) return;
     pt[pt_idx] = 0;
-    vmm_invlpg(virt);
+    vmm_tlb_invalidate(pml4, virt, virt + VMM_PAGE_SIZE);
+}
+
+void vmm_unmap_range(pte_t* pml4, uint64_t virt_start, uint64_t size) {
+    if (!pml4) return;
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, pml4);
+    uint64_t end = virt_start + size;
+    if (!vmm_range_private(pml4, virt_start)) virt_start = VMM_USER_BASE;
+    for (uint64_t va = virt_start; va < end; ) {
+        // 2MB and 1GB user pages the range covers whole go in one step; one
+        // it only partly covers is left mapped (it cannot be split here),
+        // as are the kernel's
+        pte_t* pdpt = (pml4[VMM_PML4_INDEX(va)] & VMM_FLAG_PRESENT)
+                    ? (pte_t*)(pml4[VMM_PML4_INDEX(va)] & VMM_ADDR_MASK) : 0;
+        pte_t* large = 0;
+        uint64_t step = VMM_PAGE_SIZE;
+        if (pdpt && (pdpt[VMM_PDPT_INDEX(va)] & (VMM_FLAG_PRESENT | VMM_FLAG_HUGE)) ==
+                        (VMM_FLAG_PRESENT | VMM_FLAG_HUGE)) {
+            large = &pdpt[VMM_PDPT_INDEX(va)];
+            step = VMM_HUGE_PAGE_SIZE;
+        } else if (pdpt && (pdpt[VMM_PDPT_INDEX(va)] & VMM_FLAG_PRESENT)) {
+            pte_t* pd = (pte_t*)(pdpt[VMM_PDPT_INDEX(va)] & VMM_ADDR_MASK);
+            if ((pd[VMM_PD_INDEX(va)] & (VMM_FLAG_PRESENT | VMM_FLAG_HUGE)) ==
+                    (VMM_FLAG_PRESENT | VMM_FLAG_HUGE)) {
+                large = &pd[VMM_PD_INDEX(va)];
+                step = VMM_LARGE_PAGE_SIZE;
+            }
+        }
+        if (large) {
+            uint64_t base = va & ~(step - 1);
+            if ((*large & VMM_FLAG_USER) && base >= virt_start && base + step <= end) {
+                *large = 0;
+                vmm_tlb_batch_add(&batch, base, step);
+            }
+            va = base + step;
+            continue;
+        }
+        pte_t* pte = vmm_walk(pml4, va);
+        if (pte && (*pte & VMM_FLAG_PRESENT)) {
+            *pte = 0;
+            vmm_tlb_batch_add(&batch, va, VMM_PAGE_SIZE);
+        }
+        va += VMM_PAGE_SIZE;
+    }
+    vmm_tlb_batch_flush(&batch);
 }
 
 uint64_t vmm_get_physical(pte_t* pml4, uint64_t virt) {
@@ -222,7 +977,7 @@ uint64_t vmm_get_physical(pte_t* pml4, uint64_t virt) {
     if (!(pdpt[pdpt_idx] & VMM_FLAG_PRESENT)) return 0;
     if (pdpt[pdpt_idx] & VMM_FLAG_HUGE) {
         // 1GB page
-        return (pdpt[pdpt_idx] & 0x000FFFFFC0000000ULL) | (virt & 0x3FFFFFFF);
+        return (pdpt[pdpt_idx] & VMM_HUGE_ADDR_MASK) | (virt & 0x3FFFFFFF);
     }
     pte_t* pd = (pte_t*)(pdpt[pdpt_idx] & VMM_ADDR_MASK);
 
@@ -243,28 +998,121 @@ pte_t* vmm_create_address_space(void) {
     pte_t* pml4 = vmm_alloc_table();
     if (!pml4) return 0;
 
-    // Copy kernel mappings from the kernel PML4
-    // The kernel identity mapping is in PML4 entry 0 (covers 0-512GB)
-    // All processes share the same kernel mapping
-    if (kernel_pml4) {
-        pml4[0] = kernel_pml4[0];
+    if (!kernel_pml4) return pml4;
+
+    // PML4 entry 0 (0-512GB) gets a PDPT of its own, so user pages there
+    // are private. Its kernel entries (the identity map below
+    // VMM_USER_BASE) point at the kernel's PDs, shared by all processes.
+    pte_t* pdpt = vmm_alloc_table();
+    if (!pdpt) { pmm_free_block(pml4); return 0; }
+    pte_t* kpdpt = (pte_t*)(kernel_pml4[0] & VMM_ADDR_MASK);
+    for (int j = 0; j < VMM_ENTRIES_PER_TABLE; j++) {
+        if ((kpdpt[j] & VMM_FLAG_PRESENT) && !(kpdpt[j] & VMM_FLAG_USER)) pdpt[j] = kpdpt[j];
     }
+    pml4[0] = (uint64_t)pdpt | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER;
 
+    // Other supervisor-only entries hold kernel MMIO windows (GPU etc.)
+    for (int i = 1; i < VMM_ENTRIES_PER_TABLE; i++) {
+        if ((kernel_pml4[i] & VMM_FLAG_PRESENT) && !(kernel_pml4[i] & VMM_FLAG_USER)) {
+            pml4[i] = kernel_pml4[i];
+        }
+    }
     return pml4;
 }
 
+// Share one user leaf entry between two tables as copy-on-write
+static pte_t vmm_cow_share(pte_t* src_entry) {
+    pte_t e = *src_entry;
+    if (e & VMM_FLAG_SWAPPED) {
+        zswap_ref((uint32_t)((e & VMM_ADDR_MASK) >> 12));   // Each copy decompresses its own
+        return e;
+    }
+    if (!(e & VMM_FLAG_PRESENT)) return e;
+    if ((e & VMM_FLAG_WRITABLE) && !(e & VMM_FLAG_SHARED)) {
+        e = (e & ~VMM_FLAG_WRITABLE) | VMM_FLAG_COW;
+        *src_entry = e;
+    }
+    pmm_page_ref((void*)(e & VMM_ADDR_MASK));
+    return e;
+}
+
+void* vmm_share_page(pte_t* pml4, uint64_t virt) {
+    pte_t* pte = vmm_walk(pml4, virt);
+    if (!pte || (*pte & (VMM_FLAG_PRESENT | VMM_FLAG_USER)) != (VMM_FLAG_PRESENT | VMM_FLAG_USER)) return 0;
+    // File pages can change under the mapping: they are not the caller's to give
+    vmm_vma_t* vma = vmm_vma_find(process_get_pid(), virt);
+    if (vma && vma->type == VMM_VMA_FILE) return 0;
+    int was_writable = (*pte & VMM_FLAG_WRITABLE) != 0;
+    pte_t e = vmm_cow_share(pte);
+    if (was_writable) vmm_tlb_invalidate(pml4, virt, virt + VMM_PAGE_SIZE);
+    return (void*)(e & VMM_ADDR_MASK);
+}
+
+pte_t* vmm_clone_address_space(pte_t* src) {
+    if (!src) return 0;
+    pte_t* dst = vmm_create_address_space();
+    if (!dst) return 0;
+
+    // Supervisor entries and the kernel part of entry 0 are shared kernel
+    // space (already copied); user entries get private page tables over
+    // shared frames
+    for (int i = 0; i < VMM_ENTRIES_PER_TABLE; i++) {
+        if (!(src[i] & VMM_FLAG_PRESENT)) continue;
+        if (i > 0 && !(src[i] & VMM_FLAG_USER)) continue;
+        pte_t* spdpt = (pte_t*)(src[i] & VMM_ADDR_MASK);
+        pte_t* dpdpt;
+        if (dst[i] & VMM_FLAG_PRESENT) {
+            dpdpt = (pte_t*)(dst[i] & VMM_ADDR_MASK);   // Entry 0's own PDPT
+        } else {
+            dpdpt = vmm_alloc_table();
+            if (!dpdpt) { vmm_destroy_address_space(dst); return 0; }
+            dst[i] = (uint64_t)dpdpt | (src[i] & ~VMM_ADDR_MASK);
+        }
+
+        for (int j = 0; j < VMM_ENTRIES_PER_TABLE; j++) {
+            if (!(spdpt[j] & VMM_FLAG_PRESENT) || vmm_kernel_pdpte(i, spdpt[j])) continue;
+            // 2MB/1GB user pages are shared memory segments, shared as is
+            if (spdpt[j] & VMM_FLAG_HUGE) { dpdpt[j] = spdpt[j]; continue; }
+            pte_t* spd = (pte_t*)(spdpt[j] & VMM_ADDR_MASK);
+            pte_t* dpd = vmm_alloc_table();
+            if (!dpd) { vmm_destroy_address_space(dst); return 0; }
+            dpdpt[j] = (uint64_t)dpd | (spdpt[j] & ~VMM_ADDR_MASK);
+
+            for (int k = 0; k < VMM_ENTRIES_PER_TABLE; k++) {
+                if (!(spd[k] & VMM_FLAG_PRESENT)) continue;
+                if (spd[k] & VMM_FLAG_HUGE) { dpd[k] = spd[k]; continue; }
+                pte_t* spt = (pte_t*)(spd[k] & VMM_ADDR_MASK);
+                pte_t* dpt = vmm_alloc_table();
+                if (!dpt) { vmm_destroy_address_space(dst); return 0; }
+                dpd[k] = (uint64_t)dpt | (spd[k] & ~VMM_ADDR_MASK);
+
+                for (int l = 0; l < VMM_ENTRIES_PER_TABLE; l++) {
+                    dpt[l] = vmm_cow_share(&spt[l]);
+                }
+            }
+        }
+    }
+
+    // The source lost write access to its pages: flush its stale TLB entries
+    if (src == vmm_get_current_address_space()) write_cr3(read_cr3());
+    return dst;
+}
+
 void vmm_destroy_address_space(pte_t* pml4) {
     if (!pml4 || pml4 == kernel_pml4) return;
 
     // Walk user-space entries and free allocated page tables
-    // Skip entry 0 (kernel space — shared, don't free)
-    for (int i = 1; i < VMM_ENTRIES_PER_TABLE; i++) {
+    // Skip supervisor entries and the kernel part of entry 0 (kernel
+    // space — shared, don't free)
+    for (int i = 0; i < VMM_ENTRIES_PER_TABLE; i++) {
         if (!(pml4[i] & VMM_FLAG_PRESENT)) continue;
+        if (!(pml4[i] & VMM_FLAG_USER)) continue;
         pte_t* pdpt = (pte_t*)(pml4[i] & VMM_ADDR_MASK);
 
         for (int j = 0; j < VMM_ENTRIES_PER_TABLE; j++) {
             if (!(pdpt[j] & VMM_FLAG_PRESENT)) continue;
             if (pdpt[j] & VMM_FLAG_HUGE) continue;
+            if (vmm_kernel_pdpte(i, pdpt[j])) continue;
             pte_t* pd = (pte_t*)(pdpt[j] & VMM_ADDR_MASK);
 
             for (int k = 0; k < VMM_ENTRIES_PER_TABLE; k++) {
@@ -276,6 +1124,8 @@ void vmm_destroy_address_space(pte_t* pml4) {
                 for (int l = 0; l < VMM_ENTRIES_PER_TABLE; l++) {
                     if (pt[l] & VMM_FLAG_PRESENT) {
                         pmm_free_block((void*)(pt[l] & VMM_ADDR_MASK));
+                    } else if (pt[l] & VMM_FLAG_SWAPPED) {
+                        zswap_free((uint32_t)((pt[l] & VMM_ADDR_MASK) >> 12));
                     }
                 }
                 pmm_free_block(pt);
@@ -285,13 +1135,38 @@ void vmm_destroy_address_space(pte_t* pml4) {
         pmm_free_block(pdpt);
     }
 
+    // Release its PCID; the next owner starts with a full flush
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        int pcid = vmm_pcid_of(cpu, pml4);
+        if (pcid > 0) pcid_owner[cpu][pcid] = 0;
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+
     pmm_free_block(pml4);
 }
 
 void vmm_switch_address_space(pte_t* pml4) {
-    if (pml4) {
+    if (!pml4) return;
+    int cpu = smp_cpu_id();
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    cpu_loaded[cpu] = pml4;
+    if (!vmm_pcid_enabled) {
         write_cr3((uint64_t)pml4);
+        spin_unlock_irqrestore(&pcid_lock, flags);
+        return;
     }
+
+    int pcid = vmm_pcid_of(cpu, pml4);
+    if (pcid < 0) pcid = vmm_pcid_assign(cpu, pml4);
+
+    // Keep this PCID's TLB entries unless kernel space changed since its
+    // last full flush (or it was just (re)assigned)
+    uint64_t cr3 = (uint64_t)pml4 | (uint64_t)pcid;
+    if (pcid_gen[cpu][pcid] == vmm_shared_gen) cr3 |= VMM_CR3_NOFLUSH;
+    pcid_gen[cpu][pcid] = vmm_shared_gen;
+    write_cr3(cr3);
+    spin_unlock_irqrestore(&pcid_lock, flags);
 }
 
 pte_t* vmm_get_current_address_space(void) {
@@ -306,11 +1181,29 @@ pte_t* vmm_get_kernel_pml4(void) {
 
 int vmm_map_range(pte_t* pml4, uint64_t virt_start, uint64_t phys_start,
                   uint64_t size, uint64_t flags) {
-    uint64_t pages = (size + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t virt = virt_start + i * VMM_PAGE_SIZE;
-        uint64_t phys = phys_start + i * VMM_PAGE_SIZE;
-        if (vmm_map_page(pml4, virt, phys, flags) < 0) return -1;
+    uint64_t end = virt_start + ((size + VMM_PAGE_SIZE - 1) & ~(uint64_t)(VMM_PAGE_SIZE - 1));
+    uint64_t virt = virt_start;
+    uint64_t phys = phys_start;
+
+    // Use the biggest page that fits the remaining length and that both
+    // addresses are aligned to
+    while (virt < end) {
+        uint64_t left = end - virt;
+        uint64_t align = virt | phys;
+        uint64_t step = VMM_PAGE_SIZE;
+
+        if (vmm_has_gb_pages() && left >= VMM_HUGE_PAGE_SIZE && virt >= VMM_USER_BASE &&
+            !(align & (VMM_HUGE_PAGE_SIZE - 1))) {
+            step = VMM_HUGE_PAGE_SIZE;
+        } else if (left >= VMM_LARGE_PAGE_SIZE && !(align & (VMM_LARGE_PAGE_SIZE - 1))) {
+            step = VMM_LARGE_PAGE_SIZE;
+        }
+
+        int ret = (step == VMM_PAGE_SIZE) ? vmm_map_page(pml4, virt, phys, flags)
+                                          : vmm_map_large(pml4, virt, phys, flags, step);
+        if (ret < 0) return -1;
+        virt += step;
+        phys += step;
     }
     return 0;
 }
@@ -320,7 +1213,7 @@ int vmm_alloc_pages(pte_t* pml4, uint64_t virt_start, uint64_t size, uint64_t fl
     for (uint64_t i = 0; i < pages; i++) {
         void* phys = pmm_alloc_block();
         if (!phys) return -1;
-        vmm_memset(phys, 0, VMM_PAGE_SIZE); // Zero the page
+        memset(phys, 0, VMM_PAGE_SIZE); // Zero the page
         uint64_t virt = virt_start + i * VMM_PAGE_SIZE;
         if (vmm_map_page(pml4, virt, (uint64_t)phys, flags) < 0) {
             pmm_free_block(phys);
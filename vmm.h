@@ -15,15 +15,28 @@
 #define VMM_FLAG_DIRTY        (1ULL << 6)
 #define VMM_FLAG_HUGE         (1ULL << 7)   // 2MB page (PD) or 1GB page (PDPT)
 #define VMM_FLAG_GLOBAL       (1ULL << 8)
+#define VMM_FLAG_COW          (1ULL << 9)   // Software bit: read-only copy-on-write share
+#define VMM_FLAG_SHARED       (1ULL << 10)  // Software bit: MAP_SHARED page, never COW'd
+#define VMM_FLAG_SWAPPED      (1ULL << 11)  // Software bit: not present, compressed in zswap
+                                            // (entry in the address bits)
 #define VMM_FLAG_NX           (1ULL << 63)  // No-execute
 
+// Write-combining: PWT selects PAT entry 1, which vmm_init reprograms from
+// write-through to WC (plain write-through where the CPU has no PAT).
+// Stores are buffered and sent in bursts rather than cached, so use it for
+// framebuffers and VRAM, never for registers, and sfence before telling a
+// device to read what was written.
+#define VMM_FLAG_WC           VMM_FLAG_WRITETHROUGH
+
 // Address masks
 #define VMM_ADDR_MASK         0x000FFFFFFFFFF000ULL  // Bits 12-51
 #define VMM_LARGE_ADDR_MASK   0x000FFFFFFFE00000ULL  // Bits 21-51 (2MB aligned)
+#define VMM_HUGE_ADDR_MASK    0x000FFFFFC0000000ULL  // Bits 30-51 (1GB aligned)
 
 // Page sizes
 #define VMM_PAGE_SIZE         4096
 #define VMM_LARGE_PAGE_SIZE   (2 * 1024 * 1024)  // 2MB
+#define VMM_HUGE_PAGE_SIZE    (1024ULL * 1024 * 1024)  // 1GB
 
 // Page table index extraction macros
 #define VMM_PML4_INDEX(addr)  (((uint64_t)(addr) >> 39) & 0x1FF)
@@ -34,6 +47,11 @@
 // Number of entries per table
 #define VMM_ENTRIES_PER_TABLE 512
 
+// Below this every address space maps the kernel's identity map through
+// the same page tables; user pages go above it. PML4 entry 0 of a
+// process is its own PDPT whose first entries point at the kernel's PDs.
+#define VMM_USER_BASE         0x100000000ULL   // 4GB
+
 // Page table entry type
 typedef uint64_t pte_t;
 
@@ -43,15 +61,38 @@ void vmm_init(void);
 // Map a single 4KB page: virtual -> physical with given flags
 int vmm_map_page(pte_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 
+// Map one 2MB (PD level) or 1GB (PDPT level) page; page_size is
+// VMM_LARGE_PAGE_SIZE or VMM_HUGE_PAGE_SIZE and both addresses must be
+// aligned to it. Returns -1 if 1GB pages are unsupported by the CPU.
+int vmm_map_large(pte_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags,
+                  uint64_t page_size);
+
 // Unmap a single 4KB page
 void vmm_unmap_page(pte_t* pml4, uint64_t virt);
 
+// Unmap every page in a range with a single batched TLB flush (frames
+// are not freed). 2MB/1GB pages are unmapped if the range covers them.
+void vmm_unmap_range(pte_t* pml4, uint64_t virt_start, uint64_t size);
+
 // Get the physical address for a virtual address (returns 0 if unmapped)
 uint64_t vmm_get_physical(pte_t* pml4, uint64_t virt);
 
-// Create a new address space (PML4) with kernel space already mapped
+// Create a new address space (PML4) with kernel space already mapped.
+// Mappings below VMM_USER_BASE cannot be made in it (-1 from the map
+// functions) and unmapping there does nothing.
 pte_t* vmm_create_address_space(void);
 
+// Duplicate an address space for fork(): kernel entries are shared, user
+// pages are shared read-only with VMM_FLAG_COW set in both copies
+// (VMM_FLAG_SHARED pages stay writable in both)
+pte_t* vmm_clone_address_space(pte_t* src);
+
+// Share the user page at virt (page-aligned) with the kernel: the mapping
+// becomes copy-on-write and the frame gains a reference the caller drops
+// with pmm_free_block(). Returns the frame, or 0 if virt is not a present
+// 4KB user page or belongs to a file mapping.
+void* vmm_share_page(pte_t* pml4, uint64_t virt);
+
 // Destroy an address space (free all user-space page tables)
 void vmm_destroy_address_space(pte_t* pml4);
 
@@ -64,7 +105,7 @@ pte_t* vmm_get_current_address_space(void);
 // Get the kernel PML4
 pte_t* vmm_get_kernel_pml4(void);
 
-// Map a range of pages (convenience)
+// Map a range of pages, using 1GB/2MB pages wherever alignment and length allow
 int vmm_map_range(pte_t* pml4, uint64_t virt_start, uint64_t phys_start,
                   uint64_t size, uint64_t flags);
 
@@ -74,4 +115,103 @@ int vmm_alloc_pages(pte_t* pml4, uint64_t virt_start, uint64_t size, uint64_t fl
 // Invalidate a single TLB entry
 void vmm_invlpg(uint64_t addr);
 
+// Program the calling CPU's PAT (see VMM_FLAG_WC) and set up its TLB
+// bookkeeping (CR3 must hold the kernel PML4)
+void vmm_init_ap(void);
+
+// ---- Batched TLB invalidation ----
+// Gather the ranges whose mappings changed, then flush once. Works for any
+// address space: a PML4 that is not loaded just has its PCID marked stale.
+
+#define VMM_TLB_BATCH_RANGES  8
+
+typedef struct {
+    pte_t*   pml4;
+    int      count;          // Ranges added (may exceed VMM_TLB_BATCH_RANGES)
+    uint64_t pages;          // Total pages across all ranges
+    uint64_t lo, hi;         // Bounds of everything added
+    struct {
+        uint64_t start, end;
+    } ranges[VMM_TLB_BATCH_RANGES];
+} vmm_tlb_batch_t;
+
+void vmm_tlb_batch_init(vmm_tlb_batch_t* batch, pte_t* pml4);
+void vmm_tlb_batch_add(vmm_tlb_batch_t* batch, uint64_t addr, uint64_t size);
+void vmm_tlb_batch_flush(vmm_tlb_batch_t* batch);
+
+// ---- Virtual memory areas (demand-paged regions) ----
+// A VMA reserves a range of a process's address space without backing it.
+// Pages are allocated and zeroed by the page fault handler on first touch,
+// or for file-backed areas asked of the area's pager. Shared file pages
+// (VMM_FLAG_SHARED) map the file's own frame; private ones map it
+// copy-on-write and get a private copy on the first write.
+
+#define VMM_MAX_VMAS          32
+
+// VMA types
+#define VMM_VMA_ANON          1   // Anonymous mmap
+#define VMM_VMA_HEAP          2   // brk heap
+#define VMM_VMA_STACK         3   // User stack
+#define VMM_VMA_FILE          4   // File-backed mmap
+
+// Supplies the pages of file-backed VMAs
+typedef struct vmm_pager {
+    // Frame holding page index of object, with a PMM reference taken for
+    // the mapping (unmapping drops it with pmm_free_block). write is set
+    // when the page is about to be written through a shared mapping.
+    // Returns 0 past the end of the object or out of memory.
+    void* (*get_page)(void* object, uint64_t index, int write);
+} vmm_pager_t;
+
+typedef struct {
+    uint64_t start;          // First byte (page aligned)
+    uint64_t end;            // One past the last byte (page aligned)
+    uint64_t flags;          // Page flags applied when a page is faulted in
+    int      type;           // VMM_VMA_*
+    int      in_use;
+    // VMM_VMA_FILE only
+    const vmm_pager_t* pager;
+    void*    object;         // Passed to the pager
+    uint64_t pgoff;          // Object page mapped at start
+} vmm_vma_t;
+
+// Reserve [start, start+size) for lazy zero-fill. Adjacent areas with the
+// same type and flags are merged. Returns 0 on success, -1 on overlap/full.
+int vmm_vma_reserve(int pid, uint64_t start, uint64_t size, uint64_t flags, int type);
+
+// Reserve [start, start+size) backed by object's pages from pgoff on.
+// Add VMM_FLAG_SHARED to flags for a shared mapping. Returns 0, or -1 on
+// overlap/full.
+int vmm_vma_reserve_file(int pid, uint64_t start, uint64_t size, uint64_t flags,
+                         const vmm_pager_t* pager, void* object, uint64_t pgoff);
+
+// Drop [start, start+size) from the process's VMAs, unmapping and freeing
+// any pages that were faulted in. Partially covered areas are trimmed/split.
+int vmm_vma_release(int pid, pte_t* pml4, uint64_t start, uint64_t size);
+
+// Copy a process's VMA table to another process (fork)
+void vmm_vma_copy(int src_pid, int dst_pid);
+
+// Release every VMA of a process (called on exit)
+void vmm_vma_release_all(int pid, pte_t* pml4);
+
+// Find the VMA containing addr (0 if none)
+vmm_vma_t* vmm_vma_find(int pid, uint64_t addr);
+
+// Compress up to 'pages' cold anonymous pages into zswap (PMM reclaim).
+// A clock sweeps every process's anonymous areas: a page accessed since
+// the hand last passed loses its accessed bit and stays, one that was not
+// is swapped out. Only private pages of address spaces no other CPU has
+// loaded are taken, so no shootdown is needed. Does nothing unless the
+// calling CPU holds the big kernel lock, which guards the page tables.
+// Returns the number of frames freed.
+uint64_t vmm_reclaim_anon(uint64_t pages);
+
+// Fault in the page at addr of process pid (address space pml4) as an
+// access would, taking a private copy of a copy-on-write page for a write.
+// Returns the kernel address of addr's byte, or 0 if the access would fault
+// from user mode.
+// For the kernel writing into a process that need not be the current one.
+uint8_t* vmm_vma_touch(int pid, pte_t* pml4, uint64_t addr, int write);
+
 #endif
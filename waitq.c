@@ -0,0 +1,77 @@
+// waitq.c - Wait Queues for Alteo OS
+// A waiter publishes its slot, re-checks the condition, then marks itself
+// BLOCKED under the queue lock unless a wakeup arrived in between. The
+// waker makes the condition true first and then takes the same lock, so
+// a wakeup is either seen as 'woken' or finds the process BLOCKED.
+#include "waitq.h"
+#include "process.h"
+#include "scheduler.h"
+
+void waitq_init(waitq_t* q) {
+    spin_init(&q->lock);
+    for (int i = 0; i < WAITQ_WORDS; i++) {
+        q->waiters[i] = 0;
+        q->woken[i] = 0;
+    }
+}
+
+int waitq_wait(waitq_t* q, waitq_cond_t cond, void* arg) {
+    if (cond(arg)) return 0;
+
+    process_t* cur = process_get_current();
+    int slot = cur ? (int)(cur - process_get_table()) : 0;
+    // The kernel process runs the network and timer polling: never block it
+    if (slot <= 0 || !scheduler_is_running()) return -1;
+    int word = slot / 64;
+    uint64_t bit = 1ULL << (slot % 64);
+
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&q->lock);
+        q->waiters[word] |= bit;
+        q->woken[word] &= ~bit;
+        spin_unlock_irqrestore(&q->lock, flags);
+
+        if (cond(arg)) break;
+
+        flags = spin_lock_irqsave(&q->lock);
+        if (!(q->woken[word] & bit) && cur->state == PROC_STATE_RUNNING) {
+            process_change_state(cur, PROC_STATE_BLOCKED);
+        }
+        spin_unlock_irqrestore(&q->lock, flags);
+
+        scheduler_yield();
+    }
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    q->waiters[word] &= ~bit;
+    q->woken[word] &= ~bit;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    // A wakeup that raced with the last check may have left us READY
+    if (cur->state != PROC_STATE_RUNNING) {
+        process_change_state(cur, PROC_STATE_RUNNING);
+    }
+    return 0;
+}
+
+void waitq_wake_all(waitq_t* q) {
+    uint64_t any = 0;
+    for (int i = 0; i < WAITQ_WORDS; i++) any |= q->waiters[i];
+    if (!any) return;
+    process_t* table = process_get_table();
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    for (int i = 0; i < WAITQ_WORDS; i++) {
+        uint64_t pending = q->waiters[i];
+        q->waiters[i] = 0;
+        q->woken[i] |= pending;
+        while (pending) {
+            int slot = i * 64 + __builtin_ctzll(pending);
+            pending &= pending - 1;
+            if (table[slot].state == PROC_STATE_BLOCKED) {
+                scheduler_unblock(table[slot].pid);
+            }
+        }
+    }
+    spin_unlock_irqrestore(&q->lock, flags);
+}
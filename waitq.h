@@ -0,0 +1,37 @@
+// waitq.h - Wait Queues for Alteo OS
+// A set of processes sleeping until some condition becomes true. Waiters
+// are recorded as a bitmap of process-table slots (MAX_PROCESSES <=
+// WAITQ_MAX_SLOTS), so a wait queue is a few words and can be embedded in
+// any object.
+#ifndef WAITQ_H
+#define WAITQ_H
+
+#include "stdint.h"
+#include "spinlock.h"
+
+#define WAITQ_WORDS      4
+#define WAITQ_MAX_SLOTS  (WAITQ_WORDS * 64)
+
+typedef struct {
+    spinlock_t lock;
+    uint64_t   waiters[WAITQ_WORDS];    // Slots sleeping on the queue
+    uint64_t   woken[WAITQ_WORDS];      // Slots woken since they last checked
+} waitq_t;
+
+#define WAITQ_INIT { SPINLOCK_INIT, { 0 }, { 0 } }
+
+// Condition re-checked by a waiter after every wakeup; nonzero = done
+typedef int (*waitq_cond_t)(void* arg);
+
+void waitq_init(waitq_t* q);
+
+// Block the current process until cond(arg) is true. Wakeups may be
+// spurious; the condition decides. Returns 0 once cond holds, or -1 if
+// the caller cannot block (kernel process, scheduler not running) and
+// the condition is still false.
+int waitq_wait(waitq_t* q, waitq_cond_t cond, void* arg);
+
+// Wake every process sleeping on the queue (safe from IRQ context)
+void waitq_wake_all(waitq_t* q);
+
+#endif
@@ -1,20 +1,19 @@
 // xhci.c - xHCI (USB 3.0) Host Controller Driver for Alteo OS
-// Minimal implementation: init, port detect, basic control transfers
+// Minimal implementation: init, port detect, control, interrupt and bulk
+// transfers.
+// Every transfer is asynchronous underneath: it is queued on its
+// endpoint, and the event ring, drained by the interrupt handler (or by a
+// synchronous caller's wait), completes it through its callback.
 #include "xhci.h"
+#include "klib.h"
 #include "pci.h"
 #include "heap.h"
-
-// ---- Helpers ----
-static void xhci_memset(void* dst, int val, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (uint64_t i = 0; i < n; i++) d[i] = (uint8_t)val;
-}
-
-static void xhci_memcpy(void* dst, const void* src, uint64_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (uint64_t i = 0; i < n; i++) d[i] = s[i];
-}
+#include "pmm.h"
+#include "vmm.h"
+#include "apic.h"
+#include "irq.h"
+#include "isr.h"
+#include "spinlock.h"
 
 // ---- State ----
 static volatile uint8_t*  xhci_mmio = 0;       // Base MMIO address
@@ -51,11 +50,48 @@ static uint64_t* dcbaap = 0;
 // Device contexts (one per slot)
 static uint8_t* device_contexts[XHCI_MAX_SLOTS];
 
-// Transfer rings (one per slot, endpoint 0 only for now)
+// Transfer rings (one per slot: endpoint 0 and endpoints without a ring
+// of their own)
 static xhci_trb_t* transfer_rings[XHCI_MAX_SLOTS];
 static int transfer_ring_enqueue[XHCI_MAX_SLOTS];
 static int transfer_ring_cycle[XHCI_MAX_SLOTS];
 
+// Rings of endpoints opened with xhci_open_endpoint. pending counts the
+// TRBs not yet completed, so a new TD never overwrites one in flight.
+typedef struct {
+    int         slot_id;          // 0 = unused
+    int         dci;
+    xhci_trb_t* trbs;
+    int         enqueue;
+    int         cycle;
+    int         pending;
+} xhci_ep_ring_t;
+
+static xhci_ep_ring_t ep_rings[XHCI_EP_RINGS];
+
+// Transfers waiting for their completion event, oldest first, per
+// endpoint (slot and DCI). A transfer event completes its endpoint's
+// oldest transfer.
+typedef struct {
+    xhci_xfer_cb_t cb;            // 0 = disowned by a timed-out waiter
+    void*          ctx;
+    uint32_t       len;
+    uint32_t       trbs;          // On an endpoint ring of its own
+} xhci_xfer_t;
+
+typedef struct {
+    int         slot_id;          // 0 = unused
+    int         dci;
+    uint32_t    head, tail;       // Free-running
+    xhci_xfer_t xfer[XHCI_EP_QUEUE_LEN];
+} xhci_ep_queue_t;
+
+static xhci_ep_queue_t ep_queues[XHCI_EP_QUEUES];
+
+// Guards the command, transfer and event rings and the endpoint queues
+static spinlock_t xhci_lock = SPINLOCK_INIT;
+static int xhci_irq_on = 0;
+
 // ---- MMIO Access ----
 static inline uint32_t xhci_read32(volatile uint8_t* base, uint32_t offset) {
     return *(volatile uint32_t*)(base + offset);
@@ -122,23 +158,100 @@ static void xhci_advance_event(void) {
     xhci_write64(xhci_runtime, 0x20 + 0x18, erdp); // Interrupter 0 ERDP at offset 0x38
 }
 
-// Wait for a command completion event
-static int xhci_wait_event(uint32_t trb_type, uint32_t timeout) {
-    for (uint32_t i = 0; i < timeout; i++) {
+// The endpoint's own ring, or 0 if it uses the slot's (xhci_lock held)
+static xhci_ep_ring_t* xhci_ep_ring(int slot_id, int dci) {
+    for (int i = 0; i < XHCI_EP_RINGS; i++) {
+        if (ep_rings[i].slot_id == slot_id && ep_rings[i].dci == dci) return &ep_rings[i];
+    }
+    return (xhci_ep_ring_t*)0;
+}
+
+// The endpoint's queue, claiming a free one if create (xhci_lock held)
+static xhci_ep_queue_t* xhci_ep_queue(int slot_id, int dci, int create) {
+    xhci_ep_queue_t* free_q = 0;
+    for (int i = 0; i < XHCI_EP_QUEUES; i++) {
+        xhci_ep_queue_t* q = &ep_queues[i];
+        if (q->slot_id == slot_id && q->dci == dci) return q;
+        if (!free_q && (q->slot_id == 0 || q->head == q->tail)) free_q = q;
+    }
+    if (!create || !free_q) return (xhci_ep_queue_t*)0;
+    free_q->slot_id = slot_id;
+    free_q->dci = dci;
+    free_q->head = free_q->tail = 0;
+    return free_q;
+}
+
+// Drain the event ring. Each completed transfer leaves its queue under
+// xhci_lock; its callback runs after the lock is dropped.
+static void xhci_process_events(void) {
+    for (;;) {
+        xhci_xfer_t done = { 0, 0, 0, 0 };
+        int status = -1;
+        uint32_t length = 0;
+
+        uint64_t flags = spin_lock_irqsave(&xhci_lock);
         xhci_trb_t* evt = xhci_poll_event();
-        if (evt) {
-            uint32_t type = (evt->control >> 10) & 0x3F;
-            if (type == trb_type) {
-                uint32_t cc = (evt->status >> 24) & 0xFF;
-                xhci_advance_event();
-                return (cc == XHCI_TRB_CC_SUCCESS || cc == XHCI_TRB_CC_SHORT_PKT) ? 0 : -1;
+        if (!evt) {
+            spin_unlock_irqrestore(&xhci_lock, flags);
+            return;
+        }
+        uint32_t type = (evt->control >> 10) & 0x3F;
+        if (type == XHCI_TRB_TRANSFER_EVENT) {
+            int slot_id = (int)(evt->control >> 24);
+            int dci = (int)((evt->control >> 16) & 0x1F);
+            uint32_t cc = (evt->status >> 24) & 0xFF;
+            uint32_t residual = evt->status & 0xFFFFFF;
+            xhci_ep_queue_t* q = xhci_ep_queue(slot_id, dci, 0);
+            if (q && q->head != q->tail) {
+                done = q->xfer[q->head++ % XHCI_EP_QUEUE_LEN];
+                status = (cc == XHCI_TRB_CC_SUCCESS || cc == XHCI_TRB_CC_SHORT_PKT) ? 0 : -1;
+                length = done.len > residual ? done.len - residual : 0;
+                xhci_ep_ring_t* r = done.trbs ? xhci_ep_ring(slot_id, dci) : 0;
+                if (r) r->pending -= (int)done.trbs;
             }
-            xhci_advance_event();
         }
-        // Small delay
+        // Command completions and port changes have no waiters yet
+        xhci_advance_event();
+        spin_unlock_irqrestore(&xhci_lock, flags);
+
+        if (done.cb) done.cb(done.ctx, status, length);
+    }
+}
+
+// Synchronous transfers are asynchronous ones with this completion
+typedef struct {
+    volatile int done;
+    int          status;
+} xhci_sync_t;
+
+static void xhci_sync_done(void* ctx, int status, uint32_t length) {
+    (void)length;
+    xhci_sync_t* s = (xhci_sync_t*)ctx;
+    s->status = status;
+    s->done = 1;
+}
+
+// Wait for the transfer queued as number seq on (slot_id, dci). Drains the
+// event ring itself, so it works with interrupts off or not routed. On
+// timeout the transfer is disowned, so a late completion can't touch the
+// caller's stack.
+static int xhci_sync_wait(int slot_id, int dci, uint32_t seq, xhci_sync_t* s) {
+    for (uint32_t i = 0; i < 500000 && !s->done; i++) {
+        xhci_process_events();
+        if (s->done) break;
         for (volatile int d = 0; d < 1000; d++);
     }
-    return -1; // Timeout
+    if (s->done) return s->status;
+
+    uint64_t flags = spin_lock_irqsave(&xhci_lock);
+    xhci_ep_queue_t* q = xhci_ep_queue(slot_id, dci, 0);
+    int queued = q && seq - q->head < q->tail - q->head;
+    if (queued) q->xfer[seq % XHCI_EP_QUEUE_LEN].cb = 0;
+    spin_unlock_irqrestore(&xhci_lock, flags);
+
+    // Already taken off the queue: its callback is about to run
+    if (!queued) while (!s->done) __asm__ volatile("pause");
+    return queued ? -1 : s->status;
 }
 
 // ---- Port Operations ----
@@ -192,21 +305,66 @@ int xhci_port_reset(int port) {
     return -1; // Reset timeout
 }
 
-// ---- Control Transfer ----
+// ---- Transfers ----
+
+// Copy one TRB to the endpoint's ring (its own, else the slot's) with the
+// ring's cycle bit, then wrap through a Link TRB if that filled the ring.
+// The Link TRB keeps the chain bit of a TD that continues past it.
+// Returns the ring entry written (xhci_lock held).
+static xhci_trb_t* xhci_ring_put(int slot_id, int dci, const xhci_trb_t* trb) {
+    xhci_trb_t* ring = transfer_rings[slot_id - 1];
+    int* enq = &transfer_ring_enqueue[slot_id - 1];
+    int* cyc = &transfer_ring_cycle[slot_id - 1];
+    int size = XHCI_TRANSFER_RING_SIZE;
+    xhci_ep_ring_t* r = xhci_ep_ring(slot_id, dci);
+    if (r) {
+        ring = r->trbs;
+        enq = &r->enqueue;
+        cyc = &r->cycle;
+        size = XHCI_EP_RING_SIZE;
+    }
+
+    xhci_trb_t* out = &ring[*enq];
+    out->parameter = trb->parameter;
+    out->status = trb->status;
+    out->control = (trb->control & ~1u) | *cyc;
+    (*enq)++;
+
+    if (*enq >= size - 1) {
+        ring[*enq].parameter = (uint64_t)(uintptr_t)ring;
+        ring[*enq].status = 0;
+        ring[*enq].control = (XHCI_TRB_LINK << 10) | (trb->control & XHCI_TRB_CHAIN) |
+                             (1 << 1) | *cyc;
+        *cyc ^= 1;
+        *enq = 0;
+    }
+    return out;
+}
+
+// Queue a transfer's completion on (slot_id, dci) (xhci_lock held).
+// Returns its sequence number through seq, or -1 if the queue is full.
+static int xhci_ep_push(int slot_id, int dci, xhci_xfer_cb_t cb, void* ctx, uint32_t len,
+                        uint32_t* seq) {
+    xhci_ep_queue_t* q = xhci_ep_queue(slot_id, dci, 1);
+    if (!q || q->tail - q->head >= XHCI_EP_QUEUE_LEN) return -1;
+    xhci_xfer_t* x = &q->xfer[q->tail % XHCI_EP_QUEUE_LEN];
+    x->cb = cb;
+    x->ctx = ctx;
+    x->len = len;
+    x->trbs = 0;
+    *seq = q->tail++;
+    return 0;
+}
 
 int xhci_control_transfer(int slot_id, usb_setup_packet_t* setup,
                           void* data, uint16_t data_len) {
     if (!xhci_available || slot_id < 1 || slot_id > xhci_max_slots) return -1;
     if (!transfer_rings[slot_id - 1]) return -1;
 
-    xhci_trb_t* ring = transfer_rings[slot_id - 1];
-    int* enq = &transfer_ring_enqueue[slot_id - 1];
-    int* cyc = &transfer_ring_cycle[slot_id - 1];
-
     // Setup Stage TRB
     xhci_trb_t setup_trb;
-    xhci_memset(&setup_trb, 0, sizeof(xhci_trb_t));
-    xhci_memcpy(&setup_trb.parameter, setup, 8);
+    memset(&setup_trb, 0, sizeof(xhci_trb_t));
+    memcpy(&setup_trb.parameter, setup, 8);
     setup_trb.status = 8; // Transfer length = 8 bytes for setup
     setup_trb.control = (XHCI_TRB_SETUP << 10) | (1 << 6); // IDT bit
     if (data_len > 0) {
@@ -215,93 +373,230 @@ int xhci_control_transfer(int slot_id, usb_setup_packet_t* setup,
         setup_trb.control |= (trt << 16);
     }
 
-    ring[*enq].parameter = setup_trb.parameter;
-    ring[*enq].status = setup_trb.status;
-    ring[*enq].control = (setup_trb.control & ~1u) | *cyc;
-    (*enq)++;
-
     // Data Stage TRB (if data)
+    xhci_trb_t data_trb;
+    memset(&data_trb, 0, sizeof(xhci_trb_t));
     if (data && data_len > 0) {
-        xhci_trb_t data_trb;
-        xhci_memset(&data_trb, 0, sizeof(xhci_trb_t));
         data_trb.parameter = (uint64_t)(uintptr_t)data;
         data_trb.status = data_len;
         data_trb.control = (XHCI_TRB_DATA << 10);
         if (setup->bmRequestType & USB_DIR_IN) {
             data_trb.control |= (1 << 16); // DIR = IN
         }
-
-        ring[*enq].parameter = data_trb.parameter;
-        ring[*enq].status = data_trb.status;
-        ring[*enq].control = (data_trb.control & ~1u) | *cyc;
-        (*enq)++;
     }
 
     // Status Stage TRB
     xhci_trb_t status_trb;
-    xhci_memset(&status_trb, 0, sizeof(xhci_trb_t));
+    memset(&status_trb, 0, sizeof(xhci_trb_t));
     status_trb.control = (XHCI_TRB_STATUS << 10) | (1 << 5); // IOC bit
     // Direction is opposite of data stage
     if (data_len == 0 || !(setup->bmRequestType & USB_DIR_IN)) {
         status_trb.control |= (1 << 16); // DIR = IN for status
     }
 
-    ring[*enq].parameter = status_trb.parameter;
-    ring[*enq].status = status_trb.status;
-    ring[*enq].control = (status_trb.control & ~1u) | *cyc;
-    (*enq)++;
-
-    // Handle wrap
-    if (*enq >= XHCI_TRANSFER_RING_SIZE - 1) {
-        ring[*enq].parameter = (uint64_t)(uintptr_t)ring;
-        ring[*enq].status = 0;
-        ring[*enq].control = (XHCI_TRB_LINK << 10) | (1 << 1) | *cyc;
-        *cyc ^= 1;
-        *enq = 0;
+    xhci_sync_t sync = { 0, -1 };
+    uint32_t seq;
+    uint64_t flags = spin_lock_irqsave(&xhci_lock);
+    if (xhci_ep_push(slot_id, 1, xhci_sync_done, &sync, data_len, &seq) < 0) {
+        spin_unlock_irqrestore(&xhci_lock, flags);
+        return -1;
     }
+    xhci_ring_put(slot_id, 1, &setup_trb);
+    if (data && data_len > 0) xhci_ring_put(slot_id, 1, &data_trb);
+    xhci_ring_put(slot_id, 1, &status_trb);
 
     // Ring doorbell for endpoint 0 (target = 1 for EP0)
     xhci_ring_doorbell(slot_id, 1);
+    spin_unlock_irqrestore(&xhci_lock, flags);
 
-    // Wait for completion
-    return xhci_wait_event(XHCI_TRB_TRANSFER_EVENT, 500000);
+    return xhci_sync_wait(slot_id, 1, seq, &sync);
 }
 
-int xhci_interrupt_transfer(int slot_id, uint8_t endpoint, void* data, uint16_t data_len) {
+// Queue a Normal TRB on an interrupt IN endpoint; seq as for xhci_ep_push
+static int xhci_queue_interrupt(int slot_id, uint8_t endpoint, void* data, uint16_t data_len,
+                                xhci_xfer_cb_t cb, void* ctx, uint32_t* seq) {
     if (!xhci_available || slot_id < 1 || slot_id > xhci_max_slots) return -1;
     if (!transfer_rings[slot_id - 1]) return -1;
 
-    xhci_trb_t* ring = transfer_rings[slot_id - 1];
-    int* enq = &transfer_ring_enqueue[slot_id - 1];
-    int* cyc = &transfer_ring_cycle[slot_id - 1];
-
     // Normal TRB for interrupt transfer
     xhci_trb_t trb;
-    xhci_memset(&trb, 0, sizeof(xhci_trb_t));
+    memset(&trb, 0, sizeof(xhci_trb_t));
     trb.parameter = (uint64_t)(uintptr_t)data;
     trb.status = data_len;
     trb.control = (XHCI_TRB_NORMAL << 10) | (1 << 5); // IOC
 
-    ring[*enq].parameter = trb.parameter;
-    ring[*enq].status = trb.status;
-    ring[*enq].control = (trb.control & ~1u) | *cyc;
-    (*enq)++;
+    // Doorbell target: DCI = endpoint * 2 + direction
+    // For interrupt IN endpoint N: target = (endpoint_num * 2) + 1
+    int dci = (endpoint & USB_EP_NUM_MASK) * 2 + 1;
 
-    if (*enq >= XHCI_TRANSFER_RING_SIZE - 1) {
-        ring[*enq].parameter = (uint64_t)(uintptr_t)ring;
-        ring[*enq].status = 0;
-        ring[*enq].control = (XHCI_TRB_LINK << 10) | (1 << 1) | *cyc;
-        *cyc ^= 1;
-        *enq = 0;
+    uint64_t flags = spin_lock_irqsave(&xhci_lock);
+    if (xhci_ep_push(slot_id, dci, cb, ctx, data_len, seq) < 0) {
+        spin_unlock_irqrestore(&xhci_lock, flags);
+        return -1;
     }
+    xhci_ring_put(slot_id, dci, &trb);
+    xhci_ring_doorbell(slot_id, (uint32_t)dci);
+    spin_unlock_irqrestore(&xhci_lock, flags);
+    return 0;
+}
 
-    // Doorbell target: DCI = endpoint * 2 + direction
-    // For interrupt IN endpoint N: target = (endpoint_num * 2) + 1
-    uint8_t ep_num = endpoint & USB_EP_NUM_MASK;
-    uint32_t target = ep_num * 2 + 1;
-    xhci_ring_doorbell(slot_id, target);
+int xhci_submit_interrupt(int slot_id, uint8_t endpoint, void* data, uint16_t data_len,
+                          xhci_xfer_cb_t cb, void* ctx) {
+    uint32_t seq;
+    return xhci_queue_interrupt(slot_id, endpoint, data, data_len, cb, ctx, &seq);
+}
 
-    return xhci_wait_event(XHCI_TRB_TRANSFER_EVENT, 500000);
+int xhci_interrupt_transfer(int slot_id, uint8_t endpoint, void* data, uint16_t data_len) {
+    xhci_sync_t sync = { 0, -1 };
+    uint32_t seq;
+    if (xhci_queue_interrupt(slot_id, endpoint, data, data_len, xhci_sync_done, &sync, &seq) < 0)
+        return -1;
+    return xhci_sync_wait(slot_id, (endpoint & USB_EP_NUM_MASK) * 2 + 1, seq, &sync);
+}
+
+// Device Context Index of an endpoint address (number and direction)
+static int xhci_dci(uint8_t endpoint) {
+    return (endpoint & USB_EP_NUM_MASK) * 2 + ((endpoint & USB_EP_DIR_IN) ? 1 : 0);
+}
+
+uint64_t xhci_open_endpoint(int slot_id, uint8_t endpoint) {
+    if (!xhci_available || slot_id < 1 || slot_id > xhci_max_slots) return 0;
+    int dci = xhci_dci(endpoint);
+    if (dci < 2) return 0;
+
+    // A page: aligned, and never across a 64KB boundary
+    xhci_trb_t* trbs = (xhci_trb_t*)pmm_alloc_block();
+    if (!trbs) return 0;
+    memset(trbs, 0, XHCI_EP_RING_SIZE * sizeof(xhci_trb_t));
+
+    uint64_t flags = spin_lock_irqsave(&xhci_lock);
+    xhci_ep_ring_t* r = xhci_ep_ring(slot_id, dci);
+    if (!r) r = xhci_ep_ring(0, 0);
+    if (!r || r->trbs) {
+        // Full, or already open
+        spin_unlock_irqrestore(&xhci_lock, flags);
+        pmm_free_block(trbs);
+        return r ? (uint64_t)(uintptr_t)r->trbs : 0;
+    }
+    r->slot_id = slot_id;
+    r->dci = dci;
+    r->trbs = trbs;
+    r->enqueue = 0;
+    r->cycle = 1;
+    r->pending = 0;
+    spin_unlock_irqrestore(&xhci_lock, flags);
+    return (uint64_t)(uintptr_t)trbs;
+}
+
+// Describe buf as Normal TRBs, merging physically contiguous pages up to
+// the 64KB limits. Returns the TRB count, or -1.
+static int xhci_build_td(xhci_trb_t* td, void* buf, uint32_t len) {
+    pte_t* pml4 = vmm_get_current_address_space();
+    uint64_t va = (uint64_t)buf;
+    int n = 0;
+
+    while (len) {
+        uint64_t pa = vmm_get_physical(pml4, va);
+        uint32_t chunk = PAGE_SIZE - (uint32_t)(va & (PAGE_SIZE - 1));
+        if (chunk > len) chunk = len;
+        if (!pa) return -1;
+
+        if (n) {
+            uint64_t start = td[n - 1].parameter;
+            uint32_t cur = td[n - 1].status;
+            if (start + cur == pa && ((start ^ (pa + chunk - 1)) >> 16) == 0) {
+                td[n - 1].status = cur + chunk;
+                va += chunk;
+                len -= chunk;
+                continue;
+            }
+        }
+        if (n == XHCI_TD_MAX_TRBS) return -1;
+        td[n].parameter = pa;
+        td[n].status = chunk;
+        td[n].control = (XHCI_TRB_NORMAL << 10) | XHCI_TRB_CHAIN;
+        n++;
+        va += chunk;
+        len -= chunk;
+    }
+    return n;
+}
+
+int xhci_submit_bulk(int slot_id, uint8_t endpoint, void* buf, uint32_t len,
+                     xhci_xfer_cb_t cb, void* ctx) {
+    if (!xhci_available || slot_id < 1 || slot_id > xhci_max_slots || !buf || !len) return -1;
+
+    xhci_trb_t td[XHCI_TD_MAX_TRBS];
+    int n = xhci_build_td(td, buf, len);
+    if (n < 0) return -1;
+    // Only the last TRB interrupts: one event per TD, even when a short
+    // packet ends it early
+    td[n - 1].control = (XHCI_TRB_NORMAL << 10) | XHCI_TRB_IOC;
+
+    int dci = xhci_dci(endpoint);
+    uint32_t seq;
+    uint64_t flags = spin_lock_irqsave(&xhci_lock);
+    xhci_ep_ring_t* r = xhci_ep_ring(slot_id, dci);
+    // Room for the TD and a Link TRB it may cross
+    if (!r || r->pending + n + 1 > XHCI_EP_RING_SIZE - 1 ||
+        xhci_ep_push(slot_id, dci, cb, ctx, len, &seq) < 0) {
+        spin_unlock_irqrestore(&xhci_lock, flags);
+        return -1;
+    }
+    xhci_ep_queue_t* q = xhci_ep_queue(slot_id, dci, 0);
+    q->xfer[seq % XHCI_EP_QUEUE_LEN].trbs = (uint32_t)n;
+    r->pending += n;
+
+    // The first TRB goes in with the wrong cycle bit and is handed over
+    // last, so a controller already streaming on this ring never sees
+    // half a TD
+    xhci_trb_t* first = xhci_ring_put(slot_id, dci, &td[0]);
+    first->control ^= 1;
+    for (int i = 1; i < n; i++) xhci_ring_put(slot_id, dci, &td[i]);
+    __asm__ volatile("" ::: "memory");
+    first->control ^= 1;
+
+    xhci_ring_doorbell(slot_id, (uint32_t)dci);
+    spin_unlock_irqrestore(&xhci_lock, flags);
+    return 0;
+}
+
+// ---- Interrupts ----
+
+static void xhci_msi_irq(void* ctx) {
+    (void)ctx;
+    xhci_irq_handler();
+}
+
+static void xhci_intx_irq(registers_t* regs) {
+    (void)regs;
+    xhci_irq_handler();
+}
+
+// Route completions to this CPU: MSI-X entry 0 or MSI where the function
+// has them, else its INTx line through the I/O APIC (level-triggered,
+// active low). Without an APIC, transfers complete only by polling.
+static void xhci_setup_irq(pci_device_t* dev) {
+    if (!apic_is_active()) return;
+
+    if (pci_msix_count(dev) > 0 || pci_find_capability(dev, PCI_CAP_ID_MSI)) {
+        if (pci_irq_alloc(dev, 0, xhci_msi_irq, 0, (uint8_t)lapic_get_id()) < 0) return;
+    } else {
+        if (dev->irq_line == 0 || dev->irq_line >= 16) return;
+        irq_install_handler(dev->irq_line, xhci_intx_irq);
+        ioapic_set_irq(dev->irq_line, APIC_IRQ_BASE + dev->irq_line, lapic_get_id(),
+                       IOAPIC_RED_LEVEL | IOAPIC_RED_ACTIVE_LOW);
+    }
+
+    // At most one interrupt per 250us (1000 x 250ns), enabled on
+    // interrupter 0
+    xhci_write32(xhci_runtime, XHCI_RT_IMOD, 1000);
+    xhci_write32(xhci_runtime, XHCI_RT_IMAN, XHCI_IMAN_IE | XHCI_IMAN_IP);
+    xhci_irq_on = 1;
+}
+
+int xhci_irq_active(void) {
+    return xhci_irq_on;
 }
 
 // ---- Initialization ----
@@ -378,14 +673,14 @@ int xhci_init(void) {
     if (!dcbaap) return -1;
     // Align to 64 bytes
     dcbaap = (uint64_t*)(((uintptr_t)dcbaap + 63) & ~63ULL);
-    xhci_memset(dcbaap, 0, sizeof(uint64_t) * (xhci_max_slots + 1));
+    memset(dcbaap, 0, sizeof(uint64_t) * (xhci_max_slots + 1));
     xhci_write64(xhci_op, XHCI_OP_DCBAAP, (uint64_t)(uintptr_t)dcbaap);
 
     // ---- Set up Command Ring ----
     cmd_ring = (xhci_trb_t*)kmalloc(sizeof(xhci_trb_t) * XHCI_CMD_RING_SIZE + 64);
     if (!cmd_ring) return -1;
     cmd_ring = (xhci_trb_t*)(((uintptr_t)cmd_ring + 63) & ~63ULL);
-    xhci_memset(cmd_ring, 0, sizeof(xhci_trb_t) * XHCI_CMD_RING_SIZE);
+    memset(cmd_ring, 0, sizeof(xhci_trb_t) * XHCI_CMD_RING_SIZE);
     cmd_ring_enqueue = 0;
     cmd_ring_cycle = 1;
 
@@ -397,7 +692,7 @@ int xhci_init(void) {
     event_ring = (xhci_trb_t*)kmalloc(sizeof(xhci_trb_t) * XHCI_EVENT_RING_SIZE + 64);
     if (!event_ring) return -1;
     event_ring = (xhci_trb_t*)(((uintptr_t)event_ring + 63) & ~63ULL);
-    xhci_memset(event_ring, 0, sizeof(xhci_trb_t) * XHCI_EVENT_RING_SIZE);
+    memset(event_ring, 0, sizeof(xhci_trb_t) * XHCI_EVENT_RING_SIZE);
     event_ring_dequeue = 0;
     event_ring_cycle = 1;
 
@@ -418,10 +713,12 @@ int xhci_init(void) {
     xhci_write64(xhci_runtime, 0x20 + 0x10, (uint64_t)(uintptr_t)erst);
 
     // ---- Init transfer ring arrays ----
-    xhci_memset(device_contexts, 0, sizeof(device_contexts));
-    xhci_memset(transfer_rings, 0, sizeof(transfer_rings));
-    xhci_memset(transfer_ring_enqueue, 0, sizeof(transfer_ring_enqueue));
+    memset(device_contexts, 0, sizeof(device_contexts));
+    memset(transfer_rings, 0, sizeof(transfer_rings));
+    memset(transfer_ring_enqueue, 0, sizeof(transfer_ring_enqueue));
     for (int i = 0; i < XHCI_MAX_SLOTS; i++) transfer_ring_cycle[i] = 1;
+    memset(ep_queues, 0, sizeof(ep_queues));
+    memset(ep_rings, 0, sizeof(ep_rings));
 
     // ---- Start Controller ----
     usbcmd = xhci_read32(xhci_op, XHCI_OP_USBCMD);
@@ -435,6 +732,7 @@ int xhci_init(void) {
     }
 
     xhci_available = 1;
+    xhci_setup_irq(dev);
     return 0;
 }
 
@@ -456,19 +754,10 @@ void xhci_irq_handler(void) {
     }
 
     // Clear Interrupt Pending (IP) in interrupter 0
-    uint32_t iman = xhci_read32(xhci_runtime, 0x20);
-    if (iman & 1) {
-        xhci_write32(xhci_runtime, 0x20, iman | 1);
+    uint32_t iman = xhci_read32(xhci_runtime, XHCI_RT_IMAN);
+    if (iman & XHCI_IMAN_IP) {
+        xhci_write32(xhci_runtime, XHCI_RT_IMAN, iman | XHCI_IMAN_IP);
     }
 
-    // Process events
-    while (1) {
-        xhci_trb_t* evt = xhci_poll_event();
-        if (!evt) break;
-
-        uint32_t type = (evt->control >> 10) & 0x3F;
-        (void)type; // Port change and transfer events handled by polling for now
-
-        xhci_advance_event();
-    }
+    xhci_process_events();
 }
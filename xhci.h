@@ -25,6 +25,12 @@
 #define XHCI_OP_DCBAAP         0x30    // Device Context Base Address Array Pointer (64-bit)
 #define XHCI_OP_CONFIG         0x38    // Configure
 
+// Interrupter 0 registers (relative to runtime base)
+#define XHCI_RT_IMAN           0x20    // Interrupter Management
+#define XHCI_RT_IMOD           0x24    // Interrupter Moderation (250ns units)
+#define XHCI_IMAN_IP           (1 << 0)    // Interrupt Pending (write 1 to clear)
+#define XHCI_IMAN_IE           (1 << 1)    // Interrupt Enable
+
 // Port register set (relative to op base + 0x400 + port_index * 0x10)
 #define XHCI_PORT_SC           0x00    // Port Status and Control
 #define XHCI_PORT_PMSC         0x04    // Port Power Management
@@ -101,6 +107,16 @@ typedef struct __attribute__((packed)) {
 #define XHCI_CMD_RING_SIZE      64
 #define XHCI_EVENT_RING_SIZE    64
 #define XHCI_TRANSFER_RING_SIZE 64
+#define XHCI_EP_QUEUES          16      // Endpoints with transfers in flight
+#define XHCI_EP_QUEUE_LEN       16      // Transfers in flight per endpoint
+#define XHCI_EP_RINGS           16      // Endpoints with a ring of their own
+#define XHCI_EP_RING_SIZE       256     // TRBs per endpoint ring (one page)
+#define XHCI_TD_MAX_TRBS        32      // Normal TRBs in one bulk TD
+#define XHCI_TRB_MAX_BYTES      65536   // Per TRB; a TRB can't cross 64KB either
+
+// TRB control bits
+#define XHCI_TRB_CHAIN          (1 << 4)
+#define XHCI_TRB_IOC            (1 << 5)
 
 // ---- API ----
 
@@ -126,10 +142,40 @@ int xhci_port_reset(int port);
 int xhci_control_transfer(int slot_id, usb_setup_packet_t* setup,
                           void* data, uint16_t data_len);
 
-// Submit an interrupt IN transfer (for HID polling)
+// Submit an interrupt IN transfer and wait for it
 int xhci_interrupt_transfer(int slot_id, uint8_t endpoint, void* data, uint16_t data_len);
 
-// IRQ handler for xHCI
+// Completion of an asynchronous transfer: status 0 (success or short
+// packet) or -1, and the bytes transferred. Runs from the interrupt
+// handler (or a polling wait) with no xHCI lock held, so it may queue the
+// next transfer.
+typedef void (*xhci_xfer_cb_t)(void* ctx, int status, uint32_t length);
+
+// Queue an interrupt IN transfer and return at once; cb(ctx, ...) runs
+// when it completes. Returns 0, or -1 if the endpoint already has
+// XHCI_EP_QUEUE_LEN transfers in flight.
+int xhci_submit_interrupt(int slot_id, uint8_t endpoint, void* data, uint16_t data_len,
+                          xhci_xfer_cb_t cb, void* ctx);
+
+// Give a bulk (or interrupt) endpoint a transfer ring of its own instead
+// of sharing the slot's endpoint 0 ring. Returns the ring's physical base
+// for the endpoint context's TR Dequeue Pointer (DCS = 1), or 0.
+uint64_t xhci_open_endpoint(int slot_id, uint8_t endpoint);
+
+// Queue a bulk transfer on an endpoint opened with xhci_open_endpoint and
+// return at once. endpoint carries the direction bit. buf is kernel memory
+// of any alignment, described page by page as one TD of chained Normal
+// TRBs; 64KB always fits. Several TDs may be queued back to back so the
+// controller streams from one into the next. Returns 0, or -1 if the
+// endpoint's queue or ring is full or buf needs more than XHCI_TD_MAX_TRBS.
+int xhci_submit_bulk(int slot_id, uint8_t endpoint, void* buf, uint32_t len,
+                     xhci_xfer_cb_t cb, void* ctx);
+
+// 1 if completions raise an interrupt (MSI-X, MSI or INTx); otherwise
+// asynchronous transfers complete only while a synchronous one waits
+int xhci_irq_active(void);
+
+// Drain the event ring, completing transfers (the interrupt handler)
 void xhci_irq_handler(void);
 
 #endif
@@ -0,0 +1,287 @@
+// zswap.c - Compressed In-RAM Swap for Alteo OS
+// Entries live in a fixed table; free ones are chained through pfn. Pool
+// frames start with a small header counting the bytes used and the live
+// entries in them. zs_lock guards the table, the pool and the compressor
+// scratch space; zswap_store() only trylocks it, since it runs from PMM
+// reclaim.
+#include "zswap.h"
+#include "klib.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "pagecache.h"
+#include "spinlock.h"
+
+#define LZ_MIN_MATCH    4
+#define LZ_HASH_BITS    12
+#define LZ_OUT_MAX      (PAGE_SIZE + PAGE_SIZE / 255 + 16)  // Worst-case coded size
+
+typedef struct {
+    uint32_t pfn;               // Pool frame (0 for a zero page); next free entry when free
+    uint16_t offset;            // Of the data within the pool frame
+    uint16_t len;               // Compressed bytes (0 for a zero page)
+    uint32_t refs;              // PTEs naming the entry; 0 = free
+} zswap_entry_t;
+
+typedef struct {
+    uint16_t used;              // Bytes, header included
+    uint16_t live;              // Entries stored here
+} zswap_pool_hdr_t;
+
+static zswap_entry_t entries[ZSWAP_MAX_ENTRIES];
+static uint32_t free_head;
+static zswap_pool_hdr_t* pool_cur = 0;  // Frame new entries are packed into
+static zswap_stats_t stats;
+static spinlock_t zs_lock = SPINLOCK_INIT;
+
+// Compressor scratch (under zs_lock)
+static uint16_t lz_table[1 << LZ_HASH_BITS];    // Position + 1 of the last 4 bytes hashing here
+static uint8_t lz_out[LZ_OUT_MAX];
+
+// ---- LZ77 coder ----
+// A sequence is a token (literal count << 4 | match length - 4, 15 in a
+// nibble meaning more follows in 255-continued bytes), the literals, and
+// a 2-byte little-endian match offset. The last sequence has no match.
+
+static inline uint32_t lz_read32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t lz_hash(const uint8_t* p) {
+    return (lz_read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static int lz_put_len(uint8_t* dst, int op, int n) {
+    while (n >= 255) { dst[op++] = 255; n -= 255; }
+    dst[op++] = (uint8_t)n;
+    return op;
+}
+
+// Append a sequence; -1 if the output would exceed limit
+static int lz_emit(uint8_t* dst, int op, int limit, const uint8_t* lit, int nlit,
+                   int offset, int mlen) {
+    int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    if (op + 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1 > limit) return -1;
+    dst[op++] = (uint8_t)((nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15));
+    if (nlit >= 15) op = lz_put_len(dst, op, nlit - 15);
+    memcpy(dst + op, lit, (uint64_t)nlit);
+    op += nlit;
+    if (mlen) {
+        dst[op++] = (uint8_t)offset;
+        dst[op++] = (uint8_t)(offset >> 8);
+        if (ml >= 15) op = lz_put_len(dst, op, ml - 15);
+    }
+    return op;
+}
+
+// Compress one page into dst; the coded size, or -1 if over limit
+static int lz_compress(const uint8_t* src, uint8_t* dst, int limit) {
+    memset(lz_table, 0, sizeof(lz_table));
+    int ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MIN_MATCH <= PAGE_SIZE) {
+        uint32_t h = lz_hash(src + ip);
+        int ref = (int)lz_table[h] - 1;
+        lz_table[h] = (uint16_t)(ip + 1);
+        if (ref < 0 || lz_read32(src + ref) != lz_read32(src + ip)) { ip++; continue; }
+
+        int len = LZ_MIN_MATCH;
+        while (ip + len < PAGE_SIZE && src[ref + len] == src[ip + len]) len++;
+        op = lz_emit(dst, op, limit, src + anchor, ip - anchor, ip - ref, len);
+        if (op < 0) return -1;
+        ip += len;
+        anchor = ip;
+    }
+    return lz_emit(dst, op, limit, src + anchor, PAGE_SIZE - anchor, 0, 0);
+}
+
+static int lz_get_len(const uint8_t* src, int len, int* ip, int* n) {
+    uint8_t b;
+    do {
+        if (*ip >= len) return -1;
+        b = src[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Decode a page; 0, or -1 if the data does not decode to exactly 4KB
+static int lz_decompress(const uint8_t* src, int len, uint8_t* dst) {
+    int ip = 0, op = 0;
+    while (ip < len) {
+        int token = src[ip++];
+        int nlit = token >> 4;
+        if (nlit == 15 && lz_get_len(src, len, &ip, &nlit) < 0) return -1;
+        if (ip + nlit > len || op + nlit > PAGE_SIZE) return -1;
+        memcpy(dst + op, src + ip, (uint64_t)nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == len) break;
+
+        if (ip + 2 > len) return -1;
+        int offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15 && lz_get_len(src, len, &ip, &mlen) < 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + mlen > PAGE_SIZE) return -1;
+        for (int i = 0; i < mlen; i++, op++) dst[op] = dst[op - offset];   // May overlap
+    }
+    return op == PAGE_SIZE ? 0 : -1;
+}
+
+// ---- Entries ----
+
+static int zs_is_zero(const uint64_t* p) {
+    for (int i = 0; i < PAGE_SIZE / 8; i++) if (p[i]) return 0;
+    return 1;
+}
+
+// Drop a reference; the last one frees the entry and its pool space
+static void zs_put(uint32_t slot) {
+    zswap_entry_t* e = &entries[slot];
+    if (--e->refs) return;
+    if (e->len) {
+        zswap_pool_hdr_t* h = (zswap_pool_hdr_t*)((uint64_t)e->pfn << 12);
+        stats.pool_bytes -= e->len;
+        if (--h->live == 0) {
+            if (h == pool_cur) {
+                h->used = sizeof(*h);
+            } else {
+                pmm_free_block(h);
+                stats.pool_pages--;
+            }
+        }
+    } else {
+        stats.same_filled--;
+    }
+    stats.stored--;
+    e->pfn = free_head;
+    free_head = slot;
+}
+
+// Clean page cache pages go first: dropping one costs a re-read at most,
+// and the cache's LRU already orders them. Cold anonymous pages follow.
+static uint64_t zswap_reclaim(uint64_t want) {
+    uint64_t freed = pagecache_shrink(want);
+    if (freed < want) freed += vmm_reclaim_anon(want - freed);
+    return freed;
+}
+
+// ---- Public API ----
+
+void zswap_init(void) {
+    memset(&stats, 0, sizeof(stats));
+    for (uint32_t i = 0; i < ZSWAP_MAX_ENTRIES; i++) {
+        entries[i].refs = 0;
+        entries[i].pfn = i + 1;
+    }
+    free_head = 0;
+    pool_cur = 0;
+    pmm_set_reclaim(zswap_reclaim);
+}
+
+int zswap_store(void* frame, uint32_t* slot) {
+    // Runs from PMM reclaim: never wait for the lock
+    uint64_t irq;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(irq) :: "memory");
+    if (!spin_trylock(&zs_lock)) {
+        if (irq & (1 << 9)) __asm__ volatile("sti" ::: "memory");
+        return -1;
+    }
+    if (free_head >= ZSWAP_MAX_ENTRIES) {
+        spin_unlock_irqrestore(&zs_lock, irq);
+        return -1;
+    }
+
+    uint32_t s = free_head;
+    zswap_entry_t* e = &entries[s];
+    int freed = 1;
+    if (zs_is_zero((const uint64_t*)frame)) {
+        e->len = 0;
+        e->offset = 0;
+        stats.same_filled++;
+        pmm_free_block(frame);
+    } else {
+        int n = lz_compress((const uint8_t*)frame, lz_out, ZSWAP_MAX_STORE);
+        if (n < 0) {
+            stats.rejected++;
+            spin_unlock_irqrestore(&zs_lock, irq);
+            return -1;
+        }
+        zswap_pool_hdr_t* h = pool_cur;
+        if (!h || h->used + n > PAGE_SIZE) {
+            // The page is in lz_out now: its frame becomes the next pool frame
+            if (h && h->live == 0) {
+                pmm_free_block(h);
+                stats.pool_pages--;
+            } else {
+                freed = 0;
+            }
+            h = (zswap_pool_hdr_t*)frame;
+            h->used = sizeof(*h);
+            h->live = 0;
+            pool_cur = h;
+            stats.pool_pages++;
+        } else {
+            pmm_free_block(frame);
+        }
+        memcpy((uint8_t*)h + h->used, lz_out, (uint64_t)n);
+        e->offset = h->used;
+        e->len = (uint16_t)n;
+        h->used += (uint16_t)n;
+        h->live++;
+        stats.pool_bytes += (uint64_t)n;
+        frame = h;
+    }
+    free_head = e->pfn;
+    e->pfn = e->len ? (uint32_t)((uint64_t)frame >> 12) : 0;
+    e->refs = 1;
+    stats.stored++;
+    stats.swapouts++;
+    spin_unlock_irqrestore(&zs_lock, irq);
+
+    *slot = s;
+    return freed;
+}
+
+int zswap_load(uint32_t slot, void* frame) {
+    if (slot >= ZSWAP_MAX_ENTRIES) return -1;
+    uint64_t irq = spin_lock_irqsave(&zs_lock);
+    zswap_entry_t* e = &entries[slot];
+    int rc = -1;
+    if (e->refs) {
+        if (e->len == 0) {
+            memset(frame, 0, PAGE_SIZE);
+            rc = 0;
+        } else {
+            const uint8_t* data = (const uint8_t*)((uint64_t)e->pfn << 12) + e->offset;
+            rc = lz_decompress(data, e->len, (uint8_t*)frame);
+        }
+        if (rc == 0) {
+            zs_put(slot);
+            stats.swapins++;
+        }
+    }
+    spin_unlock_irqrestore(&zs_lock, irq);
+    return rc;
+}
+
+void zswap_ref(uint32_t slot) {
+    if (slot >= ZSWAP_MAX_ENTRIES) return;
+    uint64_t irq = spin_lock_irqsave(&zs_lock);
+    if (entries[slot].refs) entries[slot].refs++;
+    spin_unlock_irqrestore(&zs_lock, irq);
+}
+
+void zswap_free(uint32_t slot) {
+    if (slot >= ZSWAP_MAX_ENTRIES) return;
+    uint64_t irq = spin_lock_irqsave(&zs_lock);
+    if (entries[slot].refs) zs_put(slot);
+    spin_unlock_irqrestore(&zs_lock, irq);
+}
+
+void zswap_get_stats(zswap_stats_t* out) {
+    if (!out) return;
+    uint64_t irq = spin_lock_irqsave(&zs_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&zs_lock, irq);
+}
@@ -0,0 +1,55 @@
+// zswap.h - Compressed In-RAM Swap for Alteo OS
+// When the PMM runs out of frames, reclaim first drops clean page cache
+// pages from the tail of the cache's LRU, then compresses cold anonymous
+// pages (vmm_reclaim_anon) into a pool of frames here. A swapped-out PTE
+// names its pool entry; the page fault handler decompresses the page into
+// a new frame on the next access.
+//
+// Pages are compressed with a small LZ77 coder (LZ4-style sequences of
+// literals and back-references, 4KB window). Pages that do not shrink to
+// ZSWAP_MAX_STORE bytes stay in memory; all-zero pages take no pool space.
+// Compressed pages are packed one after another into pool frames. The
+// first victim that does not fit into the current pool frame becomes the
+// next one, so storing never allocates. A pool frame is freed once its
+// last entry is.
+#ifndef ZSWAP_H
+#define ZSWAP_H
+
+#include "stdint.h"
+
+#define ZSWAP_MAX_ENTRIES   32768           // Compressed pages (128MB of anonymous memory)
+#define ZSWAP_MAX_STORE     (4096 * 3 / 4)  // Largest compressed size worth keeping
+
+typedef struct {
+    uint64_t stored;            // Pages held compressed now
+    uint64_t same_filled;       // ... of which all-zero
+    uint64_t pool_pages;        // Frames holding compressed data
+    uint64_t pool_bytes;        // Compressed bytes in use in them
+    uint64_t swapouts;          // Pages compressed
+    uint64_t swapins;           // Pages faulted back in
+    uint64_t rejected;          // Pages that did not compress well enough
+} zswap_stats_t;
+
+// Set up the entry table and install the PMM reclaim hook (after
+// pagecache_init)
+void zswap_init(void);
+
+// Compress the 4KB page in frame, which the caller has unmapped. On success
+// the frame belongs to zswap and *slot names the entry. Returns 1 if the
+// frame was freed, 0 if it was kept as pool storage, -1 if the page was
+// not stored (the frame is untouched and still the caller's).
+int zswap_store(void* frame, uint32_t* slot);
+
+// Decompress entry slot into frame and drop one reference to it.
+// Returns 0, or -1 for a bad slot or corrupt data.
+int zswap_load(uint32_t slot, void* frame);
+
+// Add a reference to an entry (a swapped-out PTE copied by fork)
+void zswap_ref(uint32_t slot);
+
+// Drop a reference without loading (the PTE was unmapped)
+void zswap_free(uint32_t slot);
+
+void zswap_get_stats(zswap_stats_t* out);
+
+#endif